@@ -17,12 +17,20 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "trace.h"
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
+
+/* Polling window used when adaptive polling first kicks in */
+#define AIO_POLL_NS_INITIAL 4000
 
 struct AioHandler
 {
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
     int deleted;
     int pollfds_idx;
     void *opaque;
@@ -42,6 +50,203 @@ static AioHandler *find_aio_handler(AioContext *ctx, int fd)
     return NULL;
 }
 
+#ifdef CONFIG_EPOLL
+
+/* poll() is cheaper than maintaining an epoll set for a handful of fds, so
+ * epoll is only switched on once a context has this many handlers.  It then
+ * stays on; the set is updated as handlers come and go.
+ */
+#define AIO_EPOLL_ENABLE_THRESHOLD 64
+
+/* Events fetched by one epoll_wait(); the rest stay ready for the next */
+#define AIO_EPOLL_MAX_EVENTS 128
+
+static uint32_t epoll_events_from_pfd(int pfd_events)
+{
+    return (pfd_events & G_IO_IN ? EPOLLIN : 0) |
+           (pfd_events & G_IO_OUT ? EPOLLOUT : 0) |
+           (pfd_events & G_IO_HUP ? EPOLLHUP : 0) |
+           (pfd_events & G_IO_ERR ? EPOLLERR : 0);
+}
+
+static int pfd_events_from_epoll(uint32_t events)
+{
+    return (events & EPOLLIN ? G_IO_IN : 0) |
+           (events & EPOLLOUT ? G_IO_OUT : 0) |
+           (events & EPOLLHUP ? G_IO_HUP : 0) |
+           (events & EPOLLERR ? G_IO_ERR : 0);
+}
+
+static void aio_epoll_disable(AioContext *ctx)
+{
+    AioHandler *node;
+
+    ctx->epoll_available = false;
+    if (!ctx->epoll_enabled) {
+        return;
+    }
+
+    /* Give glib the individual fds back */
+    g_source_remove_poll(&ctx->source, &ctx->epoll_pfd);
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted) {
+            g_source_add_poll(&ctx->source, &node->pfd);
+        }
+    }
+    ctx->epoll_enabled = false;
+    trace_aio_epoll_disable(ctx);
+}
+
+/* Add, change or (if it has no events left) remove @node in the epoll set */
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+    struct epoll_event event = {
+        .events = epoll_events_from_pfd(node->pfd.events),
+        .data.ptr = node,
+    };
+
+    if (!ctx->epoll_enabled) {
+        return;
+    }
+
+    if (!node->pfd.events) {
+        epoll_ctl(ctx->epollfd, EPOLL_CTL_DEL, node->pfd.fd, &event);
+    } else if (epoll_ctl(ctx->epollfd, is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                         node->pfd.fd, &event) < 0) {
+        /* Some fds, for example regular files, cannot be in an epoll set */
+        aio_epoll_disable(ctx);
+    }
+}
+
+static void aio_epoll_try_enable(AioContext *ctx)
+{
+    AioHandler *node;
+    struct epoll_event event;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (node->deleted || !node->pfd.events) {
+            continue;
+        }
+        event.events = epoll_events_from_pfd(node->pfd.events);
+        event.data.ptr = node;
+        if (epoll_ctl(ctx->epollfd, EPOLL_CTL_ADD, node->pfd.fd, &event) < 0) {
+            ctx->epoll_available = false;
+            return;
+        }
+    }
+
+    /* From now on glib only sees the epoll fd, so that the main loop does
+     * not have to go through every handler either.
+     */
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted) {
+            g_source_remove_poll(&ctx->source, &node->pfd);
+        }
+    }
+    ctx->epoll_pfd.fd = ctx->epollfd;
+    ctx->epoll_pfd.events = G_IO_IN;
+    ctx->epoll_pfd.revents = 0;
+    g_source_add_poll(&ctx->source, &ctx->epoll_pfd);
+    ctx->epoll_enabled = true;
+    trace_aio_epoll_enable(ctx);
+}
+
+/* Copy the ready events into the handlers.  Returns the number of handlers
+ * with events.
+ */
+static int aio_epoll_fetch(AioContext *ctx)
+{
+    struct epoll_event events[AIO_EPOLL_MAX_EVENTS];
+    AioHandler *node;
+    int i, ret;
+
+    ctx->epoll_pfd.revents = 0;
+    do {
+        ret = epoll_wait(ctx->epollfd, events, ARRAY_SIZE(events), 0);
+    } while (ret < 0 && errno == EINTR);
+
+    for (i = 0; i < ret; i++) {
+        node = events[i].data.ptr;
+        node->pfd.revents = pfd_events_from_epoll(events[i].events);
+    }
+    return ret;
+}
+
+/* Wait for events with nanosecond resolution, which epoll_wait() lacks */
+static int aio_epoll_wait(AioContext *ctx, int64_t timeout)
+{
+    GPollFD pfd = {
+        .fd = ctx->epollfd,
+        .events = G_IO_IN,
+    };
+    int ret;
+
+    if (timeout != 0) {
+        ret = qemu_poll_ns(&pfd, 1, timeout);
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+    return aio_epoll_fetch(ctx);
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
+#else
+    ctx->epollfd = epoll_create(AIO_EPOLL_ENABLE_THRESHOLD);
+    if (ctx->epollfd >= 0) {
+        qemu_set_cloexec(ctx->epollfd);
+    }
+#endif
+    ctx->epoll_available = ctx->epollfd >= 0;
+    ctx->epoll_enabled = false;
+}
+
+void aio_context_cleanup(AioContext *ctx)
+{
+    if (ctx->epollfd >= 0) {
+        close(ctx->epollfd);
+        ctx->epollfd = -1;
+    }
+}
+
+#else
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+}
+
+static void aio_epoll_try_enable(AioContext *ctx)
+{
+}
+
+static int aio_epoll_fetch(AioContext *ctx)
+{
+    return 0;
+}
+
+static int aio_epoll_wait(AioContext *ctx, int64_t timeout)
+{
+    abort();
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+    ctx->epollfd = -1;
+    ctx->epoll_available = false;
+    ctx->epoll_enabled = false;
+}
+
+void aio_context_cleanup(AioContext *ctx)
+{
+}
+
+#define AIO_EPOLL_ENABLE_THRESHOLD INT_MAX
+
+#endif
+
 void aio_set_fd_handler(AioContext *ctx,
                         int fd,
                         IOHandler *io_read,
@@ -55,7 +260,11 @@ void aio_set_fd_handler(AioContext *ctx,
     /* Are we deleting the fd handler? */
     if (!io_read && !io_write) {
         if (node) {
-            g_source_remove_poll(&ctx->source, &node->pfd);
+            if (!ctx->epoll_enabled) {
+                g_source_remove_poll(&ctx->source, &node->pfd);
+            }
+            node->pfd.events = 0;
+            aio_epoll_update(ctx, node, false);
 
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
@@ -71,13 +280,18 @@ void aio_set_fd_handler(AioContext *ctx,
             }
         }
     } else {
+        bool is_new = false;
+
         if (node == NULL) {
             /* Alloc and insert if it's not already there */
             node = g_malloc0(sizeof(AioHandler));
             node->pfd.fd = fd;
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
+            is_new = true;
 
-            g_source_add_poll(&ctx->source, &node->pfd);
+            if (!ctx->epoll_enabled) {
+                g_source_add_poll(&ctx->source, &node->pfd);
+            }
         }
         /* Update handler with latest information */
         node->io_read = io_read;
@@ -87,6 +301,7 @@ void aio_set_fd_handler(AioContext *ctx,
 
         node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP | G_IO_ERR : 0);
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
+        aio_epoll_update(ctx, node, is_new);
     }
 
     aio_notify(ctx);
@@ -100,10 +315,26 @@ void aio_set_event_notifier(AioContext *ctx,
                        (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    AioHandler *node = find_aio_handler(ctx, event_notifier_get_fd(notifier));
+
+    if (node) {
+        node->io_poll = io_poll;
+    }
+}
+
 bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
 
+    /* glib only polled the epoll fd, find out which handlers are ready */
+    if (ctx->epoll_enabled && ctx->epoll_pfd.revents) {
+        aio_epoll_fetch(ctx);
+    }
+
     QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         int revents;
 
@@ -172,10 +403,107 @@ static bool aio_dispatch(AioContext *ctx)
     return progress;
 }
 
+static bool run_poll_handlers_once(AioContext *ctx)
+{
+    AioHandler *node;
+    bool progress = false;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll &&
+            node->io_poll(node->opaque)) {
+            progress = true;
+        }
+    }
+
+    return progress;
+}
+
+/* Busy-wait on the poll handlers for up to @max_ns.  Returns true as soon as
+ * one of them made progress.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
+{
+    int64_t start_time, elapsed;
+    bool progress;
+
+    trace_run_poll_handlers_begin(ctx, max_ns);
+
+    ctx->walking_handlers++;
+    start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    do {
+        progress = run_poll_handlers_once(ctx);
+        elapsed = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_time;
+    } while (!progress && elapsed < max_ns);
+    ctx->walking_handlers--;
+
+    ctx->poll_attempts++;
+    ctx->poll_time_ns += elapsed;
+    if (progress) {
+        ctx->poll_successes++;
+    }
+
+    trace_run_poll_handlers_end(ctx, progress, elapsed);
+    return progress;
+}
+
+/* Poll instead of sleeping if polling is enabled and the next timer is not
+ * due sooner than the current window.
+ */
+static bool try_poll_mode(AioContext *ctx, int64_t timeout)
+{
+    int64_t max_ns;
+
+    if (!ctx->poll_ns) {
+        return false;
+    }
+
+    max_ns = ctx->poll_ns;
+    if (timeout >= 0 && timeout < max_ns) {
+        max_ns = timeout;
+    }
+    if (max_ns == 0) {
+        return false;
+    }
+    return run_poll_handlers(ctx, max_ns);
+}
+
+/* Resize the polling window after a blocking aio_poll() waited @block_ns */
+static void adjust_poll_time(AioContext *ctx, int64_t block_ns)
+{
+    int64_t old = ctx->poll_ns;
+
+    if (block_ns <= ctx->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+        return;
+    }
+
+    if (block_ns > ctx->poll_max_ns) {
+        /* We'd have to poll for too long, poll less */
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+        trace_poll_shrink(ctx, old, ctx->poll_ns);
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* There is room to grow, poll longer */
+        if (ctx->poll_ns == 0) {
+            ctx->poll_ns = AIO_POLL_NS_INITIAL;
+        } else {
+            ctx->poll_ns *= ctx->poll_grow;
+        }
+        if (ctx->poll_ns > ctx->poll_max_ns) {
+            ctx->poll_ns = ctx->poll_max_ns;
+        }
+        trace_poll_grow(ctx, old, ctx->poll_ns);
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
-    int ret;
+    int ret, nr_handlers = 0;
+    int64_t timeout, start = 0;
     bool progress;
 
     progress = false;
@@ -198,6 +526,23 @@ bool aio_poll(AioContext *ctx, bool blocking)
         return true;
     }
 
+    timeout = blocking ? timerlistgroup_deadline_ns(&ctx->tlg) : 0;
+    if (ctx->poll_max_ns && blocking) {
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (try_poll_mode(ctx, timeout)) {
+            adjust_poll_time(ctx,
+                             qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+            return true;
+        }
+    }
+
+    if (ctx->epoll_enabled) {
+        /* The epoll set is kept up to date by aio_set_fd_handler() */
+        aio_epoll_wait(ctx,
+                       blocking ? timerlistgroup_deadline_ns(&ctx->tlg) : 0);
+        goto dispatch;
+    }
+
     ctx->walking_handlers++;
 
     g_array_set_size(ctx->pollfds, 0);
@@ -205,6 +550,9 @@ bool aio_poll(AioContext *ctx, bool blocking)
     /* fill pollfds */
     QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         node->pollfds_idx = -1;
+        if (!node->deleted) {
+            nr_handlers++;
+        }
         if (!node->deleted && node->pfd.events) {
             GPollFD pfd = {
                 .fd = node->pfd.fd,
@@ -233,10 +581,23 @@ bool aio_poll(AioContext *ctx, bool blocking)
         }
     }
 
+    /* Switch to epoll for the next iteration, the events of this one are
+     * in the handlers already.
+     */
+    if (ctx->epoll_available && nr_handlers >= AIO_EPOLL_ENABLE_THRESHOLD) {
+        aio_epoll_try_enable(ctx);
+    }
+
+dispatch:
+
     /* Run dispatch even if there were no readable fds to run timers */
     if (aio_dispatch(ctx)) {
         progress = true;
     }
 
+    if (ctx->poll_max_ns && blocking) {
+        adjust_poll_time(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    }
+
     return progress;
 }
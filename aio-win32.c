@@ -28,6 +28,17 @@ struct AioHandler {
     QLIST_ENTRY(AioHandler) node;
 };
 
+void aio_context_setup(AioContext *ctx)
+{
+    ctx->epollfd = -1;
+    ctx->epoll_available = false;
+    ctx->epoll_enabled = false;
+}
+
+void aio_context_cleanup(AioContext *ctx)
+{
+}
+
 void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *e,
                             EventNotifierHandler *io_notify)
@@ -76,6 +87,13 @@ void aio_set_event_notifier(AioContext *ctx,
     aio_notify(ctx);
 }
 
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    /* Busy-wait polling is only implemented in aio-posix.c */
+}
+
 bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
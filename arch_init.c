@@ -27,12 +27,14 @@
 #ifndef _WIN32
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <zlib.h>
 #endif
 #include "config.h"
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
+#include "qemu/host-utils.h"
 #include "sysemu/arch_init.h"
 #include "audio/audio.h"
 #include "hw/i386/pc.h"
@@ -40,14 +42,19 @@
 #include "hw/audio/audio.h"
 #include "sysemu/kvm.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
 #include "hw/i386/smbios.h"
 #include "exec/address-spaces.h"
 #include "hw/audio/pcspk.h"
 #include "migration/page_cache.h"
 #include "qemu/config-file.h"
+#include "qemu/error-report.h"
 #include "qmp-commands.h"
+#include "qapi/qmp/qerror.h"
 #include "trace.h"
 #include "exec/cpu-all.h"
+#include "exec/ram_addr.h"
+#include "qemu/rcu.h"
 #include "hw/acpi/acpi.h"
 
 #ifdef DEBUG_ARCH_INIT
@@ -106,12 +113,18 @@ int graphic_depth = 32;
 const uint32_t arch_type = QEMU_ARCH;
 static bool mig_throttle_on;
 static int dirty_rate_high_cnt;
+/* Share of each 40ms period that throttled vCPUs spend asleep */
+#define MIG_THROTTLE_PCT 75
+static int mig_throttle_pct = MIG_THROTTLE_PCT;
 static void check_guest_throttling(void);
 
 /***********************************************************/
 /* ram save/restore */
 
-#define RAM_SAVE_FLAG_FULL     0x01 /* Obsolete, not used anymore */
+/* 0x01 was RAM_SAVE_FLAG_FULL, which was never sent; it now says that
+ * the pages are in a template file instead of the stream
+ */
+#define RAM_SAVE_FLAG_TEMPLATE 0x01
 #define RAM_SAVE_FLAG_COMPRESS 0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
@@ -119,6 +132,9 @@ static void check_guest_throttling(void);
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
+#define RAM_SAVE_FLAG_MULTIFD_SYNC 0x100
+/* zlib compressed page, followed by a be32 length and the data */
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x200
 
 
 static struct defconfig_file {
@@ -166,6 +182,11 @@ static struct {
     uint8_t *decoded_buf;
     /* Cache for XBZRLE */
     PageCache *cache;
+    /* Size requested by the monitor, in pages, applied by the migration
+     * thread; protected by the iothread lock */
+    int64_t resize_pages;
+    /* Cache counters, kept when the cache goes away at the end */
+    PageCacheStats stats;
 } XBZRLE = {
     .encoded_buf = NULL,
     .current_buf = NULL,
@@ -174,13 +195,82 @@ static struct {
 };
 
 
+/* Called with the iothread lock held */
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
+    if (new_size < TARGET_PAGE_SIZE) {
+        return -1;
+    }
+
+    /* The migration thread uses the cache without the iothread lock, so
+     * it also does the resize, before its next pass over RAM.
+     */
     if (XBZRLE.cache != NULL) {
-        return cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) *
-            TARGET_PAGE_SIZE;
+        XBZRLE.resize_pages = new_size / TARGET_PAGE_SIZE;
+    }
+    return pow2floor(new_size / TARGET_PAGE_SIZE) * TARGET_PAGE_SIZE;
+}
+
+static void xbzrle_cache_apply_resize(void)
+{
+    int64_t pages;
+
+    qemu_mutex_lock_iothread();
+    pages = XBZRLE.resize_pages;
+    XBZRLE.resize_pages = 0;
+    qemu_mutex_unlock_iothread();
+
+    if (pages && cache_resize(XBZRLE.cache, pages) < 0) {
+        error_report("migration: failed to resize the XBZRLE cache to %"
+                     PRId64 " pages", pages);
+    }
+}
+
+static void xbzrle_cache_get_stats(PageCacheStats *stats)
+{
+    if (XBZRLE.cache) {
+        cache_get_stats(XBZRLE.cache, stats);
+    } else {
+        *stats = XBZRLE.stats;
+    }
+}
+
+uint64_t xbzrle_mig_cache_hits(void)
+{
+    PageCacheStats stats;
+
+    xbzrle_cache_get_stats(&stats);
+    return stats.hits;
+}
+
+uint64_t xbzrle_mig_cache_evictions(void)
+{
+    PageCacheStats stats;
+
+    xbzrle_cache_get_stats(&stats);
+    return stats.evictions;
+}
+
+double xbzrle_mig_cache_hit_rate(void)
+{
+    PageCacheStats stats;
+
+    xbzrle_cache_get_stats(&stats);
+    if (stats.hits + stats.misses == 0) {
+        return 0;
+    }
+    return (double)stats.hits / (stats.hits + stats.misses);
+}
+
+double xbzrle_mig_cache_eviction_rate(void)
+{
+    PageCacheStats stats;
+
+    xbzrle_cache_get_stats(&stats);
+    if (stats.inserts == 0) {
+        return 0;
     }
-    return pow2floor(new_size);
+    return (double)stats.evictions / stats.inserts;
 }
 
 /* accounting for migration statistics */
@@ -323,6 +413,441 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
     return bytes_sent;
 }
 
+/***********************************************************/
+/* multifd: RAM pages sent over several channels
+ *
+ * Normal pages are handed out to the channels by ram_addr range, each
+ * channel being drained by its own thread into its own QEMUFile.  Zero
+ * pages, XBZRLE pages and the rest of the migration stream still go over
+ * the main QEMUFile.  A page is sent at most once between two bitmap
+ * syncs, so it is enough to put a sync point in every stream after each
+ * round of ram_save_iterate: the destination waits for all channels to
+ * reach it before it loads anything that follows in the main stream.
+ */
+
+#define MULTIFD_MAGIC          0x4d554c54U /* "MULT" */
+#define MULTIFD_VERSION        1
+#define MULTIFD_PAGES_PER_PACKET 64
+/* Each channel owns interleaved ranges of 2MB of ram_addr space */
+#define MULTIFD_RANGE_SHIFT    21
+
+#define MULTIFD_FLAG_PAGES     0x1
+#define MULTIFD_FLAG_SYNC      0x2
+#define MULTIFD_FLAG_EOS       0x4
+
+typedef struct MultiFDPages {
+    RAMBlock *block;
+    int num;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+} MultiFDPages;
+
+typedef struct MultiFDSendParams {
+    int id;
+    QemuThread thread;
+    QEMUFile *file;
+    /* filled by the migration thread, swapped with @pages on flush */
+    MultiFDPages *staging;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* everything below is protected by @mutex */
+    MultiFDPages *pages;
+    bool pending;
+    bool sync;
+    bool quit;
+    int error;
+} MultiFDSendParams;
+
+static struct {
+    MultiFDSendParams *params;
+    int count;
+} multifd_send_state;
+
+static void multifd_send_pages(QEMUFile *f, MultiFDPages *pages)
+{
+    RAMBlock *block = pages->block;
+    uint8_t *host = memory_region_get_ram_ptr(block->mr);
+    int i;
+
+    qemu_put_be32(f, MULTIFD_FLAG_PAGES);
+    qemu_put_byte(f, strlen(block->idstr));
+    qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+    qemu_put_be32(f, pages->num);
+    for (i = 0; i < pages->num; i++) {
+        qemu_put_be64(f, pages->offset[i]);
+        qemu_put_buffer_async(f, host + pages->offset[i], TARGET_PAGE_SIZE);
+    }
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    QEMUFile *f = p->file;
+
+    qemu_put_be32(f, MULTIFD_MAGIC);
+    qemu_put_be32(f, MULTIFD_VERSION);
+    qemu_put_be32(f, p->id);
+
+    qemu_mutex_lock(&p->mutex);
+    while (true) {
+        if (p->pending) {
+            MultiFDPages *pages = p->pages;
+
+            qemu_mutex_unlock(&p->mutex);
+            multifd_send_pages(f, pages);
+            qemu_mutex_lock(&p->mutex);
+            pages->num = 0;
+            pages->block = NULL;
+            p->pending = false;
+            p->error = qemu_file_get_error(f);
+            qemu_cond_broadcast(&p->cond);
+        } else if (p->sync) {
+            qemu_mutex_unlock(&p->mutex);
+            qemu_put_be32(f, MULTIFD_FLAG_SYNC);
+            qemu_fflush(f);
+            qemu_mutex_lock(&p->mutex);
+            p->sync = false;
+            p->error = qemu_file_get_error(f);
+            qemu_cond_broadcast(&p->cond);
+        } else if (p->quit) {
+            break;
+        } else {
+            qemu_cond_wait(&p->cond, &p->mutex);
+        }
+    }
+    qemu_mutex_unlock(&p->mutex);
+
+    qemu_put_be32(f, MULTIFD_FLAG_EOS);
+    qemu_fflush(f);
+
+    return NULL;
+}
+
+static bool multifd_send_active(void)
+{
+    return multifd_send_state.count > 0;
+}
+
+static void multifd_save_setup(void)
+{
+    MigrationState *s = migrate_get_current();
+    int i;
+
+    multifd_send_state.count = s->multifd_nb_files;
+    if (!multifd_send_state.count) {
+        return;
+    }
+
+    multifd_send_state.params = g_malloc0(multifd_send_state.count *
+                                          sizeof(MultiFDSendParams));
+    for (i = 0; i < multifd_send_state.count; i++) {
+        MultiFDSendParams *p = &multifd_send_state.params[i];
+
+        p->id = i;
+        p->file = s->multifd_files[i];
+        p->staging = g_malloc0(sizeof(MultiFDPages));
+        p->pages = g_malloc0(sizeof(MultiFDPages));
+        qemu_mutex_init(&p->mutex);
+        qemu_cond_init(&p->cond);
+        qemu_thread_create(&p->thread, multifd_send_thread, p,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void multifd_save_cleanup(void)
+{
+    int i;
+
+    for (i = 0; i < multifd_send_state.count; i++) {
+        MultiFDSendParams *p = &multifd_send_state.params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_cond_broadcast(&p->cond);
+        qemu_mutex_unlock(&p->mutex);
+    }
+
+    for (i = 0; i < multifd_send_state.count; i++) {
+        MultiFDSendParams *p = &multifd_send_state.params[i];
+
+        qemu_thread_join(&p->thread);
+        qemu_mutex_destroy(&p->mutex);
+        qemu_cond_destroy(&p->cond);
+        g_free(p->staging);
+        g_free(p->pages);
+    }
+
+    g_free(multifd_send_state.params);
+    multifd_send_state.params = NULL;
+    multifd_send_state.count = 0;
+}
+
+/* Hand the staged pages of @p over to its thread.  Blocks while the thread
+ * is still busy with the previous batch, which throttles the page scan to
+ * the speed of the slowest channel.
+ */
+static int multifd_send_flush(MultiFDSendParams *p)
+{
+    MultiFDPages *pages;
+    int ret;
+
+    if (!p->staging->num) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&p->mutex);
+    while (p->pending) {
+        qemu_cond_wait(&p->cond, &p->mutex);
+    }
+    pages = p->pages;
+    p->pages = p->staging;
+    p->staging = pages;
+    p->pending = true;
+    ret = p->error;
+    qemu_cond_broadcast(&p->cond);
+    qemu_mutex_unlock(&p->mutex);
+
+    return ret;
+}
+
+static int multifd_queue_page(RAMBlock *block, ram_addr_t offset)
+{
+    int idx = ((block->offset + offset) >> MULTIFD_RANGE_SHIFT) %
+              multifd_send_state.count;
+    MultiFDSendParams *p = &multifd_send_state.params[idx];
+    int ret = 0;
+
+    if (p->staging->num && p->staging->block != block) {
+        ret = multifd_send_flush(p);
+    }
+
+    p->staging->block = block;
+    p->staging->offset[p->staging->num++] = offset;
+
+    if (p->staging->num == MULTIFD_PAGES_PER_PACKET) {
+        ret = multifd_send_flush(p);
+    }
+
+    return ret;
+}
+
+/* Put a sync point in every channel and in the main stream @f.  Returns
+ * the number of bytes written to @f, or a negative error if one of the
+ * channels failed.
+ */
+static int multifd_send_sync_main(QEMUFile *f)
+{
+    int i, ret = 0;
+
+    if (!multifd_send_active()) {
+        return 0;
+    }
+
+    for (i = 0; i < multifd_send_state.count; i++) {
+        MultiFDSendParams *p = &multifd_send_state.params[i];
+
+        multifd_send_flush(p);
+        qemu_mutex_lock(&p->mutex);
+        p->sync = true;
+        qemu_cond_broadcast(&p->cond);
+        qemu_mutex_unlock(&p->mutex);
+    }
+
+    for (i = 0; i < multifd_send_state.count; i++) {
+        MultiFDSendParams *p = &multifd_send_state.params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        while (p->pending || p->sync) {
+            qemu_cond_wait(&p->cond, &p->mutex);
+        }
+        if (p->error) {
+            ret = p->error;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    return 8;
+}
+
+typedef struct MultiFDRecvParams {
+    int id;
+    QemuThread thread;
+    QEMUFile *file;
+    /* posted by the channel when it reaches a sync point */
+    QemuSemaphore sem_sync;
+    /* posted by ram_load once every channel has reached the sync point */
+    QemuSemaphore sem_go;
+    int error;
+} MultiFDRecvParams;
+
+static struct {
+    MultiFDRecvParams *params;
+    int count;
+} multifd_recv_state;
+
+static int multifd_recv_pages(QEMUFile *f)
+{
+    RAMBlock *block;
+    uint8_t *host;
+    char id[256];
+    uint8_t len;
+    uint32_t num, i;
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            break;
+        }
+    }
+    if (!block) {
+        fprintf(stderr, "multifd: can't find block %s!\n", id);
+        return -EINVAL;
+    }
+    host = memory_region_get_ram_ptr(block->mr);
+
+    num = qemu_get_be32(f);
+    if (num > MULTIFD_PAGES_PER_PACKET) {
+        fprintf(stderr, "multifd: too many pages in packet (%u)\n", num);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < num; i++) {
+        ram_addr_t offset = qemu_get_be64(f);
+
+        if (offset & ~TARGET_PAGE_MASK ||
+            offset + TARGET_PAGE_SIZE > block->length) {
+            fprintf(stderr, "multifd: bad offset " RAM_ADDR_FMT
+                    " in block %s\n", offset, id);
+            return -EINVAL;
+        }
+        qemu_get_buffer(f, host + offset, TARGET_PAGE_SIZE);
+    }
+
+    return qemu_file_get_error(f);
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    QEMUFile *f = p->file;
+    uint32_t flags;
+    int ret = 0;
+
+    if (qemu_get_be32(f) != MULTIFD_MAGIC ||
+        qemu_get_be32(f) != MULTIFD_VERSION) {
+        fprintf(stderr, "multifd: bad header on channel %d\n", p->id);
+        ret = -EINVAL;
+        goto out;
+    }
+    /* Pages carry their own location, the channel number is informative */
+    qemu_get_be32(f);
+
+    while (true) {
+        flags = qemu_get_be32(f);
+        ret = qemu_file_get_error(f);
+        if (ret) {
+            break;
+        }
+
+        if (flags == MULTIFD_FLAG_PAGES) {
+            ret = multifd_recv_pages(f);
+            if (ret) {
+                break;
+            }
+        } else if (flags == MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&p->sem_sync);
+            qemu_sem_wait(&p->sem_go);
+        } else if (flags == MULTIFD_FLAG_EOS) {
+            break;
+        } else {
+            fprintf(stderr, "multifd: unknown flags 0x%x on channel %d\n",
+                    flags, p->id);
+            ret = -EINVAL;
+            break;
+        }
+    }
+
+out:
+    if (ret) {
+        /* Don't leave ram_load waiting for a sync that will never come */
+        p->error = ret;
+        qemu_sem_post(&p->sem_sync);
+    }
+    return NULL;
+}
+
+void multifd_load_setup(QEMUFile **files, int nb_files)
+{
+    int i;
+
+    multifd_recv_state.count = nb_files;
+    multifd_recv_state.params = g_malloc0(nb_files *
+                                          sizeof(MultiFDRecvParams));
+    for (i = 0; i < nb_files; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state.params[i];
+
+        p->id = i;
+        p->file = files[i];
+        qemu_sem_init(&p->sem_sync, 0);
+        qemu_sem_init(&p->sem_go, 0);
+        qemu_thread_create(&p->thread, multifd_recv_thread, p,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+/* Called once the main stream has been loaded successfully: the source
+ * terminates every channel after the last sync point.
+ */
+void multifd_load_cleanup(void)
+{
+    int i;
+
+    for (i = 0; i < multifd_recv_state.count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state.params[i];
+
+        qemu_thread_join(&p->thread);
+        qemu_sem_destroy(&p->sem_sync);
+        qemu_sem_destroy(&p->sem_go);
+        qemu_fclose(p->file);
+    }
+
+    g_free(multifd_recv_state.params);
+    multifd_recv_state.params = NULL;
+    multifd_recv_state.count = 0;
+}
+
+static int multifd_recv_sync_main(void)
+{
+    int i, ret = 0;
+
+    if (!multifd_recv_state.count) {
+        fprintf(stderr, "multifd: sync point without channels\n");
+        return -EINVAL;
+    }
+
+    for (i = 0; i < multifd_recv_state.count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state.params[i];
+
+        qemu_sem_wait(&p->sem_sync);
+        if (p->error) {
+            ret = p->error;
+        }
+    }
+
+    for (i = 0; i < multifd_recv_state.count; i++) {
+        qemu_sem_post(&multifd_recv_state.params[i].sem_go);
+    }
+
+    return ret;
+}
 
 /* This is the last block that we have visited serching for dirty pages
  */
@@ -334,6 +859,34 @@ static unsigned long *migration_bitmap;
 static uint64_t migration_dirty_pages;
 static uint32_t last_version;
 static bool ram_bulk_stage;
+/* Set once the source has switched to postcopy */
+static bool ram_postcopy_active;
+/* Free page hints: the generation the guest must quote, 0 when no
+ * migration is running.  Bumped by every bitmap sync, since a page the
+ * guest reported free before a sync may have been reused and dirtied
+ * since.
+ */
+static uint32_t free_page_hint_gen;
+static uint32_t free_page_hint_next;
+/* Some pages were dropped from the bitmap, even during the bulk stage */
+static bool migration_bitmap_hinted;
+static NotifierList ram_bitmap_sync_notifiers =
+    NOTIFIER_LIST_INITIALIZER(ram_bitmap_sync_notifiers);
+
+/* Pages the destination faulted on during postcopy; sent before anything
+ * else.  Filled by the return path thread.
+ */
+typedef struct RAMSrcPageRequest {
+    char *idstr;
+    ram_addr_t offset;
+    ram_addr_t len;
+    QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
+} RAMSrcPageRequest;
+
+static QemuMutex src_page_req_mutex;
+static bool src_page_req_mutex_initialized;
+static QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(src_page_requests);
 
 static inline
 ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
@@ -346,7 +899,7 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
 
     unsigned long next;
 
-    if (ram_bulk_stage && nr > base) {
+    if (ram_bulk_stage && nr > base && !migration_bitmap_hinted) {
         next = nr + 1;
     } else {
         next = find_next_bit(migration_bitmap, size, nr);
@@ -359,65 +912,251 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
     return (next - base) << TARGET_PAGE_BITS;
 }
 
-static inline bool migration_bitmap_set_dirty(MemoryRegion *mr,
-                                              ram_addr_t offset)
-{
-    bool ret;
-    int nr = (mr->ram_addr + offset) >> TARGET_PAGE_BITS;
+/*
+ * Dirty rate measurement: count the pages the guest dirties over a period,
+ * per RAMBlock, without migrating.  It has its own dirty memory client, but
+ * shares the global dirty log with migration, so the two exclude each other.
+ * Everything but the thread handle is protected by the iothread lock.
+ */
+#define DIRTY_RATE_MAX_CALC_TIME 60
 
-    ret = test_and_set_bit(nr, migration_bitmap);
+static struct {
+    QemuThread thread;
+    bool thread_created;
+    DirtyRateStatus status;
+    int64_t calc_time;
+    int64_t start_time;
+    uint64_t dirty_pages;
+    uint64_t dirty_pages_rate;
+    DirtyRateBlockInfoList *blocks;
+} dirty_rate = {
+    .status = DIRTY_RATE_STATUS_UNSTARTED,
+};
 
-    if (!ret) {
-        migration_dirty_pages++;
-    }
-    return ret;
+bool dirty_rate_measuring(void)
+{
+    return dirty_rate.status == DIRTY_RATE_STATUS_MEASURING;
 }
 
-/* Needs iothread lock! */
-
-static void migration_bitmap_sync(void)
+static void *dirty_rate_thread(void *opaque)
 {
+    DirtyRateBlockInfoList *head = NULL, **tail = &head;
     RAMBlock *block;
     ram_addr_t addr;
-    uint64_t num_dirty_pages_init = migration_dirty_pages;
-    MigrationState *s = migrate_get_current();
-    static int64_t start_time;
-    static int64_t bytes_xfer_prev;
-    static int64_t num_dirty_pages_period;
-    int64_t end_time;
-    int64_t bytes_xfer_now;
+    int64_t elapsed;
 
-    if (!bytes_xfer_prev) {
-        bytes_xfer_prev = ram_bytes_transferred();
-    }
+    rcu_register_thread();
 
-    if (!start_time) {
-        start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start();
+    address_space_sync_dirty_bitmap(&address_space_memory);
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        memory_region_reset_dirty(block->mr, 0, block->length,
+                                  DIRTY_MEMORY_DIRTY_RATE);
     }
+    dirty_rate.start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_mutex_unlock_iothread();
 
-    trace_migration_bitmap_sync_start();
+    g_usleep(dirty_rate.calc_time * G_USEC_PER_SEC);
+
+    qemu_mutex_lock_iothread();
     address_space_sync_dirty_bitmap(&address_space_memory);
+    elapsed = MAX(qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                  dirty_rate.start_time, 1);
 
+    qapi_free_DirtyRateBlockInfoList(dirty_rate.blocks);
+    dirty_rate.dirty_pages = 0;
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        DirtyRateBlockInfoList *entry = g_malloc0(sizeof(*entry));
+        DirtyRateBlockInfo *info = g_malloc0(sizeof(*info));
+
         for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
-            if (memory_region_test_and_clear_dirty(block->mr,
-                                                   addr, TARGET_PAGE_SIZE,
-                                                   DIRTY_MEMORY_MIGRATION)) {
-                migration_bitmap_set_dirty(block->mr, addr);
+            if (memory_region_get_dirty(block->mr, addr, TARGET_PAGE_SIZE,
+                                        DIRTY_MEMORY_DIRTY_RATE)) {
+                info->dirty_pages++;
             }
         }
+        memory_region_reset_dirty(block->mr, 0, block->length,
+                                  DIRTY_MEMORY_DIRTY_RATE);
+
+        info->id = g_strdup(block->idstr);
+        info->size = block->length;
+        info->dirty_pages_rate = info->dirty_pages * 1000 / elapsed;
+        dirty_rate.dirty_pages += info->dirty_pages;
+
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
     }
-    trace_migration_bitmap_sync_end(migration_dirty_pages
-                                    - num_dirty_pages_init);
-    num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
-    end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    memory_global_dirty_log_stop();
 
-    /* more than 1 second = 1000 millisecons */
-    if (end_time > start_time + 1000) {
-        if (migrate_auto_converge()) {
-            /* The following detection logic can be refined later. For now:
-               Check to see if the dirtied bytes is 50% more than the approx.
-               amount of bytes that just got transferred since the last time we
+    dirty_rate.blocks = head;
+    dirty_rate.dirty_pages_rate = dirty_rate.dirty_pages * 1000 / elapsed;
+    dirty_rate.status = DIRTY_RATE_STATUS_MEASURED;
+    trace_dirty_rate_measured(dirty_rate.dirty_pages, elapsed);
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
+{
+    if (calc_time < 1 || calc_time > DIRTY_RATE_MAX_CALC_TIME) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                  "an integer in the range of 1 to 60");
+        return;
+    }
+
+    if (dirty_rate_measuring()) {
+        error_setg(errp, "a dirty rate measurement is already in progress");
+        return;
+    }
+
+    if (migration_is_active(migrate_get_current())) {
+        error_setg(errp, "migration is in progress, use query-migrate to get "
+                   "its dirty pages rate");
+        return;
+    }
+
+    /* The previous thread has finished, it set the status to measured */
+    if (dirty_rate.thread_created) {
+        qemu_thread_join(&dirty_rate.thread);
+    }
+
+    dirty_rate.calc_time = calc_time;
+    dirty_rate.status = DIRTY_RATE_STATUS_MEASURING;
+    trace_dirty_rate_start(calc_time);
+    qemu_thread_create(&dirty_rate.thread, dirty_rate_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    dirty_rate.thread_created = true;
+}
+
+static DirtyRateBlockInfoList *dirty_rate_copy_blocks(void)
+{
+    DirtyRateBlockInfoList *head = NULL, **tail = &head, *b;
+
+    for (b = dirty_rate.blocks; b; b = b->next) {
+        DirtyRateBlockInfoList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_memdup(b->value, sizeof(*b->value));
+        entry->value->id = g_strdup(b->value->id);
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_malloc0(sizeof(*info));
+
+    info->status = dirty_rate.status;
+    info->page_size = TARGET_PAGE_SIZE;
+    if (dirty_rate.status != DIRTY_RATE_STATUS_UNSTARTED) {
+        info->has_calc_time = true;
+        info->calc_time = dirty_rate.calc_time;
+    }
+    if (dirty_rate.status == DIRTY_RATE_STATUS_MEASURED) {
+        info->has_dirty_pages = true;
+        info->dirty_pages = dirty_rate.dirty_pages;
+        info->has_dirty_pages_rate = true;
+        info->dirty_pages_rate = dirty_rate.dirty_pages_rate;
+        info->has_blocks = true;
+        info->blocks = dirty_rate_copy_blocks();
+    }
+
+    return info;
+}
+
+/*
+ * Move the pages dirtied in [@start, @start + @length) from the migration
+ * dirty memory client to the migration bitmap.  When @start is on a bitmap
+ * word, whole words are merged; the remaining pages go one at a time.
+ */
+static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
+{
+    unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
+    unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
+    unsigned long k, nr;
+    ram_addr_t addr = 0;
+
+    if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) {
+        nr = (length >> TARGET_PAGE_BITS) / BITS_PER_LONG;
+        for (k = page; k < page + nr; k++) {
+            if (src[k]) {
+                unsigned long new_dirty = src[k] & ~migration_bitmap[k];
+
+                migration_bitmap[k] |= src[k];
+                migration_dirty_pages += ctpopl(new_dirty);
+                src[k] = 0;
+            }
+        }
+        addr = (ram_addr_t)(nr * BITS_PER_LONG) << TARGET_PAGE_BITS;
+
+        /* TCG only marks pages dirty again once their TLB entries
+         * are reset
+         */
+        if (tcg_enabled() && addr) {
+            cpu_physical_memory_reset_dirty(start, start + addr,
+                                            MIGRATION_DIRTY_FLAG);
+        }
+    }
+
+    for (; addr < length; addr += TARGET_PAGE_SIZE) {
+        if (cpu_physical_memory_get_dirty_flag(start + addr,
+                                               DIRTY_MEMORY_MIGRATION)) {
+            cpu_physical_memory_reset_dirty(start + addr,
+                                            start + addr + TARGET_PAGE_SIZE,
+                                            MIGRATION_DIRTY_FLAG);
+            if (!test_and_set_bit((start + addr) >> TARGET_PAGE_BITS,
+                                  migration_bitmap)) {
+                migration_dirty_pages++;
+            }
+        }
+    }
+}
+
+/* Needs iothread lock! */
+
+static void migration_bitmap_sync(void)
+{
+    RAMBlock *block;
+    uint64_t num_dirty_pages_init = migration_dirty_pages;
+    MigrationState *s = migrate_get_current();
+    static int64_t start_time;
+    static int64_t bytes_xfer_prev;
+    static int64_t num_dirty_pages_period;
+    int64_t end_time;
+    int64_t bytes_xfer_now;
+
+    if (!bytes_xfer_prev) {
+        bytes_xfer_prev = ram_bytes_transferred();
+    }
+
+    if (!start_time) {
+        start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    }
+
+    trace_migration_bitmap_sync_start();
+    address_space_sync_dirty_bitmap(&address_space_memory);
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        migration_bitmap_sync_range(block->mr->ram_addr, block->length);
+    }
+    trace_migration_bitmap_sync_end(migration_dirty_pages
+                                    - num_dirty_pages_init);
+    num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
+    end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    /* more than 1 second = 1000 millisecons */
+    if (end_time > start_time + 1000) {
+        if (migrate_auto_tune()) {
+            /* migration_auto_tune() takes care of the throttle */
+        } else if (migrate_auto_converge()) {
+            /* The following detection logic can be refined later. For now:
+               Check to see if the dirtied bytes is 50% more than the approx.
+               amount of bytes that just got transferred since the last time we
                were in this routine. If that happens >N times (for now N==4)
                we turn on the throttle down logic */
             bytes_xfer_now = ram_bytes_transferred();
@@ -439,6 +1178,548 @@ static void migration_bitmap_sync(void)
         start_time = end_time;
         num_dirty_pages_period = 0;
     }
+
+    /* Hints given before this point may be stale, ask for new ones */
+    if (++free_page_hint_next == 0) {
+        free_page_hint_next = 1;
+    }
+    atomic_set(&free_page_hint_gen, free_page_hint_next);
+    notifier_list_notify(&ram_bitmap_sync_notifiers, NULL);
+}
+
+uint32_t ram_free_page_hint_generation(void)
+{
+    return atomic_read(&free_page_hint_gen);
+}
+
+void ram_add_bitmap_sync_notifier(Notifier *notify)
+{
+    notifier_list_add(&ram_bitmap_sync_notifiers, notify);
+}
+
+void ram_remove_bitmap_sync_notifier(Notifier *notify)
+{
+    notifier_remove(notify);
+}
+
+/*
+ * The guest reported [start, start + len) as free while @gen was current.
+ * Take its pages out of the migration bitmap, unless a sync happened in
+ * between.  Needs the iothread lock.  Returns true if the hint was used.
+ */
+bool ram_discard_free_pages(uint32_t gen, ram_addr_t start, ram_addr_t len)
+{
+    unsigned long first = DIV_ROUND_UP(start, TARGET_PAGE_SIZE);
+    unsigned long last = (start + len) >> TARGET_PAGE_BITS;
+    unsigned long nr;
+    bool used = false;
+
+    qemu_mutex_lock_ramlist();
+    if (migration_bitmap && gen && gen == free_page_hint_gen &&
+        !ram_postcopy_active) {
+        for (nr = first; nr < last; nr++) {
+            if (test_and_clear_bit(nr, migration_bitmap)) {
+                migration_dirty_pages--;
+            }
+        }
+        migration_bitmap_hinted = true;
+        used = true;
+    }
+    qemu_mutex_unlock_ramlist();
+    trace_ram_discard_free_pages(gen, start, len, used);
+    return used;
+}
+
+/***********************************************************/
+/* compress: RAM pages deflated by a pool of threads
+ *
+ * The migration thread hands each page to an idle compression thread and
+ * writes whatever that thread produced for its previous page to the stream.
+ * Pages may therefore reach the stream out of order within a round, which
+ * is fine since a page is sent at most once between two bitmap syncs; all
+ * threads are flushed before every RAM_SAVE_FLAG_EOS.  Each thread copies
+ * the page first, deflate must not see its input change under its feet.
+ */
+
+typedef struct CompressParam {
+    int id;
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* protected by mutex */
+    bool start;
+    bool quit;
+    /* protected by comp_done_lock */
+    bool done;
+    /* set by the migration thread before start, result read after done */
+    RAMBlock *block;
+    ram_addr_t offset;
+    z_stream stream;
+    uint8_t *originbuf;
+    uint8_t *buf;
+    size_t buf_size;
+    size_t len;
+    bool has_data;
+    int error;
+    /* statistics, read under comp_done_lock */
+    uint64_t pages;
+    uint64_t bytes_out;
+    int64_t busy_ns;
+} CompressParam;
+
+static struct {
+    CompressParam *params;
+    int count;
+    bool running;
+    uint64_t pages;
+    uint64_t bytes;
+    uint64_t busy;
+} compress_state;
+
+static QemuMutex comp_done_lock;
+static QemuCond comp_done_cond;
+
+static void *do_data_compress(void *opaque)
+{
+    CompressParam *param = opaque;
+    int64_t t0;
+    int ret;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (!param->start) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+            continue;
+        }
+        param->start = false;
+        qemu_mutex_unlock(&param->mutex);
+
+        t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        memcpy(param->originbuf,
+               memory_region_get_ram_ptr(param->block->mr) + param->offset,
+               TARGET_PAGE_SIZE);
+
+        deflateReset(&param->stream);
+        param->stream.next_in = param->originbuf;
+        param->stream.avail_in = TARGET_PAGE_SIZE;
+        param->stream.next_out = param->buf;
+        param->stream.avail_out = param->buf_size;
+        ret = deflate(&param->stream, Z_FINISH);
+
+        qemu_mutex_lock(&comp_done_lock);
+        if (ret != Z_STREAM_END) {
+            param->error = -EIO;
+        } else {
+            param->len = param->buf_size - param->stream.avail_out;
+            param->has_data = true;
+            param->pages++;
+            param->bytes_out += param->len;
+        }
+        param->busy_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - t0;
+        param->done = true;
+        qemu_cond_signal(&comp_done_cond);
+        qemu_mutex_unlock(&comp_done_lock);
+
+        qemu_mutex_lock(&param->mutex);
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static bool compress_active(void)
+{
+    return compress_state.running;
+}
+
+static void compress_threads_save_cleanup(void)
+{
+    int i;
+
+    if (!compress_active()) {
+        return;
+    }
+
+    for (i = 0; i < compress_state.count; i++) {
+        CompressParam *p = &compress_state.params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_cond_signal(&p->cond);
+        qemu_mutex_unlock(&p->mutex);
+        qemu_thread_join(&p->thread);
+
+        qemu_mutex_destroy(&p->mutex);
+        qemu_cond_destroy(&p->cond);
+        deflateEnd(&p->stream);
+        g_free(p->originbuf);
+        g_free(p->buf);
+        p->originbuf = NULL;
+        p->buf = NULL;
+    }
+    qemu_mutex_destroy(&comp_done_lock);
+    qemu_cond_destroy(&comp_done_cond);
+
+    /* The statistics stay around for query-migrate until the next setup */
+    compress_state.running = false;
+}
+
+static int compress_threads_save_setup(void)
+{
+    int i, count;
+    CompressParam *params;
+
+    /* Statistics of the previous migration */
+    g_free(compress_state.params);
+    memset(&compress_state, 0, sizeof(compress_state));
+
+    if (!migrate_use_compression()) {
+        return 0;
+    }
+
+    count = migrate_compress_threads();
+    params = g_new0(CompressParam, count);
+    qemu_mutex_init(&comp_done_lock);
+    qemu_cond_init(&comp_done_cond);
+
+    for (i = 0; i < count; i++) {
+        CompressParam *p = &params[i];
+
+        p->id = i;
+        p->done = true;
+        if (deflateInit(&p->stream, migrate_compress_level()) != Z_OK) {
+            DPRINTF("Error initializing compression stream\n");
+            compress_state.params = params;
+            compress_state.count = i;
+            compress_state.running = true;
+            compress_threads_save_cleanup();
+            return -1;
+        }
+        p->buf_size = deflateBound(&p->stream, TARGET_PAGE_SIZE);
+        p->buf = g_malloc(p->buf_size);
+        p->originbuf = g_malloc(TARGET_PAGE_SIZE);
+        qemu_mutex_init(&p->mutex);
+        qemu_cond_init(&p->cond);
+        qemu_thread_create(&p->thread, do_data_compress, p,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    compress_state.params = params;
+    compress_state.count = count;
+    compress_state.running = true;
+    return 0;
+}
+
+/* Called with comp_done_lock held, for an idle thread */
+static int compress_flush_param(QEMUFile *f, CompressParam *p)
+{
+    int bytes_sent;
+    int cont;
+
+    if (p->error) {
+        qemu_file_set_error(f, p->error);
+        p->error = 0;
+        return 0;
+    }
+    if (!p->has_data) {
+        return 0;
+    }
+
+    cont = (p->block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    bytes_sent = save_block_hdr(f, p->block, p->offset, cont,
+                                RAM_SAVE_FLAG_COMPRESS_PAGE);
+    qemu_put_be32(f, p->len);
+    qemu_put_buffer(f, p->buf, p->len);
+    bytes_sent += 4 + p->len;
+    last_sent_block = p->block;
+    p->has_data = false;
+
+    compress_state.pages++;
+    compress_state.bytes += p->len;
+    acct_info.norm_pages++;
+
+    return bytes_sent;
+}
+
+/*
+ * Hand the page to an idle compression thread, waiting for one if they are
+ * all busy.  Returns how many bytes of earlier results went to the stream,
+ * which may well be 0.
+ */
+static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
+                                           ram_addr_t offset)
+{
+    int i, bytes_sent = 0;
+    bool waited = false;
+
+    qemu_mutex_lock(&comp_done_lock);
+    while (true) {
+        for (i = 0; i < compress_state.count; i++) {
+            CompressParam *p = &compress_state.params[i];
+
+            if (p->done) {
+                bytes_sent = compress_flush_param(f, p);
+                p->done = false;
+                p->block = block;
+                p->offset = offset;
+
+                qemu_mutex_lock(&p->mutex);
+                p->start = true;
+                qemu_cond_signal(&p->cond);
+                qemu_mutex_unlock(&p->mutex);
+                qemu_mutex_unlock(&comp_done_lock);
+                return bytes_sent;
+            }
+        }
+        if (!waited) {
+            compress_state.busy++;
+            waited = true;
+        }
+        qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+    }
+}
+
+/* Wait for all compression threads and write out their last pages */
+static int flush_compressed_data(QEMUFile *f)
+{
+    int i, bytes_sent = 0;
+
+    if (!compress_active()) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&comp_done_lock);
+    for (i = 0; i < compress_state.count; i++) {
+        CompressParam *p = &compress_state.params[i];
+
+        while (!p->done) {
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        }
+        bytes_sent += compress_flush_param(f, p);
+    }
+    qemu_mutex_unlock(&comp_done_lock);
+
+    return bytes_sent;
+}
+
+uint64_t compress_mig_pages_transferred(void)
+{
+    return compress_state.pages;
+}
+
+uint64_t compress_mig_bytes_transferred(void)
+{
+    return compress_state.bytes;
+}
+
+uint64_t compress_mig_busy_count(void)
+{
+    return compress_state.busy;
+}
+
+double compress_mig_compression_rate(void)
+{
+    if (!compress_state.pages) {
+        return 0;
+    }
+    return (double)compress_state.bytes /
+           (compress_state.pages * TARGET_PAGE_SIZE);
+}
+
+CompressThreadStatsList *compress_thread_stats(void)
+{
+    CompressThreadStatsList *head = NULL, **tail = &head;
+    CompressParam *params = compress_state.params;
+    bool running = compress_active();
+    int i;
+
+    if (running) {
+        qemu_mutex_lock(&comp_done_lock);
+    }
+    for (i = 0; i < compress_state.count; i++) {
+        CompressThreadStatsList *entry = g_malloc0(sizeof(*entry));
+        CompressThreadStats *stats = g_malloc0(sizeof(*stats));
+        int64_t busy_ms = params[i].busy_ns / 1000000;
+
+        stats->id = params[i].id;
+        stats->pages = params[i].pages;
+        stats->compressed_size = params[i].bytes_out;
+        stats->busy_time = busy_ms;
+        stats->mbps = busy_ms ? ((double)params[i].pages * TARGET_PAGE_SIZE *
+                                 8.0 / 1000.0) / busy_ms : 0;
+        entry->value = stats;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    if (running) {
+        qemu_mutex_unlock(&comp_done_lock);
+    }
+
+    return head;
+}
+
+/*
+ * ram_save_page: Writes the page at @offset in @block to the stream f
+ *
+ * Returns:  The number of bytes written.
+ *           0 means the page was not sent (e.g. unmodified for XBZRLE)
+ */
+
+static int ram_save_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                         bool last_stage)
+{
+    int ret;
+    int bytes_sent;
+    uint8_t *p;
+    ram_addr_t current_addr;
+    bool on_channel = false;
+    int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+
+    p = memory_region_get_ram_ptr(block->mr) + offset;
+
+    /* In doubt sent page as normal */
+    bytes_sent = -1;
+    ret = ram_control_save_page(f, block->offset,
+                       offset, TARGET_PAGE_SIZE, &bytes_sent);
+
+    if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
+        if (ret != RAM_SAVE_CONTROL_DELAYED) {
+            if (bytes_sent > 0) {
+                acct_info.norm_pages++;
+            } else if (bytes_sent == 0) {
+                acct_info.dup_pages++;
+            }
+        }
+    } else if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        acct_info.dup_pages++;
+        bytes_sent = save_block_hdr(f, block, offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+        bytes_sent++;
+    } else if (!ram_bulk_stage && migrate_use_xbzrle() &&
+               !multifd_send_active() && !ram_postcopy_active) {
+        current_addr = block->offset + offset;
+        bytes_sent = save_xbzrle_page(f, p, current_addr, block,
+                                      offset, cont, last_stage);
+        if (!last_stage) {
+            p = get_cached_data(XBZRLE.cache, current_addr);
+        }
+    } else if (compress_active()) {
+        /* The header goes out with the compressed data, later */
+        return compress_page_with_multi_thread(f, block, offset);
+    }
+
+    /* XBZRLE overflow or normal page */
+    if (bytes_sent == -1 && multifd_send_active()) {
+        if (multifd_queue_page(block, offset) < 0) {
+            qemu_file_set_error(f, -EIO);
+        }
+        /* 8 bytes of offset on the channel, headers amortized */
+        bytes_sent = TARGET_PAGE_SIZE + 8;
+        qemu_file_update_transfer(f, bytes_sent);
+        qemu_update_position(f, bytes_sent);
+        acct_info.norm_pages++;
+        on_channel = true;
+    } else if (bytes_sent == -1) {
+        bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+        bytes_sent += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    }
+
+    /* pages sent on a channel leave the main stream untouched */
+    if (bytes_sent > 0 && !on_channel) {
+        last_sent_block = block;
+    }
+
+    return bytes_sent;
+}
+
+/*
+ * Pops the next page requested by the destination, if any, and clears
+ * it from the dirty bitmap: it is sent now whether it is dirty or not,
+ * since the destination is waiting for it.
+ */
+static RAMBlock *unqueue_page(ram_addr_t *offset)
+{
+    RAMSrcPageRequest *entry;
+    RAMBlock *block = NULL;
+    unsigned long nr;
+
+    qemu_mutex_lock(&src_page_req_mutex);
+    while (!block && !QSIMPLEQ_EMPTY(&src_page_requests)) {
+        entry = QSIMPLEQ_FIRST(&src_page_requests);
+
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strcmp(entry->idstr, block->idstr)) {
+                break;
+            }
+        }
+        if (!block || entry->offset >= block->length) {
+            error_report("postcopy: request for unknown page %s:" RAM_ADDR_FMT,
+                         entry->idstr, entry->offset);
+            block = NULL;
+        } else {
+            *offset = entry->offset;
+        }
+
+        entry->offset += TARGET_PAGE_SIZE;
+        entry->len -= MIN(entry->len, TARGET_PAGE_SIZE);
+        if (!block || !entry->len || entry->offset >= block->length) {
+            QSIMPLEQ_REMOVE_HEAD(&src_page_requests, next_req);
+            g_free(entry->idstr);
+            g_free(entry);
+        }
+    }
+    qemu_mutex_unlock(&src_page_req_mutex);
+
+    if (block) {
+        nr = (block->mr->ram_addr + *offset) >> TARGET_PAGE_BITS;
+        if (test_and_clear_bit(nr, migration_bitmap)) {
+            migration_dirty_pages--;
+        }
+    }
+    return block;
+}
+
+void ram_save_queue_pages(const char *idstr, ram_addr_t start, ram_addr_t len)
+{
+    RAMSrcPageRequest *entry;
+
+    trace_ram_save_queue_pages(idstr, start, len);
+
+    if ((start | len) & ~TARGET_PAGE_MASK || !len) {
+        error_report("postcopy: unaligned page request %s:" RAM_ADDR_FMT
+                     "+" RAM_ADDR_FMT, idstr, start, len);
+        return;
+    }
+
+    entry = g_malloc0(sizeof(*entry));
+    entry->idstr = g_strdup(idstr);
+    entry->offset = start;
+    entry->len = len;
+
+    qemu_mutex_lock(&src_page_req_mutex);
+    QSIMPLEQ_INSERT_TAIL(&src_page_requests, entry, next_req);
+    qemu_mutex_unlock(&src_page_req_mutex);
+}
+
+static void flush_page_queue(void)
+{
+    RAMSrcPageRequest *entry;
+
+    if (!src_page_req_mutex_initialized) {
+        return;
+    }
+
+    qemu_mutex_lock(&src_page_req_mutex);
+    while (!QSIMPLEQ_EMPTY(&src_page_requests)) {
+        entry = QSIMPLEQ_FIRST(&src_page_requests);
+        QSIMPLEQ_REMOVE_HEAD(&src_page_requests, next_req);
+        g_free(entry->idstr);
+        g_free(entry);
+    }
+    qemu_mutex_unlock(&src_page_req_mutex);
 }
 
 /*
@@ -455,125 +1736,414 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
     bool complete_round = false;
     int bytes_sent = 0;
     MemoryRegion *mr;
-    ram_addr_t current_addr;
 
-    if (!block)
-        block = QTAILQ_FIRST(&ram_list.blocks);
+    /* Pages the destination is blocked on go first */
+    if (ram_postcopy_active) {
+        RAMBlock *req_block;
+        ram_addr_t req_offset;
+
+        while ((req_block = unqueue_page(&req_offset))) {
+            bytes_sent = ram_save_page(f, req_block, req_offset, last_stage);
+            if (bytes_sent > 0) {
+                return bytes_sent;
+            }
+        }
+    }
+
+    if (!block)
+        block = QTAILQ_FIRST(&ram_list.blocks);
+
+    while (true) {
+        mr = block->mr;
+        offset = migration_bitmap_find_and_reset_dirty(mr, offset);
+        if (complete_round && block == last_seen_block &&
+            offset >= last_offset) {
+            break;
+        }
+        if (offset >= block->length) {
+            offset = 0;
+            block = QTAILQ_NEXT(block, next);
+            if (!block) {
+                block = QTAILQ_FIRST(&ram_list.blocks);
+                complete_round = true;
+                ram_bulk_stage = false;
+            }
+        } else {
+            bytes_sent = ram_save_page(f, block, offset, last_stage);
+
+            /* if page is unmodified, continue to the next */
+            if (bytes_sent > 0) {
+                break;
+            }
+        }
+    }
+    last_seen_block = block;
+    last_offset = offset;
+
+    return bytes_sent;
+}
+
+static uint64_t bytes_transferred;
+
+void acct_update_position(QEMUFile *f, size_t size, bool zero)
+{
+    uint64_t pages = size / TARGET_PAGE_SIZE;
+    if (zero) {
+        acct_info.dup_pages += pages;
+    } else {
+        acct_info.norm_pages += pages;
+        bytes_transferred += size;
+        qemu_update_position(f, size);
+    }
+}
+
+static ram_addr_t ram_save_remaining(void)
+{
+    return migration_dirty_pages;
+}
+
+uint64_t ram_bytes_remaining(void)
+{
+    return ram_save_remaining() * TARGET_PAGE_SIZE;
+}
+
+uint64_t ram_bytes_transferred(void)
+{
+    return bytes_transferred;
+}
+
+uint64_t ram_bytes_total(void)
+{
+    RAMBlock *block;
+    uint64_t total = 0;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next)
+        total += block->length;
+
+    return total;
+}
+
+/* Template file being written by an outgoing "template:" or "file:"
+ * migration, or mapped or read by an incoming one
+ */
+static int ram_template_fd = -1;
+/* The same file opened with O_DIRECT, or -1 */
+static int ram_template_direct_fd = -1;
+/* "-incoming file:" reads the file into RAM instead of mapping it */
+static bool ram_template_read;
+static bool ram_template_loaded;
+
+/* The file is written or read a chunk at a time by several threads, so
+ * that the disk always has a few requests in flight.
+ */
+#define RAM_TEMPLATE_THREADS    4
+#define RAM_TEMPLATE_CHUNK      (1 << 20)
+
+/* Offsets, lengths and buffers must all be aligned for O_DIRECT */
+#define RAM_TEMPLATE_DIRECT_ALIGN   4096
+
+typedef struct RAMTemplateJob {
+    bool is_write;
+    unsigned long next_chunk;       /* atomic */
+    unsigned long nr_chunks;
+    QemuMutex lock;
+    uint64_t bytes;
+    int ret;
+} RAMTemplateJob;
+
+static void ram_template_close(void)
+{
+    if (ram_template_fd >= 0) {
+        qemu_close(ram_template_fd);
+        ram_template_fd = -1;
+    }
+    if (ram_template_direct_fd >= 0) {
+        qemu_close(ram_template_direct_fd);
+        ram_template_direct_fd = -1;
+    }
+}
+
+void ram_template_set_fd(int fd)
+{
+    ram_template_close();
+    ram_template_fd = fd;
+    ram_template_read = false;
+    ram_template_loaded = false;
+}
+
+void ram_file_set_fd(int fd, int direct_fd)
+{
+    ram_template_set_fd(fd);
+    ram_template_direct_fd = direct_fd;
+    ram_template_read = true;
+}
+
+static int ram_template_io(uint8_t *buf, size_t len, off_t offset,
+                           bool is_write)
+{
+#ifdef _WIN32
+    return -ENOTSUP;
+#else
+    ssize_t ret;
+    int fd;
+
+    while (len) {
+        fd = ram_template_fd;
+        if (ram_template_direct_fd >= 0 &&
+            !(((uintptr_t)buf | len | offset) &
+              (RAM_TEMPLATE_DIRECT_ALIGN - 1))) {
+            fd = ram_template_direct_fd;
+        }
+        if (is_write) {
+            ret = pwrite(fd, buf, len, offset);
+        } else {
+            ret = pread(fd, buf, len, offset);
+        }
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return ret < 0 ? -errno : -EIO;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+#endif
+}
+
+/* Zero pages are left as holes, so the file is sparse and clones read
+ * them back as zeroes.
+ */
+static int ram_template_save_range(RAMBlock *block, ram_addr_t offset,
+                                   ram_addr_t end, uint64_t *bytes)
+{
+    ram_addr_t start;
+    int ret;
+
+    while (offset < end) {
+        while (offset < end &&
+               is_zero_range(block->host + offset, TARGET_PAGE_SIZE)) {
+            offset += TARGET_PAGE_SIZE;
+        }
+        start = offset;
+        while (offset < end &&
+               !is_zero_range(block->host + offset, TARGET_PAGE_SIZE)) {
+            offset += TARGET_PAGE_SIZE;
+        }
+        if (offset == start) {
+            continue;
+        }
+        ret = ram_template_io(block->host + start, offset - start,
+                              block->offset + start, true);
+        if (ret < 0) {
+            return ret;
+        }
+        *bytes += offset - start;
+    }
+    return 0;
+}
+
+/* Holes are only looked up, not read.  Fresh RAM is already zero, except
+ * for what was loaded at startup, like option ROMs.
+ */
+static int ram_template_load_range(RAMBlock *block, ram_addr_t offset,
+                                   ram_addr_t end, uint64_t *bytes)
+{
+    off_t data, hole;
+    int ret;
 
-    while (true) {
-        mr = block->mr;
-        offset = migration_bitmap_find_and_reset_dirty(mr, offset);
-        if (complete_round && block == last_seen_block &&
-            offset >= last_offset) {
-            break;
-        }
-        if (offset >= block->length) {
-            offset = 0;
-            block = QTAILQ_NEXT(block, next);
-            if (!block) {
-                block = QTAILQ_FIRST(&ram_list.blocks);
-                complete_round = true;
-                ram_bulk_stage = false;
-            }
+    while (offset < end) {
+        data = block->offset + offset;
+        hole = block->offset + end;
+#ifdef SEEK_DATA
+        data = lseek(ram_template_fd, data, SEEK_DATA);
+        if (data < 0) {
+            /* ENXIO means there is only a hole up to the end of the file */
+            data = errno == ENXIO ? block->offset + end
+                                  : block->offset + offset;
         } else {
-            int ret;
-            uint8_t *p;
-            int cont = (block == last_sent_block) ?
-                RAM_SAVE_FLAG_CONTINUE : 0;
-
-            p = memory_region_get_ram_ptr(mr) + offset;
-
-            /* In doubt sent page as normal */
-            bytes_sent = -1;
-            ret = ram_control_save_page(f, block->offset,
-                               offset, TARGET_PAGE_SIZE, &bytes_sent);
-
-            if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
-                if (ret != RAM_SAVE_CONTROL_DELAYED) {
-                    if (bytes_sent > 0) {
-                        acct_info.norm_pages++;
-                    } else if (bytes_sent == 0) {
-                        acct_info.dup_pages++;
-                    }
-                }
-            } else if (is_zero_range(p, TARGET_PAGE_SIZE)) {
-                acct_info.dup_pages++;
-                bytes_sent = save_block_hdr(f, block, offset, cont,
-                                            RAM_SAVE_FLAG_COMPRESS);
-                qemu_put_byte(f, 0);
-                bytes_sent++;
-            } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
-                current_addr = block->offset + offset;
-                bytes_sent = save_xbzrle_page(f, p, current_addr, block,
-                                              offset, cont, last_stage);
-                if (!last_stage) {
-                    p = get_cached_data(XBZRLE.cache, current_addr);
-                }
+            hole = lseek(ram_template_fd, data, SEEK_HOLE);
+            if (hole < 0) {
+                hole = block->offset + end;
             }
+        }
+        data = MIN(MAX(QEMU_ALIGN_DOWN(data, TARGET_PAGE_SIZE),
+                       block->offset + offset), block->offset + end);
+        hole = MIN(QEMU_ALIGN_UP(hole, TARGET_PAGE_SIZE), block->offset + end);
+#endif
+        if (data > block->offset + offset) {
+            ram_handle_compressed(block->host + offset, 0,
+                                  data - block->offset - offset);
+        }
+        offset = data - block->offset;
+        if (offset == end) {
+            break;
+        }
 
-            /* XBZRLE overflow or normal page */
-            if (bytes_sent == -1) {
-                bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
-                bytes_sent += TARGET_PAGE_SIZE;
-                acct_info.norm_pages++;
-            }
+        ret = ram_template_io(block->host + offset, hole - data, data, false);
+        if (ret < 0) {
+            return ret;
+        }
+        *bytes += hole - data;
+        offset = hole - block->offset;
+    }
+    return 0;
+}
 
-            /* if page is unmodified, continue to the next */
-            if (bytes_sent > 0) {
-                last_sent_block = block;
+static void *ram_template_thread(void *opaque)
+{
+    RAMTemplateJob *job = opaque;
+    RAMBlock *block;
+    ram_addr_t start, end, first, last;
+    unsigned long chunk;
+    uint64_t bytes = 0;
+    int ret = 0;
+
+    while (ret == 0 &&
+           (chunk = atomic_fetch_inc(&job->next_chunk)) < job->nr_chunks) {
+        start = (ram_addr_t)chunk * RAM_TEMPLATE_CHUNK;
+        end = start + RAM_TEMPLATE_CHUNK;
+
+        /* A chunk may span the end of a block and the gap after it */
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            first = MAX(start, block->offset);
+            last = MIN(end, block->offset + block->length);
+            if (first >= last) {
+                continue;
+            }
+            if (job->is_write) {
+                ret = ram_template_save_range(block, first - block->offset,
+                                              last - block->offset, &bytes);
+            } else {
+                ret = ram_template_load_range(block, first - block->offset,
+                                              last - block->offset, &bytes);
+            }
+            if (ret < 0) {
                 break;
             }
         }
     }
-    last_seen_block = block;
-    last_offset = offset;
 
-    return bytes_sent;
+    qemu_mutex_lock(&job->lock);
+    job->bytes += bytes;
+    if (ret < 0 && job->ret == 0) {
+        job->ret = ret;
+        /* Make the other threads stop after their current chunk */
+        atomic_set(&job->next_chunk, job->nr_chunks);
+    }
+    qemu_mutex_unlock(&job->lock);
+    return NULL;
 }
 
-static uint64_t bytes_transferred;
-
-void acct_update_position(QEMUFile *f, size_t size, bool zero)
+/* Write or read every block at its ram_addr_t offset.  Called with the
+ * guest stopped and the ramlist lock held, so the blocks do not change.
+ */
+static int ram_template_run(bool is_write, uint64_t *bytes)
 {
-    uint64_t pages = size / TARGET_PAGE_SIZE;
-    if (zero) {
-        acct_info.dup_pages += pages;
-    } else {
-        acct_info.norm_pages += pages;
-        bytes_transferred += size;
-        qemu_update_position(f, size);
+    QemuThread threads[RAM_TEMPLATE_THREADS];
+    RAMTemplateJob job = {
+        .is_write = is_write,
+        .nr_chunks = DIV_ROUND_UP(last_ram_offset(), RAM_TEMPLATE_CHUNK),
+    };
+    int i;
+
+    qemu_mutex_init(&job.lock);
+    for (i = 0; i < RAM_TEMPLATE_THREADS; i++) {
+        qemu_thread_create(&threads[i], ram_template_thread, &job,
+                           QEMU_THREAD_JOINABLE);
     }
-}
+    for (i = 0; i < RAM_TEMPLATE_THREADS; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    qemu_mutex_destroy(&job.lock);
 
-static ram_addr_t ram_save_remaining(void)
-{
-    return migration_dirty_pages;
+    *bytes = job.bytes;
+    return job.ret;
 }
 
-uint64_t ram_bytes_remaining(void)
+static int ram_save_template(void)
 {
-    return ram_save_remaining() * TARGET_PAGE_SIZE;
+    uint64_t bytes;
+    int ret;
+
+    if (ftruncate(ram_template_fd, last_ram_offset()) < 0) {
+        return -errno;
+    }
+
+    ret = ram_template_run(true, &bytes);
+    bytes_transferred += bytes;
+    if (ret == 0 && qemu_fdatasync(ram_template_fd) < 0) {
+        ret = -errno;
+    }
+    return ret;
 }
 
-uint64_t ram_bytes_transferred(void)
+static int ram_load_file(void)
 {
-    return bytes_transferred;
+#ifdef _WIN32
+    return -ENOTSUP;
+#else
+    struct stat st;
+    uint64_t bytes;
+    int ret;
+
+    if (fstat(ram_template_fd, &st) < 0) {
+        return -errno;
+    }
+    if (st.st_size < last_ram_offset()) {
+        error_report("RAM file too small for the guest RAM");
+        return -EINVAL;
+    }
+
+    ret = ram_template_run(false, &bytes);
+    if (ret < 0) {
+        error_report("cannot read guest RAM from file: %s", strerror(-ret));
+    }
+    return ret;
+#endif
 }
 
-uint64_t ram_bytes_total(void)
+static int ram_load_template(RAMBlock *block)
 {
-    RAMBlock *block;
-    uint64_t total = 0;
+#ifdef _WIN32
+    return -ENOTSUP;
+#else
+    struct stat st;
+    int ret;
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next)
-        total += block->length;
+    if (fstat(ram_template_fd, &st) < 0) {
+        return -errno;
+    }
+    /* Pages past the end of the file would fault with SIGBUS */
+    if (st.st_size < block->offset + block->length) {
+        error_report("template file too small for RAM block %s",
+                     block->idstr);
+        return -EINVAL;
+    }
 
-    return total;
+    ret = qemu_ram_map_template(block, ram_template_fd);
+    if (ret < 0) {
+        error_report("cannot map RAM block %s from the template file: %s",
+                     block->idstr, strerror(-ret));
+    }
+    return ret;
+#endif
 }
 
 static void migration_end(void)
 {
+    multifd_save_cleanup();
+    compress_threads_save_cleanup();
+    flush_page_queue();
+    ram_postcopy_active = false;
+    migration_bitmap_hinted = false;
+    atomic_set(&free_page_hint_gen, 0);
+    notifier_list_notify(&ram_bitmap_sync_notifiers, NULL);
+
+    ram_template_close();
+
     if (migration_bitmap) {
         memory_global_dirty_log_stop();
         g_free(migration_bitmap);
@@ -581,6 +2151,7 @@ static void migration_end(void)
     }
 
     if (XBZRLE.cache) {
+        cache_get_stats(XBZRLE.cache, &XBZRLE.stats);
         cache_fini(XBZRLE.cache);
         g_free(XBZRLE.cache);
         g_free(XBZRLE.encoded_buf);
@@ -590,6 +2161,53 @@ static void migration_end(void)
     }
 }
 
+/*
+ * Switching to postcopy: tell the destination to drop every page that is
+ * dirty now, so that it faults on them instead of using a stale copy.
+ * Needs the iothread lock, with the guest stopped.
+ */
+int ram_postcopy_send_discard_bitmap(QEMUFile *f)
+{
+    RAMBlock *block;
+    uint64_t starts[64], lengths[64];
+    int n;
+
+    trace_ram_postcopy_send_discard_bitmap();
+
+    qemu_mutex_lock_ramlist();
+    migration_bitmap_sync();
+    /* From here on only dirty (or requested) pages are sent */
+    ram_bulk_stage = false;
+    ram_postcopy_active = true;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        unsigned long base = block->mr->ram_addr >> TARGET_PAGE_BITS;
+        unsigned long end = base + (block->length >> TARGET_PAGE_BITS);
+        unsigned long run_start, run_end;
+
+        n = 0;
+        run_start = find_next_bit(migration_bitmap, end, base);
+        while (run_start < end) {
+            run_end = find_next_zero_bit(migration_bitmap, end, run_start);
+            starts[n] = (uint64_t)(run_start - base) << TARGET_PAGE_BITS;
+            lengths[n] = (uint64_t)(run_end - run_start) << TARGET_PAGE_BITS;
+            if (++n == ARRAY_SIZE(starts)) {
+                qemu_savevm_send_postcopy_ram_discard(f, block->idstr, n,
+                                                      starts, lengths);
+                n = 0;
+            }
+            run_start = find_next_bit(migration_bitmap, end, run_end);
+        }
+        if (n) {
+            qemu_savevm_send_postcopy_ram_discard(f, block->idstr, n,
+                                                  starts, lengths);
+        }
+    }
+    qemu_mutex_unlock_ramlist();
+
+    return qemu_file_get_error(f);
+}
+
 static void ram_migration_cancel(void *opaque)
 {
     migration_end();
@@ -611,11 +2229,25 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     RAMBlock *block;
     int64_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
 
+    /* Both need the global dirty log, and stopping it is not counted */
+    if (dirty_rate_measuring()) {
+        error_report("migration: a dirty rate measurement is in progress");
+        return -1;
+    }
+
     migration_bitmap = bitmap_new(ram_pages);
     bitmap_set(migration_bitmap, 0, ram_pages);
     migration_dirty_pages = ram_pages;
     mig_throttle_on = false;
+    mig_throttle_pct = MIG_THROTTLE_PCT;
     dirty_rate_high_cnt = 0;
+    ram_postcopy_active = false;
+    /* The return path thread may outlive migration_end, never destroy it */
+    if (!src_page_req_mutex_initialized) {
+        qemu_mutex_init(&src_page_req_mutex);
+        src_page_req_mutex_initialized = true;
+    }
+    flush_page_queue();
 
     if (migrate_use_xbzrle()) {
         XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
@@ -627,6 +2259,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         }
         XBZRLE.encoded_buf = g_malloc0(TARGET_PAGE_SIZE);
         XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
+        XBZRLE.resize_pages = 0;
         acct_clear();
     }
 
@@ -646,12 +2279,20 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->length);
     }
+    if (ram_template_fd >= 0) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_TEMPLATE);
+    }
 
     qemu_mutex_unlock_ramlist();
 
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
     ram_control_after_iterate(f, RAM_CONTROL_SETUP);
 
+    multifd_save_setup();
+    if (compress_threads_save_setup() < 0) {
+        return -1;
+    }
+
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
     return 0;
@@ -664,6 +2305,16 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     int64_t t0;
     int total_sent = 0;
 
+    /* Everything is written at once, with the guest stopped */
+    if (ram_template_fd >= 0) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return 0;
+    }
+
+    if (XBZRLE.cache) {
+        xbzrle_cache_apply_resize();
+    }
+
     qemu_mutex_lock_ramlist();
 
     if (ram_list.version != last_version) {
@@ -701,6 +2352,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
 
+    total_sent += flush_compressed_data(f);
     qemu_mutex_unlock_ramlist();
 
     /*
@@ -709,6 +2361,12 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
      */
     ram_control_after_iterate(f, RAM_CONTROL_ROUND);
 
+    ret = multifd_send_sync_main(f);
+    if (ret < 0) {
+        return ret;
+    }
+    bytes_transferred += ret;
+
     bytes_transferred += total_sent;
 
     /*
@@ -728,6 +2386,17 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
+    int ret;
+
+    if (ram_template_fd >= 0) {
+        qemu_mutex_lock_ramlist();
+        ret = ram_save_template();
+        migration_end();
+        qemu_mutex_unlock_ramlist();
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return ret;
+    }
+
     qemu_mutex_lock_ramlist();
     migration_bitmap_sync();
 
@@ -747,7 +2416,9 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         bytes_transferred += bytes_sent;
     }
 
+    bytes_transferred += flush_compressed_data(f);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+    multifd_send_sync_main(f);
     migration_end();
 
     qemu_mutex_unlock_ramlist();
@@ -760,6 +2431,10 @@ static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
 {
     uint64_t remaining_size;
 
+    if (ram_template_fd >= 0) {
+        return 0;
+    }
+
     remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
 
     if (remaining_size < max_size) {
@@ -853,12 +2528,189 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
     }
 }
 
+/* Receiving side of the compress capability: the threads inflate straight
+ * into guest memory.  They are started on the first compressed page and
+ * drained at each RAM_SAVE_FLAG_EOS, before anything else can touch a page
+ * they may still be writing.
+ */
+typedef struct DecompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* protected by mutex */
+    bool start;
+    bool quit;
+    /* protected by decomp_done_lock */
+    bool done;
+    int error;
+    z_stream stream;
+    uint8_t *compbuf;
+    int len;
+    void *des;
+} DecompressParam;
+
+static DecompressParam *decomp_params;
+static int decomp_count;
+static QemuMutex decomp_done_lock;
+static QemuCond decomp_done_cond;
+
+static void *do_data_decompress(void *opaque)
+{
+    DecompressParam *param = opaque;
+    int ret;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (!param->start) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+            continue;
+        }
+        param->start = false;
+        qemu_mutex_unlock(&param->mutex);
+
+        inflateReset(&param->stream);
+        param->stream.next_in = param->compbuf;
+        param->stream.avail_in = param->len;
+        param->stream.next_out = param->des;
+        param->stream.avail_out = TARGET_PAGE_SIZE;
+        ret = inflate(&param->stream, Z_FINISH);
+
+        qemu_mutex_lock(&decomp_done_lock);
+        if (ret != Z_STREAM_END || param->stream.avail_out) {
+            param->error = -EINVAL;
+        }
+        param->done = true;
+        qemu_cond_signal(&decomp_done_cond);
+        qemu_mutex_unlock(&decomp_done_lock);
+
+        qemu_mutex_lock(&param->mutex);
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static int decompress_threads_setup(void)
+{
+    int i, count = migrate_decompress_threads();
+
+    decomp_params = g_new0(DecompressParam, count);
+    qemu_mutex_init(&decomp_done_lock);
+    qemu_cond_init(&decomp_done_cond);
+    for (i = 0; i < count; i++) {
+        DecompressParam *p = &decomp_params[i];
+
+        if (inflateInit(&p->stream) != Z_OK) {
+            decomp_count = i;
+            decompress_threads_cleanup();
+            return -1;
+        }
+        p->done = true;
+        p->compbuf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        qemu_mutex_init(&p->mutex);
+        qemu_cond_init(&p->cond);
+        qemu_thread_create(&p->thread, do_data_decompress, p,
+                           QEMU_THREAD_JOINABLE);
+        decomp_count = i + 1;
+    }
+    return 0;
+}
+
+void decompress_threads_cleanup(void)
+{
+    int i;
+
+    if (!decomp_params) {
+        return;
+    }
+
+    for (i = 0; i < decomp_count; i++) {
+        DecompressParam *p = &decomp_params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_cond_signal(&p->cond);
+        qemu_mutex_unlock(&p->mutex);
+        qemu_thread_join(&p->thread);
+
+        qemu_mutex_destroy(&p->mutex);
+        qemu_cond_destroy(&p->cond);
+        inflateEnd(&p->stream);
+        g_free(p->compbuf);
+    }
+    qemu_mutex_destroy(&decomp_done_lock);
+    qemu_cond_destroy(&decomp_done_cond);
+    g_free(decomp_params);
+    decomp_params = NULL;
+    decomp_count = 0;
+}
+
+static int decompress_data_with_multi_threads(QEMUFile *f, void *host,
+                                              int len)
+{
+    int i;
+
+    if (!decomp_params && decompress_threads_setup() < 0) {
+        return -EINVAL;
+    }
+
+    qemu_mutex_lock(&decomp_done_lock);
+    while (true) {
+        for (i = 0; i < decomp_count; i++) {
+            DecompressParam *p = &decomp_params[i];
+
+            if (p->done) {
+                p->done = false;
+                qemu_get_buffer(f, p->compbuf, len);
+                p->des = host;
+                p->len = len;
+
+                qemu_mutex_lock(&p->mutex);
+                p->start = true;
+                qemu_cond_signal(&p->cond);
+                qemu_mutex_unlock(&p->mutex);
+                qemu_mutex_unlock(&decomp_done_lock);
+                return 0;
+            }
+        }
+        qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+    }
+}
+
+static int wait_for_decompress_done(void)
+{
+    int i, ret = 0;
+
+    if (!decomp_params) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&decomp_done_lock);
+    for (i = 0; i < decomp_count; i++) {
+        DecompressParam *p = &decomp_params[i];
+
+        while (!p->done) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+        if (p->error) {
+            ret = p->error;
+            p->error = 0;
+        }
+    }
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    return ret;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
     int flags, ret = 0;
     int error;
     static uint64_t seq_iter;
+    /* With postcopy, pages must be placed atomically: the guest runs */
+    bool postcopy = postcopy_ram_incoming_active();
+    static uint8_t *postcopy_buf;
 
     seq_iter++;
 
@@ -909,8 +2761,37 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                         goto done;
                     }
 
+                    if (ram_template_fd >= 0 && !ram_template_read) {
+                        ret = ram_load_template(block);
+                        if (ret < 0) {
+                            goto done;
+                        }
+                    }
+
                     total_ram_bytes -= length;
                 }
+
+                if (ram_template_fd >= 0 && ram_template_read) {
+                    ret = ram_load_file();
+                    if (ret < 0) {
+                        goto done;
+                    }
+                }
+
+                /* The mappings stay after the file is closed */
+                if (ram_template_fd >= 0) {
+                    ram_template_close();
+                    ram_template_loaded = true;
+                }
+            }
+        }
+
+        if (flags & RAM_SAVE_FLAG_TEMPLATE) {
+            if (!ram_template_loaded) {
+                error_report("guest RAM was saved to a separate file, "
+                             "load it with -incoming file: or template:");
+                ret = -EINVAL;
+                goto done;
             }
         }
 
@@ -924,7 +2805,21 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
 
             ch = qemu_get_byte(f);
-            ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            if (!postcopy) {
+                ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            } else if (ch == 0) {
+                ret = postcopy_place_page_zero(host);
+            } else {
+                if (!postcopy_buf) {
+                    postcopy_buf = qemu_memalign(TARGET_PAGE_SIZE,
+                                                 TARGET_PAGE_SIZE);
+                }
+                memset(postcopy_buf, ch, TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(host, postcopy_buf);
+            }
+            if (ret < 0) {
+                goto done;
+            }
         } else if (flags & RAM_SAVE_FLAG_PAGE) {
             void *host;
 
@@ -933,19 +2828,60 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 return -EINVAL;
             }
 
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            if (!postcopy) {
+                qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            } else {
+                if (!postcopy_buf) {
+                    postcopy_buf = qemu_memalign(TARGET_PAGE_SIZE,
+                                                 TARGET_PAGE_SIZE);
+                }
+                qemu_get_buffer(f, postcopy_buf, TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(host, postcopy_buf);
+                if (ret < 0) {
+                    goto done;
+                }
+            }
         } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
             void *host = host_from_stream_offset(f, addr, flags);
             if (!host) {
                 return -EINVAL;
             }
 
+            if (postcopy) {
+                fprintf(stderr, "XBZRLE page received during postcopy\n");
+                ret = -EINVAL;
+                goto done;
+            }
+
             if (load_xbzrle(f, addr, host) < 0) {
                 ret = -EINVAL;
                 goto done;
             }
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host = host_from_stream_offset(f, addr, flags);
+            int len;
+
+            if (!host) {
+                return -EINVAL;
+            }
+
+            len = qemu_get_be32(f);
+            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE) || postcopy) {
+                fprintf(stderr, "Invalid compressed page, length %d\n", len);
+                ret = -EINVAL;
+                goto done;
+            }
+            ret = decompress_data_with_multi_threads(f, host, len);
+            if (ret < 0) {
+                goto done;
+            }
         } else if (flags & RAM_SAVE_FLAG_HOOK) {
             ram_control_load_hook(f, flags);
+        } else if (flags & RAM_SAVE_FLAG_MULTIFD_SYNC) {
+            ret = multifd_recv_sync_main();
+            if (ret < 0) {
+                goto done;
+            }
         }
         error = qemu_file_get_error(f);
         if (error) {
@@ -954,6 +2890,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
+    ret = wait_for_decompress_done();
+
 done:
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
@@ -1180,10 +3118,16 @@ TargetInfo *qmp_query_target(Error **errp)
 static void mig_sleep_cpu(void *opq)
 {
     qemu_mutex_unlock_iothread();
-    g_usleep(30*1000);
+    g_usleep(atomic_read(&mig_throttle_pct) * 40 * 1000 / 100);
     qemu_mutex_lock_iothread();
 }
 
+void ram_set_throttle(int pct)
+{
+    atomic_set(&mig_throttle_pct, pct);
+    mig_throttle_on = pct > 0;
+}
+
 /* To reduce the dirty rate explicitly disallow the VCPUs from spending
    much time in the VM. The migration thread will try to catchup.
    Workload will experience a performance drop.
@@ -28,6 +28,17 @@
 #define AUDIO_CAP "mixeng"
 #include "audio_int.h"
 
+/* The conversion loops walk struct st_sample arrays as flat arrays of
+ * l, r values.  Plain indexed loops like that are what the compiler's
+ * vectorizer handles.
+ */
+#ifdef FLOAT_MIXENG
+typedef mixeng_real mixeng_value;
+#else
+typedef int64_t mixeng_value;
+#endif
+QEMU_BUILD_BUG_ON(sizeof(struct st_sample) != 2 * sizeof(mixeng_value));
+
 /* 8 bit */
 #define ENDIAN_CONVERSION natural
 #define ENDIAN_CONVERT(v) (v)
@@ -353,6 +364,11 @@ void mixeng_volume (struct st_sample *buf, int len, struct mixeng_volume *vol)
         return;
     }
 
+    /* Guests usually leave the volume at the maximum; skip the multiply */
+    if (vol->l == nominal_volume.l && vol->r == nominal_volume.r) {
+        return;
+    }
+
     while (len--) {
 #ifdef FLOAT_MIXENG
         buf->l = buf->l * vol->l;
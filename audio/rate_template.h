@@ -49,10 +49,11 @@ void NAME (void *opaque, struct st_sample *ibuf, struct st_sample *obuf,
     oend = obuf + *osamp;
 
     if (rate->opos_inc == (1ULL + UINT_MAX)) {
+        mixeng_value *in = (mixeng_value *) ibuf;
+        mixeng_value *out = (mixeng_value *) obuf;
         int i, n = *isamp > *osamp ? *osamp : *isamp;
-        for (i = 0; i < n; i++) {
-            OP (obuf[i].l, ibuf[i].l);
-            OP (obuf[i].r, ibuf[i].r);
+        for (i = 0; i < n * 2; i++) {
+            OP (out[i], in[i]);
         }
         *isamp = n;
         *osamp = n;
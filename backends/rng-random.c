@@ -69,6 +69,16 @@ static void rng_random_request_entropy(RngBackend *b, size_t size,
     qemu_set_fd_handler(s->fd, entropy_available, NULL, s);
 }
 
+static void rng_random_cancel_requests(RngBackend *b)
+{
+    RndRandom *s = RNG_RANDOM(b);
+
+    if (s->receive_func) {
+        s->receive_func = NULL;
+        qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+    }
+}
+
 static void rng_random_opened(RngBackend *b, Error **errp)
 {
     RndRandom *s = RNG_RANDOM(b);
@@ -143,6 +153,7 @@ static void rng_random_class_init(ObjectClass *klass, void *data)
     RngBackendClass *rbc = RNG_BACKEND_CLASS(klass);
 
     rbc->request_entropy = rng_random_request_entropy;
+    rbc->cancel_requests = rng_random_cancel_requests;
     rbc->opened = rng_random_opened;
 }
 
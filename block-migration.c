@@ -33,6 +33,9 @@
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
+/* Reads kept in flight, at least, however low the speed limit */
+#define BLK_MIG_MIN_INFLIGHT    16
+
 //#define DEBUG_BLK_MIGRATION
 
 #ifdef DEBUG_BLK_MIGRATION
@@ -70,6 +73,8 @@ typedef struct BlkMigBlock {
     struct iovec iov;
     QEMUIOVector qiov;
     BlockDriverAIOCB *aiocb;
+    /* Reads as zeroes, was not read from the device */
+    bool zero;
 
     /* Protected by block migration lock.  */
     int ret;
@@ -120,7 +125,7 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
     uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
 
     if (block_mig_state.zero_blocks &&
-        buffer_is_zero(blk->buf, BLOCK_SIZE)) {
+        (blk->zero || buffer_is_zero(blk->buf, BLOCK_SIZE))) {
         flags |= BLK_MIG_FLAG_ZERO_BLOCK;
     }
 
@@ -255,7 +260,8 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
     int64_t cur_sector = bmds->cur_sector;
     BlockDriverState *bs = bmds->bs;
     BlkMigBlock *blk;
-    int nr_sectors;
+    int nr_sectors, pnum;
+    int64_t status;
 
     if (bmds->shared_base) {
         qemu_mutex_lock_iothread();
@@ -283,25 +289,42 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
         nr_sectors = total_sectors - cur_sector;
     }
 
-    blk = g_malloc(sizeof(BlkMigBlock));
-    blk->buf = g_malloc(BLOCK_SIZE);
+    blk = g_new0(BlkMigBlock, 1);
     blk->bmds = bmds;
     blk->sector = cur_sector;
     blk->nr_sectors = nr_sectors;
 
-    blk->iov.iov_base = blk->buf;
-    blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+    qemu_mutex_lock_iothread();
 
-    blk_mig_lock();
-    block_mig_state.submitted++;
-    blk_mig_unlock();
+    /* Chunks that read as zeroes, such as unallocated ranges without a
+     * backing file, are not read.  With the zero-blocks capability they
+     * are not even sent, only their header is.
+     */
+    status = bdrv_get_block_status(bs, cur_sector, nr_sectors, &pnum);
+    if (status >= 0 && (status & BDRV_BLOCK_ZERO) && pnum >= nr_sectors) {
+        blk->zero = true;
+        if (!block_mig_state.zero_blocks) {
+            blk->buf = g_malloc0(BLOCK_SIZE);
+        }
+        blk_mig_lock();
+        QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
+        block_mig_state.read_done++;
+        blk_mig_unlock();
+    } else {
+        blk->buf = g_malloc(BLOCK_SIZE);
+        blk->iov.iov_base = blk->buf;
+        blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
 
-    qemu_mutex_lock_iothread();
-    blk->aiocb = bdrv_aio_readv(bs, cur_sector, &blk->qiov,
-                                nr_sectors, blk_mig_read_cb, blk);
+        blk_mig_lock();
+        block_mig_state.submitted++;
+        blk_mig_unlock();
+
+        blk->aiocb = bdrv_aio_readv(bs, cur_sector, &blk->qiov,
+                                    nr_sectors, blk_mig_read_cb, blk);
+    }
 
-    bdrv_reset_dirty(bs, cur_sector, nr_sectors);
+    bdrv_reset_dirty_bitmap(bs, bmds->dirty_bitmap, cur_sector, nr_sectors);
     qemu_mutex_unlock_iothread();
 
     bmds->cur_sector = cur_sector + nr_sectors;
@@ -315,7 +338,8 @@ static void set_dirty_tracking(void)
     BlkMigDevState *bmds;
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
-        bmds->dirty_bitmap = bdrv_create_dirty_bitmap(bmds->bs, BLOCK_SIZE);
+        bmds->dirty_bitmap = bdrv_create_dirty_bitmap(bmds->bs, BLOCK_SIZE,
+                                                      NULL, NULL);
     }
 }
 
@@ -375,7 +399,11 @@ static void init_blk_migration(QEMUFile *f)
     bdrv_iterate(init_blk_migration_it, NULL);
 }
 
-/* Called with no lock taken.  */
+/* Called with no lock taken.
+ *
+ * Submits one chunk for each device that is still in the bulk phase, so
+ * that the devices are read in parallel.
+ */
 
 static int blk_mig_save_bulked_block(QEMUFile *f)
 {
@@ -389,13 +417,11 @@ static int blk_mig_save_bulked_block(QEMUFile *f)
             if (mig_save_device_bulk(f, bmds) == 1) {
                 /* completed bulk section for this device */
                 bmds->bulk_completed = 1;
+            } else {
+                ret = 1;
             }
-            completed_sector_sum += bmds->completed_sectors;
-            ret = 1;
-            break;
-        } else {
-            completed_sector_sum += bmds->completed_sectors;
         }
+        completed_sector_sum += bmds->completed_sectors;
     }
 
     if (block_mig_state.total_sector_sum != 0) {
@@ -434,58 +460,61 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
     int nr_sectors;
     int ret = -EIO;
 
-    for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
-        blk_mig_lock();
-        if (bmds_aio_inflight(bmds, sector)) {
-            blk_mig_unlock();
-            bdrv_drain_all();
-        } else {
-            blk_mig_unlock();
-        }
-        if (bdrv_get_dirty(bmds->bs, bmds->dirty_bitmap, sector)) {
+    /* Skip clean chunks with the bitmap's iterator instead of testing
+     * each of them.
+     */
+    sector = bdrv_get_next_dirty(bmds->bs, bmds->dirty_bitmap,
+                                 bmds->cur_dirty);
+    if (sector < 0 || sector >= total_sectors) {
+        bmds->cur_dirty = total_sectors;
+        return 1;
+    }
+    bmds->cur_dirty = sector;
 
-            if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-                nr_sectors = total_sectors - sector;
-            } else {
-                nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
-            }
-            blk = g_malloc(sizeof(BlkMigBlock));
-            blk->buf = g_malloc(BLOCK_SIZE);
-            blk->bmds = bmds;
-            blk->sector = sector;
-            blk->nr_sectors = nr_sectors;
-
-            if (is_async) {
-                blk->iov.iov_base = blk->buf;
-                blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-                qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-                blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
-                                            nr_sectors, blk_mig_read_cb, blk);
-
-                blk_mig_lock();
-                block_mig_state.submitted++;
-                bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
-                blk_mig_unlock();
-            } else {
-                ret = bdrv_read(bmds->bs, sector, blk->buf, nr_sectors);
-                if (ret < 0) {
-                    goto error;
-                }
-                blk_send(f, blk);
+    blk_mig_lock();
+    if (bmds_aio_inflight(bmds, sector)) {
+        blk_mig_unlock();
+        bdrv_drain_all();
+    } else {
+        blk_mig_unlock();
+    }
 
-                g_free(blk->buf);
-                g_free(blk);
-            }
+    if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
+        nr_sectors = total_sectors - sector;
+    } else {
+        nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+    }
+    blk = g_new0(BlkMigBlock, 1);
+    blk->buf = g_malloc(BLOCK_SIZE);
+    blk->bmds = bmds;
+    blk->sector = sector;
+    blk->nr_sectors = nr_sectors;
 
-            bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
-            break;
+    if (is_async) {
+        blk->iov.iov_base = blk->buf;
+        blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+
+        blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
+                                    nr_sectors, blk_mig_read_cb, blk);
+
+        blk_mig_lock();
+        block_mig_state.submitted++;
+        bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
+        blk_mig_unlock();
+    } else {
+        ret = bdrv_read(bmds->bs, sector, blk->buf, nr_sectors);
+        if (ret < 0) {
+            goto error;
         }
-        sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
-        bmds->cur_dirty = sector;
+        blk_send(f, blk);
+
+        g_free(blk->buf);
+        g_free(blk);
     }
 
-    return (bmds->cur_dirty >= bmds->total_sectors);
+    bdrv_reset_dirty_bitmap(bmds->bs, bmds->dirty_bitmap, sector, nr_sectors);
+    return 0;
 
 error:
     DPRINTF("Error reading sector %" PRId64 "\n", sector);
@@ -515,10 +544,14 @@ static int blk_mig_save_dirty_block(QEMUFile *f, int is_async)
     return ret;
 }
 
-/* Called with no locks taken.  */
+/* Called with no locks taken.
+ *
+ * Sends the chunks that were read, up to budget bytes.
+ */
 
-static int flush_blks(QEMUFile *f)
+static int flush_blks(QEMUFile *f, int64_t budget)
 {
+    int64_t start = qemu_ftell(f);
     BlkMigBlock *blk;
     int ret = 0;
 
@@ -528,7 +561,7 @@ static int flush_blks(QEMUFile *f)
 
     blk_mig_lock();
     while ((blk = QSIMPLEQ_FIRST(&block_mig_state.blk_list)) != NULL) {
-        if (qemu_file_rate_limit(f)) {
+        if (qemu_file_rate_limit(f) || qemu_ftell(f) - start >= budget) {
             break;
         }
         if (blk->ret < 0) {
@@ -617,7 +650,7 @@ static int block_save_setup(QEMUFile *f, void *opaque)
     set_dirty_tracking();
     qemu_mutex_unlock_iothread();
 
-    ret = flush_blks(f);
+    ret = flush_blks(f, INT64_MAX);
     blk_mig_reset_dirty_cursor();
     qemu_put_be64(f, BLK_MIG_FLAG_EOS);
 
@@ -628,22 +661,30 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
 {
     int ret;
     int64_t last_ftell = qemu_ftell(f);
+    /* Block data is iterated before RAM.  Leave half of each rate limit
+     * window to RAM, or a large disk starves the RAM pages; block gets
+     * the rest too when RAM does not use it, as iterate is called again.
+     */
+    int64_t budget = MAX(qemu_file_get_rate_limit(f) / 2, BLOCK_SIZE);
+    int64_t inflight = MAX(qemu_file_get_rate_limit(f),
+                           BLK_MIG_MIN_INFLIGHT * BLOCK_SIZE);
 
     DPRINTF("Enter save live iterate submitted %d transferred %d\n",
             block_mig_state.submitted, block_mig_state.transferred);
 
-    ret = flush_blks(f);
+    ret = flush_blks(f, budget);
     if (ret) {
         return ret;
     }
 
     blk_mig_reset_dirty_cursor();
 
-    /* control the rate of transfer */
+    /* Keep enough reads in flight for the disks to stay busy; what is
+     * read is sent as the rate limit allows.
+     */
     blk_mig_lock();
     while ((block_mig_state.submitted +
-            block_mig_state.read_done) * BLOCK_SIZE <
-           qemu_file_get_rate_limit(f)) {
+            block_mig_state.read_done) * BLOCK_SIZE < inflight) {
         blk_mig_unlock();
         if (block_mig_state.bulk_completed == 0) {
             /* first finish the bulk phase */
@@ -671,7 +712,7 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
     }
     blk_mig_unlock();
 
-    ret = flush_blks(f);
+    ret = flush_blks(f, budget - (qemu_ftell(f) - last_ftell));
     if (ret) {
         return ret;
     }
@@ -689,7 +730,7 @@ static int block_save_complete(QEMUFile *f, void *opaque)
     DPRINTF("Enter save live complete submitted %d transferred %d\n",
             block_mig_state.submitted, block_mig_state.transferred);
 
-    ret = flush_blks(f);
+    ret = flush_blks(f, INT64_MAX);
     if (ret) {
         return ret;
     }
@@ -27,6 +27,7 @@
 #include "monitor/monitor.h"
 #include "block/block_int.h"
 #include "block/blockjob.h"
+#include "block/throttle-groups.h"
 #include "qemu/module.h"
 #include "qapi/qmp/qjson.h"
 #include "sysemu/sysemu.h"
@@ -34,6 +35,7 @@
 #include "block/coroutine.h"
 #include "qmp-commands.h"
 #include "qemu/timer.h"
+#include "qemu/atomic.h"
 
 #ifdef CONFIG_BSD
 #include <sys/types.h>
@@ -51,12 +53,44 @@
 
 struct BdrvDirtyBitmap {
     HBitmap *bitmap;
+    char *name;         /* NULL for the anonymous bitmaps used by jobs */
+    char *filename;     /* file the bitmap is saved to, or NULL */
+    bool busy;          /* contents taken by bdrv_dirty_bitmap_take() */
     QLIST_ENTRY(BdrvDirtyBitmap) list;
 };
 
+/* Persistent dirty bitmaps are saved to a side file next to the image.
+ * All fields are big endian; the header is followed by @nb_extents
+ * DirtyBitmapFileExtent structures describing the dirty ranges.
+ *
+ * While QEMU tracks writes in the bitmap the file has the IN_USE flag set,
+ * and the flag is cleared when the bitmap is saved on close.  A file that
+ * still has the flag set when it is loaded was not closed cleanly, so
+ * writes may be missing from it and the whole disk is considered dirty.
+ */
+#define DIRTY_BITMAP_MAGIC      0x51454d5544424d50ULL /* "QEMUDBMP" */
+#define DIRTY_BITMAP_VERSION    1
+#define DIRTY_BITMAP_IN_USE     1
+
+typedef struct QEMU_PACKED DirtyBitmapFileHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint64_t size;              /* in sectors */
+    uint32_t granularity;       /* log2 of the granularity in sectors */
+    uint32_t reserved;
+    uint64_t nb_extents;
+} DirtyBitmapFileHeader;
+
+typedef struct QEMU_PACKED DirtyBitmapFileExtent {
+    uint64_t start;             /* in sectors */
+    uint64_t count;
+} DirtyBitmapFileExtent;
+
 #define NOT_DONE 0x7fffffff /* used while emulated sync operation in progress */
 
 static void bdrv_dev_change_media_cb(BlockDriverState *bs, bool load);
+static void bdrv_close_dirty_bitmaps(BlockDriverState *bs);
 static BlockDriverAIOCB *bdrv_aio_readv_em(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque);
@@ -84,6 +118,10 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
                                                void *opaque,
                                                bool is_write);
 static void coroutine_fn bdrv_co_do_rw(void *opaque);
+static void bdrv_acct_cleanup(BlockDriverState *bs);
+static int64_t bdrv_stage_clock(BlockDriverState *bs);
+static void bdrv_stage_account(BlockDriverState *bs,
+                               enum BlockRequestStage stage, int64_t since_ns);
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors, BdrvRequestFlags flags);
 
@@ -122,6 +160,11 @@ void bdrv_set_io_limits(BlockDriverState *bs,
 {
     int i;
 
+    if (bs->throttle_group) {
+        throttle_group_config(bs, cfg);
+        return;
+    }
+
     throttle_config(&bs->throttle_state, cfg);
 
     for (i = 0; i < 2; i++) {
@@ -129,6 +172,16 @@ void bdrv_set_io_limits(BlockDriverState *bs,
     }
 }
 
+/* get the current limits, whether private or shared with a group */
+void bdrv_get_io_limits(BlockDriverState *bs, ThrottleConfig *cfg)
+{
+    if (bs->throttle_group) {
+        throttle_group_get_config(bs, cfg);
+    } else {
+        throttle_get_config(&bs->throttle_state, cfg);
+    }
+}
+
 /* this function drain all the throttled IOs */
 static bool bdrv_start_throttled_reqs(BlockDriverState *bs)
 {
@@ -155,7 +208,11 @@ void bdrv_io_limits_disable(BlockDriverState *bs)
 
     bdrv_start_throttled_reqs(bs);
 
-    throttle_destroy(&bs->throttle_state);
+    if (bs->throttle_group) {
+        throttle_group_unregister_bs(bs);
+    } else {
+        throttle_destroy(&bs->throttle_state);
+    }
 }
 
 static void bdrv_throttle_read_timer_cb(void *opaque)
@@ -170,11 +227,21 @@ static void bdrv_throttle_write_timer_cb(void *opaque)
     qemu_co_enter_next(&bs->throttled_reqs[1]);
 }
 
-/* should be called before bdrv_set_io_limits if a limit is set */
-void bdrv_io_limits_enable(BlockDriverState *bs)
+/* should be called before bdrv_set_io_limits if a limit is set
+ *
+ * @group: if not NULL, share the limits with every other drive that
+ *         joined the throttle group of that name
+ */
+void bdrv_io_limits_enable(BlockDriverState *bs, const char *group)
 {
     assert(!bs->io_limits_enabled);
+    if (group) {
+        throttle_group_register_bs(bs, group);
+        bs->io_limits_enabled = true;
+        return;
+    }
     throttle_init(&bs->throttle_state,
+                  bdrv_get_aio_context(bs),
                   QEMU_CLOCK_VIRTUAL,
                   bdrv_throttle_read_timer_cb,
                   bdrv_throttle_write_timer_cb,
@@ -191,6 +258,12 @@ static void bdrv_io_limits_intercept(BlockDriverState *bs,
                                      int nb_sectors,
                                      bool is_write)
 {
+    if (bs->throttle_group) {
+        throttle_group_co_io_limits_intercept(bs, nb_sectors * BDRV_SECTOR_SIZE,
+                                              is_write);
+        return;
+    }
+
     /* does this io must wait */
     bool must_wait = throttle_schedule_timer(&bs->throttle_state, is_write);
 
@@ -334,7 +407,9 @@ BlockDriverState *bdrv_new(const char *device_name)
     notifier_with_return_list_init(&bs->before_write_notifiers);
     qemu_co_queue_init(&bs->throttled_reqs[0]);
     qemu_co_queue_init(&bs->throttled_reqs[1]);
+    qemu_co_queue_init(&bs->flush_queue);
     bs->refcnt = 1;
+    bs->aio_context = qemu_get_aio_context();
 
     return bs;
 }
@@ -1016,6 +1091,14 @@ int bdrv_open_backing_file(BlockDriverState *bs, QDict *options, Error **errp)
         error_free(local_err);
         return ret;
     }
+
+    /* The backing file must live in the same event loop as its parent, which
+     * may already have been moved to a dataplane thread
+     */
+    if (bdrv_get_aio_context(bs->backing_hd) != bdrv_get_aio_context(bs)) {
+        bdrv_set_aio_context(bs->backing_hd, bdrv_get_aio_context(bs));
+    }
+
     pstrcpy(bs->backing_file, sizeof(bs->backing_file),
             bs->backing_hd->file->filename);
     return 0;
@@ -1456,6 +1539,7 @@ void bdrv_close(BlockDriverState *bs)
     bdrv_flush(bs);
     bdrv_drain_all(); /* in case flush left pending I/O */
     notifier_list_notify(&bs->close_notifiers, bs);
+    bdrv_close_dirty_bitmaps(bs);
 
     if (bs->drv) {
         if (bs->backing_hd) {
@@ -1495,6 +1579,10 @@ void bdrv_close(BlockDriverState *bs)
     if (bs->io_limits_enabled) {
         bdrv_io_limits_disable(bs);
     }
+
+    bdrv_set_merge_limits(bs, 0, 0);
+    bdrv_set_readahead(bs, 0, 0);
+    bdrv_set_chain_cache(bs, 0);
 }
 
 void bdrv_close_all(void)
@@ -1502,7 +1590,11 @@ void bdrv_close_all(void)
     BlockDriverState *bs;
 
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        aio_context_acquire(aio_context);
         bdrv_close(bs);
+        aio_context_release(aio_context);
     }
 }
 
@@ -1518,6 +1610,9 @@ static bool bdrv_requests_pending(BlockDriverState *bs)
     if (!qemu_co_queue_empty(&bs->throttled_reqs[1])) {
         return true;
     }
+    if (bs->readahead_inflight) {
+        return true;
+    }
     if (bs->file && bdrv_requests_pending(bs->file)) {
         return true;
     }
@@ -1527,17 +1622,6 @@ static bool bdrv_requests_pending(BlockDriverState *bs)
     return false;
 }
 
-static bool bdrv_requests_pending_all(void)
-{
-    BlockDriverState *bs;
-    QTAILQ_FOREACH(bs, &bdrv_states, list) {
-        if (bdrv_requests_pending(bs)) {
-            return true;
-        }
-    }
-    return false;
-}
-
 /*
  * Wait for pending requests to complete across all BlockDriverStates
  *
@@ -1549,21 +1633,62 @@ static bool bdrv_requests_pending_all(void)
  * can be arbitrarily complex and a constant flow of I/O can come until the
  * coroutine is complete.  Because of this, it is not possible to have a
  * function to drain a single device's I/O queue.
+ *
+ * Each AioContext is acquired while it is polled, so that a dataplane
+ * thread cannot run concurrently.  Every iteration polls each AioContext
+ * once, however many devices it serves, and only blocks in the ones that
+ * have requests in flight.
  */
 void bdrv_drain_all(void)
 {
     /* Always run first iteration so any pending completion BHs run */
     bool busy = true;
     BlockDriverState *bs;
+    GSList *contexts, *busy_contexts, *l;
+    int64_t start_ns = get_clock();
+    int iterations = 0;
 
     while (busy) {
+        busy = false;
+        iterations++;
+
+        /* The main loop runs completion BHs even with no named devices */
+        contexts = g_slist_prepend(NULL, qemu_get_aio_context());
+        busy_contexts = NULL;
+
         QTAILQ_FOREACH(bs, &bdrv_states, list) {
+            AioContext *aio_context = bdrv_get_aio_context(bs);
+
+            aio_context_acquire(aio_context);
+            bdrv_flush_io_queue(bs);
             bdrv_start_throttled_reqs(bs);
+            if (bdrv_requests_pending(bs) &&
+                !g_slist_find(busy_contexts, aio_context)) {
+                busy_contexts = g_slist_prepend(busy_contexts, aio_context);
+            }
+            aio_context_release(aio_context);
+
+            if (!g_slist_find(contexts, aio_context)) {
+                contexts = g_slist_prepend(contexts, aio_context);
+            }
+        }
+
+        for (l = contexts; l; l = l->next) {
+            AioContext *aio_context = l->data;
+            bool ctx_busy = g_slist_find(busy_contexts, aio_context) != NULL;
+
+            aio_context_acquire(aio_context);
+            ctx_busy |= aio_poll(aio_context, ctx_busy);
+            aio_context_release(aio_context);
+
+            busy |= ctx_busy;
         }
 
-        busy = bdrv_requests_pending_all();
-        busy |= aio_poll(qemu_get_aio_context(), busy);
+        g_slist_free(contexts);
+        g_slist_free(busy_contexts);
     }
+
+    trace_bdrv_drain_all(iterations, get_clock() - start_ns);
 }
 
 /* make a BlockDriverState anonymous by removing from bdrv_state list.
@@ -1605,6 +1730,32 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->throttled_reqs[0]  = bs_src->throttled_reqs[0];
     bs_dest->throttled_reqs[1]  = bs_src->throttled_reqs[1];
     bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
+    bs_dest->throttle_group     = bs_src->throttle_group;
+    bs_dest->round_robin        = bs_src->round_robin;
+    bs_dest->pending_reqs[0]    = bs_src->pending_reqs[0];
+    bs_dest->pending_reqs[1]    = bs_src->pending_reqs[1];
+
+    /* request merging */
+    bs_dest->merge_max_bytes    = bs_src->merge_max_bytes;
+    bs_dest->merge_timeout_ns   = bs_src->merge_timeout_ns;
+    bs_dest->merge_req          = bs_src->merge_req;
+    bs_dest->merge_timer        = bs_src->merge_timer;
+
+    /* backing chain cache */
+    bs_dest->chain_cache            = bs_src->chain_cache;
+
+    /* copy-on-read readahead */
+    bs_dest->readahead_window       = bs_src->readahead_window;
+    bs_dest->readahead_max_inflight = bs_src->readahead_max_inflight;
+    bs_dest->readahead_inflight     = bs_src->readahead_inflight;
+    bs_dest->readahead_next         = bs_src->readahead_next;
+    bs_dest->readahead_end          = bs_src->readahead_end;
+    bs_dest->readahead_seq          = bs_src->readahead_seq;
+
+    /* latency statistics */
+    memcpy(bs_dest->latency_histogram, bs_src->latency_histogram,
+           sizeof(bs_dest->latency_histogram));
+    bs_dest->timed_stats        = bs_src->timed_stats;
 
     /* r/w error */
     bs_dest->on_read_error      = bs_src->on_read_error;
@@ -1617,6 +1768,9 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     /* dirty bitmap */
     bs_dest->dirty_bitmaps      = bs_src->dirty_bitmaps;
 
+    /* AioContext change notifiers, e.g. from NBD exports */
+    bs_dest->aio_notifiers      = bs_src->aio_notifiers;
+
     /* reference count */
     bs_dest->refcnt             = bs_src->refcnt;
 
@@ -1649,11 +1803,15 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     /* bs_new must be anonymous and shouldn't have anything fancy enabled */
     assert(bs_new->device_name[0] == '\0');
     assert(QLIST_EMPTY(&bs_new->dirty_bitmaps));
+    assert(QLIST_EMPTY(&bs_new->aio_notifiers));
     assert(bs_new->job == NULL);
     assert(bs_new->dev == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
     assert(!throttle_have_timer(&bs_new->throttle_state));
+    assert(bs_new->merge_max_bytes == 0);
+    assert(bs_new->readahead_window == 0);
+    assert(bs_new->chain_cache == NULL);
 
     tmp = *bs_new;
     *bs_new = *bs_old;
@@ -1673,6 +1831,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
     assert(!throttle_have_timer(&bs_new->throttle_state));
+    assert(bs_new->merge_max_bytes == 0);
 
     bdrv_rebind(bs_new);
     bdrv_rebind(bs_old);
@@ -1709,13 +1868,15 @@ static void bdrv_delete(BlockDriverState *bs)
     assert(!bs->job);
     assert(!bs->in_use);
     assert(!bs->refcnt);
-    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
     bdrv_close(bs);
+    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
     /* remove from list, if necessary */
     bdrv_make_anon(bs);
 
+    bdrv_acct_cleanup(bs);
+
     g_free(bs);
 }
 
@@ -1970,26 +2131,43 @@ int bdrv_commit_all(void)
  */
 static void tracked_request_end(BdrvTrackedRequest *req)
 {
+    trace_bdrv_tracked_request_end(req->bs, req->id);
+    if (req->start_ns) {
+        bdrv_stage_account(req->bs, BDRV_STAGE_DRIVER, req->start_ns);
+    }
+
     QLIST_REMOVE(req, list);
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
 /**
  * Add an active request to the tracked requests list
+ *
+ * @queued_ns is the time the request entered the block layer, as returned
+ * by bdrv_stage_clock().
  */
 static void tracked_request_begin(BdrvTrackedRequest *req,
                                   BlockDriverState *bs,
                                   int64_t sector_num,
-                                  int nb_sectors, bool is_write)
+                                  int nb_sectors, bool is_write,
+                                  int64_t queued_ns)
 {
     *req = (BdrvTrackedRequest){
         .bs = bs,
         .sector_num = sector_num,
         .nb_sectors = nb_sectors,
         .is_write = is_write,
+        .id = bdrv_new_request_id(),
         .co = qemu_coroutine_self(),
     };
 
+    trace_bdrv_tracked_request_begin(bs, req->id, req->co, sector_num,
+                                     nb_sectors, is_write);
+    if (queued_ns) {
+        bdrv_stage_account(bs, BDRV_STAGE_QUEUE, queued_ns);
+        req->start_ns = get_clock();
+    }
+
     qemu_co_queue_init(&req->wait_queue);
 
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
@@ -2328,10 +2506,12 @@ static int bdrv_rwv_co(BlockDriverState *bs, int64_t sector_num,
         /* Fast-path if already in coroutine context */
         bdrv_rw_co_entry(&rwco);
     } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
         co = qemu_coroutine_create(bdrv_rw_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(aio_context, true);
         }
     }
     return rwco.ret;
@@ -2627,6 +2807,7 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
         ret = drv->bdrv_co_writev(bs, cluster_sector_num, cluster_nb_sectors,
                                   &bounce_qiov);
     }
+    bdrv_chain_cache_invalidate(bs, cluster_sector_num, cluster_nb_sectors);
 
     if (ret < 0) {
         /* It might be okay to ignore write errors for guest requests.  If this
@@ -2645,6 +2826,338 @@ err:
     return ret;
 }
 
+/* Backing chain allocation cache
+ *
+ * With a deep chain of images, a read of data that lives in a low layer
+ * goes through the metadata of every image above it before it finds the
+ * data.  The chain cache remembers, for chunks of CHAIN_CACHE_CHUNK_SECTORS,
+ * which image of the chain holds the whole chunk, so that reads of those
+ * chunks can be sent to that image directly.  It is a direct-mapped table
+ * filled on read misses.
+ *
+ * Writes to the top image invalidate the entries they overlap.  Writes to
+ * any other image of the chain and changes to the chain itself are
+ * detected by comparing the images and their write_gen counters with the
+ * ones the cache was filled with, in which case the whole cache is
+ * dropped.
+ */
+#define CHAIN_CACHE_CHUNK_SECTORS   128
+#define CHAIN_CACHE_UNUSED          (-1)
+#define CHAIN_CACHE_ZERO            (-1)   /* unallocated in the whole chain */
+#define CHAIN_CACHE_MIXED           (-2)   /* not all in the same image */
+
+typedef struct BdrvChainCacheEntry {
+    int64_t chunk;              /* CHAIN_CACHE_UNUSED if the entry is free */
+    int depth;                  /* 0 is the top image itself */
+} BdrvChainCacheEntry;
+
+typedef struct BdrvChainCache {
+    int nb_layers;
+    BlockDriverState **layers;  /* the backing chain below the top image */
+    uint64_t *layer_gens;
+    unsigned int nb_entries;
+    BdrvChainCacheEntry *entries;
+} BdrvChainCache;
+
+static void bdrv_chain_cache_clear(BdrvChainCache *cache)
+{
+    unsigned int i;
+
+    for (i = 0; i < cache->nb_entries; i++) {
+        cache->entries[i].chunk = CHAIN_CACHE_UNUSED;
+    }
+}
+
+static BdrvChainCacheEntry *bdrv_chain_cache_entry(BdrvChainCache *cache,
+                                                   int64_t chunk)
+{
+    return &cache->entries[chunk % cache->nb_entries];
+}
+
+/* Called whenever the allocation status of [sector_num, sector_num +
+ * nb_sectors) in @bs may have changed.
+ */
+static void bdrv_chain_cache_invalidate(BlockDriverState *bs,
+                                        int64_t sector_num,
+                                        int64_t nb_sectors)
+{
+    BdrvChainCache *cache = bs->chain_cache;
+    int64_t chunk, end;
+
+    bs->write_gen++;
+    if (!cache || nb_sectors <= 0) {
+        return;
+    }
+
+    chunk = sector_num / CHAIN_CACHE_CHUNK_SECTORS;
+    end = (sector_num + nb_sectors - 1) / CHAIN_CACHE_CHUNK_SECTORS + 1;
+    if (end - chunk >= cache->nb_entries) {
+        bdrv_chain_cache_clear(cache);
+        return;
+    }
+    for (; chunk < end; chunk++) {
+        BdrvChainCacheEntry *e = bdrv_chain_cache_entry(cache, chunk);
+        if (e->chunk == chunk) {
+            e->chunk = CHAIN_CACHE_UNUSED;
+        }
+    }
+}
+
+/* Drop the cache if the backing chain is not the one it was filled with,
+ * returns false in that case.
+ */
+static bool bdrv_chain_cache_check_layers(BlockDriverState *bs)
+{
+    BdrvChainCache *cache = bs->chain_cache;
+    BlockDriverState *layer;
+    int i = 0;
+
+    for (layer = bs->backing_hd; layer; layer = layer->backing_hd, i++) {
+        if (i >= cache->nb_layers || cache->layers[i] != layer ||
+            cache->layer_gens[i] != layer->write_gen) {
+            break;
+        }
+    }
+    if (!layer && i == cache->nb_layers) {
+        return true;
+    }
+
+    for (i = 0, layer = bs->backing_hd; layer; layer = layer->backing_hd) {
+        i++;
+    }
+    cache->nb_layers = i;
+    cache->layers = g_renew(BlockDriverState *, cache->layers, i);
+    cache->layer_gens = g_renew(uint64_t, cache->layer_gens, i);
+    for (i = 0, layer = bs->backing_hd; layer; layer = layer->backing_hd, i++) {
+        cache->layers[i] = layer;
+        cache->layer_gens[i] = layer->write_gen;
+    }
+    bdrv_chain_cache_clear(cache);
+    trace_bdrv_chain_cache_reset(bs, cache->nb_layers);
+    return false;
+}
+
+/* Walk the chain to find the image that holds the whole of @chunk */
+static int coroutine_fn bdrv_chain_cache_lookup_chunk(BlockDriverState *bs,
+                                                      int64_t chunk)
+{
+    BlockDriverState *layer = bs;
+    int64_t sector_num = chunk * CHAIN_CACHE_CHUNK_SECTORS;
+    int nb_sectors = MIN(CHAIN_CACHE_CHUNK_SECTORS,
+                         bs->total_sectors - sector_num);
+    int depth = 0;
+    int pnum, ret;
+
+    while (layer) {
+        if (layer->total_sectors < sector_num + nb_sectors) {
+            /* The part beyond the end of a backing file reads as zeroes */
+            return CHAIN_CACHE_MIXED;
+        }
+        ret = bdrv_is_allocated(layer, sector_num, nb_sectors, &pnum);
+        if (ret < 0 || pnum != nb_sectors) {
+            return CHAIN_CACHE_MIXED;
+        }
+        if (ret) {
+            return depth;
+        }
+        layer = layer->backing_hd;
+        depth++;
+    }
+    return CHAIN_CACHE_ZERO;
+}
+
+/* Return the image of the backing chain of @bs that holds all of
+ * [sector_num, sector_num + nb_sectors), or NULL if the request must go
+ * through @bs as usual.  If the range is unallocated in every image, return
+ * NULL and set *zero to true.
+ */
+static BlockDriverState * coroutine_fn bdrv_chain_cache_find(
+        BlockDriverState *bs, int64_t sector_num, int nb_sectors, bool *zero)
+{
+    BdrvChainCache *cache = bs->chain_cache;
+    BlockDriverState *layer;
+    int64_t chunk, end;
+    int depth = CHAIN_CACHE_MIXED;
+
+    *zero = false;
+    if (!bs->backing_hd) {
+        return NULL;
+    }
+    bdrv_chain_cache_check_layers(bs);
+
+    chunk = sector_num / CHAIN_CACHE_CHUNK_SECTORS;
+    end = DIV_ROUND_UP(sector_num + nb_sectors, CHAIN_CACHE_CHUNK_SECTORS);
+    for (; chunk < end; chunk++) {
+        BdrvChainCacheEntry *e = bdrv_chain_cache_entry(cache, chunk);
+        int d;
+
+        if (e->chunk == chunk) {
+            d = e->depth;
+        } else {
+            uint64_t gen = bs->write_gen;
+
+            trace_bdrv_chain_cache_miss(bs, chunk);
+            d = bdrv_chain_cache_lookup_chunk(bs, chunk);
+
+            /* The lookup can yield, do not use the result if the chain was
+             * written to or modified in the meanwhile */
+            if (!bdrv_chain_cache_check_layers(bs)) {
+                return NULL;
+            }
+            if (gen != bs->write_gen) {
+                return NULL;
+            }
+            e->chunk = chunk;
+            e->depth = d;
+        }
+
+        if (d == CHAIN_CACHE_MIXED || d == 0 ||
+            (depth != CHAIN_CACHE_MIXED && d != depth)) {
+            return NULL;
+        }
+        depth = d;
+    }
+
+    if (depth == CHAIN_CACHE_ZERO) {
+        *zero = true;
+        return NULL;
+    }
+    for (layer = bs; depth > 0; depth--) {
+        layer = layer->backing_hd;
+    }
+    return layer;
+}
+
+void bdrv_set_chain_cache(BlockDriverState *bs, uint64_t size)
+{
+    BdrvChainCache *cache = bs->chain_cache;
+
+    if (cache) {
+        g_free(cache->layers);
+        g_free(cache->layer_gens);
+        g_free(cache->entries);
+        g_free(cache);
+        bs->chain_cache = NULL;
+    }
+
+    if (size >= sizeof(BdrvChainCacheEntry)) {
+        cache = g_new0(BdrvChainCache, 1);
+        cache->nb_entries = MIN(size / sizeof(BdrvChainCacheEntry), INT_MAX);
+        cache->entries = g_new(BdrvChainCacheEntry, cache->nb_entries);
+        bdrv_chain_cache_clear(cache);
+        bs->chain_cache = cache;
+    }
+}
+
+/* Readahead for copy-on-read
+ *
+ * Copy-on-read only populates the image file with what the guest reads,
+ * so a guest reading sequentially from a slow backing file waits for the
+ * backing chain on every request.  Once a few consecutive reads have been
+ * seen, the data that follows is copied in the background, up to
+ * readahead_window sectors ahead of the guest and with at most
+ * readahead_max_inflight sectors of buffers in use.  The guest then finds
+ * the data already allocated in the image file.
+ */
+#define READAHEAD_MIN_SEQUENTIAL    2
+#define READAHEAD_CHUNK_SECTORS     ((1 << 20) / BDRV_SECTOR_SIZE)
+
+typedef struct BdrvReadahead {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+} BdrvReadahead;
+
+static void coroutine_fn bdrv_readahead_co(void *opaque)
+{
+    BdrvReadahead *ra = opaque;
+    BlockDriverState *bs = ra->bs;
+    int64_t sector_num = ra->sector_num;
+    int64_t end = sector_num + ra->nb_sectors;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    void *buf;
+    int pnum, ret;
+
+    buf = qemu_blockalign(bs, ra->nb_sectors * BDRV_SECTOR_SIZE);
+    while (sector_num < end && bs->drv) {
+        ret = bdrv_is_allocated(bs, sector_num, end - sector_num, &pnum);
+        if (ret < 0 || pnum == 0) {
+            break;
+        }
+        if (!ret) {
+            trace_bdrv_readahead(bs, sector_num, pnum);
+            iov.iov_base = buf;
+            iov.iov_len = pnum * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = bdrv_co_do_readv(bs, sector_num, pnum, &qiov,
+                                   BDRV_REQ_COPY_ON_READ |
+                                   BDRV_REQ_READAHEAD);
+            if (ret < 0) {
+                break;
+            }
+        }
+        sector_num += pnum;
+    }
+    qemu_vfree(buf);
+
+    bs->readahead_inflight -= ra->nb_sectors;
+    g_free(ra);
+}
+
+/* Called for every guest read, starts prefetching if it looks sequential */
+static void bdrv_readahead(BlockDriverState *bs, int64_t sector_num,
+                           int nb_sectors)
+{
+    int64_t end = sector_num + nb_sectors;
+    int64_t limit, start;
+
+    if (sector_num == bs->readahead_next) {
+        bs->readahead_seq++;
+    } else {
+        bs->readahead_seq = 0;
+        bs->readahead_end = end;
+    }
+    bs->readahead_next = end;
+
+    if (bs->readahead_seq < READAHEAD_MIN_SEQUENTIAL || !bs->backing_hd) {
+        return;
+    }
+
+    start = MAX(end, bs->readahead_end);
+    limit = MIN(end + bs->readahead_window, bs->total_sectors);
+    while (start < limit &&
+           bs->readahead_inflight < bs->readahead_max_inflight) {
+        BdrvReadahead *ra = g_new(BdrvReadahead, 1);
+        Coroutine *co;
+
+        ra->bs = bs;
+        ra->sector_num = start;
+        ra->nb_sectors = MIN(MIN(limit - start, READAHEAD_CHUNK_SECTORS),
+                             bs->readahead_max_inflight -
+                             bs->readahead_inflight);
+        bs->readahead_inflight += ra->nb_sectors;
+        start += ra->nb_sectors;
+
+        co = qemu_coroutine_create(bdrv_readahead_co);
+        qemu_coroutine_enter(co, ra);
+    }
+    bs->readahead_end = start;
+}
+
+void bdrv_set_readahead(BlockDriverState *bs, uint64_t window,
+                        uint64_t max_memory)
+{
+    bs->readahead_window = window >> BDRV_SECTOR_BITS;
+    bs->readahead_max_inflight = MAX(max_memory >> BDRV_SECTOR_BITS,
+                                     READAHEAD_CHUNK_SECTORS);
+    if (!bs->readahead_window) {
+        bs->readahead_max_inflight = 0;
+    }
+    bs->readahead_seq = 0;
+    bs->readahead_next = bs->readahead_end = 0;
+}
+
 /*
  * Handle a read request in coroutine context
  */
@@ -2654,6 +3167,7 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
 {
     BlockDriver *drv = bs->drv;
     BdrvTrackedRequest req;
+    int64_t queued_ns = bdrv_stage_clock(bs);
     int ret;
 
     if (!drv) {
@@ -2668,6 +3182,9 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
     }
     if (flags & BDRV_REQ_COPY_ON_READ) {
         bs->copy_on_read_in_flight++;
+        if (bs->readahead_window && !(flags & BDRV_REQ_READAHEAD)) {
+            bdrv_readahead(bs, sector_num, nb_sectors);
+        }
     }
 
     if (bs->copy_on_read_in_flight) {
@@ -2679,7 +3196,23 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
         bdrv_io_limits_intercept(bs, nb_sectors, false);
     }
 
-    tracked_request_begin(&req, bs, sector_num, nb_sectors, false);
+    tracked_request_begin(&req, bs, sector_num, nb_sectors, false, queued_ns);
+
+    if (bs->chain_cache && !(flags & BDRV_REQ_COPY_ON_READ)) {
+        BlockDriverState *layer;
+        bool zero;
+
+        layer = bdrv_chain_cache_find(bs, sector_num, nb_sectors, &zero);
+        if (zero) {
+            qemu_iovec_memset(qiov, 0, 0, nb_sectors * BDRV_SECTOR_SIZE);
+            ret = 0;
+            goto out;
+        } else if (layer) {
+            trace_bdrv_chain_cache_hit(bs, layer, sector_num, nb_sectors);
+            ret = bdrv_co_do_readv(layer, sector_num, nb_sectors, qiov, 0);
+            goto out;
+        }
+    }
 
     if (flags & BDRV_REQ_COPY_ON_READ) {
         int pnum;
@@ -2836,6 +3369,7 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
 {
     BlockDriver *drv = bs->drv;
     BdrvTrackedRequest req;
+    int64_t queued_ns = bdrv_stage_clock(bs);
     int ret;
 
     if (!bs->drv) {
@@ -2857,7 +3391,7 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
         bdrv_io_limits_intercept(bs, nb_sectors, true);
     }
 
-    tracked_request_begin(&req, bs, sector_num, nb_sectors, true);
+    tracked_request_begin(&req, bs, sector_num, nb_sectors, true, queued_ns);
 
     ret = notifier_with_return_list_notify(&bs->before_write_notifiers, &req);
 
@@ -2868,12 +3402,14 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
     } else {
         ret = drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
     }
+    bs->write_gen++;
 
     if (ret == 0 && !bs->enable_write_cache) {
         ret = bdrv_co_flush(bs);
     }
 
     bdrv_set_dirty(bs, sector_num, nb_sectors);
+    bdrv_chain_cache_invalidate(bs, sector_num, nb_sectors);
 
     if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
         bs->wr_highest_sector = sector_num + nb_sectors - 1;
@@ -2922,9 +3458,11 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
         return -ENOTSUP;
     if (bs->read_only)
         return -EACCES;
-    if (bdrv_in_use(bs))
+    if (bdrv_in_use(bs) || !QLIST_EMPTY(&bs->dirty_bitmaps))
         return -EBUSY;
     ret = drv->bdrv_truncate(bs, offset);
+    bs->write_gen++;
+    bdrv_chain_cache_invalidate(bs, 0, INT64_MAX);
     if (ret == 0) {
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
         bdrv_dev_resize_cb(bs);
@@ -3155,10 +3693,15 @@ int bdrv_flush_all(void)
     int result = 0;
 
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
-        int ret = bdrv_flush(bs);
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+        int ret;
+
+        aio_context_acquire(aio_context);
+        ret = bdrv_flush(bs);
         if (ret < 0 && !result) {
             result = ret;
         }
+        aio_context_release(aio_context);
     }
 
     return result;
@@ -3345,10 +3888,12 @@ int64_t bdrv_get_block_status(BlockDriverState *bs, int64_t sector_num,
         /* Fast-path if already in coroutine context */
         bdrv_get_block_status_co_entry(&data);
     } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
         co = qemu_coroutine_create(bdrv_get_block_status_co_entry);
         qemu_coroutine_enter(co, &data);
         while (!data.done) {
-            qemu_aio_wait();
+            aio_poll(aio_context, true);
         }
     }
     return data.ret;
@@ -3433,20 +3978,102 @@ void bdrv_get_backing_filename(BlockDriverState *bs,
     pstrcpy(filename, filename_size, bs->backing_file);
 }
 
+static void coroutine_fn bdrv_write_compressed_co_entry(void *opaque)
+{
+    RwCo *rwco = opaque;
+
+    rwco->ret = bdrv_co_write_compressed(rwco->bs, rwco->sector_num,
+                                         rwco->nb_sectors, rwco->qiov);
+}
+
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors)
 {
     BlockDriver *drv = bs->drv;
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+    Coroutine *co;
+    RwCo rwco = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .qiov = &qiov,
+        .ret = NOT_DONE,
+    };
+
     if (!drv)
         return -ENOMEDIUM;
-    if (!drv->bdrv_write_compressed)
+    if (!drv->bdrv_co_write_compressed) {
+        if (!drv->bdrv_write_compressed)
+            return -ENOTSUP;
+        if (bdrv_check_request(bs, sector_num, nb_sectors))
+            return -EIO;
+
+        assert(QLIST_EMPTY(&bs->dirty_bitmaps));
+
+        bs->write_gen++;
+        return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    }
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        bdrv_write_compressed_co_entry(&rwco);
+    } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        co = qemu_coroutine_create(bdrv_write_compressed_co_entry);
+        qemu_coroutine_enter(co, &rwco);
+        while (rwco.ret == NOT_DONE) {
+            aio_poll(aio_context, true);
+        }
+    }
+
+    return rwco.ret;
+}
+
+/*
+ * A nb_sectors of 0 ends a series of compressed writes, like it does for
+ * bdrv_write_compressed(); qiov is not used then.
+ */
+int coroutine_fn bdrv_co_write_compressed(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors,
+                                          QEMUIOVector *qiov)
+{
+    BlockDriver *drv = bs->drv;
+    uint8_t *buf;
+    int ret;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_co_write_compressed && !drv->bdrv_write_compressed) {
         return -ENOTSUP;
-    if (bdrv_check_request(bs, sector_num, nb_sectors))
+    }
+    if (bdrv_check_request(bs, sector_num, nb_sectors)) {
         return -EIO;
+    }
 
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
-    return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    bs->write_gen++;
+    if (drv->bdrv_co_write_compressed) {
+        return drv->bdrv_co_write_compressed(bs, sector_num, nb_sectors, qiov);
+    }
+
+    /* Drivers without a coroutine version block the caller */
+    if (nb_sectors == 0) {
+        return drv->bdrv_write_compressed(bs, sector_num, NULL, 0);
+    }
+    buf = qemu_blockalign(bs, qiov->size);
+    qemu_iovec_to_buf(qiov, 0, buf, qiov->size);
+    ret = drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    qemu_vfree(buf);
+    return ret;
 }
 
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
@@ -3489,6 +4116,7 @@ int bdrv_writev_vmstate(BlockDriverState *bs, QEMUIOVector *qiov, int64_t pos)
     if (!drv) {
         return -ENOMEDIUM;
     } else if (drv->bdrv_save_vmstate) {
+        bs->write_gen++;
         return drv->bdrv_save_vmstate(bs, qiov, pos);
     } else if (bs->file) {
         return bdrv_writev_vmstate(bs->file, qiov, pos);
@@ -3673,24 +4301,213 @@ BlockDriverState *bdrv_find_base(BlockDriverState *bs)
 }
 
 /**************************************************************/
-/* async I/Os */
+/* request merging */
 
-BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
-                                 QEMUIOVector *qiov, int nb_sectors,
-                                 BlockDriverCompletionFunc *cb, void *opaque)
-{
-    trace_bdrv_aio_readv(bs, sector_num, nb_sectors, opaque);
+/*
+ * Sequential requests submitted through bdrv_aio_readv()/bdrv_aio_writev()
+ * are collected into one larger request while the device is plugged, or
+ * for up to merge_timeout_ns, whichever ends first.  This is transparent
+ * to the callers; each gets its own BlockDriverAIOCB and callback.
+ */
 
-    return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors, 0,
-                                 cb, opaque, false);
-}
+typedef struct BdrvMergeAIOCB {
+    BlockDriverAIOCB common;
+    bool *done;
+    QSIMPLEQ_ENTRY(BdrvMergeAIOCB) next;
+} BdrvMergeAIOCB;
 
-BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
+typedef struct BdrvMergeReq {
+    bool is_write;
+    int64_t sector_num;
+    int nb_sectors;
+    QEMUIOVector qiov;
+    unsigned int num_reqs;
+    QSIMPLEQ_HEAD(, BdrvMergeAIOCB) acbs;
+} BdrvMergeReq;
+
+static void bdrv_merge_aio_cancel(BlockDriverAIOCB *blockacb);
+
+static const AIOCBInfo bdrv_merge_aiocb_info = {
+    .aiocb_size         = sizeof(BdrvMergeAIOCB),
+    .cancel             = bdrv_merge_aio_cancel,
+};
+
+static void bdrv_merge_cb(void *opaque, int ret)
+{
+    BdrvMergeReq *mreq = opaque;
+    BdrvMergeAIOCB *acb, *next_acb;
+
+    QSIMPLEQ_FOREACH_SAFE(acb, &mreq->acbs, next, next_acb) {
+        acb->common.cb(acb->common.opaque, ret);
+        if (acb->done) {
+            *acb->done = true;
+        }
+        qemu_aio_release(acb);
+    }
+
+    qemu_iovec_destroy(&mreq->qiov);
+    g_free(mreq);
+}
+
+/* Submit the request being collected, if any */
+static void bdrv_merge_flush(BlockDriverState *bs)
+{
+    BdrvMergeReq *mreq = bs->merge_req;
+
+    if (!mreq) {
+        return;
+    }
+
+    bs->merge_req = NULL;
+    if (bs->merge_timer) {
+        timer_del(bs->merge_timer);
+    }
+
+    trace_bdrv_merge_flush(bs, mreq->sector_num, mreq->nb_sectors,
+                           mreq->num_reqs, mreq->is_write);
+    bdrv_co_aio_rw_vector(bs, mreq->sector_num, &mreq->qiov,
+                          mreq->nb_sectors, 0, bdrv_merge_cb, mreq,
+                          mreq->is_write);
+}
+
+static void bdrv_merge_timer_cb(void *opaque)
+{
+    bdrv_merge_flush(opaque);
+}
+
+static void bdrv_merge_aio_cancel(BlockDriverAIOCB *blockacb)
+{
+    BdrvMergeAIOCB *acb = container_of(blockacb, BdrvMergeAIOCB, common);
+    AioContext *aio_context = bdrv_get_aio_context(blockacb->bs);
+    bool done = false;
+
+    acb->done = &done;
+    bdrv_merge_flush(blockacb->bs);
+    while (!done) {
+        aio_poll(aio_context, true);
+    }
+}
+
+static bool bdrv_merge_can_append(BlockDriverState *bs, BdrvMergeReq *mreq,
+                                  int64_t sector_num, QEMUIOVector *qiov,
+                                  bool is_write)
+{
+    return mreq->is_write == is_write &&
+           mreq->sector_num + mreq->nb_sectors == sector_num &&
+           mreq->qiov.size + qiov->size <= bs->merge_max_bytes &&
+           mreq->qiov.niov + qiov->niov <= IOV_MAX;
+}
+
+static BlockDriverAIOCB *bdrv_aio_rw_merge(BlockDriverState *bs,
+                                           int64_t sector_num,
+                                           QEMUIOVector *qiov,
+                                           int nb_sectors,
+                                           BlockDriverCompletionFunc *cb,
+                                           void *opaque,
+                                           bool is_write)
+{
+    BdrvMergeReq *mreq = bs->merge_req;
+    BdrvMergeAIOCB *acb;
+
+    if (mreq && !bdrv_merge_can_append(bs, mreq, sector_num, qiov,
+                                       is_write)) {
+        bdrv_merge_flush(bs);
+        mreq = NULL;
+    }
+
+    /* Nothing to wait for: no batch in progress and no time limit */
+    if (!mreq && !bs->io_plugged && !bs->merge_timeout_ns) {
+        return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors, 0,
+                                     cb, opaque, is_write);
+    }
+
+    /* Requests with odd-sized buffers are passed through unchanged */
+    if (qiov->size != (size_t)nb_sectors * BDRV_SECTOR_SIZE ||
+        qiov->size >= bs->merge_max_bytes) {
+        bdrv_merge_flush(bs);
+        return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors, 0,
+                                     cb, opaque, is_write);
+    }
+
+    if (!mreq) {
+        mreq = g_new0(BdrvMergeReq, 1);
+        mreq->is_write = is_write;
+        mreq->sector_num = sector_num;
+        qemu_iovec_init(&mreq->qiov, qiov->niov);
+        QSIMPLEQ_INIT(&mreq->acbs);
+        bs->merge_req = mreq;
+
+        if (bs->merge_timer) {
+            timer_mod(bs->merge_timer,
+                      qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                      bs->merge_timeout_ns);
+        }
+    }
+
+    acb = qemu_aio_get(&bdrv_merge_aiocb_info, bs, cb, opaque);
+    acb->done = NULL;
+    QSIMPLEQ_INSERT_TAIL(&mreq->acbs, acb, next);
+
+    qemu_iovec_concat(&mreq->qiov, qiov, 0, qiov->size);
+    mreq->nb_sectors += nb_sectors;
+    mreq->num_reqs++;
+
+    if (mreq->qiov.size >= bs->merge_max_bytes) {
+        bdrv_merge_flush(bs);
+    }
+
+    return &acb->common;
+}
+
+void bdrv_set_merge_limits(BlockDriverState *bs, uint64_t max_bytes,
+                           int64_t timeout_ns)
+{
+    bdrv_merge_flush(bs);
+
+    if (!max_bytes) {
+        timeout_ns = 0;
+    }
+    bs->merge_max_bytes = max_bytes;
+    bs->merge_timeout_ns = timeout_ns;
+
+    if (timeout_ns && !bs->merge_timer) {
+        bs->merge_timer = aio_timer_new(bdrv_get_aio_context(bs),
+                                        QEMU_CLOCK_REALTIME, SCALE_NS,
+                                        bdrv_merge_timer_cb, bs);
+    } else if (!timeout_ns && bs->merge_timer) {
+        timer_del(bs->merge_timer);
+        timer_free(bs->merge_timer);
+        bs->merge_timer = NULL;
+    }
+}
+
+/**************************************************************/
+/* async I/Os */
+
+BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
+                                 QEMUIOVector *qiov, int nb_sectors,
+                                 BlockDriverCompletionFunc *cb, void *opaque)
+{
+    trace_bdrv_aio_readv(bs, sector_num, nb_sectors, opaque);
+
+    if (bs->merge_max_bytes) {
+        return bdrv_aio_rw_merge(bs, sector_num, qiov, nb_sectors,
+                                 cb, opaque, false);
+    }
+    return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors, 0,
+                                 cb, opaque, false);
+}
+
+BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
                                   QEMUIOVector *qiov, int nb_sectors,
                                   BlockDriverCompletionFunc *cb, void *opaque)
 {
     trace_bdrv_aio_writev(bs, sector_num, nb_sectors, opaque);
 
+    if (bs->merge_max_bytes) {
+        return bdrv_aio_rw_merge(bs, sector_num, qiov, nb_sectors,
+                                 cb, opaque, true);
+    }
     return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors, 0,
                                  cb, opaque, true);
 }
@@ -3701,6 +4518,9 @@ BlockDriverAIOCB *bdrv_aio_write_zeroes(BlockDriverState *bs,
 {
     trace_bdrv_aio_write_zeroes(bs, sector_num, nb_sectors, flags, opaque);
 
+    /* Keep the order with respect to requests waiting for merging */
+    bdrv_merge_flush(bs);
+
     return bdrv_co_aio_rw_vector(bs, sector_num, NULL, nb_sectors,
                                  BDRV_REQ_ZERO_WRITE | flags,
                                  cb, opaque, true);
@@ -3943,7 +4763,7 @@ static BlockDriverAIOCB *bdrv_aio_rw_vector(BlockDriverState *bs,
     acb->is_write = is_write;
     acb->qiov = qiov;
     acb->bounce = qemu_blockalign(bs, qiov->size);
-    acb->bh = qemu_bh_new(bdrv_aio_bh_cb, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_aio_bh_cb, acb);
 
     if (is_write) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
@@ -3978,6 +4798,7 @@ typedef struct BlockDriverAIOCBCoroutine {
     bool is_write;
     bool *done;
     QEMUBH* bh;
+    int64_t done_ns;    /* 0 unless stage histograms are enabled */
 } BlockDriverAIOCBCoroutine;
 
 static void bdrv_aio_co_cancel_em(BlockDriverAIOCB *blockacb)
@@ -3988,7 +4809,7 @@ static void bdrv_aio_co_cancel_em(BlockDriverAIOCB *blockacb)
 
     acb->done = &done;
     while (!done) {
-        qemu_aio_wait();
+        aio_poll(bdrv_get_aio_context(blockacb->bs), true);
     }
 }
 
@@ -4001,6 +4822,11 @@ static void bdrv_co_em_bh(void *opaque)
 {
     BlockDriverAIOCBCoroutine *acb = opaque;
 
+    if (acb->done_ns) {
+        bdrv_stage_account(acb->common.bs, BDRV_STAGE_COMPLETION,
+                           acb->done_ns);
+    }
+    trace_bdrv_co_aio_complete(acb, acb->common.id, acb->req.error);
     acb->common.cb(acb->common.opaque, acb->req.error);
 
     if (acb->done) {
@@ -4025,7 +4851,9 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque)
             acb->req.nb_sectors, acb->req.qiov, acb->req.flags);
     }
 
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    trace_bdrv_co_aio_done(acb, acb->common.id, acb->req.error);
+    acb->done_ns = bdrv_stage_clock(bs);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -4050,6 +4878,7 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
     acb->done = NULL;
 
     co = qemu_coroutine_create(bdrv_co_do_rw);
+    trace_bdrv_co_aio_start(acb, acb->common.id, co, opaque, is_write);
     qemu_coroutine_enter(co, acb);
 
     return &acb->common;
@@ -4061,7 +4890,7 @@ static void coroutine_fn bdrv_aio_flush_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_flush(bs);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -4073,8 +4902,11 @@ BlockDriverAIOCB *bdrv_aio_flush(BlockDriverState *bs,
     Coroutine *co;
     BlockDriverAIOCBCoroutine *acb;
 
+    bdrv_merge_flush(bs);
+
     acb = qemu_aio_get(&bdrv_em_co_aiocb_info, bs, cb, opaque);
     acb->done = NULL;
+    acb->done_ns = 0;
 
     co = qemu_coroutine_create(bdrv_aio_flush_co_entry);
     qemu_coroutine_enter(co, acb);
@@ -4088,7 +4920,7 @@ static void coroutine_fn bdrv_aio_discard_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_discard(bs, acb->req.sector, acb->req.nb_sectors);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -4101,10 +4933,13 @@ BlockDriverAIOCB *bdrv_aio_discard(BlockDriverState *bs,
 
     trace_bdrv_aio_discard(bs, sector_num, nb_sectors, opaque);
 
+    bdrv_merge_flush(bs);
+
     acb = qemu_aio_get(&bdrv_em_co_aiocb_info, bs, cb, opaque);
     acb->req.sector = sector_num;
     acb->req.nb_sectors = nb_sectors;
     acb->done = NULL;
+    acb->done_ns = 0;
     co = qemu_coroutine_create(bdrv_aio_discard_co_entry);
     qemu_coroutine_enter(co, acb);
 
@@ -4122,6 +4957,16 @@ void bdrv_init_with_whitelist(void)
     bdrv_init();
 }
 
+/* Request IDs are shared by AIOCBs and tracked requests and only serve to
+ * tell apart requests in traces; they are unique across all devices.
+ */
+uint64_t bdrv_new_request_id(void)
+{
+    static uint64_t next_id;
+
+    return atomic_fetch_add(&next_id, 1) + 1;
+}
+
 void *qemu_aio_get(const AIOCBInfo *aiocb_info, BlockDriverState *bs,
                    BlockDriverCompletionFunc *cb, void *opaque)
 {
@@ -4132,6 +4977,7 @@ void *qemu_aio_get(const AIOCBInfo *aiocb_info, BlockDriverState *bs,
     acb->bs = bs;
     acb->cb = cb;
     acb->opaque = opaque;
+    acb->id = bdrv_new_request_id();
     return acb;
 }
 
@@ -4174,7 +5020,8 @@ static int coroutine_fn bdrv_co_io_em(BlockDriverState *bs, int64_t sector_num,
                                       bdrv_co_io_em_complete, &co);
     }
 
-    trace_bdrv_co_io_em(bs, sector_num, nb_sectors, is_write, acb);
+    trace_bdrv_co_io_em(bs, sector_num, nb_sectors, is_write, acb,
+                        co.coroutine);
     if (!acb) {
         return -EIO;
     }
@@ -4206,18 +5053,29 @@ static void coroutine_fn bdrv_flush_co_entry(void *opaque)
 
 int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
 {
+    uint64_t current_gen;
     int ret;
 
     if (!bs || !bdrv_is_inserted(bs) || bdrv_is_read_only(bs)) {
         return 0;
     }
 
+    /* A flush that arrives while another one is in flight waits for it.
+     * Afterwards it only goes to the disk if some write completed after
+     * that flush started, so a burst of flushes costs at most two.
+     */
+    current_gen = bs->write_gen;
+    while (bs->active_flush_req) {
+        qemu_co_queue_wait(&bs->flush_queue);
+    }
+    bs->active_flush_req = true;
+
     /* Write back cached data to the OS even with cache=unsafe */
     BLKDBG_EVENT(bs->file, BLKDBG_FLUSH_TO_OS);
     if (bs->drv->bdrv_co_flush_to_os) {
         ret = bs->drv->bdrv_co_flush_to_os(bs);
         if (ret < 0) {
-            return ret;
+            goto out;
         }
     }
 
@@ -4226,6 +5084,12 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
         goto flush_parent;
     }
 
+    if (bs->flushed_gen >= current_gen) {
+        trace_bdrv_co_flush_merged(bs, current_gen);
+        bs->flush_merged++;
+        goto flush_parent;
+    }
+
     BLKDBG_EVENT(bs->file, BLKDBG_FLUSH_TO_DISK);
     if (bs->drv->bdrv_co_flush_to_disk) {
         ret = bs->drv->bdrv_co_flush_to_disk(bs);
@@ -4257,14 +5121,19 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
         ret = 0;
     }
     if (ret < 0) {
-        return ret;
+        goto out;
     }
+    bs->flushed_gen = current_gen;
 
     /* Now flush the underlying protocol.  It will also have BDRV_O_NO_FLUSH
      * in the case of cache=unsafe, so there are no useless flushes.
      */
 flush_parent:
-    return bdrv_co_flush(bs->file);
+    ret = bdrv_co_flush(bs->file);
+out:
+    bs->active_flush_req = false;
+    qemu_co_queue_restart_all(&bs->flush_queue);
+    return ret;
 }
 
 void bdrv_invalidate_cache(BlockDriverState *bs)
@@ -4304,10 +5173,12 @@ int bdrv_flush(BlockDriverState *bs)
         /* Fast-path if already in coroutine context */
         bdrv_flush_co_entry(&rwco);
     } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
         co = qemu_coroutine_create(bdrv_flush_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(aio_context, true);
         }
     }
 
@@ -4339,7 +5210,9 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
         return -EROFS;
     }
 
-    bdrv_reset_dirty(bs, sector_num, nb_sectors);
+    bdrv_discard_dirty(bs, sector_num, nb_sectors);
+    bdrv_chain_cache_invalidate(bs, sector_num, nb_sectors);
+    bs->write_gen++;
 
     /* Do nothing if disabled.  */
     if (!(bs->open_flags & BDRV_O_UNMAP)) {
@@ -4411,10 +5284,12 @@ int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
         /* Fast-path if already in coroutine context */
         bdrv_discard_co_entry(&rwco);
     } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
         co = qemu_coroutine_create(bdrv_discard_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(aio_context, true);
         }
     }
 
@@ -4531,22 +5406,46 @@ bool bdrv_qiov_is_aligned(BlockDriverState *bs, QEMUIOVector *qiov)
     return true;
 }
 
-BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs, int granularity)
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs, int granularity,
+                                          const char *name, Error **errp)
 {
     int64_t bitmap_size;
     BdrvDirtyBitmap *bitmap;
 
     assert((granularity & (granularity - 1)) == 0);
 
+    if (name && bdrv_find_dirty_bitmap(bs, name)) {
+        error_setg(errp, "Bitmap already exists: %s", name);
+        return NULL;
+    }
+
     granularity >>= BDRV_SECTOR_BITS;
     assert(granularity);
-    bitmap_size = (bdrv_getlength(bs) >> BDRV_SECTOR_BITS);
+    bitmap_size = bdrv_getlength(bs);
+    if (bitmap_size < 0) {
+        error_setg_errno(errp, -bitmap_size, "could not get length of device");
+        return NULL;
+    }
+    bitmap_size >>= BDRV_SECTOR_BITS;
     bitmap = g_malloc0(sizeof(BdrvDirtyBitmap));
     bitmap->bitmap = hbitmap_alloc(bitmap_size, ffs(granularity) - 1);
+    bitmap->name = g_strdup(name);
     QLIST_INSERT_HEAD(&bs->dirty_bitmaps, bitmap, list);
     return bitmap;
 }
 
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs, const char *name)
+{
+    BdrvDirtyBitmap *bm;
+
+    QLIST_FOREACH(bm, &bs->dirty_bitmaps, list) {
+        if (bm->name && !strcmp(name, bm->name)) {
+            return bm;
+        }
+    }
+    return NULL;
+}
+
 void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
 {
     BdrvDirtyBitmap *bm, *next;
@@ -4554,12 +5453,171 @@ void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
         if (bm == bitmap) {
             QLIST_REMOVE(bitmap, list);
             hbitmap_free(bitmap->bitmap);
+            g_free(bitmap->name);
+            g_free(bitmap->filename);
             g_free(bitmap);
             return;
         }
     }
 }
 
+static int bdrv_dirty_bitmap_write(BdrvDirtyBitmap *bitmap, uint32_t flags,
+                                   Error **errp)
+{
+    DirtyBitmapFileHeader *header;
+    DirtyBitmapFileExtent *extent;
+    GByteArray *buf;
+    HBitmapIter hbi;
+    GError *gerr = NULL;
+    uint64_t size = hbitmap_size(bitmap->bitmap);
+    uint64_t nb_extents = 0;
+    uint64_t count;
+    int64_t start;
+    int ret = 0;
+
+    buf = g_byte_array_sized_new(sizeof(*header));
+    g_byte_array_set_size(buf, sizeof(*header));
+
+    hbitmap_iter_init(&hbi, bitmap->bitmap, 0);
+    while ((start = hbitmap_iter_next_extent(&hbi, &count)) >= 0) {
+        g_byte_array_set_size(buf, buf->len + sizeof(*extent));
+        extent = (DirtyBitmapFileExtent *)(buf->data + buf->len) - 1;
+        extent->start = cpu_to_be64(start);
+        extent->count = cpu_to_be64(count);
+        nb_extents++;
+    }
+
+    header = (DirtyBitmapFileHeader *)buf->data;
+    header->magic = cpu_to_be64(DIRTY_BITMAP_MAGIC);
+    header->version = cpu_to_be32(DIRTY_BITMAP_VERSION);
+    header->flags = cpu_to_be32(flags);
+    header->size = cpu_to_be64(size);
+    header->granularity = cpu_to_be32(hbitmap_granularity(bitmap->bitmap));
+    header->reserved = 0;
+    header->nb_extents = cpu_to_be64(nb_extents);
+
+    if (!g_file_set_contents(bitmap->filename, (gchar *)buf->data, buf->len,
+                             &gerr)) {
+        error_setg(errp, "Could not write dirty bitmap file '%s': %s",
+                   bitmap->filename, gerr->message);
+        g_error_free(gerr);
+        ret = -EIO;
+    }
+    g_byte_array_free(buf, true);
+    return ret;
+}
+
+/* Attach the file @filename to @bitmap: the bitmap is loaded from it if it
+ * exists, and will be saved to it when the device is closed.
+ */
+int bdrv_dirty_bitmap_load(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                           const char *filename, Error **errp)
+{
+    DirtyBitmapFileHeader header;
+    DirtyBitmapFileExtent *extents;
+    GError *gerr = NULL;
+    gchar *contents;
+    gsize len;
+    uint64_t size = hbitmap_size(bitmap->bitmap);
+    uint64_t i, nb_extents;
+    int ret;
+
+    assert(bitmap->name && !bitmap->filename);
+
+    if (!g_file_get_contents(filename, &contents, &len, &gerr)) {
+        if (gerr->code != G_FILE_ERROR_NOENT) {
+            error_setg(errp, "Could not read dirty bitmap file '%s': %s",
+                       filename, gerr->message);
+            g_error_free(gerr);
+            return -EIO;
+        }
+        /* New bitmap, nothing to load */
+        g_error_free(gerr);
+        goto attach;
+    }
+
+    if (len < sizeof(header)) {
+        goto invalid;
+    }
+    memcpy(&header, contents, sizeof(header));
+    be64_to_cpus(&header.magic);
+    be32_to_cpus(&header.version);
+    be32_to_cpus(&header.flags);
+    be64_to_cpus(&header.size);
+    be32_to_cpus(&header.granularity);
+    be64_to_cpus(&header.nb_extents);
+
+    if (header.magic != DIRTY_BITMAP_MAGIC ||
+        header.version != DIRTY_BITMAP_VERSION) {
+        goto invalid;
+    }
+    if (header.size != size ||
+        header.granularity != hbitmap_granularity(bitmap->bitmap)) {
+        error_setg(errp, "Dirty bitmap file '%s' does not match the size or "
+                   "granularity of the bitmap", filename);
+        g_free(contents);
+        return -EINVAL;
+    }
+    nb_extents = header.nb_extents;
+    if (nb_extents > (len - sizeof(header)) / sizeof(*extents)) {
+        goto invalid;
+    }
+
+    if (header.flags & DIRTY_BITMAP_IN_USE) {
+        /* The bitmap was not saved, writes may be missing from it */
+        hbitmap_set(bitmap->bitmap, 0, size);
+    } else {
+        extents = (DirtyBitmapFileExtent *)(contents + sizeof(header));
+        for (i = 0; i < nb_extents; i++) {
+            uint64_t start = be64_to_cpu(extents[i].start);
+            uint64_t count = be64_to_cpu(extents[i].count);
+
+            if (start >= size || count > size - start) {
+                hbitmap_reset(bitmap->bitmap, 0, size);
+                goto invalid;
+            }
+            hbitmap_set(bitmap->bitmap, start, count);
+        }
+    }
+    g_free(contents);
+
+attach:
+    bitmap->filename = g_strdup(filename);
+    ret = bdrv_dirty_bitmap_write(bitmap, DIRTY_BITMAP_IN_USE, errp);
+    if (ret < 0) {
+        g_free(bitmap->filename);
+        bitmap->filename = NULL;
+    }
+    return ret;
+
+invalid:
+    error_setg(errp, "Invalid dirty bitmap file '%s'", filename);
+    g_free(contents);
+    return -EINVAL;
+}
+
+/* Save and drop the user-created bitmaps, called when the medium goes away */
+static void bdrv_close_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bm, *next;
+
+    QLIST_FOREACH_SAFE(bm, &bs->dirty_bitmaps, list, next) {
+        if (!bm->name) {
+            continue;
+        }
+        assert(!bm->busy);
+        if (bm->filename) {
+            Error *local_err = NULL;
+
+            if (bdrv_dirty_bitmap_write(bm, 0, &local_err) < 0) {
+                error_report("%s", error_get_pretty(local_err));
+                error_free(local_err);
+            }
+        }
+        bdrv_release_dirty_bitmap(bs, bm);
+    }
+}
+
 BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
 {
     BdrvDirtyBitmap *bm;
@@ -4572,6 +5630,12 @@ BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
         info->count = bdrv_get_dirty_count(bs, bm);
         info->granularity =
             ((int64_t) BDRV_SECTOR_SIZE << hbitmap_granularity(bm->bitmap));
+        info->has_name = !!bm->name;
+        info->name = g_strdup(bm->name);
+        info->has_file = !!bm->filename;
+        info->file = g_strdup(bm->filename);
+        info->has_busy = !!bm->name;
+        info->busy = bm->busy;
         entry->value = info;
         *plist = entry;
         plist = &entry->next;
@@ -4595,6 +5659,21 @@ void bdrv_dirty_iter_init(BlockDriverState *bs,
     hbitmap_iter_init(hbi, bitmap->bitmap, 0);
 }
 
+/* Return the first dirty sector at or after @sector, rounded down to the
+ * granularity of @bitmap, or -1 if there is none.
+ */
+int64_t bdrv_get_next_dirty(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                            int64_t sector)
+{
+    HBitmapIter hbi;
+
+    if (!bitmap || sector >= hbitmap_size(bitmap->bitmap)) {
+        return -1;
+    }
+    hbitmap_iter_init(&hbi, bitmap->bitmap, sector);
+    return hbitmap_iter_next(&hbi);
+}
+
 void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
                     int nr_sectors)
 {
@@ -4604,14 +5683,83 @@ void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
     }
 }
 
-void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector, int nr_sectors)
+/* Discarded sectors need not be copied by jobs, but their contents changed
+ * as far as the user's bitmaps are concerned.
+ */
+static void bdrv_discard_dirty(BlockDriverState *bs, int64_t cur_sector,
+                               int nr_sectors)
 {
     BdrvDirtyBitmap *bitmap;
     QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
-        hbitmap_reset(bitmap->bitmap, cur_sector, nr_sectors);
+        if (bitmap->name) {
+            hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
+        } else {
+            hbitmap_reset(bitmap->bitmap, cur_sector, nr_sectors);
+        }
     }
 }
 
+void bdrv_set_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                           int64_t cur_sector, int nr_sectors)
+{
+    hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
+}
+
+void bdrv_reset_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                             int64_t cur_sector, int nr_sectors)
+{
+    hbitmap_reset(bitmap->bitmap, cur_sector, nr_sectors);
+}
+
+void bdrv_clear_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
+{
+    hbitmap_reset(bitmap->bitmap, 0, hbitmap_size(bitmap->bitmap));
+}
+
+int bdrv_dirty_bitmap_granularity(BlockDriverState *bs,
+                                  BdrvDirtyBitmap *bitmap)
+{
+    return BDRV_SECTOR_SIZE << hbitmap_granularity(bitmap->bitmap);
+}
+
+/* Hand the contents of @bitmap to the caller and start again with an empty
+ * bitmap, so that the bits set from now on can be told apart from the
+ * returned ones.  The bitmap cannot be taken again or removed until the
+ * caller gives the contents back with bdrv_dirty_bitmap_put().
+ */
+HBitmap *bdrv_dirty_bitmap_take(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
+{
+    HBitmap *hb = bitmap->bitmap;
+
+    assert(!bitmap->busy);
+    bitmap->busy = true;
+    bitmap->bitmap = hbitmap_alloc(hbitmap_size(hb), hbitmap_granularity(hb));
+    return hb;
+}
+
+/* Give back the contents returned by bdrv_dirty_bitmap_take().  If @merge
+ * is true the bits in @hb are set again in @bitmap, e.g. because they could
+ * not be consumed; either way @hb is freed.
+ */
+void bdrv_dirty_bitmap_put(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                           HBitmap *hb, bool merge)
+{
+    assert(bitmap->busy);
+    assert(hbitmap_size(hb) == hbitmap_size(bitmap->bitmap));
+    assert(hbitmap_granularity(hb) == hbitmap_granularity(bitmap->bitmap));
+
+    if (merge) {
+        hbitmap_merge(bitmap->bitmap, hb);
+    }
+    hbitmap_free(hb);
+    bitmap->busy = false;
+}
+
+bool bdrv_dirty_bitmap_busy(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->busy;
+}
+
 int64_t bdrv_get_dirty_count(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
 {
     return hbitmap_count(bitmap->bitmap);
@@ -4685,6 +5833,77 @@ void bdrv_iostatus_set_err(BlockDriverState *bs, int error)
     }
 }
 
+/* Add the time integral of the queue depth between @from and @to */
+static void bdrv_acct_window_add_depth(BlockDriverState *bs,
+                                       BlockAcctWindow *w,
+                                       int64_t from, int64_t to)
+{
+    int i;
+
+    if (to <= from) {
+        return;
+    }
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        w->queue_depth_ns[i] += (double)bs->in_flight[i] * (to - from);
+    }
+}
+
+/* Bring the interval statistics up to @now, rolling over every window
+ * whose interval has elapsed.  Must be called before in_flight changes.
+ */
+static void bdrv_acct_advance(BlockDriverState *bs, int64_t now)
+{
+    BlockAcctTimedStats *ts;
+
+    QSLIST_FOREACH(ts, &bs->timed_stats, entries) {
+        int64_t len = ts->interval_length * 1000000000LL;
+        int64_t from = MAX(bs->acct_last_ns, ts->window_start_ns);
+        int64_t end = ts->window_start_ns + len;
+
+        if (now >= end) {
+            bdrv_acct_window_add_depth(bs, &ts->cur, from, end);
+            ts->last = ts->cur;
+            memset(&ts->cur, 0, sizeof(ts->cur));
+            ts->window_start_ns = end;
+            from = end;
+
+            /* more intervals passed without any request starting or
+             * completing; the queue depth stayed the same all along
+             */
+            if (now >= end + len) {
+                memset(&ts->last, 0, sizeof(ts->last));
+                bdrv_acct_window_add_depth(bs, &ts->last, 0, len);
+                ts->window_start_ns = now - (now - end) % len;
+                from = ts->window_start_ns;
+            }
+        }
+        bdrv_acct_window_add_depth(bs, &ts->cur, from, now);
+    }
+    bs->acct_last_ns = now;
+}
+
+void bdrv_acct_update_timed_stats(BlockDriverState *bs)
+{
+    bdrv_acct_advance(bs, get_clock());
+}
+
+static void bdrv_latency_histogram_account(BlockLatencyHistogram *hist,
+                                           uint64_t latency_ns)
+{
+    int lo = 0, hi = hist->nbins - 1;
+
+    /* find the first boundary that is greater than latency_ns */
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (latency_ns < hist->boundaries[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    hist->bins[lo]++;
+}
+
 void
 bdrv_acct_start(BlockDriverState *bs, BlockAcctCookie *cookie, int64_t bytes,
         enum BlockAcctType type)
@@ -4694,16 +5913,166 @@ bdrv_acct_start(BlockDriverState *bs, BlockAcctCookie *cookie, int64_t bytes,
     cookie->bytes = bytes;
     cookie->start_time_ns = get_clock();
     cookie->type = type;
+
+    bdrv_acct_advance(bs, cookie->start_time_ns);
+    bs->in_flight[type]++;
 }
 
 void
 bdrv_acct_done(BlockDriverState *bs, BlockAcctCookie *cookie)
 {
-    assert(cookie->type < BDRV_MAX_IOTYPE);
+    enum BlockAcctType type = cookie->type;
+    int64_t now = get_clock();
+    uint64_t latency_ns = now - cookie->start_time_ns;
+    BlockAcctTimedStats *ts;
+
+    assert(type < BDRV_MAX_IOTYPE);
+
+    bs->nr_bytes[type] += cookie->bytes;
+    bs->nr_ops[type]++;
+    bs->total_time_ns[type] += latency_ns;
+
+    if (bs->latency_histogram[type].nbins) {
+        bdrv_latency_histogram_account(&bs->latency_histogram[type],
+                                       latency_ns);
+    }
+
+    bdrv_acct_advance(bs, now);
+    QSLIST_FOREACH(ts, &bs->timed_stats, entries) {
+        BlockAcctWindow *w = &ts->cur;
+
+        if (!w->nr_ops[type] || latency_ns < w->min_time_ns[type]) {
+            w->min_time_ns[type] = latency_ns;
+        }
+        if (latency_ns > w->max_time_ns[type]) {
+            w->max_time_ns[type] = latency_ns;
+        }
+        w->nr_ops[type]++;
+        w->total_time_ns[type] += latency_ns;
+    }
+
+    assert(bs->in_flight[type] > 0);
+    if (--bs->in_flight[type] == 0 &&
+        !bs->in_flight[BDRV_ACCT_READ] &&
+        !bs->in_flight[BDRV_ACCT_WRITE] &&
+        !bs->in_flight[BDRV_ACCT_FLUSH]) {
+        bs->acct_idle_start_ns = now;
+    }
+}
+
+/* Set the latency histogram bins for one request type and clear its
+ * counters.  @boundaries must be strictly increasing and are given in
+ * nanoseconds; with nboundaries == 0 the histogram is disabled.
+ */
+static int bdrv_latency_histogram_set(BlockLatencyHistogram *hist,
+                                      const uint64_t *boundaries,
+                                      int nboundaries)
+{
+    int i;
 
-    bs->nr_bytes[cookie->type] += cookie->bytes;
-    bs->nr_ops[cookie->type]++;
-    bs->total_time_ns[cookie->type] += get_clock() - cookie->start_time_ns;
+    for (i = 1; i < nboundaries; i++) {
+        if (boundaries[i] <= boundaries[i - 1]) {
+            return -EINVAL;
+        }
+    }
+
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+    memset(hist, 0, sizeof(*hist));
+
+    if (nboundaries > 0) {
+        hist->nbins = nboundaries + 1;
+        hist->boundaries = g_memdup(boundaries,
+                                    nboundaries * sizeof(*boundaries));
+        hist->bins = g_new0(uint64_t, hist->nbins);
+    }
+    return 0;
+}
+
+int bdrv_set_latency_histogram(BlockDriverState *bs, enum BlockAcctType type,
+                               const uint64_t *boundaries, int nboundaries)
+{
+    assert(type < BDRV_MAX_IOTYPE);
+    return bdrv_latency_histogram_set(&bs->latency_histogram[type],
+                                      boundaries, nboundaries);
+}
+
+/* Same as bdrv_set_latency_histogram(), for the time that read and write
+ * requests spend in one stage of the block layer.
+ */
+int bdrv_set_stage_histogram(BlockDriverState *bs,
+                             enum BlockRequestStage stage,
+                             const uint64_t *boundaries, int nboundaries)
+{
+    assert(stage < BDRV_MAX_STAGE);
+    return bdrv_latency_histogram_set(&bs->stage_histogram[stage],
+                                      boundaries, nboundaries);
+}
+
+/* Returns the current time if any stage histogram is enabled, else 0 so
+ * that requests do not read the clock for nothing.
+ */
+static int64_t bdrv_stage_clock(BlockDriverState *bs)
+{
+    int i;
+
+    for (i = 0; i < BDRV_MAX_STAGE; i++) {
+        if (bs->stage_histogram[i].nbins) {
+            return get_clock();
+        }
+    }
+    return 0;
+}
+
+static void bdrv_stage_account(BlockDriverState *bs,
+                               enum BlockRequestStage stage, int64_t since_ns)
+{
+    BlockLatencyHistogram *hist = &bs->stage_histogram[stage];
+
+    if (hist->nbins) {
+        bdrv_latency_histogram_account(hist, get_clock() - since_ns);
+    }
+}
+
+/* Keep statistics over intervals of @interval_length seconds, in
+ * addition to the cumulative ones.  Adding an interval that is already
+ * tracked does nothing.
+ */
+void bdrv_add_timed_stats(BlockDriverState *bs, unsigned interval_length)
+{
+    BlockAcctTimedStats *ts;
+
+    assert(interval_length > 0);
+
+    QSLIST_FOREACH(ts, &bs->timed_stats, entries) {
+        if (ts->interval_length == interval_length) {
+            return;
+        }
+    }
+
+    bdrv_acct_update_timed_stats(bs);
+
+    ts = g_new0(BlockAcctTimedStats, 1);
+    ts->interval_length = interval_length;
+    ts->window_start_ns = bs->acct_last_ns;
+    QSLIST_INSERT_HEAD(&bs->timed_stats, ts, entries);
+}
+
+static void bdrv_acct_cleanup(BlockDriverState *bs)
+{
+    int i;
+
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        bdrv_set_latency_histogram(bs, i, NULL, 0);
+    }
+    for (i = 0; i < BDRV_MAX_STAGE; i++) {
+        bdrv_set_stage_histogram(bs, i, NULL, 0);
+    }
+    while (!QSLIST_EMPTY(&bs->timed_stats)) {
+        BlockAcctTimedStats *ts = QSLIST_FIRST(&bs->timed_stats);
+        QSLIST_REMOVE_HEAD(&bs->timed_stats, entries);
+        g_free(ts);
+    }
 }
 
 void bdrv_img_create(const char *filename, const char *fmt,
@@ -4857,8 +6226,190 @@ out:
 
 AioContext *bdrv_get_aio_context(BlockDriverState *bs)
 {
-    /* Currently BlockDriverState always uses the main loop AioContext */
-    return qemu_get_aio_context();
+    return bs->aio_context;
+}
+
+static void bdrv_detach_aio_context(BlockDriverState *bs)
+{
+    BdrvAioNotifier *ban;
+
+    if (!bs->drv) {
+        return;
+    }
+
+    QLIST_FOREACH(ban, &bs->aio_notifiers, list) {
+        ban->detach_aio_context(ban->opaque);
+    }
+
+    if (bs->io_limits_enabled && !bs->throttle_group) {
+        throttle_detach_aio_context(&bs->throttle_state);
+    }
+    if (bs->merge_timer) {
+        timer_del(bs->merge_timer);
+        timer_free(bs->merge_timer);
+        bs->merge_timer = NULL;
+    }
+    if (bs->drv->bdrv_detach_aio_context) {
+        bs->drv->bdrv_detach_aio_context(bs);
+    }
+    if (bs->file) {
+        bdrv_detach_aio_context(bs->file);
+    }
+    if (bs->backing_hd) {
+        bdrv_detach_aio_context(bs->backing_hd);
+    }
+
+    bs->aio_context = NULL;
+}
+
+static void bdrv_attach_aio_context(BlockDriverState *bs,
+                                    AioContext *new_context)
+{
+    BdrvAioNotifier *ban;
+
+    if (!bs->drv) {
+        return;
+    }
+
+    bs->aio_context = new_context;
+
+    if (bs->backing_hd) {
+        bdrv_attach_aio_context(bs->backing_hd, new_context);
+    }
+    if (bs->file) {
+        bdrv_attach_aio_context(bs->file, new_context);
+    }
+    if (bs->drv->bdrv_attach_aio_context) {
+        bs->drv->bdrv_attach_aio_context(bs, new_context);
+    }
+    if (bs->io_limits_enabled && !bs->throttle_group) {
+        throttle_attach_aio_context(&bs->throttle_state, new_context);
+    }
+    if (bs->merge_timeout_ns) {
+        bs->merge_timer = aio_timer_new(new_context, QEMU_CLOCK_REALTIME,
+                                        SCALE_NS, bdrv_merge_timer_cb, bs);
+    }
+
+    QLIST_FOREACH(ban, &bs->aio_notifiers, list) {
+        ban->attached_aio_context(new_context, ban->opaque);
+    }
+}
+
+bool bdrv_can_set_aio_context(BlockDriverState *bs)
+{
+    if (!bs->drv) {
+        return true;
+    }
+
+    /* Throttle groups are shared with drives in other contexts */
+    if (bs->throttle_group) {
+        return false;
+    }
+
+    /* Format drivers only do I/O through bs->file and bs->backing_hd, but
+     * protocol drivers may register their own fd handlers and timers
+     */
+    if (bs->drv->protocol_name && !bs->drv->bdrv_attach_aio_context) {
+        return false;
+    }
+    if (bs->file && !bdrv_can_set_aio_context(bs->file)) {
+        return false;
+    }
+    if (bs->backing_hd && !bdrv_can_set_aio_context(bs->backing_hd)) {
+        return false;
+    }
+    return true;
+}
+
+void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context)
+{
+    bdrv_drain_all(); /* ensure there are no in-flight requests */
+
+    bdrv_detach_aio_context(bs);
+
+    /* This function executes in the old AioContext so acquire the new one in
+     * case it runs in a different thread.
+     */
+    aio_context_acquire(new_context);
+    bdrv_attach_aio_context(bs, new_context);
+    aio_context_release(new_context);
+}
+
+void bdrv_add_aio_context_notifier(BlockDriverState *bs,
+        void (*attached_aio_context)(AioContext *new_context, void *opaque),
+        void (*detach_aio_context)(void *opaque), void *opaque)
+{
+    BdrvAioNotifier *ban = g_new(BdrvAioNotifier, 1);
+    *ban = (BdrvAioNotifier){
+        .attached_aio_context = attached_aio_context,
+        .detach_aio_context   = detach_aio_context,
+        .opaque               = opaque
+    };
+
+    QLIST_INSERT_HEAD(&bs->aio_notifiers, ban, list);
+}
+
+void bdrv_remove_aio_context_notifier(BlockDriverState *bs,
+                                      void (*attached_aio_context)(AioContext *,
+                                                                   void *),
+                                      void (*detach_aio_context)(void *),
+                                      void *opaque)
+{
+    BdrvAioNotifier *ban, *ban_next;
+
+    QLIST_FOREACH_SAFE(ban, &bs->aio_notifiers, list, ban_next) {
+        if (ban->attached_aio_context == attached_aio_context &&
+            ban->detach_aio_context   == detach_aio_context   &&
+            ban->opaque               == opaque)
+        {
+            QLIST_REMOVE(ban, list);
+            g_free(ban);
+
+            return;
+        }
+    }
+
+    abort();
+}
+
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    bs->io_plugged++;
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    assert(bs->io_plugged > 0);
+    if (--bs->io_plugged == 0) {
+        /* End of the batch, queue the merged request before unplugging */
+        bdrv_merge_flush(bs);
+    }
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
+void bdrv_flush_io_queue(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    bdrv_merge_flush(bs);
+    if (drv && drv->bdrv_flush_io_queue) {
+        drv->bdrv_flush_io_queue(bs);
+    } else if (bs->file) {
+        bdrv_flush_io_queue(bs->file);
+    }
 }
 
 void bdrv_add_before_write_notifier(BlockDriverState *bs,
@@ -38,6 +38,9 @@ typedef struct BackupBlockJob {
     BlockJob common;
     BlockDriverState *target;
     MirrorSyncMode sync_mode;
+    BdrvDirtyBitmap *sync_bitmap;
+    HBitmap *sync_snapshot; /* contents of sync_bitmap when the job started */
+    int64_t total_sectors;
     RateLimit limit;
     BlockdevOnError on_source_error;
     BlockdevOnError on_target_error;
@@ -116,8 +119,7 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
         trace_backup_do_cow_process(job, start);
 
         n = MIN(BACKUP_SECTORS_PER_CLUSTER,
-                job->common.len / BDRV_SECTOR_SIZE -
-                start * BACKUP_SECTORS_PER_CLUSTER);
+                job->total_sectors - start * BACKUP_SECTORS_PER_CLUSTER);
 
         if (!bounce_buffer) {
             bounce_buffer = qemu_blockalign(bs, BACKUP_CLUSTER_SIZE);
@@ -222,9 +224,33 @@ static BlockErrorAction backup_error_action(BackupBlockJob *job,
     }
 }
 
+typedef struct {
+    int ret;
+} BackupCompleteData;
+
+static void backup_complete(BlockJob *job, void *opaque)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+    BackupCompleteData *data = opaque;
+
+    if (s->sync_bitmap) {
+        /* Unless everything was copied, the bits must be set again so that
+         * the next backup picks up the data */
+        bdrv_dirty_bitmap_put(job->bs, s->sync_bitmap, s->sync_snapshot,
+                              data->ret < 0 ||
+                              block_job_is_cancelled(job));
+    }
+
+    bdrv_unref(s->target);
+
+    block_job_completed(job, data->ret);
+    g_free(data);
+}
+
 static void coroutine_fn backup_run(void *opaque)
 {
     BackupBlockJob *job = opaque;
+    BackupCompleteData *data;
     BlockDriverState *bs = job->common.bs;
     BlockDriverState *target = job->target;
     BlockdevOnError on_target_error = job->on_target_error;
@@ -243,6 +269,34 @@ static void coroutine_fn backup_run(void *opaque)
 
     job->bitmap = hbitmap_alloc(end, 0);
 
+    if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL && end > 0) {
+        HBitmapIter hbi;
+        int64_t sector;
+        int64_t granule = 1LL << hbitmap_granularity(job->sync_snapshot);
+
+        /* Mark the clean clusters as already copied, so that neither the
+         * loop below nor guest writes copy them */
+        hbitmap_set(job->bitmap, 0, end);
+        hbitmap_iter_init(&hbi, job->sync_snapshot, 0);
+        while ((sector = hbitmap_iter_next(&hbi)) >= 0) {
+            int64_t first = sector / BACKUP_SECTORS_PER_CLUSTER;
+            int64_t last = MIN(sector + granule, job->total_sectors);
+
+            last = DIV_ROUND_UP(last, BACKUP_SECTORS_PER_CLUSTER);
+            if (first < last) {
+                hbitmap_reset(job->bitmap, first, last - first);
+            }
+        }
+
+        /* Only the dirty clusters count towards progress */
+        job->common.len = (end - hbitmap_count(job->bitmap)) *
+                          BACKUP_CLUSTER_SIZE;
+        if (!hbitmap_get(job->bitmap, end - 1)) {
+            job->common.len -= end * BACKUP_CLUSTER_SIZE -
+                               job->total_sectors * BDRV_SECTOR_SIZE;
+        }
+    }
+
     bdrv_set_enable_write_cache(target, true);
     bdrv_set_on_error(target, on_target_error, on_target_error);
     bdrv_iostatus_enable(target);
@@ -258,7 +312,7 @@ static void coroutine_fn backup_run(void *opaque)
             job->common.busy = true;
         }
     } else {
-        /* Both FULL and TOP SYNC_MODE's require copying.. */
+        /* FULL, TOP and INCREMENTAL SYNC_MODE's require copying.. */
         for (; start < end; start++) {
             bool error_is_read;
 
@@ -266,6 +320,12 @@ static void coroutine_fn backup_run(void *opaque)
                 break;
             }
 
+            /* Skip clean clusters without yielding, there can be many */
+            if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL &&
+                hbitmap_get(job->bitmap, start)) {
+                continue;
+            }
+
             /* we need to yield so that qemu_aio_flush() returns.
              * (without, VM does not reboot)
              */
@@ -339,13 +399,16 @@ static void coroutine_fn backup_run(void *opaque)
     hbitmap_free(job->bitmap);
 
     bdrv_iostatus_disable(target);
-    bdrv_unref(target);
 
-    block_job_completed(&job->common, ret);
+    /* Close the target in main loop */
+    data = g_malloc(sizeof(*data));
+    data->ret = ret;
+    block_job_defer_to_main_loop(&job->common, backup_complete, data);
 }
 
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, MirrorSyncMode sync_mode,
+                  BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb, void *opaque,
@@ -356,6 +419,7 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
     assert(bs);
     assert(target);
     assert(cb);
+    assert(!sync_bitmap == (sync_mode != MIRROR_SYNC_MODE_INCREMENTAL));
 
     if ((on_source_error == BLOCKDEV_ON_ERROR_STOP ||
          on_source_error == BLOCKDEV_ON_ERROR_ENOSPC) &&
@@ -381,7 +445,14 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
     job->on_target_error = on_target_error;
     job->target = target;
     job->sync_mode = sync_mode;
+    job->total_sectors = len / BDRV_SECTOR_SIZE;
     job->common.len = len;
+
+    /* Writes from now on go to the next incremental backup */
+    if (sync_bitmap) {
+        job->sync_bitmap = sync_bitmap;
+        job->sync_snapshot = bdrv_dirty_bitmap_take(bs, sync_bitmap);
+    }
     job->common.co = qemu_coroutine_create(backup_run);
     qemu_coroutine_enter(job->common.co, job);
 }
@@ -0,0 +1,1148 @@
+/*
+ * Persistent local read cache for remote images
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "qemu/bswap.h"
+#include "qemu/queue.h"
+
+/*
+ * The cache file starts with a header, followed by a table with one entry
+ * per slot and by the slots themselves, each of which holds one cluster of
+ * the image:
+ *
+ *   [ header | entry table | padding | slot 0 | slot 1 | ... ]
+ *
+ * Entries of clean slots are only written on a clean close.  While the
+ * cache is open the header has BLKCACHE_IN_USE set; if it is still set on
+ * the next open, the clean entries may be stale and are dropped.  Entries
+ * of dirty slots (write-back mode) are written, and the cache file flushed,
+ * before a write is completed and before a slot that the table marks dirty
+ * is reused, so dirty data survives a crash.
+ */
+
+#define BLKCACHE_MAGIC              "QEMUBLKC"
+#define BLKCACHE_VERSION            1
+#define BLKCACHE_HEADER_SIZE        4096
+#define BLKCACHE_IMAGE_NAME_SIZE    1024
+
+#define BLKCACHE_IN_USE             1
+
+#define BLKCACHE_ENTRY_VALID        1
+#define BLKCACHE_ENTRY_DIRTY        2
+
+#define BLKCACHE_DEFAULT_CLUSTER    (64 * 1024)
+#define BLKCACHE_MIN_CLUSTER        4096
+#define BLKCACHE_MAX_CLUSTER        (2 * 1024 * 1024)
+
+/* How many dirty slots an allocation writes back before giving up */
+#define BLKCACHE_MAX_WRITEBACKS     4
+
+/* Larger misses bypass the cache instead of allocating a bounce buffer */
+#define BLKCACHE_MAX_FILL           (16 * 1024 * 1024)
+
+typedef struct QEMU_PACKED BlkcacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t cluster_size;
+    uint32_t reserved;
+    uint64_t nb_slots;
+    uint64_t image_size;
+    char image[BLKCACHE_IMAGE_NAME_SIZE];
+} BlkcacheHeader;
+
+typedef struct QEMU_PACKED BlkcacheEntry {
+    uint64_t cluster;
+    uint32_t flags;
+    uint32_t reserved;
+} BlkcacheEntry;
+
+typedef enum {
+    BLKCACHE_SLOT_FREE,
+    BLKCACHE_SLOT_FILLING,      /* data is being written, not readable yet */
+    BLKCACHE_SLOT_VALID,
+} BlkcacheSlotState;
+
+typedef struct BlkcacheSlot {
+    int64_t cluster;            /* hash key, -1 while the slot is free */
+    BlkcacheSlotState state;
+    bool dirty;                 /* newer than the image */
+    bool disk_dirty;            /* the entry in the cache file says dirty */
+    unsigned busy;              /* requests using the data in the slot */
+    uint64_t gen;               /* incremented by each write to the slot */
+    QTAILQ_ENTRY(BlkcacheSlot) next;
+} BlkcacheSlot;
+
+/* A range of clusters touched by an in-flight fill or write */
+typedef struct BlkcacheRange {
+    int64_t first;
+    int64_t last;
+    bool conflict;              /* fills only: a write overlapped */
+    QLIST_ENTRY(BlkcacheRange) next;
+} BlkcacheRange;
+
+typedef struct BDRVBlkcacheState {
+    BlockDriverState *image;
+    char *image_name;
+
+    int cluster_sectors;
+    uint64_t nb_slots;
+    int64_t table_offset;
+    int64_t data_offset;
+    bool writeback;
+    bool lru;
+
+    BlkcacheSlot *slots;
+    GHashTable *map;
+    /* Eviction order: free slots first, then the oldest valid ones */
+    QTAILQ_HEAD(, BlkcacheSlot) lru_list;
+
+    QLIST_HEAD(, BlkcacheRange) fills;
+    QLIST_HEAD(, BlkcacheRange) writes;
+
+    uint64_t nb_used;
+    uint64_t nb_dirty;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+} BDRVBlkcacheState;
+
+static int64_t blkcache_slot_sector(BDRVBlkcacheState *s, BlkcacheSlot *slot)
+{
+    return (s->data_offset >> BDRV_SECTOR_BITS) +
+           (slot - s->slots) * s->cluster_sectors;
+}
+
+/* Number of sectors of the image in @cluster; only the last one is short */
+static int blkcache_cluster_len(BlockDriverState *bs, int64_t cluster)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t start = cluster * s->cluster_sectors;
+
+    return MIN(s->cluster_sectors, bs->total_sectors - start);
+}
+
+static BlkcacheSlot *blkcache_lookup(BDRVBlkcacheState *s, int64_t cluster)
+{
+    return g_hash_table_lookup(s->map, &cluster);
+}
+
+static void blkcache_touch(BDRVBlkcacheState *s, BlkcacheSlot *slot)
+{
+    if (s->lru) {
+        QTAILQ_REMOVE(&s->lru_list, slot, next);
+        QTAILQ_INSERT_TAIL(&s->lru_list, slot, next);
+    }
+}
+
+static void blkcache_insert(BDRVBlkcacheState *s, BlkcacheSlot *slot,
+                            int64_t cluster, BlkcacheSlotState state)
+{
+    slot->cluster = cluster;
+    slot->state = state;
+    g_hash_table_insert(s->map, &slot->cluster, slot);
+    QTAILQ_REMOVE(&s->lru_list, slot, next);
+    QTAILQ_INSERT_TAIL(&s->lru_list, slot, next);
+    s->nb_used++;
+}
+
+/* Forget the contents of a slot.  Requests still reading it are not
+ * disturbed, the slot is only reused once they are done. */
+static void blkcache_drop(BDRVBlkcacheState *s, BlkcacheSlot *slot)
+{
+    if (slot->state == BLKCACHE_SLOT_FREE) {
+        return;
+    }
+
+    g_hash_table_remove(s->map, &slot->cluster);
+    slot->cluster = -1;
+    slot->state = BLKCACHE_SLOT_FREE;
+    if (slot->dirty) {
+        slot->dirty = false;
+        s->nb_dirty--;
+    }
+    s->nb_used--;
+
+    QTAILQ_REMOVE(&s->lru_list, slot, next);
+    QTAILQ_INSERT_HEAD(&s->lru_list, slot, next);
+}
+
+static int blkcache_write_entry(BlockDriverState *bs, BlkcacheSlot *slot,
+                                int64_t cluster, uint32_t flags)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheEntry entry = {
+        .cluster = cpu_to_le64(cluster),
+        .flags   = cpu_to_le32(flags),
+    };
+
+    return bdrv_pwrite(bs->file,
+                       s->table_offset + (slot - s->slots) * sizeof(entry),
+                       &entry, sizeof(entry));
+}
+
+static int blkcache_write_header(BlockDriverState *bs, bool in_use)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheHeader header = {
+        .version      = cpu_to_le32(BLKCACHE_VERSION),
+        .flags        = cpu_to_le32(in_use ? BLKCACHE_IN_USE : 0),
+        .cluster_size = cpu_to_le32(s->cluster_sectors * BDRV_SECTOR_SIZE),
+        .nb_slots     = cpu_to_le64(s->nb_slots),
+        .image_size   = cpu_to_le64(bs->total_sectors * BDRV_SECTOR_SIZE),
+    };
+    int ret;
+
+    memcpy(header.magic, BLKCACHE_MAGIC, sizeof(header.magic));
+    pstrcpy(header.image, sizeof(header.image), s->image_name);
+
+    ret = bdrv_pwrite(bs->file, 0, &header, sizeof(header));
+    if (ret < 0) {
+        return ret;
+    }
+    return bdrv_flush(bs->file);
+}
+
+/*
+ * Copy a dirty slot back to the image.  Works both in and outside of
+ * coroutine context.  The slot stays dirty if it was written meanwhile.
+ */
+static int blkcache_writeback(BlockDriverState *bs, BlkcacheSlot *slot)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t cluster = slot->cluster;
+    int n = blkcache_cluster_len(bs, cluster);
+    uint64_t gen = slot->gen;
+    uint8_t *buf;
+    int ret;
+
+    buf = qemu_blockalign(bs, n * BDRV_SECTOR_SIZE);
+    slot->busy++;
+
+    ret = bdrv_read(bs->file, blkcache_slot_sector(s, slot), buf, n);
+    if (ret >= 0) {
+        ret = bdrv_write(s->image, cluster * s->cluster_sectors, buf, n);
+    }
+
+    slot->busy--;
+    qemu_vfree(buf);
+
+    if (ret < 0) {
+        return ret;
+    }
+    if (slot->gen == gen && slot->dirty && slot->cluster == cluster) {
+        slot->dirty = false;
+        s->nb_dirty--;
+        s->writebacks++;
+    }
+    return 0;
+}
+
+static int blkcache_writeback_all(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t i;
+    int ret = 0;
+
+    for (i = 0; i < s->nb_slots; i++) {
+        BlkcacheSlot *slot = &s->slots[i];
+
+        if (slot->dirty) {
+            int r = blkcache_writeback(bs, slot);
+            if (r < 0 && ret == 0) {
+                ret = r;
+            }
+        }
+    }
+
+    if (ret == 0 && s->nb_dirty == 0) {
+        ret = bdrv_flush(s->image);
+    }
+    return ret;
+}
+
+/*
+ * Find a slot for new data: a free one, or else the least recently used
+ * (or oldest, with the fifo policy) one that nobody is using.  Dirty slots
+ * are written back first.  Returns NULL if no slot could be freed, in which
+ * case the caller goes without caching.
+ *
+ * The returned slot is free and marked busy; since this may yield, the
+ * caller must check again whether it still needs it.
+ */
+static BlkcacheSlot *coroutine_fn blkcache_co_alloc(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheSlot *slot;
+    int writebacks = 0;
+    int ret;
+
+retry:
+    QTAILQ_FOREACH(slot, &s->lru_list, next) {
+        if (slot->busy || slot->state == BLKCACHE_SLOT_FILLING) {
+            continue;
+        }
+        if (slot->dirty) {
+            if (writebacks++ == BLKCACHE_MAX_WRITEBACKS) {
+                return NULL;
+            }
+            blkcache_writeback(bs, slot);
+            goto retry;
+        }
+        break;
+    }
+    if (!slot) {
+        return NULL;
+    }
+
+    if (slot->state == BLKCACHE_SLOT_VALID) {
+        s->evictions++;
+    }
+    blkcache_drop(s, slot);
+    slot->busy++;
+
+    /* The table must not claim dirty data for another cluster once the
+     * slot holds something else */
+    if (slot->disk_dirty) {
+        ret = blkcache_write_entry(bs, slot, -1, 0);
+        if (ret >= 0) {
+            ret = bdrv_co_flush(bs->file);
+        }
+        if (ret < 0) {
+            slot->busy--;
+            return NULL;
+        }
+        slot->disk_dirty = false;
+    }
+
+    return slot;
+}
+
+static void blkcache_put_slot(BDRVBlkcacheState *s, BlkcacheSlot *slot)
+{
+    slot->busy--;
+}
+
+static bool blkcache_overlaps(BlkcacheRange *a, int64_t first, int64_t last)
+{
+    return a->first <= last && first <= a->last;
+}
+
+static void blkcache_add_fill(BDRVBlkcacheState *s, BlkcacheRange *fill,
+                              int64_t first, int64_t last)
+{
+    BlkcacheRange *w;
+
+    fill->first = first;
+    fill->last = last;
+    fill->conflict = false;
+    QLIST_FOREACH(w, &s->writes, next) {
+        if (blkcache_overlaps(w, first, last)) {
+            fill->conflict = true;
+        }
+    }
+    QLIST_INSERT_HEAD(&s->fills, fill, next);
+}
+
+/* Any fill that overlaps a write in time can hold stale data, so it must
+ * not make it into the cache. */
+static void blkcache_add_write(BDRVBlkcacheState *s, BlkcacheRange *write,
+                               int64_t first, int64_t last)
+{
+    BlkcacheRange *f;
+
+    write->first = first;
+    write->last = last;
+    QLIST_FOREACH(f, &s->fills, next) {
+        if (blkcache_overlaps(f, first, last)) {
+            f->conflict = true;
+        }
+    }
+    QLIST_INSERT_HEAD(&s->writes, write, next);
+}
+
+/* Insert clusters @first..@last, read from the image into @buf */
+static void coroutine_fn blkcache_co_fill(BlockDriverState *bs,
+                                          BlkcacheRange *fill, uint8_t *buf)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t cluster;
+
+    for (cluster = fill->first; cluster <= fill->last; cluster++) {
+        uint8_t *data = buf + (cluster - fill->first) * s->cluster_sectors *
+                              BDRV_SECTOR_SIZE;
+        int n = blkcache_cluster_len(bs, cluster);
+        BlkcacheSlot *slot;
+        QEMUIOVector qiov;
+        struct iovec iov;
+        int ret;
+
+        if (fill->conflict) {
+            return;
+        }
+        if (blkcache_lookup(s, cluster)) {
+            continue;
+        }
+
+        slot = blkcache_co_alloc(bs);
+        if (!slot) {
+            return;
+        }
+        if (fill->conflict || blkcache_lookup(s, cluster)) {
+            blkcache_put_slot(s, slot);
+            continue;
+        }
+
+        blkcache_insert(s, slot, cluster, BLKCACHE_SLOT_FILLING);
+
+        iov.iov_base = data;
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_writev(bs->file, blkcache_slot_sector(s, slot), n, &qiov);
+
+        blkcache_put_slot(s, slot);
+        if (ret < 0 || fill->conflict) {
+            blkcache_drop(s, slot);
+        } else {
+            slot->state = BLKCACHE_SLOT_VALID;
+        }
+    }
+}
+
+/* Read clusters @first..@last, none of which is cached, from the image */
+static int coroutine_fn blkcache_co_read_miss(BlockDriverState *bs,
+                                              int64_t first, int64_t last,
+                                              int64_t sector_num,
+                                              int nb_sectors,
+                                              QEMUIOVector *qiov,
+                                              size_t qiov_offset)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t start = first * s->cluster_sectors;
+    int n = (last - first) * s->cluster_sectors +
+            blkcache_cluster_len(bs, last);
+    BlkcacheRange fill;
+    QEMUIOVector hd_qiov;
+    struct iovec iov;
+    uint8_t *buf;
+    int ret;
+
+    s->misses += last - first + 1;
+
+    if ((int64_t)n * BDRV_SECTOR_SIZE > BLKCACHE_MAX_FILL) {
+        /* Too big to bounce, read it straight into the guest buffer */
+        qemu_iovec_init(&hd_qiov, qiov->niov);
+        qemu_iovec_concat(&hd_qiov, qiov, qiov_offset,
+                          nb_sectors * BDRV_SECTOR_SIZE);
+        ret = bdrv_co_readv(s->image, sector_num, nb_sectors, &hd_qiov);
+        qemu_iovec_destroy(&hd_qiov);
+        return ret;
+    }
+
+    buf = qemu_blockalign(bs, n * BDRV_SECTOR_SIZE);
+    blkcache_add_fill(s, &fill, first, last);
+
+    iov.iov_base = buf;
+    iov.iov_len = n * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&hd_qiov, &iov, 1);
+    ret = bdrv_co_readv(s->image, start, n, &hd_qiov);
+    if (ret >= 0) {
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            buf + (sector_num - start) * BDRV_SECTOR_SIZE,
+                            nb_sectors * BDRV_SECTOR_SIZE);
+        blkcache_co_fill(bs, &fill, buf);
+    }
+
+    QLIST_REMOVE(&fill, next);
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_readv(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors,
+                                          QEMUIOVector *qiov)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    QEMUIOVector hd_qiov;
+    size_t qiov_offset = 0;
+    int ret = 0;
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
+    while (nb_sectors > 0) {
+        int64_t cluster = sector_num / s->cluster_sectors;
+        int64_t last = cluster;
+        int offset = sector_num % s->cluster_sectors;
+        int n = MIN(nb_sectors, s->cluster_sectors - offset);
+        BlkcacheSlot *slot = blkcache_lookup(s, cluster);
+
+        if (slot && slot->state == BLKCACHE_SLOT_VALID) {
+            /* Hits in consecutive slots are read in one go */
+            BlkcacheSlot *next = slot;
+            int i, nb_slots = 1;
+
+            while (n < nb_sectors && next + 1 < s->slots + s->nb_slots) {
+                BlkcacheSlot *p = blkcache_lookup(s, last + 1);
+                if (p != next + 1 || p->state != BLKCACHE_SLOT_VALID) {
+                    break;
+                }
+                next = p;
+                last++;
+                nb_slots++;
+                n = MIN(nb_sectors, n + s->cluster_sectors);
+            }
+
+            for (i = 0; i < nb_slots; i++) {
+                slot[i].busy++;
+                blkcache_touch(s, &slot[i]);
+            }
+            s->hits += nb_slots;
+
+            qemu_iovec_reset(&hd_qiov);
+            qemu_iovec_concat(&hd_qiov, qiov, qiov_offset,
+                              n * BDRV_SECTOR_SIZE);
+            ret = bdrv_co_readv(bs->file, blkcache_slot_sector(s, slot) +
+                                offset, n, &hd_qiov);
+
+            for (i = 0; i < nb_slots; i++) {
+                blkcache_put_slot(s, &slot[i]);
+            }
+
+            if (ret < 0) {
+                /* A broken cache only costs performance, unless it holds
+                 * the only copy of the data */
+                for (i = 0; i < nb_slots; i++) {
+                    if (slot[i].dirty) {
+                        goto out;
+                    }
+                }
+                for (i = 0; i < nb_slots; i++) {
+                    if (slot[i].cluster == cluster + i) {
+                        blkcache_drop(s, &slot[i]);
+                    }
+                }
+                ret = bdrv_co_readv(s->image, sector_num, n, &hd_qiov);
+            }
+        } else {
+            /* Misses are fetched from the image as whole clusters */
+            while (n < nb_sectors) {
+                slot = blkcache_lookup(s, last + 1);
+                if (slot && slot->state == BLKCACHE_SLOT_VALID) {
+                    break;
+                }
+                last++;
+                n = MIN(nb_sectors, n + s->cluster_sectors);
+            }
+
+            ret = blkcache_co_read_miss(bs, cluster, last, sector_num, n,
+                                        qiov, qiov_offset);
+        }
+        if (ret < 0) {
+            goto out;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        qiov_offset += n * BDRV_SECTOR_SIZE;
+    }
+
+out:
+    qemu_iovec_destroy(&hd_qiov);
+    return ret;
+}
+
+/* Write-back: store one cluster's worth of a write in the cache, if
+ * possible.  Returns 1 if the caller must write the data to the image. */
+static int coroutine_fn blkcache_co_write_cluster(BlockDriverState *bs,
+                                                  int64_t cluster, int offset,
+                                                  int n, QEMUIOVector *qiov)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheSlot *slot;
+    bool new_slot = false;
+    int ret;
+
+    slot = blkcache_lookup(s, cluster);
+    if (!slot) {
+        if (n < blkcache_cluster_len(bs, cluster)) {
+            return 1;
+        }
+        slot = blkcache_co_alloc(bs);
+        if (!slot) {
+            return 1;
+        }
+        if (blkcache_lookup(s, cluster)) {
+            blkcache_put_slot(s, slot);
+            return 1;
+        }
+        /* Not readable until the data is there */
+        blkcache_insert(s, slot, cluster, BLKCACHE_SLOT_FILLING);
+        new_slot = true;
+    } else if (slot->state != BLKCACHE_SLOT_VALID) {
+        /* Somebody else's fill; it conflicts with this write anyway */
+        return 1;
+    } else {
+        slot->busy++;
+        blkcache_touch(s, slot);
+    }
+
+    slot->gen++;
+    ret = bdrv_co_writev(bs->file, blkcache_slot_sector(s, slot) + offset, n,
+                         qiov);
+    if (ret >= 0 && !slot->disk_dirty) {
+        /* The data must be on disk before the table points at it */
+        slot->disk_dirty = true;
+        ret = bdrv_co_flush(bs->file);
+        if (ret >= 0) {
+            ret = blkcache_write_entry(bs, slot, cluster,
+                                       BLKCACHE_ENTRY_VALID |
+                                       BLKCACHE_ENTRY_DIRTY);
+        }
+        if (ret < 0) {
+            slot->disk_dirty = false;
+        }
+    }
+    blkcache_put_slot(s, slot);
+
+    if (ret < 0) {
+        if (new_slot) {
+            blkcache_drop(s, slot);
+            return 1;
+        }
+        return ret;
+    }
+
+    if (new_slot) {
+        slot->state = BLKCACHE_SLOT_VALID;
+    }
+    if (!slot->dirty) {
+        slot->dirty = true;
+        s->nb_dirty++;
+    }
+    return 0;
+}
+
+static int coroutine_fn blkcache_co_writev(BlockDriverState *bs,
+                                           int64_t sector_num, int nb_sectors,
+                                           QEMUIOVector *qiov)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t first = sector_num / s->cluster_sectors;
+    int64_t last = (sector_num + nb_sectors - 1) / s->cluster_sectors;
+    BlkcacheRange write;
+    QEMUIOVector hd_qiov;
+    size_t qiov_offset = 0;
+    int64_t cluster;
+    int ret = 0;
+
+    blkcache_add_write(s, &write, first, last);
+
+    if (!s->writeback) {
+        for (cluster = first; cluster <= last; cluster++) {
+            BlkcacheSlot *slot = blkcache_lookup(s, cluster);
+            if (slot && slot->state == BLKCACHE_SLOT_VALID) {
+                blkcache_drop(s, slot);
+            }
+        }
+        ret = bdrv_co_writev(s->image, sector_num, nb_sectors, qiov);
+        goto out;
+    }
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+    while (nb_sectors > 0) {
+        int offset = sector_num % s->cluster_sectors;
+        int n = MIN(nb_sectors, s->cluster_sectors - offset);
+
+        cluster = sector_num / s->cluster_sectors;
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_concat(&hd_qiov, qiov, qiov_offset, n * BDRV_SECTOR_SIZE);
+
+        ret = blkcache_co_write_cluster(bs, cluster, offset, n, &hd_qiov);
+        if (ret == 1) {
+            ret = bdrv_co_writev(s->image, sector_num, n, &hd_qiov);
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        qiov_offset += n * BDRV_SECTOR_SIZE;
+    }
+    qemu_iovec_destroy(&hd_qiov);
+
+out:
+    QLIST_REMOVE(&write, next);
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_flush(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    /* bs->file, which holds the dirty data, is flushed by the caller */
+    return bdrv_co_flush(s->image);
+}
+
+static int64_t blkcache_getlength(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    return bdrv_getlength(s->image);
+}
+
+static BlockDataCacheStats *blkcache_get_data_cache_stats(
+    const BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlockDataCacheStats *stats = g_new0(BlockDataCacheStats, 1);
+    uint64_t cluster_size = s->cluster_sectors * BDRV_SECTOR_SIZE;
+
+    stats->size = s->nb_slots * cluster_size;
+    stats->used = s->nb_used * cluster_size;
+    stats->dirty = s->nb_dirty * cluster_size;
+    stats->hits = s->hits;
+    stats->misses = s->misses;
+    stats->evictions = s->evictions;
+    stats->writebacks = s->writebacks;
+
+    return stats;
+}
+
+/*
+ * Load the slot table.  Returns 0 if the cache file was created for the
+ * same image with the same geometry, 1 if it must be formatted again, or
+ * a negative errno.
+ */
+static int blkcache_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheHeader header;
+    BlkcacheEntry *table;
+    bool clean, mismatch;
+    uint64_t i;
+    int ret;
+
+    if (bdrv_getlength(bs->file) < s->data_offset) {
+        return 1;
+    }
+
+    ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read cache header");
+        return ret;
+    }
+    if (memcmp(header.magic, BLKCACHE_MAGIC, sizeof(header.magic)) ||
+        le32_to_cpu(header.version) != BLKCACHE_VERSION) {
+        return 1;
+    }
+
+    header.image[sizeof(header.image) - 1] = '\0';
+    clean = !(le32_to_cpu(header.flags) & BLKCACHE_IN_USE);
+    mismatch = le32_to_cpu(header.cluster_size) !=
+                   s->cluster_sectors * BDRV_SECTOR_SIZE ||
+               le64_to_cpu(header.nb_slots) != s->nb_slots ||
+               le64_to_cpu(header.image_size) !=
+                   bs->total_sectors * BDRV_SECTOR_SIZE ||
+               strcmp(header.image, s->image_name);
+    if (mismatch && le64_to_cpu(header.nb_slots) != s->nb_slots) {
+        /* Can't even look for dirty entries, trust the geometry check */
+        if (!clean) {
+            error_setg(errp, "Cache file may hold data not yet written to "
+                       "'%s'; open it with its old size first", header.image);
+            return -EBUSY;
+        }
+        return 1;
+    }
+
+    table = g_malloc(s->nb_slots * sizeof(*table));
+    ret = bdrv_pread(bs->file, s->table_offset, table,
+                     s->nb_slots * sizeof(*table));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read cache table");
+        goto out;
+    }
+
+    for (i = 0; i < s->nb_slots; i++) {
+        BlkcacheSlot *slot = &s->slots[i];
+        uint32_t flags = le32_to_cpu(table[i].flags);
+        int64_t cluster = le64_to_cpu(table[i].cluster);
+
+        if (!(flags & BLKCACHE_ENTRY_VALID)) {
+            continue;
+        }
+        if (mismatch && (flags & BLKCACHE_ENTRY_DIRTY)) {
+            error_setg(errp, "Cache file holds data not yet written to '%s'",
+                       header.image);
+            ret = -EBUSY;
+            goto out;
+        }
+        if (mismatch || (!clean && !(flags & BLKCACHE_ENTRY_DIRTY))) {
+            continue;
+        }
+        if (cluster < 0 || cluster * s->cluster_sectors >= bs->total_sectors ||
+            blkcache_lookup(s, cluster)) {
+            continue;
+        }
+
+        blkcache_insert(s, slot, cluster, BLKCACHE_SLOT_VALID);
+        if (flags & BLKCACHE_ENTRY_DIRTY) {
+            slot->dirty = slot->disk_dirty = true;
+            s->nb_dirty++;
+        }
+    }
+    ret = mismatch;
+
+out:
+    g_free(table);
+    return ret;
+}
+
+/* Write the complete slot table, e.g. on a clean close */
+static int blkcache_save(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheEntry *table;
+    uint64_t i;
+    int ret;
+
+    table = g_malloc0(s->nb_slots * sizeof(*table));
+    for (i = 0; i < s->nb_slots; i++) {
+        BlkcacheSlot *slot = &s->slots[i];
+
+        if (slot->state != BLKCACHE_SLOT_VALID) {
+            table[i].cluster = cpu_to_le64(-1);
+            continue;
+        }
+        table[i].cluster = cpu_to_le64(slot->cluster);
+        table[i].flags = cpu_to_le32(BLKCACHE_ENTRY_VALID |
+                                     (slot->dirty ? BLKCACHE_ENTRY_DIRTY : 0));
+        slot->disk_dirty = slot->dirty;
+    }
+
+    ret = bdrv_pwrite(bs->file, s->table_offset, table,
+                      s->nb_slots * sizeof(*table));
+    g_free(table);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        return ret;
+    }
+    return blkcache_write_header(bs, false);
+}
+
+/* Valid filenames look like blkcache:path/to/cache_file:path/to/image */
+static void blkcache_parse_filename(const char *filename, QDict *options,
+                                    Error **errp)
+{
+    const char *c;
+
+    if (!strstart(filename, "blkcache:", &filename)) {
+        error_setg(errp, "File name string must start with 'blkcache:'");
+        return;
+    }
+
+    c = strchr(filename, ':');
+    if (c == NULL) {
+        error_setg(errp, "blkcache requires a cache file and an image path");
+        return;
+    }
+
+    qdict_put(options, "x-cache", qstring_from_substr(filename, 0,
+                                                      c - filename - 1));
+    qdict_put(options, "x-image", qstring_from_str(c + 1));
+}
+
+static QemuOptsList runtime_opts = {
+    .name = "blkcache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "x-cache",
+            .type = QEMU_OPT_STRING,
+            .help = "[internal use only, will be removed]",
+        },
+        {
+            .name = "x-image",
+            .type = QEMU_OPT_STRING,
+            .help = "[internal use only, will be removed]",
+        },
+        {
+            .name = "size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Cache capacity (default: what fits in the cache file)",
+        },
+        {
+            .name = "cluster-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Caching granularity",
+        },
+        {
+            .name = "policy",
+            .type = QEMU_OPT_STRING,
+            .help = "Eviction policy (lru, fifo)",
+        },
+        {
+            .name = "mode",
+            .type = QEMU_OPT_STRING,
+            .help = "Write policy (writethrough, writeback)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int blkcache_open(BlockDriverState *bs, QDict *options, int flags,
+                         Error **errp)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    const char *cache, *image, *policy, *mode;
+    uint64_t cluster_size, size;
+    int64_t file_size;
+    uint64_t i;
+    int ret;
+
+    opts = qemu_opts_create_nofail(&runtime_opts);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (error_is_set(&local_err)) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    cluster_size = qemu_opt_get_size(opts, "cluster-size",
+                                     BLKCACHE_DEFAULT_CLUSTER);
+    if (cluster_size < BLKCACHE_MIN_CLUSTER ||
+        cluster_size > BLKCACHE_MAX_CLUSTER ||
+        (cluster_size & (cluster_size - 1))) {
+        error_setg(errp, "cluster-size must be a power of two between %d "
+                   "and %d", BLKCACHE_MIN_CLUSTER, BLKCACHE_MAX_CLUSTER);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->cluster_sectors = cluster_size >> BDRV_SECTOR_BITS;
+
+    policy = qemu_opt_get(opts, "policy");
+    if (!policy || !strcmp(policy, "lru")) {
+        s->lru = true;
+    } else if (strcmp(policy, "fifo")) {
+        error_setg(errp, "Invalid eviction policy '%s'", policy);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    mode = qemu_opt_get(opts, "mode");
+    if (mode && !strcmp(mode, "writeback")) {
+        s->writeback = (flags & BDRV_O_RDWR) != 0;
+    } else if (mode && strcmp(mode, "writethrough")) {
+        error_setg(errp, "Invalid cache mode '%s'", mode);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    cache = qemu_opt_get(opts, "x-cache");
+    if (cache == NULL) {
+        error_setg(errp, "Could not retrieve cache file name");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    image = qemu_opt_get(opts, "x-image");
+    if (image == NULL) {
+        error_setg(errp, "Could not retrieve image file name");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* Reads fill the cache, so it is writable even for read-only images */
+    ret = bdrv_file_open(&bs->file, cache, NULL, flags | BDRV_O_RDWR,
+                         &local_err);
+    if (ret < 0) {
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    s->image = bdrv_new("");
+    ret = bdrv_open(s->image, image, NULL, flags, NULL, &local_err);
+    if (ret < 0) {
+        error_propagate(errp, local_err);
+        bdrv_unref(s->image);
+        s->image = NULL;
+        goto fail;
+    }
+    s->image_name = g_strdup(image);
+
+    file_size = bdrv_getlength(s->image);
+    if (file_size < 0) {
+        error_setg_errno(errp, -file_size, "Could not get image size");
+        ret = file_size;
+        goto fail;
+    }
+    bs->total_sectors = file_size >> BDRV_SECTOR_BITS;
+
+    /* Size the cache: by default, whatever fits in the file */
+    size = qemu_opt_get_size(opts, "size", 0);
+    if (size == 0) {
+        file_size = bdrv_getlength(bs->file);
+        if (file_size < BLKCACHE_HEADER_SIZE) {
+            error_setg(errp, "Cache file too small, please give 'size'");
+            ret = -EINVAL;
+            goto fail;
+        }
+        s->nb_slots = (file_size - BLKCACHE_HEADER_SIZE) /
+                      (cluster_size + sizeof(BlkcacheEntry));
+        if (s->nb_slots == 0) {
+            error_setg(errp, "Cache file too small, please give 'size'");
+            ret = -EINVAL;
+            goto fail;
+        }
+        while (ROUND_UP(BLKCACHE_HEADER_SIZE +
+                        s->nb_slots * sizeof(BlkcacheEntry), cluster_size) +
+               s->nb_slots * cluster_size > file_size) {
+            s->nb_slots--;
+        }
+    } else {
+        s->nb_slots = DIV_ROUND_UP(size, cluster_size);
+    }
+    if (s->nb_slots == 0 || s->nb_slots > INT_MAX) {
+        error_setg(errp, "Invalid cache size");
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->table_offset = BLKCACHE_HEADER_SIZE;
+    s->data_offset = ROUND_UP(s->table_offset +
+                              s->nb_slots * sizeof(BlkcacheEntry),
+                              cluster_size);
+
+    s->slots = g_new0(BlkcacheSlot, s->nb_slots);
+    s->map = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->lru_list);
+    QLIST_INIT(&s->fills);
+    QLIST_INIT(&s->writes);
+    for (i = 0; i < s->nb_slots; i++) {
+        s->slots[i].cluster = -1;
+        QTAILQ_INSERT_TAIL(&s->lru_list, &s->slots[i], next);
+    }
+
+    ret = blkcache_load(bs, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+    if (ret > 0) {
+        int64_t cache_size = s->data_offset + s->nb_slots * cluster_size;
+
+        if (bdrv_getlength(bs->file) < cache_size) {
+            ret = bdrv_truncate(bs->file, cache_size);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Could not resize cache file");
+                goto fail;
+            }
+        }
+        ret = blkcache_save(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not format cache file");
+            goto fail;
+        }
+    }
+
+    /* Dirty data left behind by an earlier write-back run */
+    if (!s->writeback && s->nb_dirty && (flags & BDRV_O_RDWR)) {
+        ret = blkcache_writeback_all(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write back cached data");
+            goto fail;
+        }
+    }
+
+    ret = blkcache_write_header(bs, true);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write cache header");
+        goto fail;
+    }
+
+    qemu_opts_del(opts);
+    return 0;
+
+fail:
+    if (s->map) {
+        g_hash_table_destroy(s->map);
+        s->map = NULL;
+    }
+    g_free(s->slots);
+    s->slots = NULL;
+    if (s->image) {
+        bdrv_unref(s->image);
+        s->image = NULL;
+    }
+    g_free(s->image_name);
+    s->image_name = NULL;
+    if (bs->file) {
+        bdrv_unref(bs->file);
+        bs->file = NULL;
+    }
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void blkcache_close(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int ret;
+
+    if (s->writeback) {
+        ret = blkcache_writeback_all(bs);
+        if (ret < 0) {
+            error_report("blkcache: could not write back all data to '%s' "
+                         "(%s), it is kept in the cache", s->image_name,
+                         strerror(-ret));
+        }
+    }
+
+    ret = blkcache_save(bs);
+    if (ret < 0) {
+        error_report("blkcache: could not save cache table (%s)",
+                     strerror(-ret));
+    }
+
+    g_hash_table_destroy(s->map);
+    g_free(s->slots);
+    bdrv_unref(s->image);
+    s->image = NULL;
+    g_free(s->image_name);
+}
+
+static BlockDriver bdrv_blkcache = {
+    .format_name                = "blkcache",
+    .protocol_name              = "blkcache",
+    .instance_size              = sizeof(BDRVBlkcacheState),
+
+    .bdrv_parse_filename        = blkcache_parse_filename,
+    .bdrv_file_open             = blkcache_open,
+    .bdrv_close                 = blkcache_close,
+    .bdrv_getlength             = blkcache_getlength,
+    .bdrv_get_data_cache_stats  = blkcache_get_data_cache_stats,
+
+    .bdrv_co_readv              = blkcache_co_readv,
+    .bdrv_co_writev             = blkcache_co_writev,
+    .bdrv_co_flush_to_disk      = blkcache_co_flush,
+
+    .bdrv_check_ext_snapshot    = bdrv_check_ext_snapshot_forbidden,
+};
+
+static void bdrv_blkcache_init(void)
+{
+    bdrv_register(&bdrv_blkcache);
+}
+
+block_init(bdrv_blkcache_init);
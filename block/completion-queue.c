@@ -0,0 +1,116 @@
+/*
+ * Completion queue for block drivers backed by a threaded library
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "block/completion-queue.h"
+
+int block_completion_queue_drain(BlockCompletionQueue *q)
+{
+    QSIMPLEQ_HEAD(, BlockCompletion) done;
+    BlockCompletion *comp;
+    int n = 0;
+
+    QSIMPLEQ_INIT(&done);
+
+    qemu_mutex_lock(&q->lock);
+    QSIMPLEQ_CONCAT(&done, &q->list);
+    q->kicked = false;
+    qemu_mutex_unlock(&q->lock);
+
+    while ((comp = QSIMPLEQ_FIRST(&done)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&done, next);
+        comp->cb(comp);
+        n++;
+    }
+
+    return n;
+}
+
+static void block_completion_queue_cb(EventNotifier *e)
+{
+    BlockCompletionQueue *q = container_of(e, BlockCompletionQueue, e);
+
+    /* Clear first: a completion pushed after this point kicks again */
+    if (event_notifier_test_and_clear(e)) {
+        block_completion_queue_drain(q);
+    }
+}
+
+/*
+ * Busy-wait callback for AioContext polling.  The unlocked read is only
+ * a hint; the real check happens under the lock in the drain.
+ */
+static bool block_completion_queue_poll_cb(void *opaque)
+{
+    BlockCompletionQueue *q = container_of(opaque, BlockCompletionQueue, e);
+
+    if (!atomic_read(&q->kicked)) {
+        return false;
+    }
+    return block_completion_queue_drain(q) > 0;
+}
+
+void block_completion_queue_push(BlockCompletionQueue *q,
+                                 BlockCompletion *comp,
+                                 BlockCompletionFunc *cb)
+{
+    bool kick;
+
+    comp->cb = cb;
+
+    qemu_mutex_lock(&q->lock);
+    QSIMPLEQ_INSERT_TAIL(&q->list, comp, next);
+    kick = !q->kicked;
+    q->kicked = true;
+    qemu_mutex_unlock(&q->lock);
+
+    if (kick) {
+        event_notifier_set(&q->e);
+    }
+}
+
+void block_completion_queue_detach_aio_context(BlockCompletionQueue *q)
+{
+    aio_set_event_notifier(q->ctx, &q->e, NULL);
+    q->ctx = NULL;
+}
+
+void block_completion_queue_attach_aio_context(BlockCompletionQueue *q,
+                                               AioContext *new_context)
+{
+    q->ctx = new_context;
+    aio_set_event_notifier(new_context, &q->e, block_completion_queue_cb);
+    aio_set_event_notifier_poll(new_context, &q->e,
+                                block_completion_queue_poll_cb);
+}
+
+int block_completion_queue_init(BlockCompletionQueue *q, AioContext *ctx)
+{
+    int ret;
+
+    ret = event_notifier_init(&q->e, false);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qemu_mutex_init(&q->lock);
+    QSIMPLEQ_INIT(&q->list);
+    q->kicked = false;
+    block_completion_queue_attach_aio_context(q, ctx);
+    return 0;
+}
+
+void block_completion_queue_cleanup(BlockCompletionQueue *q)
+{
+    block_completion_queue_detach_aio_context(q);
+    assert(QSIMPLEQ_EMPTY(&q->list));
+    qemu_mutex_destroy(&q->lock);
+    event_notifier_cleanup(&q->e);
+}
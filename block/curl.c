@@ -38,10 +38,15 @@
                    CURLPROTO_FTP | CURLPROTO_FTPS | \
                    CURLPROTO_TFTP)
 
-#define CURL_NUM_STATES 8
-#define CURL_NUM_ACB    8
-#define SECTOR_SIZE     512
-#define READ_AHEAD_SIZE (256 * 1024)
+#define CURL_NUM_STATES     8
+#define CURL_MAX_STATES     64
+#define CURL_NUM_ACB        16
+#define SECTOR_SIZE         512
+#define READ_AHEAD_SIZE     (256 * 1024)
+#define READ_AHEAD_MAX      (4 * 1024 * 1024)
+
+/* Pending requests closer than this are fetched with a single range */
+#define CURL_MERGE_GAP      (64 * 1024)
 
 #define FIND_RET_NONE   0
 #define FIND_RET_OK     1
@@ -51,14 +56,15 @@ struct BDRVCURLState;
 
 typedef struct CURLAIOCB {
     BlockDriverAIOCB common;
-    QEMUBH *bh;
     QEMUIOVector *qiov;
 
     int64_t sector_num;
     int nb_sectors;
+    bool sequential;
 
     size_t start;
     size_t end;
+    QSIMPLEQ_ENTRY(CURLAIOCB) next;
 } CURLAIOCB;
 
 typedef struct CURLState
@@ -73,19 +79,33 @@ typedef struct CURLState
     char range[128];
     char errmsg[CURL_ERROR_SIZE];
     char in_use;
+    uint64_t last_used;
 } CURLState;
 
 typedef struct BDRVCURLState {
     CURLM *multi;
     size_t len;
-    CURLState states[CURL_NUM_STATES];
+    CURLState *states;
+    int num_states;
     char *url;
-    size_t readahead_size;
     bool accept_range;
+
+    /* The readahead window starts at readahead_size and doubles with every
+     * sequential request, up to readahead_max */
+    size_t readahead_size;
+    size_t readahead_max;
+    size_t readahead_cur;
+    size_t last_end;
+
+    /* Requests wait here until a connection is free */
+    QSIMPLEQ_HEAD(, CURLAIOCB) pending;
+    QEMUBH *bh;
+    uint64_t use_counter;
 } BDRVCURLState;
 
 static void curl_clean_state(CURLState *s);
 static void curl_multi_do(void *arg);
+static void curl_process_pending(void *opaque);
 
 static int curl_sock_cb(CURL *curl, curl_socket_t fd, int action,
                         void *s, void *sp)
@@ -134,8 +154,10 @@ static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
     if (!s || !s->orig_buf)
         goto read_end;
 
-    memcpy(s->orig_buf + s->buf_off, ptr, realsize);
-    s->buf_off += realsize;
+    /* Ignore anything beyond the range that was asked for */
+    memcpy(s->orig_buf + s->buf_off, ptr,
+           MIN(realsize, s->buf_len - s->buf_off));
+    s->buf_off += MIN(realsize, s->buf_len - s->buf_off);
 
     for(i=0; i<CURL_NUM_ACB; i++) {
         CURLAIOCB *acb = s->acb[i];
@@ -156,22 +178,24 @@ read_end:
     return realsize;
 }
 
+/*
+ * Look for the range in the buffers of all connections, including those
+ * of finished transfers.  On success, *pstate is the state whose buffer
+ * has (or will have) the data.
+ */
 static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
-                         CURLAIOCB *acb)
+                         CURLAIOCB *acb, CURLState **pstate)
 {
     int i;
     size_t end = start + len;
 
-    for (i=0; i<CURL_NUM_STATES; i++) {
+    for (i = 0; i < s->num_states; i++) {
         CURLState *state = &s->states[i];
         size_t buf_end = (state->buf_start + state->buf_off);
         size_t buf_fend = (state->buf_start + state->buf_len);
 
         if (!state->orig_buf)
             continue;
-        if (!state->buf_off)
-            continue;
-
         // Does the existing buffer cover our section?
         if ((start >= state->buf_start) &&
             (start <= buf_end) &&
@@ -183,11 +207,14 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
             qemu_iovec_from_buf(acb->qiov, 0, buf, len);
             acb->common.cb(acb->common.opaque, 0);
 
+            state->last_used = ++s->use_counter;
+            *pstate = state;
             return FIND_RET_OK;
         }
 
         // Wait for unfinished chunks
-        if ((start >= state->buf_start) &&
+        if (state->in_use &&
+            (start >= state->buf_start) &&
             (start <= buf_fend) &&
             (end >= state->buf_start) &&
             (end <= buf_fend))
@@ -200,6 +227,8 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
             for (j=0; j<CURL_NUM_ACB; j++) {
                 if (!state->acb[j]) {
                     state->acb[j] = acb;
+                    state->last_used = ++s->use_counter;
+                    *pstate = state;
                     return FIND_RET_WAIT;
                 }
             }
@@ -266,28 +295,28 @@ static void curl_multi_do(void *arg)
     } while(msgs_in_queue);
 }
 
+/*
+ * Grab an idle connection, or NULL if all of them are busy.  Of the idle
+ * ones, the one whose buffer was used least recently is taken, so that
+ * buffered data that is still being read survives as long as possible.
+ */
 static CURLState *curl_init_state(BDRVCURLState *s)
 {
     CURLState *state = NULL;
-    int i, j;
-
-    do {
-        for (i=0; i<CURL_NUM_STATES; i++) {
-            for (j=0; j<CURL_NUM_ACB; j++)
-                if (s->states[i].acb[j])
-                    continue;
-            if (s->states[i].in_use)
-                continue;
+    int i;
 
-            state = &s->states[i];
-            state->in_use = 1;
-            break;
+    for (i = 0; i < s->num_states; i++) {
+        if (s->states[i].in_use) {
+            continue;
         }
-        if (!state) {
-            g_usleep(100);
-            curl_multi_do(s);
+        if (!state || s->states[i].last_used < state->last_used) {
+            state = &s->states[i];
         }
-    } while(!state);
+    }
+    if (!state) {
+        return NULL;
+    }
+    state->in_use = 1;
 
     if (state->curl)
         goto has_curl;
@@ -333,6 +362,14 @@ static void curl_clean_state(CURLState *s)
     if (s->s->multi)
         curl_multi_remove_handle(s->s->multi, s->curl);
     s->in_use = 0;
+
+    /* Short or failed transfers: only what arrived can be served later */
+    s->buf_len = s->buf_off;
+
+    /* A connection is free again, start the requests waiting for one */
+    if (s->s->bh && !QSIMPLEQ_EMPTY(&s->s->pending)) {
+        qemu_bh_schedule(s->s->bh);
+    }
 }
 
 static void curl_parse_filename(const char *filename, QDict *options,
@@ -391,6 +428,21 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Readahead size",
         },
+        {
+            .name = "readahead-max",
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum readahead size for sequential reads",
+        },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of parallel connections",
+        },
+        {
+            .name = "pipelining",
+            .type = QEMU_OPT_BOOL,
+            .help = "Send several HTTP requests on one connection",
+        },
         { /* end of list */ }
     },
 };
@@ -403,6 +455,7 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
     QemuOpts *opts;
     Error *local_err = NULL;
     const char *file;
+    bool pipelining;
     double d;
 
     static int inited = 0;
@@ -427,6 +480,26 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
                 s->readahead_size);
         goto out_noclean;
     }
+    s->readahead_max = qemu_opt_get_size(opts, "readahead-max",
+                                         MAX(READ_AHEAD_MAX,
+                                             s->readahead_size));
+    if ((s->readahead_max & 0x1ff) != 0 ||
+        s->readahead_max < s->readahead_size) {
+        fprintf(stderr, "CURL: readahead-max must be a multiple of 512 and "
+                "at least the readahead size\n");
+        goto out_noclean;
+    }
+    s->readahead_cur = s->readahead_size;
+
+    s->num_states = qemu_opt_get_number(opts, "connections", CURL_NUM_STATES);
+    if (s->num_states < 1 || s->num_states > CURL_MAX_STATES) {
+        fprintf(stderr, "CURL: connections must be between 1 and %d\n",
+                CURL_MAX_STATES);
+        goto out_noclean;
+    }
+    pipelining = qemu_opt_get_bool(opts, "pipelining", false);
+    s->states = g_new0(CURLState, s->num_states);
+    QSIMPLEQ_INIT(&s->pending);
 
     file = qemu_opt_get(opts, "url");
     if (file == NULL) {
@@ -479,7 +552,11 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
     s->multi = curl_multi_init();
     curl_multi_setopt(s->multi, CURLMOPT_SOCKETDATA, s);
     curl_multi_setopt(s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb);
+    if (pipelining) {
+        curl_multi_setopt(s->multi, CURLMOPT_PIPELINING, 1L);
+    }
     curl_multi_do(s);
+    s->bh = qemu_bh_new(curl_process_pending, s);
 
     qemu_opts_del(opts);
     return 0;
@@ -489,6 +566,8 @@ out:
     curl_easy_cleanup(state->curl);
     state->curl = NULL;
 out_noclean:
+    g_free(s->states);
+    s->states = NULL;
     g_free(s->url);
     qemu_opts_del(opts);
     return -EINVAL;
@@ -496,7 +575,30 @@ out_noclean:
 
 static void curl_aio_cancel(BlockDriverAIOCB *blockacb)
 {
-    // Do we have to implement canceling? Seems to work without...
+    CURLAIOCB *acb = (CURLAIOCB *)blockacb;
+    BDRVCURLState *s = acb->common.bs->opaque;
+    CURLAIOCB *p;
+    int i, j;
+
+    /* Either it is still waiting for a connection... */
+    QSIMPLEQ_FOREACH(p, &s->pending, next) {
+        if (p == acb) {
+            QSIMPLEQ_REMOVE(&s->pending, acb, CURLAIOCB, next);
+            qemu_aio_release(acb);
+            return;
+        }
+    }
+
+    /* ...or for the data of a transfer, which goes on for the buffer */
+    for (i = 0; i < s->num_states; i++) {
+        for (j = 0; j < CURL_NUM_ACB; j++) {
+            if (s->states[i].acb[j] == acb) {
+                s->states[i].acb[j] = NULL;
+                qemu_aio_release(acb);
+                return;
+            }
+        }
+    }
 }
 
 static const AIOCBInfo curl_aiocb_info = {
@@ -504,66 +606,143 @@ static const AIOCBInfo curl_aiocb_info = {
     .cancel             = curl_aio_cancel,
 };
 
-
-static void curl_readv_bh_cb(void *p)
+/* Start fetching [start, start + len) on an idle connection, if any */
+static CURLState *curl_start_transfer(BDRVCURLState *s, size_t start,
+                                      size_t len)
 {
     CURLState *state;
-
-    CURLAIOCB *acb = p;
-    BDRVCURLState *s = acb->common.bs->opaque;
-
-    qemu_bh_delete(acb->bh);
-    acb->bh = NULL;
-
-    size_t start = acb->sector_num * SECTOR_SIZE;
     size_t end;
 
-    // In case we have the requested data already (e.g. read-ahead),
-    // we can just call the callback and be done.
-    switch (curl_find_buf(s, start, acb->nb_sectors * SECTOR_SIZE, acb)) {
-        case FIND_RET_OK:
-            qemu_aio_release(acb);
-            // fall through
-        case FIND_RET_WAIT:
-            return;
-        default:
-            break;
-    }
-
-    // No cache found, so let's start a new request
     state = curl_init_state(s);
     if (!state) {
-        acb->common.cb(acb->common.opaque, -EIO);
-        qemu_aio_release(acb);
-        return;
+        return NULL;
     }
 
-    acb->start = 0;
-    acb->end = (acb->nb_sectors * SECTOR_SIZE);
-
     state->buf_off = 0;
-    if (state->orig_buf)
-        g_free(state->orig_buf);
+    g_free(state->orig_buf);
     state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
-    end = MIN(start + state->buf_len, s->len) - 1;
+    state->buf_len = MIN(len, s->len - start);
+    end = start + state->buf_len - 1;
     state->orig_buf = g_malloc(state->buf_len);
-    state->acb[0] = acb;
+    state->last_used = ++s->use_counter;
 
     snprintf(state->range, 127, "%zd-%zd", start, end);
-    DPRINTF("CURL (AIO): Reading %d at %zd (%s)\n",
-            (acb->nb_sectors * SECTOR_SIZE), start, state->range);
+    DPRINTF("CURL (AIO): Reading %zd at %zd (%s)\n",
+            state->buf_len, start, state->range);
     curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
 
     curl_multi_add_handle(s->multi, state->curl);
-    curl_multi_do(s);
+    return state;
+}
 
+/*
+ * A sequential reader is about to run out of data that is buffered or on
+ * its way: fetch the next window on another connection in the meantime.
+ */
+static void curl_prefetch(BDRVCURLState *s, CURLState *state, size_t pos)
+{
+    size_t fend = state->buf_start + state->buf_len;
+    int i;
+
+    if (fend >= s->len || fend - pos > s->readahead_cur / 2) {
+        return;
+    }
+
+    for (i = 0; i < s->num_states; i++) {
+        CURLState *other = &s->states[i];
+
+        if (other->orig_buf && other->buf_start <= fend &&
+            fend < other->buf_start + other->buf_len) {
+            return;
+        }
+    }
+
+    curl_start_transfer(s, fend, s->readahead_cur);
+}
+
+/*
+ * Serve pending requests from the buffers, or start range requests for
+ * them.  Requests that start close to each other share one transfer.
+ */
+static void curl_process_pending(void *opaque)
+{
+    BDRVCURLState *s = opaque;
+    CURLAIOCB *acb, *p, *next;
+    CURLState *state;
+    bool started = false;
+
+    while ((acb = QSIMPLEQ_FIRST(&s->pending)) != NULL) {
+        size_t start = acb->sector_num * SECTOR_SIZE;
+        size_t len = acb->nb_sectors * SECTOR_SIZE;
+        size_t end = start + len;
+        int n = 1;
+
+        // In case we have the requested data already (e.g. read-ahead),
+        // we can just call the callback and be done.
+        switch (curl_find_buf(s, start, len, acb, &state)) {
+            case FIND_RET_OK:
+                QSIMPLEQ_REMOVE_HEAD(&s->pending, next);
+                if (acb->sequential) {
+                    curl_prefetch(s, state, end);
+                    started = true;
+                }
+                qemu_aio_release(acb);
+                continue;
+            case FIND_RET_WAIT:
+                QSIMPLEQ_REMOVE_HEAD(&s->pending, next);
+                if (acb->sequential) {
+                    curl_prefetch(s, state, end);
+                    started = true;
+                }
+                continue;
+            default:
+                break;
+        }
+
+        // No cache found, so let's start a new request
+        QSIMPLEQ_FOREACH(p, &s->pending, next) {
+            size_t p_start = p->sector_num * SECTOR_SIZE;
+            size_t p_end = p_start + p->nb_sectors * SECTOR_SIZE;
+
+            if (p != acb && n < CURL_NUM_ACB && p_start >= start &&
+                p_start <= end + CURL_MERGE_GAP) {
+                end = MAX(end, p_end);
+                n++;
+            }
+        }
+
+        state = curl_start_transfer(s, start,
+                                    end - start + s->readahead_cur);
+        if (!state) {
+            /* Retried when a transfer finishes */
+            break;
+        }
+        started = true;
+
+        n = 0;
+        QSIMPLEQ_FOREACH_SAFE(p, &s->pending, next, next) {
+            size_t p_start = p->sector_num * SECTOR_SIZE;
+            size_t p_end = p_start + p->nb_sectors * SECTOR_SIZE;
+
+            if (n < CURL_NUM_ACB && p_start >= start && p_end <= end) {
+                QSIMPLEQ_REMOVE(&s->pending, p, CURLAIOCB, next);
+                p->start = p_start - start;
+                p->end = p_end - start;
+                state->acb[n++] = p;
+            }
+        }
+    }
+
+    if (started) {
+        curl_multi_do(s);
+    }
 }
 
 static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
+    BDRVCURLState *s = bs->opaque;
     CURLAIOCB *acb;
 
     acb = qemu_aio_get(&curl_aiocb_info, bs, cb, opaque);
@@ -572,8 +751,17 @@ static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
     acb->sector_num = sector_num;
     acb->nb_sectors = nb_sectors;
 
-    acb->bh = qemu_bh_new(curl_readv_bh_cb, acb);
-    qemu_bh_schedule(acb->bh);
+    /* Grow the readahead window for sequential streams */
+    acb->sequential = sector_num * SECTOR_SIZE == s->last_end;
+    if (acb->sequential) {
+        s->readahead_cur = MIN(s->readahead_cur * 2, s->readahead_max);
+    } else {
+        s->readahead_cur = s->readahead_size;
+    }
+    s->last_end = (sector_num + nb_sectors) * SECTOR_SIZE;
+
+    QSIMPLEQ_INSERT_TAIL(&s->pending, acb, next);
+    qemu_bh_schedule(s->bh);
     return &acb->common;
 }
 
@@ -583,7 +771,11 @@ static void curl_close(BlockDriverState *bs)
     int i;
 
     DPRINTF("CURL: Close\n");
-    for (i=0; i<CURL_NUM_STATES; i++) {
+    if (s->bh) {
+        qemu_bh_delete(s->bh);
+        s->bh = NULL;
+    }
+    for (i = 0; i < s->num_states; i++) {
         if (s->states[i].in_use)
             curl_clean_state(&s->states[i]);
         if (s->states[i].curl) {
@@ -597,6 +789,7 @@ static void curl_close(BlockDriverState *bs)
     }
     if (s->multi)
         curl_multi_cleanup(s->multi);
+    g_free(s->states);
     g_free(s->url);
 }
 
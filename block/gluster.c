@@ -17,28 +17,24 @@
  */
 #include <glusterfs/api/glfs.h>
 #include "block/block_int.h"
+#include "block/completion-queue.h"
 #include "qemu/sockets.h"
 #include "qemu/uri.h"
 
 typedef struct GlusterAIOCB {
     BlockDriverAIOCB common;
+    BlockCompletion comp;
     int64_t size;
     int ret;
     bool *finished;
-    QEMUBH *bh;
 } GlusterAIOCB;
 
 typedef struct BDRVGlusterState {
     struct glfs *glfs;
-    int fds[2];
     struct glfs_fd *fd;
-    int event_reader_pos;
-    GlusterAIOCB *event_acb;
+    BlockCompletionQueue completions;
 } BDRVGlusterState;
 
-#define GLUSTER_FD_READ  0
-#define GLUSTER_FD_WRITE 1
-
 typedef struct GlusterConf {
     char *server;
     int port;
@@ -231,8 +227,10 @@ out:
     return NULL;
 }
 
-static void qemu_gluster_complete_aio(GlusterAIOCB *acb, BDRVGlusterState *s)
+/* Runs in the AioContext of the BlockDriverState, see gluster_finish_aiocb() */
+static void qemu_gluster_complete_aio(BlockCompletion *comp)
 {
+    GlusterAIOCB *acb = container_of(comp, GlusterAIOCB, comp);
     int ret;
     bool *finished = acb->finished;
     BlockDriverCompletionFunc *cb = acb->common.cb;
@@ -253,26 +251,6 @@ static void qemu_gluster_complete_aio(GlusterAIOCB *acb, BDRVGlusterState *s)
     }
 }
 
-static void qemu_gluster_aio_event_reader(void *opaque)
-{
-    BDRVGlusterState *s = opaque;
-    ssize_t ret;
-
-    do {
-        char *p = (char *)&s->event_acb;
-
-        ret = read(s->fds[GLUSTER_FD_READ], p + s->event_reader_pos,
-                   sizeof(s->event_acb) - s->event_reader_pos);
-        if (ret > 0) {
-            s->event_reader_pos += ret;
-            if (s->event_reader_pos == sizeof(s->event_acb)) {
-                s->event_reader_pos = 0;
-                qemu_gluster_complete_aio(s->event_acb, s);
-            }
-        }
-    } while (ret < 0 && errno == EINTR);
-}
-
 /* TODO Convert to fine grained options */
 static QemuOptsList runtime_opts = {
     .name = "gluster",
@@ -332,14 +310,11 @@ static int qemu_gluster_open(BlockDriverState *bs,  QDict *options,
         goto out;
     }
 
-    ret = qemu_pipe(s->fds);
+    ret = block_completion_queue_init(&s->completions,
+                                      bdrv_get_aio_context(bs));
     if (ret < 0) {
-        ret = -errno;
         goto out;
     }
-    fcntl(s->fds[GLUSTER_FD_READ], F_SETFL, O_NONBLOCK);
-    qemu_aio_set_fd_handler(s->fds[GLUSTER_FD_READ],
-        qemu_gluster_aio_event_reader, NULL, s);
 
 out:
     qemu_opts_del(opts);
@@ -405,7 +380,7 @@ static void qemu_gluster_aio_cancel(BlockDriverAIOCB *blockacb)
 
     acb->finished = &finished;
     while (!finished) {
-        qemu_aio_wait();
+        aio_poll(bdrv_get_aio_context(blockacb->bs), true);
     }
 }
 
@@ -419,18 +394,11 @@ static void gluster_finish_aiocb(struct glfs_fd *fd, ssize_t ret, void *arg)
     GlusterAIOCB *acb = (GlusterAIOCB *)arg;
     BlockDriverState *bs = acb->common.bs;
     BDRVGlusterState *s = bs->opaque;
-    int retval;
 
+    /* Called from a gluster thread, hand the request over to QEMU */
     acb->ret = ret;
-    retval = qemu_write_full(s->fds[GLUSTER_FD_WRITE], &acb, sizeof(acb));
-    if (retval != sizeof(acb)) {
-        /*
-         * Gluster AIO callback thread failed to notify the waiting
-         * QEMU thread about IO completion.
-         */
-        error_report("Gluster AIO completion failed: %s", strerror(errno));
-        abort();
-    }
+    block_completion_queue_push(&s->completions, &acb->comp,
+                                qemu_gluster_complete_aio);
 }
 
 static BlockDriverAIOCB *qemu_gluster_aio_rw(BlockDriverState *bs,
@@ -581,9 +549,7 @@ static void qemu_gluster_close(BlockDriverState *bs)
 {
     BDRVGlusterState *s = bs->opaque;
 
-    close(s->fds[GLUSTER_FD_READ]);
-    close(s->fds[GLUSTER_FD_WRITE]);
-    qemu_aio_set_fd_handler(s->fds[GLUSTER_FD_READ], NULL, NULL, NULL);
+    block_completion_queue_cleanup(&s->completions);
 
     if (s->fd) {
         glfs_close(s->fd);
@@ -592,6 +558,21 @@ static void qemu_gluster_close(BlockDriverState *bs)
     glfs_fini(s->glfs);
 }
 
+static void qemu_gluster_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVGlusterState *s = bs->opaque;
+
+    block_completion_queue_detach_aio_context(&s->completions);
+}
+
+static void qemu_gluster_attach_aio_context(BlockDriverState *bs,
+                                            AioContext *new_context)
+{
+    BDRVGlusterState *s = bs->opaque;
+
+    block_completion_queue_attach_aio_context(&s->completions, new_context);
+}
+
 static int qemu_gluster_has_zero_init(BlockDriverState *bs)
 {
     /* GlusterFS volume could be backed by a block device */
@@ -622,6 +603,8 @@ static BlockDriver bdrv_gluster = {
     .bdrv_aio_writev              = qemu_gluster_aio_writev,
     .bdrv_aio_flush               = qemu_gluster_aio_flush,
     .bdrv_has_zero_init           = qemu_gluster_has_zero_init,
+    .bdrv_detach_aio_context      = qemu_gluster_detach_aio_context,
+    .bdrv_attach_aio_context      = qemu_gluster_attach_aio_context,
 #ifdef CONFIG_GLUSTERFS_DISCARD
     .bdrv_aio_discard             = qemu_gluster_aio_discard,
 #endif
@@ -643,6 +626,8 @@ static BlockDriver bdrv_gluster_tcp = {
     .bdrv_aio_writev              = qemu_gluster_aio_writev,
     .bdrv_aio_flush               = qemu_gluster_aio_flush,
     .bdrv_has_zero_init           = qemu_gluster_has_zero_init,
+    .bdrv_detach_aio_context      = qemu_gluster_detach_aio_context,
+    .bdrv_attach_aio_context      = qemu_gluster_attach_aio_context,
 #ifdef CONFIG_GLUSTERFS_DISCARD
     .bdrv_aio_discard             = qemu_gluster_aio_discard,
 #endif
@@ -664,6 +649,8 @@ static BlockDriver bdrv_gluster_unix = {
     .bdrv_aio_writev              = qemu_gluster_aio_writev,
     .bdrv_aio_flush               = qemu_gluster_aio_flush,
     .bdrv_has_zero_init           = qemu_gluster_has_zero_init,
+    .bdrv_detach_aio_context      = qemu_gluster_detach_aio_context,
+    .bdrv_attach_aio_context      = qemu_gluster_attach_aio_context,
 #ifdef CONFIG_GLUSTERFS_DISCARD
     .bdrv_aio_discard             = qemu_gluster_aio_discard,
 #endif
@@ -685,6 +672,8 @@ static BlockDriver bdrv_gluster_rdma = {
     .bdrv_aio_writev              = qemu_gluster_aio_writev,
     .bdrv_aio_flush               = qemu_gluster_aio_flush,
     .bdrv_has_zero_init           = qemu_gluster_has_zero_init,
+    .bdrv_detach_aio_context      = qemu_gluster_detach_aio_context,
+    .bdrv_attach_aio_context      = qemu_gluster_attach_aio_context,
 #ifdef CONFIG_GLUSTERFS_DISCARD
     .bdrv_aio_discard             = qemu_gluster_aio_discard,
 #endif
@@ -45,13 +45,26 @@
 #include <block/scsi.h>
 #endif
 
-typedef struct IscsiLun {
+/* One session to the target.  With multipath there are several of them,
+ * possibly to different portals, and requests are spread across them.
+ */
+typedef struct IscsiPath {
+    struct IscsiLun *iscsilun;
     struct iscsi_context *iscsi;
+    char *portal;
+    int events;
+    int in_flight;
+    bool failed;
+} IscsiPath;
+
+typedef struct IscsiLun {
+    IscsiPath *paths;
+    int nr_paths;
+    int next_path;
     int lun;
     enum scsi_inquiry_peripheral_device_type type;
     int block_size;
     uint64_t num_blocks;
-    int events;
     QEMUTimer *nop_timer;
     uint8_t lbpme;
     uint8_t lbprz;
@@ -65,9 +78,11 @@ typedef struct IscsiTask {
     int status;
     int complete;
     int retries;
+    int failovers;
     int do_retry;
     struct scsi_task *task;
     Coroutine *co;
+    IscsiPath *path;
 } IscsiTask;
 
 typedef struct IscsiAIOCB {
@@ -75,6 +90,7 @@ typedef struct IscsiAIOCB {
     QEMUIOVector *qiov;
     QEMUBH *bh;
     IscsiLun *iscsilun;
+    IscsiPath *path;
     struct scsi_task *task;
     uint8_t *buf;
     int status;
@@ -90,6 +106,7 @@ typedef struct IscsiAIOCB {
 #define NOP_INTERVAL 5000
 #define MAX_NOP_FAILURES 3
 #define ISCSI_CMD_RETRIES 5
+#define ISCSI_MAX_SESSIONS 16
 
 static void
 iscsi_bh_cb(void *p)
@@ -129,6 +146,7 @@ iscsi_co_generic_cb(struct iscsi_context *iscsi, int status,
 {
     struct IscsiTask *iTask = opaque;
     struct scsi_task *task = command_data;
+    IscsiPath *path = iTask->path;
 
     iTask->complete = 1;
     iTask->status = status;
@@ -141,6 +159,22 @@ iscsi_co_generic_cb(struct iscsi_context *iscsi, int status,
         goto out;
     }
 
+    /* The command did not make it through this session, either because
+     * the connection broke or because iscsi_fail_path() took the tasks
+     * back.  Resubmit it on one of the other paths.
+     */
+    if ((status == SCSI_STATUS_ERROR || status == SCSI_STATUS_CANCELLED) &&
+        path && path->iscsilun->nr_paths > 1 &&
+        iTask->failovers++ < path->iscsilun->nr_paths) {
+        if (status == SCSI_STATUS_ERROR && !path->failed) {
+            error_report("iSCSI: path to %s failed: %s", path->portal,
+                         iscsi_get_error(iscsi));
+            path->failed = true;
+        }
+        iTask->do_retry = 1;
+        goto out;
+    }
+
     if (status != SCSI_STATUS_GOOD) {
         error_report("iSCSI: Failure. %s", iscsi_get_error(iscsi));
     }
@@ -173,7 +207,6 @@ static void
 iscsi_aio_cancel(BlockDriverAIOCB *blockacb)
 {
     IscsiAIOCB *acb = (IscsiAIOCB *)blockacb;
-    IscsiLun *iscsilun = acb->iscsilun;
 
     if (acb->status != -EINPROGRESS) {
         return;
@@ -182,7 +215,7 @@ iscsi_aio_cancel(BlockDriverAIOCB *blockacb)
     acb->canceled = 1;
 
     /* send a task mgmt call to the target to cancel the task on the target */
-    iscsi_task_mgmt_abort_task_async(iscsilun->iscsi, acb->task,
+    iscsi_task_mgmt_abort_task_async(acb->path->iscsi, acb->task,
                                      iscsi_abort_task_cb, acb);
 
     while (acb->status == -EINPROGRESS) {
@@ -200,43 +233,91 @@ static void iscsi_process_read(void *arg);
 static void iscsi_process_write(void *arg);
 
 static void
-iscsi_set_events(IscsiLun *iscsilun)
+iscsi_set_events(IscsiPath *path)
 {
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    struct iscsi_context *iscsi = path->iscsi;
     int ev;
 
     /* We always register a read handler.  */
     ev = POLLIN;
     ev |= iscsi_which_events(iscsi);
-    if (ev != iscsilun->events) {
+    if (ev != path->events) {
         qemu_aio_set_fd_handler(iscsi_get_fd(iscsi),
                       iscsi_process_read,
                       (ev & POLLOUT) ? iscsi_process_write : NULL,
-                      iscsilun);
+                      path);
 
     }
 
-    iscsilun->events = ev;
+    path->events = ev;
 }
 
 static void
 iscsi_process_read(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiPath *path = arg;
+    struct iscsi_context *iscsi = path->iscsi;
 
     iscsi_service(iscsi, POLLIN);
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(path);
 }
 
 static void
 iscsi_process_write(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiPath *path = arg;
+    struct iscsi_context *iscsi = path->iscsi;
 
     iscsi_service(iscsi, POLLOUT);
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(path);
+}
+
+/*
+ * Pick the healthy path with the fewest commands in flight.  The scan
+ * starts after the path that was picked last, so that idle paths are
+ * used in turn.  If every path has failed, fall back to the first one;
+ * libiscsi will keep trying to reconnect it.
+ */
+static IscsiPath *iscsi_choose_path(IscsiLun *iscsilun)
+{
+    IscsiPath *best = NULL;
+    int i;
+
+    for (i = 0; i < iscsilun->nr_paths; i++) {
+        IscsiPath *path;
+
+        path = &iscsilun->paths[(iscsilun->next_path + i) % iscsilun->nr_paths];
+        if (!path->failed && (!best || path->in_flight < best->in_flight)) {
+            best = path;
+        }
+    }
+    if (!best) {
+        best = &iscsilun->paths[0];
+    }
+
+    iscsilun->next_path = (best - iscsilun->paths + 1) % iscsilun->nr_paths;
+    return best;
+}
+
+/* Select the session for the next submission of @iTask */
+static struct iscsi_context *iscsi_co_task_path(IscsiLun *iscsilun,
+                                                struct IscsiTask *iTask)
+{
+    iTask->path = iscsi_choose_path(iscsilun);
+    iTask->complete = 0;
+    return iTask->path->iscsi;
+}
+
+static void coroutine_fn iscsi_co_wait_task(struct IscsiTask *iTask)
+{
+    IscsiPath *path = iTask->path;
+
+    path->in_flight++;
+    while (!iTask->complete) {
+        iscsi_set_events(path);
+        qemu_coroutine_yield();
+    }
+    path->in_flight--;
 }
 
 static int64_t sector_lun2qemu(int64_t sector, IscsiLun *iscsilun)
@@ -269,6 +350,7 @@ static int coroutine_fn iscsi_co_writev(BlockDriverState *bs,
 {
     IscsiLun *iscsilun = bs->opaque;
     struct IscsiTask iTask;
+    struct iscsi_context *iscsi;
     uint64_t lba;
     uint32_t num_sectors;
     uint8_t *data = NULL;
@@ -293,7 +375,8 @@ static int coroutine_fn iscsi_co_writev(BlockDriverState *bs,
 #endif
     iscsi_co_init_iscsitask(iscsilun, &iTask);
 retry:
-    iTask.task = iscsi_write16_task(iscsilun->iscsi, iscsilun->lun, lba,
+    iscsi = iscsi_co_task_path(iscsilun, &iTask);
+    iTask.task = iscsi_write16_task(iscsi, iscsilun->lun, lba,
                                     data, num_sectors * iscsilun->block_size,
                                     iscsilun->block_size, 0, 0, 0, 0, 0,
                                     iscsi_co_generic_cb, &iTask);
@@ -305,10 +388,7 @@ retry:
     scsi_task_set_iov_out(iTask.task, (struct scsi_iovec *) iov->iov,
                           iov->niov);
 #endif
-    while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
-        qemu_coroutine_yield();
-    }
+    iscsi_co_wait_task(&iTask);
 
     if (iTask.task != NULL) {
         scsi_free_scsi_task(iTask.task);
@@ -334,6 +414,7 @@ static int coroutine_fn iscsi_co_readv(BlockDriverState *bs,
 {
     IscsiLun *iscsilun = bs->opaque;
     struct IscsiTask iTask;
+    struct iscsi_context *iscsi;
     uint64_t lba;
     uint32_t num_sectors;
 #if !defined(LIBISCSI_FEATURE_IOVECTOR)
@@ -349,15 +430,16 @@ static int coroutine_fn iscsi_co_readv(BlockDriverState *bs,
 
     iscsi_co_init_iscsitask(iscsilun, &iTask);
 retry:
+    iscsi = iscsi_co_task_path(iscsilun, &iTask);
     switch (iscsilun->type) {
     case TYPE_DISK:
-        iTask.task = iscsi_read16_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_read16_task(iscsi, iscsilun->lun, lba,
                                        num_sectors * iscsilun->block_size,
                                        iscsilun->block_size, 0, 0, 0, 0, 0,
                                        iscsi_co_generic_cb, &iTask);
         break;
     default:
-        iTask.task = iscsi_read10_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_read10_task(iscsi, iscsilun->lun, lba,
                                        num_sectors * iscsilun->block_size,
                                        iscsilun->block_size, 0, 0, 0, 0, 0,
                                        iscsi_co_generic_cb, &iTask);
@@ -376,10 +458,7 @@ retry:
     }
 #endif
 
-    while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
-        qemu_coroutine_yield();
-    }
+    iscsi_co_wait_task(&iTask);
 
     if (iTask.task != NULL) {
         scsi_free_scsi_task(iTask.task);
@@ -401,19 +480,18 @@ static int coroutine_fn iscsi_co_flush(BlockDriverState *bs)
 {
     IscsiLun *iscsilun = bs->opaque;
     struct IscsiTask iTask;
+    struct iscsi_context *iscsi;
 
     iscsi_co_init_iscsitask(iscsilun, &iTask);
 
 retry:
-    if (iscsi_synchronizecache10_task(iscsilun->iscsi, iscsilun->lun, 0, 0, 0,
+    iscsi = iscsi_co_task_path(iscsilun, &iTask);
+    if (iscsi_synchronizecache10_task(iscsi, iscsilun->lun, 0, 0, 0,
                                       0, iscsi_co_generic_cb, &iTask) == NULL) {
         return -EIO;
     }
 
-    while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
-        qemu_coroutine_yield();
-    }
+    iscsi_co_wait_task(&iTask);
 
     if (iTask.task != NULL) {
         scsi_free_scsi_task(iTask.task);
@@ -477,7 +555,8 @@ static BlockDriverAIOCB *iscsi_aio_ioctl(BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiPath *path = iscsi_choose_path(iscsilun);
+    struct iscsi_context *iscsi = path->iscsi;
     struct iscsi_data data;
     IscsiAIOCB *acb;
 
@@ -486,6 +565,7 @@ static BlockDriverAIOCB *iscsi_aio_ioctl(BlockDriverState *bs,
     acb = qemu_aio_get(&iscsi_aiocb_info, bs, cb, opaque);
 
     acb->iscsilun = iscsilun;
+    acb->path        = path;
     acb->canceled    = 0;
     acb->bh          = NULL;
     acb->status      = -EINPROGRESS;
@@ -571,7 +651,7 @@ static BlockDriverAIOCB *iscsi_aio_ioctl(BlockDriverState *bs,
         }
     }
 
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(path);
 
     return &acb->common;
 }
@@ -633,6 +713,7 @@ static int64_t coroutine_fn iscsi_co_get_block_status(BlockDriverState *bs,
     struct scsi_get_lba_status *lbas = NULL;
     struct scsi_lba_status_descriptor *lbasd = NULL;
     struct IscsiTask iTask;
+    struct iscsi_context *iscsi;
     int64_t ret;
 
     iscsi_co_init_iscsitask(iscsilun, &iTask);
@@ -653,7 +734,8 @@ static int64_t coroutine_fn iscsi_co_get_block_status(BlockDriverState *bs,
     }
 
 retry:
-    if (iscsi_get_lba_status_task(iscsilun->iscsi, iscsilun->lun,
+    iscsi = iscsi_co_task_path(iscsilun, &iTask);
+    if (iscsi_get_lba_status_task(iscsi, iscsilun->lun,
                                   sector_qemu2lun(sector_num, iscsilun),
                                   8 + 16, iscsi_co_generic_cb,
                                   &iTask) == NULL) {
@@ -661,10 +743,7 @@ retry:
         goto out;
     }
 
-    while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
-        qemu_coroutine_yield();
-    }
+    iscsi_co_wait_task(&iTask);
 
     if (iTask.do_retry) {
         if (iTask.task != NULL) {
@@ -723,6 +802,7 @@ coroutine_fn iscsi_co_discard(BlockDriverState *bs, int64_t sector_num,
 {
     IscsiLun *iscsilun = bs->opaque;
     struct IscsiTask iTask;
+    struct iscsi_context *iscsi;
     struct unmap_list list;
 
     if (!is_request_lun_aligned(sector_num, nb_sectors, iscsilun)) {
@@ -739,15 +819,13 @@ coroutine_fn iscsi_co_discard(BlockDriverState *bs, int64_t sector_num,
 
     iscsi_co_init_iscsitask(iscsilun, &iTask);
 retry:
-    if (iscsi_unmap_task(iscsilun->iscsi, iscsilun->lun, 0, 0, &list, 1,
+    iscsi = iscsi_co_task_path(iscsilun, &iTask);
+    if (iscsi_unmap_task(iscsi, iscsilun->lun, 0, 0, &list, 1,
                      iscsi_co_generic_cb, &iTask) == NULL) {
         return -EIO;
     }
 
-    while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
-        qemu_coroutine_yield();
-    }
+    iscsi_co_wait_task(&iTask);
 
     if (iTask.task != NULL) {
         scsi_free_scsi_task(iTask.task);
@@ -780,6 +858,7 @@ coroutine_fn iscsi_co_write_zeroes(BlockDriverState *bs, int64_t sector_num,
 {
     IscsiLun *iscsilun = bs->opaque;
     struct IscsiTask iTask;
+    struct iscsi_context *iscsi;
     uint64_t lba;
     uint32_t nb_blocks;
 
@@ -806,17 +885,15 @@ coroutine_fn iscsi_co_write_zeroes(BlockDriverState *bs, int64_t sector_num,
 
     iscsi_co_init_iscsitask(iscsilun, &iTask);
 retry:
-    if (iscsi_writesame16_task(iscsilun->iscsi, iscsilun->lun, lba,
+    iscsi = iscsi_co_task_path(iscsilun, &iTask);
+    if (iscsi_writesame16_task(iscsi, iscsilun->lun, lba,
                                iscsilun->zeroblock, iscsilun->block_size,
                                nb_blocks, 0, !!(flags & BDRV_REQ_MAY_UNMAP),
                                0, 0, iscsi_co_generic_cb, &iTask) == NULL) {
         return -EIO;
     }
 
-    while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
-        qemu_coroutine_yield();
-    }
+    iscsi_co_wait_task(&iTask);
 
     if (iTask.task != NULL) {
         scsi_free_scsi_task(iTask.task);
@@ -954,28 +1031,107 @@ static char *parse_initiator_name(const char *target)
     return iscsi_name;
 }
 
+static int parse_portal(const char *name, const char *value, void *opaque)
+{
+    GPtrArray *portals = opaque;
+
+    if (!strcmp(name, "portal")) {
+        g_ptr_array_add(portals, g_strdup(value));
+    }
+    return 0;
+}
+
+/* Collect the additional portals of @target into @portals and return the
+ * number of sessions to open to each portal.
+ */
+static uint64_t parse_multipath(const char *target, GPtrArray *portals)
+{
+    QemuOptsList *list;
+    QemuOpts *opts;
+
+    list = qemu_find_opts("iscsi");
+    if (!list) {
+        return 1;
+    }
+
+    opts = qemu_opts_find(list, target);
+    if (opts == NULL) {
+        opts = QTAILQ_FIRST(&list->head);
+        if (!opts) {
+            return 1;
+        }
+    }
+
+    qemu_opt_foreach(opts, parse_portal, portals, 0);
+    return qemu_opt_get_number(opts, "sessions", 1);
+}
+
 #if defined(LIBISCSI_FEATURE_NOP_COUNTER)
+/*
+ * Stop using a path and take back the commands that are queued on it.
+ * Cancelling them completes them with SCSI_STATUS_CANCELLED, upon which
+ * iscsi_co_generic_cb() resubmits them on one of the remaining paths.
+ * With a single path nothing is cancelled, libiscsi requeues the commands
+ * itself once it has reconnected.
+ */
+static void iscsi_fail_path(IscsiPath *path)
+{
+    if (path->iscsilun->nr_paths == 1 || path->failed) {
+        return;
+    }
+
+    error_report("iSCSI: path to %s failed, moving its I/O to other paths",
+                 path->portal);
+    path->failed = true;
+    iscsi_scsi_cancel_all_tasks(path->iscsi);
+}
+
+static void
+iscsi_nop_cb(struct iscsi_context *iscsi, int status, void *command_data,
+             void *private_data)
+{
+    IscsiPath *path = private_data;
+
+    if (status == SCSI_STATUS_GOOD && path->failed) {
+        error_report("iSCSI: path to %s is back", path->portal);
+        path->failed = false;
+    }
+}
+
 static void iscsi_nop_timed_event(void *opaque)
 {
     IscsiLun *iscsilun = opaque;
+    int i;
 
-    if (iscsi_get_nops_in_flight(iscsilun->iscsi) > MAX_NOP_FAILURES) {
-        error_report("iSCSI: NOP timeout. Reconnecting...");
-        iscsi_reconnect(iscsilun->iscsi);
-    }
+    for (i = 0; i < iscsilun->nr_paths; i++) {
+        IscsiPath *path = &iscsilun->paths[i];
 
-    if (iscsi_nop_out_async(iscsilun->iscsi, NULL, NULL, 0, NULL) != 0) {
-        error_report("iSCSI: failed to sent NOP-Out. Disabling NOP messages.");
-        return;
+        if (iscsi_get_nops_in_flight(path->iscsi) > MAX_NOP_FAILURES) {
+            error_report("iSCSI: NOP timeout. Reconnecting...");
+            iscsi_fail_path(path);
+            iscsi_reconnect(path->iscsi);
+        }
+
+        if (iscsi_nop_out_async(path->iscsi, iscsi_nop_cb, NULL, 0,
+                                path) != 0) {
+            if (iscsilun->nr_paths == 1) {
+                error_report("iSCSI: failed to sent NOP-Out. "
+                             "Disabling NOP messages.");
+                return;
+            }
+            iscsi_fail_path(path);
+            continue;
+        }
+        iscsi_set_events(path);
     }
 
     timer_mod(iscsilun->nop_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + NOP_INTERVAL);
-    iscsi_set_events(iscsilun);
 }
 #endif
 
 static int iscsi_readcapacity_sync(IscsiLun *iscsilun)
 {
+    struct iscsi_context *iscsi = iscsi_choose_path(iscsilun)->iscsi;
     struct scsi_task *task = NULL;
     struct scsi_readcapacity10 *rc10 = NULL;
     struct scsi_readcapacity16 *rc16 = NULL;
@@ -990,7 +1146,7 @@ static int iscsi_readcapacity_sync(IscsiLun *iscsilun)
 
         switch (iscsilun->type) {
         case TYPE_DISK:
-            task = iscsi_readcapacity16_sync(iscsilun->iscsi, iscsilun->lun);
+            task = iscsi_readcapacity16_sync(iscsi, iscsilun->lun);
             if (task != NULL && task->status == SCSI_STATUS_GOOD) {
                 rc16 = scsi_datain_unmarshall(task);
                 if (rc16 == NULL) {
@@ -1005,7 +1161,7 @@ static int iscsi_readcapacity_sync(IscsiLun *iscsilun)
             }
             break;
         case TYPE_ROM:
-            task = iscsi_readcapacity10_sync(iscsilun->iscsi, iscsilun->lun, 0, 0);
+            task = iscsi_readcapacity10_sync(iscsi, iscsilun->lun, 0, 0);
             if (task != NULL && task->status == SCSI_STATUS_GOOD) {
                 rc10 = scsi_datain_unmarshall(task);
                 if (rc10 == NULL) {
@@ -1084,6 +1240,97 @@ fail:
         return NULL;
 }
 
+/* Log in to @portal and connect to the LUN named by @iscsi_url */
+static int iscsi_connect_portal(struct iscsi_url *iscsi_url, const char *portal,
+                                const char *initiator_name,
+                                struct iscsi_context **piscsi)
+{
+    struct iscsi_context *iscsi;
+    int ret;
+
+    iscsi = iscsi_create_context(initiator_name);
+    if (iscsi == NULL) {
+        error_report("iSCSI: Failed to create iSCSI context.");
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    if (iscsi_set_targetname(iscsi, iscsi_url->target)) {
+        error_report("iSCSI: Failed to set target name.");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    if (iscsi_url->user != NULL) {
+        if (iscsi_set_initiator_username_pwd(iscsi, iscsi_url->user,
+                                             iscsi_url->passwd) != 0) {
+            error_report("Failed to set initiator username and password");
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
+    /* check if we got CHAP username/password via the options */
+    if (parse_chap(iscsi, iscsi_url->target) != 0) {
+        error_report("iSCSI: Failed to set CHAP user/password");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    if (iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL) != 0) {
+        error_report("iSCSI: Failed to set session type to normal.");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    iscsi_set_header_digest(iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
+
+    /* check if we got HEADER_DIGEST via the options */
+    parse_header_digest(iscsi, iscsi_url->target);
+
+    if (iscsi_full_connect_sync(iscsi, portal, iscsi_url->lun) != 0) {
+        error_report("iSCSI: Failed to connect to LUN : %s",
+            iscsi_get_error(iscsi));
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    *piscsi = iscsi;
+    return 0;
+
+fail:
+    if (iscsi != NULL) {
+        iscsi_destroy_context(iscsi);
+    }
+    return ret;
+}
+
+static void iscsi_add_path(IscsiLun *iscsilun, struct iscsi_context *iscsi,
+                           const char *portal)
+{
+    IscsiPath *path = &iscsilun->paths[iscsilun->nr_paths++];
+
+    path->iscsilun = iscsilun;
+    path->iscsi = iscsi;
+    path->portal = g_strdup(portal);
+}
+
+static void iscsi_destroy_paths(IscsiLun *iscsilun)
+{
+    int i;
+
+    for (i = 0; i < iscsilun->nr_paths; i++) {
+        IscsiPath *path = &iscsilun->paths[i];
+
+        qemu_aio_set_fd_handler(iscsi_get_fd(path->iscsi), NULL, NULL, NULL);
+        iscsi_destroy_context(path->iscsi);
+        g_free(path->portal);
+    }
+    g_free(iscsilun->paths);
+    iscsilun->paths = NULL;
+    iscsilun->nr_paths = 0;
+}
+
 /*
  * We support iscsi url's on the form
  * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
@@ -1097,15 +1344,19 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     struct scsi_task *task = NULL;
     struct scsi_inquiry_standard *inq = NULL;
     char *initiator_name = NULL;
+    GPtrArray *portals = g_ptr_array_new();
     QemuOpts *opts;
     Error *local_err = NULL;
     const char *filename;
+    uint64_t sessions;
+    int i, j;
     int ret;
 
     if ((BDRV_SECTOR_SIZE % 512) != 0) {
         error_report("iSCSI: Invalid BDRV_SECTOR_SIZE. "
                      "BDRV_SECTOR_SIZE(%lld) is not a multiple "
                      "of 512", BDRV_SECTOR_SIZE);
+        g_ptr_array_free(portals, true);
         return -EINVAL;
     }
 
@@ -1132,55 +1383,22 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
 
     initiator_name = parse_initiator_name(iscsi_url->target);
 
-    iscsi = iscsi_create_context(initiator_name);
-    if (iscsi == NULL) {
-        error_report("iSCSI: Failed to create iSCSI context.");
-        ret = -ENOMEM;
-        goto out;
-    }
-
-    if (iscsi_set_targetname(iscsi, iscsi_url->target)) {
-        error_report("iSCSI: Failed to set target name.");
+    sessions = parse_multipath(iscsi_url->target, portals);
+    if (sessions < 1 || sessions > ISCSI_MAX_SESSIONS) {
+        error_report("iSCSI: sessions must be between 1 and %d",
+                     ISCSI_MAX_SESSIONS);
         ret = -EINVAL;
         goto out;
     }
+    iscsilun->paths = g_new0(IscsiPath, (portals->len + 1) * sessions);
 
-    if (iscsi_url->user != NULL) {
-        ret = iscsi_set_initiator_username_pwd(iscsi, iscsi_url->user,
-                                              iscsi_url->passwd);
-        if (ret != 0) {
-            error_report("Failed to set initiator username and password");
-            ret = -EINVAL;
-            goto out;
-        }
-    }
-
-    /* check if we got CHAP username/password via the options */
-    if (parse_chap(iscsi, iscsi_url->target) != 0) {
-        error_report("iSCSI: Failed to set CHAP user/password");
-        ret = -EINVAL;
+    ret = iscsi_connect_portal(iscsi_url, iscsi_url->portal, initiator_name,
+                               &iscsi);
+    if (ret < 0) {
         goto out;
     }
 
-    if (iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL) != 0) {
-        error_report("iSCSI: Failed to set session type to normal.");
-        ret = -EINVAL;
-        goto out;
-    }
-
-    iscsi_set_header_digest(iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
-
-    /* check if we got HEADER_DIGEST via the options */
-    parse_header_digest(iscsi, iscsi_url->target);
-
-    if (iscsi_full_connect_sync(iscsi, iscsi_url->portal, iscsi_url->lun) != 0) {
-        error_report("iSCSI: Failed to connect to LUN : %s",
-            iscsi_get_error(iscsi));
-        ret = -EINVAL;
-        goto out;
-    }
-
-    iscsilun->iscsi = iscsi;
+    iscsi_add_path(iscsilun, iscsi, iscsi_url->portal);
     iscsilun->lun   = iscsi_url->lun;
 
     task = iscsi_inquiry_sync(iscsi, iscsilun->lun, 0, 0, 36);
@@ -1217,7 +1435,7 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
 
     if (iscsilun->lbpme) {
         struct scsi_inquiry_logical_block_provisioning *inq_lbp;
-        task = iscsi_do_inquiry(iscsilun->iscsi, iscsilun->lun, 1,
+        task = iscsi_do_inquiry(iscsi, iscsilun->lun, 1,
                                 SCSI_INQUIRY_PAGECODE_LOGICAL_BLOCK_PROVISIONING);
         if (task == NULL) {
             ret = -EINVAL;
@@ -1237,7 +1455,7 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
 
     if (iscsilun->lbp.lbpu || iscsilun->lbp.lbpws) {
         struct scsi_inquiry_block_limits *inq_bl;
-        task = iscsi_do_inquiry(iscsilun->iscsi, iscsilun->lun, 1,
+        task = iscsi_do_inquiry(iscsi, iscsilun->lun, 1,
                                 SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS);
         if (task == NULL) {
             ret = -EINVAL;
@@ -1272,6 +1490,25 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
                                                      iscsilun);
     }
 
+    /* Open the additional sessions.  A portal that cannot be reached now
+     * is skipped, the LUN stays usable through the remaining paths.
+     */
+    for (i = 0; i <= portals->len; i++) {
+        const char *portal = i ? g_ptr_array_index(portals, i - 1)
+                               : iscsi_url->portal;
+
+        for (j = (i == 0); j < sessions; j++) {
+            struct iscsi_context *path_iscsi;
+
+            if (iscsi_connect_portal(iscsi_url, portal, initiator_name,
+                                     &path_iscsi) < 0) {
+                error_report("iSCSI: Ignoring path to %s", portal);
+                continue;
+            }
+            iscsi_add_path(iscsilun, path_iscsi, portal);
+        }
+    }
+
 #if defined(LIBISCSI_FEATURE_NOP_COUNTER)
     /* Set up a timer for sending out iSCSI NOPs */
     iscsilun->nop_timer = timer_new_ms(QEMU_CLOCK_REALTIME, iscsi_nop_timed_event, iscsilun);
@@ -1289,11 +1526,13 @@ out:
     if (task != NULL) {
         scsi_free_scsi_task(task);
     }
+    for (i = 0; i < portals->len; i++) {
+        g_free(g_ptr_array_index(portals, i));
+    }
+    g_ptr_array_free(portals, true);
 
     if (ret) {
-        if (iscsi != NULL) {
-            iscsi_destroy_context(iscsi);
-        }
+        iscsi_destroy_paths(iscsilun);
         memset(iscsilun, 0, sizeof(IscsiLun));
     }
     return ret;
@@ -1302,14 +1541,12 @@ out:
 static void iscsi_close(BlockDriverState *bs)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
 
     if (iscsilun->nop_timer) {
         timer_del(iscsilun->nop_timer);
         timer_free(iscsilun->nop_timer);
     }
-    qemu_aio_set_fd_handler(iscsi_get_fd(iscsi), NULL, NULL, NULL);
-    iscsi_destroy_context(iscsi);
+    iscsi_destroy_paths(iscsilun);
     g_free(iscsilun->zeroblock);
     memset(iscsilun, 0, sizeof(IscsiLun));
 }
@@ -1379,9 +1616,7 @@ static int iscsi_create(const char *filename, QEMUOptionParameter *options,
 
     ret = 0;
 out:
-    if (iscsilun->iscsi != NULL) {
-        iscsi_destroy_context(iscsilun->iscsi);
-    }
+    iscsi_destroy_paths(iscsilun);
     g_free(bs->opaque);
     bs->opaque = NULL;
     bdrv_unref(bs);
@@ -1465,6 +1700,14 @@ static QemuOptsList qemu_iscsi_opts = {
             .name = "initiator-name",
             .type = QEMU_OPT_STRING,
             .help = "Initiator iqn name to use when connecting",
+        },{
+            .name = "portal",
+            .type = QEMU_OPT_STRING,
+            .help = "Additional portal of the target, may be repeated",
+        },{
+            .name = "sessions",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of sessions to open to each portal",
         },
         { /* end of list */ }
     },
@@ -12,6 +12,8 @@
 #include "qemu/queue.h"
 #include "block/raw-aio.h"
 #include "qemu/event_notifier.h"
+#include "qemu/atomic.h"
+#include "trace.h"
 
 #include <libaio.h>
 
@@ -25,6 +27,9 @@
  */
 #define MAX_EVENTS 128
 
+/* Requests collected while plugged, submitted with a single io_submit() */
+#define MAX_QUEUED_IO 128
+
 struct qemu_laiocb {
     BlockDriverAIOCB common;
     struct qemu_laio_state *ctx;
@@ -36,11 +41,25 @@ struct qemu_laiocb {
     QLIST_ENTRY(qemu_laiocb) node;
 };
 
+typedef struct {
+    struct iocb *iocbs[MAX_QUEUED_IO];
+    int plugged;
+    unsigned int idx;
+} LaioQueue;
+
 struct qemu_laio_state {
     io_context_t ctx;
     EventNotifier e;
+
+    /* io queue for submit at batch */
+    LaioQueue io_q;
+
+    /* number of requests the kernel has accepted but not completed */
+    unsigned int in_flight;
 };
 
+static int ioq_submit(struct qemu_laio_state *s);
+
 static inline ssize_t io_event_ret(struct io_event *ev)
 {
     return (ssize_t)(((uint64_t)ev->res2 << 32) | ev->res);
@@ -68,25 +87,32 @@ static void qemu_laio_process_completion(struct qemu_laio_state *s,
             }
         }
 
+        trace_laio_complete(laiocb, laiocb->common.id, ret);
         laiocb->common.cb(laiocb->common.opaque, ret);
     }
 
     qemu_aio_release(laiocb);
 }
 
-static void qemu_laio_completion_cb(EventNotifier *e)
+/* Reap all completed requests without blocking, returns how many there were */
+static int qemu_laio_process_completions(struct qemu_laio_state *s)
 {
-    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
-
-    while (event_notifier_test_and_clear(&s->e)) {
-        struct io_event events[MAX_EVENTS];
-        struct timespec ts = { 0 };
-        int nevents, i;
+    struct io_event events[MAX_EVENTS];
+    struct timespec ts = { 0 };
+    int nevents, i, total = 0;
 
+    /* Keep reaping while full batches come back, one io_getevents() call
+     * per MAX_EVENTS completions rather than per eventfd wakeup.
+     */
+    do {
         do {
-            nevents = io_getevents(s->ctx, MAX_EVENTS, MAX_EVENTS, events, &ts);
+            nevents = io_getevents(s->ctx, 0, MAX_EVENTS, events, &ts);
         } while (nevents == -EINTR);
+        if (nevents <= 0) {
+            break;
+        }
 
+        s->in_flight -= nevents;
         for (i = 0; i < nevents; i++) {
             struct iocb *iocb = events[i].obj;
             struct qemu_laiocb *laiocb =
@@ -95,7 +121,62 @@ static void qemu_laio_completion_cb(EventNotifier *e)
             laiocb->ret = io_event_ret(&events[i]);
             qemu_laio_process_completion(s, laiocb);
         }
+        total += nevents;
+    } while (nevents == MAX_EVENTS);
+
+    /* Requests that got -EAGAIN can go now that slots were freed */
+    if (total > 0 && s->io_q.idx > 0 && !s->io_q.plugged) {
+        ioq_submit(s);
     }
+    return total;
+}
+
+static void qemu_laio_completion_cb(EventNotifier *e)
+{
+    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+
+    while (event_notifier_test_and_clear(&s->e)) {
+        qemu_laio_process_completions(s);
+    }
+}
+
+/*
+ * The kernel maps the completion ring of an io_context_t into user space,
+ * with the io_context_t pointing at its header.  This is the layout from
+ * fs/aio.c; it has been stable since the ring was introduced.
+ */
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+};
+
+#define AIO_RING_MAGIC 0xa10a10a1
+
+/*
+ * Busy-wait callback for AioContext polling: peek at the completion ring
+ * without a system call, and only reap it if something is there.
+ */
+static bool qemu_laio_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
+
+    if (ring->magic != AIO_RING_MAGIC) {
+        return false;
+    }
+    if (ring->head == ring->tail) {
+        return false;
+    }
+    smp_rmb();
+
+    return qemu_laio_process_completions(s) > 0;
 }
 
 static void laio_cancel(BlockDriverAIOCB *blockacb)
@@ -107,6 +188,14 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /* The request may still sit in the plug queue, push it to the kernel */
+    if (laiocb->ctx->io_q.idx > 0) {
+        ioq_submit(laiocb->ctx);
+        if (laiocb->ret != -EINPROGRESS) {
+            return;
+        }
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -135,6 +224,84 @@ static const AIOCBInfo laio_aiocb_info = {
     .cancel             = laio_cancel,
 };
 
+/*
+ * Submit the queued requests.  Whatever the kernel does not accept because
+ * it is out of slots stays queued and is retried when completions come in;
+ * with nothing in flight that would never happen, so such requests (and any
+ * hit by another error) are failed instead.
+ */
+static int ioq_submit(struct qemu_laio_state *s)
+{
+    int ret = 0;
+    unsigned int i;
+
+    while (s->io_q.idx > 0) {
+        ret = io_submit(s->ctx, s->io_q.idx, s->io_q.iocbs);
+        if (ret == -EAGAIN && s->in_flight > 0) {
+            return 0;
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        s->in_flight += ret;
+        s->io_q.idx -= ret;
+        memmove(s->io_q.iocbs, &s->io_q.iocbs[ret],
+                s->io_q.idx * sizeof(s->io_q.iocbs[0]));
+    }
+
+    for (i = 0; i < s->io_q.idx; i++) {
+        struct qemu_laiocb *laiocb =
+                container_of(s->io_q.iocbs[i], struct qemu_laiocb, iocb);
+
+        laiocb->ret = ret;
+        qemu_laio_process_completion(s, laiocb);
+    }
+    s->io_q.idx = 0;
+
+    return ret;
+}
+
+/* Queue @iocb for the next batch.  Requests are never completed from here,
+ * the caller would not be ready for its own callback yet.
+ */
+static int ioq_enqueue(struct qemu_laio_state *s, struct iocb *iocb)
+{
+    /* submit what we have if the queue is full */
+    if (s->io_q.idx == MAX_QUEUED_IO) {
+        ioq_submit(s);
+        if (s->io_q.idx == MAX_QUEUED_IO) {
+            return -EAGAIN;
+        }
+    }
+
+    s->io_q.iocbs[s->io_q.idx++] = iocb;
+    return 0;
+}
+
+void laio_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+int laio_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0 || !unplug);
+
+    if (unplug && --s->io_q.plugged > 0) {
+        return 0;
+    }
+
+    if (s->io_q.idx > 0) {
+        return ioq_submit(s);
+    }
+    return 0;
+}
+
 BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type)
@@ -167,9 +334,19 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         goto out_free_aiocb;
     }
     io_set_eventfd(&laiocb->iocb, event_notifier_get_fd(&s->e));
+    trace_laio_submit(s, laiocb, laiocb->common.id, sector_num, nb_sectors,
+                      type);
 
-    if (io_submit(s->ctx, 1, &iocbs) < 0)
-        goto out_free_aiocb;
+    if (s->io_q.plugged) {
+        if (ioq_enqueue(s, iocbs) < 0) {
+            goto out_free_aiocb;
+        }
+    } else {
+        if (io_submit(s->ctx, 1, &iocbs) < 0) {
+            goto out_free_aiocb;
+        }
+        s->in_flight++;
+    }
     return &laiocb->common;
 
 out_free_aiocb:
@@ -190,8 +367,6 @@ void *laio_init(void)
         goto out_close_efd;
     }
 
-    qemu_aio_set_event_notifier(&s->e, qemu_laio_completion_cb);
-
     return s;
 
 out_close_efd:
@@ -200,3 +375,18 @@ out_free_state:
     g_free(s);
     return NULL;
 }
+
+void laio_detach_aio_context(void *s_, AioContext *old_context)
+{
+    struct qemu_laio_state *s = s_;
+
+    aio_set_event_notifier(old_context, &s->e, NULL);
+}
+
+void laio_attach_aio_context(void *s_, AioContext *new_context)
+{
+    struct qemu_laio_state *s = s_;
+
+    aio_set_event_notifier(new_context, &s->e, qemu_laio_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, qemu_laio_poll_cb);
+}
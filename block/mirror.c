@@ -19,6 +19,7 @@
 
 #define SLICE_TIME    100000000ULL /* ns */
 #define MAX_IN_FLIGHT 16
+#define RATE_INTERVAL 1000000000LL /* ns */
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -47,7 +48,25 @@ typedef struct MirrorBlockJob {
 
     unsigned long *in_flight_bitmap;
     int in_flight;
+    int max_op_sectors;
     int ret;
+
+    /* Chunks copied in the current and in the previous pass over the
+     * dirty bitmap.  A chunk that is dirty again one pass after it was
+     * copied is being rewritten by the guest, and is skipped once.
+     */
+    int64_t nb_chunks;
+    unsigned long *copied_bitmap;
+    unsigned long *hot_bitmap;
+
+    /* Convergence estimate, updated every RATE_INTERVAL */
+    int64_t bytes_copied;
+    int64_t rate_start_ns;
+    int64_t rate_bytes_copied;
+    int64_t rate_dirty_bytes;
+    int64_t dirty_bytes;
+    int64_t copy_rate;
+    int64_t dirty_rate;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -107,11 +126,14 @@ static void mirror_write_complete(void *opaque, int ret)
         BlockDriverState *source = s->common.bs;
         BlockErrorAction action;
 
-        bdrv_set_dirty(source, op->sector_num, op->nb_sectors);
+        bdrv_set_dirty_bitmap(source, s->dirty_bitmap, op->sector_num,
+                              op->nb_sectors);
         action = mirror_error_action(s, false, -ret);
         if (action == BDRV_ACTION_REPORT && s->ret >= 0) {
             s->ret = ret;
         }
+    } else {
+        s->bytes_copied += (int64_t)op->nb_sectors * BDRV_SECTOR_SIZE;
     }
     mirror_iteration_done(op, ret);
 }
@@ -124,7 +146,8 @@ static void mirror_read_complete(void *opaque, int ret)
         BlockDriverState *source = s->common.bs;
         BlockErrorAction action;
 
-        bdrv_set_dirty(source, op->sector_num, op->nb_sectors);
+        bdrv_set_dirty_bitmap(source, s->dirty_bitmap, op->sector_num,
+                              op->nb_sectors);
         action = mirror_error_action(s, true, -ret);
         if (action == BDRV_ACTION_REPORT && s->ret >= 0) {
             s->ret = ret;
@@ -137,6 +160,42 @@ static void mirror_read_complete(void *opaque, int ret)
                     mirror_write_complete, op);
 }
 
+/* Return the next dirty sector to copy, starting a new pass over the
+ * dirty bitmap if needed.  Must only be called if there is dirty data.
+ */
+static int64_t mirror_next_dirty(MirrorBlockJob *s)
+{
+    BlockDriverState *source = s->common.bs;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t sector_num;
+
+    for (;;) {
+        sector_num = hbitmap_iter_next(&s->hbi);
+        if (sector_num < 0) {
+            unsigned long *tmp = s->hot_bitmap;
+
+            s->hot_bitmap = s->copied_bitmap;
+            s->copied_bitmap = tmp;
+            bitmap_zero(s->copied_bitmap, s->nb_chunks);
+
+            bdrv_dirty_iter_init(source, s->dirty_bitmap, &s->hbi);
+            sector_num = hbitmap_iter_next(&s->hbi);
+            trace_mirror_restart_iter(s,
+                                      bdrv_get_dirty_count(source,
+                                                           s->dirty_bitmap));
+            assert(sector_num >= 0);
+        }
+
+        /* If everything that is dirty is hot, the pass copies nothing and
+         * the next one will find an empty hot_bitmap.  So this terminates.
+         */
+        if (!test_bit(sector_num / sectors_per_chunk, s->hot_bitmap)) {
+            return sector_num;
+        }
+        trace_mirror_skip_hot(s, sector_num);
+    }
+}
+
 static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->common.bs;
@@ -144,14 +203,7 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
     int64_t end, sector_num, next_chunk, next_sector, hbitmap_next_sector;
     MirrorOp *op;
 
-    s->sector_num = hbitmap_iter_next(&s->hbi);
-    if (s->sector_num < 0) {
-        bdrv_dirty_iter_init(source, s->dirty_bitmap, &s->hbi);
-        s->sector_num = hbitmap_iter_next(&s->hbi);
-        trace_mirror_restart_iter(s,
-                                  bdrv_get_dirty_count(source, s->dirty_bitmap));
-        assert(s->sector_num >= 0);
-    }
+    s->sector_num = mirror_next_dirty(s);
 
     hbitmap_next_sector = s->sector_num;
     sector_num = s->sector_num;
@@ -186,7 +238,8 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
         int added_sectors, added_chunks;
 
         if (!bdrv_get_dirty(source, s->dirty_bitmap, next_sector) ||
-            test_bit(next_chunk, s->in_flight_bitmap)) {
+            test_bit(next_chunk, s->in_flight_bitmap) ||
+            (nb_sectors > 0 && test_bit(next_chunk, s->hot_bitmap))) {
             assert(nb_sectors > 0);
             break;
         }
@@ -210,6 +263,13 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
         added_sectors = MIN(added_sectors, end - (sector_num + nb_sectors));
         added_chunks = (added_sectors + sectors_per_chunk - 1) / sectors_per_chunk;
 
+        /* Keep operations at most max_op_sectors large, so that the buffer
+         * is shared by several requests in flight.
+         */
+        if (nb_sectors > 0 && nb_sectors + added_sectors > s->max_op_sectors) {
+            break;
+        }
+
         /* When doing COW, it may happen that there is not enough space for
          * a full cluster.  Wait if that is the case.
          */
@@ -259,7 +319,9 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
         next_sector += sectors_per_chunk;
     }
 
-    bdrv_reset_dirty(source, sector_num, nb_sectors);
+    bdrv_reset_dirty_bitmap(source, s->dirty_bitmap, sector_num, nb_sectors);
+    bitmap_set(s->copied_bitmap, sector_num / sectors_per_chunk,
+               DIV_ROUND_UP(nb_sectors, sectors_per_chunk));
 
     /* Copy the dirty cluster.  */
     s->in_flight++;
@@ -285,6 +347,30 @@ static void mirror_free_init(MirrorBlockJob *s)
     }
 }
 
+/* Measure how fast data is copied and how fast the guest dirties it.  The
+ * guest dirtied whatever was copied plus the growth of the dirty count.
+ */
+static void mirror_update_rates(MirrorBlockJob *s, int64_t cnt)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t elapsed = now - s->rate_start_ns;
+    int64_t copied, dirtied;
+
+    s->dirty_bytes = cnt * BDRV_SECTOR_SIZE;
+    if (elapsed < RATE_INTERVAL) {
+        return;
+    }
+
+    copied = s->bytes_copied - s->rate_bytes_copied;
+    dirtied = MAX(0, s->dirty_bytes - s->rate_dirty_bytes + copied);
+    s->copy_rate = copied * (double)RATE_INTERVAL / elapsed;
+    s->dirty_rate = dirtied * (double)RATE_INTERVAL / elapsed;
+
+    s->rate_start_ns = now;
+    s->rate_bytes_copied = s->bytes_copied;
+    s->rate_dirty_bytes = s->dirty_bytes;
+}
+
 static void mirror_drain(MirrorBlockJob *s)
 {
     while (s->in_flight > 0) {
@@ -292,11 +378,33 @@ static void mirror_drain(MirrorBlockJob *s)
     }
 }
 
+typedef struct {
+    int ret;
+} MirrorExitData;
+
+static void mirror_exit(BlockJob *job, void *opaque)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+    MirrorExitData *data = opaque;
+
+    if (s->should_complete && data->ret == 0) {
+        if (bdrv_get_flags(s->target) != bdrv_get_flags(s->common.bs)) {
+            bdrv_reopen(s->target, bdrv_get_flags(s->common.bs), NULL);
+        }
+        bdrv_swap(s->target, s->common.bs);
+    }
+    bdrv_close(s->target);
+    bdrv_unref(s->target);
+    block_job_completed(&s->common, data->ret);
+    g_free(data);
+}
+
 static void coroutine_fn mirror_run(void *opaque)
 {
     MirrorBlockJob *s = opaque;
+    MirrorExitData *data;
     BlockDriverState *bs = s->common.bs;
-    int64_t sector_num, end, sectors_per_chunk, length;
+    int64_t sector_num, end, sectors_per_chunk, length, max_op;
     uint64_t last_pause_ns;
     BlockDriverInfo bdi;
     char backing_filename[1024];
@@ -315,6 +423,9 @@ static void coroutine_fn mirror_run(void *opaque)
 
     length = (bdrv_getlength(bs) + s->granularity - 1) / s->granularity;
     s->in_flight_bitmap = bitmap_new(length);
+    s->nb_chunks = length;
+    s->copied_bitmap = bitmap_new(length);
+    s->hot_bitmap = bitmap_new(length);
 
     /* If we have no backing file yet in the destination, we cannot let
      * the destination do COW.  Instead, we copy sectors around the
@@ -330,6 +441,18 @@ static void coroutine_fn mirror_run(void *opaque)
         }
     }
 
+    /* Split the buffer among MAX_IN_FLIGHT operations, each a multiple of
+     * the target's optimal transfer length if it has one.
+     */
+    max_op = s->buf_size / MAX_IN_FLIGHT;
+    if (s->target->bl.opt_transfer_length) {
+        int64_t opt = (int64_t)s->target->bl.opt_transfer_length *
+                      BDRV_SECTOR_SIZE;
+        max_op = MAX(opt, QEMU_ALIGN_DOWN(max_op, opt));
+    }
+    max_op = MAX(s->granularity, QEMU_ALIGN_DOWN(max_op, s->granularity));
+    s->max_op_sectors = MIN(max_op, s->buf_size) >> BDRV_SECTOR_BITS;
+
     end = s->common.len >> BDRV_SECTOR_BITS;
     s->buf = qemu_blockalign(bs, s->buf_size);
     sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
@@ -350,7 +473,7 @@ static void coroutine_fn mirror_run(void *opaque)
 
             assert(n > 0);
             if (ret == 1) {
-                bdrv_set_dirty(bs, sector_num, n);
+                bdrv_set_dirty_bitmap(bs, s->dirty_bitmap, sector_num, n);
                 sector_num = next;
             } else {
                 sector_num += n;
@@ -360,6 +483,9 @@ static void coroutine_fn mirror_run(void *opaque)
 
     bdrv_dirty_iter_init(bs, s->dirty_bitmap, &s->hbi);
     last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    s->rate_start_ns = last_pause_ns;
+    s->rate_dirty_bytes = bdrv_get_dirty_count(bs, s->dirty_bitmap) *
+                          BDRV_SECTOR_SIZE;
     for (;;) {
         uint64_t delay_ns;
         int64_t cnt;
@@ -371,6 +497,7 @@ static void coroutine_fn mirror_run(void *opaque)
         }
 
         cnt = bdrv_get_dirty_count(bs, s->dirty_bitmap);
+        mirror_update_rates(s, cnt);
 
         /* Note that even when no rate limit is applied we need to yield
          * periodically with no pending I/O so that qemu_aio_flush() returns.
@@ -474,17 +601,15 @@ immediate_exit:
     qemu_vfree(s->buf);
     g_free(s->cow_bitmap);
     g_free(s->in_flight_bitmap);
+    g_free(s->copied_bitmap);
+    g_free(s->hot_bitmap);
     bdrv_release_dirty_bitmap(bs, s->dirty_bitmap);
     bdrv_iostatus_disable(s->target);
-    if (s->should_complete && ret == 0) {
-        if (bdrv_get_flags(s->target) != bdrv_get_flags(s->common.bs)) {
-            bdrv_reopen(s->target, bdrv_get_flags(s->common.bs), NULL);
-        }
-        bdrv_swap(s->target, s->common.bs);
-    }
-    bdrv_close(s->target);
-    bdrv_unref(s->target);
-    block_job_completed(&s->common, ret);
+
+    /* Swap images and close the target in main loop */
+    data = g_malloc(sizeof(*data));
+    data->ret = ret;
+    block_job_defer_to_main_loop(&s->common, mirror_exit, data);
 }
 
 static void mirror_set_speed(BlockJob *job, int64_t speed, Error **errp)
@@ -505,6 +630,26 @@ static void mirror_iostatus_reset(BlockJob *job)
     bdrv_iostatus_reset(s->target);
 }
 
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    info->has_copy_rate = true;
+    info->copy_rate = s->copy_rate;
+    info->has_dirty_rate = true;
+    info->dirty_rate = s->dirty_rate;
+
+    /* Leave the estimate out if the guest dirties data as fast as we copy */
+    if (s->dirty_bytes == 0) {
+        info->has_convergence_eta = true;
+        info->convergence_eta = 0;
+    } else if (s->copy_rate > s->dirty_rate) {
+        info->has_convergence_eta = true;
+        info->convergence_eta = s->dirty_bytes * 1000 /
+                                (s->copy_rate - s->dirty_rate);
+    }
+}
+
 static void mirror_complete(BlockJob *job, Error **errp)
 {
     MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
@@ -534,6 +679,7 @@ static const BlockJobDriver mirror_job_driver = {
     .set_speed     = mirror_set_speed,
     .iostatus_reset= mirror_iostatus_reset,
     .complete      = mirror_complete,
+    .query         = mirror_query,
 };
 
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
@@ -544,6 +690,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   void *opaque, Error **errp)
 {
     MirrorBlockJob *s;
+    BdrvDirtyBitmap *dirty_bitmap;
 
     if (granularity == 0) {
         /* Choose the default granularity based on the target file's cluster
@@ -566,8 +713,14 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
         return;
     }
 
+    dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity, NULL, errp);
+    if (!dirty_bitmap) {
+        return;
+    }
+
     s = block_job_create(&mirror_job_driver, bs, speed, cb, opaque, errp);
     if (!s) {
+        bdrv_release_dirty_bitmap(bs, dirty_bitmap);
         return;
     }
 
@@ -578,7 +731,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
     s->granularity = granularity;
     s->buf_size = MAX(buf_size, granularity);
 
-    s->dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity);
+    s->dirty_bitmap = dirty_bitmap;
     bdrv_set_enable_write_cache(s->target, true);
     bdrv_set_on_error(s->target, on_target_error, on_target_error);
     bdrv_iostatus_enable(s->target);
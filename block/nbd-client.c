@@ -121,29 +121,143 @@ static int nbd_co_send_request(NbdClientSession *s,
     return rc;
 }
 
-static void nbd_co_receive_reply(NbdClientSession *s,
-    struct nbd_request *request, struct nbd_reply *reply,
-    QEMUIOVector *qiov, int offset)
+/* First extent returned by NBD_CMD_BLOCK_STATUS */
+typedef struct NbdExtent {
+    uint32_t length;
+    uint32_t flags;
+} NbdExtent;
+
+static int nbd_co_drop(NbdClientSession *s, uint32_t len)
+{
+    char buf[256];
+
+    while (len > 0) {
+        uint32_t n = MIN(len, sizeof(buf));
+        if (qemu_co_recv(s->sock, buf, n) != n) {
+            return -EIO;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/* Process the payload of the structured reply chunk whose header is in
+ * s->reply.  An error chunk stores the server's error in *error; a
+ * negative return value means that the stream cannot be parsed anymore.
+ */
+static int nbd_co_receive_chunk(NbdClientSession *s,
+    struct nbd_request *request, QEMUIOVector *qiov, int offset,
+    NbdExtent *extent, int *error)
 {
+    struct nbd_reply *reply = &s->reply;
+    uint8_t buf[12];
+    uint64_t from;
+    uint32_t len;
+
+    switch (reply->type) {
+    case NBD_REPLY_TYPE_NONE:
+        return reply->length ? -EIO : 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+        if (!qiov || reply->length < 8 ||
+            qemu_co_recv(s->sock, buf, 8) != 8) {
+            return -EIO;
+        }
+        from = be64_to_cpup((uint64_t *)buf);
+        len = reply->length - 8;
+        if (from < request->from ||
+            from + len > request->from + request->len) {
+            return -EIO;
+        }
+        if (qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
+                          offset + from - request->from, len) != len) {
+            return -EIO;
+        }
+        return 0;
+
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        if (!qiov || reply->length != 12 ||
+            qemu_co_recv(s->sock, buf, 12) != 12) {
+            return -EIO;
+        }
+        from = be64_to_cpup((uint64_t *)buf);
+        len = be32_to_cpup((uint32_t *)(buf + 8));
+        if (from < request->from ||
+            from + len > request->from + request->len) {
+            return -EIO;
+        }
+        qemu_iovec_memset(qiov, offset + from - request->from, 0, len);
+        return 0;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        if (!extent || reply->length < 12 ||
+            qemu_co_recv(s->sock, buf, 12) != 12) {
+            return -EIO;
+        }
+        if (be32_to_cpup((uint32_t *)buf) != s->ext.context_id) {
+            return -EIO;
+        }
+        extent->length = be32_to_cpup((uint32_t *)(buf + 4));
+        extent->flags = be32_to_cpup((uint32_t *)(buf + 8));
+        return nbd_co_drop(s, reply->length - 12);
+
+    default:
+        if (NBD_REPLY_TYPE_IS_ERR(reply->type)) {
+            if (reply->length < 6 || qemu_co_recv(s->sock, buf, 4) != 4) {
+                return -EIO;
+            }
+            *error = be32_to_cpup((uint32_t *)buf) ?: EIO;
+            return nbd_co_drop(s, reply->length - 4);
+        }
+
+        /* Unknown informational chunks can be skipped */
+        return nbd_co_drop(s, reply->length);
+    }
+}
+
+/* Wait for the reply to @request, which is either a simple reply or a
+ * series of structured reply chunks, and return the (negative) error.
+ */
+static int nbd_co_receive_reply(NbdClientSession *s,
+    struct nbd_request *request,
+    QEMUIOVector *qiov, int offset, NbdExtent *extent)
+{
+    int error = 0;
     int ret;
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
-                                offset, request->len);
-            if (ret != request->len) {
-                reply->error = EIO;
+    for (;;) {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        if (s->reply.handle != request->handle) {
+            return -EIO;
+        }
+
+        if (s->reply.magic != NBD_STRUCTURED_REPLY_MAGIC) {
+            error = s->reply.error;
+            if (qiov && error == 0) {
+                ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
+                                    offset, request->len);
+                if (ret != request->len) {
+                    return -EIO;
+                }
             }
+
+            /* Tell the read handler to read another header.  */
+            s->reply.handle = 0;
+            return -error;
+        }
+
+        ret = nbd_co_receive_chunk(s, request, qiov, offset, extent, &error);
+        if (ret < 0) {
+            return ret;
         }
 
         /* Tell the read handler to read another header.  */
         s->reply.handle = 0;
+        if (s->reply.flags & NBD_REPLY_FLAG_DONE) {
+            return -error;
+        }
     }
 }
 
@@ -186,7 +300,6 @@ static int nbd_co_readv_1(NbdClientSession *client, int64_t sector_num,
                           int offset)
 {
     struct nbd_request request = { .type = NBD_CMD_READ };
-    struct nbd_reply reply;
     ssize_t ret;
 
     request.from = sector_num * 512;
@@ -194,13 +307,11 @@ static int nbd_co_readv_1(NbdClientSession *client, int64_t sector_num,
 
     nbd_coroutine_start(client, &request);
     ret = nbd_co_send_request(client, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, qiov, offset);
+    if (ret >= 0) {
+        ret = nbd_co_receive_reply(client, &request, qiov, offset, NULL);
     }
     nbd_coroutine_end(client, &request);
-    return -reply.error;
+    return ret;
 
 }
 
@@ -209,7 +320,6 @@ static int nbd_co_writev_1(NbdClientSession *client, int64_t sector_num,
                            int offset)
 {
     struct nbd_request request = { .type = NBD_CMD_WRITE };
-    struct nbd_reply reply;
     ssize_t ret;
 
     if (!bdrv_enable_write_cache(client->bs) &&
@@ -222,13 +332,11 @@ static int nbd_co_writev_1(NbdClientSession *client, int64_t sector_num,
 
     nbd_coroutine_start(client, &request);
     ret = nbd_co_send_request(client, &request, qiov, offset);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+    if (ret >= 0) {
+        ret = nbd_co_receive_reply(client, &request, NULL, 0, NULL);
     }
     nbd_coroutine_end(client, &request);
-    return -reply.error;
+    return ret;
 }
 
 /* qemu-nbd has a limit of slightly less than 1M per request.  Try to
@@ -274,7 +382,6 @@ int nbd_client_session_co_writev(NbdClientSession *client, int64_t sector_num,
 int nbd_client_session_co_flush(NbdClientSession *client)
 {
     struct nbd_request request = { .type = NBD_CMD_FLUSH };
-    struct nbd_reply reply;
     ssize_t ret;
 
     if (!(client->nbdflags & NBD_FLAG_SEND_FLUSH)) {
@@ -290,20 +397,17 @@ int nbd_client_session_co_flush(NbdClientSession *client)
 
     nbd_coroutine_start(client, &request);
     ret = nbd_co_send_request(client, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+    if (ret >= 0) {
+        ret = nbd_co_receive_reply(client, &request, NULL, 0, NULL);
     }
     nbd_coroutine_end(client, &request);
-    return -reply.error;
+    return ret;
 }
 
 int nbd_client_session_co_discard(NbdClientSession *client, int64_t sector_num,
     int nb_sectors)
 {
     struct nbd_request request = { .type = NBD_CMD_TRIM };
-    struct nbd_reply reply;
     ssize_t ret;
 
     if (!(client->nbdflags & NBD_FLAG_SEND_TRIM)) {
@@ -314,14 +418,57 @@ int nbd_client_session_co_discard(NbdClientSession *client, int64_t sector_num,
 
     nbd_coroutine_start(client, &request);
     ret = nbd_co_send_request(client, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+    if (ret >= 0) {
+        ret = nbd_co_receive_reply(client, &request, NULL, 0, NULL);
+    }
+    nbd_coroutine_end(client, &request);
+    return ret;
+
+}
+
+/* Requests for more than this would overflow the 32-bit length */
+#define NBD_MAX_STATUS_SECTORS (INT_MAX / 512)
+
+int64_t nbd_client_session_co_get_block_status(NbdClientSession *client,
+    int64_t sector_num, int nb_sectors, int *pnum)
+{
+    struct nbd_request request = {
+        .type = NBD_CMD_BLOCK_STATUS | NBD_CMD_FLAG_REQ_ONE
+    };
+    NbdExtent extent = { 0, 0 };
+    ssize_t ret;
+
+    if (!client->ext.base_allocation) {
+        *pnum = nb_sectors;
+        return BDRV_BLOCK_DATA;
+    }
+
+    request.from = sector_num * 512;
+    request.len = MIN(nb_sectors, NBD_MAX_STATUS_SECTORS) * 512;
+
+    nbd_coroutine_start(client, &request);
+    ret = nbd_co_send_request(client, &request, NULL, 0);
+    if (ret >= 0) {
+        ret = nbd_co_receive_reply(client, &request, NULL, 0, &extent);
     }
     nbd_coroutine_end(client, &request);
-    return -reply.error;
+    if (ret < 0) {
+        return ret;
+    }
+
+    *pnum = MIN(extent.length / 512, nb_sectors);
+    if (*pnum == 0) {
+        /* Sub-sector extent or no extent at all, assume there's data */
+        *pnum = 1;
+        return BDRV_BLOCK_DATA;
+    }
 
+    /* A hole that is not known to read as zero still has to be read */
+    if (!(extent.flags & NBD_STATE_ZERO)) {
+        return BDRV_BLOCK_DATA;
+    }
+    return BDRV_BLOCK_ZERO |
+           ((extent.flags & NBD_STATE_HOLE) ? 0 : BDRV_BLOCK_DATA);
 }
 
 static void nbd_teardown_connection(NbdClientSession *client)
@@ -363,7 +510,7 @@ int nbd_client_session_init(NbdClientSession *client, BlockDriverState *bs,
     qemu_set_block(sock);
     ret = nbd_receive_negotiate(sock, export,
                                 &client->nbdflags, &client->size,
-                                &client->blocksize);
+                                &client->blocksize, &client->ext);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         closesocket(sock);
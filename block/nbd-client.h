@@ -21,6 +21,7 @@ typedef struct NbdClientSession {
     uint32_t nbdflags;
     off_t size;
     size_t blocksize;
+    NBDExtensions ext;
 
     CoMutex send_mutex;
     CoMutex free_sema;
@@ -46,5 +47,8 @@ int nbd_client_session_co_writev(NbdClientSession *client, int64_t sector_num,
                                  int nb_sectors, QEMUIOVector *qiov);
 int nbd_client_session_co_readv(NbdClientSession *client, int64_t sector_num,
                                 int nb_sectors, QEMUIOVector *qiov);
+int64_t nbd_client_session_co_get_block_status(NbdClientSession *client,
+                                               int64_t sector_num,
+                                               int nb_sectors, int *pnum);
 
 #endif /* NBD_CLIENT_H */
@@ -310,6 +310,16 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
                                          nb_sectors);
 }
 
+static int64_t coroutine_fn nbd_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum)
+{
+    BDRVNBDState *s = bs->opaque;
+
+    return nbd_client_session_co_get_block_status(&s->client, sector_num,
+                                                  nb_sectors, pnum);
+}
+
 static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
@@ -337,6 +347,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
     .bdrv_getlength      = nbd_getlength,
+    .bdrv_co_get_block_status = nbd_co_get_block_status,
 };
 
 static BlockDriver bdrv_nbd_tcp = {
@@ -351,6 +362,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
     .bdrv_getlength      = nbd_getlength,
+    .bdrv_co_get_block_status = nbd_co_get_block_status,
 };
 
 static BlockDriver bdrv_nbd_unix = {
@@ -365,6 +377,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
     .bdrv_getlength      = nbd_getlength,
+    .bdrv_co_get_block_status = nbd_co_get_block_status,
 };
 
 static void bdrv_nbd_init(void)
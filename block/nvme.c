@@ -0,0 +1,1418 @@
+/*
+ * NVMe block driver based on VFIO
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/vfio.h>
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/nvme.h"
+#include "hw/pci/pci_regs.h"
+#include "qemu/error-report.h"
+#include "qemu/event_notifier.h"
+#include "qemu/timer.h"
+#include "qapi/qmp/qstring.h"
+#include "trace.h"
+
+/*
+ * The controller is bound to vfio-pci and driven entirely from userspace:
+ * the submission and completion queues live in memory that is mapped into
+ * the IOMMU once at open time, doorbells are written straight into BAR0,
+ * and completions are reaped either from the MSI-X eventfd or by polling
+ * the phase bit from the AioContext's busy-wait loop.
+ */
+
+#define NVME_SQ_ENTRY_BYTES     64
+#define NVME_CQ_ENTRY_BYTES     16
+#define NVME_ADMIN_QUEUE_SIZE   32
+#define NVME_QUEUE_SIZE         128
+#define NVME_MAX_QUEUES         8
+#define NVME_DOORBELL_OFFSET    0x1000
+
+/* Every request owns a bounce buffer of this size, mapped at open time */
+#define NVME_BOUNCE_SIZE        (64 * 1024)
+
+/*
+ * IOVA space: queues, PRP lists and bounce buffers are mapped permanently
+ * from NVME_IOVA_BASE up.  Guest buffers of large aligned requests get
+ * temporary mappings from the second range, which is handed out linearly
+ * and unmapped in one go when no request uses it any more.
+ */
+#define NVME_IOVA_BASE          0x10000ULL
+#define NVME_IOVA_TEMP_BASE     (1ULL << 32)
+#define NVME_IOVA_TEMP_END      (NVME_IOVA_TEMP_BASE + (1ULL << 30))
+#define NVME_TEMP_RESET_SIZE    (64 * 1024 * 1024)
+
+typedef struct BDRVNVMeState BDRVNVMeState;
+typedef struct NVMeRequest NVMeRequest;
+
+typedef void NVMeCompletionFunc(NVMeRequest *req, void *opaque, int ret);
+
+struct NVMeRequest {
+    NVMeCompletionFunc *cb;
+    void *opaque;
+    uint16_t cid;
+    int free_next;
+
+    /* One PRP list page and one bounce buffer per request */
+    uint64_t *prp_list;
+    uint64_t prp_list_iova;
+    uint8_t *bounce;
+    uint64_t bounce_iova;
+
+    /* Where to copy bounced read data on completion */
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+    size_t bounce_len;
+};
+
+typedef struct NVMeQueuePair {
+    BDRVNVMeState *s;
+    int index;
+    int size;
+
+    uint8_t *mem;
+    size_t mem_size;
+    uint64_t iova;
+
+    uint8_t *sq;
+    uint64_t sq_iova;
+    volatile uint32_t *sq_doorbell;
+    int sq_tail;
+    int unkicked;
+
+    uint8_t *cq;
+    uint64_t cq_iova;
+    volatile uint32_t *cq_doorbell;
+    int cq_head;
+    int cq_phase;
+
+    /* size - 1 requests, so that the submission queue never overflows */
+    NVMeRequest *reqs;
+    int free_req_head;
+    CoQueue free_req_queue;
+    int in_flight;
+    bool busy;
+} NVMeQueuePair;
+
+struct BDRVNVMeState {
+    int container;
+    int group;
+    int device;
+    void *bar;
+    size_t bar_size;
+    volatile NvmeBar *regs;
+    volatile uint32_t *doorbells;
+    int doorbell_scale;
+    size_t page_size;
+    int64_t timeout_ms;
+
+    /* queues[0] is the admin queue, I/O queues start at 1 */
+    NVMeQueuePair *queues[NVME_MAX_QUEUES + 1];
+    int nr_queues;
+    int next_queue;
+    int queue_size;
+
+    uint32_t nsid;
+    uint64_t nsze;
+    size_t max_transfer;
+    bool write_cache;
+    bool supports_discard;
+
+    EventNotifier irq_notifier;
+    int plugged;
+
+    uint64_t iova_next;
+    uint64_t temp_iova_next;
+    int temp_users;
+    CoQueue temp_queue;
+};
+
+typedef struct NVMeCoData {
+    Coroutine *co;
+    int ret;
+    int pending;
+    bool waiting;
+} NVMeCoData;
+
+static int nvme_vfio_dma_map(BDRVNVMeState *s, void *host, size_t size,
+                             uint64_t iova)
+{
+    struct vfio_iommu_type1_dma_map dma_map = {
+        .argsz = sizeof(dma_map),
+        .flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+        .vaddr = (uintptr_t)host,
+        .iova = iova,
+        .size = size,
+    };
+
+    if (ioctl(s->container, VFIO_IOMMU_MAP_DMA, &dma_map)) {
+        return -errno;
+    }
+    return 0;
+}
+
+static void nvme_vfio_dma_unmap(BDRVNVMeState *s, uint64_t iova, size_t size)
+{
+    struct vfio_iommu_type1_dma_unmap dma_unmap = {
+        .argsz = sizeof(dma_unmap),
+        .iova = iova,
+        .size = size,
+    };
+
+    if (ioctl(s->container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap)) {
+        error_report("nvme: failed to unmap IOVA 0x%" PRIx64 ": %s",
+                     iova, strerror(errno));
+    }
+}
+
+static void nvme_vfio_close(BDRVNVMeState *s)
+{
+    if (s->bar) {
+        munmap(s->bar, s->bar_size);
+        s->bar = NULL;
+    }
+    if (s->device >= 0) {
+        close(s->device);
+        s->device = -1;
+    }
+    if (s->group >= 0) {
+        close(s->group);
+        s->group = -1;
+    }
+    if (s->container >= 0) {
+        close(s->container);
+        s->container = -1;
+    }
+}
+
+static int nvme_vfio_open(BDRVNVMeState *s, const char *device, Error **errp)
+{
+    struct vfio_group_status group_status = { .argsz = sizeof(group_status) };
+    struct vfio_device_info device_info = { .argsz = sizeof(device_info) };
+    struct vfio_region_info bar_info = {
+        .argsz = sizeof(bar_info),
+        .index = VFIO_PCI_BAR0_REGION_INDEX,
+    };
+    struct vfio_region_info config_info = {
+        .argsz = sizeof(config_info),
+        .index = VFIO_PCI_CONFIG_REGION_INDEX,
+    };
+    char link[PATH_MAX];
+    char *path;
+    const char *name;
+    ssize_t len;
+    int groupid;
+    uint16_t cmd;
+    int ret;
+
+    path = g_strdup_printf("/sys/bus/pci/devices/%s/iommu_group", device);
+    len = readlink(path, link, sizeof(link) - 1);
+    g_free(path);
+    if (len < 0) {
+        error_setg_errno(errp, errno, "Cannot find IOMMU group of %s",
+                         device);
+        return -errno;
+    }
+    link[len] = '\0';
+    name = strrchr(link, '/');
+    if (sscanf(name ? name + 1 : link, "%d", &groupid) != 1) {
+        error_setg(errp, "Invalid IOMMU group link '%s'", link);
+        return -EINVAL;
+    }
+
+    s->container = qemu_open("/dev/vfio/vfio", O_RDWR);
+    if (s->container < 0) {
+        error_setg_errno(errp, errno, "Cannot open /dev/vfio/vfio");
+        return -errno;
+    }
+    if (ioctl(s->container, VFIO_GET_API_VERSION) != VFIO_API_VERSION) {
+        error_setg(errp, "Unsupported VFIO API version");
+        return -EINVAL;
+    }
+    if (!ioctl(s->container, VFIO_CHECK_EXTENSION, VFIO_TYPE1_IOMMU)) {
+        error_setg(errp, "VFIO type 1 IOMMU is not supported");
+        return -EINVAL;
+    }
+
+    path = g_strdup_printf("/dev/vfio/%d", groupid);
+    s->group = qemu_open(path, O_RDWR);
+    if (s->group < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Cannot open %s", path);
+        g_free(path);
+        return ret;
+    }
+    g_free(path);
+
+    if (ioctl(s->group, VFIO_GROUP_GET_STATUS, &group_status)) {
+        error_setg_errno(errp, errno, "Cannot get VFIO group status");
+        return -errno;
+    }
+    if (!(group_status.flags & VFIO_GROUP_FLAGS_VIABLE)) {
+        error_setg(errp, "VFIO group %d is not viable; are all devices in "
+                   "it bound to vfio-pci?", groupid);
+        return -EINVAL;
+    }
+    if (ioctl(s->group, VFIO_GROUP_SET_CONTAINER, &s->container)) {
+        error_setg_errno(errp, errno, "Cannot add VFIO group to container");
+        return -errno;
+    }
+    if (ioctl(s->container, VFIO_SET_IOMMU, VFIO_TYPE1_IOMMU)) {
+        error_setg_errno(errp, errno, "Cannot set up the IOMMU");
+        return -errno;
+    }
+
+    s->device = ioctl(s->group, VFIO_GROUP_GET_DEVICE_FD, device);
+    if (s->device < 0) {
+        error_setg_errno(errp, errno, "Cannot get VFIO device fd for %s",
+                         device);
+        return -errno;
+    }
+    if (ioctl(s->device, VFIO_DEVICE_GET_INFO, &device_info)) {
+        error_setg_errno(errp, errno, "Cannot get VFIO device info");
+        return -errno;
+    }
+    if (device_info.num_regions <= VFIO_PCI_CONFIG_REGION_INDEX ||
+        device_info.num_irqs <= VFIO_PCI_MSIX_IRQ_INDEX) {
+        error_setg(errp, "%s is not a PCI device", device);
+        return -EINVAL;
+    }
+
+    if (ioctl(s->device, VFIO_DEVICE_GET_REGION_INFO, &bar_info)) {
+        error_setg_errno(errp, errno, "Cannot get BAR0 info");
+        return -errno;
+    }
+    if (!(bar_info.flags & VFIO_REGION_INFO_FLAG_MMAP) ||
+        bar_info.size < NVME_DOORBELL_OFFSET + 2 * sizeof(uint32_t)) {
+        error_setg(errp, "BAR0 of %s cannot be mapped", device);
+        return -EINVAL;
+    }
+    s->bar = mmap(NULL, bar_info.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  s->device, bar_info.offset);
+    if (s->bar == MAP_FAILED) {
+        s->bar = NULL;
+        error_setg_errno(errp, errno, "Cannot map BAR0");
+        return -errno;
+    }
+    s->bar_size = bar_info.size;
+
+    /* Enable memory space and bus mastering */
+    if (ioctl(s->device, VFIO_DEVICE_GET_REGION_INFO, &config_info)) {
+        error_setg_errno(errp, errno, "Cannot get PCI config space info");
+        return -errno;
+    }
+    if (pread(s->device, &cmd, sizeof(cmd),
+              config_info.offset + PCI_COMMAND) != sizeof(cmd)) {
+        error_setg_errno(errp, errno, "Cannot read PCI command register");
+        return -EIO;
+    }
+    cmd = cpu_to_le16(le16_to_cpu(cmd) | PCI_COMMAND_MEMORY |
+                      PCI_COMMAND_MASTER);
+    if (pwrite(s->device, &cmd, sizeof(cmd),
+               config_info.offset + PCI_COMMAND) != sizeof(cmd)) {
+        error_setg_errno(errp, errno, "Cannot write PCI command register");
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/* Route MSI-X vector 0, which all completion queues use, to the eventfd */
+static int nvme_vfio_set_irq(BDRVNVMeState *s, EventNotifier *e)
+{
+    struct vfio_irq_set *irq_set;
+    size_t argsz = sizeof(*irq_set) + sizeof(int32_t);
+    int32_t fd = e ? event_notifier_get_fd(e) : -1;
+    int ret = 0;
+
+    irq_set = g_malloc0(argsz);
+    irq_set->argsz = argsz;
+    irq_set->index = VFIO_PCI_MSIX_IRQ_INDEX;
+    irq_set->start = 0;
+    if (e) {
+        irq_set->flags = VFIO_IRQ_SET_DATA_EVENTFD |
+                         VFIO_IRQ_SET_ACTION_TRIGGER;
+        irq_set->count = 1;
+        memcpy(&irq_set->data, &fd, sizeof(fd));
+    } else {
+        irq_set->flags = VFIO_IRQ_SET_DATA_NONE |
+                         VFIO_IRQ_SET_ACTION_TRIGGER;
+        irq_set->count = 0;
+    }
+    if (ioctl(s->device, VFIO_DEVICE_SET_IRQS, irq_set)) {
+        ret = -errno;
+    }
+    g_free(irq_set);
+    return ret;
+}
+
+static void nvme_free_queue_pair(BDRVNVMeState *s, NVMeQueuePair *q)
+{
+    nvme_vfio_dma_unmap(s, q->iova, q->mem_size);
+    qemu_vfree(q->mem);
+    g_free(q->reqs);
+    g_free(q);
+}
+
+static NVMeQueuePair *nvme_create_queue_pair(BDRVNVMeState *s, int index,
+                                             int size, Error **errp)
+{
+    NVMeQueuePair *q;
+    size_t sq_bytes, cq_bytes;
+    uint8_t *p;
+    uint64_t iova;
+    int nr_reqs = size - 1;
+    int i, ret;
+
+    sq_bytes = ROUND_UP(size * NVME_SQ_ENTRY_BYTES, s->page_size);
+    cq_bytes = ROUND_UP(size * NVME_CQ_ENTRY_BYTES, s->page_size);
+
+    q = g_new0(NVMeQueuePair, 1);
+    q->s = s;
+    q->index = index;
+    q->size = size;
+    q->mem_size = sq_bytes + cq_bytes +
+                  nr_reqs * (s->page_size + NVME_BOUNCE_SIZE);
+    if (s->iova_next + q->mem_size > NVME_IOVA_TEMP_BASE) {
+        error_setg(errp, "Out of IOVA space for queue %d", index);
+        g_free(q);
+        return NULL;
+    }
+    q->mem = qemu_memalign(s->page_size, q->mem_size);
+    memset(q->mem, 0, q->mem_size);
+    q->iova = s->iova_next;
+    ret = nvme_vfio_dma_map(s, q->mem, q->mem_size, q->iova);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Cannot map queue %d for DMA", index);
+        qemu_vfree(q->mem);
+        g_free(q);
+        return NULL;
+    }
+    s->iova_next += q->mem_size;
+
+    q->sq = q->mem;
+    q->sq_iova = q->iova;
+    q->cq = q->mem + sq_bytes;
+    q->cq_iova = q->iova + sq_bytes;
+    q->cq_phase = 1;
+    q->sq_doorbell = &s->doorbells[(2 * index) * s->doorbell_scale];
+    q->cq_doorbell = &s->doorbells[(2 * index + 1) * s->doorbell_scale];
+
+    p = q->cq + cq_bytes;
+    iova = q->cq_iova + cq_bytes;
+    q->reqs = g_new0(NVMeRequest, nr_reqs);
+    for (i = 0; i < nr_reqs; i++) {
+        NVMeRequest *req = &q->reqs[i];
+
+        req->cid = i + 1;
+        req->free_next = i + 1 < nr_reqs ? i + 1 : -1;
+        req->prp_list = (uint64_t *)p;
+        req->prp_list_iova = iova;
+        p += s->page_size;
+        iova += s->page_size;
+        req->bounce = p;
+        req->bounce_iova = iova;
+        p += NVME_BOUNCE_SIZE;
+        iova += NVME_BOUNCE_SIZE;
+    }
+    q->free_req_head = 0;
+    qemu_co_queue_init(&q->free_req_queue);
+
+    return q;
+}
+
+static NVMeRequest *nvme_get_free_req_nowait(NVMeQueuePair *q)
+{
+    NVMeRequest *req;
+
+    if (q->free_req_head == -1) {
+        return NULL;
+    }
+    req = &q->reqs[q->free_req_head];
+    q->free_req_head = req->free_next;
+    req->free_next = -1;
+    return req;
+}
+
+static NVMeRequest *coroutine_fn nvme_get_free_req(NVMeQueuePair *q)
+{
+    NVMeRequest *req;
+
+    while ((req = nvme_get_free_req_nowait(q)) == NULL) {
+        qemu_co_queue_wait(&q->free_req_queue);
+    }
+    return req;
+}
+
+static void nvme_put_free_req(NVMeQueuePair *q, NVMeRequest *req)
+{
+    req->cb = NULL;
+    req->qiov = NULL;
+    req->free_next = q->free_req_head;
+    q->free_req_head = req - q->reqs;
+    qemu_co_enter_next(&q->free_req_queue);
+}
+
+static void nvme_kick(BDRVNVMeState *s, NVMeQueuePair *q)
+{
+    if (s->plugged || !q->unkicked) {
+        return;
+    }
+    trace_nvme_kick(s, q->index, q->unkicked);
+    /* The entries must be visible before the controller sees the tail */
+    smp_wmb();
+    *q->sq_doorbell = cpu_to_le32(q->sq_tail);
+    q->unkicked = 0;
+}
+
+static void nvme_submit_command(BDRVNVMeState *s, NVMeQueuePair *q,
+                                NVMeRequest *req, NvmeCmd *cmd,
+                                NVMeCompletionFunc *cb, void *opaque)
+{
+    req->cb = cb;
+    req->opaque = opaque;
+    cmd->cid = cpu_to_le16(req->cid);
+
+    trace_nvme_submit_command(s, q->index, req->cid, cmd->opcode);
+    memcpy(q->sq + q->sq_tail * NVME_SQ_ENTRY_BYTES, cmd, sizeof(*cmd));
+    q->sq_tail = (q->sq_tail + 1) % q->size;
+    q->unkicked++;
+    q->in_flight++;
+    nvme_kick(s, q);
+}
+
+static int nvme_translate_error(uint16_t status)
+{
+    /* Drop the phase bit; Status Code Type and Status Code remain */
+    status = (status >> 1) & 0x7ff;
+
+    switch (status) {
+    case NVME_SUCCESS:
+        return 0;
+    case NVME_INVALID_OPCODE:
+    case NVME_INVALID_FIELD:
+        return -EINVAL;
+    case NVME_LBA_RANGE:
+    case NVME_CAP_EXCEEDED:
+        return -ENOSPC;
+    default:
+        return -EIO;
+    }
+}
+
+static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
+{
+    bool progress = false;
+
+    /* A callback may poll again, e.g. through a synchronous admin command */
+    if (q->busy || !q->in_flight) {
+        return false;
+    }
+    q->busy = true;
+
+    while (q->in_flight) {
+        NvmeCqe *c = (NvmeCqe *)(q->cq + q->cq_head * NVME_CQ_ENTRY_BYTES);
+        uint16_t status = le16_to_cpu(c->status);
+        NVMeRequest *req;
+        NVMeCompletionFunc *cb;
+        uint16_t cid;
+        int ret;
+
+        if ((status & 1) != q->cq_phase) {
+            break;
+        }
+        /* Read the rest of the entry only after the phase bit */
+        smp_rmb();
+        cid = le16_to_cpu(c->cid);
+        if (++q->cq_head == q->size) {
+            q->cq_head = 0;
+            q->cq_phase ^= 1;
+        }
+        progress = true;
+
+        if (cid == 0 || cid >= q->size) {
+            error_report("nvme: unexpected command id %u on queue %d",
+                         cid, q->index);
+            continue;
+        }
+        req = &q->reqs[cid - 1];
+        q->in_flight--;
+        if (!req->cb) {
+            /* Late completion of an admin command that timed out */
+            nvme_put_free_req(q, req);
+            continue;
+        }
+        ret = nvme_translate_error(status);
+        trace_nvme_complete_command(s, q->index, cid, ret);
+
+        if (ret == 0 && req->qiov) {
+            qemu_iovec_from_buf(req->qiov, req->qiov_offset, req->bounce,
+                                req->bounce_len);
+        }
+        cb = req->cb;
+        cb(req, req->opaque, ret);
+        nvme_put_free_req(q, req);
+    }
+
+    if (progress) {
+        *q->cq_doorbell = cpu_to_le32(q->cq_head);
+    }
+    q->busy = false;
+    return progress;
+}
+
+static bool nvme_poll_queues(BDRVNVMeState *s)
+{
+    bool progress = false;
+    int i;
+
+    for (i = 0; i <= s->nr_queues; i++) {
+        if (s->queues[i]) {
+            progress |= nvme_process_completion(s, s->queues[i]);
+        }
+    }
+    return progress;
+}
+
+static void nvme_handle_event(EventNotifier *n)
+{
+    BDRVNVMeState *s = container_of(n, BDRVNVMeState, irq_notifier);
+
+    event_notifier_test_and_clear(n);
+    nvme_poll_queues(s);
+}
+
+static bool nvme_poll_cb(void *opaque)
+{
+    BDRVNVMeState *s = container_of(opaque, BDRVNVMeState, irq_notifier);
+
+    return nvme_poll_queues(s);
+}
+
+static void nvme_cmd_sync_cb(NVMeRequest *req, void *opaque, int ret)
+{
+    int *pret = opaque;
+
+    *pret = ret;
+}
+
+/* Run an admin command to completion; only used outside of coroutines */
+static int nvme_cmd_sync(BDRVNVMeState *s, NvmeCmd *cmd)
+{
+    NVMeQueuePair *q = s->queues[0];
+    NVMeRequest *req;
+    int64_t deadline;
+    int ret = -EINPROGRESS;
+
+    req = nvme_get_free_req_nowait(q);
+    if (!req) {
+        return -EBUSY;
+    }
+    nvme_submit_command(s, q, req, cmd, nvme_cmd_sync_cb, &ret);
+
+    deadline = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + s->timeout_ms;
+    while (ret == -EINPROGRESS) {
+        if (!nvme_process_completion(s, q) &&
+            qemu_clock_get_ms(QEMU_CLOCK_REALTIME) > deadline) {
+            /* Keep the request out of the free list; the device owns it */
+            req->opaque = NULL;
+            req->cb = NULL;
+            return -ETIMEDOUT;
+        }
+    }
+    return ret;
+}
+
+static int nvme_wait_ready(BDRVNVMeState *s, bool ready, Error **errp)
+{
+    int64_t deadline = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                       s->timeout_ms;
+    uint32_t csts;
+
+    for (;;) {
+        csts = le32_to_cpu(s->regs->csts);
+        if (ready && NVME_CSTS_CFS(csts)) {
+            error_setg(errp, "Controller reported a fatal status");
+            return -EIO;
+        }
+        if (NVME_CSTS_RDY(csts) == ready) {
+            return 0;
+        }
+        if (qemu_clock_get_ms(QEMU_CLOCK_REALTIME) > deadline) {
+            error_setg(errp, "Timeout while waiting for the controller to "
+                       "become %s", ready ? "ready" : "disabled");
+            return -ETIMEDOUT;
+        }
+        g_usleep(1000);
+    }
+}
+
+static int nvme_identify(BDRVNVMeState *s, uint32_t mps_min, Error **errp)
+{
+    NvmeIdCtrl *idctrl;
+    NvmeIdNs *idns;
+    NvmeLBAF *lbaf;
+    NvmeCmd cmd;
+    size_t ctrl_size = ROUND_UP(sizeof(*idctrl), s->page_size);
+    size_t size = ctrl_size + ROUND_UP(sizeof(*idns), s->page_size);
+    uint64_t iova = s->iova_next;
+    uint8_t *buf;
+    int ret;
+
+    buf = qemu_memalign(s->page_size, size);
+    memset(buf, 0, size);
+    idctrl = (NvmeIdCtrl *)buf;
+    idns = (NvmeIdNs *)(buf + ctrl_size);
+    ret = nvme_vfio_dma_map(s, buf, size, iova);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Cannot map identify buffer");
+        qemu_vfree(buf);
+        return ret;
+    }
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADM_CMD_IDENTIFY;
+    cmd.prp1 = cpu_to_le64(iova);
+    cmd.cdw10 = cpu_to_le32(1);
+    ret = nvme_cmd_sync(s, &cmd);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to identify controller");
+        goto out;
+    }
+    if (s->nsid == 0 || s->nsid > le32_to_cpu(idctrl->nn)) {
+        error_setg(errp, "Invalid namespace %" PRIu32 " (the controller "
+                   "has %" PRIu32 ")", s->nsid, le32_to_cpu(idctrl->nn));
+        ret = -EINVAL;
+        goto out;
+    }
+    s->write_cache = idctrl->vwc & 0x1;
+    s->supports_discard = le16_to_cpu(idctrl->oncs) & NVME_ONCS_DSM;
+
+    /* PRP1 plus one list page, less the slot that holds PRP1 itself */
+    s->max_transfer = (s->page_size / sizeof(uint64_t)) * s->page_size;
+    if (idctrl->mdts) {
+        s->max_transfer = MIN(s->max_transfer,
+                              (size_t)mps_min << idctrl->mdts);
+    }
+    s->max_transfer = MAX(s->max_transfer, NVME_BOUNCE_SIZE);
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADM_CMD_IDENTIFY;
+    cmd.nsid = cpu_to_le32(s->nsid);
+    cmd.prp1 = cpu_to_le64(iova + ctrl_size);
+    ret = nvme_cmd_sync(s, &cmd);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to identify namespace");
+        goto out;
+    }
+    s->nsze = le64_to_cpu(idns->nsze);
+    lbaf = &idns->lbaf[NVME_ID_NS_FLBAS_INDEX(idns->flbas)];
+    if (le16_to_cpu(lbaf->ms)) {
+        error_setg(errp, "Namespaces with metadata are not supported");
+        ret = -ENOTSUP;
+        goto out;
+    }
+    if (lbaf->ds != BDRV_SECTOR_BITS) {
+        error_setg(errp, "Only 512 byte logical blocks are supported "
+                   "(namespace uses %d bytes)", 1 << lbaf->ds);
+        ret = -ENOTSUP;
+        goto out;
+    }
+    ret = 0;
+
+out:
+    nvme_vfio_dma_unmap(s, iova, size);
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int nvme_add_io_queue(BDRVNVMeState *s, Error **errp)
+{
+    NVMeQueuePair *q;
+    NvmeCmd cmd;
+    int n = s->nr_queues + 1;
+    int ret;
+
+    q = nvme_create_queue_pair(s, n, s->queue_size, errp);
+    if (!q) {
+        return -ENOMEM;
+    }
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADM_CMD_CREATE_CQ;
+    cmd.prp1 = cpu_to_le64(q->cq_iova);
+    cmd.cdw10 = cpu_to_le32(((q->size - 1) << 16) | n);
+    /* Physically contiguous, interrupts enabled, MSI-X vector 0 */
+    cmd.cdw11 = cpu_to_le32(0x3);
+    ret = nvme_cmd_sync(s, &cmd);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to create completion queue %d",
+                         n);
+        goto fail;
+    }
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADM_CMD_CREATE_SQ;
+    cmd.prp1 = cpu_to_le64(q->sq_iova);
+    cmd.cdw10 = cpu_to_le32(((q->size - 1) << 16) | n);
+    cmd.cdw11 = cpu_to_le32((n << 16) | 0x1);
+    ret = nvme_cmd_sync(s, &cmd);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to create submission queue %d",
+                         n);
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = NVME_ADM_CMD_DELETE_CQ;
+        cmd.cdw10 = cpu_to_le32(n);
+        nvme_cmd_sync(s, &cmd);
+        goto fail;
+    }
+
+    s->queues[n] = q;
+    s->nr_queues++;
+    return 0;
+
+fail:
+    nvme_free_queue_pair(s, q);
+    return ret;
+}
+
+static void nvme_delete_io_queues(BDRVNVMeState *s)
+{
+    NvmeCmd cmd;
+
+    while (s->nr_queues > 0) {
+        int n = s->nr_queues;
+
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = NVME_ADM_CMD_DELETE_SQ;
+        cmd.cdw10 = cpu_to_le32(n);
+        nvme_cmd_sync(s, &cmd);
+
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = NVME_ADM_CMD_DELETE_CQ;
+        cmd.cdw10 = cpu_to_le32(n);
+        nvme_cmd_sync(s, &cmd);
+
+        nvme_free_queue_pair(s, s->queues[n]);
+        s->queues[n] = NULL;
+        s->nr_queues--;
+    }
+}
+
+static void nvme_shutdown(BDRVNVMeState *s)
+{
+    int64_t deadline;
+    uint32_t cc = le32_to_cpu(s->regs->cc);
+
+    if (!NVME_CC_EN(cc)) {
+        return;
+    }
+
+    /* Normal shutdown notification, so that the device flushes its cache */
+    cc &= ~(CC_SHN_MASK << CC_SHN_SHIFT);
+    s->regs->cc = cpu_to_le32(cc | (1 << CC_SHN_SHIFT));
+    deadline = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + s->timeout_ms;
+    while ((le32_to_cpu(s->regs->csts) & (CSTS_SHST_MASK << CSTS_SHST_SHIFT))
+           != NVME_CSTS_SHST_COMPLETE) {
+        if (qemu_clock_get_ms(QEMU_CLOCK_REALTIME) > deadline) {
+            error_report("nvme: timeout during controller shutdown");
+            break;
+        }
+        g_usleep(1000);
+    }
+    s->regs->cc = cpu_to_le32(cc & ~CC_EN_MASK);
+}
+
+static void nvme_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier, NULL);
+}
+
+static void nvme_attach_aio_context(BlockDriverState *bs,
+                                    AioContext *new_context)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    aio_set_event_notifier(new_context, &s->irq_notifier, nvme_handle_event);
+    aio_set_event_notifier_poll(new_context, &s->irq_notifier, nvme_poll_cb);
+}
+
+static int nvme_init(BlockDriverState *bs, const char *device, int nr_queues,
+                     Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NvmeCmd cmd;
+    uint64_t cap;
+    uint32_t mps_min, mps_max;
+    Error *local_err = NULL;
+    int ret;
+
+    ret = nvme_vfio_open(s, device, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    s->regs = s->bar;
+    s->doorbells = (volatile uint32_t *)((uint8_t *)s->bar +
+                                         NVME_DOORBELL_OFFSET);
+
+    cap = le64_to_cpu(s->regs->cap);
+    if (!(NVME_CAP_CSS(cap) & 1)) {
+        error_setg(errp, "Device doesn't support the NVM command set");
+        return -EINVAL;
+    }
+    s->page_size = getpagesize();
+    mps_min = 4096 << NVME_CAP_MPSMIN(cap);
+    mps_max = 4096 << NVME_CAP_MPSMAX(cap);
+    if (s->page_size < mps_min || s->page_size > mps_max) {
+        error_setg(errp, "Host page size %zu is not supported by the "
+                   "controller", s->page_size);
+        return -EINVAL;
+    }
+    s->doorbell_scale = (4 << NVME_CAP_DSTRD(cap)) / sizeof(uint32_t);
+    if (NVME_DOORBELL_OFFSET + (2 * NVME_MAX_QUEUES + 2) *
+        s->doorbell_scale * sizeof(uint32_t) > s->bar_size) {
+        error_setg(errp, "BAR0 is too small for the doorbell stride");
+        return -EINVAL;
+    }
+    /* CAP.TO is in 500 ms units */
+    s->timeout_ms = MAX(500 * NVME_CAP_TO(cap), 1000);
+    s->queue_size = MIN(NVME_QUEUE_SIZE, NVME_CAP_MQES(cap) + 1);
+
+    /* Reset the controller */
+    s->regs->cc = cpu_to_le32(le32_to_cpu(s->regs->cc) & ~CC_EN_MASK);
+    ret = nvme_wait_ready(s, false, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->queues[0] = nvme_create_queue_pair(s, 0, NVME_ADMIN_QUEUE_SIZE, errp);
+    if (!s->queues[0]) {
+        return -ENOMEM;
+    }
+    s->regs->aqa = cpu_to_le32(((NVME_ADMIN_QUEUE_SIZE - 1) << AQA_ACQS_SHIFT) |
+                               ((NVME_ADMIN_QUEUE_SIZE - 1) << AQA_ASQS_SHIFT));
+    s->regs->asq = cpu_to_le64(s->queues[0]->sq_iova);
+    s->regs->acq = cpu_to_le64(s->queues[0]->cq_iova);
+    s->regs->cc = cpu_to_le32((ctz32(NVME_CQ_ENTRY_BYTES) << CC_IOCQES_SHIFT) |
+                              (ctz32(NVME_SQ_ENTRY_BYTES) << CC_IOSQES_SHIFT) |
+                              ((ctz32(s->page_size) - 12) << CC_MPS_SHIFT) |
+                              CC_EN_MASK);
+    ret = nvme_wait_ready(s, true, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = nvme_vfio_set_irq(s, &s->irq_notifier);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Cannot set up MSI-X interrupt");
+        return ret;
+    }
+
+    ret = nvme_identify(s, mps_min, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Ask for all queues at once; the controller may grant fewer */
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADM_CMD_SET_FEATURES;
+    cmd.cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES);
+    cmd.cdw11 = cpu_to_le32(((nr_queues - 1) << 16) | (nr_queues - 1));
+    nvme_cmd_sync(s, &cmd);
+
+    while (s->nr_queues < nr_queues) {
+        ret = nvme_add_io_queue(s, &local_err);
+        if (ret < 0) {
+            if (s->nr_queues == 0) {
+                error_propagate(errp, local_err);
+                return ret;
+            }
+            error_free(local_err);
+            local_err = NULL;
+            break;
+        }
+    }
+
+    bs->buffer_alignment = s->page_size;
+    nvme_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    return 0;
+}
+
+static void nvme_parse_filename(const char *filename, QDict *options,
+                                Error **errp)
+{
+    unsigned long long ns;
+    const char *slash;
+
+    if (!strstart(filename, "nvme://", &filename)) {
+        error_setg(errp, "File name string must start with 'nvme://'");
+        return;
+    }
+
+    /* nvme://<PCI address>[/<namespace>] */
+    slash = strchr(filename, '/');
+    if (slash == NULL) {
+        qdict_put(options, "device", qstring_from_str(filename));
+        return;
+    }
+    if (parse_uint_full(slash + 1, &ns, 10) < 0 || ns == 0 ||
+        ns > UINT32_MAX) {
+        error_setg(errp, "Invalid namespace '%s'", slash + 1);
+        return;
+    }
+    qdict_put(options, "device",
+              qstring_from_substr(filename, 0, slash - filename - 1));
+    qdict_put(options, "namespace", qstring_from_str(slash + 1));
+}
+
+static QemuOptsList runtime_opts = {
+    .name = "nvme",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "device",
+            .type = QEMU_OPT_STRING,
+            .help = "PCI address of the NVMe controller",
+        },
+        {
+            .name = "namespace",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Namespace to use (default: 1)",
+        },
+        {
+            .name = "queues",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of I/O queue pairs (default: 1)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static void nvme_close(BlockDriverState *bs);
+
+static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
+                          Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    const char *device;
+    uint64_t namespace, queues;
+    int ret;
+
+    s->container = s->group = s->device = -1;
+    s->iova_next = NVME_IOVA_BASE;
+    s->temp_iova_next = NVME_IOVA_TEMP_BASE;
+    qemu_co_queue_init(&s->temp_queue);
+
+    opts = qemu_opts_create_nofail(&runtime_opts);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (error_is_set(&local_err)) {
+        error_propagate(errp, local_err);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+
+    device = qemu_opt_get(opts, "device");
+    if (!device) {
+        error_setg(errp, "'device' option is required");
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    namespace = qemu_opt_get_number(opts, "namespace", 1);
+    queues = qemu_opt_get_number(opts, "queues", 1);
+    if (namespace == 0 || namespace > UINT32_MAX) {
+        error_setg(errp, "Invalid namespace %" PRIu64, namespace);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    if (queues < 1 || queues > NVME_MAX_QUEUES) {
+        error_setg(errp, "queues must be between 1 and %d", NVME_MAX_QUEUES);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    s->nsid = namespace;
+
+    ret = event_notifier_init(&s->irq_notifier, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to init event notifier");
+        qemu_opts_del(opts);
+        return ret;
+    }
+
+    ret = nvme_init(bs, device, queues, errp);
+    qemu_opts_del(opts);
+    if (ret < 0) {
+        nvme_close(bs);
+        return ret;
+    }
+    return 0;
+}
+
+static void nvme_close(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    if (s->bar) {
+        nvme_detach_aio_context(bs);
+        nvme_delete_io_queues(s);
+        nvme_shutdown(s);
+        if (s->device >= 0) {
+            nvme_vfio_set_irq(s, NULL);
+        }
+    }
+    if (s->queues[0]) {
+        nvme_free_queue_pair(s, s->queues[0]);
+        s->queues[0] = NULL;
+    }
+    if (s->temp_iova_next > NVME_IOVA_TEMP_BASE) {
+        nvme_vfio_dma_unmap(s, NVME_IOVA_TEMP_BASE,
+                            s->temp_iova_next - NVME_IOVA_TEMP_BASE);
+    }
+    nvme_vfio_close(s);
+    event_notifier_cleanup(&s->irq_notifier);
+}
+
+static int64_t nvme_getlength(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    return s->nsze << BDRV_SECTOR_BITS;
+}
+
+static NVMeQueuePair *nvme_next_queue(BDRVNVMeState *s)
+{
+    s->next_queue = (s->next_queue + 1) % s->nr_queues;
+    return s->queues[1 + s->next_queue];
+}
+
+static void nvme_co_cb(NVMeRequest *req, void *opaque, int ret)
+{
+    NVMeCoData *data = opaque;
+
+    if (ret < 0 && data->ret == 0) {
+        data->ret = ret;
+    }
+    if (--data->pending == 0 && data->waiting) {
+        qemu_coroutine_enter(data->co, NULL);
+    }
+}
+
+static void coroutine_fn nvme_co_wait(NVMeCoData *data)
+{
+    while (data->pending) {
+        data->waiting = true;
+        qemu_coroutine_yield();
+        data->waiting = false;
+    }
+}
+
+/* Fill in PRP1/PRP2 from the first @n entries of the request's list */
+static void nvme_set_prps(NVMeRequest *req, NvmeCmd *cmd, int n)
+{
+    cmd->prp1 = req->prp_list[0];
+    if (n == 1) {
+        cmd->prp2 = 0;
+    } else if (n == 2) {
+        cmd->prp2 = req->prp_list[1];
+    } else {
+        cmd->prp2 = cpu_to_le64(req->prp_list_iova + sizeof(uint64_t));
+    }
+}
+
+static int nvme_add_prps(BDRVNVMeState *s, NVMeRequest *req, int n,
+                         uint64_t iova, size_t len)
+{
+    size_t off;
+
+    for (off = 0; off < len; off += s->page_size) {
+        assert(n < s->page_size / sizeof(uint64_t));
+        req->prp_list[n++] = cpu_to_le64(iova + off);
+    }
+    return n;
+}
+
+static bool nvme_qiov_aligned(BDRVNVMeState *s, QEMUIOVector *qiov)
+{
+    int i;
+
+    for (i = 0; i < qiov->niov; i++) {
+        if (((uintptr_t)qiov->iov[i].iov_base | qiov->iov[i].iov_len) &
+            (s->page_size - 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Map all elements of @qiov into the temporary IOVA range and return their
+ * addresses in @iova.  Once a request holds a reference, the range is not
+ * recycled until it drops it again.
+ */
+static int coroutine_fn nvme_co_temp_map(BDRVNVMeState *s,
+                                         QEMUIOVector *qiov, uint64_t *iova)
+{
+    size_t needed = qiov->size;
+    int i, ret;
+
+    while (s->temp_iova_next + needed > NVME_IOVA_TEMP_END) {
+        if (s->temp_users == 0) {
+            trace_nvme_temp_reset(s, s->temp_iova_next - NVME_IOVA_TEMP_BASE);
+            nvme_vfio_dma_unmap(s, NVME_IOVA_TEMP_BASE,
+                                s->temp_iova_next - NVME_IOVA_TEMP_BASE);
+            s->temp_iova_next = NVME_IOVA_TEMP_BASE;
+        } else {
+            qemu_co_queue_wait(&s->temp_queue);
+        }
+    }
+
+    s->temp_users++;
+    for (i = 0; i < qiov->niov; i++) {
+        ret = nvme_vfio_dma_map(s, qiov->iov[i].iov_base,
+                                qiov->iov[i].iov_len, s->temp_iova_next);
+        if (ret < 0) {
+            return ret;
+        }
+        iova[i] = s->temp_iova_next;
+        s->temp_iova_next += qiov->iov[i].iov_len;
+    }
+    return 0;
+}
+
+static void coroutine_fn nvme_temp_unref(BDRVNVMeState *s)
+{
+    size_t used = s->temp_iova_next - NVME_IOVA_TEMP_BASE;
+
+    if (--s->temp_users > 0) {
+        return;
+    }
+    /* Unmapping is expensive; only do it once a fair amount piled up */
+    if (used >= NVME_TEMP_RESET_SIZE) {
+        trace_nvme_temp_reset(s, used);
+        nvme_vfio_dma_unmap(s, NVME_IOVA_TEMP_BASE, used);
+        s->temp_iova_next = NVME_IOVA_TEMP_BASE;
+    }
+    qemu_co_queue_restart_all(&s->temp_queue);
+}
+
+/* Build the PRP list for bytes [@offset, @offset + @len) of a mapped qiov */
+static int nvme_add_qiov_prps(BDRVNVMeState *s, NVMeRequest *req,
+                              QEMUIOVector *qiov, uint64_t *iova,
+                              size_t offset, size_t len)
+{
+    int n = 0;
+    int i;
+
+    for (i = 0; i < qiov->niov && len; i++) {
+        size_t iov_len = qiov->iov[i].iov_len;
+        size_t chunk;
+
+        if (offset >= iov_len) {
+            offset -= iov_len;
+            continue;
+        }
+        chunk = MIN(iov_len - offset, len);
+        n = nvme_add_prps(s, req, n, iova[i] + offset, chunk);
+        offset = 0;
+        len -= chunk;
+    }
+    return n;
+}
+
+static int coroutine_fn nvme_co_prw(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors, QEMUIOVector *qiov,
+                                    bool is_write)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NVMeCoData data = { .co = qemu_coroutine_self() };
+    size_t bytes = (size_t)nb_sectors << BDRV_SECTOR_BITS;
+    size_t max_len = NVME_BOUNCE_SIZE;
+    uint64_t *iova = NULL;
+    size_t done = 0;
+    int ret;
+
+    /*
+     * Small requests are copied through the bounce buffers, which is
+     * cheaper than an IOMMU mapping.  Large page aligned ones are mapped
+     * in place; the rest is split into bounce-sized pieces that are all
+     * in flight at the same time.
+     */
+    if (bytes > NVME_BOUNCE_SIZE && nvme_qiov_aligned(s, qiov)) {
+        iova = g_new(uint64_t, qiov->niov);
+        ret = nvme_co_temp_map(s, qiov, iova);
+        if (ret < 0) {
+            nvme_temp_unref(s);
+            g_free(iova);
+            return ret;
+        }
+        max_len = s->max_transfer;
+    }
+
+    while (done < bytes) {
+        size_t len = MIN(bytes - done, max_len);
+        NVMeQueuePair *q = nvme_next_queue(s);
+        NVMeRequest *req = nvme_get_free_req(q);
+        uint64_t lba = sector_num + (done >> BDRV_SECTOR_BITS);
+        NvmeCmd cmd;
+        int n;
+
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = is_write ? NVME_CMD_WRITE : NVME_CMD_READ;
+        cmd.nsid = cpu_to_le32(s->nsid);
+        cmd.cdw10 = cpu_to_le32(lba & 0xffffffff);
+        cmd.cdw11 = cpu_to_le32(lba >> 32);
+        cmd.cdw12 = cpu_to_le32((len >> BDRV_SECTOR_BITS) - 1);
+
+        if (iova) {
+            n = nvme_add_qiov_prps(s, req, qiov, iova, done, len);
+        } else {
+            if (is_write) {
+                qemu_iovec_to_buf(qiov, done, req->bounce, len);
+            } else {
+                req->qiov = qiov;
+                req->qiov_offset = done;
+                req->bounce_len = len;
+            }
+            n = nvme_add_prps(s, req, 0, req->bounce_iova, len);
+        }
+        nvme_set_prps(req, &cmd, n);
+
+        data.pending++;
+        nvme_submit_command(s, q, req, &cmd, nvme_co_cb, &data);
+        done += len;
+    }
+
+    nvme_co_wait(&data);
+    if (iova) {
+        nvme_temp_unref(s);
+        g_free(iova);
+    }
+    return data.ret;
+}
+
+static int coroutine_fn nvme_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, QEMUIOVector *qiov)
+{
+    return nvme_co_prw(bs, sector_num, nb_sectors, qiov, false);
+}
+
+static int coroutine_fn nvme_co_writev(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov)
+{
+    return nvme_co_prw(bs, sector_num, nb_sectors, qiov, true);
+}
+
+static int coroutine_fn nvme_co_flush(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NVMeCoData data = { .co = qemu_coroutine_self(), .pending = 1 };
+    NVMeQueuePair *q;
+    NVMeRequest *req;
+    NvmeCmd cmd;
+
+    if (!s->write_cache) {
+        return 0;
+    }
+
+    /* A flush covers all completed writes of the namespace, on any queue */
+    q = nvme_next_queue(s);
+    req = nvme_get_free_req(q);
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_CMD_FLUSH;
+    cmd.nsid = cpu_to_le32(s->nsid);
+    nvme_submit_command(s, q, req, &cmd, nvme_co_cb, &data);
+    nvme_co_wait(&data);
+    return data.ret;
+}
+
+static int coroutine_fn nvme_co_discard(BlockDriverState *bs,
+                                        int64_t sector_num, int nb_sectors)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NVMeCoData data = { .co = qemu_coroutine_self(), .pending = 1 };
+    NVMeQueuePair *q;
+    NVMeRequest *req;
+    NvmeDsmRange *range;
+    NvmeCmd cmd;
+
+    if (!s->supports_discard) {
+        return -ENOTSUP;
+    }
+
+    q = nvme_next_queue(s);
+    req = nvme_get_free_req(q);
+    range = (NvmeDsmRange *)req->bounce;
+    range->cattr = 0;
+    range->nlb = cpu_to_le32(nb_sectors);
+    range->slba = cpu_to_le64(sector_num);
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_CMD_DSM;
+    cmd.nsid = cpu_to_le32(s->nsid);
+    cmd.prp1 = cpu_to_le64(req->bounce_iova);
+    cmd.cdw10 = 0;
+    cmd.cdw11 = cpu_to_le32(NVME_DSMGMT_AD);
+    nvme_submit_command(s, q, req, &cmd, nvme_co_cb, &data);
+    nvme_co_wait(&data);
+    return data.ret;
+}
+
+static void nvme_io_plug(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    s->plugged++;
+}
+
+static void nvme_io_unplug(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    int i;
+
+    assert(s->plugged);
+    if (--s->plugged == 0) {
+        for (i = 1; i <= s->nr_queues; i++) {
+            nvme_kick(s, s->queues[i]);
+        }
+    }
+}
+
+static BlockDriver bdrv_nvme = {
+    .format_name                = "nvme",
+    .protocol_name              = "nvme",
+    .instance_size              = sizeof(BDRVNVMeState),
+
+    .bdrv_parse_filename        = nvme_parse_filename,
+    .bdrv_file_open             = nvme_file_open,
+    .bdrv_close                 = nvme_close,
+    .bdrv_getlength             = nvme_getlength,
+
+    .bdrv_co_readv              = nvme_co_readv,
+    .bdrv_co_writev             = nvme_co_writev,
+    .bdrv_co_flush_to_disk      = nvme_co_flush,
+    .bdrv_co_discard            = nvme_co_discard,
+
+    .bdrv_detach_aio_context    = nvme_detach_aio_context,
+    .bdrv_attach_aio_context    = nvme_attach_aio_context,
+
+    .bdrv_io_plug               = nvme_io_plug,
+    .bdrv_io_unplug             = nvme_io_unplug,
+};
+
+static void bdrv_nvme_init(void)
+{
+    bdrv_register(&bdrv_nvme);
+}
+
+block_init(bdrv_nvme_init);
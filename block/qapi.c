@@ -24,6 +24,7 @@
 
 #include "block/qapi.h"
 #include "block/block_int.h"
+#include "block/throttle-groups.h"
 #include "qmp-commands.h"
 #include "qapi-visit.h"
 #include "qapi/qmp-output-visitor.h"
@@ -227,7 +228,7 @@ void bdrv_query_info(BlockDriverState *bs,
 
         if (bs->io_limits_enabled) {
             ThrottleConfig cfg;
-            throttle_get_config(&bs->throttle_state, &cfg);
+            bdrv_get_io_limits(bs, &cfg);
             info->inserted->bps     = cfg.buckets[THROTTLE_BPS_TOTAL].avg;
             info->inserted->bps_rd  = cfg.buckets[THROTTLE_BPS_READ].avg;
             info->inserted->bps_wr  = cfg.buckets[THROTTLE_BPS_WRITE].avg;
@@ -264,6 +265,12 @@ void bdrv_query_info(BlockDriverState *bs,
 
             info->inserted->has_iops_size = cfg.op_size;
             info->inserted->iops_size = cfg.op_size;
+
+            if (bs->throttle_group) {
+                info->inserted->has_group = true;
+                info->inserted->group =
+                    g_strdup(throttle_group_get_name(bs));
+            }
         }
 
         bs0 = bs;
@@ -291,9 +298,70 @@ void bdrv_query_info(BlockDriverState *bs,
     qapi_free_BlockInfo(info);
 }
 
-BlockStats *bdrv_query_stats(const BlockDriverState *bs)
+static BlockLatencyHistogramInfo *
+bdrv_latency_histogram_info(BlockLatencyHistogram *hist)
+{
+    BlockLatencyHistogramInfo *info = g_new0(BlockLatencyHistogramInfo, 1);
+    uint64List **p_bound = &info->boundaries;
+    uint64List **p_bin = &info->bins;
+    int i;
+
+    for (i = 0; i < hist->nbins; i++) {
+        if (i < hist->nbins - 1) {
+            *p_bound = g_new0(uint64List, 1);
+            (*p_bound)->value = hist->boundaries[i];
+            p_bound = &(*p_bound)->next;
+        }
+        *p_bin = g_new0(uint64List, 1);
+        (*p_bin)->value = hist->bins[i];
+        p_bin = &(*p_bin)->next;
+    }
+
+    return info;
+}
+
+static BlockDeviceTimedStats *bdrv_timed_stats_info(BlockAcctTimedStats *ts)
+{
+    BlockDeviceTimedStats *info = g_new0(BlockDeviceTimedStats, 1);
+    BlockAcctWindow *w = &ts->last;
+    double len = ts->interval_length * 1000000000.0;
+
+    info->interval_length = ts->interval_length;
+
+    info->rd_operations = w->nr_ops[BDRV_ACCT_READ];
+    info->min_rd_latency_ns = w->min_time_ns[BDRV_ACCT_READ];
+    info->max_rd_latency_ns = w->max_time_ns[BDRV_ACCT_READ];
+    if (w->nr_ops[BDRV_ACCT_READ]) {
+        info->avg_rd_latency_ns = w->total_time_ns[BDRV_ACCT_READ] /
+                                  w->nr_ops[BDRV_ACCT_READ];
+    }
+
+    info->wr_operations = w->nr_ops[BDRV_ACCT_WRITE];
+    info->min_wr_latency_ns = w->min_time_ns[BDRV_ACCT_WRITE];
+    info->max_wr_latency_ns = w->max_time_ns[BDRV_ACCT_WRITE];
+    if (w->nr_ops[BDRV_ACCT_WRITE]) {
+        info->avg_wr_latency_ns = w->total_time_ns[BDRV_ACCT_WRITE] /
+                                  w->nr_ops[BDRV_ACCT_WRITE];
+    }
+
+    info->flush_operations = w->nr_ops[BDRV_ACCT_FLUSH];
+    info->min_flush_latency_ns = w->min_time_ns[BDRV_ACCT_FLUSH];
+    info->max_flush_latency_ns = w->max_time_ns[BDRV_ACCT_FLUSH];
+    if (w->nr_ops[BDRV_ACCT_FLUSH]) {
+        info->avg_flush_latency_ns = w->total_time_ns[BDRV_ACCT_FLUSH] /
+                                     w->nr_ops[BDRV_ACCT_FLUSH];
+    }
+
+    info->avg_rd_queue_depth = w->queue_depth_ns[BDRV_ACCT_READ] / len;
+    info->avg_wr_queue_depth = w->queue_depth_ns[BDRV_ACCT_WRITE] / len;
+
+    return info;
+}
+
+BlockStats *bdrv_query_stats(BlockDriverState *bs)
 {
     BlockStats *s;
+    BlockAcctTimedStats *ts;
 
     s = g_malloc0(sizeof(*s));
 
@@ -312,6 +380,72 @@ BlockStats *bdrv_query_stats(const BlockDriverState *bs)
     s->stats->wr_total_time_ns = bs->total_time_ns[BDRV_ACCT_WRITE];
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
+    s->stats->flush_merged = bs->flush_merged;
+
+    if (bs->drv && bs->drv->bdrv_get_cache_stats) {
+        s->stats->metadata_cache = bs->drv->bdrv_get_cache_stats(bs);
+        s->stats->has_metadata_cache = true;
+    }
+    if (bs->drv && bs->drv->bdrv_get_data_cache_stats) {
+        s->stats->data_cache = bs->drv->bdrv_get_data_cache_stats(bs);
+        s->stats->has_data_cache = true;
+    }
+    if (bs->drv && bs->drv->bdrv_get_object_stats) {
+        s->stats->objects = bs->drv->bdrv_get_object_stats(bs);
+        s->stats->has_objects = true;
+    }
+
+    s->stats->rd_queue_depth = bs->in_flight[BDRV_ACCT_READ];
+    s->stats->wr_queue_depth = bs->in_flight[BDRV_ACCT_WRITE];
+    if (bs->acct_idle_start_ns &&
+        !bs->in_flight[BDRV_ACCT_READ] &&
+        !bs->in_flight[BDRV_ACCT_WRITE] &&
+        !bs->in_flight[BDRV_ACCT_FLUSH]) {
+        s->stats->has_idle_time_ns = true;
+        s->stats->idle_time_ns = get_clock() - bs->acct_idle_start_ns;
+    }
+
+    if (bs->latency_histogram[BDRV_ACCT_READ].nbins) {
+        s->stats->has_rd_latency_histogram = true;
+        s->stats->rd_latency_histogram =
+            bdrv_latency_histogram_info(&bs->latency_histogram[BDRV_ACCT_READ]);
+    }
+    if (bs->latency_histogram[BDRV_ACCT_WRITE].nbins) {
+        s->stats->has_wr_latency_histogram = true;
+        s->stats->wr_latency_histogram =
+            bdrv_latency_histogram_info(&bs->latency_histogram[BDRV_ACCT_WRITE]);
+    }
+    if (bs->stage_histogram[BDRV_STAGE_QUEUE].nbins) {
+        BlockStageLatencyInfo *stage = g_new0(BlockStageLatencyInfo, 1);
+        BlockLatencyHistogram *hist = bs->stage_histogram;
+
+        stage->queue = bdrv_latency_histogram_info(&hist[BDRV_STAGE_QUEUE]);
+        stage->driver = bdrv_latency_histogram_info(&hist[BDRV_STAGE_DRIVER]);
+        stage->completion =
+            bdrv_latency_histogram_info(&hist[BDRV_STAGE_COMPLETION]);
+        s->stats->has_stage_latency = true;
+        s->stats->stage_latency = stage;
+    }
+    if (bs->latency_histogram[BDRV_ACCT_FLUSH].nbins) {
+        s->stats->has_flush_latency_histogram = true;
+        s->stats->flush_latency_histogram =
+            bdrv_latency_histogram_info(&bs->latency_histogram[BDRV_ACCT_FLUSH]);
+    }
+
+    if (!QSLIST_EMPTY(&bs->timed_stats)) {
+        BlockDeviceTimedStatsList **p_next = &s->stats->timed_stats;
+
+        bdrv_acct_update_timed_stats(bs);
+        s->stats->has_timed_stats = true;
+        QSLIST_FOREACH(ts, &bs->timed_stats, entries) {
+            BlockDeviceTimedStatsList *entry;
+
+            entry = g_new0(BlockDeviceTimedStatsList, 1);
+            entry->value = bdrv_timed_stats_info(ts);
+            *p_next = entry;
+            p_next = &entry->next;
+        }
+    }
 
     if (bs->file) {
         s->has_parent = true;
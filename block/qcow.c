@@ -239,20 +239,22 @@ static void encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                             int nb_sectors, int enc,
                             const AES_KEY *key)
 {
-    union {
-        uint64_t ll[2];
-        uint8_t b[16];
-    } ivec;
-    int i;
-
-    for(i = 0; i < nb_sectors; i++) {
-        ivec.ll[0] = cpu_to_le64(sector_num);
-        ivec.ll[1] = 0;
-        AES_cbc_encrypt(in_buf, out_buf, 512, key,
-                        ivec.b, enc);
-        sector_num++;
-        in_buf += 512;
-        out_buf += 512;
+    /* Each sector is a CBC chain whose IV is its little-endian number */
+    uint64_t ivecs[64][2];
+    int i, n;
+
+    while (nb_sectors > 0) {
+        n = MIN(nb_sectors, ARRAY_SIZE(ivecs));
+        for (i = 0; i < n; i++) {
+            ivecs[i][0] = cpu_to_le64(sector_num + i);
+            ivecs[i][1] = 0;
+        }
+        AES_cbc_encrypt_chunks(in_buf, out_buf, n, 512, key,
+                               (const unsigned char *)ivecs, enc);
+        sector_num += n;
+        in_buf += n * 512;
+        out_buf += n * 512;
+        nb_sectors -= n;
     }
 }
 
@@ -28,11 +28,11 @@
 #include "trace.h"
 
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
+    bool    referenced;     /* hit since the clock hand last passed by */
     int     ref;
+    int     hash_next;      /* next entry in the same bucket, or -1 */
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -40,20 +40,80 @@ struct Qcow2Cache {
     struct Qcow2Cache*      depends;
     int                     size;
     bool                    depends_on_flush;
+    void*                   table_array;
+    int                     table_size;
+    int*                    buckets;
+    int                     bucket_bits;
+    int                     clock_hand;
+    uint64_t                hits;
+    uint64_t                misses;
 };
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int i)
+{
+    return (uint8_t *)c->table_array + (size_t)i * c->table_size;
+}
+
+static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t table_offset = (uint8_t *)table - (uint8_t *)c->table_array;
+    int idx = table_offset / c->table_size;
+
+    assert(idx >= 0 && idx < c->size && table_offset % c->table_size == 0);
+    return idx;
+}
+
+static inline int qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    /* Tables are cluster aligned, so hash the cluster index */
+    uint64_t index = offset / c->table_size;
+
+    return (index * 0x9e3779b97f4a7c15ULL) >> (64 - c->bucket_bits);
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    int h = qcow2_cache_hash(c, c->entries[i].offset);
+
+    c->entries[i].hash_next = c->buckets[h];
+    c->buckets[h] = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p >= 0);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size)
 {
-    BDRVQcowState *s = bs->opaque;
     Qcow2Cache *c;
     int i;
 
     c = g_malloc0(sizeof(*c));
     c->size = num_tables;
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
+    c->table_size = table_size;
+    c->table_array = qemu_blockalign(bs, (size_t)num_tables * c->table_size);
 
+    /* At least one bucket per table */
+    c->bucket_bits = 1;
+    while ((1 << c->bucket_bits) < num_tables) {
+        c->bucket_bits++;
+    }
+    c->buckets = g_malloc(sizeof(*c->buckets) << c->bucket_bits);
+    for (i = 0; i < (1 << c->bucket_bits); i++) {
+        c->buckets[i] = -1;
+    }
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        c->entries[i].hash_next = -1;
     }
 
     return c;
@@ -65,15 +125,22 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses)
+{
+    *hits = c->hits;
+    *misses = c->misses;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -101,6 +168,11 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     trace_qcow2_cache_entry_flush(qemu_coroutine_self(),
                                   c == s->l2_table_cache, i);
 
+    /* The journal writes out all dirty tables of both caches at once */
+    if (s->journal_offset) {
+        return qcow2_journal_commit(bs);
+    }
+
     if (c->depends) {
         ret = qcow2_cache_flush_dependency(bs, c);
     } else if (c->depends_on_flush) {
@@ -116,13 +188,13 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
 
     if (c == s->refcount_block_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_REFCOUNT_BLOCK,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else if (c == s->l2_table_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else {
         ret = qcow2_pre_write_overlap_check(bs, 0,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     }
 
     if (ret < 0) {
@@ -135,8 +207,8 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+                      qcow2_cache_get_table_addr(c, i), c->table_size);
     if (ret < 0) {
         return ret;
     }
@@ -155,6 +227,10 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
 
     trace_qcow2_cache_flush(qemu_coroutine_self(), c == s->l2_table_cache);
 
+    if (s->journal_offset) {
+        return qcow2_journal_commit(bs);
+    }
+
     for (i = 0; i < c->size; i++) {
         ret = qcow2_cache_entry_flush(bs, c, i);
         if (ret < 0 && result != -ENOSPC) {
@@ -175,8 +251,14 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
 int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
     Qcow2Cache *dependency)
 {
+    BDRVQcowState *s = bs->opaque;
     int ret;
 
+    /* Journal transactions update both caches atomically */
+    if (s->journal_offset) {
+        return 0;
+    }
+
     if (dependency->depends) {
         ret = qcow2_cache_flush_dependency(bs, dependency);
         if (ret < 0) {
@@ -200,6 +282,52 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
     c->depends_on_flush = true;
 }
 
+/*
+ * Returns the number of dirty tables in @c and a newly allocated array
+ * describing them in *@tables.  *@flush_needed is set if data written
+ * before must be stable on disk before the tables are.
+ */
+int qcow2_cache_get_dirty_tables(BlockDriverState *bs, Qcow2Cache *c,
+    Qcow2JournalTable **tables, bool *flush_needed)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ol_ign = 0;
+    int i, n = 0;
+
+    if (c == s->refcount_block_cache) {
+        ol_ign = QCOW2_OL_REFCOUNT_BLOCK;
+    } else if (c == s->l2_table_cache) {
+        ol_ign = QCOW2_OL_ACTIVE_L2;
+    }
+
+    *tables = g_malloc(sizeof(**tables) * c->size);
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].dirty && c->entries[i].offset) {
+            (*tables)[n++] = (Qcow2JournalTable) {
+                .offset = c->entries[i].offset,
+                .data   = qcow2_cache_get_table_addr(c, i),
+                .size   = c->table_size,
+                .ol_ign = ol_ign,
+            };
+        }
+    }
+    *flush_needed = c->depends_on_flush;
+
+    return n;
+}
+
+/* Forget about dirty tables and dependencies once the journal wrote them */
+void qcow2_cache_mark_clean(Qcow2Cache *c)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].dirty = false;
+    }
+    c->depends = NULL;
+    c->depends_on_flush = false;
+}
+
 int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret, i;
@@ -211,41 +339,46 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
+        if (c->entries[i].offset) {
+            qcow2_cache_hash_remove(c, i);
+        }
         c->entries[i].offset = 0;
-        c->entries[i].cache_hits = 0;
+        c->entries[i].referenced = false;
     }
 
     return 0;
 }
 
+/*
+ * CLOCK replacement: the hand sweeps over the entries, giving the ones that
+ * were hit since its last pass a second chance, and stops at the first
+ * unused one that was not.
+ */
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
+    int n;
 
+    /* After one full turn every unused entry has lost its second chance */
+    for (n = 0; n < 2 * c->size; n++) {
+        int i = c->clock_hand;
+
+        if (++c->clock_hand == c->size) {
+            c->clock_hand = 0;
+        }
 
-    for (i = 0; i < c->size; i++) {
         if (c->entries[i].ref) {
             continue;
         }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
+        if (c->entries[i].referenced) {
+            c->entries[i].referenced = false;
+            continue;
         }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
+        return i;
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
-    }
-    return min_index;
+    /* This can't happen in current synchronous code, but leave the check
+     * here as a reminder for whoever starts using AIO with the cache */
+    abort();
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
@@ -259,8 +392,11 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
+    for (i = c->buckets[qcow2_cache_hash(c, offset)]; i >= 0;
+         i = c->entries[i].hash_next) {
         if (c->entries[i].offset == offset) {
+            c->entries[i].referenced = true;
+            c->hits++;
             goto found;
         }
     }
@@ -280,28 +416,31 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
+    if (c->entries[i].offset) {
+        qcow2_cache_hash_remove(c, i);
+    }
     c->entries[i].offset = 0;
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        c->misses++;
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(c, i),
+                         c->table_size);
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
     c->entries[i].offset = offset;
+    c->entries[i].referenced = false;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
     c->entries[i].ref++;
-    *table = c->entries[i].table;
+    *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
@@ -323,16 +462,8 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
-    }
-    return -ENOENT;
+    int i = qcow2_cache_get_table_idx(c, *table);
 
-found:
     c->entries[i].ref--;
     *table = NULL;
 
@@ -342,15 +473,7 @@ found:
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
-
-found:
     c->entries[i].dirty = true;
 }
@@ -27,6 +27,7 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "trace.h"
 
 int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
@@ -125,22 +126,23 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
 /*
  * l2_load
  *
- * Loads a L2 table into memory. If the table is in the cache, the cache
- * is used; otherwise the L2 table is loaded from the image file.
+ * Loads the L2 slice that maps the guest offset @offset into memory. The L2
+ * table is at @l2_offset in the image file; only the l2_slice_size entries
+ * of it that contain @offset are read. If the slice is in the cache, the
+ * cache is used; otherwise it is loaded from the image file.
  *
- * Returns a pointer to the L2 table on success, or NULL if the read from
- * the image file failed.
+ * Returns 0 on success, -errno in failure case
  */
 
-static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
-    uint64_t **l2_table)
+static int l2_load(BlockDriverState *bs, uint64_t offset,
+    uint64_t l2_offset, uint64_t **l2_slice)
 {
     BDRVQcowState *s = bs->opaque;
-    int ret;
-
-    ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset, (void**) l2_table);
+    int start_of_slice = sizeof(uint64_t) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
 
-    return ret;
+    return qcow2_cache_get(bs, s->l2_table_cache, l2_offset + start_of_slice,
+                           (void **) l2_slice);
 }
 
 /*
@@ -184,20 +186,32 @@ int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index)
  * table) copy the contents of the old L2 table into the newly allocated one.
  * Otherwise the new table is initialized with zeros.
  *
+ * The new table is written slice by slice through the L2 cache; the caller
+ * loads the slice it needs afterwards.
  */
 
-static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
+static int l2_allocate(BlockDriverState *bs, int l1_index)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t old_l2_offset;
-    uint64_t *l2_table = NULL;
+    uint64_t *l2_slice = NULL;
     int64_t l2_offset;
-    int ret;
+    int slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    int n_slices = s->cluster_size / slice_size2;
+    int ret, slice;
 
     old_l2_offset = s->l1_table[l1_index];
 
     trace_qcow2_l2_allocate(bs, l1_index);
 
+    /* The copy shares the clusters of the old table, which may still lack
+     * the refcount for a new snapshot */
+    ret = qcow2_snapshot_settle_l2(bs, l1_index);
+    if (ret < 0) {
+        trace_qcow2_l2_allocate_done(bs, l1_index, ret);
+        return ret;
+    }
+
     /* allocate a new l2 entry */
 
     l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
@@ -211,44 +225,52 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    /* allocate a new entry in the l2 cache */
+    for (slice = 0; slice < n_slices; slice++) {
+        /* allocate a new entry in the l2 cache */
 
-    trace_qcow2_l2_allocate_get_empty(bs, l1_index);
-    ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset, (void**) table);
-    if (ret < 0) {
-        goto fail;
-    }
+        trace_qcow2_l2_allocate_get_empty(bs, l1_index);
+        ret = qcow2_cache_get_empty(bs, s->l2_table_cache,
+                                    l2_offset + slice * slice_size2,
+                                    (void**) &l2_slice);
+        if (ret < 0) {
+            goto fail;
+        }
 
-    l2_table = *table;
+        if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
+            /* if there was no old l2 table, clear the new slice */
+            memset(l2_slice, 0, slice_size2);
+        } else {
+            uint64_t* old_slice;
 
-    if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
-        /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
-    } else {
-        uint64_t* old_table;
+            /* if there was an old l2 table, read the slice from the disk */
+            BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
+            ret = qcow2_cache_get(bs, s->l2_table_cache,
+                (old_l2_offset & L1E_OFFSET_MASK) + slice * slice_size2,
+                (void**) &old_slice);
+            if (ret < 0) {
+                goto fail;
+            }
 
-        /* if there was an old l2 table, read it from the disk */
-        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
-        ret = qcow2_cache_get(bs, s->l2_table_cache,
-            old_l2_offset & L1E_OFFSET_MASK,
-            (void**) &old_table);
-        if (ret < 0) {
-            goto fail;
+            memcpy(l2_slice, old_slice, slice_size2);
+
+            ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &old_slice);
+            if (ret < 0) {
+                goto fail;
+            }
         }
 
-        memcpy(l2_table, old_table, s->cluster_size);
+        /* write the l2 slice to the file */
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
 
-        ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &old_table);
+        trace_qcow2_l2_allocate_write_l2(bs, l1_index);
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+        ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
+        l2_slice = NULL;
         if (ret < 0) {
             goto fail;
         }
     }
 
-    /* write the l2 table to the file */
-    BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
-
-    trace_qcow2_l2_allocate_write_l2(bs, l1_index);
-    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret < 0) {
         goto fail;
@@ -262,14 +284,13 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    *table = l2_table;
     trace_qcow2_l2_allocate_done(bs, l1_index, 0);
     return 0;
 
 fail:
     trace_qcow2_l2_allocate_done(bs, l1_index, ret);
-    if (l2_table != NULL) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) table);
+    if (l2_slice != NULL) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
     }
     s->l1_table[l1_index] = old_l2_offset;
     if (l2_offset > 0) {
@@ -332,20 +353,22 @@ void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                            int nb_sectors, int enc,
                            const AES_KEY *key)
 {
-    union {
-        uint64_t ll[2];
-        uint8_t b[16];
-    } ivec;
-    int i;
-
-    for(i = 0; i < nb_sectors; i++) {
-        ivec.ll[0] = cpu_to_le64(sector_num);
-        ivec.ll[1] = 0;
-        AES_cbc_encrypt(in_buf, out_buf, 512, key,
-                        ivec.b, enc);
-        sector_num++;
-        in_buf += 512;
-        out_buf += 512;
+    /* Each sector is a CBC chain whose IV is its little-endian number */
+    uint64_t ivecs[64][2];
+    int i, n;
+
+    while (nb_sectors > 0) {
+        n = MIN(nb_sectors, ARRAY_SIZE(ivecs));
+        for (i = 0; i < n; i++) {
+            ivecs[i][0] = cpu_to_le64(sector_num + i);
+            ivecs[i][1] = 0;
+        }
+        AES_cbc_encrypt_chunks(in_buf, out_buf, n, 512, key,
+                               (const unsigned char *)ivecs, enc);
+        sector_num += n;
+        in_buf += n * 512;
+        out_buf += n * 512;
+        nb_sectors -= n;
     }
 }
 
@@ -436,19 +459,20 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     uint64_t l1_index, l2_offset, *l2_table;
     int l1_bits, c;
     unsigned int index_in_cluster, nb_clusters;
-    uint64_t nb_available, nb_needed;
+    uint64_t nb_available, nb_needed, bytes_per_slice;
     int ret;
 
     index_in_cluster = (offset >> 9) & (s->cluster_sectors - 1);
     nb_needed = *num + index_in_cluster;
 
     l1_bits = s->l2_bits + s->cluster_bits;
+    bytes_per_slice = (uint64_t)s->l2_slice_size << s->cluster_bits;
 
     /* compute how many bytes there are between the offset and
-     * the end of the l1 entry
+     * the end of the l2 slice
      */
 
-    nb_available = (1ULL << l1_bits) - (offset & ((1ULL << l1_bits) - 1));
+    nb_available = bytes_per_slice - (offset & (bytes_per_slice - 1));
 
     /* compute the number of available sectors */
 
@@ -474,16 +498,16 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         goto out;
     }
 
-    /* load the l2 table in memory */
+    /* load the l2 slice in memory */
 
-    ret = l2_load(bs, l2_offset, &l2_table);
+    ret = l2_load(bs, offset, l2_offset, &l2_table);
     if (ret < 0) {
         return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    l2_index = offset_to_l2_slice_index(s, offset);
     *cluster_offset = be64_to_cpu(l2_table[l2_index]);
     nb_clusters = size_to_clusters(s, nb_needed << 9);
 
@@ -534,10 +558,10 @@ out:
  * get_cluster_table
  *
  * for a given disk offset, load (and allocate if needed)
- * the l2 table.
+ * the l2 slice.
  *
- * the l2 table offset in the qcow2 file and the cluster index
- * in the l2 table are given to the caller.
+ * the l2 slice and the cluster index in the l2 slice are given to
+ * the caller.
  *
  * Returns 0 on success, -errno in failure case
  */
@@ -566,15 +590,9 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
     /* seek the l2 table of the given l2 offset */
 
-    if (s->l1_table[l1_index] & QCOW_OFLAG_COPIED) {
-        /* load the l2 table in memory */
-        ret = l2_load(bs, l2_offset, &l2_table);
-        if (ret < 0) {
-            return ret;
-        }
-    } else {
+    if (!(s->l1_table[l1_index] & QCOW_OFLAG_COPIED)) {
         /* First allocate a new L2 table (and do COW if needed) */
-        ret = l2_allocate(bs, l1_index, &l2_table);
+        ret = l2_allocate(bs, l1_index);
         if (ret < 0) {
             return ret;
         }
@@ -584,11 +602,20 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
             qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
                                 QCOW2_DISCARD_OTHER);
         }
+
+        /* Get the offset of the newly-allocated l2 table */
+        l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    }
+
+    /* load the l2 slice in memory */
+    ret = l2_load(bs, offset, l2_offset, &l2_table);
+    if (ret < 0) {
+        return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    l2_index = offset_to_l2_slice_index(s, offset);
 
     *new_l2_table = l2_table;
     *new_l2_index = l2_index;
@@ -664,7 +691,7 @@ static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
     BDRVQcowState *s = bs->opaque;
     int ret;
 
-    if (r->nb_sectors == 0) {
+    if (r->nb_sectors == 0 || m->skip_cow) {
         return 0;
     }
 
@@ -706,11 +733,21 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
         goto err;
     }
 
+    /* From now on, cow_end can't shrink any more */
+    m->cow_end_busy = true;
     ret = perform_cow(bs, m, &m->cow_end);
     if (ret < 0) {
         goto err;
     }
 
+    /* Requests that write into our cluster must have their data on disk
+     * before the L2 table points to it */
+    while (m->nb_cow_end_writers > 0) {
+        qemu_co_mutex_unlock(&s->lock);
+        qemu_co_queue_wait(&m->cow_end_writers_done);
+        qemu_co_mutex_lock(&s->lock);
+    }
+
     /* Update L2 table. */
     if (s->use_lazy_refcounts) {
         qcow2_mark_dirty(bs);
@@ -726,7 +763,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     }
     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
 
-    assert(l2_index + m->nb_clusters <= s->l2_size);
+    assert(l2_index + m->nb_clusters <= s->l2_slice_size);
     for (i = 0; i < m->nb_clusters; i++) {
         /* if two concurrent writes happen to the same unallocated cluster
 	 * each write allocates separate cluster and writes data concurrently.
@@ -806,17 +843,27 @@ out:
  * the same cluster. In this case we need to wait until the previous
  * request has completed and updated the L2 table accordingly.
  *
+ * If the request starts exactly where the data of the in-flight allocation
+ * ends, it doesn't have to wait: it can write into the newly allocated
+ * cluster instead, and the in-flight allocation copies that much less for
+ * its COW. This is only done if cow_end_owner is non-NULL.
+ *
  * Returns:
  *   0       if there was no dependency. *cur_bytes indicates the number of
  *           bytes from guest_offset that can be read before the next
  *           dependency must be processed (or the request is complete)
  *
+ *   1       if the request writes into the cow_end area of the in-flight
+ *           allocation *cow_end_owner. *host_offset and *cur_bytes describe
+ *           where and how much can be written.
+ *
  *   -EAGAIN if we had to wait for another request, previously gathered
  *           information on cluster allocation may be invalid now. The caller
  *           must start over anyway, so consider *cur_bytes undefined.
  */
 static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
-    uint64_t *cur_bytes, QCowL2Meta **m)
+    uint64_t *cur_bytes, QCowL2Meta **m, uint64_t *host_offset,
+    QCowL2Meta **cow_end_owner)
 {
     BDRVQcowState *s = bs->opaque;
     QCowL2Meta *old_alloc;
@@ -831,6 +878,26 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
 
         if (end <= old_start || start >= old_end) {
             /* No intersection */
+        } else if (cow_end_owner && *m == NULL &&
+                   !old_alloc->cow_end_busy &&
+                   old_alloc->cow_end.nb_sectors > 0 &&
+                   start == old_alloc->offset + old_alloc->cow_end.offset)
+        {
+            Qcow2COWRegion *r = &old_alloc->cow_end;
+
+            bytes = MIN(bytes, r->nb_sectors * BDRV_SECTOR_SIZE);
+            trace_qcow2_join_cow_end(qemu_coroutine_self(), start,
+                                     bytes >> BDRV_SECTOR_BITS);
+
+            r->offset += bytes;
+            r->nb_sectors -= bytes >> BDRV_SECTOR_BITS;
+            old_alloc->nb_cow_end_writers++;
+
+            *host_offset = old_alloc->alloc_offset +
+                           (start - old_alloc->offset);
+            *cow_end_owner = old_alloc;
+            *cur_bytes = bytes;
+            return 1;
         } else {
             if (start < old_start) {
                 /* Stop at the start of a running allocation */
@@ -906,14 +973,14 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
                                 == offset_into_cluster(s, *host_offset));
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters =
         size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
 
-    l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    l2_index = offset_to_l2_slice_index(s, guest_offset);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     /* Find L2 entry for the first involved cluster */
     ret = get_cluster_table(bs, guest_offset, &l2_table, &l2_index);
@@ -990,13 +1057,23 @@ out:
  * restarted, but the whole request should not be failed.
  */
 static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
-    uint64_t *host_offset, unsigned int *nb_clusters)
+    uint64_t *host_offset, unsigned int *nb_clusters, bool *zeroed)
 {
     BDRVQcowState *s = bs->opaque;
+    int64_t pool_offset;
 
     trace_qcow2_do_alloc_clusters_offset(qemu_coroutine_self(), guest_offset,
                                          *host_offset, *nb_clusters);
 
+    /* Take zeroed clusters from the pool if there are any */
+    pool_offset = qcow2_cluster_pool_get(bs, *host_offset, nb_clusters);
+    if (pool_offset) {
+        *host_offset = pool_offset;
+        *zeroed = true;
+        return 0;
+    }
+    *zeroed = false;
+
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
     if (*host_offset == 0) {
@@ -1044,7 +1121,8 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     int l2_index;
     uint64_t *l2_table;
     uint64_t entry;
-    unsigned int nb_clusters;
+    unsigned int nb_clusters, nb_read_zero;
+    bool zeroed;
     int ret;
 
     uint64_t alloc_cluster_offset;
@@ -1054,14 +1132,14 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     assert(*bytes > 0);
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters =
         size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
 
-    l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    l2_index = offset_to_l2_slice_index(s, guest_offset);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     /* Find L2 entry for the first involved cluster */
     ret = get_cluster_table(bs, guest_offset, &l2_table, &l2_index);
@@ -1083,6 +1161,17 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
      * wrong with our code. */
     assert(nb_clusters > 0);
 
+    /* Without a backing file, unallocated clusters read as zeroes, too */
+    for (nb_read_zero = 0; nb_read_zero < nb_clusters; nb_read_zero++) {
+        int type = qcow2_get_cluster_type(
+            be64_to_cpu(l2_table[l2_index + nb_read_zero]));
+
+        if (type != QCOW2_CLUSTER_ZERO &&
+            (type != QCOW2_CLUSTER_UNALLOCATED || bs->backing_hd)) {
+            break;
+        }
+    }
+
     ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
     if (ret < 0) {
         return ret;
@@ -1091,7 +1180,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     /* Allocate, if necessary at a given offset in the image file */
     alloc_cluster_offset = start_of_cluster(s, *host_offset);
     ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
-                                  &nb_clusters);
+                                  &nb_clusters, &zeroed);
     if (ret < 0) {
         goto fail;
     }
@@ -1144,8 +1233,13 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
             .offset     = nb_sectors * BDRV_SECTOR_SIZE,
             .nb_sectors = avail_sectors - nb_sectors,
         },
+
+        /* Encrypted zeroes don't read as zeroes */
+        .skip_cow       = zeroed && nb_read_zero >= nb_clusters &&
+                          !s->crypt_method,
     };
     qemu_co_queue_init(&(*m)->dependent_requests);
+    qemu_co_queue_init(&(*m)->cow_end_writers_done);
     QLIST_INSERT_HEAD(&s->cluster_allocs, *m, next_in_flight);
 
     *host_offset = alloc_cluster_offset + offset_into_cluster(s, guest_offset);
@@ -1179,10 +1273,16 @@ fail:
  * If the request conflicts with another write request in flight, the coroutine
  * is queued and will be reentered when the dependency has completed.
  *
+ * Unless cow_end_owner is NULL, the request may instead be directed into the
+ * cluster of an in-flight allocation whose data ends where the request
+ * starts. In this case *cow_end_owner is set to that allocation, and the
+ * caller must call qcow2_finish_cow_end_write() once the data is written.
+ *
  * Return 0 on success and -errno in error cases
  */
 int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
-    int n_start, int n_end, int *num, uint64_t *host_offset, QCowL2Meta **m)
+    int n_start, int n_end, int *num, uint64_t *host_offset, QCowL2Meta **m,
+    QCowL2Meta **cow_end_owner)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t start, remaining;
@@ -1203,6 +1303,9 @@ again:
     *host_offset = 0;
     cur_bytes = 0;
     *m = NULL;
+    if (cow_end_owner) {
+        *cow_end_owner = NULL;
+    }
 
     while (true) {
 
@@ -1234,13 +1337,15 @@ again:
          *         for contiguous clusters (the situation could have changed
          *         while we were sleeping)
          *
-         *      c) TODO: Request starts in the same cluster as the in-flight
-         *         allocation ends. Shorten the COW of the in-fight allocation,
-         *         set cluster_offset to write to the same cluster and set up
-         *         the right synchronisation between the in-flight request and
-         *         the new one.
+         *      c) Request starts in the same cluster as the in-flight
+         *         allocation ends. Shorten the COW of the in-flight
+         *         allocation and write to the same cluster; the in-flight
+         *         request waits for our data before updating the L2 table.
+         *         Only done at the start of a request, so that the host
+         *         range stays contiguous.
          */
-        ret = handle_dependencies(bs, start, &cur_bytes, m);
+        ret = handle_dependencies(bs, start, &cur_bytes, m, &cluster_offset,
+                                  cluster_offset ? NULL : cow_end_owner);
         if (ret == -EAGAIN) {
             /* Currently handle_dependencies() doesn't yield if we already had
              * an allocation. If it did, we would have to clean up the L2Meta
@@ -1249,6 +1354,12 @@ again:
             goto again;
         } else if (ret < 0) {
             return ret;
+        } else if (ret == 1) {
+            /* Nothing else can be merged into a write to another request's
+             * allocation */
+            *host_offset = start_of_cluster(s, cluster_offset);
+            remaining -= cur_bytes;
+            break;
         } else if (cur_bytes == 0) {
             break;
         } else {
@@ -1291,6 +1402,41 @@ again:
     return 0;
 }
 
+/*
+ * Completes a write into the cow_end area of the in-flight allocation
+ * @owner, whether the data could be written or not. Waits until the owner
+ * has updated the L2 table and returns 1 if the data at @guest_offset is
+ * now mapped to @host_offset, and 0 if the allocation failed and the data
+ * must be written again.
+ */
+int qcow2_finish_cow_end_write(BlockDriverState *bs, QCowL2Meta *owner,
+    uint64_t guest_offset, uint64_t host_offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+    int num = 1;
+    int ret;
+
+    assert(owner->nb_cow_end_writers > 0);
+    if (--owner->nb_cow_end_writers == 0) {
+        qemu_co_queue_restart_all(&owner->cow_end_writers_done);
+    }
+
+    /* The owner can't complete before we wait, it is only restarted when we
+     * yield. Don't touch it afterwards, it's freed by then. */
+    qemu_co_mutex_unlock(&s->lock);
+    qemu_co_queue_wait(&owner->dependent_requests);
+    qemu_co_mutex_lock(&s->lock);
+
+    ret = qcow2_get_cluster_offset(bs, guest_offset, &num, &cluster_offset);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return ret == QCOW2_CLUSTER_NORMAL &&
+           cluster_offset == start_of_cluster(s, host_offset);
+}
+
 static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
                              const uint8_t *buf, int buf_size)
 {
@@ -1318,34 +1464,70 @@ static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
     return 0;
 }
 
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+typedef struct Qcow2Inflate {
+    uint8_t *dst;
+    int dst_len;
+    const uint8_t *src;
+    int src_len;
+} Qcow2Inflate;
+
+static int qcow2_inflate_worker(void *opaque)
+{
+    Qcow2Inflate *c = opaque;
+
+    return decompress_buffer(c->dst, c->dst_len, c->src, c->src_len) < 0 ?
+           -EIO : 0;
+}
+
+/*
+ * Reads the compressed cluster described by cluster_offset and inflates it
+ * into out_buf, which must hold a full cluster.  Called without s->lock,
+ * so that several clusters can be read and inflated at the same time.
+ */
+int coroutine_fn qcow2_co_decompress_cluster(BlockDriverState *bs,
+                                             uint64_t cluster_offset,
+                                             uint8_t *out_buf)
 {
     BDRVQcowState *s = bs->opaque;
     int ret, csize, nb_csectors, sector_offset;
     uint64_t coffset;
+    uint8_t *buf;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    Qcow2Inflate inflate;
+    ThreadPool *pool;
 
     coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data, nb_csectors);
-        if (ret < 0) {
-            return ret;
-        }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
-        }
-        s->cluster_cache_offset = coffset;
+    nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    sector_offset = coffset & 511;
+    csize = nb_csectors * 512 - sector_offset;
+
+    buf = qemu_blockalign(bs, nb_csectors * 512);
+    iov.iov_base = buf;
+    iov.iov_len = nb_csectors * 512;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_readv(bs->file, coffset >> 9, nb_csectors, &qiov);
+    if (ret < 0) {
+        goto out;
     }
-    return 0;
+
+    inflate.dst = out_buf;
+    inflate.dst_len = s->cluster_size;
+    inflate.src = buf + sector_offset;
+    inflate.src_len = csize;
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    ret = thread_pool_submit_co(pool, qcow2_inflate_worker, &inflate);
+
+out:
+    qemu_vfree(buf);
+    return ret;
 }
 
 /*
  * This discards as many clusters of nb_clusters as possible at once (i.e.
- * all clusters in the same L2 table) and returns the number of discarded
+ * all clusters in the same L2 slice) and returns the number of discarded
  * clusters.
  */
 static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
@@ -1362,8 +1544,8 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
@@ -1411,7 +1593,7 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
 
     s->cache_discards = true;
 
-    /* Each L2 table is handled by its own loop iteration */
+    /* Each L2 slice is handled by its own loop iteration */
     while (nb_clusters > 0) {
         ret = discard_single_l2(bs, offset, nb_clusters, type);
         if (ret < 0) {
@@ -1432,7 +1614,7 @@ fail:
 
 /*
  * This zeroes as many clusters of nb_clusters as possible at once (i.e.
- * all clusters in the same L2 table) and returns the number of zeroed
+ * all clusters in the same L2 slice) and returns the number of zeroed
  * clusters.
  */
 static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
@@ -1449,8 +1631,8 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
@@ -1486,7 +1668,7 @@ int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
         return -ENOTSUP;
     }
 
-    /* Each L2 table is handled by its own loop iteration */
+    /* Each L2 slice is handled by its own loop iteration */
     nb_clusters = size_to_clusters(s, nb_sectors << BDRV_SECTOR_BITS);
 
     s->cache_discards = true;
@@ -1509,6 +1691,106 @@ fail:
     return ret;
 }
 
+/*
+ * Expands the zero cluster described by the L2 entry *@l2_entry_ptr (or
+ * deallocates it, for non-backed non-pre-allocated zero clusters), see
+ * expand_zero_clusters_in_l1(). *@dirty is set if the entry was changed.
+ */
+static int expand_zero_cluster(BlockDriverState *bs, uint64_t *l2_entry_ptr,
+                               uint8_t **expanded_clusters,
+                               uint64_t *nb_clusters, bool *dirty)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l2_entry = be64_to_cpu(*l2_entry_ptr);
+    int64_t offset = l2_entry & L2E_OFFSET_MASK, cluster_index;
+    int cluster_type = qcow2_get_cluster_type(l2_entry);
+    bool preallocated = offset != 0;
+    int ret;
+
+    if (cluster_type == QCOW2_CLUSTER_NORMAL) {
+        cluster_index = offset >> s->cluster_bits;
+        assert((cluster_index >= 0) && (cluster_index < *nb_clusters));
+        if ((*expanded_clusters)[cluster_index / 8] &
+            (1 << (cluster_index % 8))) {
+            /* Probably a shared L2 table; this cluster was a zero
+             * cluster which has been expanded, its refcount
+             * therefore most likely requires an update. */
+            ret = qcow2_update_cluster_refcount(bs, cluster_index, 1,
+                                                QCOW2_DISCARD_NEVER);
+            if (ret < 0) {
+                return ret;
+            }
+            /* Since we just increased the refcount, the COPIED flag may
+             * no longer be set. */
+            *l2_entry_ptr = cpu_to_be64(l2_entry & ~QCOW_OFLAG_COPIED);
+            *dirty = true;
+        }
+        return 0;
+    } else if (cluster_type != QCOW2_CLUSTER_ZERO) {
+        return 0;
+    }
+
+    if (!preallocated) {
+        if (!bs->backing_hd) {
+            /* not backed; therefore we can simply deallocate the
+             * cluster */
+            *l2_entry_ptr = 0;
+            *dirty = true;
+            return 0;
+        }
+
+        offset = qcow2_alloc_clusters(bs, s->cluster_size);
+        if (offset < 0) {
+            return offset;
+        }
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->cluster_size);
+    if (ret < 0) {
+        if (!preallocated) {
+            qcow2_free_clusters(bs, offset, s->cluster_size,
+                                QCOW2_DISCARD_ALWAYS);
+        }
+        return ret;
+    }
+
+    ret = bdrv_write_zeroes(bs->file, offset / BDRV_SECTOR_SIZE,
+                            s->cluster_sectors, 0);
+    if (ret < 0) {
+        if (!preallocated) {
+            qcow2_free_clusters(bs, offset, s->cluster_size,
+                                QCOW2_DISCARD_ALWAYS);
+        }
+        return ret;
+    }
+
+    *l2_entry_ptr = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
+    *dirty = true;
+
+    cluster_index = offset >> s->cluster_bits;
+
+    if (cluster_index >= *nb_clusters) {
+        uint64_t old_bitmap_size = (*nb_clusters + 7) / 8;
+        uint64_t new_bitmap_size;
+        /* The offset may lie beyond the old end of the underlying image
+         * file for growable files only */
+        assert(bs->file->growable);
+        *nb_clusters = size_to_clusters(s, bs->file->total_sectors *
+                                        BDRV_SECTOR_SIZE);
+        new_bitmap_size = (*nb_clusters + 7) / 8;
+        *expanded_clusters = g_realloc(*expanded_clusters,
+                                       new_bitmap_size);
+        /* clear the newly allocated space */
+        memset(&(*expanded_clusters)[old_bitmap_size], 0,
+               new_bitmap_size - old_bitmap_size);
+    }
+
+    assert((cluster_index >= 0) && (cluster_index < *nb_clusters));
+    (*expanded_clusters)[cluster_index / 8] |= 1 << (cluster_index % 8);
+
+    return 0;
+}
+
 /*
  * Expands all zero clusters in a specific L1 table (or deallocates them, for
  * non-backed non-pre-allocated zero clusters).
@@ -1525,14 +1807,17 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
 {
     BDRVQcowState *s = bs->opaque;
     bool is_active_l1 = (l1_table == s->l1_table);
-    uint64_t *l2_table = NULL;
+    uint64_t *l2_buf = NULL;
+    uint64_t *l2_slice = NULL;
+    int slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    int n_slices = s->cluster_size / slice_size2;
     int ret;
-    int i, j;
+    int i, j, slice;
 
     if (!is_active_l1) {
         /* inactive L2 tables require a buffer to be stored in when loading
          * them from disk */
-        l2_table = qemu_blockalign(bs, s->cluster_size);
+        l2_buf = qemu_blockalign(bs, s->cluster_size);
     }
 
     for (i = 0; i < l1_size; i++) {
@@ -1544,152 +1829,83 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
             continue;
         }
 
-        if (is_active_l1) {
-            /* get active L2 tables from cache */
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                    (void **)&l2_table);
-        } else {
+        if (!is_active_l1) {
             /* load inactive L2 tables from disk */
             ret = bdrv_read(bs->file, l2_offset / BDRV_SECTOR_SIZE,
-                    (void *)l2_table, s->cluster_sectors);
-        }
-        if (ret < 0) {
-            goto fail;
+                    (void *)l2_buf, s->cluster_sectors);
+            if (ret < 0) {
+                goto fail;
+            }
         }
 
-        for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
-            int64_t offset = l2_entry & L2E_OFFSET_MASK, cluster_index;
-            int cluster_type = qcow2_get_cluster_type(l2_entry);
-            bool preallocated = offset != 0;
-
-            if (cluster_type == QCOW2_CLUSTER_NORMAL) {
-                cluster_index = offset >> s->cluster_bits;
-                assert((cluster_index >= 0) && (cluster_index < *nb_clusters));
-                if ((*expanded_clusters)[cluster_index / 8] &
-                    (1 << (cluster_index % 8))) {
-                    /* Probably a shared L2 table; this cluster was a zero
-                     * cluster which has been expanded, its refcount
-                     * therefore most likely requires an update. */
-                    ret = qcow2_update_cluster_refcount(bs, cluster_index, 1,
-                                                        QCOW2_DISCARD_NEVER);
-                    if (ret < 0) {
-                        goto fail;
-                    }
-                    /* Since we just increased the refcount, the COPIED flag may
-                     * no longer be set. */
-                    l2_table[j] = cpu_to_be64(l2_entry & ~QCOW_OFLAG_COPIED);
-                    l2_dirty = true;
+        for (slice = 0; slice < n_slices; slice++) {
+            bool slice_dirty = false;
+
+            if (is_active_l1) {
+                /* get active L2 slices from cache */
+                ret = qcow2_cache_get(bs, s->l2_table_cache,
+                        l2_offset + slice * slice_size2, (void **)&l2_slice);
+                if (ret < 0) {
+                    goto fail;
                 }
-                continue;
-            }
-            else if (qcow2_get_cluster_type(l2_entry) != QCOW2_CLUSTER_ZERO) {
-                continue;
+            } else {
+                l2_slice = l2_buf + slice * s->l2_slice_size;
             }
 
-            if (!preallocated) {
-                if (!bs->backing_hd) {
-                    /* not backed; therefore we can simply deallocate the
-                     * cluster */
-                    l2_table[j] = 0;
-                    l2_dirty = true;
-                    continue;
+            for (j = 0; j < s->l2_slice_size; j++) {
+                ret = expand_zero_cluster(bs, &l2_slice[j], expanded_clusters,
+                                          nb_clusters, &slice_dirty);
+                if (ret < 0) {
+                    goto fail;
                 }
+            }
 
-                offset = qcow2_alloc_clusters(bs, s->cluster_size);
-                if (offset < 0) {
-                    ret = offset;
+            if (is_active_l1) {
+                if (slice_dirty) {
+                    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+                    qcow2_cache_depends_on_flush(s->l2_table_cache);
+                }
+                ret = qcow2_cache_put(bs, s->l2_table_cache,
+                                      (void **)&l2_slice);
+                l2_slice = NULL;
+                if (ret < 0) {
                     goto fail;
                 }
+            } else {
+                l2_dirty |= slice_dirty;
             }
+        }
 
-            ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->cluster_size);
+        if (!is_active_l1 && l2_dirty) {
+            ret = qcow2_pre_write_overlap_check(bs,
+                    QCOW2_OL_INACTIVE_L2 | QCOW2_OL_ACTIVE_L2, l2_offset,
+                    s->cluster_size);
             if (ret < 0) {
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
-                }
                 goto fail;
             }
 
-            ret = bdrv_write_zeroes(bs->file, offset / BDRV_SECTOR_SIZE,
-                                    s->cluster_sectors, 0);
+            /* The table may be shared with the active L1 table, so an old
+             * copy of it may be in the journal */
+            ret = qcow2_journal_checkpoint(bs);
             if (ret < 0) {
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
-                }
                 goto fail;
             }
 
-            l2_table[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
-            l2_dirty = true;
-
-            cluster_index = offset >> s->cluster_bits;
-
-            if (cluster_index >= *nb_clusters) {
-                uint64_t old_bitmap_size = (*nb_clusters + 7) / 8;
-                uint64_t new_bitmap_size;
-                /* The offset may lie beyond the old end of the underlying image
-                 * file for growable files only */
-                assert(bs->file->growable);
-                *nb_clusters = size_to_clusters(s, bs->file->total_sectors *
-                                                BDRV_SECTOR_SIZE);
-                new_bitmap_size = (*nb_clusters + 7) / 8;
-                *expanded_clusters = g_realloc(*expanded_clusters,
-                                               new_bitmap_size);
-                /* clear the newly allocated space */
-                memset(&(*expanded_clusters)[old_bitmap_size], 0,
-                       new_bitmap_size - old_bitmap_size);
-            }
-
-            assert((cluster_index >= 0) && (cluster_index < *nb_clusters));
-            (*expanded_clusters)[cluster_index / 8] |= 1 << (cluster_index % 8);
-        }
-
-        if (is_active_l1) {
-            if (l2_dirty) {
-                qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-                qcow2_cache_depends_on_flush(s->l2_table_cache);
-            }
-            ret = qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_table);
+            ret = bdrv_write(bs->file, l2_offset / BDRV_SECTOR_SIZE,
+                    (void *)l2_buf, s->cluster_sectors);
             if (ret < 0) {
-                l2_table = NULL;
                 goto fail;
             }
-        } else {
-            if (l2_dirty) {
-                ret = qcow2_pre_write_overlap_check(bs,
-                        QCOW2_OL_INACTIVE_L2 | QCOW2_OL_ACTIVE_L2, l2_offset,
-                        s->cluster_size);
-                if (ret < 0) {
-                    goto fail;
-                }
-
-                ret = bdrv_write(bs->file, l2_offset / BDRV_SECTOR_SIZE,
-                        (void *)l2_table, s->cluster_sectors);
-                if (ret < 0) {
-                    goto fail;
-                }
-            }
         }
     }
 
     ret = 0;
 
 fail:
-    if (l2_table) {
-        if (!is_active_l1) {
-            qemu_vfree(l2_table);
-        } else {
-            if (ret < 0) {
-                qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_table);
-            } else {
-                ret = qcow2_cache_put(bs, s->l2_table_cache,
-                        (void **)&l2_table);
-            }
-        }
+    if (is_active_l1 && l2_slice) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_slice);
     }
+    qemu_vfree(l2_buf);
     return ret;
 }
 
@@ -0,0 +1,628 @@
+/*
+ * Metadata journal for the QCOW2 format
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * Without a journal, L2 tables and refcount blocks are written in place and
+ * kept consistent by ordering flushes: refcount blocks must be stable before
+ * the L2 tables that rely on them (qcow2_cache_set_dependency).  With a
+ * journal, the dirty tables of both caches are first written as one
+ * transaction to a dedicated area of the image file and flushed once.  Only
+ * then are they written in place, and those writes need no flush of their
+ * own because the journal can replay them after a crash.
+ *
+ * Transactions are appended one after the other; each starts with a header
+ * and an array of descriptors (padded to a sector), followed by the table
+ * contents.  They carry increasing sequence numbers and a CRC32C, so that
+ * replay on open can find where the valid ones end.  When the journal is
+ * full, the file is flushed, which makes the in-place writes of all
+ * transactions in it stable, and the next one starts again at the beginning.
+ *
+ * Sequence numbers never go back, even across sessions: a transaction left
+ * behind the end of the journal by an earlier lap or session must not chain
+ * after new ones.  The header extension records a limit that all numbers
+ * used so far are below, and it is raised in steps before it is reached.
+ *
+ * A transaction with no tables is a checkpoint: it marks the journal as
+ * having nothing to replay.  One is written whenever the tables in the
+ * journal could become stale, e.g. because a cluster holding one of them is
+ * freed and may be reused for something else.
+ */
+
+#include "block/block_int.h"
+#include "qemu-common.h"
+#include "qemu/crc32c.h"
+#include "qcow2.h"
+#include "trace.h"
+
+#define QCOW2_JOURNAL_MAGIC 0x716a6e6c  /* "qjnl" */
+
+/* How far the sequence number limit is raised at a time */
+#define QCOW2_JOURNAL_SEQ_STEP  (1ULL << 16)
+
+typedef struct Qcow2JournalHeader {
+    uint32_t magic;
+    uint32_t crc;           /* CRC32C of the transaction with crc = 0 */
+    uint64_t seq;
+    uint32_t nb_tables;
+    uint32_t length;        /* of the whole transaction, in bytes */
+} QEMU_PACKED Qcow2JournalHeader;
+
+typedef struct Qcow2JournalDesc {
+    uint64_t offset;        /* where the table goes in the image file */
+    uint32_t size;
+    uint32_t reserved;
+} QEMU_PACKED Qcow2JournalDesc;
+
+static uint64_t qcow2_journal_header_len(int nb_tables)
+{
+    return align_offset(sizeof(Qcow2JournalHeader) +
+                        nb_tables * sizeof(Qcow2JournalDesc),
+                        BDRV_SECTOR_SIZE);
+}
+
+static uint64_t qcow2_journal_txn_len(Qcow2JournalTable *tables,
+                                      int nb_tables)
+{
+    uint64_t len = qcow2_journal_header_len(nb_tables);
+    int i;
+
+    for (i = 0; i < nb_tables; i++) {
+        len += tables[i].size;
+    }
+    return len;
+}
+
+static gint qcow2_journal_cluster_cmp(gconstpointer a, gconstpointer b,
+                                      gpointer opaque)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Forget which clusters the journal holds tables for */
+static void qcow2_journal_reset_clusters(BDRVQcowState *s)
+{
+    if (s->journal_clusters) {
+        g_tree_destroy(s->journal_clusters);
+    }
+    s->journal_clusters = g_tree_new_full(qcow2_journal_cluster_cmp, NULL,
+                                          g_free, NULL);
+}
+
+/*
+ * Makes sure that the header allows the next sequence number.
+ */
+static int qcow2_journal_reserve_seq(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t old_limit = s->journal_seq_limit;
+    int ret;
+
+    if (s->journal_seq < old_limit) {
+        return 0;
+    }
+
+    s->journal_seq_limit = s->journal_seq + QCOW2_JOURNAL_SEQ_STEP;
+    ret = qcow2_update_header(bs);
+    if (ret >= 0) {
+        ret = bdrv_flush(bs->file);
+    }
+    if (ret < 0) {
+        s->journal_seq_limit = old_limit;
+    }
+    return ret;
+}
+
+/*
+ * Writes a transaction for @nb_tables tables at the current journal
+ * position, which must have room for it, and makes it stable.
+ */
+static int qcow2_journal_write_txn(BlockDriverState *bs,
+                                   Qcow2JournalTable *tables, int nb_tables)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t hdr_len = qcow2_journal_header_len(nb_tables);
+    uint64_t len = qcow2_journal_txn_len(tables, nb_tables);
+    Qcow2JournalHeader *hdr;
+    Qcow2JournalDesc *desc;
+    QEMUIOVector qiov;
+    uint32_t crc;
+    int i, ret;
+
+    assert(s->journal_pos + len <= s->journal_size);
+
+    ret = qcow2_journal_reserve_seq(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    hdr = qemu_blockalign(bs, hdr_len);
+    memset(hdr, 0, hdr_len);
+    *hdr = (Qcow2JournalHeader) {
+        .magic      = cpu_to_be32(QCOW2_JOURNAL_MAGIC),
+        .seq        = cpu_to_be64(s->journal_seq),
+        .nb_tables  = cpu_to_be32(nb_tables),
+        .length     = cpu_to_be32(len),
+    };
+
+    desc = (Qcow2JournalDesc *)(hdr + 1);
+    for (i = 0; i < nb_tables; i++) {
+        desc[i].offset = cpu_to_be64(tables[i].offset);
+        desc[i].size = cpu_to_be32(tables[i].size);
+    }
+
+    crc = crc32c(0xffffffff, (uint8_t *)hdr, hdr_len);
+    for (i = 0; i < nb_tables; i++) {
+        crc = crc32c(crc, tables[i].data, tables[i].size);
+    }
+    hdr->crc = cpu_to_be32(crc);
+
+    qemu_iovec_init(&qiov, nb_tables + 1);
+    qemu_iovec_add(&qiov, hdr, hdr_len);
+    for (i = 0; i < nb_tables; i++) {
+        qemu_iovec_add(&qiov, tables[i].data, tables[i].size);
+    }
+
+    trace_qcow2_journal_commit(bs, s->journal_seq, nb_tables,
+                               s->journal_pos, len);
+    ret = bdrv_pwritev(bs->file, s->journal_offset + s->journal_pos, &qiov);
+    qemu_iovec_destroy(&qiov);
+    qemu_vfree(hdr);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->journal_pos += len;
+    s->journal_seq++;
+    return 0;
+}
+
+/*
+ * Commits one transaction and writes its tables in place.
+ */
+static int qcow2_journal_commit_txn(BlockDriverState *bs,
+                                    Qcow2JournalTable *tables, int nb_tables)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t len = qcow2_journal_txn_len(tables, nb_tables);
+    int i, ret;
+
+    if (s->journal_pos + len > s->journal_size) {
+        /* Wrap around; the tables of all transactions in the journal must
+         * be stable in place before they are overwritten */
+        ret = bdrv_flush(bs->file);
+        if (ret < 0) {
+            return ret;
+        }
+        s->journal_pos = 0;
+        qcow2_journal_reset_clusters(s);
+    }
+
+    ret = qcow2_journal_write_txn(bs, tables, nb_tables);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < nb_tables; i++) {
+        int64_t *cluster = g_malloc(sizeof(*cluster));
+
+        *cluster = tables[i].offset >> s->cluster_bits;
+        g_tree_insert(s->journal_clusters, cluster, cluster);
+
+        ret = qcow2_pre_write_overlap_check(bs, tables[i].ol_ign,
+                                            tables[i].offset, tables[i].size);
+        if (ret < 0) {
+            return ret;
+        }
+
+        ret = bdrv_pwrite(bs->file, tables[i].offset, tables[i].data,
+                          tables[i].size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Writes all dirty L2 tables and refcount blocks through the journal.
+ *
+ * Usually they all go in one transaction.  If they don't fit in the journal,
+ * refcount blocks are committed before L2 tables, which keeps the ordering
+ * that the caches would otherwise get from their dependency flushes.
+ */
+int qcow2_journal_commit(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2JournalTable *refcount_tables, *l2_tables, *tables;
+    bool refcount_flush, l2_flush;
+    int nb_refcount, nb_l2, nb_tables;
+    int first, last;
+    int ret;
+
+    nb_refcount = qcow2_cache_get_dirty_tables(bs, s->refcount_block_cache,
+                                               &refcount_tables,
+                                               &refcount_flush);
+    nb_l2 = qcow2_cache_get_dirty_tables(bs, s->l2_table_cache, &l2_tables,
+                                         &l2_flush);
+    nb_tables = nb_refcount + nb_l2;
+
+    tables = g_malloc(sizeof(*tables) * MAX(nb_tables, 1));
+    memcpy(tables, refcount_tables, sizeof(*tables) * nb_refcount);
+    memcpy(tables + nb_refcount, l2_tables, sizeof(*tables) * nb_l2);
+    g_free(refcount_tables);
+    g_free(l2_tables);
+
+    if (nb_tables == 0 || refcount_flush || l2_flush) {
+        /* Guest data that the new tables point to must be stable first */
+        ret = bdrv_flush(bs->file);
+        if (ret < 0 || nb_tables == 0) {
+            goto out;
+        }
+    }
+
+    for (first = 0; first < nb_tables; first = last) {
+        for (last = first + 1; last < nb_tables; last++) {
+            if (qcow2_journal_txn_len(tables + first, last + 1 - first) >
+                s->journal_size)
+            {
+                break;
+            }
+        }
+
+        ret = qcow2_journal_commit_txn(bs, tables + first, last - first);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    qcow2_cache_mark_clean(s->refcount_block_cache);
+    qcow2_cache_mark_clean(s->l2_table_cache);
+    ret = 0;
+
+out:
+    g_free(tables);
+    return ret;
+}
+
+/*
+ * Makes sure that nothing in the journal will be replayed, so that the
+ * tables it holds may be changed or freed outside of it.
+ */
+int qcow2_journal_checkpoint(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (!s->journal_offset || g_tree_nnodes(s->journal_clusters) == 0) {
+        return 0;
+    }
+
+    trace_qcow2_journal_checkpoint(bs, s->journal_seq);
+
+    /* Tables of the journal must be stable in place before it is reset */
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->journal_pos = 0;
+    ret = qcow2_journal_write_txn(bs, NULL, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qcow2_journal_reset_clusters(s);
+    return 0;
+}
+
+/*
+ * Called when the refcount of a cluster drops to zero.  If the journal has
+ * a table for that cluster, replaying it after the cluster is reused would
+ * destroy the new contents, so the journal must be checkpointed.
+ */
+int qcow2_journal_cluster_freed(BlockDriverState *bs, int64_t cluster_index)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (!s->journal_offset ||
+        !g_tree_lookup(s->journal_clusters, &cluster_index))
+    {
+        return 0;
+    }
+
+    return qcow2_journal_checkpoint(bs);
+}
+
+/*
+ * Reads and checks the transaction at @pos.  Returns the number of bytes
+ * it takes, 0 if there is no valid transaction or -errno on I/O errors.
+ * The transaction is returned in a newly allocated *@buf.
+ */
+static int64_t qcow2_journal_read_txn(BlockDriverState *bs, uint64_t pos,
+                                      Qcow2JournalHeader **buf)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2JournalHeader hdr;
+    Qcow2JournalDesc *desc;
+    uint64_t len, tables_len;
+    uint32_t crc;
+    int i, ret;
+
+    *buf = NULL;
+    if (pos + BDRV_SECTOR_SIZE > s->journal_size) {
+        return 0;
+    }
+
+    ret = bdrv_pread(bs->file, s->journal_offset + pos, &hdr, sizeof(hdr));
+    if (ret < 0) {
+        return ret;
+    }
+
+    len = be32_to_cpu(hdr.length);
+    if (be32_to_cpu(hdr.magic) != QCOW2_JOURNAL_MAGIC ||
+        be32_to_cpu(hdr.nb_tables) > s->journal_size / BDRV_SECTOR_SIZE ||
+        len < qcow2_journal_header_len(be32_to_cpu(hdr.nb_tables)) ||
+        len % BDRV_SECTOR_SIZE || pos + len > s->journal_size)
+    {
+        return 0;
+    }
+
+    *buf = qemu_blockalign(bs, len);
+    ret = bdrv_pread(bs->file, s->journal_offset + pos, *buf, len);
+    if (ret < 0) {
+        return ret;
+    }
+
+    (*buf)->crc = 0;
+    crc = crc32c(0xffffffff, (uint8_t *)*buf, len);
+    if (crc != be32_to_cpu(hdr.crc)) {
+        return 0;
+    }
+
+    /* The tables must exactly fill the transaction */
+    desc = (Qcow2JournalDesc *)(*buf + 1);
+    tables_len = 0;
+    for (i = 0; i < be32_to_cpu(hdr.nb_tables); i++) {
+        uint32_t size = be32_to_cpu(desc[i].size);
+
+        if (size < BDRV_SECTOR_SIZE || size > s->cluster_size ||
+            !is_power_of_2(size) ||
+            be64_to_cpu(desc[i].offset) % size)
+        {
+            return 0;
+        }
+        tables_len += size;
+    }
+    if (qcow2_journal_header_len(be32_to_cpu(hdr.nb_tables)) + tables_len
+        != len)
+    {
+        return 0;
+    }
+
+    **buf = hdr;
+    return len;
+}
+
+/*
+ * Replays the journal of an image that was not closed cleanly and prepares
+ * it for new transactions.
+ */
+int qcow2_journal_open(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2JournalHeader *txn;
+    uint64_t pos = 0, seq = 0;
+    bool found = false, replayed = false;
+    int64_t len;
+    int ret;
+
+    if (!s->journal_offset) {
+        if (s->incompatible_features & QCOW2_INCOMPAT_JOURNAL) {
+            error_setg(errp, "Image needs its metadata journal replayed, but "
+                       "has none");
+            return -EINVAL;
+        }
+        return 0;
+    }
+
+    if (s->qcow_version < 3 ||
+        offset_into_cluster(s, s->journal_offset) ||
+        s->journal_size < s->cluster_size + BDRV_SECTOR_SIZE ||
+        s->journal_size > QCOW_MAX_JOURNAL_SIZE ||
+        offset_into_cluster(s, s->journal_size))
+    {
+        error_setg(errp, "Invalid metadata journal");
+        return -EINVAL;
+    }
+
+    qcow2_journal_reset_clusters(s);
+
+    /* Replay the transactions that follow each other from the start */
+    while ((len = qcow2_journal_read_txn(bs, pos, &txn)) > 0) {
+        Qcow2JournalDesc *desc = (Qcow2JournalDesc *)(txn + 1);
+        uint8_t *data = (uint8_t *)txn +
+            qcow2_journal_header_len(be32_to_cpu(txn->nb_tables));
+        int i;
+
+        /* A number at or above the limit was never used */
+        if ((found && be64_to_cpu(txn->seq) != seq + 1) ||
+            be64_to_cpu(txn->seq) >= s->journal_seq_limit)
+        {
+            break;
+        }
+        seq = be64_to_cpu(txn->seq);
+        found = true;
+
+        trace_qcow2_journal_replay(bs, seq, be32_to_cpu(txn->nb_tables));
+        if (txn->nb_tables && bs->read_only) {
+            error_setg(errp, "Image has metadata updates in its journal, open "
+                       "it read-write once to replay them");
+            ret = -EACCES;
+            goto fail;
+        }
+
+        for (i = 0; i < be32_to_cpu(txn->nb_tables); i++) {
+            uint32_t size = be32_to_cpu(desc[i].size);
+
+            ret = bdrv_pwrite(bs->file, be64_to_cpu(desc[i].offset), data,
+                              size);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Could not replay metadata "
+                                 "journal");
+                goto fail;
+            }
+            data += size;
+            replayed = true;
+        }
+
+        qemu_vfree(txn);
+        pos += len;
+    }
+    qemu_vfree(txn);
+    txn = NULL;
+    if (len < 0) {
+        ret = len;
+        error_setg_errno(errp, -ret, "Could not read metadata journal");
+        goto fail;
+    }
+
+    /* Transactions of earlier sessions may lie behind the ones replayed,
+     * with any number below the limit */
+    s->journal_seq = s->journal_seq_limit;
+    s->journal_pos = 0;
+
+    if (bs->read_only) {
+        return 0;
+    }
+
+    if (replayed) {
+        ret = bdrv_flush(bs->file);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not replay metadata journal");
+            goto fail;
+        }
+    }
+
+    /* Start over with a checkpoint so that nothing is replayed twice */
+    ret = qcow2_journal_write_txn(bs, NULL, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write metadata journal");
+        goto fail;
+    }
+
+    /* Keep versions that don't know about the journal away while it is
+     * in use */
+    if (!(s->incompatible_features & QCOW2_INCOMPAT_JOURNAL)) {
+        s->incompatible_features |= QCOW2_INCOMPAT_JOURNAL;
+        ret = qcow2_update_header(bs);
+        if (ret >= 0) {
+            ret = bdrv_flush(bs->file);
+        }
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not update qcow2 header");
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    qemu_vfree(txn);
+    g_tree_destroy(s->journal_clusters);
+    s->journal_clusters = NULL;
+    s->journal_offset = 0;
+    return ret;
+}
+
+/*
+ * Leaves an empty journal behind and clears the journal bit.  The caches
+ * must have been flushed.
+ */
+int qcow2_journal_close(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret = 0;
+
+    if (!s->journal_offset) {
+        return 0;
+    }
+
+    if (s->incompatible_features & QCOW2_INCOMPAT_JOURNAL) {
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret >= 0) {
+            s->incompatible_features &= ~QCOW2_INCOMPAT_JOURNAL;
+            ret = qcow2_update_header(bs);
+        }
+    }
+
+    g_tree_destroy(s->journal_clusters);
+    s->journal_clusters = NULL;
+    return ret;
+}
+
+/*
+ * Adds a metadata journal of @size bytes to a newly created image.
+ */
+int qcow2_journal_create(BlockDriverState *bs, uint64_t size)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t offset;
+    int ret;
+
+    assert(s->qcow_version >= 3 && !s->journal_offset);
+
+    size = align_offset(size, s->cluster_size);
+    if (size < s->cluster_size + BDRV_SECTOR_SIZE) {
+        size = 2 * s->cluster_size;
+    }
+    if (size > QCOW_MAX_JOURNAL_SIZE) {
+        return -EINVAL;
+    }
+
+    offset = qcow2_alloc_clusters(bs, size);
+    if (offset < 0) {
+        return offset;
+    }
+
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_write_zeroes(bs->file, offset >> BDRV_SECTOR_BITS,
+                            size >> BDRV_SECTOR_BITS, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->journal_offset = offset;
+    s->journal_size = size;
+    s->autoclear_features |= QCOW2_AUTOCLEAR_JOURNAL;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->journal_offset = 0;
+        s->journal_size = 0;
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_JOURNAL;
+        goto fail;
+    }
+
+    return qcow2_journal_open(bs, NULL);
+
+fail:
+    qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_ALWAYS);
+    return ret;
+}
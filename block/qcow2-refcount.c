@@ -27,6 +27,7 @@
 #include "block/qcow2.h"
 #include "qemu/range.h"
 #include "qapi/qmp/types.h"
+#include "trace.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, int64_t size);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
@@ -554,6 +555,13 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
             ret = -EINVAL;
             goto fail;
         }
+        /* The cluster may be reused, its old contents must not be replayed */
+        if (refcount == 0) {
+            ret = qcow2_journal_cluster_freed(bs, cluster_index);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
         if (refcount == 0 && cluster_index < s->free_cluster_index) {
             s->free_cluster_index = cluster_index;
         }
@@ -705,6 +713,133 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+/*
+ * The cluster pool holds clusters that are allocated and zeroed in the
+ * background, so that allocating writes neither wait for refcount updates
+ * nor need to copy COW areas that read as zeroes. Pool clusters that are
+ * still unused when qemu exits without closing the image are leaked.
+ */
+static void coroutine_fn qcow2_cluster_pool_refill(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcowState *s = bs->opaque;
+
+    while (!s->cluster_pool_stop &&
+           s->cluster_pool_clusters < s->cluster_pool_size)
+    {
+        int nb_clusters = s->cluster_pool_size - s->cluster_pool_clusters;
+        int64_t size = (int64_t)nb_clusters << s->cluster_bits;
+        int64_t offset, file_end;
+        Qcow2PoolExtent *ext;
+        int ret;
+
+        qemu_co_mutex_lock(&s->lock);
+        file_end = bdrv_getlength(bs->file);
+        offset = qcow2_alloc_clusters(bs, size);
+        qemu_co_mutex_unlock(&s->lock);
+        if (file_end < 0 || offset < 0) {
+            break;
+        }
+
+        trace_qcow2_cluster_pool_refill(bs, offset, nb_clusters);
+
+        /* Clusters beyond the end of the file read as zeroes already */
+        if (offset < file_end) {
+            int64_t zero_bytes = MIN(size, file_end - offset);
+
+            ret = bdrv_co_write_zeroes(bs->file, offset >> BDRV_SECTOR_BITS,
+                                       DIV_ROUND_UP(zero_bytes,
+                                                    BDRV_SECTOR_SIZE),
+                                       BDRV_REQ_MAY_UNMAP);
+            if (ret >= 0) {
+                /* L2 tables may point to the clusters without a flush */
+                ret = bdrv_co_flush(bs->file);
+            }
+            if (ret < 0) {
+                qemu_co_mutex_lock(&s->lock);
+                qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_NEVER);
+                qemu_co_mutex_unlock(&s->lock);
+                break;
+            }
+        }
+
+        ext = g_malloc(sizeof(*ext));
+        ext->offset = offset;
+        ext->nb_clusters = nb_clusters;
+        QTAILQ_INSERT_TAIL(&s->cluster_pool, ext, next);
+        s->cluster_pool_clusters += nb_clusters;
+    }
+
+    s->cluster_pool_co = NULL;
+}
+
+/*
+ * Takes up to *nb_clusters contiguous clusters from the pool, starting at
+ * host_offset unless it is 0. Returns the offset of the first one and
+ * updates *nb_clusters, or returns 0 if the pool can't provide them.
+ */
+int64_t qcow2_cluster_pool_get(BlockDriverState *bs, uint64_t host_offset,
+                               unsigned int *nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2PoolExtent *ext = QTAILQ_FIRST(&s->cluster_pool);
+    int64_t offset = 0;
+    unsigned int n;
+
+    if (!s->cluster_pool_size) {
+        return 0;
+    }
+
+    if (ext && (!host_offset || host_offset == ext->offset)) {
+        n = MIN(*nb_clusters, ext->nb_clusters);
+        offset = ext->offset;
+
+        ext->offset += (uint64_t)n << s->cluster_bits;
+        ext->nb_clusters -= n;
+        if (ext->nb_clusters == 0) {
+            QTAILQ_REMOVE(&s->cluster_pool, ext, next);
+            g_free(ext);
+        }
+        s->cluster_pool_clusters -= n;
+        *nb_clusters = n;
+    }
+
+    /* Refill once half of the pool is used up */
+    if (!s->cluster_pool_co && !s->cluster_pool_stop &&
+        s->cluster_pool_clusters <= s->cluster_pool_size / 2)
+    {
+        s->cluster_pool_co = qemu_coroutine_create(qcow2_cluster_pool_refill);
+        qemu_coroutine_enter(s->cluster_pool_co, bs);
+    }
+
+    return offset;
+}
+
+/*
+ * Stops refilling and frees all clusters in the pool. The pool is refilled
+ * on the next allocation.
+ */
+void qcow2_cluster_pool_release(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2PoolExtent *ext, *next;
+
+    s->cluster_pool_stop = true;
+    while (s->cluster_pool_co) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+
+    QTAILQ_FOREACH_SAFE(ext, &s->cluster_pool, next, next) {
+        QTAILQ_REMOVE(&s->cluster_pool, ext, next);
+        qcow2_free_clusters(bs, ext->offset,
+                            (int64_t)ext->nb_clusters << s->cluster_bits,
+                            QCOW2_DISCARD_NEVER);
+        g_free(ext);
+    }
+    s->cluster_pool_clusters = 0;
+    s->cluster_pool_stop = false;
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -817,16 +952,142 @@ void qcow2_free_any_clusters(BlockDriverState *bs, uint64_t l2_entry,
 
 
 /* update the refcounts of snapshots and the copied flag */
+/*
+ * Changes the refcounts for the L2 table that *l1_entry points to by
+ * addend, like qcow2_update_snapshot_refcount() does for all tables of an
+ * L1 table.  flags says whether the clusters referenced by the table
+ * (QCOW2_REF_L2_DATA), the table itself (QCOW2_REF_L2_TABLE) or both are
+ * updated.  QCOW_OFLAG_COPIED is fixed up in the L2 entries, and in *l1_entry
+ * with QCOW2_REF_L2_TABLE; writing out *l1_entry is up to the caller.
+ */
+int qcow2_update_l2_refcount(BlockDriverState *bs, uint64_t *l1_entry,
+                             int addend, int flags)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *l2_table = NULL, l2_offset, offset;
+    int64_t old_offset;
+    int slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    int n_slices = s->cluster_size / slice_size2;
+    int j, slice, nb_csectors, refcount;
+    int ret;
+
+    l2_offset = *l1_entry & L1E_OFFSET_MASK;
+    if (!l2_offset) {
+        return 0;
+    }
+
+    for (slice = 0; (flags & QCOW2_REF_L2_DATA) && slice < n_slices; slice++) {
+        ret = qcow2_cache_get(bs, s->l2_table_cache,
+            l2_offset + slice * slice_size2, (void**) &l2_table);
+        if (ret < 0) {
+            return ret;
+        }
+
+        for (j = 0; j < s->l2_slice_size; j++) {
+            uint64_t cluster_index;
+
+            offset = be64_to_cpu(l2_table[j]);
+            old_offset = offset;
+            offset &= ~QCOW_OFLAG_COPIED;
+
+            switch (qcow2_get_cluster_type(offset)) {
+                case QCOW2_CLUSTER_COMPRESSED:
+                    nb_csectors = ((offset >> s->csize_shift) &
+                                   s->csize_mask) + 1;
+                    if (addend != 0) {
+                        ret = update_refcount(bs,
+                            (offset & s->cluster_offset_mask) & ~511,
+                            nb_csectors * 512, addend,
+                            QCOW2_DISCARD_SNAPSHOT);
+                        if (ret < 0) {
+                            goto fail;
+                        }
+                    }
+                    /* compressed clusters are never modified */
+                    refcount = 2;
+                    break;
+
+                case QCOW2_CLUSTER_NORMAL:
+                case QCOW2_CLUSTER_ZERO:
+                    cluster_index = (offset & L2E_OFFSET_MASK) >>
+                                    s->cluster_bits;
+                    if (!cluster_index) {
+                        /* unallocated */
+                        refcount = 0;
+                        break;
+                    }
+                    if (addend != 0) {
+                        refcount = qcow2_update_cluster_refcount(bs,
+                                cluster_index, addend,
+                                QCOW2_DISCARD_SNAPSHOT);
+                    } else {
+                        refcount = get_refcount(bs, cluster_index);
+                    }
+
+                    if (refcount < 0) {
+                        ret = refcount;
+                        goto fail;
+                    }
+                    break;
+
+                case QCOW2_CLUSTER_UNALLOCATED:
+                    refcount = 0;
+                    break;
+
+                default:
+                    abort();
+            }
+
+            if (refcount == 1) {
+                offset |= QCOW_OFLAG_COPIED;
+            }
+            if (offset != old_offset) {
+                if (addend > 0) {
+                    qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                        s->refcount_block_cache);
+                }
+                l2_table[j] = cpu_to_be64(offset);
+                qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
+            }
+        }
+
+        ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (flags & QCOW2_REF_L2_TABLE) {
+        if (addend != 0) {
+            refcount = qcow2_update_cluster_refcount(bs, l2_offset >>
+                    s->cluster_bits, addend, QCOW2_DISCARD_SNAPSHOT);
+        } else {
+            refcount = get_refcount(bs, l2_offset >> s->cluster_bits);
+        }
+        if (refcount < 0) {
+            return refcount;
+        }
+        if (refcount == 1) {
+            *l1_entry |= QCOW_OFLAG_COPIED;
+        } else {
+            *l1_entry &= ~QCOW_OFLAG_COPIED;
+        }
+    }
+    return 0;
+
+fail:
+    qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    return ret;
+}
+
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2, l1_allocated;
-    int64_t old_offset, old_l2_offset;
-    int i, j, l1_modified = 0, nb_csectors, refcount;
+    uint64_t *l1_table, l1_size2, l1_allocated, old_l1_entry;
+    int i, l1_modified = 0;
     int ret;
 
-    l2_table = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
 
@@ -853,115 +1114,19 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     }
 
     for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
-            old_l2_offset = l2_offset;
-            l2_offset &= L1E_OFFSET_MASK;
-
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
-
-            for(j = 0; j < s->l2_size; j++) {
-                uint64_t cluster_index;
-
-                offset = be64_to_cpu(l2_table[j]);
-                old_offset = offset;
-                offset &= ~QCOW_OFLAG_COPIED;
-
-                switch (qcow2_get_cluster_type(offset)) {
-                    case QCOW2_CLUSTER_COMPRESSED:
-                        nb_csectors = ((offset >> s->csize_shift) &
-                                       s->csize_mask) + 1;
-                        if (addend != 0) {
-                            ret = update_refcount(bs,
-                                (offset & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, addend,
-                                QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
-                                goto fail;
-                            }
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                        break;
-
-                    case QCOW2_CLUSTER_NORMAL:
-                    case QCOW2_CLUSTER_ZERO:
-                        cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
-                        if (!cluster_index) {
-                            /* unallocated */
-                            refcount = 0;
-                            break;
-                        }
-                        if (addend != 0) {
-                            refcount = qcow2_update_cluster_refcount(bs,
-                                    cluster_index, addend,
-                                    QCOW2_DISCARD_SNAPSHOT);
-                        } else {
-                            refcount = get_refcount(bs, cluster_index);
-                        }
-
-                        if (refcount < 0) {
-                            ret = refcount;
-                            goto fail;
-                        }
-                        break;
-
-                    case QCOW2_CLUSTER_UNALLOCATED:
-                        refcount = 0;
-                        break;
-
-                    default:
-                        abort();
-                }
-
-                if (refcount == 1) {
-                    offset |= QCOW_OFLAG_COPIED;
-                }
-                if (offset != old_offset) {
-                    if (addend > 0) {
-                        qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                            s->refcount_block_cache);
-                    }
-                    l2_table[j] = cpu_to_be64(offset);
-                    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-                }
-            }
-
-            ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
-
-
-            if (addend != 0) {
-                refcount = qcow2_update_cluster_refcount(bs, l2_offset >>
-                        s->cluster_bits, addend, QCOW2_DISCARD_SNAPSHOT);
-            } else {
-                refcount = get_refcount(bs, l2_offset >> s->cluster_bits);
-            }
-            if (refcount < 0) {
-                ret = refcount;
-                goto fail;
-            } else if (refcount == 1) {
-                l2_offset |= QCOW_OFLAG_COPIED;
-            }
-            if (l2_offset != old_l2_offset) {
-                l1_table[i] = l2_offset;
-                l1_modified = 1;
-            }
+        old_l1_entry = l1_table[i];
+        ret = qcow2_update_l2_refcount(bs, &l1_table[i], addend,
+                                       QCOW2_REF_L2_DATA | QCOW2_REF_L2_TABLE);
+        if (ret < 0) {
+            goto fail;
+        }
+        if (l1_table[i] != old_l1_entry) {
+            l1_modified = 1;
         }
     }
 
     ret = bdrv_flush(bs);
 fail:
-    if (l2_table) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
-    }
-
     s->cache_discards = false;
     qcow2_process_discards(bs, ret);
 
@@ -1039,29 +1204,80 @@ enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
 };
 
+/* Number of L2 tables that check_refcounts_l1() reads in parallel */
+#define QCOW2_CHECK_READAHEAD 16
+
+typedef struct Qcow2CheckRead {
+    int64_t l2_offset;
+    uint64_t *l2_table;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int ret;
+} Qcow2CheckRead;
+
+static void check_read_l2_cb(void *opaque, int ret)
+{
+    Qcow2CheckRead *r = opaque;
+
+    r->ret = ret;
+}
+
+/*
+ * Reads the L2 tables for the n entries of reads, keeping all the reads in
+ * flight at the same time.  Outside of coroutine context this hides the
+ * latency of the image file, which dominates checks of large images.
+ */
+static void check_read_l2_tables(BlockDriverState *bs, Qcow2CheckRead *reads,
+                                 int n)
+{
+    BDRVQcowState *s = bs->opaque;
+    BlockDriverAIOCB *acb;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        Qcow2CheckRead *r = &reads[i];
+
+        r->ret = -EINPROGRESS;
+        if (qemu_in_coroutine() || (r->l2_offset & (BDRV_SECTOR_SIZE - 1))) {
+            r->ret = bdrv_pread(bs->file, r->l2_offset, r->l2_table,
+                                s->cluster_size);
+            if (r->ret >= 0 && r->ret != s->cluster_size) {
+                r->ret = -EIO;
+            }
+            continue;
+        }
+
+        r->iov.iov_base = r->l2_table;
+        r->iov.iov_len = s->cluster_size;
+        qemu_iovec_init_external(&r->qiov, &r->iov, 1);
+        acb = bdrv_aio_readv(bs->file, r->l2_offset >> BDRV_SECTOR_BITS,
+                             &r->qiov, s->cluster_size >> BDRV_SECTOR_BITS,
+                             check_read_l2_cb, r);
+        if (!acb) {
+            r->ret = -EIO;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        while (reads[i].ret == -EINPROGRESS) {
+            aio_poll(bdrv_get_aio_context(bs), true);
+        }
+    }
+}
+
 /*
  * Increases the refcount in the given refcount table for the all clusters
  * referenced in the L2 table. While doing so, performs some checks on L2
  * entries.
- *
- * Returns the number of errors found by the checks or -errno if an internal
- * error occurred.
  */
-static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
-    uint16_t *refcount_table, int refcount_table_size, int64_t l2_offset,
-    int flags)
+static void check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
+    uint16_t *refcount_table, int refcount_table_size,
+    const uint64_t *l2_table, int flags)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t l2_entry;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
-
-    if (bdrv_pread(bs->file, l2_offset, l2_table, l2_size) != l2_size)
-        goto fail;
+    int i, nb_csectors;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
@@ -1137,20 +1353,13 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             abort();
         }
     }
-
-    g_free(l2_table);
-    return 0;
-
-fail:
-    fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-    g_free(l2_table);
-    return -EIO;
 }
 
 /*
  * Increases the refcount for the L1 table, its L2 tables and all referenced
  * clusters in the given refcount table. While doing so, performs some checks
- * on L1 and L2 entries.
+ * on L1 and L2 entries.  progress is the share of the whole check, in
+ * percent, that one L1 entry stands for.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
@@ -1160,11 +1369,13 @@ static int check_refcounts_l1(BlockDriverState *bs,
                               uint16_t *refcount_table,
                               int refcount_table_size,
                               int64_t l1_table_offset, int l1_size,
-                              int flags)
+                              int flags, float progress)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t *l1_table, l2_offset, l1_size2;
-    int i, ret;
+    Qcow2CheckRead reads[QCOW2_CHECK_READAHEAD];
+    uint8_t *l2_buf = NULL;
+    int i, j, n, next;
 
     l1_size2 = l1_size * sizeof(uint64_t);
 
@@ -1184,12 +1395,26 @@ static int check_refcounts_l1(BlockDriverState *bs,
             be64_to_cpus(&l1_table[i]);
     }
 
-    /* Do the actual checks */
-    for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
+    if (l1_size) {
+        l2_buf = qemu_blockalign(bs, QCOW2_CHECK_READAHEAD * s->cluster_size);
+        for (j = 0; j < QCOW2_CHECK_READAHEAD; j++) {
+            reads[j].l2_table = (uint64_t *)(l2_buf + j * s->cluster_size);
+        }
+    }
+
+    /* Do the actual checks, reading the L2 tables in batches */
+    for (i = 0; i < l1_size; i = next) {
+        n = 0;
+        for (next = i; next < l1_size && n < QCOW2_CHECK_READAHEAD; next++) {
+            if (l1_table[next]) {
+                reads[n++].l2_offset = l1_table[next] & L1E_OFFSET_MASK;
+            }
+        }
+        check_read_l2_tables(bs, reads, n);
+
+        for (j = 0; j < n; j++) {
             /* Mark L2 table as used */
-            l2_offset &= L1E_OFFSET_MASK;
+            l2_offset = reads[j].l2_offset;
             inc_refcounts(bs, res, refcount_table, refcount_table_size,
                 l2_offset, s->cluster_size);
 
@@ -1201,19 +1426,23 @@ static int check_refcounts_l1(BlockDriverState *bs,
             }
 
             /* Process and check L2 entries */
-            ret = check_refcounts_l2(bs, res, refcount_table,
-                                     refcount_table_size, l2_offset, flags);
-            if (ret < 0) {
+            if (reads[j].ret < 0) {
+                fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
                 goto fail;
             }
+            check_refcounts_l2(bs, res, refcount_table, refcount_table_size,
+                               reads[j].l2_table, flags);
         }
+        qemu_progress_print((next - i) * progress, 100);
     }
+    qemu_vfree(l2_buf);
     g_free(l1_table);
     return 0;
 
 fail:
     fprintf(stderr, "ERROR: I/O error in check_refcounts_l1\n");
     res->check_errors++;
+    qemu_vfree(l2_buf);
     g_free(l1_table);
     return -EIO;
 }
@@ -1464,8 +1693,18 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     int nb_clusters, refcount1, refcount2;
     QCowSnapshot *sn;
     uint16_t *refcount_table;
+    int64_t l1_entries;
+    float progress;
     int ret;
 
+    /* Repairs write metadata directly, which the journal must not undo */
+    if (fix) {
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     size = bdrv_getlength(bs->file);
     nb_clusters = size_to_clusters(s, size);
     refcount_table = g_malloc0(nb_clusters * sizeof(uint16_t));
@@ -1477,9 +1716,23 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         0, s->cluster_size);
 
+    /* metadata journal */
+    if (s->journal_offset) {
+        inc_refcounts(bs, res, refcount_table, nb_clusters,
+            s->journal_offset, s->journal_size);
+    }
+
+    /* Progress is reported per L1 entry, over all the L1 tables */
+    l1_entries = s->l1_size;
+    for (i = 0; i < s->nb_snapshots; i++) {
+        l1_entries += s->snapshots[i].l1_size;
+    }
+    progress = l1_entries ? 100.0 / l1_entries : 0;
+
     /* current L1 table */
     ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
-                             s->l1_table_offset, s->l1_size, CHECK_FRAG_INFO);
+                             s->l1_table_offset, s->l1_size, CHECK_FRAG_INFO,
+                             progress);
     if (ret < 0) {
         goto fail;
     }
@@ -1488,7 +1741,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     for(i = 0; i < s->nb_snapshots; i++) {
         sn = s->snapshots + i;
         ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
-            sn->l1_table_offset, sn->l1_size, 0);
+            sn->l1_table_offset, sn->l1_size, 0, progress);
         if (ret < 0) {
             goto fail;
         }
@@ -25,6 +25,8 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "block/qcow2.h"
+#include "qemu/bitmap.h"
+#include "qemu/error-report.h"
 
 typedef struct QEMU_PACKED QCowSnapshotHeader {
     /* header is 8 byte aligned */
@@ -346,6 +348,295 @@ static int find_snapshot_by_id_or_name(BlockDriverState *bs,
     return find_snapshot_by_id_and_name(bs, NULL, id_or_name);
 }
 
+/*
+ * Deferred refcount updates
+ *
+ * Creating or deleting an internal snapshot changes the refcount of every
+ * cluster that the snapshot references, which takes time proportional to
+ * the image size.  Only what is needed for a consistent view is done while
+ * the snapshot operation runs; a coroutine takes care of the rest, one L2
+ * table at a time, while the guest keeps running.
+ *
+ * After creation, the L2 tables have their new refcounts and the active L1
+ * table has QCOW_OFLAG_COPIED cleared, so that any change to a table first
+ * copies it in l2_allocate().  The clusters that a table points to get
+ * their new refcount before that copy (qcow2_snapshot_settle_l2()), or when
+ * the coroutine reaches it.  Until then, refcounts on disk are too low, so
+ * the image is marked dirty and repaired on open after a crash.  This needs
+ * a version 3 image; version 2 images are updated synchronously.
+ *
+ * After deletion, refcounts on disk are only too high until the coroutine
+ * has dropped the snapshot's references, so a crash at worst leaks
+ * clusters.  QCOW_OFLAG_COPIED is restored in the active tables last.
+ *
+ * There is at most one job; snapshot operations and qcow2_check() first
+ * wait for the previous one with qcow2_refcount_job_finish().
+ */
+
+static void qcow2_refcount_job_free(Qcow2RefcountJob *job)
+{
+    g_free(job->l1_table);
+    g_free(job->pending);
+    g_free(job);
+}
+
+/*
+ * Processes the L2 table of the job's L1 entry i, if that is still pending.
+ * Called with s->lock held, or outside of coroutine context.
+ *
+ * Returns 1 if a table was processed, 0 if there was nothing to do and < 0
+ * on error.
+ */
+static int qcow2_refcount_job_step(BlockDriverState *bs,
+                                   Qcow2RefcountJob *job, int i)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l1_entry = job->l1_table[i];
+    int ret;
+
+    if (!test_bit(i, job->pending)) {
+        return 0;
+    }
+
+    s->cache_discards = true;
+    if (job->addend > 0) {
+        /* The L2 table itself was taken care of at creation time */
+        ret = qcow2_update_l2_refcount(bs, &l1_entry, 1, QCOW2_REF_L2_DATA);
+    } else {
+        ret = qcow2_update_l2_refcount(bs, &l1_entry, -1,
+                                       QCOW2_REF_L2_DATA | QCOW2_REF_L2_TABLE);
+    }
+    s->cache_discards = false;
+    qcow2_process_discards(bs, ret);
+    if (ret < 0) {
+        return ret;
+    }
+
+    clear_bit(i, job->pending);
+    return 1;
+}
+
+/*
+ * Updates QCOW_OFLAG_COPIED for the active L1 entry i and its L2 table.
+ * Returns 1 if there was a table, 0 if not and < 0 on error.
+ */
+static int qcow2_refcount_job_copied(BlockDriverState *bs, int i)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l1_entry;
+    int ret;
+
+    if (i >= s->l1_size || !(s->l1_table[i] & L1E_OFFSET_MASK)) {
+        return 0;
+    }
+
+    l1_entry = s->l1_table[i];
+    ret = qcow2_update_l2_refcount(bs, &l1_entry, 0,
+                                   QCOW2_REF_L2_DATA | QCOW2_REF_L2_TABLE);
+    if (ret < 0) {
+        return ret;
+    }
+    if (l1_entry != s->l1_table[i]) {
+        s->l1_table[i] = l1_entry;
+        ret = qcow2_write_l1_entry(bs, i);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 1;
+}
+
+static int qcow2_refcount_job_done(BlockDriverState *bs, bool mark_clean)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_flush(bs);
+    if (ret >= 0 && mark_clean && !s->use_lazy_refcounts) {
+        ret = qcow2_mark_clean(bs);
+    }
+
+    qcow2_refcount_job_free(s->refcount_job);
+    s->refcount_job = NULL;
+    return ret;
+}
+
+static void coroutine_fn qcow2_refcount_job_co(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcowState *s = bs->opaque;
+    Qcow2RefcountJob *job = s->refcount_job;
+    AioContext *ctx = bdrv_get_aio_context(bs);
+    int i, ret = 0;
+
+    for (i = 0; ret >= 0 && i < job->l1_size; i++) {
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_refcount_job_step(bs, job, i);
+        qemu_co_mutex_unlock(&s->lock);
+
+        /* Let guest requests that wait for the lock go first */
+        if (ret > 0) {
+            co_aio_sleep_ns(ctx, QEMU_CLOCK_REALTIME, 0);
+        }
+    }
+
+    if (ret >= 0 && job->addend < 0) {
+        qemu_co_mutex_lock(&s->lock);
+        qcow2_free_clusters(bs, job->l1_table_offset,
+                            job->l1_size * sizeof(uint64_t),
+                            QCOW2_DISCARD_SNAPSHOT);
+        qemu_co_mutex_unlock(&s->lock);
+
+        for (i = 0; ret >= 0 && i < s->l1_size; i++) {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_refcount_job_copied(bs, i);
+            qemu_co_mutex_unlock(&s->lock);
+            if (ret > 0) {
+                co_aio_sleep_ns(ctx, QEMU_CLOCK_REALTIME, 0);
+            }
+        }
+    }
+
+    job->co = NULL;
+
+    if (ret < 0) {
+        error_report("qcow2: Could not update snapshot refcounts: %s",
+                     strerror(-ret));
+        /* Tables of a new snapshot still need their refcounts before they
+         * are copied, so that job stays around and is retried by
+         * qcow2_refcount_job_finish().  A deletion only leaks clusters.
+         */
+        if (job->addend > 0) {
+            return;
+        }
+    }
+    qcow2_refcount_job_done(bs, job->addend > 0);
+}
+
+static void qcow2_refcount_job_start(BlockDriverState *bs,
+                                     Qcow2RefcountJob *job)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    assert(!s->refcount_job);
+    s->refcount_job = job;
+    job->co = qemu_coroutine_create(qcow2_refcount_job_co);
+    qemu_coroutine_enter(job->co, bs);
+}
+
+/*
+ * Waits for the deferred refcount update to complete, or completes it
+ * synchronously if the coroutine failed.
+ */
+int qcow2_refcount_job_finish(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2RefcountJob *job;
+    int i, ret;
+
+    assert(!qemu_in_coroutine());
+    while (s->refcount_job && s->refcount_job->co) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+
+    job = s->refcount_job;
+    if (!job) {
+        return 0;
+    }
+    for (i = 0; i < job->l1_size; i++) {
+        ret = qcow2_refcount_job_step(bs, job, i);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return qcow2_refcount_job_done(bs, true);
+}
+
+/*
+ * Called before the L2 table of active L1 entry l1_index is copied: if it
+ * belongs to a new snapshot whose refcounts are still deferred, the
+ * clusters it points to must get their refcount first.
+ */
+int qcow2_snapshot_settle_l2(BlockDriverState *bs, int l1_index)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2RefcountJob *job = s->refcount_job;
+
+    if (!job || job->addend < 0 || l1_index >= job->l1_size) {
+        return 0;
+    }
+    return qcow2_refcount_job_step(bs, job, l1_index);
+}
+
+/*
+ * Increases the refcounts of the active L2 tables for a new snapshot and
+ * clears QCOW_OFLAG_COPIED in the active L1 table.  Returns a job for the
+ * refcounts of the data clusters, which must be started once the snapshot
+ * is in the snapshot table.
+ */
+static int qcow2_snapshot_defer_refcount(BlockDriverState *bs,
+                                         int64_t sn_l1_table_offset,
+                                         Qcow2RefcountJob **pjob)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2RefcountJob *job;
+    int i, ret;
+
+    /* Refcounts are too low until the job is done */
+    ret = qcow2_mark_dirty(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    job = g_new0(Qcow2RefcountJob, 1);
+    job->addend = 1;
+    job->l1_table_offset = sn_l1_table_offset;
+    job->l1_size = s->l1_size;
+    job->l1_table = g_memdup(s->l1_table, s->l1_size * sizeof(uint64_t));
+    job->pending = bitmap_new(s->l1_size);
+
+    for (i = 0; i < s->l1_size; i++) {
+        if (!(s->l1_table[i] & L1E_OFFSET_MASK)) {
+            continue;
+        }
+        ret = qcow2_update_l2_refcount(bs, &s->l1_table[i], 1,
+                                       QCOW2_REF_L2_TABLE);
+        if (ret < 0) {
+            goto fail;
+        }
+        set_bit(i, job->pending);
+    }
+
+    ret = bdrv_flush(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L1,
+            s->l1_table_offset, s->l1_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto fail;
+    }
+    for (i = 0; i < s->l1_size; i++) {
+        cpu_to_be64s(&s->l1_table[i]);
+    }
+    ret = bdrv_pwrite_sync(bs->file, s->l1_table_offset, s->l1_table,
+                           s->l1_size * sizeof(uint64_t));
+    for (i = 0; i < s->l1_size; i++) {
+        be64_to_cpus(&s->l1_table[i]);
+    }
+    if (ret < 0) {
+        goto fail;
+    }
+
+    *pjob = job;
+    return 0;
+
+fail:
+    qcow2_refcount_job_free(job);
+    return ret;
+}
+
 /* if no id is provided, a new one is constructed */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
 {
@@ -353,10 +644,16 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     QCowSnapshot *new_snapshot_list = NULL;
     QCowSnapshot *old_snapshot_list = NULL;
     QCowSnapshot sn1, *sn = &sn1;
+    Qcow2RefcountJob *job = NULL;
     int i, ret;
     uint64_t *l1_table = NULL;
     int64_t l1_table_offset;
 
+    ret = qcow2_refcount_job_finish(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     memset(sn, 0, sizeof(*sn));
 
     /* Generate an ID if it wasn't passed */
@@ -412,9 +709,15 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     /*
      * Increase the refcounts of all clusters and make sure everything is
      * stable on disk before updating the snapshot table to contain a pointer
-     * to the new L1 table.
+     * to the new L1 table.  Version 3 images only do it for the L2 tables
+     * here and leave the rest to a background job.
      */
-    ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size, 1);
+    if (s->qcow_version >= 3) {
+        ret = qcow2_snapshot_defer_refcount(bs, sn->l1_table_offset, &job);
+    } else {
+        ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset,
+                                             s->l1_size, 1);
+    }
     if (ret < 0) {
         goto fail;
     }
@@ -439,6 +742,11 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
 
     g_free(old_snapshot_list);
 
+    if (job) {
+        qcow2_refcount_job_start(bs, job);
+        job = NULL;
+    }
+
     /* The VM state isn't needed any more in the active L1 table; in fact, it
      * hurts by causing expensive COW for the next snapshot. */
     qcow2_discard_clusters(bs, qcow2_vm_state_offset(s),
@@ -449,6 +757,7 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
 #ifdef DEBUG_ALLOC
     {
       BdrvCheckResult result = {0};
+      qcow2_refcount_job_finish(bs);
       qcow2_check_refcounts(bs, &result, 0);
     }
 #endif
@@ -458,6 +767,10 @@ fail:
     g_free(sn->id_str);
     g_free(sn->name);
     g_free(l1_table);
+    if (job) {
+        /* Without a snapshot to point to them, the L2 tables just leak */
+        qcow2_refcount_job_free(job);
+    }
 
     return ret;
 }
@@ -472,6 +785,11 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
     int ret;
     uint64_t *sn_l1_table = NULL;
 
+    ret = qcow2_refcount_job_finish(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* Search the snapshot */
     snapshot_index = find_snapshot_by_id_or_name(bs, snapshot_id);
     if (snapshot_index < 0) {
@@ -589,7 +907,15 @@ int qcow2_snapshot_delete(BlockDriverState *bs,
 {
     BDRVQcowState *s = bs->opaque;
     QCowSnapshot sn;
-    int snapshot_index, ret;
+    Qcow2RefcountJob *job;
+    int i, snapshot_index, ret;
+
+    ret = qcow2_refcount_job_finish(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not complete a previous snapshot "
+                         "operation");
+        return ret;
+    }
 
     /* Search the snapshot */
     snapshot_index = find_snapshot_by_id_and_name(bs, snapshot_id, name);
@@ -618,28 +944,36 @@ int qcow2_snapshot_delete(BlockDriverState *bs,
     g_free(sn.name);
 
     /*
-     * Now decrease the refcounts of clusters referenced by the snapshot and
-     * free the L1 table.
+     * Now decrease the refcounts of clusters referenced by the snapshot, free
+     * the L1 table and update the copied flag on the current cluster
+     * offsets.  This happens in the background.
      */
-    ret = qcow2_update_snapshot_refcount(bs, sn.l1_table_offset,
-                                         sn.l1_size, -1);
+    job = g_new0(Qcow2RefcountJob, 1);
+    job->addend = -1;
+    job->l1_table_offset = sn.l1_table_offset;
+    job->l1_size = sn.l1_size;
+    job->l1_table = g_malloc(sn.l1_size * sizeof(uint64_t));
+    job->pending = bitmap_new(sn.l1_size);
+
+    ret = bdrv_pread(bs->file, sn.l1_table_offset, job->l1_table,
+                     sn.l1_size * sizeof(uint64_t));
     if (ret < 0) {
         error_setg(errp, "Failed to free the cluster and L1 table");
+        qcow2_refcount_job_free(job);
         return ret;
     }
-    qcow2_free_clusters(bs, sn.l1_table_offset, sn.l1_size * sizeof(uint64_t),
-                        QCOW2_DISCARD_SNAPSHOT);
-
-    /* must update the copied flag on the current cluster offsets */
-    ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size, 0);
-    if (ret < 0) {
-        error_setg(errp, "Failed to update snapshot status in disk");
-        return ret;
+    for (i = 0; i < sn.l1_size; i++) {
+        be64_to_cpus(&job->l1_table[i]);
+        if (job->l1_table[i] & L1E_OFFSET_MASK) {
+            set_bit(i, job->pending);
+        }
     }
+    qcow2_refcount_job_start(bs, job);
 
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
+        qcow2_refcount_job_finish(bs);
         qcow2_check_refcounts(bs, &result, 0);
     }
 #endif
@@ -27,6 +27,7 @@
 #include <zlib.h>
 #include "qemu/aes.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qbool.h"
@@ -57,6 +58,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_JOURNAL 0x716a726e
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -154,6 +156,27 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_JOURNAL:
+        {
+            Qcow2JournalHeaderExt journal_ext;
+
+            if (ext.len != sizeof(journal_ext)) {
+                error_setg(errp, "ERROR: ext_journal: Invalid extension "
+                           "length");
+                return -EINVAL;
+            }
+            ret = bdrv_pread(bs->file, offset, &journal_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: ext_journal: "
+                                 "Could not read journal location");
+                return ret;
+            }
+            s->journal_offset = be64_to_cpu(journal_ext.offset);
+            s->journal_size = be64_to_cpu(journal_ext.size);
+            s->journal_seq_limit = be64_to_cpu(journal_ext.seq_limit);
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -264,7 +287,7 @@ int qcow2_mark_dirty(BlockDriverState *bs)
  * function when there are no pending requests, it does not guard against
  * concurrent requests dirtying the image.
  */
-static int qcow2_mark_clean(BlockDriverState *bs)
+int qcow2_mark_clean(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
 
@@ -314,7 +337,17 @@ int qcow2_mark_consistent(BlockDriverState *bs)
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
                        BdrvCheckMode fix)
 {
-    int ret = qcow2_check_refcounts(bs, result, fix);
+    int ret;
+
+    /* Pool clusters would show up as leaks, and refcounts are only right
+     * once deferred snapshot updates are done */
+    qcow2_cluster_pool_release(bs);
+    ret = qcow2_refcount_job_finish(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = qcow2_check_refcounts(bs, result, fix);
     if (ret < 0) {
         return ret;
     }
@@ -400,6 +433,26 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Check for unintended writes into an inactive L2 table",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum L2 table cache size",
+        },
+        {
+            .name = QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum refcount block cache size",
+        },
+        {
+            .name = QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of each entry in the L2 cache",
+        },
+        {
+            .name = QCOW2_OPT_CLUSTER_POOL_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the pool of preallocated zeroed clusters",
+        },
         { /* end of list */ }
     },
 };
@@ -421,10 +474,12 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     BDRVQcowState *s = bs->opaque;
     int len, i, ret = 0;
     QCowHeader header;
-    QemuOpts *opts;
+    QemuOpts *opts = NULL;
     Error *local_err = NULL;
     uint64_t ext_end;
     uint64_t l1_vm_state_index;
+    uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
+    uint64_t cluster_pool_size;
     const char *opt_overlap_check;
     int overlap_check_template = 0;
 
@@ -594,9 +649,56 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
-    /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
+    opts = qemu_opts_create_nofail(&qcow2_runtime_opts);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (error_is_set(&local_err)) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* The L2 cache may hold slices of L2 tables rather than whole tables, so
+     * that a random access only reads the part of the table it needs */
+    l2_cache_entry_size = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+                                            s->cluster_size);
+    if (l2_cache_entry_size < BDRV_SECTOR_SIZE ||
+        l2_cache_entry_size > s->cluster_size ||
+        !is_power_of_2(l2_cache_entry_size)) {
+        error_setg(errp, "L2 cache entry size must be a power of two between "
+                   "%d and the cluster size (%d)", BDRV_SECTOR_SIZE,
+                   s->cluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->l2_slice_size = l2_cache_entry_size / sizeof(uint64_t);
+
+    /* alloc L2 table/refcount block cache, the sizes are given in bytes */
+    l2_cache_size = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_SIZE,
+        (uint64_t)L2_CACHE_SIZE * s->cluster_size) / l2_cache_entry_size;
+    refcount_cache_size = qemu_opt_get_size(opts,
+        QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+        (uint64_t)REFCOUNT_CACHE_SIZE * s->cluster_size) / s->cluster_size;
+
+    if (l2_cache_size < MIN_L2_CACHE_SIZE || l2_cache_size > INT_MAX) {
+        error_setg(errp, "L2 cache size must be between %" PRIu64 " and %"
+                   PRIu64 " bytes", MIN_L2_CACHE_SIZE * l2_cache_entry_size,
+                   (uint64_t)INT_MAX * l2_cache_entry_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (refcount_cache_size < MIN_REFCOUNT_CACHE_SIZE ||
+        refcount_cache_size > INT_MAX) {
+        error_setg(errp, "Refcount cache size must be between %d and %"
+                   PRIu64 " bytes", MIN_REFCOUNT_CACHE_SIZE * s->cluster_size,
+                   (uint64_t)INT_MAX * s->cluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
+                                           l2_cache_entry_size);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
+                                                 s->cluster_size);
 
     s->cluster_cache = g_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
@@ -613,6 +715,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     QLIST_INIT(&s->cluster_allocs);
     QTAILQ_INIT(&s->discards);
+    QTAILQ_INIT(&s->cluster_pool);
 
     /* read qcow2 extensions */
     if (qcow2_read_extensions(bs, header.header_length, ext_end, NULL,
@@ -622,6 +725,14 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    /* A journal that was written by a version which doesn't know about it
+     * may be stale, so it is only used if the autoclear bit is still set */
+    if (!(s->autoclear_features & QCOW2_AUTOCLEAR_JOURNAL)) {
+        s->journal_offset = 0;
+        s->journal_size = 0;
+        s->journal_seq_limit = 0;
+    }
+
     /* read the backing file name */
     if (header.backing_file_offset != 0) {
         len = header.backing_file_size;
@@ -644,8 +755,8 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && s->autoclear_features != 0) {
-        s->autoclear_features = 0;
+    if (!bs->read_only && (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK)) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -655,6 +766,14 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->compress_order_queue);
+
+    /* Replay metadata updates that didn't make it into place */
+    ret = qcow2_journal_open(bs, &local_err);
+    if (ret < 0) {
+        error_propagate(errp, local_err);
+        goto fail;
+    }
 
     /* Repair image if dirty */
     if (!(flags & BDRV_O_CHECK) && !bs->read_only &&
@@ -669,16 +788,20 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* Enable lazy_refcounts according to image and command line options */
-    opts = qemu_opts_create_nofail(&qcow2_runtime_opts);
-    qemu_opts_absorb_qdict(opts, options, &local_err);
-    if (error_is_set(&local_err)) {
-        error_propagate(errp, local_err);
+    s->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
+        (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
+
+    /* Let the write path take clusters from a pool that is allocated and
+     * zeroed in the background */
+    cluster_pool_size = qemu_opt_get_size(opts, QCOW2_OPT_CLUSTER_POOL_SIZE, 0)
+                        >> s->cluster_bits;
+    if (cluster_pool_size > INT_MAX) {
+        error_setg(errp, "Cluster pool size must not exceed %" PRIu64
+                   " bytes", (uint64_t)INT_MAX << s->cluster_bits);
         ret = -EINVAL;
         goto fail;
     }
-
-    s->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
-        (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
+    s->cluster_pool_size = bs->read_only ? 0 : cluster_pool_size;
 
     s->discard_passthrough[QCOW2_DISCARD_NEVER] = false;
     s->discard_passthrough[QCOW2_DISCARD_ALWAYS] = true;
@@ -703,7 +826,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         error_setg(errp, "Unsupported value '%s' for qcow2 option "
                    "'overlap-check'. Allowed are either of the following: "
                    "none, constant, cached, all", opt_overlap_check);
-        qemu_opts_del(opts);
         ret = -EINVAL;
         goto fail;
     }
@@ -718,6 +840,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     qemu_opts_del(opts);
+    opts = NULL;
     bs->bl.write_zeroes_alignment = s->cluster_sectors;
 
     if (s->use_lazy_refcounts && s->qcow_version < 3) {
@@ -736,8 +859,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     return ret;
 
  fail:
+    if (opts) {
+        qemu_opts_del(opts);
+    }
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
+    if (s->journal_clusters) {
+        g_tree_destroy(s->journal_clusters);
+        s->journal_clusters = NULL;
+    }
     qcow2_free_snapshots(bs);
     qcow2_refcount_close(bs);
     g_free(s->l1_table);
@@ -745,6 +875,11 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     s->l1_table = NULL;
     if (s->l2_table_cache) {
         qcow2_cache_destroy(bs, s->l2_table_cache);
+        s->l2_table_cache = NULL;
+    }
+    if (s->refcount_block_cache) {
+        qcow2_cache_destroy(bs, s->refcount_block_cache);
+        s->refcount_block_cache = NULL;
     }
     g_free(s->cluster_cache);
     qemu_vfree(s->cluster_data);
@@ -859,6 +994,9 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
     uint64_t bytes_done = 0;
     QEMUIOVector hd_qiov;
     uint8_t *cluster_data = NULL;
+    uint8_t *inflate_buf = NULL;
+    uint64_t coffset;
+    unsigned cache_gen;
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
@@ -913,15 +1051,35 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+            coffset = cluster_offset & s->cluster_offset_mask;
+            if (s->cluster_cache_offset == coffset) {
+                qemu_iovec_from_buf(&hd_qiov, 0,
+                    s->cluster_cache + index_in_cluster * 512,
+                    512 * cur_nr_sectors);
+                break;
+            }
+
+            /* Inflate into a private buffer without the lock, so that
+             * other requests can decompress their clusters meanwhile */
+            if (!inflate_buf) {
+                inflate_buf = g_malloc(s->cluster_size);
+            }
+            cache_gen = s->cluster_cache_gen;
+            qemu_co_mutex_unlock(&s->lock);
+            ret = qcow2_co_decompress_cluster(bs, cluster_offset,
+                                              inflate_buf);
+            qemu_co_mutex_lock(&s->lock);
             if (ret < 0) {
                 goto fail;
             }
 
             qemu_iovec_from_buf(&hd_qiov, 0,
-                s->cluster_cache + index_in_cluster * 512,
+                inflate_buf + index_in_cluster * 512,
                 512 * cur_nr_sectors);
+            if (s->cluster_cache_gen == cache_gen) {
+                memcpy(s->cluster_cache, inflate_buf, s->cluster_size);
+                s->cluster_cache_offset = coffset;
+            }
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -981,6 +1139,7 @@ fail:
 
     qemu_iovec_destroy(&hd_qiov);
     qemu_vfree(cluster_data);
+    g_free(inflate_buf);
 
     return ret;
 }
@@ -1000,6 +1159,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     uint64_t bytes_done = 0;
     uint8_t *cluster_data = NULL;
     QCowL2Meta *l2meta = NULL;
+    QCowL2Meta *cow_end_owner = NULL;
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), sector_num,
                                  remaining_sectors);
@@ -1007,6 +1167,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
     s->cluster_cache_offset = -1; /* disable compressed cache */
+    s->cluster_cache_gen++;
 
     qemu_co_mutex_lock(&s->lock);
 
@@ -1023,7 +1184,8 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
         }
 
         ret = qcow2_alloc_cluster_offset(bs, sector_num << 9,
-            index_in_cluster, n_end, &cur_nr_sectors, &cluster_offset, &l2meta);
+            index_in_cluster, n_end, &cur_nr_sectors, &cluster_offset, &l2meta,
+            &cow_end_owner);
         if (ret < 0) {
             goto fail;
         }
@@ -1067,6 +1229,20 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                              (cluster_offset >> 9) + index_in_cluster,
                              cur_nr_sectors, &hd_qiov);
         qemu_co_mutex_lock(&s->lock);
+
+        if (cow_end_owner) {
+            /* The owner must be released even if the write failed */
+            int mapped = qcow2_finish_cow_end_write(bs, cow_end_owner,
+                                                    sector_num << 9,
+                                                    cluster_offset);
+            cow_end_owner = NULL;
+            if (ret >= 0 && mapped == 0) {
+                /* The owner's allocation failed, try again on our own */
+                continue;
+            } else if (ret >= 0 && mapped < 0) {
+                ret = mapped;
+            }
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -1099,6 +1275,9 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     ret = 0;
 
 fail:
+    if (cow_end_owner) {
+        qcow2_finish_cow_end_write(bs, cow_end_owner, 0, 0);
+    }
     qemu_co_mutex_unlock(&s->lock);
 
     while (l2meta != NULL) {
@@ -1107,6 +1286,11 @@ fail:
         if (l2meta->nb_clusters != 0) {
             QLIST_REMOVE(l2meta, next_in_flight);
         }
+
+        /* Requests writing into our clusters still reference l2meta */
+        while (l2meta->nb_cow_end_writers > 0) {
+            qemu_co_queue_wait(&l2meta->cow_end_writers_done);
+        }
         qemu_co_queue_restart_all(&l2meta->dependent_requests);
 
         next = l2meta->next;
@@ -1124,6 +1308,10 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    qcow2_refcount_job_finish(bs);
+    qcow2_cluster_pool_release(bs);
+
     g_free(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
@@ -1131,6 +1319,7 @@ static void qcow2_close(BlockDriverState *bs)
     qcow2_cache_flush(bs, s->l2_table_cache);
     qcow2_cache_flush(bs, s->refcount_block_cache);
 
+    qcow2_journal_close(bs);
     qcow2_mark_clean(bs);
 
     qcow2_cache_destroy(bs, s->l2_table_cache);
@@ -1302,7 +1491,26 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
-    /* Feature table */
+    /* Metadata journal header extension */
+    if (s->journal_offset) {
+        Qcow2JournalHeaderExt journal_ext = {
+            .offset     = cpu_to_be64(s->journal_offset),
+            .size       = cpu_to_be64(s->journal_size),
+            .seq_limit  = cpu_to_be64(s->journal_seq_limit),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_JOURNAL,
+                             &journal_ext, sizeof(journal_ext), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
+    /* Feature table.  The journal entries come last and are only written
+     * for images that have a journal, so that others keep the same table */
     Qcow2Feature features[] = {
         {
             .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
@@ -1319,10 +1527,22 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
             .name = "lazy refcounts",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+            .bit  = QCOW2_INCOMPAT_JOURNAL_BITNR,
+            .name = "journal",
+        },
+        {
+            .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+            .bit  = QCOW2_AUTOCLEAR_JOURNAL_BITNR,
+            .name = "journal valid",
+        },
     };
+    size_t nb_features = s->journal_offset ? ARRAY_SIZE(features)
+                                           : ARRAY_SIZE(features) - 2;
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
-                         features, sizeof(features), buflen);
+                         features, nb_features * sizeof(features[0]), buflen);
     if (ret < 0) {
         goto fail;
     }
@@ -1401,7 +1621,7 @@ static int preallocate(BlockDriverState *bs)
     while (nb_sectors) {
         num = MIN(nb_sectors, INT_MAX >> 9);
         ret = qcow2_alloc_cluster_offset(bs, offset, 0, num, &num,
-                                         &host_offset, &meta);
+                                         &host_offset, &meta, NULL);
         if (ret < 0) {
             return ret;
         }
@@ -1446,7 +1666,7 @@ static int qcow2_create2(const char *filename, int64_t total_size,
                          const char *backing_file, const char *backing_format,
                          int flags, size_t cluster_size, int prealloc,
                          QEMUOptionParameter *options, int version,
-                         Error **errp)
+                         uint64_t journal_size, Error **errp)
 {
     /* Calculate cluster_bits */
     int cluster_bits;
@@ -1577,6 +1797,15 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         }
     }
 
+    /* The journal needs to be in place before any metadata is preallocated */
+    if (journal_size) {
+        ret = qcow2_journal_create(bs, journal_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not create metadata journal");
+            goto out;
+        }
+    }
+
     /* And if we're supposed to preallocate metadata, do that now */
     if (prealloc) {
         BDRVQcowState *s = bs->opaque;
@@ -1616,6 +1845,7 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options,
     size_t cluster_size = DEFAULT_CLUSTER_SIZE;
     int prealloc = 0;
     int version = 3;
+    uint64_t journal_size = 0;
     Error *local_err = NULL;
     int ret;
 
@@ -1657,6 +1887,8 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options,
             }
         } else if (!strcmp(options->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
             flags |= options->value.n ? BLOCK_FLAG_LAZY_REFCOUNTS : 0;
+        } else if (!strcmp(options->name, BLOCK_OPT_JOURNAL_SIZE)) {
+            journal_size = options->value.n;
         }
         options++;
     }
@@ -1673,8 +1905,21 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options,
         return -EINVAL;
     }
 
+    if (version < 3 && journal_size) {
+        error_setg(errp, "Metadata journals only supported with compatibility "
+                   "level 1.1 and above (use compat=1.1 or greater)");
+        return -EINVAL;
+    }
+
+    if (journal_size > QCOW_MAX_JOURNAL_SIZE) {
+        error_setg(errp, "Metadata journal size must not exceed %llu bytes",
+                   QCOW_MAX_JOURNAL_SIZE);
+        return -EINVAL;
+    }
+
     ret = qcow2_create2(filename, sectors, backing_file, backing_fmt, flags,
-                        cluster_size, prealloc, options, version, &local_err);
+                        cluster_size, prealloc, options, version,
+                        journal_size, &local_err);
     if (error_is_set(&local_err)) {
         error_propagate(errp, local_err);
     }
@@ -1701,21 +1946,58 @@ static int qcow2_make_empty(BlockDriverState *bs)
     return 0;
 }
 
+/* Does the cluster containing sector_num read as zeroes? */
+static bool is_zero_cluster(BlockDriverState *bs, int64_t sector_num)
+{
+    uint64_t cluster_offset;
+    int nr = 1;
+    int ret;
+
+    ret = qcow2_get_cluster_offset(bs, sector_num << BDRV_SECTOR_BITS, &nr,
+                                   &cluster_offset);
+    return ret == QCOW2_CLUSTER_ZERO ||
+           (ret == QCOW2_CLUSTER_UNALLOCATED && !bs->backing_hd);
+}
+
 static coroutine_fn int qcow2_co_write_zeroes(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors, BdrvRequestFlags flags)
 {
     int ret;
     BDRVQcowState *s = bs->opaque;
 
-    /* Emulate misaligned zero writes */
     if (sector_num % s->cluster_sectors || nb_sectors % s->cluster_sectors) {
+        /* The block layer sends the unaligned head and tail of a request
+         * on their own.  Zeroing part of a cluster that is zero already,
+         * typically on a new image, is a no-op; emulate the rest.
+         */
+        if (sector_num / s->cluster_sectors ==
+            (sector_num + nb_sectors - 1) / s->cluster_sectors) {
+            bool zero;
+
+            qemu_co_mutex_lock(&s->lock);
+            zero = is_zero_cluster(bs, sector_num);
+            qemu_co_mutex_unlock(&s->lock);
+            if (zero) {
+                return 0;
+            }
+        }
         return -ENOTSUP;
     }
 
     /* Whatever is left can use real zero clusters */
     qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_zero_clusters(bs, sector_num << BDRV_SECTOR_BITS,
-        nb_sectors);
+    if (s->qcow_version >= 3) {
+        ret = qcow2_zero_clusters(bs, sector_num << BDRV_SECTOR_BITS,
+            nb_sectors);
+    } else if (!bs->backing_hd) {
+        /* Version 2 has no zero flag, but without a backing file
+         * unallocated clusters read as zeroes */
+        ret = qcow2_discard_clusters(bs, sector_num << BDRV_SECTOR_BITS,
+            nb_sectors, (flags & BDRV_REQ_MAY_UNMAP) ?
+                        QCOW2_DISCARD_REQUEST : QCOW2_DISCARD_OTHER);
+    } else {
+        ret = -ENOTSUP;
+    }
     qemu_co_mutex_unlock(&s->lock);
 
     return ret;
@@ -1775,98 +2057,151 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+typedef struct Qcow2Deflate {
+    uint8_t *dst;
+    int dst_len;
+    const uint8_t *src;
+    int src_len;
+} Qcow2Deflate;
+
+/* Returns the compressed size, or -ENOSPC if the data does not shrink */
+static int qcow2_deflate_worker(void *opaque)
+{
+    Qcow2Deflate *c = opaque;
+    z_stream strm;
+    int ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = c->src_len;
+    strm.next_in = (uint8_t *)c->src;
+    strm.avail_out = c->dst_len;
+    strm.next_out = c->dst;
+
+    ret = deflate(&strm, Z_FINISH);
+    deflateEnd(&strm);
+    if (ret != Z_STREAM_END && ret != Z_OK) {
+        return -EINVAL;
+    }
+    if (ret != Z_STREAM_END || strm.next_out - c->dst >= c->src_len) {
+        return -ENOSPC;
+    }
+    return strm.next_out - c->dst;
+}
+
+static coroutine_fn void qcow2_compress_wait_turn(BDRVQcowState *s,
+                                                  uint64_t seq)
+{
+    while (s->compress_seq_done != seq) {
+        qemu_co_queue_wait(&s->compress_order_queue);
+    }
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+static coroutine_fn int qcow2_co_write_compressed(BlockDriverState *bs,
+                                                  int64_t sector_num,
+                                                  int nb_sectors,
+                                                  QEMUIOVector *qiov)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
+    Qcow2Deflate deflate;
+    ThreadPool *pool;
+    QEMUIOVector hd_qiov;
+    struct iovec iov;
     int ret, out_len;
-    uint8_t *out_buf;
-    uint64_t cluster_offset;
+    uint8_t *buf = NULL, *out_buf = NULL;
+    uint64_t cluster_offset, seq;
+
+    /* The ticket must be taken before anything yields, see
+     * bdrv_co_write_compressed in block_int.h */
+    seq = s->compress_seq_next++;
 
     if (nb_sectors == 0) {
+        qcow2_compress_wait_turn(s, seq);
         /* align end of file to a sector boundary to ease reading with
            sector based I/Os */
         cluster_offset = bdrv_getlength(bs->file);
         cluster_offset = (cluster_offset + 511) & ~511;
-        bdrv_truncate(bs->file, cluster_offset);
-        return 0;
+        ret = bdrv_truncate(bs->file, cluster_offset);
+        goto out;
     }
 
-    if (nb_sectors != s->cluster_sectors) {
+    /* Zero-pad last write if image size is not cluster aligned */
+    if (nb_sectors != s->cluster_sectors &&
+        (sector_num + nb_sectors != bs->total_sectors ||
+         nb_sectors > s->cluster_sectors)) {
         ret = -EINVAL;
-
-        /* Zero-pad last write if image size is not cluster aligned */
-        if (sector_num + nb_sectors == bs->total_sectors &&
-            nb_sectors < s->cluster_sectors) {
-            uint8_t *pad_buf = qemu_blockalign(bs, s->cluster_size);
-            memset(pad_buf, 0, s->cluster_size);
-            memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
-            ret = qcow2_write_compressed(bs, sector_num,
-                                         pad_buf, s->cluster_sectors);
-            qemu_vfree(pad_buf);
-        }
-        return ret;
+        goto out;
     }
+    buf = qemu_blockalign(bs, s->cluster_size);
+    memset(buf, 0, s->cluster_size);
+    qemu_iovec_to_buf(qiov, 0, buf, nb_sectors * BDRV_SECTOR_SIZE);
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
+    out_buf = g_malloc(s->cluster_size);
+    deflate.dst = out_buf;
+    deflate.dst_len = s->cluster_size;
+    deflate.src = buf;
+    deflate.src_len = s->cluster_size;
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    out_len = thread_pool_submit_co(pool, qcow2_deflate_worker, &deflate);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    /* Compressed clusters are packed at byte granularity, so neighbours
+     * share sectors; allocate and write them one at a time, in order. */
+    qcow2_compress_wait_turn(s, seq);
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
+    if (out_len == -ENOSPC) {
+        /* could not compress: write normal cluster */
+        iov.iov_base = buf;
+        iov.iov_len = s->cluster_size;
+        qemu_iovec_init_external(&hd_qiov, &iov, 1);
+        ret = bdrv_co_writev(bs, sector_num, s->cluster_sectors, &hd_qiov);
+        goto out;
+    } else if (out_len < 0) {
+        ret = out_len;
+        goto out;
     }
-    out_len = strm.next_out - out_buf;
 
-    deflateEnd(&strm);
+    qemu_co_mutex_lock(&s->lock);
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        sector_num << 9, out_len);
+    if (!cluster_offset) {
+        qemu_co_mutex_unlock(&s->lock);
+        ret = -EIO;
+        goto out;
+    }
+    cluster_offset &= s->cluster_offset_mask;
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-        if (ret < 0) {
-            goto fail;
-        }
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
-        }
-        cluster_offset &= s->cluster_offset_mask;
+    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        goto out;
+    }
 
-        ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
+    s->cluster_cache_offset = -1;
+    s->cluster_cache_gen++;
 
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+    if (ret < 0) {
+        goto out;
     }
 
     ret = 0;
-fail:
+out:
+    /* Requests that failed early still have to wait before passing on
+     * the turn */
+    qcow2_compress_wait_turn(s, seq);
+    s->compress_seq_done++;
+    qemu_co_queue_restart_all(&s->compress_order_queue);
+    qemu_vfree(buf);
     g_free(out_buf);
     return ret;
 }
@@ -1926,12 +2261,31 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
             .lazy_refcounts     = s->compatible_features &
                                   QCOW2_COMPAT_LAZY_REFCOUNTS,
             .has_lazy_refcounts = true,
+            .journal_size       = s->journal_size,
+            .has_journal_size   = s->journal_offset != 0,
         };
     }
 
     return spec_info;
 }
 
+static BlockMetadataCacheStats *qcow2_get_cache_stats(
+    const BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BlockMetadataCacheStats *stats = g_new0(BlockMetadataCacheStats, 1);
+    uint64_t hits, misses;
+
+    qcow2_cache_get_stats(s->l2_table_cache, &hits, &misses);
+    stats->l2_hits = hits;
+    stats->l2_misses = misses;
+    qcow2_cache_get_stats(s->refcount_block_cache, &hits, &misses);
+    stats->refcount_hits = hits;
+    stats->refcount_misses = misses;
+
+    return stats;
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -2073,6 +2427,12 @@ static int qcow2_amend_options(BlockDriverState *bs,
     int ret;
     int i;
 
+    /* A version downgrade must not find the image dirty */
+    ret = qcow2_refcount_job_finish(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     for (i = 0; options[i].name; i++)
     {
         if (!options[i].assigned) {
@@ -2115,6 +2475,12 @@ static int qcow2_amend_options(BlockDriverState *bs,
             }
         } else if (!strcmp(options[i].name, "lazy_refcounts")) {
             lazy_refcounts = options[i].value.n;
+        } else if (!strcmp(options[i].name, "journal_size")) {
+            if (options[i].value.n != s->journal_size) {
+                fprintf(stderr, "Changing the journal size is not "
+                        "supported.\n");
+                return -ENOTSUP;
+            }
         } else {
             /* if this assertion fails, this probably means a new option was
              * added without having it covered here */
@@ -2230,6 +2596,11 @@ static QEMUOptionParameter qcow2_create_options[] = {
         .type = OPT_FLAG,
         .help = "Postpone refcount updates",
     },
+    {
+        .name = BLOCK_OPT_JOURNAL_SIZE,
+        .type = OPT_SIZE,
+        .help = "Size of the metadata journal (0 for none)",
+    },
     { NULL }
 };
 
@@ -2253,7 +2624,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_co_write_zeroes   = qcow2_co_write_zeroes,
     .bdrv_co_discard        = qcow2_co_discard,
     .bdrv_truncate          = qcow2_truncate,
-    .bdrv_write_compressed  = qcow2_write_compressed,
+    .bdrv_co_write_compressed = qcow2_co_write_compressed,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
     .bdrv_snapshot_goto     = qcow2_snapshot_goto,
@@ -2262,6 +2633,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_load_tmp     = qcow2_snapshot_load_tmp,
     .bdrv_get_info      = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_cache_stats   = qcow2_get_cache_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -39,6 +39,9 @@
 
 #define QCOW_MAX_CRYPT_CLUSTERS 32
 
+/* Transaction lengths in the metadata journal are 32 bits */
+#define QCOW_MAX_JOURNAL_SIZE (1ULL << 30)
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1ULL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -46,15 +49,22 @@
 /* The cluster reads as all zeros */
 #define QCOW_OFLAG_ZERO (1ULL << 0)
 
+/* What qcow2_update_l2_refcount() updates */
+#define QCOW2_REF_L2_DATA   1   /* the clusters an L2 table points to */
+#define QCOW2_REF_L2_TABLE  2   /* the L2 table itself */
+
 #define REFCOUNT_SHIFT 1 /* refcount size is 2 bytes */
 
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* Default number of cached tables, unless the cache size options are used */
 #define L2_CACHE_SIZE 16
+#define MIN_L2_CACHE_SIZE 2
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
+#define MIN_REFCOUNT_CACHE_SIZE 4
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
@@ -72,6 +82,10 @@
 #define QCOW2_OPT_OVERLAP_SNAPSHOT_TABLE "overlap-check.snapshot-table"
 #define QCOW2_OPT_OVERLAP_INACTIVE_L1 "overlap-check.inactive-l1"
 #define QCOW2_OPT_OVERLAP_INACTIVE_L2 "overlap-check.inactive-l2"
+#define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
+#define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
+#define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
+#define QCOW2_OPT_CLUSTER_POOL_SIZE "cluster-pool-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -119,6 +133,13 @@ typedef struct Qcow2UnknownHeaderExtension {
     uint8_t data[];
 } Qcow2UnknownHeaderExtension;
 
+/* Location of the metadata journal in the image file */
+typedef struct Qcow2JournalHeaderExt {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t seq_limit;
+} QEMU_PACKED Qcow2JournalHeaderExt;
+
 enum {
     QCOW2_FEAT_TYPE_INCOMPATIBLE    = 0,
     QCOW2_FEAT_TYPE_COMPATIBLE      = 1,
@@ -129,11 +150,14 @@ enum {
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
     QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
+    QCOW2_INCOMPAT_JOURNAL_BITNR = 2,
     QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_JOURNAL       = 1 << QCOW2_INCOMPAT_JOURNAL_BITNR,
 
     QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+                                 | QCOW2_INCOMPAT_CORRUPT
+                                 | QCOW2_INCOMPAT_JOURNAL,
 };
 
 /* Compatible feature bits */
@@ -144,6 +168,14 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_JOURNAL_BITNR = 0,
+    QCOW2_AUTOCLEAR_JOURNAL       = 1 << QCOW2_AUTOCLEAR_JOURNAL_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK          = QCOW2_AUTOCLEAR_JOURNAL,
+};
+
 enum qcow2_discard_type {
     QCOW2_DISCARD_NEVER = 0,
     QCOW2_DISCARD_ALWAYS,
@@ -166,12 +198,30 @@ typedef struct Qcow2DiscardRegion {
     QTAILQ_ENTRY(Qcow2DiscardRegion) next;
 } Qcow2DiscardRegion;
 
+/* Contiguous zeroed clusters in the cluster pool */
+typedef struct Qcow2PoolExtent {
+    uint64_t offset;
+    int nb_clusters;
+    QTAILQ_ENTRY(Qcow2PoolExtent) next;
+} Qcow2PoolExtent;
+
+/* Refcount update left for after an internal snapshot operation */
+typedef struct Qcow2RefcountJob {
+    int addend;                 /* 1 after creation, -1 after deletion */
+    int64_t l1_table_offset;    /* L1 table of the snapshot */
+    int l1_size;
+    uint64_t *l1_table;         /* its entries, in host byte order */
+    unsigned long *pending;     /* L1 indexes whose L2 table is not done */
+    Coroutine *co;
+} Qcow2RefcountJob;
+
 typedef struct BDRVQcowState {
     int cluster_bits;
     int cluster_size;
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    int l2_slice_size; /* entries per L2 cache table, at most l2_size */
     int l1_size;
     int l1_vm_state_index;
     int csize_shift;
@@ -186,6 +236,9 @@ typedef struct BDRVQcowState {
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
     uint64_t cluster_cache_offset;
+    /* Bumped by every write, so that a decompression overlapping with a
+     * write does not fill the cache with stale data */
+    unsigned cluster_cache_gen;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -196,6 +249,12 @@ typedef struct BDRVQcowState {
 
     CoMutex lock;
 
+    /* Compressed writes take a ticket on entry and allocate their space
+     * in ticket order; the compression itself runs in parallel */
+    uint64_t compress_seq_next;
+    uint64_t compress_seq_done;
+    CoQueue compress_order_queue;
+
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
     uint32_t crypt_method_header;
     AES_KEY aes_encrypt_key;
@@ -223,8 +282,34 @@ typedef struct BDRVQcowState {
     QLIST_HEAD(, Qcow2UnknownHeaderExtension) unknown_header_ext;
     QTAILQ_HEAD (, Qcow2DiscardRegion) discards;
     bool cache_discards;
+
+    /* Metadata journal, journal_offset is 0 if the image has none */
+    uint64_t journal_offset;
+    uint64_t journal_size;
+    uint64_t journal_pos;       /* where the next transaction goes */
+    uint64_t journal_seq;       /* sequence number of the next transaction */
+    uint64_t journal_seq_limit; /* sequence numbers on disk are below this */
+    GTree *journal_clusters;    /* clusters with tables in the journal */
+
+    /* Preallocated zeroed clusters, see qcow2_cluster_pool_get() */
+    QTAILQ_HEAD (, Qcow2PoolExtent) cluster_pool;
+    int cluster_pool_size;      /* in clusters, 0 if there is no pool */
+    int cluster_pool_clusters;  /* clusters currently in the pool */
+    Coroutine *cluster_pool_co; /* refill coroutine, if it is running */
+    bool cluster_pool_stop;
+
+    /* Deferred snapshot refcount update, see qcow2-snapshot.c */
+    Qcow2RefcountJob *refcount_job;
 } BDRVQcowState;
 
+/* A dirty table on its way through the metadata journal */
+typedef struct Qcow2JournalTable {
+    uint64_t offset;
+    void *data;
+    int size;
+    int ol_ign;                 /* overlap check exemption for the write */
+} Qcow2JournalTable;
+
 /* XXX: use std qcow open function ? */
 typedef struct QCowCreateState {
     int cluster_size;
@@ -288,6 +373,25 @@ typedef struct QCowL2Meta
      */
     Qcow2COWRegion cow_end;
 
+    /**
+     * Number of other requests that write into the area that used to be
+     * cow_end (see handle_dependencies()). Their data must be written before
+     * the L2 table is updated.
+     */
+    int nb_cow_end_writers;
+
+    /** Restarted when the last of the cow_end writers has written its data */
+    CoQueue cow_end_writers_done;
+
+    /** Set when cow_end is being copied; no more requests may join then */
+    bool cow_end_busy;
+
+    /**
+     * The new clusters are zeroed and the guest reads zeroes from the COW
+     * regions, so these don't need to be copied.
+     */
+    bool skip_cow;
+
     /** Pointer to next L2Meta of the same write request */
     struct QCowL2Meta *next;
 
@@ -372,6 +476,12 @@ static inline int offset_to_l2_index(BDRVQcowState *s, int64_t offset)
     return (offset >> s->cluster_bits) & (s->l2_size - 1);
 }
 
+/* Index of the L2 entry for @offset within its L2 slice */
+static inline int offset_to_l2_slice_index(BDRVQcowState *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_slice_size - 1);
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -420,6 +530,7 @@ int qcow2_backing_read1(BlockDriverState *bs, QEMUIOVector *qiov,
                   int64_t sector_num, int nb_sectors);
 
 int qcow2_mark_dirty(BlockDriverState *bs);
+int qcow2_mark_clean(BlockDriverState *bs);
 int qcow2_mark_corrupt(BlockDriverState *bs);
 int qcow2_mark_consistent(BlockDriverState *bs);
 int qcow2_update_header(BlockDriverState *bs);
@@ -435,6 +546,9 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size);
 int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     int nb_clusters);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
+int64_t qcow2_cluster_pool_get(BlockDriverState *bs, uint64_t host_offset,
+                               unsigned int *nb_clusters);
+void qcow2_cluster_pool_release(BlockDriverState *bs);
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
                           enum qcow2_discard_type type);
@@ -443,6 +557,8 @@ void qcow2_free_any_clusters(BlockDriverState *bs, uint64_t l2_entry,
 
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend);
+int qcow2_update_l2_refcount(BlockDriverState *bs, uint64_t *l1_entry,
+                             int addend, int flags);
 
 int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                           BdrvCheckMode fix);
@@ -459,7 +575,9 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+int coroutine_fn qcow2_co_decompress_cluster(BlockDriverState *bs,
+                                             uint64_t cluster_offset,
+                                             uint8_t *out_buf);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
                      int nb_sectors, int enc,
@@ -468,7 +586,10 @@ void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
 int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int *num, uint64_t *cluster_offset);
 int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
-    int n_start, int n_end, int *num, uint64_t *host_offset, QCowL2Meta **m);
+    int n_start, int n_end, int *num, uint64_t *host_offset, QCowL2Meta **m,
+    QCowL2Meta **cow_end_owner);
+int qcow2_finish_cow_end_write(BlockDriverState *bs, QCowL2Meta *owner,
+    uint64_t guest_offset, uint64_t host_offset);
 uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
                                          uint64_t offset,
                                          int compressed_size);
@@ -495,10 +616,14 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
 
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
+int qcow2_snapshot_settle_l2(BlockDriverState *bs, int l1_index);
+int qcow2_refcount_job_finish(BlockDriverState *bs);
 
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
@@ -514,4 +639,16 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
 
+int qcow2_cache_get_dirty_tables(BlockDriverState *bs, Qcow2Cache *c,
+    Qcow2JournalTable **tables, bool *flush_needed);
+void qcow2_cache_mark_clean(Qcow2Cache *c);
+
+/* qcow2-journal.c functions */
+int qcow2_journal_create(BlockDriverState *bs, uint64_t size);
+int qcow2_journal_open(BlockDriverState *bs, Error **errp);
+int qcow2_journal_close(BlockDriverState *bs);
+int qcow2_journal_commit(BlockDriverState *bs);
+int qcow2_journal_checkpoint(BlockDriverState *bs);
+int qcow2_journal_cluster_freed(BlockDriverState *bs, int64_t cluster_index);
+
 #endif
@@ -55,11 +55,12 @@
 #include <linux/cdrom.h>
 #include <linux/fd.h>
 #include <linux/fs.h>
+#include <scsi/sg.h>
 #endif
 #ifdef CONFIG_FIEMAP
 #include <linux/fiemap.h>
 #endif
-#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+#if defined(CONFIG_FALLOCATE_PUNCH_HOLE) || defined(CONFIG_FALLOCATE_ZERO_RANGE)
 #include <linux/falloc.h>
 #endif
 #if defined (__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -133,6 +134,11 @@ typedef struct BDRVRawState {
     int64_t fd_error_time;
     int fd_got_error;
     int fd_media_changed;
+
+    /* SG_IO commands submitted with write() and reaped with read() */
+    bool sg_async;
+    int sg_in_flight;
+    QTAILQ_HEAD(, RawSgAIOCB) sg_waiting;
 #endif
 #ifdef CONFIG_LINUX_AIO
     int use_aio;
@@ -144,6 +150,11 @@ typedef struct BDRVRawState {
     bool has_discard:1;
     bool has_write_zeroes:1;
     bool discard_zeroes:1;
+    bool has_zero_range:1;
+    bool has_fallocate:1;
+#ifdef CONFIG_PREADV2
+    bool has_nowait_read:1;
+#endif
 } BDRVRawState;
 
 typedef struct BDRVRawReopenState {
@@ -175,6 +186,186 @@ typedef struct RawPosixAIOData {
 static int cdrom_reopen(BlockDriverState *bs);
 #endif
 
+#if defined(__linux__)
+/*
+ * The sg driver queues up to SG_MAX_QUEUE (16) commands per file
+ * descriptor.  Commands are written to the descriptor and their headers
+ * read back when they complete, so a single descriptor can keep many
+ * commands outstanding without tying up a thread for each of them.
+ * Commands beyond the driver's limit wait in sg_waiting.
+ */
+#define RAW_SG_MAX_QUEUE 16
+
+typedef struct RawSgAIOCB {
+    BlockDriverAIOCB common;
+    sg_io_hdr_t *hdr;
+    /* The caller's usr_ptr; the header carries the AIOCB while queued */
+    void *usr_ptr;
+    bool *done;
+    QTAILQ_ENTRY(RawSgAIOCB) next;
+} RawSgAIOCB;
+
+static void hdev_sg_complete(void *opaque);
+
+static void hdev_sg_finish(RawSgAIOCB *acb, int ret)
+{
+    acb->hdr->usr_ptr = acb->usr_ptr;
+    trace_hdev_sg_complete(acb->common.bs, acb, ret);
+    acb->common.cb(acb->common.opaque, ret);
+    if (acb->done) {
+        *acb->done = true;
+    }
+    qemu_aio_release(acb);
+}
+
+static int hdev_sg_write(BDRVRawState *s, RawSgAIOCB *acb)
+{
+    ssize_t ret;
+
+    acb->hdr->usr_ptr = acb;
+    do {
+        ret = write(s->fd, acb->hdr, sizeof(*acb->hdr));
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        acb->hdr->usr_ptr = acb->usr_ptr;
+        return -errno;
+    }
+    s->sg_in_flight++;
+    return 0;
+}
+
+/* Move commands from sg_waiting to the kernel as slots become free */
+static void hdev_sg_submit_waiting(BDRVRawState *s)
+{
+    RawSgAIOCB *acb;
+    int ret;
+
+    while (s->sg_in_flight < RAW_SG_MAX_QUEUE &&
+           (acb = QTAILQ_FIRST(&s->sg_waiting)) != NULL) {
+        ret = hdev_sg_write(s, acb);
+        if (ret == -EDOM && s->sg_in_flight > 0) {
+            /* Slots are taken by synchronous SG_IO, retry later */
+            break;
+        }
+        QTAILQ_REMOVE(&s->sg_waiting, acb, next);
+        if (ret < 0) {
+            hdev_sg_finish(acb, ret);
+        }
+    }
+}
+
+static void hdev_sg_complete(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVRawState *s = bs->opaque;
+    RawSgAIOCB *acb;
+    sg_io_hdr_t hdr;
+    ssize_t ret;
+
+    for (;;) {
+        do {
+            ret = read(s->fd, &hdr, sizeof(hdr));
+        } while (ret < 0 && errno == EINTR);
+        if (ret != sizeof(hdr)) {
+            break;
+        }
+
+        /* Status, residual count and sense length come back in the header
+         * read from the descriptor, the data and the sense bytes were
+         * written straight to the caller's buffers.
+         */
+        acb = hdr.usr_ptr;
+        s->sg_in_flight--;
+        *acb->hdr = hdr;
+        hdev_sg_finish(acb, 0);
+    }
+    hdev_sg_submit_waiting(s);
+}
+
+static void hdev_sg_cancel(BlockDriverAIOCB *blockacb)
+{
+    RawSgAIOCB *acb = (RawSgAIOCB *)blockacb;
+    BDRVRawState *s = acb->common.bs->opaque;
+    AioContext *ctx = bdrv_get_aio_context(acb->common.bs);
+    RawSgAIOCB *p;
+    bool done = false;
+
+    QTAILQ_FOREACH(p, &s->sg_waiting, next) {
+        if (p == acb) {
+            QTAILQ_REMOVE(&s->sg_waiting, acb, next);
+            hdev_sg_finish(acb, -ECANCELED);
+            return;
+        }
+    }
+
+    /* The sg driver cannot abort a command, wait for it to complete */
+    acb->done = &done;
+    while (!done) {
+        aio_poll(ctx, true);
+    }
+}
+
+static const AIOCBInfo hdev_sg_aiocb_info = {
+    .aiocb_size         = sizeof(RawSgAIOCB),
+    .cancel             = hdev_sg_cancel,
+};
+
+static BlockDriverAIOCB *hdev_sg_aio_ioctl(BlockDriverState *bs,
+        sg_io_hdr_t *hdr, BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVRawState *s = bs->opaque;
+    RawSgAIOCB *acb;
+    int ret;
+
+    acb = qemu_aio_get(&hdev_sg_aiocb_info, bs, cb, opaque);
+    acb->hdr = hdr;
+    acb->usr_ptr = hdr->usr_ptr;
+    acb->done = NULL;
+
+    if (s->sg_in_flight >= RAW_SG_MAX_QUEUE ||
+        !QTAILQ_EMPTY(&s->sg_waiting)) {
+        QTAILQ_INSERT_TAIL(&s->sg_waiting, acb, next);
+        trace_hdev_sg_submit(bs, acb, s->sg_in_flight, true);
+        return &acb->common;
+    }
+
+    ret = hdev_sg_write(s, acb);
+    if (ret == -EDOM && s->sg_in_flight > 0) {
+        QTAILQ_INSERT_TAIL(&s->sg_waiting, acb, next);
+        trace_hdev_sg_submit(bs, acb, s->sg_in_flight, true);
+        return &acb->common;
+    }
+    if (ret < 0) {
+        /* Let the caller fall back to SG_IO in the thread pool */
+        qemu_aio_release(acb);
+        return NULL;
+    }
+    trace_hdev_sg_submit(bs, acb, s->sg_in_flight, false);
+    return &acb->common;
+}
+
+/* Wait for all asynchronous commands, e.g. before the descriptor changes */
+static void hdev_sg_drain(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    while (s->sg_in_flight || !QTAILQ_EMPTY(&s->sg_waiting)) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+}
+
+static void hdev_sg_set_handler(BlockDriverState *bs, AioContext *ctx,
+                                bool enable)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->sg_async) {
+        aio_set_fd_handler(ctx, s->fd, enable ? hdev_sg_complete : NULL,
+                           NULL, bs);
+    }
+}
+#endif
+
 #if defined(__NetBSD__)
 static int raw_normalize_devicepath(const char **filename)
 {
@@ -233,7 +424,8 @@ static void raw_parse_flags(int bdrv_flags, int *open_flags)
 }
 
 #ifdef CONFIG_LINUX_AIO
-static int raw_set_aio(void **aio_ctx, int *use_aio, int bdrv_flags)
+static int raw_set_aio(void **aio_ctx, int *use_aio, int bdrv_flags,
+                       AioContext *aio_context)
 {
     int ret = -1;
     assert(aio_ctx != NULL);
@@ -251,6 +443,7 @@ static int raw_set_aio(void **aio_ctx, int *use_aio, int bdrv_flags)
             if (!*aio_ctx) {
                 goto error;
             }
+            laio_attach_aio_context(*aio_ctx, aio_context);
         }
         *use_aio = 1;
     } else {
@@ -318,7 +511,8 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->fd = fd;
 
 #ifdef CONFIG_LINUX_AIO
-    if (raw_set_aio(&s->aio_ctx, &s->use_aio, bdrv_flags)) {
+    if (raw_set_aio(&s->aio_ctx, &s->use_aio, bdrv_flags,
+                    bdrv_get_aio_context(bs))) {
         qemu_close(fd);
         ret = -errno;
         error_setg_errno(errp, -ret, "Could not set AIO state");
@@ -328,6 +522,8 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 
     s->has_discard = true;
     s->has_write_zeroes = true;
+    s->has_zero_range = true;
+    s->has_fallocate = true;
 
     if (fstat(s->fd, &st) < 0) {
         error_setg_errno(errp, errno, "Could not stat file");
@@ -335,6 +531,9 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
     if (S_ISREG(st.st_mode)) {
         s->discard_zeroes = true;
+#ifdef CONFIG_PREADV2
+        s->has_nowait_read = true;
+#endif
     }
     if (S_ISBLK(st.st_mode)) {
 #ifdef BLKDISCARDZEROES
@@ -403,7 +602,8 @@ static int raw_reopen_prepare(BDRVReopenState *state,
     /* we can use s->aio_ctx instead of a copy, because the use_aio flag is
      * valid in the 'false' condition even if aio_ctx is set, and raw_set_aio()
      * won't override aio_ctx if aio_ctx is non-NULL */
-    if (raw_set_aio(&s->aio_ctx, &raw_s->use_aio, state->flags)) {
+    if (raw_set_aio(&s->aio_ctx, &raw_s->use_aio, state->flags,
+                    bdrv_get_aio_context(state->bs))) {
         error_setg(errp, "Could not set AIO state");
         return -1;
     }
@@ -471,11 +671,23 @@ static void raw_reopen_commit(BDRVReopenState *state)
 
     s->open_flags = raw_s->open_flags;
 
+#if defined(__linux__)
+    /* Commands queued on the old descriptor would never complete */
+    hdev_sg_drain(state->bs);
+    hdev_sg_set_handler(state->bs, bdrv_get_aio_context(state->bs), false);
+#endif
     qemu_close(s->fd);
     s->fd = raw_s->fd;
 #ifdef CONFIG_LINUX_AIO
     s->use_aio = raw_s->use_aio;
 #endif
+#if defined(__linux__)
+    if (s->sg_async) {
+        fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK);
+        hdev_sg_set_handler(state->bs, bdrv_get_aio_context(state->bs),
+                            true);
+    }
+#endif
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -741,6 +953,23 @@ static int xfs_discard(BDRVRawState *s, int64_t offset, uint64_t bytes)
 }
 #endif
 
+#if defined(CONFIG_FALLOCATE_PUNCH_HOLE) || defined(CONFIG_FALLOCATE_ZERO_RANGE)
+static int do_fallocate(int fd, int mode, off_t offset, off_t len)
+{
+    do {
+        if (fallocate(fd, mode, offset, len) == 0) {
+            return 0;
+        }
+    } while (errno == EINTR);
+
+    if (errno == ENODEV || errno == ENOSYS || errno == EOPNOTSUPP ||
+        errno == ENOTTY) {
+        return -ENOTSUP;
+    }
+    return -errno;
+}
+#endif
+
 static ssize_t handle_aiocb_write_zeroes(RawPosixAIOData *aiocb)
 {
     int ret = -EOPNOTSUPP;
@@ -767,6 +996,42 @@ static ssize_t handle_aiocb_write_zeroes(RawPosixAIOData *aiocb)
             return xfs_write_zeroes(s, aiocb->aio_offset, aiocb->aio_nbytes);
         }
 #endif
+
+#ifdef CONFIG_FALLOCATE_ZERO_RANGE
+        /* ext4 since Linux 3.15, and XFS without the xfsctl headers */
+        if (s->has_zero_range) {
+            ret = do_fallocate(s->fd, FALLOC_FL_ZERO_RANGE,
+                               aiocb->aio_offset, aiocb->aio_nbytes);
+            if (ret != -ENOTSUP) {
+                return ret;
+            }
+            s->has_zero_range = false;
+        }
+#endif
+
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+        /* Older kernels and other file systems: a hole reads as zeroes.
+         * Allocate the range again afterwards, so that the guest does not
+         * hit ENOSPC later on space it had before.
+         */
+        if (s->has_discard && s->has_fallocate) {
+            ret = do_fallocate(s->fd, FALLOC_FL_PUNCH_HOLE |
+                               FALLOC_FL_KEEP_SIZE,
+                               aiocb->aio_offset, aiocb->aio_nbytes);
+            if (ret == 0) {
+                ret = do_fallocate(s->fd, 0, aiocb->aio_offset,
+                                   aiocb->aio_nbytes);
+                if (ret == -ENOTSUP) {
+                    s->has_fallocate = false;
+                    ret = 0;
+                }
+                return ret;
+            } else if (ret != -ENOTSUP) {
+                return ret;
+            }
+            s->has_discard = false;
+        }
+#endif
     }
 
     if (ret == -ENODEV || ret == -ENOSYS || ret == -EOPNOTSUPP ||
@@ -920,6 +1185,72 @@ static BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
     return thread_pool_submit_aio(pool, aio_worker, acb, cb, opaque);
 }
 
+#ifdef CONFIG_PREADV2
+/*
+ * Buffered reads that hit the page cache take a few microseconds, far less
+ * than the round trip through the thread pool.  Try them right away with
+ * RWF_NOWAIT: the kernel fails with EAGAIN instead of blocking when the data
+ * would have to come from the disk, and only then is a worker involved.
+ */
+typedef struct RawNowaitAIOCB {
+    BlockDriverAIOCB common;
+    QEMUBH *bh;
+} RawNowaitAIOCB;
+
+static void raw_nowait_cancel(BlockDriverAIOCB *blockacb)
+{
+    RawNowaitAIOCB *acb = container_of(blockacb, RawNowaitAIOCB, common);
+
+    qemu_bh_delete(acb->bh);
+    qemu_aio_release(acb);
+}
+
+static const AIOCBInfo raw_nowait_aiocb_info = {
+    .aiocb_size = sizeof(RawNowaitAIOCB),
+    .cancel     = raw_nowait_cancel,
+};
+
+static void raw_nowait_bh(void *opaque)
+{
+    RawNowaitAIOCB *acb = opaque;
+
+    qemu_bh_delete(acb->bh);
+    acb->common.cb(acb->common.opaque, 0);
+    qemu_aio_release(acb);
+}
+
+static BlockDriverAIOCB *raw_nowait_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVRawState *s = bs->opaque;
+    RawNowaitAIOCB *acb;
+    ssize_t len;
+
+    do {
+        len = preadv2(s->fd, qiov->iov, qiov->niov,
+                      sector_num * BDRV_SECTOR_SIZE, RWF_NOWAIT);
+    } while (len < 0 && errno == EINTR);
+
+    /* Short reads, e.g. at end of file, are left to the worker as well */
+    if (len != (ssize_t)nb_sectors * BDRV_SECTOR_SIZE) {
+        if (len < 0 && (errno == EOPNOTSUPP || errno == ENOSYS ||
+                        errno == EINVAL)) {
+            s->has_nowait_read = false;
+        }
+        trace_raw_nowait_readv(bs, sector_num, nb_sectors, false);
+        return NULL;
+    }
+    trace_raw_nowait_readv(bs, sector_num, nb_sectors, true);
+
+    /* The callback must not run before we return to the caller */
+    acb = qemu_aio_get(&raw_nowait_aiocb_info, bs, cb, opaque);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), raw_nowait_bh, acb);
+    qemu_bh_schedule(acb->bh);
+    return &acb->common;
+}
+#endif
+
 static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type)
@@ -929,6 +1260,17 @@ static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+#ifdef CONFIG_PREADV2
+    if (type == QEMU_AIO_READ && s->has_nowait_read &&
+        !(bs->open_flags & BDRV_O_NOCACHE) && qiov->niov <= IOV_MAX) {
+        BlockDriverAIOCB *acb = raw_nowait_readv(bs, sector_num, qiov,
+                                                 nb_sectors, cb, opaque);
+        if (acb) {
+            return acb;
+        }
+    }
+#endif
+
     /*
      * If O_DIRECT is used the buffer needs to be aligned on a sector
      * boundary.  Check if this is the case or tell the low-level
@@ -976,9 +1318,74 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
+static void raw_detach_aio_context(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->aio_ctx) {
+        laio_detach_aio_context(s->aio_ctx, bdrv_get_aio_context(bs));
+    }
+#endif
+#if defined(__linux__)
+    hdev_sg_set_handler(bs, bdrv_get_aio_context(bs), false);
+#endif
+}
+
+static void raw_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->aio_ctx) {
+        laio_attach_aio_context(s->aio_ctx, new_context);
+    }
+#endif
+#if defined(__linux__)
+    hdev_sg_set_handler(bs, new_context, true);
+#endif
+}
+
+static void raw_aio_plug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+    if (s->use_aio) {
+        laio_io_plug(bs, s->aio_ctx);
+    }
+#endif
+}
+
+static void raw_aio_unplug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+    if (s->use_aio) {
+        laio_io_unplug(bs, s->aio_ctx, true);
+    }
+#endif
+}
+
+static void raw_aio_flush_io_queue(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+    if (s->use_aio) {
+        laio_io_unplug(bs, s->aio_ctx, false);
+    }
+#endif
+}
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
+
+#if defined(__linux__)
+    hdev_sg_drain(bs);
+    hdev_sg_set_handler(bs, bdrv_get_aio_context(bs), false);
+    s->sg_async = false;
+#endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -1314,15 +1721,20 @@ static int coroutine_fn raw_co_write_zeroes(
     int nb_sectors, BdrvRequestFlags flags)
 {
     BDRVRawState *s = bs->opaque;
+    int ret;
 
-    if (!(flags & BDRV_REQ_MAY_UNMAP)) {
-        return paio_submit_co(bs, s->fd, sector_num, NULL, nb_sectors,
-                              QEMU_AIO_WRITE_ZEROES);
-    } else if (s->discard_zeroes) {
-        return paio_submit_co(bs, s->fd, sector_num, NULL, nb_sectors,
-                              QEMU_AIO_DISCARD);
+    /* When unmapping is allowed but does not work, zero the range without
+     * unmapping instead of leaving it to the block layer's bounce buffer.
+     */
+    if ((flags & BDRV_REQ_MAY_UNMAP) && s->discard_zeroes) {
+        ret = paio_submit_co(bs, s->fd, sector_num, NULL, nb_sectors,
+                             QEMU_AIO_DISCARD);
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
     }
-    return -ENOTSUP;
+    return paio_submit_co(bs, s->fd, sector_num, NULL, nb_sectors,
+                          QEMU_AIO_WRITE_ZEROES);
 }
 
 static int raw_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
@@ -1370,6 +1782,12 @@ static BlockDriver bdrv_file = {
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
 
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_flush_io_queue = raw_aio_flush_io_queue,
+
     .create_options = raw_create_options,
 };
 
@@ -1548,6 +1966,21 @@ static int hdev_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
+#if defined(__linux__)
+    /* write() and read() on the descriptor need the version 3 sg driver */
+    QTAILQ_INIT(&s->sg_waiting);
+    if (bs->sg) {
+        int version;
+
+        if (ioctl(s->fd, SG_GET_VERSION_NUM, &version) == 0 &&
+            version >= 30000 &&
+            fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK) == 0) {
+            s->sg_async = true;
+            hdev_sg_set_handler(bs, bdrv_get_aio_context(bs), true);
+        }
+    }
+#endif
+
     return ret;
 }
 
@@ -1619,6 +2052,13 @@ static BlockDriverAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+    if (req == SG_IO && s->sg_async) {
+        BlockDriverAIOCB *sg_acb = hdev_sg_aio_ioctl(bs, buf, cb, opaque);
+        if (sg_acb) {
+            return sg_acb;
+        }
+    }
+
     acb = g_slice_new(RawPosixAIOData);
     acb->bs = bs;
     acb->aio_type = QEMU_AIO_IOCTL;
@@ -1672,14 +2112,15 @@ static coroutine_fn int hdev_co_write_zeroes(BlockDriverState *bs,
     if (rc < 0) {
         return rc;
     }
-    if (!(flags & BDRV_REQ_MAY_UNMAP)) {
-        return paio_submit_co(bs, s->fd, sector_num, NULL, nb_sectors,
-                              QEMU_AIO_WRITE_ZEROES|QEMU_AIO_BLKDEV);
-    } else if (s->discard_zeroes) {
-        return paio_submit_co(bs, s->fd, sector_num, NULL, nb_sectors,
-                              QEMU_AIO_DISCARD|QEMU_AIO_BLKDEV);
+    if ((flags & BDRV_REQ_MAY_UNMAP) && s->discard_zeroes) {
+        rc = paio_submit_co(bs, s->fd, sector_num, NULL, nb_sectors,
+                            QEMU_AIO_DISCARD|QEMU_AIO_BLKDEV);
+        if (rc != -ENOTSUP) {
+            return rc;
+        }
     }
-    return -ENOTSUP;
+    return paio_submit_co(bs, s->fd, sector_num, NULL, nb_sectors,
+                          QEMU_AIO_WRITE_ZEROES|QEMU_AIO_BLKDEV);
 }
 
 static int hdev_create(const char *filename, QEMUOptionParameter *options,
@@ -1747,6 +2188,12 @@ static BlockDriver bdrv_host_device = {
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
 
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_flush_io_queue = raw_aio_flush_io_queue,
+
     /* generic scsi device */
 #ifdef __linux__
     .bdrv_ioctl         = hdev_ioctl,
@@ -1878,6 +2325,12 @@ static BlockDriver bdrv_host_floppy = {
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
 
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_flush_io_queue = raw_aio_flush_io_queue,
+
     /* removable device support */
     .bdrv_is_inserted   = floppy_is_inserted,
     .bdrv_media_changed = floppy_media_changed,
@@ -1988,6 +2441,12 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
 
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_flush_io_queue = raw_aio_flush_io_queue,
+
     /* removable device support */
     .bdrv_is_inserted   = cdrom_is_inserted,
     .bdrv_eject         = cdrom_eject,
@@ -2117,6 +2576,12 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
 
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_flush_io_queue = raw_aio_flush_io_queue,
+
     /* removable device support */
     .bdrv_is_inserted   = cdrom_is_inserted,
     .bdrv_eject         = cdrom_eject,
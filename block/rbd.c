@@ -16,6 +16,7 @@
 #include "qemu-common.h"
 #include "qemu/error-report.h"
 #include "block/block_int.h"
+#include "block/completion-queue.h"
 
 #include <rbd/librbd.h>
 
@@ -51,6 +52,13 @@
 #undef LIBRBD_SUPPORTS_DISCARD
 #endif
 
+/* rbd_aio_readv and rbd_aio_writev added in 1.12.0 */
+#if LIBRBD_VERSION_CODE >= LIBRBD_VERSION(1, 12, 0)
+#define LIBRBD_SUPPORTS_IOVEC
+#else
+#undef LIBRBD_SUPPORTS_IOVEC
+#endif
+
 #define OBJ_MAX_SIZE (1UL << OBJ_DEFAULT_OBJ_ORDER)
 
 #define RBD_MAX_CONF_NAME_SIZE 128
@@ -60,6 +68,12 @@
 #define RBD_MAX_SNAP_NAME_SIZE 128
 #define RBD_MAX_SNAPS 100
 
+/* Without vectored I/O in librbd, requests go through a bounce buffer.  A
+ * few of them are kept around instead of allocating one for each request.
+ */
+#define RBD_BOUNCE_POOL_SIZE 8
+#define RBD_BOUNCE_MIN_SIZE (64 * 1024)
+
 typedef enum {
     RBD_AIO_READ,
     RBD_AIO_WRITE,
@@ -69,7 +83,6 @@ typedef enum {
 
 typedef struct RBDAIOCB {
     BlockDriverAIOCB common;
-    QEMUBH *bh;
     int64_t ret;
     QEMUIOVector *qiov;
     char *bounce;
@@ -82,6 +95,7 @@ typedef struct RBDAIOCB {
 } RBDAIOCB;
 
 typedef struct RADOSCB {
+    BlockCompletion comp;
     int rcbid;
     RBDAIOCB *acb;
     struct BDRVRBDState *s;
@@ -91,21 +105,64 @@ typedef struct RADOSCB {
     int64_t ret;
 } RADOSCB;
 
-#define RBD_FD_READ 0
-#define RBD_FD_WRITE 1
-
 typedef struct BDRVRBDState {
-    int fds[2];
+    BlockCompletionQueue completions;
     rados_t cluster;
     rados_ioctx_t io_ctx;
     rbd_image_t image;
     char name[RBD_MAX_IMAGE_NAME_SIZE];
     char *snap;
-    int event_reader_pos;
-    RADOSCB *event_rcb;
+    int nb_bounce;
+    char *bounce_pool[RBD_BOUNCE_POOL_SIZE];
+    size_t bounce_size[RBD_BOUNCE_POOL_SIZE];
 } BDRVRBDState;
 
-static void rbd_aio_bh_cb(void *opaque);
+static size_t qemu_rbd_bounce_size(size_t size)
+{
+    size_t n = RBD_BOUNCE_MIN_SIZE;
+
+    while (n < size) {
+        n <<= 1;
+    }
+    return n;
+}
+
+#ifndef LIBRBD_SUPPORTS_IOVEC
+/* Get a bounce buffer of at least @size bytes from the pool, or allocate
+ * one rounded up to a power of two so that it can be reused for requests
+ * of similar size.
+ */
+static char *qemu_rbd_get_bounce(BlockDriverState *bs, size_t size)
+{
+    BDRVRBDState *s = bs->opaque;
+    char *buf;
+    int i;
+
+    for (i = s->nb_bounce; i-- > 0; ) {
+        if (s->bounce_size[i] >= size) {
+            buf = s->bounce_pool[i];
+            s->nb_bounce--;
+            s->bounce_pool[i] = s->bounce_pool[s->nb_bounce];
+            s->bounce_size[i] = s->bounce_size[s->nb_bounce];
+            return buf;
+        }
+    }
+    return qemu_blockalign(bs, qemu_rbd_bounce_size(size));
+}
+#endif
+
+/* Return a buffer obtained with qemu_rbd_get_bounce() to the pool */
+static void qemu_rbd_put_bounce(BDRVRBDState *s, char *buf, size_t size)
+{
+    size = qemu_rbd_bounce_size(size);
+    if (s->nb_bounce == RBD_BOUNCE_POOL_SIZE || size > OBJ_MAX_SIZE) {
+        qemu_vfree(buf);
+        return;
+    }
+    s->bounce_pool[s->nb_bounce] = buf;
+    s->bounce_size[s->nb_bounce] = size;
+    s->nb_bounce++;
+}
 
 static int qemu_rbd_next_tok(char *dst, int dst_len,
                              char *src, char delim,
@@ -368,13 +425,23 @@ static int qemu_rbd_create(const char *filename, QEMUOptionParameter *options,
     return ret;
 }
 
+/* Zero the part of a read that librbd did not fill, starting at @offs */
+static void qemu_rbd_memset(RADOSCB *rcb, int64_t offs)
+{
+    if (rcb->buf) {
+        memset(rcb->buf + offs, 0, rcb->size - offs);
+    } else {
+        qemu_iovec_memset(rcb->acb->qiov, offs, 0, rcb->size - offs);
+    }
+}
+
 /*
- * This aio completion is being called from qemu_rbd_aio_event_reader()
- * and runs in qemu context. It schedules a bh, but just in case the aio
- * was not cancelled before.
+ * This aio completion is being called from the completion queue and runs
+ * in the AioContext of the BlockDriverState.
  */
-static void qemu_rbd_complete_aio(RADOSCB *rcb)
+static void qemu_rbd_complete_aio(BlockCompletion *comp)
 {
+    RADOSCB *rcb = container_of(comp, RADOSCB, comp);
     RBDAIOCB *acb = rcb->acb;
     int64_t r;
 
@@ -389,11 +456,11 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
         }
     } else {
         if (r < 0) {
-            memset(rcb->buf, 0, rcb->size);
+            qemu_rbd_memset(rcb, 0);
             acb->ret = r;
             acb->error = 1;
         } else if (r < rcb->size) {
-            memset(rcb->buf + r, 0, rcb->size - r);
+            qemu_rbd_memset(rcb, r);
             if (!acb->error) {
                 acb->ret = rcb->size;
             }
@@ -401,36 +468,21 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
             acb->ret = r;
         }
     }
-    /* Note that acb->bh can be NULL in case where the aio was cancelled */
-    acb->bh = qemu_bh_new(rbd_aio_bh_cb, acb);
-    qemu_bh_schedule(acb->bh);
     g_free(rcb);
-}
-
-/*
- * aio fd read handler. It runs in the qemu context and calls the
- * completion handling of completed rados aio operations.
- */
-static void qemu_rbd_aio_event_reader(void *opaque)
-{
-    BDRVRBDState *s = opaque;
 
-    ssize_t ret;
-
-    do {
-        char *p = (char *)&s->event_rcb;
-
-        /* now read the rcb pointer that was sent from a non qemu thread */
-        ret = read(s->fds[RBD_FD_READ], p + s->event_reader_pos,
-                   sizeof(s->event_rcb) - s->event_reader_pos);
-        if (ret > 0) {
-            s->event_reader_pos += ret;
-            if (s->event_reader_pos == sizeof(s->event_rcb)) {
-                s->event_reader_pos = 0;
-                qemu_rbd_complete_aio(s->event_rcb);
-            }
+    if (acb->bounce) {
+        if (acb->cmd == RBD_AIO_READ) {
+            qemu_iovec_from_buf(acb->qiov, 0, acb->bounce, acb->qiov->size);
         }
-    } while (ret < 0 && errno == EINTR);
+        qemu_rbd_put_bounce(acb->s, acb->bounce, acb->qiov->size);
+        acb->bounce = NULL;
+    }
+    acb->common.cb(acb->common.opaque, (acb->ret > 0 ? 0 : acb->ret));
+    acb->status = 0;
+
+    if (!acb->cancelled) {
+        qemu_aio_release(acb);
+    }
 }
 
 /* TODO Convert to fine grained options */
@@ -538,17 +590,11 @@ static int qemu_rbd_open(BlockDriverState *bs, QDict *options, int flags,
 
     bs->read_only = (s->snap != NULL);
 
-    s->event_reader_pos = 0;
-    r = qemu_pipe(s->fds);
+    r = block_completion_queue_init(&s->completions, bdrv_get_aio_context(bs));
     if (r < 0) {
         error_report("error opening eventfd");
         goto failed;
     }
-    fcntl(s->fds[0], F_SETFL, O_NONBLOCK);
-    fcntl(s->fds[1], F_SETFL, O_NONBLOCK);
-    qemu_aio_set_fd_handler(s->fds[RBD_FD_READ], qemu_rbd_aio_event_reader,
-                            NULL, s);
-
 
     qemu_opts_del(opts);
     return 0;
@@ -569,14 +615,16 @@ static void qemu_rbd_close(BlockDriverState *bs)
 {
     BDRVRBDState *s = bs->opaque;
 
-    close(s->fds[0]);
-    close(s->fds[1]);
-    qemu_aio_set_fd_handler(s->fds[RBD_FD_READ], NULL, NULL, NULL);
+    block_completion_queue_cleanup(&s->completions);
 
     rbd_close(s->image);
     rados_ioctx_destroy(s->io_ctx);
     g_free(s->snap);
     rados_shutdown(s->cluster);
+
+    while (s->nb_bounce > 0) {
+        qemu_vfree(s->bounce_pool[--s->nb_bounce]);
+    }
 }
 
 /*
@@ -589,7 +637,7 @@ static void qemu_rbd_aio_cancel(BlockDriverAIOCB *blockacb)
     acb->cancelled = 1;
 
     while (acb->status == -EINPROGRESS) {
-        qemu_aio_wait();
+        aio_poll(bdrv_get_aio_context(acb->common.bs), true);
     }
 
     qemu_aio_release(acb);
@@ -600,75 +648,20 @@ static const AIOCBInfo rbd_aiocb_info = {
     .cancel = qemu_rbd_aio_cancel,
 };
 
-static int qemu_rbd_send_pipe(BDRVRBDState *s, RADOSCB *rcb)
-{
-    int ret = 0;
-    while (1) {
-        fd_set wfd;
-        int fd = s->fds[RBD_FD_WRITE];
-
-        /* send the op pointer to the qemu thread that is responsible
-           for the aio/op completion. Must do it in a qemu thread context */
-        ret = write(fd, (void *)&rcb, sizeof(rcb));
-        if (ret >= 0) {
-            break;
-        }
-        if (errno == EINTR) {
-            continue;
-        }
-        if (errno != EAGAIN) {
-            break;
-        }
-
-        FD_ZERO(&wfd);
-        FD_SET(fd, &wfd);
-        do {
-            ret = select(fd + 1, NULL, &wfd, NULL, NULL);
-        } while (ret < 0 && errno == EINTR);
-    }
-
-    return ret;
-}
-
 /*
  * This is the callback function for rbd_aio_read and _write
  *
  * Note: this function is being called from a non qemu thread so
  * we need to be careful about what we do here. Generally we only
- * write to the block notification pipe, and do the rest of the
- * io completion handling from qemu_rbd_aio_event_reader() which
- * runs in a qemu context.
+ * queue the rcb, and do the rest of the io completion handling from
+ * qemu_rbd_complete_aio() which runs in a qemu context.
  */
 static void rbd_finish_aiocb(rbd_completion_t c, RADOSCB *rcb)
 {
-    int ret;
     rcb->ret = rbd_aio_get_return_value(c);
     rbd_aio_release(c);
-    ret = qemu_rbd_send_pipe(rcb->s, rcb);
-    if (ret < 0) {
-        error_report("failed writing to acb->s->fds");
-        g_free(rcb);
-    }
-}
-
-/* Callback when all queued rbd_aio requests are complete */
-
-static void rbd_aio_bh_cb(void *opaque)
-{
-    RBDAIOCB *acb = opaque;
-
-    if (acb->cmd == RBD_AIO_READ) {
-        qemu_iovec_from_buf(acb->qiov, 0, acb->bounce, acb->qiov->size);
-    }
-    qemu_vfree(acb->bounce);
-    acb->common.cb(acb->common.opaque, (acb->ret > 0 ? 0 : acb->ret));
-    qemu_bh_delete(acb->bh);
-    acb->bh = NULL;
-    acb->status = 0;
-
-    if (!acb->cancelled) {
-        qemu_aio_release(acb);
-    }
+    block_completion_queue_push(&rcb->s->completions, &rcb->comp,
+                                qemu_rbd_complete_aio);
 }
 
 static int rbd_aio_discard_wrapper(rbd_image_t image,
@@ -713,19 +706,19 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
     acb = qemu_aio_get(&rbd_aiocb_info, bs, cb, opaque);
     acb->cmd = cmd;
     acb->qiov = qiov;
-    if (cmd == RBD_AIO_DISCARD || cmd == RBD_AIO_FLUSH) {
-        acb->bounce = NULL;
-    } else {
-        acb->bounce = qemu_blockalign(bs, qiov->size);
+    acb->bounce = NULL;
+#ifndef LIBRBD_SUPPORTS_IOVEC
+    if (cmd == RBD_AIO_READ || cmd == RBD_AIO_WRITE) {
+        acb->bounce = qemu_rbd_get_bounce(bs, qiov->size);
     }
+#endif
     acb->ret = 0;
     acb->error = 0;
     acb->s = s;
     acb->cancelled = 0;
-    acb->bh = NULL;
     acb->status = -EINPROGRESS;
 
-    if (cmd == RBD_AIO_WRITE) {
+    if (cmd == RBD_AIO_WRITE && acb->bounce) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
     }
 
@@ -747,10 +740,18 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
 
     switch (cmd) {
     case RBD_AIO_WRITE:
+#ifdef LIBRBD_SUPPORTS_IOVEC
+        r = rbd_aio_writev(s->image, qiov->iov, qiov->niov, off, c);
+#else
         r = rbd_aio_write(s->image, off, size, buf, c);
+#endif
         break;
     case RBD_AIO_READ:
+#ifdef LIBRBD_SUPPORTS_IOVEC
+        r = rbd_aio_readv(s->image, qiov->iov, qiov->niov, off, c);
+#else
         r = rbd_aio_read(s->image, off, size, buf, c);
+#endif
         break;
     case RBD_AIO_DISCARD:
         r = rbd_aio_discard_wrapper(s->image, off, size, c);
@@ -763,6 +764,7 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
     }
 
     if (r < 0) {
+        rbd_aio_release(c);
         goto failed;
     }
 
@@ -770,6 +772,9 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
 
 failed:
     g_free(rcb);
+    if (acb->bounce) {
+        qemu_rbd_put_bounce(s, acb->bounce, qiov->size);
+    }
     qemu_aio_release(acb);
     return NULL;
 }
@@ -986,6 +991,21 @@ static BlockDriverAIOCB* qemu_rbd_aio_discard(BlockDriverState *bs,
 }
 #endif
 
+static void qemu_rbd_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVRBDState *s = bs->opaque;
+
+    block_completion_queue_detach_aio_context(&s->completions);
+}
+
+static void qemu_rbd_attach_aio_context(BlockDriverState *bs,
+                                        AioContext *new_context)
+{
+    BDRVRBDState *s = bs->opaque;
+
+    block_completion_queue_attach_aio_context(&s->completions, new_context);
+}
+
 static QEMUOptionParameter qemu_rbd_create_options[] = {
     {
      .name = BLOCK_OPT_SIZE,
@@ -1014,6 +1034,9 @@ static BlockDriver bdrv_rbd = {
     .bdrv_truncate      = qemu_rbd_truncate,
     .protocol_name      = "rbd",
 
+    .bdrv_detach_aio_context = qemu_rbd_detach_aio_context,
+    .bdrv_attach_aio_context = qemu_rbd_attach_aio_context,
+
     .bdrv_aio_readv         = qemu_rbd_aio_readv,
     .bdrv_aio_writev        = qemu_rbd_aio_writev,
 
@@ -23,6 +23,7 @@
 
 #define SD_DEFAULT_ADDR "localhost"
 #define SD_DEFAULT_PORT 7000
+#define SD_MAX_CONNECTIONS 16
 
 #define SD_OP_CREATE_AND_WRITE_OBJ  0x01
 #define SD_OP_READ_OBJ       0x02
@@ -271,9 +272,24 @@ static inline bool is_snapshot(struct SheepdogInode *inode)
 #endif
 
 typedef struct SheepdogAIOCB SheepdogAIOCB;
+typedef struct BDRVSheepdogState BDRVSheepdogState;
+
+/* A connection for object I/O */
+typedef struct SheepdogConn {
+    BDRVSheepdogState *s;
+    int fd;
+
+    CoMutex lock;
+    Coroutine *co_send;
+    Coroutine *co_recv;
+
+    /* Requests sent on this connection and not answered yet */
+    unsigned int in_flight;
+} SheepdogConn;
 
 typedef struct AIOReq {
     SheepdogAIOCB *aiocb;
+    SheepdogConn *conn;
     unsigned int iov_offset;
 
     uint64_t oid;
@@ -312,7 +328,7 @@ struct SheepdogAIOCB {
     int nr_pending;
 };
 
-typedef struct BDRVSheepdogState {
+struct BDRVSheepdogState {
     BlockDriverState *bs;
 
     SheepdogInode inode;
@@ -327,11 +343,14 @@ typedef struct BDRVSheepdogState {
 
     char *host_spec;
     bool is_unix;
-    int fd;
 
-    CoMutex lock;
-    Coroutine *co_send;
-    Coroutine *co_recv;
+    /*
+     * Data objects are spread over the connections by index, so requests
+     * to one object are always sent on the same connection; everything
+     * else goes to the first one.
+     */
+    SheepdogConn conns[SD_MAX_CONNECTIONS];
+    int nr_conns;
 
     uint32_t aioreq_seq_num;
 
@@ -339,7 +358,11 @@ typedef struct BDRVSheepdogState {
     QLIST_HEAD(inflight_aio_head, AIOReq) inflight_aio_head;
     QLIST_HEAD(pending_aio_head, AIOReq) pending_aio_head;
     QLIST_HEAD(failed_aio_head, AIOReq) failed_aio_head;
-} BDRVSheepdogState;
+
+    unsigned int max_in_flight;
+    uint64_t nr_allocations;
+    uint64_t nr_inode_updates;
+};
 
 static const char * sd_strerror(int err)
 {
@@ -396,10 +419,13 @@ static const char * sd_strerror(int err)
  *    receiving the response.
  *
  * 2. We receive the response in aio_read_response, the fd handler to
- *    the sheepdog connection.  If metadata update is needed, we send
- *    the write request to the vdi object in sd_write_done, the write
- *    completion function.  We switch back to sd_co_readv/writev after
- *    all the requests belonging to the AIOCB are finished.
+ *    the sheepdog connection.  We switch back to sd_co_readv/writev
+ *    after all the requests belonging to the AIOCB are finished.
+ *
+ * 3. Newly allocated objects only update the in-memory inode.  The
+ *    dirty part of the vdi object is written on the next flush, so
+ *    that a burst of allocating writes costs one metadata update
+ *    instead of one per request.
  */
 
 static inline AIOReq *alloc_aio_req(BDRVSheepdogState *s, SheepdogAIOCB *acb,
@@ -672,7 +698,7 @@ static void coroutine_fn add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
                            enum AIOCBState aiocb_type);
 static void coroutine_fn resend_aioreq(BDRVSheepdogState *s, AIOReq *aio_req);
 static int reload_inode(BDRVSheepdogState *s, uint32_t snapid, const char *tag);
-static int get_sheep_fd(BDRVSheepdogState *s);
+static int get_sheep_fd(SheepdogConn *conn);
 static void co_write_request(void *opaque);
 
 static AIOReq *find_pending_req(BDRVSheepdogState *s, uint64_t oid)
@@ -709,22 +735,23 @@ static void coroutine_fn send_pending_req(BDRVSheepdogState *s, uint64_t oid)
 
 static coroutine_fn void reconnect_to_sdog(void *opaque)
 {
-    BDRVSheepdogState *s = opaque;
+    SheepdogConn *conn = opaque;
+    BDRVSheepdogState *s = conn->s;
     AIOReq *aio_req, *next;
 
-    qemu_aio_set_fd_handler(s->fd, NULL, NULL, NULL);
-    close(s->fd);
-    s->fd = -1;
+    qemu_aio_set_fd_handler(conn->fd, NULL, NULL, NULL);
+    close(conn->fd);
+    conn->fd = -1;
 
     /* Wait for outstanding write requests to be completed. */
-    while (s->co_send != NULL) {
+    while (conn->co_send != NULL) {
         co_write_request(opaque);
     }
 
     /* Try to reconnect the sheepdog server every one second. */
-    while (s->fd < 0) {
-        s->fd = get_sheep_fd(s);
-        if (s->fd < 0) {
+    while (conn->fd < 0) {
+        conn->fd = get_sheep_fd(conn);
+        if (conn->fd < 0) {
             DPRINTF("Wait for connection to be established\n");
             co_aio_sleep_ns(bdrv_get_aio_context(s->bs), QEMU_CLOCK_REALTIME,
                             1000000000ULL);
@@ -736,12 +763,17 @@ static coroutine_fn void reconnect_to_sdog(void *opaque)
      * resend_aioreq() can yield and newly created requests can be added to the
      * inflight queue before the coroutine is resumed.  To avoid mixing them, we
      * have to move all the inflight requests to the failed queue before
-     * resend_aioreq() is called.
+     * resend_aioreq() is called.  Requests on the other connections are
+     * not affected.
      */
     QLIST_FOREACH_SAFE(aio_req, &s->inflight_aio_head, aio_siblings, next) {
+        if (aio_req->conn != conn) {
+            continue;
+        }
         QLIST_REMOVE(aio_req, aio_siblings);
         QLIST_INSERT_HEAD(&s->failed_aio_head, aio_req, aio_siblings);
     }
+    conn->in_flight = 0;
 
     /* Resend all the failed aio requests. */
     while (!QLIST_EMPTY(&s->failed_aio_head)) {
@@ -756,13 +788,14 @@ static coroutine_fn void reconnect_to_sdog(void *opaque)
  * Receive responses of the I/O requests.
  *
  * This function is registered as a fd handler, and called from the
- * main loop when s->fd is ready for reading responses.
+ * main loop when a connection is ready for reading responses.
  */
 static void coroutine_fn aio_read_response(void *opaque)
 {
     SheepdogObjRsp rsp;
-    BDRVSheepdogState *s = opaque;
-    int fd = s->fd;
+    SheepdogConn *conn = opaque;
+    BDRVSheepdogState *s = conn->s;
+    int fd = conn->fd;
     int ret;
     AIOReq *aio_req = NULL;
     SheepdogAIOCB *acb;
@@ -787,12 +820,13 @@ static void coroutine_fn aio_read_response(void *opaque)
     }
 
     acb = aio_req->aiocb;
+    conn->in_flight--;
 
     switch (acb->aiocb_type) {
     case AIOCB_WRITE_UDATA:
         /* this coroutine context is no longer suitable for co_recv
-         * because we may send data to update vdi objects */
-        s->co_recv = NULL;
+         * because we may send pending requests */
+        conn->co_recv = NULL;
         if (!is_data_obj(aio_req->oid)) {
             break;
         }
@@ -809,6 +843,7 @@ static void coroutine_fn aio_read_response(void *opaque)
                 s->inode.data_vdi_id[idx] = s->inode.vdi_id;
                 s->max_dirty_data_idx = MAX(idx, s->max_dirty_data_idx);
                 s->min_dirty_data_idx = MIN(idx, s->min_dirty_data_idx);
+                s->nr_allocations++;
             }
             /*
              * Some requests may be blocked because simultaneous
@@ -854,6 +889,11 @@ static void coroutine_fn aio_read_response(void *opaque)
     case SD_RES_SUCCESS:
         break;
     case SD_RES_READONLY:
+        /*
+         * Somebody took a snapshot behind our back.  Allocations that were
+         * not flushed yet are lost from the snapshot's inode, just like
+         * data still sitting in the object cache.
+         */
         if (s->inode.vdi_id == oid_to_vid(aio_req->oid)) {
             ret = reload_inode(s, 0, "");
             if (ret < 0) {
@@ -883,29 +923,29 @@ static void coroutine_fn aio_read_response(void *opaque)
         acb->aio_done_func(acb);
     }
 out:
-    s->co_recv = NULL;
+    conn->co_recv = NULL;
     return;
 err:
-    s->co_recv = NULL;
+    conn->co_recv = NULL;
     reconnect_to_sdog(opaque);
 }
 
 static void co_read_response(void *opaque)
 {
-    BDRVSheepdogState *s = opaque;
+    SheepdogConn *conn = opaque;
 
-    if (!s->co_recv) {
-        s->co_recv = qemu_coroutine_create(aio_read_response);
+    if (!conn->co_recv) {
+        conn->co_recv = qemu_coroutine_create(aio_read_response);
     }
 
-    qemu_coroutine_enter(s->co_recv, opaque);
+    qemu_coroutine_enter(conn->co_recv, opaque);
 }
 
 static void co_write_request(void *opaque)
 {
-    BDRVSheepdogState *s = opaque;
+    SheepdogConn *conn = opaque;
 
-    qemu_coroutine_enter(s->co_send, NULL);
+    qemu_coroutine_enter(conn->co_send, NULL);
 }
 
 /*
@@ -914,19 +954,38 @@ static void co_write_request(void *opaque)
  * We cannot use this discriptor for other operations because
  * the block driver may be on waiting response from the server.
  */
-static int get_sheep_fd(BDRVSheepdogState *s)
+static int get_sheep_fd(SheepdogConn *conn)
 {
     int fd;
 
-    fd = connect_to_sdog(s);
+    fd = connect_to_sdog(conn->s);
     if (fd < 0) {
         return fd;
     }
 
-    qemu_aio_set_fd_handler(fd, co_read_response, NULL, s);
+    qemu_aio_set_fd_handler(fd, co_read_response, NULL, conn);
     return fd;
 }
 
+static SheepdogConn *sd_get_conn(BDRVSheepdogState *s, uint64_t oid)
+{
+    if (!is_data_obj(oid)) {
+        return &s->conns[0];
+    }
+    return &s->conns[data_oid_to_idx(oid) % s->nr_conns];
+}
+
+static unsigned int sd_in_flight(BDRVSheepdogState *s)
+{
+    unsigned int n = 0;
+    int i;
+
+    for (i = 0; i < s->nr_conns; i++) {
+        n += s->conns[i].in_flight;
+    }
+    return n;
+}
+
 static int sd_parse_uri(BDRVSheepdogState *s, const char *filename,
                         char *vdi, uint32_t *snapid, char *tag)
 {
@@ -1129,6 +1188,7 @@ static void coroutine_fn add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
     uint64_t offset = aio_req->offset;
     uint8_t flags = aio_req->flags;
     uint64_t old_oid = aio_req->base_oid;
+    SheepdogConn *conn;
 
     if (!nr_copies) {
         error_report("bug");
@@ -1171,29 +1231,35 @@ static void coroutine_fn add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
 
     hdr.id = aio_req->id;
 
-    qemu_co_mutex_lock(&s->lock);
-    s->co_send = qemu_coroutine_self();
-    qemu_aio_set_fd_handler(s->fd, co_read_response, co_write_request, s);
-    socket_set_cork(s->fd, 1);
+    conn = sd_get_conn(s, oid);
+    aio_req->conn = conn;
+    conn->in_flight++;
+    s->max_in_flight = MAX(s->max_in_flight, sd_in_flight(s));
+
+    qemu_co_mutex_lock(&conn->lock);
+    conn->co_send = qemu_coroutine_self();
+    qemu_aio_set_fd_handler(conn->fd, co_read_response, co_write_request,
+                            conn);
+    socket_set_cork(conn->fd, 1);
 
     /* send a header */
-    ret = qemu_co_send(s->fd, &hdr, sizeof(hdr));
+    ret = qemu_co_send(conn->fd, &hdr, sizeof(hdr));
     if (ret != sizeof(hdr)) {
         error_report("failed to send a req, %s", strerror(errno));
         goto out;
     }
 
     if (wlen) {
-        ret = qemu_co_sendv(s->fd, iov, niov, aio_req->iov_offset, wlen);
+        ret = qemu_co_sendv(conn->fd, iov, niov, aio_req->iov_offset, wlen);
         if (ret != wlen) {
             error_report("failed to send a data, %s", strerror(errno));
         }
     }
 out:
-    socket_set_cork(s->fd, 0);
-    qemu_aio_set_fd_handler(s->fd, co_read_response, NULL, s);
-    s->co_send = NULL;
-    qemu_co_mutex_unlock(&s->lock);
+    socket_set_cork(conn->fd, 0);
+    qemu_aio_set_fd_handler(conn->fd, co_read_response, NULL, conn);
+    conn->co_send = NULL;
+    qemu_co_mutex_unlock(&conn->lock);
 }
 
 static int read_write_object(int fd, char *buf, uint64_t oid, uint8_t copies,
@@ -1260,6 +1326,55 @@ static int write_object(int fd, char *buf, uint64_t oid, uint8_t copies,
                              create, cache_flags);
 }
 
+/*
+ * Get the part of the vdi object that must be written to record the
+ * objects allocated since the last update, if there are any.
+ */
+static bool sd_inode_dirty_range(BDRVSheepdogState *s, uint32_t *offset,
+                                 uint32_t *data_len)
+{
+    uint32_t mn = s->min_dirty_data_idx;
+    uint32_t mx = s->max_dirty_data_idx;
+
+    if (mn > mx) {
+        return false;
+    }
+
+    *offset = sizeof(s->inode) - sizeof(s->inode.data_vdi_id) +
+        mn * sizeof(s->inode.data_vdi_id[0]);
+    *data_len = (mx - mn + 1) * sizeof(s->inode.data_vdi_id[0]);
+    return true;
+}
+
+static void sd_inode_mark_clean(BDRVSheepdogState *s)
+{
+    s->min_dirty_data_idx = UINT32_MAX;
+    s->max_dirty_data_idx = 0;
+}
+
+/* Synchronously write the dirty part of the vdi object */
+static int sd_write_inode(BDRVSheepdogState *s, int fd)
+{
+    uint32_t offset, data_len;
+    int ret;
+
+    if (!sd_inode_dirty_range(s, &offset, &data_len)) {
+        return 0;
+    }
+
+    ret = write_object(fd, (char *)&s->inode + offset,
+                       vid_to_vdi_oid(s->inode.vdi_id), s->inode.nr_copies,
+                       data_len, offset, false, s->cache_flags);
+    if (ret < 0) {
+        error_report("failed to update the inode of %s", s->name);
+        return ret;
+    }
+
+    sd_inode_mark_clean(s);
+    s->nr_inode_updates++;
+    return 0;
+}
+
 /* update inode with the latest state */
 static int reload_inode(BDRVSheepdogState *s, uint32_t snapid, const char *tag)
 {
@@ -1364,14 +1479,34 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "URL to the sheepdog image",
         },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections for object I/O",
+        },
         { /* end of list */ }
     },
 };
 
+static void sd_close_conns(BDRVSheepdogState *s)
+{
+    int i;
+
+    for (i = 0; i < s->nr_conns; i++) {
+        SheepdogConn *conn = &s->conns[i];
+
+        if (conn->fd >= 0) {
+            qemu_aio_set_fd_handler(conn->fd, NULL, NULL, NULL);
+            closesocket(conn->fd);
+            conn->fd = -1;
+        }
+    }
+}
+
 static int sd_open(BlockDriverState *bs, QDict *options, int flags,
                    Error **errp)
 {
-    int ret, fd;
+    int ret, fd, i;
     uint32_t vid = 0;
     BDRVSheepdogState *s = bs->opaque;
     char vdi[SD_MAX_VDI_LEN], tag[SD_MAX_VDI_TAG_LEN];
@@ -1397,7 +1532,20 @@ static int sd_open(BlockDriverState *bs, QDict *options, int flags,
     QLIST_INIT(&s->inflight_aio_head);
     QLIST_INIT(&s->pending_aio_head);
     QLIST_INIT(&s->failed_aio_head);
-    s->fd = -1;
+
+    s->nr_conns = qemu_opt_get_number(opts, "connections", 1);
+    if (s->nr_conns < 1 || s->nr_conns > SD_MAX_CONNECTIONS) {
+        error_report("connections must be between 1 and %d",
+                     SD_MAX_CONNECTIONS);
+        s->nr_conns = 0;
+        ret = -EINVAL;
+        goto out;
+    }
+    for (i = 0; i < s->nr_conns; i++) {
+        s->conns[i].s = s;
+        s->conns[i].fd = -1;
+        qemu_co_mutex_init(&s->conns[i].lock);
+    }
 
     memset(vdi, 0, sizeof(vdi));
     memset(tag, 0, sizeof(tag));
@@ -1410,10 +1558,12 @@ static int sd_open(BlockDriverState *bs, QDict *options, int flags,
     if (ret < 0) {
         goto out;
     }
-    s->fd = get_sheep_fd(s);
-    if (s->fd < 0) {
-        ret = s->fd;
-        goto out;
+    for (i = 0; i < s->nr_conns; i++) {
+        s->conns[i].fd = get_sheep_fd(&s->conns[i]);
+        if (s->conns[i].fd < 0) {
+            ret = s->conns[i].fd;
+            goto out;
+        }
     }
 
     ret = find_vdi_name(s, vdi, snapid, tag, &vid, true);
@@ -1453,20 +1603,15 @@ static int sd_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     memcpy(&s->inode, buf, sizeof(s->inode));
-    s->min_dirty_data_idx = UINT32_MAX;
-    s->max_dirty_data_idx = 0;
+    sd_inode_mark_clean(s);
 
     bs->total_sectors = s->inode.vdi_size / BDRV_SECTOR_SIZE;
     pstrcpy(s->name, sizeof(s->name), vdi);
-    qemu_co_mutex_init(&s->lock);
     qemu_opts_del(opts);
     g_free(buf);
     return 0;
 out:
-    qemu_aio_set_fd_handler(s->fd, NULL, NULL, NULL);
-    if (s->fd >= 0) {
-        closesocket(s->fd);
-    }
+    sd_close_conns(s);
     qemu_opts_del(opts);
     g_free(buf);
     return ret;
@@ -1737,9 +1882,12 @@ static void sd_close(BlockDriverState *bs)
 
     fd = connect_to_sdog(s);
     if (fd < 0) {
-        return;
+        goto out;
     }
 
+    /* Nothing flushed the allocations with cache=unsafe */
+    sd_write_inode(s, fd);
+
     memset(&hdr, 0, sizeof(hdr));
 
     hdr.opcode = SD_OP_RELEASE_VDI;
@@ -1757,8 +1905,8 @@ static void sd_close(BlockDriverState *bs)
         error_report("%s, %s", sd_strerror(rsp->result), s->name);
     }
 
-    qemu_aio_set_fd_handler(s->fd, NULL, NULL, NULL);
-    closesocket(s->fd);
+out:
+    sd_close_conns(s);
     g_free(s->host_spec);
 }
 
@@ -1802,44 +1950,6 @@ static int sd_truncate(BlockDriverState *bs, int64_t offset)
     return ret;
 }
 
-/*
- * This function is called after writing data objects.  If we need to
- * update metadata, this sends a write request to the vdi object.
- * Otherwise, this switches back to sd_co_readv/writev.
- */
-static void coroutine_fn sd_write_done(SheepdogAIOCB *acb)
-{
-    BDRVSheepdogState *s = acb->common.bs->opaque;
-    struct iovec iov;
-    AIOReq *aio_req;
-    uint32_t offset, data_len, mn, mx;
-
-    mn = s->min_dirty_data_idx;
-    mx = s->max_dirty_data_idx;
-    if (mn <= mx) {
-        /* we need to update the vdi object. */
-        offset = sizeof(s->inode) - sizeof(s->inode.data_vdi_id) +
-            mn * sizeof(s->inode.data_vdi_id[0]);
-        data_len = (mx - mn + 1) * sizeof(s->inode.data_vdi_id[0]);
-
-        s->min_dirty_data_idx = UINT32_MAX;
-        s->max_dirty_data_idx = 0;
-
-        iov.iov_base = &s->inode;
-        iov.iov_len = sizeof(s->inode);
-        aio_req = alloc_aio_req(s, acb, vid_to_vdi_oid(s->inode.vdi_id),
-                                data_len, offset, 0, 0, offset);
-        QLIST_INSERT_HEAD(&s->inflight_aio_head, aio_req, aio_siblings);
-        add_aio_request(s, aio_req, &iov, 1, false, AIOCB_WRITE_UDATA);
-
-        acb->aio_done_func = sd_finish_aiocb;
-        acb->aiocb_type = AIOCB_WRITE_UDATA;
-        return;
-    }
-
-    sd_finish_aiocb(acb);
-}
-
 /* Delete current working VDI on the snapshot chain */
 static bool sd_delete(BDRVSheepdogState *s)
 {
@@ -2058,7 +2168,7 @@ static coroutine_fn int sd_co_writev(BlockDriverState *bs, int64_t sector_num,
     }
 
     acb = sd_aio_setup(bs, qiov, sector_num, nb_sectors);
-    acb->aio_done_func = sd_write_done;
+    acb->aio_done_func = sd_finish_aiocb;
     acb->aiocb_type = AIOCB_WRITE_UDATA;
 
     ret = sd_co_rw_vector(acb);
@@ -2093,16 +2203,57 @@ static coroutine_fn int sd_co_readv(BlockDriverState *bs, int64_t sector_num,
     return acb->ret;
 }
 
-static int coroutine_fn sd_co_flush_to_disk(BlockDriverState *bs)
+/* Write the dirty part of the vdi object, see sd_inode_dirty_range() */
+static int coroutine_fn sd_co_write_inode(BlockDriverState *bs)
 {
     BDRVSheepdogState *s = bs->opaque;
     SheepdogAIOCB *acb;
     AIOReq *aio_req;
+    struct iovec iov;
+    uint32_t offset, data_len, mn, mx;
 
-    if (s->cache_flags != SD_FLAG_CMD_CACHE) {
+    if (!sd_inode_dirty_range(s, &offset, &data_len)) {
         return 0;
     }
 
+    /* Objects allocated while the update is in flight start a new range */
+    mn = s->min_dirty_data_idx;
+    mx = s->max_dirty_data_idx;
+    sd_inode_mark_clean(s);
+
+    acb = sd_aio_setup(bs, NULL, 0, 0);
+    acb->aiocb_type = AIOCB_WRITE_UDATA;
+    acb->aio_done_func = sd_finish_aiocb;
+
+    iov.iov_base = &s->inode;
+    iov.iov_len = sizeof(s->inode);
+    aio_req = alloc_aio_req(s, acb, vid_to_vdi_oid(s->inode.vdi_id),
+                            data_len, offset, 0, 0, offset);
+    QLIST_INSERT_HEAD(&s->inflight_aio_head, aio_req, aio_siblings);
+    add_aio_request(s, aio_req, &iov, 1, false, AIOCB_WRITE_UDATA);
+    s->nr_inode_updates++;
+
+    qemu_coroutine_yield();
+
+    if (acb->ret < 0) {
+        s->min_dirty_data_idx = MIN(mn, s->min_dirty_data_idx);
+        s->max_dirty_data_idx = MAX(mx, s->max_dirty_data_idx);
+    }
+    return acb->ret;
+}
+
+static int coroutine_fn sd_co_flush_to_disk(BlockDriverState *bs)
+{
+    BDRVSheepdogState *s = bs->opaque;
+    SheepdogAIOCB *acb;
+    AIOReq *aio_req;
+    int ret;
+
+    ret = sd_co_write_inode(bs);
+    if (ret < 0 || s->cache_flags != SD_FLAG_CMD_CACHE) {
+        return ret;
+    }
+
     acb = sd_aio_setup(bs, NULL, 0, 0);
     acb->aiocb_type = AIOCB_FLUSH_CACHE;
     acb->aio_done_func = sd_finish_aiocb;
@@ -2153,6 +2304,12 @@ static int sd_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
         goto cleanup;
     }
 
+    /* The snapshot is cloned from the vdi object on the server */
+    ret = sd_write_inode(s, fd);
+    if (ret < 0) {
+        goto cleanup;
+    }
+
     ret = write_object(fd, (char *)&s->inode, vid_to_vdi_oid(s->inode.vdi_id),
                        s->inode.nr_copies, datalen, 0, false, s->cache_flags);
     if (ret < 0) {
@@ -2485,6 +2642,24 @@ static int64_t sd_get_allocated_file_size(BlockDriverState *bs)
     return size;
 }
 
+static BlockObjectStats *sd_get_object_stats(const BlockDriverState *bs)
+{
+    BDRVSheepdogState *s = bs->opaque;
+    BlockObjectStats *stats = g_new0(BlockObjectStats, 1);
+    AIOReq *aio_req;
+
+    stats->connections = s->nr_conns;
+    stats->in_flight = sd_in_flight(s);
+    stats->max_in_flight = s->max_in_flight;
+    QLIST_FOREACH(aio_req, &s->pending_aio_head, aio_siblings) {
+        stats->pending++;
+    }
+    stats->allocations = s->nr_allocations;
+    stats->metadata_updates = s->nr_inode_updates;
+
+    return stats;
+}
+
 static QEMUOptionParameter sd_create_options[] = {
     {
         .name = BLOCK_OPT_SIZE,
@@ -2520,6 +2695,7 @@ static BlockDriver bdrv_sheepdog = {
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
     .bdrv_getlength = sd_getlength,
     .bdrv_get_allocated_file_size = sd_get_allocated_file_size,
+    .bdrv_get_object_stats = sd_get_object_stats,
     .bdrv_truncate  = sd_truncate,
 
     .bdrv_co_readv  = sd_co_readv,
@@ -2550,6 +2726,7 @@ static BlockDriver bdrv_sheepdog_tcp = {
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
     .bdrv_getlength = sd_getlength,
     .bdrv_get_allocated_file_size = sd_get_allocated_file_size,
+    .bdrv_get_object_stats = sd_get_object_stats,
     .bdrv_truncate  = sd_truncate,
 
     .bdrv_co_readv  = sd_co_readv,
@@ -2580,6 +2757,7 @@ static BlockDriver bdrv_sheepdog_unix = {
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
     .bdrv_getlength = sd_getlength,
     .bdrv_get_allocated_file_size = sd_get_allocated_file_size,
+    .bdrv_get_object_stats = sd_get_object_stats,
     .bdrv_truncate  = sd_truncate,
 
     .bdrv_co_readv  = sd_co_readv,
@@ -0,0 +1,362 @@
+/*
+ * QEMU block throttling group infrastructure
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "block/throttle-groups.h"
+#include "qemu/queue.h"
+#include "qemu/timer.h"
+#include "block/aio.h"
+#include "qemu/main-loop.h"
+
+/* The ThrottleGroup structure (with its ThrottleState) is shared
+ * among different BlockDriverStates and it's independent from
+ * AioContext, so in order to use it from different threads it would
+ * need its own locking.  For now all members must stay in the main
+ * loop, see bdrv_can_set_aio_context().
+ *
+ * The group's timers are not tied to any member: when one fires it
+ * wakes up the member that holds the token for that direction.  The
+ * token is passed round-robin among the members that have queued
+ * requests, so a single busy drive cannot starve the others.
+ */
+typedef struct ThrottleGroup {
+    char *name; /* This is constant during the lifetime of the group */
+    unsigned refcount;
+
+    ThrottleState ts;
+    QLIST_HEAD(, BlockDriverState) head;
+    BlockDriverState *tokens[2];
+
+    QTAILQ_ENTRY(ThrottleGroup) list;
+} ThrottleGroup;
+
+static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
+    QTAILQ_HEAD_INITIALIZER(throttle_groups);
+
+static void throttle_group_timer_cb(ThrottleGroup *tg, bool is_write);
+
+static void throttle_group_read_timer_cb(void *opaque)
+{
+    throttle_group_timer_cb(opaque, false);
+}
+
+static void throttle_group_write_timer_cb(void *opaque)
+{
+    throttle_group_timer_cb(opaque, true);
+}
+
+/* Look up a group by name, creating it if it does not exist yet.  The
+ * caller owns a reference to the returned group.
+ *
+ * @name: the name of the ThrottleGroup
+ * @ret:  the ThrottleGroup
+ */
+static ThrottleGroup *throttle_group_incref(const char *name)
+{
+    ThrottleGroup *tg;
+
+    QTAILQ_FOREACH(tg, &throttle_groups, list) {
+        if (!strcmp(name, tg->name)) {
+            tg->refcount++;
+            return tg;
+        }
+    }
+
+    tg = g_new0(ThrottleGroup, 1);
+    tg->name = g_strdup(name);
+    tg->refcount = 1;
+    throttle_init(&tg->ts, qemu_get_aio_context(), QEMU_CLOCK_VIRTUAL,
+                  throttle_group_read_timer_cb,
+                  throttle_group_write_timer_cb,
+                  tg);
+    QLIST_INIT(&tg->head);
+    QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
+
+    return tg;
+}
+
+/* Drop a reference to a group, destroying it when it has no users left.
+ *
+ * @tg: the ThrottleGroup to unref
+ */
+static void throttle_group_unref(ThrottleGroup *tg)
+{
+    if (--tg->refcount) {
+        return;
+    }
+
+    assert(QLIST_EMPTY(&tg->head));
+    QTAILQ_REMOVE(&throttle_groups, tg, list);
+    throttle_destroy(&tg->ts);
+    g_free(tg->name);
+    g_free(tg);
+}
+
+/* Get the name of the group a BlockDriverState belongs to
+ *
+ * @bs:   a BlockDriverState that is a member of a group
+ * @ret:  the name of the group
+ */
+const char *throttle_group_get_name(BlockDriverState *bs)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    return tg->name;
+}
+
+/* Return the member that follows @bs in the group, wrapping around to
+ * the first one when the end of the list is reached.
+ *
+ * @bs:  the current BlockDriverState
+ * @ret: the next BlockDriverState in the group
+ */
+static BlockDriverState *throttle_group_next_bs(BlockDriverState *bs)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *next = QLIST_NEXT(bs, round_robin);
+
+    if (!next) {
+        next = QLIST_FIRST(&tg->head);
+    }
+
+    return next;
+}
+
+/* Pick the member whose queue should be served next.  Starting after
+ * the current token holder, this is the first member with pending
+ * requests in the given direction; if there is none, @bs itself.
+ *
+ * @bs:       the current BlockDriverState
+ * @is_write: the type of operation (read/write)
+ * @ret:      the next BlockDriverState to serve
+ */
+static BlockDriverState *next_throttle_token(BlockDriverState *bs,
+                                             bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *token, *start;
+
+    start = token = tg->tokens[is_write];
+    if (!token) {
+        return bs;
+    }
+
+    /* get next bs round in round robin style */
+    token = throttle_group_next_bs(token);
+    while (token != start && !token->pending_reqs[is_write]) {
+        token = throttle_group_next_bs(token);
+    }
+
+    /* If no member has pending requests just keep serving @bs, it is
+     * the one currently doing I/O.
+     */
+    if (token == start && !token->pending_reqs[is_write]) {
+        token = bs;
+    }
+
+    return token;
+}
+
+/* Once a request has been accounted, hand the token to the next member
+ * with queued requests and either wake it up at once or let the group
+ * timer do it once the bucket has leaked enough.
+ *
+ * @bs:       the BlockDriverState that just completed accounting
+ * @is_write: the type of operation (read/write)
+ */
+static void schedule_next_request(BlockDriverState *bs, bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *token;
+
+    token = next_throttle_token(bs, is_write);
+    tg->tokens[is_write] = token;
+
+    if (!token->pending_reqs[is_write]) {
+        return;
+    }
+
+    /* if the next request must wait the timer will wake it up */
+    if (throttle_schedule_timer(&tg->ts, is_write)) {
+        return;
+    }
+
+    qemu_co_queue_next(&token->throttled_reqs[is_write]);
+}
+
+static void throttle_group_timer_cb(ThrottleGroup *tg, bool is_write)
+{
+    BlockDriverState *token = tg->tokens[is_write];
+
+    if (!token) {
+        return;
+    }
+
+    if (!token->pending_reqs[is_write]) {
+        token = next_throttle_token(token, is_write);
+        tg->tokens[is_write] = token;
+    }
+
+    qemu_co_enter_next(&token->throttled_reqs[is_write]);
+}
+
+/* Check if an I/O request needs to be throttled, wait and set a timer
+ * if necessary, and schedule the next request using a round robin
+ * algorithm.
+ *
+ * @bs:       the current BlockDriverState
+ * @bytes:    the number of bytes for this I/O
+ * @is_write: the type of operation (read/write)
+ */
+void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
+                                                        unsigned int bytes,
+                                                        bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    bool must_wait;
+
+    /* Requests of a member that already has a queue behind them wait in
+     * line, so that ordering within one drive is preserved.
+     */
+    must_wait = throttle_schedule_timer(&tg->ts, is_write);
+    if (must_wait || bs->pending_reqs[is_write]) {
+        if (!tg->tokens[is_write]) {
+            tg->tokens[is_write] = bs;
+        }
+        bs->pending_reqs[is_write]++;
+        qemu_co_queue_wait(&bs->throttled_reqs[is_write]);
+        bs->pending_reqs[is_write]--;
+    }
+
+    /* The I/O will be executed, so do the accounting */
+    throttle_account(&tg->ts, is_write, bytes);
+
+    /* Schedule the next request */
+    schedule_next_request(bs, is_write);
+}
+
+/* Update the throttle configuration for a particular group.  Since it
+ * is shared, the new limits apply to every member.
+ *
+ * @bs:  a BlockDriverState that is a member of the group
+ * @cfg: the configuration to set
+ */
+void throttle_group_config(BlockDriverState *bs, ThrottleConfig *cfg)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *member;
+    int i;
+
+    throttle_config(&tg->ts, cfg);
+
+    /* throttle_config() cancelled the group timers, restart the queues */
+    QLIST_FOREACH(member, &tg->head, round_robin) {
+        for (i = 0; i < 2; i++) {
+            qemu_co_enter_next(&member->throttled_reqs[i]);
+        }
+    }
+}
+
+/* Get the throttle configuration from a particular group
+ *
+ * @bs:  a BlockDriverState that is a member of the group
+ * @cfg: the configuration will be written here
+ */
+void throttle_group_get_config(BlockDriverState *bs, ThrottleConfig *cfg)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    throttle_get_config(&tg->ts, cfg);
+}
+
+/* Register a BlockDriverState in the throttling group, creating the
+ * group if necessary.
+ *
+ * @bs:        the BlockDriverState to insert
+ * @groupname: the name of the group
+ */
+void throttle_group_register_bs(BlockDriverState *bs, const char *groupname)
+{
+    ThrottleGroup *tg;
+
+    assert(!bs->throttle_group);
+    assert(bdrv_get_aio_context(bs) == qemu_get_aio_context());
+
+    tg = throttle_group_incref(groupname);
+    bs->throttle_group = tg;
+    bs->pending_reqs[0] = bs->pending_reqs[1] = 0;
+    QLIST_INSERT_HEAD(&tg->head, bs, round_robin);
+}
+
+/* Remove a BlockDriverState from its group.  The caller must make sure
+ * that none of its requests are still queued.  If this is the last
+ * member the group is destroyed.
+ *
+ * @bs: the BlockDriverState to remove
+ */
+void throttle_group_unregister_bs(BlockDriverState *bs)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    int i;
+
+    assert(bs->pending_reqs[0] == 0 && bs->pending_reqs[1] == 0);
+
+    /* pass the tokens this member holds to somebody else */
+    for (i = 0; i < 2; i++) {
+        if (tg->tokens[i] == bs) {
+            BlockDriverState *token = throttle_group_next_bs(bs);
+            tg->tokens[i] = (token == bs) ? NULL : token;
+        }
+    }
+
+    QLIST_REMOVE(bs, round_robin);
+    bs->throttle_group = NULL;
+    throttle_group_unref(tg);
+}
+
+ThrottleGroupInfoList *throttle_group_query(void)
+{
+    ThrottleGroupInfoList *head = NULL, **p_next = &head;
+    ThrottleGroup *tg;
+
+    QTAILQ_FOREACH(tg, &throttle_groups, list) {
+        ThrottleGroupInfoList *info = g_new0(ThrottleGroupInfoList, 1);
+        ThrottleGroupMemberInfoList **m_next;
+        BlockDriverState *bs;
+
+        info->value = g_new0(ThrottleGroupInfo, 1);
+        info->value->name = g_strdup(tg->name);
+        m_next = &info->value->members;
+
+        QLIST_FOREACH(bs, &tg->head, round_robin) {
+            ThrottleGroupMemberInfoList *m;
+
+            m = g_new0(ThrottleGroupMemberInfoList, 1);
+            m->value = g_new0(ThrottleGroupMemberInfo, 1);
+            m->value->device = g_strdup(bdrv_get_device_name(bs));
+            m->value->queued_reads = bs->pending_reqs[0];
+            m->value->queued_writes = bs->pending_reqs[1];
+
+            *m_next = m;
+            m_next = &m->next;
+        }
+
+        *p_next = info;
+        p_next = &info->next;
+    }
+
+    return head;
+}
@@ -1067,8 +1067,9 @@ static coroutine_fn int vhdx_co_readv(BlockDriverState *bs, int64_t sector_num,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    qemu_co_mutex_lock(&s->lock);
-
+    /* No lock: writes only publish a new BAT entry in memory once the
+     * payload block holds the data, and after that it does not change.
+     */
     while (nb_sectors > 0) {
         /* We are a differencing file, so we need to inspect the sector bitmap
          * to see if we have the data or not */
@@ -1092,11 +1093,9 @@ static coroutine_fn int vhdx_co_readv(BlockDriverState *bs, int64_t sector_num,
                 qemu_iovec_memset(&hd_qiov, 0, 0, sinfo.bytes_avail);
                 break;
             case PAYLOAD_BLOCK_FULLY_PRESENT:
-                qemu_co_mutex_unlock(&s->lock);
                 ret = bdrv_co_readv(bs->file,
                                     sinfo.file_offset >> BDRV_SECTOR_BITS,
                                     sinfo.sectors_avail, &hd_qiov);
-                qemu_co_mutex_lock(&s->lock);
                 if (ret < 0) {
                     goto exit;
                 }
@@ -1116,7 +1115,6 @@ static coroutine_fn int vhdx_co_readv(BlockDriverState *bs, int64_t sector_num,
     }
     ret = 0;
 exit:
-    qemu_co_mutex_unlock(&s->lock);
     qemu_iovec_destroy(&hd_qiov);
     return ret;
 }
@@ -1158,6 +1156,31 @@ static void vhdx_update_bat_table_entry(BlockDriverState *bs, BDRVVHDXState *s,
 
 }
 
+/*
+ * Write the BAT entries first..last to the log journal, and flush the log
+ * out to disk: a single log entry and flush for all the blocks that a
+ * request allocated.  Entries in the range that did not change, such as
+ * sector bitmap entries, are written back unmodified.
+ */
+static int vhdx_log_bat_entries(BlockDriverState *bs, BDRVVHDXState *s,
+                                uint32_t first, uint32_t last)
+{
+    uint32_t i, count = last - first + 1;
+    uint64_t *entries;
+    int ret;
+
+    entries = g_new(uint64_t, count);
+    for (i = 0; i < count; i++) {
+        entries[i] = cpu_to_le64(s->bat[first + i]);
+    }
+    ret = vhdx_log_write_and_flush(bs, s, entries,
+                                   count * sizeof(VHDXBatEntry),
+                                   s->bat_offset +
+                                   first * sizeof(VHDXBatEntry));
+    g_free(entries);
+    return ret;
+}
+
 /* Per the spec, on the first write of guest-visible data to the file the
  * data write guid must be updated in the header */
 int vhdx_user_visible_write(BlockDriverState *bs, BDRVVHDXState *s)
@@ -1174,6 +1197,7 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
                                       int nb_sectors, QEMUIOVector *qiov)
 {
     int ret = -ENOTSUP;
+    int log_ret;
     BDRVVHDXState *s = bs->opaque;
     VHDXSectorInfo sinfo;
     uint64_t bytes_done = 0;
@@ -1184,32 +1208,49 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
     struct iovec iov2 = { 0 };
     int sectors_to_write;
     int bat_state;
-    uint64_t bat_prior_offset = 0;
-    bool bat_update = false;
+    uint64_t new_block_offset = 0;
+    bool new_block;
+    bool locked = false;
+    uint32_t bat_first = 0, bat_last = 0;
+    bool bat_dirty = false;
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
+    /* Concurrent writers must wait until the header update is on disk */
     qemu_co_mutex_lock(&s->lock);
-
     ret = vhdx_user_visible_write(bs, s);
+    qemu_co_mutex_unlock(&s->lock);
     if (ret < 0) {
         goto exit;
     }
 
     while (nb_sectors > 0) {
         bool use_zero_buffers = false;
-        bat_update = false;
+        new_block = false;
         if (s->params.data_bits & VHDX_PARAMS_HAS_PARENT) {
             /* not supported yet */
             ret = -ENOTSUP;
             goto exit;
         } else {
             vhdx_block_translate(s, sector_num, nb_sectors, &sinfo);
+            bat_state = s->bat[sinfo.bat_idx] & VHDX_BAT_STATE_BIT_MASK;
+
+            /* Writes to present blocks go ahead without the lock.  Block
+             * allocation extends the file and updates the BAT, so it is
+             * serialized; once a request has allocated a block it keeps the
+             * lock until its BAT entries are logged.  Another request may
+             * have allocated this block while we waited, look again.
+             */
+            if (bat_state != PAYLOAD_BLOCK_FULLY_PRESENT && !locked) {
+                qemu_co_mutex_lock(&s->lock);
+                locked = true;
+                vhdx_block_translate(s, sector_num, nb_sectors, &sinfo);
+                bat_state = s->bat[sinfo.bat_idx] & VHDX_BAT_STATE_BIT_MASK;
+            }
             sectors_to_write = sinfo.sectors_avail;
 
             qemu_iovec_reset(&hd_qiov);
             /* check the payload block state */
-            bat_state = s->bat[sinfo.bat_idx] & VHDX_BAT_STATE_BIT_MASK;
             switch (bat_state) {
             case PAYLOAD_BLOCK_ZERO:
                 /* in this case, we need to preserve zero writes for
@@ -1258,18 +1299,14 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
             case PAYLOAD_BLOCK_NOT_PRESENT: /* fall through */
             case PAYLOAD_BLOCK_UNMAPPED:    /* fall through */
             case PAYLOAD_BLOCK_UNDEFINED:   /* fall through */
-                bat_prior_offset = sinfo.file_offset;
                 ret = vhdx_allocate_block(bs, s, &sinfo.file_offset);
                 if (ret < 0) {
                     goto exit;
                 }
                 /* once we support differencing files, this may also be
                  * partially present */
-                /* update block state to the newly specified state */
-                vhdx_update_bat_table_entry(bs, s, &sinfo, &bat_entry,
-                                            &bat_entry_offset,
-                                            PAYLOAD_BLOCK_FULLY_PRESENT);
-                bat_update = true;
+                new_block_offset = sinfo.file_offset;
+                new_block = true;
                 /* since we just allocated a block, file_offset is the
                  * beginning of the payload block. It needs to be the
                  * write address, which includes the offset into the block */
@@ -1282,21 +1319,18 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
                  * there is a problem */
                 if (sinfo.file_offset < (1024 * 1024)) {
                     ret = -EFAULT;
-                    goto error_bat_restore;
+                    goto exit;
                 }
 
                 if (!use_zero_buffers) {
                     qemu_iovec_concat(&hd_qiov, qiov,  bytes_done,
                                       sinfo.bytes_avail);
                 }
-                /* block exists, so we can just overwrite it */
-                qemu_co_mutex_unlock(&s->lock);
                 ret = bdrv_co_writev(bs->file,
                                     sinfo.file_offset >> BDRV_SECTOR_BITS,
                                     sectors_to_write, &hd_qiov);
-                qemu_co_mutex_lock(&s->lock);
                 if (ret < 0) {
-                    goto error_bat_restore;
+                    goto exit;
                 }
                 break;
             case PAYLOAD_BLOCK_PARTIALLY_PRESENT:
@@ -1308,15 +1342,20 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
                 break;
             }
 
-            if (bat_update) {
-                /* this will update the BAT entry into the log journal, and
-                 * then flush the log journal out to disk */
-                ret =  vhdx_log_write_and_flush(bs, s, &bat_entry,
-                                                sizeof(VHDXBatEntry),
-                                                bat_entry_offset);
-                if (ret < 0) {
-                    goto exit;
+            if (new_block) {
+                /* The data is in place, make the block visible to readers.
+                 * The BAT entry goes to the log journal when the request
+                 * is done.
+                 */
+                sinfo.file_offset = new_block_offset;
+                vhdx_update_bat_table_entry(bs, s, &sinfo, &bat_entry,
+                                            &bat_entry_offset,
+                                            PAYLOAD_BLOCK_FULLY_PRESENT);
+                if (!bat_dirty) {
+                    bat_first = sinfo.bat_idx;
                 }
+                bat_last = sinfo.bat_idx;
+                bat_dirty = true;
             }
 
             nb_sectors -= sinfo.sectors_avail;
@@ -1326,20 +1365,21 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
         }
     }
 
-    goto exit;
-
-error_bat_restore:
-    if (bat_update) {
-        /* keep metadata in sync, and restore the bat entry state
-         * if error. */
-        sinfo.file_offset = bat_prior_offset;
-        vhdx_update_bat_table_entry(bs, s, &sinfo, &bat_entry,
-                                    &bat_entry_offset, bat_state);
-    }
 exit:
+    /* Blocks allocated before an error hold data and are already in the
+     * in-memory BAT, so they are logged in any case.
+     */
+    if (bat_dirty) {
+        log_ret = vhdx_log_bat_entries(bs, s, bat_first, bat_last);
+        if (ret >= 0) {
+            ret = log_ret;
+        }
+    }
+    if (locked) {
+        qemu_co_mutex_unlock(&s->lock);
+    }
     qemu_vfree(iov1.iov_base);
     qemu_vfree(iov2.iov_base);
-    qemu_co_mutex_unlock(&s->lock);
     qemu_iovec_destroy(&hd_qiov);
     return ret;
 }
@@ -27,6 +27,7 @@
 #include "block/block_int.h"
 #include "qemu/module.h"
 #include "migration/migration.h"
+#include "block/thread-pool.h"
 #include <zlib.h>
 
 #define VMDK3_MAGIC (('C' << 24) | ('O' << 16) | ('W' << 8) | 'D')
@@ -81,8 +82,11 @@ typedef struct {
     uint16_t compressAlgorithm;
 } QEMU_PACKED VMDK4Header;
 
+/* Default number of L2 tables cached per extent */
 #define L2_CACHE_SIZE 16
 
+#define VMDK_OPT_L2_CACHE_SIZE "l2-cache-size"
+
 typedef struct VmdkExtent {
     BlockDriverState *file;
     bool flat;
@@ -101,9 +105,14 @@ typedef struct VmdkExtent {
     uint32_t l1_entry_sectors;
 
     unsigned int l2_size;
+    /* l2_cache_tables tables; l2_cache_map finds the slot of a table by
+     * its offset, so that large caches cost nothing on a hit.
+     */
+    unsigned int l2_cache_tables;
     uint32_t *l2_cache;
-    uint32_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    uint32_t *l2_cache_offsets;
+    uint32_t *l2_cache_counts;
+    GHashTable *l2_cache_map;
 
     int64_t cluster_sectors;
     char *type;
@@ -121,6 +130,8 @@ typedef struct BDRVVmdkState {
     VmdkExtent *extents;
     Error *migration_blocker;
     char *create_type;
+    /* Bytes of L2 tables to cache per extent, 0 for the default */
+    uint64_t l2_cache_size;
 } BDRVVmdkState;
 
 typedef struct VmdkMetaData {
@@ -128,6 +139,7 @@ typedef struct VmdkMetaData {
     unsigned int l1_index;
     unsigned int l2_index;
     unsigned int l2_offset;
+    /* A grain was allocated and its L2 entry must be written */
     int valid;
     uint32_t *l2_cache_entry;
 } VmdkMetaData;
@@ -216,6 +228,11 @@ static void vmdk_free_extents(BlockDriverState *bs)
         e = &s->extents[i];
         g_free(e->l1_table);
         g_free(e->l2_cache);
+        g_free(e->l2_cache_offsets);
+        g_free(e->l2_cache_counts);
+        if (e->l2_cache_map) {
+            g_hash_table_destroy(e->l2_cache_map);
+        }
         g_free(e->l1_backup_table);
         g_free(e->type);
         if (e->file != bs->file) {
@@ -447,8 +464,10 @@ static int vmdk_add_extent(BlockDriverState *bs,
 static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent,
                             Error **errp)
 {
+    BDRVVmdkState *s = bs->opaque;
     int ret;
     int l1_size, i;
+    uint64_t tables;
 
     /* read the L1 table */
     l1_size = extent->l1_size * sizeof(uint32_t);
@@ -484,8 +503,18 @@ static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent,
         }
     }
 
+    tables = L2_CACHE_SIZE;
+    if (s->l2_cache_size) {
+        tables = s->l2_cache_size / (extent->l2_size * sizeof(uint32_t));
+        /* No point in caching more tables than the extent has */
+        tables = MIN(MAX(tables, 1), MAX(extent->l1_size, 1));
+    }
+    extent->l2_cache_tables = tables;
     extent->l2_cache =
-        g_malloc(extent->l2_size * L2_CACHE_SIZE * sizeof(uint32_t));
+        g_malloc(extent->l2_size * tables * sizeof(uint32_t));
+    extent->l2_cache_offsets = g_new0(uint32_t, tables);
+    extent->l2_cache_counts = g_new0(uint32_t, tables);
+    extent->l2_cache_map = g_hash_table_new(NULL, NULL);
     return 0;
  fail_l1b:
     g_free(extent->l1_backup_table);
@@ -848,11 +877,36 @@ exit:
     return ret;
 }
 
+static QemuOptsList vmdk_runtime_opts = {
+    .name = "vmdk",
+    .head = QTAILQ_HEAD_INITIALIZER(vmdk_runtime_opts.head),
+    .desc = {
+        {
+            .name = VMDK_OPT_L2_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Bytes of grain tables to cache for each extent",
+        },
+        { /* end of list */ }
+    },
+};
+
 static int vmdk_open(BlockDriverState *bs, QDict *options, int flags,
                      Error **errp)
 {
     int ret;
     BDRVVmdkState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+
+    opts = qemu_opts_create_nofail(&vmdk_runtime_opts);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (error_is_set(&local_err)) {
+        error_propagate(errp, local_err);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    s->l2_cache_size = qemu_opt_get_size(opts, VMDK_OPT_L2_CACHE_SIZE, 0);
+    qemu_opts_del(opts);
 
     if (vmdk_open_sparse(bs, bs->file, flags, errp) == 0) {
         s->desc_offset = 0x200;
@@ -966,8 +1020,9 @@ static int get_cluster_offset(BlockDriverState *bs,
                                     uint64_t *cluster_offset)
 {
     unsigned int l1_index, l2_offset, l2_index;
-    int min_index, i, j;
+    unsigned int min_index, i, j;
     uint32_t min_count, *l2_table;
+    gpointer slot;
     bool zeroed = false;
 
     if (m_data) {
@@ -987,27 +1042,35 @@ static int get_cluster_offset(BlockDriverState *bs,
     if (!l2_offset) {
         return VMDK_UNALLOC;
     }
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (l2_offset == extent->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++extent->l2_cache_counts[i] == 0xffffffff) {
-                for (j = 0; j < L2_CACHE_SIZE; j++) {
-                    extent->l2_cache_counts[j] >>= 1;
-                }
+    /* The map stores slot + 1, l2_offset is never 0 here */
+    slot = g_hash_table_lookup(extent->l2_cache_map,
+                               GUINT_TO_POINTER(l2_offset));
+    if (slot) {
+        i = GPOINTER_TO_UINT(slot) - 1;
+        /* increment the hit count */
+        if (++extent->l2_cache_counts[i] == 0xffffffff) {
+            for (j = 0; j < extent->l2_cache_tables; j++) {
+                extent->l2_cache_counts[j] >>= 1;
             }
-            l2_table = extent->l2_cache + (i * extent->l2_size);
-            goto found;
         }
+        l2_table = extent->l2_cache + (i * extent->l2_size);
+        goto found;
     }
     /* not found: load a new entry in the least used one */
     min_index = 0;
     min_count = 0xffffffff;
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
+    for (i = 0; i < extent->l2_cache_tables; i++) {
         if (extent->l2_cache_counts[i] < min_count) {
             min_count = extent->l2_cache_counts[i];
             min_index = i;
         }
     }
+    if (extent->l2_cache_offsets[min_index]) {
+        g_hash_table_remove(extent->l2_cache_map,
+                GUINT_TO_POINTER(extent->l2_cache_offsets[min_index]));
+        extent->l2_cache_offsets[min_index] = 0;
+    }
+    extent->l2_cache_counts[min_index] = 0;
     l2_table = extent->l2_cache + (min_index * extent->l2_size);
     if (bdrv_pread(
                 extent->file,
@@ -1020,12 +1083,13 @@ static int get_cluster_offset(BlockDriverState *bs,
 
     extent->l2_cache_offsets[min_index] = l2_offset;
     extent->l2_cache_counts[min_index] = 1;
+    g_hash_table_insert(extent->l2_cache_map, GUINT_TO_POINTER(l2_offset),
+                        GUINT_TO_POINTER(min_index + 1));
  found:
     l2_index = ((offset >> 9) / extent->cluster_sectors) % extent->l2_size;
     *cluster_offset = le32_to_cpu(l2_table[l2_index]);
 
     if (m_data) {
-        m_data->valid = 1;
         m_data->l1_index = l1_index;
         m_data->l2_index = l2_index;
         m_data->offset = *cluster_offset;
@@ -1064,6 +1128,7 @@ static int get_cluster_offset(BlockDriverState *bs,
         }
 
         if (m_data) {
+            m_data->valid = 1;
             m_data->offset = *cluster_offset;
         }
     }
@@ -1134,35 +1199,40 @@ static int64_t coroutine_fn vmdk_co_get_block_status(BlockDriverState *bs,
 }
 
 static int vmdk_write_extent(VmdkExtent *extent, int64_t cluster_offset,
-                            int64_t offset_in_cluster, const uint8_t *buf,
+                            int64_t offset_in_cluster, QEMUIOVector *qiov,
                             int nb_sectors, int64_t sector_num)
 {
     int ret;
     VmdkGrainMarker *data = NULL;
     uLongf buf_len;
-    const uint8_t *write_buf = buf;
+    uint8_t *buf = NULL;
     int write_len = nb_sectors * 512;
 
-    if (extent->compressed) {
-        if (!extent->has_marker) {
-            ret = -EINVAL;
-            goto out;
-        }
-        buf_len = (extent->cluster_sectors << 9) * 2;
-        data = g_malloc(buf_len + sizeof(VmdkGrainMarker));
-        if (compress(data->data, &buf_len, buf, nb_sectors << 9) != Z_OK ||
-                buf_len == 0) {
-            ret = -EINVAL;
-            goto out;
-        }
-        data->lba = sector_num;
-        data->size = buf_len;
-        write_buf = (uint8_t *)data;
-        write_len = buf_len + sizeof(VmdkGrainMarker);
+    if (!extent->compressed) {
+        return bdrv_co_writev(extent->file,
+                              (cluster_offset + offset_in_cluster) >> 9,
+                              nb_sectors, qiov);
     }
+
+    if (!extent->has_marker) {
+        ret = -EINVAL;
+        goto out;
+    }
+    buf = qemu_blockalign(extent->file, write_len);
+    qemu_iovec_to_buf(qiov, 0, buf, write_len);
+    buf_len = (extent->cluster_sectors << 9) * 2;
+    data = g_malloc(buf_len + sizeof(VmdkGrainMarker));
+    if (compress(data->data, &buf_len, buf, write_len) != Z_OK ||
+            buf_len == 0) {
+        ret = -EINVAL;
+        goto out;
+    }
+    data->lba = sector_num;
+    data->size = buf_len;
+    write_len = buf_len + sizeof(VmdkGrainMarker);
     ret = bdrv_pwrite(extent->file,
                         cluster_offset + offset_in_cluster,
-                        write_buf,
+                        data,
                         write_len);
     if (ret != write_len) {
         ret = ret < 0 ? ret : -EIO;
@@ -1170,32 +1240,43 @@ static int vmdk_write_extent(VmdkExtent *extent, int64_t cluster_offset,
     }
     ret = 0;
  out:
+    qemu_vfree(buf);
     g_free(data);
     return ret;
 }
 
-static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
-                            int64_t offset_in_cluster, uint8_t *buf,
+typedef struct VmdkInflate {
+    uint8_t *dst;
+    uLongf dst_len;
+    const uint8_t *src;
+    uLong src_len;
+} VmdkInflate;
+
+static int vmdk_inflate_worker(void *opaque)
+{
+    VmdkInflate *c = opaque;
+
+    return uncompress(c->dst, &c->dst_len, c->src, c->src_len) == Z_OK ?
+           0 : -EINVAL;
+}
+
+static int coroutine_fn vmdk_read_extent(BlockDriverState *bs,
+                            VmdkExtent *extent, int64_t cluster_offset,
+                            int64_t offset_in_cluster, QEMUIOVector *qiov,
                             int nb_sectors)
 {
     int ret;
     int cluster_bytes, buf_bytes;
-    uint8_t *cluster_buf, *compressed_data;
+    uint8_t *cluster_buf;
     uint8_t *uncomp_buf;
-    uint32_t data_len;
     VmdkGrainMarker *marker;
-    uLongf buf_len;
-
+    VmdkInflate inflate;
+    ThreadPool *pool;
 
     if (!extent->compressed) {
-        ret = bdrv_pread(extent->file,
-                          cluster_offset + offset_in_cluster,
-                          buf, nb_sectors * 512);
-        if (ret == nb_sectors * 512) {
-            return 0;
-        } else {
-            return -EIO;
-        }
+        return bdrv_co_readv(extent->file,
+                             (cluster_offset + offset_in_cluster) >> 9,
+                             nb_sectors, qiov);
     }
     cluster_bytes = extent->cluster_sectors * 512;
     /* Read two clusters in case GrainMarker + compressed data > one cluster */
@@ -1208,30 +1289,35 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
     if (ret < 0) {
         goto out;
     }
-    compressed_data = cluster_buf;
-    buf_len = cluster_bytes;
-    data_len = cluster_bytes;
+    inflate.dst = uncomp_buf;
+    inflate.dst_len = cluster_bytes;
+    inflate.src = cluster_buf;
+    inflate.src_len = cluster_bytes;
     if (extent->has_marker) {
         marker = (VmdkGrainMarker *)cluster_buf;
-        compressed_data = marker->data;
-        data_len = le32_to_cpu(marker->size);
+        inflate.src = marker->data;
+        inflate.src_len = le32_to_cpu(marker->size);
     }
-    if (!data_len || data_len > buf_bytes) {
+    if (!inflate.src_len || inflate.src_len > buf_bytes) {
         ret = -EINVAL;
         goto out;
     }
-    ret = uncompress(uncomp_buf, &buf_len, compressed_data, data_len);
-    if (ret != Z_OK) {
-        ret = -EINVAL;
-        goto out;
 
+    /* Decompress in a worker thread, so that the grains of concurrent
+     * requests are inflated in parallel while the guest keeps running.
+     */
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    ret = thread_pool_submit_co(pool, vmdk_inflate_worker, &inflate);
+    if (ret < 0) {
+        goto out;
     }
     if (offset_in_cluster < 0 ||
-            offset_in_cluster + nb_sectors * 512 > buf_len) {
+            offset_in_cluster + nb_sectors * 512 > inflate.dst_len) {
         ret = -EINVAL;
         goto out;
     }
-    memcpy(buf, uncomp_buf + offset_in_cluster, nb_sectors * 512);
+    qemu_iovec_from_buf(qiov, 0, uncomp_buf + offset_in_cluster,
+                        nb_sectors * 512);
     ret = 0;
 
  out:
@@ -1240,20 +1326,31 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
     return ret;
 }
 
-static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/* s->lock only protects the metadata.  It is dropped while guest data is
+ * read, so that requests to different clusters, and different extents,
+ * run concurrently.
+ */
+static coroutine_fn int vmdk_co_readv(BlockDriverState *bs,
+                                      int64_t sector_num, int nb_sectors,
+                                      QEMUIOVector *qiov)
 {
     BDRVVmdkState *s = bs->opaque;
-    int ret;
+    int ret = 0;
     uint64_t n, index_in_cluster;
     uint64_t extent_begin_sector, extent_relative_sector_num;
     VmdkExtent *extent = NULL;
     uint64_t cluster_offset;
+    uint64_t bytes_done = 0;
+    QEMUIOVector local_qiov;
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    qemu_co_mutex_lock(&s->lock);
 
     while (nb_sectors > 0) {
         extent = find_extent(s, sector_num, extent);
         if (!extent) {
-            return -EIO;
+            ret = -EIO;
+            goto fail;
         }
         ret = get_cluster_offset(
                             bs, extent, NULL,
@@ -1265,58 +1362,66 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
         if (n > nb_sectors) {
             n = nb_sectors;
         }
+
+        qemu_iovec_reset(&local_qiov);
+        qemu_iovec_concat(&local_qiov, qiov, bytes_done, n * 512);
+
         if (ret != VMDK_OK) {
             /* if not allocated, try to read from parent image, if exist */
             if (bs->backing_hd && ret != VMDK_ZEROED) {
                 if (!vmdk_is_cid_valid(bs)) {
-                    return -EINVAL;
+                    ret = -EINVAL;
+                    goto fail;
                 }
-                ret = bdrv_read(bs->backing_hd, sector_num, buf, n);
+                qemu_co_mutex_unlock(&s->lock);
+                ret = bdrv_co_readv(bs->backing_hd, sector_num, n,
+                                    &local_qiov);
+                qemu_co_mutex_lock(&s->lock);
                 if (ret < 0) {
-                    return ret;
+                    goto fail;
                 }
             } else {
-                memset(buf, 0, 512 * n);
+                qemu_iovec_memset(&local_qiov, 0, 0, n * 512);
             }
         } else {
-            ret = vmdk_read_extent(extent,
+            qemu_co_mutex_unlock(&s->lock);
+            ret = vmdk_read_extent(bs, extent,
                             cluster_offset, index_in_cluster * 512,
-                            buf, n);
+                            &local_qiov, n);
+            qemu_co_mutex_lock(&s->lock);
             if (ret) {
-                return ret;
+                goto fail;
             }
         }
         nb_sectors -= n;
         sector_num += n;
-        buf += n * 512;
+        bytes_done += n * 512;
     }
-    return 0;
-}
+    ret = 0;
 
-static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
-                                     uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVmdkState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vmdk_read(bs, sector_num, buf, nb_sectors);
+fail:
     qemu_co_mutex_unlock(&s->lock);
+    qemu_iovec_destroy(&local_qiov);
     return ret;
 }
 
 /**
  * vmdk_write:
- * @zeroed:       buf is ignored (data is zero), use zeroed_grain GTE feature
+ * @zeroed:       qiov is ignored (data is zero), use zeroed_grain GTE feature
  *                if possible, otherwise return -ENOTSUP.
  * @zero_dry_run: used for zeroed == true only, don't update L2 table, just try
  *                with each cluster. By dry run we can find if the zero write
  *                is possible without modifying image data.
  *
+ * Called with s->lock held.  The lock is dropped while data is written to
+ * a grain that is already allocated; new grains keep it until their L2
+ * entry is written.
+ *
  * Returns: error code with 0 for success.
  */
-static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
-                      const uint8_t *buf, int nb_sectors,
-                      bool zeroed, bool zero_dry_run)
+static int coroutine_fn vmdk_write(BlockDriverState *bs, int64_t sector_num,
+                                   QEMUIOVector *qiov, int nb_sectors,
+                                   bool zeroed, bool zero_dry_run)
 {
     BDRVVmdkState *s = bs->opaque;
     VmdkExtent *extent = NULL;
@@ -1324,7 +1429,9 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
     int64_t index_in_cluster;
     uint64_t extent_begin_sector, extent_relative_sector_num;
     uint64_t cluster_offset;
+    uint64_t bytes_done = 0;
     VmdkMetaData m_data;
+    QEMUIOVector local_qiov;
 
     if (sector_num > bs->total_sectors) {
         error_report("Wrong offset: sector_num=0x%" PRIx64
@@ -1333,10 +1440,13 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
         return -EIO;
     }
 
+    qemu_iovec_init(&local_qiov, qiov ? qiov->niov : 1);
+
     while (nb_sectors > 0) {
         extent = find_extent(s, sector_num, extent);
         if (!extent) {
-            return -EIO;
+            ret = -EIO;
+            goto out;
         }
         ret = get_cluster_offset(
                                 bs,
@@ -1349,7 +1459,8 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
                 /* Refuse write to allocated cluster for streamOptimized */
                 error_report("Could not write to allocated cluster"
                               " for streamOptimized");
-                return -EIO;
+                ret = -EIO;
+                goto out;
             } else {
                 /* allocate */
                 ret = get_cluster_offset(
@@ -1361,7 +1472,8 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
             }
         }
         if (ret == VMDK_ERROR) {
-            return -EINVAL;
+            ret = -EINVAL;
+            goto out;
         }
         extent_begin_sector = extent->end_sector - extent->sectors;
         extent_relative_sector_num = sector_num - extent_begin_sector;
@@ -1380,50 +1492,70 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
                     m_data.offset = VMDK_GTE_ZEROED;
                     /* update L2 tables */
                     if (vmdk_L2update(extent, &m_data) != VMDK_OK) {
-                        return -EIO;
+                        ret = -EIO;
+                        goto out;
                     }
                 }
             } else {
-                return -ENOTSUP;
+                ret = -ENOTSUP;
+                goto out;
             }
         } else {
-            ret = vmdk_write_extent(extent,
-                            cluster_offset, index_in_cluster * 512,
-                            buf, n, sector_num);
-            if (ret) {
-                return ret;
-            }
+            qemu_iovec_reset(&local_qiov);
+            qemu_iovec_concat(&local_qiov, qiov, bytes_done, n * 512);
+
             if (m_data.valid) {
+                ret = vmdk_write_extent(extent,
+                                cluster_offset, index_in_cluster * 512,
+                                &local_qiov, n, sector_num);
+                if (ret) {
+                    goto out;
+                }
                 /* update L2 tables */
                 if (vmdk_L2update(extent, &m_data) != VMDK_OK) {
-                    return -EIO;
+                    ret = -EIO;
+                    goto out;
+                }
+            } else {
+                qemu_co_mutex_unlock(&s->lock);
+                ret = vmdk_write_extent(extent,
+                                cluster_offset, index_in_cluster * 512,
+                                &local_qiov, n, sector_num);
+                qemu_co_mutex_lock(&s->lock);
+                if (ret) {
+                    goto out;
                 }
             }
         }
         nb_sectors -= n;
         sector_num += n;
-        buf += n * 512;
+        bytes_done += n * 512;
 
         /* update CID on the first write every time the virtual disk is
          * opened */
         if (!s->cid_updated) {
             ret = vmdk_write_cid(bs, time(NULL));
             if (ret < 0) {
-                return ret;
+                goto out;
             }
             s->cid_updated = true;
         }
     }
-    return 0;
+    ret = 0;
+
+out:
+    qemu_iovec_destroy(&local_qiov);
+    return ret;
 }
 
-static coroutine_fn int vmdk_co_write(BlockDriverState *bs, int64_t sector_num,
-                                      const uint8_t *buf, int nb_sectors)
+static coroutine_fn int vmdk_co_writev(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov)
 {
     int ret;
     BDRVVmdkState *s = bs->opaque;
     qemu_co_mutex_lock(&s->lock);
-    ret = vmdk_write(bs, sector_num, buf, nb_sectors, false, false);
+    ret = vmdk_write(bs, sector_num, qiov, nb_sectors, false, false);
     qemu_co_mutex_unlock(&s->lock);
     return ret;
 }
@@ -1961,8 +2093,8 @@ static BlockDriver bdrv_vmdk = {
     .bdrv_probe                   = vmdk_probe,
     .bdrv_open                    = vmdk_open,
     .bdrv_reopen_prepare          = vmdk_reopen_prepare,
-    .bdrv_read                    = vmdk_co_read,
-    .bdrv_write                   = vmdk_co_write,
+    .bdrv_co_readv                = vmdk_co_readv,
+    .bdrv_co_writev               = vmdk_co_writev,
     .bdrv_co_write_zeroes         = vmdk_co_write_zeroes,
     .bdrv_close                   = vmdk_close,
     .bdrv_create                  = vmdk_create,
@@ -26,6 +26,7 @@
 #include "block/block_int.h"
 #include "qemu/module.h"
 #include "migration/migration.h"
+#include "qemu/bitmap.h"
 #if defined(CONFIG_UUID)
 #include <uuid/uuid.h>
 #endif
@@ -120,7 +121,12 @@ typedef struct BDRVVPCState {
     int max_table_entries;
     uint32_t *pagetable;
     uint64_t bat_offset;
-    uint64_t last_bitmap_offset;
+
+    /* Blocks whose sector bitmap is known to have all bits set.  Blocks
+     * allocated by QEMU get one; blocks written by other tools get it
+     * before the first write to them.
+     */
+    unsigned long *bitmap_filled;
 
     uint32_t block_size;
     uint32_t bitmap_size;
@@ -276,7 +282,7 @@ static int vpc_open(BlockDriverState *bs, QDict *options, int flags,
             goto fail;
         }
 
-        s->last_bitmap_offset = (int64_t) -1;
+        s->bitmap_filled = bitmap_new(s->max_table_entries);
 
 #ifdef CACHE
         s->pageentry_u8 = g_malloc(512);
@@ -298,6 +304,7 @@ static int vpc_open(BlockDriverState *bs, QDict *options, int flags,
 
 fail:
     g_free(s->pagetable);
+    g_free(s->bitmap_filled);
 #ifdef CACHE
     g_free(s->pageentry_u8);
 #endif
@@ -314,11 +321,10 @@ static int vpc_reopen_prepare(BDRVReopenState *state,
  * Returns the absolute byte offset of the given sector in the image file.
  * If the sector is not allocated, -1 is returned instead.
  *
- * The parameter write must be 1 if the offset will be used for a write
- * operation (the block bitmaps is updated then), 0 otherwise.
+ * This only looks at the in-memory BAT, so it does not need s->lock.
  */
 static inline int64_t get_sector_offset(BlockDriverState *bs,
-    int64_t sector_num, int write)
+    int64_t sector_num)
 {
     BDRVVPCState *s = bs->opaque;
     uint64_t offset = sector_num * 512;
@@ -334,19 +340,6 @@ static inline int64_t get_sector_offset(BlockDriverState *bs,
     bitmap_offset = 512 * (uint64_t) s->pagetable[pagetable_index];
     block_offset = bitmap_offset + s->bitmap_size + (512 * pageentry_index);
 
-    // We must ensure that we don't write to any sectors which are marked as
-    // unused in the bitmap. We get away with setting all bits in the block
-    // bitmap each time we write to a new block. This might cause Virtual PC to
-    // miss sparse read optimization, but it's not a problem in terms of
-    // correctness.
-    if (write && (s->last_bitmap_offset != bitmap_offset)) {
-        uint8_t bitmap[s->bitmap_size];
-
-        s->last_bitmap_offset = bitmap_offset;
-        memset(bitmap, 0xff, s->bitmap_size);
-        bdrv_pwrite_sync(bs->file, bitmap_offset, bitmap, s->bitmap_size);
-    }
-
 //    printf("sector: %" PRIx64 ", index: %x, offset: %x, bioff: %" PRIx64 ", bloff: %" PRIx64 "\n",
 //	sector_num, pagetable_index, pageentry_index,
 //	bitmap_offset, block_offset);
@@ -382,6 +375,37 @@ static inline int64_t get_sector_offset(BlockDriverState *bs,
     return block_offset;
 }
 
+/*
+ * We must ensure that we don't write to any sectors which are marked as
+ * unused in the bitmap. We get away with setting all bits in the block
+ * bitmap the first time we write to a block. This might cause Virtual PC to
+ * miss sparse read optimization, but it's not a problem in terms of
+ * correctness.
+ *
+ * Must be called with s->lock held.
+ *
+ * Returns 0 on success and < 0 on error
+ */
+static int fill_block_bitmap(BlockDriverState *bs, uint32_t index)
+{
+    BDRVVPCState *s = bs->opaque;
+    uint8_t bitmap[s->bitmap_size];
+    int ret;
+
+    if (test_bit(index, s->bitmap_filled)) {
+        return 0;
+    }
+
+    memset(bitmap, 0xff, s->bitmap_size);
+    ret = bdrv_pwrite_sync(bs->file, 512 * (uint64_t) s->pagetable[index],
+                           bitmap, s->bitmap_size);
+    if (ret < 0) {
+        return ret;
+    }
+    set_bit(index, s->bitmap_filled);
+    return 0;
+}
+
 /*
  * Writes the footer to the end of the image file. This is needed when the
  * file grows as it overwrites the old footer
@@ -406,31 +430,32 @@ static int rewrite_footer(BlockDriverState* bs)
  * the Block Allocation Table to use the space at the old end of the image
  * file (overwriting the old footer)
  *
+ * Must be called with s->lock held.
+ *
  * Returns the sectors' offset in the image file on success and < 0 on error
  */
 static int64_t alloc_block(BlockDriverState* bs, int64_t sector_num)
 {
     BDRVVPCState *s = bs->opaque;
     int64_t bat_offset;
+    uint64_t block_offset;
     uint32_t index, bat_value;
     int ret;
     uint8_t bitmap[s->bitmap_size];
 
     // Check if sector_num is valid
     if ((sector_num < 0) || (sector_num > bs->total_sectors))
-        return -1;
+        return -EINVAL;
 
-    // Write entry into in-memory BAT
     index = (sector_num * 512) / s->block_size;
     if (s->pagetable[index] != 0xFFFFFFFF)
-        return -1;
+        return -EINVAL;
 
-    s->pagetable[index] = s->free_data_block_offset / 512;
+    block_offset = s->free_data_block_offset;
 
     // Initialize the block's bitmap
     memset(bitmap, 0xff, s->bitmap_size);
-    ret = bdrv_pwrite_sync(bs->file, s->free_data_block_offset, bitmap,
-        s->bitmap_size);
+    ret = bdrv_pwrite_sync(bs->file, block_offset, bitmap, s->bitmap_size);
     if (ret < 0) {
         return ret;
     }
@@ -443,16 +468,21 @@ static int64_t alloc_block(BlockDriverState* bs, int64_t sector_num)
 
     // Write BAT entry to disk
     bat_offset = s->bat_offset + (4 * index);
-    bat_value = be32_to_cpu(s->pagetable[index]);
+    bat_value = cpu_to_be32(block_offset / 512);
     ret = bdrv_pwrite_sync(bs->file, bat_offset, &bat_value, 4);
     if (ret < 0)
         goto fail;
 
-    return get_sector_offset(bs, sector_num, 0);
+    // Readers do not take the lock, so only publish the block in the
+    // in-memory BAT once it is on disk
+    s->pagetable[index] = block_offset / 512;
+    set_bit(index, s->bitmap_filled);
+
+    return get_sector_offset(bs, sector_num);
 
 fail:
     s->free_data_block_offset -= (s->block_size + s->bitmap_size);
-    return -1;
+    return ret;
 }
 
 static int vpc_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
@@ -468,20 +498,28 @@ static int vpc_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
-static int vpc_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static coroutine_fn int vpc_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                     int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVVPCState *s = bs->opaque;
     int ret;
     int64_t offset;
     int64_t sectors, sectors_per_block;
+    uint64_t bytes_done = 0;
+    QEMUIOVector hd_qiov;
     VHDFooter *footer = (VHDFooter *) s->footer_buf;
 
     if (cpu_to_be32(footer->type) == VHD_FIXED) {
-        return bdrv_read(bs->file, sector_num, buf, nb_sectors);
+        return bdrv_co_readv(bs->file, sector_num, nb_sectors, qiov);
     }
+
+    /* Reads only look at the in-memory BAT, which allocating writes update
+     * after the new block is on disk.  No lock is needed.
+     */
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+    ret = 0;
     while (nb_sectors > 0) {
-        offset = get_sector_offset(bs, sector_num, 0);
+        offset = get_sector_offset(bs, sector_num);
 
         sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
         sectors = sectors_per_block - (sector_num % sectors_per_block);
@@ -490,81 +528,89 @@ static int vpc_read(BlockDriverState *bs, int64_t sector_num,
         }
 
         if (offset == -1) {
-            memset(buf, 0, sectors * BDRV_SECTOR_SIZE);
+            qemu_iovec_memset(qiov, bytes_done, 0,
+                              sectors * BDRV_SECTOR_SIZE);
         } else {
-            ret = bdrv_pread(bs->file, offset, buf,
-                sectors * BDRV_SECTOR_SIZE);
-            if (ret != sectors * BDRV_SECTOR_SIZE) {
-                return -1;
+            qemu_iovec_reset(&hd_qiov);
+            qemu_iovec_concat(&hd_qiov, qiov, bytes_done,
+                              sectors * BDRV_SECTOR_SIZE);
+            ret = bdrv_co_readv(bs->file, offset >> BDRV_SECTOR_BITS,
+                                sectors, &hd_qiov);
+            if (ret < 0) {
+                break;
             }
         }
 
         nb_sectors -= sectors;
         sector_num += sectors;
-        buf += sectors * BDRV_SECTOR_SIZE;
+        bytes_done += sectors * BDRV_SECTOR_SIZE;
     }
-    return 0;
-}
 
-static coroutine_fn int vpc_co_read(BlockDriverState *bs, int64_t sector_num,
-                                    uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVPCState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vpc_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_iovec_destroy(&hd_qiov);
     return ret;
 }
 
-static int vpc_write(BlockDriverState *bs, int64_t sector_num,
-    const uint8_t *buf, int nb_sectors)
+static coroutine_fn int vpc_co_writev(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVVPCState *s = bs->opaque;
     int64_t offset;
     int64_t sectors, sectors_per_block;
+    uint64_t bytes_done = 0;
+    QEMUIOVector hd_qiov;
     int ret;
     VHDFooter *footer =  (VHDFooter *) s->footer_buf;
 
     if (cpu_to_be32(footer->type) == VHD_FIXED) {
-        return bdrv_write(bs->file, sector_num, buf, nb_sectors);
+        return bdrv_co_writev(bs->file, sector_num, nb_sectors, qiov);
     }
-    while (nb_sectors > 0) {
-        offset = get_sector_offset(bs, sector_num, 1);
 
+    /* s->lock only covers the BAT and bitmap updates, the data itself is
+     * written without it.
+     */
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+    ret = 0;
+    while (nb_sectors > 0) {
         sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
         sectors = sectors_per_block - (sector_num % sectors_per_block);
         if (sectors > nb_sectors) {
             sectors = nb_sectors;
         }
 
-        if (offset == -1) {
-            offset = alloc_block(bs, sector_num);
-            if (offset < 0)
-                return -1;
+        offset = get_sector_offset(bs, sector_num);
+        if (offset == -1 ||
+            !test_bit(sector_num / sectors_per_block, s->bitmap_filled)) {
+            qemu_co_mutex_lock(&s->lock);
+            offset = get_sector_offset(bs, sector_num);
+            if (offset == -1) {
+                offset = alloc_block(bs, sector_num);
+            } else {
+                ret = fill_block_bitmap(bs, sector_num / sectors_per_block);
+            }
+            qemu_co_mutex_unlock(&s->lock);
+            if (offset < 0) {
+                ret = offset;
+            }
+            if (ret < 0) {
+                break;
+            }
         }
 
-        ret = bdrv_pwrite(bs->file, offset, buf, sectors * BDRV_SECTOR_SIZE);
-        if (ret != sectors * BDRV_SECTOR_SIZE) {
-            return -1;
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_concat(&hd_qiov, qiov, bytes_done,
+                          sectors * BDRV_SECTOR_SIZE);
+        ret = bdrv_co_writev(bs->file, offset >> BDRV_SECTOR_BITS,
+                             sectors, &hd_qiov);
+        if (ret < 0) {
+            break;
         }
 
         nb_sectors -= sectors;
         sector_num += sectors;
-        buf += sectors * BDRV_SECTOR_SIZE;
+        bytes_done += sectors * BDRV_SECTOR_SIZE;
     }
 
-    return 0;
-}
-
-static coroutine_fn int vpc_co_write(BlockDriverState *bs, int64_t sector_num,
-                                     const uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVPCState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vpc_write(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
+    qemu_iovec_destroy(&hd_qiov);
     return ret;
 }
 
@@ -833,6 +879,7 @@ static void vpc_close(BlockDriverState *bs)
 {
     BDRVVPCState *s = bs->opaque;
     g_free(s->pagetable);
+    g_free(s->bitmap_filled);
 #ifdef CACHE
     g_free(s->pageentry_u8);
 #endif
@@ -867,8 +914,8 @@ static BlockDriver bdrv_vpc = {
     .bdrv_reopen_prepare    = vpc_reopen_prepare,
     .bdrv_create            = vpc_create,
 
-    .bdrv_read              = vpc_co_read,
-    .bdrv_write             = vpc_co_write,
+    .bdrv_co_readv          = vpc_co_readv,
+    .bdrv_co_writev         = vpc_co_writev,
 
     .bdrv_get_info          = vpc_get_info,
 
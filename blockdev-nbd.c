@@ -70,6 +70,7 @@ static void nbd_close_notifier(Notifier *n, void *data)
 }
 
 void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
+                        bool has_max_requests, int64_t max_requests,
                         Error **errp)
 {
     BlockDriverState *bs;
@@ -92,6 +93,12 @@ void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
         return;
     }
 
+    if (has_max_requests && (max_requests < 1 || max_requests > INT_MAX)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "max-requests",
+                  "a positive integer");
+        return;
+    }
+
     if (!has_writable) {
         writable = false;
     }
@@ -100,6 +107,9 @@ void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
     }
 
     exp = nbd_export_new(bs, 0, -1, writable ? 0 : NBD_FLAG_READ_ONLY, NULL);
+    if (has_max_requests) {
+        nbd_export_set_max_requests(exp, max_requests);
+    }
 
     nbd_export_set_name(exp, device);
 
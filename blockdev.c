@@ -42,6 +42,7 @@
 #include "qapi/qmp-output-visitor.h"
 #include "sysemu/sysemu.h"
 #include "block/block_int.h"
+#include "block/throttle-groups.h"
 #include "qmp-commands.h"
 #include "trace.h"
 #include "sysemu/arch_init.h"
@@ -307,6 +308,37 @@ static bool check_throttle_config(ThrottleConfig *cfg, Error **errp)
 typedef enum { MEDIA_DISK, MEDIA_CDROM } DriveMediaType;
 
 /* Takes the ownership of bs_opts */
+/* Parse a colon-separated list of interval lengths in seconds, and
+ * if @bs is not NULL enable timed statistics for each of them.
+ */
+static bool parse_stats_intervals(BlockDriverState *bs, const char *str,
+                                  Error **errp)
+{
+    char **intervals = g_strsplit(str, ":", 0);
+    bool ret = true;
+    int i;
+
+    for (i = 0; intervals[i]; i++) {
+        unsigned long length;
+        char *end;
+
+        errno = 0;
+        length = strtoul(intervals[i], &end, 10);
+        if (errno || *end || end == intervals[i] ||
+            length == 0 || length > UINT_MAX) {
+            error_setg(errp, "Invalid interval length: '%s'", intervals[i]);
+            ret = false;
+            break;
+        }
+        if (bs) {
+            bdrv_add_timed_stats(bs, length);
+        }
+    }
+
+    g_strfreev(intervals);
+    return ret;
+}
+
 static DriveInfo *blockdev_init(QDict *bs_opts,
                                 BlockInterfaceType type,
                                 Error **errp)
@@ -321,6 +353,12 @@ static DriveInfo *blockdev_init(QDict *bs_opts,
     ThrottleConfig cfg;
     int snapshot = 0;
     bool copy_on_read;
+    const char *throttling_group;
+    const char *stats_intervals;
+    uint64_t merge_max_size;
+    int64_t merge_timeout;
+    uint64_t readahead_window, readahead_max_memory;
+    uint64_t chain_cache_size;
     int ret;
     Error *error = NULL;
     QemuOpts *opts;
@@ -437,6 +475,44 @@ static DriveInfo *blockdev_init(QDict *bs_opts,
         goto early_err;
     }
 
+    throttling_group = qemu_opt_get(opts, "throttling.group");
+    if (throttling_group && !*throttling_group) {
+        error_setg(errp, "throttling.group must not be empty");
+        goto early_err;
+    }
+
+    /* request merging */
+    merge_max_size = qemu_opt_get_size(opts, "merge.max-size", 0);
+    merge_timeout = qemu_opt_get_number(opts, "merge.timeout", 0);
+    if (merge_max_size && merge_max_size < BDRV_SECTOR_SIZE) {
+        error_setg(errp, "merge.max-size must be at least %d bytes",
+                   BDRV_SECTOR_SIZE);
+        goto early_err;
+    }
+    if (merge_timeout < 0 || merge_timeout > 1000000) {
+        error_setg(errp, "merge.timeout must be between 0 and 1000000 "
+                   "microseconds");
+        goto early_err;
+    }
+
+    /* copy-on-read readahead */
+    readahead_window = qemu_opt_get_size(opts, "readahead.window", 0);
+    readahead_max_memory = qemu_opt_get_size(opts, "readahead.max-memory",
+                                             16 << 20);
+    if (readahead_window && !copy_on_read) {
+        error_setg(errp, "readahead.window requires copy-on-read");
+        goto early_err;
+    }
+
+    chain_cache_size = qemu_opt_get_size(opts, "chain-cache.size", 0);
+
+    stats_intervals = qemu_opt_get(opts, "stats-intervals");
+    if (stats_intervals && !parse_stats_intervals(NULL, stats_intervals,
+                                                  &error)) {
+        error_propagate(errp, error);
+        goto early_err;
+    }
+
     on_write_error = BLOCKDEV_ON_ERROR_ENOSPC;
     if ((buf = qemu_opt_get(opts, "werror")) != NULL) {
         if (type != IF_IDE && type != IF_SCSI && type != IF_VIRTIO && type != IF_NONE) {
@@ -480,9 +556,13 @@ static DriveInfo *blockdev_init(QDict *bs_opts,
 
     bdrv_set_on_error(dinfo->bdrv, on_read_error, on_write_error);
 
+    if (stats_intervals) {
+        parse_stats_intervals(dinfo->bdrv, stats_intervals, NULL);
+    }
+
     /* disk I/O throttling */
     if (throttle_enabled(&cfg)) {
-        bdrv_io_limits_enable(dinfo->bdrv);
+        bdrv_io_limits_enable(dinfo->bdrv, throttling_group);
         bdrv_set_io_limits(dinfo->bdrv, &cfg);
     }
 
@@ -524,6 +604,20 @@ static DriveInfo *blockdev_init(QDict *bs_opts,
     if (bdrv_key_required(dinfo->bdrv))
         autostart = 0;
 
+    if (merge_max_size) {
+        bdrv_set_merge_limits(dinfo->bdrv, merge_max_size,
+                              merge_timeout * SCALE_US);
+    }
+
+    if (readahead_window) {
+        bdrv_set_readahead(dinfo->bdrv, readahead_window,
+                           readahead_max_memory);
+    }
+
+    if (chain_cache_size) {
+        bdrv_set_chain_cache(dinfo->bdrv, chain_cache_size);
+    }
+
     QDECREF(bs_opts);
     qemu_opts_del(opts);
 
@@ -1066,6 +1160,7 @@ struct BlkTransactionState {
 typedef struct InternalSnapshotState {
     BlkTransactionState common;
     BlockDriverState *bs;
+    AioContext *aio_context;
     QEMUSnapshotInfo sn;
 } InternalSnapshotState;
 
@@ -1098,6 +1193,10 @@ static void internal_snapshot_prepare(BlkTransactionState *common,
         return;
     }
 
+    /* AioContext is released in .clean() */
+    state->aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(state->aio_context);
+
     if (!bdrv_is_inserted(bs)) {
         error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
         return;
@@ -1173,11 +1272,22 @@ static void internal_snapshot_abort(BlkTransactionState *common)
     }
 }
 
+static void internal_snapshot_clean(BlkTransactionState *common)
+{
+    InternalSnapshotState *state = DO_UPCAST(InternalSnapshotState,
+                                             common, common);
+
+    if (state->aio_context) {
+        aio_context_release(state->aio_context);
+    }
+}
+
 /* external snapshot private data */
 typedef struct ExternalSnapshotState {
     BlkTransactionState common;
     BlockDriverState *old_bs;
     BlockDriverState *new_bs;
+    AioContext *aio_context;
 } ExternalSnapshotState;
 
 static void external_snapshot_prepare(BlkTransactionState *common,
@@ -1219,6 +1329,10 @@ static void external_snapshot_prepare(BlkTransactionState *common,
         return;
     }
 
+    /* AioContext is released in .clean() */
+    state->aio_context = bdrv_get_aio_context(state->old_bs);
+    aio_context_acquire(state->aio_context);
+
     if (!bdrv_is_inserted(state->old_bs)) {
         error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
         return;
@@ -1263,7 +1377,11 @@ static void external_snapshot_prepare(BlkTransactionState *common,
                     flags | BDRV_O_NO_BACKING, drv, &local_err);
     if (ret != 0) {
         error_propagate(errp, local_err);
+        return;
     }
+
+    /* The overlay must be serviced by the same event loop as old_bs */
+    bdrv_set_aio_context(state->new_bs, state->aio_context);
 }
 
 static void external_snapshot_commit(BlkTransactionState *common)
@@ -1289,6 +1407,15 @@ static void external_snapshot_abort(BlkTransactionState *common)
     }
 }
 
+static void external_snapshot_clean(BlkTransactionState *common)
+{
+    ExternalSnapshotState *state =
+                             DO_UPCAST(ExternalSnapshotState, common, common);
+    if (state->aio_context) {
+        aio_context_release(state->aio_context);
+    }
+}
+
 typedef struct DriveBackupState {
     BlkTransactionState common;
     BlockDriverState *bs;
@@ -1311,6 +1438,7 @@ static void drive_backup_prepare(BlkTransactionState *common, Error **errp)
                      backup->has_speed, backup->speed,
                      backup->has_on_source_error, backup->on_source_error,
                      backup->has_on_target_error, backup->on_target_error,
+                     backup->has_bitmap, backup->bitmap,
                      &local_err);
     if (error_is_set(&local_err)) {
         error_propagate(errp, local_err);
@@ -1330,7 +1458,11 @@ static void drive_backup_abort(BlkTransactionState *common)
 
     /* Only cancel if it's the job we started */
     if (bs && bs->job && bs->job == state->job) {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        aio_context_acquire(aio_context);
         block_job_cancel_sync(bs->job);
+        aio_context_release(aio_context);
     }
 }
 
@@ -1350,6 +1482,7 @@ static const BdrvActionOps actions[] = {
         .prepare  = external_snapshot_prepare,
         .commit   = external_snapshot_commit,
         .abort = external_snapshot_abort,
+        .clean = external_snapshot_clean,
     },
     [TRANSACTION_ACTION_KIND_DRIVE_BACKUP] = {
         .instance_size = sizeof(DriveBackupState),
@@ -1365,6 +1498,7 @@ static const BdrvActionOps actions[] = {
         .instance_size = sizeof(InternalSnapshotState),
         .prepare  = internal_snapshot_prepare,
         .abort = internal_snapshot_abort,
+        .clean = internal_snapshot_clean,
     },
 };
 
@@ -1575,10 +1709,13 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                bool has_iops_wr_max,
                                int64_t iops_wr_max,
                                bool has_iops_size,
-                               int64_t iops_size, Error **errp)
+                               int64_t iops_size,
+                               bool has_group,
+                               const char *group, Error **errp)
 {
     ThrottleConfig cfg;
     BlockDriverState *bs;
+    AioContext *aio_context;
 
     bs = bdrv_find(device);
     if (!bs) {
@@ -1622,8 +1759,30 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         return;
     }
 
+    if (has_group && !*group) {
+        error_setg(errp, "throttle group name must not be empty");
+        return;
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
+    if (has_group && throttle_enabled(&cfg) &&
+        aio_context != qemu_get_aio_context()) {
+        error_setg(errp, "Device '%s' uses an I/O thread and cannot join "
+                   "a throttle group", device);
+        goto out;
+    }
+
+    /* moving to another group (or out of one) starts from scratch */
+    if (bs->io_limits_enabled && has_group &&
+        (!bs->throttle_group ||
+         strcmp(throttle_group_get_name(bs), group))) {
+        bdrv_io_limits_disable(bs);
+    }
+
     if (!bs->io_limits_enabled && throttle_enabled(&cfg)) {
-        bdrv_io_limits_enable(bs);
+        bdrv_io_limits_enable(bs, has_group ? group : NULL);
     } else if (bs->io_limits_enabled && !throttle_enabled(&cfg)) {
         bdrv_io_limits_disable(bs);
     }
@@ -1631,20 +1790,114 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
     if (bs->io_limits_enabled) {
         bdrv_set_io_limits(bs, &cfg);
     }
+
+out:
+    aio_context_release(aio_context);
+}
+
+ThrottleGroupInfoList *qmp_query_throttle_groups(Error **errp)
+{
+    return throttle_group_query();
+}
+
+/* @type is a BlockAcctType, or BDRV_MAX_IOTYPE + a BlockRequestStage */
+static int block_latency_histogram_set(BlockDriverState *bs, int type,
+                                       uint64List *boundaries)
+{
+    uint64_t *array;
+    uint64List *entry;
+    int n = 0, ret;
+
+    for (entry = boundaries; entry; entry = entry->next) {
+        n++;
+    }
+
+    array = g_new(uint64_t, MAX(n, 1));
+    n = 0;
+    for (entry = boundaries; entry; entry = entry->next) {
+        array[n++] = entry->value;
+    }
+
+    if (type < BDRV_MAX_IOTYPE) {
+        ret = bdrv_set_latency_histogram(bs, type, array, n);
+    } else {
+        ret = bdrv_set_stage_histogram(bs, type - BDRV_MAX_IOTYPE, array, n);
+    }
+    g_free(array);
+    return ret;
+}
+
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     bool has_boundaries_stage,
+                                     uint64List *boundaries_stage,
+                                     Error **errp)
+{
+    BlockDriverState *bs;
+    AioContext *aio_context;
+    int i, ret;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!has_boundaries_read) {
+        boundaries_read = has_boundaries ? boundaries : NULL;
+    }
+    if (!has_boundaries_write) {
+        boundaries_write = has_boundaries ? boundaries : NULL;
+    }
+    if (!has_boundaries_flush) {
+        boundaries_flush = has_boundaries ? boundaries : NULL;
+    }
+    if (!has_boundaries_stage) {
+        boundaries_stage = NULL;
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
+    ret = block_latency_histogram_set(bs, BDRV_ACCT_READ, boundaries_read) ||
+          block_latency_histogram_set(bs, BDRV_ACCT_WRITE, boundaries_write) ||
+          block_latency_histogram_set(bs, BDRV_ACCT_FLUSH, boundaries_flush);
+    for (i = 0; !ret && i < BDRV_MAX_STAGE; i++) {
+        ret = block_latency_histogram_set(bs, BDRV_MAX_IOTYPE + i,
+                                          boundaries_stage);
+    }
+    if (ret) {
+        error_setg(errp, "Histogram boundaries must be strictly increasing");
+    }
+
+    aio_context_release(aio_context);
 }
 
 int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
 {
     const char *id = qdict_get_str(qdict, "id");
     BlockDriverState *bs;
+    AioContext *aio_context;
 
     bs = bdrv_find(id);
     if (!bs) {
         qerror_report(QERR_DEVICE_NOT_FOUND, id);
         return -1;
     }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
     if (bdrv_in_use(bs)) {
         qerror_report(QERR_DEVICE_IN_USE, id);
+        aio_context_release(aio_context);
         return -1;
     }
 
@@ -1668,12 +1921,14 @@ int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
         drive_uninit(drive_get_by_blockdev(bs));
     }
 
+    aio_context_release(aio_context);
     return 0;
 }
 
 void qmp_block_resize(const char *device, int64_t size, Error **errp)
 {
     BlockDriverState *bs;
+    AioContext *aio_context;
     int ret;
 
     bs = bdrv_find(device);
@@ -1690,7 +1945,10 @@ void qmp_block_resize(const char *device, int64_t size, Error **errp)
     /* complete all in-flight operations before resizing the device */
     bdrv_drain_all();
 
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
     ret = bdrv_truncate(bs, size);
+    aio_context_release(aio_context);
     switch (ret) {
     case 0:
         break;
@@ -1744,6 +2002,7 @@ void qmp_block_stream(const char *device, bool has_base,
     BlockDriverState *bs;
     BlockDriverState *base_bs = NULL;
     Error *local_err = NULL;
+    AioContext *aio_context;
 
     if (!has_on_error) {
         on_error = BLOCKDEV_ON_ERROR_REPORT;
@@ -1755,11 +2014,14 @@ void qmp_block_stream(const char *device, bool has_base,
         return;
     }
 
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
     if (base) {
         base_bs = bdrv_find_backing_image(bs, base);
         if (base_bs == NULL) {
             error_set(errp, QERR_BASE_NOT_FOUND, base);
-            return;
+            goto out;
         }
     }
 
@@ -1767,10 +2029,13 @@ void qmp_block_stream(const char *device, bool has_base,
                  on_error, block_job_cb, bs, &local_err);
     if (error_is_set(&local_err)) {
         error_propagate(errp, local_err);
-        return;
+        goto out;
     }
 
     trace_qmp_block_stream(bs, bs->job);
+
+out:
+    aio_context_release(aio_context);
 }
 
 void qmp_block_commit(const char *device,
@@ -1781,6 +2046,7 @@ void qmp_block_commit(const char *device,
     BlockDriverState *bs;
     BlockDriverState *base_bs, *top_bs;
     Error *local_err = NULL;
+    AioContext *aio_context;
     /* This will be part of the QMP command, if/when the
      * BlockdevOnError change for blkmirror makes it in
      */
@@ -1795,6 +2061,9 @@ void qmp_block_commit(const char *device,
         return;
     }
 
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
     /* default top_bs is the active layer */
     top_bs = bs;
 
@@ -1806,7 +2075,7 @@ void qmp_block_commit(const char *device,
 
     if (top_bs == NULL) {
         error_setg(errp, "Top image file %s not found", top ? top : "NULL");
-        return;
+        goto out;
     }
 
     if (has_base && base) {
@@ -1817,15 +2086,18 @@ void qmp_block_commit(const char *device,
 
     if (base_bs == NULL) {
         error_set(errp, QERR_BASE_NOT_FOUND, base ? base : "NULL");
-        return;
+        goto out;
     }
 
     commit_start(bs, base_bs, top_bs, speed, on_error, block_job_cb, bs,
                 &local_err);
     if (local_err != NULL) {
         error_propagate(errp, local_err);
-        return;
+        goto out;
     }
+
+out:
+    aio_context_release(aio_context);
 }
 
 void qmp_drive_backup(const char *device, const char *target,
@@ -1835,13 +2107,16 @@ void qmp_drive_backup(const char *device, const char *target,
                       bool has_speed, int64_t speed,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
+                      bool has_bitmap, const char *bitmap,
                       Error **errp)
 {
     BlockDriverState *bs;
     BlockDriverState *target_bs;
     BlockDriverState *source = NULL;
+    BdrvDirtyBitmap *sync_bitmap = NULL;
     BlockDriver *drv = NULL;
     Error *local_err = NULL;
+    AioContext *aio_context;
     int flags;
     int64_t size;
     int ret;
@@ -1865,9 +2140,12 @@ void qmp_drive_backup(const char *device, const char *target,
         return;
     }
 
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
     if (!bdrv_is_inserted(bs)) {
         error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
-        return;
+        goto out;
     }
 
     if (!has_format) {
@@ -1877,19 +2155,41 @@ void qmp_drive_backup(const char *device, const char *target,
         drv = bdrv_find_format(format);
         if (!drv) {
             error_set(errp, QERR_INVALID_BLOCK_FORMAT, format);
-            return;
+            goto out;
         }
     }
 
     if (bdrv_in_use(bs)) {
         error_set(errp, QERR_DEVICE_IN_USE, device);
-        return;
+        goto out;
+    }
+
+    if (sync == MIRROR_SYNC_MODE_INCREMENTAL) {
+        if (!has_bitmap) {
+            error_set(errp, QERR_MISSING_PARAMETER, "bitmap");
+            goto out;
+        }
+        sync_bitmap = bdrv_find_dirty_bitmap(bs, bitmap);
+        if (!sync_bitmap) {
+            error_setg(errp, "Dirty bitmap '%s' not found", bitmap);
+            goto out;
+        }
+        if (bdrv_dirty_bitmap_busy(bs, sync_bitmap)) {
+            error_setg(errp, "Dirty bitmap '%s' is in use", bitmap);
+            goto out;
+        }
+    } else if (has_bitmap) {
+        error_setg(errp, "a bitmap can only be used with sync mode "
+                   "'incremental'");
+        goto out;
     }
 
     flags = bs->open_flags | BDRV_O_RDWR;
 
     /* See if we have a backing HD we can use to create our new image
-     * on top of. */
+     * on top of.  An incremental backup only writes the data that changed,
+     * it is up to the user to provide a target whose backing file is the
+     * previous backup. */
     if (sync == MIRROR_SYNC_MODE_TOP) {
         source = bs->backing_hd;
         if (!source) {
@@ -1903,7 +2203,7 @@ void qmp_drive_backup(const char *device, const char *target,
     size = bdrv_getlength(bs);
     if (size < 0) {
         error_setg_errno(errp, -size, "bdrv_getlength failed");
-        return;
+        goto out;
     }
 
     if (mode != NEW_IMAGE_MODE_EXISTING) {
@@ -1920,7 +2220,7 @@ void qmp_drive_backup(const char *device, const char *target,
 
     if (error_is_set(&local_err)) {
         error_propagate(errp, local_err);
-        return;
+        goto out;
     }
 
     target_bs = bdrv_new("");
@@ -1928,16 +2228,141 @@ void qmp_drive_backup(const char *device, const char *target,
     if (ret < 0) {
         bdrv_unref(target_bs);
         error_propagate(errp, local_err);
-        return;
+        goto out;
     }
 
-    backup_start(bs, target_bs, speed, sync, on_source_error, on_target_error,
+    bdrv_set_aio_context(target_bs, aio_context);
+
+    backup_start(bs, target_bs, speed, sync, sync_bitmap,
+                 on_source_error, on_target_error,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
         bdrv_unref(target_bs);
         error_propagate(errp, local_err);
+        goto out;
+    }
+
+out:
+    aio_context_release(aio_context);
+}
+
+/* Look up a named dirty bitmap, with the AioContext of its device acquired
+ * on success.
+ */
+static BdrvDirtyBitmap *block_dirty_bitmap_lookup(const char *device,
+                                                  const char *name,
+                                                  BlockDriverState **pbs,
+                                                  AioContext **paio,
+                                                  Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    AioContext *aio_context;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return NULL;
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (!bitmap) {
+        error_setg(errp, "Dirty bitmap '%s' not found", name);
+        aio_context_release(aio_context);
+        return NULL;
+    }
+
+    *pbs = bs;
+    *paio = aio_context;
+    return bitmap;
+}
+
+void qmp_block_dirty_bitmap_add(const char *device, const char *name,
+                                bool has_granularity, uint32_t granularity,
+                                bool has_file, const char *file,
+                                Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    AioContext *aio_context;
+
+    if (!has_granularity) {
+        granularity = 65536;
+    }
+    if (granularity < 512 || granularity > 1048576 * 64 ||
+        (granularity & (granularity - 1))) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "granularity",
+                  "a power of 2 between 512 and 64M");
+        return;
+    }
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        goto out;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (!bitmap) {
+        goto out;
+    }
+    if (has_file && bdrv_dirty_bitmap_load(bs, bitmap, file, errp) < 0) {
+        bdrv_release_dirty_bitmap(bs, bitmap);
+    }
+
+out:
+    aio_context_release(aio_context);
+}
+
+void qmp_block_dirty_bitmap_remove(const char *device, const char *name,
+                                   Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    AioContext *aio_context;
+
+    bitmap = block_dirty_bitmap_lookup(device, name, &bs, &aio_context, errp);
+    if (!bitmap) {
+        return;
+    }
+
+    if (bdrv_dirty_bitmap_busy(bs, bitmap)) {
+        error_setg(errp, "Dirty bitmap '%s' is in use", name);
+    } else {
+        bdrv_release_dirty_bitmap(bs, bitmap);
+    }
+    aio_context_release(aio_context);
+}
+
+void qmp_block_dirty_bitmap_clear(const char *device, const char *name,
+                                  Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    AioContext *aio_context;
+
+    bitmap = block_dirty_bitmap_lookup(device, name, &bs, &aio_context, errp);
+    if (!bitmap) {
         return;
     }
+
+    if (bdrv_dirty_bitmap_busy(bs, bitmap)) {
+        error_setg(errp, "Dirty bitmap '%s' is in use", name);
+    } else {
+        bdrv_clear_dirty_bitmap(bs, bitmap);
+    }
+    aio_context_release(aio_context);
 }
 
 #define DEFAULT_MIRROR_BUF_SIZE   (10 << 20)
@@ -1957,6 +2382,7 @@ void qmp_drive_mirror(const char *device, const char *target,
     BlockDriverState *source, *target_bs;
     BlockDriver *drv = NULL;
     Error *local_err = NULL;
+    AioContext *aio_context;
     int flags;
     int64_t size;
     int ret;
@@ -1980,6 +2406,12 @@ void qmp_drive_mirror(const char *device, const char *target,
         buf_size = DEFAULT_MIRROR_BUF_SIZE;
     }
 
+    if (sync == MIRROR_SYNC_MODE_INCREMENTAL) {
+        error_setg(errp, "sync mode 'incremental' is only supported by "
+                   "drive-backup");
+        return;
+    }
+
     if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
         error_set(errp, QERR_INVALID_PARAMETER, device);
         return;
@@ -1995,9 +2427,12 @@ void qmp_drive_mirror(const char *device, const char *target,
         return;
     }
 
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
     if (!bdrv_is_inserted(bs)) {
         error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
-        return;
+        goto out;
     }
 
     if (!has_format) {
@@ -2007,13 +2442,13 @@ void qmp_drive_mirror(const char *device, const char *target,
         drv = bdrv_find_format(format);
         if (!drv) {
             error_set(errp, QERR_INVALID_BLOCK_FORMAT, format);
-            return;
+            goto out;
         }
     }
 
     if (bdrv_in_use(bs)) {
         error_set(errp, QERR_DEVICE_IN_USE, device);
-        return;
+        goto out;
     }
 
     flags = bs->open_flags | BDRV_O_RDWR;
@@ -2028,7 +2463,7 @@ void qmp_drive_mirror(const char *device, const char *target,
     size = bdrv_getlength(bs);
     if (size < 0) {
         error_setg_errno(errp, -size, "bdrv_getlength failed");
-        return;
+        goto out;
     }
 
     if ((sync == MIRROR_SYNC_MODE_FULL || !source)
@@ -2056,7 +2491,7 @@ void qmp_drive_mirror(const char *device, const char *target,
 
     if (error_is_set(&local_err)) {
         error_propagate(errp, local_err);
-        return;
+        goto out;
     }
 
     /* Mirroring takes care of copy-on-write using the source's backing
@@ -2068,33 +2503,45 @@ void qmp_drive_mirror(const char *device, const char *target,
     if (ret < 0) {
         bdrv_unref(target_bs);
         error_propagate(errp, local_err);
-        return;
+        goto out;
     }
 
+    bdrv_set_aio_context(target_bs, aio_context);
+
     mirror_start(bs, target_bs, speed, granularity, buf_size, sync,
                  on_source_error, on_target_error,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
         bdrv_unref(target_bs);
         error_propagate(errp, local_err);
-        return;
+        goto out;
     }
+
+out:
+    aio_context_release(aio_context);
 }
 
-static BlockJob *find_block_job(const char *device)
+/* Get the block job for a given device name and acquire its AioContext */
+static BlockJob *find_block_job(const char *device, AioContext **aio_context)
 {
     BlockDriverState *bs;
 
     bs = bdrv_find(device);
     if (!bs || !bs->job) {
+        *aio_context = NULL;
         return NULL;
     }
+
+    *aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(*aio_context);
+
     return bs->job;
 }
 
 void qmp_block_job_set_speed(const char *device, int64_t speed, Error **errp)
 {
-    BlockJob *job = find_block_job(device);
+    AioContext *aio_context;
+    BlockJob *job = find_block_job(device, &aio_context);
 
     if (!job) {
         error_set(errp, QERR_BLOCK_JOB_NOT_ACTIVE, device);
@@ -2102,12 +2549,14 @@ void qmp_block_job_set_speed(const char *device, int64_t speed, Error **errp)
     }
 
     block_job_set_speed(job, speed, errp);
+    aio_context_release(aio_context);
 }
 
 void qmp_block_job_cancel(const char *device,
                           bool has_force, bool force, Error **errp)
 {
-    BlockJob *job = find_block_job(device);
+    AioContext *aio_context;
+    BlockJob *job = find_block_job(device, &aio_context);
 
     if (!has_force) {
         force = false;
@@ -2119,16 +2568,19 @@ void qmp_block_job_cancel(const char *device,
     }
     if (job->paused && !force) {
         error_set(errp, QERR_BLOCK_JOB_PAUSED, device);
-        return;
+        goto out;
     }
 
     trace_qmp_block_job_cancel(job);
     block_job_cancel(job);
+out:
+    aio_context_release(aio_context);
 }
 
 void qmp_block_job_pause(const char *device, Error **errp)
 {
-    BlockJob *job = find_block_job(device);
+    AioContext *aio_context;
+    BlockJob *job = find_block_job(device, &aio_context);
 
     if (!job) {
         error_set(errp, QERR_BLOCK_JOB_NOT_ACTIVE, device);
@@ -2137,11 +2589,13 @@ void qmp_block_job_pause(const char *device, Error **errp)
 
     trace_qmp_block_job_pause(job);
     block_job_pause(job);
+    aio_context_release(aio_context);
 }
 
 void qmp_block_job_resume(const char *device, Error **errp)
 {
-    BlockJob *job = find_block_job(device);
+    AioContext *aio_context;
+    BlockJob *job = find_block_job(device, &aio_context);
 
     if (!job) {
         error_set(errp, QERR_BLOCK_JOB_NOT_ACTIVE, device);
@@ -2150,11 +2604,13 @@ void qmp_block_job_resume(const char *device, Error **errp)
 
     trace_qmp_block_job_resume(job);
     block_job_resume(job);
+    aio_context_release(aio_context);
 }
 
 void qmp_block_job_complete(const char *device, Error **errp)
 {
-    BlockJob *job = find_block_job(device);
+    AioContext *aio_context;
+    BlockJob *job = find_block_job(device, &aio_context);
 
     if (!job) {
         error_set(errp, QERR_BLOCK_JOB_NOT_ACTIVE, device);
@@ -2163,6 +2619,7 @@ void qmp_block_job_complete(const char *device, Error **errp)
 
     trace_qmp_block_job_complete(job);
     block_job_complete(job, errp);
+    aio_context_release(aio_context);
 }
 
 void qmp_blockdev_add(BlockdevOptions *options, Error **errp)
@@ -2339,6 +2796,37 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "throttling.iops-size",
             .type = QEMU_OPT_NUMBER,
             .help = "when limiting by iops max size of an I/O in bytes",
+        },{
+            .name = "throttling.group",
+            .type = QEMU_OPT_STRING,
+            .help = "name of the block throttling group",
+        },{
+            .name = "stats-intervals",
+            .type = QEMU_OPT_STRING,
+            .help = "colon separated list of intervals "
+                    "for collecting I/O statistics, in seconds",
+        },{
+            .name = "merge.max-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "merge sequential requests up to this many bytes",
+        },{
+            .name = "merge.timeout",
+            .type = QEMU_OPT_NUMBER,
+            .help = "longest time in microseconds a request waits to be merged",
+        },{
+            .name = "readahead.window",
+            .type = QEMU_OPT_SIZE,
+            .help = "with copy-on-read, prefetch up to this many bytes "
+                    "ahead of sequential reads",
+        },{
+            .name = "readahead.max-memory",
+            .type = QEMU_OPT_SIZE,
+            .help = "maximum size of the buffers used for readahead",
+        },{
+            .name = "chain-cache.size",
+            .type = QEMU_OPT_SIZE,
+            .help = "memory used to cache which image of the backing chain "
+                    "holds the data",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
@@ -35,6 +35,7 @@
 #include "qemu/envlist.h"
 
 int singlestep;
+static bool perf_map;
 #if defined(CONFIG_USE_GUEST_BASE)
 unsigned long mmap_min_addr;
 unsigned long guest_base;
@@ -695,6 +696,7 @@ static void usage(void)
            "-D logfile        write logs to 'logfile' (default stderr)\n"
            "-p pagesize       set the host page size to 'pagesize'\n"
            "-singlestep       always run in singlestep mode\n"
+           "-perfmap          write a perf map of the translated code\n"
            "-strace           log system calls\n"
            "\n"
            "Environment variables:\n"
@@ -852,6 +854,8 @@ int main(int argc, char **argv)
             optind++;
         } else if (!strcmp(r, "singlestep")) {
             singlestep = 1;
+        } else if (!strcmp(r, "perfmap")) {
+            perf_map = true;
         } else if (!strcmp(r, "strace")) {
             do_strace = 1;
         } else
@@ -905,6 +909,9 @@ int main(int argc, char **argv)
 #endif
     }
     tcg_exec_init(0);
+    if (perf_map) {
+        tcg_perf_map_init();
+    }
     cpu_exec_init_all();
     /* NOTE: we need to init the CPU at this stage to get
        qemu_host_page_size */
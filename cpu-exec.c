@@ -115,7 +115,8 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
     /* find translated block using physical mappings */
     phys_pc = get_page_addr_code(env, pc);
     phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
+    h = tb_phys_hash_func(phys_pc, cs_base, flags,
+                          tcg_ctx.tb_ctx.tb_phys_hash_bits);
     ptb1 = &tcg_ctx.tb_ctx.tb_phys_hash[h];
     for(;;) {
         tb = *ptb1;
@@ -141,8 +142,11 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
         ptb1 = &tb->phys_hash_next;
     }
  not_found:
-   /* if no translated code available, then translate it now */
+   /* if no translated code available, then translate it now; the new TB
+      is already at the head of its list, and the table may have been
+      resized, leaving ptb1 dangling */
     tb = tb_gen_code(env, pc, cs_base, flags, 0);
+    goto cache;
 
  found:
     /* Move the last found TB to the head of the list */
@@ -151,6 +155,7 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
         tb->phys_hash_next = tcg_ctx.tb_ctx.tb_phys_hash[h];
         tcg_ctx.tb_ctx.tb_phys_hash[h] = tb;
     }
+ cache:
     /* we add the TB in the virtual pc hash table */
     env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
     return tb;
@@ -38,6 +38,7 @@
 #include "qemu/main-loop.h"
 #include "qemu/bitmap.h"
 #include "qemu/seqlock.h"
+#include "qemu/rcu.h"
 
 #ifndef _WIN32
 #include "qemu/compatfd.h"
@@ -708,6 +709,73 @@ static QemuMutex qemu_global_mutex;
 static QemuCond qemu_io_proceeded_cond;
 static bool iothread_requesting_mutex;
 
+/* Whether this thread holds the global mutex.  The vCPU threads take it
+ * directly rather than with qemu_mutex_lock_iothread(), so every place
+ * that takes or retakes it sets this.
+ */
+static __thread bool iothread_locked;
+
+/* Time spent waiting for and holding the BQL.  KVM and qtest vCPU threads
+ * have their own counters in CPUState; the TCG thread runs all vCPUs and
+ * has one for itself; any other thread that takes the BQL, such as the
+ * migration thread, is accounted in bql_other_stats.  Everything here is
+ * protected by the BQL.
+ */
+typedef struct BQLStats {
+    uint64_t acquired;
+    uint64_t contended;
+    int64_t wait_ns;
+    int64_t hold_ns;
+    int64_t max_hold_ns;
+} BQLStats;
+
+static BQLStats bql_main_stats, bql_tcg_stats, bql_other_stats;
+static __thread BQLStats *bql_thread_stats;
+static int64_t bql_hold_start;
+
+static BQLStats *bql_stats(void)
+{
+    return bql_thread_stats ? bql_thread_stats : &bql_other_stats;
+}
+
+/* Called with the BQL just taken.  @wait_start is when the thread found it
+ * contended, or 0.
+ */
+static void bql_acquired(int64_t wait_start)
+{
+    BQLStats *s = bql_stats();
+
+    iothread_locked = true;
+    bql_hold_start = get_clock();
+    s->acquired++;
+    if (wait_start) {
+        s->contended++;
+        s->wait_ns += bql_hold_start - wait_start;
+    }
+}
+
+static void bql_released(void)
+{
+    BQLStats *s = bql_stats();
+    int64_t held = get_clock() - bql_hold_start;
+
+    s->hold_ns += held;
+    if (held > s->max_hold_ns) {
+        s->max_hold_ns = held;
+    }
+}
+
+/* Waiting on a condition variable releases the BQL, and that is not
+ * counted as holding it.
+ */
+static void qemu_bql_cond_wait(QemuCond *cond)
+{
+    bql_released();
+    qemu_cond_wait(cond, &qemu_global_mutex);
+    iothread_locked = true;
+    bql_hold_start = get_clock();
+}
+
 static QemuThread io_thread;
 
 static QemuThread *tcg_cpu_thread;
@@ -726,9 +794,10 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_pause_cond);
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
-    qemu_mutex_init(&qemu_global_mutex);
+    qemu_mutex_init_adaptive(&qemu_global_mutex);
 
     qemu_thread_get_self(&io_thread);
+    bql_thread_stats = &bql_main_stats;
 }
 
 void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
@@ -756,7 +825,7 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     while (!wi.done) {
         CPUState *self_cpu = current_cpu;
 
-        qemu_cond_wait(&qemu_work_cond, &qemu_global_mutex);
+        qemu_bql_cond_wait(&qemu_work_cond);
         current_cpu = self_cpu;
     }
 }
@@ -825,11 +894,11 @@ static void qemu_tcg_wait_io_event(void)
        /* Start accounting real time to the virtual clock if the CPUs
           are idle.  */
         qemu_clock_warp(QEMU_CLOCK_VIRTUAL);
-        qemu_cond_wait(tcg_halt_cond, &qemu_global_mutex);
+        qemu_bql_cond_wait(tcg_halt_cond);
     }
 
     while (iothread_requesting_mutex) {
-        qemu_cond_wait(&qemu_io_proceeded_cond, &qemu_global_mutex);
+        qemu_bql_cond_wait(&qemu_io_proceeded_cond);
     }
 
     CPU_FOREACH(cpu) {
@@ -840,22 +909,82 @@ static void qemu_tcg_wait_io_event(void)
 static void qemu_kvm_wait_io_event(CPUState *cpu)
 {
     while (cpu_thread_is_idle(cpu)) {
-        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+        qemu_bql_cond_wait(cpu->halt_cond);
     }
 
     qemu_kvm_eat_signals(cpu);
     qemu_wait_io_event_common(cpu);
 }
 
+/* Placement of the vCPU threads, from the -smp affinity and sched options.
+ * vCPU n uses entry n % nb_vcpu_sched.
+ */
+static QemuThreadSched *vcpu_sched;
+static int nb_vcpu_sched;
+
+int qemu_set_vcpu_sched(const char *affinity, const char *sched)
+{
+    char **cpus = NULL;
+    int i, n = 1;
+
+    if (affinity) {
+        cpus = g_strsplit(affinity, ":", 0);
+        n = g_strv_length(cpus);
+    }
+
+    g_free(vcpu_sched);
+    vcpu_sched = g_new0(QemuThreadSched, n);
+    nb_vcpu_sched = n;
+
+    for (i = 0; i < n; i++) {
+        if ((cpus && qemu_thread_parse_affinity(&vcpu_sched[i], cpus[i]) < 0) ||
+            (sched && qemu_thread_parse_sched(&vcpu_sched[i], sched) < 0)) {
+            g_strfreev(cpus);
+            g_free(vcpu_sched);
+            vcpu_sched = NULL;
+            nb_vcpu_sched = 0;
+            return -EINVAL;
+        }
+    }
+
+    g_strfreev(cpus);
+    return 0;
+}
+
+/* Called by the vCPU thread before it reports that it was created, so the
+ * guest never runs with the wrong placement.
+ */
+static void qemu_vcpu_set_sched(CPUState *cpu)
+{
+    int ret;
+
+    if (!nb_vcpu_sched) {
+        return;
+    }
+
+    ret = qemu_thread_set_sched(&vcpu_sched[cpu->cpu_index % nb_vcpu_sched]);
+    if (ret < 0) {
+        fprintf(stderr, "qemu: cannot set the affinity or scheduling "
+                "policy of vCPU %d: %s\n", cpu->cpu_index, strerror(-ret));
+        exit(1);
+    }
+}
+
 static void *qemu_kvm_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
     int r;
 
+    /* kvm_cpu_exec() looks up regions without the global mutex */
+    rcu_register_thread();
+
     qemu_mutex_lock(&qemu_global_mutex);
+    bql_thread_stats = cpu->bql_stats;
+    bql_acquired(0);
     qemu_thread_get_self(cpu->thread);
     cpu->thread_id = qemu_get_thread_id();
     current_cpu = cpu;
+    qemu_vcpu_set_sched(cpu);
 
     r = kvm_init_vcpu(cpu);
     if (r < 0) {
@@ -892,9 +1021,13 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
     sigset_t waitset;
     int r;
 
+    rcu_register_thread();
+
+    bql_thread_stats = cpu->bql_stats;
     qemu_mutex_lock_iothread();
     qemu_thread_get_self(cpu->thread);
     cpu->thread_id = qemu_get_thread_id();
+    qemu_vcpu_set_sched(cpu);
 
     sigemptyset(&waitset);
     sigaddset(&waitset, SIG_IPI);
@@ -930,10 +1063,17 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
 
+    rcu_register_thread();
+
     qemu_tcg_init_cpu_signals();
     qemu_thread_get_self(cpu->thread);
 
+    /* All vCPUs share this thread, so only the first one's options apply */
+    qemu_vcpu_set_sched(cpu);
+
     qemu_mutex_lock(&qemu_global_mutex);
+    bql_thread_stats = &bql_tcg_stats;
+    bql_acquired(0);
     CPU_FOREACH(cpu) {
         cpu->thread_id = qemu_get_thread_id();
         cpu->created = true;
@@ -942,7 +1082,7 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
 
     /* wait for initial kick-off after machine start */
     while (QTAILQ_FIRST(&cpus)->stopped) {
-        qemu_cond_wait(tcg_halt_cond, &qemu_global_mutex);
+        qemu_bql_cond_wait(tcg_halt_cond);
 
         /* process any pending work */
         CPU_FOREACH(cpu) {
@@ -1038,23 +1178,37 @@ static bool qemu_in_vcpu_thread(void)
     return current_cpu && qemu_cpu_is_self(current_cpu);
 }
 
+bool qemu_mutex_iothread_locked(void)
+{
+    return iothread_locked;
+}
+
 void qemu_mutex_lock_iothread(void)
 {
+    int64_t wait_start = 0;
+
     if (!tcg_enabled()) {
-        qemu_mutex_lock(&qemu_global_mutex);
+        if (qemu_mutex_trylock(&qemu_global_mutex)) {
+            wait_start = get_clock();
+            qemu_mutex_lock(&qemu_global_mutex);
+        }
     } else {
         iothread_requesting_mutex = true;
         if (qemu_mutex_trylock(&qemu_global_mutex)) {
+            wait_start = get_clock();
             qemu_cpu_kick_thread(first_cpu);
             qemu_mutex_lock(&qemu_global_mutex);
         }
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    bql_acquired(wait_start);
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    iothread_locked = false;
+    bql_released();
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
@@ -1093,7 +1247,7 @@ void pause_all_vcpus(void)
     }
 
     while (!all_vcpus_paused()) {
-        qemu_cond_wait(&qemu_pause_cond, &qemu_global_mutex);
+        qemu_bql_cond_wait(&qemu_pause_cond);
         CPU_FOREACH(cpu) {
             qemu_cpu_kick(cpu);
         }
@@ -1131,7 +1285,7 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
         cpu->hThread = qemu_thread_get_handle(cpu->thread);
 #endif
         while (!cpu->created) {
-            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+            qemu_bql_cond_wait(&qemu_cpu_cond);
         }
         tcg_cpu_thread = cpu->thread;
     } else {
@@ -1142,25 +1296,27 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
 
 static void qemu_kvm_start_vcpu(CPUState *cpu)
 {
+    cpu->bql_stats = g_new0(BQLStats, 1);
     cpu->thread = g_malloc0(sizeof(QemuThread));
     cpu->halt_cond = g_malloc0(sizeof(QemuCond));
     qemu_cond_init(cpu->halt_cond);
     qemu_thread_create(cpu->thread, qemu_kvm_cpu_thread_fn, cpu,
                        QEMU_THREAD_JOINABLE);
     while (!cpu->created) {
-        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        qemu_bql_cond_wait(&qemu_cpu_cond);
     }
 }
 
 static void qemu_dummy_start_vcpu(CPUState *cpu)
 {
+    cpu->bql_stats = g_new0(BQLStats, 1);
     cpu->thread = g_malloc0(sizeof(QemuThread));
     cpu->halt_cond = g_malloc0(sizeof(QemuCond));
     qemu_cond_init(cpu->halt_cond);
     qemu_thread_create(cpu->thread, qemu_dummy_cpu_thread_fn, cpu,
                        QEMU_THREAD_JOINABLE);
     while (!cpu->created) {
-        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        qemu_bql_cond_wait(&qemu_cpu_cond);
     }
 }
 
@@ -1376,6 +1532,60 @@ CpuInfoList *qmp_query_cpus(Error **errp)
     return head;
 }
 
+static BqlThreadInfo *bql_thread_info(const char *thread, BQLStats *s)
+{
+    BqlThreadInfo *info = g_new0(BqlThreadInfo, 1);
+
+    info->thread = g_strdup(thread);
+    info->acquired = s->acquired;
+    info->contended = s->contended;
+    info->wait_ns = s->wait_ns;
+    info->hold_ns = s->hold_ns;
+    info->max_hold_ns = s->max_hold_ns;
+    return info;
+}
+
+static void bql_info_add(BqlThreadInfoList ***tail, BqlThreadInfo *info)
+{
+    BqlThreadInfoList *entry = g_new0(BqlThreadInfoList, 1);
+
+    entry->value = info;
+    **tail = entry;
+    *tail = &entry->next;
+}
+
+BqlInfo *qmp_query_bql(Error **errp)
+{
+    BqlInfo *info = g_new0(BqlInfo, 1);
+    BqlThreadInfoList **tail = &info->threads;
+    BqlThreadInfo *thread;
+    QemuMutexStats stats;
+    CPUState *cpu;
+
+    qemu_mutex_get_stats(&qemu_global_mutex, &stats);
+    info->contended = stats.contended;
+    info->slept = stats.slept;
+
+    bql_info_add(&tail, bql_thread_info("main", &bql_main_stats));
+    if (tcg_enabled()) {
+        bql_info_add(&tail, bql_thread_info("tcg", &bql_tcg_stats));
+    }
+    CPU_FOREACH(cpu) {
+        if (!cpu->bql_stats) {
+            continue;
+        }
+        thread = bql_thread_info("vcpu", cpu->bql_stats);
+        thread->has_cpu_index = true;
+        thread->cpu_index = cpu->cpu_index;
+        thread->has_thread_id = true;
+        thread->thread_id = cpu->thread_id;
+        bql_info_add(&tail, thread);
+    }
+    bql_info_add(&tail, bql_thread_info("other", &bql_other_stats));
+
+    return info;
+}
+
 void qmp_memsave(int64_t addr, int64_t size, const char *filename,
                  bool has_cpu, int64_t cpu_index, Error **errp)
 {
@@ -26,12 +26,15 @@
 #include "exec/cputlb.h"
 
 #include "exec/memory-internal.h"
+#include "exec/ram_addr.h"
 
 //#define DEBUG_TLB
 //#define DEBUG_TLB_CHECK
 
 /* statistics */
 int tlb_flush_count;
+uint64_t tlb_miss_count;
+uint64_t tlb_victim_hit_count;
 
 static const CPUTLBEntry s_cputlb_empty_entry = {
     .addr_read  = -1,
@@ -71,22 +74,43 @@ void tlb_flush(CPUArchState *env, int flush_global)
             env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
         }
     }
+    for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        int mmu_idx;
+
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+        }
+    }
 
     memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
 
+    env->vtlb_index = 0;
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
     tlb_flush_count++;
 }
 
+/* true if any kind of access to the page at @addr hits @tlb_entry */
+static inline bool tlb_entry_is_page(CPUTLBEntry *tlb_entry,
+                                     target_ulong addr)
+{
+    return addr == (tlb_entry->addr_read &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           addr == (tlb_entry->addr_write &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           addr == (tlb_entry->addr_code &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK));
+}
+
+static inline bool tlb_entry_is_empty(CPUTLBEntry *tlb_entry)
+{
+    return (tlb_entry->addr_read & tlb_entry->addr_write &
+            tlb_entry->addr_code) == (target_ulong)-1;
+}
+
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
-    if (addr == (tlb_entry->addr_read &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_write &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_code &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+    if (tlb_entry_is_page(tlb_entry, addr)) {
         *tlb_entry = s_cputlb_empty_entry;
     }
 }
@@ -120,6 +144,14 @@ void tlb_flush_page(CPUArchState *env, target_ulong addr)
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
     }
 
+    /* check whether there are entries that need to be flushed in the vtlb */
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+        }
+    }
+
     tb_flush_jmp_cache(env, addr);
 }
 
@@ -185,6 +217,11 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
             }
+
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
         }
     }
 }
@@ -208,6 +245,13 @@ void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
     }
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
+        }
+    }
 }
 
 /* Our TLB does not support large pages, so remember the area covered by
@@ -241,7 +285,7 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                   int mmu_idx, target_ulong size)
 {
     MemoryRegionSection *section;
-    unsigned int index;
+    unsigned int index, vidx;
     target_ulong address;
     target_ulong code_address;
     uintptr_t addend;
@@ -279,8 +323,24 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                                             prot, &address);
 
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
+
+    /* make sure the victim tlb has no stale copy of the new page */
+    for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++) {
+        tlb_flush_entry(&env->tlb_v_table[mmu_idx][vidx],
+                        vaddr & TARGET_PAGE_MASK);
+    }
+
+    /* do not discard the translation in te, evict it into the victim tlb,
+       unless it is empty or for the same page */
+    if (!tlb_entry_is_page(te, vaddr & TARGET_PAGE_MASK) &&
+        !tlb_entry_is_empty(te)) {
+        vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    }
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -77,27 +77,33 @@ typedef struct {
     int sg_cur_index;
     dma_addr_t sg_cur_byte;
     QEMUIOVector iov;
-    QEMUBH *bh;
+    void *bounce;
+    dma_addr_t bounce_addr;
     DMAIOFunc *io_func;
 } DMAAIOCB;
 
-static void dma_bdrv_cb(void *opaque, int ret);
+/* Largest part of a segment that goes through the request's own buffer */
+#define DMA_BOUNCE_SIZE     (64 * 1024)
 
-static void reschedule_dma(void *opaque)
-{
-    DMAAIOCB *dbs = (DMAAIOCB *)opaque;
-
-    qemu_bh_delete(dbs->bh);
-    dbs->bh = NULL;
-    dma_bdrv_cb(dbs, 0);
-}
-
-static void continue_after_map_failure(void *opaque)
+/* Nothing of the current segment could be mapped, e.g. because it is not
+ * RAM and every bounce buffer of address_space_map() is busy.  Transfer
+ * up to DMA_BOUNCE_SIZE bytes of it through a buffer of the request, so
+ * that the request does not wait for other devices to release theirs.
+ */
+static void *dma_bdrv_bounce(DMAAIOCB *dbs, dma_addr_t addr,
+                             dma_addr_t *len)
 {
-    DMAAIOCB *dbs = (DMAAIOCB *)opaque;
+    *len = MIN(*len, DMA_BOUNCE_SIZE);
+    trace_dma_bounce(dbs, addr, *len);
 
-    dbs->bh = qemu_bh_new(reschedule_dma, dbs);
-    qemu_bh_schedule(dbs->bh);
+    if (!dbs->bounce) {
+        dbs->bounce = qemu_blockalign(dbs->bs, DMA_BOUNCE_SIZE);
+    }
+    dbs->bounce_addr = addr;
+    if (dbs->dir == DMA_DIRECTION_TO_DEVICE) {
+        dma_memory_read(dbs->sg->as, addr, dbs->bounce, *len);
+    }
+    return dbs->bounce;
 }
 
 static void dma_bdrv_unmap(DMAAIOCB *dbs)
@@ -105,6 +111,13 @@ static void dma_bdrv_unmap(DMAAIOCB *dbs)
     int i;
 
     for (i = 0; i < dbs->iov.niov; ++i) {
+        if (dbs->iov.iov[i].iov_base == dbs->bounce) {
+            if (dbs->dir == DMA_DIRECTION_FROM_DEVICE) {
+                dma_memory_write(dbs->sg->as, dbs->bounce_addr, dbs->bounce,
+                                 dbs->iov.iov[i].iov_len);
+            }
+            continue;
+        }
         dma_memory_unmap(dbs->sg->as, dbs->iov.iov[i].iov_base,
                          dbs->iov.iov[i].iov_len, dbs->dir,
                          dbs->iov.iov[i].iov_len);
@@ -121,10 +134,8 @@ static void dma_complete(DMAAIOCB *dbs, int ret)
         dbs->common.cb(dbs->common.opaque, ret);
     }
     qemu_iovec_destroy(&dbs->iov);
-    if (dbs->bh) {
-        qemu_bh_delete(dbs->bh);
-        dbs->bh = NULL;
-    }
+    qemu_vfree(dbs->bounce);
+    dbs->bounce = NULL;
     if (!dbs->in_cancel) {
         /* Requests may complete while dma_aio_cancel is in progress.  In
          * this case, the AIOCB should not be released because it is still
@@ -154,20 +165,22 @@ static void dma_bdrv_cb(void *opaque, int ret)
         cur_addr = dbs->sg->sg[dbs->sg_cur_index].base + dbs->sg_cur_byte;
         cur_len = dbs->sg->sg[dbs->sg_cur_index].len - dbs->sg_cur_byte;
         mem = dma_memory_map(dbs->sg->as, cur_addr, &cur_len, dbs->dir);
-        if (!mem)
-            break;
+        if (!mem) {
+            /* Submit what is mapped, the rest comes with the next round */
+            if (dbs->iov.size) {
+                break;
+            }
+            mem = dma_bdrv_bounce(dbs, cur_addr, &cur_len);
+        }
         qemu_iovec_add(&dbs->iov, mem, cur_len);
         dbs->sg_cur_byte += cur_len;
         if (dbs->sg_cur_byte == dbs->sg->sg[dbs->sg_cur_index].len) {
             dbs->sg_cur_byte = 0;
             ++dbs->sg_cur_index;
         }
-    }
-
-    if (dbs->iov.size == 0) {
-        trace_dma_map_wait(dbs);
-        cpu_register_map_client(dbs, continue_after_map_failure);
-        return;
+        if (mem == dbs->bounce) {
+            break;
+        }
     }
 
     dbs->acb = dbs->io_func(dbs->bs, dbs->sector_num, &dbs->iov,
@@ -214,7 +227,7 @@ BlockDriverAIOCB *dma_bdrv_io(
     dbs->sg_cur_byte = 0;
     dbs->dir = dir;
     dbs->io_func = io_func;
-    dbs->bh = NULL;
+    dbs->bounce = NULL;
     qemu_iovec_init(&dbs->iov, sg->nsg);
     dma_bdrv_cb(dbs, 0);
     return &dbs->common;
@@ -24,6 +24,13 @@
 #include "sysemu/cpus.h"
 #include "qapi/error.h"
 #include "qmp-commands.h"
+#include "qemu/thread.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+
+#include <zlib.h>
 
 static uint16_t cpu_convert_to_target16(uint16_t val, int endian)
 {
@@ -76,20 +83,57 @@ typedef struct DumpState {
     int64_t begin;
     int64_t length;
     Error **errp;
+
+    DumpGuestMemoryFormat format;
+    int nr_cpus;
+    /* Written by another thread while a detached dump runs */
+    DumpStatus status;
+    bool detached;
+    QemuThread thread;
+    uint64_t total_size;
+    uint64_t written_size;
+
+    /* kdump-compressed format */
+    uint8_t *note_buf;              /* where the notes are collected */
+    size_t note_buf_offset;
+    size_t block_size;              /* = guest page size */
+    uint64_t max_mapnr;             /* highest page frame number + 1 */
+    uint64_t num_dumpable;          /* pages that get a descriptor */
+    uint8_t *dump_bitmap;
+    size_t len_dump_bitmap;         /* of one bitmap, in bytes */
+    size_t sub_hdr_size;            /* in blocks */
+    off_t offset_page;              /* of the first page descriptor */
 } DumpState;
 
+static DumpState dump_state_global;
+
+bool dump_in_progress(void)
+{
+    return atomic_read(&dump_state_global.status) == DUMP_STATUS_ACTIVE;
+}
+
 static int dump_cleanup(DumpState *s)
 {
     int ret = 0;
 
+    /* A detached dump ends in its own thread */
+    if (s->detached) {
+        qemu_mutex_lock_iothread();
+    }
     guest_phys_blocks_free(&s->guest_phys_blocks);
     memory_mapping_list_free(&s->list);
+    g_free(s->dump_bitmap);
+    s->dump_bitmap = NULL;
     if (s->fd != -1) {
         close(s->fd);
+        s->fd = -1;
     }
     if (s->resume) {
         vm_start();
     }
+    if (s->detached) {
+        qemu_mutex_unlock_iothread();
+    }
 
     return ret;
 }
@@ -271,7 +315,7 @@ static inline int cpu_index(CPUState *cpu)
     return cpu->cpu_index + 1;
 }
 
-static int write_elf64_notes(DumpState *s)
+static int write_elf64_notes(WriteCoreDumpFunction f, DumpState *s)
 {
     CPUState *cpu;
     int ret;
@@ -279,7 +323,7 @@ static int write_elf64_notes(DumpState *s)
 
     CPU_FOREACH(cpu) {
         id = cpu_index(cpu);
-        ret = cpu_write_elf64_note(fd_write_vmcore, cpu, id, s);
+        ret = cpu_write_elf64_note(f, cpu, id, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write elf notes.\n");
             return -1;
@@ -287,7 +331,7 @@ static int write_elf64_notes(DumpState *s)
     }
 
     CPU_FOREACH(cpu) {
-        ret = cpu_write_elf64_qemunote(fd_write_vmcore, cpu, s);
+        ret = cpu_write_elf64_qemunote(f, cpu, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write CPU status.\n");
             return -1;
@@ -321,7 +365,7 @@ static int write_elf32_note(DumpState *s)
     return 0;
 }
 
-static int write_elf32_notes(DumpState *s)
+static int write_elf32_notes(WriteCoreDumpFunction f, DumpState *s)
 {
     CPUState *cpu;
     int ret;
@@ -329,7 +373,7 @@ static int write_elf32_notes(DumpState *s)
 
     CPU_FOREACH(cpu) {
         id = cpu_index(cpu);
-        ret = cpu_write_elf32_note(fd_write_vmcore, cpu, id, s);
+        ret = cpu_write_elf32_note(f, cpu, id, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write elf notes.\n");
             return -1;
@@ -337,7 +381,7 @@ static int write_elf32_notes(DumpState *s)
     }
 
     CPU_FOREACH(cpu) {
-        ret = cpu_write_elf32_qemunote(fd_write_vmcore, cpu, s);
+        ret = cpu_write_elf32_qemunote(f, cpu, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write CPU status.\n");
             return -1;
@@ -403,6 +447,7 @@ static int write_memory(DumpState *s, GuestPhysBlock *block, ram_addr_t start,
         if (ret < 0) {
             return ret;
         }
+        s->written_size += TARGET_PAGE_SIZE;
     }
 
     if ((size % TARGET_PAGE_SIZE) != 0) {
@@ -411,6 +456,7 @@ static int write_memory(DumpState *s, GuestPhysBlock *block, ram_addr_t start,
         if (ret < 0) {
             return ret;
         }
+        s->written_size += size % TARGET_PAGE_SIZE;
     }
 
     return 0;
@@ -574,7 +620,7 @@ static int dump_begin(DumpState *s)
         }
 
         /* write notes to vmcore */
-        if (write_elf64_notes(s) < 0) {
+        if (write_elf64_notes(fd_write_vmcore, s) < 0) {
             return -1;
         }
 
@@ -597,7 +643,7 @@ static int dump_begin(DumpState *s)
         }
 
         /* write notes to vmcore */
-        if (write_elf32_notes(s) < 0) {
+        if (write_elf32_notes(fd_write_vmcore, s) < 0) {
             return -1;
         }
     }
@@ -686,6 +732,524 @@ static int create_vmcore(DumpState *s)
     return 0;
 }
 
+#if !defined(WIN32)
+/*
+ * kdump-compressed format.  The layout of the file is:
+ *
+ *   ----------------------------
+ *   |  disk dump header        |   one block
+ *   ----------------------------
+ *   |  kdump sub header        |   sub_hdr_size blocks
+ *   |  elf notes               |
+ *   ----------------------------
+ *   |  1st bitmap              |   valid pages
+ *   ----------------------------
+ *   |  2nd bitmap              |   dumped pages, the same here
+ *   ----------------------------
+ *   |  page descriptors        |   one per bit set in the 2nd bitmap
+ *   ----------------------------
+ *   |  page data               |   the zero page comes first
+ *   ----------------------------
+ *
+ * A block is a guest page.  Descriptors and data are written at two
+ * offsets at once, so the file must be seekable.
+ */
+
+/* Pages handed to a worker at a time */
+#define DUMP_BATCH_PAGES        64
+#define DUMP_MAX_THREADS        8
+
+typedef struct DumpWorker {
+    QemuThread thread;
+    QemuSemaphore sem_start;
+    QemuSemaphore *sem_done;
+    DumpState *s;
+    bool quit;
+
+    /* Input, set up by the dump thread */
+    int nr_pages;
+    const uint8_t *src[DUMP_BATCH_PAGES];
+    uint8_t *bounce;                /* for pages at the edge of a block */
+
+    /* Output: the stored pages, back to back */
+    uint8_t *out;
+    size_t out_len;
+    bool zero[DUMP_BATCH_PAGES];
+    uint32_t size[DUMP_BATCH_PAGES];
+    uint32_t flags[DUMP_BATCH_PAGES];
+} DumpWorker;
+
+typedef struct DumpPageIter {
+    GuestPhysBlock *block;
+    uint64_t pfn;
+} DumpPageIter;
+
+static void dump_page_iter_init(DumpState *s, DumpPageIter *it)
+{
+    it->block = QTAILQ_FIRST(&s->guest_phys_blocks.head);
+    it->pfn = it->block ? it->block->target_start / s->block_size : 0;
+}
+
+/*
+ * Return the next guest page in page frame order.  If @data is not NULL,
+ * point it to the contents; a page that is only partly covered by its
+ * block is assembled in @bounce, with the rest zeroed.  Should two blocks
+ * share a page, the page is reported once, with the first one's part.
+ */
+static bool dump_next_page(DumpState *s, DumpPageIter *it, uint64_t *pfn,
+                           const uint8_t **data, uint8_t *bounce)
+{
+    GuestPhysBlock *block = it->block;
+    hwaddr addr, start, end;
+
+    while (block && it->pfn * s->block_size >= block->target_end) {
+        block = QTAILQ_NEXT(block, next);
+        if (block) {
+            it->pfn = MAX(it->pfn, block->target_start / s->block_size);
+        }
+    }
+    it->block = block;
+    if (!block) {
+        return false;
+    }
+
+    *pfn = it->pfn++;
+    if (!data) {
+        return true;
+    }
+
+    addr = *pfn * s->block_size;
+    if (addr >= block->target_start &&
+        addr + s->block_size <= block->target_end) {
+        *data = block->host_addr + (addr - block->target_start);
+        return true;
+    }
+
+    start = MAX(addr, block->target_start);
+    end = MIN(addr + s->block_size, block->target_end);
+    memset(bounce, 0, s->block_size);
+    memcpy(bounce + (start - addr),
+           block->host_addr + (start - block->target_start), end - start);
+    *data = bounce;
+    return true;
+}
+
+static int dump_pwrite(DumpState *s, const void *buf, size_t size,
+                       off_t offset)
+{
+    const uint8_t *p = buf;
+    ssize_t ret;
+
+    while (size > 0) {
+        ret = pwrite(s->fd, p, size, offset);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        p += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+static int buf_write_note(void *buf, size_t size, void *opaque)
+{
+    DumpState *s = opaque;
+
+    if (s->note_buf_offset + size > s->note_size) {
+        return -1;
+    }
+    memcpy(s->note_buf + s->note_buf_offset, buf, size);
+    s->note_buf_offset += size;
+    return 0;
+}
+
+static const char *dump_uts_machine(DumpState *s)
+{
+    switch (s->dump_info.d_machine) {
+    case EM_X86_64:
+        return "x86_64";
+    case EM_386:
+        return "i386";
+    case EM_PPC64:
+        return "ppc64";
+    case EM_S390:
+        return "s390x";
+    default:
+        return "";
+    }
+}
+
+/* Write the headers and the notes, the first 1 + sub_hdr_size blocks */
+static int write_kdump_headers(DumpState *s)
+{
+    int endian = s->dump_info.d_endian;
+    size_t size = (1 + s->sub_hdr_size) * s->block_size;
+    uint8_t *buf = g_malloc0(size);
+    uint8_t *sub = buf + s->block_size;
+    uint64_t offset_note;
+    uint32_t max_mapnr32 = MIN(s->max_mapnr, UINT32_MAX);
+    uint32_t bitmap_blocks = 2 * s->len_dump_bitmap / s->block_size;
+    struct timeval tv;
+    int ret;
+
+    gettimeofday(&tv, NULL);
+
+    if (s->dump_info.d_class == ELFCLASS64) {
+        DiskDumpHeader64 *dh = (DiskDumpHeader64 *)buf;
+        KdumpSubHeader64 *kh = (KdumpSubHeader64 *)sub;
+
+        memcpy(dh->signature, KDUMP_SIGNATURE, KDUMP_SIG_LEN);
+        dh->header_version = cpu_convert_to_target32(KDUMP_HEADER_VERSION,
+                                                     endian);
+        pstrcpy(dh->utsname.machine, sizeof(dh->utsname.machine),
+                dump_uts_machine(s));
+        dh->timestamp_sec = cpu_convert_to_target64(tv.tv_sec, endian);
+        dh->timestamp_usec = cpu_convert_to_target64(tv.tv_usec, endian);
+        dh->status = cpu_convert_to_target32(KDUMP_DH_COMPRESSED_ZLIB,
+                                             endian);
+        dh->block_size = cpu_convert_to_target32(s->block_size, endian);
+        dh->sub_hdr_size = cpu_convert_to_target32(s->sub_hdr_size, endian);
+        dh->bitmap_blocks = cpu_convert_to_target32(bitmap_blocks, endian);
+        dh->max_mapnr = cpu_convert_to_target32(max_mapnr32, endian);
+        dh->nr_cpus = cpu_convert_to_target32(s->nr_cpus, endian);
+
+        offset_note = s->block_size + sizeof(*kh);
+        kh->dump_level = cpu_convert_to_target32(KDUMP_DUMP_LEVEL, endian);
+        kh->offset_note = cpu_convert_to_target64(offset_note, endian);
+        kh->size_note = cpu_convert_to_target64(s->note_size, endian);
+        kh->max_mapnr_64 = cpu_convert_to_target64(s->max_mapnr, endian);
+    } else {
+        DiskDumpHeader32 *dh = (DiskDumpHeader32 *)buf;
+        KdumpSubHeader32 *kh = (KdumpSubHeader32 *)sub;
+
+        memcpy(dh->signature, KDUMP_SIGNATURE, KDUMP_SIG_LEN);
+        dh->header_version = cpu_convert_to_target32(KDUMP_HEADER_VERSION,
+                                                     endian);
+        pstrcpy(dh->utsname.machine, sizeof(dh->utsname.machine),
+                dump_uts_machine(s));
+        dh->timestamp_sec = cpu_convert_to_target32(tv.tv_sec, endian);
+        dh->timestamp_usec = cpu_convert_to_target32(tv.tv_usec, endian);
+        dh->status = cpu_convert_to_target32(KDUMP_DH_COMPRESSED_ZLIB,
+                                             endian);
+        dh->block_size = cpu_convert_to_target32(s->block_size, endian);
+        dh->sub_hdr_size = cpu_convert_to_target32(s->sub_hdr_size, endian);
+        dh->bitmap_blocks = cpu_convert_to_target32(bitmap_blocks, endian);
+        dh->max_mapnr = cpu_convert_to_target32(max_mapnr32, endian);
+        dh->nr_cpus = cpu_convert_to_target32(s->nr_cpus, endian);
+
+        offset_note = s->block_size + sizeof(*kh);
+        kh->dump_level = cpu_convert_to_target32(KDUMP_DUMP_LEVEL, endian);
+        kh->offset_note = cpu_convert_to_target64(offset_note, endian);
+        kh->size_note = cpu_convert_to_target32(s->note_size, endian);
+        kh->max_mapnr_64 = cpu_convert_to_target64(s->max_mapnr, endian);
+    }
+
+    /* The notes follow the sub header */
+    s->note_buf = buf + offset_note;
+    s->note_buf_offset = 0;
+    if (s->dump_info.d_class == ELFCLASS64) {
+        ret = write_elf64_notes(buf_write_note, s);
+    } else {
+        ret = write_elf32_notes(buf_write_note, s);
+    }
+    s->note_buf = NULL;
+    if (ret < 0) {
+        /* the notes writer cleaned up already */
+        g_free(buf);
+        return -1;
+    }
+
+    ret = dump_pwrite(s, buf, size, 0);
+    g_free(buf);
+    if (ret < 0) {
+        dump_error(s, "dump: failed to write kdump headers.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int write_kdump_bitmaps(DumpState *s)
+{
+    off_t offset = (1 + s->sub_hdr_size) * s->block_size;
+
+    if (dump_pwrite(s, s->dump_bitmap, s->len_dump_bitmap, offset) < 0 ||
+        dump_pwrite(s, s->dump_bitmap, s->len_dump_bitmap,
+                    offset + s->len_dump_bitmap) < 0) {
+        dump_error(s, "dump: failed to write kdump bitmaps.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void dump_compress_batch(DumpWorker *w)
+{
+    size_t page_size = w->s->block_size;
+    uLongf len;
+    int i;
+
+    w->out_len = 0;
+    for (i = 0; i < w->nr_pages; i++) {
+        w->zero[i] = buffer_is_zero(w->src[i], page_size);
+        if (w->zero[i]) {
+            continue;
+        }
+
+        /* Keep the page as is unless it gets smaller */
+        len = page_size - 1;
+        if (compress2(w->out + w->out_len, &len, w->src[i], page_size,
+                      Z_BEST_SPEED) == Z_OK) {
+            w->size[i] = len;
+            w->flags[i] = KDUMP_DH_COMPRESSED_ZLIB;
+        } else {
+            memcpy(w->out + w->out_len, w->src[i], page_size);
+            w->size[i] = page_size;
+            w->flags[i] = 0;
+        }
+        w->out_len += w->size[i];
+    }
+}
+
+static void *dump_worker_thread(void *opaque)
+{
+    DumpWorker *w = opaque;
+
+    for (;;) {
+        qemu_sem_wait(&w->sem_start);
+        if (w->quit) {
+            break;
+        }
+        dump_compress_batch(w);
+        qemu_sem_post(w->sem_done);
+    }
+
+    return NULL;
+}
+
+static int dump_nr_threads(void)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return MAX(MIN(ncpus, DUMP_MAX_THREADS), 1);
+}
+
+/* Append a page descriptor, writing them out a block at a time */
+static int write_kdump_desc(DumpState *s, PageDescriptor *pd_buf, int *nr,
+                            off_t *offset, PageDescriptor *pd)
+{
+    int per_block = s->block_size / sizeof(PageDescriptor);
+
+    if (pd) {
+        pd_buf[(*nr)++] = *pd;
+        if (*nr < per_block) {
+            return 0;
+        }
+    }
+    if (*nr == 0) {
+        return 0;
+    }
+    if (dump_pwrite(s, pd_buf, *nr * sizeof(PageDescriptor), *offset) < 0) {
+        return -1;
+    }
+    *offset += *nr * sizeof(PageDescriptor);
+    *nr = 0;
+    return 0;
+}
+
+/*
+ * Compress the pages in worker threads, a batch per worker and round,
+ * and write the results in page frame order from this thread.
+ */
+static int write_kdump_pages(DumpState *s)
+{
+    int endian = s->dump_info.d_endian;
+    int nr_threads = dump_nr_threads();
+    DumpWorker *workers = g_new0(DumpWorker, nr_threads);
+    QemuSemaphore sem_done;
+    PageDescriptor *pd_buf = g_malloc(s->block_size);
+    PageDescriptor pd, pd_zero;
+    off_t offset_desc = s->offset_page;
+    off_t offset_data;
+    uint8_t *zero_page;
+    DumpPageIter it;
+    uint64_t pfn;
+    bool more = true;
+    int nr_desc = 0;
+    int ret = -1;
+    int i, j, n;
+
+    qemu_sem_init(&sem_done, 0);
+    for (i = 0; i < nr_threads; i++) {
+        DumpWorker *w = &workers[i];
+
+        w->s = s;
+        w->sem_done = &sem_done;
+        w->bounce = g_malloc(DUMP_BATCH_PAGES * s->block_size);
+        w->out = g_malloc(DUMP_BATCH_PAGES * s->block_size);
+        qemu_sem_init(&w->sem_start, 0);
+        qemu_thread_create(&w->thread, dump_worker_thread, w,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    /* Every page that only holds zeroes points to a single copy */
+    offset_data = s->offset_page + s->num_dumpable * sizeof(PageDescriptor);
+    zero_page = g_malloc0(s->block_size);
+    ret = dump_pwrite(s, zero_page, s->block_size, offset_data);
+    g_free(zero_page);
+    if (ret < 0) {
+        goto out;
+    }
+    pd_zero.offset = cpu_convert_to_target64(offset_data, endian);
+    pd_zero.size = cpu_convert_to_target32(s->block_size, endian);
+    pd_zero.flags = 0;
+    pd_zero.page_flags = 0;
+    offset_data += s->block_size;
+
+    dump_page_iter_init(s, &it);
+    while (more) {
+        n = 0;
+        for (i = 0; i < nr_threads && more; i++) {
+            DumpWorker *w = &workers[i];
+
+            for (j = 0; j < DUMP_BATCH_PAGES; j++) {
+                if (!dump_next_page(s, &it, &pfn, &w->src[j],
+                                    w->bounce + j * s->block_size)) {
+                    more = false;
+                    break;
+                }
+            }
+            w->nr_pages = j;
+            if (j) {
+                qemu_sem_post(&w->sem_start);
+                n++;
+            }
+        }
+        for (i = 0; i < n; i++) {
+            qemu_sem_wait(&sem_done);
+        }
+
+        for (i = 0; i < n; i++) {
+            DumpWorker *w = &workers[i];
+            off_t offset = offset_data;
+
+            for (j = 0; j < w->nr_pages; j++) {
+                if (w->zero[j]) {
+                    ret = write_kdump_desc(s, pd_buf, &nr_desc, &offset_desc,
+                                           &pd_zero);
+                } else {
+                    pd.offset = cpu_convert_to_target64(offset, endian);
+                    pd.size = cpu_convert_to_target32(w->size[j], endian);
+                    pd.flags = cpu_convert_to_target32(w->flags[j], endian);
+                    pd.page_flags = 0;
+                    offset += w->size[j];
+                    ret = write_kdump_desc(s, pd_buf, &nr_desc, &offset_desc,
+                                           &pd);
+                }
+                if (ret < 0) {
+                    goto out;
+                }
+            }
+            ret = dump_pwrite(s, w->out, w->out_len, offset_data);
+            if (ret < 0) {
+                goto out;
+            }
+            offset_data += w->out_len;
+            s->written_size += (uint64_t)w->nr_pages * s->block_size;
+        }
+    }
+    ret = write_kdump_desc(s, pd_buf, &nr_desc, &offset_desc, NULL);
+
+out:
+    for (i = 0; i < nr_threads; i++) {
+        DumpWorker *w = &workers[i];
+
+        w->quit = true;
+        qemu_sem_post(&w->sem_start);
+        qemu_thread_join(&w->thread);
+        qemu_sem_destroy(&w->sem_start);
+        g_free(w->bounce);
+        g_free(w->out);
+    }
+    qemu_sem_destroy(&sem_done);
+    g_free(workers);
+    g_free(pd_buf);
+
+    if (ret < 0) {
+        dump_error(s, "dump: failed to write kdump pages.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int create_kdump_vmcore(DumpState *s)
+{
+    if (write_kdump_headers(s) < 0) {
+        return -1;
+    }
+
+    if (write_kdump_bitmaps(s) < 0) {
+        return -1;
+    }
+
+    if (write_kdump_pages(s) < 0) {
+        return -1;
+    }
+
+    dump_completed(s);
+    return 0;
+}
+
+/* Size the file and mark the pages that will be dumped */
+static int kdump_init(DumpState *s, Error **errp)
+{
+    GuestPhysBlock *last;
+    DumpPageIter it;
+    uint64_t pfn;
+    size_t i;
+
+    if (lseek(s->fd, 0, SEEK_CUR) == (off_t)-1) {
+        error_setg(errp, "kdump-compressed format needs a seekable file");
+        return -1;
+    }
+
+    s->block_size = TARGET_PAGE_SIZE;
+    last = QTAILQ_LAST(&s->guest_phys_blocks.head, GuestPhysBlockHead);
+    s->max_mapnr = last ? DIV_ROUND_UP(last->target_end, s->block_size) : 0;
+    s->len_dump_bitmap = ROUND_UP(DIV_ROUND_UP(s->max_mapnr, 8),
+                                  s->block_size);
+    s->dump_bitmap = g_malloc0(s->len_dump_bitmap);
+
+    /* Both bitmaps use bit pfn % 8 of byte pfn / 8 */
+    s->num_dumpable = 0;
+    dump_page_iter_init(s, &it);
+    while (dump_next_page(s, &it, &pfn, NULL, NULL)) {
+        s->dump_bitmap[pfn >> 3] |= 1 << (pfn & 7);
+    }
+    for (i = 0; i < s->len_dump_bitmap; i++) {
+        s->num_dumpable += ctpop8(s->dump_bitmap[i]);
+    }
+
+    if (s->dump_info.d_class == ELFCLASS64) {
+        s->sub_hdr_size = sizeof(KdumpSubHeader64);
+    } else {
+        s->sub_hdr_size = sizeof(KdumpSubHeader32);
+    }
+    s->sub_hdr_size = DIV_ROUND_UP(s->sub_hdr_size + s->note_size,
+                                   s->block_size);
+    s->offset_page = (1 + s->sub_hdr_size) * s->block_size +
+                     2 * s->len_dump_bitmap;
+    s->total_size = s->num_dumpable * s->block_size;
+
+    return 0;
+}
+#endif
+
 static ram_addr_t get_start_block(DumpState *s)
 {
     GuestPhysBlock *block;
@@ -714,6 +1278,28 @@ static ram_addr_t get_start_block(DumpState *s)
     return -1;
 }
 
+/* Bytes of guest memory that the dump covers */
+static uint64_t dump_calculate_size(DumpState *s)
+{
+    GuestPhysBlock *block;
+    int64_t left, right;
+    uint64_t total = 0;
+
+    QTAILQ_FOREACH(block, &s->guest_phys_blocks.head, next) {
+        if (s->has_filter) {
+            left = MAX(s->begin, block->target_start);
+            right = MIN(s->begin + s->length, block->target_end);
+            if (right > left) {
+                total += right - left;
+            }
+        } else {
+            total += block->target_end - block->target_start;
+        }
+    }
+
+    return total;
+}
+
 static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
                      int64_t begin, int64_t length, Error **errp)
 {
@@ -738,6 +1324,7 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
         nr_cpus++;
     }
 
+    s->nr_cpus = nr_cpus;
     s->errp = errp;
     s->fd = fd;
     s->has_filter = has_filter;
@@ -828,6 +1415,14 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
         }
     }
 
+    s->total_size = dump_calculate_size(s);
+#if !defined(WIN32)
+    if (s->format != DUMP_GUEST_MEMORY_FORMAT_ELF && kdump_init(s, errp) < 0) {
+        memory_mapping_list_free(&s->list);
+        goto cleanup;
+    }
+#endif
+
     return 0;
 
 cleanup:
@@ -840,15 +1435,56 @@ cleanup:
     return -1;
 }
 
+static void dump_process(DumpState *s, Error **errp)
+{
+    int ret;
+
+#if !defined(WIN32)
+    if (s->format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        ret = create_kdump_vmcore(s);
+    } else
+#endif
+    {
+        ret = create_vmcore(s);
+    }
+
+    if (ret < 0) {
+        if (!s->detached) {
+            if (!error_is_set(errp)) {
+                error_set(errp, QERR_IO_ERROR);
+            }
+        } else {
+            error_report("dump-guest-memory: failed to write the dump");
+        }
+    }
+
+    /* Last, a new dump may start as soon as this is seen */
+    atomic_mb_set(&s->status,
+                  ret < 0 ? DUMP_STATUS_FAILED : DUMP_STATUS_COMPLETED);
+}
+
+static void *dump_thread(void *opaque)
+{
+    rcu_register_thread();
+    dump_process(opaque, NULL);
+    rcu_unregister_thread();
+    return NULL;
+}
+
 void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
                            int64_t begin, bool has_length, int64_t length,
-                           Error **errp)
+                           bool has_format, DumpGuestMemoryFormat format,
+                           bool has_detach, bool detach, Error **errp)
 {
     const char *p;
     int fd = -1;
     DumpState *s;
     int ret;
 
+    if (dump_in_progress()) {
+        error_setg(errp, "a guest memory dump is already in progress");
+        return;
+    }
     if (has_begin && !has_length) {
         error_set(errp, QERR_MISSING_PARAMETER, "length");
         return;
@@ -857,6 +1493,22 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
         error_set(errp, QERR_MISSING_PARAMETER, "begin");
         return;
     }
+    if (!has_format) {
+        format = DUMP_GUEST_MEMORY_FORMAT_ELF;
+    }
+    if (format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
+#if defined(WIN32)
+        error_setg(errp, "kdump-compressed format is not supported on "
+                   "this host");
+        return;
+#endif
+        /* The kdump file is indexed by physical page frame */
+        if (paging || has_begin) {
+            error_setg(errp, "kdump-compressed format cannot be combined "
+                       "with paging or a memory range");
+            return;
+        }
+    }
 
 #if !defined(WIN32)
     if (strstart(file, "fd:", &p)) {
@@ -880,17 +1532,37 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
         return;
     }
 
-    s = g_malloc0(sizeof(DumpState));
+    s = &dump_state_global;
+    memset(s, 0, sizeof(*s));
+    s->format = format;
 
     ret = dump_init(s, fd, paging, has_begin, begin, length, errp);
     if (ret < 0) {
-        g_free(s);
+        s->status = DUMP_STATUS_FAILED;
         return;
     }
 
-    if (create_vmcore(s) < 0 && !error_is_set(s->errp)) {
-        error_set(errp, QERR_IO_ERROR);
+    atomic_mb_set(&s->status, DUMP_STATUS_ACTIVE);
+    if (has_detach && detach) {
+        /* The guest stays paused, so memory can be read from the thread */
+        s->detached = true;
+        s->errp = NULL;
+        qemu_thread_create(&s->thread, dump_thread, s, QEMU_THREAD_DETACHED);
+        return;
     }
 
-    g_free(s);
+    dump_process(s, errp);
+}
+
+DumpQueryResult *qmp_query_dump(Error **errp)
+{
+    DumpState *s = &dump_state_global;
+    DumpQueryResult *result = g_new0(DumpQueryResult, 1);
+
+    result->status = atomic_mb_read(&s->status);
+    /* Updated by the dump thread without a lock; a snapshot is enough */
+    result->completed = atomic_read(&s->written_size);
+    result->total = s->total_size;
+
+    return result;
 }
@@ -50,8 +50,10 @@
 #include "translate-all.h"
 
 #include "exec/memory-internal.h"
+#include "exec/ram_addr.h"
 
 #include "qemu/range.h"
+#include "qemu/rcu.h"
 
 //#define DEBUG_SUBPAGE
 
@@ -113,6 +115,8 @@ typedef struct PhysPageMap {
 } PhysPageMap;
 
 struct AddressSpaceDispatch {
+    struct rcu_head rcu;
+
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
      */
@@ -347,7 +351,8 @@ MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
     hwaddr len = *plen;
 
     for (;;) {
-        section = address_space_translate_internal(as->dispatch, addr, &addr, plen, true);
+        AddressSpaceDispatch *d = atomic_rcu_read(&as->dispatch);
+        section = address_space_translate_internal(d, addr, &addr, plen, true);
         mr = section->mr;
 
         if (!mr->iommu_ops) {
@@ -376,7 +381,9 @@ address_space_translate_for_iotlb(AddressSpace *as, hwaddr addr, hwaddr *xlat,
                                   hwaddr *plen)
 {
     MemoryRegionSection *section;
-    section = address_space_translate_internal(as->dispatch, addr, xlat, plen, false);
+    AddressSpaceDispatch *d = atomic_rcu_read(&as->dispatch);
+
+    section = address_space_translate_internal(d, addr, xlat, plen, false);
 
     assert(!section->mr->iommu_ops);
     return section;
@@ -951,6 +958,65 @@ void qemu_mutex_unlock_ramlist(void)
     qemu_mutex_unlock(&ram_list.mutex);
 }
 
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_mbind)
+/* From <numaif.h>, so that we do not need libnuma */
+#define QEMU_MPOL_PREFERRED     1
+#define QEMU_MPOL_BIND          2
+#define QEMU_MPOL_INTERLEAVE    3
+#define QEMU_MPOL_MF_STRICT     (1 << 0)
+#define QEMU_MPOL_MF_MOVE       (1 << 1)
+
+/* Must be called before the memory is touched, or the pages that are
+ * already there stay where they are.
+ */
+static void ram_block_set_policy(RAMBlock *block, void *host,
+                                 ram_addr_t length,
+                                 const HostMemPolicy *policy)
+{
+    static const int modes[] = {
+        [HOST_MEM_POLICY_PREFERRED] = QEMU_MPOL_PREFERRED,
+        [HOST_MEM_POLICY_BIND] = QEMU_MPOL_BIND,
+        [HOST_MEM_POLICY_INTERLEAVE] = QEMU_MPOL_INTERLEAVE,
+    };
+    unsigned long maxnode, last;
+    unsigned flags = 0;
+
+    if (!policy || policy->mode == HOST_MEM_POLICY_DEFAULT) {
+        return;
+    }
+
+    /* The kernel ignores the last bit of the mask.  An empty mask with
+     * "preferred" means the node of the faulting thread.
+     */
+    last = find_last_bit(policy->nodes, MAX_HOST_NODES);
+    maxnode = last < MAX_HOST_NODES ? last + 2 : 0;
+    if (policy->mode == HOST_MEM_POLICY_BIND) {
+        flags = QEMU_MPOL_MF_STRICT | QEMU_MPOL_MF_MOVE;
+    }
+
+    if (syscall(__NR_mbind, host, length, modes[policy->mode],
+                policy->nodes, maxnode, flags)) {
+        fprintf(stderr, "Cannot bind guest memory '%s' to host nodes: %s\n",
+                block->mr->name, strerror(errno));
+        exit(1);
+    }
+}
+#else
+static void ram_block_set_policy(RAMBlock *block, void *host,
+                                 ram_addr_t length,
+                                 const HostMemPolicy *policy)
+{
+    if (policy && policy->mode != HOST_MEM_POLICY_DEFAULT) {
+        fprintf(stderr, "NUMA memory policies not supported on this host\n");
+        exit(1);
+    }
+}
+#endif
+
 #ifdef __linux__
 
 #include <sys/vfs.h>
@@ -977,22 +1043,134 @@ static long gethugepagesize(const char *path)
     return fs.f_bsize;
 }
 
-static sigjmp_buf sigjump;
+/* Preallocation touches the pages from several threads.  Most of the cost
+ * of faulting in a hugepage is the kernel clearing it, which scales with
+ * the number of host CPUs.  The pages are allocated on first touch, so the
+ * host kernel also spreads them over the nodes that the threads run on.
+ */
+#define RAM_PREALLOC_MAX_THREADS    16
+
+/* Each thread reports its progress after this many pages */
+#define RAM_PREALLOC_PROGRESS_PAGES 1024
+
+typedef struct RAMPreallocThread {
+    QemuThread thread;
+    const char *name;
+    int index;
+    char *addr;
+    size_t numpages;
+    size_t hpagesize;
+} RAMPreallocThread;
+
+static __thread sigjmp_buf *prealloc_sigjump;
+static bool prealloc_failed;
 
 static void sigbus_handler(int signal)
 {
-    siglongjmp(sigjump, 1);
+    siglongjmp(*prealloc_sigjump, 1);
+}
+
+static void *ram_prealloc_thread(void *opaque)
+{
+    RAMPreallocThread *t = opaque;
+    sigjmp_buf env;
+    sigset_t set, oldset;
+    size_t i;
+
+    /* qemu_thread_create() blocks every signal in the new thread */
+    sigemptyset(&set);
+    sigaddset(&set, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
+
+    prealloc_sigjump = &env;
+    if (sigsetjmp(env, 1)) {
+        atomic_mb_set(&prealloc_failed, true);
+    } else {
+        /* MAP_POPULATE silently ignores failures, so touch every page */
+        for (i = 0; i < t->numpages; i++) {
+            *(volatile char *)(t->addr + i * t->hpagesize) = 0;
+            if ((i + 1) % RAM_PREALLOC_PROGRESS_PAGES == 0) {
+                trace_ram_prealloc_progress(t->name, t->index,
+                                            i + 1, t->numpages);
+            }
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    return NULL;
+}
+
+static int ram_prealloc_nthreads(size_t numpages)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (ncpus < 1) {
+        ncpus = 1;
+    }
+    return MIN(MIN(ncpus, RAM_PREALLOC_MAX_THREADS), MAX(numpages, 1));
+}
+
+static void ram_prealloc(const char *name, char *area, size_t memory,
+                         size_t hpagesize, int nthreads)
+{
+    RAMPreallocThread *threads;
+    struct sigaction act, oldact;
+    size_t numpages = memory / hpagesize;
+    int64_t start = get_clock();
+    int ret, i;
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = &sigbus_handler;
+    act.sa_flags = 0;
+
+    ret = sigaction(SIGBUS, &act, &oldact);
+    if (ret) {
+        perror("file_ram_alloc: failed to install signal handler");
+        exit(1);
+    }
+
+    prealloc_failed = false;
+    threads = g_new0(RAMPreallocThread, nthreads);
+    for (i = 0; i < nthreads; i++) {
+        threads[i].name = name;
+        threads[i].index = i;
+        threads[i].addr = area;
+        threads[i].numpages = numpages / nthreads + (i < numpages % nthreads);
+        threads[i].hpagesize = hpagesize;
+        area += threads[i].numpages * hpagesize;
+        qemu_thread_create(&threads[i].thread, ram_prealloc_thread,
+                           &threads[i], QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_join(&threads[i].thread);
+    }
+    g_free(threads);
+
+    if (prealloc_failed) {
+        fprintf(stderr, "file_ram_alloc: failed to preallocate pages\n");
+        exit(1);
+    }
+
+    ret = sigaction(SIGBUS, &oldact, NULL);
+    if (ret) {
+        perror("file_ram_alloc: failed to reinstall signal handler");
+        exit(1);
+    }
+
+    trace_ram_prealloc_done(name, memory, nthreads,
+                            (get_clock() - start) / SCALE_MS);
 }
 
 static void *file_ram_alloc(RAMBlock *block,
                             ram_addr_t memory,
-                            const char *path)
+                            const char *path,
+                            const HostMemPolicy *policy)
 {
     char *filename;
     char *sanitized_name;
     char *c;
     void *area;
-    int fd;
+    int fd, flags, nthreads = 0;
     unsigned long hpagesize;
 
     hpagesize = gethugepagesize(path);
@@ -1040,59 +1218,42 @@ static void *file_ram_alloc(RAMBlock *block,
     if (ftruncate(fd, memory))
         perror("ftruncate");
 
-    area = mmap(0, memory, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    flags = mem_share ? MAP_SHARED : MAP_PRIVATE;
+    if (mem_prealloc) {
+        nthreads = ram_prealloc_nthreads(memory / hpagesize);
+#ifdef MAP_POPULATE
+        /* With one thread, let the kernel fault in the pages up front; the
+         * touch loop below then only checks that they are all there.
+         * Populating a private mapping would only map the pages read-only.
+         */
+        if (nthreads == 1 && mem_share) {
+            flags |= MAP_POPULATE;
+        }
+#endif
+    }
+
+    area = mmap(0, memory, PROT_READ | PROT_WRITE, flags, fd, 0);
     if (area == MAP_FAILED) {
         perror("file_ram_alloc: can't mmap RAM pages");
         close(fd);
         return (NULL);
     }
 
-    if (mem_prealloc) {
-        int ret, i;
-        struct sigaction act, oldact;
-        sigset_t set, oldset;
-
-        memset(&act, 0, sizeof(act));
-        act.sa_handler = &sigbus_handler;
-        act.sa_flags = 0;
-
-        ret = sigaction(SIGBUS, &act, &oldact);
-        if (ret) {
-            perror("file_ram_alloc: failed to install signal handler");
-            exit(1);
-        }
+    ram_block_set_policy(block, area, memory, policy);
 
-        /* unblock SIGBUS */
-        sigemptyset(&set);
-        sigaddset(&set, SIGBUS);
-        pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
-
-        if (sigsetjmp(sigjump, 1)) {
-            fprintf(stderr, "file_ram_alloc: failed to preallocate pages\n");
-            exit(1);
-        }
-
-        /* MAP_POPULATE silently ignores failures */
-        for (i = 0; i < (memory/hpagesize)-1; i++) {
-            memset(area + (hpagesize*i), 0, 1);
-        }
-
-        ret = sigaction(SIGBUS, &oldact, NULL);
-        if (ret) {
-            perror("file_ram_alloc: failed to reinstall signal handler");
-            exit(1);
-        }
-
-        pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (mem_prealloc) {
+        ram_prealloc(block->mr->name, area, memory, hpagesize, nthreads);
     }
 
     block->fd = fd;
+    block->page_size = hpagesize;
     return area;
 }
 #else
 static void *file_ram_alloc(RAMBlock *block,
                             ram_addr_t memory,
-                            const char *path)
+                            const char *path,
+                            const HostMemPolicy *policy)
 {
     fprintf(stderr, "-mem-path not supported on this host\n");
     exit(1);
@@ -1206,30 +1367,40 @@ static int memory_try_enable_merging(void *addr, size_t len)
     return qemu_madvise(addr, len, QEMU_MADV_MERGEABLE);
 }
 
-ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
-                                   MemoryRegion *mr)
+static ram_addr_t ram_block_add(ram_addr_t size, void *host,
+                                MemoryRegion *mr,
+                                const HostMemPolicy *policy)
 {
     RAMBlock *block, *new_block;
+    const char *path = mem_path;
+    ram_addr_t old_ram_size, new_ram_size;
+    int i;
+
+    old_ram_size = last_ram_offset() >> TARGET_PAGE_BITS;
 
     size = TARGET_PAGE_ALIGN(size);
     new_block = g_malloc0(sizeof(*new_block));
     new_block->fd = -1;
+    new_block->page_size = qemu_real_host_page_size;
 
     /* This assumes the iothread lock is taken here too.  */
     qemu_mutex_lock_ramlist();
     new_block->mr = mr;
     new_block->offset = find_ram_offset(size);
+    if (policy && policy->mem_path) {
+        path = policy->mem_path;
+    }
     if (host) {
         new_block->host = host;
         new_block->flags |= RAM_PREALLOC_MASK;
     } else if (xen_enabled()) {
-        if (mem_path) {
+        if (path) {
             fprintf(stderr, "-mem-path not supported with Xen\n");
             exit(1);
         }
         xen_ram_alloc(new_block->offset, size, mr);
     } else {
-        if (mem_path) {
+        if (path) {
             if (phys_mem_alloc != qemu_anon_ram_alloc) {
                 /*
                  * file_ram_alloc() needs to allocate just like
@@ -1240,7 +1411,7 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
                         "-mem-path not supported with this accelerator\n");
                 exit(1);
             }
-            new_block->host = file_ram_alloc(new_block, size, mem_path);
+            new_block->host = file_ram_alloc(new_block, size, path, policy);
         }
         if (!new_block->host) {
             new_block->host = phys_mem_alloc(size);
@@ -1249,6 +1420,7 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
                         new_block->mr->name, strerror(errno));
                 exit(1);
             }
+            ram_block_set_policy(new_block, new_block->host, size, policy);
             memory_try_enable_merging(new_block->host, size);
         }
     }
@@ -1270,11 +1442,19 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
     ram_list.version++;
     qemu_mutex_unlock_ramlist();
 
-    ram_list.phys_dirty = g_realloc(ram_list.phys_dirty,
-                                       last_ram_offset() >> TARGET_PAGE_BITS);
-    memset(ram_list.phys_dirty + (new_block->offset >> TARGET_PAGE_BITS),
-           0, size >> TARGET_PAGE_BITS);
-    cpu_physical_memory_set_dirty_range(new_block->offset, size, 0xff);
+    new_ram_size = last_ram_offset() >> TARGET_PAGE_BITS;
+    if (new_ram_size > old_ram_size) {
+        for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
+            ram_list.dirty_memory[i] =
+                g_realloc(ram_list.dirty_memory[i],
+                          BITS_TO_LONGS(new_ram_size) * sizeof(unsigned long));
+            bitmap_clear(ram_list.dirty_memory[i], old_ram_size,
+                         BITS_TO_LONGS(new_ram_size) * BITS_PER_LONG -
+                         old_ram_size);
+        }
+    }
+    cpu_physical_memory_set_dirty_range(new_block->offset, size,
+                                        ALL_DIRTY_FLAGS);
 
     qemu_ram_setup_dump(new_block->host, size);
     qemu_madvise(new_block->host, size, QEMU_MADV_HUGEPAGE);
@@ -1286,9 +1466,21 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
     return new_block->offset;
 }
 
+ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
+                                   MemoryRegion *mr)
+{
+    return ram_block_add(size, host, mr, NULL);
+}
+
 ram_addr_t qemu_ram_alloc(ram_addr_t size, MemoryRegion *mr)
 {
-    return qemu_ram_alloc_from_ptr(size, NULL, mr);
+    return ram_block_add(size, NULL, mr, NULL);
+}
+
+ram_addr_t qemu_ram_alloc_policy(ram_addr_t size, MemoryRegion *mr,
+                                 const HostMemPolicy *policy)
+{
+    return ram_block_add(size, NULL, mr, policy);
 }
 
 void qemu_ram_free_from_ptr(ram_addr_t addr)
@@ -1362,9 +1554,9 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
                 if (block->fd >= 0) {
 #ifdef MAP_POPULATE
                     flags |= mem_prealloc ? MAP_POPULATE | MAP_SHARED :
-                        MAP_PRIVATE;
+                        mem_share ? MAP_SHARED : MAP_PRIVATE;
 #else
-                    flags |= MAP_PRIVATE;
+                    flags |= mem_share ? MAP_SHARED : MAP_PRIVATE;
 #endif
                     area = mmap(vaddr, length, PROT_READ | PROT_WRITE,
                                 flags, block->fd, offset);
@@ -1393,6 +1585,34 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
         }
     }
 }
+
+/* Replace the memory of @block with a private mapping of @fd, at the
+ * block's ram_addr_t offset.  Pages are then read on demand through the
+ * page cache, and shared with every other process that maps the same
+ * file until the guest writes to them.
+ */
+int qemu_ram_map_template(RAMBlock *block, int fd)
+{
+    void *area;
+
+    if ((block->flags & RAM_PREALLOC_MASK) || xen_enabled() ||
+        block->fd >= 0) {
+        return -ENOTSUP;
+    }
+    if (block->offset & (qemu_real_host_page_size - 1)) {
+        return -EINVAL;
+    }
+
+    area = mmap(block->host, block->length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, fd, block->offset);
+    if (area != block->host) {
+        return -errno;
+    }
+
+    qemu_ram_setup_dump(block->host, block->length);
+    qemu_madvise(block->host, block->length, QEMU_MADV_DONTFORK);
+    return 0;
+}
 #endif /* !_WIN32 */
 
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
@@ -1422,6 +1642,23 @@ void *qemu_get_ram_ptr(ram_addr_t addr)
     return block->host + (addr - block->offset);
 }
 
+/* Return the file descriptor that backs the RAM at @addr, or -1 if the RAM
+ * is anonymous memory.  *@offset is set to the offset of @addr in the file.
+ */
+int qemu_get_ram_fd(ram_addr_t addr, ram_addr_t *offset)
+{
+    RAMBlock *block = qemu_get_ram_block(addr);
+
+    *offset = addr - block->offset;
+    return block->fd;
+}
+
+/* Return the size of the host pages that back the RAM at @addr */
+size_t qemu_ram_pagesize(ram_addr_t addr)
+{
+    return qemu_get_ram_block(addr)->page_size;
+}
+
 /* Return a host pointer to guest's ram. Similar to qemu_get_ram_ptr
  * but takes a size argument */
 static void *qemu_ram_ptr_length(ram_addr_t addr, hwaddr *size)
@@ -1503,11 +1740,11 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
     default:
         abort();
     }
-    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
+    dirty_flags |= (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG);
     cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
     /* we remove the notdirty callback only if the code has been
        flushed */
-    if (dirty_flags == 0xff) {
+    if (dirty_flags == ALL_DIRTY_FLAGS) {
         CPUArchState *env = current_cpu->env_ptr;
         tlb_set_dirty(env, env->mem_io_vaddr);
     }
@@ -1762,6 +1999,12 @@ static void mem_begin(MemoryListener *listener)
     as->next_dispatch = d;
 }
 
+static void address_space_dispatch_free(AddressSpaceDispatch *d)
+{
+    phys_sections_free(&d->map);
+    g_free(d);
+}
+
 static void mem_commit(MemoryListener *listener)
 {
     AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
@@ -1770,11 +2013,13 @@ static void mem_commit(MemoryListener *listener)
 
     phys_page_compact_all(next, next->map.nodes_nb);
 
-    as->dispatch = next;
-
+    /* Readers outside the global lock may still be walking the old map,
+     * and the sections in it keep their MemoryRegions alive.  Free it
+     * after a grace period.
+     */
+    atomic_rcu_set(&as->dispatch, next);
     if (cur) {
-        phys_sections_free(&cur->map);
-        g_free(cur);
+        call_rcu(cur, address_space_dispatch_free, rcu);
     }
 }
 
@@ -1830,8 +2075,10 @@ void address_space_destroy_dispatch(AddressSpace *as)
     AddressSpaceDispatch *d = as->dispatch;
 
     memory_listener_unregister(&as->dispatch_listener);
-    g_free(d);
-    as->dispatch = NULL;
+    atomic_rcu_set(&as->dispatch, NULL);
+    if (d) {
+        call_rcu(d, address_space_dispatch_free, rcu);
+    }
 }
 
 static void memory_map_init(void)
@@ -1914,7 +2161,8 @@ static void invalidate_and_set_dirty(hwaddr addr,
         /* invalidate code */
         tb_invalidate_phys_page_range(addr, addr + length, 0);
         /* set dirty bit */
-        cpu_physical_memory_set_dirty_flags(addr, (0xff & ~CODE_DIRTY_FLAG));
+        cpu_physical_memory_set_dirty_flags(addr,
+                                            ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG);
     }
     xen_modified_memory(addr, length);
 }
@@ -2052,6 +2300,70 @@ bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
     return error;
 }
 
+/* The dispatch map is read under rcu_read_lock(), which keeps it and the
+ * MemoryRegions it references alive until the access is done.
+ */
+bool address_space_rw_unlocked(AddressSpace *as, hwaddr addr, uint8_t *buf,
+                               int len, bool is_write)
+{
+    AddressSpaceDispatch *d;
+    MemoryRegionSection *section;
+    MemoryRegion *mr;
+    hwaddr addr1, l = len;
+    uint64_t val;
+    bool done = false;
+
+    rcu_read_lock();
+    d = atomic_rcu_read(&as->dispatch);
+    section = address_space_translate_internal(d, addr, &addr1, &l, true);
+    mr = section->mr;
+
+    if (mr->iommu_ops || mr->global_locking || mr->flush_coalesced_mmio ||
+        memory_region_is_ram(mr) || memory_region_is_romd(mr) || l < len ||
+        memory_access_size(mr, len, addr1) != len) {
+        goto out;
+    }
+
+    if (is_write) {
+        switch (len) {
+        case 8:
+            val = ldq_p(buf);
+            break;
+        case 4:
+            val = ldl_p(buf);
+            break;
+        case 2:
+            val = lduw_p(buf);
+            break;
+        default:
+            val = ldub_p(buf);
+            break;
+        }
+        io_mem_write(mr, addr1, val, len);
+    } else {
+        io_mem_read(mr, addr1, &val, len);
+        switch (len) {
+        case 8:
+            stq_p(buf, val);
+            break;
+        case 4:
+            stl_p(buf, val);
+            break;
+        case 2:
+            stw_p(buf, val);
+            break;
+        default:
+            stb_p(buf, val);
+            break;
+        }
+    }
+    done = true;
+
+out:
+    rcu_read_unlock();
+    return done;
+}
+
 bool address_space_write(AddressSpace *as, hwaddr addr,
                          const uint8_t *buf, int len)
 {
@@ -2105,9 +2417,60 @@ typedef struct {
     void *buffer;
     hwaddr addr;
     hwaddr len;
+    bool in_use;
 } BounceBuffer;
 
-static BounceBuffer bounce;
+#define BOUNCE_BUFFERS_DEFAULT  16
+
+/* Buffers for address_space_map() of memory that cannot be accessed
+ * directly.  Each is allocated on first use and kept afterwards; their
+ * number and size come from the bounce-buffers and bounce-buffer-size
+ * machine options.
+ */
+static BounceBuffer *bounce;
+static unsigned int nr_bounce;
+static hwaddr bounce_size;
+
+static BounceBuffer *bounce_buffer_get(void)
+{
+    unsigned int i;
+
+    if (!bounce) {
+        QemuOpts *opts = qemu_get_machine_opts();
+
+        nr_bounce = qemu_opt_get_number(opts, "bounce-buffers",
+                                        BOUNCE_BUFFERS_DEFAULT);
+        nr_bounce = MAX(nr_bounce, 1);
+        bounce_size = qemu_opt_get_size(opts, "bounce-buffer-size",
+                                        TARGET_PAGE_SIZE);
+        bounce_size = TARGET_PAGE_ALIGN(MAX(bounce_size, 1));
+        bounce = g_new0(BounceBuffer, nr_bounce);
+    }
+
+    for (i = 0; i < nr_bounce; i++) {
+        if (!bounce[i].in_use) {
+            if (!bounce[i].buffer) {
+                bounce[i].buffer = qemu_memalign(TARGET_PAGE_SIZE,
+                                                 bounce_size);
+            }
+            bounce[i].in_use = true;
+            return &bounce[i];
+        }
+    }
+    return NULL;
+}
+
+static BounceBuffer *bounce_buffer_find(void *buffer)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr_bounce; i++) {
+        if (bounce[i].in_use && bounce[i].buffer == buffer) {
+            return &bounce[i];
+        }
+    }
+    return NULL;
+}
 
 typedef struct MapClient {
     void *opaque;
@@ -2185,6 +2548,7 @@ void *address_space_map(AddressSpace *as,
     hwaddr l, xlat, base;
     MemoryRegion *mr, *this_mr;
     ram_addr_t raddr;
+    BounceBuffer *bb;
 
     if (len == 0) {
         return NULL;
@@ -2193,23 +2557,22 @@ void *address_space_map(AddressSpace *as,
     l = len;
     mr = address_space_translate(as, addr, &xlat, &l, is_write);
     if (!memory_access_is_direct(mr, is_write)) {
-        if (bounce.buffer) {
+        bb = bounce_buffer_get();
+        if (!bb) {
             return NULL;
         }
-        /* Avoid unbounded allocations */
-        l = MIN(l, TARGET_PAGE_SIZE);
-        bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
-        bounce.addr = addr;
-        bounce.len = l;
+        l = MIN(l, bounce_size);
+        bb->addr = addr;
+        bb->len = l;
 
         memory_region_ref(mr);
-        bounce.mr = mr;
+        bb->mr = mr;
         if (!is_write) {
-            address_space_read(as, addr, bounce.buffer, l);
+            address_space_read(as, addr, bb->buffer, l);
         }
 
         *plen = l;
-        return bounce.buffer;
+        return bb->buffer;
     }
 
     base = xlat;
@@ -2242,7 +2605,9 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
+    BounceBuffer *bb = bounce_buffer_find(buffer);
+
+    if (!bb) {
         MemoryRegion *mr;
         ram_addr_t addr1;
 
@@ -2266,11 +2631,10 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         return;
     }
     if (is_write) {
-        address_space_write(as, bounce.addr, bounce.buffer, access_len);
+        address_space_write(as, bb->addr, bb->buffer, access_len);
     }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    memory_region_unref(bounce.mr);
+    bb->in_use = false;
+    memory_region_unref(bb->mr);
     cpu_notify_map_clients();
 }
 
@@ -2287,6 +2651,24 @@ void cpu_physical_memory_unmap(void *buffer, hwaddr len,
     return address_space_unmap(&address_space_memory, buffer, len, is_write, access_len);
 }
 
+/* Marks RAM written through a long-lived mapping as dirty, like
+ * address_space_unmap() does for is_write == 1.  @addr is the ram_addr_t
+ * of the first byte written.
+ */
+void cpu_physical_memory_mark_written(ram_addr_t addr, hwaddr length)
+{
+    while (length) {
+        hwaddr l = TARGET_PAGE_SIZE - (addr & ~TARGET_PAGE_MASK);
+
+        if (l > length) {
+            l = length;
+        }
+        invalidate_and_set_dirty(addr, l);
+        addr += l;
+        length -= l;
+    }
+}
+
 /* warning: addr must be aligned */
 static inline uint32_t ldl_phys_internal(hwaddr addr,
                                          enum device_endian endian)
@@ -2497,7 +2879,7 @@ void stl_phys_notdirty(hwaddr addr, uint32_t val)
                 tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
                 /* set dirty bit */
                 cpu_physical_memory_set_dirty_flags(
-                    addr1, (0xff & ~CODE_DIRTY_FLAG));
+                    addr1, ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG);
             }
         }
     }
@@ -40,6 +40,9 @@ these four paragraphs for those parts of this code that are retained.
  */
 #include "config.h"
 
+#include <float.h>
+#include <math.h>
+
 #include "fpu/softfloat.h"
 
 /*----------------------------------------------------------------------------
@@ -1858,6 +1861,173 @@ static float32 subFloat32Sigs( float32 a, float32 b, flag zSign STATUS_PARAM)
 
 }
 
+/*----------------------------------------------------------------------------
+| Host FPU fast path.  When both inputs are zero or normal, the result of an
+| IEEE operation does not depend on the target, so the host FPU can compute
+| it, as long as:
+|  - the rounding mode is round-to-nearest-even, the mode the host runs in;
+|  - the inexact flag is already set, since finding out whether the host
+|    rounded would cost more than the operation.  Guests keep their flags
+|    sticky, so this is the common case once FP code has run for a while;
+|  - the result is not tiny, so that underflow, tininess detection and
+|    flush-to-zero of outputs stay with softfloat.
+| Overflow is easy to detect from the infinite result.  Everything else,
+| including NaNs, infinities and denormal inputs, takes the softfloat path.
+| Hosts that evaluate float and double in extended precision (x87) would
+| round twice and are left out.
+*----------------------------------------------------------------------------*/
+
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define QEMU_HARDFLOAT 1
+#else
+#define QEMU_HARDFLOAT 0
+#endif
+
+typedef union {
+    float32 s;
+    float h;
+} union_float32;
+
+typedef union {
+    float64 s;
+    double h;
+} union_float64;
+
+static inline bool can_use_fpu(float_status *status)
+{
+    return QEMU_HARDFLOAT &&
+           likely(STATUS(float_exception_flags) & float_flag_inexact) &&
+           likely(STATUS(float_rounding_mode) == float_round_nearest_even);
+}
+
+static inline bool float32_is_zero_or_normal(float32 a)
+{
+    uint32_t exp = (float32_val(a) >> 23) & 0xff;
+
+    return exp != 0xff && (exp != 0 || float32_is_zero(a));
+}
+
+static inline bool float64_is_zero_or_normal(float64 a)
+{
+    uint64_t exp = (float64_val(a) >> 52) & 0x7ff;
+
+    return exp != 0x7ff && (exp != 0 || float64_is_zero(a));
+}
+
+static inline float hard_f32_add(float a, float b)
+{
+    return a + b;
+}
+
+static inline float hard_f32_sub(float a, float b)
+{
+    return a - b;
+}
+
+static inline float hard_f32_mul(float a, float b)
+{
+    return a * b;
+}
+
+static inline float hard_f32_div(float a, float b)
+{
+    return a / b;
+}
+
+static inline double hard_f64_add(double a, double b)
+{
+    return a + b;
+}
+
+static inline double hard_f64_sub(double a, double b)
+{
+    return a - b;
+}
+
+static inline double hard_f64_mul(double a, double b)
+{
+    return a * b;
+}
+
+static inline double hard_f64_div(double a, double b)
+{
+    return a / b;
+}
+
+/* Returns true and stores the result in *r if the host computed it */
+static inline bool float32_hard_op2(float32 a, float32 b, float32 *r,
+                                    float (*op)(float, float) STATUS_PARAM)
+{
+    union_float32 ua, ub, ur;
+
+    if (!can_use_fpu(status) ||
+        !float32_is_zero_or_normal(a) || !float32_is_zero_or_normal(b)) {
+        return false;
+    }
+    ua.s = a;
+    ub.s = b;
+    ur.h = op(ua.h, ub.h);
+    if (unlikely(isinf(ur.h))) {
+        float_raise(float_flag_overflow STATUS_VAR);
+    } else if (unlikely(fabsf(ur.h) <= FLT_MIN)) {
+        return false;
+    }
+    *r = ur.s;
+    return true;
+}
+
+static inline bool float64_hard_op2(float64 a, float64 b, float64 *r,
+                                    double (*op)(double, double) STATUS_PARAM)
+{
+    union_float64 ua, ub, ur;
+
+    if (!can_use_fpu(status) ||
+        !float64_is_zero_or_normal(a) || !float64_is_zero_or_normal(b)) {
+        return false;
+    }
+    ua.s = a;
+    ub.s = b;
+    ur.h = op(ua.h, ub.h);
+    if (unlikely(isinf(ur.h))) {
+        float_raise(float_flag_overflow STATUS_VAR);
+    } else if (unlikely(fabs(ur.h) <= DBL_MIN)) {
+        return false;
+    }
+    *r = ur.s;
+    return true;
+}
+
+/* The square root of a positive normal number is normal and never
+ * overflows; the square root of a zero is that zero.
+ */
+static inline bool float32_hard_sqrt(float32 a, float32 *r STATUS_PARAM)
+{
+    union_float32 u;
+
+    if (!can_use_fpu(status) || !float32_is_zero_or_normal(a) ||
+        (float32_is_neg(a) && !float32_is_zero(a))) {
+        return false;
+    }
+    u.s = a;
+    u.h = sqrtf(u.h);
+    *r = u.s;
+    return true;
+}
+
+static inline bool float64_hard_sqrt(float64 a, float64 *r STATUS_PARAM)
+{
+    union_float64 u;
+
+    if (!can_use_fpu(status) || !float64_is_zero_or_normal(a) ||
+        (float64_is_neg(a) && !float64_is_zero(a))) {
+        return false;
+    }
+    u.s = a;
+    u.h = sqrt(u.h);
+    *r = u.s;
+    return true;
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of adding the single-precision floating-point values `a'
 | and `b'.  The operation is performed according to the IEC/IEEE Standard for
@@ -1867,6 +2037,12 @@ static float32 subFloat32Sigs( float32 a, float32 b, flag zSign STATUS_PARAM)
 float32 float32_add( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
+    float32 r;
+
+    if (float32_hard_op2(a, b, &r, hard_f32_add STATUS_VAR)) {
+        return r;
+    }
+
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1890,6 +2066,12 @@ float32 float32_add( float32 a, float32 b STATUS_PARAM )
 float32 float32_sub( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
+    float32 r;
+
+    if (float32_hard_op2(a, b, &r, hard_f32_sub STATUS_VAR)) {
+        return r;
+    }
+
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -1917,6 +2099,11 @@ float32 float32_mul( float32 a, float32 b STATUS_PARAM )
     uint32_t aSig, bSig;
     uint64_t zSig64;
     uint32_t zSig;
+    float32 r;
+
+    if (float32_hard_op2(a, b, &r, hard_f32_mul STATUS_VAR)) {
+        return r;
+    }
 
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
@@ -1978,6 +2165,13 @@ float32 float32_div( float32 a, float32 b STATUS_PARAM )
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint32_t aSig, bSig, zSig;
+    float32 r;
+
+    if (!float32_is_zero(b) &&
+        float32_hard_op2(a, b, &r, hard_f32_div STATUS_VAR)) {
+        return r;
+    }
+
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
@@ -2351,6 +2545,12 @@ float32 float32_sqrt( float32 a STATUS_PARAM )
     int_fast16_t aExp, zExp;
     uint32_t aSig, zSig;
     uint64_t rem, term;
+    float32 r;
+
+    if (float32_hard_sqrt(a, &r STATUS_VAR)) {
+        return r;
+    }
+
     a = float32_squash_input_denormal(a STATUS_VAR);
 
     aSig = extractFloat32Frac( a );
@@ -3430,6 +3630,12 @@ static float64 subFloat64Sigs( float64 a, float64 b, flag zSign STATUS_PARAM )
 float64 float64_add( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
+    float64 r;
+
+    if (float64_hard_op2(a, b, &r, hard_f64_add STATUS_VAR)) {
+        return r;
+    }
+
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3453,6 +3659,12 @@ float64 float64_add( float64 a, float64 b STATUS_PARAM )
 float64 float64_sub( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
+    float64 r;
+
+    if (float64_hard_op2(a, b, &r, hard_f64_sub STATUS_VAR)) {
+        return r;
+    }
+
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3478,6 +3690,11 @@ float64 float64_mul( float64 a, float64 b STATUS_PARAM )
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
     uint64_t aSig, bSig, zSig0, zSig1;
+    float64 r;
+
+    if (float64_hard_op2(a, b, &r, hard_f64_mul STATUS_VAR)) {
+        return r;
+    }
 
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
@@ -3541,6 +3758,13 @@ float64 float64_div( float64 a, float64 b STATUS_PARAM )
     uint64_t aSig, bSig, zSig;
     uint64_t rem0, rem1;
     uint64_t term0, term1;
+    float64 r;
+
+    if (!float64_is_zero(b) &&
+        float64_hard_op2(a, b, &r, hard_f64_div STATUS_VAR)) {
+        return r;
+    }
+
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
@@ -3924,6 +4148,12 @@ float64 float64_sqrt( float64 a STATUS_PARAM )
     int_fast16_t aExp, zExp;
     uint64_t aSig, zSig, doubleZSig;
     uint64_t rem0, rem1, term0, term1;
+    float64 r;
+
+    if (float64_hard_sqrt(a, &r STATUS_VAR)) {
+        return r;
+    }
+
     a = float64_squash_input_denormal(a STATUS_VAR);
 
     aSig = extractFloat64Frac( a );
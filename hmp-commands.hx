@@ -309,19 +309,25 @@ ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "live:-l,name:s?",
+        .params     = "[-l] [tag|id]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created"
+                      "\n\t\t\t -l: save the RAM while the guest runs, see 'info savevm'",
         .mhandler.cmd = do_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-l] [@var{tag}|@var{id}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+
+With @option{-l}, the command returns at once and the RAM is saved while
+the guest keeps running, like a migration; the guest is only stopped for
+the last pass.  @code{info savevm} shows the progress and
+@code{migrate_cancel} aborts it.
 ETEXI
 
     {
@@ -366,6 +372,40 @@ STEXI
 @findex singlestep
 Run the emulation in single step mode.
 If called with option off, the emulation returns to normal mode.
+ETEXI
+
+    {
+        .name       = "tb-profile",
+        .args_type  = "option:s",
+        .params     = "on|off|reset",
+        .help       = "count the executions of translation blocks",
+        .mhandler.cmd = do_tb_profile,
+    },
+
+STEXI
+@item tb-profile on|off|reset
+@findex tb-profile
+With @var{on}, blocks translated from now on count how often they are
+executed, for @code{info tb-hot}.  Blocks that were translated before
+are not counted until they are translated again.  @var{off} stops adding
+counters to new blocks, @var{reset} clears the statistics.
+ETEXI
+
+    {
+        .name       = "exit-profile",
+        .args_type  = "option:s",
+        .params     = "on|off",
+        .help       = "profile KVM exits by MMIO address and I/O port",
+        .mhandler.cmd = hmp_exit_profile,
+    },
+
+STEXI
+@item exit-profile on|off
+@findex exit-profile
+With @var{on}, MMIO and PIO exits that QEMU handles with the global lock
+held are counted by address, together with the time spent handling them,
+for @code{info exits}.  Turning the profile on discards the previous one,
+@var{off} stops it but keeps the data.
 ETEXI
 
     {
@@ -909,6 +949,40 @@ STEXI
 @findex migrate_cancel
 Cancel the current VM migration.
 
+ETEXI
+
+    {
+        .name       = "migrate_start_postcopy",
+        .args_type  = "",
+        .params     = "",
+        .help       = "Switch the current migration to postcopy, "
+                      "the x-postcopy-ram capability must be set",
+        .mhandler.cmd = hmp_migrate_start_postcopy,
+    },
+
+STEXI
+@item migrate_start_postcopy
+@findex migrate_start_postcopy
+Switch the current migration to postcopy: the guest is started on the
+destination, which fetches the pages it is still missing from the source.
+The x-postcopy-ram capability must be enabled before the migration starts.
+
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "second:i",
+        .params     = "second",
+        .help       = "start measuring the guest dirty page rate for "
+                      "'second' seconds, see 'info dirty_rate'",
+        .mhandler.cmd = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate @var{second}
+@findex calc_dirty_rate
+Start measuring how fast the guest dirties its RAM during @var{second}
+seconds, without migrating it.  Use @code{info dirty_rate} for the result.
 ETEXI
 
     {
@@ -971,6 +1045,20 @@ STEXI
 @item migrate_set_capability @var{capability} @var{state}
 @findex migrate_set_capability
 Enable/Disable the usage of a capability @var{capability} for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_parameter",
+        .args_type  = "parameter:s,value:i",
+        .params     = "parameter value",
+        .help       = "Set the parameter for migration",
+        .mhandler.cmd = hmp_migrate_set_parameter,
+    },
+
+STEXI
+@item migrate_set_parameter @var{parameter} @var{value}
+@findex migrate_set_parameter
+Set the parameter @var{parameter} for migration.
 ETEXI
 
     {
@@ -993,9 +1081,12 @@ ETEXI
 
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:-p,filename:F,begin:i?,length:i?",
-        .params     = "[-p] filename [begin] [length]",
+        .args_type  = "paging:-p,zlib:-z,detach:-d,filename:F,begin:i?,"
+                      "length:i?",
+        .params     = "[-p] [-z] [-d] filename [begin] [length]",
         .help       = "dump guest memory to file"
+                      "\n\t\t\t -z: kdump-compressed format, with zlib"
+                      "\n\t\t\t -d: return at once, see 'info dump'"
                       "\n\t\t\t begin(optional): the starting physical address"
                       "\n\t\t\t length(optional): the memory size, in bytes",
         .mhandler.cmd = hmp_dump_guest_memory,
@@ -1003,12 +1094,16 @@ ETEXI
 
 
 STEXI
-@item dump-guest-memory [-p] @var{protocol} @var{begin} @var{length}
+@item dump-guest-memory [-p] [-z] [-d] @var{protocol} @var{begin} @var{length}
 @findex dump-guest-memory
 Dump guest memory to @var{protocol}. The file can be processed with crash or
 gdb.
   filename: dump file name
     paging: do paging to get guest's memory mapping
+      zlib: write the kdump-compressed format, with zlib; only crash can
+            read it.  Cannot be combined with paging, begin or length
+    detach: write the dump in the background and return at once; the
+            guest stays paused until the dump is complete
      begin: the starting physical address. It's optional, and should be
             specified with length together.
     length: the memory size, in bytes. It's optional, and should be specified
@@ -1648,6 +1743,10 @@ show block device statistics
 show the cpu registers
 @item info cpus
 show infos for each CPU
+@item info iothreads
+show iothreads and their polling statistics
+@item info timers
+show timer slack and wakeup statistics of each clock
 @item info history
 show the command line history
 @item info irq
@@ -1662,10 +1761,28 @@ show virtual to physical memory mappings (i386, SH4, SPARC, PPC, and Xtensa only
 show the active virtual memory mappings (i386 only)
 @item info jit
 show dynamic compiler info
+@item info tb-hot [@var{count}]
+show the @var{count} (default 20) guest addresses whose translation blocks
+were executed most often, with the number of guest instructions this
+amounts to, how often they were translated and invalidated, and the
+symbol they belong to if one is known
 @item info numa
 show NUMA information
 @item info kvm
 show KVM information
+@item info xen_mapcache
+show how often the Xen mapcache found guest memory already mapped, how
+often it had to map it, and how much of it is mapped
+@item info kvm_msi
+show how MSIs were injected into KVM: with KVM_SIGNAL_MSI, or through
+dynamic routes, and how often the routing table was rewritten
+@item info exits
+show how often each vCPU exited to QEMU, by exit reason, and with
+@code{exit-profile on} the MMIO addresses and I/O ports that caused the
+most exits and how long the device model took for them
+@item info bql
+show how often the global mutex was found taken, and how long each
+thread waited for it and held it
 @item info usb
 show USB devices plugged on the virtual USB hub
 @item info usbhost
@@ -1682,6 +1799,9 @@ show the current VM status (running|paused)
 show guest PCMCIA status
 @item info mice
 show which guest mouse is receiving events
+@item info display
+show how often each graphic console was refreshed, how many refreshes found
+changes and how long they took
 @item info vnc
 show the vnc server status
 @item info name
@@ -1694,10 +1814,18 @@ show CPU statistics
 show user network stack connection states
 @item info migrate
 show migration status
+@item info dump
+show the progress of the last guest memory dump
+@item info savevm
+show the progress of the last live snapshot
 @item info migrate_capabilities
 show current migration capabilities
+@item info migrate_parameters
+show current migration parameters
 @item info migrate_cache_size
 show current migration XBZRLE cache size
+@item info dirty_rate
+show the result of the last dirty rate measurement
 @item info balloon
 show balloon information
 @item info qtree
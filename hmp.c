@@ -72,6 +72,81 @@ void hmp_info_kvm(Monitor *mon, const QDict *qdict)
     qapi_free_KvmInfo(info);
 }
 
+/* Addresses shown per vCPU by "info exits" */
+#define HMP_EXIT_ADDRESSES      10
+
+void hmp_info_exits(Monitor *mon, const QDict *qdict)
+{
+    KvmExitInfoList *info_list, *info;
+    KvmExitCountList *count;
+    KvmExitAddressList *addr;
+    Error *err = NULL;
+    int i;
+
+    info_list = qmp_query_kvm_exits(&err);
+    if (err) {
+        hmp_handle_error(mon, &err);
+        return;
+    }
+
+    for (info = info_list; info; info = info->next) {
+        monitor_printf(mon, "CPU #%" PRId64 ":", info->value->cpu);
+        for (count = info->value->exits; count; count = count->next) {
+            monitor_printf(mon, " %s=%" PRId64, count->value->reason,
+                           count->value->count);
+        }
+        monitor_printf(mon, "\n");
+
+        if (!info->value->has_addresses) {
+            continue;
+        }
+        for (addr = info->value->addresses, i = 0;
+             addr && i < HMP_EXIT_ADDRESSES; addr = addr->next, i++) {
+            monitor_printf(mon, "  %-4s 0x%016" PRIx64 " %10" PRId64
+                           " exits %10" PRId64 " ns/exit  %s\n",
+                           addr->value->space, addr->value->address,
+                           addr->value->count,
+                           addr->value->time_ns / addr->value->count,
+                           addr->value->has_region ?
+                           addr->value->region : "");
+        }
+        if (info->value->dropped) {
+            monitor_printf(mon, "  %" PRId64 " exits not profiled, too many "
+                           "addresses\n", info->value->dropped);
+        }
+    }
+
+    qapi_free_KvmExitInfoList(info_list);
+}
+
+void hmp_info_bql(Monitor *mon, const QDict *qdict)
+{
+    BqlInfo *info;
+    BqlThreadInfoList *thread;
+    BqlThreadInfo *t;
+
+    info = qmp_query_bql(NULL);
+
+    monitor_printf(mon, "contended %" PRId64 ", slept after spinning %"
+                   PRId64 "\n", info->contended, info->slept);
+    for (thread = info->threads; thread; thread = thread->next) {
+        t = thread->value;
+        if (t->has_cpu_index) {
+            monitor_printf(mon, "CPU #%" PRId64 " (thread %" PRId64 "):",
+                           t->cpu_index, t->thread_id);
+        } else {
+            monitor_printf(mon, "%s:", t->thread);
+        }
+        monitor_printf(mon, " acquired %" PRId64 ", contended %" PRId64
+                       ", waited %" PRId64 " us, held %" PRId64
+                       " us (max %" PRId64 " us)\n",
+                       t->acquired, t->contended, t->wait_ns / 1000,
+                       t->hold_ns / 1000, t->max_hold_ns / 1000);
+    }
+
+    qapi_free_BqlInfo(info);
+}
+
 void hmp_info_status(Monitor *mon, const QDict *qdict)
 {
     StatusInfo *info;
@@ -213,6 +288,69 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 " (%0.2f%%)\n",
+                       info->xbzrle_cache->cache_hit,
+                       info->xbzrle_cache->cache_hit_rate * 100);
+        monitor_printf(mon, "xbzrle cache evictions: %" PRIu64
+                       " (%0.2f%%)\n",
+                       info->xbzrle_cache->cache_evictions,
+                       info->xbzrle_cache->cache_eviction_rate * 100);
+    }
+
+    if (info->has_compression) {
+        CompressThreadStatsList *thread;
+
+        monitor_printf(mon, "compression pages: %" PRIu64 " pages\n",
+                       info->compression->pages);
+        monitor_printf(mon, "compression busy: %" PRIu64 "\n",
+                       info->compression->busy);
+        monitor_printf(mon, "compressed size: %" PRIu64 " kbytes\n",
+                       info->compression->compressed_size >> 10);
+        monitor_printf(mon, "compression rate: %0.2f\n",
+                       info->compression->compression_rate);
+        for (thread = info->compression->threads; thread;
+             thread = thread->next) {
+            monitor_printf(mon, "compress thread %" PRId64 ": %" PRIu64
+                           " pages, %" PRIu64 " kbytes, busy %" PRIu64
+                           " milliseconds, %0.2f mbps\n",
+                           thread->value->id, thread->value->pages,
+                           thread->value->compressed_size >> 10,
+                           thread->value->busy_time, thread->value->mbps);
+        }
+    }
+
+    if (info->has_rdma) {
+        monitor_printf(mon, "rdma registration hits: %" PRIu64 "\n",
+                       info->rdma->registration_hits);
+        monitor_printf(mon, "rdma registration misses: %" PRIu64 "\n",
+                       info->rdma->registration_misses);
+        monitor_printf(mon, "rdma unregistrations: %" PRIu64 "\n",
+                       info->rdma->unregistrations);
+        monitor_printf(mon, "rdma writes: %" PRIu64 "\n",
+                       info->rdma->writes);
+        monitor_printf(mon, "rdma max outstanding writes: %" PRIu64 "\n",
+                       info->rdma->max_outstanding);
+        monitor_printf(mon, "rdma registration time: %" PRIu64
+                       " milliseconds\n", info->rdma->registration_time);
+        monitor_printf(mon, "rdma wire time: %" PRIu64 " milliseconds\n",
+                       info->rdma->wire_time);
+    }
+
+    if (info->has_auto_tune) {
+        monitor_printf(mon, "auto-tune bandwidth limit: %" PRIu64
+                       " kbytes/s\n", info->auto_tune->bandwidth_limit >> 10);
+        monitor_printf(mon, "auto-tune bandwidth: %" PRIu64 " kbytes/s\n",
+                       info->auto_tune->bandwidth >> 10);
+        monitor_printf(mon, "auto-tune dirty rate: %" PRIu64 " kbytes/s\n",
+                       info->auto_tune->dirty_rate >> 10);
+        monitor_printf(mon, "auto-tune throttle: %" PRId64 "%%\n",
+                       info->auto_tune->throttle);
+        monitor_printf(mon, "auto-tune downtime limit: %" PRIu64
+                       " milliseconds\n", info->auto_tune->downtime_limit);
+        monitor_printf(mon, "auto-tune adjustments: %" PRIu64 " (last: %s)\n",
+                       info->auto_tune->adjustments,
+                       MigrationAutoTuneAction_lookup[
+                           info->auto_tune->last_action]);
     }
 
     qapi_free_MigrationInfo(info);
@@ -238,6 +376,78 @@ void hmp_info_migrate_capabilities(Monitor *mon, const QDict *qdict)
     qapi_free_MigrationCapabilityStatusList(caps);
 }
 
+void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
+{
+    MigrationParameters *params;
+
+    params = qmp_query_migrate_parameters(NULL);
+
+    if (params) {
+        monitor_printf(mon, "parameters:");
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS],
+            params->x_multifd_channels);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_LEVEL],
+            params->compress_level);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_THREADS],
+            params->compress_threads);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_DECOMPRESS_THREADS],
+            params->decompress_threads);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[
+                MIGRATION_PARAMETER_X_RDMA_REGISTRATION_CACHE],
+            params->x_rdma_registration_cache);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_FILE_BUFFER_SIZE],
+            params->x_file_buffer_size);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_FILE_IOV_MAX],
+            params->x_file_iov_max);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[
+                MIGRATION_PARAMETER_X_AUTO_TUNE_MAX_BANDWIDTH],
+            params->x_auto_tune_max_bandwidth);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_AUTO_TUNE_DEADLINE],
+            params->x_auto_tune_deadline);
+        monitor_printf(mon, "\n");
+    }
+
+    qapi_free_MigrationParameters(params);
+}
+
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info;
+    DirtyRateBlockInfoList *block;
+
+    info = qmp_query_dirty_rate(NULL);
+
+    monitor_printf(mon, "status: %s\n",
+                   DirtyRateStatus_lookup[info->status]);
+    if (info->has_calc_time) {
+        monitor_printf(mon, "calc time: %" PRId64 " seconds\n",
+                       info->calc_time);
+    }
+    if (info->has_dirty_pages_rate) {
+        monitor_printf(mon, "dirty pages: %" PRId64 "\n", info->dirty_pages);
+        monitor_printf(mon, "dirty pages rate: %" PRId64 " pages/s (%"
+                       PRId64 " kbytes/s)\n", info->dirty_pages_rate,
+                       (info->dirty_pages_rate * info->page_size) >> 10);
+    }
+    for (block = info->blocks; block; block = block->next) {
+        monitor_printf(mon, "  %s: %" PRId64 " dirty pages, %" PRId64
+                       " pages/s\n", block->value->id,
+                       block->value->dirty_pages,
+                       block->value->dirty_pages_rate);
+    }
+
+    qapi_free_DirtyRateInfo(info);
+}
+
 void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
 {
     monitor_printf(mon, "xbzrel cache size: %" PRId64 " kbytes\n",
@@ -282,6 +492,44 @@ void hmp_info_cpus(Monitor *mon, const QDict *qdict)
     qapi_free_CpuInfoList(cpu_list);
 }
 
+void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
+{
+    IOThreadInfoList *info_list = qmp_query_iothreads(NULL);
+    IOThreadInfoList *info;
+
+    for (info = info_list; info; info = info->next) {
+        IOThreadInfo *value = info->value;
+
+        monitor_printf(mon, "%s: thread_id=%" PRId64 "\n",
+                       value->id, value->thread_id);
+        monitor_printf(mon, "    poll-max-ns=%" PRId64 " poll-ns=%" PRId64
+                       " attempts=%" PRId64 " successes=%" PRId64
+                       " time-ns=%" PRId64 "\n",
+                       value->poll_max_ns, value->poll_ns,
+                       value->poll_attempts, value->poll_successes,
+                       value->poll_time_ns);
+    }
+
+    qapi_free_IOThreadInfoList(info_list);
+}
+
+void hmp_info_timers(Monitor *mon, const QDict *qdict)
+{
+    TimerClockInfoList *info_list = qmp_query_timers(NULL);
+    TimerClockInfoList *info;
+
+    for (info = info_list; info; info = info->next) {
+        TimerClockInfo *value = info->value;
+
+        monitor_printf(mon, "%s: slack-ns=%" PRId64 " wakeups=%" PRId64
+                       " timers-fired=%" PRId64 "\n",
+                       value->clock, value->slack_ns, value->wakeups,
+                       value->timers_fired);
+    }
+
+    qapi_free_TimerClockInfoList(info_list);
+}
+
 void hmp_info_block(Monitor *mon, const QDict *qdict)
 {
     BlockInfoList *block_list, *info;
@@ -366,6 +614,10 @@ void hmp_info_block(Monitor *mon, const QDict *qdict)
                             info->value->inserted->iops_rd_max,
                             info->value->inserted->iops_wr_max,
                             info->value->inserted->iops_size);
+            if (info->value->inserted->has_group) {
+                monitor_printf(mon, "    Throttle group:   %s\n",
+                               info->value->inserted->group);
+            }
         }
 
         if (verbose) {
@@ -406,7 +658,7 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
                        " wr_total_time_ns=%" PRId64
                        " rd_total_time_ns=%" PRId64
                        " flush_total_time_ns=%" PRId64
-                       "\n",
+                       " flush_merged=%" PRId64,
                        stats->value->stats->rd_bytes,
                        stats->value->stats->wr_bytes,
                        stats->value->stats->rd_operations,
@@ -414,7 +666,40 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
                        stats->value->stats->flush_operations,
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
-                       stats->value->stats->flush_total_time_ns);
+                       stats->value->stats->flush_total_time_ns,
+                       stats->value->stats->flush_merged);
+        if (stats->value->stats->has_metadata_cache) {
+            BlockMetadataCacheStats *cache =
+                stats->value->stats->metadata_cache;
+
+            monitor_printf(mon, " l2_hits=%" PRId64
+                           " l2_misses=%" PRId64
+                           " refcount_hits=%" PRId64
+                           " refcount_misses=%" PRId64,
+                           cache->l2_hits, cache->l2_misses,
+                           cache->refcount_hits, cache->refcount_misses);
+        }
+        if (stats->value->stats->has_data_cache) {
+            BlockDataCacheStats *cache = stats->value->stats->data_cache;
+
+            monitor_printf(mon, " cache_hits=%" PRId64
+                           " cache_misses=%" PRId64
+                           " cache_used=%" PRId64
+                           " cache_dirty=%" PRId64,
+                           cache->hits, cache->misses,
+                           cache->used, cache->dirty);
+        }
+        if (stats->value->stats->has_objects) {
+            BlockObjectStats *objs = stats->value->stats->objects;
+
+            monitor_printf(mon, " obj_in_flight=%" PRId64
+                           " obj_pending=%" PRId64
+                           " obj_allocations=%" PRId64
+                           " obj_metadata_updates=%" PRId64,
+                           objs->in_flight, objs->pending,
+                           objs->allocations, objs->metadata_updates);
+        }
+        monitor_printf(mon, "\n");
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -425,6 +710,7 @@ void hmp_info_vnc(Monitor *mon, const QDict *qdict)
     VncInfo *info;
     Error *err = NULL;
     VncClientInfoList *client;
+    VncEncoderInfoList *enc;
 
     info = qmp_query_vnc(&err);
     if (err) {
@@ -459,6 +745,12 @@ void hmp_info_vnc(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "    username: %s\n",
                            client->value->has_sasl_username ?
                            client->value->sasl_username : "none");
+            for (enc = client->value->encoders; enc; enc = enc->next) {
+                monitor_printf(mon, "  %10s: %" PRId64 " rects, %" PRId64
+                               " bytes, %" PRId64 " us\n",
+                               enc->value->encoding, enc->value->rects,
+                               enc->value->bytes, enc->value->time_ns / 1000);
+            }
         }
     }
 
@@ -663,6 +955,16 @@ void hmp_info_block_jobs(Monitor *mon, const QDict *qdict)
                            list->value->len,
                            list->value->speed);
         }
+        if (list->value->has_copy_rate) {
+            monitor_printf(mon, "    copying %" PRId64 " bytes/s, guest dirtying"
+                           " %" PRId64 " bytes/s",
+                           list->value->copy_rate, list->value->dirty_rate);
+            if (list->value->has_convergence_eta) {
+                monitor_printf(mon, ", in sync in about %" PRId64 " ms",
+                               list->value->convergence_eta);
+            }
+            monitor_printf(mon, "\n");
+        }
         list = list->next;
     }
 }
@@ -949,7 +1251,8 @@ void hmp_drive_backup(Monitor *mon, const QDict *qdict)
 
     qmp_drive_backup(device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
-                     true, mode, false, 0, false, 0, false, 0, &errp);
+                     true, mode, false, 0, false, 0, false, 0,
+                     false, NULL, &errp);
     hmp_handle_error(mon, &errp);
 }
 
@@ -1003,6 +1306,22 @@ void hmp_migrate_cancel(Monitor *mon, const QDict *qdict)
     qmp_migrate_cancel(NULL);
 }
 
+void hmp_migrate_start_postcopy(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_migrate_start_postcopy(&err);
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(qdict_get_int(qdict, "second"), &err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_migrate_set_downtime(Monitor *mon, const QDict *qdict)
 {
     double value = qdict_get_double(qdict, "value");
@@ -1060,6 +1379,78 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
+{
+    const char *param = qdict_get_str(qdict, "parameter");
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+    bool has_x_multifd_channels = false;
+    bool has_compress_level = false;
+    bool has_compress_threads = false;
+    bool has_decompress_threads = false;
+    bool has_x_rdma_registration_cache = false;
+    bool has_x_file_buffer_size = false;
+    bool has_x_file_iov_max = false;
+    bool has_x_auto_tune_max_bandwidth = false;
+    bool has_x_auto_tune_deadline = false;
+    int i;
+
+    for (i = 0; i < MIGRATION_PARAMETER_MAX; i++) {
+        if (strcmp(param, MigrationParameter_lookup[i]) == 0) {
+            switch (i) {
+            case MIGRATION_PARAMETER_X_MULTIFD_CHANNELS:
+                has_x_multifd_channels = true;
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_LEVEL:
+                has_compress_level = true;
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_THREADS:
+                has_compress_threads = true;
+                break;
+            case MIGRATION_PARAMETER_DECOMPRESS_THREADS:
+                has_decompress_threads = true;
+                break;
+            case MIGRATION_PARAMETER_X_RDMA_REGISTRATION_CACHE:
+                has_x_rdma_registration_cache = true;
+                break;
+            case MIGRATION_PARAMETER_X_FILE_BUFFER_SIZE:
+                has_x_file_buffer_size = true;
+                break;
+            case MIGRATION_PARAMETER_X_FILE_IOV_MAX:
+                has_x_file_iov_max = true;
+                break;
+            case MIGRATION_PARAMETER_X_AUTO_TUNE_MAX_BANDWIDTH:
+                has_x_auto_tune_max_bandwidth = true;
+                break;
+            case MIGRATION_PARAMETER_X_AUTO_TUNE_DEADLINE:
+                has_x_auto_tune_deadline = true;
+                break;
+            }
+            qmp_migrate_set_parameters(has_x_multifd_channels, value,
+                                       has_compress_level, value,
+                                       has_compress_threads, value,
+                                       has_decompress_threads, value,
+                                       has_x_rdma_registration_cache, value,
+                                       has_x_file_buffer_size, value,
+                                       has_x_file_iov_max, value,
+                                       has_x_auto_tune_max_bandwidth, value,
+                                       has_x_auto_tune_deadline, value,
+                                       &err);
+            break;
+        }
+    }
+
+    if (i == MIGRATION_PARAMETER_MAX) {
+        error_set(&err, QERR_INVALID_PARAMETER, param);
+    }
+
+    if (err) {
+        monitor_printf(mon, "migrate_set_parameter: %s\n",
+                       error_get_pretty(err));
+        error_free(err);
+    }
+}
+
 void hmp_set_password(Monitor *mon, const QDict *qdict)
 {
     const char *protocol  = qdict_get_str(qdict, "protocol");
@@ -1148,7 +1539,9 @@ void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
                               false,
                               0,
                               false, /* No default I/O size */
-                              0, &err);
+                              0,
+                              false, /* keep the current throttle group */
+                              NULL, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -1304,6 +1697,8 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
 {
     Error *errp = NULL;
     int paging = qdict_get_try_bool(qdict, "paging", 0);
+    int zlib = qdict_get_try_bool(qdict, "zlib", 0);
+    int detach = qdict_get_try_bool(qdict, "detach", 0);
     const char *file = qdict_get_str(qdict, "filename");
     bool has_begin = qdict_haskey(qdict, "begin");
     bool has_length = qdict_haskey(qdict, "length");
@@ -1321,11 +1716,50 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
     prot = g_strconcat("file:", file, NULL);
 
     qmp_dump_guest_memory(paging, prot, has_begin, begin, has_length, length,
-                          &errp);
+                          zlib, DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZLIB,
+                          true, detach, &errp);
     hmp_handle_error(mon, &errp);
     g_free(prot);
 }
 
+void hmp_info_dump(Monitor *mon, const QDict *qdict)
+{
+    DumpQueryResult *result = qmp_query_dump(NULL);
+
+    monitor_printf(mon, "Status: %s\n", DumpStatus_lookup[result->status]);
+    if (result->status != DUMP_STATUS_NONE) {
+        monitor_printf(mon, "Completed: %" PRId64 " of %" PRId64 " bytes "
+                       "(%" PRId64 "%%)\n", result->completed, result->total,
+                       result->total ?
+                       result->completed * 100 / result->total : 100);
+    }
+    qapi_free_DumpQueryResult(result);
+}
+
+void hmp_info_savevm(Monitor *mon, const QDict *qdict)
+{
+    SaveVMInfo *info = qmp_query_savevm(NULL);
+
+    monitor_printf(mon, "Status: %s\n", SaveVMStatus_lookup[info->status]);
+    if (info->has_name) {
+        monitor_printf(mon, "Snapshot: %s\n", info->name);
+    }
+    if (info->has_ram) {
+        monitor_printf(mon, "RAM: %" PRId64 " of %" PRId64 " kbytes "
+                       "transferred, %" PRId64 " kbytes remaining\n",
+                       info->ram->transferred >> 10, info->ram->total >> 10,
+                       info->ram->remaining >> 10);
+    }
+    if (info->has_vm_state_size) {
+        monitor_printf(mon, "VM state size: %" PRId64 " kbytes\n",
+                       info->vm_state_size >> 10);
+    }
+    if (info->has_error) {
+        monitor_printf(mon, "Error: %s\n", info->error);
+    }
+    qapi_free_SaveVMInfo(info);
+}
+
 void hmp_netdev_add(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
@@ -1490,7 +1924,8 @@ void hmp_nbd_server_start(Monitor *mon, const QDict *qdict)
             continue;
         }
 
-        qmp_nbd_server_add(info->value->device, true, writable, &local_err);
+        qmp_nbd_server_add(info->value->device, true, writable, false, 0,
+                           &local_err);
 
         if (local_err != NULL) {
             qmp_nbd_server_stop(NULL);
@@ -1510,7 +1945,7 @@ void hmp_nbd_server_add(Monitor *mon, const QDict *qdict)
     int writable = qdict_get_try_bool(qdict, "writable", 0);
     Error *local_err = NULL;
 
-    qmp_nbd_server_add(device, true, writable, &local_err);
+    qmp_nbd_server_add(device, true, writable, false, 0, &local_err);
 
     if (local_err != NULL) {
         hmp_handle_error(mon, &local_err);
@@ -1548,6 +1983,21 @@ void hmp_chardev_remove(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &local_err);
 }
 
+void hmp_exit_profile(Monitor *mon, const QDict *qdict)
+{
+    const char *option = qdict_get_str(qdict, "option");
+    Error *err = NULL;
+
+    if (!strcmp(option, "on")) {
+        qmp_kvm_exit_profile(true, &err);
+    } else if (!strcmp(option, "off")) {
+        qmp_kvm_exit_profile(false, &err);
+    } else {
+        monitor_printf(mon, "unexpected option %s\n", option);
+    }
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_qemu_io(Monitor *mon, const QDict *qdict)
 {
     BlockDriverState *bs;
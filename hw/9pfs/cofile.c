@@ -48,11 +48,16 @@ int v9fs_co_st_gen(V9fsPDU *pdu, V9fsPath *path, mode_t st_mode,
 int v9fs_co_lstat(V9fsPDU *pdu, V9fsPath *path, struct stat *stbuf)
 {
     int err;
+    uint64_t gen;
     V9fsState *s = pdu->s;
 
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
+    if (v9fs_attr_cache_lookup(s, path, stbuf, &err)) {
+        return err;
+    }
+    gen = s->attr_cache_gen;
     v9fs_path_read_lock(s);
     v9fs_co_run_in_worker(
         {
@@ -62,6 +67,10 @@ int v9fs_co_lstat(V9fsPDU *pdu, V9fsPath *path, struct stat *stbuf)
             }
         });
     v9fs_path_unlock(s);
+    /* Do not store what a concurrent modification may have changed */
+    if (gen == s->attr_cache_gen) {
+        v9fs_attr_cache_insert(s, path, stbuf, err);
+    }
     return err;
 }
 
@@ -105,6 +114,10 @@ int v9fs_co_open(V9fsPDU *pdu, V9fsFidState *fidp, int flags)
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
+    /* Opens count as read-only requests, but O_TRUNC changes the size */
+    if (flags & O_TRUNC) {
+        v9fs_attr_cache_invalidate(s);
+    }
     v9fs_path_read_lock(s);
     v9fs_co_run_in_worker(
         {
@@ -116,6 +129,9 @@ int v9fs_co_open(V9fsPDU *pdu, V9fsFidState *fidp, int flags)
             }
         });
     v9fs_path_unlock(s);
+    if (flags & O_TRUNC) {
+        v9fs_attr_cache_invalidate(s);
+    }
     if (!err) {
         total_open_fd++;
         if (total_open_fd > open_fd_hw) {
@@ -0,0 +1,125 @@
+/*
+ * Virtio 9p attribute cache
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Remembers the result of lstat for a path, including ENOENT, for
+ * attr_cache_ttl milliseconds.  Lookups of the same names over and over
+ * (header search paths during a build) are then answered without a trip
+ * to the worker threads.
+ *
+ * Every request that may modify the export drops the whole cache, both
+ * when it is submitted and when it completes, and bumps a generation
+ * count.  An lstat that overlapped with such a request does not store
+ * its result.  Changes made behind QEMU's back, by the host or through
+ * another export of the same directory, show up once the entries expire.
+ *
+ * The cache is only touched from the main loop, so it needs no lock.
+ */
+
+#include "qemu-common.h"
+#include "qemu/timer.h"
+#include "virtio-9p.h"
+
+/* Past this many entries the cache starts over */
+#define V9FS_ATTR_CACHE_MAX     4096
+
+typedef struct V9fsAttrEntry {
+    V9fsPath path;
+    struct stat st;
+    int err;
+    int64_t expires;
+} V9fsAttrEntry;
+
+static guint v9fs_path_hash(gconstpointer key)
+{
+    const V9fsPath *path = key;
+    guint h = 2166136261u;
+    int i;
+
+    for (i = 0; i < path->size; i++) {
+        h = (h ^ (uint8_t)path->data[i]) * 16777619u;
+    }
+    return h;
+}
+
+static gboolean v9fs_path_equal(gconstpointer a, gconstpointer b)
+{
+    const V9fsPath *pa = a, *pb = b;
+
+    return pa->size == pb->size && !memcmp(pa->data, pb->data, pa->size);
+}
+
+static void v9fs_attr_entry_free(gpointer data)
+{
+    V9fsAttrEntry *entry = data;
+
+    v9fs_path_free(&entry->path);
+    g_free(entry);
+}
+
+void v9fs_attr_cache_init(V9fsState *s)
+{
+    if (!s->fsconf.attr_cache_ttl) {
+        return;
+    }
+    s->attr_cache = g_hash_table_new_full(v9fs_path_hash, v9fs_path_equal,
+                                          NULL, v9fs_attr_entry_free);
+}
+
+bool v9fs_attr_cache_lookup(V9fsState *s, V9fsPath *path,
+                            struct stat *stbuf, int *err)
+{
+    V9fsAttrEntry *entry;
+
+    if (!s->attr_cache) {
+        return false;
+    }
+    entry = g_hash_table_lookup(s->attr_cache, path);
+    if (!entry) {
+        return false;
+    }
+    if (qemu_clock_get_ms(QEMU_CLOCK_REALTIME) >= entry->expires) {
+        g_hash_table_remove(s->attr_cache, path);
+        return false;
+    }
+    *stbuf = entry->st;
+    *err = entry->err;
+    return true;
+}
+
+void v9fs_attr_cache_insert(V9fsState *s, V9fsPath *path,
+                            struct stat *stbuf, int err)
+{
+    V9fsAttrEntry *entry;
+
+    /* Other errors may be transient, do not keep them */
+    if (!s->attr_cache || (err != 0 && err != -ENOENT)) {
+        return;
+    }
+    if (g_hash_table_size(s->attr_cache) >= V9FS_ATTR_CACHE_MAX) {
+        g_hash_table_remove_all(s->attr_cache);
+    }
+
+    entry = g_new0(V9fsAttrEntry, 1);
+    v9fs_path_init(&entry->path);
+    v9fs_path_copy(&entry->path, path);
+    if (err == 0) {
+        entry->st = *stbuf;
+    }
+    entry->err = err;
+    entry->expires = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                     s->fsconf.attr_cache_ttl;
+    g_hash_table_replace(s->attr_cache, &entry->path, entry);
+}
+
+void v9fs_attr_cache_invalidate(V9fsState *s)
+{
+    s->attr_cache_gen++;
+    if (s->attr_cache) {
+        g_hash_table_remove_all(s->attr_cache);
+    }
+}
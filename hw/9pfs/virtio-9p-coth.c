@@ -14,6 +14,7 @@
 
 #include "fsdev/qemu-fsdev.h"
 #include "qemu/thread.h"
+#include "qemu/rcu.h"
 #include "block/coroutine.h"
 #include "virtio-9p-coth.h"
 
@@ -26,16 +27,12 @@ void co_run_in_worker_bh(void *opaque)
     g_thread_pool_push(v9fs_pool.pool, co, NULL);
 }
 
-static void v9fs_qemu_process_req_done(void *arg)
+static void v9fs_qemu_process_req_done(EventNotifier *e)
 {
-    char byte;
-    ssize_t len;
     Coroutine *co;
 
-    do {
-        len = read(v9fs_pool.rfd, &byte, sizeof(byte));
-    } while (len == -1 &&  errno == EINTR);
-
+    event_notifier_test_and_clear(e);
+    /* One wakeup can stand for many completed requests */
     while ((co = g_async_queue_try_pop(v9fs_pool.completed)) != NULL) {
         qemu_coroutine_enter(co, NULL);
     }
@@ -43,30 +40,59 @@ static void v9fs_qemu_process_req_done(void *arg)
 
 static void v9fs_thread_routine(gpointer data, gpointer user_data)
 {
-    ssize_t len;
-    char byte = 0;
     Coroutine *co = data;
 
+    /* glib owns the pool threads and gives no hook for their exit, so
+     * register only for the duration of the request; the synth backend
+     * reads its tree under RCU.
+     */
+    rcu_register_thread();
     qemu_coroutine_enter(co, NULL);
+    rcu_unregister_thread();
 
     g_async_queue_push(v9fs_pool.completed, co);
-    do {
-        len = write(v9fs_pool.wfd, &byte, sizeof(byte));
-    } while (len == -1 && errno == EINTR);
+    event_notifier_set(&v9fs_pool.e);
+}
+
+/*
+ * The pool is shared by all 9p devices.  @threads is the limit a device
+ * asked for, 0 meaning no limit; the pool takes the largest one.
+ */
+static void v9fs_set_max_threads(V9fsThPool *p, uint32_t threads)
+{
+    if (p->max_threads == -1) {
+        return;
+    }
+    if (threads == 0 || threads > INT_MAX) {
+        p->max_threads = -1;
+    } else {
+        p->max_threads = MAX(p->max_threads, (int)threads);
+    }
+    g_thread_pool_set_max_threads(p->pool, p->max_threads, NULL);
+
+    /* Keep idle workers around, so that a burst of requests does not
+     * pay for thread creation each time.
+     */
+    g_thread_pool_set_max_unused_threads(p->max_threads == -1 ?
+                                         8 : p->max_threads);
 }
 
-int v9fs_init_worker_threads(void)
+int v9fs_init_worker_threads(uint32_t threads)
 {
     int ret = 0;
-    int notifier_fds[2];
     V9fsThPool *p = &v9fs_pool;
     sigset_t set, oldset;
 
+    if (p->pool) {
+        v9fs_set_max_threads(p, threads);
+        return 0;
+    }
+
     sigfillset(&set);
     /* Leave signal handling to the iothread.  */
     pthread_sigmask(SIG_SETMASK, &set, &oldset);
 
-    if (qemu_pipe(notifier_fds) == -1) {
+    if (event_notifier_init(&p->e, 0) < 0) {
         ret = -1;
         goto err_out;
     }
@@ -84,13 +110,10 @@ int v9fs_init_worker_threads(void)
         ret = -1;
         goto err_out;
     }
-    p->rfd = notifier_fds[0];
-    p->wfd = notifier_fds[1];
-
-    fcntl(p->rfd, F_SETFL, O_NONBLOCK);
-    fcntl(p->wfd, F_SETFL, O_NONBLOCK);
+    p->max_threads = 0;
+    v9fs_set_max_threads(p, threads);
 
-    qemu_set_fd_handler(p->rfd, v9fs_qemu_process_req_done, NULL, NULL);
+    event_notifier_set_handler(&p->e, v9fs_qemu_process_req_done);
 err_out:
     pthread_sigmask(SIG_SETMASK, &oldset, NULL);
     return ret;
@@ -104,7 +104,7 @@ static void virtio_9p_device_realize(DeviceState *dev, Error **errp)
                    " and export path:%s", s->fsconf.fsdev_id, s->ctx.fs_root);
         goto out;
     }
-    if (v9fs_init_worker_threads() < 0) {
+    if (v9fs_init_worker_threads(s->fsconf.threads) < 0) {
         error_setg(errp, "worker thread initialization failed");
         goto out;
     }
@@ -127,6 +127,7 @@ static void virtio_9p_device_realize(DeviceState *dev, Error **errp)
         goto out;
     }
     v9fs_path_free(&path);
+    v9fs_attr_cache_init(s);
 
     return;
 out:
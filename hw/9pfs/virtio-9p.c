@@ -594,10 +594,17 @@ static void free_pdu(V9fsState *s, V9fsPDU *pdu)
  * because we always expect to have enough space to encode
  * error details
  */
+static inline bool is_read_only_op(V9fsPDU *pdu);
+
 static void complete_pdu(V9fsState *s, V9fsPDU *pdu, ssize_t len)
 {
     int8_t id = pdu->id + 1; /* Response */
 
+    /* Attributes read while the request ran may be stale already */
+    if (!is_read_only_op(pdu)) {
+        v9fs_attr_cache_invalidate(s);
+    }
+
     if (len < 0) {
         int err = -len;
         len = 7;
@@ -1070,8 +1077,16 @@ static void v9fs_getattr(void *opaque)
     /*
      * Currently we only support BASIC fields in stat, so there is no
      * need to look at request_mask.
+     *
+     * An open fid already has a file descriptor, and fstat on it saves
+     * the path walk of lstat.  Drivers that cannot fstat fall back to
+     * the path inside v9fs_co_fstat.
      */
-    retval = v9fs_co_lstat(pdu, &fidp->path, &stbuf);
+    if (fidp->fid_type == P9_FID_FILE || fidp->fid_type == P9_FID_DIR) {
+        retval = v9fs_co_fstat(pdu, fidp, &stbuf);
+    } else {
+        retval = v9fs_co_lstat(pdu, &fidp->path, &stbuf);
+    }
     if (retval < 0) {
         goto out;
     }
@@ -3239,6 +3254,8 @@ static void submit_pdu(V9fsState *s, V9fsPDU *pdu)
 
     if (is_ro_export(&s->ctx) && !is_read_only_op(pdu)) {
         handler = v9fs_fs_ro;
+    } else if (!is_read_only_op(pdu)) {
+        v9fs_attr_cache_invalidate(s);
     }
     co = qemu_coroutine_create(handler);
     qemu_coroutine_enter(co, pdu);
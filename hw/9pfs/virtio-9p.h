@@ -225,6 +225,9 @@ typedef struct V9fsState
     int32_t root_fid;
     Error *migration_blocker;
     V9fsConf fsconf;
+    /* lstat results by path, see virtio-9p-cache.c */
+    GHashTable *attr_cache;
+    uint64_t attr_cache_gen;
 } V9fsState;
 
 typedef struct V9fsStatState {
@@ -395,6 +398,12 @@ extern void v9fs_path_free(V9fsPath *path);
 extern void v9fs_path_copy(V9fsPath *lhs, V9fsPath *rhs);
 extern int v9fs_name_to_path(V9fsState *s, V9fsPath *dirpath,
                              const char *name, V9fsPath *path);
+extern void v9fs_attr_cache_init(V9fsState *s);
+extern bool v9fs_attr_cache_lookup(V9fsState *s, V9fsPath *path,
+                                   struct stat *stbuf, int *err);
+extern void v9fs_attr_cache_insert(V9fsState *s, V9fsPath *path,
+                                   struct stat *stbuf, int err);
+extern void v9fs_attr_cache_invalidate(V9fsState *s);
 
 #define pdu_marshal(pdu, offset, fmt, args...)  \
     v9fs_marshal(pdu->elem.in_sg, pdu->elem.in_num, offset, 1, fmt, ##args)
@@ -405,8 +414,11 @@ extern int v9fs_name_to_path(V9fsState *s, V9fsPath *dirpath,
 #define VIRTIO_9P(obj) \
         OBJECT_CHECK(V9fsState, (obj), TYPE_VIRTIO_9P)
 
-#define DEFINE_VIRTIO_9P_PROPERTIES(_state, _field)             \
-        DEFINE_PROP_STRING("mount_tag", _state, _field.tag),    \
-        DEFINE_PROP_STRING("fsdev", _state, _field.fsdev_id)
+#define DEFINE_VIRTIO_9P_PROPERTIES(_state, _field)                     \
+        DEFINE_PROP_STRING("mount_tag", _state, _field.tag),            \
+        DEFINE_PROP_STRING("fsdev", _state, _field.fsdev_id),           \
+        DEFINE_PROP_UINT32("threads", _state, _field.threads, 0),       \
+        DEFINE_PROP_UINT32("attr_cache_ttl", _state,                    \
+                           _field.attr_cache_ttl, 0)
 
 #endif
@@ -0,0 +1,185 @@
+/*
+ * ACPI memory hotplug registers
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "hw/acpi/memory_hotplug.h"
+
+#define MEMHP_SELECTOR          0x00
+#define MEMHP_BASE_LO           0x04
+#define MEMHP_BASE_HI           0x08
+#define MEMHP_SIZE_LO           0x0c
+#define MEMHP_SIZE_HI           0x10
+#define MEMHP_END_LO            0x14
+#define MEMHP_END_HI            0x18
+#define MEMHP_PROXIMITY         0x1c
+#define MEMHP_STATUS            0x20
+
+#define MEMHP_ENABLED           1
+#define MEMHP_INSERTING         2
+#define MEMHP_REMOVING          4
+#define MEMHP_EJECT             8
+
+static uint64_t acpi_memory_hotplug_read(void *opaque, hwaddr addr,
+                                         unsigned int size)
+{
+    MemHotplugState *s = opaque;
+    DimmDevice *dimm;
+    MemStatus *st;
+    uint64_t end;
+
+    if (addr == MEMHP_SELECTOR) {
+        return s->selector;
+    }
+    if (s->selector >= s->dev_count) {
+        return 0;
+    }
+
+    st = &s->devs[s->selector];
+    if (addr == MEMHP_STATUS) {
+        return (st->is_enabled ? MEMHP_ENABLED : 0) |
+               (st->is_inserting ? MEMHP_INSERTING : 0) |
+               (st->is_removing ? MEMHP_REMOVING : 0);
+    }
+
+    dimm = dimm_find_slot(s->bus, s->selector);
+    if (!dimm) {
+        return 0;
+    }
+    end = dimm->addr + dimm->size - 1;
+    switch (addr) {
+    case MEMHP_BASE_LO:
+        return (uint32_t)dimm->addr;
+    case MEMHP_BASE_HI:
+        return dimm->addr >> 32;
+    case MEMHP_SIZE_LO:
+        return (uint32_t)dimm->size;
+    case MEMHP_SIZE_HI:
+        return dimm->size >> 32;
+    case MEMHP_END_LO:
+        return (uint32_t)end;
+    case MEMHP_END_HI:
+        return end >> 32;
+    case MEMHP_PROXIMITY:
+        return dimm->node;
+    default:
+        return 0;
+    }
+}
+
+static void acpi_memory_eject(MemHotplugState *s, uint32_t slot)
+{
+    DimmDevice *dimm = dimm_find_slot(s->bus, slot);
+
+    s->devs[slot].is_enabled = false;
+    s->devs[slot].is_removing = false;
+    if (dimm) {
+        object_unparent(OBJECT(dimm));
+    }
+}
+
+static void acpi_memory_hotplug_write(void *opaque, hwaddr addr,
+                                      uint64_t data, unsigned int size)
+{
+    MemHotplugState *s = opaque;
+    MemStatus *st;
+
+    if (addr == MEMHP_SELECTOR) {
+        s->selector = data;
+        return;
+    }
+    if (addr != MEMHP_STATUS || s->selector >= s->dev_count) {
+        return;
+    }
+
+    st = &s->devs[s->selector];
+    if (data & MEMHP_INSERTING) {
+        st->is_inserting = false;
+    }
+    if (data & MEMHP_REMOVING) {
+        st->is_removing = false;
+    }
+    if (data & MEMHP_EJECT) {
+        acpi_memory_eject(s, s->selector);
+    }
+}
+
+static const MemoryRegionOps acpi_memory_hotplug_ops = {
+    .read = acpi_memory_hotplug_read,
+    .write = acpi_memory_hotplug_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .valid = {
+        .min_access_size = 4,
+        .max_access_size = 4,
+    },
+};
+
+void acpi_memory_hotplug_init(MemoryRegion *as, Object *owner,
+                              MemHotplugState *state, DimmBus *bus)
+{
+    state->bus = bus;
+    state->dev_count = bus->slots;
+    state->devs = g_new0(MemStatus, state->dev_count);
+
+    memory_region_init_io(&state->io, owner, &acpi_memory_hotplug_ops, state,
+                          "acpi-mem-hotplug", ACPI_MEMORY_HOTPLUG_IO_LEN);
+    memory_region_add_subregion(as, ACPI_MEMORY_HOTPLUG_BASE, &state->io);
+}
+
+bool acpi_memory_plug(MemHotplugState *state, DimmDevice *dimm, bool add)
+{
+    MemStatus *st = &state->devs[dimm->slot];
+
+    if (add) {
+        /* DIMMs given on the command line are found by the guest at boot */
+        st->is_enabled = true;
+        st->is_inserting = DEVICE(dimm)->hotplugged;
+        return st->is_inserting;
+    }
+
+    st->is_removing = true;
+    return true;
+}
+
+void acpi_memory_hotplug_reset(MemHotplugState *state)
+{
+    uint32_t i;
+
+    state->selector = 0;
+    for (i = 0; i < state->dev_count; i++) {
+        state->devs[i].is_inserting = false;
+        if (state->devs[i].is_removing) {
+            acpi_memory_eject(state, i);
+        }
+    }
+}
+
+static const VMStateDescription vmstate_memhp_sts = {
+    .name = "memory hotplug device state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField []) {
+        VMSTATE_BOOL(is_enabled, MemStatus),
+        VMSTATE_BOOL(is_inserting, MemStatus),
+        VMSTATE_BOOL(is_removing, MemStatus),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+const VMStateDescription vmstate_memory_hotplug = {
+    .name = "memory hotplug state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField []) {
+        VMSTATE_UINT32(selector, MemHotplugState),
+        VMSTATE_STRUCT_VARRAY_POINTER_UINT32(devs, MemHotplugState, dev_count,
+                                             vmstate_memhp_sts, MemStatus),
+        VMSTATE_END_OF_LIST()
+    }
+};
@@ -30,6 +30,7 @@
 #include "hw/nvram/fw_cfg.h"
 #include "exec/address-spaces.h"
 #include "hw/acpi/piix4.h"
+#include "hw/acpi/memory_hotplug.h"
 
 //#define DEBUG
 
@@ -99,6 +100,8 @@ typedef struct PIIX4PMState {
 
     CPUStatus gpe_cpu;
     Notifier cpu_added_notifier;
+
+    MemHotplugState mem_hotplug;
 } PIIX4PMState;
 
 #define TYPE_PIIX4_PM "PIIX4_PM"
@@ -123,7 +126,8 @@ static void pm_update_sci(PIIX4PMState *s)
                    ACPI_BITMASK_GLOBAL_LOCK_ENABLE |
                    ACPI_BITMASK_TIMER_ENABLE)) != 0) ||
         (((s->ar.gpe.sts[0] & s->ar.gpe.en[0]) &
-          (PIIX4_PCI_HOTPLUG_STATUS | PIIX4_CPU_HOTPLUG_STATUS)) != 0);
+          (PIIX4_PCI_HOTPLUG_STATUS | PIIX4_CPU_HOTPLUG_STATUS |
+           ACPI_MEMORY_HOTPLUG_STATUS)) != 0);
 
     qemu_set_irq(s->irq, sci_level);
     /* schedule a timer interruption if needed */
@@ -288,6 +292,24 @@ static int acpi_load_old(QEMUFile *f, void *opaque, int version_id)
  * qemu 1.2).
  *
  */
+static bool vmstate_memhp_needed(void *opaque)
+{
+    PIIX4PMState *s = opaque;
+
+    return s->mem_hotplug.dev_count > 0;
+}
+
+static const VMStateDescription vmstate_memhp_state = {
+    .name = "piix4_pm/memhp",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField []) {
+        VMSTATE_MEMORY_HOTPLUG(mem_hotplug, PIIX4PMState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_acpi = {
     .name = "piix4_pm",
     .version_id = 3,
@@ -307,6 +329,14 @@ static const VMStateDescription vmstate_acpi = {
         VMSTATE_STRUCT(pci0_status, PIIX4PMState, 2, vmstate_pci_status,
                        struct pci_status),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection[]) {
+        {
+            .vmsd = &vmstate_memhp_state,
+            .needed = vmstate_memhp_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
@@ -384,6 +414,7 @@ static void piix4_reset(void *opaque)
     }
     pm_io_space_update(s);
     piix4_update_hotplug(s);
+    acpi_memory_hotplug_reset(&s->mem_hotplug);
 }
 
 static void piix4_pm_powerdown_req(Notifier *n, void *opaque)
@@ -707,10 +738,22 @@ static void piix4_cpu_added_req(Notifier *n, void *opaque)
 static int piix4_device_hotplug(DeviceState *qdev, PCIDevice *dev,
                                 PCIHotplugState state);
 
+static int piix4_dimm_hotplug(DeviceState *qdev, DimmDevice *dimm, bool add)
+{
+    PIIX4PMState *s = PIIX4_PM(qdev);
+
+    if (acpi_memory_plug(&s->mem_hotplug, dimm, add)) {
+        s->ar.gpe.sts[0] |= ACPI_MEMORY_HOTPLUG_STATUS;
+        pm_update_sci(s);
+    }
+    return 0;
+}
+
 static void piix4_acpi_system_hot_add_init(MemoryRegion *parent,
                                            PCIBus *bus, PIIX4PMState *s)
 {
     CPUState *cpu;
+    Object *dimm_bus;
 
     memory_region_init_io(&s->io_gpe, OBJECT(s), &piix4_gpe_ops, s,
                           "acpi-gpe0", GPE_LEN);
@@ -734,6 +777,14 @@ static void piix4_acpi_system_hot_add_init(MemoryRegion *parent,
     memory_region_add_subregion(parent, PIIX4_PROC_BASE, &s->io_cpu);
     s->cpu_added_notifier.notify = piix4_cpu_added_req;
     qemu_register_cpu_added_notifier(&s->cpu_added_notifier);
+
+    /* The board creates the bus before the PM device, if it has DIMM slots */
+    dimm_bus = object_resolve_path_type("", TYPE_DIMM_BUS, NULL);
+    if (dimm_bus) {
+        acpi_memory_hotplug_init(parent, OBJECT(s), &s->mem_hotplug,
+                                 DIMM_BUS(dimm_bus));
+        dimm_bus_hotplug(DIMM_BUS(dimm_bus), piix4_dimm_hotplug, DEVICE(s));
+    }
 }
 
 static void enable_device(PIIX4PMState *s, int slot)
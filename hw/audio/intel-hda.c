@@ -1191,6 +1191,7 @@ static const VMStateDescription vmstate_intel_hda = {
     .name = "intel-hda",
     .version_id = 1,
     .post_load = intel_hda_post_load,
+    .save_parallel = true,
     .fields = (VMStateField []) {
         VMSTATE_PCI_DEVICE(pci, IntelHDAState),
 
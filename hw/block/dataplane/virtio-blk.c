@@ -17,40 +17,36 @@
 #include "qemu/thread.h"
 #include "qemu/error-report.h"
 #include "hw/virtio/dataplane/vring.h"
-#include "ioq.h"
 #include "block/block.h"
 #include "hw/virtio/virtio-blk.h"
 #include "virtio-blk.h"
 #include "block/aio.h"
 #include "hw/virtio/virtio-bus.h"
+#include "sysemu/iothread.h"
+#include "qemu/rcu.h"
 
 enum {
     SEG_MAX = 126,                  /* maximum number of I/O segments */
     VRING_MAX = SEG_MAX + 2,        /* maximum number of vring descriptors */
-    REQ_MAX = VRING_MAX,            /* maximum number of requests in the vring,
-                                     * is VRING_MAX / 2 with traditional and
-                                     * VRING_MAX with indirect descriptors */
 };
 
+typedef struct VirtIOBlockDataPlaneQueue VirtIOBlockDataPlaneQueue;
+
 typedef struct {
-    struct iocb iocb;               /* Linux AIO control block */
+    VirtIOBlockDataPlaneQueue *q;   /* virtqueue the request came from */
     QEMUIOVector *inhdr;            /* iovecs for virtio_blk_inhdr */
     unsigned int head;              /* vring descriptor index */
-    struct iovec *bounce_iov;       /* used if guest buffers are unaligned */
-    QEMUIOVector *read_qiov;        /* for read completion /w bounce buffer */
+    QEMUIOVector qiov;              /* guest buffers for read/write */
 } VirtIOBlockRequest;
 
-struct VirtIOBlockDataPlane {
-    bool started;
-    bool starting;
-    bool stopping;
-    QEMUBH *start_bh;
-    QemuThread thread;
-
-    VirtIOBlkConf *blk;
-    int fd;                         /* image file descriptor */
+/* Per-virtqueue state.  All virtqueues of a device are serviced by the
+ * device's AioContext, since a BlockDriverState can only be accessed from
+ * one AioContext at a time.
+ */
+struct VirtIOBlockDataPlaneQueue {
+    VirtIOBlockDataPlane *s;
+    unsigned int index;             /* virtqueue index */
 
-    VirtIODevice *vdev;
     Vring vring;                    /* virtqueue vring */
     EventNotifier *guest_notifier;  /* irq */
 
@@ -59,56 +55,69 @@ struct VirtIOBlockDataPlane {
      * (because you don't own the file descriptor or handle; you just
      * use it).
      */
-    AioContext *ctx;
-    EventNotifier io_notifier;      /* Linux AIO completion */
     EventNotifier host_notifier;    /* doorbell */
+};
+
+struct VirtIOBlockDataPlane {
+    bool started;
+    bool starting;
+    bool stopping;
+    QEMUBH *start_bh;
+    QemuThread thread;
+    QemuThreadSched sched;
+    IOThread *iothread;             /* or NULL to use our own thread */
 
-    IOQueue ioqueue;                /* Linux AIO queue (should really be per
-                                       dataplane thread) */
-    VirtIOBlockRequest requests[REQ_MAX]; /* pool of requests, managed by the
-                                             queue */
+    VirtIOBlkConf *blk;
 
-    unsigned int num_reqs;
+    VirtIODevice *vdev;
+    AioContext *ctx;
+    unsigned int num_queues;
+    VirtIOBlockDataPlaneQueue *queues;
 };
 
 /* Raise an interrupt to signal guest, if necessary */
-static void notify_guest(VirtIOBlockDataPlane *s)
+static void notify_guest(VirtIOBlockDataPlaneQueue *q)
 {
-    if (!vring_should_notify(s->vdev, &s->vring)) {
+    if (!vring_should_notify(q->s->vdev, &q->vring)) {
         return;
     }
 
-    event_notifier_set(s->guest_notifier);
+    event_notifier_set(q->guest_notifier);
 }
 
-static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
+static void complete_request_early(VirtIOBlockDataPlaneQueue *q,
+                                   unsigned int head,
+                                   QEMUIOVector *inhdr, unsigned char status)
 {
-    VirtIOBlockDataPlane *s = opaque;
-    VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
+    struct virtio_blk_inhdr hdr = {
+        .status = status,
+    };
+
+    qemu_iovec_from_buf(inhdr, 0, &hdr, sizeof(hdr));
+    qemu_iovec_destroy(inhdr);
+    g_slice_free(QEMUIOVector, inhdr);
+
+    vring_push(&q->vring, head, sizeof(hdr));
+    notify_guest(q);
+}
+
+static void complete_request(void *opaque, int ret)
+{
+    VirtIOBlockRequest *req = opaque;
+    VirtIOBlockDataPlaneQueue *q = req->q;
     struct virtio_blk_inhdr hdr;
     int len;
 
-    if (likely(ret >= 0)) {
+    if (likely(ret == 0)) {
         hdr.status = VIRTIO_BLK_S_OK;
-        len = ret;
+        len = req->qiov.size;
     } else {
         hdr.status = VIRTIO_BLK_S_IOERR;
         len = 0;
     }
 
-    trace_virtio_blk_data_plane_complete_request(s, req->head, ret);
-
-    if (req->read_qiov) {
-        assert(req->bounce_iov);
-        qemu_iovec_from_buf(req->read_qiov, 0, req->bounce_iov->iov_base, len);
-        qemu_iovec_destroy(req->read_qiov);
-        g_slice_free(QEMUIOVector, req->read_qiov);
-    }
-
-    if (req->bounce_iov) {
-        qemu_vfree(req->bounce_iov->iov_base);
-        g_slice_free(struct iovec, req->bounce_iov);
-    }
+    trace_virtio_blk_data_plane_complete_request(q->s, q->index, req->head,
+                                                 ret);
 
     qemu_iovec_from_buf(req->inhdr, 0, &hdr, sizeof(hdr));
     qemu_iovec_destroy(req->inhdr);
@@ -118,86 +127,93 @@ static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
      * written to, but for virtio-blk it seems to be the number of bytes
      * transferred plus the status bytes.
      */
-    vring_push(&s->vring, req->head, len + sizeof(hdr));
+    vring_push(&q->vring, req->head, len + sizeof(hdr));
+    notify_guest(q);
 
-    s->num_reqs--;
+    /* If there were more requests than iovecs, the vring will not be empty yet
+     * so check again.  There should now be enough resources to process more
+     * requests.
+     */
+    if (unlikely(vring_more_avail(&q->vring))) {
+        event_notifier_set(&q->host_notifier);
+    }
+
+    qemu_iovec_destroy(&req->qiov);
+    g_slice_free(VirtIOBlockRequest, req);
 }
 
-static void complete_request_early(VirtIOBlockDataPlane *s, unsigned int head,
-                                   QEMUIOVector *inhdr, unsigned char status)
+static VirtIOBlockRequest *alloc_request(VirtIOBlockDataPlaneQueue *q,
+                                         unsigned int head,
+                                         QEMUIOVector *inhdr)
 {
-    struct virtio_blk_inhdr hdr = {
-        .status = status,
-    };
+    VirtIOBlockRequest *req = g_slice_new(VirtIOBlockRequest);
 
-    qemu_iovec_from_buf(inhdr, 0, &hdr, sizeof(hdr));
-    qemu_iovec_destroy(inhdr);
-    g_slice_free(QEMUIOVector, inhdr);
-
-    vring_push(&s->vring, head, sizeof(hdr));
-    notify_guest(s);
+    req->q = q;
+    req->head = head;
+    req->inhdr = inhdr;
+    qemu_iovec_init(&req->qiov, 1);
+    return req;
 }
 
 /* Get disk serial number */
-static void do_get_id_cmd(VirtIOBlockDataPlane *s,
+static void do_get_id_cmd(VirtIOBlockDataPlaneQueue *q,
                           struct iovec *iov, unsigned int iov_cnt,
                           unsigned int head, QEMUIOVector *inhdr)
 {
+    VirtIOBlockDataPlane *s = q->s;
     char id[VIRTIO_BLK_ID_BYTES];
 
     /* Serial number not NUL-terminated when shorter than buffer */
     strncpy(id, s->blk->serial ? s->blk->serial : "", sizeof(id));
     iov_from_buf(iov, iov_cnt, 0, id, sizeof(id));
-    complete_request_early(s, head, inhdr, VIRTIO_BLK_S_OK);
+    complete_request_early(q, head, inhdr, VIRTIO_BLK_S_OK);
 }
 
-static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
+static int do_rdwr_cmd(VirtIOBlockDataPlaneQueue *q, bool read,
                        struct iovec *iov, unsigned int iov_cnt,
-                       long long offset, unsigned int head,
+                       int64_t sector_num, unsigned int head,
                        QEMUIOVector *inhdr)
 {
-    struct iocb *iocb;
-    QEMUIOVector qiov;
-    struct iovec *bounce_iov = NULL;
-    QEMUIOVector *read_qiov = NULL;
-
-    qemu_iovec_init_external(&qiov, iov, iov_cnt);
-    if (!bdrv_qiov_is_aligned(s->blk->conf.bs, &qiov)) {
-        void *bounce_buffer = qemu_blockalign(s->blk->conf.bs, qiov.size);
-
-        if (read) {
-            /* Need to copy back from bounce buffer on completion */
-            read_qiov = g_slice_new(QEMUIOVector);
-            qemu_iovec_init(read_qiov, iov_cnt);
-            qemu_iovec_concat_iov(read_qiov, iov, iov_cnt, 0, qiov.size);
-        } else {
-            qemu_iovec_to_buf(&qiov, 0, bounce_buffer, qiov.size);
-        }
-
-        /* Redirect I/O to aligned bounce buffer */
-        bounce_iov = g_slice_new(struct iovec);
-        bounce_iov->iov_base = bounce_buffer;
-        bounce_iov->iov_len = qiov.size;
-        iov = bounce_iov;
-        iov_cnt = 1;
+    BlockDriverState *bs = q->s->blk->conf.bs;
+    VirtIOBlockRequest *req = alloc_request(q, head, inhdr);
+    size_t size = iov_size(iov, iov_cnt);
+
+    if (size & (BDRV_SECTOR_SIZE - 1)) {
+        error_report("virtio-blk request size %zu is not sector-aligned",
+                     size);
+        qemu_iovec_destroy(&req->qiov);
+        g_slice_free(VirtIOBlockRequest, req);
+        return -EFAULT;
     }
 
-    iocb = ioq_rdwr(&s->ioqueue, read, iov, iov_cnt, offset);
+    /* The iovecs array is reused for the next batch of requests, so the
+     * block layer needs its own copy.  The guest buffers are not copied;
+     * they stay mapped until the request is pushed back onto the vring.
+     */
+    qemu_iovec_concat_iov(&req->qiov, iov, iov_cnt, 0, size);
 
-    /* Fill in virtio block metadata needed for completion */
-    VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
-    req->head = head;
-    req->inhdr = inhdr;
-    req->bounce_iov = bounce_iov;
-    req->read_qiov = read_qiov;
+    if (read) {
+        bdrv_aio_readv(bs, sector_num, &req->qiov,
+                       size / BDRV_SECTOR_SIZE, complete_request, req);
+    } else {
+        bdrv_aio_writev(bs, sector_num, &req->qiov,
+                        size / BDRV_SECTOR_SIZE, complete_request, req);
+    }
     return 0;
 }
 
-static int process_request(IOQueue *ioq, struct iovec iov[],
+static void do_flush_cmd(VirtIOBlockDataPlaneQueue *q, unsigned int head,
+                         QEMUIOVector *inhdr)
+{
+    VirtIOBlockRequest *req = alloc_request(q, head, inhdr);
+
+    bdrv_aio_flush(q->s->blk->conf.bs, complete_request, req);
+}
+
+static int process_request(VirtIOBlockDataPlaneQueue *q, struct iovec iov[],
                            unsigned int out_num, unsigned int in_num,
                            unsigned int head)
 {
-    VirtIOBlockDataPlane *s = container_of(ioq, VirtIOBlockDataPlane, ioqueue);
     struct iovec *in_iov = &iov[out_num];
     struct virtio_blk_outhdr outhdr;
     QEMUIOVector *inhdr;
@@ -229,53 +245,54 @@ static int process_request(IOQueue *ioq, struct iovec iov[],
 
     switch (outhdr.type) {
     case VIRTIO_BLK_T_IN:
-        do_rdwr_cmd(s, true, in_iov, in_num, outhdr.sector * 512, head, inhdr);
+        if (do_rdwr_cmd(q, true, in_iov, in_num, outhdr.sector,
+                        head, inhdr) < 0) {
+            goto fault;
+        }
         return 0;
 
     case VIRTIO_BLK_T_OUT:
-        do_rdwr_cmd(s, false, iov, out_num, outhdr.sector * 512, head, inhdr);
+        if (do_rdwr_cmd(q, false, iov, out_num, outhdr.sector,
+                        head, inhdr) < 0) {
+            goto fault;
+        }
         return 0;
 
     case VIRTIO_BLK_T_SCSI_CMD:
         /* TODO support SCSI commands */
-        complete_request_early(s, head, inhdr, VIRTIO_BLK_S_UNSUPP);
+        complete_request_early(q, head, inhdr, VIRTIO_BLK_S_UNSUPP);
         return 0;
 
     case VIRTIO_BLK_T_FLUSH:
-        /* TODO fdsync not supported by Linux AIO, do it synchronously here! */
-        if (qemu_fdatasync(s->fd) < 0) {
-            complete_request_early(s, head, inhdr, VIRTIO_BLK_S_IOERR);
-        } else {
-            complete_request_early(s, head, inhdr, VIRTIO_BLK_S_OK);
-        }
+        do_flush_cmd(q, head, inhdr);
         return 0;
 
     case VIRTIO_BLK_T_GET_ID:
-        do_get_id_cmd(s, in_iov, in_num, head, inhdr);
+        do_get_id_cmd(q, in_iov, in_num, head, inhdr);
         return 0;
 
     default:
         error_report("virtio-blk unsupported request type %#x", outhdr.type);
-        qemu_iovec_destroy(inhdr);
-        g_slice_free(QEMUIOVector, inhdr);
-        return -EFAULT;
+        goto fault;
     }
+
+fault:
+    qemu_iovec_destroy(inhdr);
+    g_slice_free(QEMUIOVector, inhdr);
+    return -EFAULT;
 }
 
 static void handle_notify(EventNotifier *e)
 {
-    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           host_notifier);
+    VirtIOBlockDataPlaneQueue *q = container_of(e, VirtIOBlockDataPlaneQueue,
+                                                host_notifier);
+    VirtIOBlockDataPlane *s = q->s;
 
     /* There is one array of iovecs into which all new requests are extracted
      * from the vring.  Requests are read from the vring and the translated
      * descriptors are written to the iovecs array.  The iovecs do not have to
-     * persist across handle_notify() calls because the kernel copies the
-     * iovecs on io_submit().
-     *
-     * Handling io_submit() EAGAIN may require storing the requests across
-     * handle_notify() calls until the kernel has sufficient resources to
-     * accept more I/O.  This is not implemented yet.
+     * persist across handle_notify() calls because each request copies them
+     * into its own QEMUIOVector before it is submitted to the block layer.
      */
     struct iovec iovec[VRING_MAX];
     struct iovec *end = &iovec[VRING_MAX];
@@ -290,24 +307,24 @@ static void handle_notify(EventNotifier *e)
      */
     int head;
     unsigned int out_num = 0, in_num = 0;
-    unsigned int num_queued;
 
-    event_notifier_test_and_clear(&s->host_notifier);
+    event_notifier_test_and_clear(&q->host_notifier);
+    bdrv_io_plug(s->blk->conf.bs);
     for (;;) {
         /* Disable guest->host notifies to avoid unnecessary vmexits */
-        vring_disable_notification(s->vdev, &s->vring);
+        vring_disable_notification(s->vdev, &q->vring);
 
         for (;;) {
-            head = vring_pop(s->vdev, &s->vring, iov, end, &out_num, &in_num);
+            head = vring_pop(s->vdev, &q->vring, iov, end, &out_num, &in_num);
             if (head < 0) {
                 break; /* no more requests */
             }
 
-            trace_virtio_blk_data_plane_process_request(s, out_num, in_num,
-                                                        head);
+            trace_virtio_blk_data_plane_process_request(s, q->index, out_num,
+                                                        in_num, head);
 
-            if (process_request(&s->ioqueue, iov, out_num, in_num, head) < 0) {
-                vring_set_broken(&s->vring);
+            if (process_request(q, iov, out_num, in_num, head) < 0) {
+                vring_set_broken(&q->vring);
                 break;
             }
             iov += out_num + in_num;
@@ -317,7 +334,7 @@ static void handle_notify(EventNotifier *e)
             /* Re-enable guest->host notifies and stop processing the vring.
              * But if the guest has snuck in more descriptors, keep processing.
              */
-            if (vring_enable_notification(s->vdev, &s->vring)) {
+            if (vring_enable_notification(s->vdev, &q->vring)) {
                 break;
             }
         } else { /* head == -ENOBUFS or fatal error, iovecs[] is depleted */
@@ -329,44 +346,51 @@ static void handle_notify(EventNotifier *e)
         }
     }
 
-    num_queued = ioq_num_queued(&s->ioqueue);
-    if (num_queued > 0) {
-        s->num_reqs += num_queued;
-
-        int rc = ioq_submit(&s->ioqueue);
-        if (unlikely(rc < 0)) {
-            fprintf(stderr, "ioq_submit failed %d\n", rc);
-            exit(1);
-        }
-    }
+    /* Hand the whole batch to the kernel at once */
+    bdrv_io_unplug(s->blk->conf.bs);
 }
 
-static void handle_io(EventNotifier *e)
+/* Busy-wait callback: look at the avail ring without waiting for a kick */
+static bool handle_notify_poll(void *opaque)
 {
-    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           io_notifier);
+    EventNotifier *e = opaque;
+    VirtIOBlockDataPlaneQueue *q = container_of(e, VirtIOBlockDataPlaneQueue,
+                                                host_notifier);
 
-    event_notifier_test_and_clear(&s->io_notifier);
-    if (ioq_run_completion(&s->ioqueue, complete_request, s) > 0) {
-        notify_guest(s);
+    if (!vring_more_avail(&q->vring)) {
+        return false;
     }
 
-    /* If there were more requests than iovecs, the vring will not be empty yet
-     * so check again.  There should now be enough resources to process more
-     * requests.
-     */
-    if (unlikely(vring_more_avail(&s->vring))) {
-        handle_notify(&s->host_notifier);
-    }
+    handle_notify(e);
+    return true;
 }
 
 static void *data_plane_thread(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
+    int ret;
+
+    rcu_register_thread();
 
-    while (!s->stopping || s->num_reqs > 0) {
-        aio_poll(s->ctx, true);
+    ret = qemu_thread_set_sched(&s->sched);
+    if (ret < 0) {
+        error_report("cannot set the affinity or scheduling policy of the "
+                     "dataplane thread: %s", strerror(-ret));
+    }
+
+    /* The main loop acquires our AioContext to reconfigure the
+     * BlockDriverState.  aio_poll() returns false when the contention
+     * callback kicked us, so the lock is dropped for it right away.
+     */
+    while (!s->stopping) {
+        aio_context_acquire(s->ctx);
+        while (!s->stopping && aio_poll(s->ctx, true)) {
+            /* Progress was made, keep going */
+        }
+        aio_context_release(s->ctx);
     }
+
+    rcu_unregister_thread();
     return NULL;
 }
 
@@ -385,7 +409,8 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
                                   Error **errp)
 {
     VirtIOBlockDataPlane *s;
-    int fd;
+    QemuThreadSched sched = {};
+    unsigned int i;
 
     *dataplane = NULL;
 
@@ -393,6 +418,26 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
         return;
     }
 
+    if (blk->iothread &&
+        (blk->data_plane_affinity || blk->data_plane_sched)) {
+        error_setg(errp, "x-data-plane-affinity and x-data-plane-sched "
+                         "cannot be used with iothread");
+        return;
+    }
+
+    if (blk->data_plane_affinity &&
+        qemu_thread_parse_affinity(&sched, blk->data_plane_affinity) < 0) {
+        error_setg(errp, "invalid x-data-plane-affinity, use cpu[-cpu]");
+        return;
+    }
+
+    if (blk->data_plane_sched &&
+        qemu_thread_parse_sched(&sched, blk->data_plane_sched) < 0) {
+        error_setg(errp, "invalid x-data-plane-sched, "
+                         "use other, fifo[:priority] or rr[:priority]");
+        return;
+    }
+
     if (blk->scsi) {
         error_setg(errp,
                    "device is incompatible with x-data-plane, use scsi=off");
@@ -414,17 +459,26 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
         return;
     }
 
-    fd = raw_get_aio_fd(blk->conf.bs);
-    if (fd < 0) {
+    if (!bdrv_can_set_aio_context(blk->conf.bs)) {
         error_setg(errp, "drive is incompatible with x-data-plane, "
-                         "use format=raw,cache=none,aio=native");
+                         "its protocol cannot be moved to another AioContext");
         return;
     }
 
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
-    s->fd = fd;
     s->blk = blk;
+    s->sched = sched;
+    s->iothread = blk->iothread;
+    if (s->iothread) {
+        object_ref(OBJECT(s->iothread));
+    }
+    s->num_queues = blk->num_queues;
+    s->queues = g_new0(VirtIOBlockDataPlaneQueue, s->num_queues);
+    for (i = 0; i < s->num_queues; i++) {
+        s->queues[i].s = s;
+        s->queues[i].index = i;
+    }
 
     /* Prevent block operations that conflict with data plane thread */
     bdrv_set_in_use(blk->conf.bs, 1);
@@ -440,6 +494,10 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 
     virtio_blk_data_plane_stop(s);
     bdrv_set_in_use(s->blk->conf.bs, 0);
+    if (s->iothread) {
+        object_unref(OBJECT(s->iothread));
+    }
+    g_free(s->queues);
     g_free(s);
 }
 
@@ -447,8 +505,9 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIOBlockDataPlaneQueue *q;
     VirtQueue *vq;
-    int i;
+    unsigned int i;
 
     if (s->started) {
         return;
@@ -460,81 +519,130 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 
     s->starting = true;
 
-    vq = virtio_get_queue(s->vdev, 0);
-    if (!vring_setup(&s->vring, s->vdev, 0)) {
-        s->starting = false;
-        return;
+    for (i = 0; i < s->num_queues; i++) {
+        if (!vring_setup(&s->queues[i].vring, s->vdev, i)) {
+            while (i-- > 0) {
+                vring_teardown(&s->queues[i].vring, s->vdev, i);
+            }
+            s->starting = false;
+            return;
+        }
     }
 
-    s->ctx = aio_context_new();
-
-    /* Set up guest notifier (irq) */
-    if (k->set_guest_notifiers(qbus->parent, 1, true) != 0) {
+    /* Set up guest notifiers (irq) */
+    if (k->set_guest_notifiers(qbus->parent, s->num_queues, true) != 0) {
         fprintf(stderr, "virtio-blk failed to set guest notifier, "
                 "ensure -enable-kvm is set\n");
         exit(1);
     }
-    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
 
-    /* Set up virtqueue notify */
-    if (k->set_host_notifier(qbus->parent, 0, true) != 0) {
-        fprintf(stderr, "virtio-blk failed to set host notifier\n");
-        exit(1);
+    if (s->iothread) {
+        /* The IOThread owns the polling parameters of its AioContext */
+        s->ctx = iothread_get_aio_context(s->iothread);
+        aio_context_ref(s->ctx);
+    } else {
+        s->ctx = aio_context_new();
+        aio_context_set_poll_params(s->ctx, s->blk->poll_max_ns,
+                                    s->blk->poll_grow, s->blk->poll_shrink);
     }
-    s->host_notifier = *virtio_queue_get_host_notifier(vq);
-    aio_set_event_notifier(s->ctx, &s->host_notifier, handle_notify);
 
-    /* Set up ioqueue */
-    ioq_init(&s->ioqueue, s->fd, REQ_MAX);
-    for (i = 0; i < ARRAY_SIZE(s->requests); i++) {
-        ioq_put_iocb(&s->ioqueue, &s->requests[i].iocb);
+    /* An IOThread may already be polling s->ctx */
+    aio_context_acquire(s->ctx);
+    for (i = 0; i < s->num_queues; i++) {
+        q = &s->queues[i];
+        vq = virtio_get_queue(s->vdev, i);
+
+        q->guest_notifier = virtio_queue_get_guest_notifier(vq);
+
+        /* Set up virtqueue notify */
+        if (k->set_host_notifier(qbus->parent, i, true) != 0) {
+            fprintf(stderr, "virtio-blk failed to set host notifier\n");
+            exit(1);
+        }
+        q->host_notifier = *virtio_queue_get_host_notifier(vq);
+        aio_set_event_notifier(s->ctx, &q->host_notifier, handle_notify);
+        aio_set_event_notifier_poll(s->ctx, &q->host_notifier,
+                                    handle_notify_poll);
     }
-    s->io_notifier = *ioq_get_notifier(&s->ioqueue);
-    aio_set_event_notifier(s->ctx, &s->io_notifier, handle_io);
+    aio_context_release(s->ctx);
+
+    /* From now on the drive is only touched from the dataplane thread, or
+     * by whoever holds s->ctx.
+     */
+    bdrv_set_aio_context(s->blk->conf.bs, s->ctx);
 
     s->starting = false;
     s->started = true;
-    trace_virtio_blk_data_plane_start(s);
+    trace_virtio_blk_data_plane_start(s, s->num_queues);
 
-    /* Kick right away to begin processing requests already in vring */
-    event_notifier_set(virtio_queue_get_host_notifier(vq));
+    /* Kick right away to begin processing requests already in vrings */
+    for (i = 0; i < s->num_queues; i++) {
+        vq = virtio_get_queue(s->vdev, i);
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    }
 
     /* Spawn thread in BH so it inherits iothread cpusets */
-    s->start_bh = qemu_bh_new(start_data_plane_bh, s);
-    qemu_bh_schedule(s->start_bh);
+    if (!s->iothread) {
+        s->start_bh = qemu_bh_new(start_data_plane_bh, s);
+        qemu_bh_schedule(s->start_bh);
+    }
 }
 
 void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    AioPollStats stats;
+    unsigned int i;
+
     if (!s->started || s->stopping) {
         return;
     }
-    s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
-    /* Stop thread or cancel pending thread creation BH */
-    if (s->start_bh) {
-        qemu_bh_delete(s->start_bh);
-        s->start_bh = NULL;
-    } else {
-        aio_notify(s->ctx);
-        qemu_thread_join(&s->thread);
+    aio_context_acquire(s->ctx);
+
+    /* Stop notifications for new requests from guest */
+    for (i = 0; i < s->num_queues; i++) {
+        aio_set_event_notifier(s->ctx, &s->queues[i].host_notifier, NULL);
+    }
+
+    /* Drain and move the drive back to the main loop */
+    bdrv_set_aio_context(s->blk->conf.bs, qemu_get_aio_context());
+
+    aio_context_release(s->ctx);
+
+    /* Stop thread or cancel pending thread creation BH.  An IOThread keeps
+     * running for its other users.
+     */
+    s->stopping = true;
+    if (!s->iothread) {
+        if (s->start_bh) {
+            qemu_bh_delete(s->start_bh);
+            s->start_bh = NULL;
+        } else {
+            aio_notify(s->ctx);
+            qemu_thread_join(&s->thread);
+        }
     }
 
-    aio_set_event_notifier(s->ctx, &s->io_notifier, NULL);
-    ioq_cleanup(&s->ioqueue);
+    for (i = 0; i < s->num_queues; i++) {
+        k->set_host_notifier(qbus->parent, i, false);
+    }
 
-    aio_set_event_notifier(s->ctx, &s->host_notifier, NULL);
-    k->set_host_notifier(qbus->parent, 0, false);
+    aio_context_get_poll_stats(s->ctx, &stats);
+    trace_virtio_blk_data_plane_poll_stats(s, stats.attempts, stats.successes,
+                                           stats.time_ns, stats.poll_ns);
 
     aio_context_unref(s->ctx);
+    s->ctx = NULL;
 
-    /* Clean up guest notifier (irq) */
-    k->set_guest_notifiers(qbus->parent, 1, false);
+    /* Clean up guest notifiers (irq) */
+    k->set_guest_notifiers(qbus->parent, s->num_queues, false);
 
-    vring_teardown(&s->vring, s->vdev, 0);
+    for (i = 0; i < s->num_queues; i++) {
+        vring_teardown(&s->queues[i].vring, s->vdev, i);
+    }
     s->started = false;
     s->stopping = false;
 }
@@ -18,17 +18,86 @@
  * Usage: add options:
  *      -drive file=<file>,if=none,id=<drive_id>
  *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>
+ *
+ * With x-data-plane=on the I/O queues are serviced by a dedicated thread.
+ * Guests that configure the shadow doorbell buffer then kick it through
+ * ioeventfd, or not at all while it polls (x-poll-max-ns).
  */
 
 #include <hw/block/block.h>
 #include <hw/hw.h>
+#include <hw/pci/msi.h>
 #include <hw/pci/msix.h>
 #include <hw/pci/pci.h>
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
 
 #include "nvme.h"
 
 static void nvme_process_sq(void *opaque);
 
+/* I/O queues move to the data plane's AioContext, the admin queue pair
+ * always stays in the main loop.
+ */
+static bool nvme_in_data_plane(NvmeCtrl *n, uint16_t qid)
+{
+#ifdef CONFIG_NVME_DATA_PLANE
+    return qid && n->dp_started;
+#else
+    return false;
+#endif
+}
+
+static AioContext *nvme_queue_context(NvmeCtrl *n, uint16_t qid)
+{
+#ifdef CONFIG_NVME_DATA_PLANE
+    if (nvme_in_data_plane(n, qid)) {
+        return n->dp_ctx;
+    }
+#endif
+    return qemu_get_aio_context();
+}
+
+/* Queue entries, PRP lists and shadow doorbells are accessed through the
+ * thread-safe HostMem cache while the data plane runs, since the data plane
+ * thread does not hold the global mutex.
+ */
+static int nvme_addr_read(NvmeCtrl *n, hwaddr addr, void *buf, int size)
+{
+#ifdef CONFIG_NVME_DATA_PLANE
+    if (n->dp_started) {
+        void *p = hostmem_lookup(&n->dp_hostmem, addr, size, false);
+
+        if (!p) {
+            return -1;
+        }
+        memcpy(buf, p, size);
+        return 0;
+    }
+#endif
+    pci_dma_read(&n->parent_obj, addr, buf, size);
+    return 0;
+}
+
+static int nvme_addr_write(NvmeCtrl *n, hwaddr addr, void *buf, int size)
+{
+#ifdef CONFIG_NVME_DATA_PLANE
+    if (n->dp_started) {
+        void *p = hostmem_lookup(&n->dp_hostmem, addr, size, true);
+
+        if (!p) {
+            return -1;
+        }
+        memcpy(p, buf, size);
+        return 0;
+    }
+#endif
+    pci_dma_write(&n->parent_obj, addr, buf, size);
+    return 0;
+}
+
 static int nvme_check_sqid(NvmeCtrl *n, uint16_t sqid)
 {
     return sqid < n->num_queues && n->sq[sqid] != NULL ? 0 : -1;
@@ -63,15 +132,132 @@ static uint8_t nvme_sq_empty(NvmeSQueue *sq)
     return sq->head == sq->tail;
 }
 
+static void nvme_irq_raise(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    if (msix_enabled(&(n->parent_obj))) {
+        msix_notify(&(n->parent_obj), cq->vector);
+    } else {
+        pci_irq_pulse(&n->parent_obj);
+    }
+}
+
+#ifdef CONFIG_NVME_DATA_PLANE
+/* Interrupts of data plane queues are delivered by the main loop */
+static void nvme_irq_notifier_read(EventNotifier *e)
+{
+    NvmeCQueue *cq = container_of(e, NvmeCQueue, irq_notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_irq_raise(cq->ctrl, cq);
+    }
+}
+#endif
+
 static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
 {
     if (cq->irq_enabled) {
-        if (msix_enabled(&(n->parent_obj))) {
-            msix_notify(&(n->parent_obj), cq->vector);
-        } else {
-            pci_irq_pulse(&n->parent_obj);
+#ifdef CONFIG_NVME_DATA_PLANE
+        if (nvme_in_data_plane(n, cq->cqid)) {
+            event_notifier_set(&cq->irq_notifier);
+            return;
+        }
+#endif
+        nvme_irq_raise(n, cq);
+    }
+}
+
+/* Interrupt coalescing applies to I/O queues whose vector does not opt out */
+static bool nvme_cq_coalescing(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    return cq->cqid && NVME_INTC_THR(n->features.int_coalescing) &&
+        !NVME_INTVC_CD(n->features.int_vector_config[cq->vector]);
+}
+
+static bool nvme_cq_idle(NvmeCQueue *cq)
+{
+    NvmeSQueue *sq;
+
+    QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
+        if (!QTAILQ_EMPTY(&sq->out_req_list)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Interrupt after the aggregation threshold is exceeded or the aggregation
+ * time has passed.  Don't hold back entries when nothing else is in flight,
+ * no further completion would come to flush them.
+ */
+static void nvme_cq_notify(NvmeCtrl *n, NvmeCQueue *cq, uint32_t posted)
+{
+    uint32_t intc = n->features.int_coalescing;
+
+    if (nvme_cq_coalescing(n, cq)) {
+        cq->intc_pending += posted;
+        if (cq->intc_pending <= NVME_INTC_THR(intc) && !nvme_cq_idle(cq)) {
+            if (NVME_INTC_TIME(intc) && !timer_pending(cq->intc_timer)) {
+                timer_mod(cq->intc_timer,
+                          qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                          NVME_INTC_TIME(intc) * 100 * SCALE_US);
+            }
+            return;
         }
     }
+    cq->intc_pending = 0;
+    timer_del(cq->intc_timer);
+    nvme_isr_notify(n, cq);
+}
+
+static void nvme_intc_timer_cb(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    cq->intc_pending = 0;
+    nvme_isr_notify(cq->ctrl, cq);
+}
+
+/* Shadow doorbells: the guest writes new tail and head values to the
+ * doorbell buffer and only rings the MMIO doorbell once the value passes the
+ * event index.  The event index is updated after the queue was looked at, so
+ * the guest asks again as soon as there is something new.
+ */
+static void nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    uint32_t tail;
+
+    if (sq->db_addr &&
+        !nvme_addr_read(sq->ctrl, sq->db_addr, &tail, sizeof(tail))) {
+        tail = le32_to_cpu(tail);
+        if (tail < sq->size) {
+            sq->tail = tail;
+        }
+    }
+}
+
+static void nvme_update_sq_eventidx(NvmeSQueue *sq)
+{
+    uint32_t ei = cpu_to_le32(sq->tail);
+
+    if (sq->ei_addr) {
+        nvme_addr_write(sq->ctrl, sq->ei_addr, &ei, sizeof(ei));
+        smp_mb();
+    }
+}
+
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    uint32_t head;
+
+    if (cq->db_addr &&
+        !nvme_addr_read(cq->ctrl, cq->db_addr, &head, sizeof(head))) {
+        head = le32_to_cpu(head);
+        if (head < cq->size) {
+            cq->head = head;
+        }
+        head = cpu_to_le32(cq->head);
+        nvme_addr_write(cq->ctrl, cq->ei_addr, &head, sizeof(head));
+    }
 }
 
 static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
@@ -99,7 +285,9 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
 
             nents = (len + n->page_size - 1) >> n->page_bits;
             prp_trans = MIN(n->max_prp_ents, nents) * sizeof(uint64_t);
-            pci_dma_read(&n->parent_obj, prp2, (void *)prp_list, prp_trans);
+            if (nvme_addr_read(n, prp2, (void *)prp_list, prp_trans)) {
+                goto unmap;
+            }
             while (len != 0) {
                 uint64_t prp_ent = le64_to_cpu(prp_list[i]);
 
@@ -111,8 +299,10 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
                     i = 0;
                     nents = (len + n->page_size - 1) >> n->page_bits;
                     prp_trans = MIN(n->max_prp_ents, nents) * sizeof(uint64_t);
-                    pci_dma_read(&n->parent_obj, prp_ent, (void *)prp_list,
-                        prp_trans);
+                    if (nvme_addr_read(n, prp_ent, (void *)prp_list,
+                            prp_trans)) {
+                        goto unmap;
+                    }
                     prp_ent = le64_to_cpu(prp_list[i]);
                 }
 
@@ -159,7 +349,9 @@ static void nvme_post_cqes(void *opaque)
     NvmeCQueue *cq = opaque;
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
+    uint32_t posted = 0;
 
+    nvme_update_cq_head(cq);
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
         NvmeSQueue *sq;
         hwaddr addr;
@@ -175,11 +367,18 @@ static void nvme_post_cqes(void *opaque)
         req->cqe.sq_head = cpu_to_le16(sq->head);
         addr = cq->dma_addr + cq->tail * n->cqe_size;
         nvme_inc_cq_tail(cq);
-        pci_dma_write(&n->parent_obj, addr, (void *)&req->cqe,
-            sizeof(req->cqe));
+        nvme_addr_write(n, addr, (void *)&req->cqe, sizeof(req->cqe));
+
+        /* The SQ may have stopped for lack of free requests */
+        if (QTAILQ_EMPTY(&sq->req_list)) {
+            qemu_bh_schedule(sq->bh);
+        }
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+        posted++;
+    }
+    if (posted) {
+        nvme_cq_notify(n, cq, posted);
     }
-    nvme_isr_notify(n, cq);
 }
 
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
@@ -187,7 +386,7 @@ static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
     assert(cq->cqid == req->sq->cqid);
     QTAILQ_REMOVE(&req->sq->out_req_list, req, entry);
     QTAILQ_INSERT_TAIL(&cq->req_list, req, entry);
-    timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    qemu_bh_schedule(cq->bh);
 }
 
 static void nvme_rw_cb(void *opaque, int ret)
@@ -204,10 +403,37 @@ static void nvme_rw_cb(void *opaque, int ret)
         req->status = NVME_INTERNAL_DEV_ERROR;
     }
 
+    if (nvme_in_data_plane(n, sq->sqid)) {
+        qemu_iovec_destroy(&req->iov);
+    }
     qemu_sglist_destroy(&req->qsg);
     nvme_enqueue_req_completion(cq, req);
 }
 
+#ifdef CONFIG_NVME_DATA_PLANE
+/* The data plane cannot use the dma helpers, their bounce buffer and map
+ * client handling belongs to the main loop.  Guest RAM is mapped directly.
+ */
+static int nvme_map_iov(NvmeCtrl *n, NvmeRequest *req, bool is_write)
+{
+    int i;
+
+    qemu_iovec_init(&req->iov, req->qsg.nsg);
+    for (i = 0; i < req->qsg.nsg; i++) {
+        ScatterGatherEntry *sg = &req->qsg.sg[i];
+        void *p = hostmem_lookup(&n->dp_hostmem, sg->base, sg->len,
+                                 !is_write);
+
+        if (!p) {
+            qemu_iovec_destroy(&req->iov);
+            return -1;
+        }
+        qemu_iovec_add(&req->iov, p, sg->len);
+    }
+    return 0;
+}
+#endif
+
 static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     NvmeRequest *req)
 {
@@ -231,6 +457,25 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     }
     assert((nlb << data_shift) == req->qsg.size);
 
+#ifdef CONFIG_NVME_DATA_PLANE
+    if (nvme_in_data_plane(n, req->sq->sqid)) {
+        int nb_sectors = data_size >> BDRV_SECTOR_BITS;
+
+        if (nvme_map_iov(n, req, is_write)) {
+            qemu_sglist_destroy(&req->qsg);
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        dma_acct_start(n->conf.bs, &req->acct, &req->qsg, is_write ?
+            BDRV_ACCT_WRITE : BDRV_ACCT_READ);
+        req->aiocb = is_write ?
+            bdrv_aio_writev(n->conf.bs, aio_slba, &req->iov, nb_sectors,
+                            nvme_rw_cb, req) :
+            bdrv_aio_readv(n->conf.bs, aio_slba, &req->iov, nb_sectors,
+                           nvme_rw_cb, req);
+        return NVME_NO_COMPLETE;
+    }
+#endif
+
     dma_acct_start(n->conf.bs, &req->acct, &req->qsg, is_write ?
         BDRV_ACCT_WRITE : BDRV_ACCT_READ);
     req->aiocb = is_write ?
@@ -261,11 +506,81 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     }
 }
 
+#ifdef CONFIG_NVME_DATA_PLANE
+static void nvme_sq_set_ioeventfd(NvmeCtrl *n, NvmeSQueue *sq, bool assign)
+{
+    hwaddr addr = 0x1000 + (sq->sqid << 3);
+
+    if (assign == sq->ioeventfd) {
+        return;
+    }
+    if (assign) {
+        memory_region_add_eventfd(&n->iomem, addr, 4, false, 0,
+                                  &sq->notifier);
+    } else {
+        memory_region_del_eventfd(&n->iomem, addr, 4, false, 0,
+                                  &sq->notifier);
+    }
+    sq->ioeventfd = assign;
+}
+
+static void nvme_sq_notifier_read(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    event_notifier_test_and_clear(e);
+    nvme_process_sq(sq);
+}
+
+/* Busy-wait callback: look at the shadow doorbell without waiting for a kick */
+static bool nvme_sq_notifier_poll(void *opaque)
+{
+    NvmeSQueue *sq = container_of(opaque, NvmeSQueue, notifier);
+
+    nvme_update_sq_tail(sq);
+    if (nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list)) {
+        return false;
+    }
+    nvme_process_sq(sq);
+    return true;
+}
+#endif
+
+static void nvme_sq_set_dbbuf(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    nvme_update_sq_eventidx(sq);
+#ifdef CONFIG_NVME_DATA_PLANE
+    /* The tail comes from the shadow doorbell now, so the MMIO doorbell
+     * write can go straight to the data plane without a userspace exit.
+     */
+    if (nvme_in_data_plane(n, sq->sqid)) {
+        nvme_sq_set_ioeventfd(n, sq, true);
+    }
+#endif
+}
+
+static void nvme_cq_set_dbbuf(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    uint32_t ei = cpu_to_le32(cq->head);
+
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + (1 << 2);
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + (1 << 2);
+    nvme_addr_write(n, cq->ei_addr, &ei, sizeof(ei));
+}
+
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
     n->sq[sq->sqid] = NULL;
-    timer_del(sq->timer);
-    timer_free(sq->timer);
+#ifdef CONFIG_NVME_DATA_PLANE
+    if (nvme_in_data_plane(n, sq->sqid)) {
+        nvme_sq_set_ioeventfd(n, sq, false);
+        aio_set_event_notifier(n->dp_ctx, &sq->notifier, NULL);
+        event_notifier_cleanup(&sq->notifier);
+    }
+#endif
+    qemu_bh_delete(sq->bh);
     g_free(sq->io_req);
     if (sq->sqid) {
         g_free(sq);
@@ -319,6 +634,7 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     sq->size = size;
     sq->cqid = cqid;
     sq->head = sq->tail = 0;
+    sq->db_addr = sq->ei_addr = 0;
     sq->io_req = g_malloc(sq->size * sizeof(*sq->io_req));
 
     QTAILQ_INIT(&sq->req_list);
@@ -327,12 +643,25 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         sq->io_req[i].sq = sq;
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    sq->bh = aio_bh_new(nvme_queue_context(n, sqid), nvme_process_sq, sq);
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
+
+#ifdef CONFIG_NVME_DATA_PLANE
+    if (nvme_in_data_plane(n, sqid)) {
+        event_notifier_init(&sq->notifier, 0);
+        aio_set_event_notifier(n->dp_ctx, &sq->notifier,
+                               nvme_sq_notifier_read);
+        aio_set_event_notifier_poll(n->dp_ctx, &sq->notifier,
+                                    nvme_sq_notifier_poll);
+    }
+#endif
+    if (sqid && n->dbbuf_dbs) {
+        nvme_sq_set_dbbuf(n, sq);
+    }
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -369,8 +698,15 @@ static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
     n->cq[cq->cqid] = NULL;
-    timer_del(cq->timer);
-    timer_free(cq->timer);
+    qemu_bh_delete(cq->bh);
+    timer_del(cq->intc_timer);
+    timer_free(cq->intc_timer);
+#ifdef CONFIG_NVME_DATA_PLANE
+    if (nvme_in_data_plane(n, cq->cqid)) {
+        event_notifier_set_handler(&cq->irq_notifier, NULL);
+        event_notifier_cleanup(&cq->irq_notifier);
+    }
+#endif
     msix_vector_unuse(&n->parent_obj, cq->vector);
     if (cq->cqid) {
         g_free(cq);
@@ -406,11 +742,26 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     cq->irq_enabled = irq_enabled;
     cq->vector = vector;
     cq->head = cq->tail = 0;
+    cq->db_addr = cq->ei_addr = 0;
+    cq->intc_pending = 0;
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
     n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    cq->bh = aio_bh_new(nvme_queue_context(n, cqid), nvme_post_cqes, cq);
+    cq->intc_timer = aio_timer_new(nvme_queue_context(n, cqid),
+                                   QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                   nvme_intc_timer_cb, cq);
+
+#ifdef CONFIG_NVME_DATA_PLANE
+    if (nvme_in_data_plane(n, cqid)) {
+        event_notifier_init(&cq->irq_notifier, 0);
+        event_notifier_set_handler(&cq->irq_notifier, nvme_irq_notifier_read);
+    }
+#endif
+    if (cqid && n->dbbuf_dbs) {
+        nvme_cq_set_dbbuf(n, cq);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -432,7 +783,7 @@ static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
     if (!prp1) {
         return NVME_INVALID_FIELD | NVME_DNR;
     }
-    if (vector > n->num_queues) {
+    if (vector >= n->num_queues) {
         return NVME_INVALID_IRQ_VECTOR | NVME_DNR;
     }
     if (!(NVME_CQ_FLAGS_PC(qflags))) {
@@ -470,11 +821,23 @@ static uint16_t nvme_identify(NvmeCtrl *n, NvmeCmd *cmd)
 static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
+    uint32_t iv;
 
     switch (dw10) {
     case NVME_NUMBER_OF_QUEUES:
         req->cqe.result = cpu_to_le32(n->num_queues);
         break;
+    case NVME_INTERRUPT_COALESCING:
+        req->cqe.result = cpu_to_le32(n->features.int_coalescing);
+        break;
+    case NVME_INTERRUPT_VECTOR_CONF:
+        iv = NVME_INTVC_IV(dw11);
+        if (iv >= n->num_queues) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        req->cqe.result = cpu_to_le32(n->features.int_vector_config[iv]);
+        break;
     default:
         return NVME_INVALID_FIELD | NVME_DNR;
     }
@@ -484,18 +847,66 @@ static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
+    uint32_t iv;
 
     switch (dw10) {
     case NVME_NUMBER_OF_QUEUES:
         req->cqe.result = cpu_to_le32(n->num_queues);
         break;
+    case NVME_INTERRUPT_COALESCING:
+        n->features.int_coalescing = dw11 & 0xffff;
+        break;
+    case NVME_INTERRUPT_VECTOR_CONF:
+        iv = NVME_INTVC_IV(dw11);
+        if (iv >= n->num_queues) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        n->features.int_vector_config[iv] = dw11 & 0x1ffff;
+        break;
     default:
         return NVME_INVALID_FIELD | NVME_DNR;
     }
     return NVME_SUCCESS;
 }
 
-static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+static void nvme_reset_features(NvmeCtrl *n)
+{
+    int i;
+
+    n->features.int_coalescing = 0;
+    for (i = 0; i < n->num_queues; i++) {
+        n->features.int_vector_config[i] = i;
+    }
+}
+
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    /* Both buffers are a single page */
+    if (!dbs_addr || dbs_addr & (n->page_size - 1) ||
+        !eis_addr || eis_addr & (n->page_size - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    /* The admin queue keeps using the MMIO doorbells */
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    for (i = 1; i < n->num_queues; i++) {
+        if (n->sq[i]) {
+            nvme_sq_set_dbbuf(n, n->sq[i]);
+        }
+        if (n->cq[i]) {
+            nvme_cq_set_dbbuf(n, n->cq[i]);
+        }
+    }
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_do_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     switch (cmd->opcode) {
     case NVME_ADM_CMD_DELETE_SQ:
@@ -512,11 +923,29 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DB_BUFFER_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
 }
 
+static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+#ifdef CONFIG_NVME_DATA_PLANE
+    uint16_t status;
+
+    /* Keep the data plane thread away while I/O queues change */
+    if (n->dp_started) {
+        aio_context_acquire(n->dp_ctx);
+        status = nvme_do_admin_cmd(n, cmd, req);
+        aio_context_release(n->dp_ctx);
+        return status;
+    }
+#endif
+    return nvme_do_admin_cmd(n, cmd, req);
+}
+
 static void nvme_process_sq(void *opaque)
 {
     NvmeSQueue *sq = opaque;
@@ -528,9 +957,18 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
+#ifdef CONFIG_NVME_DATA_PLANE
+    if (sq->sqid && n->dp_stopping) {
+        return;
+    }
+#endif
+
+    nvme_update_sq_tail(sq);
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * n->sqe_size;
-        pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
+        if (nvme_addr_read(n, addr, (void *)&cmd, sizeof(cmd))) {
+            break;
+        }
         nvme_inc_sq_head(sq);
 
         req = QTAILQ_FIRST(&sq->req_list);
@@ -545,23 +983,133 @@ static void nvme_process_sq(void *opaque)
             req->status = status;
             nvme_enqueue_req_completion(cq, req);
         }
+
+        /* Ask for a doorbell write once the queue looks empty, then look
+         * again in case the guest added entries before it saw the event
+         * index.
+         */
+        if (nvme_sq_empty(sq) && sq->ei_addr) {
+            nvme_update_sq_eventidx(sq);
+            nvme_update_sq_tail(sq);
+        }
     }
 }
 
-static void nvme_clear_ctrl(NvmeCtrl *n)
+static void nvme_free_queues(NvmeCtrl *n, int first)
 {
     int i;
 
-    for (i = 0; i < n->num_queues; i++) {
+    for (i = first; i < n->num_queues; i++) {
         if (n->sq[i] != NULL) {
             nvme_free_sq(n->sq[i], n);
         }
     }
-    for (i = 0; i < n->num_queues; i++) {
+    for (i = first; i < n->num_queues; i++) {
         if (n->cq[i] != NULL) {
             nvme_free_cq(n->cq[i], n);
         }
     }
+}
+
+#ifdef CONFIG_NVME_DATA_PLANE
+static void *nvme_data_plane_thread(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+
+    rcu_register_thread();
+
+    /* aio_poll() returns false when the main loop wants the AioContext, so
+     * the lock is dropped for it right away.
+     */
+    while (!n->dp_stopping) {
+        aio_context_acquire(n->dp_ctx);
+        while (!n->dp_stopping && aio_poll(n->dp_ctx, true)) {
+            /* Progress was made, keep going */
+        }
+        aio_context_release(n->dp_ctx);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void nvme_data_plane_start_bh(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+
+    qemu_bh_delete(n->dp_start_bh);
+    n->dp_start_bh = NULL;
+    qemu_thread_create(&n->dp_thread, nvme_data_plane_thread,
+                       n, QEMU_THREAD_JOINABLE);
+}
+
+/* Called when the controller is enabled, before any I/O queue exists */
+static void nvme_data_plane_start(NvmeCtrl *n)
+{
+    if (!n->data_plane || n->dp_started) {
+        return;
+    }
+
+    n->dp_ctx = aio_context_new();
+    aio_context_set_poll_params(n->dp_ctx, n->poll_max_ns, n->poll_grow,
+                                n->poll_shrink);
+    hostmem_init(&n->dp_hostmem);
+
+    /* From now on the drive is only touched from the data plane thread, or
+     * by whoever holds dp_ctx.
+     */
+    bdrv_set_aio_context(n->conf.bs, n->dp_ctx);
+    n->dp_started = true;
+
+    /* Spawn thread in BH so it inherits iothread cpusets */
+    n->dp_start_bh = qemu_bh_new(nvme_data_plane_start_bh, n);
+    qemu_bh_schedule(n->dp_start_bh);
+}
+
+static void nvme_data_plane_stop(NvmeCtrl *n)
+{
+    if (!n->dp_started) {
+        return;
+    }
+
+    aio_context_acquire(n->dp_ctx);
+
+    /* No new commands from the guest, complete the ones in flight and hand
+     * the drive back to the main loop.
+     */
+    n->dp_stopping = true;
+    bdrv_set_aio_context(n->conf.bs, qemu_get_aio_context());
+
+    /* The I/O queues' handlers live in dp_ctx */
+    nvme_free_queues(n, 1);
+
+    aio_context_release(n->dp_ctx);
+
+    /* Stop thread or cancel pending thread creation BH */
+    if (n->dp_start_bh) {
+        qemu_bh_delete(n->dp_start_bh);
+        n->dp_start_bh = NULL;
+    } else {
+        aio_notify(n->dp_ctx);
+        qemu_thread_join(&n->dp_thread);
+    }
+
+    aio_context_unref(n->dp_ctx);
+    n->dp_ctx = NULL;
+    hostmem_finalize(&n->dp_hostmem);
+    n->dp_started = false;
+    n->dp_stopping = false;
+}
+#endif
+
+static void nvme_clear_ctrl(NvmeCtrl *n)
+{
+#ifdef CONFIG_NVME_DATA_PLANE
+    nvme_data_plane_stop(n);
+#endif
+    nvme_free_queues(n, 0);
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
+    nvme_reset_features(n);
 
     bdrv_flush(n->conf.bs);
     n->bar.cc = 0;
@@ -594,6 +1142,9 @@ static int nvme_start_ctrl(NvmeCtrl *n)
         NVME_AQA_ACQS(n->bar.aqa) + 1, 1);
     nvme_init_sq(&n->admin_sq, n, n->bar.asq, 0, 0,
         NVME_AQA_ASQS(n->bar.aqa) + 1);
+#ifdef CONFIG_NVME_DATA_PLANE
+    nvme_data_plane_start(n);
+#endif
 
     return 0;
 }
@@ -686,19 +1237,29 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
             return;
         }
 
+#ifdef CONFIG_NVME_DATA_PLANE
+        if (nvme_in_data_plane(n, qid)) {
+            aio_context_acquire(n->dp_ctx);
+        }
+#endif
         start_sqs = nvme_cq_full(cq) ? 1 : 0;
         cq->head = new_head;
         if (start_sqs) {
             NvmeSQueue *sq;
             QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
-                timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+                qemu_bh_schedule(sq->bh);
             }
-            timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+            qemu_bh_schedule(cq->bh);
         }
 
         if (cq->tail != cq->head) {
             nvme_isr_notify(n, cq);
         }
+#ifdef CONFIG_NVME_DATA_PLANE
+        if (nvme_in_data_plane(n, qid)) {
+            aio_context_release(n->dp_ctx);
+        }
+#endif
     } else {
         uint16_t new_tail = val & 0xffff;
         NvmeSQueue *sq;
@@ -714,7 +1275,7 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         }
 
         sq->tail = new_tail;
-        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        qemu_bh_schedule(sq->bh);
     }
 }
 
@@ -762,6 +1323,25 @@ static int nvme_init(PCIDevice *pci_dev)
         return -1;
     }
 
+#ifdef CONFIG_NVME_DATA_PLANE
+    if (n->data_plane) {
+        if (bdrv_in_use(n->conf.bs)) {
+            error_report("nvme: cannot use x-data-plane while the drive is "
+                         "in use");
+            return -1;
+        }
+        if (!bdrv_can_set_aio_context(n->conf.bs)) {
+            error_report("nvme: drive is incompatible with x-data-plane, "
+                         "its protocol cannot be moved to another "
+                         "AioContext");
+            return -1;
+        }
+
+        /* Prevent block operations that conflict with data plane thread */
+        bdrv_set_in_use(n->conf.bs, 1);
+    }
+#endif
+
     pci_conf = pci_dev->config;
     pci_conf[PCI_INTERRUPT_PIN] = 1;
     pci_config_set_prog_interface(pci_dev->config, 0x2);
@@ -776,6 +1356,9 @@ static int nvme_init(PCIDevice *pci_dev)
     n->namespaces = g_malloc0(sizeof(*n->namespaces)*n->num_namespaces);
     n->sq = g_malloc0(sizeof(*n->sq)*n->num_queues);
     n->cq = g_malloc0(sizeof(*n->cq)*n->num_queues);
+    n->features.int_vector_config = g_malloc0(
+        sizeof(*n->features.int_vector_config) * n->num_queues);
+    nvme_reset_features(n);
 
     memory_region_init_io(&n->iomem, OBJECT(n), &nvme_mmio_ops, n,
                           "nvme", n->reg_size);
@@ -783,6 +1366,7 @@ static int nvme_init(PCIDevice *pci_dev)
         PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64,
         &n->iomem);
     msix_init_exclusive_bar(&n->parent_obj, n->num_queues, 4);
+    msi_irqfd_enable(&n->parent_obj, n->num_queues);
 
     id->vid = cpu_to_le16(pci_get_word(pci_conf + PCI_VENDOR_ID));
     id->ssvid = cpu_to_le16(pci_get_word(pci_conf + PCI_SUBSYSTEM_VENDOR_ID));
@@ -793,7 +1377,7 @@ static int nvme_init(PCIDevice *pci_dev)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
@@ -838,6 +1422,12 @@ static void nvme_exit(PCIDevice *pci_dev)
     g_free(n->namespaces);
     g_free(n->cq);
     g_free(n->sq);
+    g_free(n->features.int_vector_config);
+#ifdef CONFIG_NVME_DATA_PLANE
+    if (n->data_plane) {
+        bdrv_set_in_use(n->conf.bs, 0);
+    }
+#endif
     msix_uninit_exclusive_bar(pci_dev);
     memory_region_destroy(&n->iomem);
 }
@@ -845,6 +1435,12 @@ static void nvme_exit(PCIDevice *pci_dev)
 static Property nvme_props[] = {
     DEFINE_BLOCK_PROPERTIES(NvmeCtrl, conf),
     DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
+#ifdef CONFIG_NVME_DATA_PLANE
+    DEFINE_PROP_BIT("x-data-plane", NvmeCtrl, data_plane, 0, false),
+    DEFINE_PROP_UINT32("x-poll-max-ns", NvmeCtrl, poll_max_ns, 0),
+    DEFINE_PROP_UINT32("x-poll-grow", NvmeCtrl, poll_grow, 0),
+    DEFINE_PROP_UINT32("x-poll-shrink", NvmeCtrl, poll_shrink, 0),
+#endif
     DEFINE_PROP_END_OF_LIST(),
 };
 
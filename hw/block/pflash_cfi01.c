@@ -42,6 +42,9 @@
 #include "qemu/timer.h"
 #include "exec/address-spaces.h"
 #include "qemu/host-utils.h"
+#include "qemu/bitmap.h"
+#include "qemu/error-report.h"
+#include "sysemu/sysemu.h"
 #include "hw/sysbus.h"
 
 #define PFLASH_BUG(fmt, ...) \
@@ -89,6 +92,18 @@ struct pflash_t {
     MemoryRegion mem;
     char *name;
     void *storage;
+
+    /* Programmed and erased sectors are written back to the drive
+     * writeback_ms after the first change, one run of dirty sectors at a
+     * time, and synchronously when the VM stops or the drive is closed.
+     */
+    uint32_t writeback_ms;
+    unsigned long *dirty;
+    int64_t nb_sectors;
+    QEMUTimer *writeback_timer;
+    bool writeback_busy;
+    QEMUIOVector writeback_qiov;
+    Notifier close_notifier;
 };
 
 static const VMStateDescription vmstate_pflash = {
@@ -225,6 +240,83 @@ static uint32_t pflash_read (pflash_t *pfl, hwaddr offset,
 }
 
 /* update flash content on disk */
+static void pflash_writeback(pflash_t *pfl);
+
+static void pflash_writeback_cb(void *opaque, int ret)
+{
+    pflash_t *pfl = opaque;
+
+    pfl->writeback_busy = false;
+    if (ret < 0) {
+        error_report("%s: flash write-back failed: %s", pfl->name,
+                     strerror(-ret));
+    }
+    /* Sectors changed while the write was in flight */
+    pflash_writeback(pfl);
+}
+
+/* Start writing the first run of dirty sectors */
+static void pflash_writeback(pflash_t *pfl)
+{
+    int64_t first, end;
+
+    first = find_first_bit(pfl->dirty, pfl->nb_sectors);
+    if (pfl->writeback_busy || first >= pfl->nb_sectors) {
+        return;
+    }
+    end = find_next_zero_bit(pfl->dirty, pfl->nb_sectors, first);
+    bitmap_clear(pfl->dirty, first, end - first);
+
+    qemu_iovec_reset(&pfl->writeback_qiov);
+    qemu_iovec_add(&pfl->writeback_qiov, pfl->storage + (first << 9),
+                   (end - first) << 9);
+    pfl->writeback_busy = true;
+    bdrv_aio_writev(pfl->bs, first, &pfl->writeback_qiov, end - first,
+                    pflash_writeback_cb, pfl);
+}
+
+static void pflash_writeback_timer(void *opaque)
+{
+    pflash_writeback(opaque);
+}
+
+/* Wait for the write-back in flight and write the rest synchronously */
+static void pflash_writeback_sync(pflash_t *pfl)
+{
+    int64_t first, end;
+
+    timer_del(pfl->writeback_timer);
+    if (pfl->writeback_busy) {
+        bdrv_drain_all();
+    }
+    while ((first = find_first_bit(pfl->dirty, pfl->nb_sectors)) <
+           pfl->nb_sectors) {
+        end = find_next_zero_bit(pfl->dirty, pfl->nb_sectors, first);
+        bitmap_clear(pfl->dirty, first, end - first);
+        if (bdrv_write(pfl->bs, first, pfl->storage + (first << 9),
+                       end - first) < 0) {
+            error_report("%s: flash write-back failed", pfl->name);
+        }
+    }
+}
+
+static void pflash_vm_state_change(void *opaque, int running, RunState state)
+{
+    pflash_t *pfl = opaque;
+
+    if (!running) {
+        pflash_writeback_sync(pfl);
+    }
+}
+
+static void pflash_close_notify(Notifier *notifier, void *data)
+{
+    pflash_t *pfl = container_of(notifier, pflash_t, close_notifier);
+
+    pflash_writeback_sync(pfl);
+    bdrv_flush(pfl->bs);
+}
+
 static void pflash_update(pflash_t *pfl, int offset,
                           int size)
 {
@@ -234,8 +326,17 @@ static void pflash_update(pflash_t *pfl, int offset,
         /* round to sectors */
         offset = offset >> 9;
         offset_end = (offset_end + 511) >> 9;
-        bdrv_write(pfl->bs, offset, pfl->storage + (offset << 9),
-                   offset_end - offset);
+        if (!pfl->writeback_ms) {
+            bdrv_write(pfl->bs, offset, pfl->storage + (offset << 9),
+                       offset_end - offset);
+            return;
+        }
+        bitmap_set(pfl->dirty, offset, offset_end - offset);
+        if (!pfl->writeback_busy && !timer_pending(pfl->writeback_timer)) {
+            timer_mod(pfl->writeback_timer,
+                      qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                      pfl->writeback_ms);
+        }
     }
 }
 
@@ -613,6 +714,19 @@ static void pflash_cfi01_realize(DeviceState *dev, Error **errp)
         pfl->ro = 0;
     }
 
+    if (pfl->bs && !pfl->ro && pfl->writeback_ms) {
+        pfl->nb_sectors = DIV_ROUND_UP(total_len, 512);
+        pfl->dirty = bitmap_new(pfl->nb_sectors);
+        qemu_iovec_init(&pfl->writeback_qiov, 1);
+        pfl->writeback_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                            pflash_writeback_timer, pfl);
+        qemu_add_vm_change_state_handler(pflash_vm_state_change, pfl);
+        pfl->close_notifier.notify = pflash_close_notify;
+        bdrv_add_close_notifier(pfl->bs, &pfl->close_notifier);
+    } else {
+        pfl->writeback_ms = 0;
+    }
+
     pfl->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, pflash_timer, pfl);
     pfl->wcycle = 0;
     pfl->cmd = 0;
@@ -713,6 +827,7 @@ static Property pflash_cfi01_properties[] = {
     DEFINE_PROP_UINT16("id2", struct pflash_t, ident2, 0),
     DEFINE_PROP_UINT16("id3", struct pflash_t, ident3, 0),
     DEFINE_PROP_STRING("name", struct pflash_t, name),
+    DEFINE_PROP_UINT32("x-writeback-ms", struct pflash_t, writeback_ms, 100),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -16,6 +16,16 @@ struct blkif_common_response {
 	char dummy;
 };
 
+/* Indirect requests, for Xen headers that predate them.  The segments
+ * are in up to BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST granted pages, as
+ * arrays of struct blkif_request_segment padded to 8 bytes.  */
+#ifndef BLKIF_OP_INDIRECT
+#define BLKIF_OP_INDIRECT 6
+#define BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST 8
+#endif
+#define BLKIF_SEGS_PER_INDIRECT_FRAME \
+	(XC_PAGE_SIZE / sizeof(struct blkif_request_segment))
+
 /* i386 protocol version */
 #pragma pack(push, 4)
 struct blkif_x86_32_request {
@@ -31,7 +41,17 @@ struct blkif_x86_32_response {
 	uint8_t         operation;       /* copied from request */
 	int16_t         status;          /* BLKIF_RSP_???       */
 };
+struct blkif_x86_32_request_indirect {
+	uint8_t        operation;    /* BLKIF_OP_INDIRECT                    */
+	uint8_t        indirect_op;  /* BLKIF_OP_{READ,WRITE}                */
+	uint16_t       nr_segments;  /* number of segments                   */
+	uint64_t       id;           /* private guest value, echoed in resp  */
+	blkif_sector_t sector_number;/* start sector idx on disk             */
+	blkif_vdev_t   handle;       /* same as for read/write requests      */
+	grant_ref_t    indirect_grefs[BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST];
+};
 typedef struct blkif_x86_32_request blkif_x86_32_request_t;
+typedef struct blkif_x86_32_request_indirect blkif_x86_32_request_indirect_t;
 typedef struct blkif_x86_32_response blkif_x86_32_response_t;
 #pragma pack(pop)
 
@@ -49,7 +69,17 @@ struct blkif_x86_64_response {
 	uint8_t         operation;       /* copied from request */
 	int16_t         status;          /* BLKIF_RSP_???       */
 };
+struct blkif_x86_64_request_indirect {
+	uint8_t        operation;    /* BLKIF_OP_INDIRECT                    */
+	uint8_t        indirect_op;  /* BLKIF_OP_{READ,WRITE}                */
+	uint16_t       nr_segments;  /* number of segments                   */
+	uint64_t       __attribute__((__aligned__(8))) id;
+	blkif_sector_t sector_number;/* start sector idx on disk             */
+	blkif_vdev_t   handle;       /* same as for read/write requests      */
+	grant_ref_t    indirect_grefs[BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST];
+};
 typedef struct blkif_x86_64_request blkif_x86_64_request_t;
+typedef struct blkif_x86_64_request_indirect blkif_x86_64_request_indirect_t;
 typedef struct blkif_x86_64_response blkif_x86_64_response_t;
 
 DEFINE_RING_TYPES(blkif_common, struct blkif_common_request, struct blkif_common_response);
@@ -100,4 +130,49 @@ static inline void blkif_get_x86_64_req(blkif_request_t *dst, blkif_x86_64_reque
 		dst->seg[i] = src->seg[i];
 }
 
+/* Indirect requests are returned with the operation they carry; the
+ * segments themselves are read from the indirect pages later.  */
+static inline void blkif_get_x86_32_req_indirect(blkif_request_t *dst,
+	int *nr_segments, grant_ref_t *grefs,
+	blkif_x86_32_request_indirect_t *src)
+{
+	int i;
+
+	dst->operation = src->indirect_op;
+	dst->nr_segments = 0;
+	dst->handle = src->handle;
+	dst->id = src->id;
+	dst->sector_number = src->sector_number;
+	*nr_segments = src->nr_segments;
+	for (i = 0; i < BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST; i++)
+		grefs[i] = src->indirect_grefs[i];
+}
+
+static inline void blkif_get_x86_64_req_indirect(blkif_request_t *dst,
+	int *nr_segments, grant_ref_t *grefs,
+	blkif_x86_64_request_indirect_t *src)
+{
+	int i;
+
+	dst->operation = src->indirect_op;
+	dst->nr_segments = 0;
+	dst->handle = src->handle;
+	dst->id = src->id;
+	dst->sector_number = src->sector_number;
+	*nr_segments = src->nr_segments;
+	for (i = 0; i < BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST; i++)
+		grefs[i] = src->indirect_grefs[i];
+}
+
+/* The native layout is the host's: i386 alignment or natural alignment */
+#if defined(__i386__)
+#define blkif_get_native_req_indirect(dst, nr, grefs, src) \
+	blkif_get_x86_32_req_indirect(dst, nr, grefs, \
+		(blkif_x86_32_request_indirect_t *)(src))
+#else
+#define blkif_get_native_req_indirect(dst, nr, grefs, src) \
+	blkif_get_x86_64_req_indirect(dst, nr, grefs, \
+		(blkif_x86_64_request_indirect_t *)(src))
+#endif
+
 #endif /* __XEN_BLKIF_H__ */
@@ -44,16 +44,27 @@
 
 static int batch_maps   = 0;
 
-static int max_requests = 32;
-
 /* ------------------------------------------------------------- */
 
 #define BLOCK_SIZE  512
 #define IOCB_COUNT  (BLKIF_MAX_SEGMENTS_PER_REQUEST + 2)
 
+/* Largest multi-page ring and indirect request we accept.  Requests in
+ * flight follow the ring size, up to MAX_REQUESTS.  */
+#define MAX_RING_PAGE_ORDER     4
+#define MAX_RING_PAGES          (1 << MAX_RING_PAGE_ORDER)
+#define MAX_INDIRECT_SEGMENTS   64
+#define MAX_SEGMENTS            MAX(MAX_INDIRECT_SEGMENTS, \
+                                    BLKIF_MAX_SEGMENTS_PER_REQUEST)
+#define MAX_REQUESTS            128
+
 struct PersistentGrant {
     void *page;
+    uint32_t ref;
+    /* requests that use the page right now */
+    int users;
     struct XenBlkDev *blkdev;
+    QTAILQ_ENTRY(PersistentGrant) lru;
 };
 
 typedef struct PersistentGrant PersistentGrant;
@@ -62,6 +73,12 @@ struct ioreq {
     blkif_request_t     req;
     int16_t             status;
 
+    /* segments, copied from the request or from its indirect pages */
+    int                 nr_segments;
+    struct blkif_request_segment seg[MAX_SEGMENTS];
+    bool                indirect;
+    grant_ref_t         indirect_grefs[BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST];
+
     /* parsed request */
     off_t               start;
     QEMUIOVector        v;
@@ -70,12 +87,14 @@ struct ioreq {
     uint8_t             mapped;
 
     /* grant mapping */
-    uint32_t            domids[BLKIF_MAX_SEGMENTS_PER_REQUEST];
-    uint32_t            refs[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    uint32_t            domids[MAX_SEGMENTS];
+    uint32_t            refs[MAX_SEGMENTS];
     int                 prot;
-    void                *page[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    void                *page[MAX_SEGMENTS];
     void                *pages;
     int                 num_unmap;
+    PersistentGrant     *grants[MAX_SEGMENTS];
+    int                 num_grants;
 
     /* aio status */
     int                 aio_inflight;
@@ -96,7 +115,8 @@ struct XenBlkDev {
     bool                directiosafe;
     const char          *fileproto;
     const char          *filename;
-    int                 ring_ref;
+    int                 ring_ref[MAX_RING_PAGES];
+    int                 nr_ring_ref;
     void                *sring;
     int64_t             file_blk;
     int64_t             file_size;
@@ -112,10 +132,13 @@ struct XenBlkDev {
     int                 requests_total;
     int                 requests_inflight;
     int                 requests_finished;
+    int                 max_requests;
 
-    /* Persistent grants extension */
+    /* Persistent grants extension.  At most max_grants pages stay
+     * mapped; past that the least recently used unused one is dropped.  */
     gboolean            feature_persistent;
     GTree               *persistent_gnts;
+    QTAILQ_HEAD(, PersistentGrant) persistent_lru;
     unsigned int        persistent_gnt_count;
     unsigned int        max_grants;
 
@@ -131,6 +154,8 @@ static void ioreq_reset(struct ioreq *ioreq)
 {
     memset(&ioreq->req, 0, sizeof(ioreq->req));
     ioreq->status = 0;
+    ioreq->nr_segments = 0;
+    ioreq->indirect = false;
     ioreq->start = 0;
     ioreq->presync = 0;
     ioreq->postsync = 0;
@@ -141,6 +166,8 @@ static void ioreq_reset(struct ioreq *ioreq)
     ioreq->prot = 0;
     memset(ioreq->page, 0, sizeof(ioreq->page));
     ioreq->pages = NULL;
+    ioreq->num_unmap = 0;
+    ioreq->num_grants = 0;
 
     ioreq->aio_inflight = 0;
     ioreq->aio_errors = 0;
@@ -170,24 +197,72 @@ static void destroy_grant(gpointer pgnt)
                       strerror(errno));
     }
     grant->blkdev->persistent_gnt_count--;
+    QTAILQ_REMOVE(&grant->blkdev->persistent_lru, grant, lru);
     xen_be_printf(&grant->blkdev->xendev, 3,
                   "unmapped grant %p\n", grant->page);
     g_free(grant);
 }
 
+static PersistentGrant *persistent_grant_lookup(struct XenBlkDev *blkdev,
+                                                uint32_t ref)
+{
+    PersistentGrant *grant;
+
+    grant = g_tree_lookup(blkdev->persistent_gnts, GUINT_TO_POINTER(ref));
+    if (grant) {
+        QTAILQ_REMOVE(&blkdev->persistent_lru, grant, lru);
+        QTAILQ_INSERT_TAIL(&blkdev->persistent_lru, grant, lru);
+    }
+    return grant;
+}
+
+/* Makes room for one more persistent grant if the cache is full */
+static bool persistent_grant_make_room(struct XenBlkDev *blkdev)
+{
+    PersistentGrant *grant;
+
+    if (blkdev->persistent_gnt_count < blkdev->max_grants) {
+        return true;
+    }
+    QTAILQ_FOREACH(grant, &blkdev->persistent_lru, lru) {
+        if (!grant->users) {
+            g_tree_remove(blkdev->persistent_gnts,
+                          GUINT_TO_POINTER(grant->ref));
+            return true;
+        }
+    }
+    return false;
+}
+
+static PersistentGrant *persistent_grant_add(struct XenBlkDev *blkdev,
+                                             uint32_t ref, void *page)
+{
+    PersistentGrant *grant = g_malloc0(sizeof(*grant));
+
+    grant->page = page;
+    grant->ref = ref;
+    grant->blkdev = blkdev;
+    xen_be_printf(&blkdev->xendev, 3,
+                  "adding grant %" PRIu32 " page: %p\n", ref, page);
+    g_tree_insert(blkdev->persistent_gnts, GUINT_TO_POINTER(ref), grant);
+    QTAILQ_INSERT_TAIL(&blkdev->persistent_lru, grant, lru);
+    blkdev->persistent_gnt_count++;
+    return grant;
+}
+
 static struct ioreq *ioreq_start(struct XenBlkDev *blkdev)
 {
     struct ioreq *ioreq = NULL;
 
     if (QLIST_EMPTY(&blkdev->freelist)) {
-        if (blkdev->requests_total >= max_requests) {
+        if (blkdev->requests_total >= blkdev->max_requests) {
             goto out;
         }
         /* allocate new struct */
         ioreq = g_malloc0(sizeof(*ioreq));
         ioreq->blkdev = blkdev;
         blkdev->requests_total++;
-        qemu_iovec_init(&ioreq->v, BLKIF_MAX_SEGMENTS_PER_REQUEST);
+        qemu_iovec_init(&ioreq->v, MAX_SEGMENTS);
     } else {
         /* get one from freelist */
         ioreq = QLIST_FIRST(&blkdev->freelist);
@@ -225,6 +300,68 @@ static void ioreq_release(struct ioreq *ioreq, bool finish)
     }
 }
 
+/*
+ * Copies the segments of an indirect request out of its indirect pages,
+ * so that the frontend cannot change them after they are checked.  The
+ * pages go to the persistent grant cache like data pages.
+ */
+static int ioreq_read_indirect(struct ioreq *ioreq)
+{
+    struct XenBlkDev *blkdev = ioreq->blkdev;
+    XenGnttab gnt = blkdev->xendev.gnttabdev;
+    PersistentGrant *grant;
+    uint32_t ref;
+    void *page;
+    int i, n, nr_pages;
+
+    if (ioreq->nr_segments > MAX_INDIRECT_SEGMENTS) {
+        xen_be_printf(&blkdev->xendev, 0, "error: nr_segments too big\n");
+        return -1;
+    }
+
+    nr_pages = DIV_ROUND_UP(ioreq->nr_segments, BLKIF_SEGS_PER_INDIRECT_FRAME);
+    for (i = 0; i < nr_pages; i++) {
+        ref = ioreq->indirect_grefs[i];
+        grant = NULL;
+        if (blkdev->feature_persistent) {
+            grant = persistent_grant_lookup(blkdev, ref);
+        }
+        if (grant) {
+            page = grant->page;
+        } else {
+            page = xc_gnttab_map_grant_ref(gnt, blkdev->xendev.dom, ref,
+                                           PROT_READ | PROT_WRITE);
+            if (page == NULL) {
+                xen_be_printf(&blkdev->xendev, 0,
+                              "can't map indirect grant ref %d (%s)\n",
+                              ref, strerror(errno));
+                return -1;
+            }
+            blkdev->cnt_map++;
+        }
+
+        n = MIN(ioreq->nr_segments - i * BLKIF_SEGS_PER_INDIRECT_FRAME,
+                BLKIF_SEGS_PER_INDIRECT_FRAME);
+        memcpy(&ioreq->seg[i * BLKIF_SEGS_PER_INDIRECT_FRAME], page,
+               n * sizeof(struct blkif_request_segment));
+
+        if (grant) {
+            continue;
+        }
+        if (blkdev->feature_persistent && persistent_grant_make_room(blkdev)) {
+            persistent_grant_add(blkdev, ref, page);
+        } else {
+            if (xc_gnttab_munmap(gnt, page, 1) != 0) {
+                xen_be_printf(&blkdev->xendev, 0,
+                              "xc_gnttab_munmap failed: %s\n",
+                              strerror(errno));
+            }
+            blkdev->cnt_map--;
+        }
+    }
+    return 0;
+}
+
 /*
  * translate request into iovec + start offset
  * do sanity checks along the way
@@ -237,16 +374,24 @@ static int ioreq_parse(struct ioreq *ioreq)
     int i;
 
     xen_be_printf(&blkdev->xendev, 3,
-                  "op %d, nr %d, handle %d, id %" PRId64 ", sector %" PRId64 "\n",
-                  ioreq->req.operation, ioreq->req.nr_segments,
+                  "op %d%s, nr %d, handle %d, id %" PRId64 ", sector %" PRId64 "\n",
+                  ioreq->req.operation, ioreq->indirect ? " (indirect)" : "",
+                  ioreq->nr_segments,
                   ioreq->req.handle, ioreq->req.id, ioreq->req.sector_number);
+    if (ioreq->indirect && ioreq->req.operation != BLKIF_OP_READ &&
+        ioreq->req.operation != BLKIF_OP_WRITE) {
+        xen_be_printf(&blkdev->xendev, 0,
+                      "error: unknown indirect operation (%d)\n",
+                      ioreq->req.operation);
+        goto err;
+    }
     switch (ioreq->req.operation) {
     case BLKIF_OP_READ:
         ioreq->prot = PROT_WRITE; /* to memory */
         break;
     case BLKIF_OP_FLUSH_DISKCACHE:
         ioreq->presync = 1;
-        if (!ioreq->req.nr_segments) {
+        if (!ioreq->nr_segments) {
             return 0;
         }
         /* fall through */
@@ -264,26 +409,31 @@ static int ioreq_parse(struct ioreq *ioreq)
         goto err;
     }
 
-    ioreq->start = ioreq->req.sector_number * blkdev->file_blk;
-    for (i = 0; i < ioreq->req.nr_segments; i++) {
-        if (i == BLKIF_MAX_SEGMENTS_PER_REQUEST) {
-            xen_be_printf(&blkdev->xendev, 0, "error: nr_segments too big\n");
+    if (ioreq->indirect) {
+        if (ioreq_read_indirect(ioreq) != 0) {
             goto err;
         }
-        if (ioreq->req.seg[i].first_sect > ioreq->req.seg[i].last_sect) {
+    } else if (ioreq->nr_segments > BLKIF_MAX_SEGMENTS_PER_REQUEST) {
+        xen_be_printf(&blkdev->xendev, 0, "error: nr_segments too big\n");
+        goto err;
+    }
+
+    ioreq->start = ioreq->req.sector_number * blkdev->file_blk;
+    for (i = 0; i < ioreq->nr_segments; i++) {
+        if (ioreq->seg[i].first_sect > ioreq->seg[i].last_sect) {
             xen_be_printf(&blkdev->xendev, 0, "error: first > last sector\n");
             goto err;
         }
-        if (ioreq->req.seg[i].last_sect * BLOCK_SIZE >= XC_PAGE_SIZE) {
+        if (ioreq->seg[i].last_sect * BLOCK_SIZE >= XC_PAGE_SIZE) {
             xen_be_printf(&blkdev->xendev, 0, "error: page crossing\n");
             goto err;
         }
 
         ioreq->domids[i] = blkdev->xendev.dom;
-        ioreq->refs[i]   = ioreq->req.seg[i].gref;
+        ioreq->refs[i]   = ioreq->seg[i].gref;
 
-        mem = ioreq->req.seg[i].first_sect * blkdev->file_blk;
-        len = (ioreq->req.seg[i].last_sect - ioreq->req.seg[i].first_sect + 1) * blkdev->file_blk;
+        mem = ioreq->seg[i].first_sect * blkdev->file_blk;
+        len = (ioreq->seg[i].last_sect - ioreq->seg[i].first_sect + 1) * blkdev->file_blk;
         qemu_iovec_add(&ioreq->v, (void*)mem, len);
     }
     if (ioreq->start + ioreq->v.size > blkdev->file_size) {
@@ -302,7 +452,15 @@ static void ioreq_unmap(struct ioreq *ioreq)
     XenGnttab gnt = ioreq->blkdev->xendev.gnttabdev;
     int i;
 
-    if (ioreq->num_unmap == 0 || ioreq->mapped == 0) {
+    if (ioreq->mapped == 0) {
+        return;
+    }
+    for (i = 0; i < ioreq->num_grants; i++) {
+        ioreq->grants[i]->users--;
+    }
+    ioreq->num_grants = 0;
+    if (ioreq->num_unmap == 0) {
+        ioreq->mapped = 0;
         return;
     }
     if (batch_maps) {
@@ -334,9 +492,9 @@ static void ioreq_unmap(struct ioreq *ioreq)
 static int ioreq_map(struct ioreq *ioreq)
 {
     XenGnttab gnt = ioreq->blkdev->xendev.gnttabdev;
-    uint32_t domids[BLKIF_MAX_SEGMENTS_PER_REQUEST];
-    uint32_t refs[BLKIF_MAX_SEGMENTS_PER_REQUEST];
-    void *page[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    uint32_t domids[MAX_SEGMENTS];
+    uint32_t refs[MAX_SEGMENTS];
+    void *page[MAX_SEGMENTS];
     int i, j, new_maps = 0;
     PersistentGrant *grant;
     /* domids and refs variables will contain the information necessary
@@ -352,10 +510,12 @@ static int ioreq_map(struct ioreq *ioreq)
     }
     if (ioreq->blkdev->feature_persistent) {
         for (i = 0; i < ioreq->v.niov; i++) {
-            grant = g_tree_lookup(ioreq->blkdev->persistent_gnts,
-                                    GUINT_TO_POINTER(ioreq->refs[i]));
+            grant = persistent_grant_lookup(ioreq->blkdev, ioreq->refs[i]);
 
             if (grant != NULL) {
+                /* Keep it from being evicted until the request is done */
+                grant->users++;
+                ioreq->grants[ioreq->num_grants++] = grant;
                 page[i] = grant->page;
                 xen_be_printf(&ioreq->blkdev->xendev, 3,
                               "using persistent-grant %" PRIu32 "\n",
@@ -389,6 +549,9 @@ static int ioreq_map(struct ioreq *ioreq)
             xen_be_printf(&ioreq->blkdev->xendev, 0,
                           "can't map %d grant refs (%s, %d maps)\n",
                           new_maps, strerror(errno), ioreq->blkdev->cnt_map);
+            ioreq->mapped = 1;
+            ioreq->num_unmap = 0;
+            ioreq_unmap(ioreq);
             return -1;
         }
         for (i = 0, j = 0; i < ioreq->v.niov; i++) {
@@ -406,6 +569,7 @@ static int ioreq_map(struct ioreq *ioreq)
                               "can't map grant ref %d (%s, %d maps)\n",
                               refs[i], strerror(errno), ioreq->blkdev->cnt_map);
                 ioreq->mapped = 1;
+                ioreq->num_unmap = i;
                 ioreq_unmap(ioreq);
                 return -1;
             }
@@ -418,30 +582,31 @@ static int ioreq_map(struct ioreq *ioreq)
         }
     }
     if (ioreq->blkdev->feature_persistent) {
-        while ((ioreq->blkdev->persistent_gnt_count < ioreq->blkdev->max_grants)
-              && new_maps) {
+        while (new_maps && persistent_grant_make_room(ioreq->blkdev)) {
             /* Go through the list of newly mapped grants and add as many
-             * as possible to the list of persistently mapped grants.
+             * as possible to the list of persistently mapped grants,
+             * evicting the least recently used ones that are idle.
              *
              * Since we start at the end of ioreq->page(s), we only need
              * to decrease new_maps to prevent this granted pages from
-             * being unmapped in ioreq_unmap.
+             * being unmapped in ioreq_unmap.  A grant that appears twice
+             * in the request stops the walk, the copy in the tree must
+             * not be replaced while in use.
              */
-            grant = g_malloc0(sizeof(*grant));
+            if (g_tree_lookup(ioreq->blkdev->persistent_gnts,
+                              GUINT_TO_POINTER(refs[new_maps - 1]))) {
+                break;
+            }
             new_maps--;
             if (batch_maps) {
-                grant->page = ioreq->pages + (new_maps) * XC_PAGE_SIZE;
+                grant = persistent_grant_add(ioreq->blkdev, refs[new_maps],
+                        ioreq->pages + new_maps * XC_PAGE_SIZE);
             } else {
-                grant->page = ioreq->page[new_maps];
+                grant = persistent_grant_add(ioreq->blkdev, refs[new_maps],
+                                             ioreq->page[new_maps]);
             }
-            grant->blkdev = ioreq->blkdev;
-            xen_be_printf(&ioreq->blkdev->xendev, 3,
-                          "adding grant %" PRIu32 " page: %p\n",
-                          refs[new_maps], grant->page);
-            g_tree_insert(ioreq->blkdev->persistent_gnts,
-                          GUINT_TO_POINTER(refs[new_maps]),
-                          grant);
-            ioreq->blkdev->persistent_gnt_count++;
+            grant->users++;
+            ioreq->grants[ioreq->num_grants++] = grant;
         }
     }
     for (i = 0; i < ioreq->v.niov; i++) {
@@ -491,7 +656,7 @@ static int ioreq_runio_qemu_aio(struct ioreq *ioreq)
 {
     struct XenBlkDev *blkdev = ioreq->blkdev;
 
-    if (ioreq->req.nr_segments && ioreq_map(ioreq) == -1) {
+    if (ioreq->nr_segments && ioreq_map(ioreq) == -1) {
         goto err_no_map;
     }
 
@@ -511,7 +676,7 @@ static int ioreq_runio_qemu_aio(struct ioreq *ioreq)
         break;
     case BLKIF_OP_WRITE:
     case BLKIF_OP_FLUSH_DISKCACHE:
-        if (!ioreq->req.nr_segments) {
+        if (!ioreq->nr_segments) {
             break;
         }
 
@@ -605,20 +770,57 @@ static void blk_send_response_all(struct XenBlkDev *blkdev)
 
 static int blk_get_request(struct XenBlkDev *blkdev, struct ioreq *ioreq, RING_IDX rc)
 {
+    void *src;
+
+    switch (blkdev->protocol) {
+    case BLKIF_PROTOCOL_NATIVE:
+        src = RING_GET_REQUEST(&blkdev->rings.native, rc);
+        break;
+    case BLKIF_PROTOCOL_X86_32:
+        src = RING_GET_REQUEST(&blkdev->rings.x86_32_part, rc);
+        break;
+    case BLKIF_PROTOCOL_X86_64:
+        src = RING_GET_REQUEST(&blkdev->rings.x86_64_part, rc);
+        break;
+    default:
+        return -1;
+    }
+
+    /* The operation is the first byte in every layout */
+    if (*(uint8_t *)src == BLKIF_OP_INDIRECT) {
+        ioreq->indirect = true;
+        switch (blkdev->protocol) {
+        case BLKIF_PROTOCOL_NATIVE:
+            blkif_get_native_req_indirect(&ioreq->req, &ioreq->nr_segments,
+                                          ioreq->indirect_grefs, src);
+            break;
+        case BLKIF_PROTOCOL_X86_32:
+            blkif_get_x86_32_req_indirect(&ioreq->req, &ioreq->nr_segments,
+                                          ioreq->indirect_grefs, src);
+            break;
+        case BLKIF_PROTOCOL_X86_64:
+            blkif_get_x86_64_req_indirect(&ioreq->req, &ioreq->nr_segments,
+                                          ioreq->indirect_grefs, src);
+            break;
+        }
+        return 0;
+    }
+
     switch (blkdev->protocol) {
     case BLKIF_PROTOCOL_NATIVE:
-        memcpy(&ioreq->req, RING_GET_REQUEST(&blkdev->rings.native, rc),
-               sizeof(ioreq->req));
+        memcpy(&ioreq->req, src, sizeof(ioreq->req));
         break;
     case BLKIF_PROTOCOL_X86_32:
-        blkif_get_x86_32_req(&ioreq->req,
-                             RING_GET_REQUEST(&blkdev->rings.x86_32_part, rc));
+        blkif_get_x86_32_req(&ioreq->req, src);
         break;
     case BLKIF_PROTOCOL_X86_64:
-        blkif_get_x86_64_req(&ioreq->req,
-                             RING_GET_REQUEST(&blkdev->rings.x86_64_part, rc));
+        blkif_get_x86_64_req(&ioreq->req, src);
         break;
     }
+    ioreq->nr_segments = ioreq->req.nr_segments;
+    memcpy(ioreq->seg, ioreq->req.seg,
+           MIN(ioreq->nr_segments, BLKIF_MAX_SEGMENTS_PER_REQUEST) *
+           sizeof(ioreq->seg[0]));
     return 0;
 }
 
@@ -659,7 +861,7 @@ static void blk_handle_requests(struct XenBlkDev *blkdev)
         ioreq_runio_qemu_aio(ioreq);
     }
 
-    if (blkdev->more_work && blkdev->requests_inflight < max_requests) {
+    if (blkdev->more_work && blkdev->requests_inflight < blkdev->max_requests) {
         qemu_bh_schedule(blkdev->bh);
     }
 }
@@ -693,7 +895,7 @@ static void blk_alloc(struct XenDevice *xendev)
         batch_maps = 1;
     }
     if (xc_gnttab_set_max_grants(xendev->gnttabdev,
-            MAX_GRANTS(max_requests, BLKIF_MAX_SEGMENTS_PER_REQUEST)) < 0) {
+            MAX_GRANTS(MAX_REQUESTS, MAX_SEGMENTS + 1) + MAX_RING_PAGES) < 0) {
         xen_be_printf(xendev, 0, "xc_gnttab_set_max_grants failed: %s\n",
                       strerror(errno));
     }
@@ -764,6 +966,10 @@ static int blk_init(struct XenDevice *xendev)
      */
     xenstore_write_be_int(&blkdev->xendev, "feature-flush-cache", 1);
     xenstore_write_be_int(&blkdev->xendev, "feature-persistent", 1);
+    xenstore_write_be_int(&blkdev->xendev, "max-ring-page-order",
+                          MAX_RING_PAGE_ORDER);
+    xenstore_write_be_int(&blkdev->xendev, "feature-max-indirect-segments",
+                          MAX_INDIRECT_SEGMENTS);
     xenstore_write_be_int(&blkdev->xendev, "info", info);
 
     g_free(directiosafe);
@@ -788,7 +994,8 @@ out_error:
 static int blk_connect(struct XenDevice *xendev)
 {
     struct XenBlkDev *blkdev = container_of(xendev, struct XenBlkDev, xendev);
-    int pers, index, qflags;
+    uint32_t domids[MAX_RING_PAGES], refs[MAX_RING_PAGES];
+    int pers, index, qflags, order, i;
     bool readonly = true;
 
     /* read-only ? */
@@ -858,8 +1065,32 @@ static int blk_connect(struct XenDevice *xendev)
     xenstore_write_be_int64(&blkdev->xendev, "sectors",
                             blkdev->file_size / blkdev->file_blk);
 
-    if (xenstore_read_fe_int(&blkdev->xendev, "ring-ref", &blkdev->ring_ref) == -1) {
-        return -1;
+    /* A single page ring uses ring-ref, larger ones ring-ref0... */
+    if (xenstore_read_fe_int(&blkdev->xendev, "ring-page-order", &order) == -1) {
+        order = 0;
+    }
+    if (order == 0) {
+        blkdev->nr_ring_ref = 1;
+        if (xenstore_read_fe_int(&blkdev->xendev, "ring-ref",
+                                 &blkdev->ring_ref[0]) == -1) {
+            return -1;
+        }
+    } else {
+        if (order < 0 || order > MAX_RING_PAGE_ORDER) {
+            xen_be_printf(&blkdev->xendev, 0, "bad ring-page-order %d\n",
+                          order);
+            return -1;
+        }
+        blkdev->nr_ring_ref = 1 << order;
+        for (i = 0; i < blkdev->nr_ring_ref; i++) {
+            char node[16];
+
+            snprintf(node, sizeof(node), "ring-ref%d", i);
+            if (xenstore_read_fe_int(&blkdev->xendev, node,
+                                     &blkdev->ring_ref[i]) == -1) {
+                return -1;
+            }
+        }
     }
     if (xenstore_read_fe_int(&blkdev->xendev, "event-channel",
                              &blkdev->xendev.remote_port) == -1) {
@@ -881,52 +1112,65 @@ static int blk_connect(struct XenDevice *xendev)
         }
     }
 
-    blkdev->sring = xc_gnttab_map_grant_ref(blkdev->xendev.gnttabdev,
-                                            blkdev->xendev.dom,
-                                            blkdev->ring_ref,
-                                            PROT_READ | PROT_WRITE);
+    for (i = 0; i < blkdev->nr_ring_ref; i++) {
+        domids[i] = blkdev->xendev.dom;
+        refs[i] = blkdev->ring_ref[i];
+    }
+    blkdev->sring = xc_gnttab_map_grant_refs(blkdev->xendev.gnttabdev,
+                                             blkdev->nr_ring_ref,
+                                             domids, refs,
+                                             PROT_READ | PROT_WRITE);
     if (!blkdev->sring) {
         return -1;
     }
-    blkdev->cnt_map++;
+    blkdev->cnt_map += blkdev->nr_ring_ref;
 
     switch (blkdev->protocol) {
     case BLKIF_PROTOCOL_NATIVE:
     {
         blkif_sring_t *sring_native = blkdev->sring;
-        BACK_RING_INIT(&blkdev->rings.native, sring_native, XC_PAGE_SIZE);
+        BACK_RING_INIT(&blkdev->rings.native, sring_native,
+                       XC_PAGE_SIZE * blkdev->nr_ring_ref);
         break;
     }
     case BLKIF_PROTOCOL_X86_32:
     {
         blkif_x86_32_sring_t *sring_x86_32 = blkdev->sring;
 
-        BACK_RING_INIT(&blkdev->rings.x86_32_part, sring_x86_32, XC_PAGE_SIZE);
+        BACK_RING_INIT(&blkdev->rings.x86_32_part, sring_x86_32,
+                       XC_PAGE_SIZE * blkdev->nr_ring_ref);
         break;
     }
     case BLKIF_PROTOCOL_X86_64:
     {
         blkif_x86_64_sring_t *sring_x86_64 = blkdev->sring;
 
-        BACK_RING_INIT(&blkdev->rings.x86_64_part, sring_x86_64, XC_PAGE_SIZE);
+        BACK_RING_INIT(&blkdev->rings.x86_64_part, sring_x86_64,
+                       XC_PAGE_SIZE * blkdev->nr_ring_ref);
         break;
     }
     }
 
+    /* Serve as many requests at once as the ring holds */
+    blkdev->max_requests = MIN(RING_SIZE(&blkdev->rings.common), MAX_REQUESTS);
+
     if (blkdev->feature_persistent) {
         /* Init persistent grants */
-        blkdev->max_grants = max_requests * BLKIF_MAX_SEGMENTS_PER_REQUEST;
+        blkdev->max_grants = blkdev->max_requests *
+                             BLKIF_MAX_SEGMENTS_PER_REQUEST;
         blkdev->persistent_gnts = g_tree_new_full((GCompareDataFunc)int_cmp,
                                              NULL, NULL,
                                              (GDestroyNotify)destroy_grant);
+        QTAILQ_INIT(&blkdev->persistent_lru);
         blkdev->persistent_gnt_count = 0;
     }
 
     xen_be_bind_evtchn(&blkdev->xendev);
 
     xen_be_printf(&blkdev->xendev, 1, "ok: proto %s, ring-ref %d, "
-                  "remote port %d, local port %d\n",
-                  blkdev->xendev.protocol, blkdev->ring_ref,
+                  "ring pages %d, remote port %d, local port %d\n",
+                  blkdev->xendev.protocol, blkdev->ring_ref[0],
+                  blkdev->nr_ring_ref,
                   blkdev->xendev.remote_port, blkdev->xendev.local_port);
     return 0;
 }
@@ -943,8 +1187,9 @@ static void blk_disconnect(struct XenDevice *xendev)
     xen_be_unbind_evtchn(&blkdev->xendev);
 
     if (blkdev->sring) {
-        xc_gnttab_munmap(blkdev->xendev.gnttabdev, blkdev->sring, 1);
-        blkdev->cnt_map--;
+        xc_gnttab_munmap(blkdev->xendev.gnttabdev, blkdev->sring,
+                         blkdev->nr_ring_ref);
+        blkdev->cnt_map -= blkdev->nr_ring_ref;
         blkdev->sring = NULL;
     }
 }
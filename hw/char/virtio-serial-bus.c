@@ -57,6 +57,9 @@ static bool use_multiport(VirtIOSerial *vser)
     return vdev->guest_features & (1 << VIRTIO_CONSOLE_F_MULTIPORT);
 }
 
+/* Most host data offered to the guest at once, see virtio_serial_guest_ready */
+#define VIRTIO_SERIAL_READ_MAX  (64 * 1024)
+
 static size_t write_to_port(VirtIOSerialPort *port,
                             const uint8_t *buf, size_t size)
 {
@@ -101,6 +104,34 @@ static void discard_vq_data(VirtQueue *vq, VirtIODevice *vdev)
     virtio_notify(vdev, vq);
 }
 
+/* Hand what is left of the current element to the port in one call */
+static void flush_elem_iov(VirtIOSerialPort *port, VirtIOSerialPortClass *vsc)
+{
+    struct iovec *sg = &port->elem.out_sg[port->iov_idx];
+    struct iovec first;
+    ssize_t ret;
+
+    if (port->iov_idx >= port->elem.out_num) {
+        return;
+    }
+    first = *sg;
+    sg->iov_base += port->iov_offset;
+    sg->iov_len -= port->iov_offset;
+    ret = vsc->have_data_iov(port, sg, port->elem.out_num - port->iov_idx);
+    *sg = first;
+
+    if (!port->throttled || ret <= 0) {
+        return;
+    }
+    ret += port->iov_offset;
+    while (port->iov_idx < port->elem.out_num &&
+           ret >= port->elem.out_sg[port->iov_idx].iov_len) {
+        ret -= port->elem.out_sg[port->iov_idx].iov_len;
+        port->iov_idx++;
+    }
+    port->iov_offset = ret;
+}
+
 static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
                                  VirtIODevice *vdev)
 {
@@ -123,6 +154,16 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
             port->iov_offset = 0;
         }
 
+        if (vsc->have_data_iov) {
+            flush_elem_iov(port, vsc);
+            if (port->throttled) {
+                break;
+            }
+            virtqueue_push(vq, &port->elem, 0);
+            port->elem.out_num = 0;
+            continue;
+        }
+
         for (i = port->iov_idx; i < port->elem.out_num; i++) {
             size_t buf_size;
             ssize_t ret;
@@ -250,7 +291,11 @@ size_t virtio_serial_guest_ready(VirtIOSerialPort *port)
     if (use_multiport(port->vser) && !port->guest_connected) {
         return 0;
     }
-    virtqueue_get_avail_bytes(vq, &bytes, NULL, 4096, 0);
+    /* Counting further than this would only slow down the common case;
+     * it is enough for a chardev to read several guest buffers' worth
+     * with one system call and hand them over in one go.
+     */
+    virtqueue_get_avail_bytes(vq, &bytes, NULL, VIRTIO_SERIAL_READ_MAX, 0);
     return bytes;
 }
 
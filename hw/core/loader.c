@@ -53,6 +53,9 @@
 #include "exec/address-spaces.h"
 
 #include <zlib.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 bool rom_file_in_ram = true;
 
@@ -578,6 +581,8 @@ struct Rom {
     size_t datasize;
 
     uint8_t *data;
+    /* data is a private mapping of the file rather than a copy */
+    bool mapped;
     MemoryRegion *mr;
     int isrom;
     char *fw_dir;
@@ -608,6 +613,53 @@ static void rom_insert(Rom *rom)
     QTAILQ_INSERT_TAIL(&roms, rom, next);
 }
 
+static void rom_free_data(Rom *rom)
+{
+#ifndef _WIN32
+    if (rom->mapped) {
+        munmap(rom->data, rom->datasize);
+        rom->mapped = false;
+        rom->data = NULL;
+        return;
+    }
+#endif
+    g_free(rom->data);
+    rom->data = NULL;
+}
+
+/* Reading every option ROM and firmware image up front is a measurable
+ * part of startup, and keeps a second copy of each image in memory.  Map
+ * the file instead: pages are read when something first touches them,
+ * and fw_cfg files the guest never asks for are never read at all.  The
+ * mapping is private, so rom_ptr() users can still patch the image.
+ */
+static int rom_read_file(Rom *rom, int fd)
+{
+    int rc;
+
+#ifndef _WIN32
+    if (rom->datasize) {
+        void *data = mmap(NULL, rom->datasize, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            rom->data = data;
+            rom->mapped = true;
+            return 0;
+        }
+    }
+#endif
+
+    rom->data = g_malloc0(rom->datasize);
+    lseek(fd, 0, SEEK_SET);
+    rc = read(fd, rom->data, rom->datasize);
+    if (rc != rom->datasize) {
+        fprintf(stderr, "rom: file %-20s: read error: rc=%d (expected %zd)\n",
+                rom->name, rc, rom->datasize);
+        return -1;
+    }
+    return 0;
+}
+
 static void *rom_set_mr(Rom *rom, Object *owner, const char *name)
 {
     void *data;
@@ -627,7 +679,7 @@ int rom_add_file(const char *file, const char *fw_dir,
                  hwaddr addr, int32_t bootindex)
 {
     Rom *rom;
-    int rc, fd = -1;
+    int fd = -1;
     char devpath[100];
 
     rom = g_malloc0(sizeof(*rom));
@@ -651,12 +703,7 @@ int rom_add_file(const char *file, const char *fw_dir,
     rom->addr     = addr;
     rom->romsize  = lseek(fd, 0, SEEK_END);
     rom->datasize = rom->romsize;
-    rom->data     = g_malloc0(rom->datasize);
-    lseek(fd, 0, SEEK_SET);
-    rc = read(fd, rom->data, rom->datasize);
-    if (rc != rom->datasize) {
-        fprintf(stderr, "rom: file %-20s: read error: rc=%d (expected %zd)\n",
-                rom->name, rc, rom->datasize);
+    if (rom_read_file(rom, fd) < 0) {
         goto err;
     }
     close(fd);
@@ -693,7 +740,7 @@ int rom_add_file(const char *file, const char *fw_dir,
 err:
     if (fd != -1)
         close(fd);
-    g_free(rom->data);
+    rom_free_data(rom);
     g_free(rom->path);
     g_free(rom->name);
     g_free(rom);
@@ -782,8 +829,7 @@ static void rom_reset(void *unused)
         }
         if (rom->isrom) {
             /* rom needs to be written only once */
-            g_free(rom->data);
-            rom->data = NULL;
+            rom_free_data(rom);
         }
     }
 }
@@ -309,6 +309,7 @@ static void cirrus_bitblt_fill_nop(CirrusVGAState *s,
 
 #define ROP_NAME src
 #define ROP_FN(d, s) s
+#define ROP_COPY
 #include "cirrus_vga_rop.h"
 
 #define ROP_NAME 1
@@ -58,6 +58,16 @@ glue(cirrus_bitblt_rop_fwd_, ROP_NAME)(CirrusVGAState *s,
     }
 
     for (y = 0; y < bltheight; y++) {
+#ifdef ROP_COPY
+        /* Unless the destination line starts inside the source line,
+           copying forwards a byte at a time is what memmove does.  */
+        if (dst <= src || dst >= src + bltwidth) {
+            memmove(dst, src, bltwidth);
+            dst += bltwidth + dstpitch;
+            src += bltwidth + srcpitch;
+            continue;
+        }
+#endif
         for (x = 0; x < bltwidth; x++) {
             ROP_OP(dst, *src);
             dst++;
@@ -78,6 +88,16 @@ glue(cirrus_bitblt_rop_bkwd_, ROP_NAME)(CirrusVGAState *s,
     dstpitch += bltwidth;
     srcpitch += bltwidth;
     for (y = 0; y < bltheight; y++) {
+#ifdef ROP_COPY
+        /* Likewise backwards, unless the destination line ends inside
+           the source line.  */
+        if (dst >= src || dst <= src - bltwidth) {
+            memmove(dst - bltwidth + 1, src - bltwidth + 1, bltwidth);
+            dst += dstpitch - bltwidth;
+            src += srcpitch - bltwidth;
+            continue;
+        }
+#endif
         for (x = 0; x < bltwidth; x++) {
             ROP_OP(dst, *src);
             dst--;
@@ -203,6 +223,7 @@ glue(glue(cirrus_bitblt_rop_bkwd_transp_, ROP_NAME),_16)(CirrusVGAState *s,
 #include "cirrus_vga_rop2.h"
 
 #undef ROP_NAME
+#undef ROP_COPY
 #undef ROP_OP
 #undef ROP_OP_16
 #undef ROP_OP_32
@@ -263,11 +263,24 @@ glue(glue(glue(cirrus_fill_, ROP_NAME), _),DEPTH)
     uint8_t *d, *d1;
     uint32_t col;
     int x, y;
+#ifdef ROP_COPY
+    /* bytes written per line, the last pixel may go past width */
+    int line_bytes = (width + (DEPTH / 8) - 1) / (DEPTH / 8) * (DEPTH / 8);
+#endif
 
     col = s->cirrus_blt_fgcol;
 
     d1 = dst;
     for(y = 0; y < height; y++) {
+#ifdef ROP_COPY
+        /* The result does not depend on the destination, so once the
+           first line is drawn the others are copies of it.  */
+        if (y > 0 && dst_pitch >= line_bytes) {
+            memcpy(d1, dst, line_bytes);
+            d1 += dst_pitch;
+            continue;
+        }
+#endif
         d = d1;
         for(x = 0; x < width; x += (DEPTH / 8)) {
             PUTPIXEL();
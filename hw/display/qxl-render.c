@@ -22,16 +22,17 @@
 #include "qxl.h"
 #include "trace.h"
 
-static void qxl_blit(PCIQXLDevice *qxl, QXLRect *rect)
+static void qxl_blit(PCIQXLDevice *qxl, DisplaySurface *surface,
+                     QXLRect *rect)
 {
-    DisplaySurface *surface = qemu_console_surface(qxl->vga.con);
-    uint8_t *dst = surface_data(surface);
+    uint8_t *dst;
     uint8_t *src;
     int len, i;
 
-    if (is_buffer_shared(surface)) {
+    if (!surface || is_buffer_shared(surface)) {
         return;
     }
+    dst = surface_data(surface);
     trace_qxl_render_blit(qxl->guest_primary.qxl_stride,
             rect->left, rect->right, rect->top, rect->bottom);
     src = qxl->guest_primary.data;
@@ -109,6 +110,7 @@ static void qxl_render_update_area_unlocked(PCIQXLDevice *qxl)
         }
         qxl_set_rect_to_surface(qxl, &qxl->dirty[0]);
         qxl->num_dirty_rects = 1;
+        qxl->num_blitted_rects = 0;
         trace_qxl_render_guest_primary_resized(
                qxl->guest_primary.surface.width,
                qxl->guest_primary.surface.height,
@@ -129,6 +131,7 @@ static void qxl_render_update_area_unlocked(PCIQXLDevice *qxl)
                  qxl->guest_primary.surface.height);
         }
         dpy_gfx_replace_surface(vga->con, surface);
+        qxl->render_surface = is_buffer_shared(surface) ? NULL : surface;
     }
 
     if (!qxl->guest_primary.data) {
@@ -138,13 +141,72 @@ static void qxl_render_update_area_unlocked(PCIQXLDevice *qxl)
         if (qemu_spice_rect_is_empty(qxl->dirty+i)) {
             break;
         }
-        qxl_blit(qxl, qxl->dirty+i);
+        /* Rectangles are usually blitted by the spice server thread */
+        if (i >= qxl->num_blitted_rects) {
+            qxl_blit(qxl, qxl->render_surface, qxl->dirty+i);
+        }
         dpy_gfx_update(vga->con,
                        qxl->dirty[i].left, qxl->dirty[i].top,
                        qxl->dirty[i].right - qxl->dirty[i].left,
                        qxl->dirty[i].bottom - qxl->dirty[i].top);
     }
+    qxl->stats[QXL_STAT_RENDER_RECTS] += i;
     qxl->num_dirty_rects = 0;
+    qxl->num_blitted_rects = 0;
+}
+
+static void qxl_rect_union(QXLRect *dst, const QXLRect *src)
+{
+    dst->left   = MIN(dst->left, src->left);
+    dst->top    = MIN(dst->top, src->top);
+    dst->right  = MAX(dst->right, src->right);
+    dst->bottom = MAX(dst->bottom, src->bottom);
+}
+
+/*
+ * Called from the spice server thread with ssd.lock held, when an
+ * update_area request completed.  The rectangles are copied to the local
+ * surface right away, so that the bottom half in the main loop only has to
+ * tell the display listeners about them.  When more rectangles arrive than
+ * fit in qxl->dirty, the last slot grows to cover the extra ones instead
+ * of forcing a full redraw.
+ */
+void qxl_render_add_dirty_rects(PCIQXLDevice *qxl, QXLRect *rects, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (qemu_spice_rect_is_empty(&rects[i])) {
+            continue;
+        }
+        if (qxl->num_dirty_rects < QXL_NUM_DIRTY_RECTS) {
+            qxl->dirty[qxl->num_dirty_rects++] = rects[i];
+        } else {
+            qxl_rect_union(&qxl->dirty[QXL_NUM_DIRTY_RECTS - 1], &rects[i]);
+            qxl->num_blitted_rects = MIN(qxl->num_blitted_rects,
+                                         QXL_NUM_DIRTY_RECTS - 1);
+        }
+    }
+
+    if (!qxl->guest_primary.data) {
+        return;
+    }
+    for (i = qxl->num_blitted_rects; i < qxl->num_dirty_rects; i++) {
+        qxl_blit(qxl, qxl->render_surface, qxl->dirty+i);
+    }
+    qxl->num_blitted_rects = qxl->num_dirty_rects;
+}
+
+/*
+ * Called in the main loop before the console surface is taken over by
+ * someone else, so that the spice server thread stops blitting into it.
+ */
+void qxl_render_drop_surface(PCIQXLDevice *qxl)
+{
+    qemu_mutex_lock(&qxl->ssd.lock);
+    qxl->render_surface = NULL;
+    qxl->num_blitted_rects = 0;
+    qemu_mutex_unlock(&qxl->ssd.lock);
 }
 
 /*
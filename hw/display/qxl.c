@@ -24,6 +24,7 @@
 #include "qemu/timer.h"
 #include "qemu/queue.h"
 #include "qemu/atomic.h"
+#include "qapi/visitor.h"
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
 #include "trace.h"
@@ -628,6 +629,11 @@ static int interface_get_command(QXLInstance *sin, struct QXLCommandExt *ext)
             qxl_send_events(qxl, QXL_INTERRUPT_DISPLAY);
         }
         qxl->guest_primary.commands++;
+        if (le32_to_cpu(ext->cmd.type) == QXL_CMD_SURFACE) {
+            qxl->stats[QXL_STAT_SURFACE]++;
+        } else {
+            qxl->stats[QXL_STAT_DRAW]++;
+        }
         qxl_track_command(qxl, ext);
         qxl_log_command(qxl, "cmd", ext);
         trace_qxl_ring_command_get(qxl->id, qxl_mode_to_string(qxl->mode));
@@ -773,6 +779,7 @@ static int interface_get_cursor_command(QXLInstance *sin, struct QXLCommandExt *
             qxl_send_events(qxl, QXL_INTERRUPT_CURSOR);
         }
         qxl->guest_primary.commands++;
+        qxl->stats[QXL_STAT_CURSOR]++;
         qxl_track_command(qxl, ext);
         qxl_log_command(qxl, "csr", ext);
         if (qxl->id == 0) {
@@ -882,10 +889,9 @@ static void interface_update_area_complete(QXLInstance *sin,
         QXLRect *dirty, uint32_t num_updated_rects)
 {
     PCIQXLDevice *qxl = container_of(sin, PCIQXLDevice, ssd.qxl);
-    int i;
-    int qxl_i;
 
     qemu_mutex_lock(&qxl->ssd.lock);
+    qxl->stats[QXL_STAT_UPDATE_AREA]++;
     if (surface_id != 0 || !qxl->render_update_cookie_num) {
         qemu_mutex_unlock(&qxl->ssd.lock);
         return;
@@ -894,12 +900,9 @@ static void interface_update_area_complete(QXLInstance *sin,
             dirty->right, dirty->top, dirty->bottom);
     trace_qxl_interface_update_area_complete_rest(qxl->id, num_updated_rects);
     if (qxl->num_dirty_rects + num_updated_rects > QXL_NUM_DIRTY_RECTS) {
-        /*
-         * overflow - treat this as a full update. Not expected to be common.
-         */
+        /* overflow - the extra rectangles are merged into the last one */
         trace_qxl_interface_update_area_complete_overflow(qxl->id,
                                                           QXL_NUM_DIRTY_RECTS);
-        qxl->guest_primary.resized = 1;
     }
     if (qxl->guest_primary.resized) {
         /*
@@ -909,11 +912,7 @@ static void interface_update_area_complete(QXLInstance *sin,
         qemu_mutex_unlock(&qxl->ssd.lock);
         return;
     }
-    qxl_i = qxl->num_dirty_rects;
-    for (i = 0; i < num_updated_rects; i++) {
-        qxl->dirty[qxl_i++] = dirty[i];
-    }
-    qxl->num_dirty_rects += num_updated_rects;
+    qxl_render_add_dirty_rects(qxl, dirty, num_updated_rects);
     trace_qxl_interface_update_area_complete_schedule_bh(qxl->id,
                                                          qxl->num_dirty_rects);
     qemu_bh_schedule(qxl->update_area_bh);
@@ -1077,6 +1076,7 @@ static void qxl_enter_vga_mode(PCIQXLDevice *d)
         return;
     }
     trace_qxl_enter_vga_mode(d->id);
+    qxl_render_drop_surface(d);
 #if SPICE_SERVER_VERSION >= 0x000c03 /* release 0.12.3 */
     spice_qxl_driver_unload(&d->ssd.qxl);
 #endif
@@ -1923,6 +1923,37 @@ static void qxl_init_ramsize(PCIQXLDevice *qxl)
     qxl->vram_size = msb_mask(qxl->vram_size * 2 - 1);
 }
 
+static void qxl_get_stat(Object *obj, Visitor *v, void *opaque,
+                         const char *name, Error **errp)
+{
+    uint64_t value = *(uint64_t *)opaque;
+
+    visit_type_uint64(v, &value, name, errp);
+}
+
+static const char *const qxl_stat_names[QXL_STAT_MAX] = {
+    [QXL_STAT_DRAW]         = "commands-draw",
+    [QXL_STAT_SURFACE]      = "commands-surface",
+    [QXL_STAT_CURSOR]       = "commands-cursor",
+    [QXL_STAT_UPDATE_AREA]  = "update-area-completions",
+    [QXL_STAT_RENDER_RECTS] = "render-rects",
+};
+
+/*
+ * The counters are updated by the spice server thread and read without a
+ * lock; an occasional torn value is acceptable for statistics.
+ */
+static void qxl_add_stat_properties(PCIQXLDevice *qxl)
+{
+    int i;
+
+    for (i = 0; i < QXL_STAT_MAX; i++) {
+        object_property_add(OBJECT(qxl), qxl_stat_names[i], "uint64",
+                            qxl_get_stat, NULL, NULL,
+                            &qxl->stats[i], NULL);
+    }
+}
+
 static int qxl_init_common(PCIQXLDevice *qxl)
 {
     uint8_t* config = qxl->pci.config;
@@ -2032,6 +2063,8 @@ static int qxl_init_common(PCIQXLDevice *qxl)
 
     qxl->update_area_bh = qemu_bh_new(qxl_render_update_area_bh, qxl);
 
+    qxl_add_stat_properties(qxl);
+
     return 0;
 }
 
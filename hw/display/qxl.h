@@ -30,6 +30,15 @@ enum qxl_mode {
 #define QXL_PAGE_BITS 12
 #define QXL_PAGE_SIZE (1 << QXL_PAGE_BITS);
 
+enum {
+    QXL_STAT_DRAW,              /* drawing and update commands */
+    QXL_STAT_SURFACE,           /* surface create and destroy commands */
+    QXL_STAT_CURSOR,            /* cursor ring commands */
+    QXL_STAT_UPDATE_AREA,       /* update_area requests from the guest */
+    QXL_STAT_RENDER_RECTS,      /* dirty rectangles rendered locally */
+    QXL_STAT_MAX,
+};
+
 typedef struct PCIQXLDevice {
     PCIDevice          pci;
     SimpleSpiceDisplay ssd;
@@ -117,8 +126,17 @@ typedef struct PCIQXLDevice {
     /* qxl_render_update state */
     int                render_update_cookie_num;
     int                num_dirty_rects;
+    int                num_blitted_rects;
     QXLRect            dirty[QXL_NUM_DIRTY_RECTS];
     QEMUBH            *update_area_bh;
+    /* Flipped copy of the guest primary that the spice server thread blits
+     * into, NULL when the console uses guest memory directly.  Protected
+     * by ssd.lock.
+     */
+    DisplaySurface    *render_surface;
+
+    /* Statistics, exported as read-only properties */
+    uint64_t           stats[QXL_STAT_MAX];
 } PCIQXLDevice;
 
 #define PANIC_ON(x) if ((x)) {                         \
@@ -163,5 +181,7 @@ void qxl_render_update(PCIQXLDevice *qxl);
 int qxl_render_cursor(PCIQXLDevice *qxl, QXLCommandExt *ext);
 void qxl_render_update_area_done(PCIQXLDevice *qxl, QXLCookie *cookie);
 void qxl_render_update_area_bh(void *opaque);
+void qxl_render_add_dirty_rects(PCIQXLDevice *qxl, QXLRect *rects, int n);
+void qxl_render_drop_surface(PCIQXLDevice *qxl);
 
 #endif
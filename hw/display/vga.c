@@ -1847,6 +1847,9 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
                                   page_min,
                                   page_max - page_min,
                                   DIRTY_MEMORY_VGA);
+        s->idle_refreshes = 0;
+    } else {
+        s->idle_refreshes++;
     }
     memset(s->invalidated_y_table, 0, ((height + 31) >> 5) * 4);
 }
@@ -1883,6 +1886,15 @@ static void vga_draw_blank(VGACommonState *s, int full_update)
 #define GMODE_GRAPH    1
 #define GMODE_BLANK 2
 
+/*
+ * After VGA_IDLE_REFRESHES graphic refreshes without any change, only every
+ * VGA_IDLE_SKIP-th refresh looks at the dirty bitmap.  The bitmap keeps
+ * accumulating meanwhile, so nothing is lost; the first change after an
+ * idle period is just shown up to VGA_IDLE_SKIP refresh intervals late.
+ */
+#define VGA_IDLE_REFRESHES 16
+#define VGA_IDLE_SKIP       4
+
 static void vga_update_display(void *opaque)
 {
     VGACommonState *s = opaque;
@@ -1903,8 +1915,14 @@ static void vga_update_display(void *opaque)
         if (graphic_mode != s->graphic_mode) {
             s->graphic_mode = graphic_mode;
             s->cursor_blink_time = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
+            s->idle_refreshes = 0;
             full_update = 1;
         }
+        if (graphic_mode == GMODE_GRAPH &&
+            s->idle_refreshes >= VGA_IDLE_REFRESHES &&
+            s->idle_refreshes++ % VGA_IDLE_SKIP) {
+            return;
+        }
         switch(graphic_mode) {
         case GMODE_TEXT:
             vga_draw_text(s, full_update);
@@ -1927,6 +1945,29 @@ static void vga_invalidate_display(void *opaque)
 
     s->last_width = -1;
     s->last_height = -1;
+    s->idle_refreshes = 0;
+}
+
+/*
+ * With KVM, dirty logging write-protects VRAM and every refresh syncs the
+ * bitmap from the kernel.  When the displays only refresh at the idle rate,
+ * nobody is looking at the screen (e.g. a VNC server without clients), so
+ * stop logging and redraw everything once they come back.
+ */
+static void vga_update_interval(void *opaque, uint64_t interval)
+{
+    VGACommonState *s = opaque;
+
+    if (interval >= GUI_REFRESH_INTERVAL_IDLE) {
+        if (!s->dirty_log_paused) {
+            vga_dirty_log_stop(s);
+            s->dirty_log_paused = true;
+        }
+    } else if (s->dirty_log_paused) {
+        vga_dirty_log_start(s);
+        s->dirty_log_paused = false;
+        vga_invalidate_display(s);
+    }
 }
 
 void vga_common_reset(VGACommonState *s)
@@ -2250,6 +2291,7 @@ static const GraphicHwOps vga_ops = {
     .invalidate  = vga_invalidate_display,
     .gfx_update  = vga_update_display,
     .text_update = vga_update_text,
+    .update_interval = vga_update_interval,
 };
 
 void vga_common_init(VGACommonState *s, Object *obj)
@@ -155,6 +155,10 @@ typedef struct VGACommonState {
     const GraphicHwOps *hw_ops;
     bool full_update_text;
     bool full_update_gfx;
+    /* graphic refreshes in a row that found nothing to draw */
+    unsigned int idle_refreshes;
+    /* dirty logging is off while no display is interested */
+    bool dirty_log_paused;
     /* hardware mouse cursor support */
     uint32_t invalidated_y_table[VGA_MAX_HEIGHT / 32];
     void (*cursor_invalidate)(struct VGACommonState *s);
@@ -39,6 +39,7 @@
 
 /* Supported chipsets: */
 #include "hw/acpi/piix4.h"
+#include "hw/acpi/memory_hotplug.h"
 #include "hw/i386/ich9.h"
 #include "hw/pci/pci_bus.h"
 #include "hw/pci-host/q35.h"
@@ -646,6 +647,302 @@ build_append_notify(GArray *device, const char *name,
     build_free_array(method);
 }
 
+static void build_extop_package(GArray *package, uint8_t op)
+{
+    build_package(package, op, 1);
+    build_prepend_byte(package, 0x5B); /* ExtOpPrefix */
+}
+
+static void
+build_append_method(GArray *scope, const char *name, uint8_t flags,
+                    GArray *body)
+{
+    GArray *method = build_alloc_array();
+    uint8_t op = 0x14; /* MethodOp */
+
+    build_append_nameseg(method, "%s", name);
+    build_append_byte(method, flags); /* MethodFlags */
+    build_append_array(method, body);
+    build_package(method, op, 2);
+
+    build_append_array(scope, method);
+    build_free_array(method);
+}
+
+/* If (LEqual(<field>, One)) { <body> } */
+static void build_append_if_set(GArray *method, const char *field,
+                                GArray *body)
+{
+    GArray *ifop = build_alloc_array();
+    uint8_t op = 0xA0; /* IfOp */
+
+    build_append_byte(ifop, 0x93); /* LEqualOp */
+    build_append_nameseg(ifop, "%s", field);
+    build_append_byte(ifop, 0x01); /* OneOp */
+    build_append_array(ifop, body);
+    build_package(ifop, op, 1);
+
+    build_append_array(method, ifop);
+    build_free_array(ifop);
+}
+
+/* Acquire(MLCK, 0xFFFF) */
+static void build_memhp_acquire(GArray *method)
+{
+    build_append_byte(method, 0x5B); /* ExtOpPrefix */
+    build_append_byte(method, 0x23); /* AcquireOp */
+    build_append_nameseg(method, "MLCK");
+    build_append_byte(method, 0xFF); /* Timeout */
+    build_append_byte(method, 0xFF);
+}
+
+/* Acquire(MLCK, 0xFFFF), Store(Arg0, MSEL) */
+static void build_memhp_select(GArray *method)
+{
+    build_memhp_acquire(method);
+    build_append_byte(method, 0x70); /* StoreOp */
+    build_append_byte(method, 0x68); /* Arg0Op */
+    build_append_nameseg(method, "MSEL");
+}
+
+/* Release(MLCK) */
+static void build_memhp_release(GArray *method)
+{
+    build_append_byte(method, 0x5B); /* ExtOpPrefix */
+    build_append_byte(method, 0x27); /* ReleaseOp */
+    build_append_nameseg(method, "MLCK");
+}
+
+/* QWordMemory(ResourceProducer, PosDecode, MinFixed, MaxFixed, Cacheable,
+ *             ReadWrite, 0, 0, 0, 0, 0) with an EndTag, patched by MCRS
+ */
+static const uint8_t memhp_crs[48] = {
+    0x8A, 0x2B, 0x00, 0x00, 0x0C, 0x03, [46] = 0x79, 0x00,
+};
+
+/* Address, length, proximity and status of the DIMMs, through the ACPI
+ * registers of docs/specs/acpi_mem_hotplug.txt, and Device(MPxx) for each
+ * slot.  The GPE handler of the DSDT calls MHPS.
+ */
+static void build_memory_hotplug(GArray *sb_scope, int slots)
+{
+    static const struct {
+        const char *name;
+        uint8_t bits;
+    } fields[] = {
+        { "MSEL", 32 }, { "MRBL", 32 }, { "MRBH", 32 }, { "MRLL", 32 },
+        { "MRLH", 32 }, { "MREL", 32 }, { "MREH", 32 }, { "MPRX", 32 },
+        { "MENA", 1 }, { "MINS", 1 }, { "MRMV", 1 }, { "MEJT", 1 },
+    };
+    static const struct {
+        const char *name;
+        uint8_t offset;
+        const char *reg;
+    } crs_fields[] = {
+        { "MINL", 14, "MRBL" }, { "MINH", 18, "MRBH" },
+        { "MAXL", 22, "MREL" }, { "MAXH", 26, "MREH" },
+        { "LENL", 38, "MRLL" }, { "LENH", 42, "MRLH" },
+    };
+    GArray *field, *method, *body, *loop, *dev;
+    int i;
+
+    if (!slots) {
+        /* Method(MHPS, 0) {} */
+        method = build_alloc_array();
+        build_append_method(sb_scope, "MHPS", 0x00, method);
+        build_free_array(method);
+        return;
+    }
+
+    /* OperationRegion(MHPR, SystemIO, 0x0a00, 0x24) */
+    build_append_byte(sb_scope, 0x5B); /* ExtOpPrefix */
+    build_append_byte(sb_scope, 0x80); /* OpRegionOp */
+    build_append_nameseg(sb_scope, "MHPR");
+    build_append_byte(sb_scope, 0x01); /* SystemIO */
+    build_append_value(sb_scope, ACPI_MEMORY_HOTPLUG_BASE, 2);
+    build_append_value(sb_scope, ACPI_MEMORY_HOTPLUG_IO_LEN, 1);
+
+    /* Field(MHPR, DWordAcc, NoLock, WriteAsZeros) { MSEL, 32, ... } */
+    field = build_alloc_array();
+    build_append_nameseg(field, "MHPR");
+    build_append_byte(field, 0x43); /* FieldFlags */
+    for (i = 0; i < ARRAY_SIZE(fields); i++) {
+        build_append_nameseg(field, "%s", fields[i].name);
+        build_append_byte(field, fields[i].bits); /* PkgLength */
+    }
+    build_extop_package(field, 0x81); /* FieldOp */
+    build_append_array(sb_scope, field);
+    build_free_array(field);
+
+    /* Mutex(MLCK, 0) */
+    build_append_byte(sb_scope, 0x5B); /* ExtOpPrefix */
+    build_append_byte(sb_scope, 0x01); /* MutexOp */
+    build_append_nameseg(sb_scope, "MLCK");
+    build_append_byte(sb_scope, 0x00); /* SyncFlags */
+
+    /* Method(MSTA, 1) { Return 0xF if the slot is enabled, else Zero } */
+    method = build_alloc_array();
+    build_append_byte(method, 0x70); /* StoreOp */
+    build_append_byte(method, 0x00); /* ZeroOp */
+    build_append_byte(method, 0x60); /* Local0Op */
+    build_memhp_select(method);
+    body = build_alloc_array();
+    build_append_byte(body, 0x70); /* StoreOp */
+    build_append_value(body, 0x0F, 1);
+    build_append_byte(body, 0x60); /* Local0Op */
+    build_append_if_set(method, "MENA", body);
+    build_free_array(body);
+    build_memhp_release(method);
+    build_append_byte(method, 0xA4); /* ReturnOp */
+    build_append_byte(method, 0x60); /* Local0Op */
+    build_append_method(sb_scope, "MSTA", 0x01, method);
+    build_free_array(method);
+
+    /* Method(MCRS, 1, Serialized) { Return the range of the slot } */
+    method = build_alloc_array();
+    build_memhp_select(method);
+    build_append_byte(method, 0x08); /* NameOp */
+    build_append_nameseg(method, "MR64");
+    body = build_alloc_array();
+    build_append_value(body, sizeof(memhp_crs), 1); /* BufferSize */
+    g_array_append_vals(body, memhp_crs, sizeof(memhp_crs));
+    build_package(body, 0x11, 1); /* BufferOp */
+    build_append_array(method, body);
+    build_free_array(body);
+    for (i = 0; i < ARRAY_SIZE(crs_fields); i++) {
+        build_append_byte(method, 0x8A); /* CreateDWordFieldOp */
+        build_append_nameseg(method, "MR64");
+        build_append_value(method, crs_fields[i].offset, 1);
+        build_append_nameseg(method, "%s", crs_fields[i].name);
+    }
+    for (i = 0; i < ARRAY_SIZE(crs_fields); i++) {
+        build_append_byte(method, 0x70); /* StoreOp */
+        build_append_nameseg(method, "%s", crs_fields[i].reg);
+        build_append_nameseg(method, "%s", crs_fields[i].name);
+    }
+    build_memhp_release(method);
+    build_append_byte(method, 0xA4); /* ReturnOp */
+    build_append_nameseg(method, "MR64");
+    build_append_method(sb_scope, "MCRS", 0x09, method);
+    build_free_array(method);
+
+    /* Method(MPXM, 1) { Return the proximity domain of the slot } */
+    method = build_alloc_array();
+    build_memhp_select(method);
+    build_append_byte(method, 0x70); /* StoreOp */
+    build_append_nameseg(method, "MPRX");
+    build_append_byte(method, 0x60); /* Local0Op */
+    build_memhp_release(method);
+    build_append_byte(method, 0xA4); /* ReturnOp */
+    build_append_byte(method, 0x60); /* Local0Op */
+    build_append_method(sb_scope, "MPXM", 0x01, method);
+    build_free_array(method);
+
+    /* Method(MEJ0, 2) { Store(One, MEJT) for the slot } */
+    method = build_alloc_array();
+    build_memhp_select(method);
+    build_append_byte(method, 0x70); /* StoreOp */
+    build_append_byte(method, 0x01); /* OneOp */
+    build_append_nameseg(method, "MEJT");
+    build_memhp_release(method);
+    build_append_method(sb_scope, "MEJ0", 0x02, method);
+    build_free_array(method);
+
+    /* Device(MPxx) for each slot */
+    for (i = 0; i < slots; i++) {
+        dev = build_alloc_array();
+        build_append_nameseg(dev, "MP%0.02X", i);
+        build_append_byte(dev, 0x08); /* NameOp */
+        build_append_nameseg(dev, "_HID");
+        build_append_value(dev, 0x800CD041, 4); /* EISAID("PNP0C80") */
+        build_append_byte(dev, 0x08); /* NameOp */
+        build_append_nameseg(dev, "_UID");
+        build_append_value(dev, i, 1);
+
+        method = build_alloc_array();
+        build_append_byte(method, 0xA4); /* ReturnOp */
+        build_append_nameseg(method, "MCRS");
+        build_append_value(method, i, 1);
+        build_append_method(dev, "_CRS", 0x00, method);
+        build_free_array(method);
+
+        method = build_alloc_array();
+        build_append_byte(method, 0xA4); /* ReturnOp */
+        build_append_nameseg(method, "MSTA");
+        build_append_value(method, i, 1);
+        build_append_method(dev, "_STA", 0x00, method);
+        build_free_array(method);
+
+        method = build_alloc_array();
+        build_append_byte(method, 0xA4); /* ReturnOp */
+        build_append_nameseg(method, "MPXM");
+        build_append_value(method, i, 1);
+        build_append_method(dev, "_PXM", 0x00, method);
+        build_free_array(method);
+
+        method = build_alloc_array();
+        build_append_nameseg(method, "MEJ0");
+        build_append_value(method, i, 1);
+        build_append_byte(method, 0x68); /* Arg0Op */
+        build_append_method(dev, "_EJ0", 0x01, method);
+        build_free_array(method);
+
+        build_extop_package(dev, 0x82); /* DeviceOp */
+        build_append_array(sb_scope, dev);
+        build_free_array(dev);
+    }
+
+    /* Method(MTFY, 2) {If (LEqual(Arg0, 0x00)) {Notify(MP00, Arg1)} ...} */
+    build_append_notify(sb_scope, "MTFY", "MP%0.02X", 0, slots);
+
+    /* Method(MHPS, 0): notify the guest of the slots with a pending
+     * insertion (Device Check) or removal (Eject Request)
+     */
+    method = build_alloc_array();
+    build_memhp_acquire(method);
+    build_append_byte(method, 0x70); /* StoreOp */
+    build_append_byte(method, 0x00); /* ZeroOp */
+    build_append_byte(method, 0x60); /* Local0Op */
+
+    loop = build_alloc_array();
+    build_append_byte(loop, 0x95); /* LLessOp */
+    build_append_byte(loop, 0x60); /* Local0Op */
+    build_append_value(loop, slots, 2);
+    build_append_byte(loop, 0x70); /* StoreOp */
+    build_append_byte(loop, 0x60); /* Local0Op */
+    build_append_nameseg(loop, "MSEL");
+
+    body = build_alloc_array();
+    build_append_nameseg(body, "MTFY");
+    build_append_byte(body, 0x60); /* Local0Op */
+    build_append_byte(body, 0x01); /* OneOp: Device Check */
+    build_append_byte(body, 0x70); /* StoreOp */
+    build_append_byte(body, 0x01); /* OneOp */
+    build_append_nameseg(body, "MINS");
+    build_append_if_set(loop, "MINS", body);
+    build_free_array(body);
+
+    body = build_alloc_array();
+    build_append_nameseg(body, "MTFY");
+    build_append_byte(body, 0x60); /* Local0Op */
+    build_append_value(body, 3, 1); /* Eject Request */
+    build_append_byte(body, 0x70); /* StoreOp */
+    build_append_byte(body, 0x01); /* OneOp */
+    build_append_nameseg(body, "MRMV");
+    build_append_if_set(loop, "MRMV", body);
+    build_free_array(body);
+
+    build_append_byte(loop, 0x75); /* IncrementOp */
+    build_append_byte(loop, 0x60); /* Local0Op */
+    build_package(loop, 0xA2, 1); /* WhileOp */
+    build_append_array(method, loop);
+    build_free_array(loop);
+
+    build_memhp_release(method);
+    build_append_method(sb_scope, "MHPS", 0x00, method);
+    build_free_array(method);
+}
+
 static void patch_pcihp(int slot, uint8_t *ssdt_ptr, uint32_t eject)
 {
     ssdt_ptr[ACPI_PCIHP_OFFSET_HEX] = acpi_get_hex(slot >> 4);
@@ -775,6 +1072,8 @@ build_ssdt(GArray *table_data, GArray *linker,
             build_free_array(pci0);
         }
 
+        build_memory_hotplug(sb_scope, guest_info->ram_slots);
+
         build_package(sb_scope, op, 3);
         build_append_array(table_data, sb_scope);
         build_free_array(sb_scope);
@@ -887,6 +1186,15 @@ build_srat(GArray *table_data, GArray *linker,
         acpi_build_srat_memory(numamem, 0, 0, 0, 0);
     }
 
+    /* The DIMMs report their own node with _PXM */
+    if (guest_info->hotplug_memory_size) {
+        numamem = acpi_data_push(table_data, sizeof *numamem);
+        acpi_build_srat_memory(numamem, guest_info->hotplug_memory_base,
+                               guest_info->hotplug_memory_size,
+                               guest_info->numa_nodes - 1, 1);
+        numamem->flags |= cpu_to_le32(2); /* Hot Pluggable */
+    }
+
     build_header(linker, table_data,
                  (void *)(table_data->data + srat_start),
                  ACPI_SRAT_SIGNATURE,
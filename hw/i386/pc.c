@@ -71,6 +71,7 @@
 /* Leave a chunk of memory at the top of RAM for the BIOS ACPI tables.  */
 #define ACPI_DATA_SIZE       0x10000
 #define BIOS_CFG_IOPORT 0x510
+#define BIOS_CFG_DMA_IOPORT 0x514
 #define FW_CFG_ACPI_TABLES (FW_CFG_ARCH_LOCAL + 0)
 #define FW_CFG_SMBIOS_ENTRIES (FW_CFG_ARCH_LOCAL + 1)
 #define FW_CFG_IRQ0_OVERRIDE (FW_CFG_ARCH_LOCAL + 2)
@@ -628,7 +629,8 @@ static FWCfgState *bochs_bios_init(void)
     int i, j;
     unsigned int apic_id_limit = pc_apic_id_limit(max_cpus);
 
-    fw_cfg = fw_cfg_init(BIOS_CFG_IOPORT, BIOS_CFG_IOPORT + 1, 0, 0);
+    fw_cfg = fw_cfg_init_dma(BIOS_CFG_IOPORT, BIOS_CFG_IOPORT + 1,
+                             BIOS_CFG_DMA_IOPORT, 0, 0, 0);
     /* FW_CFG_MAX_CPUS is a bit confusing/problematic on x86:
      *
      * SeaBIOS needs FW_CFG_MAX_CPUS for CPU hotplug, but the CPU hotplug
@@ -644,7 +646,9 @@ static FWCfgState *bochs_bios_init(void)
      *     the APIC ID, not the "CPU index"
      */
     fw_cfg_add_i16(fw_cfg, FW_CFG_MAX_CPUS, (uint16_t)apic_id_limit);
-    fw_cfg_add_i32(fw_cfg, FW_CFG_ID, 1);
+    fw_cfg_add_i32(fw_cfg, FW_CFG_ID,
+                   fw_cfg_dma_enabled(fw_cfg) ?
+                   FW_CFG_VERSION | FW_CFG_VERSION_DMA : FW_CFG_VERSION);
     fw_cfg_add_i64(fw_cfg, FW_CFG_RAM_SIZE, (uint64_t)ram_size);
     fw_cfg_add_bytes(fw_cfg, FW_CFG_ACPI_TABLES,
                      acpi_tables, acpi_tables_len);
@@ -1155,12 +1159,13 @@ FWCfgState *pc_memory_init(MemoryRegion *system_memory,
 
     /* Allocate RAM.  We allocate it as a single memory region and use
      * aliases to address portions of it, mostly for backwards compatibility
-     * with older qemus that used qemu_ram_alloc().
+     * with older qemus that used qemu_ram_alloc().  With host placement
+     * options for the NUMA nodes, it is a container of one RAM region per
+     * node instead.
      */
     ram = g_malloc(sizeof(*ram));
-    memory_region_init_ram(ram, NULL, "pc.ram",
-                           below_4g_mem_size + above_4g_mem_size);
-    vmstate_register_ram_global(ram);
+    memory_region_allocate_system_memory(ram, NULL, "pc.ram",
+                                         below_4g_mem_size + above_4g_mem_size);
     *ram_memory = ram;
     ram_below_4g = g_malloc(sizeof(*ram_below_4g));
     memory_region_init_alias(ram_below_4g, NULL, "ram-below-4g", ram,
@@ -1176,6 +1181,22 @@ FWCfgState *pc_memory_init(MemoryRegion *system_memory,
         e820_add_entry(0x100000000ULL, above_4g_mem_size, E820_RAM);
     }
 
+    /* The DIMMs go in a range of their own above the RAM.  It is not in
+     * the e820 map: the guest finds the DIMMs through ACPI.
+     */
+    if (ram_slots) {
+        guest_info->ram_slots = ram_slots;
+        guest_info->hotplug_memory_base =
+            ROUND_UP(0x100000000ULL + above_4g_mem_size, 1ULL << 30);
+        guest_info->hotplug_memory_size = maxram_size - ram_size;
+        guest_info->hotplug_memory = g_malloc(sizeof(MemoryRegion));
+        memory_region_init(guest_info->hotplug_memory, NULL, "hotplug-memory",
+                           guest_info->hotplug_memory_size);
+        memory_region_add_subregion(system_memory,
+                                    guest_info->hotplug_memory_base,
+                                    guest_info->hotplug_memory);
+    }
+
 
     /* Initialize PC system firmware */
     pc_system_firmware_init(rom_memory, guest_info->isapc_ram_fw);
@@ -1198,6 +1219,15 @@ FWCfgState *pc_memory_init(MemoryRegion *system_memory,
     for (i = 0; i < nb_option_roms; i++) {
         rom_add_option(option_rom[i].name, option_rom[i].bootindex);
     }
+    if (guest_info->hotplug_memory) {
+        uint64_t *reserved_end = g_malloc(sizeof(*reserved_end));
+
+        /* Keep the firmware from putting 64-bit BARs in the DIMM range */
+        *reserved_end = cpu_to_le64(guest_info->hotplug_memory_base +
+                                    guest_info->hotplug_memory_size);
+        fw_cfg_add_file(fw_cfg, "etc/reserved-memory-end", reserved_end,
+                        sizeof(*reserved_end));
+    }
     guest_info->fw_cfg = fw_cfg;
     return fw_cfg;
 }
@@ -31,6 +31,7 @@
 #include "hw/i386/smbios.h"
 #include "hw/pci/pci.h"
 #include "hw/pci/pci_ids.h"
+#include "hw/mem/dimm.h"
 #include "hw/usb.h"
 #include "net/net.h"
 #include "hw/boards.h"
@@ -159,6 +160,12 @@ static void pc_init1(QEMUMachineInitArgs *args,
                               system_memory, system_io, args->ram_size,
                               above_4g_mem_size,
                               pci_memory, ram_memory);
+        /* before the PM device, that handles the DIMM hotplug events */
+        if (guest_info->hotplug_memory && acpi_enabled) {
+            dimm_bus_create(DEVICE(i440fx_state), guest_info->hotplug_memory,
+                            guest_info->hotplug_memory_base,
+                            guest_info->ram_slots);
+        }
     } else {
         pci_bus = NULL;
         i440fx_state = NULL;
@@ -378,6 +385,10 @@ static QEMUMachine pc_i440fx_machine_v1_7 = {
     PC_I440FX_1_7_MACHINE_OPTIONS,
     .name = "pc-i440fx-1.7",
     .init = pc_init_pci_1_7,
+    .compat_props = (GlobalProperty[]) {
+        PC_COMPAT_1_7,
+        { /* end of list */ }
+    },
 };
 
 #define PC_I440FX_1_6_MACHINE_OPTIONS PC_I440FX_MACHINE_OPTIONS
@@ -431,15 +431,23 @@ static void ahci_reg_init(AHCIState *s)
 static void check_cmd(AHCIState *s, int port)
 {
     AHCIPortRegs *pr = &s->dev[port].port_regs;
+    BlockDriverState *bs = s->dev[port].port.ifs[0].bs;
     int slot;
 
     if ((pr->cmd & PORT_CMD_START) && pr->cmd_issue) {
+        /* Queued commands issued together reach the disk together */
+        if (bs) {
+            bdrv_io_plug(bs);
+        }
         for (slot = 0; (slot < 32) && pr->cmd_issue; slot++) {
             if ((pr->cmd_issue & (1 << slot)) &&
                 !handle_cmd(s, port, slot)) {
                 pr->cmd_issue &= ~(1 << slot);
             }
         }
+        if (bs) {
+            bdrv_io_unplug(bs);
+        }
     }
 }
 
@@ -495,6 +503,8 @@ static void ahci_reset_port(AHCIState *s, int port)
     pr->scr_act = 0;
     d->busy_slot = -1;
     d->init_d2h_sent = false;
+    d->ncq_done = 0;
+    qemu_bh_cancel(d->ncq_bh);
 
     ide_state = &s->dev[port].port.ifs[0];
     if (!ide_state->bs) {
@@ -521,6 +531,8 @@ static void ahci_reset_port(AHCIState *s, int port)
         qemu_sglist_destroy(&ncq_tfs->sglist);
         ncq_tfs->used = 0;
     }
+    d->ncq_done = 0;
+    qemu_bh_cancel(d->ncq_bh);
 
     s->dev[port].port_state = STATE_RUN;
     if (!ide_state->bs) {
@@ -712,32 +724,59 @@ out:
     return r;
 }
 
-static void ncq_cb(void *opaque, int ret)
+/* Report all tags that completed successfully in one Set Device Bits FIS */
+static void ahci_ncq_flush_sdb(AHCIDevice *ad)
 {
-    NCQTransferState *ncq_tfs = (NCQTransferState *)opaque;
-    IDEState *ide_state = &ncq_tfs->drive->port.ifs[0];
+    IDEState *ide_state = &ad->port.ifs[0];
+    uint32_t done = ad->ncq_done;
+
+    if (!done) {
+        return;
+    }
+    ad->ncq_done = 0;
+    ide_state->status = READY_STAT | SEEK_STAT;
+    ahci_write_fis_sdb(ad->hba, ad->port_no, done);
+}
+
+static void ahci_ncq_sdb_bh(void *opaque)
+{
+    ahci_ncq_flush_sdb(opaque);
+}
+
+static void ncq_finish(NCQTransferState *ncq_tfs, int ret)
+{
+    AHCIDevice *ad = ncq_tfs->drive;
+    IDEState *ide_state = &ad->port.ifs[0];
 
     /* Clear bit for this tag in SActive */
-    ncq_tfs->drive->port_regs.scr_act &= ~(1 << ncq_tfs->tag);
+    ad->port_regs.scr_act &= ~(1 << ncq_tfs->tag);
+
+    DPRINTF(ad->port_no, "NCQ transfer tag %d finished\n", ncq_tfs->tag);
+
+    ncq_tfs->aiocb = NULL;
+    ncq_tfs->used = 0;
 
     if (ret < 0) {
-        /* error */
+        /* error, report what completed before so that it is not blamed */
+        ahci_ncq_flush_sdb(ad);
         ide_state->error = ABRT_ERR;
         ide_state->status = READY_STAT | ERR_STAT;
-        ncq_tfs->drive->port_regs.scr_err |= (1 << ncq_tfs->tag);
+        ad->port_regs.scr_err |= (1 << ncq_tfs->tag);
+        ahci_write_fis_sdb(ad->hba, ad->port_no, (1 << ncq_tfs->tag));
     } else {
-        ide_state->status = READY_STAT | SEEK_STAT;
+        /* Completions that arrive together share one FIS and interrupt */
+        ad->ncq_done |= (1 << ncq_tfs->tag);
+        qemu_bh_schedule(ad->ncq_bh);
     }
+}
 
-    ahci_write_fis_sdb(ncq_tfs->drive->hba, ncq_tfs->drive->port_no,
-                       (1 << ncq_tfs->tag));
-
-    DPRINTF(ncq_tfs->drive->port_no, "NCQ transfer tag %d finished\n",
-            ncq_tfs->tag);
+static void ncq_cb(void *opaque, int ret)
+{
+    NCQTransferState *ncq_tfs = (NCQTransferState *)opaque;
 
     bdrv_acct_done(ncq_tfs->drive->port.ifs[0].bs, &ncq_tfs->acct);
     qemu_sglist_destroy(&ncq_tfs->sglist);
-    ncq_tfs->used = 0;
+    ncq_finish(ncq_tfs, ret);
 }
 
 static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
@@ -753,6 +792,12 @@ static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
         return;
     }
 
+    if (ncq_fis->command != READ_FPDMA_QUEUED &&
+        ncq_fis->command != WRITE_FPDMA_QUEUED) {
+        DPRINTF(port, "error: tried to process non-NCQ command as NCQ\n");
+        return;
+    }
+
     ncq_tfs->used = 1;
     ncq_tfs->drive = &s->dev[port];
     ncq_tfs->slot = slot;
@@ -773,8 +818,19 @@ static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
             ncq_tfs->lba, ncq_tfs->lba + ncq_tfs->sector_count - 2,
             s->dev[port].port.ifs[0].nb_sectors - 1);
 
-    ahci_populate_sglist(&s->dev[port], &ncq_tfs->sglist, 0);
     ncq_tfs->tag = tag;
+    if (ahci_populate_sglist(&s->dev[port], &ncq_tfs->sglist, 0)) {
+        DPRINTF(port, "error: tag %d has no valid PRDT\n", tag);
+        ncq_finish(ncq_tfs, -EINVAL);
+        return;
+    }
+    if (ncq_tfs->lba + (ncq_tfs->sglist.size >> BDRV_SECTOR_BITS) >
+        s->dev[port].port.ifs[0].nb_sectors) {
+        DPRINTF(port, "error: tag %d beyond the end of the disk\n", tag);
+        qemu_sglist_destroy(&ncq_tfs->sglist);
+        ncq_finish(ncq_tfs, -EINVAL);
+        return;
+    }
 
     switch(ncq_fis->command) {
         case READ_FPDMA_QUEUED:
@@ -805,9 +861,7 @@ static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
                                             ncq_cb, ncq_tfs);
             break;
         default:
-            DPRINTF(port, "error: tried to process non-NCQ command as NCQ\n");
-            qemu_sglist_destroy(&ncq_tfs->sglist);
-            break;
+            abort();
     }
 }
 
@@ -1183,11 +1237,17 @@ void ahci_init(AHCIState *s, DeviceState *qdev, AddressSpace *as, int ports)
         ad->port_no = i;
         ad->port.dma = &ad->dma;
         ad->port.dma->ops = &ahci_dma_ops;
+        ad->ncq_bh = qemu_bh_new(ahci_ncq_sdb_bh, ad);
     }
 }
 
 void ahci_uninit(AHCIState *s)
 {
+    int i;
+
+    for (i = 0; i < s->ports; i++) {
+        qemu_bh_delete(s->dev[i].ncq_bh);
+    }
     memory_region_destroy(&s->mem);
     memory_region_destroy(&s->idp);
     g_free(s->dev);
@@ -1247,6 +1307,18 @@ static const VMStateDescription vmstate_ahci_device = {
     },
 };
 
+static void ahci_state_pre_save(void *opaque)
+{
+    AHCIState *s = opaque;
+    int i;
+
+    /* Deliver completions still waiting for their SDB FIS */
+    for (i = 0; i < s->ports; i++) {
+        qemu_bh_cancel(s->dev[i].ncq_bh);
+        ahci_ncq_flush_sdb(&s->dev[i]);
+    }
+}
+
 static int ahci_state_post_load(void *opaque, int version_id)
 {
     int i;
@@ -1280,6 +1352,7 @@ static int ahci_state_post_load(void *opaque, int version_id)
 const VMStateDescription vmstate_ahci = {
     .name = "ahci",
     .version_id = 1,
+    .pre_save = ahci_state_pre_save,
     .post_load = ahci_state_post_load,
     .fields = (VMStateField []) {
         VMSTATE_STRUCT_VARRAY_POINTER_INT32(dev, AHCIState, ports,
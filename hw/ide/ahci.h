@@ -286,6 +286,8 @@ struct AHCIDevice {
     bool init_d2h_sent;
     AHCICmdHdr *cur_cmd;
     NCQTransferState ncq_tfs[AHCI_MAX_CMDS];
+    uint32_t ncq_done;      /* tags completed since the last SDB FIS */
+    QEMUBH *ncq_bh;
 };
 
 typedef struct AHCIState {
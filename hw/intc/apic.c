@@ -28,14 +28,27 @@
 
 #define MAX_APIC_WORDS 8
 
+/* isr_max or irr_max must be recomputed from the register */
+#define APIC_VECTOR_UNKNOWN             -2
+
 #define SYNC_FROM_VAPIC                 0x1
 #define SYNC_TO_VAPIC                   0x2
 #define SYNC_ISR_IRR_TO_VAPIC           0x4
 
 static APICCommonState *local_apics[MAX_APICS + 1];
 
+/* Logical destination lookup, indexed by bit number in the flat model and
+ * by cluster and bit number in the cluster model.  Each entry is a bitmask
+ * of local_apics indices.  The tables are rebuilt on the next logical
+ * delivery after any APIC changes its LDR or DFR.
+ */
+static uint32_t apic_flat_dest[8][MAX_APIC_WORDS];
+static uint32_t apic_cluster_dest[16][4][MAX_APIC_WORDS];
+static bool apic_logical_dirty = true;
+
 static void apic_set_irq(APICCommonState *s, int vector_num, int trigger_mode);
 static void apic_update_irq(APICCommonState *s);
+static int apic_find_dest(uint8_t dest);
 static void apic_get_delivery_bitmask(uint32_t *deliver_bitmask,
                                       uint8_t dest, uint8_t dest_mode);
 
@@ -87,6 +100,57 @@ static int get_highest_priority_int(uint32_t *tab)
     return -1;
 }
 
+static int apic_isr_max(APICCommonState *s)
+{
+    if (s->isr_max == APIC_VECTOR_UNKNOWN) {
+        s->isr_max = get_highest_priority_int(s->isr);
+    }
+    return s->isr_max;
+}
+
+static int apic_irr_max(APICCommonState *s)
+{
+    if (s->irr_max == APIC_VECTOR_UNKNOWN) {
+        s->irr_max = get_highest_priority_int(s->irr);
+    }
+    return s->irr_max;
+}
+
+/* Setting a bit can only raise the maximum; clearing the maximum itself
+ * defers the scan to the next lookup.
+ */
+static void apic_set_irr(APICCommonState *s, int vector_num)
+{
+    apic_set_bit(s->irr, vector_num);
+    if (s->irr_max != APIC_VECTOR_UNKNOWN && vector_num > s->irr_max) {
+        s->irr_max = vector_num;
+    }
+}
+
+static void apic_clear_irr(APICCommonState *s, int vector_num)
+{
+    apic_reset_bit(s->irr, vector_num);
+    if (vector_num == s->irr_max) {
+        s->irr_max = APIC_VECTOR_UNKNOWN;
+    }
+}
+
+static void apic_set_isr(APICCommonState *s, int vector_num)
+{
+    apic_set_bit(s->isr, vector_num);
+    if (s->isr_max != APIC_VECTOR_UNKNOWN && vector_num > s->isr_max) {
+        s->isr_max = vector_num;
+    }
+}
+
+static void apic_clear_isr(APICCommonState *s, int vector_num)
+{
+    apic_reset_bit(s->isr, vector_num);
+    if (vector_num == s->isr_max) {
+        s->isr_max = APIC_VECTOR_UNKNOWN;
+    }
+}
+
 static void apic_sync_vapic(APICCommonState *s, int sync_type)
 {
     VAPICState vapic_state;
@@ -115,7 +179,7 @@ static void apic_sync_vapic(APICCommonState *s, int sync_type)
             length = sizeof(VAPICState);
         }
 
-        vector = get_highest_priority_int(s->isr);
+        vector = apic_isr_max(s);
         if (vector < 0) {
             vector = 0;
         }
@@ -123,7 +187,7 @@ static void apic_sync_vapic(APICCommonState *s, int sync_type)
 
         vapic_state.zero = 0;
 
-        vector = get_highest_priority_int(s->irr);
+        vector = apic_irr_max(s);
         if (vector < 0) {
             vector = 0;
         }
@@ -184,7 +248,7 @@ void apic_deliver_pic_intr(DeviceState *d, int level)
         case APIC_DM_FIXED:
             if (!(lvt & APIC_LVT_LEVEL_TRIGGER))
                 break;
-            apic_reset_bit(s->irr, lvt & 0xff);
+            apic_clear_irr(s, lvt & 0xff);
             /* fall through */
         case APIC_DM_EXTINT:
             cpu_reset_interrupt(CPU(s->cpu), CPU_INTERRUPT_HARD);
@@ -200,17 +264,16 @@ static void apic_external_nmi(APICCommonState *s)
 
 #define foreach_apic(apic, deliver_bitmask, code) \
 {\
-    int __i, __j, __mask;\
+    int __i, __j;\
+    uint32_t __mask;\
     for(__i = 0; __i < MAX_APIC_WORDS; __i++) {\
         __mask = deliver_bitmask[__i];\
-        if (__mask) {\
-            for(__j = 0; __j < 32; __j++) {\
-                if (__mask & (1 << __j)) {\
-                    apic = local_apics[__i * 32 + __j];\
-                    if (apic) {\
-                        code;\
-                    }\
-                }\
+        while (__mask) {\
+            __j = apic_ffs_bit(__mask);\
+            __mask &= __mask - 1;\
+            apic = local_apics[__i * 32 + __j];\
+            if (apic) {\
+                code;\
             }\
         }\
     }\
@@ -282,10 +345,23 @@ void apic_deliver_irq(uint8_t dest, uint8_t dest_mode, uint8_t delivery_mode,
                       uint8_t vector_num, uint8_t trigger_mode)
 {
     uint32_t deliver_bitmask[MAX_APIC_WORDS];
+    int idx;
 
     trace_apic_deliver_irq(dest, dest_mode, delivery_mode, vector_num,
                            trigger_mode);
 
+    /* Physical mode with a single destination is what IOAPIC and MSI
+     * routes almost always use; skip building the bitmask for it.
+     */
+    if (dest_mode == 0 && dest != 0xff &&
+        (delivery_mode == APIC_DM_FIXED || delivery_mode == APIC_DM_LOWPRI)) {
+        idx = apic_find_dest(dest);
+        if (idx >= 0 && local_apics[idx]) {
+            apic_set_irq(local_apics[idx], vector_num, trigger_mode);
+        }
+        return;
+    }
+
     apic_get_delivery_bitmask(deliver_bitmask, dest, dest_mode);
     apic_bus_deliver(deliver_bitmask, delivery_mode, vector_num, trigger_mode);
 }
@@ -317,12 +393,67 @@ static uint8_t apic_get_tpr(APICCommonState *s)
     return s->tpr >> 4;
 }
 
+/* With paravirtual EOI the guest acknowledges an interrupt by clearing
+ * bit 0 of a flag in its own memory instead of writing the EOI register.
+ * The flag is only offered for edge-triggered interrupts accepted while
+ * nothing else is pending; the deferred EOI is then done here, before
+ * anything looks at the ISR.
+ */
+static hwaddr apic_pv_eoi_addr(APICCommonState *s)
+{
+    return s->cpu->env.pv_eoi_en_msr & ~(uint64_t)MSR_PV_EOI_EN_ENABLE;
+}
+
+static void apic_pv_eoi_sync(APICCommonState *s)
+{
+    int isrv;
+
+    if (!s->pv_eoi_pending) {
+        return;
+    }
+    if ((s->cpu->env.pv_eoi_en_msr & MSR_PV_EOI_EN_ENABLE) &&
+        (ldub_phys(apic_pv_eoi_addr(s)) & 1)) {
+        return;
+    }
+    s->pv_eoi_pending = false;
+    if (!(s->cpu->env.pv_eoi_en_msr & MSR_PV_EOI_EN_ENABLE)) {
+        /* Turned off meanwhile, the guest writes the EOI register again */
+        return;
+    }
+    isrv = apic_isr_max(s);
+    if (isrv >= 0) {
+        apic_clear_isr(s, isrv);
+    }
+}
+
+/* Make the guest write the EOI register for the current interrupt */
+static void apic_pv_eoi_cancel(APICCommonState *s)
+{
+    apic_pv_eoi_sync(s);
+    if (s->pv_eoi_pending) {
+        stb_phys(apic_pv_eoi_addr(s), 0);
+        s->pv_eoi_pending = false;
+    }
+}
+
+static void apic_pv_eoi_offer(APICCommonState *s, int vector_num)
+{
+    if (!tcg_enabled() || s->vapic_paddr ||
+        !(s->cpu->env.pv_eoi_en_msr & MSR_PV_EOI_EN_ENABLE) ||
+        apic_get_bit(s->tmr, vector_num) || apic_irr_max(s) >= 0) {
+        apic_pv_eoi_cancel(s);
+        return;
+    }
+    stb_phys(apic_pv_eoi_addr(s), 1);
+    s->pv_eoi_pending = true;
+}
+
 static int apic_get_ppr(APICCommonState *s)
 {
     int tpr, isrv, ppr;
 
     tpr = (s->tpr >> 4);
-    isrv = get_highest_priority_int(s->isr);
+    isrv = apic_isr_max(s);
     if (isrv < 0)
         isrv = 0;
     isrv >>= 4;
@@ -348,7 +479,9 @@ static int apic_get_arb_pri(APICCommonState *s)
 static int apic_irq_pending(APICCommonState *s)
 {
     int irrv, ppr;
-    irrv = get_highest_priority_int(s->irr);
+
+    apic_pv_eoi_sync(s);
+    irrv = apic_irr_max(s);
     if (irrv < 0) {
         return 0;
     }
@@ -388,7 +521,9 @@ static void apic_set_irq(APICCommonState *s, int vector_num, int trigger_mode)
 {
     apic_report_irq_delivered(!apic_get_bit(s->irr, vector_num));
 
-    apic_set_bit(s->irr, vector_num);
+    /* A deferred EOI would not give the new interrupt a chance to run */
+    apic_pv_eoi_cancel(s);
+    apic_set_irr(s, vector_num);
     if (trigger_mode)
         apic_set_bit(s->tmr, vector_num);
     else
@@ -409,10 +544,12 @@ static void apic_set_irq(APICCommonState *s, int vector_num, int trigger_mode)
 static void apic_eoi(APICCommonState *s)
 {
     int isrv;
-    isrv = get_highest_priority_int(s->isr);
+
+    apic_pv_eoi_sync(s);
+    isrv = apic_isr_max(s);
     if (isrv < 0)
         return;
-    apic_reset_bit(s->isr, isrv);
+    apic_clear_isr(s, isrv);
     if (!(s->spurious_vec & APIC_SV_DIRECTED_IO) && apic_get_bit(s->tmr, isrv)) {
         ioapic_eoi_broadcast(isrv);
     }
@@ -439,10 +576,37 @@ static int apic_find_dest(uint8_t dest)
     return -1;
 }
 
+static void apic_update_logical_dest(void)
+{
+    APICCommonState *apic;
+    uint8_t bits;
+    int i;
+
+    memset(apic_flat_dest, 0, sizeof(apic_flat_dest));
+    memset(apic_cluster_dest, 0, sizeof(apic_cluster_dest));
+    for (i = 0; i < MAX_APICS; i++) {
+        apic = local_apics[i];
+        if (!apic) {
+            break;
+        }
+        if (apic->dest_mode == 0xf) {
+            for (bits = apic->log_dest; bits; bits &= bits - 1) {
+                apic_set_bit(apic_flat_dest[ctz32(bits)], i);
+            }
+        } else if (apic->dest_mode == 0x0) {
+            for (bits = apic->log_dest & 0x0f; bits; bits &= bits - 1) {
+                apic_set_bit(apic_cluster_dest[apic->log_dest >> 4]
+                                              [ctz32(bits)], i);
+            }
+        }
+    }
+    apic_logical_dirty = false;
+}
+
 static void apic_get_delivery_bitmask(uint32_t *deliver_bitmask,
                                       uint8_t dest, uint8_t dest_mode)
 {
-    APICCommonState *apic_iter;
+    uint8_t bits;
     int i;
 
     if (dest_mode == 0) {
@@ -455,22 +619,22 @@ static void apic_get_delivery_bitmask(uint32_t *deliver_bitmask,
                 apic_set_bit(deliver_bitmask, idx);
         }
     } else {
-        /* XXX: cluster mode */
+        if (apic_logical_dirty) {
+            apic_update_logical_dest();
+        }
+        /* APICs in the flat model match any common bit, those in the
+         * cluster model need the same cluster and a common member bit.
+         */
         memset(deliver_bitmask, 0x00, MAX_APIC_WORDS * sizeof(uint32_t));
-        for(i = 0; i < MAX_APICS; i++) {
-            apic_iter = local_apics[i];
-            if (apic_iter) {
-                if (apic_iter->dest_mode == 0xf) {
-                    if (dest & apic_iter->log_dest)
-                        apic_set_bit(deliver_bitmask, i);
-                } else if (apic_iter->dest_mode == 0x0) {
-                    if ((dest & 0xf0) == (apic_iter->log_dest & 0xf0) &&
-                        (dest & apic_iter->log_dest & 0x0f)) {
-                        apic_set_bit(deliver_bitmask, i);
-                    }
-                }
-            } else {
-                break;
+        for (bits = dest; bits; bits &= bits - 1) {
+            for (i = 0; i < MAX_APIC_WORDS; i++) {
+                deliver_bitmask[i] |= apic_flat_dest[ctz32(bits)][i];
+            }
+        }
+        for (bits = dest & 0x0f; bits; bits &= bits - 1) {
+            for (i = 0; i < MAX_APIC_WORDS; i++) {
+                deliver_bitmask[i] |=
+                    apic_cluster_dest[dest >> 4][ctz32(bits)][i];
             }
         }
     }
@@ -573,8 +737,9 @@ int apic_get_interrupt(DeviceState *d)
         apic_sync_vapic(s, SYNC_TO_VAPIC);
         return s->spurious_vec & 0xff;
     }
-    apic_reset_bit(s->irr, intno);
-    apic_set_bit(s->isr, intno);
+    apic_clear_irr(s, intno);
+    apic_set_isr(s, intno);
+    apic_pv_eoi_offer(s, intno);
     apic_sync_vapic(s, SYNC_TO_VAPIC);
 
     /* re-inject if there is still a pending PIC interrupt */
@@ -602,10 +767,84 @@ int apic_accept_pic_intr(DeviceState *d)
     return 0;
 }
 
+static bool apic_tsc_deadline_mode(APICCommonState *s)
+{
+    return (s->lvt[APIC_LVT_TIMER] & APIC_LVT_TIMER_MODE) ==
+           APIC_LVT_TIMER_TSCDEADLINE;
+}
+
+/* The TSC and the virtual clock are sampled once when the first APIC is
+ * created, so that the TSC rate can be measured when no tsc-freq was set.
+ * Both stop while the VM is stopped.
+ */
+static uint64_t apic_tsc_calib_ticks;
+static int64_t apic_tsc_calib_ns = -1;
+
+/* Measurements shorter than this are too coarse */
+#define APIC_TSC_CALIB_MIN_MS           100
+
+static uint32_t apic_tsc_khz(APICCommonState *s, int64_t now)
+{
+    int64_t elapsed_ms;
+    uint64_t khz;
+
+    if (s->cpu->env.tsc_khz) {
+        return s->cpu->env.tsc_khz;
+    }
+    elapsed_ms = (now - apic_tsc_calib_ns) / SCALE_MS;
+    if (apic_tsc_calib_ns < 0 || elapsed_ms < APIC_TSC_CALIB_MIN_MS) {
+        /* The rate of the tick counter with -icount */
+        return 1000000;
+    }
+    khz = (cpu_get_ticks() - apic_tsc_calib_ticks) / elapsed_ms;
+    return MAX(MIN(khz, UINT32_MAX), 1);
+}
+
+static void apic_tsc_deadline_update(APICCommonState *s, int64_t now)
+{
+    CPUX86State *env = &s->cpu->env;
+    uint64_t tsc, delta;
+
+    s->timer_expiry = -1;
+    if ((s->lvt[APIC_LVT_TIMER] & APIC_LVT_MASKED) || !env->tsc_deadline) {
+        timer_del(s->timer);
+        return;
+    }
+
+    tsc = cpu_get_tsc(env) + env->tsc_offset;
+    if (env->tsc_deadline <= tsc) {
+        s->next_time = now;
+    } else {
+        delta = muldiv64(env->tsc_deadline - tsc, 1000000,
+                         apic_tsc_khz(s, now));
+        if (delta >= INT64_MAX - now) {
+            timer_del(s->timer);
+            return;
+        }
+        s->next_time = now + delta;
+    }
+    s->timer_expiry = s->next_time;
+    timer_mod(s->timer, s->next_time);
+}
+
+static void apic_set_tsc_deadline(APICCommonState *s, uint64_t val)
+{
+    /* Writes are ignored outside of TSC-deadline mode */
+    if (!apic_tsc_deadline_mode(s)) {
+        return;
+    }
+    s->cpu->env.tsc_deadline = val;
+    apic_tsc_deadline_update(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+}
+
 static uint32_t apic_get_current_count(APICCommonState *s)
 {
     int64_t d;
     uint32_t val;
+
+    if (apic_tsc_deadline_mode(s)) {
+        return 0;
+    }
     d = (qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - s->initial_count_load_time) >>
         s->count_shift;
     if (s->lvt[APIC_LVT_TIMER] & APIC_LVT_TIMER_PERIODIC) {
@@ -622,6 +861,10 @@ static uint32_t apic_get_current_count(APICCommonState *s)
 
 static void apic_timer_update(APICCommonState *s, int64_t current_time)
 {
+    if (apic_tsc_deadline_mode(s)) {
+        apic_tsc_deadline_update(s, current_time);
+        return;
+    }
     if (apic_next_timer(s, current_time)) {
         timer_mod(s->timer, s->next_time);
     } else {
@@ -633,6 +876,13 @@ static void apic_timer(void *opaque)
 {
     APICCommonState *s = opaque;
 
+    if (apic_tsc_deadline_mode(s)) {
+        /* The deadline fires once and then reads as zero */
+        s->cpu->env.tsc_deadline = 0;
+        s->timer_expiry = -1;
+        apic_local_deliver(s, APIC_LVT_TIMER);
+        return;
+    }
     apic_local_deliver(s, APIC_LVT_TIMER);
     apic_timer_update(s, s->next_time);
 }
@@ -688,6 +938,7 @@ static uint32_t apic_mem_readl(void *opaque, hwaddr addr)
         break;
     case 0x0a:
         /* ppr */
+        apic_pv_eoi_sync(s);
         val = apic_get_ppr(s);
         break;
     case 0x0b:
@@ -703,6 +954,7 @@ static uint32_t apic_mem_readl(void *opaque, hwaddr addr)
         val = s->spurious_vec;
         break;
     case 0x10 ... 0x17:
+        apic_pv_eoi_sync(s);
         val = s->isr[index & 7];
         break;
     case 0x18 ... 0x1f:
@@ -795,9 +1047,11 @@ static void apic_mem_writel(void *opaque, hwaddr addr, uint32_t val)
         break;
     case 0x0d:
         s->log_dest = val >> 24;
+        apic_logical_dirty = true;
         break;
     case 0x0e:
         s->dest_mode = val >> 28;
+        apic_logical_dirty = true;
         break;
     case 0x0f:
         s->spurious_vec = val & 0x1ff;
@@ -820,8 +1074,15 @@ static void apic_mem_writel(void *opaque, hwaddr addr, uint32_t val)
     case 0x32 ... 0x37:
         {
             int n = index - 0x32;
+            bool was_deadline = apic_tsc_deadline_mode(s);
+
             s->lvt[n] = val;
             if (n == APIC_LVT_TIMER) {
+                /* Switching to or from TSC-deadline mode disarms the timer */
+                if (apic_tsc_deadline_mode(s) != was_deadline) {
+                    s->cpu->env.tsc_deadline = 0;
+                    s->initial_count = 0;
+                }
                 apic_timer_update(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
             } else if (n == APIC_LVT_LINT0 && apic_check_pic(s)) {
                 apic_update_irq(s);
@@ -829,6 +1090,9 @@ static void apic_mem_writel(void *opaque, hwaddr addr, uint32_t val)
         }
         break;
     case 0x38:
+        if (apic_tsc_deadline_mode(s)) {
+            break;
+        }
         s->initial_count = val;
         s->initial_count_load_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
         apic_timer_update(s, s->initial_count_load_time);
@@ -856,6 +1120,10 @@ static void apic_pre_save(APICCommonState *s)
 
 static void apic_post_load(APICCommonState *s)
 {
+    s->isr_max = APIC_VECTOR_UNKNOWN;
+    s->irr_max = APIC_VECTOR_UNKNOWN;
+    apic_logical_dirty = true;
+
     if (s->timer_expiry != -1) {
         timer_mod(s->timer, s->timer_expiry);
     } else {
@@ -863,6 +1131,15 @@ static void apic_post_load(APICCommonState *s)
     }
 }
 
+static void apic_reset(APICCommonState *s)
+{
+    /* isr and irr were just cleared */
+    s->isr_max = -1;
+    s->irr_max = -1;
+    s->pv_eoi_pending = false;
+    apic_logical_dirty = true;
+}
+
 static const MemoryRegionOps apic_io_ops = {
     .old_mmio = {
         .read = { apic_mem_readb, apic_mem_readw, apic_mem_readl, },
@@ -878,6 +1155,13 @@ static void apic_init(APICCommonState *s)
 
     s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, apic_timer, s);
     local_apics[s->idx] = s;
+    if (apic_tsc_calib_ns < 0) {
+        apic_tsc_calib_ticks = cpu_get_ticks();
+        apic_tsc_calib_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    }
+    s->isr_max = APIC_VECTOR_UNKNOWN;
+    s->irr_max = APIC_VECTOR_UNKNOWN;
+    apic_logical_dirty = true;
 
     msi_supported = true;
 }
@@ -894,6 +1178,8 @@ static void apic_class_init(ObjectClass *klass, void *data)
     k->external_nmi = apic_external_nmi;
     k->pre_save = apic_pre_save;
     k->post_load = apic_post_load;
+    k->reset = apic_reset;
+    k->set_tsc_deadline = apic_set_tsc_deadline;
 }
 
 static const TypeInfo apic_info = {
@@ -65,6 +65,41 @@ void cpu_set_apic_tpr(DeviceState *d, uint8_t val)
     info->set_tpr(s, val);
 }
 
+void cpu_set_apic_tsc_deadline(DeviceState *d, uint64_t val)
+{
+    APICCommonState *s;
+    APICCommonClass *info;
+
+    if (!d) {
+        return;
+    }
+
+    s = APIC_COMMON(d);
+    info = APIC_COMMON_GET_CLASS(s);
+
+    if (info->set_tsc_deadline) {
+        info->set_tsc_deadline(s, val);
+    }
+}
+
+uint64_t cpu_get_apic_tsc_deadline(DeviceState *d)
+{
+    APICCommonState *s;
+
+    if (!d) {
+        return 0;
+    }
+
+    s = APIC_COMMON(d);
+
+    /* The MSR reads as zero outside of TSC-deadline mode */
+    if ((s->lvt[APIC_LVT_TIMER] & APIC_LVT_TIMER_MODE) !=
+        APIC_LVT_TIMER_TSCDEADLINE) {
+        return 0;
+    }
+    return s->cpu->env.tsc_deadline;
+}
+
 uint8_t cpu_get_apic_tpr(DeviceState *d)
 {
     APICCommonState *s;
@@ -173,6 +208,7 @@ bool apic_next_timer(APICCommonState *s, int64_t current_time)
 void apic_init_reset(DeviceState *d)
 {
     APICCommonState *s = DO_UPCAST(APICCommonState, busdev.qdev, d);
+    APICCommonClass *info;
     int i;
 
     if (!s) {
@@ -201,6 +237,11 @@ void apic_init_reset(DeviceState *d)
         timer_del(s->timer);
     }
     s->timer_expiry = -1;
+
+    info = APIC_COMMON_GET_CLASS(s);
+    if (info->reset) {
+        info->reset(s);
+    }
 }
 
 void apic_designate_bsp(DeviceState *d)
@@ -339,6 +380,24 @@ static int apic_dispatch_post_load(void *opaque, int version_id)
     return 0;
 }
 
+static bool apic_pv_eoi_needed(void *opaque)
+{
+    APICCommonState *s = APIC_COMMON(opaque);
+
+    return s->pv_eoi_pending;
+}
+
+static const VMStateDescription vmstate_apic_pv_eoi = {
+    .name = "apic/pv_eoi",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(pv_eoi_pending, APICCommonState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_apic_common = {
     .name = "apic",
     .version_id = 3,
@@ -369,6 +428,14 @@ static const VMStateDescription vmstate_apic_common = {
         VMSTATE_INT64(timer_expiry,
                       APICCommonState), /* open-coded timer state */
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection[]) {
+        {
+            .vmsd = &vmstate_apic_pv_eoi,
+            .needed = apic_pv_eoi_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
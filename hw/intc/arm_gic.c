@@ -45,8 +45,10 @@ static inline int gic_get_current_cpu(GICState *s)
     return 0;
 }
 
-/* TODO: Many places that call this routine could be optimized.  */
-/* Update interrupt status after enabled or pending bits have been changed.  */
+/* Update interrupt status after enabled or pending bits have been changed.
+ * Only interrupts that are pending somewhere are looked at, so the cost
+ * does not grow with the number of interrupts the GIC has.
+ */
 void gic_update(GICState *s)
 {
     int best_irq;
@@ -65,7 +67,9 @@ void gic_update(GICState *s)
         }
         best_prio = 0x100;
         best_irq = 1023;
-        for (irq = 0; irq < s->num_irq; irq++) {
+        for (irq = find_first_bit(s->pending_irqs, s->num_irq);
+             irq < s->num_irq;
+             irq = find_next_bit(s->pending_irqs, s->num_irq, irq + 1)) {
             if (GIC_TEST_ENABLED(irq, cm) && GIC_TEST_PENDING(irq, cm)) {
                 if (GIC_GET_PRIORITY(irq, cpu) < best_prio) {
                     best_prio = GIC_GET_PRIORITY(irq, cpu);
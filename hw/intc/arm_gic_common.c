@@ -34,6 +34,14 @@ static int gic_post_load(void *opaque, int version_id)
 {
     GICState *s = (GICState *)opaque;
     ARMGICCommonClass *c = ARM_GIC_COMMON_GET_CLASS(s);
+    int i;
+
+    bitmap_zero(s->pending_irqs, GIC_MAXIRQ);
+    for (i = 0; i < GIC_MAXIRQ; i++) {
+        if (s->irq_state[i].pending) {
+            set_bit(i, s->pending_irqs);
+        }
+    }
 
     if (c->post_load) {
         c->post_load(s);
@@ -113,6 +121,7 @@ static void arm_gic_common_reset(DeviceState *dev)
     GICState *s = ARM_GIC_COMMON(dev);
     int i;
     memset(s->irq_state, 0, GIC_MAXIRQ * sizeof(gic_irq_state));
+    bitmap_zero(s->pending_irqs, GIC_MAXIRQ);
     for (i = 0 ; i < s->num_cpu; i++) {
         if (s->revision == REV_11MPCORE) {
             s->priority_mask[i] = 0xf0;
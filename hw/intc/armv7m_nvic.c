@@ -324,13 +324,13 @@ static void nvic_writel(nvic_state *s, uint32_t offset, uint32_t value)
         if (value & (1 << 28)) {
             armv7m_nvic_set_pending(s, ARMV7M_EXCP_PENDSV);
         } else if (value & (1 << 27)) {
-            s->gic.irq_state[ARMV7M_EXCP_PENDSV].pending = 0;
+            gic_clear_pending(&s->gic, ARMV7M_EXCP_PENDSV, ALL_CPU_MASK);
             gic_update(&s->gic);
         }
         if (value & (1 << 26)) {
             armv7m_nvic_set_pending(s, ARMV7M_EXCP_SYSTICK);
         } else if (value & (1 << 25)) {
-            s->gic.irq_state[ARMV7M_EXCP_SYSTICK].pending = 0;
+            gic_clear_pending(&s->gic, ARMV7M_EXCP_SYSTICK, ALL_CPU_MASK);
             gic_update(&s->gic);
         }
         break;
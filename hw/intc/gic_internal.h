@@ -32,8 +32,8 @@
 #define GIC_SET_ENABLED(irq, cm) s->irq_state[irq].enabled |= (cm)
 #define GIC_CLEAR_ENABLED(irq, cm) s->irq_state[irq].enabled &= ~(cm)
 #define GIC_TEST_ENABLED(irq, cm) ((s->irq_state[irq].enabled & (cm)) != 0)
-#define GIC_SET_PENDING(irq, cm) s->irq_state[irq].pending |= (cm)
-#define GIC_CLEAR_PENDING(irq, cm) s->irq_state[irq].pending &= ~(cm)
+#define GIC_SET_PENDING(irq, cm) gic_set_pending(s, irq, cm)
+#define GIC_CLEAR_PENDING(irq, cm) gic_clear_pending(s, irq, cm)
 #define GIC_TEST_PENDING(irq, cm) ((s->irq_state[irq].pending & (cm)) != 0)
 #define GIC_SET_ACTIVE(irq, cm) s->irq_state[irq].active |= (cm)
 #define GIC_CLEAR_ACTIVE(irq, cm) s->irq_state[irq].active &= ~(cm)
@@ -56,6 +56,26 @@
 #define REV_11MPCORE 0
 #define REV_NVIC 0xffffffff
 
+/* The pending bits must only be changed through these two functions, so
+ * that pending_irqs stays in sync and gic_update() can skip interrupts
+ * that are not pending anywhere.
+ */
+static inline void gic_set_pending(GICState *s, int irq, int cm)
+{
+    s->irq_state[irq].pending |= cm;
+    if (s->irq_state[irq].pending) {
+        set_bit(irq, s->pending_irqs);
+    }
+}
+
+static inline void gic_clear_pending(GICState *s, int irq, int cm)
+{
+    s->irq_state[irq].pending &= ~cm;
+    if (!s->irq_state[irq].pending) {
+        clear_bit(irq, s->pending_irqs);
+    }
+}
+
 void gic_set_pending_private(GICState *s, int cpu, int irq);
 uint32_t gic_acknowledge_irq(GICState *s, int cpu);
 void gic_complete_irq(GICState *s, int cpu, int irq);
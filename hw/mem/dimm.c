@@ -0,0 +1,283 @@
+/*
+ * Hot-pluggable memory DIMMs
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "hw/hw.h"
+#include "hw/mem/dimm.h"
+#include "qemu/bitmap.h"
+#include "sysemu/sysemu.h"
+
+DimmBus *dimm_bus_create(DeviceState *parent, MemoryRegion *container,
+                         hwaddr base, int slots)
+{
+    DimmBus *bus;
+
+    bus = DIMM_BUS(qbus_create(TYPE_DIMM_BUS, parent, "dimm.0"));
+    bus->container = container;
+    bus->base = base;
+    bus->size = memory_region_size(container);
+    bus->slots = slots;
+    return bus;
+}
+
+void dimm_bus_hotplug(DimmBus *bus, dimm_hotplug_fn hotplug,
+                      DeviceState *dev)
+{
+    bus->qbus.allow_hotplug = 1;
+    bus->hotplug = hotplug;
+    bus->hotplug_dev = dev;
+}
+
+DimmDevice *dimm_find_slot(DimmBus *bus, int slot)
+{
+    BusChild *kid;
+
+    QTAILQ_FOREACH(kid, &bus->qbus.children, sibling) {
+        DimmDevice *dimm = DIMM(kid->child);
+
+        if (kid->child->realized && dimm->slot == slot) {
+            return dimm;
+        }
+    }
+    return NULL;
+}
+
+/* The plugged DIMM that overlaps [addr, addr + size), or NULL */
+static DimmDevice *dimm_find_range(DimmBus *bus, uint64_t addr,
+                                   uint64_t size)
+{
+    BusChild *kid;
+
+    QTAILQ_FOREACH(kid, &bus->qbus.children, sibling) {
+        DimmDevice *dimm = DIMM(kid->child);
+
+        if (kid->child->realized &&
+            addr < dimm->addr + dimm->size && dimm->addr < addr + size) {
+            return dimm;
+        }
+    }
+    return NULL;
+}
+
+static void dimm_assign_slot(DimmBus *bus, DimmDevice *dimm, Error **errp)
+{
+    int slot;
+
+    if (dimm->slot == -1) {
+        for (slot = 0; slot < bus->slots; slot++) {
+            if (!dimm_find_slot(bus, slot)) {
+                dimm->slot = slot;
+                return;
+            }
+        }
+        error_setg(errp, "all %d memory slots are in use", bus->slots);
+        return;
+    }
+
+    if (dimm->slot < 0 || dimm->slot >= bus->slots) {
+        error_setg(errp, "memory slot %d does not exist, the machine has %d",
+                   dimm->slot, bus->slots);
+    } else if (dimm_find_slot(bus, dimm->slot)) {
+        error_setg(errp, "memory slot %d is in use", dimm->slot);
+    }
+}
+
+/* First fit, unless the user chose the address */
+static void dimm_assign_addr(DimmBus *bus, DimmDevice *dimm, Error **errp)
+{
+    DimmDevice *other;
+    uint64_t addr;
+
+    if (dimm->addr) {
+        if (dimm->addr % DIMM_ALIGN) {
+            error_setg(errp, "dimm address must be a multiple of %" PRIu64
+                       " MB", DIMM_ALIGN >> 20);
+        } else if (dimm->addr < bus->base ||
+                   dimm->addr - bus->base + dimm->size > bus->size) {
+            error_setg(errp, "dimm does not fit in the hotplug memory range "
+                       "0x%" PRIx64 "-0x%" PRIx64, (uint64_t)bus->base,
+                       bus->base + bus->size - 1);
+        } else if (dimm_find_range(bus, dimm->addr, dimm->size)) {
+            error_setg(errp, "dimm at 0x%" PRIx64 " overlaps another one",
+                       dimm->addr);
+        }
+        return;
+    }
+
+    addr = bus->base;
+    while ((other = dimm_find_range(bus, addr, dimm->size))) {
+        addr = other->addr + other->size;
+    }
+    if (addr - bus->base + dimm->size > bus->size) {
+        error_setg(errp, "not enough hotplug memory left for a %" PRIu64
+                   " MB dimm, see -m maxmem", dimm->size >> 20);
+        return;
+    }
+    dimm->addr = addr;
+}
+
+static void dimm_parse_policy(DimmDevice *dimm, HostMemPolicy *policy,
+                              Error **errp)
+{
+    unsigned long long first, last;
+    char *end;
+
+    memset(policy, 0, sizeof(*policy));
+    policy->mem_path = dimm->mem_path;
+
+    if (dimm->host_nodes) {
+        if (parse_uint(dimm->host_nodes, &first, &end, 10) < 0) {
+            goto bad_nodes;
+        }
+        if (*end == '-') {
+            if (parse_uint_full(end + 1, &last, 10) < 0) {
+                goto bad_nodes;
+            }
+        } else if (*end == '\0') {
+            last = first;
+        } else {
+            goto bad_nodes;
+        }
+        if (last >= MAX_HOST_NODES || last < first) {
+            goto bad_nodes;
+        }
+        bitmap_set(policy->nodes, first, last - first + 1);
+        policy->mode = HOST_MEM_POLICY_BIND;
+    }
+
+    if (!dimm->policy) {
+        /* as given by host-nodes */
+    } else if (!strcmp(dimm->policy, "default")) {
+        policy->mode = HOST_MEM_POLICY_DEFAULT;
+    } else if (!strcmp(dimm->policy, "preferred")) {
+        policy->mode = HOST_MEM_POLICY_PREFERRED;
+    } else if (!strcmp(dimm->policy, "bind")) {
+        policy->mode = HOST_MEM_POLICY_BIND;
+    } else if (!strcmp(dimm->policy, "interleave")) {
+        policy->mode = HOST_MEM_POLICY_INTERLEAVE;
+    } else {
+        error_setg(errp, "invalid memory policy: %s", dimm->policy);
+        return;
+    }
+
+    if ((policy->mode == HOST_MEM_POLICY_BIND ||
+         policy->mode == HOST_MEM_POLICY_INTERLEAVE) &&
+        bitmap_empty(policy->nodes, MAX_HOST_NODES)) {
+        error_setg(errp, "memory policy %s needs host-nodes", dimm->policy);
+    }
+    return;
+
+bad_nodes:
+    error_setg(errp, "invalid host node range: %s", dimm->host_nodes);
+}
+
+static void dimm_realize(DeviceState *dev, Error **errp)
+{
+    DimmDevice *dimm = DIMM(dev);
+    DimmBus *bus = DIMM_BUS(qdev_get_parent_bus(dev));
+    HostMemPolicy policy;
+    Error *local_err = NULL;
+    char *name;
+
+    if (!dimm->size || dimm->size % DIMM_ALIGN) {
+        error_setg(errp, "dimm size must be a non-zero multiple of %" PRIu64
+                   " MB", DIMM_ALIGN >> 20);
+        return;
+    }
+    if (dimm->node >= MAX(nb_numa_nodes, 1)) {
+        error_setg(errp, "dimm node %" PRIu32 " does not exist", dimm->node);
+        return;
+    }
+
+    dimm_parse_policy(dimm, &policy, &local_err);
+    if (!local_err) {
+        dimm_assign_slot(bus, dimm, &local_err);
+    }
+    if (!local_err) {
+        dimm_assign_addr(bus, dimm, &local_err);
+    }
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    name = g_strdup_printf("dimm%d", dimm->slot);
+    memory_region_init_ram_policy(&dimm->mr, OBJECT(dev), name, dimm->size,
+                                  &policy);
+    g_free(name);
+    vmstate_register_ram(&dimm->mr, dev);
+    memory_region_add_subregion(bus->container, dimm->addr - bus->base,
+                                &dimm->mr);
+
+    if (bus->hotplug) {
+        bus->hotplug(bus->hotplug_dev, dimm, true);
+    }
+}
+
+static void dimm_unrealize(DeviceState *dev, Error **errp)
+{
+    DimmDevice *dimm = DIMM(dev);
+    DimmBus *bus = DIMM_BUS(qdev_get_parent_bus(dev));
+
+    memory_region_del_subregion(bus->container, &dimm->mr);
+    vmstate_unregister_ram(&dimm->mr, dev);
+    memory_region_destroy(&dimm->mr);
+}
+
+/* Ask the guest to release the memory; it is removed on eject */
+static int dimm_unplug(DeviceState *dev)
+{
+    DimmDevice *dimm = DIMM(dev);
+    DimmBus *bus = DIMM_BUS(qdev_get_parent_bus(dev));
+
+    return bus->hotplug(bus->hotplug_dev, dimm, false);
+}
+
+static Property dimm_properties[] = {
+    DEFINE_PROP_UINT64("addr", DimmDevice, addr, 0),
+    DEFINE_PROP_INT32("slot", DimmDevice, slot, -1),
+    DEFINE_PROP_SIZE("size", DimmDevice, size, 0),
+    DEFINE_PROP_UINT32("node", DimmDevice, node, 0),
+    DEFINE_PROP_STRING("mem-path", DimmDevice, mem_path),
+    DEFINE_PROP_STRING("host-nodes", DimmDevice, host_nodes),
+    DEFINE_PROP_STRING("policy", DimmDevice, policy),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void dimm_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = dimm_realize;
+    dc->unrealize = dimm_unrealize;
+    dc->unplug = dimm_unplug;
+    dc->bus_type = TYPE_DIMM_BUS;
+    dc->props = dimm_properties;
+    dc->desc = "memory DIMM";
+}
+
+static const TypeInfo dimm_info = {
+    .name          = TYPE_DIMM,
+    .parent        = TYPE_DEVICE,
+    .instance_size = sizeof(DimmDevice),
+    .class_init    = dimm_class_init,
+};
+
+static const TypeInfo dimm_bus_info = {
+    .name          = TYPE_DIMM_BUS,
+    .parent        = TYPE_BUS,
+    .instance_size = sizeof(DimmBus),
+};
+
+static void dimm_register_types(void)
+{
+    type_register_static(&dimm_bus_info);
+    type_register_static(&dimm_info);
+}
+
+type_init(dimm_register_types)
@@ -0,0 +1,510 @@
+/*
+ * Dedicated threads for virtio-net packet processing
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "qemu/iov.h"
+#include "qemu/thread.h"
+#include "qemu/error-report.h"
+#include "hw/virtio/dataplane/vring.h"
+#include "hw/virtio/virtio-net.h"
+#include "hw/virtio/virtio-bus.h"
+#include "net/net.h"
+#include "net/tap.h"
+#include "virtio-net.h"
+#include "block/aio.h"
+#include "qemu/rcu.h"
+
+enum {
+    VRING_MAX = VIRTQUEUE_MAX_SIZE, /* maximum number of vring descriptors */
+    RX_BURST = 256,                 /* packets received per fd event */
+};
+
+/* Per-queue-pair state.  Every queue pair has its own AioContext and
+ * thread, which own both virtqueues and the tap file descriptor.
+ */
+typedef struct {
+    VirtIONetDataPlane *s;
+    unsigned int index;             /* queue pair index */
+
+    AioContext *ctx;
+    QemuThread thread;
+
+    NetClientState *peer;           /* tap backend of this queue pair */
+    int fd;                         /* tap file descriptor */
+
+    Vring rx_vring;
+    Vring tx_vring;
+    EventNotifier *rx_guest_notifier;   /* irq */
+    EventNotifier *tx_guest_notifier;
+
+    /* Note that these EventNotifiers are assigned by value.  This is
+     * fine as long as you do not call event_notifier_cleanup on them
+     * (because you don't own the file descriptor or handle; you just
+     * use it).
+     */
+    EventNotifier rx_host_notifier;     /* doorbell */
+    EventNotifier tx_host_notifier;
+
+    bool rx_waiting;                /* out of rx buffers, tap not polled */
+    bool tx_waiting;                /* tap is full, waiting for POLLOUT */
+
+    /* Packet that could not be written to the tap yet */
+    int tx_head;
+    struct iovec *tx_sg;
+    unsigned int tx_sg_num;
+
+    struct iovec rx_iov[VRING_MAX];
+    struct iovec tx_iov[VRING_MAX];
+} VirtIONetDataPlaneQueue;
+
+struct VirtIONetDataPlane {
+    bool started;
+    bool stopping;
+    QEMUBH *start_bh;
+
+    VirtIONet *n;
+    VirtIODevice *vdev;
+
+    /* The tap has no vnet header, so it is added on receive and stripped
+     * on transmit here.
+     */
+    bool fill_hdr;
+    size_t guest_hdr_len;
+
+    unsigned int num_queues;        /* running queue pairs */
+    VirtIONetDataPlaneQueue *queues;
+};
+
+static void handle_rx(void *opaque);
+static void handle_tx_writable(void *opaque);
+
+/* Raise an interrupt to signal guest, if necessary */
+static void notify_guest(VirtIONetDataPlane *s, Vring *vring,
+                         EventNotifier *notifier)
+{
+    if (!vring_should_notify(s->vdev, vring)) {
+        return;
+    }
+
+    event_notifier_set(notifier);
+}
+
+static void update_fd_handler(VirtIONetDataPlaneQueue *q)
+{
+    aio_set_fd_handler(q->ctx, q->fd,
+                       q->rx_waiting ? NULL : handle_rx,
+                       q->tx_waiting ? handle_tx_writable : NULL,
+                       q);
+}
+
+/* Copy packets from the tap straight into guest rx buffers */
+static void handle_rx(void *opaque)
+{
+    static const struct virtio_net_hdr zero_hdr = {
+        .gso_type = VIRTIO_NET_HDR_GSO_NONE,
+    };
+    VirtIONetDataPlaneQueue *q = opaque;
+    VirtIONetDataPlane *s = q->s;
+    unsigned int out_num, in_num, count = 0;
+    struct iovec *sg;
+    ssize_t len;
+    int head;
+
+    vring_disable_notification(s->vdev, &q->rx_vring);
+    while (count < RX_BURST) {
+        head = vring_pop(s->vdev, &q->rx_vring, q->rx_iov,
+                         &q->rx_iov[VRING_MAX], &out_num, &in_num);
+        if (head == -EAGAIN) {
+            /* Stop polling the tap until the guest adds buffers, unless
+             * it has snuck some in already.
+             */
+            if (vring_enable_notification(s->vdev, &q->rx_vring)) {
+                q->rx_waiting = true;
+                update_fd_handler(q);
+                break;
+            }
+            vring_disable_notification(s->vdev, &q->rx_vring);
+            continue;
+        }
+        if (head < 0 || out_num) {
+            vring_set_broken(&q->rx_vring);
+            q->rx_waiting = true;
+            update_fd_handler(q);
+            break;
+        }
+
+        sg = q->rx_iov;
+        if (s->fill_hdr) {
+            iov_from_buf(sg, in_num, 0, &zero_hdr, s->guest_hdr_len);
+            iov_discard_front(&sg, &in_num, s->guest_hdr_len);
+        }
+
+        do {
+            len = readv(q->fd, sg, in_num);
+        } while (len < 0 && errno == EINTR);
+        if (len < 0) {
+            /* Nothing to read; keep the buffer for the next packet */
+            vring_unpop(&q->rx_vring);
+            break;
+        }
+
+        if (s->fill_hdr) {
+            len += s->guest_hdr_len;
+        }
+        vring_push(&q->rx_vring, head, len);
+        count++;
+    }
+
+    if (count) {
+        trace_virtio_net_data_plane_rx(s, q->index, count);
+        notify_guest(s, &q->rx_vring, q->rx_guest_notifier);
+    }
+}
+
+/* The guest added rx buffers */
+static void handle_rx_kick(EventNotifier *e)
+{
+    VirtIONetDataPlaneQueue *q = container_of(e, VirtIONetDataPlaneQueue,
+                                              rx_host_notifier);
+
+    event_notifier_test_and_clear(e);
+    if (!q->rx_waiting) {
+        return;
+    }
+
+    /* Packets that piled up in the tap are read on the next aio_poll() */
+    vring_disable_notification(q->s->vdev, &q->rx_vring);
+    q->rx_waiting = false;
+    update_fd_handler(q);
+}
+
+static void handle_tx(VirtIONetDataPlaneQueue *q)
+{
+    VirtIONetDataPlane *s = q->s;
+    unsigned int out_num, in_num, count = 0;
+    ssize_t ret;
+    int head;
+
+    vring_disable_notification(s->vdev, &q->tx_vring);
+    for (;;) {
+        if (q->tx_head < 0) {
+            head = vring_pop(s->vdev, &q->tx_vring, q->tx_iov,
+                             &q->tx_iov[VRING_MAX], &out_num, &in_num);
+            if (head == -EAGAIN) {
+                /* Re-enable guest->host notifies and stop processing the
+                 * vring.  But if the guest has snuck in more descriptors,
+                 * keep processing.
+                 */
+                if (vring_enable_notification(s->vdev, &q->tx_vring)) {
+                    break;
+                }
+                vring_disable_notification(s->vdev, &q->tx_vring);
+                continue;
+            }
+            if (head < 0 || in_num) {
+                vring_set_broken(&q->tx_vring);
+                break;
+            }
+
+            q->tx_head = head;
+            q->tx_sg = q->tx_iov;
+            q->tx_sg_num = out_num;
+            if (s->fill_hdr) {
+                iov_discard_front(&q->tx_sg, &q->tx_sg_num, s->guest_hdr_len);
+            }
+        }
+
+        do {
+            ret = writev(q->fd, q->tx_sg, q->tx_sg_num);
+        } while (ret < 0 && errno == EINTR);
+        if (ret < 0 && errno == EAGAIN) {
+            /* Keep the packet and retry once the tap drains */
+            q->tx_waiting = true;
+            update_fd_handler(q);
+            break;
+        }
+
+        /* Like tap_write_packet(), other errors drop the packet */
+        vring_push(&q->tx_vring, q->tx_head, 0);
+        q->tx_head = -1;
+
+        if (++count >= s->n->tx_burst) {
+            /* Give rx a chance; notifies stay off until we come back */
+            event_notifier_set(&q->tx_host_notifier);
+            break;
+        }
+    }
+
+    if (count) {
+        trace_virtio_net_data_plane_tx(s, q->index, count);
+        notify_guest(s, &q->tx_vring, q->tx_guest_notifier);
+    }
+}
+
+static void handle_tx_kick(EventNotifier *e)
+{
+    VirtIONetDataPlaneQueue *q = container_of(e, VirtIONetDataPlaneQueue,
+                                              tx_host_notifier);
+
+    event_notifier_test_and_clear(e);
+    if (q->tx_waiting) {
+        return; /* handle_tx_writable() picks up the vring */
+    }
+    handle_tx(q);
+}
+
+static void handle_tx_writable(void *opaque)
+{
+    VirtIONetDataPlaneQueue *q = opaque;
+
+    q->tx_waiting = false;
+    update_fd_handler(q);
+    handle_tx(q);
+}
+
+static void *data_plane_thread(void *opaque)
+{
+    VirtIONetDataPlaneQueue *q = opaque;
+    VirtIONetDataPlane *s = q->s;
+
+    rcu_register_thread();
+
+    while (!s->stopping) {
+        aio_context_acquire(q->ctx);
+        while (!s->stopping && aio_poll(q->ctx, true)) {
+            /* Progress was made, keep going */
+        }
+        aio_context_release(q->ctx);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void start_data_plane_bh(void *opaque)
+{
+    VirtIONetDataPlane *s = opaque;
+    unsigned int i;
+
+    qemu_bh_delete(s->start_bh);
+    s->start_bh = NULL;
+    for (i = 0; i < s->num_queues; i++) {
+        qemu_thread_create(&s->queues[i].thread, data_plane_thread,
+                           &s->queues[i], QEMU_THREAD_JOINABLE);
+    }
+}
+
+void virtio_net_data_plane_create(VirtIONet *n,
+                                  VirtIONetDataPlane **dataplane,
+                                  Error **errp)
+{
+    VirtIONetDataPlane *s;
+    NetClientState *peer;
+    unsigned int i;
+
+    *dataplane = NULL;
+
+    if (!n->net_conf.data_plane) {
+        return;
+    }
+
+    /* Packets go straight between the vrings and the tap file descriptor,
+     * so every queue needs a tap of its own.
+     */
+    for (i = 0; i < n->max_queues; i++) {
+        peer = n->nic_conf.peers.ncs[i];
+        if (!peer || peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
+            error_setg(errp, "x-data-plane requires a tap network backend");
+            return;
+        }
+        if (tap_get_vhost_net(peer)) {
+            error_setg(errp, "device is incompatible with x-data-plane, "
+                             "use vhost=off");
+            return;
+        }
+    }
+
+    s = g_new0(VirtIONetDataPlane, 1);
+    s->n = n;
+    s->vdev = VIRTIO_DEVICE(n);
+    s->queues = g_new0(VirtIONetDataPlaneQueue, n->max_queues);
+    for (i = 0; i < n->max_queues; i++) {
+        s->queues[i].s = s;
+        s->queues[i].index = i;
+    }
+
+    *dataplane = s;
+}
+
+void virtio_net_data_plane_destroy(VirtIONetDataPlane *s)
+{
+    if (!s) {
+        return;
+    }
+
+    virtio_net_data_plane_stop(s);
+    g_free(s->queues);
+    g_free(s);
+}
+
+bool virtio_net_data_plane_start(VirtIONetDataPlane *s,
+                                 unsigned int num_queues)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIONet *n = s->n;
+    VirtIONetDataPlaneQueue *q;
+    VirtQueue *vq;
+    unsigned int i;
+
+    if (s->started) {
+        return true;
+    }
+
+    /* The tap must produce exactly the header the guest expects, or none
+     * at all.  Mergeable rx buffers are not offered with x-data-plane.
+     */
+    if (n->mergeable_rx_bufs ||
+        (n->host_hdr_len && n->host_hdr_len != n->guest_hdr_len)) {
+        error_report("virtio-net: tap header does not match the guest, "
+                     "not starting dataplane");
+        return false;
+    }
+    s->fill_hdr = !n->host_hdr_len;
+    s->guest_hdr_len = n->guest_hdr_len;
+
+    for (i = 0; i < num_queues * 2; i++) {
+        q = &s->queues[i / 2];
+        if (!vring_setup(i % 2 ? &q->tx_vring : &q->rx_vring, s->vdev, i)) {
+            while (i-- > 0) {
+                q = &s->queues[i / 2];
+                vring_teardown(i % 2 ? &q->tx_vring : &q->rx_vring,
+                               s->vdev, i);
+            }
+            return false;
+        }
+    }
+
+    /* Set up guest notifiers (irq) */
+    if (k->set_guest_notifiers(qbus->parent, num_queues * 2, true) != 0) {
+        fprintf(stderr, "virtio-net failed to set guest notifier, "
+                "ensure -enable-kvm is set\n");
+        exit(1);
+    }
+
+    for (i = 0; i < num_queues; i++) {
+        q = &s->queues[i];
+        q->ctx = aio_context_new();
+
+        /* From now on the tap is only touched from this queue's thread */
+        q->peer = qemu_get_subqueue(n->nic, i)->peer;
+        q->peer->info->poll(q->peer, false);
+        q->fd = tap_get_fd(q->peer);
+
+        /* Set up virtqueue notify */
+        if (k->set_host_notifier(qbus->parent, i * 2, true) != 0 ||
+            k->set_host_notifier(qbus->parent, i * 2 + 1, true) != 0) {
+            fprintf(stderr, "virtio-net failed to set host notifier\n");
+            exit(1);
+        }
+
+        vq = virtio_get_queue(s->vdev, i * 2);
+        q->rx_guest_notifier = virtio_queue_get_guest_notifier(vq);
+        q->rx_host_notifier = *virtio_queue_get_host_notifier(vq);
+        aio_set_event_notifier(q->ctx, &q->rx_host_notifier, handle_rx_kick);
+
+        vq = virtio_get_queue(s->vdev, i * 2 + 1);
+        q->tx_guest_notifier = virtio_queue_get_guest_notifier(vq);
+        q->tx_host_notifier = *virtio_queue_get_host_notifier(vq);
+        aio_set_event_notifier(q->ctx, &q->tx_host_notifier, handle_tx_kick);
+
+        q->rx_waiting = false;
+        q->tx_waiting = false;
+        q->tx_head = -1;
+        update_fd_handler(q);
+    }
+
+    s->num_queues = num_queues;
+    s->started = true;
+    trace_virtio_net_data_plane_start(s, num_queues);
+
+    /* Kick right away to begin processing packets already in vrings */
+    for (i = 0; i < num_queues; i++) {
+        event_notifier_set(&s->queues[i].tx_host_notifier);
+    }
+
+    /* Spawn threads in BH so they inherit iothread cpusets */
+    s->start_bh = qemu_bh_new(start_data_plane_bh, s);
+    qemu_bh_schedule(s->start_bh);
+    return true;
+}
+
+void virtio_net_data_plane_stop(VirtIONetDataPlane *s)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIONetDataPlaneQueue *q;
+    unsigned int i;
+
+    if (!s->started || s->stopping) {
+        return;
+    }
+    trace_virtio_net_data_plane_stop(s);
+
+    /* Stop threads or cancel pending thread creation BH */
+    s->stopping = true;
+    if (s->start_bh) {
+        qemu_bh_delete(s->start_bh);
+        s->start_bh = NULL;
+    } else {
+        for (i = 0; i < s->num_queues; i++) {
+            aio_notify(s->queues[i].ctx);
+        }
+        for (i = 0; i < s->num_queues; i++) {
+            qemu_thread_join(&s->queues[i].thread);
+        }
+    }
+
+    for (i = 0; i < s->num_queues; i++) {
+        q = &s->queues[i];
+
+        aio_set_fd_handler(q->ctx, q->fd, NULL, NULL, NULL);
+        aio_set_event_notifier(q->ctx, &q->rx_host_notifier, NULL);
+        aio_set_event_notifier(q->ctx, &q->tx_host_notifier, NULL);
+        k->set_host_notifier(qbus->parent, i * 2, false);
+        k->set_host_notifier(qbus->parent, i * 2 + 1, false);
+        aio_context_unref(q->ctx);
+        q->ctx = NULL;
+
+        /* The main loop sends the pending packet again */
+        if (q->tx_head >= 0) {
+            vring_unpop(&q->tx_vring);
+            q->tx_head = -1;
+        }
+
+        /* The main loop relies on guest notifies */
+        vring_enable_notification(s->vdev, &q->rx_vring);
+        vring_enable_notification(s->vdev, &q->tx_vring);
+    }
+
+    /* Clean up guest notifiers (irq) */
+    k->set_guest_notifiers(qbus->parent, s->num_queues * 2, false);
+
+    for (i = 0; i < s->num_queues; i++) {
+        q = &s->queues[i];
+        vring_teardown(&q->rx_vring, s->vdev, i * 2);
+        vring_teardown(&q->tx_vring, s->vdev, i * 2 + 1);
+        q->peer->info->poll(q->peer, true);
+    }
+
+    s->num_queues = 0;
+    s->started = false;
+    s->stopping = false;
+}
@@ -0,0 +1,26 @@
+/*
+ * Dedicated threads for virtio-net packet processing
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HW_DATAPLANE_VIRTIO_NET_H
+#define HW_DATAPLANE_VIRTIO_NET_H
+
+#include "hw/virtio/virtio-net.h"
+
+typedef struct VirtIONetDataPlane VirtIONetDataPlane;
+
+void virtio_net_data_plane_create(VirtIONet *n,
+                                  VirtIONetDataPlane **dataplane,
+                                  Error **errp);
+void virtio_net_data_plane_destroy(VirtIONetDataPlane *s);
+bool virtio_net_data_plane_start(VirtIONetDataPlane *s,
+                                 unsigned int num_queues);
+void virtio_net_data_plane_stop(VirtIONetDataPlane *s);
+
+#endif /* HW_DATAPLANE_VIRTIO_NET_H */
@@ -67,6 +67,9 @@ static int debugflags = DBGBIT(TXERR) | DBGBIT(GENERAL);
 
 #define MAXIMUM_ETHERNET_HDR_LEN (14+4)
 
+/* Descriptors read with a single DMA */
+#define E1000_DESC_BATCH 16
+
 /*
  * HW models:
  *  E1000_DEV_ID_82540EM works with Windows and Linux
@@ -143,11 +146,27 @@ typedef struct E1000State_st {
     bool mit_irq_level;        /* Tracks interrupt pin level. */
     uint32_t mit_ide;          /* Tracks E1000_TXD_CMD_IDE bit. */
 
+    /* Interrupt delay timers: RDTR/TIDV restart with every packet, and
+     * RADV/TADV bound the delay from the first one (the deadline).
+     */
+    QEMUTimer *rx_delay_timer;
+    int64_t rx_delay_deadline; /* 0 if no RXT0 is being delayed. */
+    QEMUTimer *tx_delay_timer;
+    int64_t tx_delay_deadline; /* 0 if no TXDW is being delayed. */
+
+    /* Receive descriptors prefetched from RDH, like the on-chip cache. */
+    struct e1000_rx_desc rx_desc_cache[E1000_DESC_BATCH];
+    uint32_t rx_desc_cache_pos; /* Next entry to use... */
+    uint32_t rx_desc_cache_len; /* ...out of this many valid entries. */
+    uint32_t rx_desc_cache_rdh; /* Ring index of the next entry. */
+
 /* Compatibility flags for migration to/from qemu 1.3.0 and older */
 #define E1000_FLAG_AUTONEG_BIT 0
 #define E1000_FLAG_MIT_BIT 1
+#define E1000_FLAG_DELAY_BIT 2
 #define E1000_FLAG_AUTONEG (1 << E1000_FLAG_AUTONEG_BIT)
 #define E1000_FLAG_MIT (1 << E1000_FLAG_MIT_BIT)
+#define E1000_FLAG_DELAY (1 << E1000_FLAG_DELAY_BIT)
     uint32_t compat_flags;
 } E1000State;
 
@@ -169,7 +188,7 @@ enum {
     defreg(TPR),	defreg(TPT),	defreg(TXDCTL),	defreg(WUFC),
     defreg(RA),		defreg(MTA),	defreg(CRCERRS),defreg(VFTA),
     defreg(VET),        defreg(RDTR),   defreg(RADV),   defreg(TADV),
-    defreg(ITR),
+    defreg(ITR),        defreg(TIDV),
 };
 
 static void
@@ -294,10 +313,11 @@ set_interrupt_cause(E1000State *s, int index, uint32_t val)
          * Here we detect a potential raising edge. We postpone raising the
          * interrupt line if we are inside the mitigation delay window
          * (s->mit_timer_on == 1).
-         * We provide a partial implementation of interrupt mitigation,
-         * emulating only RADV, TADV and ITR (lower 16 bits, 1024ns units for
-         * RADV and TADV, 256ns units for ITR). RDTR is only used to enable
-         * RADV; relative timers based on TIDV and RDTR are not implemented.
+         * ITR is emulated here (lower 16 bits, 256ns units).  With the
+         * "interrupt-delay" property, RXT0 and TXDW are in addition delayed
+         * by the RDTR/RADV and TIDV/TADV timers before they get here;
+         * without it, RADV and TADV (1024ns units) only extend the window
+         * below.
          */
         if (s->mit_timer_on) {
             return;
@@ -309,12 +329,14 @@ set_interrupt_cause(E1000State *s, int index, uint32_t val)
              * Then rearm the timer.
              */
             mit_delay = 0;
-            if (s->mit_ide &&
-                    (pending_ints & (E1000_ICR_TXQE | E1000_ICR_TXDW))) {
-                mit_update_delay(&mit_delay, s->mac_reg[TADV] * 4);
-            }
-            if (s->mac_reg[RDTR] && (pending_ints & E1000_ICS_RXT0)) {
-                mit_update_delay(&mit_delay, s->mac_reg[RADV] * 4);
+            if (!(s->compat_flags & E1000_FLAG_DELAY)) {
+                if (s->mit_ide &&
+                        (pending_ints & (E1000_ICR_TXQE | E1000_ICR_TXDW))) {
+                    mit_update_delay(&mit_delay, s->mac_reg[TADV] * 4);
+                }
+                if (s->mac_reg[RDTR] && (pending_ints & E1000_ICS_RXT0)) {
+                    mit_update_delay(&mit_delay, s->mac_reg[RADV] * 4);
+                }
             }
             mit_update_delay(&mit_delay, s->mac_reg[ITR]);
 
@@ -349,6 +371,80 @@ set_ics(E1000State *s, int index, uint32_t val)
     set_interrupt_cause(s, 0, val | s->mac_reg[ICR]);
 }
 
+static inline bool
+e1000_delay_enabled(E1000State *s)
+{
+    return (s->compat_flags & (E1000_FLAG_MIT | E1000_FLAG_DELAY)) ==
+           (E1000_FLAG_MIT | E1000_FLAG_DELAY);
+}
+
+/*
+ * Postpone an interrupt cause by @delay, restarting the countdown if it is
+ * already postponed, but no later than @abs_delay after it was first
+ * postponed.  Both are in 1024ns units, 0 for abs_delay meaning no bound.
+ * Returns false, and the cause should be raised now, if @delay is 0.
+ */
+static bool
+e1000_delay_cause(QEMUTimer *timer, int64_t *deadline,
+                  uint32_t delay, uint32_t abs_delay)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    if (!delay) {
+        return false;
+    }
+    if (!*deadline) {
+        *deadline = abs_delay ? now + abs_delay * 1024LL : INT64_MAX;
+    }
+    timer_mod(timer, MIN(now + delay * 1024LL, *deadline));
+    return true;
+}
+
+static void
+e1000_rx_delay_timer(void *opaque)
+{
+    E1000State *s = opaque;
+
+    s->rx_delay_deadline = 0;
+    set_ics(s, 0, E1000_ICS_RXT0);
+}
+
+static void
+e1000_tx_delay_timer(void *opaque)
+{
+    E1000State *s = opaque;
+
+    s->tx_delay_deadline = 0;
+    set_ics(s, 0, E1000_ICR_TXDW);
+}
+
+static inline void
+e1000_rx_desc_cache_flush(E1000State *s)
+{
+    s->rx_desc_cache_pos = s->rx_desc_cache_len = 0;
+}
+
+/*
+ * Number of descriptors from @head that can be read at once: up to @tail
+ * or the end of the ring, whichever comes first, and at most
+ * E1000_DESC_BATCH.
+ */
+static uint32_t
+e1000_desc_batch(uint32_t head, uint32_t tail, uint32_t ndesc)
+{
+    uint32_t n;
+
+    if (head >= ndesc || head == tail) {
+        /* bogus ring setup, see start_xmit */
+        return 1;
+    }
+    n = ndesc - head;
+    if (tail > head) {
+        n = MIN(n, tail - head);
+    }
+    return MIN(n, E1000_DESC_BATCH);
+}
+
 static int
 rxbufsize(uint32_t v)
 {
@@ -380,9 +476,14 @@ static void e1000_reset(void *opaque)
 
     timer_del(d->autoneg_timer);
     timer_del(d->mit_timer);
+    timer_del(d->rx_delay_timer);
+    timer_del(d->tx_delay_timer);
     d->mit_timer_on = 0;
     d->mit_irq_level = 0;
     d->mit_ide = 0;
+    d->rx_delay_deadline = 0;
+    d->tx_delay_deadline = 0;
+    e1000_rx_desc_cache_flush(d);
     memset(d->phy_reg, 0, sizeof d->phy_reg);
     memmove(d->phy_reg, phy_reg_init, sizeof phy_reg_init);
     memset(d->mac_reg, 0, sizeof d->mac_reg);
@@ -415,6 +516,7 @@ static void
 set_rx_control(E1000State *s, int index, uint32_t val)
 {
     s->mac_reg[RCTL] = val;
+    e1000_rx_desc_cache_flush(s);
     s->rxbuf_size = rxbufsize(val);
     s->rxbuf_min_shift = ((val / E1000_RCTL_RDMTS_QUAT) & 3) + 1;
     DBGOUT(RX, "RCTL: %d, mac_reg[RCTL] = 0x%x\n", s->mac_reg[RDT],
@@ -758,8 +860,9 @@ start_xmit(E1000State *s)
 {
     PCIDevice *d = PCI_DEVICE(s);
     dma_addr_t base;
-    struct e1000_tx_desc desc;
+    struct e1000_tx_desc descs[E1000_DESC_BATCH], *desc;
     uint32_t tdh_start = s->mac_reg[TDH], cause = E1000_ICS_TXQE;
+    uint32_t n, i;
 
     if (!(s->mac_reg[TCTL] & E1000_TCTL_EN)) {
         DBGOUT(TX, "tx disabled\n");
@@ -767,29 +870,44 @@ start_xmit(E1000State *s)
     }
 
     while (s->mac_reg[TDH] != s->mac_reg[TDT]) {
+        /* Everything from TDH to TDT is ours, read it in one go */
+        n = e1000_desc_batch(s->mac_reg[TDH], s->mac_reg[TDT],
+                             s->mac_reg[TDLEN] / sizeof(*desc));
         base = tx_desc_base(s) +
                sizeof(struct e1000_tx_desc) * s->mac_reg[TDH];
-        pci_dma_read(d, base, &desc, sizeof(desc));
-
-        DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
-               (void *)(intptr_t)desc.buffer_addr, desc.lower.data,
-               desc.upper.data);
-
-        process_tx_desc(s, &desc);
-        cause |= txdesc_writeback(s, base, &desc);
-
-        if (++s->mac_reg[TDH] * sizeof(desc) >= s->mac_reg[TDLEN])
-            s->mac_reg[TDH] = 0;
-        /*
-         * the following could happen only if guest sw assigns
-         * bogus values to TDT/TDLEN.
-         * there's nothing too intelligent we could do about this.
-         */
-        if (s->mac_reg[TDH] == tdh_start) {
-            DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
-                   tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
-            break;
+        pci_dma_read(d, base, descs, n * sizeof(*desc));
+
+        for (i = 0, desc = descs; i < n; i++, desc++) {
+            DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
+                   (void *)(intptr_t)desc->buffer_addr, desc->lower.data,
+                   desc->upper.data);
+
+            process_tx_desc(s, desc);
+            cause |= txdesc_writeback(s, base + i * sizeof(*desc), desc);
+
+            if (++s->mac_reg[TDH] * sizeof(*desc) >= s->mac_reg[TDLEN])
+                s->mac_reg[TDH] = 0;
+            /*
+             * the following could happen only if guest sw assigns
+             * bogus values to TDT/TDLEN.
+             * there's nothing too intelligent we could do about this.
+             */
+            if (s->mac_reg[TDH] == tdh_start) {
+                DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
+                       tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
+                goto out;
+            }
+        }
+    }
+out:
+    if (e1000_delay_enabled(s)) {
+        /* TXDW of descriptors with IDE set waits for TIDV/TADV */
+        if ((cause & E1000_ICR_TXDW) && s->mit_ide &&
+            e1000_delay_cause(s->tx_delay_timer, &s->tx_delay_deadline,
+                              s->mac_reg[TIDV], s->mac_reg[TADV])) {
+            cause &= ~E1000_ICR_TXDW;
         }
+        s->mit_ide = 0;
     }
     set_ics(s, 0, cause);
 }
@@ -898,6 +1016,30 @@ static uint64_t rx_desc_base(E1000State *s)
     return (bah << 32) + bal;
 }
 
+/*
+ * Read the descriptor at RDH, located at @base.  The descriptors from RDH
+ * to RDT belong to the device, so a batch of them is read at once and
+ * used for the next packets, until the guest moves the ring.
+ */
+static void
+e1000_rx_desc_fetch(E1000State *s, dma_addr_t base, struct e1000_rx_desc *desc)
+{
+    uint32_t rdh = s->mac_reg[RDH];
+
+    if (s->rx_desc_cache_pos >= s->rx_desc_cache_len ||
+        s->rx_desc_cache_rdh != rdh) {
+        uint32_t n = e1000_desc_batch(rdh, s->mac_reg[RDT],
+                                      s->mac_reg[RDLEN] / sizeof(*desc));
+
+        pci_dma_read(PCI_DEVICE(s), base, s->rx_desc_cache,
+                     n * sizeof(*desc));
+        s->rx_desc_cache_pos = 0;
+        s->rx_desc_cache_len = n;
+    }
+    *desc = s->rx_desc_cache[s->rx_desc_cache_pos++];
+    s->rx_desc_cache_rdh = rdh + 1;
+}
+
 static ssize_t
 e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
@@ -982,7 +1124,7 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
             desc_size = s->rxbuf_size;
         }
         base = rx_desc_base(s) + sizeof(desc) * s->mac_reg[RDH];
-        pci_dma_read(d, base, &desc, sizeof(desc));
+        e1000_rx_desc_fetch(s, base, &desc);
         desc.special = vlan_special;
         desc.status |= (vlan_status | E1000_RXD_STAT_DD);
         if (desc.buffer_addr) {
@@ -1048,6 +1190,13 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
         s->rxbuf_min_shift)
         n |= E1000_ICS_RXDMT0;
 
+    /* RXT0 waits for RDTR/RADV, RXDMT0 is immediate */
+    if (e1000_delay_enabled(s) &&
+        e1000_delay_cause(s->rx_delay_timer, &s->rx_delay_deadline,
+                          s->mac_reg[RDTR], s->mac_reg[RADV])) {
+        n &= ~E1000_ICS_RXT0;
+    }
+
     set_ics(s, 0, n);
 
     return size;
@@ -1132,6 +1281,23 @@ static void
 set_dlen(E1000State *s, int index, uint32_t val)
 {
     s->mac_reg[index] = val & 0xfff80;
+    if (index == RDLEN) {
+        e1000_rx_desc_cache_flush(s);
+    }
+}
+
+static void
+set_rdh(E1000State *s, int index, uint32_t val)
+{
+    s->mac_reg[index] = val & 0xffff;
+    e1000_rx_desc_cache_flush(s);
+}
+
+static void
+set_rdba(E1000State *s, int index, uint32_t val)
+{
+    s->mac_reg[index] = val;
+    e1000_rx_desc_cache_flush(s);
 }
 
 static void
@@ -1172,7 +1338,7 @@ static uint32_t (*macreg_readops[])(E1000State *, int) = {
     getreg(RDH),	getreg(RDT),	getreg(VET),	getreg(ICS),
     getreg(TDBAL),	getreg(TDBAH),	getreg(RDBAH),	getreg(RDBAL),
     getreg(TDLEN),      getreg(RDLEN),  getreg(RDTR),   getreg(RADV),
-    getreg(TADV),       getreg(ITR),
+    getreg(TADV),       getreg(ITR),        getreg(TIDV),
 
     [TOTH] = mac_read_clr8,	[TORH] = mac_read_clr8,	[GPRC] = mac_read_clr4,
     [GPTC] = mac_read_clr4,	[TPR] = mac_read_clr4,	[TPT] = mac_read_clr4,
@@ -1187,15 +1353,15 @@ enum { NREADOPS = ARRAY_SIZE(macreg_readops) };
 #define putreg(x)	[x] = mac_writereg
 static void (*macreg_writeops[])(E1000State *, int, uint32_t) = {
     putreg(PBA),	putreg(EERD),	putreg(SWSM),	putreg(WUFC),
-    putreg(TDBAL),	putreg(TDBAH),	putreg(TXDCTL),	putreg(RDBAH),
-    putreg(RDBAL),	putreg(LEDCTL), putreg(VET),
+    putreg(TDBAL),	putreg(TDBAH),	putreg(TXDCTL),
+    putreg(LEDCTL),     putreg(VET),    [RDBAH] = set_rdba, [RDBAL] = set_rdba,
     [TDLEN] = set_dlen,	[RDLEN] = set_dlen,	[TCTL] = set_tctl,
     [TDT] = set_tctl,	[MDIC] = set_mdic,	[ICS] = set_ics,
-    [TDH] = set_16bit,	[RDH] = set_16bit,	[RDT] = set_rdt,
+    [TDH] = set_16bit,	[RDH] = set_rdh,	[RDT] = set_rdt,
     [IMC] = set_imc,	[IMS] = set_ims,	[ICR] = set_icr,
     [EECD] = set_eecd,	[RCTL] = set_rx_control, [CTRL] = set_ctrl,
     [RDTR] = set_16bit, [RADV] = set_16bit,     [TADV] = set_16bit,
-    [ITR] = set_16bit,
+    [ITR] = set_16bit,  [TIDV] = set_16bit,
     [RA ... RA+31] = &mac_writereg,
     [MTA ... MTA+127] = &mac_writereg,
     [VFTA ... VFTA+127] = &mac_writereg,
@@ -1277,6 +1443,16 @@ static void e1000_pre_save(void *opaque)
     E1000State *s = opaque;
     NetClientState *nc = qemu_get_queue(s->nic);
 
+    /* Delayed interrupts are raised now, as if the delay had expired. */
+    if (s->rx_delay_deadline) {
+        timer_del(s->rx_delay_timer);
+        e1000_rx_delay_timer(s);
+    }
+    if (s->tx_delay_deadline) {
+        timer_del(s->tx_delay_timer);
+        e1000_tx_delay_timer(s);
+    }
+
     /* If the mitigation timer is active, emulate a timeout now. */
     if (s->mit_timer_on) {
         e1000_mit_timer(s);
@@ -1308,8 +1484,12 @@ static int e1000_post_load(void *opaque, int version_id)
             s->mac_reg[TADV] = 0;
         s->mit_irq_level = false;
     }
+    if (!e1000_delay_enabled(s)) {
+        s->mac_reg[TIDV] = 0;
+    }
     s->mit_ide = 0;
     s->mit_timer_on = false;
+    e1000_rx_desc_cache_flush(s);
 
     /* nc.link_down can't be migrated, so infer link_down according
      * to link status bit in mac_reg[STATUS].
@@ -1352,6 +1532,24 @@ static const VMStateDescription vmstate_e1000_mit_state = {
     }
 };
 
+static bool e1000_delay_state_needed(void *opaque)
+{
+    E1000State *s = opaque;
+
+    return e1000_delay_enabled(s);
+}
+
+static const VMStateDescription vmstate_e1000_delay_state = {
+    .name = "e1000/delay_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields    = (VMStateField[]) {
+        VMSTATE_UINT32(mac_reg[TIDV], E1000State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_e1000 = {
     .name = "e1000",
     .version_id = 2,
@@ -1434,6 +1632,9 @@ static const VMStateDescription vmstate_e1000 = {
         {
             .vmsd = &vmstate_e1000_mit_state,
             .needed = e1000_mit_state_needed,
+        }, {
+            .vmsd = &vmstate_e1000_delay_state,
+            .needed = e1000_delay_state_needed,
         }, {
             /* empty */
         }
@@ -1488,6 +1689,10 @@ pci_e1000_uninit(PCIDevice *dev)
     timer_free(d->autoneg_timer);
     timer_del(d->mit_timer);
     timer_free(d->mit_timer);
+    timer_del(d->rx_delay_timer);
+    timer_free(d->rx_delay_timer);
+    timer_del(d->tx_delay_timer);
+    timer_free(d->tx_delay_timer);
     memory_region_destroy(&d->mmio);
     memory_region_destroy(&d->io);
     qemu_del_nic(d->nic);
@@ -1545,6 +1750,10 @@ static int pci_e1000_init(PCIDevice *pci_dev)
 
     d->autoneg_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, e1000_autoneg_timer, d);
     d->mit_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, e1000_mit_timer, d);
+    d->rx_delay_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                     e1000_rx_delay_timer, d);
+    d->tx_delay_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                     e1000_tx_delay_timer, d);
 
     return 0;
 }
@@ -1561,6 +1770,8 @@ static Property e1000_properties[] = {
                     compat_flags, E1000_FLAG_AUTONEG_BIT, true),
     DEFINE_PROP_BIT("mitigation", E1000State,
                     compat_flags, E1000_FLAG_MIT_BIT, true),
+    DEFINE_PROP_BIT("interrupt-delay", E1000State,
+                    compat_flags, E1000_FLAG_DELAY_BIT, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
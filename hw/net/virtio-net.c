@@ -23,10 +23,13 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qapi/qmp/qjson.h"
 #include "monitor/monitor.h"
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+# include "dataplane/virtio-net.h"
+# include "migration/migration.h"
+#endif
 
 #define VIRTIO_NET_VM_VERSION    11
 
-#define MAC_TABLE_ENTRIES    64
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
 /*
@@ -105,14 +108,7 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     NetClientState *nc = qemu_get_queue(n->nic);
     int queues = n->multiqueue ? n->max_queues : 1;
 
-    if (!nc->peer) {
-        return;
-    }
-    if (nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
-        return;
-    }
-
-    if (!tap_get_vhost_net(nc->peer)) {
+    if (!get_vhost_net(nc->peer)) {
         return;
     }
 
@@ -122,7 +118,7 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
     if (!n->vhost_started) {
         int r;
-        if (!vhost_net_query(tap_get_vhost_net(nc->peer), vdev)) {
+        if (!vhost_net_query(get_vhost_net(nc->peer), vdev)) {
             return;
         }
         n->vhost_started = 1;
@@ -138,6 +134,59 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
 }
 
+static bool virtio_net_data_plane_started(VirtIONet *n)
+{
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    return n->dataplane_queues != 0;
+#else
+    return false;
+#endif
+}
+
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+static void virtio_net_data_plane_halt(VirtIONet *n, bool kick)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int i, queues = n->dataplane_queues;
+
+    virtio_net_data_plane_stop(n->dataplane);
+    n->dataplane_queues = 0;
+    if (kick) {
+        /* Let the main loop pick up what the guest queued meanwhile */
+        for (i = 0; i < queues * 2; i++) {
+            virtio_queue_notify(vdev, i);
+        }
+    }
+}
+#endif
+
+static void virtio_net_data_plane_status(VirtIONet *n, uint8_t status)
+{
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    NetClientState *nc = qemu_get_queue(n->nic);
+    int queues = n->multiqueue ? n->curr_queues : 1;
+
+    if (!n->dataplane) {
+        return;
+    }
+
+    if (!virtio_net_started(n, status) || !nc->peer || nc->peer->link_down) {
+        queues = 0;
+    }
+    if (queues == n->dataplane_queues) {
+        return;
+    }
+
+    /* The number of queue pairs changed, restart with the new one */
+    if (n->dataplane_queues) {
+        virtio_net_data_plane_halt(n, queues != 0);
+    }
+    if (queues && virtio_net_data_plane_start(n->dataplane, queues)) {
+        n->dataplane_queues = queues;
+    }
+#endif
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -146,6 +195,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     uint8_t queue_status;
 
     virtio_net_vhost_status(n, status);
+    virtio_net_data_plane_status(n, status);
 
     for (i = 0; i < n->max_queues; i++) {
         q = &n->vqs[i];
@@ -160,7 +210,8 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             continue;
         }
 
-        if (virtio_net_started(n, queue_status) && !n->vhost_started) {
+        if (virtio_net_started(n, queue_status) && !n->vhost_started &&
+            !virtio_net_data_plane_started(n)) {
             if (q->tx_timer) {
                 timer_mod(q->tx_timer,
                                qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + n->tx_timeout);
@@ -293,6 +344,58 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
     return info;
 }
 
+static unsigned mac_hash(const uint8_t *mac)
+{
+    uint32_t h = 2166136261u;
+    int i;
+
+    for (i = 0; i < ETH_ALEN; i++) {
+        h = (h ^ mac[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* Index the MAC filter after it changed.  The index is kept at most half
+ * full, so that a lookup probes few slots.
+ */
+static void virtio_net_mac_hash_rebuild(VirtIONet *n)
+{
+    unsigned size, h;
+    int i;
+
+    for (size = 16; size < 2 * n->mac_table.in_use; size *= 2) {
+        /* nothing */
+    }
+    n->mac_table.hash_mask = size - 1;
+    memset(n->mac_table.hash, 0, size * sizeof(n->mac_table.hash[0]));
+
+    for (i = 0; i < n->mac_table.in_use; i++) {
+        h = mac_hash(&n->mac_table.macs[i * ETH_ALEN]);
+        while (n->mac_table.hash[h & n->mac_table.hash_mask]) {
+            h++;
+        }
+        n->mac_table.hash[h & n->mac_table.hash_mask] = i + 1;
+    }
+}
+
+/* Is mac in the unicast (multi == false) or multicast part of the filter? */
+static bool virtio_net_mac_lookup(VirtIONet *n, const uint8_t *mac,
+                                  bool multi)
+{
+    unsigned h = mac_hash(mac);
+    int i;
+
+    while ((i = n->mac_table.hash[h & n->mac_table.hash_mask]) != 0) {
+        i--;
+        if ((i >= n->mac_table.first_multi) == multi &&
+            !memcmp(mac, &n->mac_table.macs[i * ETH_ALEN], ETH_ALEN)) {
+            return true;
+        }
+        h++;
+    }
+    return false;
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -312,7 +415,8 @@ static void virtio_net_reset(VirtIODevice *vdev)
     n->mac_table.first_multi = 0;
     n->mac_table.multi_overflow = 0;
     n->mac_table.uni_overflow = 0;
-    memset(n->mac_table.macs, 0, MAC_TABLE_ENTRIES * ETH_ALEN);
+    memset(n->mac_table.macs, 0, n->mac_table.size * ETH_ALEN);
+    virtio_net_mac_hash_rebuild(n);
     memcpy(&n->mac[0], &n->nic->conf->macaddr, sizeof(n->mac));
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     memset(n->vlans, 0, MAX_VLAN >> 3);
@@ -437,13 +541,15 @@ static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
         features &= ~(0x1 << VIRTIO_NET_F_HOST_UFO);
     }
 
-    if (!nc->peer || nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
-        return features;
+    /* The dataplane reads each packet into a single descriptor chain */
+    if (n->net_conf.data_plane) {
+        features &= ~(0x1 << VIRTIO_NET_F_MRG_RXBUF);
     }
-    if (!tap_get_vhost_net(nc->peer)) {
+
+    if (!get_vhost_net(nc->peer)) {
         return features;
     }
-    return vhost_net_get_features(tap_get_vhost_net(nc->peer), features);
+    return vhost_net_get_features(get_vhost_net(nc->peer), features);
 }
 
 static uint32_t virtio_net_bad_features(VirtIODevice *vdev)
@@ -507,13 +613,10 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
     for (i = 0;  i < n->max_queues; i++) {
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
 
-        if (!nc->peer || nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
-            continue;
-        }
-        if (!tap_get_vhost_net(nc->peer)) {
+        if (!get_vhost_net(nc->peer)) {
             continue;
         }
-        vhost_net_ack_features(tap_get_vhost_net(nc->peer), features);
+        vhost_net_ack_features(get_vhost_net(nc->peer), features);
     }
 }
 
@@ -614,7 +717,7 @@ static int virtio_net_handle_mac(VirtIONet *n, uint8_t cmd,
     int first_multi = 0;
     uint8_t uni_overflow = 0;
     uint8_t multi_overflow = 0;
-    uint8_t *macs = g_malloc0(MAC_TABLE_ENTRIES * ETH_ALEN);
+    uint8_t *macs = g_malloc0(n->mac_table.size * ETH_ALEN);
 
     s = iov_to_buf(iov, iov_cnt, 0, &mac_data.entries,
                    sizeof(mac_data.entries));
@@ -628,7 +731,7 @@ static int virtio_net_handle_mac(VirtIONet *n, uint8_t cmd,
         goto error;
     }
 
-    if (mac_data.entries <= MAC_TABLE_ENTRIES) {
+    if (mac_data.entries <= n->mac_table.size) {
         s = iov_to_buf(iov, iov_cnt, 0, macs,
                        mac_data.entries * ETH_ALEN);
         if (s != mac_data.entries * ETH_ALEN) {
@@ -656,7 +759,7 @@ static int virtio_net_handle_mac(VirtIONet *n, uint8_t cmd,
         goto error;
     }
 
-    if (in_use + mac_data.entries <= MAC_TABLE_ENTRIES) {
+    if (in_use + mac_data.entries <= n->mac_table.size) {
         s = iov_to_buf(iov, iov_cnt, 0, &macs[in_use * ETH_ALEN],
                        mac_data.entries * ETH_ALEN);
         if (s != mac_data.entries * ETH_ALEN) {
@@ -671,7 +774,8 @@ static int virtio_net_handle_mac(VirtIONet *n, uint8_t cmd,
     n->mac_table.first_multi = first_multi;
     n->mac_table.uni_overflow = uni_overflow;
     n->mac_table.multi_overflow = multi_overflow;
-    memcpy(n->mac_table.macs, macs, MAC_TABLE_ENTRIES * ETH_ALEN);
+    memcpy(n->mac_table.macs, macs, n->mac_table.size * ETH_ALEN);
+    virtio_net_mac_hash_rebuild(n);
     g_free(macs);
     rxfilter_notify(nc);
 
@@ -811,6 +915,11 @@ static int virtio_net_can_receive(NetClientState *nc)
         return 0;
     }
 
+    /* The dataplane owns the rx vrings */
+    if (virtio_net_data_plane_started(n)) {
+        return 0;
+    }
+
     if (!virtio_queue_ready(q->rx_vq) ||
         !(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return 0;
@@ -892,7 +1001,6 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     static const uint8_t bcast[] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
     static const uint8_t vlan[] = {0x81, 0x00};
     uint8_t *ptr = (uint8_t *)buf;
-    int i;
 
     if (n->promisc)
         return 1;
@@ -914,11 +1022,7 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
             return 1;
         }
 
-        for (i = n->mac_table.first_multi; i < n->mac_table.in_use; i++) {
-            if (!memcmp(ptr, &n->mac_table.macs[i * ETH_ALEN], ETH_ALEN)) {
-                return 1;
-            }
-        }
+        return virtio_net_mac_lookup(n, ptr, true);
     } else { // unicast
         if (n->nouni) {
             return 0;
@@ -928,17 +1032,17 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
             return 1;
         }
 
-        for (i = 0; i < n->mac_table.first_multi; i++) {
-            if (!memcmp(ptr, &n->mac_table.macs[i * ETH_ALEN], ETH_ALEN)) {
-                return 1;
-            }
-        }
+        return virtio_net_mac_lookup(n, ptr, false);
     }
-
-    return 0;
 }
 
-static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+/*
+ * Copy one packet into the rx ring.  The used elements are filled from
+ * offset *used on, and *used is advanced past them; the caller flushes
+ * them and notifies the guest, once for a whole batch of packets.
+ */
+static ssize_t virtio_net_receive_one(NetClientState *nc, const uint8_t *buf,
+                                      size_t size, unsigned *used)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1022,7 +1126,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, &elem, total, i++);
+        virtqueue_fill(q->rx_vq, &elem, total, *used + i++);
     }
 
     if (mhdr_cnt) {
@@ -1032,35 +1136,100 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
-
+    *used += i;
     return size;
 }
 
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    unsigned used = 0;
+    ssize_t ret;
+
+    ret = virtio_net_receive_one(nc, buf, size, &used);
+    if (used) {
+        virtqueue_flush(q->rx_vq, used);
+        virtio_notify(VIRTIO_DEVICE(n), q->rx_vq);
+    }
+    return ret;
+}
+
+/* Packets from the tap backend arrive several at a time.  Their buffers
+ * all become visible to the guest with a single used index update and a
+ * single interrupt.
+ */
+static int virtio_net_receive_batch(NetClientState *nc,
+                                    const NetPacketIOV *pkts, int count)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    uint8_t buffer[NET_BUFSIZE];
+    unsigned used = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        const uint8_t *buf = buffer;
+        size_t size;
+
+        if (pkts[i].iovcnt == 1) {
+            buf = pkts[i].iov[0].iov_base;
+            size = pkts[i].iov[0].iov_len;
+        } else {
+            size = iov_to_buf(pkts[i].iov, pkts[i].iovcnt, 0,
+                              buffer, sizeof(buffer));
+        }
+
+        /* Out of buffers: the rest is queued until the guest adds more */
+        if (virtio_net_receive_one(nc, buf, size, &used) == 0) {
+            break;
+        }
+    }
+
+    if (used) {
+        virtqueue_flush(q->rx_vq, used);
+        virtio_notify(VIRTIO_DEVICE(n), q->rx_vq);
+    }
+    return i;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
+/* TX */
+
+/* Packets popped from the tx vring per call into the net layer */
+#define VIRTIO_NET_TX_BATCH 16
+
+typedef struct VirtIONetTxPacket {
+    VirtQueueElement elem;
+    struct iovec sg[VIRTQUEUE_MAX_SIZE];
+} VirtIONetTxPacket;
+
+/* The peer is done with a packet that it could not take right away */
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
-    virtqueue_push(q->tx_vq, &q->async_tx.elem, 0);
+    assert(q->tx_async_head < q->tx_async_tail);
+    virtqueue_push(q->tx_vq, &q->tx_batch[q->tx_async_head++].elem, 0);
     virtio_notify(vdev, q->tx_vq);
 
-    q->async_tx.elem.out_num = q->async_tx.len = 0;
+    if (q->tx_async_head < q->tx_async_tail) {
+        return;
+    }
+    q->tx_async_head = q->tx_async_tail = 0;
 
     virtio_queue_set_notification(q->tx_vq, 1);
     virtio_net_flush_tx(q);
 }
 
-/* TX */
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement elem;
+    NetPacketIOV pkts[VIRTIO_NET_TX_BATCH];
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -1069,58 +1238,78 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
     assert(vdev->vm_running);
 
-    if (q->async_tx.elem.out_num) {
+    if (q->tx_async_tail) {
         virtio_queue_set_notification(q->tx_vq, 0);
         return num_packets;
     }
 
-    while (virtqueue_pop(q->tx_vq, &elem)) {
-        ssize_t ret, len;
-        unsigned int out_num = elem.out_num;
-        struct iovec *out_sg = &elem.out_sg[0];
-        struct iovec sg[VIRTQUEUE_MAX_SIZE];
+    if (!q->tx_batch) {
+        q->tx_batch = g_new(VirtIONetTxPacket, VIRTIO_NET_TX_BATCH);
+    }
 
-        if (out_num < 1) {
-            error_report("virtio-net header not in first element");
-            exit(1);
-        }
+    while (num_packets < n->tx_burst) {
+        int count = 0, sent, i;
 
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
-                                       out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
-        }
+        while (count < VIRTIO_NET_TX_BATCH &&
+               num_packets + count < n->tx_burst &&
+               virtqueue_pop(q->tx_vq, &q->tx_batch[count].elem)) {
+            VirtIONetTxPacket *pkt = &q->tx_batch[count];
+            unsigned int out_num = pkt->elem.out_num;
+            struct iovec *out_sg = &pkt->elem.out_sg[0];
 
-        len = n->guest_hdr_len;
+            if (out_num < 1) {
+                error_report("virtio-net header not in first element");
+                exit(1);
+            }
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
-            virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
-            q->async_tx.len  = len;
-            return -EBUSY;
+            /*
+             * If host wants to see the guest header as is, we can
+             * pass it on unchanged. Otherwise, copy just the parts
+             * that host is interested in.
+             */
+            assert(n->host_hdr_len <= n->guest_hdr_len);
+            if (n->host_hdr_len != n->guest_hdr_len) {
+                unsigned sg_num = iov_copy(pkt->sg, ARRAY_SIZE(pkt->sg),
+                                           out_sg, out_num,
+                                           0, n->host_hdr_len);
+                sg_num += iov_copy(pkt->sg + sg_num,
+                                   ARRAY_SIZE(pkt->sg) - sg_num,
+                                   out_sg, out_num,
+                                   n->guest_hdr_len, -1);
+                out_num = sg_num;
+                out_sg = pkt->sg;
+            }
+
+            pkts[count].iov = out_sg;
+            pkts[count].iovcnt = out_num;
+            count++;
+        }
+        if (count == 0) {
+            break;
         }
 
-        len += ret;
+        /* Packets that the peer cannot take right away are queued without
+         * copying.  Their descriptors stay with us until
+         * virtio_net_tx_complete(), which also throttles the guest.
+         */
+        sent = qemu_sendv_packet_batch_zerocopy(
+                qemu_get_subqueue(n->nic, queue_index),
+                pkts, count, virtio_net_tx_complete);
 
-        virtqueue_push(q->tx_vq, &elem, 0);
-        virtio_notify(vdev, q->tx_vq);
+        for (i = 0; i < sent; i++) {
+            virtqueue_push(q->tx_vq, &q->tx_batch[i].elem, 0);
+        }
+        if (sent) {
+            virtio_notify(vdev, q->tx_vq);
+        }
 
-        if (++num_packets >= n->tx_burst) {
-            break;
+        if (sent < count) {
+            virtio_queue_set_notification(q->tx_vq, 0);
+            q->tx_async_head = sent;
+            q->tx_async_tail = count;
+            return -EBUSY;
         }
+        num_packets += count;
     }
     return num_packets;
 }
@@ -1337,8 +1526,8 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
 
     if (version_id >= 5) {
         n->mac_table.in_use = qemu_get_be32(f);
-        /* MAC_TABLE_ENTRIES may be different from the saved image */
-        if (n->mac_table.in_use <= MAC_TABLE_ENTRIES) {
+        /* The table size may be different from the saved image */
+        if (n->mac_table.in_use <= n->mac_table.size) {
             qemu_get_buffer(f, n->mac_table.macs,
                             n->mac_table.in_use * ETH_ALEN);
         } else if (n->mac_table.in_use) {
@@ -1410,6 +1599,7 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
     n->mac_table.first_multi = i;
+    virtio_net_mac_hash_rebuild(n);
 
     /* nc.link_down can't be migrated, so infer link_down according
      * to link status bit in n->status */
@@ -1433,6 +1623,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch = virtio_net_receive_batch,
     .cleanup = virtio_net_cleanup,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
@@ -1443,7 +1634,7 @@ static bool virtio_net_guest_notifier_pending(VirtIODevice *vdev, int idx)
     VirtIONet *n = VIRTIO_NET(vdev);
     NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
     assert(n->vhost_started);
-    return vhost_net_virtqueue_pending(tap_get_vhost_net(nc->peer), idx);
+    return vhost_net_virtqueue_pending(get_vhost_net(nc->peer), idx);
 }
 
 static void virtio_net_guest_notifier_mask(VirtIODevice *vdev, int idx,
@@ -1452,7 +1643,7 @@ static void virtio_net_guest_notifier_mask(VirtIODevice *vdev, int idx,
     VirtIONet *n = VIRTIO_NET(vdev);
     NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
     assert(n->vhost_started);
-    vhost_net_virtqueue_mask(tap_get_vhost_net(nc->peer),
+    vhost_net_virtqueue_mask(get_vhost_net(nc->peer),
                              vdev, idx, mask);
 }
 
@@ -1491,16 +1682,74 @@ void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
     n->netclient_type = g_strdup(type);
 }
 
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+/* Disable dataplane threads during live migration since they do not
+ * update the dirty memory bitmap yet.
+ */
+static void virtio_net_migration_state_changed(Notifier *notifier, void *data)
+{
+    VirtIONet *n = container_of(notifier, VirtIONet,
+                                migration_state_notifier);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    MigrationState *mig = data;
+    Error *err = NULL;
+
+    if (migration_in_setup(mig)) {
+        if (!n->dataplane) {
+            return;
+        }
+        if (n->dataplane_queues) {
+            virtio_net_data_plane_halt(n, true);
+        }
+        virtio_net_data_plane_destroy(n->dataplane);
+        n->dataplane = NULL;
+    } else if (migration_has_finished(mig) ||
+               migration_has_failed(mig)) {
+        if (n->dataplane) {
+            return;
+        }
+        virtio_net_data_plane_create(n, &n->dataplane, &err);
+        if (err != NULL) {
+            error_report("%s", error_get_pretty(err));
+            error_free(err);
+            return;
+        }
+        virtio_net_set_status(vdev, vdev->status);
+    }
+}
+#endif /* CONFIG_VIRTIO_NET_DATA_PLANE */
+
 static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIONet *n = VIRTIO_NET(dev);
     NetClientState *nc;
+    unsigned hash_size;
     int i;
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    Error *err = NULL;
+#endif
 
     virtio_init(vdev, "virtio-net", VIRTIO_ID_NET, n->config_size);
 
     n->max_queues = MAX(n->nic_conf.queues, 1);
+    if (n->net_conf.mac_table_entries < 1 ||
+        n->net_conf.mac_table_entries > MAC_TABLE_ENTRIES_MAX) {
+        error_setg(errp, "virtio-net: mac_table_entries must be between 1 "
+                   "and %d", MAC_TABLE_ENTRIES_MAX);
+        virtio_cleanup(vdev);
+        return;
+    }
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    virtio_net_data_plane_create(n, &n->dataplane, &err);
+    if (err != NULL) {
+        error_propagate(errp, err);
+        virtio_cleanup(vdev);
+        return;
+    }
+    n->migration_state_notifier.notify = virtio_net_migration_state_changed;
+    add_migration_state_change_notifier(&n->migration_state_notifier);
+#endif
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
     n->vqs[0].rx_vq = virtio_add_queue(vdev, 256, virtio_net_handle_rx);
     n->curr_queues = 1;
@@ -1558,7 +1807,13 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     virtio_net_set_mrg_rx_bufs(n, 0);
     n->promisc = 1; /* for compatibility */
 
-    n->mac_table.macs = g_malloc0(MAC_TABLE_ENTRIES * ETH_ALEN);
+    n->mac_table.size = n->net_conf.mac_table_entries;
+    n->mac_table.macs = g_malloc0(n->mac_table.size * ETH_ALEN);
+    for (hash_size = 16; hash_size < 2 * n->mac_table.size; hash_size *= 2) {
+        /* nothing */
+    }
+    n->mac_table.hash = g_new0(uint16_t, hash_size);
+    n->mac_table.hash_mask = 15;
 
     n->vlans = g_malloc0(MAX_VLAN >> 3);
 
@@ -1581,6 +1836,12 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     /* This will stop vhost backend if appropriate. */
     virtio_net_set_status(vdev, 0);
 
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    remove_migration_state_change_notifier(&n->migration_state_notifier);
+    virtio_net_data_plane_destroy(n->dataplane);
+    n->dataplane = NULL;
+#endif
+
     unregister_savevm(dev, "virtio-net", n);
 
     if (n->netclient_name) {
@@ -1593,6 +1854,7 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     }
 
     g_free(n->mac_table.macs);
+    g_free(n->mac_table.hash);
     g_free(n->vlans);
 
     for (i = 0; i < n->max_queues; i++) {
@@ -1607,6 +1869,7 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
         } else if (q->tx_bh) {
             qemu_bh_delete(q->tx_bh);
         }
+        g_free(q->tx_batch);
     }
 
     g_free(n->vqs);
@@ -1631,6 +1894,8 @@ static Property virtio_net_properties[] = {
                                                TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_UINT32("mac_table_entries", VirtIONet,
+                       net_conf.mac_table_entries, MAC_TABLE_ENTRIES),
     DEFINE_PROP_END_OF_LIST(),
 };
 
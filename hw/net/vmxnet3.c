@@ -309,6 +309,14 @@ typedef struct {
         MACAddr *mcast_list;
         uint32_t mcast_list_len;
         uint32_t mcast_list_buff_size; /* needed for live migration. */
+
+        /* RSS configuration, only meaningful if rss_enabled */
+        bool rss_enabled;
+        uint16_t rss_hash_type;
+        uint16_t rss_key_size;
+        uint16_t rss_ind_table_size;
+        uint8_t rss_key[UPT1_RSS_MAX_KEY_SIZE];
+        uint8_t rss_ind_table[UPT1_RSS_MAX_IND_TABLE_SIZE];
 } VMXNET3State;
 
 /* Interrupt management */
@@ -670,6 +678,16 @@ vmxnet3_pop_next_tx_descr(VMXNET3State *s,
     return false;
 }
 
+/*
+ * With a multiqueue backend, each TX queue is sent through its own
+ * backend queue, wrapping around if the guest uses more queues than the
+ * backend has.
+ */
+static NetClientState *vmxnet3_get_tx_queue(VMXNET3State *s, uint32_t qidx)
+{
+    return qemu_get_subqueue(s->nic, qidx % MAX(1, s->conf.peers.queues));
+}
+
 static bool
 vmxnet3_send_packet(VMXNET3State *s, uint32_t qidx)
 {
@@ -684,7 +702,7 @@ vmxnet3_send_packet(VMXNET3State *s, uint32_t qidx)
     vmxnet3_dump_virt_hdr(vmxnet_tx_pkt_get_vhdr(s->tx_pkt));
     vmxnet_tx_pkt_dump(s->tx_pkt);
 
-    if (!vmxnet_tx_pkt_send(s->tx_pkt, qemu_get_queue(s->nic))) {
+    if (!vmxnet_tx_pkt_send(s->tx_pkt, vmxnet3_get_tx_queue(s, qidx))) {
         status = VMXNET3_PKT_STATUS_DISCARD;
         goto func_exit;
     }
@@ -788,23 +806,22 @@ vmxnet3_revert_rxc_descr(VMXNET3State *s, int qidx)
     vmxnet3_dec_rx_completion_counter(s, qidx);
 }
 
-#define RXQ_IDX      (0)
 #define RX_HEAD_BODY_RING (0)
 #define RX_BODY_ONLY_RING (1)
 
 static bool
-vmxnet3_get_next_head_rx_descr(VMXNET3State *s,
+vmxnet3_get_next_head_rx_descr(VMXNET3State *s, int qidx,
                                struct Vmxnet3_RxDesc *descr_buf,
                                uint32_t *descr_idx,
                                uint32_t *ridx)
 {
     for (;;) {
         uint32_t ring_gen;
-        vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_HEAD_BODY_RING,
+        vmxnet3_read_next_rx_descr(s, qidx, RX_HEAD_BODY_RING,
                                    descr_buf, descr_idx);
 
         /* If no more free descriptors - return */
-        ring_gen = vmxnet3_get_rx_ring_gen(s, RXQ_IDX, RX_HEAD_BODY_RING);
+        ring_gen = vmxnet3_get_rx_ring_gen(s, qidx, RX_HEAD_BODY_RING);
         if (descr_buf->gen != ring_gen) {
             return false;
         }
@@ -812,11 +829,11 @@ vmxnet3_get_next_head_rx_descr(VMXNET3State *s,
         /* Only read after generation field verification */
         smp_rmb();
         /* Re-read to be sure we got the latest version */
-        vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_HEAD_BODY_RING,
+        vmxnet3_read_next_rx_descr(s, qidx, RX_HEAD_BODY_RING,
                                    descr_buf, descr_idx);
 
         /* Mark current descriptor as used/skipped */
-        vmxnet3_inc_rx_consumption_counter(s, RXQ_IDX, RX_HEAD_BODY_RING);
+        vmxnet3_inc_rx_consumption_counter(s, qidx, RX_HEAD_BODY_RING);
 
         /* If this is what we are looking for - return */
         if (descr_buf->btype == VMXNET3_RXD_BTYPE_HEAD) {
@@ -827,21 +844,21 @@ vmxnet3_get_next_head_rx_descr(VMXNET3State *s,
 }
 
 static bool
-vmxnet3_get_next_body_rx_descr(VMXNET3State *s,
+vmxnet3_get_next_body_rx_descr(VMXNET3State *s, int qidx,
                                struct Vmxnet3_RxDesc *d,
                                uint32_t *didx,
                                uint32_t *ridx)
 {
-    vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_HEAD_BODY_RING, d, didx);
+    vmxnet3_read_next_rx_descr(s, qidx, RX_HEAD_BODY_RING, d, didx);
 
     /* Try to find corresponding descriptor in head/body ring */
-    if (d->gen == vmxnet3_get_rx_ring_gen(s, RXQ_IDX, RX_HEAD_BODY_RING)) {
+    if (d->gen == vmxnet3_get_rx_ring_gen(s, qidx, RX_HEAD_BODY_RING)) {
         /* Only read after generation field verification */
         smp_rmb();
         /* Re-read to be sure we got the latest version */
-        vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_HEAD_BODY_RING, d, didx);
+        vmxnet3_read_next_rx_descr(s, qidx, RX_HEAD_BODY_RING, d, didx);
         if (d->btype == VMXNET3_RXD_BTYPE_BODY) {
-            vmxnet3_inc_rx_consumption_counter(s, RXQ_IDX, RX_HEAD_BODY_RING);
+            vmxnet3_inc_rx_consumption_counter(s, qidx, RX_HEAD_BODY_RING);
             *ridx = RX_HEAD_BODY_RING;
             return true;
         }
@@ -851,17 +868,17 @@ vmxnet3_get_next_body_rx_descr(VMXNET3State *s,
      * If there is no free descriptors on head/body ring or next free
      * descriptor is a head descriptor switch to body only ring
      */
-    vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_BODY_ONLY_RING, d, didx);
+    vmxnet3_read_next_rx_descr(s, qidx, RX_BODY_ONLY_RING, d, didx);
 
     /* If no more free descriptors - return */
-    if (d->gen == vmxnet3_get_rx_ring_gen(s, RXQ_IDX, RX_BODY_ONLY_RING)) {
+    if (d->gen == vmxnet3_get_rx_ring_gen(s, qidx, RX_BODY_ONLY_RING)) {
         /* Only read after generation field verification */
         smp_rmb();
         /* Re-read to be sure we got the latest version */
-        vmxnet3_read_next_rx_descr(s, RXQ_IDX, RX_BODY_ONLY_RING, d, didx);
+        vmxnet3_read_next_rx_descr(s, qidx, RX_BODY_ONLY_RING, d, didx);
         assert(d->btype == VMXNET3_RXD_BTYPE_BODY);
         *ridx = RX_BODY_ONLY_RING;
-        vmxnet3_inc_rx_consumption_counter(s, RXQ_IDX, RX_BODY_ONLY_RING);
+        vmxnet3_inc_rx_consumption_counter(s, qidx, RX_BODY_ONLY_RING);
         return true;
     }
 
@@ -869,15 +886,17 @@ vmxnet3_get_next_body_rx_descr(VMXNET3State *s,
 }
 
 static inline bool
-vmxnet3_get_next_rx_descr(VMXNET3State *s, bool is_head,
+vmxnet3_get_next_rx_descr(VMXNET3State *s, int qidx, bool is_head,
                           struct Vmxnet3_RxDesc *descr_buf,
                           uint32_t *descr_idx,
                           uint32_t *ridx)
 {
     if (is_head || !s->rx_packets_compound) {
-        return vmxnet3_get_next_head_rx_descr(s, descr_buf, descr_idx, ridx);
+        return vmxnet3_get_next_head_rx_descr(s, qidx, descr_buf,
+                                              descr_idx, ridx);
     } else {
-        return vmxnet3_get_next_body_rx_descr(s, descr_buf, descr_idx, ridx);
+        return vmxnet3_get_next_body_rx_descr(s, qidx, descr_buf,
+                                              descr_idx, ridx);
     }
 }
 
@@ -962,6 +981,89 @@ vmxnet3_physical_memory_writev(const struct iovec *iov,
     }
 }
 
+/*
+ * Toeplitz hash of @input, as specified for Microsoft RSS: each set bit
+ * of the input XORs in the 32 bits of the key starting at that bit.
+ */
+static uint32_t
+vmxnet3_toeplitz_hash(const uint8_t *key, size_t key_size,
+                      const uint8_t *input, size_t len)
+{
+    uint32_t hash = 0;
+    uint32_t window = ldl_be_p(key);
+    size_t i;
+    int bit;
+
+    for (i = 0; i < len; i++) {
+        for (bit = 7; bit >= 0; bit--) {
+            if (input[i] & (1 << bit)) {
+                hash ^= window;
+            }
+            window <<= 1;
+            if (i + 4 < key_size && (key[i + 4] & (1 << bit))) {
+                window |= 1;
+            }
+        }
+    }
+
+    return hash;
+}
+
+/*
+ * Pick the RX queue of the current packet from the RSS indirection table.
+ * Packets that are not hashed go to queue 0, with type
+ * VMXNET3_RCD_RSS_TYPE_NONE.
+ */
+static int
+vmxnet3_rss_select_queue(VMXNET3State *s, uint8_t *rss_type,
+                         uint32_t *rss_hash)
+{
+    uint8_t input[VMXNET_RX_PKT_RSS_INPUT_MAX];
+    bool isip4, isip6, isudp, istcp;
+    size_t len = 0;
+    uint8_t qidx;
+
+    *rss_type = VMXNET3_RCD_RSS_TYPE_NONE;
+    *rss_hash = 0;
+
+    if (!s->rss_enabled) {
+        return 0;
+    }
+
+    vmxnet_rx_pkt_get_protocols(s->rx_pkt, &isip4, &isip6, &isudp, &istcp);
+
+    if (isip4) {
+        if (istcp && (s->rss_hash_type & UPT1_RSS_HASH_TYPE_TCP_IPV4)) {
+            len = vmxnet_rx_pkt_get_rss_input(s->rx_pkt, true, input);
+            *rss_type = VMXNET3_RCD_RSS_TYPE_TCPIPV4;
+        }
+        if (!len && (s->rss_hash_type & UPT1_RSS_HASH_TYPE_IPV4)) {
+            len = vmxnet_rx_pkt_get_rss_input(s->rx_pkt, false, input);
+            *rss_type = VMXNET3_RCD_RSS_TYPE_IPV4;
+        }
+    } else if (isip6) {
+        if (istcp && (s->rss_hash_type & UPT1_RSS_HASH_TYPE_TCP_IPV6)) {
+            len = vmxnet_rx_pkt_get_rss_input(s->rx_pkt, true, input);
+            *rss_type = VMXNET3_RCD_RSS_TYPE_TCPIPV6;
+        }
+        if (!len && (s->rss_hash_type & UPT1_RSS_HASH_TYPE_IPV6)) {
+            len = vmxnet_rx_pkt_get_rss_input(s->rx_pkt, false, input);
+            *rss_type = VMXNET3_RCD_RSS_TYPE_IPV6;
+        }
+    }
+
+    if (!len) {
+        *rss_type = VMXNET3_RCD_RSS_TYPE_NONE;
+        return 0;
+    }
+
+    *rss_hash = vmxnet3_toeplitz_hash(s->rss_key, s->rss_key_size,
+                                      input, len);
+    qidx = s->rss_ind_table[*rss_hash % s->rss_ind_table_size];
+
+    return (qidx < s->rxq_num) ? qidx : 0;
+}
+
 static bool
 vmxnet3_indicate_packet(VMXNET3State *s)
 {
@@ -979,6 +1081,9 @@ vmxnet3_indicate_packet(VMXNET3State *s)
     size_t bytes_left = vmxnet_rx_pkt_get_total_len(s->rx_pkt);
     uint16_t num_frags = 0;
     size_t chunk_size;
+    uint8_t rss_type;
+    uint32_t rss_hash;
+    int qidx = vmxnet3_rss_select_queue(s, &rss_type, &rss_hash);
 
     vmxnet_rx_pkt_dump(s->rx_pkt);
 
@@ -989,12 +1094,13 @@ vmxnet3_indicate_packet(VMXNET3State *s)
             break;
         }
 
-        new_rxcd_pa = vmxnet3_pop_rxc_descr(s, RXQ_IDX, &new_rxcd_gen);
+        new_rxcd_pa = vmxnet3_pop_rxc_descr(s, qidx, &new_rxcd_gen);
         if (!new_rxcd_pa) {
             break;
         }
 
-        if (!vmxnet3_get_next_rx_descr(s, is_head, &rxd, &rxd_idx, &rx_ridx)) {
+        if (!vmxnet3_get_next_rx_descr(s, qidx, is_head,
+                                       &rxd, &rxd_idx, &rx_ridx)) {
             break;
         }
 
@@ -1015,10 +1121,12 @@ vmxnet3_indicate_packet(VMXNET3State *s)
         rxcd.len = chunk_size;
         rxcd.sop = is_head;
         rxcd.gen = new_rxcd_gen;
-        rxcd.rqID = RXQ_IDX + rx_ridx * s->rxq_num;
+        rxcd.rqID = qidx + rx_ridx * s->rxq_num;
 
         if (0 == bytes_left) {
             vmxnet3_rx_update_descr(s->rx_pkt, &rxcd);
+            rxcd.rssType = rss_type;
+            rxcd.rssHash = cpu_to_le32(rss_hash);
         }
 
         VMW_RIPRN("RX Completion descriptor: rxRing: %lu rxIdx %lu len %lu "
@@ -1045,19 +1153,19 @@ vmxnet3_indicate_packet(VMXNET3State *s)
     }
 
     if (0 != new_rxcd_pa) {
-        vmxnet3_revert_rxc_descr(s, RXQ_IDX);
+        vmxnet3_revert_rxc_descr(s, qidx);
     }
 
-    vmxnet3_trigger_interrupt(s, s->rxq_descr[RXQ_IDX].intr_idx);
+    vmxnet3_trigger_interrupt(s, s->rxq_descr[qidx].intr_idx);
 
     if (bytes_left == 0) {
-        vmxnet3_on_rx_done_update_stats(s, RXQ_IDX, VMXNET3_PKT_STATUS_OK);
+        vmxnet3_on_rx_done_update_stats(s, qidx, VMXNET3_PKT_STATUS_OK);
         return true;
     } else if (num_frags == s->max_rx_frags) {
-        vmxnet3_on_rx_done_update_stats(s, RXQ_IDX, VMXNET3_PKT_STATUS_ERROR);
+        vmxnet3_on_rx_done_update_stats(s, qidx, VMXNET3_PKT_STATUS_ERROR);
         return false;
     } else {
-        vmxnet3_on_rx_done_update_stats(s, RXQ_IDX,
+        vmxnet3_on_rx_done_update_stats(s, qidx,
                                         VMXNET3_PKT_STATUS_OUT_OF_BUF);
         return false;
     }
@@ -1145,6 +1253,7 @@ static void vmxnet3_reset(VMXNET3State *s)
     s->drv_shmem = 0;
     s->tx_sop = true;
     s->skip_current_tx_pkt = false;
+    s->rss_enabled = false;
 }
 
 static void vmxnet3_update_rx_mode(VMXNET3State *s)
@@ -1290,15 +1399,68 @@ static void vmxnet3_update_features(VMXNET3State *s)
               s->lro_supported, rxcso_supported,
               s->rx_vlan_stripping);
     if (s->peer_has_vhdr) {
-        tap_set_offload(qemu_get_queue(s->nic)->peer,
-                        rxcso_supported,
-                        s->lro_supported,
-                        s->lro_supported,
-                        0,
-                        0);
+        int i;
+
+        for (i = 0; i < MAX(1, s->conf.peers.queues); i++) {
+            tap_set_offload(qemu_get_subqueue(s->nic, i)->peer,
+                            rxcso_supported,
+                            s->lro_supported,
+                            s->lro_supported,
+                            0,
+                            0);
+        }
     }
 }
 
+static void vmxnet3_update_rss(VMXNET3State *s)
+{
+    struct UPT1_RSSConf conf;
+    uint32_t guest_features;
+    uint32_t conf_len;
+    hwaddr conf_pa;
+
+    s->rss_enabled = false;
+
+    guest_features = VMXNET3_READ_DRV_SHARED32(s->drv_shmem,
+                                               devRead.misc.uptFeatures);
+    if (!VMXNET_FLAG_IS_SET(guest_features, UPT1_F_RSS) || s->rxq_num < 2) {
+        VMW_CFPRN("RSS is disabled");
+        return;
+    }
+
+    conf_len = VMXNET3_READ_DRV_SHARED32(s->drv_shmem,
+                                         devRead.rssConfDesc.confLen);
+    conf_pa = VMXNET3_READ_DRV_SHARED64(s->drv_shmem,
+                                        devRead.rssConfDesc.confPA);
+    if (conf_len < sizeof(conf) || !conf_pa) {
+        VMW_WRPRN("RSS configuration is invalid, length %u", conf_len);
+        return;
+    }
+
+    cpu_physical_memory_read(conf_pa, &conf, sizeof(conf));
+    s->rss_hash_type = le16_to_cpu(conf.hashType);
+    s->rss_key_size = le16_to_cpu(conf.hashKeySize);
+    s->rss_ind_table_size = le16_to_cpu(conf.indTableSize);
+
+    if (le16_to_cpu(conf.hashFunc) != UPT1_RSS_HASH_FUNC_TOEPLITZ ||
+        s->rss_key_size < sizeof(uint32_t) ||
+        s->rss_key_size > UPT1_RSS_MAX_KEY_SIZE ||
+        s->rss_ind_table_size == 0 ||
+        s->rss_ind_table_size > UPT1_RSS_MAX_IND_TABLE_SIZE) {
+        VMW_WRPRN("Unsupported RSS configuration: function %u, key %u, "
+                  "table %u", le16_to_cpu(conf.hashFunc),
+                  s->rss_key_size, s->rss_ind_table_size);
+        return;
+    }
+
+    memcpy(s->rss_key, conf.hashKey, sizeof(s->rss_key));
+    memcpy(s->rss_ind_table, conf.indTable, sizeof(s->rss_ind_table));
+    s->rss_enabled = true;
+
+    VMW_CFPRN("RSS: hash types 0x%x, key size %u, table size %u",
+              s->rss_hash_type, s->rss_key_size, s->rss_ind_table_size);
+}
+
 static bool vmxnet3_verify_intx(VMXNET3State *s, int intx)
 {
     return s->msix_used || s->msi_used || (intx ==
@@ -1352,6 +1514,7 @@ static void vmxnet3_activate_device(VMXNET3State *s)
 
     VMW_CFPRN("Number of TX/RX queues %u/%u", s->txq_num, s->rxq_num);
     assert(s->txq_num <= VMXNET3_DEVICE_MAX_TX_QUEUES);
+    assert(s->rxq_num <= VMXNET3_DEVICE_MAX_RX_QUEUES);
 
     qdescr_table_pa =
         VMXNET3_READ_DRV_SHARED64(s->drv_shmem, devRead.misc.queueDescPA);
@@ -1447,6 +1610,8 @@ static void vmxnet3_activate_device(VMXNET3State *s)
                sizeof(s->rxq_descr[i].rxq_stats));
     }
 
+    vmxnet3_update_rss(s);
+
     /* Make sure everything is in place before device activation */
     smp_wmb();
 
@@ -1496,6 +1661,12 @@ static void vmxnet3_handle_command(VMXNET3State *s, uint64_t cmd)
     case VMXNET3_CMD_UPDATE_FEATURE:
         VMW_CBPRN("Set: Update features");
         vmxnet3_update_features(s);
+        vmxnet3_update_rss(s);
+        break;
+
+    case VMXNET3_CMD_UPDATE_RSSIDT:
+        VMW_CBPRN("Set: Update RSS indirection table");
+        vmxnet3_update_rss(s);
         break;
 
     case VMXNET3_CMD_UPDATE_PMCFG:
@@ -1925,6 +2096,7 @@ static void vmxnet3_net_init(VMXNET3State *s)
     s->nic = qemu_new_nic(&net_vmxnet3_info, &s->conf,
                           object_get_typename(OBJECT(s)),
                           d->id, s);
+    s->rss_enabled = false;
 
     s->peer_has_vhdr = vmxnet3_peer_has_vnet_hdr(s);
     s->tx_sop = true;
@@ -1935,10 +2107,14 @@ static void vmxnet3_net_init(VMXNET3State *s)
     s->lro_supported = false;
 
     if (s->peer_has_vhdr) {
-        tap_set_vnet_hdr_len(qemu_get_queue(s->nic)->peer,
-            sizeof(struct virtio_net_hdr));
+        int i;
+
+        for (i = 0; i < MAX(1, s->conf.peers.queues); i++) {
+            NetClientState *peer = qemu_get_subqueue(s->nic, i)->peer;
 
-        tap_using_vnet_hdr(qemu_get_queue(s->nic)->peer, 1);
+            tap_set_vnet_hdr_len(peer, sizeof(struct virtio_net_hdr));
+            tap_using_vnet_hdr(peer, 1);
+        }
     }
 
     qemu_format_nic_info_str(qemu_get_queue(s->nic), s->conf.macaddr.a);
@@ -2185,6 +2361,30 @@ static const VMStateDescription vmxstate_vmxnet3_mcast_list = {
     }
 };
 
+static bool vmxnet3_rss_needed(void *opaque)
+{
+    VMXNET3State *s = opaque;
+
+    return s->rss_enabled;
+}
+
+static const VMStateDescription vmstate_vmxnet3_rss = {
+    .name = "vmxnet3/rss",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(rss_enabled, VMXNET3State),
+        VMSTATE_UINT16(rss_hash_type, VMXNET3State),
+        VMSTATE_UINT16(rss_key_size, VMXNET3State),
+        VMSTATE_UINT16(rss_ind_table_size, VMXNET3State),
+        VMSTATE_UINT8_ARRAY(rss_key, VMXNET3State, UPT1_RSS_MAX_KEY_SIZE),
+        VMSTATE_UINT8_ARRAY(rss_ind_table, VMXNET3State,
+                            UPT1_RSS_MAX_IND_TABLE_SIZE),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void vmxnet3_get_ring_from_file(QEMUFile *f, Vmxnet3Ring *r)
 {
     r->pa = qemu_get_be64(f);
@@ -2425,6 +2625,10 @@ static const VMStateDescription vmstate_vmxnet3 = {
             .vmsd = &vmxstate_vmxnet3_mcast_list,
             .needed = vmxnet3_mc_list_needed
         },
+        {
+            .vmsd = &vmstate_vmxnet3_rss,
+            .needed = vmxnet3_rss_needed
+        },
         {
             /* empty element. */
         }
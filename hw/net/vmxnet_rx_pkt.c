@@ -45,6 +45,9 @@ struct VmxnetRxPkt {
     bool isip6;
     bool isudp;
     bool istcp;
+    const uint8_t *data;
+    size_t l3hdr_off;   /* 0 if the IP header is not usable */
+    size_t l4hdr_off;   /* 0 if the TCP ports are not usable */
 };
 
 void vmxnet_rx_pkt_init(struct VmxnetRxPkt **pkt, bool has_virt_hdr)
@@ -65,6 +68,39 @@ struct virtio_net_hdr *vmxnet_rx_pkt_get_vhdr(struct VmxnetRxPkt *pkt)
     return &pkt->virt_hdr;
 }
 
+static void vmxnet_rx_pkt_parse_offsets(struct VmxnetRxPkt *pkt,
+                                        const uint8_t *data, size_t len)
+{
+    size_t l3hdr_off = eth_get_l2_hdr_length(data);
+
+    pkt->data = data;
+    pkt->l3hdr_off = pkt->l4hdr_off = 0;
+
+    if (pkt->isip4) {
+        struct ip_header *iphdr = (struct ip_header *) (data + l3hdr_off);
+
+        pkt->l3hdr_off = l3hdr_off;
+        /* Only the first fragment has the ports, hash all on addresses */
+        if (pkt->istcp &&
+            !(be16_to_cpu(iphdr->ip_off) & (IP_MF | IP_OFFMASK)) &&
+            len >= l3hdr_off + IP_HDR_GET_LEN(iphdr) + sizeof(uint32_t)) {
+            pkt->l4hdr_off = l3hdr_off + IP_HDR_GET_LEN(iphdr);
+        }
+    } else if (pkt->isip6 && len >= l3hdr_off + sizeof(struct ip6_header)) {
+        struct iovec hdr_vec = { .iov_base = (void *) data, .iov_len = len };
+        uint8_t l4proto;
+        size_t full_ip6hdr_len;
+
+        pkt->l3hdr_off = l3hdr_off;
+        if (pkt->istcp &&
+            eth_parse_ipv6_hdr(&hdr_vec, 1, l3hdr_off,
+                               &l4proto, &full_ip6hdr_len) &&
+            len >= l3hdr_off + full_ip6hdr_len + sizeof(uint32_t)) {
+            pkt->l4hdr_off = l3hdr_off + full_ip6hdr_len;
+        }
+    }
+}
+
 void vmxnet_rx_pkt_attach_data(struct VmxnetRxPkt *pkt, const void *data,
                                size_t len, bool strip_vlan)
 {
@@ -95,6 +131,8 @@ void vmxnet_rx_pkt_attach_data(struct VmxnetRxPkt *pkt, const void *data,
 
     eth_get_protocols(data, len, &pkt->isip4, &pkt->isip6,
         &pkt->isudp, &pkt->istcp);
+
+    vmxnet_rx_pkt_parse_offsets(pkt, data, len);
 }
 
 void vmxnet_rx_pkt_dump(struct VmxnetRxPkt *pkt)
@@ -143,6 +181,39 @@ void vmxnet_rx_pkt_get_protocols(struct VmxnetRxPkt *pkt,
     *istcp = pkt->istcp;
 }
 
+size_t vmxnet_rx_pkt_get_rss_input(struct VmxnetRxPkt *pkt, bool with_ports,
+                                   uint8_t *buf)
+{
+    const uint8_t *l3hdr;
+    size_t len;
+
+    assert(pkt);
+
+    if (!pkt->l3hdr_off) {
+        return 0;
+    }
+    l3hdr = pkt->data + pkt->l3hdr_off;
+
+    if (pkt->isip4) {
+        len = 2 * sizeof(uint32_t);
+        memcpy(buf, l3hdr + offsetof(struct ip_header, ip_src), len);
+    } else {
+        len = 2 * sizeof(struct in6_address);
+        memcpy(buf, l3hdr + offsetof(struct ip6_header, ip6_src), len);
+    }
+
+    if (with_ports) {
+        if (!pkt->l4hdr_off) {
+            return 0;
+        }
+        /* TCP source and destination ports */
+        memcpy(buf + len, pkt->data + pkt->l4hdr_off, sizeof(uint32_t));
+        len += sizeof(uint32_t);
+    }
+
+    return len;
+}
+
 struct iovec *vmxnet_rx_pkt_get_iovec(struct VmxnetRxPkt *pkt)
 {
     assert(pkt);
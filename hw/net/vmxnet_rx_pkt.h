@@ -68,6 +68,25 @@ void vmxnet_rx_pkt_get_protocols(struct VmxnetRxPkt *pkt,
                                  bool *isip4, bool *isip6,
                                  bool *isudp, bool *istcp);
 
+/* Largest input of vmxnet_rx_pkt_get_rss_input(): IPv6 addresses and ports */
+#define VMXNET_RX_PKT_RSS_INPUT_MAX (2 * 16 + 2 * 2)
+
+/**
+ * fetches the packet fields RSS hashes are computed over, in network byte
+ * order: the source and destination IP addresses, followed by the source
+ * and destination TCP ports if requested
+ *
+ * @pkt:            packet
+ * @with_ports:     whether to include the TCP ports
+ * @buf:            buffer of at least VMXNET_RX_PKT_RSS_INPUT_MAX bytes
+ *
+ * Return:  number of bytes stored in @buf, 0 if the packet is not IP or,
+ *          with @with_ports, not an unfragmented TCP segment
+ *
+ */
+size_t vmxnet_rx_pkt_get_rss_input(struct VmxnetRxPkt *pkt, bool with_ports,
+                                   uint8_t *buf);
+
 /**
  * returns virtio header stored in rx context
  *
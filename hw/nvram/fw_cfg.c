@@ -26,12 +26,15 @@
 #include "hw/isa/isa.h"
 #include "hw/nvram/fw_cfg.h"
 #include "hw/sysbus.h"
+#include "sysemu/dma.h"
+#include "qemu/bitops.h"
 #include "trace.h"
 #include "qemu/error-report.h"
 #include "qemu/config-file.h"
 
 #define FW_CFG_SIZE 2
 #define FW_CFG_DATA_SIZE 1
+#define FW_CFG_DMA_SIZE 8
 #define TYPE_FW_CFG "fw_cfg"
 #define FW_CFG_NAME "fw_cfg"
 #define FW_CFG_PATH "/machine/" FW_CFG_NAME
@@ -50,8 +53,11 @@ struct FWCfgState {
     SysBusDevice parent_obj;
     /*< public >*/
 
-    MemoryRegion ctl_iomem, data_iomem, comb_iomem;
-    uint32_t ctl_iobase, data_iobase;
+    MemoryRegion ctl_iomem, data_iomem, comb_iomem, dma_iomem;
+    uint32_t ctl_iobase, data_iobase, dma_iobase;
+    bool dma_enabled;
+    /* Descriptor address, latched one half at a time */
+    uint64_t dma_addr;
     FWCfgEntry entries[2][FW_CFG_MAX_ENTRY];
     FWCfgFiles *files;
     uint16_t cur_entry;
@@ -261,6 +267,110 @@ static uint8_t fw_cfg_read(FWCfgState *s)
     return ret;
 }
 
+/* Copy the selected item straight into guest memory.  A firmware that
+ * loads a kernel and initrd byte by byte through the data port takes one
+ * exit per byte; with this, it takes one exit per item.
+ */
+static void fw_cfg_dma_transfer(FWCfgState *s)
+{
+    FWCfgDmaAccess dma;
+    FWCfgEntry *e;
+    dma_addr_t desc, len;
+    bool read = false;
+    int arch;
+
+    desc = s->dma_addr;
+    s->dma_addr = 0;
+
+    if (dma_memory_read(&address_space_memory, desc, &dma, sizeof(dma))) {
+        stl_be_dma(&address_space_memory,
+                   desc + offsetof(FWCfgDmaAccess, control),
+                   FW_CFG_DMA_CTL_ERROR);
+        return;
+    }
+    dma.control = be32_to_cpu(dma.control);
+    dma.length = be32_to_cpu(dma.length);
+    dma.address = be64_to_cpu(dma.address);
+    trace_fw_cfg_dma_transfer(s, desc, dma.control, dma.length, dma.address);
+
+    if (dma.control & FW_CFG_DMA_CTL_SELECT) {
+        fw_cfg_select(s, dma.control >> 16);
+    }
+
+    arch = !!(s->cur_entry & FW_CFG_ARCH_LOCAL);
+    e = &s->entries[arch][s->cur_entry & FW_CFG_ENTRY_MASK];
+
+    if (dma.control & FW_CFG_DMA_CTL_READ) {
+        read = true;
+    } else if (!(dma.control & FW_CFG_DMA_CTL_SKIP)) {
+        /* Writes are not supported */
+        dma.length = 0;
+    }
+    dma.control = 0;
+
+    while (dma.length > 0 && !(dma.control & FW_CFG_DMA_CTL_ERROR)) {
+        if (s->cur_entry == FW_CFG_INVALID || !e->data ||
+            s->cur_offset >= e->len) {
+            /* Past the end, like the data port: read zeroes */
+            len = dma.length;
+            if (read &&
+                dma_memory_set(&address_space_memory, dma.address, 0, len)) {
+                dma.control |= FW_CFG_DMA_CTL_ERROR;
+            }
+        } else {
+            len = MIN(dma.length, e->len - s->cur_offset);
+            if (e->read_callback) {
+                e->read_callback(e->callback_opaque, s->cur_offset);
+            }
+            if (read &&
+                dma_memory_write(&address_space_memory, dma.address,
+                                 &e->data[s->cur_offset], len)) {
+                dma.control |= FW_CFG_DMA_CTL_ERROR;
+            }
+            s->cur_offset += len;
+        }
+        dma.address += len;
+        dma.length -= len;
+    }
+
+    stl_be_dma(&address_space_memory,
+               desc + offsetof(FWCfgDmaAccess, control), dma.control);
+}
+
+static uint64_t fw_cfg_dma_mem_read(void *opaque, hwaddr addr,
+                                    unsigned size)
+{
+    return extract64(FW_CFG_DMA_SIGNATURE, (FW_CFG_DMA_SIZE - addr - size) * 8,
+                     size * 8);
+}
+
+static void fw_cfg_dma_mem_write(void *opaque, hwaddr addr,
+                                 uint64_t value, unsigned size)
+{
+    FWCfgState *s = opaque;
+
+    if (size == 4) {
+        if (addr == 0) {
+            s->dma_addr = value << 32;
+        } else {
+            s->dma_addr |= value;
+            fw_cfg_dma_transfer(s);
+        }
+    } else {
+        s->dma_addr = value;
+        fw_cfg_dma_transfer(s);
+    }
+}
+
+static bool fw_cfg_dma_mem_valid(void *opaque, hwaddr addr,
+                                 unsigned size, bool is_write)
+{
+    if (!is_write) {
+        return true;
+    }
+    return (size == 4 && (addr == 0 || addr == 4)) || (size == 8 && addr == 0);
+}
+
 static uint64_t fw_cfg_data_mem_read(void *opaque, hwaddr addr,
                                      unsigned size)
 {
@@ -333,11 +443,23 @@ static const MemoryRegionOps fw_cfg_comb_mem_ops = {
     .valid.accepts = fw_cfg_comb_valid,
 };
 
+static const MemoryRegionOps fw_cfg_dma_mem_ops = {
+    .read = fw_cfg_dma_mem_read,
+    .write = fw_cfg_dma_mem_write,
+    .endianness = DEVICE_BIG_ENDIAN,
+    .valid = {
+        .accepts = fw_cfg_dma_mem_valid,
+        .max_access_size = 8,
+    },
+    .impl.max_access_size = 8,
+};
+
 static void fw_cfg_reset(DeviceState *d)
 {
     FWCfgState *s = FW_CFG(d);
 
     fw_cfg_select(s, 0);
+    s->dma_addr = 0;
 }
 
 /* Save restore 32 bit int as uint16_t
@@ -373,6 +495,23 @@ static bool is_version_1(void *opaque, int version_id)
     return version_id == 1;
 }
 
+static bool fw_cfg_dma_needed(void *opaque)
+{
+    FWCfgState *s = opaque;
+
+    return s->dma_enabled;
+}
+
+static const VMStateDescription vmstate_fw_cfg_dma = {
+    .name = "fw_cfg/dma",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(dma_addr, FWCfgState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_fw_cfg = {
     .name = "fw_cfg",
     .version_id = 2,
@@ -383,6 +522,14 @@ static const VMStateDescription vmstate_fw_cfg = {
         VMSTATE_UINT16_HACK(cur_offset, FWCfgState, is_version_1),
         VMSTATE_UINT32_V(cur_offset, FWCfgState, 2),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection[]) {
+        {
+            .vmsd = &vmstate_fw_cfg_dma,
+            .needed = fw_cfg_dma_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
@@ -509,8 +656,9 @@ static void fw_cfg_machine_ready(struct Notifier *n, void *data)
     fw_cfg_add_file(s, "bootorder", (uint8_t*)bootindex, len);
 }
 
-FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
-                        hwaddr ctl_addr, hwaddr data_addr)
+FWCfgState *fw_cfg_init_dma(uint32_t ctl_port, uint32_t data_port,
+                            uint32_t dma_port, hwaddr ctl_addr,
+                            hwaddr data_addr, hwaddr dma_addr)
 {
     DeviceState *dev;
     SysBusDevice *d;
@@ -519,6 +667,10 @@ FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
     dev = qdev_create(NULL, TYPE_FW_CFG);
     qdev_prop_set_uint32(dev, "ctl_iobase", ctl_port);
     qdev_prop_set_uint32(dev, "data_iobase", data_port);
+    qdev_prop_set_uint32(dev, "dma_iobase", dma_port);
+    if (!dma_port && !dma_addr) {
+        qdev_prop_set_bit(dev, "dma_enabled", false);
+    }
     d = SYS_BUS_DEVICE(dev);
 
     s = FW_CFG(dev);
@@ -535,6 +687,9 @@ FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
     if (data_addr) {
         sysbus_mmio_map(d, 1, data_addr);
     }
+    if (dma_addr && s->dma_enabled) {
+        sysbus_mmio_map(d, 2, dma_addr);
+    }
     fw_cfg_add_bytes(s, FW_CFG_SIGNATURE, (char *)"QEMU", 4);
     fw_cfg_add_bytes(s, FW_CFG_UUID, qemu_uuid, 16);
     fw_cfg_add_i16(s, FW_CFG_NOGRAPHIC, (uint16_t)(display_type == DT_NOGRAPHIC));
@@ -549,6 +704,17 @@ FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
     return s;
 }
 
+FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
+                        hwaddr ctl_addr, hwaddr data_addr)
+{
+    return fw_cfg_init_dma(ctl_port, data_port, 0, ctl_addr, data_addr, 0);
+}
+
+bool fw_cfg_dma_enabled(FWCfgState *s)
+{
+    return s->dma_enabled;
+}
+
 static void fw_cfg_initfn(Object *obj)
 {
     SysBusDevice *sbd = SYS_BUS_DEVICE(obj);
@@ -563,6 +729,9 @@ static void fw_cfg_initfn(Object *obj)
     /* In case ctl and data overlap: */
     memory_region_init_io(&s->comb_iomem, OBJECT(s), &fw_cfg_comb_mem_ops, s,
                           "fwcfg", FW_CFG_SIZE);
+    memory_region_init_io(&s->dma_iomem, OBJECT(s), &fw_cfg_dma_mem_ops, s,
+                          "fwcfg.dma", FW_CFG_DMA_SIZE);
+    sysbus_init_mmio(sbd, &s->dma_iomem);
 }
 
 static void fw_cfg_realize(DeviceState *dev, Error **errp)
@@ -581,11 +750,16 @@ static void fw_cfg_realize(DeviceState *dev, Error **errp)
             sysbus_add_io(sbd, s->data_iobase, &s->data_iomem);
         }
     }
+    if (s->dma_enabled && s->dma_iobase) {
+        sysbus_add_io(sbd, s->dma_iobase, &s->dma_iomem);
+    }
 }
 
 static Property fw_cfg_properties[] = {
     DEFINE_PROP_HEX32("ctl_iobase", FWCfgState, ctl_iobase, -1),
     DEFINE_PROP_HEX32("data_iobase", FWCfgState, data_iobase, -1),
+    DEFINE_PROP_HEX32("dma_iobase", FWCfgState, dma_iobase, 0),
+    DEFINE_PROP_BOOL("dma_enabled", FWCfgState, dma_enabled, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -20,6 +20,9 @@
 
 #include "hw/pci/msi.h"
 #include "qemu/range.h"
+#include "qemu/event_notifier.h"
+#include "qemu/main-loop.h"
+#include "sysemu/kvm.h"
 
 /* Eventually those constants should go to Linux pci_regs.h */
 #define PCI_MSI_PENDING_32      0x10
@@ -224,6 +227,7 @@ void msi_uninit(struct PCIDevice *dev)
     cap_size = msi_cap_sizeof(flags);
     pci_del_capability(dev, PCI_CAP_ID_MSI, cap_size);
     dev->cap_present &= ~QEMU_PCI_CAP_MSI;
+    msi_irqfd_disable(dev);
 
     MSI_DEV_PRINTF(dev, "uninit\n");
 }
@@ -291,6 +295,9 @@ void msi_notify(PCIDevice *dev, unsigned int vector)
                    "notify vector 0x%x"
                    " address: 0x%"PRIx64" data: 0x%"PRIx32"\n",
                    vector, msg.address, msg.data);
+    if (msi_irqfd_notify(dev, vector, msg)) {
+        return;
+    }
     stl_le_phys(msg.address, msg.data);
 }
 
@@ -363,6 +370,14 @@ void msi_write_config(PCIDevice *dev, uint32_t addr, uint32_t val, int len)
         pci_set_word(dev->config + msi_flags_off(dev), flags);
     }
 
+    if (dev->msi_irqfd) {
+        kvm_irqchip_begin_route_changes(kvm_state);
+        for (vector = 0; vector < msi_nr_vectors(flags); vector++) {
+            msi_irqfd_update(dev, vector, msi_get_message(dev, vector));
+        }
+        kvm_irqchip_end_route_changes(kvm_state);
+    }
+
     if (!msi_per_vector_mask) {
         /* if per vector masking isn't supported,
            there is no pending interrupt. */
@@ -393,3 +408,142 @@ unsigned int msi_nr_vectors_allocated(const PCIDevice *dev)
     uint16_t flags = pci_get_word(dev->config + msi_flags_off(dev));
     return msi_nr_vectors(flags);
 }
+
+/*
+ * Without help, an MSI is a write to the APIC window that KVM turns into
+ * an ioctl, from a thread that holds the iothread lock.  Devices that
+ * opt in get a KVM MSI route and an irqfd per vector instead, and a
+ * notification becomes a write to an eventfd.  That needs no lock, so
+ * dataplane threads can raise interrupts directly.
+ *
+ * Routes are programmed with the iothread lock held: when the guest
+ * writes the MSI capability or the MSI-X table, or on a notification
+ * from the iothread.  A notification from another thread that finds no
+ * route for the current message falls back to the APIC write.
+ */
+struct PCIMSIIrqfd {
+    EventNotifier notifier;
+    int virq;
+    MSIMessage msg;
+};
+
+int msi_irqfd_enable(PCIDevice *dev, unsigned int nr_vectors)
+{
+    unsigned int i;
+    int ret;
+
+    if (!kvm_msi_via_irqfd_enabled()) {
+        return -ENOTSUP;
+    }
+    assert(!dev->msi_irqfd);
+
+    dev->msi_irqfd = g_new0(PCIMSIIrqfd, nr_vectors);
+    for (i = 0; i < nr_vectors; i++) {
+        dev->msi_irqfd[i].virq = -1;
+        ret = event_notifier_init(&dev->msi_irqfd[i].notifier, 0);
+        if (ret < 0) {
+            while (i-- > 0) {
+                event_notifier_cleanup(&dev->msi_irqfd[i].notifier);
+            }
+            g_free(dev->msi_irqfd);
+            dev->msi_irqfd = NULL;
+            return ret;
+        }
+    }
+    dev->msi_irqfd_nr = nr_vectors;
+    return 0;
+}
+
+void msi_irqfd_disable(PCIDevice *dev)
+{
+    PCIMSIIrqfd *v;
+    unsigned int i;
+
+    if (!dev->msi_irqfd) {
+        return;
+    }
+    for (i = 0; i < dev->msi_irqfd_nr; i++) {
+        v = &dev->msi_irqfd[i];
+        if (v->virq >= 0) {
+            kvm_irqchip_remove_irqfd_notifier(kvm_state, &v->notifier,
+                                              v->virq);
+            kvm_irqchip_release_virq(kvm_state, v->virq);
+        }
+        event_notifier_cleanup(&v->notifier);
+    }
+    g_free(dev->msi_irqfd);
+    dev->msi_irqfd = NULL;
+    dev->msi_irqfd_nr = 0;
+}
+
+static bool msi_irqfd_msg_equal(MSIMessage a, MSIMessage b)
+{
+    return a.address == b.address && a.data == b.data;
+}
+
+/* Called with the iothread lock held */
+void msi_irqfd_update(PCIDevice *dev, unsigned int vector, MSIMessage msg)
+{
+    PCIMSIIrqfd *v;
+    int virq;
+
+    if (!dev->msi_irqfd || vector >= dev->msi_irqfd_nr || !msg.address) {
+        return;
+    }
+    v = &dev->msi_irqfd[vector];
+
+    if (v->virq >= 0) {
+        if (msi_irqfd_msg_equal(v->msg, msg)) {
+            return;
+        }
+        if (kvm_irqchip_update_msi_route(kvm_state, v->virq, msg) < 0) {
+            return;
+        }
+    } else {
+        virq = kvm_irqchip_add_msi_route(kvm_state, msg);
+        if (virq < 0) {
+            /* Out of routes: this vector keeps using the slow path */
+            return;
+        }
+        if (kvm_irqchip_add_irqfd_notifier(kvm_state, &v->notifier, NULL,
+                                           virq) < 0) {
+            kvm_irqchip_release_virq(kvm_state, virq);
+            return;
+        }
+        atomic_set(&v->virq, virq);
+    }
+
+    /* Readers compare against the cached message, publish it last */
+    smp_wmb();
+    atomic_set(&v->msg.address, msg.address);
+    atomic_set(&v->msg.data, msg.data);
+}
+
+/* Deliver the interrupt through the irqfd of @vector if it has a route
+ * for @msg.  Returns false if the caller has to write @msg to the APIC.
+ */
+bool msi_irqfd_notify(PCIDevice *dev, unsigned int vector, MSIMessage msg)
+{
+    PCIMSIIrqfd *v;
+
+    if (!dev->msi_irqfd || vector >= dev->msi_irqfd_nr) {
+        return false;
+    }
+    v = &dev->msi_irqfd[vector];
+
+    if (atomic_read(&v->virq) < 0 ||
+        atomic_read(&v->msg.address) != msg.address ||
+        atomic_read(&v->msg.data) != msg.data) {
+        if (!qemu_mutex_iothread_locked()) {
+            return false;
+        }
+        msi_irqfd_update(dev, vector, msg);
+        if (v->virq < 0 || !msi_irqfd_msg_equal(v->msg, msg)) {
+            return false;
+        }
+    }
+
+    smp_rmb();
+    event_notifier_set(&v->notifier);
+    return true;
+}
@@ -174,6 +174,7 @@ static void msix_table_mmio_write(void *opaque, hwaddr addr,
 
     was_masked = msix_is_masked(dev, vector);
     pci_set_long(dev->msix_table + addr, val);
+    msi_irqfd_update(dev, vector, msix_get_message(dev, vector));
     msix_handle_mask_update(dev, vector, was_masked);
 }
 
@@ -369,6 +370,7 @@ void msix_uninit(PCIDevice *dev, MemoryRegion *table_bar, MemoryRegion *pba_bar)
     g_free(dev->msix_entry_used);
     dev->msix_entry_used = NULL;
     dev->cap_present &= ~QEMU_PCI_CAP_MSIX;
+    msi_irqfd_disable(dev);
 }
 
 void msix_uninit_exclusive_bar(PCIDevice *dev)
@@ -439,6 +441,9 @@ void msix_notify(PCIDevice *dev, unsigned vector)
 
     msg = msix_get_message(dev, vector);
 
+    if (msi_irqfd_notify(dev, vector, msg)) {
+        return;
+    }
     stl_le_phys(msg.address, msg.data);
 }
 
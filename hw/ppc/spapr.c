@@ -300,7 +300,9 @@ static void *spapr_create_fdt_skel(hwaddr initrd_base,
     uint32_t start_prop = cpu_to_be32(initrd_base);
     uint32_t end_prop = cpu_to_be32(initrd_base + initrd_size);
     char hypertas_prop[] = "hcall-pft\0hcall-term\0hcall-dabr\0hcall-interrupt"
-        "\0hcall-tce\0hcall-vio\0hcall-splpar\0hcall-bulk\0hcall-set-mode";
+        "\0hcall-tce\0hcall-vio\0hcall-splpar\0hcall-bulk\0hcall-set-mode"
+        "\0hcall-multi-tce";
+    size_t hypertas_len = sizeof(hypertas_prop);
     char qemu_hypertas_prop[] = "hcall-memop1";
     uint32_t refpoints[] = {cpu_to_be32(0x4), cpu_to_be32(0x4)};
     uint32_t interrupt_server_ranges_prop[] = {0, cpu_to_be32(smp_cpus)};
@@ -471,8 +473,15 @@ static void *spapr_create_fdt_skel(hwaddr initrd_base,
     /* RTAS */
     _FDT((fdt_begin_node(fdt, "rtas")));
 
+    /* Without kernel support, the multi-TCE hypercalls exit to QEMU while
+     * H_PUT_TCE stays in the kernel.  Do not advertise them then; the
+     * entry is last in the list so that it is easy to cut.
+     */
+    if (kvm_enabled() && !kvmppc_spapr_use_multitce()) {
+        hypertas_len -= sizeof("hcall-multi-tce");
+    }
     _FDT((fdt_property(fdt, "ibm,hypertas-functions", hypertas_prop,
-                       sizeof(hypertas_prop))));
+                       hypertas_len)));
     _FDT((fdt_property(fdt, "qemu,hypertas-functions", qemu_hypertas_prop,
                        sizeof(qemu_hypertas_prop))));
 
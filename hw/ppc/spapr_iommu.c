@@ -243,6 +243,81 @@ static target_ulong h_put_tce(PowerPCCPU *cpu, sPAPREnvironment *spapr,
     return ret;
 }
 
+/* Up to 512 TCEs from a page of guest memory */
+static target_ulong h_put_tce_indirect(PowerPCCPU *cpu,
+                                       sPAPREnvironment *spapr,
+                                       target_ulong opcode, target_ulong *args)
+{
+    target_ulong liobn = args[0];
+    target_ulong ioba = args[1];
+    target_ulong tce_list = args[2];
+    target_ulong npages = args[3];
+    target_ulong ret = H_PARAMETER, tce = 0;
+    sPAPRTCETable *tcet = spapr_tce_find_by_liobn(liobn);
+    target_ulong i;
+
+    if (!tcet || npages > SPAPR_TCE_PAGE_SIZE / sizeof(uint64_t)) {
+        return H_PARAMETER;
+    }
+
+    ioba &= ~SPAPR_TCE_PAGE_MASK;
+    tce_list &= ~SPAPR_TCE_PAGE_MASK;
+    for (i = 0; i < npages; i++, ioba += SPAPR_TCE_PAGE_SIZE) {
+        tce = ldq_phys(tce_list + i * sizeof(uint64_t));
+        ret = put_tce_emu(tcet, ioba, tce);
+        if (ret != H_SUCCESS) {
+            break;
+        }
+    }
+    trace_spapr_iommu_indirect(liobn, args[1], tce_list, i, tce, ret);
+
+    return ret;
+}
+
+/* The same TCE for npages consecutive pages, usually to clear them */
+static target_ulong h_stuff_tce(PowerPCCPU *cpu, sPAPREnvironment *spapr,
+                                target_ulong opcode, target_ulong *args)
+{
+    target_ulong liobn = args[0];
+    target_ulong ioba = args[1];
+    target_ulong tce = args[2];
+    target_ulong npages = args[3];
+    target_ulong ret = H_PARAMETER;
+    sPAPRTCETable *tcet = spapr_tce_find_by_liobn(liobn);
+    target_ulong i;
+
+    if (!tcet) {
+        return H_PARAMETER;
+    }
+
+    ioba &= ~SPAPR_TCE_PAGE_MASK;
+    for (i = 0; i < npages; i++, ioba += SPAPR_TCE_PAGE_SIZE) {
+        ret = put_tce_emu(tcet, ioba, tce);
+        if (ret != H_SUCCESS) {
+            break;
+        }
+    }
+    trace_spapr_iommu_stuff(liobn, args[1], tce, npages, ret);
+
+    return ret;
+}
+
+static target_ulong h_get_tce(PowerPCCPU *cpu, sPAPREnvironment *spapr,
+                              target_ulong opcode, target_ulong *args)
+{
+    target_ulong liobn = args[0];
+    target_ulong ioba = args[1];
+    sPAPRTCETable *tcet = spapr_tce_find_by_liobn(liobn);
+
+    ioba &= ~SPAPR_TCE_PAGE_MASK;
+    if (!tcet || ioba >= tcet->window_size) {
+        return H_PARAMETER;
+    }
+    args[0] = tcet->table[ioba >> SPAPR_TCE_PAGE_SHIFT];
+
+    return H_SUCCESS;
+}
+
 int spapr_dma_dt(void *fdt, int node_off, const char *propname,
                  uint32_t liobn, uint64_t window, uint32_t size)
 {
@@ -295,6 +370,11 @@ static void spapr_tce_table_class_init(ObjectClass *klass, void *data)
 
     /* hcall-tce */
     spapr_register_hypercall(H_PUT_TCE, h_put_tce);
+    spapr_register_hypercall(H_GET_TCE, h_get_tce);
+
+    /* hcall-multi-tce */
+    spapr_register_hypercall(H_PUT_TCE_INDIRECT, h_put_tce_indirect);
+    spapr_register_hypercall(H_STUFF_TCE, h_stuff_tce);
 }
 
 static TypeInfo spapr_tce_table_info = {
@@ -20,7 +20,9 @@
 #include "hw/virtio/virtio-net.h"
 #include "hw/sysbus.h"
 #include "qemu/bitops.h"
+#include "qemu/atomic.h"
 #include "hw/virtio/virtio-bus.h"
+#include "sysemu/iothread.h"
 
 #include "ioinst.h"
 #include "css.h"
@@ -191,6 +193,13 @@ typedef struct VirtioFeatDesc {
     uint8_t index;
 } QEMU_PACKED VirtioFeatDesc;
 
+typedef struct VirtioThinintInfo {
+    uint64_t summary_indicator;
+    uint64_t device_indicator;
+    uint64_t ind_bit;
+    uint8_t isc;
+} QEMU_PACKED VirtioThinintInfo;
+
 /* Specify where the virtqueues for the subchannel are in guest memory. */
 static int virtio_ccw_set_vqs(SubchDev *sch, uint64_t addr, uint32_t align,
                               uint16_t index, uint16_t num)
@@ -235,6 +244,7 @@ static int virtio_ccw_cb(SubchDev *sch, CCW1 ccw)
     void *config;
     hwaddr indicators;
     VqConfigBlock vq_config;
+    VirtioThinintInfo thinint;
     VirtioCcwDevice *dev = sch->driver_data;
     VirtIODevice *vdev = virtio_ccw_get_vdev(sch);
     bool check_len;
@@ -428,6 +438,9 @@ static int virtio_ccw_cb(SubchDev *sch, CCW1 ccw)
         }
         if (!ccw.cda) {
             ret = -EFAULT;
+        } else if (dev->thinint_active) {
+            /* Trigger a command reject. */
+            ret = -ENOSYS;
         } else {
             indicators = ldq_phys(ccw.cda);
             dev->indicators = indicators;
@@ -455,6 +468,47 @@ static int virtio_ccw_cb(SubchDev *sch, CCW1 ccw)
             ret = 0;
         }
         break;
+    case CCW_CMD_SET_IND_ADAPTER:
+        if (check_len) {
+            if (ccw.count != sizeof(thinint)) {
+                ret = -EINVAL;
+                break;
+            }
+        } else if (ccw.count < sizeof(thinint)) {
+            /* Can't execute command. */
+            ret = -EINVAL;
+            break;
+        }
+        if (!ccw.cda) {
+            ret = -EFAULT;
+        } else if (dev->indicators && !dev->thinint_active) {
+            /* Classic indicators are already set up, trigger a command
+             * reject.
+             */
+            ret = -ENOSYS;
+        } else {
+            thinint.summary_indicator =
+                ldq_phys(ccw.cda + offsetof(VirtioThinintInfo,
+                                            summary_indicator));
+            thinint.device_indicator =
+                ldq_phys(ccw.cda + offsetof(VirtioThinintInfo,
+                                            device_indicator));
+            thinint.ind_bit =
+                ldq_phys(ccw.cda + offsetof(VirtioThinintInfo, ind_bit));
+            thinint.isc = ldub_phys(ccw.cda + offsetof(VirtioThinintInfo, isc));
+            if (thinint.isc > 7) {
+                ret = -EINVAL;
+                break;
+            }
+            dev->summary_indicator = thinint.summary_indicator;
+            dev->indicators = thinint.device_indicator;
+            dev->ind_bit = thinint.ind_bit;
+            dev->thinint_isc = thinint.isc;
+            dev->thinint_active = dev->indicators && dev->summary_indicator;
+            sch->curr_status.scsw.count = ccw.count - sizeof(thinint);
+            ret = 0;
+        }
+        break;
     case CCW_CMD_READ_VQ_CONF:
         if (check_len) {
             if (ccw.count != sizeof(vq_config)) {
@@ -687,6 +741,10 @@ static void virtio_ccw_blk_instance_init(Object *obj)
     VirtIOBlkCcw *dev = VIRTIO_BLK_CCW(obj);
     object_initialize(&dev->vdev, sizeof(dev->vdev), TYPE_VIRTIO_BLK);
     object_property_add_child(obj, "virtio-backend", OBJECT(&dev->vdev), NULL);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&dev->blk.iothread, NULL);
+#endif
 }
 
 static int virtio_ccw_serial_init(VirtioCcwDevice *ccw_dev)
@@ -855,16 +913,57 @@ static inline VirtioCcwDevice *to_virtio_ccw_dev_fast(DeviceState *d)
     return container_of(d, VirtioCcwDevice, parent_obj);
 }
 
+/* The guest clears indicator bits while it runs, so they are set with an
+ * atomic operation.  Returns the previous value of the byte.
+ */
+static uint8_t virtio_ccw_set_ind_atomic(SubchDev *sch, hwaddr ind_loc,
+                                         uint8_t to_be_set)
+{
+    uint8_t ind_old, ind_new;
+    hwaddr len = 1;
+    uint8_t *ind_addr;
+
+    ind_addr = cpu_physical_memory_map(ind_loc, &len, 1);
+    if (!ind_addr) {
+        error_report("%s(%x.%x.%04x): unable to access indicator",
+                     __func__, sch->cssid, sch->ssid, sch->schid);
+        /* Pretend it was set, so that no interrupt is made */
+        return to_be_set;
+    }
+    do {
+        ind_old = *ind_addr;
+        ind_new = ind_old | to_be_set;
+    } while (atomic_cmpxchg(ind_addr, ind_old, ind_new) != ind_old);
+    cpu_physical_memory_unmap(ind_addr, len, 1, len);
+
+    return ind_old;
+}
+
 static void virtio_ccw_notify(DeviceState *d, uint16_t vector)
 {
     VirtioCcwDevice *dev = to_virtio_ccw_dev_fast(d);
     SubchDev *sch = dev->sch;
     uint64_t indicators;
+    uint64_t ind_bit;
 
     if (vector >= 128) {
         return;
     }
 
+    if (vector < VIRTIO_PCI_QUEUE_MAX && dev->thinint_active) {
+        /* One bit per queue, numbered from the most significant bit of
+         * the first byte.  Only the first notification since the guest
+         * last cleared the summary indicator makes an interrupt.
+         */
+        ind_bit = dev->ind_bit + vector;
+        virtio_ccw_set_ind_atomic(sch, dev->indicators + ind_bit / 8,
+                                  0x80 >> (ind_bit % 8));
+        if (!virtio_ccw_set_ind_atomic(sch, dev->summary_indicator, 0x01)) {
+            css_adapter_interrupt(dev->thinint_isc);
+        }
+        return;
+    }
+
     if (vector < VIRTIO_PCI_QUEUE_MAX) {
         if (!dev->indicators) {
             return;
@@ -904,6 +1003,10 @@ static void virtio_ccw_reset(DeviceState *d)
     css_reset_sch(dev->sch);
     dev->indicators = 0;
     dev->indicators2 = 0;
+    dev->thinint_active = false;
+    dev->summary_indicator = 0;
+    dev->ind_bit = 0;
+    dev->thinint_isc = 0;
 }
 
 static void virtio_ccw_vmstate_change(DeviceState *d, bool running)
@@ -957,6 +1060,10 @@ static int virtio_ccw_set_guest_notifier(VirtioCcwDevice *dev, int n,
          * is queried with test subchannel. We want to use vhost, though.
          * Lets make sure to have vhost running and wire up the irq fd to
          * land in qemu (and only the irq fd) in this code.
+         * With adapter interrupts the handler only sets indicator bits, and
+         * the summary indicator coalesces the interrupts of all queues.
+         * Injecting them from the kernel needs adapter routes, which the
+         * KVM interface used here does not have.
          */
         if (k->guest_notifier_mask) {
             k->guest_notifier_mask(vdev, n, false);
@@ -1008,6 +1115,10 @@ static Property virtio_ccw_net_properties[] = {
     DEFINE_PROP_STRING("devno", VirtioCcwDevice, bus_id),
     DEFINE_VIRTIO_NET_FEATURES(VirtioCcwDevice, host_features[0]),
     DEFINE_VIRTIO_NET_PROPERTIES(VirtIONetCcw, vdev.net_conf),
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    DEFINE_PROP_BIT("x-data-plane", VirtIONetCcw, vdev.net_conf.data_plane,
+                    0, false),
+#endif
     DEFINE_NIC_PROPERTIES(VirtIONetCcw, vdev.nic_conf),
     DEFINE_PROP_BIT("ioeventfd", VirtioCcwDevice, flags,
                     VIRTIO_CCW_FLAG_USE_IOEVENTFD_BIT, true),
@@ -1041,6 +1152,13 @@ static Property virtio_ccw_blk_properties[] = {
                     VIRTIO_CCW_FLAG_USE_IOEVENTFD_BIT, true),
 #ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
     DEFINE_PROP_BIT("x-data-plane", VirtIOBlkCcw, blk.data_plane, 0, false),
+    DEFINE_PROP_UINT32("x-poll-max-ns", VirtIOBlkCcw, blk.poll_max_ns, 0),
+    DEFINE_PROP_UINT32("x-poll-grow", VirtIOBlkCcw, blk.poll_grow, 0),
+    DEFINE_PROP_UINT32("x-poll-shrink", VirtIOBlkCcw, blk.poll_shrink, 0),
+    DEFINE_PROP_STRING("x-data-plane-affinity", VirtIOBlkCcw,
+                       blk.data_plane_affinity),
+    DEFINE_PROP_STRING("x-data-plane-sched", VirtIOBlkCcw,
+                       blk.data_plane_sched),
 #endif
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -1095,6 +1213,7 @@ static const TypeInfo virtio_ccw_serial = {
 static Property virtio_ccw_balloon_properties[] = {
     DEFINE_PROP_STRING("devno", VirtioCcwDevice, bus_id),
     DEFINE_VIRTIO_COMMON_FEATURES(VirtioCcwDevice, host_features[0]),
+    DEFINE_VIRTIO_BALLOON_PROPERTIES(VirtIOBalloonCcw, vdev.host_features),
     DEFINE_PROP_BIT("ioeventfd", VirtioCcwDevice, flags,
                     VIRTIO_CCW_FLAG_USE_IOEVENTFD_BIT, true),
     DEFINE_PROP_END_OF_LIST(),
@@ -38,6 +38,7 @@
 #define CCW_CMD_SET_IND      0x43
 #define CCW_CMD_SET_CONF_IND 0x53
 #define CCW_CMD_READ_VQ_CONF 0x32
+#define CCW_CMD_SET_IND_ADAPTER 0x73
 
 #define TYPE_VIRTIO_CCW_DEVICE "virtio-ccw-device"
 #define VIRTIO_CCW_DEVICE(obj) \
@@ -86,6 +87,11 @@ struct VirtioCcwDevice {
     /* Guest provided values: */
     hwaddr indicators;
     hwaddr indicators2;
+    /* Adapter (thin) interrupts, see CCW_CMD_SET_IND_ADAPTER */
+    bool thinint_active;
+    hwaddr summary_indicator;
+    uint64_t ind_bit;
+    uint8_t thinint_isc;
 };
 
 /* virtual css bus type */
@@ -0,0 +1,569 @@
+/*
+ * Dedicated threads for virtio-scsi I/O processing
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "qemu/iov.h"
+#include "qemu/thread.h"
+#include "qemu/error-report.h"
+#include "hw/virtio/dataplane/vring.h"
+#include "hw/virtio/virtio-scsi.h"
+#include "hw/virtio/virtio-bus.h"
+#include "block/block.h"
+#include "virtio-scsi.h"
+#include "block/aio.h"
+#include "qemu/rcu.h"
+
+enum {
+    SEG_MAX = 126,                  /* maximum number of I/O segments */
+    VRING_MAX = SEG_MAX + 2,        /* maximum number of vring descriptors */
+};
+
+/* Per-request-queue state.  Every request virtqueue has its own AioContext
+ * and thread.  A BlockDriverState can only be used from one AioContext, so
+ * each LUN is handed to one of the threads when the dataplane starts.
+ * Commands for a LUN that arrive on another queue are forwarded to the
+ * thread that owns it, and pushed back onto the vring they came from.
+ */
+struct VirtIOSCSIDataPlaneQueue {
+    VirtIOSCSIDataPlane *s;
+    unsigned int index;             /* request queue index */
+
+    AioContext *ctx;
+    QemuThread thread;
+
+    /* Requests are popped by this queue's thread, but completed by the
+     * thread that owns the LUN.
+     */
+    QemuMutex vring_lock;
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+
+    /* Completions are batched: the first sets notify_pending and
+     * schedules notify_bh, which raises one interrupt for all of them.
+     */
+    bool notify_pending;
+    QEMUBH *notify_bh;
+
+    /* Note that these EventNotifiers are assigned by value.  This is
+     * fine as long as you do not call event_notifier_cleanup on them
+     * (because you don't own the file descriptor or handle; you just
+     * use it).
+     */
+    EventNotifier host_notifier;    /* doorbell */
+
+    /* Commands forwarded by other queues for LUNs owned by this one */
+    QemuMutex inbox_lock;
+    QSIMPLEQ_HEAD(, VirtIOSCSIReq) inbox;
+    QEMUBH *inbox_bh;
+};
+
+struct VirtIOSCSIDataPlane {
+    bool started;
+    bool stopping;
+    QEMUBH *start_bh;
+
+    VirtIOSCSI *dev;
+    VirtIODevice *vdev;
+    unsigned int num_queues;
+    VirtIOSCSIDataPlaneQueue *queues;
+};
+
+/* Request virtqueues come after the control and event virtqueues */
+static inline unsigned int vq_index(VirtIOSCSIDataPlaneQueue *q)
+{
+    return q->index + 2;
+}
+
+/* Called with the vring lock held */
+static void notify_guest(VirtIOSCSIDataPlaneQueue *q)
+{
+    if (!vring_should_notify(q->s->vdev, &q->vring)) {
+        return;
+    }
+
+    event_notifier_set(q->guest_notifier);
+}
+
+static void notify_guest_bh(void *opaque)
+{
+    VirtIOSCSIDataPlaneQueue *q = opaque;
+
+    qemu_mutex_lock(&q->vring_lock);
+    if (q->notify_pending) {
+        q->notify_pending = false;
+        notify_guest(q);
+    }
+    qemu_mutex_unlock(&q->vring_lock);
+}
+
+/* Called from virtio_scsi_complete_req() in whatever thread owns the LUN */
+void virtio_scsi_data_plane_complete_req(VirtIOSCSIReq *req)
+{
+    VirtIOSCSIDataPlaneQueue *q = req->dpq;
+
+    qemu_mutex_lock(&q->vring_lock);
+    vring_push(&q->vring, req->head, req->qiov.size + req->resp_size);
+    q->notify_pending = true;
+    qemu_mutex_unlock(&q->vring_lock);
+    qemu_bh_schedule(q->notify_bh);
+
+    qemu_iovec_destroy(&req->qiov);
+    g_slice_free(VirtIOSCSIReq, req);
+}
+
+/* The queue whose thread runs the AioContext of the LUN's drive */
+static VirtIOSCSIDataPlaneQueue *lun_owner(VirtIOSCSIDataPlaneQueue *q,
+                                           SCSIDevice *d)
+{
+    VirtIOSCSIDataPlane *s = q->s;
+    AioContext *ctx;
+    unsigned int i;
+
+    if (!d || !d->conf.bs) {
+        return q;
+    }
+
+    ctx = bdrv_get_aio_context(d->conf.bs);
+    for (i = 0; i < s->num_queues; i++) {
+        if (s->queues[i].ctx == ctx) {
+            return &s->queues[i];
+        }
+    }
+    return q;
+}
+
+static void submit_request(VirtIOSCSIDataPlaneQueue *q, VirtIOSCSIReq *req)
+{
+    VirtIOSCSI *dev = q->s->dev;
+    SCSIDevice *d = virtio_scsi_device_find(dev, req->req.cmd->lun);
+
+    virtio_scsi_handle_cmd_req(dev, d, req);
+}
+
+static void handle_inbox(void *opaque)
+{
+    VirtIOSCSIDataPlaneQueue *q = opaque;
+    QSIMPLEQ_HEAD(, VirtIOSCSIReq) reqs = QSIMPLEQ_HEAD_INITIALIZER(reqs);
+    VirtIOSCSIReq *req;
+
+    qemu_mutex_lock(&q->inbox_lock);
+    QSIMPLEQ_CONCAT(&reqs, &q->inbox);
+    qemu_mutex_unlock(&q->inbox_lock);
+
+    while ((req = QSIMPLEQ_FIRST(&reqs))) {
+        QSIMPLEQ_REMOVE_HEAD(&reqs, next);
+        submit_request(q, req);
+    }
+}
+
+static int process_request(VirtIOSCSIDataPlaneQueue *q, struct iovec iov[],
+                           unsigned int out_num, unsigned int in_num,
+                           unsigned int head)
+{
+    VirtIOSCSIDataPlane *s = q->s;
+    VirtIOSCSICommon *vs = &s->dev->parent_obj;
+    struct iovec *in_iov = &iov[out_num];
+    struct iovec *data_iov;
+    unsigned int data_num;
+    VirtIOSCSIDataPlaneQueue *owner;
+    VirtIOSCSIReq *req;
+
+    /* The headers are in the first buffer of each direction, like in the
+     * main loop.
+     */
+    if (out_num < 1 || in_num < 1 ||
+        iov[0].iov_len < sizeof(VirtIOSCSICmdReq) + vs->cdb_size ||
+        in_iov[0].iov_len < sizeof(VirtIOSCSICmdResp) + vs->sense_size) {
+        error_report("wrong size for virtio-scsi headers");
+        return -EFAULT;
+    }
+
+    req = g_slice_new0(VirtIOSCSIReq);
+    req->dev = s->dev;
+    req->vq = virtio_get_queue(s->vdev, vq_index(q));
+    req->dpq = q;
+    req->head = head;
+    req->req.buf = iov[0].iov_base;
+    req->resp.buf = in_iov[0].iov_base;
+    req->resp_size = in_iov[0].iov_len;
+    req->mode = in_num > 1 ? SCSI_XFER_FROM_DEV : SCSI_XFER_TO_DEV;
+
+    /* The iovecs array is reused for the next request, so the SCSI layer
+     * needs its own copy.  The guest buffers are not copied; they stay
+     * mapped until the request is pushed back onto the vring.
+     */
+    if (out_num > 1) {
+        data_iov = &iov[1];
+        data_num = out_num - 1;
+    } else {
+        data_iov = &in_iov[1];
+        data_num = in_num - 1;
+    }
+    qemu_iovec_init(&req->qiov, data_num);
+    qemu_iovec_concat_iov(&req->qiov, data_iov, data_num, 0,
+                          iov_size(data_iov, data_num));
+
+    if (out_num > 1 && in_num > 1) {
+        req->resp.cmd->response = VIRTIO_SCSI_S_FAILURE;
+        virtio_scsi_complete_req(req);
+        return 0;
+    }
+
+    owner = lun_owner(q, virtio_scsi_device_find(s->dev, req->req.cmd->lun));
+    if (owner == q) {
+        submit_request(q, req);
+        return 0;
+    }
+
+    trace_virtio_scsi_data_plane_forward(s, q->index, owner->index);
+    qemu_mutex_lock(&owner->inbox_lock);
+    QSIMPLEQ_INSERT_TAIL(&owner->inbox, req, next);
+    qemu_mutex_unlock(&owner->inbox_lock);
+    qemu_bh_schedule(owner->inbox_bh);
+    return 0;
+}
+
+static void handle_notify(EventNotifier *e)
+{
+    VirtIOSCSIDataPlaneQueue *q = container_of(e, VirtIOSCSIDataPlaneQueue,
+                                               host_notifier);
+    VirtIOSCSIDataPlane *s = q->s;
+
+    /* Requests are popped one at a time, since each of them copies its
+     * iovecs before it is submitted.
+     */
+    struct iovec iov[VRING_MAX];
+    unsigned int out_num = 0, in_num = 0;
+    int head;
+
+    event_notifier_test_and_clear(&q->host_notifier);
+
+    qemu_mutex_lock(&q->vring_lock);
+    /* Disable guest->host notifies to avoid unnecessary vmexits */
+    vring_disable_notification(s->vdev, &q->vring);
+    for (;;) {
+        head = vring_pop(s->vdev, &q->vring, iov, &iov[VRING_MAX],
+                         &out_num, &in_num);
+        if (head == -EAGAIN) { /* vring emptied */
+            /* Re-enable guest->host notifies and stop processing the vring.
+             * But if the guest has snuck in more descriptors, keep processing.
+             */
+            if (vring_enable_notification(s->vdev, &q->vring)) {
+                break;
+            }
+            vring_disable_notification(s->vdev, &q->vring);
+            continue;
+        }
+
+        /* With a fresh iovecs array -ENOBUFS means that the guest ignored
+         * seg_max, which is as fatal as a bad descriptor.
+         */
+        if (head < 0) {
+            vring_set_broken(&q->vring);
+            break;
+        }
+
+        /* Completing a request takes the lock */
+        qemu_mutex_unlock(&q->vring_lock);
+        if (process_request(q, iov, out_num, in_num, head) < 0) {
+            qemu_mutex_lock(&q->vring_lock);
+            vring_set_broken(&q->vring);
+            break;
+        }
+        qemu_mutex_lock(&q->vring_lock);
+    }
+    qemu_mutex_unlock(&q->vring_lock);
+}
+
+static void *data_plane_thread(void *opaque)
+{
+    VirtIOSCSIDataPlaneQueue *q = opaque;
+    VirtIOSCSIDataPlane *s = q->s;
+
+    rcu_register_thread();
+
+    /* The main loop acquires our AioContext for task management functions
+     * and to move the drives back.  aio_poll() returns false when the
+     * contention callback kicked us, so the lock is dropped for it right
+     * away.
+     */
+    while (!s->stopping) {
+        aio_context_acquire(q->ctx);
+        while (!s->stopping && aio_poll(q->ctx, true)) {
+            /* Progress was made, keep going */
+        }
+        aio_context_release(q->ctx);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void start_data_plane_bh(void *opaque)
+{
+    VirtIOSCSIDataPlane *s = opaque;
+    unsigned int i;
+
+    qemu_bh_delete(s->start_bh);
+    s->start_bh = NULL;
+    for (i = 0; i < s->num_queues; i++) {
+        qemu_thread_create(&s->queues[i].thread, data_plane_thread,
+                           &s->queues[i], QEMU_THREAD_JOINABLE);
+    }
+}
+
+void virtio_scsi_data_plane_create(VirtIOSCSI *dev,
+                                   VirtIOSCSIDataPlane **dataplane)
+{
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(dev);
+    VirtIOSCSIDataPlane *s;
+    VirtIOSCSIDataPlaneQueue *q;
+    unsigned int i;
+
+    *dataplane = NULL;
+
+    if (!vs->conf.data_plane) {
+        return;
+    }
+
+    s = g_new0(VirtIOSCSIDataPlane, 1);
+    s->dev = dev;
+    s->vdev = VIRTIO_DEVICE(dev);
+    s->num_queues = vs->conf.num_queues;
+    s->queues = g_new0(VirtIOSCSIDataPlaneQueue, s->num_queues);
+    for (i = 0; i < s->num_queues; i++) {
+        q = &s->queues[i];
+        q->s = s;
+        q->index = i;
+        qemu_mutex_init(&q->vring_lock);
+        qemu_mutex_init(&q->inbox_lock);
+        QSIMPLEQ_INIT(&q->inbox);
+    }
+
+    *dataplane = s;
+}
+
+void virtio_scsi_data_plane_destroy(VirtIOSCSIDataPlane *s)
+{
+    unsigned int i;
+
+    if (!s) {
+        return;
+    }
+
+    virtio_scsi_data_plane_stop(s);
+    for (i = 0; i < s->num_queues; i++) {
+        qemu_mutex_destroy(&s->queues[i].vring_lock);
+        qemu_mutex_destroy(&s->queues[i].inbox_lock);
+    }
+    g_free(s->queues);
+    g_free(s);
+}
+
+static bool on_error_stops(BlockDriverState *bs, bool is_read)
+{
+    BlockdevOnError on_error = bdrv_get_on_error(bs, is_read);
+
+    return on_error == BLOCKDEV_ON_ERROR_STOP ||
+           on_error == BLOCKDEV_ON_ERROR_ENOSPC;
+}
+
+/* Every LUN is moved to a dataplane thread, so all of them must allow it */
+static bool luns_can_leave_main_loop(VirtIOSCSIDataPlane *s)
+{
+    BusChild *kid;
+    SCSIDevice *d;
+    BlockDriverState *bs;
+
+    QTAILQ_FOREACH(kid, &s->dev->bus.qbus.children, sibling) {
+        d = DO_UPCAST(SCSIDevice, qdev, kid->child);
+        bs = d->conf.bs;
+        if (!bs || !bdrv_can_set_aio_context(bs)) {
+            error_report("virtio-scsi: LUN %d:%d cannot be moved to another "
+                         "AioContext, not starting dataplane", d->id, d->lun);
+            return false;
+        }
+        if (bdrv_in_use(bs)) {
+            error_report("virtio-scsi: LUN %d:%d is in use, "
+                         "not starting dataplane", d->id, d->lun);
+            return false;
+        }
+
+        /* Stopping the VM on errors needs the main loop */
+        if (on_error_stops(bs, true) || on_error_stops(bs, false)) {
+            error_report("virtio-scsi: LUN %d:%d uses werror or rerror other "
+                         "than report or ignore, not starting dataplane",
+                         d->id, d->lun);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool virtio_scsi_data_plane_start(VirtIOSCSIDataPlane *s)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIOSCSIDataPlaneQueue *q;
+    BlockDriverState *bs;
+    BusChild *kid;
+    VirtQueue *vq;
+    unsigned int i, num_luns = 0;
+
+    if (s->started) {
+        return true;
+    }
+
+    if (!luns_can_leave_main_loop(s)) {
+        return false;
+    }
+
+    for (i = 0; i < s->num_queues; i++) {
+        q = &s->queues[i];
+        if (!vring_setup(&q->vring, s->vdev, vq_index(q))) {
+            while (i-- > 0) {
+                q = &s->queues[i];
+                vring_teardown(&q->vring, s->vdev, vq_index(q));
+            }
+            return false;
+        }
+    }
+
+    /* Set up guest notifiers (irq).  The control and event virtqueues stay
+     * in the main loop, but their notifiers come first.
+     */
+    if (k->set_guest_notifiers(qbus->parent, s->num_queues + 2, true) != 0) {
+        fprintf(stderr, "virtio-scsi failed to set guest notifier, "
+                "ensure -enable-kvm is set\n");
+        exit(1);
+    }
+
+    for (i = 0; i < s->num_queues; i++) {
+        q = &s->queues[i];
+        q->ctx = aio_context_new();
+        q->inbox_bh = aio_bh_new(q->ctx, handle_inbox, q);
+        q->notify_bh = aio_bh_new(q->ctx, notify_guest_bh, q);
+        q->notify_pending = false;
+
+        /* Set up virtqueue notify */
+        if (k->set_host_notifier(qbus->parent, vq_index(q), true) != 0) {
+            fprintf(stderr, "virtio-scsi failed to set host notifier\n");
+            exit(1);
+        }
+
+        vq = virtio_get_queue(s->vdev, vq_index(q));
+        q->guest_notifier = virtio_queue_get_guest_notifier(vq);
+        q->host_notifier = *virtio_queue_get_host_notifier(vq);
+        aio_set_event_notifier(q->ctx, &q->host_notifier, handle_notify);
+    }
+
+    /* From now on a drive is only touched from the thread it is assigned
+     * to, or by whoever holds that thread's AioContext.
+     */
+    QTAILQ_FOREACH(kid, &s->dev->bus.qbus.children, sibling) {
+        bs = DO_UPCAST(SCSIDevice, qdev, kid->child)->conf.bs;
+        bdrv_set_in_use(bs, 1);
+        bdrv_set_aio_context(bs, s->queues[num_luns % s->num_queues].ctx);
+        num_luns++;
+    }
+
+    s->started = true;
+    trace_virtio_scsi_data_plane_start(s, s->num_queues, num_luns);
+
+    /* Kick right away to begin processing requests already in vrings */
+    for (i = 0; i < s->num_queues; i++) {
+        event_notifier_set(&s->queues[i].host_notifier);
+    }
+
+    /* Spawn threads in BH so they inherit iothread cpusets */
+    s->start_bh = qemu_bh_new(start_data_plane_bh, s);
+    qemu_bh_schedule(s->start_bh);
+    return true;
+}
+
+void virtio_scsi_data_plane_stop(VirtIOSCSIDataPlane *s)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIOSCSIDataPlaneQueue *q;
+    BlockDriverState *bs;
+    AioContext *ctx;
+    BusChild *kid;
+    unsigned int i;
+
+    if (!s->started || s->stopping) {
+        return;
+    }
+    trace_virtio_scsi_data_plane_stop(s);
+
+    /* Stop notifications for new requests from guest */
+    for (i = 0; i < s->num_queues; i++) {
+        q = &s->queues[i];
+        aio_context_acquire(q->ctx);
+        aio_set_event_notifier(q->ctx, &q->host_notifier, NULL);
+        aio_context_release(q->ctx);
+    }
+
+    /* Nothing is forwarded anymore; submit what is still on the way */
+    for (i = 0; i < s->num_queues; i++) {
+        q = &s->queues[i];
+        aio_context_acquire(q->ctx);
+        handle_inbox(q);
+        aio_context_release(q->ctx);
+    }
+
+    /* Drain and move the drives back to the main loop */
+    QTAILQ_FOREACH(kid, &s->dev->bus.qbus.children, sibling) {
+        bs = DO_UPCAST(SCSIDevice, qdev, kid->child)->conf.bs;
+        ctx = bdrv_get_aio_context(bs);
+        aio_context_acquire(ctx);
+        bdrv_set_aio_context(bs, qemu_get_aio_context());
+        aio_context_release(ctx);
+        bdrv_set_in_use(bs, 0);
+    }
+
+    /* Stop threads or cancel pending thread creation BH */
+    s->stopping = true;
+    if (s->start_bh) {
+        qemu_bh_delete(s->start_bh);
+        s->start_bh = NULL;
+    } else {
+        for (i = 0; i < s->num_queues; i++) {
+            aio_notify(s->queues[i].ctx);
+        }
+        for (i = 0; i < s->num_queues; i++) {
+            qemu_thread_join(&s->queues[i].thread);
+        }
+    }
+
+    for (i = 0; i < s->num_queues; i++) {
+        q = &s->queues[i];
+        k->set_host_notifier(qbus->parent, vq_index(q), false);
+        qemu_bh_delete(q->inbox_bh);
+        q->inbox_bh = NULL;
+
+        /* Deliver what the threads did not get to */
+        notify_guest_bh(q);
+        qemu_bh_delete(q->notify_bh);
+        q->notify_bh = NULL;
+        aio_context_unref(q->ctx);
+        q->ctx = NULL;
+    }
+
+    /* Clean up guest notifiers (irq) */
+    k->set_guest_notifiers(qbus->parent, s->num_queues + 2, false);
+
+    for (i = 0; i < s->num_queues; i++) {
+        q = &s->queues[i];
+        vring_teardown(&q->vring, s->vdev, vq_index(q));
+    }
+    s->started = false;
+    s->stopping = false;
+}
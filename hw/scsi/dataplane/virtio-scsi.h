@@ -0,0 +1,26 @@
+/*
+ * Dedicated threads for virtio-scsi I/O processing
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HW_DATAPLANE_VIRTIO_SCSI_H
+#define HW_DATAPLANE_VIRTIO_SCSI_H
+
+#include "hw/virtio/virtio-scsi.h"
+
+typedef struct VirtIOSCSIDataPlane VirtIOSCSIDataPlane;
+typedef struct VirtIOSCSIDataPlaneQueue VirtIOSCSIDataPlaneQueue;
+
+void virtio_scsi_data_plane_create(VirtIOSCSI *dev,
+                                   VirtIOSCSIDataPlane **dataplane);
+void virtio_scsi_data_plane_destroy(VirtIOSCSIDataPlane *s);
+bool virtio_scsi_data_plane_start(VirtIOSCSIDataPlane *s);
+void virtio_scsi_data_plane_stop(VirtIOSCSIDataPlane *s);
+void virtio_scsi_data_plane_complete_req(VirtIOSCSIReq *req);
+
+#endif /* HW_DATAPLANE_VIRTIO_SCSI_H */
@@ -88,6 +88,14 @@ typedef struct MegasasState {
     int doorbell;
     int busy;
 
+    /* Interrupt coalescing: completions per interrupt, longest delay of
+     * an interrupt, and the doorbell count while the interrupt is held
+     */
+    uint32_t intr_coalesce_max;
+    uint32_t intr_coalesce_usecs;
+    int doorbell_held;
+    QEMUTimer *coalesce_timer;
+
     MegasasCmd *event_cmd;
     int event_locale;
     int event_class;
@@ -499,9 +507,53 @@ static MegasasCmd *megasas_enqueue_frame(MegasasState *s,
     return cmd;
 }
 
-static void megasas_complete_frame(MegasasState *s, uint64_t context)
+static void megasas_raise_irq(MegasasState *s)
 {
     PCIDevice *pci_dev = PCI_DEVICE(s);
+
+    if (msix_enabled(pci_dev)) {
+        trace_megasas_msix_raise(0);
+        msix_notify(pci_dev, 0);
+    } else {
+        trace_megasas_irq_raise();
+        pci_irq_assert(pci_dev);
+    }
+}
+
+/*
+ * The interrupt for the first completion after the guest acknowledged the
+ * previous ones is held back until intr_coalesce_max completions are
+ * waiting, intr_coalesce_usecs have passed, or no frame is left in flight.
+ */
+static void megasas_coalesce_irq(MegasasState *s)
+{
+    if (s->doorbell < s->intr_coalesce_max && s->busy) {
+        s->doorbell_held = s->doorbell;
+        if (s->intr_coalesce_usecs && !timer_pending(s->coalesce_timer)) {
+            timer_mod(s->coalesce_timer,
+                      qemu_clock_get_us(QEMU_CLOCK_VIRTUAL) +
+                      s->intr_coalesce_usecs);
+        }
+        return;
+    }
+
+    s->doorbell_held = 0;
+    timer_del(s->coalesce_timer);
+    megasas_raise_irq(s);
+}
+
+static void megasas_coalesce_timer(void *opaque)
+{
+    MegasasState *s = opaque;
+
+    if (s->doorbell_held && megasas_intr_enabled(s)) {
+        s->doorbell_held = 0;
+        megasas_raise_irq(s);
+    }
+}
+
+static void megasas_complete_frame(MegasasState *s, uint64_t context)
+{
     int tail, queue_offset;
 
     /* Decrement busy count */
@@ -529,14 +581,8 @@ static void megasas_complete_frame(MegasasState *s, uint64_t context)
     if (megasas_intr_enabled(s)) {
         /* Notify HBA */
         s->doorbell++;
-        if (s->doorbell == 1) {
-            if (msix_enabled(pci_dev)) {
-                trace_megasas_msix_raise(0);
-                msix_notify(pci_dev, 0);
-            } else {
-                trace_megasas_irq_raise();
-                pci_irq_assert(pci_dev);
-            }
+        if (s->doorbell == s->doorbell_held + 1) {
+            megasas_coalesce_irq(s);
         }
     } else {
         trace_megasas_qf_complete_noirq(context);
@@ -1946,6 +1992,8 @@ static void megasas_mmio_write(void *opaque, hwaddr addr,
         break;
     case MFI_ODCR0:
         s->doorbell = 0;
+        s->doorbell_held = 0;
+        timer_del(s->coalesce_timer);
         if (s->producer_pa && megasas_intr_enabled(s)) {
             /* Update reply queue pointer */
             trace_megasas_qf_update(s->reply_queue_head, s->busy);
@@ -2041,6 +2089,8 @@ static void megasas_soft_reset(MegasasState *s)
     s->producer_pa = 0;
     s->fw_state = MFI_FWSTATE_READY;
     s->doorbell = 0;
+    s->doorbell_held = 0;
+    timer_del(s->coalesce_timer);
     s->intr_mask = MEGASAS_INTR_DISABLED_MASK;
     s->frame_hi = 0;
     s->flags &= ~MEGASAS_MASK_USE_QUEUE64;
@@ -2083,6 +2133,8 @@ static void megasas_scsi_uninit(PCIDevice *d)
     memory_region_destroy(&s->mmio_io);
     memory_region_destroy(&s->port_io);
     memory_region_destroy(&s->queue_io);
+    timer_del(s->coalesce_timer);
+    timer_free(s->coalesce_timer);
 }
 
 static const struct SCSIBusInfo megasas_scsi_info = {
@@ -2164,6 +2216,8 @@ static int megasas_scsi_init(PCIDevice *dev)
         MAX_SCSI_DEVS : MFI_MAX_LD;
     s->producer_pa = 0;
     s->consumer_pa = 0;
+    s->coalesce_timer = timer_new_us(QEMU_CLOCK_VIRTUAL,
+                                     megasas_coalesce_timer, s);
     for (i = 0; i < s->fw_cmds; i++) {
         s->frames[i].index = i;
         s->frames[i].context = -1;
@@ -2196,6 +2250,10 @@ static Property megasas_properties[] = {
 #endif
     DEFINE_PROP_BIT("use_jbod", MegasasState, flags,
                     MEGASAS_FLAG_USE_JBOD, false),
+    DEFINE_PROP_UINT32("x-intr-coalesce-max", MegasasState,
+                       intr_coalesce_max, 0),
+    DEFINE_PROP_UINT32("x-intr-coalesce-usecs", MegasasState,
+                       intr_coalesce_usecs, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -101,7 +101,7 @@ static void scsi_dma_restart_bh(void *opaque)
                 scsi_req_continue(req);
                 break;
             case SCSI_XFER_NONE:
-                assert(!req->sg);
+                assert(!req->sg && !req->iov);
                 scsi_req_dequeue(req);
                 scsi_req_enqueue(req);
                 break;
@@ -532,6 +532,9 @@ static const struct SCSIReqOps reqops_target_command = {
 };
 
 
+/* Enough for the queue depth of common HBAs */
+#define SCSI_REQ_POOL_MAX 128
+
 SCSIRequest *scsi_req_alloc(const SCSIReqOps *reqops, SCSIDevice *d,
                             uint32_t tag, uint32_t lun, void *hba_private)
 {
@@ -539,7 +542,16 @@ SCSIRequest *scsi_req_alloc(const SCSIReqOps *reqops, SCSIDevice *d,
     SCSIBus *bus = scsi_bus_from_device(d);
     BusState *qbus = BUS(bus);
 
-    req = g_malloc0(reqops->size);
+    if (reqops->size > d->req_pool_size) {
+        req = g_malloc0(reqops->size);
+    } else if (QSLIST_EMPTY(&d->req_pool)) {
+        req = g_malloc0(d->req_pool_size);
+    } else {
+        req = QSLIST_FIRST(&d->req_pool);
+        QSLIST_REMOVE_HEAD(&d->req_pool, pool_next);
+        d->req_pool_len--;
+        memset(req, 0, reqops->size);
+    }
     req->refcount = 1;
     req->bus = bus;
     req->dev = d;
@@ -721,6 +733,12 @@ static void scsi_req_enqueue_internal(SCSIRequest *req)
     } else {
         req->sg = NULL;
     }
+    if (req->bus->info->get_iov) {
+        req->iov = req->bus->info->get_iov(req);
+    } else {
+        req->iov = NULL;
+    }
+    assert(!req->sg || !req->iov);
     req->enqueued = true;
     QTAILQ_INSERT_TAIL(&req->dev->requests, req, next);
 }
@@ -1555,7 +1573,8 @@ void scsi_req_unref(SCSIRequest *req)
 {
     assert(req->refcount > 0);
     if (--req->refcount == 0) {
-        BusState *qbus = req->dev->qdev.parent_bus;
+        SCSIDevice *d = req->dev;
+        BusState *qbus = d->qdev.parent_bus;
         SCSIBus *bus = DO_UPCAST(SCSIBus, qbus, qbus);
 
         if (bus->info->free_request && req->hba_private) {
@@ -1564,9 +1583,17 @@ void scsi_req_unref(SCSIRequest *req)
         if (req->ops->free_req) {
             req->ops->free_req(req);
         }
-        object_unref(OBJECT(req->dev));
+
+        /* Requests that fit were allocated with the pool size */
+        if (req->ops->size <= d->req_pool_size &&
+            d->req_pool_len < SCSI_REQ_POOL_MAX) {
+            QSLIST_INSERT_HEAD(&d->req_pool, req, pool_next);
+            d->req_pool_len++;
+        } else {
+            g_free(req);
+        }
+        object_unref(OBJECT(d));
         object_unref(OBJECT(qbus->parent));
-        g_free(req);
     }
 }
 
@@ -1592,12 +1619,29 @@ void scsi_req_continue(SCSIRequest *req)
 void scsi_req_data(SCSIRequest *req, int len)
 {
     uint8_t *buf;
+    size_t xfer;
     if (req->io_canceled) {
         trace_scsi_req_data_canceled(req->dev->id, req->lun, req->tag, len);
         return;
     }
     trace_scsi_req_data(req->dev->id, req->lun, req->tag, len);
     assert(req->cmd.mode != SCSI_XFER_NONE);
+    if (req->iov) {
+        /* Same as below, but the buffers are in host memory already */
+        assert(!req->dma_started);
+        req->dma_started = true;
+
+        buf = scsi_req_get_buf(req);
+        xfer = MIN(len, req->iov->size);
+        if (req->cmd.mode == SCSI_XFER_FROM_DEV) {
+            qemu_iovec_from_buf(req->iov, 0, buf, xfer);
+        } else {
+            qemu_iovec_to_buf(req->iov, 0, buf, xfer);
+        }
+        req->resid = req->iov->size - xfer;
+        scsi_req_continue(req);
+        return;
+    }
     if (!req->sg) {
         req->resid -= len;
         req->bus->info->transfer_data(req, len);
@@ -1934,10 +1978,22 @@ static void scsi_device_class_init(ObjectClass *klass, void *data)
     k->props    = scsi_props;
 }
 
+static void scsi_dev_finalize(Object *obj)
+{
+    SCSIDevice *dev = SCSI_DEVICE(obj);
+    SCSIRequest *req;
+
+    while ((req = QSLIST_FIRST(&dev->req_pool))) {
+        QSLIST_REMOVE_HEAD(&dev->req_pool, pool_next);
+        g_free(req);
+    }
+}
+
 static const TypeInfo scsi_device_type_info = {
     .name = TYPE_SCSI_DEVICE,
     .parent = TYPE_DEVICE,
     .instance_size = sizeof(SCSIDevice),
+    .instance_finalize = scsi_dev_finalize,
     .abstract = true,
     .class_size = sizeof(SCSIDeviceClass),
     .class_init = scsi_device_class_init,
@@ -288,6 +288,44 @@ static void scsi_dma_complete(void *opaque, int ret)
     scsi_dma_complete_noio(opaque, ret);
 }
 
+/* Submit the whole transfer of a READ or WRITE as a single block layer
+ * request.  Used when the HBA supplied a scatter/gather list or host
+ * buffers, which skips the bounce buffer and its restart callbacks.  The
+ * caller holds a reference for the AIO.
+ */
+static void scsi_dma_submit(SCSIDiskReq *r, bool is_write)
+{
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
+    BlockDriverState *bs = s->qdev.conf.bs;
+    enum BlockAcctType type = is_write ? BDRV_ACCT_WRITE : BDRV_ACCT_READ;
+    QEMUIOVector *qiov = r->req.iov;
+
+    if (r->req.sg) {
+        dma_acct_start(bs, &r->acct, r->req.sg, type);
+        r->req.resid -= r->req.sg->size;
+        if (is_write) {
+            r->req.aiocb = dma_bdrv_write(bs, r->req.sg, r->sector,
+                                          scsi_dma_complete, r);
+        } else {
+            r->req.aiocb = dma_bdrv_read(bs, r->req.sg, r->sector,
+                                         scsi_dma_complete, r);
+        }
+        return;
+    }
+
+    bdrv_acct_start(bs, &r->acct, qiov->size, type);
+    r->req.resid -= qiov->size;
+    if (is_write) {
+        r->req.aiocb = bdrv_aio_writev(bs, r->sector, qiov,
+                                       qiov->size / BDRV_SECTOR_SIZE,
+                                       scsi_dma_complete, r);
+    } else {
+        r->req.aiocb = bdrv_aio_readv(bs, r->sector, qiov,
+                                      qiov->size / BDRV_SECTOR_SIZE,
+                                      scsi_dma_complete, r);
+    }
+}
+
 static void scsi_read_complete(void * opaque, int ret)
 {
     SCSIDiskReq *r = (SCSIDiskReq *)opaque;
@@ -344,11 +382,8 @@ static void scsi_do_read(void *opaque, int ret)
     /* The request is used as the AIO opaque value, so add a ref.  */
     scsi_req_ref(&r->req);
 
-    if (r->req.sg) {
-        dma_acct_start(s->qdev.conf.bs, &r->acct, r->req.sg, BDRV_ACCT_READ);
-        r->req.resid -= r->req.sg->size;
-        r->req.aiocb = dma_bdrv_read(s->qdev.conf.bs, r->req.sg, r->sector,
-                                     scsi_dma_complete, r);
+    if (r->req.sg || r->req.iov) {
+        scsi_dma_submit(r, false);
     } else {
         n = scsi_init_iovec(r, SCSI_DMA_BUF_SIZE);
         bdrv_acct_start(s->qdev.conf.bs, &r->acct, n * BDRV_SECTOR_SIZE, BDRV_ACCT_READ);
@@ -397,6 +432,9 @@ static void scsi_read_data(SCSIRequest *req)
     if (first && scsi_is_cmd_fua(&r->req.cmd)) {
         bdrv_acct_start(s->qdev.conf.bs, &r->acct, 0, BDRV_ACCT_FLUSH);
         r->req.aiocb = bdrv_aio_flush(s->qdev.conf.bs, scsi_do_read, r);
+    } else if (r->req.sg || r->req.iov) {
+        /* Fast path: nothing to restart, use the reference taken above */
+        scsi_dma_submit(r, false);
     } else {
         scsi_do_read(r, 0);
     }
@@ -493,7 +531,7 @@ static void scsi_write_data(SCSIRequest *req)
         return;
     }
 
-    if (!r->req.sg && !r->qiov.size) {
+    if (!r->req.sg && !r->req.iov && !r->qiov.size) {
         /* Called for the first time.  Ask the driver to send us more data.  */
         r->started = true;
         scsi_write_complete(r, 0);
@@ -506,7 +544,7 @@ static void scsi_write_data(SCSIRequest *req)
 
     if (r->req.cmd.buf[0] == VERIFY_10 || r->req.cmd.buf[0] == VERIFY_12 ||
         r->req.cmd.buf[0] == VERIFY_16) {
-        if (r->req.sg) {
+        if (r->req.sg || r->req.iov) {
             scsi_dma_complete_noio(r, 0);
         } else {
             scsi_write_complete(r, 0);
@@ -514,11 +552,8 @@ static void scsi_write_data(SCSIRequest *req)
         return;
     }
 
-    if (r->req.sg) {
-        dma_acct_start(s->qdev.conf.bs, &r->acct, r->req.sg, BDRV_ACCT_WRITE);
-        r->req.resid -= r->req.sg->size;
-        r->req.aiocb = dma_bdrv_write(s->qdev.conf.bs, r->req.sg, r->sector,
-                                      scsi_dma_complete, r);
+    if (r->req.sg || r->req.iov) {
+        scsi_dma_submit(r, true);
     } else {
         n = r->qiov.size / 512;
         bdrv_acct_start(s->qdev.conf.bs, &r->acct, n * BDRV_SECTOR_SIZE, BDRV_ACCT_WRITE);
@@ -2220,6 +2255,9 @@ static int scsi_initfn(SCSIDevice *dev)
             MAX(s->qdev.conf.logical_block_size, DEFAULT_DISCARD_GRANULARITY);
     }
 
+    /* Reads, writes and emulated commands are SCSIDiskReqs; recycle them */
+    s->qdev.req_pool_size = sizeof(SCSIDiskReq);
+
     if (!s->version) {
         s->version = g_strdup(qemu_get_version());
     }
@@ -57,6 +57,7 @@ typedef struct SCSIGenericReq {
     int buflen;
     int len;
     sg_io_hdr_t io_header;
+    BlockAcctCookie acct;
 } SCSIGenericReq;
 
 static void scsi_generic_save_request(QEMUFile *f, SCSIRequest *req)
@@ -178,6 +179,15 @@ static int execute_command(BlockDriverState *bdrv,
         return -EIO;
     }
 
+    /* Data transfers show up in query-blockstats, including the number of
+     * commands in flight on the LUN.
+     */
+    if (direction != SG_DXFER_NONE) {
+        bdrv_acct_start(bdrv, &r->acct, r->buflen,
+                        direction == SG_DXFER_FROM_DEV ? BDRV_ACCT_READ
+                                                       : BDRV_ACCT_WRITE);
+    }
+
     return 0;
 }
 
@@ -188,6 +198,7 @@ static void scsi_read_complete(void * opaque, int ret)
     int len;
 
     r->req.aiocb = NULL;
+    bdrv_acct_done(s->conf.bs, &r->acct);
     if (ret) {
         DPRINTF("IO error ret %d\n", ret);
         scsi_command_complete(r, ret);
@@ -248,6 +259,7 @@ static void scsi_write_complete(void * opaque, int ret)
 
     DPRINTF("scsi_write_complete() ret = %d\n", ret);
     r->req.aiocb = NULL;
+    bdrv_acct_done(s->conf.bs, &r->acct);
     if (ret) {
         DPRINTF("IO error\n");
         scsi_command_complete(r, ret);
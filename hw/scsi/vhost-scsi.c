@@ -32,7 +32,8 @@ static int vhost_scsi_set_endpoint(VHostSCSI *s)
 
     memset(&backend, 0, sizeof(backend));
     pstrcpy(backend.vhost_wwpn, sizeof(backend.vhost_wwpn), vs->conf.wwpn);
-    ret = ioctl(s->dev.control, VHOST_SCSI_SET_ENDPOINT, &backend);
+    ret = s->dev.vhost_ops->vhost_call(&s->dev, VHOST_SCSI_SET_ENDPOINT,
+                                       &backend);
     if (ret < 0) {
         return -errno;
     }
@@ -46,12 +47,12 @@ static void vhost_scsi_clear_endpoint(VHostSCSI *s)
 
     memset(&backend, 0, sizeof(backend));
     pstrcpy(backend.vhost_wwpn, sizeof(backend.vhost_wwpn), vs->conf.wwpn);
-    ioctl(s->dev.control, VHOST_SCSI_CLEAR_ENDPOINT, &backend);
+    s->dev.vhost_ops->vhost_call(&s->dev, VHOST_SCSI_CLEAR_ENDPOINT, &backend);
 }
 
 static int vhost_scsi_start(VHostSCSI *s)
 {
-    int ret, abi_version, i;
+    int ret, abi_version;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
@@ -61,7 +62,8 @@ static int vhost_scsi_start(VHostSCSI *s)
         return -ENOSYS;
     }
 
-    ret = ioctl(s->dev.control, VHOST_SCSI_GET_ABI_VERSION, &abi_version);
+    ret = s->dev.vhost_ops->vhost_call(&s->dev, VHOST_SCSI_GET_ABI_VERSION,
+                                       &abi_version);
     if (ret < 0) {
         return -errno;
     }
@@ -97,14 +99,6 @@ static int vhost_scsi_start(VHostSCSI *s)
         goto err_endpoint;
     }
 
-    /* guest_notifier_mask/pending not used yet, so just unmask
-     * everything here.  virtio-pci will do the right thing by
-     * enabling/disabling irqfd.
-     */
-    for (i = 0; i < s->dev.nvqs; i++) {
-        vhost_virtqueue_mask(&s->dev, vdev, i, false);
-    }
-
     return ret;
 
 err_endpoint:
@@ -158,6 +152,32 @@ static uint32_t vhost_scsi_get_features(VirtIODevice *vdev,
     return features;
 }
 
+/* With irqfd, interrupts of a vector the guest masked are collected in the
+ * vhost masked notifier instead of going to KVM, virtio-pci asks for them when
+ * the vector is unmasked again.
+ */
+static bool vhost_scsi_guest_notifier_pending(VirtIODevice *vdev, int idx)
+{
+    VHostSCSI *s = VHOST_SCSI(vdev);
+
+    return vhost_virtqueue_pending(&s->dev, idx);
+}
+
+static void vhost_scsi_guest_notifier_mask(VirtIODevice *vdev, int idx,
+                                           bool mask)
+{
+    VHostSCSI *s = VHOST_SCSI(vdev);
+
+    vhost_virtqueue_mask(&s->dev, vdev, idx, mask);
+}
+
+/* All virtqueues, control and event included, are serviced by the kernel
+ * target once vhost is started.  The guest must not kick them before that.
+ */
+static void vhost_scsi_handle_output(VirtIODevice *vdev, VirtQueue *vq)
+{
+}
+
 static void vhost_scsi_set_config(VirtIODevice *vdev,
                                   const uint8_t *config)
 {
@@ -217,7 +237,9 @@ static void vhost_scsi_realize(DeviceState *dev, Error **errp)
         }
     }
 
-    virtio_scsi_common_realize(dev, &err);
+    virtio_scsi_common_realize(dev, &err, vhost_scsi_handle_output,
+                               vhost_scsi_handle_output,
+                               vhost_scsi_handle_output);
     if (err != NULL) {
         error_propagate(errp, err);
         return;
@@ -227,7 +249,17 @@ static void vhost_scsi_realize(DeviceState *dev, Error **errp)
     s->dev.vqs = g_new(struct vhost_virtqueue, s->dev.nvqs);
     s->dev.vq_index = 0;
 
-    ret = vhost_dev_init(&s->dev, vhostfd, "/dev/vhost-scsi", true);
+    if (vhostfd == -1) {
+        vhostfd = open("/dev/vhost-scsi", O_RDWR);
+        if (vhostfd < 0) {
+            error_setg(errp, "vhost-scsi: open vhost char device failed: %s",
+                       strerror(errno));
+            return;
+        }
+    }
+
+    ret = vhost_dev_init(&s->dev, (void *)(uintptr_t)vhostfd,
+                         VHOST_BACKEND_TYPE_KERNEL, true);
     if (ret < 0) {
         error_setg(errp, "vhost-scsi: vhost initialization failed: %s",
                    strerror(-ret));
@@ -273,6 +305,8 @@ static void vhost_scsi_class_init(ObjectClass *klass, void *data)
     vdc->get_features = vhost_scsi_get_features;
     vdc->set_config = vhost_scsi_set_config;
     vdc->set_status = vhost_scsi_set_status;
+    vdc->guest_notifier_mask = vhost_scsi_guest_notifier_mask;
+    vdc->guest_notifier_pending = vhost_scsi_guest_notifier_pending;
 }
 
 static const TypeInfo vhost_scsi_info = {
@@ -15,37 +15,24 @@
 
 #include "hw/virtio/virtio-scsi.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/bitmap.h"
+#include "qemu/main-loop.h"
+#include "block/aio.h"
 #include <hw/scsi/scsi.h>
 #include <block/scsi.h>
 #include <hw/virtio/virtio-bus.h>
-
-typedef struct VirtIOSCSIReq {
-    VirtIOSCSI *dev;
-    VirtQueue *vq;
-    VirtQueueElement elem;
-    QEMUSGList qsgl;
-    SCSIRequest *sreq;
-    union {
-        char                  *buf;
-        VirtIOSCSICmdReq      *cmd;
-        VirtIOSCSICtrlTMFReq  *tmf;
-        VirtIOSCSICtrlANReq   *an;
-    } req;
-    union {
-        char                  *buf;
-        VirtIOSCSICmdResp     *cmd;
-        VirtIOSCSICtrlTMFResp *tmf;
-        VirtIOSCSICtrlANResp  *an;
-        VirtIOSCSIEvent       *event;
-    } resp;
-} VirtIOSCSIReq;
+#ifdef CONFIG_VIRTIO_SCSI_DATA_PLANE
+# include "dataplane/virtio-scsi.h"
+# include "migration/migration.h"
+#endif
 
 static inline int virtio_scsi_get_lun(uint8_t *lun)
 {
     return ((lun[2] << 8) | lun[3]) & 0x3FFF;
 }
 
-static inline SCSIDevice *virtio_scsi_device_find(VirtIOSCSI *s, uint8_t *lun)
+SCSIDevice *virtio_scsi_device_find(VirtIOSCSI *s, uint8_t *lun)
 {
     if (lun[0] != 1) {
         return NULL;
@@ -56,19 +43,43 @@ static inline SCSIDevice *virtio_scsi_device_find(VirtIOSCSI *s, uint8_t *lun)
     return scsi_device_find(&s->bus, 0, lun[1], virtio_scsi_get_lun(lun));
 }
 
-static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
+static void virtio_scsi_notify_bh(void *opaque)
+{
+    VirtIOSCSI *s = opaque;
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    unsigned long nvqs = s->parent_obj.conf.num_queues + 2;
+    unsigned long i;
+
+    for (i = find_first_bit(s->notify_vqs, nvqs); i < nvqs;
+         i = find_next_bit(s->notify_vqs, nvqs, i + 1)) {
+        clear_bit(i, s->notify_vqs);
+        virtio_notify(vdev, virtio_get_queue(vdev, i));
+    }
+}
+
+void virtio_scsi_complete_req(VirtIOSCSIReq *req)
 {
     VirtIOSCSI *s = req->dev;
     VirtQueue *vq = req->vq;
-    VirtIODevice *vdev = VIRTIO_DEVICE(s);
-    virtqueue_push(vq, &req->elem, req->qsgl.size + req->elem.in_sg[0].iov_len);
-    qemu_sglist_destroy(&req->qsgl);
+
     if (req->sreq) {
         req->sreq->hba_private = NULL;
         scsi_req_unref(req->sreq);
     }
+#ifdef CONFIG_VIRTIO_SCSI_DATA_PLANE
+    if (req->dpq) {
+        virtio_scsi_data_plane_complete_req(req);
+        return;
+    }
+#endif
+
+    virtqueue_push_buf(vq, req->elem,
+                       req->qsgl.size + req->elem->in_sg[0].iov_len);
+    qemu_sglist_destroy(&req->qsgl);
+    virtqueue_buf_free(req->elem);
     g_free(req);
-    virtio_notify(vdev, vq);
+    set_bit(virtio_queue_get_id(vq), s->notify_vqs);
+    qemu_bh_schedule(s->notify_bh);
 }
 
 static void virtio_scsi_bad_req(void)
@@ -91,35 +102,40 @@ static void qemu_sgl_init_external(VirtIOSCSIReq *req, struct iovec *sg,
 static void virtio_scsi_parse_req(VirtIOSCSI *s, VirtQueue *vq,
                                   VirtIOSCSIReq *req)
 {
-    assert(req->elem.in_num);
+    VirtQueueBuf *elem = req->elem;
+
+    assert(elem->in_num);
     req->vq = vq;
     req->dev = s;
     req->sreq = NULL;
-    if (req->elem.out_num) {
-        req->req.buf = req->elem.out_sg[0].iov_base;
+    req->dpq = NULL;
+    req->mode = elem->in_num > 1 ? SCSI_XFER_FROM_DEV : SCSI_XFER_TO_DEV;
+    if (elem->out_num) {
+        req->req.buf = elem->out_sg[0].iov_base;
     }
-    req->resp.buf = req->elem.in_sg[0].iov_base;
+    req->resp.buf = elem->in_sg[0].iov_base;
 
-    if (req->elem.out_num > 1) {
-        qemu_sgl_init_external(req, &req->elem.out_sg[1],
-                               &req->elem.out_addr[1],
-                               req->elem.out_num - 1);
+    if (elem->out_num > 1) {
+        qemu_sgl_init_external(req, &elem->out_sg[1], &elem->out_addr[1],
+                               elem->out_num - 1);
     } else {
-        qemu_sgl_init_external(req, &req->elem.in_sg[1],
-                               &req->elem.in_addr[1],
-                               req->elem.in_num - 1);
+        qemu_sgl_init_external(req, &elem->in_sg[1], &elem->in_addr[1],
+                               elem->in_num - 1);
     }
 }
 
 static VirtIOSCSIReq *virtio_scsi_pop_req(VirtIOSCSI *s, VirtQueue *vq)
 {
     VirtIOSCSIReq *req;
-    req = g_malloc(sizeof(*req));
-    if (!virtqueue_pop(vq, &req->elem)) {
-        g_free(req);
+    VirtQueueBuf *elem;
+
+    elem = virtqueue_pop_buf(vq);
+    if (!elem) {
         return NULL;
     }
 
+    req = g_malloc(sizeof(*req));
+    req->elem = elem;
     virtio_scsi_parse_req(s, vq, req);
     return req;
 }
@@ -130,9 +146,11 @@ static void virtio_scsi_save_request(QEMUFile *f, SCSIRequest *sreq)
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(req->dev);
     uint32_t n = virtio_queue_get_id(req->vq) - 2;
 
+    /* The dataplane is stopped while migrating */
+    assert(!req->dpq);
     assert(n < vs->conf.num_queues);
     qemu_put_be32s(f, &n);
-    qemu_put_buffer(f, (unsigned char *)&req->elem, sizeof(req->elem));
+    virtqueue_buf_save(f, req->elem);
 }
 
 static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
@@ -146,25 +164,39 @@ static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
     req = g_malloc(sizeof(*req));
     qemu_get_be32s(f, &n);
     assert(n < vs->conf.num_queues);
-    qemu_get_buffer(f, (unsigned char *)&req->elem, sizeof(req->elem));
+    req->elem = virtqueue_buf_load(f);
+    if (!req->elem) {
+        error_report("Invalid virtio-scsi request in migration stream");
+        exit(1);
+    }
+    virtqueue_buf_map(req->elem);
     virtio_scsi_parse_req(s, vs->cmd_vqs[n], req);
 
     scsi_req_ref(sreq);
     req->sreq = sreq;
     if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
-        int req_mode =
-            (req->elem.in_num > 1 ? SCSI_XFER_FROM_DEV : SCSI_XFER_TO_DEV);
-
-        assert(req->sreq->cmd.mode == req_mode);
+        assert(req->sreq->cmd.mode == req->mode);
     }
     return req;
 }
 
-static void virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
+/* With x-data-plane, the requests of a LUN are only touched by whoever
+ * holds the AioContext of its drive.
+ */
+static AioContext *virtio_scsi_lun_aio_context(SCSIDevice *d)
+{
+    if (!d->conf.bs) {
+        return qemu_get_aio_context();
+    }
+    return bdrv_get_aio_context(d->conf.bs);
+}
+
+static void virtio_scsi_do_tmf_locked(VirtIOSCSI *s, SCSIDevice *d,
+                                      VirtIOSCSIReq *req)
 {
-    SCSIDevice *d = virtio_scsi_device_find(s, req->req.tmf->lun);
     SCSIRequest *r, *next;
     BusChild *kid;
+    AioContext *ctx;
     int target;
 
     /* Here VIRTIO_SCSI_S_OK means "FUNCTION COMPLETE".  */
@@ -244,7 +276,10 @@ static void virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
         QTAILQ_FOREACH(kid, &s->bus.qbus.children, sibling) {
              d = DO_UPCAST(SCSIDevice, qdev, kid->child);
              if (d->channel == 0 && d->id == target) {
+                ctx = virtio_scsi_lun_aio_context(d);
+                aio_context_acquire(ctx);
                 qdev_reset_all(&d->qdev);
+                aio_context_release(ctx);
              }
         }
         s->resetting--;
@@ -266,6 +301,21 @@ fail:
     req->resp.tmf->response = VIRTIO_SCSI_S_BAD_TARGET;
 }
 
+static void virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
+{
+    SCSIDevice *d = virtio_scsi_device_find(s, req->req.tmf->lun);
+    AioContext *ctx = NULL;
+
+    if (d) {
+        ctx = virtio_scsi_lun_aio_context(d);
+        aio_context_acquire(ctx);
+    }
+    virtio_scsi_do_tmf_locked(s, d, req);
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
 static void virtio_scsi_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOSCSI *s = (VirtIOSCSI *)vdev;
@@ -273,13 +323,13 @@ static void virtio_scsi_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 
     while ((req = virtio_scsi_pop_req(s, vq))) {
         int out_size, in_size;
-        if (req->elem.out_num < 1 || req->elem.in_num < 1) {
+        if (req->elem->out_num < 1 || req->elem->in_num < 1) {
             virtio_scsi_bad_req();
             continue;
         }
 
-        out_size = req->elem.out_sg[0].iov_len;
-        in_size = req->elem.in_sg[0].iov_len;
+        out_size = req->elem->out_sg[0].iov_len;
+        in_size = req->elem->in_sg[0].iov_len;
         if (req->req.tmf->type == VIRTIO_SCSI_T_TMF) {
             if (out_size < sizeof(VirtIOSCSICtrlTMFReq) ||
                 in_size < sizeof(VirtIOSCSICtrlTMFResp)) {
@@ -323,7 +373,14 @@ static QEMUSGList *virtio_scsi_get_sg_list(SCSIRequest *r)
 {
     VirtIOSCSIReq *req = r->hba_private;
 
-    return &req->qsgl;
+    return req->dpq ? NULL : &req->qsgl;
+}
+
+static QEMUIOVector *virtio_scsi_get_iov(SCSIRequest *r)
+{
+    VirtIOSCSIReq *req = r->hba_private;
+
+    return req->dpq ? &req->qiov : NULL;
 }
 
 static void virtio_scsi_request_cancelled(SCSIRequest *r)
@@ -347,6 +404,50 @@ static void virtio_scsi_fail_cmd_req(VirtIOSCSIReq *req)
     virtio_scsi_complete_req(req);
 }
 
+/* Hand a command request whose headers have been checked to the SCSI layer.
+ * Called from the main loop, or from the thread that owns d's AioContext.
+ */
+void virtio_scsi_handle_cmd_req(VirtIOSCSI *s, SCSIDevice *d,
+                                VirtIOSCSIReq *req)
+{
+    size_t size;
+    unsigned int niov;
+
+    if (!d) {
+        req->resp.cmd->response = VIRTIO_SCSI_S_BAD_TARGET;
+        virtio_scsi_complete_req(req);
+        return;
+    }
+    req->sreq = scsi_req_new(d, req->req.cmd->tag,
+                             virtio_scsi_get_lun(req->req.cmd->lun),
+                             req->req.cmd->cdb, req);
+
+    if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
+        size = req->dpq ? req->qiov.size : req->qsgl.size;
+        if (req->sreq->cmd.mode != req->mode ||
+            req->sreq->cmd.xfer > size) {
+            req->resp.cmd->response = VIRTIO_SCSI_S_OVERRUN;
+            virtio_scsi_complete_req(req);
+            return;
+        }
+
+        /* Host buffers go to the block layer as they are, so they must
+         * cover whole sectors: drop what the command does not transfer.
+         */
+        if (req->dpq && req->sreq->cmd.xfer < size) {
+            niov = req->qiov.niov;
+            iov_discard_back(req->qiov.iov, &niov,
+                             size - req->sreq->cmd.xfer);
+            req->qiov.niov = niov;
+            req->qiov.size = req->sreq->cmd.xfer;
+        }
+    }
+
+    if (scsi_req_enqueue(req->sreq)) {
+        scsi_req_continue(req->sreq);
+    }
+}
+
 static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
 {
     /* use non-QOM casts in the data path */
@@ -354,53 +455,40 @@ static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
     VirtIOSCSICommon *vs = &s->parent_obj;
 
     VirtIOSCSIReq *req;
-    int n;
+
+#ifdef CONFIG_VIRTIO_SCSI_DATA_PLANE
+    /* Some guests kick before setting VIRTIO_CONFIG_S_DRIVER_OK so start
+     * dataplane here instead of waiting for .set_status().
+     */
+    if (s->dataplane && !s->dataplane_fenced) {
+        if (virtio_scsi_data_plane_start(s->dataplane)) {
+            return;
+        }
+        s->dataplane_fenced = true;
+    }
+#endif
 
     while ((req = virtio_scsi_pop_req(s, vq))) {
         SCSIDevice *d;
         int out_size, in_size;
-        if (req->elem.out_num < 1 || req->elem.in_num < 1) {
+        if (req->elem->out_num < 1 || req->elem->in_num < 1) {
             virtio_scsi_bad_req();
         }
 
-        out_size = req->elem.out_sg[0].iov_len;
-        in_size = req->elem.in_sg[0].iov_len;
+        out_size = req->elem->out_sg[0].iov_len;
+        in_size = req->elem->in_sg[0].iov_len;
         if (out_size < sizeof(VirtIOSCSICmdReq) + vs->cdb_size ||
             in_size < sizeof(VirtIOSCSICmdResp) + vs->sense_size) {
             virtio_scsi_bad_req();
         }
 
-        if (req->elem.out_num > 1 && req->elem.in_num > 1) {
+        if (req->elem->out_num > 1 && req->elem->in_num > 1) {
             virtio_scsi_fail_cmd_req(req);
             continue;
         }
 
         d = virtio_scsi_device_find(s, req->req.cmd->lun);
-        if (!d) {
-            req->resp.cmd->response = VIRTIO_SCSI_S_BAD_TARGET;
-            virtio_scsi_complete_req(req);
-            continue;
-        }
-        req->sreq = scsi_req_new(d, req->req.cmd->tag,
-                                 virtio_scsi_get_lun(req->req.cmd->lun),
-                                 req->req.cmd->cdb, req);
-
-        if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
-            int req_mode =
-                (req->elem.in_num > 1 ? SCSI_XFER_FROM_DEV : SCSI_XFER_TO_DEV);
-
-            if (req->sreq->cmd.mode != req_mode ||
-                req->sreq->cmd.xfer > req->qsgl.size) {
-                req->resp.cmd->response = VIRTIO_SCSI_S_OVERRUN;
-                virtio_scsi_complete_req(req);
-                continue;
-            }
-        }
-
-        n = scsi_req_enqueue(req->sreq);
-        if (n) {
-            scsi_req_continue(req->sreq);
-        }
+        virtio_scsi_handle_cmd_req(s, d, req);
     }
 }
 
@@ -444,6 +532,45 @@ static uint32_t virtio_scsi_get_features(VirtIODevice *vdev,
     return requested_features;
 }
 
+#ifdef CONFIG_VIRTIO_SCSI_DATA_PLANE
+static void virtio_scsi_set_status(VirtIODevice *vdev, uint8_t status)
+{
+    VirtIOSCSI *s = VIRTIO_SCSI(vdev);
+
+    if (s->dataplane && !(status & (VIRTIO_CONFIG_S_DRIVER |
+                                    VIRTIO_CONFIG_S_DRIVER_OK))) {
+        virtio_scsi_data_plane_stop(s->dataplane);
+        s->dataplane_fenced = false;
+    }
+}
+
+/* Disable dataplane threads during live migration since they do not
+ * update the dirty memory bitmap yet.
+ */
+static void virtio_scsi_migration_state_changed(Notifier *notifier,
+                                                void *data)
+{
+    VirtIOSCSI *s = container_of(notifier, VirtIOSCSI,
+                                 migration_state_notifier);
+    MigrationState *mig = data;
+
+    if (migration_in_setup(mig)) {
+        if (!s->dataplane) {
+            return;
+        }
+        virtio_scsi_data_plane_destroy(s->dataplane);
+        s->dataplane = NULL;
+    } else if (migration_has_finished(mig) ||
+               migration_has_failed(mig)) {
+        if (s->dataplane) {
+            return;
+        }
+        bdrv_drain_all(); /* complete in-flight non-dataplane requests */
+        virtio_scsi_data_plane_create(s, &s->dataplane);
+    }
+}
+#endif /* CONFIG_VIRTIO_SCSI_DATA_PLANE */
+
 static void virtio_scsi_reset(VirtIODevice *vdev)
 {
     VirtIOSCSI *s = VIRTIO_SCSI(vdev);
@@ -453,6 +580,10 @@ static void virtio_scsi_reset(VirtIODevice *vdev)
     qbus_reset_all(&s->bus.qbus);
     s->resetting--;
 
+    /* The rings are gone, so are the interrupts for them */
+    qemu_bh_cancel(s->notify_bh);
+    bitmap_zero(s->notify_vqs, vs->conf.num_queues + 2);
+
     vs->sense_size = VIRTIO_SCSI_SENSE_SIZE;
     vs->cdb_size = VIRTIO_SCSI_CDB_SIZE;
     s->events_dropped = false;
@@ -464,6 +595,9 @@ static void virtio_scsi_reset(VirtIODevice *vdev)
 static void virtio_scsi_save(QEMUFile *f, void *opaque)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(opaque);
+
+    /* Interrupts are part of the device state, do not lose pending ones */
+    virtio_scsi_notify_bh(opaque);
     virtio_save(vdev, f);
 }
 
@@ -497,7 +631,7 @@ static void virtio_scsi_push_event(VirtIOSCSI *s, SCSIDevice *dev,
         return;
     }
 
-    if (req->elem.out_num || req->elem.in_num != 1) {
+    if (req->elem->out_num || req->elem->in_num != 1) {
         virtio_scsi_bad_req();
     }
 
@@ -506,7 +640,7 @@ static void virtio_scsi_push_event(VirtIOSCSI *s, SCSIDevice *dev,
         s->events_dropped = false;
     }
 
-    in_size = req->elem.in_sg[0].iov_len;
+    in_size = req->elem->in_sg[0].iov_len;
     if (in_size < sizeof(VirtIOSCSIEvent)) {
         virtio_scsi_bad_req();
     }
@@ -585,16 +719,27 @@ static struct SCSIBusInfo virtio_scsi_scsi_info = {
     .hotplug = virtio_scsi_hotplug,
     .hot_unplug = virtio_scsi_hot_unplug,
     .get_sg_list = virtio_scsi_get_sg_list,
+    .get_iov = virtio_scsi_get_iov,
     .save_request = virtio_scsi_save_request,
     .load_request = virtio_scsi_load_request,
 };
 
-void virtio_scsi_common_realize(DeviceState *dev, Error **errp)
+void virtio_scsi_common_realize(DeviceState *dev, Error **errp,
+                                HandleOutput ctrl, HandleOutput evt,
+                                HandleOutput cmd)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOSCSICommon *s = VIRTIO_SCSI_COMMON(dev);
     int i;
 
+    if (s->conf.num_queues == 0 ||
+        s->conf.num_queues > VIRTIO_PCI_QUEUE_MAX - 2) {
+        error_setg(errp, "Invalid number of queues (= %" PRIu32 "), "
+                         "must be a positive integer less than %d.",
+                   s->conf.num_queues, VIRTIO_PCI_QUEUE_MAX - 2);
+        return;
+    }
+
     virtio_init(vdev, "virtio-scsi", VIRTIO_ID_SCSI,
                 sizeof(VirtIOSCSIConfig));
 
@@ -602,13 +747,10 @@ void virtio_scsi_common_realize(DeviceState *dev, Error **errp)
     s->sense_size = VIRTIO_SCSI_SENSE_SIZE;
     s->cdb_size = VIRTIO_SCSI_CDB_SIZE;
 
-    s->ctrl_vq = virtio_add_queue(vdev, VIRTIO_SCSI_VQ_SIZE,
-                                  virtio_scsi_handle_ctrl);
-    s->event_vq = virtio_add_queue(vdev, VIRTIO_SCSI_VQ_SIZE,
-                                   virtio_scsi_handle_event);
+    s->ctrl_vq = virtio_add_queue(vdev, VIRTIO_SCSI_VQ_SIZE, ctrl);
+    s->event_vq = virtio_add_queue(vdev, VIRTIO_SCSI_VQ_SIZE, evt);
     for (i = 0; i < s->conf.num_queues; i++) {
-        s->cmd_vqs[i] = virtio_add_queue(vdev, VIRTIO_SCSI_VQ_SIZE,
-                                         virtio_scsi_handle_cmd);
+        s->cmd_vqs[i] = virtio_add_queue(vdev, VIRTIO_SCSI_VQ_SIZE, cmd);
     }
 }
 
@@ -619,7 +761,9 @@ static void virtio_scsi_device_realize(DeviceState *dev, Error **errp)
     static int virtio_scsi_id;
     Error *err = NULL;
 
-    virtio_scsi_common_realize(dev, &err);
+    virtio_scsi_common_realize(dev, &err, virtio_scsi_handle_ctrl,
+                               virtio_scsi_handle_event,
+                               virtio_scsi_handle_cmd);
     if (err != NULL) {
         error_propagate(errp, err);
         return;
@@ -627,6 +771,18 @@ static void virtio_scsi_device_realize(DeviceState *dev, Error **errp)
 
     scsi_bus_new(&s->bus, sizeof(s->bus), dev,
                  &virtio_scsi_scsi_info, vdev->bus_name);
+    s->notify_bh = qemu_bh_new(virtio_scsi_notify_bh, s);
+    s->notify_vqs = bitmap_new(s->parent_obj.conf.num_queues + 2);
+
+#ifdef CONFIG_VIRTIO_SCSI_DATA_PLANE
+    virtio_scsi_data_plane_create(s, &s->dataplane);
+    if (s->dataplane) {
+        /* LUNs are assigned to the dataplane threads when they start */
+        s->bus.qbus.allow_hotplug = 0;
+    }
+    s->migration_state_notifier.notify = virtio_scsi_migration_state_changed;
+    add_migration_state_change_notifier(&s->migration_state_notifier);
+#endif
 
     if (!dev->hotplugged) {
         scsi_bus_legacy_handle_cmdline(&s->bus, &err);
@@ -653,7 +809,14 @@ static void virtio_scsi_device_unrealize(DeviceState *dev, Error **errp)
 {
     VirtIOSCSI *s = VIRTIO_SCSI(dev);
 
+#ifdef CONFIG_VIRTIO_SCSI_DATA_PLANE
+    remove_migration_state_change_notifier(&s->migration_state_notifier);
+    virtio_scsi_data_plane_destroy(s->dataplane);
+    s->dataplane = NULL;
+#endif
     unregister_savevm(dev, "virtio-scsi", s);
+    qemu_bh_delete(s->notify_bh);
+    g_free(s->notify_vqs);
 
     virtio_scsi_common_unrealize(dev, errp);
 }
@@ -684,6 +847,9 @@ static void virtio_scsi_class_init(ObjectClass *klass, void *data)
     vdc->set_config = virtio_scsi_set_config;
     vdc->get_features = virtio_scsi_get_features;
     vdc->reset = virtio_scsi_reset;
+#ifdef CONFIG_VIRTIO_SCSI_DATA_PLANE
+    vdc->set_status = virtio_scsi_set_status;
+#endif
 }
 
 static const TypeInfo virtio_scsi_common_info = {
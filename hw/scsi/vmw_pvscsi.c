@@ -69,6 +69,18 @@ typedef struct PVSCSISGState {
     uint32_t resid;
 } PVSCSISGState;
 
+/* SG elements are read ahead this many at a time, within the page */
+#define PVSCSI_SG_BATCH                   (16)
+
+typedef struct PVSCSISGBatch {
+    struct PVSCSISGElement elem[PVSCSI_SG_BATCH];
+    int count;
+    int next;
+} PVSCSISGBatch;
+
+/* Completion descriptors written to the ring at once */
+#define PVSCSI_CMP_BATCH                  (16)
+
 typedef QTAILQ_HEAD(, PVSCSIRequest) PVSCSIRequestList;
 
 typedef struct {
@@ -98,6 +110,12 @@ typedef struct {
 
     PVSCSIRingInfo rings;                /* Data transfer rings manager      */
     uint32_t resetting;                  /* Reset in progress                */
+
+    /* Completion interrupt coalescing */
+    uint32_t intr_coalesce_max;          /* Completions per interrupt        */
+    uint32_t intr_coalesce_usecs;        /* Longest delay of an interrupt    */
+    uint32_t cmp_held;                   /* Completions not signalled yet    */
+    QEMUTimer *coalesce_timer;
 } PVSCSIState;
 
 typedef struct PVSCSIRequest {
@@ -208,12 +226,17 @@ pvscsi_ring_cleanup(PVSCSIRingInfo *mgr)
     memset(mgr->msg_ring_pages_pa, 0, sizeof(mgr->msg_ring_pages_pa));
 }
 
+/* @ready_ptr caches the producer index, which is only read again once the
+ * requests it announced are consumed
+ */
 static hwaddr
-pvscsi_ring_pop_req_descr(PVSCSIRingInfo *mgr)
+pvscsi_ring_pop_req_descr(PVSCSIRingInfo *mgr, uint32_t *ready_ptr)
 {
-    uint32_t ready_ptr = RS_GET_FIELD(mgr->rs_pa, reqProdIdx);
+    if (*ready_ptr == (uint32_t)mgr->consumed_ptr) {
+        *ready_ptr = RS_GET_FIELD(mgr->rs_pa, reqProdIdx);
+    }
 
-    if (ready_ptr != mgr->consumed_ptr) {
+    if (*ready_ptr != (uint32_t)mgr->consumed_ptr) {
         uint32_t next_ready_ptr =
             mgr->consumed_ptr++ & mgr->txr_len_mask;
         uint32_t next_ready_page =
@@ -311,6 +334,8 @@ pvscsi_reset_state(PVSCSIState *s)
     s->msg_ring_info_valid = FALSE;
     QTAILQ_INIT(&s->pending_queue);
     QTAILQ_INIT(&s->completion_queue);
+    s->cmp_held = 0;
+    timer_del(s->coalesce_timer);
 }
 
 static void
@@ -355,15 +380,39 @@ pvscsi_raise_message_interrupt(PVSCSIState *s)
     pvscsi_update_irq_status(s);
 }
 
+/*
+ * Hold back the completion interrupt until intr_coalesce_max completions
+ * are waiting, intr_coalesce_usecs have passed, or no request is left in
+ * flight, so that the guest is never left waiting for the last ones.
+ */
+static void
+pvscsi_coalesce_completion_interrupt(PVSCSIState *s, uint32_t completed)
+{
+    s->cmp_held += completed;
+    if (s->cmp_held < s->intr_coalesce_max &&
+        !QTAILQ_EMPTY(&s->pending_queue)) {
+        if (s->intr_coalesce_usecs && !timer_pending(s->coalesce_timer)) {
+            timer_mod(s->coalesce_timer,
+                      qemu_clock_get_us(QEMU_CLOCK_VIRTUAL) +
+                      s->intr_coalesce_usecs);
+        }
+        return;
+    }
+
+    s->cmp_held = 0;
+    timer_del(s->coalesce_timer);
+    pvscsi_raise_completion_interrupt(s);
+}
+
 static void
-pvscsi_cmp_ring_put(PVSCSIState *s, struct PVSCSIRingCmpDesc *cmp_desc)
+pvscsi_coalesce_timer(void *opaque)
 {
-    hwaddr cmp_descr_pa;
+    PVSCSIState *s = opaque;
 
-    cmp_descr_pa = pvscsi_ring_pop_cmp_descr(&s->rings);
-    trace_pvscsi_cmp_ring_put(cmp_descr_pa);
-    cpu_physical_memory_write(cmp_descr_pa, (void *)cmp_desc,
-                              sizeof(*cmp_desc));
+    if (s->cmp_held) {
+        s->cmp_held = 0;
+        pvscsi_raise_completion_interrupt(s);
+    }
 }
 
 static void
@@ -382,19 +431,39 @@ pvscsi_process_completion_queue(void *opaque)
 {
     PVSCSIState *s = opaque;
     PVSCSIRequest *pvscsi_req;
-    bool has_completed = false;
+    struct PVSCSIRingCmpDesc batch[PVSCSI_CMP_BATCH];
+    hwaddr batch_pa = 0, cmp_descr_pa;
+    uint32_t completed = 0;
+    int n = 0;
 
     while (!QTAILQ_EMPTY(&s->completion_queue)) {
         pvscsi_req = QTAILQ_FIRST(&s->completion_queue);
         QTAILQ_REMOVE(&s->completion_queue, pvscsi_req, next);
-        pvscsi_cmp_ring_put(s, &pvscsi_req->cmp);
+
+        cmp_descr_pa = pvscsi_ring_pop_cmp_descr(&s->rings);
+        trace_pvscsi_cmp_ring_put(cmp_descr_pa);
+
+        /* Write runs of adjacent descriptors with a single access */
+        if (n == PVSCSI_CMP_BATCH ||
+            (n && cmp_descr_pa != batch_pa + n * sizeof(batch[0]))) {
+            cpu_physical_memory_write(batch_pa, batch, n * sizeof(batch[0]));
+            n = 0;
+        }
+        if (!n) {
+            batch_pa = cmp_descr_pa;
+        }
+        batch[n++] = pvscsi_req->cmp;
+
         g_free(pvscsi_req);
-        has_completed = true;
+        completed++;
     }
 
-    if (has_completed) {
+    if (n) {
+        cpu_physical_memory_write(batch_pa, batch, n * sizeof(batch[0]));
+    }
+    if (completed) {
         pvscsi_ring_flush_cmp(&s->rings);
-        pvscsi_raise_completion_interrupt(s);
+        pvscsi_coalesce_completion_interrupt(s, completed);
     }
 }
 
@@ -445,11 +514,23 @@ static QEMUSGList *pvscsi_get_sg_list(SCSIRequest *r)
 }
 
 static void
-pvscsi_get_next_sg_elem(PVSCSISGState *sg)
+pvscsi_get_next_sg_elem(PCIDevice *d, PVSCSISGState *sg, PVSCSISGBatch *batch)
 {
     struct PVSCSISGElement elem;
 
-    cpu_physical_memory_read(sg->elemAddr, (void *)&elem, sizeof(elem));
+    /* The elements of a request are contiguous: read ahead up to the end
+     * of the page of this one
+     */
+    if (batch->next == batch->count) {
+        uint32_t left = VMW_PAGE_SIZE - (sg->elemAddr & (VMW_PAGE_SIZE - 1));
+
+        batch->count = MAX(1, MIN(PVSCSI_SG_BATCH, left / sizeof(elem)));
+        batch->next = 0;
+        pci_dma_read(d, sg->elemAddr, batch->elem,
+                     batch->count * sizeof(elem));
+    }
+    elem = batch->elem[batch->next++];
+
     if ((elem.flags & ~PVSCSI_KNOWN_FLAGS) != 0) {
         /*
             * There is PVSCSI_SGE_FLAG_CHAIN_ELEMENT flag described in
@@ -594,9 +675,11 @@ pvscsi_convert_sglist(PVSCSIRequest *r)
     int chunk_size;
     uint64_t data_length = r->req.dataLen;
     PVSCSISGState sg = r->sg;
+    PVSCSISGBatch batch = { .count = 0, .next = 0 };
+
     while (data_length) {
         while (!sg.resid) {
-            pvscsi_get_next_sg_elem(&sg);
+            pvscsi_get_next_sg_elem(PCI_DEVICE(r->dev), &sg, &batch);
             trace_pvscsi_convert_sglist(r->req.context, r->sg.dataAddr,
                                         r->sg.resid);
         }
@@ -675,9 +758,11 @@ pvscsi_process_io(PVSCSIState *s)
 {
     PVSCSIRingReqDesc descr;
     hwaddr next_descr_pa;
+    uint32_t ready_ptr = s->rings.consumed_ptr;
 
     assert(s->rings_info_valid);
-    while ((next_descr_pa = pvscsi_ring_pop_req_descr(&s->rings)) != 0) {
+    while ((next_descr_pa =
+            pvscsi_ring_pop_req_descr(&s->rings, &ready_ptr)) != 0) {
 
         /* Only read after production index verification */
         smp_rmb();
@@ -1087,6 +1172,8 @@ pvscsi_init(PCIDevice *pci_dev)
         memory_region_destroy(&s->io_space);
         return -ENOMEM;
     }
+    s->coalesce_timer = timer_new_us(QEMU_CLOCK_VIRTUAL,
+                                     pvscsi_coalesce_timer, s);
 
     scsi_bus_new(&s->bus, sizeof(s->bus), DEVICE(pci_dev),
                  &pvscsi_scsi_info, NULL);
@@ -1102,6 +1189,8 @@ pvscsi_uninit(PCIDevice *pci_dev)
 
     trace_pvscsi_state("uninit");
     qemu_bh_delete(s->completion_worker);
+    timer_del(s->coalesce_timer);
+    timer_free(s->coalesce_timer);
 
     pvscsi_cleanup_msi(s);
 
@@ -1181,6 +1270,10 @@ pvscsi_write_config(PCIDevice *pci, uint32_t addr, uint32_t val, int len)
 
 static Property pvscsi_properties[] = {
     DEFINE_PROP_UINT8("use_msg", PVSCSIState, use_msg, 1),
+    DEFINE_PROP_UINT32("x-intr-coalesce-max", PVSCSIState,
+                       intr_coalesce_max, 0),
+    DEFINE_PROP_UINT32("x-intr-coalesce-usecs", PVSCSIState,
+                       intr_coalesce_usecs, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
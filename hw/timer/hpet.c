@@ -28,6 +28,8 @@
 #include "hw/i386/pc.h"
 #include "ui/console.h"
 #include "qemu/timer.h"
+#include "qemu/seqlock.h"
+#include "qemu/main-loop.h"
 #include "hw/timer/hpet.h"
 #include "hw/sysbus.h"
 #include "hw/timer/mc146818rtc.h"
@@ -66,6 +68,12 @@ typedef struct HPETState {
     /*< public >*/
 
     MemoryRegion iomem;
+    /* The main counter, read without the global lock */
+    MemoryRegion counter_iomem;
+    /* Protects config's enable bit, hpet_offset and hpet_counter for
+     * hpet_read_counter(); writers hold the global lock.
+     */
+    QemuSeqLock counter_lock;
     uint64_t hpet_offset;
     qemu_irq irqs[HPET_NUM_IRQ_ROUTES];
     uint32_t flags;
@@ -155,6 +163,25 @@ static uint64_t hpet_get_ticks(HPETState *s)
     return ns_to_ticks(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + s->hpet_offset);
 }
 
+/* Can be called without the global lock */
+static uint64_t hpet_read_counter(HPETState *s)
+{
+    uint64_t config, offset, counter;
+    unsigned start;
+
+    do {
+        start = seqlock_read_begin(&s->counter_lock);
+        config = s->config;
+        offset = s->hpet_offset;
+        counter = s->hpet_counter;
+    } while (seqlock_read_retry(&s->counter_lock, start));
+
+    if (!(config & HPET_CFG_ENABLE)) {
+        return counter;
+    }
+    return ns_to_ticks(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + offset);
+}
+
 /*
  * calculate diff between comparator value and current ticks
  */
@@ -226,7 +253,9 @@ static void hpet_pre_save(void *opaque)
     HPETState *s = opaque;
 
     /* save current counter value */
+    seqlock_write_lock(&s->counter_lock);
     s->hpet_counter = hpet_get_ticks(s);
+    seqlock_write_unlock(&s->counter_lock);
 }
 
 static int hpet_pre_load(void *opaque)
@@ -243,7 +272,9 @@ static int hpet_post_load(void *opaque, int version_id)
     HPETState *s = opaque;
 
     /* Recalculate the offset between the main counter and guest time */
+    seqlock_write_lock(&s->counter_lock);
     s->hpet_offset = ticks_to_ns(s->hpet_counter) - qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    seqlock_write_unlock(&s->counter_lock);
 
     /* Push number of timers into capability returned via HPET_ID */
     s->capability &= ~HPET_ID_NUM_TIM_MASK;
@@ -446,19 +477,11 @@ static uint64_t hpet_ram_read(void *opaque, hwaddr addr,
             DPRINTF("qemu: invalid HPET_CFG + 4 hpet_ram_readl\n");
             return 0;
         case HPET_COUNTER:
-            if (hpet_enabled(s)) {
-                cur_tick = hpet_get_ticks(s);
-            } else {
-                cur_tick = s->hpet_counter;
-            }
+            cur_tick = hpet_read_counter(s);
             DPRINTF("qemu: reading counter  = %" PRIx64 "\n", cur_tick);
             return cur_tick;
         case HPET_COUNTER + 4:
-            if (hpet_enabled(s)) {
-                cur_tick = hpet_get_ticks(s);
-            } else {
-                cur_tick = s->hpet_counter;
-            }
+            cur_tick = hpet_read_counter(s);
             DPRINTF("qemu: reading counter + 4  = %" PRIx64 "\n", cur_tick);
             return cur_tick >> 32;
         case HPET_STATUS:
@@ -573,11 +596,18 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
             return;
         case HPET_CFG:
             val = hpet_fixup_reg(new_val, old_val, HPET_CFG_WRITE_MASK);
+            seqlock_write_lock(&s->counter_lock);
             s->config = (s->config & 0xffffffff00000000ULL) | val;
             if (activating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
-                /* Enable main counter and interrupt generation. */
                 s->hpet_offset =
                     ticks_to_ns(s->hpet_counter) - qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+            } else if (deactivating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
+                s->hpet_counter = hpet_get_ticks(s);
+            }
+            seqlock_write_unlock(&s->counter_lock);
+
+            if (activating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
+                /* Enable main counter and interrupt generation. */
                 for (i = 0; i < s->num_timers; i++) {
                     if ((&s->timer[i])->cmp != ~0ULL) {
                         hpet_set_timer(&s->timer[i]);
@@ -585,7 +615,6 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
                 }
             } else if (deactivating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
                 /* Halt main counter and disable interrupt generation. */
-                s->hpet_counter = hpet_get_ticks(s);
                 for (i = 0; i < s->num_timers; i++) {
                     hpet_del_timer(&s->timer[i]);
                 }
@@ -617,8 +646,10 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
             if (hpet_enabled(s)) {
                 DPRINTF("qemu: Writing counter while HPET enabled!\n");
             }
+            seqlock_write_lock(&s->counter_lock);
             s->hpet_counter =
                 (s->hpet_counter & 0xffffffff00000000ULL) | value;
+            seqlock_write_unlock(&s->counter_lock);
             DPRINTF("qemu: HPET counter written. ctr = %#x -> %" PRIx64 "\n",
                     value, s->hpet_counter);
             break;
@@ -626,8 +657,10 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
             if (hpet_enabled(s)) {
                 DPRINTF("qemu: Writing counter while HPET enabled!\n");
             }
+            seqlock_write_lock(&s->counter_lock);
             s->hpet_counter =
                 (s->hpet_counter & 0xffffffffULL) | (((uint64_t)value) << 32);
+            seqlock_write_unlock(&s->counter_lock);
             DPRINTF("qemu: HPET counter + 4 written. ctr = %#x -> %" PRIx64 "\n",
                     value, s->hpet_counter);
             break;
@@ -648,6 +681,36 @@ static const MemoryRegionOps hpet_ram_ops = {
     .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
+static uint64_t hpet_counter_read(void *opaque, hwaddr addr, unsigned size)
+{
+    return hpet_read_counter(opaque) >> (addr * 8);
+}
+
+static void hpet_counter_write(void *opaque, hwaddr addr, uint64_t value,
+                               unsigned size)
+{
+    bool locked = qemu_mutex_iothread_locked();
+
+    /* Rare, and done with the counter halted; not worth a separate path */
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    hpet_ram_write(opaque, HPET_COUNTER + addr, value, size);
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+static const MemoryRegionOps hpet_counter_ops = {
+    .read = hpet_counter_read,
+    .write = hpet_counter_write,
+    .valid = {
+        .min_access_size = 4,
+        .max_access_size = 4,
+    },
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
 static void hpet_reset(DeviceState *d)
 {
     HPETState *s = HPET(d);
@@ -670,9 +733,11 @@ static void hpet_reset(DeviceState *d)
     }
 
     qemu_set_irq(s->pit_enabled, 1);
+    seqlock_write_lock(&s->counter_lock);
     s->hpet_counter = 0ULL;
     s->hpet_offset = 0ULL;
     s->config = 0ULL;
+    seqlock_write_unlock(&s->counter_lock);
     hpet_cfg.hpet[s->hpet_id].event_timer_block_id = (uint32_t)s->capability;
     hpet_cfg.hpet[s->hpet_id].address = sbd->mmio[0].addr;
 
@@ -704,6 +769,17 @@ static void hpet_init(Object *obj)
     /* HPET Area */
     memory_region_init_io(&s->iomem, obj, &hpet_ram_ops, s, "hpet", 0x400);
     sysbus_init_mmio(sbd, &s->iomem);
+
+    /* Guests poll the main counter as a clocksource.  Reads only need the
+     * snapshot under counter_lock, so KVM can handle them without taking
+     * the global lock.
+     */
+    seqlock_init(&s->counter_lock, NULL);
+    memory_region_init_io(&s->counter_iomem, obj, &hpet_counter_ops, s,
+                          "hpet-counter", 8);
+    memory_region_clear_global_locking(&s->counter_iomem);
+    memory_region_add_subregion_overlap(&s->iomem, HPET_COUNTER,
+                                        &s->counter_iomem, 1);
 }
 
 static void hpet_realize(DeviceState *dev, Error **errp)
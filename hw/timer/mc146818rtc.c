@@ -860,6 +860,8 @@ static void rtc_realizefn(DeviceState *dev, Error **errp)
 
     memory_region_init_io(&s->io, OBJECT(s), &cmos_ops, s, "rtc", 2);
     isa_register_ioport(isadev, &s->io, base);
+    /* The index register is write-only, queue writes to it under KVM */
+    memory_region_add_coalescing(&s->io, 0, 1);
 
     qdev_set_legacy_instance_id(dev, base, 3);
     qemu_register_reset(rtc_reset, s);
@@ -67,6 +67,8 @@ typedef struct {
 
     QEMUTimer *eof_timer;
     int64_t sof_time;
+    /* Frames to wait for, beyond the current one, while the bus is idle */
+    uint32_t idle_stepdown;
 
     /* OHCI state */
     /* Control partition */
@@ -695,6 +697,7 @@ static void ohci_async_complete_packet(USBPort *port, USBPacket *packet)
 #endif
     ohci->async_complete = 1;
     ohci_process_lists(ohci, 1);
+    ohci_kick(ohci);
 }
 
 #define USUB(a, b) ((int16_t)((uint16_t)(a) - (uint16_t)(b)))
@@ -1250,14 +1253,44 @@ static int ohci_service_ed_list(OHCIState *ohci, uint32_t head, int completion)
     return active;
 }
 
+/* While the bus is idle the frame timer fires only every
+ * OHCI_MAX_STEPDOWN + 1 frames, and processes the frames in between in
+ * one go.
+ */
+#define OHCI_MAX_STEPDOWN 7
+
 /* Generate a SOF event, and set a timer for EOF */
 static void ohci_sof(OHCIState *ohci)
 {
     ohci->sof_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
-    timer_mod(ohci->eof_timer, ohci->sof_time + usb_frame_time);
+    timer_mod(ohci->eof_timer,
+              ohci->sof_time + usb_frame_time * (ohci->idle_stepdown + 1));
     ohci_set_interrupt(ohci, OHCI_INTR_SF);
 }
 
+/* Something may need a frame soon, stop waiting for the stepdown */
+static void ohci_kick(OHCIState *ohci)
+{
+    if (ohci->idle_stepdown && ohci->eof_timer) {
+        ohci->idle_stepdown = 0;
+        timer_mod(ohci->eof_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    }
+}
+
+/*
+ * Nothing is in flight, no list has been filled, and nothing waits for
+ * the done queue or for SOF interrupts.  Interrupt endpoints that keep
+ * NAKing do not count as activity; their devices call usb_wakeup() when
+ * they have data.
+ */
+static bool ohci_bus_idle(OHCIState *ohci)
+{
+    return !ohci->async_td && ohci->done == 0 && ohci->done_count == 7 &&
+           !(ohci->status & (OHCI_STATUS_CLF | OHCI_STATUS_BLF)) &&
+           !(ohci->intr_status & OHCI_INTR_WD) &&
+           !(ohci->intr & OHCI_INTR_SF);
+}
+
 /* Process Control and Bulk lists.  */
 static void ohci_process_lists(OHCIState *ohci, int completion)
 {
@@ -1280,16 +1313,15 @@ static void ohci_process_lists(OHCIState *ohci, int completion)
     }
 }
 
-/* Do frame processing on frame boundary */
-static void ohci_frame_boundary(void *opaque)
+/* Do frame processing on frame boundary, return false if the bus stopped */
+static bool ohci_process_frame(OHCIState *ohci)
 {
-    OHCIState *ohci = opaque;
     struct ohci_hcca hcca;
 
     if (ohci_read_hcca(ohci, ohci->hcca, &hcca)) {
         fprintf(stderr, "usb-ohci: HCCA read error at %x\n", ohci->hcca);
         ohci_die(ohci);
-        return;
+        return false;
     }
 
     /* Process all the lists at the end of the frame */
@@ -1313,7 +1345,7 @@ static void ohci_frame_boundary(void *opaque)
 
     /* Stop if UnrecoverableError happened or ohci_sof will crash */
     if (ohci->intr_status & OHCI_INTR_UE) {
-        return;
+        return false;
     }
 
     /* Frame boundary, so do EOF stuf here */
@@ -1337,13 +1369,37 @@ static void ohci_frame_boundary(void *opaque)
     if (ohci->done_count != 7 && ohci->done_count != 0)
         ohci->done_count--;
 
-    /* Do SOF stuff here */
-    ohci_sof(ohci);
-
     /* Writeback HCCA */
     if (ohci_put_hcca(ohci, ohci->hcca, &hcca)) {
         ohci_die(ohci);
+        return false;
     }
+    return true;
+}
+
+static void ohci_frame_boundary(void *opaque)
+{
+    OHCIState *ohci = opaque;
+    int64_t elapsed = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - ohci->sof_time;
+    int i, frames;
+
+    /* Catch up with the frames skipped while the timer was stepped down */
+    frames = MIN(elapsed / usb_frame_time, OHCI_MAX_STEPDOWN + 1);
+    frames = MAX(frames, 1);
+    for (i = 0; i < frames; i++) {
+        if (!ohci_process_frame(ohci)) {
+            return;
+        }
+    }
+
+    if (!ohci_bus_idle(ohci)) {
+        ohci->idle_stepdown = 0;
+    } else if (ohci->idle_stepdown < OHCI_MAX_STEPDOWN) {
+        ohci->idle_stepdown++;
+    }
+
+    /* Do SOF stuff here */
+    ohci_sof(ohci);
 }
 
 /* Start sending SOF tokens across the USB bus, lists are processed in
@@ -1363,6 +1419,7 @@ static int ohci_bus_start(OHCIState *ohci)
 
     DPRINTF("usb-ohci: %s: USB Operational\n", ohci->name);
 
+    ohci->idle_stepdown = 0;
     ohci_sof(ohci);
 
     return 1;
@@ -1713,6 +1770,7 @@ static void ohci_mem_write(void *opaque,
     switch (addr >> 2) {
     case 1: /* HcControl */
         ohci_set_ctl(ohci, val);
+        ohci_kick(ohci);
         break;
 
     case 2: /* HcCommandStatus */
@@ -1721,6 +1779,7 @@ static void ohci_mem_write(void *opaque,
 
         /* Bits written as '0' remain unchanged in the register */
         ohci->status |= val;
+        ohci_kick(ohci);
 
         if (ohci->status & OHCI_STATUS_HCR)
             ohci_reset(ohci);
@@ -1734,6 +1793,7 @@ static void ohci_mem_write(void *opaque,
     case 4: /* HcInterruptEnable */
         ohci->intr |= val;
         ohci_intr_update(ohci);
+        ohci_kick(ohci);
         break;
 
     case 5: /* HcInterruptDisable */
@@ -1843,7 +1903,16 @@ static USBPortOps ohci_port_ops = {
     .complete = ohci_async_complete_packet,
 };
 
+static void ohci_wakeup_endpoint(USBBus *bus, USBEndpoint *ep,
+                                 unsigned int stream)
+{
+    OHCIState *ohci = container_of(bus, OHCIState, bus);
+
+    ohci_kick(ohci);
+}
+
 static USBBusOps ohci_bus_ops = {
+    .wakeup_endpoint = ohci_wakeup_endpoint,
 };
 
 static int usb_ohci_init(OHCIState *ohci, DeviceState *dev,
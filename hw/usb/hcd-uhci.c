@@ -81,6 +81,17 @@
 
 #define MAX_FRAMES_PER_TICK    (QH_VALID / 2)
 
+/* While no transfer makes progress the frame timer fires only every
+ * UHCI_MAX_STEPDOWN + 1 frames, and processes the frames in between in
+ * one go.
+ */
+#define UHCI_MAX_STEPDOWN      7
+
+/* An interrupt IN endpoint that NAKed is not polled again until its
+ * device calls usb_wakeup(), or this many frames have passed.
+ */
+#define UHCI_NAK_REPOLL        32
+
 #define NB_PORTS 2
 
 enum {
@@ -136,6 +147,8 @@ struct UHCIQueue {
     QTAILQ_ENTRY(UHCIQueue) next;
     QTAILQ_HEAD(asyncs_head, UHCIAsync) asyncs;
     int8_t    valid;
+    /* Frames left before an idle interrupt endpoint is polled again */
+    uint8_t   nak_repoll;
 };
 
 typedef struct UHCIPort {
@@ -160,6 +173,9 @@ struct UHCIState {
     uint32_t frame_bytes;
     uint32_t frame_bandwidth;
     bool completions_only;
+    /* Did any transfer make progress in the frames of this tick? */
+    bool frame_active;
+    uint32_t idle_stepdown;
     UHCIPort ports[NB_PORTS];
 
     /* Interrupts that should be raised at the end of the current frame.  */
@@ -470,6 +486,9 @@ static void uhci_port_write(void *opaque, hwaddr addr,
 
     trace_usb_uhci_mmio_writew(addr, val);
 
+    /* The guest is busy with us, go back to full speed */
+    s->idle_stepdown = 0;
+
     switch(addr) {
     case 0x00:
         if ((val & UHCI_CMD_RS) && !(s->cmd & UHCI_CMD_RS)) {
@@ -873,6 +892,12 @@ static int uhci_handle_td(UHCIState *s, UHCIQueue *q, uint32_t qh_addr,
         return TD_RESULT_ASYNC_CONT;
     }
 
+    if (q && q->nak_repoll) {
+        q->nak_repoll--;
+        td->ctrl |= TD_CTRL_NAK;
+        return TD_RESULT_NEXT_QH;
+    }
+
     /* Allocate new packet */
     if (q == NULL) {
         USBDevice *dev = uhci_find_device(s, (td->token >> 8) & 0x7f);
@@ -928,6 +953,13 @@ static int uhci_handle_td(UHCIState *s, UHCIQueue *q, uint32_t qh_addr,
     }
 
 done:
+    /* Companion controllers do not get wakeup_endpoint calls, so they have
+     * to poll every frame.
+     */
+    if (async->packet.status == USB_RET_NAK && pid == USB_TOKEN_IN &&
+        q->ep->type == USB_ENDPOINT_XFER_INT && !s->masterbus) {
+        q->nak_repoll = UHCI_NAK_REPOLL;
+    }
     ret = uhci_complete_td(s, td, async, int_mask);
     uhci_async_free(async);
     return ret;
@@ -1099,18 +1131,22 @@ static void uhci_process_frame(UHCIState *s)
         case TD_RESULT_STOP_FRAME: /* interrupted frame */
             goto out;
 
-        case TD_RESULT_NEXT_QH:
         case TD_RESULT_ASYNC_CONT:
+            s->frame_active = true;
+            /* fall through */
+        case TD_RESULT_NEXT_QH:
             trace_usb_uhci_td_nextqh(curr_qh & ~0xf, link & ~0xf);
             link = curr_qh ? qh.link : td.link;
             continue;
 
         case TD_RESULT_ASYNC_START:
+            s->frame_active = true;
             trace_usb_uhci_td_async(curr_qh & ~0xf, link & ~0xf);
             link = curr_qh ? qh.link : td.link;
             continue;
 
         case TD_RESULT_COMPLETE:
+            s->frame_active = true;
             trace_usb_uhci_td_complete(curr_qh & ~0xf, link & ~0xf);
             link = td.link;
             td_count++;
@@ -1183,6 +1219,7 @@ static void uhci_frame_timer(void *opaque)
         frames = MAX_FRAMES_PER_TICK;
     }
 
+    s->frame_active = false;
     for (i = 0; i < frames; i++) {
         s->frame_bytes = 0;
         trace_usb_uhci_frame_start(s->frnum);
@@ -1200,10 +1237,20 @@ static void uhci_frame_timer(void *opaque)
         s->status2 |= s->pending_int_mask;
         s->status  |= UHCI_STS_USBINT;
         uhci_update_irq(s);
+        s->frame_active = true;
     }
     s->pending_int_mask = 0;
 
-    timer_mod(s->frame_timer, t_now + frame_t);
+    /* The guest adds transfers to the schedule without telling us, so
+     * only slow down a little, and only as a standalone controller.
+     */
+    if (s->frame_active || s->masterbus) {
+        s->idle_stepdown = 0;
+    } else if (s->idle_stepdown < UHCI_MAX_STEPDOWN) {
+        s->idle_stepdown++;
+    }
+
+    timer_mod(s->frame_timer, t_now + frame_t * (s->idle_stepdown + 1));
 }
 
 static const MemoryRegionOps uhci_ioport_ops = {
@@ -1224,7 +1271,27 @@ static USBPortOps uhci_port_ops = {
     .complete = uhci_async_complete,
 };
 
+static void uhci_wakeup_endpoint(USBBus *bus, USBEndpoint *ep,
+                                 unsigned int stream)
+{
+    UHCIState *s = container_of(bus, UHCIState, bus);
+    UHCIQueue *q;
+
+    QTAILQ_FOREACH(q, &s->queues, next) {
+        if (q->ep == ep) {
+            q->nak_repoll = 0;
+        }
+    }
+
+    /* Poll the endpoint in the next frame rather than after a stepdown */
+    if (s->idle_stepdown && (s->cmd & UHCI_CMD_RS)) {
+        s->idle_stepdown = 0;
+        timer_mod(s->frame_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    }
+}
+
 static USBBusOps uhci_bus_ops = {
+    .wakeup_endpoint = uhci_wakeup_endpoint,
 };
 
 static int usb_uhci_common_initfn(PCIDevice *dev)
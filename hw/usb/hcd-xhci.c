@@ -325,9 +325,19 @@ typedef enum EPType {
     ET_INTR_IN,
 } EPType;
 
+/* TRBs are read ahead in batches of up to TRB_CACHE_SIZE, without
+ * crossing a TRB_CACHE_BOUNDARY, to save DMA round trips.
+ */
+#define TRB_CACHE_SIZE 16
+#define TRB_CACHE_BOUNDARY 4096
+
 typedef struct XHCIRing {
     dma_addr_t dequeue;
     bool ccs;
+    /* TRBs read ahead from guest memory, still little endian */
+    dma_addr_t cache_base;
+    unsigned int cache_len;
+    uint8_t cache[TRB_CACHE_SIZE * TRB_SIZE];
 } XHCIRing;
 
 typedef struct XHCIPort {
@@ -973,21 +983,65 @@ static void xhci_ring_init(XHCIState *xhci, XHCIRing *ring,
 {
     ring->dequeue = base;
     ring->ccs = 1;
+    ring->cache_len = 0;
+}
+
+/* Drop TRBs read ahead, the guest may have written new ones since */
+static void xhci_ring_invalidate(XHCIRing *ring)
+{
+    ring->cache_len = 0;
+}
+
+static void xhci_ring_fill_cache(XHCIState *xhci, XHCIRing *ring,
+                                 dma_addr_t addr)
+{
+    dma_addr_t len;
+
+    len = TRB_CACHE_BOUNDARY - (addr & (TRB_CACHE_BOUNDARY - 1));
+    len = MIN(len, sizeof(ring->cache));
+    pci_dma_read(PCI_DEVICE(xhci), addr, ring->cache, len);
+    ring->cache_base = addr;
+    ring->cache_len = len;
+}
+
+static void xhci_ring_copy_trb(XHCIRing *ring, dma_addr_t addr,
+                               XHCITRB *trb)
+{
+    memcpy(trb, ring->cache + (addr - ring->cache_base), TRB_SIZE);
+    le64_to_cpus(&trb->parameter);
+    le32_to_cpus(&trb->status);
+    le32_to_cpus(&trb->control);
+}
+
+/*
+ * Read the TRB at @addr, using the read-ahead cache.  A cached TRB that
+ * is not owned by the controller yet may have been written by the guest
+ * since it was read, so it is read again before giving up on it.
+ */
+static void xhci_ring_read_trb(XHCIState *xhci, XHCIRing *ring,
+                               dma_addr_t addr, bool ccs, XHCITRB *trb)
+{
+    bool cached = addr >= ring->cache_base &&
+                  addr + TRB_SIZE <= ring->cache_base + ring->cache_len;
+
+    if (!cached) {
+        xhci_ring_fill_cache(xhci, ring, addr);
+    }
+    xhci_ring_copy_trb(ring, addr, trb);
+    if (cached && (trb->control & TRB_C) != ccs) {
+        xhci_ring_fill_cache(xhci, ring, addr);
+        xhci_ring_copy_trb(ring, addr, trb);
+    }
 }
 
 static TRBType xhci_ring_fetch(XHCIState *xhci, XHCIRing *ring, XHCITRB *trb,
                                dma_addr_t *addr)
 {
-    PCIDevice *pci_dev = PCI_DEVICE(xhci);
-
     while (1) {
         TRBType type;
-        pci_dma_read(pci_dev, ring->dequeue, trb, TRB_SIZE);
+        xhci_ring_read_trb(xhci, ring, ring->dequeue, ring->ccs, trb);
         trb->addr = ring->dequeue;
         trb->ccs = ring->ccs;
-        le64_to_cpus(&trb->parameter);
-        le32_to_cpus(&trb->status);
-        le32_to_cpus(&trb->control);
 
         trace_usb_xhci_fetch_trb(ring->dequeue, trb_name(trb),
                                  trb->parameter, trb->status, trb->control);
@@ -1013,9 +1067,8 @@ static TRBType xhci_ring_fetch(XHCIState *xhci, XHCIRing *ring, XHCITRB *trb,
     }
 }
 
-static int xhci_ring_chain_length(XHCIState *xhci, const XHCIRing *ring)
+static int xhci_ring_chain_length(XHCIState *xhci, XHCIRing *ring)
 {
-    PCIDevice *pci_dev = PCI_DEVICE(xhci);
     XHCITRB trb;
     int length = 0;
     dma_addr_t dequeue = ring->dequeue;
@@ -1025,10 +1078,7 @@ static int xhci_ring_chain_length(XHCIState *xhci, const XHCIRing *ring)
 
     while (1) {
         TRBType type;
-        pci_dma_read(pci_dev, dequeue, &trb, TRB_SIZE);
-        le64_to_cpus(&trb.parameter);
-        le32_to_cpus(&trb.status);
-        le32_to_cpus(&trb.control);
+        xhci_ring_read_trb(xhci, ring, dequeue, ccs, &trb);
 
         if ((trb.control & TRB_C) != ccs) {
             return -length;
@@ -2154,6 +2204,7 @@ static void xhci_kick_ep(XHCIState *xhci, unsigned int slotid,
         xhci_set_ep_state(xhci, epctx, NULL, EP_RUNNING);
     }
     assert(ring->dequeue != 0);
+    xhci_ring_invalidate(ring);
 
     while (1) {
         XHCITransfer *xfer = &epctx->transfers[epctx->next_xfer];
@@ -2684,6 +2735,7 @@ static void xhci_process_commands(XHCIState *xhci)
     }
 
     xhci->crcr_low |= CRCR_CRR;
+    xhci_ring_invalidate(&xhci->cmd_ring);
 
     while ((type = xhci_ring_fetch(xhci, &xhci->cmd_ring, &trb, &addr))) {
         event.ptr = addr;
@@ -39,10 +39,16 @@
 #include "qemu-common.h"
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
+#include "qemu/error-report.h"
 #include "trace.h"
 
 #include "hw/usb.h"
 
+/* Bulk streams need libusb 1.0.19 or newer */
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000103
+#define HAVE_STREAMS 1
+#endif
+
 /* ------------------------------------------------------------------------ */
 
 #define TYPE_USB_HOST_DEVICE "usb-host"
@@ -720,6 +726,9 @@ static void usb_host_ep_update(USBHostDevice *s)
     struct libusb_config_descriptor *conf;
     const struct libusb_interface_descriptor *intf;
     const struct libusb_endpoint_descriptor *endp;
+#ifdef HAVE_STREAMS
+    struct libusb_ss_endpoint_companion_descriptor *endp_ss_comp;
+#endif
     uint8_t devep, type;
     int pid, ep;
     int rc, i, e;
@@ -765,6 +774,23 @@ static void usb_host_ep_update(USBHostDevice *s)
             usb_ep_set_type(udev, pid, ep, type);
             usb_ep_set_ifnum(udev, pid, ep, i);
             usb_ep_set_halted(udev, pid, ep, 0);
+
+            /* Let the host controller queue several packets, each of which
+             * becomes an URB of its own, instead of one at a time.
+             */
+            if (type == USB_ENDPOINT_XFER_BULK &&
+                (s->options & (1 << USB_HOST_OPT_PIPELINE))) {
+                usb_ep_set_pipeline(udev, pid, ep, true);
+            }
+#ifdef HAVE_STREAMS
+            if (type == USB_ENDPOINT_XFER_BULK &&
+                libusb_get_ss_endpoint_companion_descriptor(ctx, endp,
+                    &endp_ss_comp) == LIBUSB_SUCCESS) {
+                usb_ep_set_max_streams(udev, pid, ep,
+                                       endp_ss_comp->bmAttributes);
+                libusb_free_ss_endpoint_companion_descriptor(endp_ss_comp);
+            }
+#endif
         }
     }
 
@@ -1174,7 +1200,8 @@ static void usb_host_handle_data(USBDevice *udev, USBPacket *p)
     size_t size;
     int ep, rc;
 
-    if (usb_host_use_combining(p->ep) && p->state == USB_PACKET_SETUP) {
+    if (usb_host_use_combining(p->ep) && !p->stream &&
+        p->state == USB_PACKET_SETUP) {
         p->status = USB_RET_ADD_TO_QUEUE;
         return;
     }
@@ -1202,10 +1229,23 @@ static void usb_host_handle_data(USBDevice *udev, USBPacket *p)
             usb_packet_copy(p, r->buffer, size);
         }
         ep = p->ep->nr | (r->in ? USB_DIR_IN : 0);
-        libusb_fill_bulk_transfer(r->xfer, s->dh, ep,
-                                  r->buffer, size,
-                                  usb_host_req_complete_data, r,
-                                  BULK_TIMEOUT);
+        if (p->stream) {
+#ifdef HAVE_STREAMS
+            libusb_fill_bulk_stream_transfer(r->xfer, s->dh, ep, p->stream,
+                                             r->buffer, size,
+                                             usb_host_req_complete_data, r,
+                                             BULK_TIMEOUT);
+#else
+            usb_host_req_free(r);
+            p->status = USB_RET_STALL;
+            return;
+#endif
+        } else {
+            libusb_fill_bulk_transfer(r->xfer, s->dh, ep,
+                                      r->buffer, size,
+                                      usb_host_req_complete_data, r,
+                                      BULK_TIMEOUT);
+        }
         break;
     case USB_ENDPOINT_XFER_INT:
         r = usb_host_req_alloc(s, p, p->pid == USB_TOKEN_IN, p->iov.size);
@@ -1248,6 +1288,65 @@ static void usb_host_handle_data(USBDevice *udev, USBPacket *p)
     p->status = USB_RET_ASYNC;
 }
 
+#ifdef HAVE_STREAMS
+static void usb_host_ep_addresses(USBEndpoint **eps, int nr_eps,
+                                  unsigned char *endpoints)
+{
+    int i;
+
+    for (i = 0; i < nr_eps; i++) {
+        endpoints[i] = eps[i]->nr |
+                       (eps[i]->pid == USB_TOKEN_IN ? USB_DIR_IN : 0);
+    }
+}
+#endif
+
+static int usb_host_alloc_streams(USBDevice *udev, USBEndpoint **eps,
+                                  int nr_eps, int streams)
+{
+#ifdef HAVE_STREAMS
+    USBHostDevice *s = USB_HOST_DEVICE(udev);
+    unsigned char endpoints[30];
+    int rc;
+
+    if (s->dh == NULL) {
+        return -1;
+    }
+    usb_host_ep_addresses(eps, nr_eps, endpoints);
+    rc = libusb_alloc_streams(s->dh, streams, endpoints, nr_eps);
+    if (rc < 0) {
+        usb_host_libusb_error("libusb_alloc_streams", rc);
+        return -1;
+    }
+    /* The host controller may grant fewer streams than requested; the
+     * guest will not use stream ids beyond what the device can handle.
+     */
+    if (rc != streams) {
+        error_report("libusb_alloc_streams: got %d streams, wanted %d",
+                     rc, streams);
+    }
+    return 0;
+#else
+    error_report("usb-host: bulk streams need libusb 1.0.19 or newer");
+    return -1;
+#endif
+}
+
+static void usb_host_free_streams(USBDevice *udev, USBEndpoint **eps,
+                                  int nr_eps)
+{
+#ifdef HAVE_STREAMS
+    USBHostDevice *s = USB_HOST_DEVICE(udev);
+    unsigned char endpoints[30];
+
+    if (s->dh == NULL) {
+        return;
+    }
+    usb_host_ep_addresses(eps, nr_eps, endpoints);
+    libusb_free_streams(s->dh, endpoints, nr_eps);
+#endif
+}
+
 static void usb_host_flush_ep_queue(USBDevice *dev, USBEndpoint *ep)
 {
     if (usb_host_use_combining(ep)) {
@@ -1349,6 +1448,8 @@ static void usb_host_class_initfn(ObjectClass *klass, void *data)
     uc->handle_reset   = usb_host_handle_reset;
     uc->handle_destroy = usb_host_handle_destroy;
     uc->flush_ep_queue = usb_host_flush_ep_queue;
+    uc->alloc_streams  = usb_host_alloc_streams;
+    uc->free_streams   = usb_host_free_streams;
     dc->vmsd = &vmstate_usb_host;
     dc->props = usb_host_dev_properties;
     set_bit(DEVICE_CATEGORY_BRIDGE, dc->categories);
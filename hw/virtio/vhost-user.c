@@ -0,0 +1,409 @@
+/*
+ * vhost-user
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The protocol is described in docs/specs/vhost-user.txt.  Requests are
+ * the vhost ioctls, sent as messages over a UNIX stream socket; file
+ * descriptors travel as SCM_RIGHTS ancillary data.
+ */
+
+#include "hw/virtio/vhost.h"
+#include "hw/virtio/vhost-backend.h"
+#include "exec/cpu-common.h"
+#include "sysemu/sysemu.h"
+#include "qemu/error-report.h"
+#include "trace.h"
+
+#include <sys/socket.h>
+#include <linux/vhost.h>
+
+#define VHOST_MEMORY_MAX_NREGIONS    8
+
+typedef enum VhostUserRequest {
+    VHOST_USER_NONE = 0,
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_LOG_BASE = 6,
+    VHOST_USER_SET_LOG_FD = 7,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_MAX
+} VhostUserRequest;
+
+typedef struct VhostUserMemoryRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+} VhostUserMemoryRegion;
+
+typedef struct VhostUserMemory {
+    uint32_t nregions;
+    uint32_t padding;
+    VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+} VhostUserMemory;
+
+typedef struct VhostUserMsg {
+    uint32_t request;
+
+#define VHOST_USER_VERSION_MASK     (0x3)
+#define VHOST_USER_REPLY_MASK       (0x1 << 2)
+    uint32_t flags;
+    uint32_t size; /* the following payload size */
+    union {
+#define VHOST_USER_VRING_IDX_MASK   (0xff)
+#define VHOST_USER_VRING_NOFD_MASK  (0x1 << 8)
+        uint64_t u64;
+        struct vhost_vring_state state;
+        struct vhost_vring_addr addr;
+        VhostUserMemory memory;
+    };
+} QEMU_PACKED VhostUserMsg;
+
+static VhostUserMsg m __attribute__ ((unused));
+#define VHOST_USER_HDR_SIZE (sizeof(m.request) \
+                            + sizeof(m.flags) \
+                            + sizeof(m.size))
+
+#define VHOST_USER_PAYLOAD_SIZE (sizeof(m) - VHOST_USER_HDR_SIZE)
+
+/* The version of the protocol we support */
+#define VHOST_USER_VERSION    (0x1)
+
+static unsigned long int ioctl_to_vhost_user_request[VHOST_USER_MAX] = {
+    -1,                     /* VHOST_USER_NONE */
+    VHOST_GET_FEATURES,     /* VHOST_USER_GET_FEATURES */
+    VHOST_SET_FEATURES,     /* VHOST_USER_SET_FEATURES */
+    VHOST_SET_OWNER,        /* VHOST_USER_SET_OWNER */
+    VHOST_RESET_OWNER,      /* VHOST_USER_RESET_OWNER */
+    VHOST_SET_MEM_TABLE,    /* VHOST_USER_SET_MEM_TABLE */
+    VHOST_SET_LOG_BASE,     /* VHOST_USER_SET_LOG_BASE */
+    VHOST_SET_LOG_FD,       /* VHOST_USER_SET_LOG_FD */
+    VHOST_SET_VRING_NUM,    /* VHOST_USER_SET_VRING_NUM */
+    VHOST_SET_VRING_ADDR,   /* VHOST_USER_SET_VRING_ADDR */
+    VHOST_SET_VRING_BASE,   /* VHOST_USER_SET_VRING_BASE */
+    VHOST_GET_VRING_BASE,   /* VHOST_USER_GET_VRING_BASE */
+    VHOST_SET_VRING_KICK,   /* VHOST_USER_SET_VRING_KICK */
+    VHOST_SET_VRING_CALL,   /* VHOST_USER_SET_VRING_CALL */
+    VHOST_SET_VRING_ERR     /* VHOST_USER_SET_VRING_ERR */
+};
+
+static VhostUserRequest vhost_user_request_translate(unsigned long int request)
+{
+    VhostUserRequest idx;
+
+    for (idx = 0; idx < VHOST_USER_MAX; idx++) {
+        if (ioctl_to_vhost_user_request[idx] == request) {
+            break;
+        }
+    }
+
+    return (idx == VHOST_USER_MAX) ? VHOST_USER_NONE : idx;
+}
+
+static int vhost_user_read(struct vhost_dev *dev, VhostUserMsg *msg)
+{
+    int fd = (uintptr_t) dev->opaque;
+    uint8_t *p = (uint8_t *) msg;
+    ssize_t r;
+
+    r = qemu_recv_full(fd, p, VHOST_USER_HDR_SIZE, 0);
+    if (r != VHOST_USER_HDR_SIZE) {
+        error_report("Failed to read msg header. Read %zd instead of %zu.",
+                     r, VHOST_USER_HDR_SIZE);
+        goto fail;
+    }
+
+    /* validate received flags */
+    if (msg->flags != (VHOST_USER_REPLY_MASK | VHOST_USER_VERSION)) {
+        error_report("Failed to read msg header."
+                     " Flags 0x%x instead of 0x%x.", msg->flags,
+                     VHOST_USER_REPLY_MASK | VHOST_USER_VERSION);
+        goto fail;
+    }
+
+    /* validate message size is sane */
+    if (msg->size > VHOST_USER_PAYLOAD_SIZE) {
+        error_report("Failed to read msg header."
+                     " Size %d exceeds the maximum %zu.", msg->size,
+                     VHOST_USER_PAYLOAD_SIZE);
+        goto fail;
+    }
+
+    if (msg->size) {
+        p += VHOST_USER_HDR_SIZE;
+        r = qemu_recv_full(fd, p, msg->size, 0);
+        if (r != msg->size) {
+            error_report("Failed to read msg payload."
+                         " Read %zd instead of %d.", r, msg->size);
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    errno = EIO;
+    return -1;
+}
+
+static int vhost_user_write(struct vhost_dev *dev, VhostUserMsg *msg,
+                            int *fds, int fd_num)
+{
+    int fd = (uintptr_t) dev->opaque;
+    size_t size = VHOST_USER_HDR_SIZE + msg->size;
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))];
+    struct msghdr msgh;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    ssize_t r;
+
+    iov.iov_base = msg;
+    iov.iov_len = size;
+
+    memset(&msgh, 0, sizeof(msgh));
+    msgh.msg_iov = &iov;
+    msgh.msg_iovlen = 1;
+
+    if (fd_num) {
+        assert(fd_num <= VHOST_MEMORY_MAX_NREGIONS);
+        msgh.msg_control = control;
+        msgh.msg_controllen = CMSG_SPACE(fd_num * sizeof(int));
+
+        cmsg = CMSG_FIRSTHDR(&msgh);
+        cmsg->cmsg_len = CMSG_LEN(fd_num * sizeof(int));
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), fds, fd_num * sizeof(int));
+    }
+
+    do {
+        r = sendmsg(fd, &msgh, 0);
+    } while (r < 0 && errno == EINTR);
+
+    if (r < 0) {
+        return -1;
+    }
+
+    /* The descriptors went with the first byte, send the rest as is */
+    if (r < size &&
+        qemu_send_full(fd, (uint8_t *) msg + r, size - r, 0) != size - r) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int vhost_user_fill_mem_table(struct vhost_dev *dev, VhostUserMsg *msg,
+                                     int *fds)
+{
+    int fd_num = 0;
+    int i;
+
+    if (!mem_share) {
+        error_report("vhost-user: guest memory is not shared, "
+                     "use -mem-path and -mem-share");
+        return -1;
+    }
+
+    for (i = 0; i < dev->mem->nregions; ++i) {
+        struct vhost_memory_region *reg = dev->mem->regions + i;
+        VhostUserMemoryRegion *ureg;
+        ram_addr_t ram_addr, offset;
+        int fd;
+
+        qemu_ram_addr_from_host((void *)(uintptr_t) reg->userspace_addr,
+                                &ram_addr);
+        fd = qemu_get_ram_fd(ram_addr, &offset);
+        if (fd < 0) {
+            /* Too small for -mem-path, e.g. option ROMs; no virtqueue or
+             * packet buffer lives there.
+             */
+            continue;
+        }
+        if (fd_num == VHOST_MEMORY_MAX_NREGIONS) {
+            error_report("vhost-user: too many memory regions");
+            return -1;
+        }
+
+        ureg = &msg->memory.regions[fd_num];
+        ureg->guest_phys_addr = reg->guest_phys_addr;
+        ureg->memory_size = reg->memory_size;
+        ureg->userspace_addr = reg->userspace_addr;
+        ureg->mmap_offset = offset;
+        fds[fd_num++] = fd;
+    }
+
+    msg->memory.nregions = fd_num;
+    msg->memory.padding = 0;
+    msg->size = sizeof(m.memory.nregions) + sizeof(m.memory.padding) +
+                fd_num * sizeof(VhostUserMemoryRegion);
+
+    return fd_num;
+}
+
+static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
+        void *arg)
+{
+    VhostUserMsg msg;
+    VhostUserRequest msg_request;
+    struct vhost_vring_file *file = 0;
+    bool need_reply = false;
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    int fd_num = 0;
+
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    msg_request = vhost_user_request_translate(request);
+    msg.request = msg_request;
+    msg.flags = VHOST_USER_VERSION;
+    msg.size = 0;
+
+    switch (msg_request) {
+    case VHOST_USER_GET_FEATURES:
+        need_reply = true;
+        break;
+
+    case VHOST_USER_SET_FEATURES:
+    case VHOST_USER_SET_LOG_BASE:
+        msg.u64 = *((__u64 *) arg);
+        msg.size = sizeof(m.u64);
+        break;
+
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_RESET_OWNER:
+        break;
+
+    case VHOST_USER_SET_MEM_TABLE:
+        fd_num = vhost_user_fill_mem_table(dev, &msg, fds);
+        if (fd_num < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        break;
+
+    case VHOST_USER_SET_LOG_FD:
+        fds[fd_num++] = *((int *) arg);
+        break;
+
+    case VHOST_USER_SET_VRING_NUM:
+    case VHOST_USER_SET_VRING_BASE:
+        memcpy(&msg.state, arg, sizeof(struct vhost_vring_state));
+        msg.size = sizeof(m.state);
+        break;
+
+    case VHOST_USER_GET_VRING_BASE:
+        memcpy(&msg.state, arg, sizeof(struct vhost_vring_state));
+        msg.size = sizeof(m.state);
+        need_reply = true;
+        break;
+
+    case VHOST_USER_SET_VRING_ADDR:
+        memcpy(&msg.addr, arg, sizeof(struct vhost_vring_addr));
+        msg.size = sizeof(m.addr);
+        break;
+
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+    case VHOST_USER_SET_VRING_ERR:
+        file = arg;
+        msg.u64 = file->index & VHOST_USER_VRING_IDX_MASK;
+        msg.size = sizeof(m.u64);
+        if (file->fd >= 0) {
+            fds[fd_num++] = file->fd;
+        } else {
+            msg.u64 |= VHOST_USER_VRING_NOFD_MASK;
+        }
+        break;
+
+    default:
+        error_report("vhost-user trying to send unhandled ioctl 0x%lx",
+                     request);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    trace_vhost_user_call(dev, msg_request, msg.size, fd_num);
+
+    if (vhost_user_write(dev, &msg, fds, fd_num) < 0) {
+        return -1;
+    }
+
+    if (need_reply) {
+        if (vhost_user_read(dev, &msg) < 0) {
+            return -1;
+        }
+
+        if (msg_request != msg.request) {
+            error_report("Received unexpected msg type."
+                         " Expected %d received %d", msg_request, msg.request);
+            errno = EIO;
+            return -1;
+        }
+
+        switch (msg_request) {
+        case VHOST_USER_GET_FEATURES:
+            if (msg.size != sizeof(m.u64)) {
+                error_report("Received bad msg size.");
+                errno = EIO;
+                return -1;
+            }
+            /* The dirty log is in QEMU's private memory where the backend
+             * cannot write it, so do not offer logging (and migration).
+             */
+            *((__u64 *) arg) = msg.u64 & ~(0x1ULL << VHOST_F_LOG_ALL);
+            break;
+        case VHOST_USER_GET_VRING_BASE:
+            if (msg.size != sizeof(m.state)) {
+                error_report("Received bad msg size.");
+                errno = EIO;
+                return -1;
+            }
+            memcpy(arg, &msg.state, sizeof(struct vhost_vring_state));
+            break;
+        default:
+            error_report("Received unexpected msg type.");
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int vhost_user_init(struct vhost_dev *dev, void *opaque)
+{
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    dev->opaque = opaque;
+
+    return 0;
+}
+
+static int vhost_user_cleanup(struct vhost_dev *dev)
+{
+    int fd = (uintptr_t) dev->opaque;
+
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    return close(fd);
+}
+
+const VhostOps user_ops = {
+    .backend_type = VHOST_BACKEND_TYPE_USER,
+    .vhost_call = vhost_user_call,
+    .vhost_backend_init = vhost_user_init,
+    .vhost_backend_cleanup = vhost_user_cleanup
+};
@@ -24,6 +24,10 @@
 #include "sysemu/kvm.h"
 #include "exec/address-spaces.h"
 #include "qapi/visitor.h"
+#include "qemu/bitmap.h"
+#include "qemu/main-loop.h"
+#include "migration/migration.h"
+#include "trace.h"
 
 #if defined(__linux__)
 #include <sys/mman.h>
@@ -31,15 +35,103 @@
 
 #include "hw/virtio/virtio-bus.h"
 
-static void balloon_page(void *addr, int deflate)
+#define BALLOON_PAGE_SIZE   (1 << VIRTIO_BALLOON_PFN_SHIFT)
+
+/* Consecutive balloon pages of one memory region */
+typedef struct BalloonRun {
+    MemoryRegion *mr;
+    ram_addr_t offset;
+    ram_addr_t len;
+} BalloonRun;
+
+static bool balloon_can_discard(void)
 {
 #if defined(__linux__)
-    if (!kvm_enabled() || kvm_has_sync_mmu())
-        qemu_madvise(addr, TARGET_PAGE_SIZE,
-                deflate ? QEMU_MADV_WILLNEED : QEMU_MADV_DONTNEED);
+    return !kvm_enabled() || kvm_has_sync_mmu();
+#else
+    return false;
 #endif
 }
 
+static void balloon_pbp_free(VirtIOBalloon *s)
+{
+    g_free(s->pbp_bitmap);
+    s->pbp_bitmap = NULL;
+    s->pbp_base = NULL;
+    s->pbp_size = 0;
+}
+
+/*
+ * Balloon pages smaller than the host page can only be given back once
+ * the guest has inflated all of the host page.  Only one such page is
+ * tracked, which covers a guest that inflates its pages in order.
+ */
+static void balloon_pbp_add(VirtIOBalloon *s, uint8_t *addr, size_t len,
+                            size_t page_size)
+{
+    uint8_t *base = (uint8_t *)((uintptr_t)addr & ~(uintptr_t)(page_size - 1));
+    size_t nr = page_size / BALLOON_PAGE_SIZE;
+
+    if (s->pbp_base != base || s->pbp_size != page_size) {
+        balloon_pbp_free(s);
+        s->pbp_bitmap = bitmap_new(nr);
+        s->pbp_base = base;
+        s->pbp_size = page_size;
+    }
+    bitmap_set(s->pbp_bitmap, (addr - base) / BALLOON_PAGE_SIZE,
+               DIV_ROUND_UP(len, BALLOON_PAGE_SIZE));
+    if (bitmap_full(s->pbp_bitmap, nr)) {
+        qemu_madvise(base, page_size, QEMU_MADV_DONTNEED);
+        balloon_pbp_free(s);
+    }
+}
+
+static void balloon_inflate(VirtIOBalloon *s, uint8_t *addr, size_t len,
+                            size_t page_size)
+{
+    uintptr_t mask = page_size - 1;
+    uint8_t *start = (uint8_t *)(((uintptr_t)addr + mask) & ~mask);
+    uint8_t *end = (uint8_t *)(((uintptr_t)addr + len) & ~mask);
+
+    if (start >= end) {
+        balloon_pbp_add(s, addr, len, page_size);
+        return;
+    }
+    if (addr < start) {
+        balloon_pbp_add(s, addr, start - addr, page_size);
+    }
+    qemu_madvise(start, end - start, QEMU_MADV_DONTNEED);
+    if (end < addr + len) {
+        balloon_pbp_add(s, end, addr + len - end, page_size);
+    }
+}
+
+static void balloon_flush_run(VirtIOBalloon *s, BalloonRun *run, bool deflate)
+{
+    uint8_t *addr;
+
+    if (!run->mr) {
+        return;
+    }
+    if (balloon_can_discard()) {
+        addr = (uint8_t *)memory_region_get_ram_ptr(run->mr) + run->offset;
+        trace_virtio_balloon_run(addr, run->len, deflate);
+        if (!deflate) {
+            balloon_inflate(s, addr, run->len,
+                            qemu_ram_pagesize(run->mr->ram_addr +
+                                              run->offset));
+        } else {
+            if (s->pbp_base && addr < s->pbp_base + s->pbp_size &&
+                s->pbp_base < addr + run->len) {
+                balloon_pbp_free(s);
+            }
+            qemu_madvise(addr, run->len, QEMU_MADV_WILLNEED);
+        }
+    }
+    memory_region_unref(run->mr);
+    run->mr = NULL;
+}
+
 static const char *balloon_stat_names[] = {
    [VIRTIO_BALLOON_S_SWAP_IN] = "stat-swap-in",
    [VIRTIO_BALLOON_S_SWAP_OUT] = "stat-swap-out",
@@ -183,36 +275,113 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
     VirtQueueElement elem;
     MemoryRegionSection section;
+    bool deflate = vq == s->dvq;
 
     while (virtqueue_pop(vq, &elem)) {
+        BalloonRun run = { .mr = NULL };
         size_t offset = 0;
         uint32_t pfn;
 
+        /* Guests tend to send runs of consecutive pages, which are then
+         * given back (or faulted in) with one madvise each.
+         */
         while (iov_to_buf(elem.out_sg, elem.out_num, offset, &pfn, 4) == 4) {
             ram_addr_t pa;
-            ram_addr_t addr;
 
             pa = (ram_addr_t)ldl_p(&pfn) << VIRTIO_BALLOON_PFN_SHIFT;
             offset += 4;
 
             /* FIXME: remove get_system_memory(), but how? */
             section = memory_region_find(get_system_memory(), pa, 1);
-            if (!int128_nz(section.size) || !memory_region_is_ram(section.mr))
+            if (!int128_nz(section.size)) {
                 continue;
+            }
+            if (!memory_region_is_ram(section.mr)) {
+                memory_region_unref(section.mr);
+                continue;
+            }
 
-            /* Using memory_region_get_ram_ptr is bending the rules a bit, but
-               should be OK because we only want a single page.  */
-            addr = section.offset_within_region;
-            balloon_page(memory_region_get_ram_ptr(section.mr) + addr,
-                         !!(vq == s->dvq));
-            memory_region_unref(section.mr);
+            if (section.mr == run.mr &&
+                section.offset_within_region == run.offset + run.len) {
+                run.len += BALLOON_PAGE_SIZE;
+                memory_region_unref(section.mr);
+                continue;
+            }
+            balloon_flush_run(s, &run, deflate);
+            run.mr = section.mr;
+            run.offset = section.offset_within_region;
+            run.len = BALLOON_PAGE_SIZE;
         }
+        balloon_flush_run(s, &run, deflate);
 
         virtqueue_push(vq, &elem, offset);
         virtio_notify(vdev, vq);
     }
 }
 
+static bool balloon_free_page_hint_supported(const VirtIOBalloon *s)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    return vdev->guest_features & (1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT);
+}
+
+/*
+ * Each buffer starts with the command id the guest was answering, as a
+ * 32-bit little endian value in the readable part.  The writable part
+ * lists guest memory that was free when the guest scanned it; none of it
+ * is written, so it is not dirtied either.
+ */
+static void virtio_balloon_handle_free_page_hint(VirtIODevice *vdev,
+                                                 VirtQueue *vq)
+{
+    VirtQueueElement elem;
+    MemoryRegion *mr;
+    ram_addr_t ram_addr;
+    uint32_t id;
+    unsigned int i;
+
+    while (virtqueue_pop(vq, &elem)) {
+        if (iov_to_buf(elem.out_sg, elem.out_num, 0, &id, 4) == 4) {
+            id = le32_to_cpu(id);
+            for (i = 0; i < elem.in_num; i++) {
+                mr = qemu_ram_addr_from_host(elem.in_sg[i].iov_base,
+                                             &ram_addr);
+                if (mr &&
+                    !ram_discard_free_pages(id, ram_addr,
+                                            elem.in_sg[i].iov_len)) {
+                    /* Stale or unwanted, so is the rest of the buffer */
+                    break;
+                }
+            }
+        }
+        virtqueue_push(vq, &elem, 0);
+        virtio_notify(vdev, vq);
+    }
+}
+
+static void balloon_free_page_hint_bh(void *opaque)
+{
+    VirtIOBalloon *s = opaque;
+    uint32_t id = ram_free_page_hint_generation();
+
+    if (id == s->free_page_hint_cmd_id) {
+        return;
+    }
+    s->free_page_hint_cmd_id = id;
+    if (balloon_free_page_hint_supported(s)) {
+        virtio_notify_config(VIRTIO_DEVICE(s));
+    }
+}
+
+/* Called from the migration thread after each dirty bitmap sync */
+static void balloon_free_page_hint_notify(Notifier *notifier, void *data)
+{
+    VirtIOBalloon *s = container_of(notifier, VirtIOBalloon,
+                                    free_page_hint_notifier);
+
+    qemu_bh_schedule(s->free_page_hint_bh);
+}
+
 static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
@@ -262,8 +431,9 @@ static void virtio_balloon_get_config(VirtIODevice *vdev, uint8_t *config_data)
 
     config.num_pages = cpu_to_le32(dev->num_pages);
     config.actual = cpu_to_le32(dev->actual);
+    config.free_page_hint_cmd_id = cpu_to_le32(dev->free_page_hint_cmd_id);
 
-    memcpy(config_data, &config, 8);
+    memcpy(config_data, &config, dev->config_size);
 }
 
 static void virtio_balloon_set_config(VirtIODevice *vdev,
@@ -272,7 +442,7 @@ static void virtio_balloon_set_config(VirtIODevice *vdev,
     VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
     struct virtio_balloon_config config;
     uint32_t oldactual = dev->actual;
-    memcpy(&config, config_data, 8);
+    memcpy(&config, config_data, dev->config_size);
     dev->actual = le32_to_cpu(config.actual);
     if (dev->actual != oldactual) {
         qemu_balloon_changed(ram_size -
@@ -282,7 +452,10 @@ static void virtio_balloon_set_config(VirtIODevice *vdev,
 
 static uint32_t virtio_balloon_get_features(VirtIODevice *vdev, uint32_t f)
 {
+    VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
+
     f |= (1 << VIRTIO_BALLOON_F_STATS_VQ);
+    f |= s->host_features;
     return f;
 }
 
@@ -343,7 +516,13 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     VirtIOBalloon *s = VIRTIO_BALLOON(dev);
     int ret;
 
-    virtio_init(vdev, "virtio-balloon", VIRTIO_ID_BALLOON, 8);
+    /* The command id is only visible with free page hints */
+    s->config_size = offsetof(struct virtio_balloon_config,
+                              free_page_hint_cmd_id);
+    if (s->host_features & (1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        s->config_size = sizeof(struct virtio_balloon_config);
+    }
+    virtio_init(vdev, "virtio-balloon", VIRTIO_ID_BALLOON, s->config_size);
 
     ret = qemu_add_balloon_handler(virtio_balloon_to_target,
                                    virtio_balloon_stat, s);
@@ -357,6 +536,13 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     s->ivq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->dvq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(vdev, 128, virtio_balloon_receive_stats);
+    if (s->host_features & (1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        s->fvq = virtio_add_queue(vdev, 128,
+                                  virtio_balloon_handle_free_page_hint);
+        s->free_page_hint_bh = qemu_bh_new(balloon_free_page_hint_bh, s);
+        s->free_page_hint_notifier.notify = balloon_free_page_hint_notify;
+        ram_add_bitmap_sync_notifier(&s->free_page_hint_notifier);
+    }
 
     register_savevm(dev, "virtio-balloon", -1, 1,
                     virtio_balloon_save, virtio_balloon_load, s);
@@ -376,12 +562,19 @@ static void virtio_balloon_device_unrealize(DeviceState *dev, Error **errp)
     VirtIOBalloon *s = VIRTIO_BALLOON(dev);
 
     balloon_stats_destroy_timer(s);
+    if (s->free_page_hint_bh) {
+        ram_remove_bitmap_sync_notifier(&s->free_page_hint_notifier);
+        qemu_bh_delete(s->free_page_hint_bh);
+        s->free_page_hint_bh = NULL;
+    }
+    balloon_pbp_free(s);
     qemu_remove_balloon_handler(s);
     unregister_savevm(dev, "virtio-balloon", s);
     virtio_cleanup(vdev);
 }
 
 static Property virtio_balloon_properties[] = {
+    DEFINE_VIRTIO_BALLOON_PROPERTIES(VirtIOBalloon, host_features),
     DEFINE_PROP_END_OF_LIST(),
 };
 
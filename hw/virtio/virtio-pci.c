@@ -34,6 +34,7 @@
 #include "qemu/range.h"
 #include "hw/virtio/virtio-bus.h"
 #include "qapi/visitor.h"
+#include "sysemu/iothread.h"
 
 /* from Linux's linux/virtio_pci.h */
 
@@ -553,6 +554,7 @@ static int kvm_virtio_pci_vector_use(VirtIOPCIProxy *proxy, int nvqs)
     int ret, queue_no;
     MSIMessage msg;
 
+    kvm_irqchip_begin_route_changes(kvm_state);
     for (queue_no = 0; queue_no < nvqs; queue_no++) {
         if (!virtio_queue_get_num(vdev, queue_no)) {
             break;
@@ -577,6 +579,7 @@ static int kvm_virtio_pci_vector_use(VirtIOPCIProxy *proxy, int nvqs)
             }
         }
     }
+    kvm_irqchip_end_route_changes(kvm_state);
     return 0;
 
 undo:
@@ -590,6 +593,7 @@ undo:
         }
         kvm_virtio_pci_vq_vector_release(proxy, vector);
     }
+    kvm_irqchip_end_route_changes(kvm_state);
     return ret;
 }
 
@@ -1069,6 +1073,13 @@ static Property virtio_blk_pci_properties[] = {
     DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 2),
 #ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
     DEFINE_PROP_BIT("x-data-plane", VirtIOBlkPCI, blk.data_plane, 0, false),
+    DEFINE_PROP_UINT32("x-poll-max-ns", VirtIOBlkPCI, blk.poll_max_ns, 0),
+    DEFINE_PROP_UINT32("x-poll-grow", VirtIOBlkPCI, blk.poll_grow, 0),
+    DEFINE_PROP_UINT32("x-poll-shrink", VirtIOBlkPCI, blk.poll_shrink, 0),
+    DEFINE_PROP_STRING("x-data-plane-affinity", VirtIOBlkPCI,
+                       blk.data_plane_affinity),
+    DEFINE_PROP_STRING("x-data-plane-sched", VirtIOBlkPCI,
+                       blk.data_plane_sched),
 #endif
     DEFINE_VIRTIO_BLK_FEATURES(VirtIOPCIProxy, host_features),
     DEFINE_VIRTIO_BLK_PROPERTIES(VirtIOBlkPCI, blk),
@@ -1107,6 +1118,10 @@ static void virtio_blk_pci_instance_init(Object *obj)
     VirtIOBlkPCI *dev = VIRTIO_BLK_PCI(obj);
     object_initialize(&dev->vdev, sizeof(dev->vdev), TYPE_VIRTIO_BLK);
     object_property_add_child(obj, "virtio-backend", OBJECT(&dev->vdev), NULL);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&dev->blk.iothread, NULL);
+#endif
 }
 
 static const TypeInfo virtio_blk_pci_info = {
@@ -1126,6 +1141,10 @@ static Property virtio_scsi_pci_properties[] = {
                        DEV_NVECTORS_UNSPECIFIED),
     DEFINE_VIRTIO_SCSI_FEATURES(VirtIOPCIProxy, host_features),
     DEFINE_VIRTIO_SCSI_PROPERTIES(VirtIOSCSIPCI, vdev.parent_obj.conf),
+#ifdef CONFIG_VIRTIO_SCSI_DATA_PLANE
+    DEFINE_PROP_BIT("x-data-plane", VirtIOSCSIPCI,
+                    vdev.parent_obj.conf.data_plane, 0, false),
+#endif
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -1275,6 +1294,7 @@ static void balloon_pci_stats_set_poll_interval(Object *obj, struct Visitor *v,
 
 static Property virtio_balloon_pci_properties[] = {
     DEFINE_VIRTIO_COMMON_FEATURES(VirtIOPCIProxy, host_features),
+    DEFINE_VIRTIO_BALLOON_PROPERTIES(VirtIOBalloonPCI, vdev.host_features),
     DEFINE_PROP_HEX32("class", VirtIOPCIProxy, class_code, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -1420,6 +1440,10 @@ static Property virtio_net_properties[] = {
     DEFINE_VIRTIO_NET_FEATURES(VirtIOPCIProxy, host_features),
     DEFINE_NIC_PROPERTIES(VirtIONetPCI, vdev.nic_conf),
     DEFINE_VIRTIO_NET_PROPERTIES(VirtIONetPCI, vdev.net_conf),
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    DEFINE_PROP_BIT("x-data-plane", VirtIONetPCI, vdev.net_conf.data_plane,
+                    0, false),
+#endif
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -36,20 +36,13 @@ static size_t get_request_size(VirtQueue *vq, unsigned quota)
 
 static void virtio_rng_process(VirtIORNG *vrng);
 
-/* Send data from a char device over to the guest */
-static void chr_read(void *opaque, const void *buf, size_t size)
+/* Copy entropy into the guest's buffers, returns the number of bytes used */
+static size_t virtio_rng_push(VirtIORNG *vrng, const void *buf, size_t size)
 {
-    VirtIORNG *vrng = opaque;
     VirtIODevice *vdev = VIRTIO_DEVICE(vrng);
     VirtQueueElement elem;
     size_t len;
-    int offset;
-
-    if (!is_guest_ready(vrng)) {
-        return;
-    }
-
-    vrng->quota_remaining -= size;
+    size_t offset;
 
     offset = 0;
     while (offset < size) {
@@ -62,7 +55,45 @@ static void chr_read(void *opaque, const void *buf, size_t size)
 
         virtqueue_push(vrng->vq, &elem, len);
     }
+    vrng->quota_remaining -= offset;
     virtio_notify(vdev, vrng->vq);
+    return offset;
+}
+
+/* Send data from a char device over to the guest */
+static void chr_read(void *opaque, const void *buf, size_t size)
+{
+    VirtIORNG *vrng = opaque;
+
+    if (!is_guest_ready(vrng)) {
+        return;
+    }
+
+    virtio_rng_push(vrng, buf, size);
+}
+
+static void virtio_rng_pool_fill(void *opaque, const void *buf, size_t size)
+{
+    VirtIORNG *vrng = opaque;
+
+    /* size is 0 when the backend dropped the request */
+    vrng->pool_refilling = false;
+    size = MIN(size, vrng->conf.pool_size - vrng->pool_len);
+    memcpy(vrng->pool + vrng->pool_len, buf, size);
+    vrng->pool_len += size;
+
+    virtio_rng_process(vrng);
+}
+
+static void virtio_rng_pool_refill(VirtIORNG *vrng)
+{
+    if (vrng->pool_refilling || vrng->pool_len == vrng->conf.pool_size) {
+        return;
+    }
+    vrng->pool_refilling = true;
+    rng_backend_request_entropy(vrng->rng,
+                                vrng->conf.pool_size - vrng->pool_len,
+                                virtio_rng_pool_fill, vrng);
 }
 
 static void virtio_rng_process(VirtIORNG *vrng)
@@ -81,6 +112,18 @@ static void virtio_rng_process(VirtIORNG *vrng)
     }
     size = get_request_size(vrng->vq, quota);
     size = MIN(vrng->quota_remaining, size);
+
+    if (vrng->pool) {
+        size = MIN(size, vrng->pool_len);
+        if (size) {
+            size = virtio_rng_push(vrng, vrng->pool, size);
+            vrng->pool_len -= size;
+            memmove(vrng->pool, vrng->pool + size, vrng->pool_len);
+        }
+        virtio_rng_pool_refill(vrng);
+        return;
+    }
+
     if (size) {
         rng_backend_request_entropy(vrng->rng, size, chr_read, vrng);
     }
@@ -145,6 +188,12 @@ static void virtio_rng_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    if (vrng->conf.pool_size > VIRTIO_RNG_POOL_MAX) {
+        error_setg(errp, "pool-size must be at most %d",
+                   VIRTIO_RNG_POOL_MAX);
+        return;
+    }
+
     if (vrng->conf.rng == NULL) {
         vrng->conf.default_backend = RNG_RANDOM(object_new(TYPE_RNG_RANDOM));
 
@@ -183,6 +232,14 @@ static void virtio_rng_device_realize(DeviceState *dev, Error **errp)
     timer_mod(vrng->rate_limit_timer,
                    qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + vrng->conf.period_ms);
 
+    /* Start filling the pool now, so that entropy is at hand as soon as
+     * the guest boots.
+     */
+    if (vrng->conf.pool_size) {
+        vrng->pool = g_malloc(vrng->conf.pool_size);
+        virtio_rng_pool_refill(vrng);
+    }
+
     register_savevm(dev, "virtio-rng", -1, 1, virtio_rng_save,
                     virtio_rng_load, vrng);
 }
@@ -194,6 +251,10 @@ static void virtio_rng_device_unrealize(DeviceState *dev, Error **errp)
 
     timer_del(vrng->rate_limit_timer);
     timer_free(vrng->rate_limit_timer);
+    if (vrng->pool_refilling) {
+        rng_backend_cancel_requests(vrng->rng);
+    }
+    g_free(vrng->pool);
     unregister_savevm(dev, "virtio-rng", vrng);
     virtio_cleanup(vdev);
 }
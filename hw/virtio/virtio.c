@@ -18,6 +18,8 @@
 #include "hw/virtio/virtio.h"
 #include "qemu/atomic.h"
 #include "hw/virtio/virtio-bus.h"
+#include "hw/xen/xen.h"
+#include "exec/address-spaces.h"
 
 /*
  * The alignment to use between consumer and producer parts of vring.
@@ -54,6 +56,14 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+/* A part of the ring that is mapped into QEMU's address space */
+typedef struct VRingRegion
+{
+    uint8_t *hva;               /* NULL if accessed with ldX_phys/stX_phys */
+    hwaddr len;
+    ram_addr_t ram_addr;
+} VRingRegion;
+
 typedef struct VRing
 {
     unsigned int num;
@@ -61,8 +71,20 @@ typedef struct VRing
     hwaddr desc;
     hwaddr avail;
     hwaddr used;
+    /* The mappings are valid while map_gen equals vring_map_gen */
+    unsigned int map_gen;
+    VRingRegion desc_map;
+    VRingRegion avail_map;
+    VRingRegion used_map;
 } VRing;
 
+/* VirtQueueBuf capacities are VIRTQUEUE_BUF_MIN_SG << class */
+#define VIRTQUEUE_BUF_MIN_SG    4
+#define VIRTQUEUE_BUF_CLASSES   10
+
+/* Chains up to this long are collected without allocating */
+#define VIRTQUEUE_BUF_STACK_DESC 16
+
 struct VirtQueue
 {
     VRing vring;
@@ -86,13 +108,126 @@ struct VirtQueue
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+
+    /*
+     * Totals of the complete chains between last_avail_idx and
+     * avail_cache_idx, as counted by virtqueue_get_avail_bytes(), so that
+     * it does not walk the same chains again on every call.
+     */
+    bool avail_cache_valid;
+    uint16_t avail_cache_idx;
+    unsigned int avail_cache_bufs;
+    unsigned int avail_cache_in;
+    unsigned int avail_cache_out;
+
+    /* Free VirtQueueBufs by size class, at most vring.num in total */
+    QSLIST_HEAD(, VirtQueueBuf) buf_pool[VIRTQUEUE_BUF_CLASSES];
+    unsigned int buf_pool_len;
+};
+
+/* A descriptor table being walked: the ring's own table or an indirect one */
+typedef struct VRingDescTable
+{
+    hwaddr pa;
+    const uint8_t *hva;
+    hwaddr map_len;             /* non-zero if hva must be unmapped */
+    uint8_t *copy;              /* non-NULL if hva must be freed */
+    unsigned int max;
+} VRingDescTable;
+
+/*
+ * Ring mappings are dropped on their next use after any change to the
+ * memory topology, which may have moved or removed the RAM behind them.
+ * The generation starts at 1 so that a zeroed VRing is never valid.
+ */
+static unsigned int vring_map_gen = 1;
+
+static void vring_listener_commit(MemoryListener *listener)
+{
+    vring_map_gen++;
+}
+
+static MemoryListener vring_listener = {
+    .commit = vring_listener_commit,
 };
 
+static void vring_region_map(VRingRegion *r, hwaddr pa, hwaddr size,
+                             bool is_write)
+{
+    hwaddr len = size;
+    void *hva;
+
+    r->hva = NULL;
+
+    /* The Xen map cache does not expect mappings to be held */
+    if (xen_enabled()) {
+        return;
+    }
+
+    hva = cpu_physical_memory_map(pa, &len, is_write);
+    if (!hva) {
+        return;
+    }
+
+    /* Only RAM can be kept mapped; a bounce buffer has no RAM block */
+    if (len != size || !qemu_ram_addr_from_host(hva, &r->ram_addr)) {
+        cpu_physical_memory_unmap(hva, len, 0, 0);
+        return;
+    }
+
+    r->hva = hva;
+    r->len = len;
+}
+
+static void vring_region_unmap(VRingRegion *r)
+{
+    if (r->hva) {
+        /* Writes were marked dirty as they were done */
+        cpu_physical_memory_unmap(r->hva, r->len, 0, 0);
+        r->hva = NULL;
+    }
+}
+
+static void vring_unmap(VRing *vring)
+{
+    vring_region_unmap(&vring->desc_map);
+    vring_region_unmap(&vring->avail_map);
+    vring_region_unmap(&vring->used_map);
+    vring->map_gen = 0;
+}
+
+static void vring_map(VRing *vring)
+{
+    vring_unmap(vring);
+
+    if (vring->desc && vring->num) {
+        vring_region_map(&vring->desc_map, vring->desc,
+                         sizeof(VRingDesc) * vring->num, false);
+        /* Include used_event after the avail ring ... */
+        vring_region_map(&vring->avail_map, vring->avail,
+                         offsetof(VRingAvail, ring[vring->num + 1]), false);
+        /* ... and avail_event after the used ring */
+        vring_region_map(&vring->used_map, vring->used,
+                         offsetof(VRingUsed, ring[vring->num]) +
+                         sizeof(uint16_t), true);
+    }
+    vring->map_gen = vring_map_gen;
+}
+
+static inline void vring_check_map(VRing *vring)
+{
+    if (unlikely(vring->map_gen != vring_map_gen)) {
+        vring_map(vring);
+    }
+}
+
 /* virt queue functions */
 static void virtqueue_init(VirtQueue *vq)
 {
     hwaddr pa = vq->pa;
 
+    vring_unmap(&vq->vring);
+    vq->avail_cache_valid = false;
     vq->vring.desc = pa;
     vq->vring.avail = pa + vq->vring.num * sizeof(VRingDesc);
     vq->vring.used = vring_align(vq->vring.avail +
@@ -100,53 +235,133 @@ static void virtqueue_init(VirtQueue *vq)
                                  vq->vring.align);
 }
 
-static inline uint64_t vring_desc_addr(hwaddr desc_pa, int i)
+static inline uint16_t vring_avail_lduw(VirtQueue *vq, hwaddr off)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return ldq_phys(pa);
+    vring_check_map(&vq->vring);
+    if (likely(vq->vring.avail_map.hva)) {
+        return lduw_p(vq->vring.avail_map.hva + off);
+    }
+    return lduw_phys(vq->vring.avail + off);
 }
 
-static inline uint32_t vring_desc_len(hwaddr desc_pa, int i)
+static inline uint16_t vring_used_lduw(VirtQueue *vq, hwaddr off)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return ldl_phys(pa);
+    vring_check_map(&vq->vring);
+    if (likely(vq->vring.used_map.hva)) {
+        return lduw_p(vq->vring.used_map.hva + off);
+    }
+    return lduw_phys(vq->vring.used + off);
 }
 
-static inline uint16_t vring_desc_flags(hwaddr desc_pa, int i)
+static inline void vring_used_stw(VirtQueue *vq, hwaddr off, uint16_t val)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return lduw_phys(pa);
+    VRingRegion *r = &vq->vring.used_map;
+
+    vring_check_map(&vq->vring);
+    if (likely(r->hva)) {
+        stw_p(r->hva + off, val);
+        cpu_physical_memory_mark_written(r->ram_addr + off, sizeof(val));
+    } else {
+        stw_phys(vq->vring.used + off, val);
+    }
 }
 
-static inline uint16_t vring_desc_next(hwaddr desc_pa, int i)
+static inline void vring_used_stl(VirtQueue *vq, hwaddr off, uint32_t val)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return lduw_phys(pa);
+    VRingRegion *r = &vq->vring.used_map;
+
+    vring_check_map(&vq->vring);
+    if (likely(r->hva)) {
+        stl_p(r->hva + off, val);
+        cpu_physical_memory_mark_written(r->ram_addr + off, sizeof(val));
+    } else {
+        stl_phys(vq->vring.used + off, val);
+    }
+}
+
+static void vring_desc_table_init(VirtQueue *vq, VRingDescTable *table)
+{
+    vring_check_map(&vq->vring);
+    table->pa = vq->vring.desc;
+    table->hva = vq->vring.desc_map.hva;
+    table->map_len = 0;
+    table->copy = NULL;
+    table->max = vq->vring.num;
+}
+
+/* Switch to the indirect table described by desc; len is validated */
+static void vring_desc_table_indirect(VRingDescTable *table,
+                                      const VRingDesc *desc)
+{
+    hwaddr len = desc->len;
+    void *hva = NULL;
+
+    table->pa = desc->addr;
+    table->hva = NULL;
+    table->max = desc->len / sizeof(VRingDesc);
+
+    /* The table only lives for one walk, so a bounce buffer is fine */
+    if (len) {
+        hva = cpu_physical_memory_map(table->pa, &len, 0);
+    }
+    if (hva && len == desc->len) {
+        table->hva = hva;
+        table->map_len = len;
+        return;
+    } else if (hva) {
+        cpu_physical_memory_unmap(hva, len, 0, 0);
+    }
+
+    /* Not mappable in one piece: fetch it with a single bulk copy rather
+     * than one access per descriptor, unless it is implausibly large. */
+    if (desc->len && table->max <= VIRTQUEUE_MAX_SIZE * 2) {
+        table->copy = g_malloc(desc->len);
+        cpu_physical_memory_read(table->pa, table->copy, desc->len);
+        table->hva = table->copy;
+    }
+}
+
+static void vring_desc_table_done(VRingDescTable *table)
+{
+    if (table->map_len) {
+        cpu_physical_memory_unmap((void *)table->hva, table->map_len, 0, 0);
+        table->hva = NULL;
+        table->map_len = 0;
+    }
+    if (table->copy) {
+        g_free(table->copy);
+        table->hva = table->copy = NULL;
+    }
+}
+
+static void vring_desc_read(VRingDescTable *table, unsigned int i,
+                            VRingDesc *desc)
+{
+    if (likely(table->hva)) {
+        memcpy(desc, table->hva + sizeof(VRingDesc) * i, sizeof(VRingDesc));
+    } else {
+        cpu_physical_memory_read(table->pa + sizeof(VRingDesc) * i,
+                                 desc, sizeof(VRingDesc));
+    }
+    desc->addr = tswap64(desc->addr);
+    desc->len = tswap32(desc->len);
+    desc->flags = tswap16(desc->flags);
+    desc->next = tswap16(desc->next);
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return lduw_phys(pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, flags));
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    return lduw_phys(pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, idx));
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return lduw_phys(pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, ring[i]));
 }
 
 static inline uint16_t vring_used_event(VirtQueue *vq)
@@ -156,54 +371,44 @@ static inline uint16_t vring_used_event(VirtQueue *vq)
 
 static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
-    stl_phys(pa, val);
+    vring_used_stl(vq, offsetof(VRingUsed, ring[i].id), val);
 }
 
 static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
-    stl_phys(pa, val);
+    vring_used_stl(vq, offsetof(VRingUsed, ring[i].len), val);
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return lduw_phys(pa);
+    return vring_used_lduw(vq, offsetof(VRingUsed, idx));
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    stw_phys(pa, val);
+    vring_used_stw(vq, offsetof(VRingUsed, idx), val);
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) | mask);
+    hwaddr off = offsetof(VRingUsed, flags);
+
+    vring_used_stw(vq, off, vring_used_lduw(vq, off) | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) & ~mask);
+    hwaddr off = offsetof(VRingUsed, flags);
+
+    vring_used_stw(vq, off, vring_used_lduw(vq, off) & ~mask);
 }
 
 static inline void vring_avail_event(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    stw_phys(pa, val);
+    vring_used_stw(vq, offsetof(VRingUsed, ring[vq->vring.num]), val);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
@@ -232,37 +437,53 @@ int virtio_queue_empty(VirtQueue *vq)
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
-void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
-                    unsigned int len, unsigned int idx)
+static void virtqueue_fill_sg(VirtQueue *vq, unsigned int index,
+                              const struct iovec *in_sg, unsigned int in_num,
+                              const struct iovec *out_sg, unsigned int out_num,
+                              unsigned int len, unsigned int idx)
 {
     unsigned int offset;
     int i;
 
-    trace_virtqueue_fill(vq, elem, len, idx);
-
     offset = 0;
-    for (i = 0; i < elem->in_num; i++) {
-        size_t size = MIN(len - offset, elem->in_sg[i].iov_len);
+    for (i = 0; i < in_num; i++) {
+        size_t size = MIN(len - offset, in_sg[i].iov_len);
 
-        cpu_physical_memory_unmap(elem->in_sg[i].iov_base,
-                                  elem->in_sg[i].iov_len,
+        cpu_physical_memory_unmap(in_sg[i].iov_base,
+                                  in_sg[i].iov_len,
                                   1, size);
 
         offset += size;
     }
 
-    for (i = 0; i < elem->out_num; i++)
-        cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
-                                  elem->out_sg[i].iov_len,
-                                  0, elem->out_sg[i].iov_len);
+    for (i = 0; i < out_num; i++)
+        cpu_physical_memory_unmap(out_sg[i].iov_base,
+                                  out_sg[i].iov_len,
+                                  0, out_sg[i].iov_len);
 
     idx = (idx + vring_used_idx(vq)) % vq->vring.num;
 
     /* Get a pointer to the next entry in the used ring. */
-    vring_used_ring_id(vq, idx, elem->index);
+    vring_used_ring_id(vq, idx, index);
     vring_used_ring_len(vq, idx, len);
 }
 
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
+{
+    trace_virtqueue_fill(vq, elem, len, idx);
+    virtqueue_fill_sg(vq, elem->index, elem->in_sg, elem->in_num,
+                      elem->out_sg, elem->out_num, len, idx);
+}
+
+void virtqueue_fill_buf(VirtQueue *vq, const VirtQueueBuf *buf,
+                        unsigned int len, unsigned int idx)
+{
+    trace_virtqueue_fill(vq, buf, len, idx);
+    virtqueue_fill_sg(vq, buf->index, buf->in_sg, buf->in_num,
+                      buf->out_sg, buf->out_num, len, idx);
+}
+
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
 {
     uint16_t old, new;
@@ -284,6 +505,13 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     virtqueue_flush(vq, 1);
 }
 
+void virtqueue_push_buf(VirtQueue *vq, const VirtQueueBuf *buf,
+                        unsigned int len)
+{
+    virtqueue_fill_buf(vq, buf, len, 0);
+    virtqueue_flush(vq, 1);
+}
+
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
     uint16_t num_heads = vring_avail_idx(vq) - idx;
@@ -320,19 +548,18 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(hwaddr desc_pa,
-                                    unsigned int i, unsigned int max)
+static unsigned virtqueue_next_desc(const VRingDesc *desc, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(desc_pa, i) & VRING_DESC_F_NEXT))
+    if (!(desc->flags & VRING_DESC_F_NEXT)) {
         return max;
+    }
 
-    /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(desc_pa, i);
-    /* Make sure compiler knows to grab that: we don't want it changing! */
-    smp_wmb();
+    /* Check they're not leading us off end of descriptors.  desc is our
+     * own copy, so the guest cannot change it behind our back. */
+    next = desc->next;
 
     if (next >= max) {
         error_report("Desc next is %u", next);
@@ -342,6 +569,33 @@ static unsigned virtqueue_next_desc(hwaddr desc_pa,
     return next;
 }
 
+/* Drop the chain just popped, which last_avail_idx has already moved
+ * past, from the totals cached by virtqueue_get_avail_bytes().
+ */
+static void virtqueue_avail_cache_pop(VirtQueue *vq, const struct iovec *in_sg,
+                                      unsigned int in_num,
+                                      const struct iovec *out_sg,
+                                      unsigned int out_num, bool indirect)
+{
+    unsigned int i;
+
+    if (!vq->avail_cache_valid) {
+        return;
+    }
+    if (vq->avail_cache_idx == (uint16_t)(vq->last_avail_idx - 1)) {
+        vq->avail_cache_idx = vq->last_avail_idx;
+        return;
+    }
+
+    vq->avail_cache_bufs -= indirect ? 1 : in_num + out_num;
+    for (i = 0; i < in_num; i++) {
+        vq->avail_cache_in -= in_sg[i].iov_len;
+    }
+    for (i = 0; i < out_num; i++) {
+        vq->avail_cache_out -= out_sg[i].iov_len;
+    }
+}
+
 void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                                unsigned int *out_bytes,
                                unsigned max_in_bytes, unsigned max_out_bytes)
@@ -352,56 +606,83 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     idx = vq->last_avail_idx;
 
     total_bufs = in_total = out_total = 0;
+    if (vq->avail_cache_valid &&
+        virtqueue_num_heads(vq, idx) >= (uint16_t)(vq->avail_cache_idx - idx)) {
+        /* Resume after the chains counted by previous calls */
+        idx = vq->avail_cache_idx;
+        total_bufs = vq->avail_cache_bufs;
+        in_total = vq->avail_cache_in;
+        out_total = vq->avail_cache_out;
+        if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+            goto done;
+        }
+    }
+
     while (virtqueue_num_heads(vq, idx)) {
-        unsigned int max, num_bufs, indirect = 0;
-        hwaddr desc_pa;
-        int i;
+        unsigned int num_bufs, indirect = 0;
+        VRingDescTable table;
+        VRingDesc desc;
+        unsigned int i;
 
-        max = vq->vring.num;
+        vring_desc_table_init(vq, &table);
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
-        desc_pa = vq->vring.desc;
+        vring_desc_read(&table, i, &desc);
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
 
             /* If we've got too many, that implies a descriptor loop. */
-            if (num_bufs >= max) {
+            if (num_bufs >= table.max) {
                 error_report("Looped descriptor");
                 exit(1);
             }
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-            desc_pa = vring_desc_addr(desc_pa, i);
+            vring_desc_table_indirect(&table, &desc);
             num_bufs = i = 0;
+            vring_desc_read(&table, i, &desc);
         }
 
-        do {
+        for (;;) {
             /* If we've got too many, that implies a descriptor loop. */
-            if (++num_bufs > max) {
+            if (++num_bufs > table.max) {
                 error_report("Looped descriptor");
                 exit(1);
             }
 
-            if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(desc_pa, i);
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
             } else {
-                out_total += vring_desc_len(desc_pa, i);
+                out_total += desc.len;
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+                vring_desc_table_done(&table);
                 goto done;
             }
-        } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+
+            i = virtqueue_next_desc(&desc, table.max);
+            if (i == table.max) {
+                break;
+            }
+            vring_desc_read(&table, i, &desc);
+        }
+        vring_desc_table_done(&table);
 
         if (!indirect)
             total_bufs = num_bufs;
         else
             total_bufs++;
+
+        vq->avail_cache_valid = true;
+        vq->avail_cache_idx = idx;
+        vq->avail_cache_bufs = total_bufs;
+        vq->avail_cache_in = in_total;
+        vq->avail_cache_out = out_total;
     }
 done:
     if (in_bytes) {
@@ -439,8 +720,10 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
 
 int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
 {
-    unsigned int i, head, max;
-    hwaddr desc_pa = vq->vring.desc;
+    unsigned int i, head;
+    VRingDescTable table;
+    VRingDesc desc;
+    bool indirect = false;
 
     if (!virtqueue_num_heads(vq, vq->last_avail_idx))
         return 0;
@@ -448,53 +731,67 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     /* When we start there are none of either input nor output. */
     elem->out_num = elem->in_num = 0;
 
-    max = vq->vring.num;
+    vring_desc_table_init(vq, &table);
 
     i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
     if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
         vring_avail_event(vq, vring_avail_idx(vq));
     }
 
-    if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+    vring_desc_read(&table, i, &desc);
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(desc_pa, i);
+        indirect = true;
+        vring_desc_table_indirect(&table, &desc);
         i = 0;
+        vring_desc_read(&table, i, &desc);
     }
 
     /* Collect all the descriptors */
-    do {
+    for (;;) {
         struct iovec *sg;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
+        if (desc.flags & VRING_DESC_F_WRITE) {
             if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
                 error_report("Too many write descriptors in indirect table");
                 exit(1);
             }
-            elem->in_addr[elem->in_num] = vring_desc_addr(desc_pa, i);
+            elem->in_addr[elem->in_num] = desc.addr;
             sg = &elem->in_sg[elem->in_num++];
         } else {
             if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
                 error_report("Too many read descriptors in indirect table");
                 exit(1);
             }
-            elem->out_addr[elem->out_num] = vring_desc_addr(desc_pa, i);
+            elem->out_addr[elem->out_num] = desc.addr;
             sg = &elem->out_sg[elem->out_num++];
         }
 
-        sg->iov_len = vring_desc_len(desc_pa, i);
+        sg->iov_len = desc.len;
 
         /* If we've got too many, that implies a descriptor loop. */
-        if ((elem->in_num + elem->out_num) > max) {
+        if ((elem->in_num + elem->out_num) > table.max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+
+        i = virtqueue_next_desc(&desc, table.max);
+        if (i == table.max) {
+            break;
+        }
+        vring_desc_read(&table, i, &desc);
+    }
+
+    /* Release an indirect table before mapping, it may hold the bounce
+     * buffer. */
+    vring_desc_table_done(&table);
+    virtqueue_avail_cache_pop(vq, elem->in_sg, elem->in_num,
+                              elem->out_sg, elem->out_num, indirect);
 
     /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
@@ -508,6 +805,225 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     return elem->in_num + elem->out_num;
 }
 
+/* Take a buffer with room for in_num + out_num segments from the pool of
+ * vq, or allocate one.  vq may be NULL for a buffer not owned by a queue.
+ */
+static VirtQueueBuf *virtqueue_buf_get(VirtQueue *vq, unsigned int in_num,
+                                       unsigned int out_num)
+{
+    unsigned int c = 0;
+    VirtQueueBuf *buf = NULL;
+
+    while ((VIRTQUEUE_BUF_MIN_SG << c) < in_num + out_num) {
+        c++;
+    }
+    assert(c < VIRTQUEUE_BUF_CLASSES);
+
+    if (vq) {
+        buf = QSLIST_FIRST(&vq->buf_pool[c]);
+    }
+    if (buf) {
+        QSLIST_REMOVE_HEAD(&vq->buf_pool[c], next);
+        vq->buf_pool_len--;
+    } else {
+        unsigned int max_sg = VIRTQUEUE_BUF_MIN_SG << c;
+
+        buf = g_malloc(sizeof(*buf) +
+                       max_sg * (sizeof(hwaddr) + sizeof(struct iovec)));
+        buf->vq = vq;
+        buf->max_sg = max_sg;
+    }
+
+    buf->in_num = in_num;
+    buf->out_num = out_num;
+    buf->in_addr = buf->addr;
+    buf->out_addr = buf->addr + in_num;
+    buf->in_sg = (struct iovec *)(buf->addr + buf->max_sg);
+    buf->out_sg = buf->in_sg + in_num;
+    return buf;
+}
+
+/* Return a buffer to its queue's pool.  Its segments must have been
+ * unmapped, normally by virtqueue_fill_buf().
+ */
+void virtqueue_buf_free(VirtQueueBuf *buf)
+{
+    VirtQueue *vq = buf->vq;
+    unsigned int c = 0;
+
+    if (!vq || vq->buf_pool_len >= vq->vring.num) {
+        g_free(buf);
+        return;
+    }
+
+    while ((VIRTQUEUE_BUF_MIN_SG << c) < buf->max_sg) {
+        c++;
+    }
+    QSLIST_INSERT_HEAD(&vq->buf_pool[c], buf, next);
+    vq->buf_pool_len++;
+}
+
+static void virtqueue_buf_pool_free(VirtQueue *vq)
+{
+    VirtQueueBuf *buf;
+    int c;
+
+    for (c = 0; c < VIRTQUEUE_BUF_CLASSES; c++) {
+        while ((buf = QSLIST_FIRST(&vq->buf_pool[c])) != NULL) {
+            QSLIST_REMOVE_HEAD(&vq->buf_pool[c], next);
+            g_free(buf);
+        }
+    }
+    vq->buf_pool_len = 0;
+}
+
+void virtqueue_buf_map(VirtQueueBuf *buf)
+{
+    virtqueue_map_sg(buf->in_sg, buf->in_addr, buf->in_num, 1);
+    virtqueue_map_sg(buf->out_sg, buf->out_addr, buf->out_num, 0);
+}
+
+/* Like virtqueue_pop(), but the element is only as large as the chain */
+VirtQueueBuf *virtqueue_pop_buf(VirtQueue *vq)
+{
+    VRingDesc stack_chain[VIRTQUEUE_BUF_STACK_DESC];
+    VRingDesc *chain = stack_chain;
+    unsigned int i, head, n, in_num, out_num;
+    VRingDescTable table;
+    VirtQueueBuf *buf;
+    VRingDesc desc;
+    bool indirect = false;
+
+    if (!virtqueue_num_heads(vq, vq->last_avail_idx)) {
+        return NULL;
+    }
+
+    vring_desc_table_init(vq, &table);
+
+    i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
+    if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        vring_avail_event(vq, vring_avail_idx(vq));
+    }
+
+    vring_desc_read(&table, i, &desc);
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingDesc)) {
+            error_report("Invalid size for indirect buffer table");
+            exit(1);
+        }
+
+        /* loop over the indirect descriptor table */
+        indirect = true;
+        vring_desc_table_indirect(&table, &desc);
+        i = 0;
+        vring_desc_read(&table, i, &desc);
+    }
+
+    /* Collect the chain first to learn how large the element must be */
+    n = in_num = out_num = 0;
+    for (;;) {
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            if (in_num >= VIRTQUEUE_MAX_SIZE) {
+                error_report("Too many write descriptors in indirect table");
+                exit(1);
+            }
+            in_num++;
+        } else {
+            if (out_num >= VIRTQUEUE_MAX_SIZE) {
+                error_report("Too many read descriptors in indirect table");
+                exit(1);
+            }
+            out_num++;
+        }
+
+        if (n == VIRTQUEUE_BUF_STACK_DESC) {
+            chain = g_new(VRingDesc, VIRTQUEUE_MAX_SIZE * 2);
+            memcpy(chain, stack_chain, sizeof(stack_chain));
+        }
+        chain[n++] = desc;
+
+        /* If we've got too many, that implies a descriptor loop. */
+        if (n > table.max) {
+            error_report("Looped descriptor");
+            exit(1);
+        }
+
+        i = virtqueue_next_desc(&desc, table.max);
+        if (i == table.max) {
+            break;
+        }
+        vring_desc_read(&table, i, &desc);
+    }
+    vring_desc_table_done(&table);
+
+    buf = virtqueue_buf_get(vq, in_num, out_num);
+    buf->index = head;
+
+    in_num = out_num = 0;
+    for (i = 0; i < n; i++) {
+        if (chain[i].flags & VRING_DESC_F_WRITE) {
+            buf->in_addr[in_num] = chain[i].addr;
+            buf->in_sg[in_num++].iov_len = chain[i].len;
+        } else {
+            buf->out_addr[out_num] = chain[i].addr;
+            buf->out_sg[out_num++].iov_len = chain[i].len;
+        }
+    }
+    if (chain != stack_chain) {
+        g_free(chain);
+    }
+    virtqueue_avail_cache_pop(vq, buf->in_sg, buf->in_num,
+                              buf->out_sg, buf->out_num, indirect);
+
+    virtqueue_buf_map(buf);
+
+    vq->inuse++;
+
+    trace_virtqueue_pop(vq, buf, buf->in_num, buf->out_num);
+    return buf;
+}
+
+/* Buffers are migrated in the layout of a VirtQueueElement, which is what
+ * devices have always put in the stream.
+ */
+void virtqueue_buf_save(QEMUFile *f, const VirtQueueBuf *buf)
+{
+    VirtQueueElement *elem = g_new0(VirtQueueElement, 1);
+
+    elem->index = buf->index;
+    elem->in_num = buf->in_num;
+    elem->out_num = buf->out_num;
+    memcpy(elem->in_addr, buf->in_addr, buf->in_num * sizeof(hwaddr));
+    memcpy(elem->out_addr, buf->out_addr, buf->out_num * sizeof(hwaddr));
+    memcpy(elem->in_sg, buf->in_sg, buf->in_num * sizeof(struct iovec));
+    memcpy(elem->out_sg, buf->out_sg, buf->out_num * sizeof(struct iovec));
+    qemu_put_buffer(f, (unsigned char *)elem, sizeof(*elem));
+    g_free(elem);
+}
+
+/* The buffer is not mapped and belongs to no queue; returns NULL if the
+ * element in the stream is invalid.
+ */
+VirtQueueBuf *virtqueue_buf_load(QEMUFile *f)
+{
+    VirtQueueElement *elem = g_new(VirtQueueElement, 1);
+    VirtQueueBuf *buf = NULL;
+
+    qemu_get_buffer(f, (unsigned char *)elem, sizeof(*elem));
+    if (elem->in_num <= VIRTQUEUE_MAX_SIZE &&
+        elem->out_num <= VIRTQUEUE_MAX_SIZE) {
+        buf = virtqueue_buf_get(NULL, elem->in_num, elem->out_num);
+        buf->index = elem->index;
+        memcpy(buf->in_addr, elem->in_addr, buf->in_num * sizeof(hwaddr));
+        memcpy(buf->out_addr, elem->out_addr, buf->out_num * sizeof(hwaddr));
+        memcpy(buf->in_sg, elem->in_sg, buf->in_num * sizeof(struct iovec));
+        memcpy(buf->out_sg, elem->out_sg,
+               buf->out_num * sizeof(struct iovec));
+    }
+    g_free(elem);
+    return buf;
+}
+
 /* virtio device */
 static void virtio_notify_vector(VirtIODevice *vdev, uint16_t vector)
 {
@@ -555,10 +1071,12 @@ void virtio_reset(void *opaque)
     virtio_notify_vector(vdev, vdev->config_vector);
 
     for(i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        vring_unmap(&vdev->vq[i].vring);
         vdev->vq[i].vring.desc = 0;
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
         vdev->vq[i].last_avail_idx = 0;
+        vdev->vq[i].avail_cache_valid = false;
         vdev->vq[i].pa = 0;
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].signalled_used = 0;
@@ -764,6 +1282,8 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
         abort();
     }
 
+    vring_unmap(&vdev->vq[n].vring);
+    virtqueue_buf_pool_free(&vdev->vq[n]);
     vdev->vq[n].vring.num = 0;
 }
 
@@ -958,6 +1478,12 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        vring_unmap(&vdev->vq[i].vring);
+        virtqueue_buf_pool_free(&vdev->vq[i]);
+    }
     qemu_del_vm_change_state_handler(vdev->vmstate);
     g_free(vdev->config);
     g_free(vdev->vq);
@@ -987,7 +1513,13 @@ static void virtio_vmstate_change(void *opaque, int running, RunState state)
 void virtio_init(VirtIODevice *vdev, const char *name,
                  uint16_t device_id, size_t config_size)
 {
+    static bool vring_listener_registered;
     int i;
+
+    if (!vring_listener_registered) {
+        memory_listener_register(&vring_listener, &address_space_memory);
+        vring_listener_registered = true;
+    }
     vdev->device_id = device_id;
     vdev->status = 0;
     vdev->isr = 0;
@@ -1063,6 +1595,7 @@ uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
 void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
 {
     vdev->vq[n].last_avail_idx = idx;
+    vdev->vq[n].avail_cache_valid = false;
 }
 
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
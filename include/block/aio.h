@@ -19,6 +19,7 @@
 #include "qemu/queue.h"
 #include "qemu/event_notifier.h"
 #include "qemu/thread.h"
+#include "qemu/rfifolock.h"
 #include "qemu/timer.h"
 
 typedef struct BlockDriverAIOCB BlockDriverAIOCB;
@@ -34,8 +35,10 @@ struct BlockDriverAIOCB {
     BlockDriverState *bs;
     BlockDriverCompletionFunc *cb;
     void *opaque;
+    uint64_t id;    /* unique, used to correlate trace events */
 };
 
+uint64_t bdrv_new_request_id(void);
 void *qemu_aio_get(const AIOCBInfo *aiocb_info, BlockDriverState *bs,
                    BlockDriverCompletionFunc *cb, void *opaque);
 void qemu_aio_release(void *p);
@@ -43,10 +46,14 @@ void qemu_aio_release(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
 
 struct AioContext {
     GSource source;
 
+    /* Protects against concurrent use of the context by several threads */
+    RFifoLock lock;
+
     /* The list of registered AIO handlers */
     QLIST_HEAD(, AioHandler) aio_handlers;
 
@@ -72,13 +79,42 @@ struct AioContext {
     /* GPollFDs for aio_poll() */
     GArray *pollfds;
 
+    /* epoll(7) set of the handlers, used instead of pollfds once there are
+     * many of them.  glib then only polls epoll_pfd.
+     */
+    int epollfd;
+    bool epoll_available;
+    bool epoll_enabled;
+    GPollFD epoll_pfd;
+
     /* Thread pool for performing work and receiving completion callbacks */
     struct ThreadPool *thread_pool;
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
+
+    /* Adaptive polling.  poll_ns is the current busy-wait window; it grows
+     * by poll_grow while blocking waits are shorter than poll_max_ns and
+     * shrinks by poll_shrink otherwise.  A poll_max_ns of 0 disables it.
+     */
+    int64_t poll_ns;
+    int64_t poll_max_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
+
+    /* Polling statistics, see aio_context_get_poll_stats() */
+    uint64_t poll_attempts;
+    uint64_t poll_successes;
+    int64_t poll_time_ns;
 };
 
+typedef struct AioPollStats {
+    uint64_t attempts;      /* aio_poll() calls that busy-waited */
+    uint64_t successes;     /* ...and found an event without sleeping */
+    int64_t time_ns;        /* total time spent busy-waiting */
+    int64_t poll_ns;        /* current polling window */
+} AioPollStats;
+
 /**
  * aio_context_new: Allocate a new AioContext.
  *
@@ -88,6 +124,16 @@ struct AioContext {
  */
 AioContext *aio_context_new(void);
 
+/**
+ * aio_context_setup:
+ * aio_context_cleanup:
+ *
+ * Initialize and free the host specific part of an AioContext.  Only for
+ * aio_context_new() and its finalizer.
+ */
+void aio_context_setup(AioContext *ctx);
+void aio_context_cleanup(AioContext *ctx);
+
 /**
  * aio_context_ref:
  * @ctx: The AioContext to operate on.
@@ -104,6 +150,41 @@ void aio_context_ref(AioContext *ctx);
  */
 void aio_context_unref(AioContext *ctx);
 
+/* Take ownership of the AioContext.  If the AioContext will be shared between
+ * threads, a thread must have ownership when calling aio_poll().
+ *
+ * Note that multiple threads calling aio_poll() means timers, BHs, and
+ * callbacks may be invoked from a different thread than they were registered
+ * from.  Therefore, code must use AioContext acquire/release or use
+ * fine-grained synchronization to protect shared state if other threads will
+ * be accessing it simultaneously.
+ */
+void aio_context_acquire(AioContext *ctx);
+
+/* Relinquish ownership of the AioContext. */
+void aio_context_release(AioContext *ctx);
+
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: longest busy-wait window in nanoseconds, 0 disables polling
+ * @grow: factor by which the window grows, 0 selects the default
+ * @shrink: divisor by which the window shrinks, 0 resets it to zero
+ *
+ * Let aio_poll() call the #AioPollFn of registered handlers in a loop for
+ * up to the current window before it sleeps in the kernel.  The window adapts
+ * to how long aio_poll() actually waited for events.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink);
+
+/**
+ * aio_context_get_poll_stats:
+ * @ctx: the aio context
+ * @stats: filled in with the polling counters of @ctx
+ */
+void aio_context_get_poll_stats(AioContext *ctx, AioPollStats *stats);
+
 /**
  * aio_bh_new: Allocate a new bottom half structure.
  *
@@ -225,6 +306,16 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             EventNotifierHandler *io_read);
 
+/* Attach a busy-wait callback to an event notifier registered with
+ * aio_set_event_notifier().  While polling is enabled, aio_poll() calls
+ * @io_poll with the notifier as argument instead of sleeping; it must return
+ * true if it found and processed work.  Pass NULL to detach it.  The callback
+ * is dropped automatically together with the notifier's handler.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
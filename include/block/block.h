@@ -88,6 +88,10 @@ typedef enum {
      * opened with BDRV_O_UNMAP.
      */
     BDRV_REQ_MAY_UNMAP    = 0x4,
+    /* Internal read issued by copy-on-read readahead, which must not
+     * trigger more readahead itself.
+     */
+    BDRV_REQ_READAHEAD    = 0x8,
 } BdrvRequestFlags;
 
 #define BDRV_O_RDWR        0x0002
@@ -163,9 +167,20 @@ void bdrv_stats_print(Monitor *mon, const QObject *data);
 void bdrv_info_stats(Monitor *mon, QObject **ret_data);
 
 /* disk I/O throttling */
-void bdrv_io_limits_enable(BlockDriverState *bs);
+void bdrv_io_limits_enable(BlockDriverState *bs, const char *group);
 void bdrv_io_limits_disable(BlockDriverState *bs);
 
+/* sequential request merging, max_bytes == 0 disables it */
+void bdrv_set_merge_limits(BlockDriverState *bs, uint64_t max_bytes,
+                           int64_t timeout_ns);
+
+/* backing chain allocation cache, size == 0 disables it */
+void bdrv_set_chain_cache(BlockDriverState *bs, uint64_t size);
+
+/* copy-on-read readahead, window == 0 disables it */
+void bdrv_set_readahead(BlockDriverState *bs, uint64_t window,
+                        uint64_t max_memory);
+
 void bdrv_init(void);
 void bdrv_init_with_whitelist(void);
 BlockDriver *bdrv_find_protocol(const char *filename,
@@ -387,6 +402,9 @@ const char *bdrv_get_device_name(BlockDriverState *bs);
 int bdrv_get_flags(BlockDriverState *bs);
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors);
+int coroutine_fn bdrv_co_write_compressed(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors,
+                                          QEMUIOVector *qiov);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
 ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs);
 void bdrv_round_to_clusters(BlockDriverState *bs,
@@ -422,16 +440,35 @@ void bdrv_set_buffer_alignment(BlockDriverState *bs, int align);
 void *qemu_blockalign(BlockDriverState *bs, size_t size);
 bool bdrv_qiov_is_aligned(BlockDriverState *bs, QEMUIOVector *qiov);
 
+struct HBitmap;
 struct HBitmapIter;
 typedef struct BdrvDirtyBitmap BdrvDirtyBitmap;
-BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs, int granularity);
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs, int granularity,
+                                          const char *name, Error **errp);
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs,
+                                        const char *name);
 void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap);
+int bdrv_dirty_bitmap_load(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                           const char *filename, Error **errp);
 BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs);
+int bdrv_dirty_bitmap_granularity(BlockDriverState *bs,
+                                  BdrvDirtyBitmap *bitmap);
 int bdrv_get_dirty(BlockDriverState *bs, BdrvDirtyBitmap *bitmap, int64_t sector);
 void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector, int nr_sectors);
-void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector, int nr_sectors);
+void bdrv_set_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                           int64_t cur_sector, int nr_sectors);
+void bdrv_reset_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                             int64_t cur_sector, int nr_sectors);
+void bdrv_clear_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap);
+struct HBitmap *bdrv_dirty_bitmap_take(BlockDriverState *bs,
+                                       BdrvDirtyBitmap *bitmap);
+void bdrv_dirty_bitmap_put(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                           struct HBitmap *hb, bool merge);
+bool bdrv_dirty_bitmap_busy(BlockDriverState *bs, BdrvDirtyBitmap *bitmap);
 void bdrv_dirty_iter_init(BlockDriverState *bs,
                           BdrvDirtyBitmap *bitmap, struct HBitmapIter *hbi);
+int64_t bdrv_get_next_dirty(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                            int64_t sector);
 int64_t bdrv_get_dirty_count(BlockDriverState *bs, BdrvDirtyBitmap *bitmap);
 
 void bdrv_enable_copy_on_read(BlockDriverState *bs);
@@ -467,6 +504,21 @@ typedef struct BlockAcctCookie {
 void bdrv_acct_start(BlockDriverState *bs, BlockAcctCookie *cookie,
         int64_t bytes, enum BlockAcctType type);
 void bdrv_acct_done(BlockDriverState *bs, BlockAcctCookie *cookie);
+int bdrv_set_latency_histogram(BlockDriverState *bs, enum BlockAcctType type,
+                               const uint64_t *boundaries, int nboundaries);
+
+/* Stages of a read or write request in the block layer */
+enum BlockRequestStage {
+    BDRV_STAGE_QUEUE,       /* throttling and waits for overlapping requests */
+    BDRV_STAGE_DRIVER,      /* inside the format and protocol drivers */
+    BDRV_STAGE_COMPLETION,  /* AIO completion bottom half */
+    BDRV_MAX_STAGE,
+};
+
+int bdrv_set_stage_histogram(BlockDriverState *bs,
+                             enum BlockRequestStage stage,
+                             const uint64_t *boundaries, int nboundaries);
+void bdrv_add_timed_stats(BlockDriverState *bs, unsigned interval_length);
 
 typedef enum {
     BLKDBG_L1_UPDATE,
@@ -518,6 +570,76 @@ typedef enum {
     BLKDBG_EVENT_MAX,
 } BlkDebugEvent;
 
+/**
+ * bdrv_get_aio_context:
+ *
+ * Returns: the currently bound #AioContext
+ */
+AioContext *bdrv_get_aio_context(BlockDriverState *bs);
+
+/**
+ * bdrv_set_aio_context:
+ *
+ * Changes the #AioContext used for fd handlers, timers, and BHs by this
+ * BlockDriverState and all its children.
+ *
+ * This function must be called from the old #AioContext or with a lock held so
+ * the old #AioContext is not executing.
+ */
+void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context);
+
+/**
+ * bdrv_can_set_aio_context:
+ *
+ * Returns: true if all drivers of this BlockDriverState and its children can
+ * be moved to another #AioContext with bdrv_set_aio_context()
+ */
+bool bdrv_can_set_aio_context(BlockDriverState *bs);
+
+/**
+ * bdrv_add_aio_context_notifier:
+ *
+ * If a long-running job intends to be always run in the same AioContext as a
+ * certain BDS, it may use this function to be notified of changes regarding
+ * the association of the BDS to an AioContext.
+ *
+ * attached_aio_context() is called after the target BDS has been attached to a
+ * new AioContext; detach_aio_context() is called before the target BDS is being
+ * detached from its old AioContext.
+ */
+void bdrv_add_aio_context_notifier(BlockDriverState *bs,
+        void (*attached_aio_context)(AioContext *new_context, void *opaque),
+        void (*detach_aio_context)(void *opaque), void *opaque);
+
+/**
+ * bdrv_remove_aio_context_notifier:
+ *
+ * Unsubscribe of change notifications regarding the BDS's AioContext. The
+ * parameters given here have to be the same as those given to
+ * bdrv_add_aio_context_notifier().
+ */
+void bdrv_remove_aio_context_notifier(BlockDriverState *bs,
+                                      void (*aio_context_attached)(AioContext *,
+                                                                   void *),
+                                      void (*aio_context_detached)(void *),
+                                      void *opaque);
+
+/**
+ * bdrv_io_plug:
+ *
+ * Hold back requests submitted to @bs until the matching bdrv_io_unplug(),
+ * so that drivers can hand them to the kernel as one batch.  Calls nest.
+ */
+void bdrv_io_plug(BlockDriverState *bs);
+void bdrv_io_unplug(BlockDriverState *bs);
+
+/**
+ * bdrv_flush_io_queue:
+ *
+ * Submit requests held back by bdrv_io_plug() without unplugging.
+ */
+void bdrv_flush_io_queue(BlockDriverState *bs);
+
 #define BLKDBG_EVENT(bs, evt) bdrv_debug_event(bs, evt)
 void bdrv_debug_event(BlockDriverState *bs, BlkDebugEvent event);
 
@@ -52,6 +52,7 @@
 #define BLOCK_OPT_SUBFMT            "subformat"
 #define BLOCK_OPT_COMPAT_LEVEL      "compat"
 #define BLOCK_OPT_LAZY_REFCOUNTS    "lazy_refcounts"
+#define BLOCK_OPT_JOURNAL_SIZE      "journal_size"
 #define BLOCK_OPT_ADAPTER_TYPE      "adapter_type"
 #define BLOCK_OPT_REDUNDANCY        "redundancy"
 
@@ -60,6 +61,8 @@ typedef struct BdrvTrackedRequest {
     int64_t sector_num;
     int nb_sectors;
     bool is_write;
+    uint64_t id;        /* unique, used to correlate trace events */
+    int64_t start_ns;   /* 0 unless stage histograms are enabled */
     QLIST_ENTRY(BdrvTrackedRequest) list;
     Coroutine *co; /* owner, used for deadlock detection */
     CoQueue wait_queue; /* coroutines blocked on this request */
@@ -164,6 +167,13 @@ struct BlockDriver {
 
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    /*
+     * Compressed writes are laid out in the image in the order they are
+     * submitted.  The order is fixed before the first yield, so callers
+     * can keep several in flight.
+     */
+    int coroutine_fn (*bdrv_co_write_compressed)(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -181,6 +191,11 @@ struct BlockDriver {
                                   Error **errp);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
+    BlockMetadataCacheStats *(*bdrv_get_cache_stats)(
+        const BlockDriverState *bs);
+    BlockDataCacheStats *(*bdrv_get_data_cache_stats)(
+        const BlockDriverState *bs);
+    BlockObjectStats *(*bdrv_get_object_stats)(const BlockDriverState *bs);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, QEMUIOVector *qiov,
                              int64_t pos);
@@ -232,9 +247,67 @@ struct BlockDriver {
      */
     int (*bdrv_has_zero_init)(BlockDriverState *bs);
 
+    /* Remove fd handlers, timers, and other event loop callbacks so the event
+     * loop is no longer in use.  Called with no in-flight requests and in
+     * depth-first traversal order with parents before child nodes.
+     */
+    void (*bdrv_detach_aio_context)(BlockDriverState *bs);
+
+    /* Add fd handlers, timers, and other event loop callbacks so I/O requests
+     * can be processed again.  Called with no in-flight requests and in
+     * depth-first traversal order with child nodes before parent nodes.
+     */
+    void (*bdrv_attach_aio_context)(BlockDriverState *bs,
+                                    AioContext *new_context);
+
+    /* io queue for linux-aio */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+    void (*bdrv_flush_io_queue)(BlockDriverState *bs);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
+/* Latency histogram of one request type.  Bin i counts the requests
+ * whose latency was in [boundaries[i - 1], boundaries[i]), the first
+ * and last bins are open-ended.
+ */
+typedef struct BlockLatencyHistogram {
+    int nbins;              /* 0 if disabled */
+    uint64_t *boundaries;   /* nbins - 1 entries, in nanoseconds */
+    uint64_t *bins;
+} BlockLatencyHistogram;
+
+/* Accounting over one interval of a BlockAcctTimedStats */
+typedef struct BlockAcctWindow {
+    uint64_t nr_ops[BDRV_MAX_IOTYPE];
+    uint64_t total_time_ns[BDRV_MAX_IOTYPE];
+    uint64_t min_time_ns[BDRV_MAX_IOTYPE];
+    uint64_t max_time_ns[BDRV_MAX_IOTYPE];
+    /* time integral of the number of requests in flight */
+    double queue_depth_ns[BDRV_MAX_IOTYPE];
+} BlockAcctWindow;
+
+/* Statistics over fixed-length intervals; @last holds the most recent
+ * complete interval and @cur the one being accumulated.
+ */
+typedef struct BlockAcctTimedStats {
+    unsigned interval_length;   /* in seconds */
+    int64_t window_start_ns;
+    BlockAcctWindow cur;
+    BlockAcctWindow last;
+    QSLIST_ENTRY(BlockAcctTimedStats) entries;
+} BlockAcctTimedStats;
+
+typedef struct BdrvAioNotifier {
+    void (*attached_aio_context)(AioContext *new_context, void *opaque);
+    void (*detach_aio_context)(void *opaque);
+
+    void *opaque;
+
+    QLIST_ENTRY(BdrvAioNotifier) list;
+} BdrvAioNotifier;
+
 typedef struct BlockLimits {
     /* maximum number of sectors that can be discarded at once */
     int max_discard;
@@ -294,16 +367,69 @@ struct BlockDriverState {
     /* number of in-flight copy-on-read requests */
     unsigned int copy_on_read_in_flight;
 
+    /* Flush coalescing.  write_gen counts completed writes, flushed_gen
+     * is the value of write_gen when the last successful flush started.
+     * Only one flush is sent down at a time; the others wait in
+     * flush_queue and are dropped if that flush covered their writes.
+     */
+    uint64_t write_gen;
+    uint64_t flushed_gen;
+    bool active_flush_req;
+    CoQueue flush_queue;
+
     /* I/O throttling */
     ThrottleState throttle_state;
     CoQueue      throttled_reqs[2];
     bool         io_limits_enabled;
 
+    /* throttle group membership, see block/throttle-groups.c.  When
+     * throttle_group is set the limits live in the group and
+     * throttle_state is unused.
+     */
+    struct ThrottleGroup *throttle_group;
+    QLIST_ENTRY(BlockDriverState) round_robin;
+    unsigned int pending_reqs[2];
+
+    /* request merging, see bdrv_set_merge_limits() */
+    uint64_t merge_max_bytes;
+    int64_t merge_timeout_ns;
+    struct BdrvMergeReq *merge_req;
+    QEMUTimer *merge_timer;
+
+    /* bumped whenever the allocation status of the image may change */
+    uint64_t write_gen;
+
+    /* allocation status of the backing chain, see bdrv_set_chain_cache() */
+    struct BdrvChainCache *chain_cache;
+
+    /* copy-on-read readahead, see bdrv_set_readahead() */
+    int64_t readahead_window;       /* in sectors, 0 if disabled */
+    int64_t readahead_max_inflight; /* in sectors */
+    int64_t readahead_inflight;
+    int64_t readahead_next;         /* sector after the last guest read */
+    int64_t readahead_end;          /* sector after the last prefetch */
+    unsigned int readahead_seq;     /* consecutive sequential reads */
+
+    /* nesting depth of bdrv_io_plug() */
+    unsigned int io_plugged;
+
     /* I/O stats (display with "info blockstats"). */
     uint64_t nr_bytes[BDRV_MAX_IOTYPE];
     uint64_t nr_ops[BDRV_MAX_IOTYPE];
     uint64_t total_time_ns[BDRV_MAX_IOTYPE];
     uint64_t wr_highest_sector;
+    uint64_t flush_merged;
+
+    /* Latency histograms and interval statistics, see
+     * bdrv_set_latency_histogram(), bdrv_set_stage_histogram() and
+     * bdrv_add_timed_stats().
+     */
+    BlockLatencyHistogram latency_histogram[BDRV_MAX_IOTYPE];
+    BlockLatencyHistogram stage_histogram[BDRV_MAX_STAGE];
+    QSLIST_HEAD(, BlockAcctTimedStats) timed_stats;
+    unsigned int in_flight[BDRV_MAX_IOTYPE];
+    int64_t acct_last_ns;       /* last change of in_flight */
+    int64_t acct_idle_start_ns; /* last time in_flight dropped to zero */
 
     /* I/O Limits */
     BlockLimits bl;
@@ -337,12 +463,18 @@ struct BlockDriverState {
     BlockJob *job;
 
     QDict *options;
+
+    AioContext *aio_context; /* event loop used for fd handlers, timers, etc */
+    QLIST_HEAD(, BdrvAioNotifier) aio_notifiers;
 };
 
 int get_tmp_filename(char *filename, int size);
 
 void bdrv_set_io_limits(BlockDriverState *bs,
                         ThrottleConfig *cfg);
+void bdrv_get_io_limits(BlockDriverState *bs, ThrottleConfig *cfg);
+
+void bdrv_acct_update_timed_stats(BlockDriverState *bs);
 
 
 /**
@@ -354,13 +486,6 @@ void bdrv_set_io_limits(BlockDriverState *bs,
 void bdrv_add_before_write_notifier(BlockDriverState *bs,
                                     NotifierWithReturn *notifier);
 
-/**
- * bdrv_get_aio_context:
- *
- * Returns: the currently bound #AioContext
- */
-AioContext *bdrv_get_aio_context(BlockDriverState *bs);
-
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
 #endif
@@ -440,6 +565,8 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
  * @target: Block device to write to.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @sync_mode: What parts of the disk image should be copied to the destination.
+ * @sync_bitmap: The dirty bitmap to use if @sync_mode is
+ * MIRROR_SYNC_MODE_INCREMENTAL, NULL otherwise.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @cb: Completion function for the job.
@@ -450,6 +577,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
  */
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, MirrorSyncMode sync_mode,
+                  BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb, void *opaque,
@@ -0,0 +1,58 @@
+/*
+ * Completion queue for block drivers backed by a threaded library
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_COMPLETION_QUEUE_H
+#define BLOCK_COMPLETION_QUEUE_H
+
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/event_notifier.h"
+
+/*
+ * Libraries such as librbd and libgfapi invoke their completion callbacks
+ * from threads of their own.  Instead of writing one pointer per request
+ * into a pipe, the callback links a BlockCompletion (embedded in the
+ * driver's request structure) into the queue.  Only the first completion
+ * after a drain kicks the event notifier; the handler then runs in the
+ * AioContext of the BlockDriverState and completes everything that has
+ * piled up in the meantime.
+ */
+typedef struct BlockCompletion BlockCompletion;
+typedef void BlockCompletionFunc(BlockCompletion *comp);
+
+struct BlockCompletion {
+    BlockCompletionFunc *cb;
+    QSIMPLEQ_ENTRY(BlockCompletion) next;
+};
+
+typedef struct BlockCompletionQueue {
+    EventNotifier e;
+    QemuMutex lock;
+    QSIMPLEQ_HEAD(, BlockCompletion) list;
+    bool kicked;
+    AioContext *ctx;
+} BlockCompletionQueue;
+
+int block_completion_queue_init(BlockCompletionQueue *q, AioContext *ctx);
+void block_completion_queue_cleanup(BlockCompletionQueue *q);
+
+void block_completion_queue_detach_aio_context(BlockCompletionQueue *q);
+void block_completion_queue_attach_aio_context(BlockCompletionQueue *q,
+                                               AioContext *new_context);
+
+/* Thread-safe; may be called from any thread */
+void block_completion_queue_push(BlockCompletionQueue *q,
+                                 BlockCompletion *comp,
+                                 BlockCompletionFunc *cb);
+
+/* Run the callbacks of all queued completions; returns how many ran */
+int block_completion_queue_drain(BlockCompletionQueue *q);
+
+#endif
@@ -36,8 +36,21 @@ struct nbd_reply {
     uint32_t magic;
     uint32_t error;
     uint64_t handle;
+    /* The following are only valid for structured reply chunks, i.e.
+     * when magic is NBD_STRUCTURED_REPLY_MAGIC.
+     */
+    uint16_t flags;
+    uint16_t type;
+    uint32_t length;
 } QEMU_PACKED;
 
+/* Extensions negotiated by the client during the handshake */
+typedef struct NBDExtensions {
+    bool structured_reply;
+    bool base_allocation;
+    uint32_t context_id;
+} NBDExtensions;
+
 #define NBD_FLAG_HAS_FLAGS      (1 << 0)        /* Flags are there */
 #define NBD_FLAG_READ_ONLY      (1 << 1)        /* Device is read-only */
 #define NBD_FLAG_SEND_FLUSH     (1 << 2)        /* Send FLUSH */
@@ -45,15 +58,49 @@ struct nbd_reply {
 #define NBD_FLAG_ROTATIONAL     (1 << 4)        /* Use elevator algorithm - rotational media */
 #define NBD_FLAG_SEND_TRIM      (1 << 5)        /* Send TRIM (discard) */
 
+/* Handshake flags, sent by the server (16 bits) and the client (32 bits) */
+#define NBD_FLAG_FIXED_NEWSTYLE   (1 << 0)
+#define NBD_FLAG_C_FIXED_NEWSTYLE (1 << 0)
+
+/* Options */
+#define NBD_OPT_EXPORT_NAME       1
+#define NBD_OPT_STRUCTURED_REPLY  8
+#define NBD_OPT_SET_META_CONTEXT  10
+
+/* Option replies */
+#define NBD_REP_ACK               1
+#define NBD_REP_META_CONTEXT      4
+#define NBD_REP_FLAG_ERROR        (1U << 31)
+#define NBD_REP_ERR_UNSUP         (NBD_REP_FLAG_ERROR | 1)
+#define NBD_REP_ERR_INVALID       (NBD_REP_FLAG_ERROR | 3)
+#define NBD_REP_ERR_UNKNOWN       (NBD_REP_FLAG_ERROR | 6)
+
+/* The only metadata context we know about */
+#define NBD_META_BASE_ALLOCATION  "base:allocation"
+#define NBD_STATE_HOLE            (1 << 0)
+#define NBD_STATE_ZERO            (1 << 1)
+
+/* Structured reply chunks */
+#define NBD_STRUCTURED_REPLY_MAGIC  0x668e33ef
+#define NBD_REPLY_FLAG_DONE         (1 << 0)
+#define NBD_REPLY_TYPE_NONE         0
+#define NBD_REPLY_TYPE_OFFSET_DATA  1
+#define NBD_REPLY_TYPE_OFFSET_HOLE  2
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_ERROR        ((1 << 15) + 1)
+#define NBD_REPLY_TYPE_IS_ERR(type) ((type) & (1 << 15))
+
 #define NBD_CMD_MASK_COMMAND	0x0000ffff
 #define NBD_CMD_FLAG_FUA	(1 << 16)
+#define NBD_CMD_FLAG_REQ_ONE	(1 << 19)
 
 enum {
     NBD_CMD_READ = 0,
     NBD_CMD_WRITE = 1,
     NBD_CMD_DISC = 2,
     NBD_CMD_FLUSH = 3,
-    NBD_CMD_TRIM = 4
+    NBD_CMD_TRIM = 4,
+    NBD_CMD_BLOCK_STATUS = 7
 };
 
 #define NBD_DEFAULT_PORT	10809
@@ -69,7 +116,7 @@ int unix_socket_outgoing(const char *path);
 int unix_socket_incoming(const char *path);
 
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, size_t *blocksize);
+                          off_t *size, size_t *blocksize, NBDExtensions *ext);
 int nbd_init(int fd, int csock, uint32_t flags, off_t size, size_t blocksize);
 ssize_t nbd_send_request(int csock, struct nbd_request *request);
 ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply);
@@ -82,6 +129,7 @@ typedef struct NBDClient NBDClient;
 NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
                           off_t size, uint32_t nbdflags,
                           void (*close)(NBDExport *));
+void nbd_export_set_max_requests(NBDExport *exp, int max_requests);
 void nbd_export_close(NBDExport *exp);
 void nbd_export_get(NBDExport *exp);
 void nbd_export_put(NBDExport *exp);
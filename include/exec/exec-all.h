@@ -114,8 +114,8 @@ static inline void tlb_flush(CPUArchState *env, int flush_global)
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
+/* initial size of tb_phys_hash, it grows with the number of TBs */
 #define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
 
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
@@ -142,6 +142,7 @@ struct TranslationBlock {
     uint16_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+    bool invalid;       /* set by tb_phys_invalidate() */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
     /* next matching tb for physical address. */
@@ -166,16 +167,36 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    uint64_t exec_count; /* executions, if translated with tb_profile_enabled */
 };
 
 #include "exec/spinlock.h"
 
 typedef struct TBContext TBContext;
 
+/* The code buffer and the TB array are split into regions that are filled
+   in turn.  When the last one is full, the oldest region is invalidated and
+   reused, so that only the TBs in it have to be translated again.  */
+#define TB_MAX_REGIONS 8
+
+typedef struct TBRegion {
+    uint8_t *start;     /* generated code of the region */
+    uint8_t *end;
+    uint8_t *code_end;  /* end of the code, when it is not the current one */
+    int first_tb;       /* index in tbs[] of the first TB of the region */
+    int nb_tbs;
+} TBRegion;
+
 struct TBContext {
 
     TranslationBlock *tbs;
-    TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+    TBRegion regions[TB_MAX_REGIONS];
+    int nb_regions;
+    int cur_region;
+    int tbs_per_region;
+    TranslationBlock **tb_phys_hash;
+    unsigned int tb_phys_hash_bits;
+    int nb_hashed_tbs;  /* number of TBs in tb_phys_hash */
     int nb_tbs;
     /* any access to the tbs or the page table must use this lock */
     spinlock_t tb_lock;
@@ -183,6 +204,8 @@ struct TBContext {
     /* statistics */
     int tb_flush_count;
     int tb_phys_invalidate_count;
+    int tb_phys_hash_resize_count;
+    int tb_region_evict_count;
 
     int tb_invalidated_flag;
 };
@@ -202,9 +225,26 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+/* Hash of a TB's physical PC, CS base and flags into a table of 1 << bits
+ * buckets.  The key is mixed with the 64-bit finalizer of MurmurHash3 and
+ * the top bits are used, so that PCs with the same alignment and TBs that
+ * differ only in their flags do not cluster.
+ */
+static inline unsigned int tb_phys_hash_func(tb_page_addr_t phys_pc,
+                                             target_ulong cs_base,
+                                             uint64_t flags,
+                                             unsigned int bits)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    uint64_t h = phys_pc;
+
+    h ^= (uint64_t)cs_base * 0x9e3779b97f4a7c15ULL;
+    h ^= flags * 0xc2b2ae3d27d4eb4fULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h >> (64 - bits);
 }
 
 void tb_free(TranslationBlock *tb);
@@ -333,6 +373,12 @@ bool io_mem_write(struct MemoryRegion *mr, hwaddr addr,
 void tlb_fill(CPUArchState *env1, target_ulong addr, int is_write, int mmu_idx,
               uintptr_t retaddr);
 
+/* TLB statistics for "info jit": lookups that missed tlb_table, and those
+ * of them that were found in the victim TLB instead of calling tlb_fill.
+ */
+extern uint64_t tlb_miss_count;
+extern uint64_t tlb_victim_hit_count;
+
 uint8_t helper_ldb_cmmu(CPUArchState *env, target_ulong addr, int mmu_idx);
 uint16_t helper_ldw_cmmu(CPUArchState *env, target_ulong addr, int mmu_idx);
 uint32_t helper_ldl_cmmu(CPUArchState *env, target_ulong addr, int mmu_idx);
@@ -375,6 +421,9 @@ void cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler);
 /* vl.c */
 extern int singlestep;
 
+/* translate-all.c */
+extern int tb_profile_enabled;
+
 /* cpu-exec.c */
 extern volatile sig_atomic_t exit_request;
 
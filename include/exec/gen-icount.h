@@ -9,7 +9,7 @@ static TCGArg *icount_arg;
 static int icount_label;
 static int exitreq_label;
 
-static inline void gen_tb_start(void)
+static inline void gen_tb_start(TranslationBlock *tb)
 {
     TCGv_i32 count;
     TCGv_i32 flag;
@@ -21,6 +21,18 @@ static inline void gen_tb_start(void)
     tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
     tcg_temp_free_i32(flag);
 
+    if (tb_profile_enabled) {
+        /* count the executions of the TB for "info tb-hot" */
+        TCGv_ptr ptr = tcg_const_ptr(&tb->exec_count);
+        TCGv_i64 execs = tcg_temp_new_i64();
+
+        tcg_gen_ld_i64(execs, ptr, 0);
+        tcg_gen_addi_i64(execs, execs, 1);
+        tcg_gen_st_i64(execs, ptr, 0);
+        tcg_temp_free_i64(execs);
+        tcg_temp_free_ptr(ptr);
+    }
+
     if (!use_icount)
         return;
 
@@ -26,6 +26,7 @@
 #include "qemu/queue.h"
 #include "qemu/int128.h"
 #include "qemu/notify.h"
+#include "qemu/bitmap.h"
 
 #define MAX_PHYS_ADDR_SPACE_BITS 62
 #define MAX_PHYS_ADDR            (((hwaddr)1 << MAX_PHYS_ADDR_SPACE_BITS) - 1)
@@ -33,12 +34,31 @@
 typedef struct MemoryRegionOps MemoryRegionOps;
 typedef struct MemoryRegionMmio MemoryRegionMmio;
 
-/* Must match *_DIRTY_FLAGS in cpu-all.h.  To be replaced with dynamic
- * registration.
+/* Placement of guest RAM on the host NUMA nodes, applied with mbind(2) */
+typedef enum {
+    HOST_MEM_POLICY_DEFAULT,
+    HOST_MEM_POLICY_PREFERRED,
+    HOST_MEM_POLICY_BIND,
+    HOST_MEM_POLICY_INTERLEAVE,
+} HostMemPolicyMode;
+
+#define MAX_HOST_NODES 128
+
+typedef struct HostMemPolicy {
+    HostMemPolicyMode mode;
+    DECLARE_BITMAP(nodes, MAX_HOST_NODES);
+    /* hugetlbfs mount for this memory, or NULL to use -mem-path */
+    const char *mem_path;
+} HostMemPolicy;
+
+/* Dirty memory clients, each has a bitmap in ram_list.dirty_memory.  To be
+ * replaced with dynamic registration.
  */
 #define DIRTY_MEMORY_VGA       0
 #define DIRTY_MEMORY_CODE      1
+#define DIRTY_MEMORY_DIRTY_RATE 2
 #define DIRTY_MEMORY_MIGRATION 3
+#define DIRTY_MEMORY_NUM       4        /* num of dirty bits */
 
 struct MemoryRegionMmio {
     CPUReadMemoryFunc *read[3];
@@ -151,6 +171,8 @@ struct MemoryRegion {
     bool rom_device;
     bool warning_printed; /* For reservations */
     bool flush_coalesced_mmio;
+    bool global_locking;
+    uint8_t direct_sizes; /* access sizes that can call ops directly */
     MemoryRegion *alias;
     hwaddr alias_offset;
     int priority;
@@ -172,6 +194,13 @@ typedef struct MemoryListener MemoryListener;
  *
  * Allows a component to adjust to changes in the guest-visible memory map.
  * Use with memory_listener_register() and memory_listener_unregister().
+ *
+ * A topology update calls @begin, then the region callbacks for every
+ * address space whose memory map changed, then @commit.  Address spaces
+ * whose map did not change are not replayed at all.  A listener with an
+ * @address_space_filter only gets @begin and @commit when that address
+ * space changed, so it can rebuild its state in @begin from the
+ * @region_add and @region_nop calls that follow.
  */
 struct MemoryListener {
     void (*begin)(MemoryListener *listener);
@@ -206,6 +235,7 @@ struct AddressSpace {
     char *name;
     MemoryRegion *root;
     struct FlatView *current_map;
+    struct FlatView *next_map;
     int ioeventfd_nb;
     struct MemoryRegionIoeventfd *ioeventfds;
     struct AddressSpaceDispatch *dispatch;
@@ -315,6 +345,26 @@ void memory_region_init_ram(MemoryRegion *mr,
                             const char *name,
                             uint64_t size);
 
+/**
+ * memory_region_init_ram_policy:  Initialize RAM memory region with a host
+ *                                 memory placement policy.
+ *
+ * Like memory_region_init_ram(), but the RAM is bound to the host NUMA
+ * nodes of @policy, and is allocated on the hugetlbfs mount at
+ * @policy->mem_path if set.
+ *
+ * @mr: the #MemoryRegion to be initialized.
+ * @owner: the object that tracks the region's reference count
+ * @name: the name of the region.
+ * @size: size of the region.
+ * @policy: where to place the memory on the host.
+ */
+void memory_region_init_ram_policy(MemoryRegion *mr,
+                                   struct Object *owner,
+                                   const char *name,
+                                   uint64_t size,
+                                   const HostMemPolicy *policy);
+
 /**
  * memory_region_init_ram_ptr:  Initialize RAM memory region from a
  *                              user-provided pointer.  Accesses into the
@@ -643,6 +693,13 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode);
  * Enabled writes to a region to be queued for later processing. MMIO ->write
  * callbacks may be delayed until a non-coalesced MMIO is issued.
  * Only useful for IO regions.  Roughly similar to write-combining hardware.
+ * Regions mapped in the I/O port address space are coalesced as well when
+ * KVM supports it (KVM_CAP_COALESCED_PIO), which suits write-only registers
+ * such as index ports: the region is flushed before any access to it, so a
+ * read of the data register still sees the queued index write.
+ *
+ * Coalescing is registered for the places where the region is mapped when
+ * this is called, so map the region first.
  *
  * @mr: the memory region to be write coalesced
  */
@@ -699,6 +756,24 @@ void memory_region_set_flush_coalesced(MemoryRegion *mr);
  */
 void memory_region_clear_flush_coalesced(MemoryRegion *mr);
 
+/**
+ * memory_region_clear_global_locking: Declares that access processing does
+ *                                     not depend on the QEMU global lock.
+ *
+ * By default, accesses to a region are done with the global lock held.  A
+ * region whose callbacks do their own locking, or need none, can clear that
+ * requirement: KVM then handles accesses to it from the vCPU thread without
+ * taking the global lock, so several vCPUs can access it at the same time.
+ *
+ * The callbacks must not call anything that needs the global lock, such as
+ * qemu_set_irq() or timer_mod().  Only single accesses that the region
+ * supports natively are done without the lock; other accesses, and regions
+ * with coalescing, still take it.
+ *
+ * @mr: the memory region to be updated.
+ */
+void memory_region_clear_global_locking(MemoryRegion *mr);
+
 /**
  * memory_region_add_eventfd: Request an eventfd to be triggered when a word
  *                            is written to a location.
@@ -969,6 +1044,26 @@ void address_space_destroy(AddressSpace *as);
 bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
                       int len, bool is_write);
 
+/**
+ * address_space_rw_unlocked: access a region that does not need the global
+ *                            lock.
+ *
+ * Can be called without the QEMU global lock.  If @addr..@addr+@len-1 is
+ * covered by a single I/O region that cleared global locking with
+ * memory_region_clear_global_locking(), and @len is an access size it
+ * supports at @addr, do the access and return true.  Otherwise return false
+ * without accessing anything; the caller must then take the global lock and
+ * use address_space_rw().
+ *
+ * @as: #AddressSpace to be accessed
+ * @addr: address within that address space
+ * @buf: buffer with the data transferred
+ * @len: access size in bytes
+ * @is_write: indicates the transfer direction
+ */
+bool address_space_rw_unlocked(AddressSpace *as, hwaddr addr, uint8_t *buf,
+                               int len, bool is_write);
+
 /**
  * address_space_write: write to address space.
  *
@@ -997,6 +1092,9 @@ bool address_space_read(AddressSpace *as, hwaddr addr, uint8_t *buf, int len);
 /* address_space_translate: translate an address range into an address space
  * into a MemoryRegion and an address range into that section
  *
+ * Must be called with the global lock or within rcu_read_lock(); the
+ * returned MemoryRegion can only be used until either is released.
+ *
  * @as: #AddressSpace to be accessed
  * @addr: address within that address space
  * @xlat: pointer to address within the returned memory region section's
@@ -1028,6 +1126,8 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
 /* address_space_map: map a physical memory region into a host virtual address
  *
  * May map a subset of the requested range, given by and returned in @plen.
+ * Memory that is not RAM is mapped through a pool of bounce buffers, see
+ * the bounce-buffers and bounce-buffer-size machine options.
  * May return %NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
  * Use cpu_register_map_client() to know when retrying the map operation is
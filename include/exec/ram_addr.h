@@ -0,0 +1,213 @@
+/*
+ * Dirty memory tracking for guest RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * Each dirty memory client (DIRTY_MEMORY_*) has a bitmap with one bit per
+ * target page of ram_addr_t space, in ram_list.dirty_memory.  The
+ * *_DIRTY_FLAG masks below select a set of clients.
+ *
+ * This header is for use by code that tracks or consumes dirty memory
+ * directly: exec.c, memory.c, cputlb.c, the KVM dirty log and RAM
+ * migration.  Everybody else goes through the memory_region_*_dirty API.
+ */
+
+#ifndef RAM_ADDR_H
+#define RAM_ADDR_H
+
+#ifndef CONFIG_USER_ONLY
+#include "hw/xen/xen.h"
+#include "qemu/bitmap.h"
+#include "exec/memory.h"
+
+#define VGA_DIRTY_FLAG        (1 << DIRTY_MEMORY_VGA)
+#define CODE_DIRTY_FLAG       (1 << DIRTY_MEMORY_CODE)
+#define DIRTY_RATE_DIRTY_FLAG (1 << DIRTY_MEMORY_DIRTY_RATE)
+#define MIGRATION_DIRTY_FLAG  (1 << DIRTY_MEMORY_MIGRATION)
+#define ALL_DIRTY_FLAGS       ((1 << DIRTY_MEMORY_NUM) - 1)
+
+static inline bool cpu_physical_memory_get_dirty_flag(ram_addr_t addr,
+                                                      unsigned client)
+{
+    return test_bit(addr >> TARGET_PAGE_BITS, ram_list.dirty_memory[client]);
+}
+
+static inline int cpu_physical_memory_get_dirty_flags(ram_addr_t addr)
+{
+    unsigned client;
+    int flags = 0;
+
+    for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+        if (cpu_physical_memory_get_dirty_flag(addr, client)) {
+            flags |= 1 << client;
+        }
+    }
+    return flags;
+}
+
+/* read dirty bit (return 0 or 1) */
+static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
+{
+    return cpu_physical_memory_get_dirty_flags(addr) == ALL_DIRTY_FLAGS;
+}
+
+/* Return the clients of @dirty_flags with a dirty page in the range */
+static inline int cpu_physical_memory_get_dirty(ram_addr_t start,
+                                                ram_addr_t length,
+                                                int dirty_flags)
+{
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    unsigned long end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+    unsigned client;
+    int ret = 0;
+
+    for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+        if ((dirty_flags & (1 << client)) &&
+            find_next_bit(ram_list.dirty_memory[client], end, page) < end) {
+            ret |= 1 << client;
+        }
+    }
+    return ret;
+}
+
+static inline void cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
+                                                       int dirty_flags)
+{
+    unsigned client;
+
+    for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+        if (dirty_flags & (1 << client)) {
+            set_bit(addr >> TARGET_PAGE_BITS, ram_list.dirty_memory[client]);
+        }
+    }
+}
+
+static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
+{
+    cpu_physical_memory_set_dirty_flags(addr, ALL_DIRTY_FLAGS);
+}
+
+static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
+                                                       ram_addr_t length,
+                                                       int dirty_flags)
+{
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    unsigned long end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+    unsigned client;
+
+    for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+        if (dirty_flags & (1 << client)) {
+            bitmap_set(ram_list.dirty_memory[client], page, end - page);
+        }
+    }
+    xen_modified_memory(start, length);
+}
+
+static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
+                                                        ram_addr_t length,
+                                                        int dirty_flags)
+{
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    unsigned long end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+    unsigned client;
+
+    for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+        if (dirty_flags & (1 << client)) {
+            bitmap_clear(ram_list.dirty_memory[client], page, end - page);
+        }
+    }
+}
+
+/*
+ * Mark dirty, for every client, the pages set in @bitmap, a little endian
+ * bitmap of @pages host pages starting at @start, as returned by the KVM
+ * dirty log.  When the range starts on a bitmap word and host and target
+ * pages have the same size, whole words are or-ed in.
+ */
+static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
+                                                          ram_addr_t start,
+                                                          ram_addr_t pages)
+{
+    unsigned long len = BITS_TO_LONGS(pages);
+    unsigned long hpratio = getpagesize() / TARGET_PAGE_SIZE;
+    unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
+    unsigned long i, j, c;
+    unsigned client;
+
+    if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start &&
+        hpratio == 1) {
+        for (i = 0; i < len; i++) {
+            if (bitmap[i]) {
+                c = leul_to_cpu(bitmap[i]);
+                for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+                    ram_list.dirty_memory[client][page + i] |= c;
+                }
+            }
+        }
+        xen_modified_memory(start, pages << TARGET_PAGE_BITS);
+        return;
+    }
+
+    for (i = 0; i < len; i++) {
+        if (bitmap[i]) {
+            c = leul_to_cpu(bitmap[i]);
+            do {
+                j = ctzl(c);
+                c &= ~(1ul << j);
+                cpu_physical_memory_set_dirty_range(
+                    start + (i * BITS_PER_LONG + j) * hpratio *
+                    TARGET_PAGE_SIZE,
+                    hpratio * TARGET_PAGE_SIZE, ALL_DIRTY_FLAGS);
+            } while (c);
+        }
+    }
+}
+
+/*
+ * Mark dirty, for every client, the pages set in @bits, a host endian word
+ * covering BITS_PER_LONG pages of @page_size bytes from @start, as kept by
+ * the vhost dirty log.  With target-sized pages the word is or-ed into the
+ * bitmaps, shifted across two words if @start is not aligned to one.
+ */
+static inline void cpu_physical_memory_set_dirty_word(ram_addr_t start,
+                                                      unsigned long bits,
+                                                      ram_addr_t page_size)
+{
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    unsigned long word = BIT_WORD(page);
+    unsigned shift = page % BITS_PER_LONG;
+    unsigned client, j;
+
+    if (!bits) {
+        return;
+    }
+    if (page_size != TARGET_PAGE_SIZE || (start & ~TARGET_PAGE_MASK)) {
+        do {
+            j = ctzl(bits);
+            bits &= ~(1ul << j);
+            cpu_physical_memory_set_dirty_range(start + j * page_size,
+                                                page_size, ALL_DIRTY_FLAGS);
+        } while (bits);
+        return;
+    }
+
+    for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+        ram_list.dirty_memory[client][word] |= bits << shift;
+        if (shift && (bits >> (BITS_PER_LONG - shift))) {
+            ram_list.dirty_memory[client][word + 1] |=
+                bits >> (BITS_PER_LONG - shift);
+        }
+    }
+    xen_modified_memory(start, BITS_PER_LONG * TARGET_PAGE_SIZE);
+}
+
+void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
+                                     int dirty_flags);
+
+#endif
+
+#endif
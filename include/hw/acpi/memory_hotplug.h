@@ -0,0 +1,57 @@
+/*
+ * ACPI memory hotplug registers
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The register block is described in docs/specs/acpi_mem_hotplug.txt; the
+ * AML that drives it is generated in the SSDT.
+ */
+
+#ifndef HW_ACPI_MEMORY_HOTPLUG_H
+#define HW_ACPI_MEMORY_HOTPLUG_H
+
+#include "hw/hw.h"
+#include "hw/mem/dimm.h"
+
+#define ACPI_MEMORY_HOTPLUG_BASE        0x0a00
+#define ACPI_MEMORY_HOTPLUG_IO_LEN      0x24
+
+/* GPE0 status bit for memory hotplug events */
+#define ACPI_MEMORY_HOTPLUG_STATUS      8
+
+typedef struct MemStatus {
+    bool is_enabled;
+    bool is_inserting;
+    bool is_removing;
+} MemStatus;
+
+typedef struct MemHotplugState {
+    DimmBus *bus;
+    uint32_t selector;
+    uint32_t dev_count;
+    MemStatus *devs;
+    MemoryRegion io;
+} MemHotplugState;
+
+void acpi_memory_hotplug_init(MemoryRegion *as, Object *owner,
+                              MemHotplugState *state, DimmBus *bus);
+
+/* Record that @dimm was plugged, or that its removal was requested.
+ * Returns true if the guest must be sent a GPE.
+ */
+bool acpi_memory_plug(MemHotplugState *state, DimmDevice *dimm, bool add);
+
+/* Drop the pending events, and remove the DIMMs the guest was asked to
+ * release: the guest will not see them when it boots again.
+ */
+void acpi_memory_hotplug_reset(MemHotplugState *state);
+
+extern const VMStateDescription vmstate_memory_hotplug;
+
+#define VMSTATE_MEMORY_HOTPLUG(memhp, state) \
+    VMSTATE_STRUCT(memhp, state, 1, vmstate_memory_hotplug, MemHotplugState)
+
+#endif
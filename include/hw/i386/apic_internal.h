@@ -50,6 +50,8 @@
 #define APIC_TRIGGER_LEVEL              1
 
 #define APIC_LVT_TIMER_PERIODIC         (1<<17)
+#define APIC_LVT_TIMER_TSCDEADLINE      (2<<17)
+#define APIC_LVT_TIMER_MODE             (3<<17)
 #define APIC_LVT_MASKED                 (1<<16)
 #define APIC_LVT_LEVEL_TRIGGER          (1<<15)
 #define APIC_LVT_REMOTE_IRR             (1<<14)
@@ -89,6 +91,8 @@ typedef struct APICCommonClass
     void (*external_nmi)(APICCommonState *s);
     void (*pre_save)(APICCommonState *s);
     void (*post_load)(APICCommonState *s);
+    void (*reset)(APICCommonState *s);
+    void (*set_tsc_deadline)(APICCommonState *s, uint64_t val);
 } APICCommonClass;
 
 struct APICCommonState {
@@ -106,6 +110,8 @@ struct APICCommonState {
     uint32_t isr[8];  /* in service register */
     uint32_t tmr[8];  /* trigger mode register */
     uint32_t irr[8]; /* interrupt request register */
+    int isr_max;     /* highest bit set in isr, -1 if none */
+    int irr_max;     /* highest bit set in irr, -1 if none */
     uint32_t lvt[APIC_LVT_NB];
     uint32_t esr; /* error register */
     uint32_t icr[2];
@@ -121,6 +127,9 @@ struct APICCommonState {
     int sipi_vector;
     int wait_for_sipi;
 
+    /* The guest was told it may skip the EOI write, see apic_pv_eoi_sync */
+    bool pv_eoi_pending;
+
     uint32_t vapic_control;
     DeviceState *vapic;
     hwaddr vapic_paddr; /* note: persistence via kvmvapic */
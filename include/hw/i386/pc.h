@@ -43,6 +43,11 @@ struct PcGuestInfo {
     uint64_t *node_cpu;
     FWCfgState *fw_cfg;
     bool has_acpi_build;
+    /* DIMM slots, and the range the DIMMs are mapped in */
+    int ram_slots;
+    hwaddr hotplug_memory_base;
+    uint64_t hotplug_memory_size;
+    MemoryRegion *hotplug_memory;
 };
 
 /* parallel.c */
@@ -240,6 +245,7 @@ uint16_t pvpanic_port(void);
 int e820_add_entry(uint64_t, uint64_t, uint32_t);
 
 #define PC_Q35_COMPAT_1_7 \
+        PC_COMPAT_1_7, \
         {\
             .driver   = "hpet",\
             .property = HPET_INTCAP,\
@@ -258,7 +264,19 @@ int e820_add_entry(uint64_t, uint64_t, uint32_t);
         PC_COMPAT_1_4, \
         PC_Q35_COMPAT_1_5
 
+#define PC_COMPAT_1_7 \
+        {\
+            .driver   = "e1000",\
+            .property = "interrupt-delay",\
+            .value    = "off",\
+        },{\
+            .driver   = "fw_cfg",\
+            .property = "dma_enabled",\
+            .value    = "off",\
+        }
+
 #define PC_COMPAT_1_6 \
+        PC_COMPAT_1_7, \
         {\
             .driver   = "e1000",\
             .property = "mitigation",\
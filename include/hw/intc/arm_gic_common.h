@@ -22,6 +22,7 @@
 #define HW_ARM_GIC_COMMON_H
 
 #include "hw/sysbus.h"
+#include "qemu/bitmap.h"
 
 /* Maximum number of possible interrupts, determined by the GIC architecture */
 #define GIC_MAXIRQ 1020
@@ -50,6 +51,10 @@ typedef struct GICState {
     bool cpu_enabled[GIC_NCPU];
 
     gic_irq_state irq_state[GIC_MAXIRQ];
+    /* Interrupts that are pending on at least one CPU.  Not migrated,
+     * it is rebuilt from irq_state.
+     */
+    DECLARE_BITMAP(pending_irqs, GIC_MAXIRQ);
     uint8_t irq_target[GIC_MAXIRQ];
     uint8_t priority1[GIC_INTERNAL][GIC_NCPU];
     uint8_t priority2[GIC_MAXIRQ - GIC_INTERNAL];
@@ -0,0 +1,84 @@
+/*
+ * Hot-pluggable memory DIMMs
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Each DIMM is a RAM block of its own, mapped in the hotplug memory range
+ * that the board reserves above the rest of the RAM.  The board creates a
+ * dimm bus for that range, with one slot per possible DIMM, and firmware
+ * such as ACPI tells the guest about the DIMMs through the bus's hotplug
+ * handler.
+ */
+
+#ifndef HW_DIMM_H
+#define HW_DIMM_H
+
+#include "hw/qdev.h"
+#include "exec/memory.h"
+
+#define TYPE_DIMM "dimm"
+#define DIMM(obj) OBJECT_CHECK(DimmDevice, (obj), TYPE_DIMM)
+
+#define TYPE_DIMM_BUS "dimm-bus"
+#define DIMM_BUS(obj) OBJECT_CHECK(DimmBus, (obj), TYPE_DIMM_BUS)
+
+/* The ACPI tables number the slots with one byte */
+#define DIMM_MAX_SLOTS          256
+
+/* DIMM addresses and sizes are multiples of the Linux memory block size */
+#define DIMM_ALIGN              (128ULL << 20)
+
+typedef struct DimmDevice {
+    DeviceState qdev;
+
+    /* Guest physical address and slot, or 0 and -1 to take the first free
+     * space and slot
+     */
+    uint64_t addr;
+    int32_t slot;
+    uint64_t size;
+    /* Guest NUMA node */
+    uint32_t node;
+    /* Host placement, as for -numa node */
+    char *mem_path;
+    char *host_nodes;
+    char *policy;
+
+    MemoryRegion mr;
+} DimmDevice;
+
+/* Called when @dimm is plugged (@add) or when its removal is requested.
+ * The handler calls object_unparent() on @dimm once the guest has let it
+ * go.
+ */
+typedef int (*dimm_hotplug_fn)(DeviceState *hotplug_dev, DimmDevice *dimm,
+                               bool add);
+
+typedef struct DimmBus {
+    BusState qbus;
+
+    /* The hotplug memory range, @size bytes at @base */
+    MemoryRegion *container;
+    hwaddr base;
+    uint64_t size;
+    int slots;
+
+    dimm_hotplug_fn hotplug;
+    DeviceState *hotplug_dev;
+} DimmBus;
+
+/* Create the bus for @slots DIMMs, that are mapped in @container */
+DimmBus *dimm_bus_create(DeviceState *parent, MemoryRegion *container,
+                         hwaddr base, int slots);
+
+/* Set the handler that tells the guest about DIMMs, and allow hotplug */
+void dimm_bus_hotplug(DimmBus *bus, dimm_hotplug_fn hotplug,
+                      DeviceState *dev);
+
+/* The DIMM in @slot, or NULL */
+DimmDevice *dimm_find_slot(DimmBus *bus, int slot);
+
+#endif
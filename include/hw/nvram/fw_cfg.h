@@ -48,6 +48,19 @@
 
 #define FW_CFG_MAX_FILE_PATH    56
 
+/* Feature bits in FW_CFG_ID */
+#define FW_CFG_VERSION          0x01
+#define FW_CFG_VERSION_DMA      0x02
+
+/* FWCfgDmaAccess control bits */
+#define FW_CFG_DMA_CTL_ERROR    0x01
+#define FW_CFG_DMA_CTL_READ     0x02
+#define FW_CFG_DMA_CTL_SKIP     0x04
+#define FW_CFG_DMA_CTL_SELECT   0x08
+
+/* Returned by reads of the DMA address register, "QEMU CFG" */
+#define FW_CFG_DMA_SIGNATURE    0x51454d5520434647ULL
+
 #ifndef NO_QEMU_PROTOS
 typedef struct FWCfgFile {
     uint32_t  size;        /* file size */
@@ -61,6 +74,13 @@ typedef struct FWCfgFiles {
     FWCfgFile f[];
 } FWCfgFiles;
 
+/* DMA descriptor in guest memory, all fields big endian */
+typedef struct FWCfgDmaAccess {
+    uint32_t control;
+    uint32_t length;
+    uint64_t address;
+} FWCfgDmaAccess;
+
 typedef void (*FWCfgCallback)(void *opaque, uint8_t *data);
 typedef void (*FWCfgReadCallback)(void *opaque, uint32_t offset);
 
@@ -78,6 +98,10 @@ void fw_cfg_add_file_callback(FWCfgState *s, const char *filename,
                               void *data, size_t len);
 FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
                         hwaddr crl_addr, hwaddr data_addr);
+FWCfgState *fw_cfg_init_dma(uint32_t ctl_port, uint32_t data_port,
+                            uint32_t dma_port, hwaddr ctl_addr,
+                            hwaddr data_addr, hwaddr dma_addr);
+bool fw_cfg_dma_enabled(FWCfgState *s);
 
 FWCfgState *fw_cfg_find(void);
 
@@ -42,6 +42,11 @@ void msi_notify(PCIDevice *dev, unsigned int vector);
 void msi_write_config(PCIDevice *dev, uint32_t addr, uint32_t val, int len);
 unsigned int msi_nr_vectors_allocated(const PCIDevice *dev);
 
+int msi_irqfd_enable(PCIDevice *dev, unsigned int nr_vectors);
+void msi_irqfd_disable(PCIDevice *dev);
+void msi_irqfd_update(PCIDevice *dev, unsigned int vector, MSIMessage msg);
+bool msi_irqfd_notify(PCIDevice *dev, unsigned int vector, MSIMessage msg);
+
 static inline bool msi_present(const PCIDevice *dev)
 {
     return dev->cap_present & QEMU_PCI_CAP_MSI;
@@ -208,6 +208,8 @@ typedef struct PCIDeviceClass {
     const char *romfile;
 } PCIDeviceClass;
 
+typedef struct PCIMSIIrqfd PCIMSIIrqfd;
+
 typedef void (*PCIINTxRoutingNotifier)(PCIDevice *dev);
 typedef int (*MSIVectorUseNotifier)(PCIDevice *dev, unsigned int vector,
                                       MSIMessage msg);
@@ -281,6 +283,10 @@ struct PCIDevice {
     /* Offset of MSI capability in config space */
     uint8_t msi_cap;
 
+    /* MSI and MSI-X delivery through KVM irqfds, see msi_irqfd_enable() */
+    PCIMSIIrqfd *msi_irqfd;
+    unsigned int msi_irqfd_nr;
+
     /* PCI Express */
     PCIExpressDevice exp;
 
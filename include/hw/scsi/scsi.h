@@ -53,6 +53,7 @@ struct SCSIRequest {
     SCSICommand       cmd;
     BlockDriverAIOCB  *aiocb;
     QEMUSGList        *sg;
+    QEMUIOVector      *iov;
     bool              dma_started;
     uint8_t sense[SCSI_SENSE_BUF_SIZE];
     uint32_t sense_len;
@@ -61,6 +62,7 @@ struct SCSIRequest {
     bool retry;
     void *hba_private;
     QTAILQ_ENTRY(SCSIRequest) next;
+    QSLIST_ENTRY(SCSIRequest) pool_next;
 };
 
 #define TYPE_SCSI_DEVICE "scsi-device"
@@ -97,6 +99,13 @@ struct SCSIDevice
     int blocksize;
     int type;
     uint64_t max_lba;
+
+    /* Freed requests are kept for reuse if they fit in req_pool_size
+     * bytes, which the device sets to the size of its largest requests.
+     */
+    size_t req_pool_size;
+    unsigned int req_pool_len;
+    QSLIST_HEAD(, SCSIRequest) req_pool;
 };
 
 extern const VMStateDescription vmstate_scsi_device;
@@ -138,6 +147,12 @@ struct SCSIBusInfo {
     void (*change)(SCSIBus *bus, SCSIDevice *dev, SCSISense sense);
     QEMUSGList *(*get_sg_list)(SCSIRequest *req);
 
+    /* Like get_sg_list, but the buffers are already mapped to host memory.
+     * Used by HBAs that run outside the main loop, where guest memory
+     * cannot be mapped.  At most one of the two may return non-NULL.
+     */
+    QEMUIOVector *(*get_iov)(SCSIRequest *req);
+
     void (*save_request)(QEMUFile *f, SCSIRequest *req);
     void *(*load_request)(QEMUFile *f, SCSIRequest *req);
     void (*free_request)(SCSIBus *bus, void *priv);
@@ -49,6 +49,14 @@ static inline void vring_set_broken(Vring *vring)
     vring->broken = true;
 }
 
+/* Give back the descriptor chain returned by the last vring_pop(), so
+ * that the next vring_pop() returns it again
+ */
+static inline void vring_unpop(Vring *vring)
+{
+    vring->last_avail_idx--;
+}
+
 bool vring_setup(Vring *vring, VirtIODevice *vdev, int n);
 void vring_teardown(Vring *vring, VirtIODevice *vdev, int n);
 void vring_disable_notification(VirtIODevice *vdev, Vring *vring);
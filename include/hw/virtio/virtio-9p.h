@@ -19,6 +19,10 @@ typedef struct V9fsConf
     /* tag name for the device */
     char *tag;
     char *fsdev_id;
+    /* upper bound for the shared worker pool, 0 for no limit */
+    uint32_t threads;
+    /* milliseconds to keep lstat results, 0 disables the cache */
+    uint32_t attr_cache_ttl;
 } V9fsConf;
 
 #endif
@@ -30,6 +30,7 @@
 /* The feature bitmap for virtio balloon */
 #define VIRTIO_BALLOON_F_MUST_TELL_HOST 0 /* Tell before reclaiming pages */
 #define VIRTIO_BALLOON_F_STATS_VQ 1       /* Memory stats virtqueue */
+#define VIRTIO_BALLOON_F_FREE_PAGE_HINT 3 /* Free page hint virtqueue */
 
 /* Size of a PFN in the balloon interface. */
 #define VIRTIO_BALLOON_PFN_SHIFT 12
@@ -40,6 +41,8 @@ struct virtio_balloon_config
     uint32_t num_pages;
     /* Number of pages we've actually got in balloon. */
     uint32_t actual;
+    /* Free page hints must quote this, 0 means hints are not wanted. */
+    uint32_t free_page_hint_cmd_id;
 };
 
 /* Memory Statistics */
@@ -58,7 +61,7 @@ typedef struct VirtIOBalloonStat {
 
 typedef struct VirtIOBalloon {
     VirtIODevice parent_obj;
-    VirtQueue *ivq, *dvq, *svq;
+    VirtQueue *ivq, *dvq, *svq, *fvq;
     uint32_t num_pages;
     uint32_t actual;
     uint64_t stats[VIRTIO_BALLOON_S_NR];
@@ -67,6 +70,20 @@ typedef struct VirtIOBalloon {
     QEMUTimer *stats_timer;
     int64_t stats_last_update;
     int64_t stats_poll_interval;
+    uint32_t host_features;
+    size_t config_size;
+    /* A host page that is only partly in the balloon */
+    uint8_t *pbp_base;
+    size_t pbp_size;
+    unsigned long *pbp_bitmap;
+    /* Free page hints */
+    uint32_t free_page_hint_cmd_id;
+    QEMUBH *free_page_hint_bh;
+    Notifier free_page_hint_notifier;
 } VirtIOBalloon;
 
+#define DEFINE_VIRTIO_BALLOON_PROPERTIES(_state, _features_field)         \
+        DEFINE_PROP_BIT("free-page-hint", _state, _features_field,        \
+                        VIRTIO_BALLOON_F_FREE_PAGE_HINT, false)
+
 #endif
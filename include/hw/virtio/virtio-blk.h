@@ -38,6 +38,7 @@
 #define VIRTIO_BLK_F_WCE        9       /* write cache enabled */
 #define VIRTIO_BLK_F_TOPOLOGY   10      /* Topology information is available */
 #define VIRTIO_BLK_F_CONFIG_WCE 11      /* write cache configurable */
+#define VIRTIO_BLK_F_MQ         12      /* support more than one vq */
 
 #define VIRTIO_BLK_ID_BYTES     20      /* ID string length */
 
@@ -55,6 +56,8 @@ struct virtio_blk_config
     uint16_t min_io_size;
     uint32_t opt_io_size;
     uint8_t wce;
+    uint8_t unused;
+    uint16_t num_queues;
 } QEMU_PACKED;
 
 /* These two define direction. */
@@ -110,6 +113,13 @@ struct VirtIOBlkConf
     uint32_t scsi;
     uint32_t config_wce;
     uint32_t data_plane;
+    uint32_t num_queues;
+    uint32_t poll_max_ns;   /* dataplane busy-wait window, 0 disables */
+    uint32_t poll_grow;
+    uint32_t poll_shrink;
+    char *data_plane_affinity;  /* host CPUs of the dataplane thread */
+    char *data_plane_sched;     /* and its scheduling policy */
+    struct IOThread *iothread;  /* run dataplane here, not in its own thread */
 };
 
 struct VirtIOBlockDataPlane;
@@ -117,7 +127,6 @@ struct VirtIOBlockDataPlane;
 typedef struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockDriverState *bs;
-    VirtQueue *vq;
     void *rq;
     QEMUBH *bh;
     BlockConf *conf;
@@ -140,13 +149,15 @@ typedef struct VirtIOBlock {
         DEFINE_BLOCK_CHS_PROPERTIES(_state, _field.conf),                     \
         DEFINE_PROP_STRING("serial", _state, _field.serial),                  \
         DEFINE_PROP_BIT("config-wce", _state, _field.config_wce, 0, true),    \
+        DEFINE_PROP_UINT32("num-queues", _state, _field.num_queues, 1),       \
         DEFINE_PROP_BIT("scsi", _state, _field.scsi, 0, true)
 #else
 #define DEFINE_VIRTIO_BLK_PROPERTIES(_state, _field)                          \
         DEFINE_BLOCK_PROPERTIES(_state, _field.conf),                         \
         DEFINE_BLOCK_CHS_PROPERTIES(_state, _field.conf),                     \
         DEFINE_PROP_STRING("serial", _state, _field.serial),                  \
-        DEFINE_PROP_BIT("config-wce", _state, _field.config_wce, 0, true)
+        DEFINE_PROP_BIT("config-wce", _state, _field.config_wce, 0, true),    \
+        DEFINE_PROP_UINT32("num-queues", _state, _field.num_queues, 1)
 #endif /* __linux__ */
 
 void virtio_blk_set_conf(DeviceState *dev, VirtIOBlkConf *blk);
@@ -65,11 +65,18 @@
  * and latency. */
 #define TX_BURST 256
 
+/* Default and largest size of the receive MAC filter.  Guests that set
+ * more addresses than this fall back to promiscuous receive. */
+#define MAC_TABLE_ENTRIES    64
+#define MAC_TABLE_ENTRIES_MAX 16384
+
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    uint32_t data_plane;
+    uint32_t mac_table_entries;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
@@ -147,10 +154,10 @@ typedef struct VirtIONetQueue {
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
     int tx_waiting;
-    struct {
-        VirtQueueElement elem;
-        ssize_t len;
-    } async_tx;
+    struct VirtIONetTxPacket *tx_batch; /* packets handed to the peer */
+    /* tx_batch[tx_async_head..tx_async_tail) are waiting for the peer */
+    unsigned int tx_async_head;
+    unsigned int tx_async_tail;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -181,6 +188,10 @@ typedef struct VirtIONet {
         uint8_t multi_overflow;
         uint8_t uni_overflow;
         uint8_t *macs;
+        int size;               /* capacity of macs, in entries */
+        /* Open addressing index of macs: 1 + entry number, 0 if free */
+        uint16_t *hash;
+        unsigned hash_mask;
     } mac_table;
     uint32_t *vlans;
     virtio_net_conf net_conf;
@@ -193,6 +204,11 @@ typedef struct VirtIONet {
     char *netclient_name;
     char *netclient_type;
     uint64_t curr_guest_offloads;
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    Notifier migration_state_notifier;
+    struct VirtIONetDataPlane *dataplane;
+    uint16_t dataplane_queues;  /* queue pairs run by dataplane, 0 if off */
+#endif
 } VirtIONet;
 
 #define VIRTIO_NET_CTRL_MAC    1
@@ -268,7 +284,9 @@ struct virtio_net_ctrl_mq {
 #define DEFINE_VIRTIO_NET_PROPERTIES(_state, _field)                           \
     DEFINE_PROP_UINT32("x-txtimer", _state, _field.txtimer, TX_TIMER_INTERVAL),\
     DEFINE_PROP_INT32("x-txburst", _state, _field.txburst, TX_BURST),          \
-    DEFINE_PROP_STRING("tx", _state, _field.tx)
+    DEFINE_PROP_STRING("tx", _state, _field.tx),                               \
+    DEFINE_PROP_UINT32("mac_table_entries", _state, _field.mac_table_entries, \
+                       MAC_TABLE_ENTRIES)
 
 void virtio_net_set_config_size(VirtIONet *n, uint32_t host_features);
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
@@ -28,6 +28,7 @@ struct VirtIORNGConf {
     RngBackend *rng;
     uint64_t max_bytes;
     uint32_t period_ms;
+    uint32_t pool_size;
     RndRandom *default_backend;
 };
 
@@ -46,8 +47,19 @@ typedef struct VirtIORNG {
      */
     QEMUTimer *rate_limit_timer;
     int64_t quota_remaining;
+
+    /* Entropy read ahead from the backend, also host state.  The guest
+     * is served from here first, and the pool is refilled in the
+     * background.
+     */
+    uint8_t *pool;
+    uint32_t pool_len;
+    bool pool_refilling;
 } VirtIORNG;
 
+/* Upper limit for the pool-size property */
+#define VIRTIO_RNG_POOL_MAX (64 * 1024)
+
 /* Set a default rate limit of 2^47 bytes per minute or roughly 2TB/s.  If
    you have an entropy source capable of generating more entropy than this
    and you can pass it through via virtio-rng, then hats off to you.  Until
@@ -56,6 +68,7 @@ typedef struct VirtIORNG {
 #define DEFINE_VIRTIO_RNG_PROPERTIES(_state, _conf_field)                    \
         DEFINE_PROP_UINT64("max-bytes", _state, _conf_field.max_bytes,       \
                            INT64_MAX),                                       \
-        DEFINE_PROP_UINT32("period", _state, _conf_field.period_ms, 1 << 16)
+        DEFINE_PROP_UINT32("period", _state, _conf_field.period_ms, 1 << 16), \
+        DEFINE_PROP_UINT32("pool-size", _state, _conf_field.pool_size, 0)
 
 #endif
@@ -17,6 +17,7 @@
 #include "hw/virtio/virtio.h"
 #include "hw/pci/pci.h"
 #include "hw/scsi/scsi.h"
+#include "sysemu/dma.h"
 
 #define TYPE_VIRTIO_SCSI_COMMON "virtio-scsi-common"
 #define VIRTIO_SCSI_COMMON(obj) \
@@ -153,6 +154,7 @@ struct VirtIOSCSIConf {
     uint32_t cmd_per_lun;
     char *vhostfd;
     char *wwpn;
+    uint32_t data_plane;
 };
 
 typedef struct VirtIOSCSICommon {
@@ -166,14 +168,60 @@ typedef struct VirtIOSCSICommon {
     VirtQueue **cmd_vqs;
 } VirtIOSCSICommon;
 
+struct VirtIOSCSIDataPlane;
+struct VirtIOSCSIDataPlaneQueue;
+
 typedef struct {
     VirtIOSCSICommon parent_obj;
 
     SCSIBus bus;
     int resetting;
     bool events_dropped;
+
+    /* Completions only mark their virtqueue; one bottom half raises the
+     * interrupts for everything that completed in the meantime.
+     */
+    QEMUBH *notify_bh;
+    unsigned long *notify_vqs;
+#ifdef CONFIG_VIRTIO_SCSI_DATA_PLANE
+    Notifier migration_state_notifier;
+    struct VirtIOSCSIDataPlane *dataplane;
+    bool dataplane_fenced;      /* LUNs cannot leave the main loop */
+#endif
 } VirtIOSCSI;
 
+typedef struct VirtIOSCSIReq {
+    VirtIOSCSI *dev;
+    VirtQueue *vq;
+    VirtQueueBuf *elem;
+    QEMUSGList qsgl;
+    SCSIRequest *sreq;
+    enum SCSIXferMode mode;     /* direction of the guest data buffers */
+
+    /* Requests popped by the dataplane have no elem and no qsgl; their
+     * data buffers are already mapped and described by qiov.
+     */
+    struct VirtIOSCSIDataPlaneQueue *dpq;
+    unsigned int head;
+    size_t resp_size;
+    QEMUIOVector qiov;
+    QSIMPLEQ_ENTRY(VirtIOSCSIReq) next;
+
+    union {
+        char                  *buf;
+        VirtIOSCSICmdReq      *cmd;
+        VirtIOSCSICtrlTMFReq  *tmf;
+        VirtIOSCSICtrlANReq   *an;
+    } req;
+    union {
+        char                  *buf;
+        VirtIOSCSICmdResp     *cmd;
+        VirtIOSCSICtrlTMFResp *tmf;
+        VirtIOSCSICtrlANResp  *an;
+        VirtIOSCSIEvent       *event;
+    } resp;
+} VirtIOSCSIReq;
+
 #define DEFINE_VIRTIO_SCSI_PROPERTIES(_state, _conf_field)                     \
     DEFINE_PROP_UINT32("num_queues", _state, _conf_field.num_queues, 1),       \
     DEFINE_PROP_UINT32("max_sectors", _state, _conf_field.max_sectors, 0xFFFF),\
@@ -186,7 +234,16 @@ typedef struct {
     DEFINE_PROP_BIT("param_change", _state, _feature_field,                    \
                                             VIRTIO_SCSI_F_CHANGE, true)
 
-void virtio_scsi_common_realize(DeviceState *dev, Error **errp);
+typedef void (*HandleOutput)(VirtIODevice *, VirtQueue *);
+
+void virtio_scsi_common_realize(DeviceState *dev, Error **errp,
+                                HandleOutput ctrl, HandleOutput evt,
+                                HandleOutput cmd);
 void virtio_scsi_common_unrealize(DeviceState *dev, Error **errp);
 
+SCSIDevice *virtio_scsi_device_find(VirtIOSCSI *s, uint8_t *lun);
+void virtio_scsi_handle_cmd_req(VirtIOSCSI *s, SCSIDevice *d,
+                                VirtIOSCSIReq *req);
+void virtio_scsi_complete_req(VirtIOSCSIReq *req);
+
 #endif /* _QEMU_VIRTIO_SCSI_H */
@@ -105,6 +105,12 @@ typedef struct VirtIOSerialPortClass {
      */
     ssize_t (*have_data)(VirtIOSerialPort *port, const uint8_t *buf,
                          ssize_t len);
+    /*
+     * Optional, like have_data but for all of a buffer the guest
+     * queued, which can span several pages.
+     */
+    ssize_t (*have_data_iov)(VirtIOSerialPort *port, const struct iovec *iov,
+                             int iovcnt);
 } VirtIOSerialPortClass;
 
 /*
@@ -92,6 +92,28 @@ typedef struct VirtQueueElement
     struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
 } VirtQueueElement;
 
+/*
+ * A virtqueue element sized for its descriptor chain.  The arrays point
+ * into storage allocated with the structure; the structure itself comes
+ * from a free list of the queue it was popped from.
+ */
+typedef struct VirtQueueBuf VirtQueueBuf;
+struct VirtQueueBuf
+{
+    unsigned int index;
+    unsigned int out_num;
+    unsigned int in_num;
+    hwaddr *in_addr;
+    hwaddr *out_addr;
+    struct iovec *in_sg;
+    struct iovec *out_sg;
+    /* private */
+    VirtQueue *vq;
+    unsigned int max_sg;
+    QSLIST_ENTRY(VirtQueueBuf) next;
+    hwaddr addr[0];
+};
+
 #define VIRTIO_PCI_QUEUE_MAX 64
 
 #define VIRTIO_NO_VECTOR 0xffff
@@ -174,6 +196,15 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     size_t num_sg, int is_write);
 int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem);
+VirtQueueBuf *virtqueue_pop_buf(VirtQueue *vq);
+void virtqueue_fill_buf(VirtQueue *vq, const VirtQueueBuf *buf,
+                        unsigned int len, unsigned int idx);
+void virtqueue_push_buf(VirtQueue *vq, const VirtQueueBuf *buf,
+                        unsigned int len);
+void virtqueue_buf_free(VirtQueueBuf *buf);
+void virtqueue_buf_map(VirtQueueBuf *buf);
+void virtqueue_buf_save(QEMUFile *f, const VirtQueueBuf *buf);
+VirtQueueBuf *virtqueue_buf_load(QEMUFile *f);
 int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
                           unsigned int out_bytes);
 void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
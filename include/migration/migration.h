@@ -30,6 +30,9 @@ struct MigrationParams {
 
 typedef struct MigrationState MigrationState;
 
+/* Upper bound for the x-multifd-channels parameter */
+#define MULTIFD_MAX_CHANNELS 16
+
 struct MigrationState
 {
     int64_t bandwidth_limit;
@@ -48,8 +51,40 @@ struct MigrationState
     int64_t dirty_pages_rate;
     int64_t dirty_bytes_rate;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+    int64_t parameters[MIGRATION_PARAMETER_MAX];
     int64_t xbzrle_cache_size;
     int64_t setup_time;
+
+    /* Extra connections opened by the transport for x-multifd */
+    QEMUFile *multifd_files[MULTIFD_MAX_CHANNELS];
+    int multifd_nb_files;
+
+    /* x-postcopy-ram: set by migrate-start-postcopy */
+    bool start_postcopy;
+    /* Page requests from the destination once postcopy has started */
+    QEMUFile *rp_file;
+    QemuThread rp_thread;
+    bool rp_error;
+
+    /* Whether the guest was running when the migration thread stopped it */
+    bool vm_was_running;
+
+    /* x-auto-tune: the interval being measured and the current settings */
+    int64_t tune_time;
+    int64_t tune_bytes;
+    int64_t tune_bandwidth;
+    int64_t tune_bandwidth_limit;
+    uint64_t tune_downtime;
+    int tune_throttle;
+    int64_t tune_adjustments;
+    MigrationAutoTuneAction tune_action;
+};
+
+/* Messages sent on the return path from the destination to the source */
+enum mig_rp_message_type {
+    MIG_RP_MSG_INVALID = 0,  /* Must be 0 */
+    MIG_RP_MSG_SHUT,         /* sibling will not send any more RP messages */
+    MIG_RP_MSG_REQ_PAGES,    /* offset, len, idstr of the pages wanted */
 };
 
 void process_incoming_migration(QEMUFile *f);
@@ -80,8 +115,24 @@ void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **
 
 void rdma_start_outgoing_migration(void *opaque, const char *host_port, Error **errp);
 
+void migrate_start_outgoing_file(QEMUFile *f);
+
+void template_start_incoming_migration(const char *path, Error **errp);
+
+void template_start_outgoing_migration(MigrationState *s, const char *path,
+                                       Error **errp);
+
+void file_start_incoming_migration(const char *path, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp);
+
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
 
+/* Statistics of the last outgoing RDMA migration, NULL if there was none */
+RDMAStats *rdma_mig_stats(void);
+void rdma_mig_stats_reset(void);
+
 void migrate_fd_error(MigrationState *s);
 
 void migrate_fd_connect(MigrationState *s);
@@ -90,6 +141,7 @@ int migrate_fd_close(MigrationState *s);
 
 void add_migration_state_change_notifier(Notifier *notify);
 void remove_migration_state_change_notifier(Notifier *notify);
+bool migration_is_active(MigrationState *);
 bool migration_in_setup(MigrationState *);
 bool migration_has_finished(MigrationState *);
 bool migration_has_failed(MigrationState *);
@@ -112,10 +164,31 @@ uint64_t norm_mig_pages_transferred(void);
 uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
+uint64_t xbzrle_mig_cache_hits(void);
+uint64_t xbzrle_mig_cache_evictions(void);
+double xbzrle_mig_cache_hit_rate(void);
+double xbzrle_mig_cache_eviction_rate(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
+/* arch_init.c: guest RAM goes to, or comes from, a raw template file */
+void ram_template_set_fd(int fd);
+void ram_file_set_fd(int fd, int direct_fd);
+
+/* arch_init.c: keep vCPUs asleep for pct percent of the time, 0 to stop */
+void ram_set_throttle(int pct);
+
+/* arch_init.c: postcopy support on the source */
+void ram_save_queue_pages(const char *idstr, ram_addr_t start, ram_addr_t len);
+int ram_postcopy_send_discard_bitmap(QEMUFile *f);
+
+/* arch_init.c: pages the guest reported as free are not migrated */
+uint32_t ram_free_page_hint_generation(void);
+bool ram_discard_free_pages(uint32_t gen, ram_addr_t start, ram_addr_t len);
+void ram_add_bitmap_sync_notifier(Notifier *notify);
+void ram_remove_bitmap_sync_notifier(Notifier *notify);
+
 /**
  * @migrate_add_blocker - prevent migration from proceeding
  *
@@ -130,10 +203,44 @@ void migrate_add_blocker(Error *reason);
  */
 void migrate_del_blocker(Error *reason);
 
+/**
+ * @migrate_set_thread_sched - set the placement of the migration thread
+ *
+ * @affinity - host CPUs as "cpu[-cpu]", or NULL
+ * @sched - scheduling policy as "other|fifo|rr[:priority]", or NULL
+ *
+ * Returns 0, or -EINVAL if an option cannot be parsed.
+ */
+int migrate_set_thread_sched(const char *affinity, const char *sched);
+
 bool migrate_rdma_pin_all(void);
+int64_t migrate_rdma_registration_cache(void);
+void migrate_set_file_buffer_size(QEMUFile *f);
 bool migrate_zero_blocks(void);
 
 bool migrate_auto_converge(void);
+bool migrate_auto_tune(void);
+bool migrate_postcopy_ram(void);
+
+bool migrate_use_multifd(void);
+int migrate_multifd_channels(void);
+
+bool migrate_use_compression(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+
+/* arch_init.c: receiving side of the x-multifd channels */
+void multifd_load_setup(QEMUFile **files, int nb_files);
+void multifd_load_cleanup(void);
+
+/* arch_init.c: compress capability */
+void decompress_threads_cleanup(void);
+uint64_t compress_mig_pages_transferred(void);
+uint64_t compress_mig_bytes_transferred(void);
+uint64_t compress_mig_busy_count(void);
+double compress_mig_compression_rate(void);
+CompressThreadStatsList *compress_thread_stats(void);
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
@@ -144,6 +251,8 @@ int64_t migrate_xbzrle_cache_size(void);
 
 int64_t xbzrle_cache_resize(int64_t new_size);
 
+bool dirty_rate_measuring(void);
+
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_after_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_load_hook(QEMUFile *f, uint64_t flags);
@@ -18,6 +18,18 @@
 /* Page cache for storing guest pages */
 typedef struct PageCache PageCache;
 
+typedef struct PageCacheStats {
+    uint64_t hits;          /* cache_is_cached found the page */
+    uint64_t misses;        /* cache_is_cached did not find the page */
+    uint64_t evictions;     /* cache_insert threw out another page */
+    uint64_t inserts;       /* calls to cache_insert */
+} PageCacheStats;
+
+/*
+ * The cache has no locking; the migration thread is its only user.  Only
+ * cache_get_stats may be called from another thread.
+ */
+
 /**
  * cache_init: Initialize the page cache
  *
@@ -58,7 +70,8 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
- * will dup the data on insert. the previous value will be overwritten
+ * will copy the data on insert. the previous value will be overwritten,
+ * or another page of the same set evicted
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
@@ -67,8 +80,7 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata);
 
 /**
- * cache_resize: resize the page cache. In case of size reduction the extra
- * pages will be freed
+ * cache_resize: resize the page cache. The cached pages are dropped
  *
  * Returns -1 on error new cache size on success
  *
@@ -77,4 +89,12 @@ void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata);
  */
 int64_t cache_resize(PageCache *cache, int64_t num_pages);
 
+/**
+ * cache_get_stats: get the hit, miss and eviction counters of the cache
+ *
+ * @cache pointer to the PageCache struct
+ * @stats: filled with the counters since cache_init
+ */
+void cache_get_stats(const PageCache *cache, PageCacheStats *stats);
+
 #endif
@@ -0,0 +1,44 @@
+/*
+ * Postcopy migration for RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_POSTCOPY_RAM_H
+#define QEMU_POSTCOPY_RAM_H
+
+#include "migration/qemu-file.h"
+
+/* Return true if the host supports everything we need to do postcopy-ram */
+bool postcopy_ram_supported_by_host(void);
+
+/*
+ * Discard @length bytes from @start in RAMBlock @idstr on the destination,
+ * so that the next access faults and fetches the page from the source.
+ */
+int postcopy_ram_discard_range(const char *idstr, uint64_t start,
+                               uint64_t length);
+
+/*
+ * Register guest RAM with userfaultfd and start the thread that turns
+ * faults into page requests on the return path @rp.
+ */
+int postcopy_ram_incoming_setup(QEMUFile *rp);
+
+/* Stop faulting, unregister guest RAM and say goodbye to the source */
+int postcopy_ram_incoming_cleanup(void);
+
+/* True between postcopy_ram_incoming_setup and the end of the migration */
+bool postcopy_ram_incoming_active(void);
+
+/*
+ * Atomically copy the page at @from into guest memory at @host and wake
+ * up anything waiting on it.  @host must be page aligned.
+ */
+int postcopy_place_page(void *host, void *from);
+
+/* Same as postcopy_place_page, for a page full of zeroes */
+int postcopy_place_page_zero(void *host);
+
+#endif
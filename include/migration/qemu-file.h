@@ -94,6 +94,12 @@ typedef struct QEMUFileOps {
     QEMURamSaveFunc *save_page;
 } QEMUFileOps;
 
+/* Default and allowed sizes of the buffer and iovec array of a QEMUFile */
+#define QEMU_FILE_BUF_SIZE      32768
+#define QEMU_FILE_BUF_SIZE_MIN  4096
+#define QEMU_FILE_BUF_SIZE_MAX  (16 * 1024 * 1024)
+#define QEMU_FILE_IOV_MAX       MIN(IOV_MAX, 64)
+
 QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops);
 QEMUFile *qemu_fopen(const char *filename, const char *mode);
 QEMUFile *qemu_fdopen(int fd, const char *mode);
@@ -138,10 +144,13 @@ uint64_t qemu_get_be64(QEMUFile *f);
 
 int qemu_file_rate_limit(QEMUFile *f);
 void qemu_file_reset_rate_limit(QEMUFile *f);
+void qemu_file_update_transfer(QEMUFile *f, int64_t len);
 void qemu_file_set_rate_limit(QEMUFile *f, int64_t new_rate);
 int64_t qemu_file_get_rate_limit(QEMUFile *f);
 int qemu_file_get_error(QEMUFile *f);
+void qemu_file_set_error(QEMUFile *f, int ret);
 void qemu_fflush(QEMUFile *f);
+void qemu_file_set_buffer_size(QEMUFile *f, int buf_size, int iov_max);
 
 static inline void qemu_put_be64s(QEMUFile *f, const uint64_t *pv)
 {
@@ -132,6 +132,10 @@ struct VMStateDescription {
     int (*pre_load)(void *opaque);
     int (*post_load)(void *opaque, int version_id);
     void (*pre_save)(void *opaque);
+    /* Saving only reads the device and may run in a worker thread while
+     * another thread holds the iothread lock (the VM is stopped).
+     */
+    bool save_parallel;
     VMStateField *fields;
     const VMStateSubsection *subsections;
 };
@@ -7,7 +7,7 @@
 #include "block/block.h"
 #include "monitor/readline.h"
 
-extern Monitor *cur_mon;
+extern __thread Monitor *cur_mon;
 extern Monitor *default_mon;
 
 /* flags for monitor_init */
@@ -15,9 +15,12 @@ extern Monitor *default_mon;
 #define MONITOR_USE_READLINE  0x02
 #define MONITOR_USE_CONTROL   0x04
 #define MONITOR_USE_PRETTY    0x08
+#define MONITOR_USE_IOTHREAD  0x10
 
 /* flags for monitor commands */
 #define MONITOR_CMD_ASYNC       0x0001
+/* The command does not need the global mutex, and does not use cur_mon */
+#define MONITOR_CMD_BQL_FREE    0x0002
 
 /* QMP events */
 typedef enum MonitorEvent {
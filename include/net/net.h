@@ -42,14 +42,25 @@ typedef struct NICConf {
 
 /* Net clients */
 
+/* One packet of a batch.  receive_batch returns how many packets of the
+ * batch it consumed; the rest is queued and delivered one by one when the
+ * client is flushed.
+ */
+struct NetPacketIOV {
+    const struct iovec *iov;
+    int iovcnt;
+};
+
 typedef void (NetPoll)(NetClientState *, bool enable);
 typedef int (NetCanReceive)(NetClientState *);
 typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
+typedef int (NetReceiveBatch)(NetClientState *, const NetPacketIOV *, int);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
 typedef void (NetClientDestructor)(NetClientState *);
 typedef RxFilterInfo *(QueryRxFilter)(NetClientState *);
+typedef void (NetPrintStats)(NetClientState *, Monitor *);
 
 typedef struct NetClientInfo {
     NetClientOptionsKind type;
@@ -57,11 +68,13 @@ typedef struct NetClientInfo {
     NetReceive *receive;
     NetReceive *receive_raw;
     NetReceiveIOV *receive_iov;
+    NetReceiveBatch *receive_batch;
     NetCanReceive *can_receive;
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
     QueryRxFilter *query_rx_filter;
     NetPoll *poll;
+    NetPrintStats *print_stats;
 } NetClientInfo;
 
 struct NetClientState {
@@ -113,6 +126,12 @@ ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
                           int iovcnt);
 ssize_t qemu_sendv_packet_async(NetClientState *nc, const struct iovec *iov,
                                 int iovcnt, NetPacketSent *sent_cb);
+int qemu_sendv_packet_batch_async(NetClientState *nc,
+                                  const NetPacketIOV *pkts, int count,
+                                  NetPacketSent *sent_cb);
+int qemu_sendv_packet_batch_zerocopy(NetClientState *nc,
+                                     const NetPacketIOV *pkts, int count,
+                                     NetPacketSent *sent_cb);
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
@@ -136,6 +155,11 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
                             const struct iovec *iov,
                             int iovcnt,
                             void *opaque);
+int qemu_deliver_packet_batch(NetClientState *sender,
+                              unsigned flags,
+                              const NetPacketIOV *pkts,
+                              int count,
+                              void *opaque);
 
 void print_net_client(Monitor *mon, NetClientState *nc);
 void do_info_network(Monitor *mon, const QDict *qdict);
@@ -31,13 +31,23 @@ typedef struct NetQueue NetQueue;
 
 typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
+typedef struct NetQueueStats {
+    uint32_t count;         /* packets queued now */
+    uint32_t max_count;     /* high-water mark of count */
+    uint64_t queued;        /* packets ever queued */
+    uint64_t dropped;       /* packets dropped because the queue was full */
+} NetQueueStats;
+
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
+#define QEMU_NET_PACKET_FLAG_ZEROCOPY  (1<<1)
 
 NetQueue *qemu_new_net_queue(void *opaque);
 
 void qemu_del_net_queue(NetQueue *queue);
 
+void qemu_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats);
+
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             NetClientState *sender,
                             unsigned flags,
@@ -52,6 +62,13 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const NetPacketIOV *pkts,
+                              int count,
+                              NetPacketSent *sent_cb);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
 
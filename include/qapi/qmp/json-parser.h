@@ -17,8 +17,9 @@
 #include "qemu-common.h"
 #include "qapi/qmp/qlist.h"
 #include "qapi/error.h"
+#include <glib.h>
 
-QObject *json_parser_parse(QList *tokens, va_list *ap);
-QObject *json_parser_parse_err(QList *tokens, va_list *ap, Error **errp);
+QObject *json_parser_parse(GQueue *tokens, va_list *ap);
+QObject *json_parser_parse_err(GQueue *tokens, va_list *ap, Error **errp);
 
 #endif
@@ -14,21 +14,34 @@
 #ifndef QEMU_JSON_STREAMER_H
 #define QEMU_JSON_STREAMER_H
 
-#include "qapi/qmp/qlist.h"
+#include <glib.h>
 #include "qapi/qmp/json-lexer.h"
 
+/* A token as seen by the parser.  Tokens used to be QDicts, which cost
+ * several allocations and a 4 KiB hash table for every token.
+ */
+typedef struct JSONToken {
+    JSONTokenType type;
+    int x;
+    int y;
+    char str[];
+} JSONToken;
+
+/* @emit receives a queue of JSONTokens, or NULL after a lexical error.
+ * The queue and the tokens are freed when @emit returns.
+ */
 typedef struct JSONMessageParser
 {
-    void (*emit)(struct JSONMessageParser *parser, QList *tokens);
+    void (*emit)(struct JSONMessageParser *parser, GQueue *tokens);
     JSONLexer lexer;
     int brace_count;
     int bracket_count;
-    QList *tokens;
+    GQueue *tokens;
     uint64_t token_size;
 } JSONMessageParser;
 
 void json_message_parser_init(JSONMessageParser *parser,
-                              void (*func)(JSONMessageParser *, QList *));
+                              void (*func)(JSONMessageParser *, GQueue *));
 
 int json_message_parser_feed(JSONMessageParser *parser,
                              const char *buffer, size_t size);
@@ -15,6 +15,8 @@
 #define QJSON_H
 
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include "qemu/compiler.h"
 #include "qapi/qmp/qobject.h"
 #include "qapi/qmp/qstring.h"
@@ -26,4 +28,17 @@ QObject *qobject_from_jsonv(const char *string, va_list *ap) GCC_FMT_ATTR(1, 0);
 QString *qobject_to_json(const QObject *obj);
 QString *qobject_to_json_pretty(const QObject *obj);
 
+/* @buf holds @len bytes of JSON text and is NUL-terminated */
+typedef void QJSONWriteFunc(void *opaque, const char *buf, size_t len);
+
+/**
+ * qobject_to_json_write: serialize @obj to JSON text
+ *
+ * Unlike qobject_to_json(), the text is not collected in a QString but
+ * passed to @write a few kilobytes at a time, so that a large object can
+ * be sent out as it is converted.
+ */
+void qobject_to_json_write(const QObject *obj, bool pretty,
+                           QJSONWriteFunc *write, void *opaque);
+
 #endif /* QJSON_H */
@@ -277,6 +277,7 @@ typedef struct PCIHostDeviceAddress {
 } PCIHostDeviceAddress;
 
 void tcg_exec_init(unsigned long tb_size);
+void tcg_perf_map_init(void);
 bool tcg_enabled(void);
 
 void cpu_exec_init_all(void);
@@ -348,10 +349,13 @@ size_t qemu_iovec_memset(QEMUIOVector *qiov, size_t offset,
                          int fillc, size_t bytes);
 
 bool buffer_is_zero(const void *buf, size_t len);
+long buffer_diff_copy(void *dst, const void *src, size_t chunk, long nr,
+                      unsigned long *todo, unsigned long *dirty);
 
 void qemu_progress_init(int enabled, float min_skip);
 void qemu_progress_end(void);
 void qemu_progress_print(float delta, int max);
+void qemu_progress_add_bytes(uint64_t bytes);
 const char *qemu_get_vm_name(void);
 
 #define QEMU_FILE_TYPE_BIOS   0
@@ -473,6 +477,11 @@ can_use_buffer_find_nonzero_offset(const void *buf, size_t len)
 }
 size_t buffer_find_nonzero_offset(const void *buf, size_t len);
 
+#if defined(CONFIG_AVX2_OPT) && defined(CONFIG_CPUID_H)
+/* True if both the CPU and the OS support AVX2 */
+bool host_cpu_has_avx2(void);
+#endif
+
 /*
  * helper to parse debug environment variables
  */
@@ -23,6 +23,21 @@ void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
 		     const unsigned long length, const AES_KEY *key,
 		     unsigned char *ivec, const int enc);
 
+/*
+ * CBC-encrypt or decrypt @nb_chunks consecutive chunks of @chunk_len bytes,
+ * a multiple of AES_BLOCK_SIZE, each with its own IV.  @ivecs holds the
+ * @nb_chunks IVs one after the other and is not modified.  @in and @out
+ * may be the same buffer.  With AES-NI, several chunks are encrypted in
+ * parallel.
+ */
+void AES_cbc_encrypt_chunks(const unsigned char *in, unsigned char *out,
+                            unsigned long nb_chunks, unsigned long chunk_len,
+                            const AES_KEY *key, const unsigned char *ivecs,
+                            const int enc);
+
+/* Whether the AES functions use the AES-NI instructions of the host */
+bool AES_accelerated(void);
+
 /*
 AES_Te0[x] = S [x].[02, 01, 01, 03];
 AES_Te1[x] = S [x].[03, 02, 01, 01];
@@ -129,6 +129,26 @@
 #define atomic_set(ptr, i)     ((*(__typeof__(*ptr) *volatile) (ptr)) = (i))
 #endif
 
+/* atomic_rcu_read loads a pointer that is published with atomic_rcu_set,
+ * so that it can be dereferenced in an RCU read-side critical section (see
+ * docs/rcu.txt).  atomic_rcu_set orders the initialization of the object
+ * before the store of the pointer.
+ */
+#ifndef atomic_rcu_read
+#define atomic_rcu_read(ptr)    ({          \
+    typeof(*ptr) _val = atomic_read(ptr);   \
+    smp_read_barrier_depends();             \
+    _val;                                   \
+})
+#endif
+
+#ifndef atomic_rcu_set
+#define atomic_rcu_set(ptr, i)  do {        \
+    smp_wmb();                              \
+    atomic_set(ptr, i);                     \
+} while (0)
+#endif
+
 /* These have the same semantics as Java volatile variables.
  * See http://gee.cs.oswego.edu/dl/jmm/cookbook.html:
  * "1. Issue a StoreStore barrier (wmb) before each volatile store."
@@ -80,6 +80,15 @@ bool hbitmap_empty(const HBitmap *hb);
  */
 int hbitmap_granularity(const HBitmap *hb);
 
+/**
+ * hbitmap_size:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the number of bits that can be set in the HBitmap, that is the
+ * size passed to hbitmap_alloc rounded up to the granularity.
+ */
+uint64_t hbitmap_size(const HBitmap *hb);
+
 /**
  * hbitmap_count:
  * @hb: HBitmap to operate on.
@@ -117,6 +126,96 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count);
  */
 bool hbitmap_get(const HBitmap *hb, uint64_t item);
 
+/**
+ * hbitmap_next_zero:
+ * @hb: HBitmap to operate on.
+ * @start: First bit to look at (0-based).
+ *
+ * Return the first bit at or after @start that is not set, rounded down
+ * to the granularity, or hbitmap_size(@hb) if all of them are set.
+ */
+uint64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start);
+
+/**
+ * hbitmap_merge:
+ * @a: HBitmap to operate on.
+ * @b: HBitmap to merge into @a.
+ *
+ * Set in @a every bit that is set in @b.  The two bitmaps must have the
+ * same size and granularity; return false, leaving @a untouched, if they
+ * do not.
+ */
+bool hbitmap_merge(HBitmap *a, const HBitmap *b);
+
+/**
+ * hbitmap_and:
+ * @a: HBitmap to operate on.
+ * @b: HBitmap to intersect @a with.
+ *
+ * Reset in @a every bit that is not set in @b.  Same requirements and
+ * return value as hbitmap_merge.
+ */
+bool hbitmap_and(HBitmap *a, const HBitmap *b);
+
+/**
+ * hbitmap_serialization_granularity:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the number of bits that a part passed to hbitmap_serialize_part
+ * and hbitmap_deserialize_part must be aligned to.  Only the end of the
+ * last part may be unaligned, at hbitmap_size(@hb).
+ */
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb);
+
+/**
+ * hbitmap_serialization_size:
+ * @hb: HBitmap to operate on.
+ * @start: First bit of the part (0-based).
+ * @count: Number of bits in the part.
+ *
+ * Return the number of bytes that hbitmap_serialize_part needs for the
+ * part.
+ */
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_serialize_part:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer of hbitmap_serialization_size() bytes.
+ * @start: First bit of the part (0-based).
+ * @count: Number of bits in the part.
+ *
+ * Store a part of the bitmap in @buf, one bit per group of 2^granularity
+ * bits, in an endianness-independent format.
+ */
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_deserialize_part:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer filled by hbitmap_serialize_part.
+ * @start: First bit of the part (0-based).
+ * @count: Number of bits in the part.
+ * @finish: Whether to call hbitmap_deserialize_finish.
+ *
+ * Replace a part of the bitmap with the contents of @buf.  The count and
+ * the upper levels of the bitmap are only updated by
+ * hbitmap_deserialize_finish, which must be called, once, after the last
+ * part and before the bitmap is used again.
+ */
+void hbitmap_deserialize_part(HBitmap *hb, const uint8_t *buf,
+                              uint64_t start, uint64_t count, bool finish);
+
+/**
+ * hbitmap_deserialize_finish:
+ * @hb: HBitmap to operate on.
+ *
+ * Rebuild the bitmap after hbitmap_deserialize_part.
+ */
+void hbitmap_deserialize_finish(HBitmap *hb);
+
 /**
  * hbitmap_free:
  * @hb: HBitmap to operate on.
@@ -205,5 +304,18 @@ static inline size_t hbitmap_iter_next_word(HBitmapIter *hbi, unsigned long *p_c
     return hbi->pos;
 }
 
+/**
+ * hbitmap_iter_next_extent:
+ * @hbi: HBitmapIter to operate on.
+ * @count: Location where to store the length of the extent.
+ *
+ * Return the first bit of the next run of set bits in @hbi's associated
+ * HBitmap and store its length, in bits, in *@count; the iterator is moved
+ * past the end of the run.  Return -1, and set *@count to zero, if all
+ * remaining bits are zero.  The cost is that of hbitmap_iter_next plus
+ * one word for every BITS_PER_LONG granules in the run.
+ */
+int64_t hbitmap_iter_next_extent(HBitmapIter *hbi, uint64_t *count);
+
 
 #endif
@@ -82,6 +82,14 @@ ssize_t iov_send_recv(int sockfd, struct iovec *iov, unsigned iov_cnt,
 #define iov_send(sockfd, iov, iov_cnt, offset, bytes) \
   iov_send_recv(sockfd, iov, iov_cnt, offset, bytes, true)
 
+/**
+ * Write the iovec to a file descriptor of any kind with one writev,
+ * restarting it after a signal.  Returns the number of bytes written,
+ * which may be short for a non-blocking descriptor, or -1 with errno set.
+ * At most IOV_MAX elements are written.
+ */
+ssize_t iov_writev(int fd, const struct iovec *iov, unsigned iov_cnt);
+
 /**
  * Produce a text hexdump of iovec `iov' with `iov_cnt' number of elements
  * in file `fp', prefixing each line with `prefix' and processing not more
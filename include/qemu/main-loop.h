@@ -299,6 +299,18 @@ void qemu_mutex_lock_iothread(void);
  */
 void qemu_mutex_unlock_iothread(void);
 
+/**
+ * qemu_mutex_iothread_locked: Return whether the calling thread holds the
+ * main loop mutex.
+ *
+ * This covers the vCPU threads, which hold the mutex while they run guest
+ * code, as well as threads that took it with qemu_mutex_lock_iothread().
+ * It lets code that runs both with and without the mutex, such as writes
+ * to a QEMUFile from the migration thread or to the HPET counter, take it
+ * only when needed.
+ */
+bool qemu_mutex_iothread_locked(void);
+
 /* internal interfaces */
 
 void qemu_fd_register(int fd);
@@ -0,0 +1,128 @@
+/*
+ * Read-copy-update
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_RCU_H
+#define QEMU_RCU_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <assert.h>
+#include "qemu/compiler.h"
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+
+/* Read-copy-update, as described in docs/rcu.txt.
+ *
+ * Readers bracket their accesses with rcu_read_lock() and rcu_read_unlock(),
+ * which never block and can be nested.  Writers publish a new version of a
+ * data structure with atomic_rcu_set() and free the old one only after
+ * every reader that could have seen it is done, either by waiting with
+ * synchronize_rcu() or by having call_rcu() free it later.
+ *
+ * Threads other than the main thread must call rcu_register_thread() before
+ * they enter a read-side critical section.
+ */
+
+/* Bit 0 of a reader's counter says that it is in a critical section; the
+ * rest is a copy of rcu_gp_ctr, which advances at each grace period.
+ */
+#define RCU_GP_LOCKED           (1UL << 0)
+#define RCU_GP_CTR              (1UL << 1)
+
+struct rcu_reader_data {
+    /* Written by the reader, read by synchronize_rcu() */
+    unsigned long ctr;
+    /* Set by synchronize_rcu() when it waits for this reader */
+    bool waiting;
+    /* Only used by the reader itself */
+    unsigned depth;
+    bool registered;
+    /* Protected by rcu_gp_lock */
+    QLIST_ENTRY(rcu_reader_data) node;
+};
+
+extern unsigned long rcu_gp_ctr;
+extern QemuEvent rcu_gp_event;
+extern __thread struct rcu_reader_data rcu_reader;
+
+static inline void rcu_read_lock(void)
+{
+    struct rcu_reader_data *p_rcu_reader = &rcu_reader;
+
+    if (p_rcu_reader->depth++ > 0) {
+        return;
+    }
+
+    /* synchronize_rcu() would not wait for an unregistered reader */
+    assert(p_rcu_reader->registered);
+
+    /* The exchange is a full barrier: the counter must be visible to
+     * synchronize_rcu() before the critical section reads anything.
+     */
+    atomic_xchg(&p_rcu_reader->ctr, atomic_read(&rcu_gp_ctr));
+}
+
+static inline void rcu_read_unlock(void)
+{
+    struct rcu_reader_data *p_rcu_reader = &rcu_reader;
+
+    assert(p_rcu_reader->depth != 0);
+    if (--p_rcu_reader->depth > 0) {
+        return;
+    }
+
+    atomic_xchg(&p_rcu_reader->ctr, 0);
+    if (unlikely(atomic_read(&p_rcu_reader->waiting))) {
+        atomic_set(&p_rcu_reader->waiting, false);
+        qemu_event_set(&rcu_gp_event);
+    }
+}
+
+/**
+ * synchronize_rcu: wait for a grace period
+ *
+ * Return once every read-side critical section that was running when the
+ * function was called has ended.  Must not be called inside a critical
+ * section.
+ */
+void synchronize_rcu(void);
+
+void rcu_register_thread(void);
+void rcu_unregister_thread(void);
+
+struct rcu_head;
+typedef void RCUCBFunc(struct rcu_head *head);
+
+struct rcu_head {
+    struct rcu_head *next;
+    RCUCBFunc *func;
+};
+
+void call_rcu1(struct rcu_head *head, RCUCBFunc *func);
+
+/**
+ * call_rcu: call a function after a grace period
+ *
+ * Call @func(@head) after every read-side critical section that may have
+ * seen @head has ended.  @field is the struct rcu_head member of *@head,
+ * and must be the first member so that @func can take a pointer to the
+ * containing structure.  Callbacks run in a separate thread, with the
+ * global mutex taken.
+ */
+#define call_rcu(head, func, field)                                       \
+    call_rcu1(({                                                          \
+        char __attribute__((unused))                                      \
+            offset_must_be_zero[-offsetof(typeof(*(head)), field)];       \
+        &(head)->field;                                                   \
+    }), (RCUCBFunc *)(func))
+
+#endif
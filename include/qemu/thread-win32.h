@@ -5,6 +5,11 @@
 struct QemuMutex {
     CRITICAL_SECTION lock;
     LONG owner;
+
+    /* Adaptive mutexes only, updated with the mutex held */
+    bool adaptive;
+    int spin;
+    uint64_t contended, slept;
 };
 
 struct QemuCond {
@@ -25,8 +25,19 @@ void qemu_mutex_lock(QemuMutex *mutex);
 int qemu_mutex_trylock(QemuMutex *mutex);
 void qemu_mutex_unlock(QemuMutex *mutex);
 
-#define rcu_read_lock() do { } while (0)
-#define rcu_read_unlock() do { } while (0)
+/* Like qemu_mutex_init, but when the mutex is contended qemu_mutex_lock
+ * spins for a while before sleeping, and counts how often that happens.
+ * Meant for locks that are taken often and held briefly, like the BQL.
+ */
+void qemu_mutex_init_adaptive(QemuMutex *mutex);
+
+typedef struct QemuMutexStats {
+    uint64_t contended;     /* qemu_mutex_lock found the mutex taken */
+    uint64_t slept;         /* ... and spinning was not enough */
+} QemuMutexStats;
+
+/* Contention statistics of an adaptive mutex; call with @mutex held */
+void qemu_mutex_get_stats(QemuMutex *mutex, QemuMutexStats *stats);
 
 void qemu_cond_init(QemuCond *cond);
 void qemu_cond_destroy(QemuCond *cond);
@@ -60,4 +71,33 @@ void qemu_thread_get_self(QemuThread *thread);
 bool qemu_thread_is_self(QemuThread *thread);
 void qemu_thread_exit(void *retval);
 
+typedef enum {
+    QEMU_THREAD_SCHED_DEFAULT,      /* keep what the thread inherited */
+    QEMU_THREAD_SCHED_OTHER,
+    QEMU_THREAD_SCHED_FIFO,
+    QEMU_THREAD_SCHED_RR,
+} QemuThreadSchedPolicy;
+
+/* Placement and scheduling policy of a thread, as given by the user.  An
+ * all-zero QemuThreadSched leaves the thread alone.
+ */
+typedef struct QemuThreadSched {
+    /* Host CPUs first_cpu..first_cpu + nr_cpus - 1, or any if nr_cpus == 0 */
+    int first_cpu, nr_cpus;
+    QemuThreadSchedPolicy policy;
+    int priority;
+} QemuThreadSched;
+
+/* Parse "cpu[-cpu]" into @sched.  Returns 0 or -EINVAL. */
+int qemu_thread_parse_affinity(QemuThreadSched *sched, const char *str);
+/* Parse "other|fifo|rr[:priority]" into @sched.  Returns 0 or -EINVAL. */
+int qemu_thread_parse_sched(QemuThreadSched *sched, const char *str);
+/* Apply @sched to the calling thread.  Returns 0 or a negative errno. */
+int qemu_thread_set_sched(const QemuThreadSched *sched);
+
+struct Notifier;
+/* Run @notifier when the calling thread exits (not called for main thread) */
+void qemu_thread_atexit_add(struct Notifier *notifier);
+void qemu_thread_atexit_remove(struct Notifier *notifier);
+
 #endif
@@ -59,7 +59,8 @@ struct QEMUTimer {
     QEMUTimerList *timer_list;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    uint64_t seq;               /* orders timers with the same expire_time */
+    int heap_index;             /* position in the active timer heap, or -1 */
     int scale;
 };
 
@@ -198,6 +199,29 @@ void qemu_clock_notify(QEMUClockType type);
  */
 void qemu_clock_enable(QEMUClockType type, bool enabled);
 
+/**
+ * qemu_clock_set_slack:
+ * @type: the clock type
+ * @slack_ns: the slack in nanoseconds, 0 to disable
+ *
+ * Allow the timers of a clock to fire up to @slack_ns nanoseconds late.
+ * The poll timeout computed by timerlist_deadline_ns() is rounded up to a
+ * multiple of @slack_ns, so that timers whose deadlines are close
+ * together are run by a single host wakeup.  Clocks that are not used
+ * for deadlines, such as vm_clock with icount, are not affected.
+ *
+ * Caller should hold BQL.
+ */
+void qemu_clock_set_slack(QEMUClockType type, int64_t slack_ns);
+
+/**
+ * qemu_clock_get_slack:
+ * @type: the clock type
+ *
+ * Returns: the slack of the clock in nanoseconds
+ */
+int64_t qemu_clock_get_slack(QEMUClockType type);
+
 /**
  * qemu_clock_warp:
  * @type: the clock type
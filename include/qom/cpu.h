@@ -131,6 +131,8 @@ typedef struct CPUClass {
 } CPUClass;
 
 struct KVMState;
+struct KVMExitStats;
+struct BQLStats;
 struct kvm_run;
 
 /**
@@ -197,6 +199,8 @@ struct CPUState {
     bool kvm_vcpu_dirty;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    struct KVMExitStats *kvm_exit_stats;
+    struct BQLStats *bql_stats;
 
     /* TODO Move common fields from CPUArchState here. */
     int cpu_index; /* used by alpha TCG */
@@ -344,7 +344,8 @@ typedef void (ObjectUnparent)(Object *obj);
  */
 typedef void (ObjectFree)(void *obj);
 
-#define OBJECT_CLASS_CAST_CACHE 4
+/* Slots in the per-class cache of successful casts, a power of two */
+#define OBJECT_CLASS_CAST_CACHE 16
 
 /**
  * ObjectClass:
@@ -384,6 +385,7 @@ struct Object
     ObjectClass *class;
     ObjectFree *free;
     QTAILQ_HEAD(, ObjectProperty) properties;
+    GHashTable *property_hash;
     uint32_t ref;
     Object *parent;
 };
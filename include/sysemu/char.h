@@ -56,6 +56,8 @@ typedef void IOEventHandler(void *opaque, int event);
 struct CharDriverState {
     void (*init)(struct CharDriverState *s);
     int (*chr_write)(struct CharDriverState *s, const uint8_t *buf, int len);
+    int (*chr_writev)(struct CharDriverState *s, const struct iovec *iov,
+                      int iovcnt);
     GSource *(*chr_add_watch)(struct CharDriverState *s, GIOCondition cond);
     void (*chr_update_read_handler)(struct CharDriverState *s);
     int (*chr_ioctl)(struct CharDriverState *s, int cmd, void *arg);
@@ -80,6 +82,9 @@ struct CharDriverState {
     int avail_connections;
     int is_mux;
     guint fd_in_tag;
+    GMainContext *context;      /* where watches go, NULL for the main loop */
+    uint8_t *read_buf;          /* for backends that read from a file */
+    int read_buf_len;
     QemuOpts *opts;
     QTAILQ_ENTRY(CharDriverState) next;
 };
@@ -160,6 +165,17 @@ void qemu_chr_fe_printf(CharDriverState *s, const char *fmt, ...)
 int qemu_chr_fe_add_watch(CharDriverState *s, GIOCondition cond,
                           GIOFunc func, void *user_data);
 
+/**
+ * @qemu_chr_fe_set_context:
+ *
+ * Run the read handlers, and the callbacks of qemu_chr_fe_add_watch, in
+ * @context instead of the main loop.  The frontend must then take care of
+ * its own locking.  Accepting connections still happens in the main loop.
+ *
+ * Returns: 0 on success, -ENOTSUP if the backend does not support it
+ */
+int qemu_chr_fe_set_context(CharDriverState *s, GMainContext *context);
+
 /**
  * @qemu_chr_fe_write:
  *
@@ -173,6 +189,22 @@ int qemu_chr_fe_add_watch(CharDriverState *s, GIOCondition cond,
  */
 int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len);
 
+/**
+ * @qemu_chr_fe_writev:
+ *
+ * Write a scatter/gather list to a character backend from the front end.
+ * Backends that can, send all of it with one system call.  Like
+ * @qemu_chr_fe_write, this function does not block; on a short write, the
+ * caller should wait with @qemu_chr_fe_add_watch and resend the rest.
+ *
+ * @iov the data
+ * @iovcnt the number of elements in @iov
+ *
+ * Returns: the number of bytes consumed, or -1 if none could be
+ */
+int qemu_chr_fe_writev(CharDriverState *s, const struct iovec *iov,
+                       int iovcnt);
+
 /**
  * @qemu_chr_fe_write_all:
  *
@@ -13,6 +13,9 @@ void cpu_synchronize_all_post_init(void);
 
 void qtest_clock_warp(int64_t dest);
 
+/* Parse the -smp affinity and sched options.  Returns 0 or -EINVAL. */
+int qemu_set_vcpu_sched(const char *affinity, const char *sched);
+
 #ifndef CONFIG_USER_ONLY
 /* vl.c */
 extern int smp_cores;
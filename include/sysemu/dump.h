@@ -14,6 +14,103 @@
 #ifndef DUMP_H
 #define DUMP_H
 
+/* kdump-compressed format, as written by makedumpfile */
+#define KDUMP_SIGNATURE             "KDUMP   "
+#define KDUMP_SIG_LEN               (sizeof(KDUMP_SIGNATURE) - 1)
+#define KDUMP_HEADER_VERSION        6
+#define KDUMP_DUMP_LEVEL            1       /* zero pages are not stored */
+#define KDUMP_DH_COMPRESSED_ZLIB    0x1
+#define KDUMP_NEW_UTS_LEN           65
+
+typedef struct NewUtsname {
+    char sysname[KDUMP_NEW_UTS_LEN];
+    char nodename[KDUMP_NEW_UTS_LEN];
+    char release[KDUMP_NEW_UTS_LEN];
+    char version[KDUMP_NEW_UTS_LEN];
+    char machine[KDUMP_NEW_UTS_LEN];
+    char domainname[KDUMP_NEW_UTS_LEN];
+} NewUtsname;
+
+typedef struct QEMU_PACKED DiskDumpHeader32 {
+    char signature[KDUMP_SIG_LEN];
+    uint32_t header_version;
+    NewUtsname utsname;
+    char pad1[2];
+    uint32_t timestamp_sec;
+    uint32_t timestamp_usec;
+    uint32_t status;
+    uint32_t block_size;
+    uint32_t sub_hdr_size;          /* in blocks */
+    uint32_t bitmap_blocks;
+    uint32_t max_mapnr;             /* obsolete, see max_mapnr_64 */
+    uint32_t total_ram_blocks;
+    uint32_t device_blocks;
+    uint32_t written_blocks;
+    uint32_t current_cpu;
+    uint32_t nr_cpus;
+} DiskDumpHeader32;
+
+typedef struct QEMU_PACKED DiskDumpHeader64 {
+    char signature[KDUMP_SIG_LEN];
+    uint32_t header_version;
+    NewUtsname utsname;
+    char pad1[6];
+    uint64_t timestamp_sec;
+    uint64_t timestamp_usec;
+    uint32_t status;
+    uint32_t block_size;
+    uint32_t sub_hdr_size;
+    uint32_t bitmap_blocks;
+    uint32_t max_mapnr;
+    uint32_t total_ram_blocks;
+    uint32_t device_blocks;
+    uint32_t written_blocks;
+    uint32_t current_cpu;
+    uint32_t nr_cpus;
+} DiskDumpHeader64;
+
+typedef struct QEMU_PACKED KdumpSubHeader32 {
+    uint32_t phys_base;
+    uint32_t dump_level;
+    uint32_t split;
+    uint32_t start_pfn;
+    uint32_t end_pfn;
+    uint64_t offset_vmcoreinfo;
+    uint32_t size_vmcoreinfo;
+    uint64_t offset_note;
+    uint32_t size_note;
+    uint64_t offset_eraseinfo;
+    uint32_t size_eraseinfo;
+    uint64_t start_pfn_64;
+    uint64_t end_pfn_64;
+    uint64_t max_mapnr_64;
+} KdumpSubHeader32;
+
+typedef struct QEMU_PACKED KdumpSubHeader64 {
+    uint64_t phys_base;
+    uint32_t dump_level;
+    uint32_t split;
+    uint64_t start_pfn;
+    uint64_t end_pfn;
+    uint64_t offset_vmcoreinfo;
+    uint64_t size_vmcoreinfo;
+    uint64_t offset_note;
+    uint64_t size_note;
+    uint64_t offset_eraseinfo;
+    uint64_t size_eraseinfo;
+    uint64_t start_pfn_64;
+    uint64_t end_pfn_64;
+    uint64_t max_mapnr_64;
+} KdumpSubHeader64;
+
+/* One per dumped page, in page frame order */
+typedef struct QEMU_PACKED PageDescriptor {
+    uint64_t offset;                /* of the page data in the file */
+    uint32_t size;                  /* of the page data */
+    uint32_t flags;                 /* KDUMP_DH_COMPRESSED_*, or 0 */
+    uint64_t page_flags;
+} PageDescriptor;
+
 typedef struct ArchDumpInfo {
     int d_machine;  /* Architecture */
     int d_endian;   /* ELFDATA2LSB or ELFDATA2MSB */
@@ -25,4 +122,7 @@ int cpu_get_dump_info(ArchDumpInfo *info,
                       const struct GuestPhysBlockList *guest_phys_blocks);
 ssize_t cpu_get_note_size(int class, int machine, int nr_cpus);
 
+/* A detached dump is being written; the guest must stay paused */
+bool dump_in_progress(void);
+
 #endif
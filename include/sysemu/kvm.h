@@ -312,6 +312,21 @@ static inline void cpu_synchronize_post_init(CPUState *cpu)
 int kvm_irqchip_add_msi_route(KVMState *s, MSIMessage msg);
 int kvm_irqchip_update_msi_route(KVMState *s, int virq, MSIMessage msg);
 void kvm_irqchip_release_virq(KVMState *s, int virq);
+void kvm_irqchip_begin_route_changes(KVMState *s);
+void kvm_irqchip_end_route_changes(KVMState *s);
+
+typedef struct KVMMSIRouteStats {
+    bool direct_msi;        /* KVM_SIGNAL_MSI is available */
+    uint64_t direct;        /* MSIs sent with KVM_SIGNAL_MSI */
+    uint64_t hits;          /* MSIs sent through an existing dynamic route */
+    uint64_t misses;        /* MSIs that needed a new dynamic route */
+    uint64_t evictions;     /* dynamic routes dropped to make room */
+    uint64_t commits;       /* KVM_SET_GSI_ROUTING calls */
+    unsigned int routes;    /* entries in the routing table */
+    unsigned int gsi_count;
+} KVMMSIRouteStats;
+
+void kvm_irqchip_get_msi_stats(KVMMSIRouteStats *stats);
 
 int kvm_irqchip_add_irqfd_notifier(KVMState *s, EventNotifier *n,
                                    EventNotifier *rn, int virq);
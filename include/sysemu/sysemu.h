@@ -83,8 +83,18 @@ void qemu_savevm_state_begin(QEMUFile *f,
                              const MigrationParams *params);
 int qemu_savevm_state_iterate(QEMUFile *f);
 void qemu_savevm_state_complete(QEMUFile *f);
+void qemu_savevm_state_postcopy_start(QEMUFile *f);
+void qemu_savevm_state_complete_postcopy(QEMUFile *f);
+void qemu_savevm_send_postcopy_ram_discard(QEMUFile *f, const char *name,
+                                           uint16_t nranges,
+                                           uint64_t *start_list,
+                                           uint64_t *length_list);
 void qemu_savevm_state_cancel(void);
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size);
+/* qemu_loadvm_state returned with the postcopy listen thread still
+ * loading RAM in the background; it owns the QEMUFile.
+ */
+#define LOADVM_POSTCOPY_RUNNING 1
 int qemu_loadvm_state(QEMUFile *f);
 
 /* SLIRP */
@@ -101,6 +111,7 @@ typedef enum DisplayType
 } DisplayType;
 
 extern int autostart;
+extern int mem_share;
 
 typedef enum {
     VGA_NONE, VGA_STD, VGA_CIRRUS, VGA_VMWARE, VGA_XENFB, VGA_QXL,
@@ -118,6 +129,11 @@ extern int win2k_install_hack;
 extern int alt_grab;
 extern int ctrl_grab;
 extern int smp_cpus;
+/* Memory hotplug: the number of DIMM slots, and the RAM size with all of
+ * them populated; maxram_size is ram_size without slots.
+ */
+extern int ram_slots;
+extern uint64_t maxram_size;
 extern int max_cpus;
 extern int cursor_hide;
 extern int graphic_rotate;
@@ -136,6 +152,10 @@ extern QEMUClockType rtc_clock;
 extern int nb_numa_nodes;
 extern uint64_t node_mem[MAX_NODES];
 extern unsigned long *node_cpumask[MAX_NODES];
+void memory_region_allocate_system_memory(MemoryRegion *mr,
+                                          struct Object *owner,
+                                          const char *name,
+                                          uint64_t ram_size);
 
 #define MAX_OPTION_ROMS 16
 typedef struct QEMUOptionRom {
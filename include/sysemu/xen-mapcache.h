@@ -14,6 +14,16 @@
 typedef hwaddr (*phys_offset_to_gaddr_t)(hwaddr start_addr,
                                                      ram_addr_t size,
                                                      void *opaque);
+
+typedef struct XenMapCacheStats {
+    uint64_t hits;          /* lookups answered by an existing mapping */
+    uint64_t misses;        /* lookups that had to map guest memory */
+    uint64_t remaps;        /* calls to xc_map_foreign_bulk */
+    uint64_t evictions;     /* mappings dropped to stay under max_size */
+    uint64_t mapped_size;
+    uint64_t max_size;
+} XenMapCacheStats;
+
 #ifdef CONFIG_XEN
 
 void xen_map_cache_init(phys_offset_to_gaddr_t f,
@@ -23,6 +33,7 @@ uint8_t *xen_map_cache(hwaddr phys_addr, hwaddr size,
 ram_addr_t xen_ram_addr_from_mapcache(void *ptr);
 void xen_invalidate_map_cache_entry(uint8_t *buffer);
 void xen_invalidate_map_cache(void);
+void xen_map_cache_get_stats(XenMapCacheStats *stats);
 
 #else
 
@@ -51,6 +62,11 @@ static inline void xen_invalidate_map_cache(void)
 {
 }
 
+static inline void xen_map_cache_get_stats(XenMapCacheStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
 #endif
 
 #endif /* !XEN_MAPCACHE_H */
@@ -109,6 +109,7 @@ struct QemuConsoleClass {
 
 #define QEMU_BIG_ENDIAN_FLAG    0x01
 #define QEMU_ALLOCATED_FLAG     0x02
+#define QEMU_SHM_FLAG           0x04
 
 struct PixelFormat {
     uint8_t bits_per_pixel;
@@ -126,6 +127,10 @@ struct DisplaySurface {
     uint8_t flags;
 
     struct PixelFormat pf;
+
+    /* Shared memory segment holding the pixels, if QEMU_SHM_FLAG is set */
+    int shm_fd;
+    size_t shm_size;
 };
 
 /* cursor data format is 32bit RGBA */
@@ -193,6 +198,9 @@ PixelFormat qemu_default_pixelformat(int bpp);
 
 DisplaySurface *qemu_create_displaysurface(int width, int height);
 void qemu_free_displaysurface(DisplaySurface *surface);
+void *qemu_display_shm_alloc(size_t size, int *fd);
+void qemu_display_shm_free(void *data, size_t size, int fd);
+void qemu_displaysurface_use_shm(void);
 
 static inline int is_surface_bgr(DisplaySurface *surface)
 {
@@ -282,6 +290,7 @@ QemuConsole *graphic_console_init(DeviceState *dev,
 
 void graphic_hw_update(QemuConsole *con);
 void graphic_hw_invalidate(QemuConsole *con);
+void console_info(Monitor *mon, const QDict *qdict);
 void graphic_hw_text_update(QemuConsole *con, console_ch_t *chardata);
 
 QemuConsole *qemu_console_lookup_by_index(unsigned int index);
@@ -332,6 +341,9 @@ static inline int vnc_display_pw_expire(DisplayState *ds, time_t expires)
 /* curses.c */
 void curses_display_init(DisplayState *ds, int full_screen);
 
+/* shm.c */
+void shm_display_init(DisplayState *ds, const char *path, Error **errp);
+
 /* input.c */
 int index_from_key(const char *key);
 int index_from_keycode(int code);
@@ -0,0 +1,226 @@
+/*
+ * Event loop thread
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * An IOThread runs the event loop of its own AioContext.  Devices that are
+ * given an IOThread with their "iothread" property process I/O in it, so
+ * that several devices can share one host thread, or be spread across
+ * several, as the user sees fit.
+ */
+
+#include "qemu-common.h"
+#include "qom/object.h"
+#include "qemu/module.h"
+#include "qapi/visitor.h"
+#include "sysemu/iothread.h"
+#include "qemu/rcu.h"
+#include "qmp-commands.h"
+
+#define IOTHREADS_PATH "/objects"
+
+static void *iothread_run(void *opaque)
+{
+    IOThread *iothread = opaque;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock(&iothread->init_done_lock);
+    iothread->thread_id = qemu_get_thread_id();
+    qemu_cond_signal(&iothread->init_done_cond);
+    qemu_mutex_unlock(&iothread->init_done_lock);
+
+    /* Devices and the main loop acquire our AioContext to access it, and
+     * their contention callback makes aio_poll() return false right away.
+     */
+    while (!atomic_read(&iothread->stopping)) {
+        aio_context_acquire(iothread->ctx);
+        while (!atomic_read(&iothread->stopping) &&
+               aio_poll(iothread->ctx, true)) {
+            /* Progress was made, keep going */
+        }
+        aio_context_release(iothread->ctx);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static int64_t *iothread_poll_param(IOThread *iothread, const char *name)
+{
+    if (!strcmp(name, "poll-max-ns")) {
+        return &iothread->poll_max_ns;
+    } else if (!strcmp(name, "poll-grow")) {
+        return &iothread->poll_grow;
+    } else {
+        return &iothread->poll_shrink;
+    }
+}
+
+static void iothread_get_poll_param(Object *obj, Visitor *v, void *opaque,
+                                    const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    visit_type_int64(v, iothread_poll_param(iothread, name), name, errp);
+}
+
+static void iothread_set_poll_param(Object *obj, Visitor *v, void *opaque,
+                                    const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int64(v, &value, name, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    if (value < 0) {
+        error_setg(errp, "%s must not be negative", name);
+        return;
+    }
+
+    /* The polling parameters can be changed while the thread runs */
+    *iothread_poll_param(iothread, name) = value;
+    aio_context_acquire(iothread->ctx);
+    aio_context_set_poll_params(iothread->ctx, iothread->poll_max_ns,
+                                iothread->poll_grow, iothread->poll_shrink);
+    aio_context_release(iothread->ctx);
+}
+
+static void iothread_instance_init(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->stopping = false;
+    iothread->thread_id = -1;
+    iothread->ctx = aio_context_new();
+
+    qemu_mutex_init(&iothread->init_done_lock);
+    qemu_cond_init(&iothread->init_done_cond);
+
+    /* This assumes we are called from a thread with useful CPU affinity for
+     * us to inherit.
+     */
+    qemu_thread_create(&iothread->thread, iothread_run,
+                       iothread, QEMU_THREAD_JOINABLE);
+
+    /* Wait for initialization to complete */
+    qemu_mutex_lock(&iothread->init_done_lock);
+    while (iothread->thread_id == -1) {
+        qemu_cond_wait(&iothread->init_done_cond,
+                       &iothread->init_done_lock);
+    }
+    qemu_mutex_unlock(&iothread->init_done_lock);
+
+    object_property_add(obj, "poll-max-ns", "int",
+                        iothread_get_poll_param, iothread_set_poll_param,
+                        NULL, NULL, NULL);
+    object_property_add(obj, "poll-grow", "int",
+                        iothread_get_poll_param, iothread_set_poll_param,
+                        NULL, NULL, NULL);
+    object_property_add(obj, "poll-shrink", "int",
+                        iothread_get_poll_param, iothread_set_poll_param,
+                        NULL, NULL, NULL);
+}
+
+static void iothread_instance_finalize(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    atomic_mb_set(&iothread->stopping, true);
+    aio_notify(iothread->ctx);
+    qemu_thread_join(&iothread->thread);
+    qemu_cond_destroy(&iothread->init_done_cond);
+    qemu_mutex_destroy(&iothread->init_done_lock);
+    aio_context_unref(iothread->ctx);
+}
+
+static const TypeInfo iothread_info = {
+    .name = TYPE_IOTHREAD,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(IOThread),
+    .instance_init = iothread_instance_init,
+    .instance_finalize = iothread_instance_finalize,
+};
+
+static void iothread_register_types(void)
+{
+    type_register_static(&iothread_info);
+}
+
+type_init(iothread_register_types)
+
+IOThread *iothread_find(const char *id)
+{
+    Object *container = container_get(object_get_root(), IOTHREADS_PATH);
+    Object *child;
+
+    child = object_resolve_path_component(container, id);
+    if (!child) {
+        return NULL;
+    }
+    return (IOThread *)object_dynamic_cast(child, TYPE_IOTHREAD);
+}
+
+char *iothread_get_id(IOThread *iothread)
+{
+    char *path = object_get_canonical_path(OBJECT(iothread));
+    char *id = g_strdup(strrchr(path, '/') + 1);
+
+    g_free(path);
+    return id;
+}
+
+AioContext *iothread_get_aio_context(IOThread *iothread)
+{
+    return iothread->ctx;
+}
+
+static int query_one_iothread(Object *object, void *opaque)
+{
+    IOThreadInfoList ***prev = opaque;
+    IOThreadInfoList *elem;
+    IOThreadInfo *info;
+    IOThread *iothread;
+    AioPollStats stats;
+
+    iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
+    if (!iothread) {
+        return 0;
+    }
+
+    aio_context_get_poll_stats(iothread->ctx, &stats);
+
+    info = g_new0(IOThreadInfo, 1);
+    info->id = iothread_get_id(iothread);
+    info->thread_id = iothread->thread_id;
+    info->poll_max_ns = iothread->poll_max_ns;
+    info->poll_ns = stats.poll_ns;
+    info->poll_attempts = stats.attempts;
+    info->poll_successes = stats.successes;
+    info->poll_time_ns = stats.time_ns;
+
+    elem = g_new0(IOThreadInfoList, 1);
+    elem->value = info;
+    elem->next = NULL;
+
+    **prev = elem;
+    *prev = &elem->next;
+    return 0;
+}
+
+IOThreadInfoList *qmp_query_iothreads(Error **errp)
+{
+    IOThreadInfoList *head = NULL;
+    IOThreadInfoList **prev = &head;
+    Object *container = container_get(object_get_root(), IOTHREADS_PATH);
+
+    object_child_foreach(container, query_one_iothread, &prev);
+    return head;
+}
@@ -32,7 +32,10 @@
 #include "qemu/bswap.h"
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
+#include "exec/ram_addr.h"
 #include "qemu/event_notifier.h"
+#include "qemu/timer.h"
+#include "qmp-commands.h"
 #include "trace.h"
 
 /* This check must be after config-host.h is included */
@@ -77,6 +80,7 @@ struct KVMState
     int fd;
     int vmfd;
     int coalesced_mmio;
+    bool coalesced_pio;
     struct kvm_coalesced_mmio_ring *coalesced_mmio_ring;
     bool coalesced_flush_in_progress;
     int broken_set_mem_region;
@@ -101,7 +105,13 @@ struct KVMState
     uint32_t *used_gsi_bitmap;
     unsigned int gsi_count;
     QTAILQ_HEAD(msi_hashtab, KVMMSIRoute) msi_hashtab[KVM_MSI_HASHTAB_SIZE];
+    /* Dynamic MSI routes, least recently used first */
+    QTAILQ_HEAD(, KVMMSIRoute) msi_lru;
     bool direct_msi;
+    /* Nesting of kvm_irqchip_begin_route_changes() */
+    int route_batch;
+    bool routes_dirty;
+    KVMMSIRouteStats msi_stats;
 #endif
 };
 
@@ -220,6 +230,235 @@ static int kvm_set_user_memory_region(KVMState *s, KVMSlot *slot)
     return kvm_vm_ioctl(s, KVM_SET_USER_MEMORY_REGION, &mem);
 }
 
+/*
+ * Exit statistics
+ *
+ * Every vCPU counts its exits by reason.  While profiling is on, the MMIO
+ * and PIO exits that are dispatched under the global lock are also
+ * counted by address, together with the time spent in the device model.
+ * The counters are only written by the vCPU thread, and the address
+ * tables are only used with the global lock held.
+ */
+
+static const char *const kvm_exit_reason_names[] = {
+    [KVM_EXIT_UNKNOWN] = "unknown",
+    [KVM_EXIT_EXCEPTION] = "exception",
+    [KVM_EXIT_IO] = "io",
+    [KVM_EXIT_HYPERCALL] = "hypercall",
+    [KVM_EXIT_DEBUG] = "debug",
+    [KVM_EXIT_HLT] = "hlt",
+    [KVM_EXIT_MMIO] = "mmio",
+    [KVM_EXIT_IRQ_WINDOW_OPEN] = "irq-window-open",
+    [KVM_EXIT_SHUTDOWN] = "shutdown",
+    [KVM_EXIT_FAIL_ENTRY] = "fail-entry",
+    [KVM_EXIT_INTR] = "intr",
+    [KVM_EXIT_SET_TPR] = "set-tpr",
+    [KVM_EXIT_TPR_ACCESS] = "tpr-access",
+    [KVM_EXIT_S390_SIEIC] = "s390-sieic",
+    [KVM_EXIT_S390_RESET] = "s390-reset",
+    [KVM_EXIT_DCR] = "dcr",
+    [KVM_EXIT_NMI] = "nmi",
+    [KVM_EXIT_INTERNAL_ERROR] = "internal-error",
+    [KVM_EXIT_OSI] = "osi",
+    [KVM_EXIT_PAPR_HCALL] = "papr-hcall",
+    [KVM_EXIT_S390_UCONTROL] = "s390-ucontrol",
+    [KVM_EXIT_WATCHDOG] = "watchdog",
+    [KVM_EXIT_S390_TSCH] = "s390-tsch",
+    [KVM_EXIT_EPR] = "epr",
+};
+
+#define KVM_EXIT_REASONS        ARRAY_SIZE(kvm_exit_reason_names)
+
+/* Addresses profiled per vCPU; exits to further addresses are dropped */
+#define KVM_EXIT_PROFILE_MAX    4096
+#define KVM_EXIT_PROFILE_PIO    (1ULL << 63)
+
+typedef struct KVMExitAddr {
+    uint64_t key;           /* address, or port | KVM_EXIT_PROFILE_PIO */
+    uint64_t count;
+    uint64_t time_ns;
+} KVMExitAddr;
+
+struct KVMExitStats {
+    /* The last entry counts reasons without a name */
+    uint64_t count[KVM_EXIT_REASONS + 1];
+    GHashTable *addrs;
+    uint64_t dropped;
+};
+
+static bool kvm_exit_profile;
+
+static void kvm_count_exit(CPUState *cpu, int run_ret)
+{
+    uint64_t *count = cpu->kvm_exit_stats->count;
+    uint32_t reason;
+
+    if (run_ret >= 0) {
+        reason = cpu->kvm_run->exit_reason;
+    } else if (run_ret == -EINTR || run_ret == -EAGAIN) {
+        reason = KVM_EXIT_INTR;
+    } else {
+        return;
+    }
+    count[MIN(reason, KVM_EXIT_REASONS)]++;
+}
+
+static void kvm_profile_exit(CPUState *cpu, uint64_t key, int64_t start_ns)
+{
+    struct KVMExitStats *stats = cpu->kvm_exit_stats;
+    KVMExitAddr *addr;
+
+    addr = g_hash_table_lookup(stats->addrs, &key);
+    if (!addr) {
+        if (g_hash_table_size(stats->addrs) >= KVM_EXIT_PROFILE_MAX) {
+            stats->dropped++;
+            return;
+        }
+        addr = g_new0(KVMExitAddr, 1);
+        addr->key = key;
+        g_hash_table_insert(stats->addrs, &addr->key, addr);
+    }
+    addr->count++;
+    addr->time_ns += get_clock() - start_ns;
+}
+
+void qmp_kvm_exit_profile(bool enable, Error **errp)
+{
+    struct KVMExitStats *stats;
+    CPUState *cpu;
+
+    if (!kvm_enabled()) {
+        error_setg(errp, "KVM is not in use");
+        return;
+    }
+
+    /* Turning profiling on starts from scratch.  Turning it off keeps the
+     * data, so that it can still be queried.
+     */
+    if (enable) {
+        CPU_FOREACH(cpu) {
+            stats = cpu->kvm_exit_stats;
+            if (!stats) {
+                continue;
+            }
+            if (stats->addrs) {
+                g_hash_table_remove_all(stats->addrs);
+            } else {
+                stats->addrs = g_hash_table_new_full(g_int64_hash,
+                                                     g_int64_equal,
+                                                     NULL, g_free);
+            }
+            stats->dropped = 0;
+        }
+    }
+    kvm_exit_profile = enable;
+}
+
+static gint kvm_exit_addr_cmp(gconstpointer a, gconstpointer b)
+{
+    const KVMExitAddr *pa = *(KVMExitAddr **)a;
+    const KVMExitAddr *pb = *(KVMExitAddr **)b;
+
+    return pa->count < pb->count ? 1 : pa->count > pb->count ? -1 : 0;
+}
+
+static KvmExitAddress *kvm_exit_address(KVMExitAddr *addr)
+{
+    KvmExitAddress *info = g_new0(KvmExitAddress, 1);
+    MemoryRegionSection section;
+    bool pio = addr->key & KVM_EXIT_PROFILE_PIO;
+
+    info->space = g_strdup(pio ? "pio" : "mmio");
+    info->address = addr->key & ~KVM_EXIT_PROFILE_PIO;
+    info->count = addr->count;
+    info->time_ns = addr->time_ns;
+
+    /* The region is looked up now; the address may have been remapped
+     * since the exits happened.
+     */
+    section = memory_region_find(pio ? get_system_io() : get_system_memory(),
+                                 info->address, 1);
+    if (section.mr) {
+        if (memory_region_name(section.mr)) {
+            info->has_region = true;
+            info->region = g_strdup(memory_region_name(section.mr));
+        }
+        memory_region_unref(section.mr);
+    }
+    return info;
+}
+
+static KvmExitInfo *kvm_exit_info(CPUState *cpu)
+{
+    struct KVMExitStats *stats = cpu->kvm_exit_stats;
+    KvmExitInfo *info = g_new0(KvmExitInfo, 1);
+    KvmExitCountList *count, **count_tail = &info->exits;
+    KvmExitAddressList *addr, **addr_tail = &info->addresses;
+    GHashTableIter iter;
+    GPtrArray *sorted;
+    KVMExitAddr *p;
+    int i;
+
+    info->cpu = cpu->cpu_index;
+    for (i = 0; i <= KVM_EXIT_REASONS; i++) {
+        if (!stats->count[i]) {
+            continue;
+        }
+        count = g_new0(KvmExitCountList, 1);
+        count->value = g_new0(KvmExitCount, 1);
+        count->value->reason = g_strdup(i < KVM_EXIT_REASONS &&
+                                        kvm_exit_reason_names[i] ?
+                                        kvm_exit_reason_names[i] : "other");
+        count->value->count = stats->count[i];
+        *count_tail = count;
+        count_tail = &count->next;
+    }
+
+    if (!stats->addrs) {
+        return info;
+    }
+    info->has_addresses = true;
+    info->has_dropped = true;
+    info->dropped = stats->dropped;
+
+    sorted = g_ptr_array_new();
+    g_hash_table_iter_init(&iter, stats->addrs);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&p)) {
+        g_ptr_array_add(sorted, p);
+    }
+    g_ptr_array_sort(sorted, kvm_exit_addr_cmp);
+    for (i = 0; i < sorted->len; i++) {
+        addr = g_new0(KvmExitAddressList, 1);
+        addr->value = kvm_exit_address(g_ptr_array_index(sorted, i));
+        *addr_tail = addr;
+        addr_tail = &addr->next;
+    }
+    g_ptr_array_free(sorted, TRUE);
+    return info;
+}
+
+KvmExitInfoList *qmp_query_kvm_exits(Error **errp)
+{
+    KvmExitInfoList *head = NULL, **tail = &head, *entry;
+    CPUState *cpu;
+
+    if (!kvm_enabled()) {
+        error_setg(errp, "KVM is not in use");
+        return NULL;
+    }
+
+    CPU_FOREACH(cpu) {
+        if (!cpu->kvm_exit_stats) {
+            continue;
+        }
+        entry = g_new0(KvmExitInfoList, 1);
+        entry->value = kvm_exit_info(cpu);
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
 static void kvm_reset_vcpu(void *opaque)
 {
     CPUState *cpu = opaque;
@@ -244,6 +483,12 @@ int kvm_init_vcpu(CPUState *cpu)
     cpu->kvm_fd = ret;
     cpu->kvm_state = s;
     cpu->kvm_vcpu_dirty = true;
+    cpu->kvm_exit_stats = g_new0(struct KVMExitStats, 1);
+    if (kvm_exit_profile) {
+        cpu->kvm_exit_stats->addrs = g_hash_table_new_full(g_int64_hash,
+                                                           g_int64_equal,
+                                                           NULL, g_free);
+    }
 
     mmap_size = kvm_ioctl(s, KVM_GET_VCPU_MMAP_SIZE, 0);
     if (mmap_size < 0) {
@@ -379,31 +624,11 @@ static int kvm_set_migration_log(int enable)
 static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
                                          unsigned long *bitmap)
 {
-    unsigned int i, j;
-    unsigned long page_number, c;
-    hwaddr addr, addr1;
-    unsigned int pages = int128_get64(section->size) / getpagesize();
-    unsigned int len = (pages + HOST_LONG_BITS - 1) / HOST_LONG_BITS;
-    unsigned long hpratio = getpagesize() / TARGET_PAGE_SIZE;
+    ram_addr_t start = section->offset_within_region +
+                       memory_region_get_ram_addr(section->mr);
+    ram_addr_t pages = int128_get64(section->size) / getpagesize();
 
-    /*
-     * bitmap-traveling is faster than memory-traveling (for addr...)
-     * especially when most of the memory is not dirty.
-     */
-    for (i = 0; i < len; i++) {
-        if (bitmap[i] != 0) {
-            c = leul_to_cpu(bitmap[i]);
-            do {
-                j = ffsl(c) - 1;
-                c &= ~(1ul << j);
-                page_number = (i * HOST_LONG_BITS + j) * hpratio;
-                addr1 = page_number * TARGET_PAGE_SIZE;
-                addr = section->offset_within_region + addr1;
-                memory_region_set_dirty(section->mr, addr,
-                                        TARGET_PAGE_SIZE * hpratio);
-            } while (c != 0);
-        }
-    }
+    cpu_physical_memory_set_dirty_lebitmap(bitmap, start, pages);
     return 0;
 }
 
@@ -507,6 +732,40 @@ static void kvm_uncoalesce_mmio_region(MemoryListener *listener,
     }
 }
 
+static void kvm_coalesce_pio_add(MemoryListener *listener,
+                                 MemoryRegionSection *section,
+                                 hwaddr start, hwaddr size)
+{
+    KVMState *s = kvm_state;
+
+    if (s->coalesced_pio) {
+        struct kvm_coalesced_mmio_zone zone;
+
+        zone.addr = start;
+        zone.size = size;
+        zone.pio = 1;
+
+        (void)kvm_vm_ioctl(s, KVM_REGISTER_COALESCED_MMIO, &zone);
+    }
+}
+
+static void kvm_coalesce_pio_del(MemoryListener *listener,
+                                 MemoryRegionSection *section,
+                                 hwaddr start, hwaddr size)
+{
+    KVMState *s = kvm_state;
+
+    if (s->coalesced_pio) {
+        struct kvm_coalesced_mmio_zone zone;
+
+        zone.addr = start;
+        zone.size = size;
+        zone.pio = 1;
+
+        (void)kvm_vm_ioctl(s, KVM_UNREGISTER_COALESCED_MMIO, &zone);
+    }
+}
+
 int kvm_check_extension(KVMState *s, unsigned int extension)
 {
     int ret;
@@ -916,6 +1175,8 @@ static MemoryListener kvm_memory_listener = {
 static MemoryListener kvm_io_listener = {
     .eventfd_add = kvm_io_ioeventfd_add,
     .eventfd_del = kvm_io_ioeventfd_del,
+    .coalesced_mmio_add = kvm_coalesce_pio_add,
+    .coalesced_mmio_del = kvm_coalesce_pio_del,
     .priority = 10,
 };
 
@@ -950,6 +1211,7 @@ int kvm_set_irq(KVMState *s, int irq, int level)
 typedef struct KVMMSIRoute {
     struct kvm_irq_routing_entry kroute;
     QTAILQ_ENTRY(KVMMSIRoute) entry;
+    QTAILQ_ENTRY(KVMMSIRoute) lru;
 } KVMMSIRoute;
 
 static void set_gsi(KVMState *s, unsigned int gsi)
@@ -988,6 +1250,7 @@ void kvm_init_irq_routing(KVMState *s)
         for (i = 0; i < KVM_MSI_HASHTAB_SIZE; i++) {
             QTAILQ_INIT(&s->msi_hashtab[i]);
         }
+        QTAILQ_INIT(&s->msi_lru);
     }
 
     kvm_arch_init_irq_routing(s);
@@ -997,9 +1260,47 @@ void kvm_irqchip_commit_routes(KVMState *s)
 {
     int ret;
 
+    /* KVM_SET_GSI_ROUTING replaces the whole table, do it once per batch */
+    if (s->route_batch) {
+        s->routes_dirty = true;
+        return;
+    }
+
     s->irq_routes->flags = 0;
     ret = kvm_vm_ioctl(s, KVM_SET_GSI_ROUTING, s->irq_routes);
     assert(ret == 0);
+    s->routes_dirty = false;
+    s->msi_stats.commits++;
+}
+
+/* Callers that set up many routes at once, e.g. one per vector of a
+ * device, bracket them so that the table is committed at the end only.
+ */
+void kvm_irqchip_begin_route_changes(KVMState *s)
+{
+    s->route_batch++;
+}
+
+void kvm_irqchip_end_route_changes(KVMState *s)
+{
+    assert(s->route_batch > 0);
+    if (--s->route_batch == 0 && s->routes_dirty) {
+        kvm_irqchip_commit_routes(s);
+    }
+}
+
+void kvm_irqchip_get_msi_stats(KVMMSIRouteStats *stats)
+{
+    KVMState *s = kvm_state;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!s) {
+        return;
+    }
+    *stats = s->msi_stats;
+    stats->direct_msi = s->direct_msi;
+    stats->routes = s->irq_routes ? s->irq_routes->nr : 0;
+    stats->gsi_count = s->gsi_count;
 }
 
 static void kvm_add_routing_entry(KVMState *s,
@@ -1085,25 +1386,37 @@ void kvm_irqchip_release_virq(KVMState *s, int virq)
     clear_gsi(s, virq);
 }
 
-static unsigned int kvm_hash_msi(uint32_t data)
+static unsigned int kvm_hash_msi(MSIMessage msg)
 {
-    /* This is optimized for IA32 MSI layout. However, no other arch shall
-     * repeat the mistake of not providing a direct MSI injection API. */
-    return data & 0xff;
+    /* This is optimized for IA32 MSI layout: the vector is in the low
+     * byte of the data, the destination APIC ID in bits 12-19 of the
+     * address.  However, no other arch shall repeat the mistake of not
+     * providing a direct MSI injection API. */
+    return (msg.data ^ (msg.address >> 12)) & (KVM_MSI_HASHTAB_SIZE - 1);
 }
 
-static void kvm_flush_dynamic_msi_routes(KVMState *s)
+/* Make room for one more route by dropping the least recently used
+ * dynamic one.  Dropping them all, as was done before, made guests with
+ * more vectors than GSIs recreate every route over and over.
+ */
+static bool kvm_evict_dynamic_msi_route(KVMState *s)
 {
-    KVMMSIRoute *route, *next;
-    unsigned int hash;
+    KVMMSIRoute *route = QTAILQ_FIRST(&s->msi_lru);
+    MSIMessage msg;
 
-    for (hash = 0; hash < KVM_MSI_HASHTAB_SIZE; hash++) {
-        QTAILQ_FOREACH_SAFE(route, &s->msi_hashtab[hash], entry, next) {
-            kvm_irqchip_release_virq(s, route->kroute.gsi);
-            QTAILQ_REMOVE(&s->msi_hashtab[hash], route, entry);
-            g_free(route);
-        }
+    if (!route) {
+        return false;
     }
+    msg.address = route->kroute.u.msi.address_lo |
+                  ((uint64_t)route->kroute.u.msi.address_hi << 32);
+    msg.data = cpu_to_le32(route->kroute.u.msi.data);
+
+    kvm_irqchip_release_virq(s, route->kroute.gsi);
+    QTAILQ_REMOVE(&s->msi_hashtab[kvm_hash_msi(msg)], route, entry);
+    QTAILQ_REMOVE(&s->msi_lru, route, lru);
+    g_free(route);
+    s->msi_stats.evictions++;
+    return true;
 }
 
 static int kvm_irqchip_get_virq(KVMState *s)
@@ -1111,7 +1424,6 @@ static int kvm_irqchip_get_virq(KVMState *s)
     uint32_t *word = s->used_gsi_bitmap;
     int max_words = ALIGN(s->gsi_count, 32) / 32;
     int i, bit;
-    bool retry = true;
 
 again:
     /* Return the lowest unused GSI in the bitmap */
@@ -1123,9 +1435,7 @@ again:
 
         return bit - 1 + i * 32;
     }
-    if (!s->direct_msi && retry) {
-        retry = false;
-        kvm_flush_dynamic_msi_routes(s);
+    if (!s->direct_msi && kvm_evict_dynamic_msi_route(s)) {
         goto again;
     }
     return -ENOSPC;
@@ -1134,13 +1444,15 @@ again:
 
 static KVMMSIRoute *kvm_lookup_msi_route(KVMState *s, MSIMessage msg)
 {
-    unsigned int hash = kvm_hash_msi(msg.data);
+    unsigned int hash = kvm_hash_msi(msg);
     KVMMSIRoute *route;
 
     QTAILQ_FOREACH(route, &s->msi_hashtab[hash], entry) {
         if (route->kroute.u.msi.address_lo == (uint32_t)msg.address &&
             route->kroute.u.msi.address_hi == (msg.address >> 32) &&
             route->kroute.u.msi.data == le32_to_cpu(msg.data)) {
+            QTAILQ_REMOVE(&s->msi_lru, route, lru);
+            QTAILQ_INSERT_TAIL(&s->msi_lru, route, lru);
             return route;
         }
     }
@@ -1159,13 +1471,18 @@ int kvm_irqchip_send_msi(KVMState *s, MSIMessage msg)
         msi.flags = 0;
         memset(msi.pad, 0, sizeof(msi.pad));
 
+        s->msi_stats.direct++;
         return kvm_vm_ioctl(s, KVM_SIGNAL_MSI, &msi);
     }
 
     route = kvm_lookup_msi_route(s, msg);
-    if (!route) {
+    if (route) {
+        s->msi_stats.hits++;
+    } else {
         int virq;
 
+        s->msi_stats.misses++;
+
         virq = kvm_irqchip_get_virq(s);
         if (virq < 0) {
             return virq;
@@ -1182,8 +1499,8 @@ int kvm_irqchip_send_msi(KVMState *s, MSIMessage msg)
         kvm_add_routing_entry(s, &route->kroute);
         kvm_irqchip_commit_routes(s);
 
-        QTAILQ_INSERT_TAIL(&s->msi_hashtab[kvm_hash_msi(msg.data)], route,
-                           entry);
+        QTAILQ_INSERT_TAIL(&s->msi_hashtab[kvm_hash_msi(msg)], route, entry);
+        QTAILQ_INSERT_TAIL(&s->msi_lru, route, lru);
     }
 
     assert(route->kroute.type == KVM_IRQ_ROUTING_MSI);
@@ -1294,6 +1611,19 @@ int kvm_irqchip_update_msi_route(KVMState *s, int virq, MSIMessage msg)
 {
     return -ENOSYS;
 }
+
+void kvm_irqchip_begin_route_changes(KVMState *s)
+{
+}
+
+void kvm_irqchip_end_route_changes(KVMState *s)
+{
+}
+
+void kvm_irqchip_get_msi_stats(KVMMSIRouteStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
 #endif /* !KVM_CAP_IRQ_ROUTING */
 
 int kvm_irqchip_add_irqfd_notifier(KVMState *s, EventNotifier *n,
@@ -1465,6 +1795,9 @@ int kvm_init(void)
     }
 
     s->coalesced_mmio = kvm_check_extension(s, KVM_CAP_COALESCED_MMIO);
+    /* PIO entries share the ring, so they need coalesced MMIO as well */
+    s->coalesced_pio = s->coalesced_mmio &&
+                       kvm_check_extension(s, KVM_CAP_COALESCED_PIO);
 
     s->broken_set_mem_region = 1;
     ret = kvm_check_extension(s, KVM_CAP_JOIN_MEMORY_REGIONS_WORKS);
@@ -1557,6 +1890,31 @@ static void kvm_handle_io(uint16_t port, void *data, int direction, int size,
     }
 }
 
+/* Handle an MMIO or PIO exit without the global lock, if it accesses a
+ * region that does not need it.  Returns false if the exit was not handled.
+ */
+static bool kvm_handle_exit_unlocked(struct kvm_run *run)
+{
+    switch (run->exit_reason) {
+    case KVM_EXIT_IO:
+        if (run->io.count != 1) {
+            return false;
+        }
+        return address_space_rw_unlocked(&address_space_io, run->io.port,
+                                         (uint8_t *)run + run->io.data_offset,
+                                         run->io.size,
+                                         run->io.direction == KVM_EXIT_IO_OUT);
+    case KVM_EXIT_MMIO:
+        return address_space_rw_unlocked(&address_space_memory,
+                                         run->mmio.phys_addr,
+                                         run->mmio.data,
+                                         run->mmio.len,
+                                         run->mmio.is_write);
+    default:
+        return false;
+    }
+}
+
 static int kvm_handle_internal_error(CPUState *cpu, struct kvm_run *run)
 {
     fprintf(stderr, "KVM internal error.");
@@ -1601,7 +1959,13 @@ void kvm_flush_coalesced_mmio_buffer(void)
 
             ent = &ring->coalesced_mmio[ring->first];
 
-            cpu_physical_memory_write(ent->phys_addr, ent->data, ent->len);
+            if (ent->pio == 1) {
+                address_space_rw(&address_space_io, ent->phys_addr,
+                                 ent->data, ent->len, true);
+            } else {
+                cpu_physical_memory_write(ent->phys_addr, ent->data,
+                                          ent->len);
+            }
             smp_wmb();
             ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
         }
@@ -1642,6 +2006,7 @@ void kvm_cpu_synchronize_post_init(CPUState *cpu)
 int kvm_cpu_exec(CPUState *cpu)
 {
     struct kvm_run *run = cpu->kvm_run;
+    int64_t profile_start;
     int ret, run_ret;
 
     DPRINTF("kvm_cpu_exec()\n");
@@ -1669,7 +2034,16 @@ int kvm_cpu_exec(CPUState *cpu)
         }
         qemu_mutex_unlock_iothread();
 
-        run_ret = kvm_vcpu_ioctl(cpu, KVM_RUN, 0);
+        /* Exits to regions that do their own locking are handled here and
+         * the vCPU reentered directly.  Skipping pre_run and post_run is
+         * fine: anything that needs them, such as an interrupt, kicks the
+         * vCPU, and the next KVM_RUN returns -EINTR.
+         */
+        do {
+            run_ret = kvm_vcpu_ioctl(cpu, KVM_RUN, 0);
+            kvm_count_exit(cpu, run_ret);
+        } while (run_ret >= 0 && !cpu->exit_request &&
+                 kvm_handle_exit_unlocked(run));
 
         qemu_mutex_lock_iothread();
         kvm_arch_post_run(cpu, run);
@@ -1686,6 +2060,7 @@ int kvm_cpu_exec(CPUState *cpu)
         }
 
         trace_kvm_run_exit(cpu->cpu_index, run->exit_reason);
+        profile_start = kvm_exit_profile ? get_clock() : 0;
         switch (run->exit_reason) {
         case KVM_EXIT_IO:
             DPRINTF("handle_io\n");
@@ -1694,6 +2069,10 @@ int kvm_cpu_exec(CPUState *cpu)
                           run->io.direction,
                           run->io.size,
                           run->io.count);
+            if (profile_start) {
+                kvm_profile_exit(cpu, run->io.port | KVM_EXIT_PROFILE_PIO,
+                                 profile_start);
+            }
             ret = 0;
             break;
         case KVM_EXIT_MMIO:
@@ -1702,6 +2081,9 @@ int kvm_cpu_exec(CPUState *cpu)
                                    run->mmio.data,
                                    run->mmio.len,
                                    run->mmio.is_write);
+            if (profile_start) {
+                kvm_profile_exit(cpu, run->mmio.phys_addr, profile_start);
+            }
             ret = 0;
             break;
         case KVM_EXIT_IRQ_WINDOW_OPEN:
@@ -17,6 +17,7 @@
 
 #ifndef CONFIG_USER_ONLY
 #include "hw/pci/msi.h"
+#include "qmp-commands.h"
 #endif
 
 KVMState *kvm_state;
@@ -136,6 +137,19 @@ int kvm_irqchip_update_msi_route(KVMState *s, int virq, MSIMessage msg)
     return -ENOSYS;
 }
 
+void kvm_irqchip_begin_route_changes(KVMState *s)
+{
+}
+
+void kvm_irqchip_end_route_changes(KVMState *s)
+{
+}
+
+void kvm_irqchip_get_msi_stats(KVMMSIRouteStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
 int kvm_irqchip_add_irqfd_notifier(KVMState *s, EventNotifier *n,
                                    EventNotifier *rn, int virq)
 {
@@ -146,4 +160,15 @@ int kvm_irqchip_remove_irqfd_notifier(KVMState *s, EventNotifier *n, int virq)
 {
     return -ENOSYS;
 }
+
+KvmExitInfoList *qmp_query_kvm_exits(Error **errp)
+{
+    error_setg(errp, "KVM is not in use");
+    return NULL;
+}
+
+void qmp_kvm_exit_profile(bool enable, Error **errp)
+{
+    error_setg(errp, "KVM is not in use");
+}
 #endif
@@ -3473,6 +3473,13 @@ static void handle_arg_strace(const char *arg)
     do_strace = 1;
 }
 
+static bool perf_map;
+
+static void handle_arg_perfmap(const char *arg)
+{
+    perf_map = true;
+}
+
 static void handle_arg_version(const char *arg)
 {
     printf("qemu-" TARGET_NAME " version " QEMU_VERSION QEMU_PKGVERSION
@@ -3525,6 +3532,8 @@ static const struct qemu_argument arg_table[] = {
      "",           "run in singlestep mode"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
+    {"perfmap",    "QEMU_PERFMAP",     false, handle_arg_perfmap,
+     "",           "write a perf map of the translated code"},
     {"version",    "QEMU_VERSION",     false, handle_arg_version,
      "",           "display version information and exit"},
     {NULL, NULL, false, NULL, NULL, NULL}
@@ -3763,6 +3772,9 @@ int main(int argc, char **argv, char **envp)
 #endif
     }
     tcg_exec_init(0);
+    if (perf_map) {
+        tcg_perf_map_init();
+    }
     cpu_exec_init_all();
     /* NOTE: we need to init the CPU at this stage to get
        qemu_host_page_size */
@@ -1700,6 +1700,30 @@ static abi_long do_getsockopt(int sockfd, int level, int optname,
     return ret;
 }
 
+/* Most calls pass only a few buffers; convert them into a per-thread
+   array instead of allocating one on every call.  */
+#define IOVEC_CACHE_SIZE 16
+static __thread struct iovec iovec_cache[IOVEC_CACHE_SIZE];
+static __thread bool iovec_cache_busy;
+
+static struct iovec *iovec_alloc(int count)
+{
+    if (count <= IOVEC_CACHE_SIZE && !iovec_cache_busy) {
+        iovec_cache_busy = true;
+        return iovec_cache;
+    }
+    return calloc(count, sizeof(struct iovec));
+}
+
+static void iovec_free(struct iovec *vec)
+{
+    if (vec == iovec_cache) {
+        iovec_cache_busy = false;
+    } else {
+        free(vec);
+    }
+}
+
 static struct iovec *lock_iovec(int type, abi_ulong target_addr,
                                 int count, int copy)
 {
@@ -1717,7 +1741,7 @@ static struct iovec *lock_iovec(int type, abi_ulong target_addr,
         return NULL;
     }
 
-    vec = calloc(count, sizeof(struct iovec));
+    vec = iovec_alloc(count);
     if (vec == NULL) {
         errno = ENOMEM;
         return NULL;
@@ -1763,15 +1787,18 @@ static struct iovec *lock_iovec(int type, abi_ulong target_addr,
     return vec;
 
  fail:
-    free(vec);
- fail2:
     unlock_user(target_vec, target_addr, 0);
+ fail2:
+    iovec_free(vec);
     return NULL;
 }
 
 static void unlock_iovec(struct iovec *vec, abi_ulong target_addr,
                          int count, int copy)
 {
+#ifdef DEBUG_REMAP
+    /* Without DEBUG_REMAP, lock_user() returns guest memory itself and
+       there is nothing to copy back.  */
     struct target_iovec *target_vec;
     int i;
 
@@ -1780,7 +1807,7 @@ static void unlock_iovec(struct iovec *vec, abi_ulong target_addr,
     if (target_vec) {
         for (i = 0; i < count; i++) {
             abi_ulong base = tswapal(target_vec[i].iov_base);
-            abi_long len = tswapal(target_vec[i].iov_base);
+            abi_long len = tswapal(target_vec[i].iov_len);
             if (len < 0) {
                 break;
             }
@@ -1788,8 +1815,9 @@ static void unlock_iovec(struct iovec *vec, abi_ulong target_addr,
         }
         unlock_user(target_vec, target_addr, 0);
     }
+#endif
 
-    free(vec);
+    iovec_free(vec);
 }
 
 static inline int target_to_host_sock_type(int *type)
@@ -19,36 +19,26 @@
 #include "qemu/bitops.h"
 #include "qom/object.h"
 #include "trace.h"
+#include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include <assert.h>
 
 #include "exec/memory-internal.h"
+#include "exec/ram_addr.h"
 
 //#define DEBUG_UNASSIGNED
 
 static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
+static bool ioeventfd_update_pending;
 static bool global_dirty_log = false;
 
-/* flat_view_mutex is taken around reading as->current_map; the critical
- * section is extremely short, so I'm using a single mutex for every AS.
- * We could also RCU for the read-side.
- *
- * The BQL is taken around transaction commits, hence both locks are taken
- * while writing to as->current_map (with the BQL taken outside).
- */
-static QemuMutex flat_view_mutex;
-
 static QTAILQ_HEAD(memory_listeners, MemoryListener) memory_listeners
     = QTAILQ_HEAD_INITIALIZER(memory_listeners);
 
 static QTAILQ_HEAD(, AddressSpace) address_spaces
     = QTAILQ_HEAD_INITIALIZER(address_spaces);
 
-static void memory_init(void)
-{
-    qemu_mutex_init(&flat_view_mutex);
-}
-
 typedef struct AddrRange AddrRange;
 
 /*
@@ -239,6 +229,7 @@ struct FlatRange {
  * order.
  */
 struct FlatView {
+    struct rcu_head rcu;
     unsigned ref;
     FlatRange *ranges;
     unsigned nr;
@@ -259,6 +250,22 @@ static bool flatrange_equal(FlatRange *a, FlatRange *b)
         && a->readonly == b->readonly;
 }
 
+static bool flatview_equal(FlatView *a, FlatView *b)
+{
+    unsigned i;
+
+    if (a->nr != b->nr) {
+        return false;
+    }
+    for (i = 0; i < a->nr; i++) {
+        if (!flatrange_equal(&a->ranges[i], &b->ranges[i])
+            || a->ranges[i].dirty_log_mask != b->ranges[i].dirty_log_mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static void flatview_init(FlatView *view)
 {
     view->ref = 1;
@@ -295,15 +302,31 @@ static void flatview_destroy(FlatView *view)
     g_free(view);
 }
 
-static void flatview_ref(FlatView *view)
+/* Fails if the last reference is gone and the view is waiting for a grace
+ * period to be destroyed.
+ */
+static bool flatview_ref(FlatView *view)
 {
-    atomic_inc(&view->ref);
+    unsigned ref = atomic_read(&view->ref);
+
+    while (ref) {
+        unsigned old = atomic_cmpxchg(&view->ref, ref, ref + 1);
+        if (old == ref) {
+            return true;
+        }
+        ref = old;
+    }
+    return false;
 }
 
+/* A view can be shared by several address spaces, and readers can still
+ * find it through as->current_map after the last reference is dropped, so
+ * it is destroyed after a grace period.
+ */
 static void flatview_unref(FlatView *view)
 {
     if (atomic_fetch_dec(&view->ref) == 1) {
-        flatview_destroy(view);
+        call_rcu(view, flatview_destroy, rcu);
     }
 }
 
@@ -582,6 +605,21 @@ static void render_memory_region(FlatView *view,
 }
 
 /* Render a memory topology into a list of disjoint absolute ranges. */
+/* An enabled alias at address 0 that maps all of a region from offset 0
+ * renders exactly like the region itself.  Address spaces whose roots reduce
+ * to the same region, such as the bus master address spaces of PCI devices,
+ * can then share one FlatView.
+ */
+static MemoryRegion *flatview_root(MemoryRegion *mr)
+{
+    while (mr && mr->enabled && mr->alias && !mr->readonly
+           && mr->addr == 0 && mr->alias_offset == 0 && mr->alias->addr == 0
+           && int128_ge(mr->size, mr->alias->size)) {
+        mr = mr->alias;
+    }
+    return mr;
+}
+
 static FlatView *generate_memory_topology(MemoryRegion *mr)
 {
     FlatView *view;
@@ -647,14 +685,20 @@ static void address_space_add_del_ioeventfds(AddressSpace *as,
     }
 }
 
+/* as->current_map is read under RCU, and written under the BQL with
+ * atomic_rcu_set().  A view is only destroyed after a grace period, so it
+ * stays valid in the critical section; if its last reference is already
+ * gone, as->current_map has changed and the new view is read again.
+ */
 static FlatView *address_space_get_flatview(AddressSpace *as)
 {
     FlatView *view;
 
-    qemu_mutex_lock(&flat_view_mutex);
-    view = as->current_map;
-    flatview_ref(view);
-    qemu_mutex_unlock(&flat_view_mutex);
+    rcu_read_lock();
+    do {
+        view = atomic_rcu_read(&as->current_map);
+    } while (!flatview_ref(view));
+    rcu_read_unlock();
     return view;
 }
 
@@ -755,18 +799,16 @@ static void address_space_update_topology_pass(AddressSpace *as,
 }
 
 
-static void address_space_update_topology(AddressSpace *as)
+static void address_space_update_topology(AddressSpace *as,
+                                          FlatView *new_view)
 {
     FlatView *old_view = address_space_get_flatview(as);
-    FlatView *new_view = generate_memory_topology(as->root);
 
     address_space_update_topology_pass(as, old_view, new_view, false);
     address_space_update_topology_pass(as, old_view, new_view, true);
 
-    qemu_mutex_lock(&flat_view_mutex);
-    flatview_unref(as->current_map);
-    as->current_map = new_view;
-    qemu_mutex_unlock(&flat_view_mutex);
+    atomic_rcu_set(&as->current_map, new_view);
+    flatview_unref(old_view);
 
     /* Note that all the old MemoryRegions are still alive up to this
      * point.  This relieves most MemoryListeners from the need to
@@ -785,21 +827,91 @@ void memory_region_transaction_begin(void)
     ++memory_region_transaction_depth;
 }
 
-void memory_region_transaction_commit(void)
+/* Only address spaces whose FlatView changed are replayed to the listeners.
+ * A listener that is bound to an address space only gets begin and commit
+ * if that address space changed; the others get them if any did.
+ */
+static bool memory_listener_update_pending(MemoryListener *listener,
+                                           unsigned nb_changed)
+{
+    if (listener->address_space_filter) {
+        return listener->address_space_filter->next_map != NULL;
+    }
+    return nb_changed > 0;
+}
+
+static void memory_region_update_topology(void)
 {
+    GHashTable *views;
+    MemoryListener *listener;
     AddressSpace *as;
+    MemoryRegion *root;
+    FlatView *view;
+    unsigned nb_as = 0, nb_rendered = 0, nb_changed = 0;
+    int64_t start = get_clock();
+
+    /* The table holds a reference to each view it contains */
+    views = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                  (GDestroyNotify)flatview_unref);
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        root = flatview_root(as->root);
+        view = g_hash_table_lookup(views, root);
+        if (!view) {
+            view = generate_memory_topology(as->root);
+            g_hash_table_insert(views, root, view);
+            nb_rendered++;
+        }
+
+        nb_as++;
+        if (flatview_equal(as->current_map, view)) {
+            as->next_map = NULL;
+        } else {
+            flatview_ref(view);
+            as->next_map = view;
+            nb_changed++;
+        }
+    }
+
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        if (listener->begin
+            && memory_listener_update_pending(listener, nb_changed)) {
+            listener->begin(listener);
+        }
+    }
 
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        if (as->next_map) {
+            address_space_update_topology(as, as->next_map);
+        } else if (ioeventfd_update_pending) {
+            address_space_update_ioeventfds(as);
+        }
+    }
+
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        if (listener->commit
+            && memory_listener_update_pending(listener, nb_changed)) {
+            listener->commit(listener);
+        }
+    }
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        as->next_map = NULL;
+    }
+    ioeventfd_update_pending = false;
+    g_hash_table_destroy(views);
+
+    trace_memory_region_update_topology(nb_as, nb_rendered, nb_changed,
+                                        get_clock() - start);
+}
+
+void memory_region_transaction_commit(void)
+{
     assert(memory_region_transaction_depth);
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth && memory_region_update_pending) {
         memory_region_update_pending = false;
-        MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
-
-        QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-            address_space_update_topology(as);
-        }
-
-        MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+        memory_region_update_topology();
     }
 }
 
@@ -861,6 +973,7 @@ void memory_region_init(MemoryRegion *mr,
     mr->ioeventfd_nb = 0;
     mr->ioeventfds = NULL;
     mr->flush_coalesced_mmio = false;
+    mr->global_locking = true;
 }
 
 static uint64_t unassigned_mem_read(void *opaque, hwaddr addr,
@@ -953,11 +1066,44 @@ static uint64_t memory_region_dispatch_read1(MemoryRegion *mr,
     return data;
 }
 
+/* Sizes for which an aligned access needs no validity check and no
+   splitting, so that it can go straight to ops->read or ops->write */
+static void memory_region_init_direct_sizes(MemoryRegion *mr)
+{
+    const MemoryRegionOps *ops = mr->ops;
+    unsigned min = ops->impl.min_access_size ? : 1;
+    unsigned max = ops->impl.max_access_size ? : 4;
+    unsigned size;
+
+    mr->direct_sizes = 0;
+    if (!ops->read || !ops->write || ops->valid.accepts) {
+        return;
+    }
+    for (size = min; size <= max && size <= 8; size <<= 1) {
+        mr->direct_sizes |= size;
+    }
+}
+
+static inline bool memory_region_access_direct(MemoryRegion *mr,
+                                               hwaddr addr, unsigned size)
+{
+    return (mr->direct_sizes & size) && !(addr & (size - 1)) &&
+           !mr->flush_coalesced_mmio;
+}
+
 static bool memory_region_dispatch_read(MemoryRegion *mr,
                                         hwaddr addr,
                                         uint64_t *pval,
                                         unsigned size)
 {
+    if (memory_region_access_direct(mr, addr, size)) {
+        *pval = mr->ops->read(mr->opaque, addr, size) &
+                (-1ULL >> (64 - size * 8));
+        trace_memory_region_ops_read(mr, addr, *pval, size);
+        adjust_endianness(mr, pval, size);
+        return false;
+    }
+
     if (!memory_region_access_valid(mr, addr, size, false)) {
         *pval = unassigned_mem_read(mr, addr, size);
         return true;
@@ -973,6 +1119,14 @@ static bool memory_region_dispatch_write(MemoryRegion *mr,
                                          uint64_t data,
                                          unsigned size)
 {
+    if (memory_region_access_direct(mr, addr, size)) {
+        data &= -1ULL >> (64 - size * 8);
+        adjust_endianness(mr, &data, size);
+        trace_memory_region_ops_write(mr, addr, data, size);
+        mr->ops->write(mr->opaque, addr, data, size);
+        return false;
+    }
+
     if (!memory_region_access_valid(mr, addr, size, true)) {
         unassigned_mem_write(mr, addr, data, size);
         return true;
@@ -1004,6 +1158,7 @@ void memory_region_init_io(MemoryRegion *mr,
     mr->opaque = opaque;
     mr->terminates = true;
     mr->ram_addr = ~(ram_addr_t)0;
+    memory_region_init_direct_sizes(mr);
 }
 
 void memory_region_init_ram(MemoryRegion *mr,
@@ -1018,6 +1173,19 @@ void memory_region_init_ram(MemoryRegion *mr,
     mr->ram_addr = qemu_ram_alloc(size, mr);
 }
 
+void memory_region_init_ram_policy(MemoryRegion *mr,
+                                   Object *owner,
+                                   const char *name,
+                                   uint64_t size,
+                                   const HostMemPolicy *policy)
+{
+    memory_region_init(mr, owner, name, size);
+    mr->ram = true;
+    mr->terminates = true;
+    mr->destructor = memory_region_destructor_ram;
+    mr->ram_addr = qemu_ram_alloc_policy(size, mr, policy);
+}
+
 void memory_region_init_ram_ptr(MemoryRegion *mr,
                                 Object *owner,
                                 const char *name,
@@ -1057,6 +1225,7 @@ void memory_region_init_rom_device(MemoryRegion *mr,
     mr->opaque = opaque;
     mr->terminates = true;
     mr->rom_device = true;
+    memory_region_init_direct_sizes(mr);
     mr->destructor = memory_region_destructor_rom_device;
     mr->ram_addr = qemu_ram_alloc(size, mr);
 }
@@ -1182,7 +1351,8 @@ void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
                              hwaddr size)
 {
     assert(mr->terminates);
-    return cpu_physical_memory_set_dirty_range(mr->ram_addr + addr, size, -1);
+    cpu_physical_memory_set_dirty_range(mr->ram_addr + addr, size,
+                                        ALL_DIRTY_FLAGS);
 }
 
 bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
@@ -1349,6 +1519,11 @@ void memory_region_clear_flush_coalesced(MemoryRegion *mr)
     }
 }
 
+void memory_region_clear_global_locking(MemoryRegion *mr)
+{
+    mr->global_locking = false;
+}
+
 void memory_region_add_eventfd(MemoryRegion *mr,
                                hwaddr addr,
                                unsigned size,
@@ -1379,6 +1554,7 @@ void memory_region_add_eventfd(MemoryRegion *mr,
             sizeof(*mr->ioeventfds) * (mr->ioeventfd_nb-1 - i));
     mr->ioeventfds[i] = mrfd;
     memory_region_update_pending |= mr->enabled;
+    ioeventfd_update_pending |= mr->enabled;
     memory_region_transaction_commit();
 }
 
@@ -1412,6 +1588,7 @@ void memory_region_del_eventfd(MemoryRegion *mr,
     mr->ioeventfds = g_realloc(mr->ioeventfds,
                                   sizeof(*mr->ioeventfds)*mr->ioeventfd_nb + 1);
     memory_region_update_pending |= mr->enabled;
+    ioeventfd_update_pending |= mr->enabled;
     memory_region_transaction_commit();
 }
 
@@ -1708,14 +1885,11 @@ void memory_listener_unregister(MemoryListener *listener)
 
 void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
 {
-    if (QTAILQ_EMPTY(&address_spaces)) {
-        memory_init();
-    }
-
     memory_region_transaction_begin();
     as->root = root;
     as->current_map = g_new(FlatView, 1);
     flatview_init(as->current_map);
+    as->next_map = NULL;
     as->ioeventfd_nb = 0;
     as->ioeventfds = NULL;
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
@@ -18,6 +18,7 @@
 #include "qemu/main-loop.h"
 #include "qemu/sockets.h"
 #include "qemu/bitmap.h"
+#include "qemu/timer.h"
 #include "block/coroutine.h"
 #include <stdio.h>
 #include <sys/types.h>
@@ -233,6 +234,17 @@ static void network_to_caps(RDMACapabilities *cap)
     cap->flags = ntohl(cap->flags);
 }
 
+/*
+ * Dynamically registered chunk on the source, linked into the
+ * least-recently-used list of the RDMAContext.
+ */
+typedef struct RDMARegChunk {
+    QTAILQ_ENTRY(RDMARegChunk) next;
+    int      index;            /* which block the chunk belongs to */
+    uint64_t chunk;
+    bool     cached;           /* currently on the LRU list */
+} RDMARegChunk;
+
 /*
  * Representation of a RAMBlock from an RDMA perspective.
  * This is not transmitted, only local.
@@ -254,6 +266,7 @@ typedef struct RDMALocalBlock {
     int      nb_chunks;
     unsigned long *transit_bitmap;
     unsigned long *unregister_bitmap;
+    RDMARegChunk *reg_chunks;  /* LRU entries for chunk-level registration */
 } RDMALocalBlock;
 
 /*
@@ -392,9 +405,33 @@ typedef struct RDMAContext {
     int unregister_current, unregister_next;
     uint64_t unregistrations[RDMA_SIGNALED_SEND_MAX];
 
+    /*
+     * Source only, dynamic registration: registered chunks from the least
+     * to the most recently written, and how many of them may stay
+     * registered at the same time (0 for no limit).
+     */
+    QTAILQ_HEAD(, RDMARegChunk) reg_lru;
+    uint64_t reg_lru_len;
+    uint64_t reg_cache_max;
+
     GHashTable *blockmap;
 } RDMAContext;
 
+/*
+ * Statistics of the last outgoing RDMA migration, reported by
+ * query-migrate. Updated by the migration thread only.
+ */
+static struct {
+    bool active;
+    uint64_t registration_hits;
+    uint64_t registration_misses;
+    uint64_t unregistrations;
+    uint64_t writes;
+    int max_outstanding;
+    int64_t registration_ns;    /* waiting for the dest to register */
+    int64_t wire_ns;            /* waiting for RDMA writes to complete */
+} rdma_stats;
+
 /*
  * Interface to the rest of the migration call stack.
  */
@@ -537,6 +574,46 @@ static inline uint8_t *ram_chunk_end(const RDMALocalBlock *rdma_ram_block,
     return result;
 }
 
+/*
+ * Move a dynamically registered chunk to the most recently used end of the
+ * LRU, adding it if it is not there yet.
+ */
+static void qemu_rdma_lru_touch(RDMAContext *rdma, RDMALocalBlock *block,
+                                uint64_t chunk)
+{
+    RDMARegChunk *entry;
+
+    if (!block->reg_chunks) {
+        block->reg_chunks = g_malloc0(block->nb_chunks * sizeof(RDMARegChunk));
+    }
+
+    entry = &block->reg_chunks[chunk];
+    if (entry->cached) {
+        QTAILQ_REMOVE(&rdma->reg_lru, entry, next);
+    } else {
+        entry->index = block->index;
+        entry->chunk = chunk;
+        entry->cached = true;
+        rdma->reg_lru_len++;
+    }
+    QTAILQ_INSERT_TAIL(&rdma->reg_lru, entry, next);
+}
+
+static void qemu_rdma_lru_remove(RDMAContext *rdma, RDMALocalBlock *block,
+                                 uint64_t chunk)
+{
+    RDMARegChunk *entry;
+
+    if (!block->reg_chunks || !block->reg_chunks[chunk].cached) {
+        return;
+    }
+
+    entry = &block->reg_chunks[chunk];
+    QTAILQ_REMOVE(&rdma->reg_lru, entry, next);
+    entry->cached = false;
+    rdma->reg_lru_len--;
+}
+
 static int __qemu_rdma_add_block(RDMAContext *rdma, void *host_addr,
                          ram_addr_t block_offset, uint64_t length)
 {
@@ -660,6 +737,16 @@ static int __qemu_rdma_delete_block(RDMAContext *rdma, ram_addr_t block_offset)
     g_free(block->remote_keys);
     block->remote_keys = NULL;
 
+    if (block->reg_chunks) {
+        int j;
+
+        for (j = 0; j < block->nb_chunks; j++) {
+            qemu_rdma_lru_remove(rdma, block, j);
+        }
+        g_free(block->reg_chunks);
+        block->reg_chunks = NULL;
+    }
+
     for (x = 0; x < local->nb_blocks; x++) {
         g_hash_table_remove(rdma->blockmap, (void *)old[x].offset);
     }
@@ -1219,36 +1306,32 @@ const char *print_wrid(int wrid)
  * RDMA requires memory registration (mlock/pinning), but this is not good for
  * overcommitment.
  *
- * In preparation for the future where LRU information or workload-specific
- * writable writable working set memory access behavior is available to QEMU
- * it would be nice to have in place the ability to UN-register/UN-pin
- * particular memory regions from the RDMA hardware when it is determine that
- * those regions of memory will likely not be accessed again in the near future.
- *
- * While we do not yet have such information right now, the following
- * compile-time option allows us to perform a non-optimized version of this
- * behavior.
+ * Unless 'rdma-pin-all' is requested, chunks are registered the first time
+ * they are written and then stay registered, so that rewriting a dirty page
+ * costs no extra round trip. The source keeps the registered chunks on an
+ * LRU list; once the 'x-rdma-registration-cache' limit is reached, the least
+ * recently written chunk that is not in flight gets UN-registered/UN-pinned
+ * on both sides before a new one is registered.
  *
- * By uncommenting this option, you will cause *all* RDMA transfers to be
- * unregistered immediately after the transfer completes on both sides of the
- * connection. This has no effect in 'rdma-pin-all' mode, only regular mode.
+ * By uncommenting the following option, you will instead cause *all* RDMA
+ * transfers to be unregistered immediately after the transfer completes on
+ * both sides of the connection. This has no effect in 'rdma-pin-all' mode,
+ * only regular mode.
  *
- * This will have a terrible impact on migration performance, so until future
- * workload information or LRU information is available, do not attempt to use
- * this feature except for basic testing.
+ * This will have a terrible impact on migration performance, so do not
+ * attempt to use this feature except for basic testing.
  */
 //#define RDMA_UNREGISTRATION_EXAMPLE
 
 /*
- * Perform a non-optimized memory unregistration after every transfer
- * for demonsration purposes, only if pin-all is not requested.
+ * Process the chunks queued for unregistration, only if pin-all is not
+ * requested.
  *
  * Potential optimizations:
  * 1. Start a new thread to run this function continuously
         - for bit clearing
         - and for receipt of unregister messages
- * 2. Use an LRU.
- * 3. Use workload hints.
+ * 2. Use workload hints.
  */
 static int qemu_rdma_unregister_waiting(RDMAContext *rdma)
 {
@@ -1299,12 +1382,14 @@ static int qemu_rdma_unregister_waiting(RDMAContext *rdma)
         ret = ibv_dereg_mr(block->pmr[chunk]);
         block->pmr[chunk] = NULL;
         block->remote_keys[chunk] = 0;
+        qemu_rdma_lru_remove(rdma, block, chunk);
 
         if (ret != 0) {
             perror("unregistration chunk failed");
             return -ret;
         }
         rdma->total_registrations--;
+        rdma_stats.unregistrations++;
 
         reg.key.chunk = chunk;
         register_to_network(&reg);
@@ -1444,6 +1529,17 @@ static uint64_t qemu_rdma_poll(RDMAContext *rdma, uint64_t *wr_id_out,
     return  0;
 }
 
+/*
+ * Time the migration thread spent blocked on the completion of its own
+ * RDMA writes is time the link, not the CPU, was the bottleneck.
+ */
+static void qemu_rdma_account_wait(int wrid, int64_t start)
+{
+    if (wrid == RDMA_WRID_RDMA_WRITE) {
+        rdma_stats.wire_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+    }
+}
+
 /*
  * Block until the next work request has completed.
  *
@@ -1464,6 +1560,7 @@ static int qemu_rdma_block_for_wrid(RDMAContext *rdma, int wrid_requested,
     struct ibv_cq *cq;
     void *cq_ctx;
     uint64_t wr_id = RDMA_WRID_NONE, wr_id_in;
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     if (ibv_req_notify_cq(rdma->cq, 0)) {
         return -1;
@@ -1488,6 +1585,7 @@ static int qemu_rdma_block_for_wrid(RDMAContext *rdma, int wrid_requested,
     }
 
     if (wr_id == wrid_requested) {
+        qemu_rdma_account_wait(wrid_requested, start);
         return 0;
     }
 
@@ -1538,12 +1636,14 @@ success_block_for_wrid:
     if (num_cq_events) {
         ibv_ack_cq_events(cq, num_cq_events);
     }
+    qemu_rdma_account_wait(wrid_requested, start);
     return 0;
 
 err_block_for_wrid:
     if (num_cq_events) {
         ibv_ack_cq_events(cq, num_cq_events);
     }
+    qemu_rdma_account_wait(wrid_requested, start);
     return ret;
 }
 
@@ -1836,6 +1936,47 @@ static int qemu_rdma_exchange_recv(RDMAContext *rdma, RDMAControlHeader *head,
     return 0;
 }
 
+/*
+ * Make room in the registration cache for one more chunk by unregistering
+ * the least recently written one that is not in flight, waiting for writes
+ * to complete if all of them are.
+ */
+static int qemu_rdma_lru_evict(RDMAContext *rdma)
+{
+    RDMARegChunk *entry;
+    RDMALocalBlock *block;
+    int ret;
+
+    while (rdma->reg_cache_max && rdma->reg_lru_len >= rdma->reg_cache_max) {
+        QTAILQ_FOREACH(entry, &rdma->reg_lru, next) {
+            block = &(rdma->local_ram_blocks.block[entry->index]);
+            if (!test_bit(entry->chunk, block->transit_bitmap)) {
+                break;
+            }
+        }
+
+        if (!entry) {
+            ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
+            if (ret < 0) {
+                return ret;
+            }
+            continue;
+        }
+
+        DDPRINTF("Evicting block %d chunk %" PRIu64 " from the registration"
+                 " cache\n", entry->index, entry->chunk);
+
+        qemu_rdma_signal_unregister(rdma, entry->index, entry->chunk,
+                                    RDMA_WRID_RDMA_WRITE);
+        ret = qemu_rdma_unregister_waiting(rdma);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
 /*
  * Write an actual chunk of memory using RDMA.
  *
@@ -1850,6 +1991,7 @@ static int qemu_rdma_write_one(QEMUFile *f, RDMAContext *rdma,
     struct ibv_send_wr send_wr = { 0 };
     struct ibv_send_wr *bad_wr;
     int reg_result_idx, ret, count = 0;
+    int64_t reg_start;
     uint64_t chunk, chunks;
     uint8_t *chunk_start, *chunk_end;
     RDMALocalBlock *block = &(rdma->local_ram_blocks.block[current_index]);
@@ -1889,9 +2031,10 @@ retry:
     chunk_end = ram_chunk_end(block, chunk + chunks);
 
     if (!rdma->pin_all) {
-#ifdef RDMA_UNREGISTRATION_EXAMPLE
-        qemu_rdma_unregister_waiting(rdma);
-#endif
+        ret = qemu_rdma_unregister_waiting(rdma);
+        if (ret < 0) {
+            return ret;
+        }
     }
 
     while (test_bit(chunk, block->transit_bitmap)) {
@@ -1954,6 +2097,14 @@ retry:
             /*
              * Otherwise, tell other side to register.
              */
+            if (!rdma->pin_all) {
+                ret = qemu_rdma_lru_evict(rdma);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+
+            reg_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
             reg.current_index = current_index;
             if (block->is_ram_block) {
                 reg.key.current_addr = current_addr;
@@ -1993,6 +2144,10 @@ retry:
 
             block->remote_keys[chunk] = reg_result->rkey;
             block->remote_host_addr = reg_result->host_addr;
+
+            rdma_stats.registration_ns +=
+                qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - reg_start;
+            rdma_stats.registration_misses++;
         } else {
             /* already registered before */
             if (qemu_rdma_register_and_get_keys(rdma, block,
@@ -2002,6 +2157,11 @@ retry:
                 fprintf(stderr, "cannot get lkey!\n");
                 return -EINVAL;
             }
+            rdma_stats.registration_hits++;
+        }
+
+        if (!rdma->pin_all) {
+            qemu_rdma_lru_touch(rdma, block, chunk);
         }
 
         send_wr.wr.rdma.rkey = block->remote_keys[chunk];
@@ -2062,6 +2222,7 @@ retry:
     set_bit(chunk, block->transit_bitmap);
     acct_update_position(f, sge.length, false);
     rdma->total_writes++;
+    rdma_stats.writes++;
 
     return 0;
 }
@@ -2089,6 +2250,8 @@ static int qemu_rdma_write_flush(QEMUFile *f, RDMAContext *rdma)
 
     if (ret == 0) {
         rdma->nb_sent++;
+        rdma_stats.max_outstanding = MAX(rdma_stats.max_outstanding,
+                                         rdma->nb_sent);
         DDDPRINTF("sent total: %d\n", rdma->nb_sent);
     }
 
@@ -2504,6 +2667,7 @@ static void *qemu_rdma_data_init(const char *host_port, Error **errp)
         memset(rdma, 0, sizeof(RDMAContext));
         rdma->current_index = -1;
         rdma->current_chunk = -1;
+        QTAILQ_INIT(&rdma->reg_lru);
 
         addr = inet_parse(host_port, NULL);
         if (addr != NULL) {
@@ -3411,6 +3575,10 @@ void rdma_start_outgoing_migration(void *opaque,
         goto err;
     }
 
+    rdma_stats.active = true;
+    rdma->reg_cache_max = (migrate_rdma_registration_cache() << 20) >>
+                          RDMA_REG_CHUNK_SHIFT;
+
     ret = qemu_rdma_source_init(rdma, &local_err,
         s->enabled_capabilities[MIGRATION_CAPABILITY_X_RDMA_PIN_ALL]);
 
@@ -3435,3 +3603,27 @@ err:
     g_free(rdma);
     migrate_fd_error(s);
 }
+
+void rdma_mig_stats_reset(void)
+{
+    memset(&rdma_stats, 0, sizeof(rdma_stats));
+}
+
+RDMAStats *rdma_mig_stats(void)
+{
+    RDMAStats *stats;
+
+    if (!rdma_stats.active) {
+        return NULL;
+    }
+
+    stats = g_malloc0(sizeof(*stats));
+    stats->registration_hits = rdma_stats.registration_hits;
+    stats->registration_misses = rdma_stats.registration_misses;
+    stats->unregistrations = rdma_stats.unregistrations;
+    stats->writes = rdma_stats.writes;
+    stats->max_outstanding = rdma_stats.max_outstanding;
+    stats->registration_time = rdma_stats.registration_ns / 1000000;
+    stats->wire_time = rdma_stats.wire_ns / 1000000;
+    return stats;
+}
@@ -19,6 +19,7 @@
 #include "migration/qemu-file.h"
 #include "block/block.h"
 #include "qemu/main-loop.h"
+#include "qemu/timer.h"
 
 //#define DEBUG_MIGRATION_TCP
 
@@ -30,9 +31,40 @@
     do { } while (0)
 #endif
 
+/* How long the destination waits for the x-multifd channels to show up
+ * once the main connection has been accepted, in nanoseconds.
+ */
+#define MULTIFD_ACCEPT_TIMEOUT (10 * 1000000000LL)
+
+static char *outgoing_host_port;
+
+/* The extra channels are connected only after the main connection is up,
+ * so that the destination sees the main stream first in its accept queue.
+ */
+static int tcp_connect_multifd_channels(MigrationState *s)
+{
+    Error *local_err = NULL;
+    int i, fd;
+
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        fd = inet_connect(outgoing_host_port, &local_err);
+        if (fd < 0) {
+            fprintf(stderr, "could not connect multifd channel %d: %s\n",
+                    i, error_get_pretty(local_err));
+            error_free(local_err);
+            return -1;
+        }
+        s->multifd_files[i] = qemu_fopen_socket(fd, "wb");
+        s->multifd_nb_files++;
+    }
+
+    return 0;
+}
+
 static void tcp_wait_for_connect(int fd, void *opaque)
 {
     MigrationState *s = opaque;
+    int i;
 
     if (fd < 0) {
         DPRINTF("migrate connect error\n");
@@ -41,15 +73,63 @@ static void tcp_wait_for_connect(int fd, void *opaque)
     } else {
         DPRINTF("migrate connect success\n");
         s->file = qemu_fopen_socket(fd, "wb");
+        if (migrate_use_multifd() && tcp_connect_multifd_channels(s) < 0) {
+            for (i = 0; i < s->multifd_nb_files; i++) {
+                qemu_fclose(s->multifd_files[i]);
+                s->multifd_files[i] = NULL;
+            }
+            s->multifd_nb_files = 0;
+            qemu_fclose(s->file);
+            s->file = NULL;
+            migrate_fd_error(s);
+            return;
+        }
         migrate_fd_connect(s);
     }
 }
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    g_free(outgoing_host_port);
+    outgoing_host_port = g_strdup(host_port);
     inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
+static int tcp_accept_multifd_channels(int s)
+{
+    QEMUFile *files[MULTIFD_MAX_CHANNELS];
+    int nb_files = migrate_multifd_channels();
+    int i, c;
+
+    for (i = 0; i < nb_files; i++) {
+        GPollFD pfd = { .fd = s, .events = G_IO_IN };
+
+        if (qemu_poll_ns(&pfd, 1, MULTIFD_ACCEPT_TIMEOUT) <= 0) {
+            fprintf(stderr, "timed out waiting for multifd channel %d\n", i);
+            goto fail;
+        }
+        do {
+            c = qemu_accept(s, NULL, NULL);
+        } while (c == -1 && socket_error() == EINTR);
+        if (c == -1) {
+            fprintf(stderr, "could not accept multifd channel %d\n", i);
+            goto fail;
+        }
+        /* The channels are read by dedicated threads, so keep them blocking */
+        qemu_set_block(c);
+        files[i] = qemu_fopen_socket(c, "rb");
+    }
+
+    multifd_load_setup(files, nb_files);
+    return 0;
+
+fail:
+    while (i-- > 0) {
+        qemu_fclose(files[i]);
+    }
+    return -1;
+}
+
 static void tcp_accept_incoming_migration(void *opaque)
 {
     struct sockaddr_in addr;
@@ -62,15 +142,21 @@ static void tcp_accept_incoming_migration(void *opaque)
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
     } while (c == -1 && socket_error() == EINTR);
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    closesocket(s);
 
     DPRINTF("accepted migration\n");
 
     if (c == -1) {
         fprintf(stderr, "could not accept migration connection\n");
+        closesocket(s);
         goto out;
     }
 
+    if (migrate_use_multifd() && tcp_accept_multifd_channels(s) < 0) {
+        closesocket(s);
+        goto out;
+    }
+    closesocket(s);
+
     f = qemu_fopen_socket(c, "rb");
     if (f == NULL) {
         fprintf(stderr, "could not qemu_fopen socket\n");
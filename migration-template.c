@@ -0,0 +1,153 @@
+/*
+ * Migration to and from a template file
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * "template:<path>" writes the device state to <path> and guest RAM, as
+ * a raw image, to <path>.ram.  "-incoming template:<path>" maps that
+ * image privately as guest RAM instead of copying it, so that many
+ * clones of one template start quickly and share the pages they have
+ * not written to.
+ *
+ * "file:<path>" uses the same two files, but is meant for saving and
+ * restoring one VM: the image is written with O_DIRECT, and
+ * "-incoming file:<path>" reads it back into RAM, both with several
+ * threads.
+ */
+
+#include "qemu-common.h"
+#include "qemu/main-loop.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "qapi/error.h"
+
+static void template_open_outgoing(MigrationState *s, const char *path,
+                                   bool direct, Error **errp)
+{
+    char *ram_path;
+    int fd, ram_fd, direct_fd = -1;
+
+    /* The pages are written once with the guest stopped, not streamed */
+    if (migrate_use_xbzrle() || migrate_postcopy_ram() ||
+        migrate_use_multifd() || migrate_use_compression()) {
+        error_setg(errp, "%s cannot be used with xbzrle, "
+                   "x-postcopy-ram, x-multifd or compress",
+                   direct ? "file:" : "template:");
+        return;
+    }
+
+    fd = qemu_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "cannot create %s", path);
+        return;
+    }
+
+    ram_path = g_strdup_printf("%s.ram", path);
+    ram_fd = qemu_open(ram_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+                       0600);
+    if (ram_fd < 0) {
+        error_setg_errno(errp, errno, "cannot create %s", ram_path);
+        g_free(ram_path);
+        qemu_close(fd);
+        return;
+    }
+
+#ifdef O_DIRECT
+    /* Not every file system supports O_DIRECT, so this is optional */
+    if (direct) {
+        direct_fd = qemu_open(ram_path, O_WRONLY | O_DIRECT | O_BINARY);
+    }
+#endif
+    g_free(ram_path);
+
+    if (direct) {
+        ram_file_set_fd(ram_fd, direct_fd);
+    } else {
+        ram_template_set_fd(ram_fd);
+    }
+    s->file = qemu_fdopen(fd, "wb");
+    migrate_fd_connect(s);
+}
+
+void template_start_outgoing_migration(MigrationState *s, const char *path,
+                                       Error **errp)
+{
+    template_open_outgoing(s, path, false, errp);
+}
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp)
+{
+    template_open_outgoing(s, path, true, errp);
+}
+
+static void template_accept_incoming_migration(void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    qemu_set_fd_handler2(qemu_get_fd(f), NULL, NULL, NULL, NULL);
+    process_incoming_migration(f);
+}
+
+static void template_open_incoming(const char *path, bool read_ram,
+                                   Error **errp)
+{
+    char *ram_path;
+    QEMUFile *f;
+    int fd, ram_fd, direct_fd = -1;
+
+    fd = qemu_open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "cannot open %s", path);
+        return;
+    }
+
+    /* A private mapping does not need write access to the file */
+    ram_path = g_strdup_printf("%s.ram", path);
+    ram_fd = qemu_open(ram_path, O_RDONLY | O_BINARY);
+    if (ram_fd < 0) {
+        error_setg_errno(errp, errno, "cannot open %s", ram_path);
+        g_free(ram_path);
+        qemu_close(fd);
+        return;
+    }
+
+#ifdef O_DIRECT
+    if (read_ram) {
+        direct_fd = qemu_open(ram_path, O_RDONLY | O_DIRECT | O_BINARY);
+    }
+#endif
+    g_free(ram_path);
+
+    f = qemu_fdopen(fd, "rb");
+    if (f == NULL) {
+        error_setg_errno(errp, errno, "failed to open the source descriptor");
+        if (direct_fd >= 0) {
+            qemu_close(direct_fd);
+        }
+        qemu_close(ram_fd);
+        qemu_close(fd);
+        return;
+    }
+
+    if (read_ram) {
+        ram_file_set_fd(ram_fd, direct_fd);
+    } else {
+        ram_template_set_fd(ram_fd);
+    }
+    qemu_set_fd_handler2(fd, NULL, template_accept_incoming_migration, NULL,
+                         f);
+}
+
+void template_start_incoming_migration(const char *path, Error **errp)
+{
+    template_open_incoming(path, false, errp);
+}
+
+void file_start_incoming_migration(const char *path, Error **errp)
+{
+    template_open_incoming(path, true, errp);
+}
@@ -23,7 +23,9 @@
 #include "qemu/sockets.h"
 #include "migration/block.h"
 #include "qemu/thread.h"
+#include "qemu/rcu.h"
 #include "qmp-commands.h"
+#include "qemu/error-report.h"
 #include "trace.h"
 
 //#define DEBUG_MIGRATION
@@ -43,6 +45,7 @@ enum {
     MIG_STATE_CANCELLED,
     MIG_STATE_ACTIVE,
     MIG_STATE_COMPLETED,
+    MIG_STATE_POSTCOPY_ACTIVE,
 };
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration speed throttling */
@@ -55,9 +58,39 @@ enum {
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Default number of extra channels used by x-multifd */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+
+/* Default compression parameters: favour speed, decompression is cheap */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREADS 8
+#define DEFAULT_MIGRATE_DECOMPRESS_THREADS 2
+#define MAX_MIGRATE_COMPRESS_THREADS 255
+
+/* x-auto-tune looks at each second of the migration in turn */
+#define AUTO_TUNE_INTERVAL      1000
+#define AUTO_TUNE_THROTTLE_MIN  20
+#define AUTO_TUNE_THROTTLE_MAX  90
+#define AUTO_TUNE_THROTTLE_STEP 10
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
+/* Placement of the migration thread, from -realtime */
+static QemuThreadSched migration_thread_sched;
+
+int migrate_set_thread_sched(const char *affinity, const char *sched)
+{
+    QemuThreadSched s = {};
+
+    if ((affinity && qemu_thread_parse_affinity(&s, affinity) < 0) ||
+        (sched && qemu_thread_parse_sched(&s, sched) < 0)) {
+        return -EINVAL;
+    }
+    migration_thread_sched = s;
+    return 0;
+}
+
 /* When we add fault tolerance, we could have several
    migrations at once.  For now we don't need to add
    dynamic creation of migration */
@@ -69,6 +102,18 @@ MigrationState *migrate_get_current(void)
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
         .mbps = -1,
+        .parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] =
+            DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] =
+            DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_THREADS] =
+            DEFAULT_MIGRATE_COMPRESS_THREADS,
+        .parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
+            DEFAULT_MIGRATE_DECOMPRESS_THREADS,
+        .parameters[MIGRATION_PARAMETER_X_RDMA_REGISTRATION_CACHE] = 0,
+        .parameters[MIGRATION_PARAMETER_X_FILE_BUFFER_SIZE] =
+            QEMU_FILE_BUF_SIZE,
+        .parameters[MIGRATION_PARAMETER_X_FILE_IOV_MAX] = QEMU_FILE_IOV_MAX,
     };
 
     return &current_migration;
@@ -91,6 +136,10 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     else if (strstart(uri, "fd:", &p))
         fd_start_incoming_migration(p, errp);
+    else if (strstart(uri, "template:", &p))
+        template_start_incoming_migration(p, errp);
+    else if (strstart(uri, "file:", &p))
+        file_start_incoming_migration(p, errp);
 #endif
     else {
         error_setg(errp, "unknown migration protocol: %s", uri);
@@ -103,11 +152,15 @@ static void process_incoming_migration_co(void *opaque)
     int ret;
 
     ret = qemu_loadvm_state(f);
-    qemu_fclose(f);
+    if (ret != LOADVM_POSTCOPY_RUNNING) {
+        qemu_fclose(f);
+    }
     if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(EXIT_FAILURE);
     }
+    multifd_load_cleanup();
+    decompress_threads_cleanup();
     qemu_announce_self();
     DPRINTF("successfully loaded vm state\n");
 
@@ -129,9 +182,16 @@ void process_incoming_migration(QEMUFile *f)
 
     assert(fd != -1);
     qemu_set_nonblock(fd);
+    migrate_set_file_buffer_size(f);
     qemu_coroutine_enter(co, f);
 }
 
+bool migration_is_active(MigrationState *s)
+{
+    return s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
+           s->state == MIG_STATE_POSTCOPY_ACTIVE;
+}
+
 /* amount of nanoseconds we are willing to wait for migration to be down.
  * the choice of nanoseconds is because it is the maximum resolution that
  * get_clock() can achieve. It is an internal measure. All user-visible
@@ -143,6 +203,15 @@ uint64_t migrate_max_downtime(void)
     return max_downtime;
 }
 
+/* Downtime in nanoseconds allowed for the final pass */
+static uint64_t migration_downtime_limit(MigrationState *s)
+{
+    if (migrate_auto_tune()) {
+        return MAX(s->tune_downtime, max_downtime);
+    }
+    return max_downtime;
+}
+
 MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
 {
     MigrationCapabilityStatusList *head = NULL;
@@ -178,6 +247,47 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_cache_hits();
+        info->xbzrle_cache->cache_evictions = xbzrle_mig_cache_evictions();
+        info->xbzrle_cache->cache_hit_rate = xbzrle_mig_cache_hit_rate();
+        info->xbzrle_cache->cache_eviction_rate =
+            xbzrle_mig_cache_eviction_rate();
+    }
+}
+
+static void get_compression_stats(MigrationInfo *info)
+{
+    if (migrate_use_compression()) {
+        info->has_compression = true;
+        info->compression = g_malloc0(sizeof(*info->compression));
+        info->compression->pages = compress_mig_pages_transferred();
+        info->compression->busy = compress_mig_busy_count();
+        info->compression->compressed_size = compress_mig_bytes_transferred();
+        info->compression->compression_rate = compress_mig_compression_rate();
+        info->compression->threads = compress_thread_stats();
+    }
+}
+
+static void get_rdma_stats(MigrationInfo *info)
+{
+#ifdef CONFIG_RDMA
+    info->rdma = rdma_mig_stats();
+    info->has_rdma = info->rdma != NULL;
+#endif
+}
+
+static void get_auto_tune_stats(MigrationInfo *info, MigrationState *s)
+{
+    if (migrate_auto_tune()) {
+        info->has_auto_tune = true;
+        info->auto_tune = g_malloc0(sizeof(*info->auto_tune));
+        info->auto_tune->bandwidth_limit = s->tune_bandwidth_limit;
+        info->auto_tune->bandwidth = s->tune_bandwidth;
+        info->auto_tune->dirty_rate = s->dirty_bytes_rate;
+        info->auto_tune->throttle = s->tune_throttle;
+        info->auto_tune->downtime_limit = migration_downtime_limit(s) / 1000000;
+        info->auto_tune->adjustments = s->tune_adjustments;
+        info->auto_tune->last_action = s->tune_action;
     }
 }
 
@@ -227,9 +337,38 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
+        get_rdma_stats(info);
+        get_auto_tune_stats(info, s);
+        break;
+    case MIG_STATE_POSTCOPY_ACTIVE:
+        /* The guest runs on the destination, RAM is still being sent */
+        info->has_status = true;
+        info->status = g_strdup("postcopy-active");
+        info->has_total_time = true;
+        info->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME)
+            - s->total_time;
+        info->has_downtime = true;
+        info->downtime = s->downtime;
+        info->has_setup_time = true;
+        info->setup_time = s->setup_time;
+
+        info->has_ram = true;
+        info->ram = g_malloc0(sizeof(*info->ram));
+        info->ram->transferred = ram_bytes_transferred();
+        info->ram->remaining = ram_bytes_remaining();
+        info->ram->total = ram_bytes_total();
+        info->ram->duplicate = dup_mig_pages_transferred();
+        info->ram->skipped = skipped_mig_pages_transferred();
+        info->ram->normal = norm_mig_pages_transferred();
+        info->ram->normal_bytes = norm_mig_bytes_transferred();
+        info->ram->mbps = s->mbps;
         break;
     case MIG_STATE_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
+        get_rdma_stats(info);
+        get_auto_tune_stats(info, s);
 
         info->has_status = true;
         info->status = g_strdup("completed");
@@ -270,7 +409,7 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     MigrationState *s = migrate_get_current();
     MigrationCapabilityStatusList *cap;
 
-    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP) {
+    if (migration_is_active(s)) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -280,11 +419,157 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     }
 }
 
+void qmp_migrate_set_parameters(bool has_x_multifd_channels,
+                                int64_t x_multifd_channels,
+                                bool has_compress_level,
+                                int64_t compress_level,
+                                bool has_compress_threads,
+                                int64_t compress_threads,
+                                bool has_decompress_threads,
+                                int64_t decompress_threads,
+                                bool has_x_rdma_registration_cache,
+                                int64_t x_rdma_registration_cache,
+                                bool has_x_file_buffer_size,
+                                int64_t x_file_buffer_size,
+                                bool has_x_file_iov_max,
+                                int64_t x_file_iov_max,
+                                bool has_x_auto_tune_max_bandwidth,
+                                int64_t x_auto_tune_max_bandwidth,
+                                bool has_x_auto_tune_deadline,
+                                int64_t x_auto_tune_deadline,
+                                Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (migration_is_active(s)) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (has_x_multifd_channels &&
+        (x_multifd_channels < 1 ||
+         x_multifd_channels > MULTIFD_MAX_CHANNELS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "x-multifd-channels",
+                  "is invalid, it should be in the range of 1 to 16");
+        return;
+    }
+    if (has_compress_level && (compress_level < 0 || compress_level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-level",
+                  "is invalid, it should be in the range of 0 to 9");
+        return;
+    }
+    if (has_compress_threads &&
+        (compress_threads < 1 ||
+         compress_threads > MAX_MIGRATE_COMPRESS_THREADS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-threads",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_decompress_threads &&
+        (decompress_threads < 1 ||
+         decompress_threads > MAX_MIGRATE_COMPRESS_THREADS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "decompress-threads",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_x_rdma_registration_cache && x_rdma_registration_cache < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE,
+                  "x-rdma-registration-cache",
+                  "is invalid, it should not be negative");
+        return;
+    }
+    if (has_x_file_buffer_size &&
+        (x_file_buffer_size < QEMU_FILE_BUF_SIZE_MIN ||
+         x_file_buffer_size > QEMU_FILE_BUF_SIZE_MAX)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "x-file-buffer-size",
+                  "is invalid, it should be in the range of 4096 to 16777216");
+        return;
+    }
+    if (has_x_file_iov_max &&
+        (x_file_iov_max < 1 || x_file_iov_max > IOV_MAX)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "x-file-iov-max",
+                  "is invalid, it should be between 1 and the host's IOV_MAX");
+        return;
+    }
+    if (has_x_auto_tune_max_bandwidth && x_auto_tune_max_bandwidth < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE,
+                  "x-auto-tune-max-bandwidth",
+                  "is invalid, it should not be negative");
+        return;
+    }
+    if (has_x_auto_tune_deadline && x_auto_tune_deadline < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "x-auto-tune-deadline",
+                  "is invalid, it should not be negative");
+        return;
+    }
+
+    if (has_x_multifd_channels) {
+        s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] =
+            x_multifd_channels;
+    }
+    if (has_compress_level) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
+    }
+    if (has_compress_threads) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS] = compress_threads;
+    }
+    if (has_decompress_threads) {
+        s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
+            decompress_threads;
+    }
+    if (has_x_rdma_registration_cache) {
+        s->parameters[MIGRATION_PARAMETER_X_RDMA_REGISTRATION_CACHE] =
+            x_rdma_registration_cache;
+    }
+    if (has_x_file_buffer_size) {
+        s->parameters[MIGRATION_PARAMETER_X_FILE_BUFFER_SIZE] =
+            x_file_buffer_size;
+    }
+    if (has_x_file_iov_max) {
+        s->parameters[MIGRATION_PARAMETER_X_FILE_IOV_MAX] = x_file_iov_max;
+    }
+    if (has_x_auto_tune_max_bandwidth) {
+        s->parameters[MIGRATION_PARAMETER_X_AUTO_TUNE_MAX_BANDWIDTH] =
+            x_auto_tune_max_bandwidth;
+    }
+    if (has_x_auto_tune_deadline) {
+        s->parameters[MIGRATION_PARAMETER_X_AUTO_TUNE_DEADLINE] =
+            x_auto_tune_deadline;
+    }
+}
+
+MigrationParameters *qmp_query_migrate_parameters(Error **errp)
+{
+    MigrationParameters *params;
+    MigrationState *s = migrate_get_current();
+
+    params = g_malloc0(sizeof(*params));
+    params->x_multifd_channels =
+        s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
+    params->compress_level = s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
+    params->compress_threads =
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
+    params->decompress_threads =
+        s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+    params->x_rdma_registration_cache =
+        s->parameters[MIGRATION_PARAMETER_X_RDMA_REGISTRATION_CACHE];
+    params->x_file_buffer_size =
+        s->parameters[MIGRATION_PARAMETER_X_FILE_BUFFER_SIZE];
+    params->x_file_iov_max = s->parameters[MIGRATION_PARAMETER_X_FILE_IOV_MAX];
+    params->x_auto_tune_max_bandwidth =
+        s->parameters[MIGRATION_PARAMETER_X_AUTO_TUNE_MAX_BANDWIDTH];
+    params->x_auto_tune_deadline =
+        s->parameters[MIGRATION_PARAMETER_X_AUTO_TUNE_DEADLINE];
+
+    return params;
+}
+
 /* shared migration helpers */
 
 static void migrate_fd_cleanup(void *opaque)
 {
     MigrationState *s = opaque;
+    int i;
 
     qemu_bh_delete(s->cleanup_bh);
     s->cleanup_bh = NULL;
@@ -295,16 +580,29 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_thread_join(&s->thread);
         qemu_mutex_lock_iothread();
 
+        if (s->rp_file) {
+            qemu_fclose(s->rp_file);
+            s->rp_file = NULL;
+        }
+
         qemu_fclose(s->file);
         s->file = NULL;
     }
 
-    assert(s->state != MIG_STATE_ACTIVE);
+    assert(s->state != MIG_STATE_ACTIVE &&
+           s->state != MIG_STATE_POSTCOPY_ACTIVE);
 
     if (s->state != MIG_STATE_COMPLETED) {
         qemu_savevm_state_cancel();
     }
 
+    /* The channel threads are gone once RAM migration has ended */
+    for (i = 0; i < s->multifd_nb_files; i++) {
+        qemu_fclose(s->multifd_files[i]);
+        s->multifd_files[i] = NULL;
+    }
+    s->multifd_nb_files = 0;
+
     notifier_list_notify(&migration_state_notifiers, s);
 }
 
@@ -362,15 +660,18 @@ static MigrationState *migrate_init(const MigrationParams *params)
     MigrationState *s = migrate_get_current();
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+    int64_t parameters[MIGRATION_PARAMETER_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
+    memcpy(parameters, s->parameters, sizeof(parameters));
 
     memset(s, 0, sizeof(*s));
     s->params = *params;
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
+    memcpy(s->parameters, parameters, sizeof(parameters));
     s->xbzrle_cache_size = xbzrle_cache_size;
 
     s->bandwidth_limit = bandwidth_limit;
@@ -378,6 +679,9 @@ static MigrationState *migrate_init(const MigrationParams *params)
     trace_migrate_set_state(MIG_STATE_SETUP);
 
     s->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+#ifdef CONFIG_RDMA
+    rdma_mig_stats_reset();
+#endif
     return s;
 }
 
@@ -405,7 +709,7 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     params.blk = has_blk && blk;
     params.shared = has_inc && inc;
 
-    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP) {
+    if (migration_is_active(s)) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -419,7 +723,30 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (dirty_rate_measuring()) {
+        error_setg(errp, "a dirty rate measurement is in progress");
+        return;
+    }
+
+    if (migrate_postcopy_ram() && (params.blk || params.shared)) {
+        error_setg(errp, "x-postcopy-ram cannot be used with block migration");
+        return;
+    }
+
+    if (migrate_postcopy_ram() && migrate_use_multifd()) {
+        error_setg(errp, "x-postcopy-ram cannot be used with x-multifd");
+        return;
+    }
+
+    if (migrate_use_compression() &&
+        (migrate_postcopy_ram() || migrate_use_multifd())) {
+        error_setg(errp, "compress cannot be used with x-postcopy-ram or "
+                   "x-multifd");
+        return;
+    }
+
     s = migrate_init(&params);
+    ram_template_set_fd(-1);
 
     if (strstart(uri, "tcp:", &p)) {
         tcp_start_outgoing_migration(s, p, &local_err);
@@ -434,6 +761,10 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "template:", &p)) {
+        template_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
 #endif
     } else {
         error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri", "a valid migration protocol");
@@ -452,9 +783,30 @@ void qmp_migrate_cancel(Error **errp)
     migrate_fd_cancel(migrate_get_current());
 }
 
+void qmp_migrate_start_postcopy(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (!migrate_postcopy_ram()) {
+        error_setg(errp, "Enable the x-postcopy-ram capability before "
+                   "starting the migration");
+        return;
+    }
+
+    if (s->state == MIG_STATE_NONE) {
+        error_setg(errp, "Postcopy must be started after migration has been"
+                   " started");
+        return;
+    }
+
+    /* Picked up by the migration thread on its next iteration */
+    atomic_mb_set(&s->start_postcopy, true);
+}
+
 void qmp_migrate_set_cache_size(int64_t value, Error **errp)
 {
     MigrationState *s = migrate_get_current();
+    int64_t new_size;
 
     /* Check for truncation */
     if (value != (size_t)value) {
@@ -463,7 +815,14 @@ void qmp_migrate_set_cache_size(int64_t value, Error **errp)
         return;
     }
 
-    s->xbzrle_cache_size = xbzrle_cache_resize(value);
+    new_size = xbzrle_cache_resize(value);
+    if (new_size < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
+                  "is smaller than a page");
+        return;
+    }
+
+    s->xbzrle_cache_size = new_size;
 }
 
 int64_t qmp_query_migrate_cache_size(Error **errp)
@@ -484,6 +843,7 @@ void qmp_migrate_set_speed(int64_t value, Error **errp)
 
     s = migrate_get_current();
     s->bandwidth_limit = value;
+    s->tune_bandwidth_limit = value;
     if (s->file) {
         qemu_file_set_rate_limit(s->file, s->bandwidth_limit / XFER_LIMIT_RATIO);
     }
@@ -514,6 +874,24 @@ bool migrate_auto_converge(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
 }
 
+bool migrate_auto_tune(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_AUTO_TUNE];
+}
+
+bool migrate_postcopy_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_POSTCOPY_RAM];
+}
+
 bool migrate_zero_blocks(void)
 {
     MigrationState *s;
@@ -523,6 +901,81 @@ bool migrate_zero_blocks(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_BLOCKS];
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
+}
+
+bool migrate_use_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+}
+
+int64_t migrate_rdma_registration_cache(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_RDMA_REGISTRATION_CACHE];
+}
+
+void migrate_set_file_buffer_size(QEMUFile *f)
+{
+    MigrationState *s;
+    int64_t *params;
+
+    s = migrate_get_current();
+    params = s->parameters;
+
+    qemu_file_set_buffer_size(f, params[MIGRATION_PARAMETER_X_FILE_BUFFER_SIZE],
+                              params[MIGRATION_PARAMETER_X_FILE_IOV_MAX]);
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -543,6 +996,208 @@ int64_t migrate_xbzrle_cache_size(void)
 
 /* migration thread support */
 
+/*
+ * Handles messages sent by the destination on the return path once
+ * postcopy has started: page requests, until it says it is done.
+ */
+static void *source_return_path_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    QEMUFile *rp = s->rp_file;
+    uint16_t type, len;
+    uint8_t buf[512];
+    char idstr[256];
+    uint64_t start;
+    uint32_t size;
+    uint8_t idlen;
+
+    while (true) {
+        type = qemu_get_be16(rp);
+        len = qemu_get_be16(rp);
+        if (qemu_file_get_error(rp) || len > sizeof(buf) ||
+            qemu_get_buffer(rp, buf, len) != len) {
+            error_report("postcopy: error reading the return path");
+            goto err;
+        }
+
+        switch (type) {
+        case MIG_RP_MSG_SHUT:
+            if (len != 4 || ldl_be_p(buf)) {
+                error_report("postcopy: destination failed");
+                goto err;
+            }
+            trace_source_return_path_thread_end();
+            return NULL;
+
+        case MIG_RP_MSG_REQ_PAGES:
+            if (len < 13 || len != 13 + buf[12]) {
+                error_report("postcopy: malformed page request");
+                goto err;
+            }
+            start = ldq_be_p(buf);
+            size = ldl_be_p(buf + 8);
+            idlen = buf[12];
+            memcpy(idstr, buf + 13, idlen);
+            idstr[idlen] = 0;
+            ram_save_queue_pages(idstr, start, size);
+            break;
+
+        default:
+            error_report("postcopy: unknown return path message %u", type);
+            goto err;
+        }
+    }
+
+err:
+    s->rp_error = true;
+    trace_source_return_path_thread_end();
+    return NULL;
+}
+
+/*
+ * Switch from precopy to postcopy: stop the guest, tell the destination
+ * which pages it must drop and send it the device state, after which the
+ * guest runs there and fetches the missing pages on demand.
+ */
+static int postcopy_start(MigrationState *s, bool *old_vm_running)
+{
+    int fd = qemu_get_fd(s->file);
+    int ret;
+
+    trace_postcopy_start();
+
+    if (fd == -1) {
+        error_report("postcopy: migration transport has no return path");
+        return -1;
+    }
+
+    qemu_mutex_lock_iothread();
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    *old_vm_running = runstate_is_running();
+
+    ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->rp_file = qemu_fopen_socket(dup(fd), "rb");
+    if (!s->rp_file) {
+        ret = -1;
+        goto fail;
+    }
+    qemu_thread_create(&s->rp_thread, source_return_path_thread, s,
+                       QEMU_THREAD_JOINABLE);
+
+    ret = ram_postcopy_send_discard_bitmap(s->file);
+    if (ret == 0) {
+        qemu_savevm_state_postcopy_start(s->file);
+        ret = qemu_file_get_error(s->file);
+    }
+    qemu_mutex_unlock_iothread();
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_POSTCOPY_ACTIVE);
+    /* Page requests must not wait behind the rate limit */
+    qemu_file_set_rate_limit(s->file, INT_MAX);
+    return 0;
+
+fail:
+    qemu_mutex_unlock_iothread();
+    return ret;
+}
+
+/*
+ * x-auto-tune: once a second, compare the throughput of the stream with
+ * the rate limit and with the rate at which the guest dirties memory.
+ * Raise the limit while the stream keeps up with it.  Once it does not,
+ * the network is the bottleneck, and auto-converge throttling is adjusted
+ * instead.  With a deadline, whatever cannot be sent by then goes into the
+ * downtime.
+ */
+static void migration_auto_tune(MigrationState *s, int64_t now,
+                                uint64_t pending)
+{
+    int64_t cap = s->parameters[MIGRATION_PARAMETER_X_AUTO_TUNE_MAX_BANDWIDTH];
+    int64_t deadline = s->parameters[MIGRATION_PARAMETER_X_AUTO_TUNE_DEADLINE];
+    MigrationAutoTuneAction action = MIGRATION_AUTO_TUNE_ACTION_NONE;
+    int64_t elapsed = now - s->tune_time;
+    int64_t bytes = qemu_ftell(s->file);
+    int64_t bw, dirty, progress, left, rest;
+    uint64_t downtime = 0;
+    bool on_track, ahead;
+
+    if (elapsed < AUTO_TUNE_INTERVAL) {
+        return;
+    }
+    bw = (bytes - s->tune_bytes) * 1000 / elapsed;
+    s->tune_time = now;
+    s->tune_bytes = bytes;
+    s->tune_bandwidth = bw;
+    if (bw <= 0) {
+        return;
+    }
+    dirty = s->dirty_bytes_rate;
+    progress = MAX(bw - dirty, 0);
+
+    if (bw >= s->tune_bandwidth_limit / 10 * 9 &&
+        (!cap || s->tune_bandwidth_limit < cap)) {
+        s->tune_bandwidth_limit = s->tune_bandwidth_limit / 2 * 3;
+        if (cap) {
+            s->tune_bandwidth_limit = MIN(s->tune_bandwidth_limit, cap);
+        }
+        qemu_file_set_rate_limit(s->file,
+                                 s->tune_bandwidth_limit / XFER_LIMIT_RATIO);
+        action = MIGRATION_AUTO_TUNE_ACTION_RAISE_BANDWIDTH;
+    }
+
+    if (deadline) {
+        left = MAX(deadline - (now - s->total_time), 0);
+        rest = pending - progress * left / 1000;
+        if (rest > 0) {
+            downtime = rest * 1000 / bw * 1000000;
+        }
+        on_track = downtime <= max_downtime;
+        ahead = progress * left / 1000 >= 2 * pending;
+    } else {
+        /* The same test auto-converge uses on its own */
+        on_track = dirty * 2 <= bw;
+        ahead = dirty * 4 <= bw;
+    }
+
+    if (migrate_auto_converge() &&
+        action == MIGRATION_AUTO_TUNE_ACTION_NONE) {
+        if (!on_track && s->tune_throttle < AUTO_TUNE_THROTTLE_MAX) {
+            s->tune_throttle = s->tune_throttle ?
+                s->tune_throttle + AUTO_TUNE_THROTTLE_STEP :
+                AUTO_TUNE_THROTTLE_MIN;
+            action = MIGRATION_AUTO_TUNE_ACTION_THROTTLE;
+        } else if (ahead && s->tune_throttle) {
+            s->tune_throttle -= AUTO_TUNE_THROTTLE_STEP;
+            if (s->tune_throttle < AUTO_TUNE_THROTTLE_MIN) {
+                s->tune_throttle = 0;
+            }
+            action = MIGRATION_AUTO_TUNE_ACTION_RELAX_THROTTLE;
+        }
+        ram_set_throttle(s->tune_throttle);
+    }
+
+    if (downtime > MAX(s->tune_downtime, max_downtime) &&
+        action == MIGRATION_AUTO_TUNE_ACTION_NONE) {
+        action = MIGRATION_AUTO_TUNE_ACTION_RAISE_DOWNTIME;
+    }
+    s->tune_downtime = downtime;
+
+    if (action != MIGRATION_AUTO_TUNE_ACTION_NONE) {
+        s->tune_action = action;
+        s->tune_adjustments++;
+    }
+    trace_migration_auto_tune(action, bw, dirty, s->tune_bandwidth_limit,
+                              s->tune_throttle, downtime / 1000000);
+}
+
 static void *migration_thread(void *opaque)
 {
     MigrationState *s = opaque;
@@ -551,23 +1206,64 @@ static void *migration_thread(void *opaque)
     int64_t initial_bytes = 0;
     int64_t max_size = 0;
     int64_t start_time = initial_time;
+    uint64_t last_pending = 0;
     bool old_vm_running = false;
+    bool entered_postcopy = false;
+    int ret;
+
+    rcu_register_thread();
+
+    ret = qemu_thread_set_sched(&migration_thread_sched);
+    if (ret < 0) {
+        error_report("cannot set the affinity or scheduling policy of the "
+                     "migration thread: %s", strerror(-ret));
+    }
 
     DPRINTF("beginning savevm\n");
     qemu_savevm_state_begin(s->file, &s->params);
 
     s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
     migrate_set_state(s, MIG_STATE_SETUP, MIG_STATE_ACTIVE);
+    s->tune_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    s->tune_bytes = qemu_ftell(s->file);
 
     DPRINTF("setup complete\n");
 
-    while (s->state == MIG_STATE_ACTIVE) {
+    while (s->state == MIG_STATE_ACTIVE ||
+           s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         int64_t current_time;
         uint64_t pending_size;
 
-        if (!qemu_file_rate_limit(s->file)) {
+        if (s->state == MIG_STATE_ACTIVE &&
+            atomic_mb_read(&s->start_postcopy)) {
+            start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+            entered_postcopy = true;
+            if (postcopy_start(s, &old_vm_running) < 0) {
+                migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_ERROR);
+                break;
+            }
+            s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_time;
+            continue;
+        }
+
+        if (s->state == MIG_STATE_POSTCOPY_ACTIVE) {
+            pending_size = qemu_savevm_state_pending(s->file, 0);
+            if (pending_size) {
+                qemu_savevm_state_iterate(s->file);
+            } else {
+                qemu_mutex_lock_iothread();
+                qemu_savevm_state_complete_postcopy(s->file);
+                qemu_mutex_unlock_iothread();
+                if (!qemu_file_get_error(s->file)) {
+                    migrate_set_state(s, MIG_STATE_POSTCOPY_ACTIVE,
+                                      MIG_STATE_COMPLETED);
+                    break;
+                }
+            }
+        } else if (!qemu_file_rate_limit(s->file)) {
             DPRINTF("iterate\n");
             pending_size = qemu_savevm_state_pending(s->file, max_size);
+            last_pending = pending_size;
             DPRINTF("pending size %" PRIu64 " max %" PRIu64 "\n",
                     pending_size, max_size);
             if (pending_size && pending_size >= max_size) {
@@ -580,6 +1276,7 @@ static void *migration_thread(void *opaque)
                 start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
                 qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
                 old_vm_running = runstate_is_running();
+                s->vm_was_running = old_vm_running;
 
                 ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
                 if (ret >= 0) {
@@ -600,8 +1297,8 @@ static void *migration_thread(void *opaque)
             }
         }
 
-        if (qemu_file_get_error(s->file)) {
-            migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_ERROR);
+        if (qemu_file_get_error(s->file) || s->rp_error) {
+            migrate_set_state(s, s->state, MIG_STATE_ERROR);
             break;
         }
         current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
@@ -609,7 +1306,7 @@ static void *migration_thread(void *opaque)
             uint64_t transferred_bytes = qemu_ftell(s->file) - initial_bytes;
             uint64_t time_spent = current_time - initial_time;
             double bandwidth = transferred_bytes / time_spent;
-            max_size = bandwidth * migrate_max_downtime() / 1000000;
+            max_size = bandwidth * migration_downtime_limit(s) / 1000000;
 
             s->mbps = time_spent ? (((double) transferred_bytes * 8.0) /
                     ((double) time_spent / 1000.0)) / 1000.0 / 1000.0 : -1;
@@ -623,6 +1320,10 @@ static void *migration_thread(void *opaque)
                 s->expected_downtime = s->dirty_bytes_rate / bandwidth;
             }
 
+            if (migrate_auto_tune() && s->state == MIG_STATE_ACTIVE) {
+                migration_auto_tune(s, current_time, last_pending);
+            }
+
             qemu_file_reset_rate_limit(s->file);
             initial_time = current_time;
             initial_bytes = qemu_ftell(s->file);
@@ -633,23 +1334,51 @@ static void *migration_thread(void *opaque)
         }
     }
 
+    if (s->rp_file) {
+        /* Wait for the destination to finish with the return path, or
+         * kick the thread out of its read on failure.
+         */
+        if (s->state != MIG_STATE_COMPLETED) {
+            shutdown(qemu_get_fd(s->file), SHUT_RDWR);
+        }
+        qemu_thread_join(&s->rp_thread);
+    }
+
     qemu_mutex_lock_iothread();
     if (s->state == MIG_STATE_COMPLETED) {
         int64_t end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
         s->total_time = end_time - s->total_time;
-        s->downtime = end_time - start_time;
+        if (!entered_postcopy) {
+            s->downtime = end_time - start_time;
+        }
         runstate_set(RUN_STATE_POSTMIGRATE);
     } else {
-        if (old_vm_running) {
+        /* Once the destination has run the guest, there is no going back */
+        if (old_vm_running && !entered_postcopy) {
             vm_start();
         }
     }
     qemu_bh_schedule(s->cleanup_bh);
     qemu_mutex_unlock_iothread();
 
+    rcu_unregister_thread();
     return NULL;
 }
 
+/*
+ * Migrates to a QEMUFile that the caller opened, such as the VM state area
+ * of an image for savevm-start.  The caller has checked that no migration
+ * is active and that the capabilities in use fit the file.
+ */
+void migrate_start_outgoing_file(QEMUFile *f)
+{
+    MigrationParams params = { .blk = false, .shared = false };
+    MigrationState *s = migrate_init(&params);
+
+    s->file = f;
+    migrate_fd_connect(s);
+}
+
 void migrate_fd_connect(MigrationState *s)
 {
     s->state = MIG_STATE_SETUP;
@@ -661,6 +1390,8 @@ void migrate_fd_connect(MigrationState *s)
 
     qemu_file_set_rate_limit(s->file,
                              s->bandwidth_limit / XFER_LIMIT_RATIO);
+    s->tune_bandwidth_limit = s->bandwidth_limit;
+    migrate_set_file_buffer_size(s->file);
 
     /* Notify before starting migration thread */
     notifier_list_notify(&migration_state_notifiers, s);
@@ -67,6 +67,8 @@
 #include "qmp-commands.h"
 #include "hmp.h"
 #include "qemu/thread.h"
+#include "hw/xen/xen.h"
+#include "sysemu/xen-mapcache.h"
 
 /* for pic/irq_info */
 #if defined(TARGET_SPARC)
@@ -163,10 +165,27 @@ struct MonFdset {
     QLIST_ENTRY(MonFdset) next;
 };
 
+/* A command read by the monitor I/O thread, waiting for the main loop */
+typedef struct MonitorQMPRequest {
+    QObject *req;       /* NULL if the input could not be parsed */
+    bool closed;        /* not a command: the connection was closed */
+    QSIMPLEQ_ENTRY(MonitorQMPRequest) entry;
+} MonitorQMPRequest;
+
 typedef struct MonitorControl {
     QObject *id;
     JSONMessageParser parser;
     int command_mode;
+
+    /* With MONITOR_USE_IOTHREAD, input is parsed in the monitor I/O thread
+     * and queued for dispatch_bh.  qmp_pending counts the requests that
+     * are queued or being dispatched; while it is nonzero, BQL-free
+     * commands are queued too, so that replies stay in order.
+     */
+    QemuMutex qmp_queue_lock;
+    QSIMPLEQ_HEAD(, MonitorQMPRequest) qmp_requests;
+    int qmp_pending;
+    QEMUBH *dispatch_bh;
 } MonitorControl;
 
 /*
@@ -189,6 +208,8 @@ struct Monitor {
     int flags;
     int suspend_cnt;
     bool skip_flush;
+    bool use_iothread;
+    QemuMutex out_lock;         /* protects outbuf and watch */
     QString *outbuf;
     guint watch;
     ReadLineState *rs;
@@ -214,7 +235,8 @@ static mon_cmd_t info_cmds[];
 
 static const mon_cmd_t qmp_cmds[];
 
-Monitor *cur_mon;
+/* Thread-local, as the monitor I/O thread runs commands too */
+__thread Monitor *cur_mon;
 Monitor *default_mon;
 
 static void monitor_command_cb(Monitor *mon, const char *cmdline,
@@ -263,17 +285,21 @@ int monitor_read_password(Monitor *mon, ReadLineFunc *readline_func,
     }
 }
 
+static void monitor_flush_locked(Monitor *mon);
+
 static gboolean monitor_unblocked(GIOChannel *chan, GIOCondition cond,
                                   void *opaque)
 {
     Monitor *mon = opaque;
 
+    qemu_mutex_lock(&mon->out_lock);
     mon->watch = 0;
-    monitor_flush(mon);
+    monitor_flush_locked(mon);
+    qemu_mutex_unlock(&mon->out_lock);
     return FALSE;
 }
 
-void monitor_flush(Monitor *mon)
+static void monitor_flush_locked(Monitor *mon)
 {
     int rc;
     size_t len;
@@ -307,8 +333,15 @@ void monitor_flush(Monitor *mon)
     }
 }
 
+void monitor_flush(Monitor *mon)
+{
+    qemu_mutex_lock(&mon->out_lock);
+    monitor_flush_locked(mon);
+    qemu_mutex_unlock(&mon->out_lock);
+}
+
 /* flush at every end of line */
-static void monitor_puts(Monitor *mon, const char *str)
+static void monitor_puts_locked(Monitor *mon, const char *str)
 {
     char c;
 
@@ -321,11 +354,18 @@ static void monitor_puts(Monitor *mon, const char *str)
         }
         qstring_append_chr(mon->outbuf, c);
         if (c == '\n') {
-            monitor_flush(mon);
+            monitor_flush_locked(mon);
         }
     }
 }
 
+static void monitor_puts(Monitor *mon, const char *str)
+{
+    qemu_mutex_lock(&mon->out_lock);
+    monitor_puts_locked(mon, str);
+    qemu_mutex_unlock(&mon->out_lock);
+}
+
 void monitor_vprintf(Monitor *mon, const char *fmt, va_list ap)
 {
     char *buf;
@@ -404,18 +444,30 @@ static inline int monitor_has_error(const Monitor *mon)
     return mon->error != NULL;
 }
 
-static void monitor_json_emitter(Monitor *mon, const QObject *data)
+static void monitor_json_write(void *opaque, const char *buf, size_t len)
 {
-    QString *json;
+    Monitor *mon = opaque;
 
-    json = mon->flags & MONITOR_USE_PRETTY ? qobject_to_json_pretty(data) :
-                                             qobject_to_json(data);
-    assert(json != NULL);
+    monitor_puts_locked(mon, buf);
 
-    qstring_append_chr(json, '\n');
-    monitor_puts(mon, qstring_get_str(json));
+    /* Pass each chunk on to the character device, unless it is already
+     * blocked and monitor_unblocked() will flush the rest.
+     */
+    if (!mon->watch) {
+        monitor_flush_locked(mon);
+    }
+}
 
-    QDECREF(json);
+static void monitor_json_emitter(Monitor *mon, const QObject *data)
+{
+    /* Events from the main loop and replies from the I/O thread must not
+     * be interleaved.
+     */
+    qemu_mutex_lock(&mon->out_lock);
+    qobject_to_json_write(data, mon->flags & MONITOR_USE_PRETTY,
+                          monitor_json_write, mon);
+    monitor_puts_locked(mon, "\n");
+    qemu_mutex_unlock(&mon->out_lock);
 }
 
 static QDict *build_qmp_error_dict(const QError *err)
@@ -683,6 +735,7 @@ static void handle_user_command(Monitor *mon, const char *cmdline);
 static void monitor_data_init(Monitor *mon)
 {
     memset(mon, 0, sizeof(Monitor));
+    qemu_mutex_init(&mon->out_lock);
     mon->outbuf = qstring_new();
     /* Use *mon_cmds by default. */
     mon->cmd_table = mon_cmds;
@@ -691,6 +744,7 @@ static void monitor_data_init(Monitor *mon)
 static void monitor_data_destroy(Monitor *mon)
 {
     QDECREF(mon->outbuf);
+    qemu_mutex_destroy(&mon->out_lock);
 }
 
 char *qmp_human_monitor_command(const char *command_line, bool has_cpu_index,
@@ -1119,6 +1173,52 @@ static void do_info_jit(Monitor *mon, const QDict *qdict)
     dump_exec_info((FILE *)mon, monitor_fprintf);
 }
 
+static void do_info_tb_hot(Monitor *mon, const QDict *qdict)
+{
+    dump_tb_hot((FILE *)mon, monitor_fprintf,
+                qdict_get_try_int(qdict, "count", 20));
+}
+
+static void do_info_xen_mapcache(Monitor *mon, const QDict *qdict)
+{
+    XenMapCacheStats stats;
+
+    if (!xen_enabled()) {
+        monitor_printf(mon, "Xen is not in use\n");
+        return;
+    }
+
+    xen_map_cache_get_stats(&stats);
+    monitor_printf(mon, "hits: %" PRIu64 "\n", stats.hits);
+    monitor_printf(mon, "misses: %" PRIu64 "\n", stats.misses);
+    monitor_printf(mon, "remaps: %" PRIu64 "\n", stats.remaps);
+    monitor_printf(mon, "evictions: %" PRIu64 "\n", stats.evictions);
+    monitor_printf(mon, "mapped: %" PRIu64 " of %" PRIu64 " MB\n",
+                   stats.mapped_size >> 20, stats.max_size >> 20);
+}
+
+static void do_info_kvm_msi(Monitor *mon, const QDict *qdict)
+{
+    KVMMSIRouteStats stats;
+
+    if (!kvm_enabled()) {
+        monitor_printf(mon, "KVM is not in use\n");
+        return;
+    }
+
+    kvm_irqchip_get_msi_stats(&stats);
+    monitor_printf(mon, "KVM_SIGNAL_MSI: %s\n",
+                   stats.direct_msi ? "available" : "not available");
+    monitor_printf(mon, "direct: %" PRIu64 "\n", stats.direct);
+    monitor_printf(mon, "route hits: %" PRIu64 "\n", stats.hits);
+    monitor_printf(mon, "route misses: %" PRIu64 "\n", stats.misses);
+    monitor_printf(mon, "route evictions: %" PRIu64 "\n", stats.evictions);
+    monitor_printf(mon, "routing table commits: %" PRIu64 "\n",
+                   stats.commits);
+    monitor_printf(mon, "routes: %u of %u GSIs\n", stats.routes,
+                   stats.gsi_count);
+}
+
 static void do_info_history(Monitor *mon, const QDict *qdict)
 {
     int i;
@@ -1219,6 +1319,21 @@ static void do_singlestep(Monitor *mon, const QDict *qdict)
     }
 }
 
+static void do_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    const char *option = qdict_get_str(qdict, "option");
+
+    if (!strcmp(option, "on")) {
+        tb_profile_enabled = 1;
+    } else if (!strcmp(option, "off")) {
+        tb_profile_enabled = 0;
+    } else if (!strcmp(option, "reset")) {
+        tb_profile_reset();
+    } else {
+        monitor_printf(mon, "unexpected option %s\n", option);
+    }
+}
+
 static void do_gdbserver(Monitor *mon, const QDict *qdict)
 {
     const char *device = qdict_get_try_str(qdict, "device");
@@ -2687,6 +2802,20 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show infos for each CPU",
         .mhandler.cmd = hmp_info_cpus,
     },
+    {
+        .name       = "iothreads",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show iothreads",
+        .mhandler.cmd = hmp_info_iothreads,
+    },
+    {
+        .name       = "timers",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show timer wakeup statistics of each clock",
+        .mhandler.cmd = hmp_info_timers,
+    },
     {
         .name       = "history",
         .args_type  = "",
@@ -2763,6 +2892,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show dynamic compiler info",
         .mhandler.cmd = do_info_jit,
     },
+    {
+        .name       = "tb-hot",
+        .args_type  = "count:i?",
+        .params     = "[count]",
+        .help       = "show the most executed translation blocks",
+        .mhandler.cmd = do_info_tb_hot,
+    },
     {
         .name       = "kvm",
         .args_type  = "",
@@ -2770,6 +2906,34 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show KVM information",
         .mhandler.cmd = hmp_info_kvm,
     },
+    {
+        .name       = "xen_mapcache",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show Xen mapcache statistics",
+        .mhandler.cmd = do_info_xen_mapcache,
+    },
+    {
+        .name       = "kvm_msi",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show KVM MSI routing statistics",
+        .mhandler.cmd = do_info_kvm_msi,
+    },
+    {
+        .name       = "exits",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show KVM exit statistics",
+        .mhandler.cmd = hmp_info_exits,
+    },
+    {
+        .name       = "bql",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show global mutex contention statistics",
+        .mhandler.cmd = hmp_info_bql,
+    },
     {
         .name       = "numa",
         .args_type  = "",
@@ -2833,6 +2997,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show which guest mouse is receiving events",
         .mhandler.cmd = hmp_info_mice,
     },
+    {
+        .name       = "display",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the display refresh statistics of each console",
+        .mhandler.cmd = console_info,
+    },
     {
         .name       = "vnc",
         .args_type  = "",
@@ -2886,6 +3057,20 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show migration status",
         .mhandler.cmd = hmp_info_migrate,
     },
+    {
+        .name       = "dump",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show guest memory dump status",
+        .mhandler.cmd = hmp_info_dump,
+    },
+    {
+        .name       = "savevm",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show live snapshot status",
+        .mhandler.cmd = hmp_info_savevm,
+    },
     {
         .name       = "migrate_capabilities",
         .args_type  = "",
@@ -2893,6 +3078,20 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show current migration capabilities",
         .mhandler.cmd = hmp_info_migrate_capabilities,
     },
+    {
+        .name       = "migrate_parameters",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration parameters",
+        .mhandler.cmd = hmp_info_migrate_parameters,
+    },
+    {
+        .name       = "dirty_rate",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the result of the last dirty rate measurement",
+        .mhandler.cmd = hmp_info_dirty_rate,
+    },
     {
         .name       = "migrate_cache_size",
         .args_type  = "",
@@ -4645,18 +4844,15 @@ static void qmp_call_cmd(Monitor *mon, const mon_cmd_t *cmd,
     qobject_decref(data);
 }
 
-static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
+static void monitor_qmp_dispatch(Monitor *mon, QObject *obj)
 {
     int err;
-    QObject *obj;
     QDict *input, *args;
     const mon_cmd_t *cmd;
     const char *cmd_name;
-    Monitor *mon = cur_mon;
 
     args = input = NULL;
 
-    obj = json_parser_parse(tokens, NULL);
     if (!obj) {
         // FIXME: should be triggered in json_parser_parse()
         qerror_report(QERR_JSON_PARSING);
@@ -4717,6 +4913,115 @@ out:
     QDECREF(args);
 }
 
+static void monitor_qmp_closed(Monitor *mon)
+{
+    mon_refcount--;
+    monitor_fdsets_cleanup();
+}
+
+/* Can @obj run in the I/O thread?  Anything doubtful, including input that
+ * would produce an error, goes to the main loop, which reports errors
+ * exactly like it does without the I/O thread.
+ */
+static bool monitor_qmp_is_bql_free(Monitor *mon, QObject *obj)
+{
+    const mon_cmd_t *cmd;
+    const char *cmd_name;
+    QDict *input;
+    QObject *args;
+
+    if (!obj || qobject_type(obj) != QTYPE_QDICT || !qmp_cmd_mode(mon)) {
+        return false;
+    }
+
+    input = qobject_to_qdict(obj);
+    cmd_name = qdict_get_try_str(input, "execute");
+    if (!cmd_name || compare_cmd(cmd_name, "qmp_capabilities")) {
+        return false;
+    }
+
+    args = qdict_get(input, "arguments");
+    if (args && (qobject_type(args) != QTYPE_QDICT ||
+                 qdict_size(qobject_to_qdict(args)))) {
+        return false;
+    }
+
+    cmd = qmp_find_cmd(cmd_name);
+    return cmd && (cmd->flags & MONITOR_CMD_BQL_FREE);
+}
+
+static void monitor_qmp_dispatch_bh(void *opaque)
+{
+    Monitor *mon = opaque;
+    MonitorControl *mc = mon->mc;
+    MonitorQMPRequest *req;
+    Monitor *old_mon = cur_mon;
+
+    cur_mon = mon;
+    for (;;) {
+        qemu_mutex_lock(&mc->qmp_queue_lock);
+        req = QSIMPLEQ_FIRST(&mc->qmp_requests);
+        if (req) {
+            QSIMPLEQ_REMOVE_HEAD(&mc->qmp_requests, entry);
+        }
+        qemu_mutex_unlock(&mc->qmp_queue_lock);
+        if (!req) {
+            break;
+        }
+
+        if (req->closed) {
+            monitor_qmp_closed(mon);
+        } else {
+            monitor_qmp_dispatch(mon, req->req);
+        }
+        g_free(req);
+
+        qemu_mutex_lock(&mc->qmp_queue_lock);
+        mc->qmp_pending--;
+        qemu_mutex_unlock(&mc->qmp_queue_lock);
+    }
+    cur_mon = old_mon;
+}
+
+/* Called in the I/O thread, except for CHR_EVENT_CLOSED */
+static void monitor_qmp_queue(Monitor *mon, QObject *obj, bool closed)
+{
+    MonitorControl *mc = mon->mc;
+    MonitorQMPRequest *req;
+
+    qemu_mutex_lock(&mc->qmp_queue_lock);
+    if (!closed && mc->qmp_pending == 0 && monitor_qmp_is_bql_free(mon, obj)) {
+        /* Only this thread queues requests, so the main loop stays out of
+         * the way until we are done.
+         */
+        qemu_mutex_unlock(&mc->qmp_queue_lock);
+        monitor_qmp_dispatch(mon, obj);
+        return;
+    }
+
+    req = g_new0(MonitorQMPRequest, 1);
+    req->req = obj;
+    req->closed = closed;
+    QSIMPLEQ_INSERT_TAIL(&mc->qmp_requests, req, entry);
+    mc->qmp_pending++;
+    qemu_mutex_unlock(&mc->qmp_queue_lock);
+
+    qemu_bh_schedule(mc->dispatch_bh);
+}
+
+static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
+{
+    Monitor *mon = cur_mon;
+    QObject *obj;
+
+    obj = json_parser_parse(tokens, NULL);
+    if (mon->use_iothread) {
+        monitor_qmp_queue(mon, obj, false);
+    } else {
+        monitor_qmp_dispatch(mon, obj);
+    }
+}
+
 /**
  * monitor_control_read(): Read and handle QMP input
  */
@@ -4801,8 +5106,14 @@ static void monitor_control_event(void *opaque, int event)
     case CHR_EVENT_CLOSED:
         json_message_parser_destroy(&mon->mc->parser);
         json_message_parser_init(&mon->mc->parser, handle_qmp_command);
-        mon_refcount--;
-        monitor_fdsets_cleanup();
+        if (mon->use_iothread) {
+            /* This may run in the I/O thread, so let the main loop do the
+             * rest once it is done with the commands read before.
+             */
+            monitor_qmp_queue(mon, NULL, true);
+        } else {
+            monitor_qmp_closed(mon);
+        }
         break;
     }
 }
@@ -4881,6 +5192,32 @@ static void sortcmdlist(void)
  * End:
  */
 
+/* All monitors with iothread=on share one thread, which reads their input
+ * and runs the BQL-free commands.
+ */
+static void *monitor_io_thread(void *opaque)
+{
+    GMainContext *context = opaque;
+
+    for (;;) {
+        g_main_context_iteration(context, TRUE);
+    }
+    return NULL;
+}
+
+static GMainContext *monitor_io_context(void)
+{
+    static GMainContext *context;
+    static QemuThread thread;
+
+    if (!context) {
+        context = g_main_context_new();
+        qemu_thread_create(&thread, monitor_io_thread, context,
+                           QEMU_THREAD_DETACHED);
+    }
+    return context;
+}
+
 void monitor_init(CharDriverState *chr, int flags)
 {
     static int is_first_init = 1;
@@ -4904,6 +5241,17 @@ void monitor_init(CharDriverState *chr, int flags)
 
     if (monitor_ctrl_mode(mon)) {
         mon->mc = g_malloc0(sizeof(MonitorControl));
+        qemu_mutex_init(&mon->mc->qmp_queue_lock);
+        QSIMPLEQ_INIT(&mon->mc->qmp_requests);
+        if (flags & MONITOR_USE_IOTHREAD) {
+            if (qemu_chr_fe_set_context(chr, monitor_io_context()) < 0) {
+                fprintf(stderr, "chardev \"%s\" cannot be used by a monitor "
+                        "with iothread=on\n", chr->label);
+                exit(1);
+            }
+            mon->use_iothread = true;
+            mon->mc->dispatch_bh = qemu_bh_new(monitor_qmp_dispatch_bh, mon);
+        }
         /* Control mode requires special handlers */
         qemu_chr_add_handlers(chr, monitor_can_read, monitor_control_read,
                               monitor_control_event, mon);
@@ -5004,6 +5352,9 @@ QemuOptsList qemu_mon_opts = {
         },{
             .name = "pretty",
             .type = QEMU_OPT_BOOL,
+        },{
+            .name = "iothread",
+            .type = QEMU_OPT_BOOL,
         },
         { /* end of list */ }
     },
@@ -60,8 +60,10 @@
 
 #define NBD_REQUEST_SIZE        (4 + 4 + 8 + 8 + 4)
 #define NBD_REPLY_SIZE          (4 + 4 + 8)
+#define NBD_CHUNK_HEADER_SIZE   (4 + 2 + 2 + 8 + 4)
 #define NBD_REQUEST_MAGIC       0x25609513
 #define NBD_REPLY_MAGIC         0x67446698
+#define NBD_REP_MAGIC           0x3e889045565a9LL
 #define NBD_OPTS_MAGIC          0x49484156454F5054LL
 #define NBD_CLIENT_MAGIC        0x0000420281861253LL
 
@@ -77,8 +79,6 @@
 #define NBD_SET_TIMEOUT         _IO(0xab, 9)
 #define NBD_SET_FLAGS           _IO(0xab, 10)
 
-#define NBD_OPT_EXPORT_NAME     (1 << 0)
-
 /* Definitions for opaque data types */
 
 typedef struct NBDRequest NBDRequest;
@@ -98,8 +98,11 @@ struct NBDExport {
     off_t dev_offset;
     off_t size;
     uint32_t nbdflags;
+    int max_requests;
     QTAILQ_HEAD(, NBDClient) clients;
     QTAILQ_ENTRY(NBDExport) next;
+
+    AioContext *ctx;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -116,6 +119,10 @@ struct NBDClient {
     CoMutex send_lock;
     Coroutine *send_coroutine;
 
+    bool can_read;
+
+    NBDExtensions ext;
+
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
@@ -281,59 +288,236 @@ int unix_socket_outgoing(const char *path)
 
 */
 
+static int nbd_send_option_reply(int csock, uint32_t opt, uint32_t type,
+                                 uint32_t len, const void *data)
+{
+    uint8_t buf[8 + 4 + 4 + 4];
+
+    /* Option reply
+        [ 0 ..   7]   NBD_REP_MAGIC
+        [ 8 ..  11]   option
+        [12 ..  15]   reply type
+        [16 ..  19]   length
+        [20 ..  xx]   data (length bytes)
+     */
+    cpu_to_be64w((uint64_t*)buf, NBD_REP_MAGIC);
+    cpu_to_be32w((uint32_t*)(buf + 8), opt);
+    cpu_to_be32w((uint32_t*)(buf + 12), type);
+    cpu_to_be32w((uint32_t*)(buf + 16), len);
+
+    if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("write failed (option reply)");
+        return -EINVAL;
+    }
+    if (len && write_sync(csock, (void *)data, len) != len) {
+        LOG("write failed (option reply data)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int nbd_drop_option(int csock, uint32_t length)
+{
+    char buf[256];
+
+    while (length > 0) {
+        uint32_t n = MIN(length, sizeof(buf));
+        if (read_sync(csock, buf, n) != n) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+        length -= n;
+    }
+    return 0;
+}
+
+/* Read a length-prefixed string of at most 255 bytes out of the payload of
+ * an option, whose remaining length is in *length.
+ */
+static int nbd_read_option_string(int csock, char *name, uint32_t *length)
+{
+    uint32_t len;
+
+    if (*length < sizeof(len) ||
+        read_sync(csock, &len, sizeof(len)) != sizeof(len)) {
+        return -EINVAL;
+    }
+    *length -= sizeof(len);
+    len = be32_to_cpu(len);
+    if (len > 255 || len > *length) {
+        return -EINVAL;
+    }
+    if (read_sync(csock, name, len) != len) {
+        return -EINVAL;
+    }
+    name[len] = '\0';
+    *length -= len;
+    return 0;
+}
+
+/* Handle NBD_OPT_SET_META_CONTEXT.  The only context we support is
+ * "base:allocation", which is mapped onto bdrv_get_block_status().
+ */
+static int nbd_negotiate_meta_context(NBDClient *client, uint32_t length,
+                                      char *meta_export)
+{
+    int csock = client->sock;
+    uint32_t nb_queries, context_id;
+    char query[256];
+    bool found = false;
+
+    if (!client->ext.structured_reply) {
+        if (nbd_drop_option(csock, length) < 0) {
+            return -EINVAL;
+        }
+        return nbd_send_option_reply(csock, NBD_OPT_SET_META_CONTEXT,
+                                     NBD_REP_ERR_INVALID, 0, NULL);
+    }
+
+    if (nbd_read_option_string(csock, meta_export, &length) < 0 ||
+        length < sizeof(nb_queries) ||
+        read_sync(csock, &nb_queries, sizeof(nb_queries)) !=
+        sizeof(nb_queries)) {
+        LOG("invalid meta context request");
+        return -EINVAL;
+    }
+    length -= sizeof(nb_queries);
+    nb_queries = be32_to_cpu(nb_queries);
+
+    while (nb_queries--) {
+        if (nbd_read_option_string(csock, query, &length) < 0) {
+            LOG("invalid meta context query");
+            return -EINVAL;
+        }
+        if (!strcmp(query, NBD_META_BASE_ALLOCATION)) {
+            found = true;
+        }
+    }
+    if (nbd_drop_option(csock, length) < 0) {
+        return -EINVAL;
+    }
+
+    if (!nbd_export_find(meta_export)) {
+        return nbd_send_option_reply(csock, NBD_OPT_SET_META_CONTEXT,
+                                     NBD_REP_ERR_UNKNOWN, 0, NULL);
+    }
+
+    client->ext.base_allocation = found;
+    if (found) {
+        uint8_t buf[4 + sizeof(NBD_META_BASE_ALLOCATION) - 1];
+
+        context_id = client->ext.context_id = 1;
+        cpu_to_be32w((uint32_t*)buf, context_id);
+        memcpy(buf + 4, NBD_META_BASE_ALLOCATION, sizeof(buf) - 4);
+        if (nbd_send_option_reply(csock, NBD_OPT_SET_META_CONTEXT,
+                                  NBD_REP_META_CONTEXT,
+                                  sizeof(buf), buf) < 0) {
+            return -EINVAL;
+        }
+    }
+    return nbd_send_option_reply(csock, NBD_OPT_SET_META_CONTEXT,
+                                 NBD_REP_ACK, 0, NULL);
+}
+
 static int nbd_receive_options(NBDClient *client)
 {
     int csock = client->sock;
     char name[256];
-    uint32_t tmp, length;
+    char meta_export[256] = "";
+    uint32_t tmp, length, clientflags;
     uint64_t magic;
+    bool fixed;
     int rc;
 
     /* Client sends:
-        [ 0 ..   3]   reserved (0)
-        [ 4 ..  11]   NBD_OPTS_MAGIC
-        [12 ..  15]   NBD_OPT_EXPORT_NAME
-        [16 ..  19]   length
-        [20 ..  xx]   export name (length bytes)
+        [ 0 ..   3]   client flags
+
+       then any number of options, the last one being NBD_OPT_EXPORT_NAME:
+        [ 0 ..   7]   NBD_OPTS_MAGIC
+        [ 8 ..  11]   option
+        [12 ..  15]   length
+        [16 ..  xx]   option data (length bytes)
+
+       Only clients that set NBD_FLAG_C_FIXED_NEWSTYLE get replies to
+       options other than NBD_OPT_EXPORT_NAME.
      */
 
     rc = -EINVAL;
-    if (read_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp)) {
+    if (read_sync(csock, &clientflags, sizeof(clientflags)) !=
+        sizeof(clientflags)) {
         LOG("read failed");
         goto fail;
     }
-    TRACE("Checking reserved");
-    if (tmp != 0) {
-        LOG("Bad reserved received");
+    TRACE("Checking client flags");
+    clientflags = be32_to_cpu(clientflags);
+    if (clientflags & ~NBD_FLAG_C_FIXED_NEWSTYLE) {
+        LOG("Bad client flags received");
         goto fail;
     }
+    fixed = clientflags & NBD_FLAG_C_FIXED_NEWSTYLE;
 
-    if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
-        LOG("read failed");
-        goto fail;
-    }
-    TRACE("Checking reserved");
-    if (magic != be64_to_cpu(NBD_OPTS_MAGIC)) {
-        LOG("Bad magic received");
-        goto fail;
-    }
+    for (;;) {
+        if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
+            LOG("read failed");
+            goto fail;
+        }
+        TRACE("Checking magic");
+        if (magic != be64_to_cpu(NBD_OPTS_MAGIC)) {
+            LOG("Bad magic received");
+            goto fail;
+        }
 
-    if (read_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp)) {
-        LOG("read failed");
-        goto fail;
-    }
-    TRACE("Checking option");
-    if (tmp != be32_to_cpu(NBD_OPT_EXPORT_NAME)) {
-        LOG("Bad option received");
-        goto fail;
-    }
+        if (read_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp)) {
+            LOG("read failed");
+            goto fail;
+        }
+        if (read_sync(csock, &length, sizeof(length)) != sizeof(length)) {
+            LOG("read failed");
+            goto fail;
+        }
+        tmp = be32_to_cpu(tmp);
+        length = be32_to_cpu(length);
 
-    if (read_sync(csock, &length, sizeof(length)) != sizeof(length)) {
-        LOG("read failed");
-        goto fail;
+        TRACE("Checking option %u", tmp);
+        if (tmp == NBD_OPT_EXPORT_NAME) {
+            break;
+        }
+        if (!fixed) {
+            LOG("Bad option received");
+            goto fail;
+        }
+
+        switch (tmp) {
+        case NBD_OPT_STRUCTURED_REPLY:
+            if (length) {
+                if (nbd_drop_option(csock, length) < 0) {
+                    goto fail;
+                }
+                rc = nbd_send_option_reply(csock, tmp, NBD_REP_ERR_INVALID,
+                                           0, NULL);
+            } else {
+                client->ext.structured_reply = true;
+                rc = nbd_send_option_reply(csock, tmp, NBD_REP_ACK, 0, NULL);
+            }
+            break;
+        case NBD_OPT_SET_META_CONTEXT:
+            rc = nbd_negotiate_meta_context(client, length, meta_export);
+            break;
+        default:
+            if (nbd_drop_option(csock, length) < 0) {
+                goto fail;
+            }
+            rc = nbd_send_option_reply(csock, tmp, NBD_REP_ERR_UNSUP,
+                                       0, NULL);
+            break;
+        }
+        if (rc < 0) {
+            goto fail;
+        }
+        rc = -EINVAL;
     }
+
     TRACE("Checking length");
-    length = be32_to_cpu(length);
     if (length > 255) {
         LOG("Bad length received");
         goto fail;
@@ -350,6 +534,11 @@ static int nbd_receive_options(NBDClient *client)
         goto fail;
     }
 
+    /* The metadata context was selected for a different export */
+    if (strcmp(name, meta_export)) {
+        client->ext.base_allocation = false;
+    }
+
     QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
     nbd_export_get(client->exp);
 
@@ -378,7 +567,7 @@ static int nbd_send_negotiate(NBDClient *client)
        Negotiation header with options, part 1:
         [ 0 ..   7]   passwd       ("NBDMAGIC")
         [ 8 ..  15]   magic        (NBD_OPTS_MAGIC)
-        [16 ..  17]   server flags (0)
+        [16 ..  17]   server flags (NBD_FLAG_FIXED_NEWSTYLE)
 
        part 2 (after options are sent):
         [18 ..  25]   size
@@ -399,6 +588,7 @@ static int nbd_send_negotiate(NBDClient *client)
         cpu_to_be16w((uint16_t*)(buf + 26), client->exp->nbdflags | myflags);
     } else {
         cpu_to_be64w((uint64_t*)(buf + 8), NBD_OPTS_MAGIC);
+        cpu_to_be16w((uint16_t*)(buf + 16), NBD_FLAG_FIXED_NEWSTYLE);
     }
 
     if (client->exp) {
@@ -433,8 +623,128 @@ fail:
     return rc;
 }
 
+static int nbd_send_option(int csock, uint32_t opt, uint32_t len,
+                           const void *data)
+{
+    uint8_t buf[8 + 4 + 4];
+
+    cpu_to_be64w((uint64_t*)buf, NBD_OPTS_MAGIC);
+    cpu_to_be32w((uint32_t*)(buf + 8), opt);
+    cpu_to_be32w((uint32_t*)(buf + 12), len);
+
+    if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("write failed (option)");
+        return -EINVAL;
+    }
+    if (len && write_sync(csock, (void *)data, len) != len) {
+        LOG("write failed (option data)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int nbd_receive_option_reply(int csock, uint32_t opt, uint32_t *type,
+                                    uint32_t *len)
+{
+    uint8_t buf[8 + 4 + 4 + 4];
+
+    if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("read failed (option reply)");
+        return -EINVAL;
+    }
+    if (be64_to_cpup((uint64_t*)buf) != NBD_REP_MAGIC ||
+        be32_to_cpup((uint32_t*)(buf + 8)) != opt) {
+        LOG("Bad option reply received");
+        return -EINVAL;
+    }
+    *type = be32_to_cpup((uint32_t*)(buf + 12));
+    *len = be32_to_cpup((uint32_t*)(buf + 16));
+    return 0;
+}
+
+/* Ask a fixed newstyle server for structured replies and for the
+ * "base:allocation" metadata context of export @name.  Servers that do
+ * not know about them simply leave @ext cleared.
+ */
+static int nbd_negotiate_extensions(int csock, const char *name,
+                                    NBDExtensions *ext)
+{
+    uint32_t type, len, namelen, querylen;
+    uint8_t *buf;
+    size_t size;
+    char reply[4 + 256];
+    int rc;
+
+    memset(ext, 0, sizeof(*ext));
+
+    rc = nbd_send_option(csock, NBD_OPT_STRUCTURED_REPLY, 0, NULL);
+    if (rc == 0) {
+        rc = nbd_receive_option_reply(csock, NBD_OPT_STRUCTURED_REPLY,
+                                      &type, &len);
+    }
+    if (rc < 0) {
+        return rc;
+    }
+    if (nbd_drop_option(csock, len) < 0) {
+        return -EINVAL;
+    }
+    if (type != NBD_REP_ACK) {
+        return 0;
+    }
+    ext->structured_reply = true;
+
+    /* export name, one query */
+    namelen = strlen(name);
+    querylen = strlen(NBD_META_BASE_ALLOCATION);
+    size = 4 + namelen + 4 + 4 + querylen;
+    buf = g_malloc(size);
+    cpu_to_be32w((uint32_t*)buf, namelen);
+    memcpy(buf + 4, name, namelen);
+    cpu_to_be32w((uint32_t*)(buf + 4 + namelen), 1);
+    cpu_to_be32w((uint32_t*)(buf + 8 + namelen), querylen);
+    memcpy(buf + 12 + namelen, NBD_META_BASE_ALLOCATION, querylen);
+    rc = nbd_send_option(csock, NBD_OPT_SET_META_CONTEXT, size, buf);
+    g_free(buf);
+    if (rc < 0) {
+        return rc;
+    }
+
+    for (;;) {
+        rc = nbd_receive_option_reply(csock, NBD_OPT_SET_META_CONTEXT,
+                                      &type, &len);
+        if (rc < 0) {
+            return rc;
+        }
+        if (type != NBD_REP_META_CONTEXT) {
+            break;
+        }
+        if (len < 4 || len > sizeof(reply) - 1) {
+            LOG("Bad meta context reply received");
+            return -EINVAL;
+        }
+        if (read_sync(csock, reply, len) != len) {
+            LOG("read failed (meta context)");
+            return -EINVAL;
+        }
+        reply[len] = '\0';
+        if (!strcmp(reply + 4, NBD_META_BASE_ALLOCATION)) {
+            ext->base_allocation = true;
+            ext->context_id = be32_to_cpup((uint32_t*)reply);
+        }
+    }
+
+    /* NBD_REP_ACK, or an error that we treat as "not supported" */
+    if (nbd_drop_option(csock, len) < 0) {
+        return -EINVAL;
+    }
+    if (type != NBD_REP_ACK) {
+        ext->base_allocation = false;
+    }
+    return 0;
+}
+
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, size_t *blocksize)
+                          off_t *size, size_t *blocksize, NBDExtensions *ext)
 {
     char buf[256];
     uint64_t magic, s;
@@ -478,10 +788,15 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
     magic = be64_to_cpu(magic);
     TRACE("Magic is 0x%" PRIx64, magic);
 
+    if (ext) {
+        memset(ext, 0, sizeof(*ext));
+    }
+
     if (name) {
-        uint32_t reserved = 0;
+        uint32_t clientflags = 0;
         uint32_t opt;
         uint32_t namesize;
+        uint16_t globalflags;
 
         TRACE("Checking magic (opts_magic)");
         if (magic != NBD_OPTS_MAGIC) {
@@ -492,13 +807,21 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
             LOG("flags read failed");
             goto fail;
         }
-        *flags = be16_to_cpu(tmp) << 16;
-        /* reserved for future use */
-        if (write_sync(csock, &reserved, sizeof(reserved)) !=
-            sizeof(reserved)) {
-            LOG("write failed (reserved)");
+        globalflags = be16_to_cpu(tmp);
+        *flags = globalflags << 16;
+        if (globalflags & NBD_FLAG_FIXED_NEWSTYLE) {
+            clientflags = cpu_to_be32(NBD_FLAG_C_FIXED_NEWSTYLE);
+        }
+        if (write_sync(csock, &clientflags, sizeof(clientflags)) !=
+            sizeof(clientflags)) {
+            LOG("write failed (client flags)");
             goto fail;
         }
+        if (ext && (globalflags & NBD_FLAG_FIXED_NEWSTYLE)) {
+            if (nbd_negotiate_extensions(csock, name, ext) < 0) {
+                goto fail;
+            }
+        }
         /* write the export name */
         magic = cpu_to_be64(magic);
         if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -548,7 +871,7 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
             LOG("read failed (tmp)");
             goto fail;
         }
-        *flags |= be32_to_cpu(tmp);
+        *flags |= be16_to_cpu(tmp);
     }
     if (read_sync(csock, &buf, 124) != 124) {
         LOG("read failed (buf)");
@@ -732,16 +1055,19 @@ static ssize_t nbd_receive_request(int csock, struct nbd_request *request)
 
 ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
+    uint8_t buf[NBD_CHUNK_HEADER_SIZE];
     uint32_t magic;
     ssize_t ret;
 
-    ret = read_sync(csock, buf, sizeof(buf));
+    /* A simple reply is shorter than a chunk header, so it is always
+     * safe to read that much first.
+     */
+    ret = read_sync(csock, buf, NBD_REPLY_SIZE);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret != sizeof(buf)) {
+    if (ret != NBD_REPLY_SIZE) {
         LOG("read failed");
         return -EINVAL;
     }
@@ -750,11 +1076,45 @@ ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
+
+       Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload
      */
 
     magic = be32_to_cpup((uint32_t*)buf);
+    reply->magic = magic;
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        /* The rest of the header is on its way, wait for it */
+        do {
+            ret = read_sync(csock, buf + NBD_REPLY_SIZE,
+                            sizeof(buf) - NBD_REPLY_SIZE);
+        } while (ret == -EAGAIN);
+        if (ret != sizeof(buf) - NBD_REPLY_SIZE) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+
+        reply->error  = 0;
+        reply->flags  = be16_to_cpup((uint16_t*)(buf + 4));
+        reply->type   = be16_to_cpup((uint16_t*)(buf + 6));
+        reply->handle = be64_to_cpup((uint64_t*)(buf + 8));
+        reply->length = be32_to_cpup((uint32_t*)(buf + 16));
+
+        TRACE("Got chunk: "
+              "{ .flags = %u, .type = %u, handle = %" PRIu64", length = %u }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+
     reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
     reply->handle = be64_to_cpup((uint64_t*)(buf + 8));
+    reply->flags  = NBD_REPLY_FLAG_DONE;
+    reply->type   = NBD_REPLY_TYPE_NONE;
+    reply->length = 0;
 
     TRACE("Got reply: "
           "{ magic = 0x%x, .error = %d, handle = %" PRIu64" }",
@@ -767,11 +1127,8 @@ ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
+static void nbd_encode_reply(uint8_t *buf, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
-    ssize_t ret;
-
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
@@ -780,23 +1137,14 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     cpu_to_be32w((uint32_t*)buf, NBD_REPLY_MAGIC);
     cpu_to_be32w((uint32_t*)(buf + 4), reply->error);
     cpu_to_be64w((uint64_t*)(buf + 8), reply->handle);
-
-    TRACE("Sending response to client");
-
-    ret = write_sync(csock, buf, sizeof(buf));
-    if (ret < 0) {
-        return ret;
-    }
-
-    if (ret != sizeof(buf)) {
-        LOG("writing to socket failed");
-        return -EINVAL;
-    }
-    return 0;
 }
 
 #define MAX_NBD_REQUESTS 16
 
+static void nbd_set_handlers(NBDClient *client);
+static void nbd_unset_handlers(NBDClient *client);
+static void nbd_update_can_read(NBDClient *client);
+
 void nbd_client_get(NBDClient *client)
 {
     client->refcount++;
@@ -810,7 +1158,7 @@ void nbd_client_put(NBDClient *client)
          */
         assert(client->closing);
 
-        qemu_set_fd_handler2(client->sock, NULL, NULL, NULL, NULL);
+        nbd_unset_handlers(client);
         close(client->sock);
         client->sock = -1;
         if (client->exp) {
@@ -844,8 +1192,9 @@ static NBDRequest *nbd_request_get(NBDClient *client)
 {
     NBDRequest *req;
 
-    assert(client->nb_requests <= MAX_NBD_REQUESTS - 1);
+    assert(client->nb_requests <= client->exp->max_requests - 1);
     client->nb_requests++;
+    nbd_update_can_read(client);
 
     req = g_slice_new0(NBDRequest);
     nbd_client_get(client);
@@ -862,12 +1211,40 @@ static void nbd_request_put(NBDRequest *req)
     }
     g_slice_free(NBDRequest, req);
 
-    if (client->nb_requests-- == MAX_NBD_REQUESTS) {
-        qemu_notify_event();
-    }
+    client->nb_requests--;
+    nbd_update_can_read(client);
     nbd_client_put(client);
 }
 
+static void bs_aio_attached(AioContext *ctx, void *opaque)
+{
+    NBDExport *exp = opaque;
+    NBDClient *client;
+
+    TRACE("Export %s: Attaching clients to AIO context %p\n", exp->name, ctx);
+
+    exp->ctx = ctx;
+
+    QTAILQ_FOREACH(client, &exp->clients, next) {
+        nbd_set_handlers(client);
+    }
+}
+
+static void bs_aio_detach(void *opaque)
+{
+    NBDExport *exp = opaque;
+    NBDClient *client;
+
+    TRACE("Export %s: Detaching clients from AIO context %p\n", exp->name,
+          exp->ctx);
+
+    QTAILQ_FOREACH(client, &exp->clients, next) {
+        nbd_unset_handlers(client);
+    }
+
+    exp->ctx = NULL;
+}
+
 NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
                           off_t size, uint32_t nbdflags,
                           void (*close)(NBDExport *))
@@ -879,11 +1256,23 @@ NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
     exp->dev_offset = dev_offset;
     exp->nbdflags = nbdflags;
     exp->size = size == -1 ? bdrv_getlength(bs) : size;
+    exp->max_requests = MAX_NBD_REQUESTS;
     exp->close = close;
+    exp->ctx = bdrv_get_aio_context(bs);
     bdrv_ref(bs);
+    bdrv_add_aio_context_notifier(bs, bs_aio_attached, bs_aio_detach, exp);
     return exp;
 }
 
+/* Only takes effect for requests received after the call; it is meant
+ * to be used right after nbd_export_new(), before clients connect.
+ */
+void nbd_export_set_max_requests(NBDExport *exp, int max_requests)
+{
+    assert(max_requests > 0);
+    exp->max_requests = max_requests;
+}
+
 NBDExport *nbd_export_find(const char *name)
 {
     NBDExport *exp;
@@ -920,7 +1309,12 @@ void nbd_export_set_name(NBDExport *exp, const char *name)
 void nbd_export_close(NBDExport *exp)
 {
     NBDClient *client, *next;
+    AioContext *ctx = exp->ctx;
 
+    /* The clients run in the export's AioContext, which need not be
+     * the one of the calling thread.
+     */
+    aio_context_acquire(ctx);
     nbd_export_get(exp);
     QTAILQ_FOREACH_SAFE(client, &exp->clients, next, next) {
         nbd_client_close(client);
@@ -928,9 +1322,12 @@ void nbd_export_close(NBDExport *exp)
     nbd_export_set_name(exp, NULL);
     nbd_export_put(exp);
     if (exp->bs) {
+        bdrv_remove_aio_context_notifier(exp->bs, bs_aio_attached,
+                                         bs_aio_detach, exp);
         bdrv_unref(exp->bs);
         exp->bs = NULL;
     }
+    aio_context_release(ctx);
 }
 
 void nbd_export_get(NBDExport *exp)
@@ -971,42 +1368,241 @@ void nbd_export_close_all(void)
     }
 }
 
-static int nbd_can_read(void *opaque);
-static void nbd_read(void *opaque);
-static void nbd_restart_write(void *opaque);
-
-static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
-                                 int len)
+static ssize_t nbd_co_sendv(NBDClient *client, struct iovec *iov, int niov,
+                            size_t total)
 {
-    NBDClient *client = req->client;
     int csock = client->sock;
     ssize_t rc, ret;
 
     qemu_co_mutex_lock(&client->send_lock);
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read,
-                         nbd_restart_write, client);
     client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
 
-    if (!len) {
-        rc = nbd_send_reply(csock, reply);
+    ret = qemu_co_sendv(csock, iov, niov, 0, total);
+    if (ret < 0) {
+        rc = ret;
+    } else if (ret != total) {
+        LOG("writing to socket failed");
+        rc = -EIO;
     } else {
-        socket_set_cork(csock, 1);
-        rc = nbd_send_reply(csock, reply);
-        if (rc >= 0) {
-            ret = qemu_co_send(csock, req->data, len);
-            if (ret != len) {
-                rc = -EIO;
-            }
-        }
-        socket_set_cork(csock, 0);
+        rc = 0;
     }
 
     client->send_coroutine = NULL;
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
+    nbd_set_handlers(client);
     qemu_co_mutex_unlock(&client->send_lock);
     return rc;
 }
 
+/* Send the reply header and, for reads, the payload straight out of the
+ * request buffer with a single vectored write; this saves a syscall and
+ * the corking dance for every read.
+ */
+static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
+                                 int len)
+{
+    uint8_t buf[NBD_REPLY_SIZE];
+    struct iovec iov[2];
+
+    TRACE("Sending response to client");
+
+    nbd_encode_reply(buf, reply);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = sizeof(buf);
+    iov[1].iov_base = req->data;
+    iov[1].iov_len = len;
+
+    return nbd_co_sendv(req->client, iov, len ? 2 : 1, sizeof(buf) + len);
+}
+
+/* Send a structured reply chunk made of a small fixed-size @payload,
+ * followed by @data_len bytes of @data.
+ */
+static ssize_t nbd_co_send_chunk(NBDRequest *req, uint64_t handle,
+                                 uint16_t flags, uint16_t type,
+                                 void *payload, size_t payload_len,
+                                 void *data, size_t data_len)
+{
+    uint8_t buf[NBD_CHUNK_HEADER_SIZE];
+    struct iovec iov[3];
+    int niov = 1;
+
+    /* Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload
+     */
+    cpu_to_be32w((uint32_t*)buf, NBD_STRUCTURED_REPLY_MAGIC);
+    cpu_to_be16w((uint16_t*)(buf + 4), flags);
+    cpu_to_be16w((uint16_t*)(buf + 6), type);
+    cpu_to_be64w((uint64_t*)(buf + 8), handle);
+    cpu_to_be32w((uint32_t*)(buf + 16), payload_len + data_len);
+
+    TRACE("Sending chunk (type %u, flags %u) to client", type, flags);
+
+    iov[0].iov_base = buf;
+    iov[0].iov_len = sizeof(buf);
+    if (payload_len) {
+        iov[niov].iov_base = payload;
+        iov[niov].iov_len = payload_len;
+        niov++;
+    }
+    if (data_len) {
+        iov[niov].iov_base = data;
+        iov[niov].iov_len = data_len;
+        niov++;
+    }
+
+    return nbd_co_sendv(req->client, iov, niov,
+                        sizeof(buf) + payload_len + data_len);
+}
+
+static ssize_t nbd_co_send_error_chunk(NBDRequest *req, uint64_t handle,
+                                       uint32_t error)
+{
+    uint8_t payload[4 + 2];
+
+    /* error, then a zero-length message */
+    cpu_to_be32w((uint32_t*)payload, error);
+    cpu_to_be16w((uint16_t*)(payload + 4), 0);
+    return nbd_co_send_chunk(req, handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, payload, sizeof(payload),
+                             NULL, 0);
+}
+
+/* Answer NBD_CMD_READ with a structured reply.  Ranges that read as zero
+ * are neither read from the image nor put on the wire: they are sent as
+ * hole chunks instead.
+ */
+static ssize_t nbd_co_read_structured(NBDRequest *req,
+                                      struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    int64_t sector_num = (request->from + exp->dev_offset) / 512;
+    int nb_sectors = request->len / 512;
+    int done = 0;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    uint8_t payload[8 + 4];
+    int64_t ret;
+    ssize_t rc;
+    int n;
+
+    if (nb_sectors == 0) {
+        return nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                                 NBD_REPLY_TYPE_NONE, NULL, 0, NULL, 0);
+    }
+
+    while (done < nb_sectors) {
+        uint16_t flags;
+
+        ret = bdrv_get_block_status(exp->bs, sector_num + done,
+                                    nb_sectors - done, &n);
+        if (ret < 0 || n == 0) {
+            /* Just read the rest, block status is only a hint here */
+            ret = BDRV_BLOCK_DATA;
+            n = nb_sectors - done;
+        }
+        flags = (done + n == nb_sectors) ? NBD_REPLY_FLAG_DONE : 0;
+        cpu_to_be64w((uint64_t*)payload, request->from + done * 512ULL);
+
+        if (ret & BDRV_BLOCK_ZERO) {
+            cpu_to_be32w((uint32_t*)(payload + 8), n * 512);
+            rc = nbd_co_send_chunk(req, request->handle, flags,
+                                   NBD_REPLY_TYPE_OFFSET_HOLE,
+                                   payload, 12, NULL, 0);
+        } else {
+            iov.iov_base = req->data + done * 512;
+            iov.iov_len = n * 512;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = bdrv_co_readv(exp->bs, sector_num + done, n, &qiov);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                return nbd_co_send_error_chunk(req, request->handle, -ret);
+            }
+            rc = nbd_co_send_chunk(req, request->handle, flags,
+                                   NBD_REPLY_TYPE_OFFSET_DATA,
+                                   payload, 8, iov.iov_base, iov.iov_len);
+        }
+        if (rc < 0) {
+            return rc;
+        }
+        done += n;
+    }
+
+    return 0;
+}
+
+/* At most this many extents are returned for one NBD_CMD_BLOCK_STATUS */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS 128
+
+/* Answer NBD_CMD_BLOCK_STATUS for the "base:allocation" context */
+static ssize_t nbd_co_block_status(NBDRequest *req,
+                                   struct nbd_request *request)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    int64_t sector_num = (request->from + exp->dev_offset) / 512;
+    uint64_t remaining = request->len;
+    uint32_t lengths[NBD_MAX_BLOCK_STATUS_EXTENTS];
+    uint32_t flags[NBD_MAX_BLOCK_STATUS_EXTENTS];
+    uint8_t payload[4 + 8 * NBD_MAX_BLOCK_STATUS_EXTENTS];
+    int max_extents, nb_extents = 0;
+    int64_t ret;
+    int i, n;
+
+    max_extents = (request->type & NBD_CMD_FLAG_REQ_ONE) ?
+                  1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
+
+    while (remaining > 0) {
+        uint32_t state = 0;
+        uint32_t len;
+
+        ret = bdrv_get_block_status(exp->bs, sector_num,
+                                    DIV_ROUND_UP(remaining, 512), &n);
+        if (ret < 0) {
+            LOG("block status failed");
+            return nbd_co_send_error_chunk(req, request->handle, -ret);
+        }
+        if (n == 0) {
+            break;
+        }
+
+        if (!(ret & BDRV_BLOCK_DATA)) {
+            state |= NBD_STATE_HOLE;
+        }
+        if (ret & BDRV_BLOCK_ZERO) {
+            state |= NBD_STATE_ZERO;
+        }
+        len = MIN((uint64_t)n * 512, remaining);
+
+        if (nb_extents && flags[nb_extents - 1] == state) {
+            lengths[nb_extents - 1] += len;
+        } else if (nb_extents == max_extents) {
+            break;
+        } else {
+            lengths[nb_extents] = len;
+            flags[nb_extents] = state;
+            nb_extents++;
+        }
+
+        sector_num += n;
+        remaining -= len;
+    }
+
+    cpu_to_be32w((uint32_t*)payload, client->ext.context_id);
+    for (i = 0; i < nb_extents; i++) {
+        cpu_to_be32w((uint32_t*)(payload + 4 + i * 8), lengths[i]);
+        cpu_to_be32w((uint32_t*)(payload + 8 + i * 8), flags[i]);
+    }
+
+    return nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_BLOCK_STATUS,
+                             payload, 4 + nb_extents * 8, NULL, 0);
+}
+
 static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
 {
     NBDClient *client = req->client;
@@ -1015,6 +1611,8 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
     ssize_t rc;
 
     client->recv_coroutine = qemu_coroutine_self();
+    nbd_update_can_read(client);
+
     rc = nbd_receive_request(csock, request);
     if (rc < 0) {
         if (rc != -EAGAIN) {
@@ -1023,7 +1621,11 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
         goto out;
     }
 
-    if (request->len > NBD_MAX_BUFFER_SIZE) {
+    TRACE("Decoding type");
+
+    command = request->type & NBD_CMD_MASK_COMMAND;
+    if ((command == NBD_CMD_READ || command == NBD_CMD_WRITE) &&
+        request->len > NBD_MAX_BUFFER_SIZE) {
         LOG("len (%u) is larger than max len (%u)",
             request->len, NBD_MAX_BUFFER_SIZE);
         rc = -EINVAL;
@@ -1036,10 +1638,6 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
         rc = -EINVAL;
         goto out;
     }
-
-    TRACE("Decoding type");
-
-    command = request->type & NBD_CMD_MASK_COMMAND;
     if (command == NBD_CMD_READ || command == NBD_CMD_WRITE) {
         req->data = qemu_blockalign(client->exp->bs, request->len);
     }
@@ -1056,6 +1654,8 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 
 out:
     client->recv_coroutine = NULL;
+    nbd_update_can_read(client);
+
     return rc;
 }
 
@@ -1066,6 +1666,9 @@ static void nbd_trip(void *opaque)
     NBDRequest *req;
     struct nbd_request request;
     struct nbd_reply reply;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    uint32_t command;
     ssize_t ret;
 
     TRACE("Reading request.");
@@ -1084,6 +1687,7 @@ static void nbd_trip(void *opaque)
 
     reply.handle = request.handle;
     reply.error = 0;
+    command = request.type & NBD_CMD_MASK_COMMAND;
 
     if (ret < 0) {
         reply.error = -ret;
@@ -1099,7 +1703,7 @@ static void nbd_trip(void *opaque)
         goto invalid_request;
     }
 
-    switch (request.type & NBD_CMD_MASK_COMMAND) {
+    switch (command) {
     case NBD_CMD_READ:
         TRACE("Request type is READ");
 
@@ -1112,8 +1716,18 @@ static void nbd_trip(void *opaque)
             }
         }
 
-        ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
-                        req->data, request.len / 512);
+        if (client->ext.structured_reply) {
+            if (nbd_co_read_structured(req, &request) < 0) {
+                goto out;
+            }
+            break;
+        }
+
+        iov.iov_base = req->data;
+        iov.iov_len = request.len;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_readv(exp->bs, (request.from + exp->dev_offset) / 512,
+                            request.len / 512, &qiov);
         if (ret < 0) {
             LOG("reading from file failed");
             reply.error = -ret;
@@ -1135,8 +1749,11 @@ static void nbd_trip(void *opaque)
 
         TRACE("Writing to device");
 
-        ret = bdrv_write(exp->bs, (request.from + exp->dev_offset) / 512,
-                         req->data, request.len / 512);
+        iov.iov_base = req->data;
+        iov.iov_len = request.len;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_writev(exp->bs, (request.from + exp->dev_offset) / 512,
+                             request.len / 512, &qiov);
         if (ret < 0) {
             LOG("writing to file failed");
             reply.error = -ret;
@@ -1184,12 +1801,30 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+        if (!client->ext.base_allocation || request.len == 0) {
+            goto invalid_request;
+        }
+        if (nbd_co_block_status(req, &request) < 0) {
+            goto out;
+        }
+        break;
     default:
         LOG("invalid request type (%u) received", request.type);
     invalid_request:
-        reply.error = -EINVAL;
+        reply.error = EINVAL;
     error_reply:
-        if (nbd_co_send_reply(req, &reply, 0) < 0) {
+        /* Reads and block status queries must be answered with a
+         * structured reply once those have been negotiated.
+         */
+        if (client->ext.structured_reply &&
+            (command == NBD_CMD_READ || command == NBD_CMD_BLOCK_STATUS)) {
+            ret = nbd_co_send_error_chunk(req, reply.handle, reply.error);
+        } else {
+            ret = nbd_co_send_reply(req, &reply, 0);
+        }
+        if (ret < 0) {
             goto out;
         }
         break;
@@ -1206,13 +1841,6 @@ out:
     nbd_client_close(client);
 }
 
-static int nbd_can_read(void *opaque)
-{
-    NBDClient *client = opaque;
-
-    return client->recv_coroutine || client->nb_requests < MAX_NBD_REQUESTS;
-}
-
 static void nbd_read(void *opaque)
 {
     NBDClient *client = opaque;
@@ -1231,6 +1859,40 @@ static void nbd_restart_write(void *opaque)
     qemu_coroutine_enter(client->send_coroutine, NULL);
 }
 
+static void nbd_set_handlers(NBDClient *client)
+{
+    if (client->exp && client->exp->ctx) {
+        aio_set_fd_handler(client->exp->ctx, client->sock,
+                           client->can_read ? nbd_read : NULL,
+                           client->send_coroutine ? nbd_restart_write : NULL,
+                           client);
+    }
+}
+
+static void nbd_unset_handlers(NBDClient *client)
+{
+    if (client->exp && client->exp->ctx) {
+        aio_set_fd_handler(client->exp->ctx, client->sock, NULL, NULL, NULL);
+    }
+}
+
+/* Stop reading from the socket while the client has max_requests
+ * requests in flight, unless a request is being received.
+ */
+static void nbd_update_can_read(NBDClient *client)
+{
+    bool can_read = client->recv_coroutine ||
+                    client->nb_requests < client->exp->max_requests;
+
+    if (can_read != client->can_read) {
+        client->can_read = can_read;
+        nbd_set_handlers(client);
+
+        /* There is no need to invoke aio_notify(), since aio_set_fd_handler()
+         * in nbd_set_handlers() will have taken care of that */
+    }
+}
+
 NBDClient *nbd_client_new(NBDExport *exp, int csock,
                           void (*close)(NBDClient *))
 {
@@ -1245,7 +1907,14 @@ NBDClient *nbd_client_new(NBDExport *exp, int csock,
     }
     client->close = close;
     qemu_co_mutex_init(&client->send_lock);
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
+
+    /* After negotiation client->exp is set even for clients that
+     * selected an export by name.
+     */
+    aio_context_acquire(client->exp->ctx);
+    client->can_read = true;
+    nbd_set_handlers(client);
+    aio_context_release(client->exp->ctx);
 
     if (exp) {
         QTAILQ_INSERT_TAIL(&exp->clients, client, next);
@@ -18,20 +18,57 @@
 #include "qemu-common.h"
 #include "net/checksum.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define PROTO_TCP  6
 #define PROTO_UDP 17
 
+/*
+ * The sum of the big-endian 16-bit words of a buffer is the sum of its
+ * even bytes times 256, plus the sum of its odd bytes.  Add the two
+ * separately, which vectorizes without any byte swapping.
+ */
 uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
 {
-    uint32_t sum = 0;
-    int i;
+    uint64_t even = 0, odd = 0, sum;
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i veven = zero, vodd = zero;
+    uint64_t lanes[2];
+
+    /* psadbw against zero adds up the 8 bytes of each half */
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i *)(buf + i));
+
+        veven = _mm_add_epi64(veven, _mm_sad_epu8(_mm_and_si128(v, mask),
+                                                  zero));
+        vodd = _mm_add_epi64(vodd, _mm_sad_epu8(_mm_srli_epi16(v, 8), zero));
+    }
+    _mm_storeu_si128((__m128i *)lanes, veven);
+    even = lanes[0] + lanes[1];
+    _mm_storeu_si128((__m128i *)lanes, vodd);
+    odd = lanes[0] + lanes[1];
+#endif
+
+    for (; i + 1 < len; i += 2) {
+        even += buf[i];
+        odd += buf[i + 1];
+    }
+    if (i < len) {
+        even += buf[i];
+    }
 
-    for (i = seq; i < seq + len; i++) {
-        if (i & 1) {
-            sum += (uint32_t)buf[i - seq];
-        } else {
-            sum += (uint32_t)buf[i - seq] << 8;
-        }
+    /* An odd offset in the packet swaps the high and low bytes */
+    sum = seq & 1 ? (odd << 8) + even : (even << 8) + odd;
+
+    /* Fold into 32 bits; 2^32 is 1 modulo 0xffff, as 2^16 is */
+    while (sum >> 32) {
+        sum = (sum & 0xffffffff) + (sum >> 32);
     }
     return sum;
 }
@@ -27,6 +27,9 @@
 #include "qemu/error-report.h"
 #include "qemu/log.h"
 #include "qemu/timer.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "monitor/monitor.h"
 #include "hub.h"
 
 typedef struct DumpState {
@@ -34,6 +37,28 @@ typedef struct DumpState {
     int64_t start_ts;
     int fd;
     int pcap_caplen;
+
+    /* File rotation, if filesize is not 0 */
+    char *filename;
+    uint64_t filesize;
+    uint64_t written;
+    unsigned int file_index;
+
+    /*
+     * Asynchronous mode, if ring is not NULL: records are queued in the
+     * ring by the net path and written by a separate thread.  There is a
+     * single producer and a single consumer; each owns one index.
+     */
+    uint8_t *ring;
+    uint32_t ring_size;     /* a power of 2, so the indexes can wrap */
+    uint32_t ring_head;     /* written by the net path */
+    uint32_t ring_tail;     /* written by the thread */
+    bool stop;
+    QemuEvent ring_event;
+    QemuThread thread;
+
+    uint64_t packets;
+    uint64_t dropped;
 } DumpState;
 
 #define PCAP_MAGIC 0xa1b2c3d4
@@ -57,75 +82,243 @@ struct pcap_sf_pkthdr {
     uint32_t len;
 };
 
-static ssize_t dump_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+/* Open @filename and write the pcap file header, returns -1 on error. */
+static int dump_open(const char *filename, int snaplen)
 {
-    DumpState *s = DO_UPCAST(DumpState, nc, nc);
-    struct pcap_sf_pkthdr hdr;
-    int64_t ts;
-    int caplen;
+    struct pcap_file_hdr hdr;
+    int fd;
 
-    /* Early return in case of previous error. */
-    if (s->fd < 0) {
-        return size;
+    fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644);
+    if (fd < 0) {
+        error_report("-net dump: can't open %s", filename);
+        return -1;
+    }
+
+    hdr.magic = PCAP_MAGIC;
+    hdr.version_major = 2;
+    hdr.version_minor = 4;
+    hdr.thiszone = 0;
+    hdr.sigfigs = 0;
+    hdr.snaplen = snaplen;
+    hdr.linktype = 1;
+
+    if (write(fd, &hdr, sizeof(hdr)) < sizeof(hdr)) {
+        error_report("-net dump write error: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Switch to the next file if @len more bytes would make the current one
+ * exceed the size limit.  The files are named <file>, <file>.1, <file>.2...
+ */
+static void dump_rotate(DumpState *s, size_t len)
+{
+    char *filename;
+
+    if (!s->filesize || s->fd < 0 ||
+        s->written + len <= s->filesize ||
+        s->written == sizeof(struct pcap_file_hdr)) {
+        return;
     }
 
-    ts = muldiv64(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL), 1000000, get_ticks_per_sec());
-    caplen = size > s->pcap_caplen ? s->pcap_caplen : size;
+    close(s->fd);
+    filename = g_strdup_printf("%s.%u", s->filename, ++s->file_index);
+    s->fd = dump_open(filename, s->pcap_caplen);
+    s->written = sizeof(struct pcap_file_hdr);
+    g_free(filename);
+}
 
-    hdr.ts.tv_sec = ts / 1000000 + s->start_ts;
-    hdr.ts.tv_usec = ts % 1000000;
-    hdr.caplen = caplen;
-    hdr.len = size;
-    if (write(s->fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
-        write(s->fd, buf, caplen) != caplen) {
+static void dump_write(DumpState *s, const void *buf, size_t len)
+{
+    if (s->fd < 0) {
+        return;
+    }
+    if (write(s->fd, buf, len) != len) {
         qemu_log("-net dump write error - stop dump\n");
         close(s->fd);
         s->fd = -1;
+        return;
     }
+    s->written += len;
+}
+
+static void dump_fill_hdr(DumpState *s, struct pcap_sf_pkthdr *hdr,
+                          size_t size)
+{
+    int64_t ts;
+
+    ts = muldiv64(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL), 1000000,
+                  get_ticks_per_sec());
+
+    hdr->ts.tv_sec = ts / 1000000 + s->start_ts;
+    hdr->ts.tv_usec = ts % 1000000;
+    hdr->caplen = size > s->pcap_caplen ? s->pcap_caplen : size;
+    hdr->len = size;
+}
+
+/* Copy @len bytes in or out of the ring at free running index @idx. */
+static void dump_ring_copy(DumpState *s, uint32_t idx, void *buf, size_t len,
+                           bool to_ring)
+{
+    uint32_t off = idx % s->ring_size;
+    size_t first = MIN(len, s->ring_size - off);
+
+    if (to_ring) {
+        memcpy(s->ring + off, buf, first);
+        memcpy(s->ring, (uint8_t *)buf + first, len - first);
+    } else {
+        memcpy(buf, s->ring + off, first);
+        memcpy((uint8_t *)buf + first, s->ring, len - first);
+    }
+}
+
+static void dump_ring_write(DumpState *s, uint32_t idx, size_t len)
+{
+    uint32_t off = idx % s->ring_size;
+    size_t first = MIN(len, s->ring_size - off);
+
+    dump_write(s, s->ring + off, first);
+    if (len > first) {
+        dump_write(s, s->ring, len - first);
+    }
+}
+
+static void *dump_thread(void *opaque)
+{
+    DumpState *s = opaque;
+    uint32_t tail = s->ring_tail;
+
+    for (;;) {
+        struct pcap_sf_pkthdr hdr;
+        uint32_t head, start;
+
+        qemu_event_reset(&s->ring_event);
+        head = atomic_read(&s->ring_head);
+        if (head == tail) {
+            if (atomic_read(&s->stop)) {
+                break;
+            }
+            qemu_event_wait(&s->ring_event);
+            continue;
+        }
+        /* Read the records only after their end was published */
+        smp_rmb();
+
+        /* Write as many records at once as fit in the current file */
+        start = tail;
+        while (tail != head) {
+            uint32_t rec_len;
+
+            dump_ring_copy(s, tail, &hdr, sizeof(hdr), false);
+            rec_len = sizeof(hdr) + hdr.caplen;
+            if (tail != start &&
+                s->filesize && s->written + (tail - start) + rec_len >
+                s->filesize) {
+                break;
+            }
+            tail += rec_len;
+        }
+        dump_rotate(s, tail - start);
+        dump_ring_write(s, start, tail - start);
+
+        /* Release the space only after it was read */
+        smp_mb();
+        atomic_set(&s->ring_tail, tail);
+    }
+
+    return NULL;
+}
+
+static ssize_t dump_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    DumpState *s = DO_UPCAST(DumpState, nc, nc);
+    struct pcap_sf_pkthdr hdr;
+    uint32_t head, space;
+
+    dump_fill_hdr(s, &hdr, size);
+
+    if (!s->ring) {
+        /* Early return in case of previous error. */
+        if (s->fd < 0) {
+            return size;
+        }
+        dump_rotate(s, sizeof(hdr) + hdr.caplen);
+        dump_write(s, &hdr, sizeof(hdr));
+        dump_write(s, buf, hdr.caplen);
+        s->packets++;
+        return size;
+    }
+
+    /* Never wait for the thread: drop the packet if the ring is full */
+    head = s->ring_head;
+    space = s->ring_size - (head - atomic_read(&s->ring_tail));
+    if (space < sizeof(hdr) + hdr.caplen) {
+        s->dropped++;
+        return size;
+    }
+    /* The space must be free before it is overwritten */
+    smp_mb();
+
+    dump_ring_copy(s, head, &hdr, sizeof(hdr), true);
+    dump_ring_copy(s, head + sizeof(hdr), (void *)buf, hdr.caplen, true);
+    smp_wmb();
+    atomic_set(&s->ring_head, head + sizeof(hdr) + hdr.caplen);
+    qemu_event_set(&s->ring_event);
+    s->packets++;
 
     return size;
 }
 
+static void dump_print_stats(NetClientState *nc, Monitor *mon)
+{
+    DumpState *s = DO_UPCAST(DumpState, nc, nc);
+
+    monitor_printf(mon, "    dump: %" PRIu64 " packets, %" PRIu64
+                   " dropped, file %u\n",
+                   s->packets, s->dropped, s->file_index);
+}
+
 static void dump_cleanup(NetClientState *nc)
 {
     DumpState *s = DO_UPCAST(DumpState, nc, nc);
 
-    close(s->fd);
+    if (s->ring) {
+        /* Let the thread drain the ring */
+        atomic_set(&s->stop, true);
+        qemu_event_set(&s->ring_event);
+        qemu_thread_join(&s->thread);
+        qemu_event_destroy(&s->ring_event);
+        g_free(s->ring);
+    }
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    g_free(s->filename);
 }
 
 static NetClientInfo net_dump_info = {
     .type = NET_CLIENT_OPTIONS_KIND_DUMP,
     .size = sizeof(DumpState),
     .receive = dump_receive,
+    .print_stats = dump_print_stats,
     .cleanup = dump_cleanup,
 };
 
 static int net_dump_init(NetClientState *peer, const char *device,
-                         const char *name, const char *filename, int len)
+                         const char *name, const char *filename, int len,
+                         uint64_t ring_size, uint64_t filesize)
 {
-    struct pcap_file_hdr hdr;
     NetClientState *nc;
     DumpState *s;
     struct tm tm;
     int fd;
 
-    fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644);
+    fd = dump_open(filename, len);
     if (fd < 0) {
-        error_report("-net dump: can't open %s", filename);
-        return -1;
-    }
-
-    hdr.magic = PCAP_MAGIC;
-    hdr.version_major = 2;
-    hdr.version_minor = 4;
-    hdr.thiszone = 0;
-    hdr.sigfigs = 0;
-    hdr.snaplen = len;
-    hdr.linktype = 1;
-
-    if (write(fd, &hdr, sizeof(hdr)) < sizeof(hdr)) {
-        error_report("-net dump write error: %s", strerror(errno));
-        close(fd);
         return -1;
     }
 
@@ -138,10 +331,20 @@ static int net_dump_init(NetClientState *peer, const char *device,
 
     s->fd = fd;
     s->pcap_caplen = len;
+    s->filename = g_strdup(filename);
+    s->filesize = filesize;
+    s->written = sizeof(struct pcap_file_hdr);
 
     qemu_get_timedate(&tm, 0);
     s->start_ts = mktime(&tm);
 
+    if (ring_size) {
+        s->ring_size = pow2floor(ring_size);
+        s->ring = g_malloc(ring_size);
+        qemu_event_init(&s->ring_event, false);
+        qemu_thread_create(&s->thread, dump_thread, s, QEMU_THREAD_JOINABLE);
+    }
+
     return 0;
 }
 
@@ -181,5 +384,15 @@ int net_init_dump(const NetClientOptions *opts, const char *name,
         len = 65536;
     }
 
-    return net_dump_init(peer, "dump", name, file, len);
+    if (dump->has_ring &&
+        (dump->ring > INT32_MAX ||
+         pow2floor(dump->ring) < sizeof(struct pcap_sf_pkthdr) + len)) {
+        error_report("invalid ring size: %" PRIu64
+                     ", must hold at least one packet", dump->ring);
+        return -1;
+    }
+
+    return net_dump_init(peer, "dump", name, file, len,
+                         dump->has_ring ? dump->ring : 0,
+                         dump->has_filesize ? dump->filesize : 0);
 }
@@ -533,6 +533,41 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
+int qemu_deliver_packet_batch(NetClientState *sender,
+                              unsigned flags,
+                              const NetPacketIOV *pkts,
+                              int count,
+                              void *opaque)
+{
+    NetClientState *nc = opaque;
+    int i;
+
+    if (nc->link_down) {
+        return count;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    if (nc->info->receive_batch) {
+        i = nc->info->receive_batch(nc, pkts, count);
+    } else {
+        for (i = 0; i < count; i++) {
+            if (qemu_deliver_packet_iov(sender, flags, pkts[i].iov,
+                                        pkts[i].iovcnt, opaque) == 0) {
+                break;
+            }
+        }
+    }
+
+    if (i < count) {
+        nc->receive_disabled = 1;
+    }
+
+    return i;
+}
+
 ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                 const struct iovec *iov, int iovcnt,
                                 NetPacketSent *sent_cb)
@@ -550,6 +585,52 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                    iov, iovcnt, sent_cb);
 }
 
+static int qemu_sendv_packet_batch_with_flags(NetClientState *sender,
+                                              unsigned flags,
+                                              const NetPacketIOV *pkts,
+                                              int count,
+                                              NetPacketSent *sent_cb)
+{
+    NetQueue *queue;
+
+    if (sender->link_down || !sender->peer) {
+        return count;
+    }
+
+    queue = sender->peer->incoming_queue;
+
+    return qemu_net_queue_send_batch(queue, sender, flags,
+                                     pkts, count, sent_cb);
+}
+
+/*
+ * Send @count packets to the peer in one go.  Returns how many of them
+ * were delivered or dropped; the others are queued and @sent_cb is called
+ * once the last of them has been delivered.
+ */
+int qemu_sendv_packet_batch_async(NetClientState *sender,
+                                  const NetPacketIOV *pkts, int count,
+                                  NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_batch_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_NONE,
+                                              pkts, count, sent_cb);
+}
+
+/*
+ * Like qemu_sendv_packet_batch_async(), but packets that cannot be
+ * delivered right away are queued by reference.  The buffers must stay
+ * valid until @sent_cb has been called for each of them, in order.
+ */
+int qemu_sendv_packet_batch_zerocopy(NetClientState *sender,
+                                     const NetPacketIOV *pkts, int count,
+                                     NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_batch_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_ZEROCOPY,
+                                              pkts, count, sent_cb);
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
@@ -734,6 +815,9 @@ static int (* const net_client_init_fun[NET_CLIENT_OPTIONS_KIND_MAX])(
         [NET_CLIENT_OPTIONS_KIND_BRIDGE]    = net_init_bridge,
 #endif
         [NET_CLIENT_OPTIONS_KIND_HUBPORT]   = net_init_hubport,
+#ifdef CONFIG_LINUX
+        [NET_CLIENT_OPTIONS_KIND_VHOST_USER] = net_init_vhost_user,
+#endif
 };
 
 
@@ -767,6 +851,9 @@ static int net_client_init1(const void *object, int is_netdev, Error **errp)
         case NET_CLIENT_OPTIONS_KIND_BRIDGE:
 #endif
         case NET_CLIENT_OPTIONS_KIND_HUBPORT:
+#ifdef CONFIG_LINUX
+        case NET_CLIENT_OPTIONS_KIND_VHOST_USER:
+#endif
             break;
 
         default:
@@ -967,10 +1054,23 @@ void qmp_netdev_del(const char *id, Error **errp)
 
 void print_net_client(Monitor *mon, NetClientState *nc)
 {
+    NetQueueStats stats;
+
     monitor_printf(mon, "%s: index=%d,type=%s,%s\n", nc->name,
                    nc->queue_index,
                    NetClientOptionsKind_lookup[nc->info->type],
                    nc->info_str);
+
+    qemu_net_queue_get_stats(nc->incoming_queue, &stats);
+    if (stats.queued || stats.dropped) {
+        monitor_printf(mon, "    queue: %" PRIu32 " packets (max %" PRIu32
+                       "), %" PRIu64 " queued, %" PRIu64 " dropped\n",
+                       stats.count, stats.max_count,
+                       stats.queued, stats.dropped);
+    }
+    if (nc->info->print_stats) {
+        nc->info->print_stats(nc, mon);
+    }
 }
 
 RxFilterInfoList *qmp_query_rx_filter(bool has_name, const char *name,
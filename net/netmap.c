@@ -36,6 +36,9 @@
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
 
+/* Packets moved between the rings and the peer per net layer call */
+#define NETMAP_BATCH 64
+
 /* Private netmap device info. */
 typedef struct NetmapPriv {
     int                 fd;
@@ -53,7 +56,14 @@ typedef struct NetmapState {
     NetmapPriv          me;
     bool                read_poll;
     bool                write_poll;
+    bool                tx_pending;             /* slots not synced yet */
+    QEMUBH              *tx_bh;
+    uint64_t            rx_packets;
+    uint64_t            tx_packets;
+    uint64_t            tx_syncs;
+    uint64_t            tx_dropped;
     struct iovec        iov[IOV_MAX];
+    NetPacketIOV        pkts[NETMAP_BATCH];
 } NetmapState;
 
 #define D(format, ...)                                          \
@@ -108,10 +118,10 @@ pkt_copy(const void *_src, void *_dst, int l)
 #endif /* __FreeBSD__ */
 
 /*
- * Open a netmap device. We assume there is only one queue
- * (which is the case for the VALE bridge).
+ * Open a netmap device.  With more than one queue, bind the fd to ring
+ * @ring only; VALE ports are created with @queues rings.
  */
-static int netmap_open(NetmapPriv *me)
+static int netmap_open(NetmapPriv *me, unsigned int ring, unsigned int queues)
 {
     int fd;
     int err;
@@ -127,12 +137,21 @@ static int netmap_open(NetmapPriv *me)
     memset(&req, 0, sizeof(req));
     pstrcpy(req.nr_name, sizeof(req.nr_name), me->ifname);
     req.nr_ringid = NETMAP_NO_TX_POLL;
+    if (queues > 1) {
+        req.nr_ringid |= NETMAP_HW_RING | ring;
+        req.nr_tx_rings = req.nr_rx_rings = queues;
+    }
     req.nr_version = NETMAP_API;
     err = ioctl(fd, NIOCREGIF, &req);
     if (err) {
         error_report("Unable to register %s: %s", me->ifname, strerror(errno));
         goto error;
     }
+    if (req.nr_tx_rings < queues || req.nr_rx_rings < queues) {
+        error_report("%s has only %u tx and %u rx rings, %u queues requested",
+                     me->ifname, req.nr_tx_rings, req.nr_rx_rings, queues);
+        goto error;
+    }
     l = me->memsize = req.nr_memsize;
 
     me->mem = mmap(0, l, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
@@ -144,8 +163,8 @@ static int netmap_open(NetmapPriv *me)
     }
 
     me->nifp = NETMAP_IF(me->mem, req.nr_offset);
-    me->tx = NETMAP_TXRING(me->nifp, 0);
-    me->rx = NETMAP_RXRING(me->nifp, 0);
+    me->tx = NETMAP_TXRING(me->nifp, ring);
+    me->rx = NETMAP_RXRING(me->nifp, ring);
     return 0;
 
 error:
@@ -199,7 +218,7 @@ static void netmap_poll(NetClientState *nc, bool enable)
 
     if (s->read_poll != enable || s->write_poll != enable) {
         s->read_poll = enable;
-        s->read_poll = enable;
+        s->write_poll = enable;
         netmap_update_fd_handler(s);
     }
 }
@@ -217,89 +236,77 @@ static void netmap_writable(void *opaque)
     qemu_flush_queued_packets(&s->nc);
 }
 
-static ssize_t netmap_receive(NetClientState *nc,
-      const uint8_t *buf, size_t size)
+/* Hand the slots filled since the last sync to the kernel */
+static void netmap_tx_sync(NetmapState *s)
 {
-    NetmapState *s = DO_UPCAST(NetmapState, nc, nc);
-    struct netmap_ring *ring = s->me.tx;
-    uint32_t i;
-    uint32_t idx;
-    uint8_t *dst;
-
-    if (unlikely(!ring)) {
-        /* Drop. */
-        return size;
-    }
+    s->tx_pending = false;
+    s->tx_syncs++;
+    ioctl(s->me.fd, NIOCTXSYNC, NULL);
+}
 
-    if (unlikely(size > ring->nr_buf_size)) {
-        RD(5, "[netmap_receive] drop packet of size %d > %d\n",
-                                    (int)size, ring->nr_buf_size);
-        return size;
-    }
+/*
+ * Packets are put in the tx ring as they come, and a single NIOCTXSYNC
+ * covers everything queued during one main loop iteration.
+ */
+static void netmap_tx_sync_bh(void *opaque)
+{
+    NetmapState *s = opaque;
 
-    if (ring->avail == 0) {
-        /* No available slots in the netmap TX ring. */
-        netmap_write_poll(s, true);
-        return 0;
+    if (s->tx_pending) {
+        netmap_tx_sync(s);
     }
+}
 
-    i = ring->cur;
-    idx = ring->slot[i].buf_idx;
-    dst = (uint8_t *)NETMAP_BUF(ring, idx);
-
-    ring->slot[i].len = size;
-    ring->slot[i].flags = 0;
-    pkt_copy(buf, dst, size);
-    ring->cur = NETMAP_RING_NEXT(ring, i);
-    ring->avail--;
-    ioctl(s->me.fd, NIOCTXSYNC, NULL);
+/* Number of slots the packet in @iov takes */
+static inline uint32_t netmap_slots(struct netmap_ring *ring,
+                                    const struct iovec *iov, int iovcnt)
+{
+    uint32_t slots = 0;
+    int j;
 
-    return size;
+    for (j = 0; j < iovcnt; j++) {
+        slots += DIV_ROUND_UP(iov[j].iov_len, ring->nr_buf_size);
+    }
+    return slots;
 }
 
-static ssize_t netmap_receive_iov(NetClientState *nc,
-                    const struct iovec *iov, int iovcnt)
+/*
+ * Copy one packet into the tx ring, splitting each iovec fragment over
+ * as many slots as needed.  Returns false if the ring is full even after
+ * a sync.
+ */
+static bool netmap_tx_one(NetmapState *s, const struct iovec *iov,
+                          int iovcnt)
 {
-    NetmapState *s = DO_UPCAST(NetmapState, nc, nc);
     struct netmap_ring *ring = s->me.tx;
-    uint32_t last;
-    uint32_t idx;
+    uint32_t i, idx, last = ring->cur;
+    uint32_t slots = netmap_slots(ring, iov, iovcnt);
     uint8_t *dst;
     int j;
-    uint32_t i;
-    uint32_t avail;
 
-    if (unlikely(!ring)) {
-        /* Drop the packet. */
-        return iov_size(iov, iovcnt);
+    if (unlikely(slots > ring->num_slots - 1)) {
+        RD(5, "[netmap_tx_one] drop packet of %u slots\n", slots);
+        s->tx_dropped++;
+        return true;
     }
 
-    i = ring->cur;
-    avail = ring->avail;
-
-    if (avail < iovcnt) {
-        /* Not enough netmap slots. */
-        netmap_write_poll(s, true);
-        return 0;
+    if (ring->avail < slots) {
+        /* Reclaim the slots the kernel is done with */
+        netmap_tx_sync(s);
+        if (ring->avail < slots) {
+            return false;
+        }
     }
 
+    i = ring->cur;
     for (j = 0; j < iovcnt; j++) {
         int iov_frag_size = iov[j].iov_len;
         int offset = 0;
         int nm_frag_size;
 
-        /* Split each iovec fragment over more netmap slots, if
-           necessary. */
         while (iov_frag_size) {
             nm_frag_size = MIN(iov_frag_size, ring->nr_buf_size);
 
-            if (unlikely(avail == 0)) {
-                /* We run out of netmap slots while splitting the
-                   iovec fragments. */
-                netmap_write_poll(s, true);
-                return 0;
-            }
-
             idx = ring->slot[i].buf_idx;
             dst = (uint8_t *)NETMAP_BUF(ring, idx);
 
@@ -309,7 +316,6 @@ static ssize_t netmap_receive_iov(NetClientState *nc,
 
             last = i;
             i = NETMAP_RING_NEXT(ring, i);
-            avail--;
 
             offset += nm_frag_size;
             iov_frag_size -= nm_frag_size;
@@ -320,13 +326,62 @@ static ssize_t netmap_receive_iov(NetClientState *nc,
 
     /* Now update ring->cur and ring->avail. */
     ring->cur = i;
-    ring->avail = avail;
+    ring->avail -= slots;
 
-    ioctl(s->me.fd, NIOCTXSYNC, NULL);
+    s->tx_packets++;
+    if (!s->tx_pending) {
+        s->tx_pending = true;
+        qemu_bh_schedule(s->tx_bh);
+    }
+    return true;
+}
+
+static int netmap_receive_batch(NetClientState *nc,
+                                const NetPacketIOV *pkts, int count)
+{
+    NetmapState *s = DO_UPCAST(NetmapState, nc, nc);
+    int n;
 
+    if (unlikely(!s->me.tx)) {
+        /* Drop. */
+        return count;
+    }
+
+    for (n = 0; n < count; n++) {
+        if (!netmap_tx_one(s, pkts[n].iov, pkts[n].iovcnt)) {
+            /* No available slots in the netmap TX ring. */
+            netmap_write_poll(s, true);
+            break;
+        }
+    }
+    return n;
+}
+
+static ssize_t netmap_receive_iov(NetClientState *nc,
+                    const struct iovec *iov, int iovcnt)
+{
+    NetPacketIOV pkt = {
+        .iov = iov,
+        .iovcnt = iovcnt,
+    };
+
+    if (netmap_receive_batch(nc, &pkt, 1) == 0) {
+        return 0;
+    }
     return iov_size(iov, iovcnt);
 }
 
+static ssize_t netmap_receive(NetClientState *nc,
+      const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return netmap_receive_iov(nc, &iov, 1);
+}
+
 /* Complete a previous send (backend --> guest) and enable the
    fd_read callback. */
 static void netmap_send_completed(NetClientState *nc, ssize_t len)
@@ -342,36 +397,46 @@ static void netmap_send(void *opaque)
     struct netmap_ring *ring = s->me.rx;
 
     /* Keep sending while there are available packets into the netmap
-       RX ring and the forwarding path towards the peer is open. */
+       RX ring and the forwarding path towards the peer is open.  The
+       packets point straight into the netmap buffers, which stay ours
+       until the next poll() on the fd. */
     while (ring->avail > 0 && qemu_can_send_packet(&s->nc)) {
-        uint32_t i;
-        uint32_t idx;
-        bool morefrag;
         int iovcnt = 0;
-        int iovsize;
-
-        do {
-            i = ring->cur;
-            idx = ring->slot[i].buf_idx;
-            morefrag = (ring->slot[i].flags & NS_MOREFRAG);
-            s->iov[iovcnt].iov_base = (u_char *)NETMAP_BUF(ring, idx);
-            s->iov[iovcnt].iov_len = ring->slot[i].len;
-            iovcnt++;
-
-            ring->cur = NETMAP_RING_NEXT(ring, i);
-            ring->avail--;
-        } while (ring->avail && morefrag);
-
-        if (unlikely(!ring->avail && morefrag)) {
-            RD(5, "[netmap_send] ran out of slots, with a pending"
-                   "incomplete packet\n");
+        int count = 0;
+        int sent;
+
+        while (ring->avail > 0 && count < NETMAP_BATCH &&
+               iovcnt < IOV_MAX) {
+            uint32_t i;
+            uint32_t idx;
+            bool morefrag;
+
+            s->pkts[count].iov = &s->iov[iovcnt];
+            do {
+                i = ring->cur;
+                idx = ring->slot[i].buf_idx;
+                morefrag = (ring->slot[i].flags & NS_MOREFRAG);
+                s->iov[iovcnt].iov_base = (u_char *)NETMAP_BUF(ring, idx);
+                s->iov[iovcnt].iov_len = ring->slot[i].len;
+                iovcnt++;
+
+                ring->cur = NETMAP_RING_NEXT(ring, i);
+                ring->avail--;
+            } while (ring->avail && morefrag && iovcnt < IOV_MAX);
+
+            if (unlikely(morefrag)) {
+                RD(5, "[netmap_send] ran out of slots, with a pending"
+                       "incomplete packet\n");
+            }
+            s->pkts[count].iovcnt = &s->iov[iovcnt] - s->pkts[count].iov;
+            count++;
         }
 
-        iovsize = qemu_sendv_packet_async(&s->nc, s->iov, iovcnt,
-                                            netmap_send_completed);
-
-        if (iovsize == 0) {
-            /* The peer does not receive anymore. Packet is queued, stop
+        s->rx_packets += count;
+        sent = qemu_sendv_packet_batch_async(&s->nc, s->pkts, count,
+                                             netmap_send_completed);
+        if (sent < count) {
+            /* The peer does not receive anymore. Packets are queued, stop
              * reading from the backend until netmap_send_completed()
              */
             netmap_read_poll(s, false);
@@ -380,6 +445,15 @@ static void netmap_send(void *opaque)
     }
 }
 
+static void netmap_print_stats(NetClientState *nc, Monitor *mon)
+{
+    NetmapState *s = DO_UPCAST(NetmapState, nc, nc);
+
+    monitor_printf(mon, "    netmap: rx %" PRIu64 " packets, tx %" PRIu64
+                   " packets in %" PRIu64 " syncs, %" PRIu64 " dropped\n",
+                   s->rx_packets, s->tx_packets, s->tx_syncs, s->tx_dropped);
+}
+
 /* Flush and close. */
 static void netmap_cleanup(NetClientState *nc)
 {
@@ -388,6 +462,10 @@ static void netmap_cleanup(NetClientState *nc)
     qemu_purge_queued_packets(nc);
 
     netmap_poll(nc, false);
+    if (s->tx_pending) {
+        netmap_tx_sync(s);
+    }
+    qemu_bh_delete(s->tx_bh);
     munmap(s->me.mem, s->me.memsize);
     close(s->me.fd);
 
@@ -401,13 +479,18 @@ static NetClientInfo net_netmap_info = {
     .size = sizeof(NetmapState),
     .receive = netmap_receive,
     .receive_iov = netmap_receive_iov,
+    .receive_batch = netmap_receive_batch,
     .poll = netmap_poll,
+    .print_stats = netmap_print_stats,
     .cleanup = netmap_cleanup,
 };
 
 /* The exported init function
  *
- * ... -net netmap,ifname="..."
+ * ... -net netmap,ifname="..."[,queues=n]
+ *
+ * With queues=n, one client is created per ring pair, all with the same
+ * name, and a multiqueue NIC uses one of them per queue.
  */
 int net_init_netmap(const NetClientOptions *opts,
         const char *name, NetClientState *peer)
@@ -416,20 +499,38 @@ int net_init_netmap(const NetClientOptions *opts,
     NetClientState *nc;
     NetmapPriv me;
     NetmapState *s;
+    unsigned int i, queues;
+
+    queues = netmap_opts->has_queues ? netmap_opts->queues : 1;
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_report("netmap: queues must be between 1 and %d",
+                     MAX_QUEUE_NUM);
+        return -1;
+    }
 
-    pstrcpy(me.fdname, sizeof(me.fdname),
-        netmap_opts->has_devname ? netmap_opts->devname : "/dev/netmap");
-    /* Set default name for the port if not supplied. */
-    pstrcpy(me.ifname, sizeof(me.ifname), netmap_opts->ifname);
-    if (netmap_open(&me)) {
+    /* QEMU vlans does not support multiqueue, in this case peer is set. */
+    if (peer && queues > 1) {
+        error_report("Multiqueue netmap cannot be used with QEMU vlans");
         return -1;
     }
-    /* Create the object. */
-    nc = qemu_new_net_client(&net_netmap_info, peer, "netmap", name);
-    s = DO_UPCAST(NetmapState, nc, nc);
-    s->me = me;
-    netmap_read_poll(s, true); /* Initially only poll for reads. */
+
+    for (i = 0; i < queues; i++) {
+        pstrcpy(me.fdname, sizeof(me.fdname),
+            netmap_opts->has_devname ? netmap_opts->devname : "/dev/netmap");
+        /* Set default name for the port if not supplied. */
+        pstrcpy(me.ifname, sizeof(me.ifname), netmap_opts->ifname);
+        if (netmap_open(&me, i, queues)) {
+            return -1;
+        }
+        /* Create the object. */
+        nc = qemu_new_net_client(&net_netmap_info, peer, "netmap", name);
+        s = DO_UPCAST(NetmapState, nc, nc);
+        s->me = me;
+        s->tx_bh = qemu_bh_new(netmap_tx_sync_bh, s);
+        snprintf(nc->info_str, sizeof(nc->info_str), "ifname=%s,ring=%u",
+                 me.ifname, i);
+        netmap_read_poll(s, true); /* Initially only poll for reads. */
+    }
 
     return 0;
 }
-
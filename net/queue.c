@@ -23,6 +23,7 @@
 
 #include "net/queue.h"
 #include "qemu/queue.h"
+#include "qemu/iov.h"
 #include "net/net.h"
 
 /* The delivery handler may only return zero if it will call
@@ -37,17 +38,46 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * With QEMU_NET_PACKET_FLAG_ZEROCOPY only the iovec array is queued, not
+ * the data.  The sender must keep the buffers alive until the sent
+ * callback, which is then called for every queued packet.
+ */
+
+/*
+ * Packets are allocated from per-queue free lists of two sizes: small
+ * ones for ordinary frames, large ones for anything up to a full GSO
+ * frame.  Freed packets go back to their list, up to a limit, instead of
+ * to the allocator.
  */
+enum {
+    NET_PACKET_POOL_SMALL,
+    NET_PACKET_POOL_LARGE,
+    NET_PACKET_POOL_MAX,
+    NET_PACKET_POOL_NONE = NET_PACKET_POOL_MAX,
+};
+
+static const struct {
+    size_t size;        /* bytes of packet data */
+    unsigned max_free;  /* free packets kept per queue */
+} net_packet_pools[NET_PACKET_POOL_MAX] = {
+    [NET_PACKET_POOL_SMALL] = { 2048, 256 },
+    [NET_PACKET_POOL_LARGE] = { NET_BUFSIZE, 16 },
+};
 
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
     unsigned flags;
     int size;
+    int iovcnt;             /* QEMU_NET_PACKET_FLAG_ZEROCOPY only */
+    int pool;               /* NET_PACKET_POOL_* it was allocated from */
     NetPacketSent *sent_cb;
     uint8_t data[0];
 };
 
+typedef QTAILQ_HEAD(, NetPacket) NetPacketList;
+
 struct NetQueue {
     void *opaque;
     uint32_t nq_maxlen;
@@ -55,12 +85,65 @@ struct NetQueue {
 
     QTAILQ_HEAD(packets, NetPacket) packets;
 
+    NetPacketList free_packets[NET_PACKET_POOL_MAX];
+    unsigned nr_free[NET_PACKET_POOL_MAX];
+
+    NetQueueStats stats;
+
     unsigned delivering : 1;
 };
 
+static NetPacket *qemu_net_queue_alloc_packet(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
+    int pool;
+
+    for (pool = 0; pool < NET_PACKET_POOL_MAX; pool++) {
+        if (size <= net_packet_pools[pool].size) {
+            break;
+        }
+    }
+
+    if (pool == NET_PACKET_POOL_NONE) {
+        packet = g_malloc(sizeof(NetPacket) + size);
+    } else if (!QTAILQ_EMPTY(&queue->free_packets[pool])) {
+        packet = QTAILQ_FIRST(&queue->free_packets[pool]);
+        QTAILQ_REMOVE(&queue->free_packets[pool], packet, entry);
+        queue->nr_free[pool]--;
+    } else {
+        packet = g_malloc(sizeof(NetPacket) + net_packet_pools[pool].size);
+    }
+    packet->pool = pool;
+    return packet;
+}
+
+static void qemu_net_queue_free_packet(NetQueue *queue, NetPacket *packet)
+{
+    int pool = packet->pool;
+
+    if (pool == NET_PACKET_POOL_NONE ||
+        queue->nr_free[pool] >= net_packet_pools[pool].max_free) {
+        g_free(packet);
+        return;
+    }
+    QTAILQ_INSERT_HEAD(&queue->free_packets[pool], packet, entry);
+    queue->nr_free[pool]++;
+}
+
+static void qemu_net_queue_insert(NetQueue *queue, NetPacket *packet)
+{
+    queue->nq_count++;
+    queue->stats.queued++;
+    if (queue->nq_count > queue->stats.max_count) {
+        queue->stats.max_count = queue->nq_count;
+    }
+    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+}
+
 NetQueue *qemu_new_net_queue(void *opaque)
 {
     NetQueue *queue;
+    int i;
 
     queue = g_malloc0(sizeof(NetQueue));
 
@@ -69,6 +152,9 @@ NetQueue *qemu_new_net_queue(void *opaque)
     queue->nq_count = 0;
 
     QTAILQ_INIT(&queue->packets);
+    for (i = 0; i < NET_PACKET_POOL_MAX; i++) {
+        QTAILQ_INIT(&queue->free_packets[i]);
+    }
 
     queue->delivering = 0;
 
@@ -78,15 +164,29 @@ NetQueue *qemu_new_net_queue(void *opaque)
 void qemu_del_net_queue(NetQueue *queue)
 {
     NetPacket *packet, *next;
+    int i;
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         g_free(packet);
     }
 
+    for (i = 0; i < NET_PACKET_POOL_MAX; i++) {
+        QTAILQ_FOREACH_SAFE(packet, &queue->free_packets[i], entry, next) {
+            QTAILQ_REMOVE(&queue->free_packets[i], packet, entry);
+            g_free(packet);
+        }
+    }
+
     g_free(queue);
 }
 
+void qemu_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats)
+{
+    *stats = queue->stats;
+    stats->count = queue->nq_count;
+}
+
 static void qemu_net_queue_append(NetQueue *queue,
                                   NetClientState *sender,
                                   unsigned flags,
@@ -97,17 +197,17 @@ static void qemu_net_queue_append(NetQueue *queue,
     NetPacket *packet;
 
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+        queue->stats.dropped++;
         return; /* drop if queue full and no callback */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
+    packet = qemu_net_queue_alloc_packet(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
     memcpy(packet->data, buf, size);
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_insert(queue, packet);
 }
 
 static void qemu_net_queue_append_iov(NetQueue *queue,
@@ -122,13 +222,14 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
     int i;
 
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+        queue->stats.dropped++;
         return; /* drop if queue full and no callback */
     }
     for (i = 0; i < iovcnt; i++) {
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_queue_alloc_packet(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -141,8 +242,29 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
         packet->size += len;
     }
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_insert(queue, packet);
+}
+
+static void qemu_net_queue_append_zerocopy(NetQueue *queue,
+                                           NetClientState *sender,
+                                           unsigned flags,
+                                           const struct iovec *iov,
+                                           int iovcnt,
+                                           NetPacketSent *sent_cb)
+{
+    NetPacket *packet;
+
+    assert(sent_cb);
+    packet = qemu_net_queue_alloc_packet(queue,
+                                         iovcnt * sizeof(struct iovec));
+    packet->sender = sender;
+    packet->sent_cb = sent_cb;
+    packet->flags = flags;
+    packet->size = iov_size(iov, iovcnt);
+    packet->iovcnt = iovcnt;
+    memcpy(packet->data, iov, iovcnt * sizeof(struct iovec));
+
+    qemu_net_queue_insert(queue, packet);
 }
 
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
@@ -175,6 +297,21 @@ static ssize_t qemu_net_queue_deliver_iov(NetQueue *queue,
     return ret;
 }
 
+static int qemu_net_queue_deliver_batch(NetQueue *queue,
+                                        NetClientState *sender,
+                                        unsigned flags,
+                                        const NetPacketIOV *pkts,
+                                        int count)
+{
+    int ret;
+
+    queue->delivering = 1;
+    ret = qemu_deliver_packet_batch(sender, flags, pkts, count, queue->opaque);
+    queue->delivering = 0;
+
+    return ret;
+}
+
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             NetClientState *sender,
                             unsigned flags,
@@ -225,6 +362,48 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/*
+ * Deliver as many packets of the batch as the receiver takes, and queue
+ * the rest.  Only the last queued packet carries @sent_cb, so the sender
+ * is called back once when the whole batch is through.  Zero-copy packets
+ * are the exception: each of them is called back, so that the sender
+ * knows when it can release the buffers.
+ *
+ * Returns the number of packets that were delivered right away.
+ */
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const NetPacketIOV *pkts,
+                              int count,
+                              NetPacketSent *sent_cb)
+{
+    int ret = 0;
+    int i;
+
+    if (!queue->delivering && qemu_can_send_packet(sender)) {
+        ret = qemu_net_queue_deliver_batch(queue, sender, flags, pkts, count);
+    }
+
+    for (i = ret; i < count; i++) {
+        if (flags & QEMU_NET_PACKET_FLAG_ZEROCOPY) {
+            qemu_net_queue_append_zerocopy(queue, sender, flags,
+                                           pkts[i].iov, pkts[i].iovcnt,
+                                           sent_cb);
+        } else {
+            qemu_net_queue_append_iov(queue, sender, flags,
+                                      pkts[i].iov, pkts[i].iovcnt,
+                                      i == count - 1 ? sent_cb : NULL);
+        }
+    }
+
+    if (ret == count) {
+        qemu_net_queue_flush(queue);
+    }
+
+    return ret;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
     NetPacket *packet, *next;
@@ -233,7 +412,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
         if (packet->sender == from) {
             QTAILQ_REMOVE(&queue->packets, packet, entry);
             queue->nq_count--;
-            g_free(packet);
+            qemu_net_queue_free_packet(queue, packet);
         }
     }
 }
@@ -248,11 +427,19 @@ bool qemu_net_queue_flush(NetQueue *queue)
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         queue->nq_count--;
 
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
+        if (packet->flags & QEMU_NET_PACKET_FLAG_ZEROCOPY) {
+            ret = qemu_net_queue_deliver_iov(queue,
+                                             packet->sender,
+                                             packet->flags,
+                                             (struct iovec *)packet->data,
+                                             packet->iovcnt);
+        } else {
+            ret = qemu_net_queue_deliver(queue,
+                                         packet->sender,
+                                         packet->flags,
+                                         packet->data,
+                                         packet->size);
+        }
         if (ret == 0) {
             queue->nq_count++;
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
@@ -263,7 +450,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_queue_free_packet(queue, packet);
     }
     return true;
 }
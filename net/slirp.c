@@ -137,7 +137,8 @@ static int net_slirp_init(NetClientState *peer, const char *model,
                           const char *vhostname, const char *tftp_export,
                           const char *bootfile, const char *vdhcp_start,
                           const char *vnameserver, const char *smb_export,
-                          const char *vsmbserver, const char **dnssearch)
+                          const char *vsmbserver, const char **dnssearch,
+                          int mtu, int sndbuf, int rcvbuf)
 {
     /* default settings according to historic slirp */
     struct in_addr net  = { .s_addr = htonl(0x0a000200) }; /* 10.0.2.0 */
@@ -243,7 +244,8 @@ static int net_slirp_init(NetClientState *peer, const char *model,
     s = DO_UPCAST(SlirpState, nc, nc);
 
     s->slirp = slirp_init(restricted, net, mask, host, vhostname,
-                          tftp_export, bootfile, dhcp, dns, dnssearch, s);
+                          tftp_export, bootfile, dhcp, dns, dnssearch,
+                          mtu, sndbuf, rcvbuf, s);
     QTAILQ_INSERT_TAIL(&slirp_stacks, s, entry);
 
     for (config = slirp_configs; config; config = config->next) {
@@ -738,6 +740,21 @@ int net_init_slirp(const NetClientOptions *opts, const char *name,
     assert(opts->kind == NET_CLIENT_OPTIONS_KIND_USER);
     user = opts->user;
 
+    if (user->has_mtu &&
+        (user->mtu < SLIRP_MTU_MIN || user->mtu > SLIRP_MTU_MAX)) {
+        error_report("user: mtu must be between %d and %d",
+                     SLIRP_MTU_MIN, SLIRP_MTU_MAX);
+        return -1;
+    }
+    if ((user->has_sndbuf && (user->sndbuf < SLIRP_SOCKBUF_MIN ||
+                              user->sndbuf > SLIRP_SOCKBUF_MAX)) ||
+        (user->has_rcvbuf && (user->rcvbuf < SLIRP_SOCKBUF_MIN ||
+                              user->rcvbuf > SLIRP_SOCKBUF_MAX))) {
+        error_report("user: sndbuf and rcvbuf must be between %d and %d",
+                     SLIRP_SOCKBUF_MIN, SLIRP_SOCKBUF_MAX);
+        return -1;
+    }
+
     vnet = user->has_net ? g_strdup(user->net) :
            user->has_ip  ? g_strdup_printf("%s/24", user->ip) :
            NULL;
@@ -752,7 +769,10 @@ int net_init_slirp(const NetClientOptions *opts, const char *name,
     ret = net_slirp_init(peer, "user", name, user->q_restrict, vnet,
                          user->host, user->hostname, user->tftp,
                          user->bootfile, user->dhcpstart, user->dns, user->smb,
-                         user->smbserver, dnssearch);
+                         user->smbserver, dnssearch,
+                         user->has_mtu ? user->mtu : 0,
+                         user->has_sndbuf ? user->sndbuf : 0,
+                         user->has_rcvbuf ? user->rcvbuf : 0);
 
     while (slirp_configs) {
         config = slirp_configs;
@@ -33,6 +33,9 @@
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
 
+/* Datagrams moved per recvmmsg()/sendmmsg() call */
+#define NET_SOCKET_BATCH 8
+
 typedef struct NetSocketState {
     NetClientState nc;
     int listen_fd;
@@ -46,6 +49,9 @@ typedef struct NetSocketState {
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
     bool write_poll;              /* waiting to transmit data? */
+#ifdef CONFIG_SENDMMSG
+    uint8_t (*dgram_bufs)[NET_BUFSIZE]; /* recvmmsg() buffers */
+#endif
 } NetSocketState;
 
 static void net_socket_accept(void *opaque);
@@ -142,6 +148,42 @@ static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf,
     return ret;
 }
 
+#ifdef CONFIG_SENDMMSG
+static int net_socket_receive_dgram_batch(NetClientState *nc,
+                                          const NetPacketIOV *pkts, int count)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    struct mmsghdr msgs[NET_SOCKET_BATCH];
+    int i, n, done = 0;
+
+    while (done < count) {
+        n = MIN(count - done, NET_SOCKET_BATCH);
+        memset(msgs, 0, sizeof(msgs[0]) * n);
+        for (i = 0; i < n; i++) {
+            msgs[i].msg_hdr.msg_name = &s->dgram_dst;
+            msgs[i].msg_hdr.msg_namelen = sizeof(s->dgram_dst);
+            msgs[i].msg_hdr.msg_iov = (struct iovec *)pkts[done + i].iov;
+            msgs[i].msg_hdr.msg_iovlen = pkts[done + i].iovcnt;
+        }
+
+        do {
+            n = sendmmsg(s->fd, msgs, n, 0);
+        } while (n == -1 && errno == EINTR);
+
+        if (n == -1 && errno == EAGAIN) {
+            net_socket_write_poll(s, true);
+            return done;
+        }
+        if (n <= 0) {
+            /* Drop the batch, as net_socket_receive_dgram() would */
+            return count;
+        }
+        done += n;
+    }
+    return done;
+}
+#endif
+
 static void net_socket_send(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -220,6 +262,42 @@ static void net_socket_send(void *opaque)
     }
 }
 
+#ifdef CONFIG_SENDMMSG
+static void net_socket_send_dgram(void *opaque)
+{
+    NetSocketState *s = opaque;
+    struct mmsghdr msgs[NET_SOCKET_BATCH];
+    struct iovec iov[NET_SOCKET_BATCH];
+    NetPacketIOV pkts[NET_SOCKET_BATCH];
+    int i, n;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < NET_SOCKET_BATCH; i++) {
+        iov[i].iov_base = s->dgram_bufs[i];
+        iov[i].iov_len = NET_BUFSIZE;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    n = recvmmsg(s->fd, msgs, NET_SOCKET_BATCH, 0, NULL);
+    if (n < 0) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (msgs[i].msg_len == 0) {
+            /* end of connection */
+            net_socket_read_poll(s, false);
+            net_socket_write_poll(s, false);
+            break;
+        }
+        iov[i].iov_len = msgs[i].msg_len;
+        pkts[i].iov = &iov[i];
+        pkts[i].iovcnt = 1;
+    }
+    qemu_sendv_packet_batch_async(&s->nc, pkts, i, NULL);
+}
+#else
 static void net_socket_send_dgram(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -236,6 +314,7 @@ static void net_socket_send_dgram(void *opaque)
     }
     qemu_send_packet(&s->nc, s->buf, size);
 }
+#endif
 
 static int net_socket_mcast_create(struct sockaddr_in *mcastaddr, struct in_addr *localaddr)
 {
@@ -336,12 +415,19 @@ static void net_socket_cleanup(NetClientState *nc)
         closesocket(s->listen_fd);
         s->listen_fd = -1;
     }
+#ifdef CONFIG_SENDMMSG
+    g_free(s->dgram_bufs);
+    s->dgram_bufs = NULL;
+#endif
 }
 
 static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_OPTIONS_KIND_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
+#ifdef CONFIG_SENDMMSG
+    .receive_batch = net_socket_receive_dgram_batch,
+#endif
     .cleanup = net_socket_cleanup,
 };
 
@@ -399,6 +485,9 @@ static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
     s->fd = fd;
     s->listen_fd = -1;
     s->send_fn = net_socket_send_dgram;
+#ifdef CONFIG_SENDMMSG
+    s->dgram_bufs = g_malloc(NET_SOCKET_BATCH * NET_BUFSIZE);
+#endif
     net_socket_read_poll(s, true);
 
     /* mcast: save bound address as dst */
@@ -44,12 +44,15 @@
 
 #include "net/vhost_net.h"
 
+/* Packets read from the tap per delivery to the peer */
+#define TAP_BATCH 8
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
-    uint8_t buf[NET_BUFSIZE];
+    uint8_t buf[TAP_BATCH][NET_BUFSIZE];
     bool read_poll;
     bool write_poll;
     bool using_vnet_hdr;
@@ -188,26 +191,41 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
-    int size;
+    struct iovec iov[TAP_BATCH];
+    NetPacketIOV pkts[TAP_BATCH];
+    int size, count, sent;
 
     do {
-        uint8_t *buf = s->buf;
+        /* Drain up to a batch from the tap, then hand it over at once */
+        for (count = 0; count < TAP_BATCH; count++) {
+            uint8_t *buf = s->buf[count];
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
-        if (size <= 0) {
-            break;
-        }
+            size = tap_read_packet(s->fd, buf, NET_BUFSIZE);
+            if (size <= 0) {
+                break;
+            }
+
+            if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                buf  += s->host_vnet_hdr_len;
+                size -= s->host_vnet_hdr_len;
+            }
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
+            iov[count].iov_base = buf;
+            iov[count].iov_len = size;
+            pkts[count].iov = &iov[count];
+            pkts[count].iovcnt = 1;
+        }
+        if (count == 0) {
+            break;
         }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
+        sent = qemu_sendv_packet_batch_async(&s->nc, pkts, count,
+                                             tap_send_completed);
+        if (sent < count) {
             tap_read_poll(s, false);
+            break;
         }
-    } while (size > 0 && qemu_can_send_packet(&s->nc));
+    } while (count == TAP_BATCH && qemu_can_send_packet(&s->nc));
 }
 
 bool tap_has_ufo(NetClientState *nc)
@@ -621,19 +639,29 @@ static int net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
 
     if (tap->has_vhost ? tap->vhost :
         vhostfdname || (tap->has_vhostforce && tap->vhostforce)) {
+        VhostNetOptions options;
         int vhostfd;
 
+        options.backend_type = VHOST_BACKEND_TYPE_KERNEL;
+        options.net_backend = &s->nc;
+        options.force = tap->has_vhostforce && tap->vhostforce;
+
         if (tap->has_vhostfd || tap->has_vhostfds) {
             vhostfd = monitor_handle_fd_param(cur_mon, vhostfdname);
             if (vhostfd == -1) {
                 return -1;
             }
         } else {
-            vhostfd = -1;
+            vhostfd = open("/dev/vhost-net", O_RDWR);
+            if (vhostfd < 0) {
+                error_report("tap: open vhost char device failed: %s",
+                             strerror(errno));
+                return -1;
+            }
         }
+        options.opaque = (void *)(uintptr_t)vhostfd;
 
-        s->vhost_net = vhost_net_init(&s->nc, vhostfd,
-                                      tap->has_vhostforce && tap->vhostforce);
+        s->vhost_net = vhost_net_init(&options);
         if (!s->vhost_net) {
             error_report("vhost-net requested but could not be initialized");
             return -1;
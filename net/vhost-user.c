@@ -0,0 +1,102 @@
+/*
+ * vhost-user.c
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "clients.h"
+#include "net/vhost_net.h"
+#include "net/vhost-user.h"
+#include "qemu/error-report.h"
+#include "qemu/sockets.h"
+
+typedef struct VhostUserState {
+    NetClientState nc;
+    VHostNetState *vhost_net;
+} VhostUserState;
+
+VHostNetState *vhost_user_get_vhost_net(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    return s->vhost_net;
+}
+
+/* The external process moves packets through the rings.  Anything that
+ * still comes this way, before vhost is started, is dropped.
+ */
+static ssize_t vhost_user_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    return size;
+}
+
+static void vhost_user_cleanup(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+
+    if (s->vhost_net) {
+        vhost_net_cleanup(s->vhost_net);
+        s->vhost_net = NULL;
+    }
+}
+
+static NetClientInfo net_vhost_user_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_VHOST_USER,
+    .size = sizeof(VhostUserState),
+    .receive = vhost_user_receive,
+    .cleanup = vhost_user_cleanup,
+};
+
+int net_init_vhost_user(const NetClientOptions *opts, const char *name,
+                        NetClientState *peer)
+{
+    const NetdevVhostUserOptions *vhost_user_opts;
+    VhostNetOptions options;
+    VhostUserState *s;
+    NetClientState *nc;
+    Error *err = NULL;
+    int fd;
+
+    assert(opts->kind == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    vhost_user_opts = opts->vhost_user;
+
+    /* The rings are shared with the NIC directly, a hub cannot sit in
+     * between.
+     */
+    if (peer) {
+        error_report("vhost-user cannot be used with QEMU vlans");
+        return -1;
+    }
+
+    fd = unix_connect(vhost_user_opts->path, &err);
+    if (fd < 0) {
+        error_report("vhost-user: %s", error_get_pretty(err));
+        error_free(err);
+        return -1;
+    }
+
+    nc = qemu_new_net_client(&net_vhost_user_info, peer, "vhost-user", name);
+    snprintf(nc->info_str, sizeof(nc->info_str), "path=%s",
+             vhost_user_opts->path);
+    s = DO_UPCAST(VhostUserState, nc, nc);
+
+    options.backend_type = VHOST_BACKEND_TYPE_USER;
+    options.net_backend = nc;
+    options.opaque = (void *)(uintptr_t)fd;
+    options.force = vhost_user_opts->has_vhostforce &&
+                    vhost_user_opts->vhostforce;
+
+    s->vhost_net = vhost_net_init(&options);
+    if (!s->vhost_net) {
+        error_report("vhost-user requested but could not be initialized");
+        qemu_del_net_client(nc);
+        return -1;
+    }
+
+    return 0;
+}
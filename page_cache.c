@@ -23,6 +23,7 @@
 #include <glib.h>
 
 #include "qemu-common.h"
+#include "qemu/atomic.h"
 #include "migration/page_cache.h"
 
 #ifdef DEBUG_CACHE
@@ -33,26 +34,88 @@
     do { } while (0)
 #endif
 
+/*
+ * The cache is set-associative: an address maps to one set of
+ * CACHE_WAYS items, and a page only evicts another page of its set,
+ * picked by a per-set CLOCK hand that skips recently used items.  All
+ * page copies live in one slab, item i owning the i-th page of it.
+ */
+
+#define CACHE_WAYS 8
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
-    uint64_t it_age;
-    uint8_t *it_data;
+    bool it_ref;    /* used since the CLOCK hand last passed */
 };
 
+typedef struct CacheSet {
+    unsigned int hand;
+} CacheSet;
+
 struct PageCache {
     CacheItem *page_cache;
+    CacheSet *sets;
+    uint8_t *data;
     unsigned int page_size;
     int64_t max_num_items;
-    uint64_t max_item_age;
+    int64_t num_sets;
+    unsigned int ways;
     int64_t num_items;
+    PageCacheStats stats;
 };
 
-PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+static uint8_t *cache_item_data(const PageCache *cache, const CacheItem *it)
+{
+    return cache->data + (size_t)(it - cache->page_cache) * cache->page_size;
+}
+
+static int64_t cache_get_set(const PageCache *cache, uint64_t address)
+{
+    return (address / cache->page_size) & (cache->num_sets - 1);
+}
+
+/* Sets the geometry and allocates everything; contents are empty */
+static int cache_alloc(PageCache *cache, int64_t num_pages)
 {
     int64_t i;
 
+    cache->max_num_items = num_pages;
+    cache->ways = MIN(num_pages, CACHE_WAYS);
+    cache->num_sets = num_pages / cache->ways;
+    cache->num_items = 0;
+
+    cache->data = g_try_malloc((size_t)num_pages * cache->page_size);
+    if (!cache->data) {
+        DPRINTF("Error allocating %" PRId64 " pages\n", num_pages);
+        return -1;
+    }
+    cache->page_cache = g_malloc(num_pages * sizeof(*cache->page_cache));
+    cache->sets = g_malloc0(cache->num_sets * sizeof(*cache->sets));
+
+    for (i = 0; i < num_pages; i++) {
+        cache->page_cache[i].it_addr = -1;
+        cache->page_cache[i].it_ref = false;
+    }
+
+    DPRINTF("Setting cache to %" PRId64 " sets of %u pages\n",
+            cache->num_sets, cache->ways);
+    return 0;
+}
+
+static void cache_free(PageCache *cache)
+{
+    g_free(cache->data);
+    g_free(cache->page_cache);
+    g_free(cache->sets);
+    cache->data = NULL;
+    cache->page_cache = NULL;
+    cache->sets = NULL;
+}
+
+PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+{
     PageCache *cache;
 
     if (num_pages <= 0) {
@@ -60,27 +123,17 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         return NULL;
     }
 
-    cache = g_malloc(sizeof(*cache));
-
     /* round down to the nearest power of 2 */
     if (!is_power_of_2(num_pages)) {
         num_pages = pow2floor(num_pages);
         DPRINTF("rounding down to %" PRId64 "\n", num_pages);
     }
-    cache->page_size = page_size;
-    cache->num_items = 0;
-    cache->max_item_age = 0;
-    cache->max_num_items = num_pages;
-
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
-
-    cache->page_cache = g_malloc((cache->max_num_items) *
-                                 sizeof(*cache->page_cache));
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
-        cache->page_cache[i].it_age = 0;
-        cache->page_cache[i].it_addr = -1;
+    cache = g_malloc0(sizeof(*cache));
+    cache->page_size = page_size;
+    if (cache_alloc(cache, num_pages) < 0) {
+        g_free(cache);
+        return NULL;
     }
 
     return cache;
@@ -88,87 +141,99 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
 
 void cache_fini(PageCache *cache)
 {
-    int64_t i;
-
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        g_free(cache->page_cache[i].it_data);
-    }
-
-    g_free(cache->page_cache);
-    cache->page_cache = NULL;
-}
-
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
-{
-    size_t pos;
-
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    cache_free(cache);
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
-
-    return (cache->page_cache[pos].it_addr == addr);
+    set = &cache->page_cache[cache_get_set(cache, addr) * cache->ways];
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
-
-    g_assert(cache);
-    g_assert(cache->page_cache);
-
-    pos = cache_get_cache_pos(cache, addr);
-
-    return &cache->page_cache[pos];
+    /* The statistics and the CLOCK bit are not part of the lookup result */
+    PageCache *c = (PageCache *)cache;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    if (it) {
+        it->it_ref = true;
+        atomic_inc(&c->stats.hits);
+        return true;
+    }
+    atomic_inc(&c->stats.misses);
+    return false;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? cache_item_data(cache, it) : NULL;
 }
 
 void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
 {
-
-    CacheItem *it = NULL;
+    CacheSet *cs;
+    CacheItem *set, *it;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
+    if (!it) {
+        cs = &cache->sets[cache_get_set(cache, addr)];
+        set = &cache->page_cache[cache_get_set(cache, addr) * cache->ways];
+
+        for (i = 0; i < cache->ways; i++) {
+            if (set[i].it_addr == -1) {
+                it = &set[i];
+                atomic_inc(&cache->num_items);
+                break;
+            }
+        }
 
-    /* free old cached data if any */
-    g_free(it->it_data);
+        /* Full set: the CLOCK hand gives used items a second chance */
+        while (!it) {
+            CacheItem *victim = &set[cs->hand];
 
-    if (!it->it_data) {
-        cache->num_items++;
+            cs->hand = (cs->hand + 1) % cache->ways;
+            if (victim->it_ref) {
+                victim->it_ref = false;
+            } else {
+                it = victim;
+                atomic_inc(&cache->stats.evictions);
+            }
+        }
+        /* A new page only gets its second chance once it is looked up
+         * again, so that pages seen just once do not push out busy ones.
+         */
+        it->it_addr = addr;
+        it->it_ref = false;
     }
 
-    it->it_data = g_memdup(pdata, cache->page_size);
-    it->it_age = ++cache->max_item_age;
-    it->it_addr = addr;
+    memcpy(cache_item_data(cache, it), pdata, cache->page_size);
+    atomic_inc(&cache->stats.inserts);
 }
 
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
-    PageCache *new_cache;
-    int64_t i;
-
-    CacheItem *old_it, *new_it;
+    int64_t old_num_pages;
 
     g_assert(cache);
 
@@ -177,44 +242,37 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return -1;
     }
 
+    if (new_num_pages <= 0) {
+        return -1;
+    }
+
     /* same size */
     if (pow2floor(new_num_pages) == cache->max_num_items) {
         return cache->max_num_items;
     }
 
-    new_cache = cache_init(new_num_pages, cache->page_size);
-    if (!(new_cache)) {
+    /* The contents are dropped rather than copied: the old slab is freed
+     * first, so that resizing a big cache does not need both at once, and
+     * the cache fills up again within one pass over RAM.
+     */
+    old_num_pages = cache->max_num_items;
+    cache_free(cache);
+    if (cache_alloc(cache, pow2floor(new_num_pages)) < 0) {
         DPRINTF("Error creating new cache\n");
-        return -1;
-    }
-
-    /* move all data from old cache */
-    for (i = 0; i < cache->max_num_items; i++) {
-        old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
-                g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
-                g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
-            }
+        /* Keep a usable cache of the old size, the memory was just freed */
+        if (cache_alloc(cache, old_num_pages) < 0) {
+            abort();
         }
+        return -1;
     }
 
-    g_free(cache->page_cache);
-    cache->page_cache = new_cache->page_cache;
-    cache->max_num_items = new_cache->max_num_items;
-    cache->num_items = new_cache->num_items;
-
-    g_free(new_cache);
-
     return cache->max_num_items;
 }
+
+void cache_get_stats(const PageCache *cache, PageCacheStats *stats)
+{
+    stats->hits = atomic_read(&cache->stats.hits);
+    stats->misses = atomic_read(&cache->stats.misses);
+    stats->evictions = atomic_read(&cache->stats.evictions);
+    stats->inserts = atomic_read(&cache->stats.inserts);
+}
@@ -0,0 +1,394 @@
+/*
+ * Postcopy migration for RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * Postcopy is a migration technique where the execution flips from the
+ * source to the destination before all the data has been copied.  Guest
+ * RAM that has not arrived yet is registered with userfaultfd on the
+ * destination; accesses to it fault, and a dedicated thread asks the
+ * source for the missing pages over the return path.
+ */
+
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/event_notifier.h"
+#include "qemu/thread.h"
+#include "exec/cpu-all.h"
+#include "exec/memory.h"
+#include "migration/migration.h"
+#include "migration/postcopy-ram.h"
+#include "trace.h"
+
+#if defined(CONFIG_POSTCOPY_RAM)
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+static struct {
+    bool active;
+    int userfault_fd;
+    EventNotifier quit;
+    QemuThread fault_thread;
+    /* Return path to the source, shared by the fault and listen threads */
+    QemuMutex rp_mutex;
+    QEMUFile *rp;
+} postcopy_incoming = {
+    .userfault_fd = -1,
+};
+
+static void postcopy_send_rp_message(uint16_t type, uint16_t len,
+                                     const uint8_t *data)
+{
+    qemu_mutex_lock(&postcopy_incoming.rp_mutex);
+    qemu_put_be16(postcopy_incoming.rp, type);
+    qemu_put_be16(postcopy_incoming.rp, len);
+    qemu_put_buffer(postcopy_incoming.rp, data, len);
+    qemu_fflush(postcopy_incoming.rp);
+    qemu_mutex_unlock(&postcopy_incoming.rp_mutex);
+}
+
+static void postcopy_request_page(RAMBlock *block, ram_addr_t offset)
+{
+    uint8_t buf[8 + 4 + 1 + sizeof(block->idstr)];
+    size_t idlen = strlen(block->idstr);
+
+    trace_postcopy_request_page(block->idstr, offset);
+
+    stq_be_p(buf, offset);
+    stl_be_p(buf + 8, TARGET_PAGE_SIZE);
+    buf[12] = idlen;
+    memcpy(buf + 13, block->idstr, idlen);
+    postcopy_send_rp_message(MIG_RP_MSG_REQ_PAGES, 13 + idlen, buf);
+}
+
+static RAMBlock *postcopy_find_block(uint8_t *host, ram_addr_t *offset)
+{
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        uint8_t *base = memory_region_get_ram_ptr(block->mr);
+
+        if (host >= base && host < base + block->length) {
+            *offset = host - base;
+            return block;
+        }
+    }
+    return NULL;
+}
+
+bool postcopy_ram_supported_by_host(void)
+{
+    struct uffdio_api api_struct;
+    RAMBlock *block;
+    int ufd;
+
+    /* Pages are requested and placed one host page at a time */
+    if (getpagesize() != TARGET_PAGE_SIZE) {
+        error_report("postcopy: target page size %d differs from host "
+                     "page size %d", TARGET_PAGE_SIZE, getpagesize());
+        return false;
+    }
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (block->fd >= 0) {
+            error_report("postcopy: file backed RAM (%s) is not supported",
+                         block->idstr);
+            return false;
+        }
+    }
+
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (ufd == -1) {
+        error_report("postcopy: userfaultfd not available: %s",
+                     strerror(errno));
+        return false;
+    }
+
+    api_struct.api = UFFD_API;
+    api_struct.features = 0;
+    if (ioctl(ufd, UFFDIO_API, &api_struct)) {
+        error_report("postcopy: UFFDIO_API failed: %s", strerror(errno));
+        close(ufd);
+        return false;
+    }
+
+    close(ufd);
+    return true;
+}
+
+int postcopy_ram_discard_range(const char *idstr, uint64_t start,
+                               uint64_t length)
+{
+    RAMBlock *block;
+
+    trace_postcopy_ram_discard_range(idstr, start, length);
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strcmp(idstr, block->idstr)) {
+            break;
+        }
+    }
+    if (!block) {
+        error_report("postcopy: discard for unknown block %s", idstr);
+        return -EINVAL;
+    }
+
+    if ((start | length) & ~TARGET_PAGE_MASK ||
+        start + length > block->length) {
+        error_report("postcopy: bad discard range %" PRIx64 "+%" PRIx64
+                     " in %s", start, length, idstr);
+        return -EINVAL;
+    }
+
+    if (qemu_madvise(memory_region_get_ram_ptr(block->mr) + start, length,
+                     QEMU_MADV_DONTNEED) < 0) {
+        error_report("postcopy: madvise failed: %s", strerror(errno));
+        return -errno;
+    }
+
+    return 0;
+}
+
+static void *postcopy_ram_fault_thread(void *opaque)
+{
+    struct pollfd pfd[2];
+    struct uffd_msg msg;
+    RAMBlock *block;
+    ram_addr_t offset;
+    ssize_t ret;
+
+    pfd[0].fd = postcopy_incoming.userfault_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = event_notifier_get_fd(&postcopy_incoming.quit);
+    pfd[1].events = POLLIN;
+
+    while (true) {
+        pfd[0].revents = 0;
+        pfd[1].revents = 0;
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("postcopy: fault thread poll failed: %s",
+                         strerror(errno));
+            break;
+        }
+
+        if (pfd[1].revents) {
+            break;
+        }
+
+        ret = read(postcopy_incoming.userfault_fd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            error_report("postcopy: failed to read userfault event: %s",
+                         ret < 0 ? strerror(errno) : "short read");
+            break;
+        }
+
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        block = postcopy_find_block((uint8_t *)(uintptr_t)
+                                    msg.arg.pagefault.address, &offset);
+        if (!block) {
+            error_report("postcopy: fault on unknown address %" PRIx64,
+                         (uint64_t)msg.arg.pagefault.address);
+            continue;
+        }
+
+        /* The same page may be requested more than once: the source sends
+         * it again and placing it fails harmlessly with EEXIST.
+         */
+        postcopy_request_page(block, offset & TARGET_PAGE_MASK);
+    }
+
+    return NULL;
+}
+
+int postcopy_ram_incoming_setup(QEMUFile *rp)
+{
+    struct uffdio_api api_struct;
+    struct uffdio_register reg;
+    RAMBlock *block;
+
+    postcopy_incoming.userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (postcopy_incoming.userfault_fd == -1) {
+        error_report("postcopy: userfaultfd failed: %s", strerror(errno));
+        return -errno;
+    }
+
+    api_struct.api = UFFD_API;
+    api_struct.features = 0;
+    if (ioctl(postcopy_incoming.userfault_fd, UFFDIO_API, &api_struct)) {
+        error_report("postcopy: UFFDIO_API failed: %s", strerror(errno));
+        goto fail;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        reg.range.start = (uintptr_t)memory_region_get_ram_ptr(block->mr);
+        reg.range.len = block->length;
+        if (ioctl(postcopy_incoming.userfault_fd, UFFDIO_REGISTER, &reg)) {
+            error_report("postcopy: failed to register %s: %s",
+                         block->idstr, strerror(errno));
+            goto fail;
+        }
+        if (!(reg.ioctls & ((__u64)1 << _UFFDIO_COPY))) {
+            error_report("postcopy: UFFDIO_COPY not available for %s",
+                         block->idstr);
+            goto fail;
+        }
+    }
+
+    if (event_notifier_init(&postcopy_incoming.quit, false) < 0) {
+        goto fail;
+    }
+    qemu_mutex_init(&postcopy_incoming.rp_mutex);
+    postcopy_incoming.rp = rp;
+    postcopy_incoming.active = true;
+
+    qemu_thread_create(&postcopy_incoming.fault_thread,
+                       postcopy_ram_fault_thread, NULL, QEMU_THREAD_JOINABLE);
+    return 0;
+
+fail:
+    /* Closing the descriptor drops any registration made so far */
+    close(postcopy_incoming.userfault_fd);
+    postcopy_incoming.userfault_fd = -1;
+    return -1;
+}
+
+int postcopy_ram_incoming_cleanup(void)
+{
+    struct uffdio_range range;
+    RAMBlock *block;
+    uint8_t buf[4];
+
+    if (!postcopy_incoming.active) {
+        return 0;
+    }
+
+    event_notifier_set(&postcopy_incoming.quit);
+    qemu_thread_join(&postcopy_incoming.fault_thread);
+    event_notifier_cleanup(&postcopy_incoming.quit);
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        range.start = (uintptr_t)memory_region_get_ram_ptr(block->mr);
+        range.len = block->length;
+        if (ioctl(postcopy_incoming.userfault_fd, UFFDIO_UNREGISTER, &range)) {
+            error_report("postcopy: failed to unregister %s: %s",
+                         block->idstr, strerror(errno));
+        }
+    }
+    close(postcopy_incoming.userfault_fd);
+    postcopy_incoming.userfault_fd = -1;
+    postcopy_incoming.active = false;
+
+    stl_be_p(buf, 0);
+    postcopy_send_rp_message(MIG_RP_MSG_SHUT, sizeof(buf), buf);
+    qemu_fclose(postcopy_incoming.rp);
+    postcopy_incoming.rp = NULL;
+    qemu_mutex_destroy(&postcopy_incoming.rp_mutex);
+
+    return 0;
+}
+
+bool postcopy_ram_incoming_active(void)
+{
+    return postcopy_incoming.active;
+}
+
+int postcopy_place_page(void *host, void *from)
+{
+    struct uffdio_copy copy_struct;
+
+    copy_struct.dst = (uintptr_t)host;
+    copy_struct.src = (uintptr_t)from;
+    copy_struct.len = TARGET_PAGE_SIZE;
+    copy_struct.mode = 0;
+
+    if (ioctl(postcopy_incoming.userfault_fd, UFFDIO_COPY, &copy_struct)) {
+        /* The page was already placed by an earlier copy of it */
+        if (errno == EEXIST) {
+            return 0;
+        }
+        error_report("postcopy: UFFDIO_COPY failed at %p: %s",
+                     host, strerror(errno));
+        return -errno;
+    }
+
+    return 0;
+}
+
+int postcopy_place_page_zero(void *host)
+{
+    struct uffdio_zeropage zero_struct;
+
+    zero_struct.range.start = (uintptr_t)host;
+    zero_struct.range.len = TARGET_PAGE_SIZE;
+    zero_struct.mode = 0;
+
+    if (ioctl(postcopy_incoming.userfault_fd, UFFDIO_ZEROPAGE, &zero_struct)) {
+        if (errno == EEXIST) {
+            return 0;
+        }
+        error_report("postcopy: UFFDIO_ZEROPAGE failed at %p: %s",
+                     host, strerror(errno));
+        return -errno;
+    }
+
+    return 0;
+}
+
+#else
+/* No target OS support, stubs just fail */
+
+bool postcopy_ram_supported_by_host(void)
+{
+    error_report("postcopy: not supported on this host");
+    return false;
+}
+
+int postcopy_ram_discard_range(const char *idstr, uint64_t start,
+                               uint64_t length)
+{
+    return -ENOTSUP;
+}
+
+int postcopy_ram_incoming_setup(QEMUFile *rp)
+{
+    return -ENOTSUP;
+}
+
+int postcopy_ram_incoming_cleanup(void)
+{
+    return 0;
+}
+
+bool postcopy_ram_incoming_active(void)
+{
+    return false;
+}
+
+int postcopy_place_page(void *host, void *from)
+{
+    return -ENOTSUP;
+}
+
+int postcopy_place_page_zero(void *host)
+{
+    return -ENOTSUP;
+}
+
+#endif
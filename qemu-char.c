@@ -26,6 +26,7 @@
 #include "ui/console.h"
 #include "sysemu/sysemu.h"
 #include "qemu/timer.h"
+#include "qemu/iov.h"
 #include "sysemu/char.h"
 #include "hw/usb.h"
 #include "qmp-commands.h"
@@ -84,6 +85,8 @@
 #include "ui/qemu-spice.h"
 
 #define READ_BUF_LEN 4096
+/* Backends that read from a file grow their buffer up to this size */
+#define READ_BUF_MAX (64 * 1024)
 
 /***********************************************************/
 /* character device */
@@ -118,6 +121,54 @@ int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len)
     return s->chr_write(s, buf, len);
 }
 
+int qemu_chr_fe_writev(CharDriverState *s, const struct iovec *iov,
+                       int iovcnt)
+{
+    int i, ret, total = 0;
+
+    if (s->chr_writev) {
+        return s->chr_writev(s, iov, iovcnt);
+    }
+    for (i = 0; i < iovcnt; i++) {
+        ret = s->chr_write(s, iov[i].iov_base, iov[i].iov_len);
+        if (ret < 0) {
+            return total ? total : ret;
+        }
+        total += ret;
+        if (ret < iov[i].iov_len) {
+            break;
+        }
+    }
+    return total;
+}
+
+/* Return the read buffer of @s, and clamp *@len to its size.  It starts
+ * at READ_BUF_LEN bytes and doubles after every read that filled it
+ * while the front end could take more, so that bulk transfers need
+ * fewer system calls.
+ */
+static uint8_t *qemu_chr_get_read_buf(CharDriverState *s, int *len)
+{
+    if (!s->read_buf) {
+        s->read_buf_len = READ_BUF_LEN;
+        s->read_buf = g_malloc(s->read_buf_len);
+    }
+    if (*len > s->read_buf_len) {
+        *len = s->read_buf_len;
+    }
+    return s->read_buf;
+}
+
+static void qemu_chr_read_buf_done(CharDriverState *s, int max_size,
+                                   int size)
+{
+    if (size == s->read_buf_len && max_size > size &&
+        s->read_buf_len < READ_BUF_MAX) {
+        s->read_buf_len *= 2;
+        s->read_buf = g_realloc(s->read_buf, s->read_buf_len);
+    }
+}
+
 int qemu_chr_fe_write_all(CharDriverState *s, const uint8_t *buf, int len)
 {
     int offset = 0;
@@ -645,7 +696,7 @@ static gboolean io_watch_poll_prepare(GSource *source, gint *timeout_)
     if (now_active) {
         iwp->src = g_io_create_watch(iwp->channel, G_IO_IN | G_IO_ERR | G_IO_HUP);
         g_source_set_callback(iwp->src, iwp->fd_read, iwp->opaque, NULL);
-        g_source_attach(iwp->src, NULL);
+        g_source_attach(iwp->src, g_source_get_context(source));
     } else {
         g_source_destroy(iwp->src);
         g_source_unref(iwp->src);
@@ -688,11 +739,14 @@ static GSourceFuncs io_watch_poll_funcs = {
     .finalize = io_watch_poll_finalize,
 };
 
-/* Can only be used for read */
+/* Can only be used for read.  The watch is attached to @context, NULL
+ * meaning the main loop.
+ */
 static guint io_add_watch_poll(GIOChannel *channel,
                                IOCanReadHandler *fd_can_read,
                                GIOFunc fd_read,
-                               gpointer user_data)
+                               gpointer user_data,
+                               GMainContext *context)
 {
     IOWatchPoll *iwp;
     int tag;
@@ -704,19 +758,19 @@ static guint io_add_watch_poll(GIOChannel *channel,
     iwp->fd_read = (GSourceFunc) fd_read;
     iwp->src = NULL;
 
-    tag = g_source_attach(&iwp->parent, NULL);
+    tag = g_source_attach(&iwp->parent, context);
     g_source_unref(&iwp->parent);
     return tag;
 }
 
-static void io_remove_watch_poll(guint tag)
+static void io_remove_watch_poll(guint tag, GMainContext *context)
 {
     GSource *source;
     IOWatchPoll *iwp;
 
     g_return_if_fail (tag > 0);
 
-    source = g_main_context_find_source_by_id(NULL, tag);
+    source = g_main_context_find_source_by_id(context, tag);
     g_return_if_fail (source != NULL);
 
     iwp = io_watch_poll_from_source(source);
@@ -731,7 +785,7 @@ static void io_remove_watch_poll(guint tag)
 static void remove_fd_in_watch(CharDriverState *chr)
 {
     if (chr->fd_in_tag) {
-        io_remove_watch_poll(chr->fd_in_tag);
+        io_remove_watch_poll(chr->fd_in_tag, chr->context);
         chr->fd_in_tag = 0;
     }
 }
@@ -820,22 +874,29 @@ static int fd_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     return io_channel_send(s->fd_out, buf, len);
 }
 
+static int fd_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                         int iovcnt)
+{
+    FDCharDriver *s = chr->opaque;
+
+    /* The channel is unbuffered, it is fine to go around it */
+    return iov_writev(g_io_channel_unix_get_fd(s->fd_out), iov, iovcnt);
+}
+
 static gboolean fd_chr_read(GIOChannel *chan, GIOCondition cond, void *opaque)
 {
     CharDriverState *chr = opaque;
     FDCharDriver *s = chr->opaque;
     int len;
-    uint8_t buf[READ_BUF_LEN];
+    uint8_t *buf;
     GIOStatus status;
     gsize bytes_read;
 
-    len = sizeof(buf);
-    if (len > s->max_size) {
-        len = s->max_size;
-    }
+    len = s->max_size;
     if (len == 0) {
         return TRUE;
     }
+    buf = qemu_chr_get_read_buf(chr, &len);
 
     status = g_io_channel_read_chars(chan, (gchar *)buf,
                                      len, &bytes_read, NULL);
@@ -846,6 +907,7 @@ static gboolean fd_chr_read(GIOChannel *chan, GIOCondition cond, void *opaque)
     }
     if (status == G_IO_STATUS_NORMAL) {
         qemu_chr_be_write(chr, buf, bytes_read);
+        qemu_chr_read_buf_done(chr, s->max_size, bytes_read);
     }
 
     return TRUE;
@@ -873,7 +935,7 @@ static void fd_chr_update_read_handler(CharDriverState *chr)
     remove_fd_in_watch(chr);
     if (s->fd_in) {
         chr->fd_in_tag = io_add_watch_poll(s->fd_in, fd_chr_read_poll,
-                                           fd_chr_read, chr);
+                                           fd_chr_read, chr, chr->context);
     }
 }
 
@@ -908,6 +970,7 @@ static CharDriverState *qemu_chr_open_fd(int fd_in, int fd_out)
     chr->opaque = s;
     chr->chr_add_watch = fd_chr_add_watch;
     chr->chr_write = fd_chr_write;
+    chr->chr_writev = fd_chr_writev;
     chr->chr_update_read_handler = fd_chr_update_read_handler;
     chr->chr_close = fd_chr_close;
 
@@ -1080,16 +1143,16 @@ static gboolean pty_chr_read(GIOChannel *chan, GIOCondition cond, void *opaque)
 {
     CharDriverState *chr = opaque;
     PtyCharDriver *s = chr->opaque;
-    gsize size, len;
-    uint8_t buf[READ_BUF_LEN];
+    gsize size;
+    int len;
+    uint8_t *buf;
     GIOStatus status;
 
-    len = sizeof(buf);
-    if (len > s->read_bytes)
-        len = s->read_bytes;
+    len = s->read_bytes;
     if (len == 0) {
         return TRUE;
     }
+    buf = qemu_chr_get_read_buf(chr, &len);
     status = g_io_channel_read_chars(s->fd, (gchar *)buf, len, &size, NULL);
     if (status != G_IO_STATUS_NORMAL) {
         pty_chr_state(chr, 0);
@@ -1097,6 +1160,7 @@ static gboolean pty_chr_read(GIOChannel *chan, GIOCondition cond, void *opaque)
     } else {
         pty_chr_state(chr, 1);
         qemu_chr_be_write(chr, buf, size);
+        qemu_chr_read_buf_done(chr, s->read_bytes, size);
     }
     return TRUE;
 }
@@ -1136,8 +1200,10 @@ static void pty_chr_state(CharDriverState *chr, int connected)
         if (!s->connected) {
             s->connected = 1;
             qemu_chr_be_generic_open(chr);
+        }
+        if (!chr->fd_in_tag) {
             chr->fd_in_tag = io_add_watch_poll(s->fd, pty_chr_read_poll,
-                                               pty_chr_read, chr);
+                                               pty_chr_read, chr, chr->context);
         }
     }
 }
@@ -2231,7 +2297,7 @@ static void udp_chr_update_read_handler(CharDriverState *chr)
     remove_fd_in_watch(chr);
     if (s->chan) {
         chr->fd_in_tag = io_add_watch_poll(s->chan, udp_chr_read_poll,
-                                           udp_chr_read, chr);
+                                           udp_chr_read, chr, chr->context);
     }
 }
 
@@ -2312,6 +2378,19 @@ static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     }
 }
 
+#ifndef _WIN32
+static int tcp_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                          int iovcnt)
+{
+    TCPCharDriver *s = chr->opaque;
+    if (s->connected) {
+        return iov_writev(s->fd, iov, iovcnt);
+    } else {
+        return iov_size(iov, iovcnt);
+    }
+}
+#endif
+
 static int tcp_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -2458,33 +2537,37 @@ static gboolean tcp_chr_read(GIOChannel *chan, GIOCondition cond, void *opaque)
 {
     CharDriverState *chr = opaque;
     TCPCharDriver *s = chr->opaque;
-    uint8_t buf[READ_BUF_LEN];
+    uint8_t *buf;
     int len, size;
 
     if (!s->connected || s->max_size <= 0) {
         return TRUE;
     }
-    len = sizeof(buf);
-    if (len > s->max_size)
-        len = s->max_size;
+    len = s->max_size;
+    buf = qemu_chr_get_read_buf(chr, &len);
     size = tcp_chr_recv(chr, (void *)buf, len);
     if (size == 0) {
         /* connection closed */
         s->connected = 0;
-        if (s->listen_chan) {
-            s->listen_tag = g_io_add_watch(s->listen_chan, G_IO_IN, tcp_chr_accept, chr);
-        }
         remove_fd_in_watch(chr);
         g_io_channel_unref(s->chan);
         s->chan = NULL;
         closesocket(s->fd);
         s->fd = -1;
+        /* The old socket must be gone before the main loop, which may be
+         * another thread, can accept a new connection.
+         */
+        if (s->listen_chan) {
+            s->listen_tag = g_io_add_watch(s->listen_chan, G_IO_IN, tcp_chr_accept, chr);
+        }
         qemu_chr_be_event(chr, CHR_EVENT_CLOSED);
     } else if (size > 0) {
+        len = size;
         if (s->do_telnetopt)
             tcp_chr_process_IAC_bytes(chr, s, buf, &size);
         if (size > 0)
             qemu_chr_be_write(chr, buf, size);
+        qemu_chr_read_buf_done(chr, s->max_size, len);
     }
 
     return TRUE;
@@ -2505,11 +2588,22 @@ static void tcp_chr_connect(void *opaque)
     s->connected = 1;
     if (s->chan) {
         chr->fd_in_tag = io_add_watch_poll(s->chan, tcp_chr_read_poll,
-                                           tcp_chr_read, chr);
+                                           tcp_chr_read, chr, chr->context);
     }
     qemu_chr_be_generic_open(chr);
 }
 
+static void tcp_chr_update_read_handler(CharDriverState *chr)
+{
+    TCPCharDriver *s = chr->opaque;
+
+    remove_fd_in_watch(chr);
+    if (s->connected && s->chan) {
+        chr->fd_in_tag = io_add_watch_poll(s->chan, tcp_chr_read_poll,
+                                           tcp_chr_read, chr, chr->context);
+    }
+}
+
 #define IACSET(x,a,b,c) x[0] = a; x[1] = b; x[2] = c;
 static void tcp_chr_telnet_init(int fd)
 {
@@ -2661,10 +2755,14 @@ static CharDriverState *qemu_chr_open_socket_fd(int fd, bool do_nodelay,
 
     chr->opaque = s;
     chr->chr_write = tcp_chr_write;
+#ifndef _WIN32
+    chr->chr_writev = tcp_chr_writev;
+#endif
     chr->chr_close = tcp_chr_close;
     chr->get_msgfd = tcp_get_msgfd;
     chr->chr_add_client = tcp_chr_add_client;
     chr->chr_add_watch = tcp_chr_add_watch;
+    chr->chr_update_read_handler = tcp_chr_update_read_handler;
     /* be isn't opened until we get a connection */
     chr->explicit_be_open = true;
 
@@ -3372,12 +3470,24 @@ int qemu_chr_fe_add_watch(CharDriverState *s, GIOCondition cond,
 
     src = s->chr_add_watch(s, cond);
     g_source_set_callback(src, (GSourceFunc)func, user_data, NULL);
-    tag = g_source_attach(src, NULL);
+    tag = g_source_attach(src, s->context);
     g_source_unref(src);
 
     return tag;
 }
 
+int qemu_chr_fe_set_context(CharDriverState *s, GMainContext *context)
+{
+    if (s->is_mux || !s->chr_update_read_handler) {
+        return -ENOTSUP;
+    }
+
+    remove_fd_in_watch(s);
+    s->context = context;
+    s->chr_update_read_handler(s);
+    return 0;
+}
+
 int qemu_chr_fe_claim(CharDriverState *s)
 {
     if (s->avail_connections < 1) {
@@ -3409,6 +3519,7 @@ void qemu_chr_delete(CharDriverState *chr)
     }
     g_free(chr->filename);
     g_free(chr->label);
+    g_free(chr->read_buf);
     if (chr->opts) {
         qemu_opts_del(chr->opts);
     }
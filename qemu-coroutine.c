@@ -15,31 +15,95 @@
 #include "trace.h"
 #include "qemu-common.h"
 #include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/notify.h"
 #include "block/coroutine.h"
 #include "block/coroutine_int.h"
 
 enum {
-    /* Maximum free pool size prevents holding too many freed coroutines */
-    POOL_MAX_SIZE = 64,
+    /* Each thread keeps at least this many freed coroutines around... */
+    POOL_MIN_SIZE = 64,
+    /* ...and up to as many as it had running at once, within this limit */
+    POOL_MAX_SIZE = 4096,
+    /* Size of the overflow pool shared by all threads */
+    POOL_SHARED_SIZE = 256,
 };
 
-/** Free list to speed up creation */
-static QemuMutex pool_lock;
-static QSLIST_HEAD(, Coroutine) pool = QSLIST_HEAD_INITIALIZER(pool);
-static unsigned int pool_size;
+/*
+ * Free lists to speed up creation.  Every thread allocates from and
+ * releases to its own list without any synchronization.  When that is
+ * full, coroutines go to the shared pool, which is pushed to with cmpxchg
+ * and emptied in one go by a thread whose own list has run dry.
+ */
+static QSLIST_HEAD(, Coroutine) release_pool = QSLIST_HEAD_INITIALIZER(pool);
+static int release_pool_size;
+
+static __thread QSLIST_HEAD(, Coroutine) alloc_pool =
+    QSLIST_HEAD_INITIALIZER(pool);
+static __thread unsigned int alloc_pool_size;
+static __thread unsigned int alloc_pool_max = POOL_MIN_SIZE;
+static __thread int alloc_in_use;
+static __thread Notifier coroutine_pool_cleanup_notifier;
+
+static void coroutine_pool_cleanup(Notifier *n, void *value)
+{
+    Coroutine *co;
+    Coroutine *tmp;
+
+    QSLIST_FOREACH_SAFE(co, &alloc_pool, pool_next, tmp) {
+        QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
+        qemu_coroutine_delete(co);
+    }
+    alloc_pool_size = 0;
+}
+
+static void release_pool_push(Coroutine *co)
+{
+    Coroutine *old;
+
+    do {
+        old = atomic_read(&release_pool.slh_first);
+        co->pool_next.sle_next = old;
+    } while (atomic_cmpxchg(&release_pool.slh_first, old, co) != old);
+    atomic_inc(&release_pool_size);
+}
+
+/* Move the whole shared pool to this thread's (empty) free list */
+static void release_pool_take(void)
+{
+    Coroutine *co;
+    int n = 0;
+
+    co = atomic_xchg(&release_pool.slh_first, NULL);
+    alloc_pool.slh_first = co;
+    for (; co; co = QSLIST_NEXT(co, pool_next)) {
+        n++;
+    }
+    alloc_pool_size = n;
+    atomic_sub(&release_pool_size, n);
+}
 
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
 {
     Coroutine *co = NULL;
 
     if (CONFIG_COROUTINE_POOL) {
-        qemu_mutex_lock(&pool_lock);
-        co = QSLIST_FIRST(&pool);
+        if (QSLIST_EMPTY(&alloc_pool) && atomic_read(&release_pool_size) > 0) {
+            release_pool_take();
+        }
+        co = QSLIST_FIRST(&alloc_pool);
         if (co) {
-            QSLIST_REMOVE_HEAD(&pool, pool_next);
-            pool_size--;
+            QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
+            alloc_pool_size--;
+        } else if (!coroutine_pool_cleanup_notifier.notify) {
+            coroutine_pool_cleanup_notifier.notify = coroutine_pool_cleanup;
+            qemu_thread_atexit_add(&coroutine_pool_cleanup_notifier);
+        }
+
+        /* Grow the list with the number of requests this thread runs */
+        if (++alloc_in_use > alloc_pool_max && alloc_pool_max < POOL_MAX_SIZE) {
+            alloc_pool_max = MIN(alloc_in_use, POOL_MAX_SIZE);
         }
-        qemu_mutex_unlock(&pool_lock);
     }
 
     if (!co) {
@@ -53,37 +117,39 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
 
 static void coroutine_delete(Coroutine *co)
 {
+    co->caller = NULL;
+
     if (CONFIG_COROUTINE_POOL) {
-        qemu_mutex_lock(&pool_lock);
-        if (pool_size < POOL_MAX_SIZE) {
-            QSLIST_INSERT_HEAD(&pool, co, pool_next);
-            co->caller = NULL;
-            pool_size++;
-            qemu_mutex_unlock(&pool_lock);
+        /* Coroutines may terminate in another thread than they started */
+        if (alloc_in_use > 0) {
+            alloc_in_use--;
+        }
+        if (alloc_pool_size < alloc_pool_max) {
+            QSLIST_INSERT_HEAD(&alloc_pool, co, pool_next);
+            alloc_pool_size++;
+            return;
+        }
+        if (atomic_read(&release_pool_size) < POOL_SHARED_SIZE) {
+            release_pool_push(co);
             return;
         }
-        qemu_mutex_unlock(&pool_lock);
     }
 
     qemu_coroutine_delete(co);
 }
 
-static void __attribute__((constructor)) coroutine_pool_init(void)
-{
-    qemu_mutex_init(&pool_lock);
-}
-
-static void __attribute__((destructor)) coroutine_pool_cleanup(void)
+static void __attribute__((destructor)) coroutine_release_pool_cleanup(void)
 {
     Coroutine *co;
     Coroutine *tmp;
 
-    QSLIST_FOREACH_SAFE(co, &pool, pool_next, tmp) {
-        QSLIST_REMOVE_HEAD(&pool, pool_next);
+    /* The main thread does not run its exit notifiers */
+    coroutine_pool_cleanup(NULL, NULL);
+
+    QSLIST_FOREACH_SAFE(co, &release_pool, pool_next, tmp) {
+        QSLIST_REMOVE_HEAD(&release_pool, pool_next);
         qemu_coroutine_delete(co);
     }
-
-    qemu_mutex_destroy(&pool_lock);
 }
 
 static void coroutine_swap(Coroutine *from, Coroutine *to)
@@ -31,6 +31,7 @@
 #include "sysemu/sysemu.h"
 #include "block/block_int.h"
 #include "block/qapi.h"
+#include "qemu/aes.h"
 #include <getopt.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -113,6 +114,9 @@ static void help(void)
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
+           "  '-m' number of parallel coroutines for convert (1 to 16, default 8)\n"
+           "  '-W' allow convert to write out of order to the destination\n"
+           "  '-C' size of each request issued by convert (default 2M)\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -130,7 +134,19 @@ static void help(void)
            "Parameters to compare subcommand:\n"
            "  '-f' first image format\n"
            "  '-F' second image format\n"
-           "  '-s' run in Strict mode - fail on different image size or sector allocation\n";
+           "  '-s' run in Strict mode - fail on different image size or sector allocation\n"
+           "\n"
+           "Parameters to bench subcommand:\n"
+           "  '-c' number of requests to send (default 75000)\n"
+           "  '-D' run for the given number of seconds instead of a request count\n"
+           "  '-d' number of requests in flight (default 64)\n"
+           "  '-n' use native AIO\n"
+           "  '-o' offset of the first request in bytes\n"
+           "  '-P' byte pattern written with '-w'\n"
+           "  '-r' issue requests at random offsets\n"
+           "  '-s' size of each request in bytes (default 4k)\n"
+           "  '-S' distance between sequential requests (default: request size)\n"
+           "  '-w' send writes instead of reads\n";
 
     printf("%s\nSupported formats:", help_msg);
     bdrv_iterate_format(format_print, NULL);
@@ -544,7 +560,7 @@ static int img_check(int argc, char **argv)
     int fix = 0;
     int flags = BDRV_O_FLAGS | BDRV_O_CHECK;
     ImageCheck *check;
-    bool quiet = false;
+    bool quiet = false, progress = false;
 
     fmt = NULL;
     output = NULL;
@@ -557,7 +573,7 @@ static int img_check(int argc, char **argv)
             {"output", required_argument, 0, OPTION_OUTPUT},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, "f:hr:q",
+        c = getopt_long(argc, argv, "f:hr:qp",
                         long_options, &option_index);
         if (c == -1) {
             break;
@@ -587,6 +603,9 @@ static int img_check(int argc, char **argv)
         case 'q':
             quiet = true;
             break;
+        case 'p':
+            progress = true;
+            break;
         }
     }
     if (optind != argc - 1) {
@@ -608,8 +627,16 @@ static int img_check(int argc, char **argv)
         return 1;
     }
 
+    /* The progress line would corrupt the JSON output */
+    if (quiet || output_format != OFORMAT_HUMAN) {
+        progress = false;
+    }
+    qemu_progress_init(progress, 1.0);
+    qemu_progress_print(0, 100);
+
     check = g_new0(ImageCheck, 1);
     ret = collect_image_check(bs, check, filename, fmt, fix);
+    qemu_progress_end();
 
     if (ret == -ENOTSUP) {
         if (output_format == OFORMAT_HUMAN) {
@@ -1127,19 +1154,463 @@ out3:
     return ret;
 }
 
+enum ImgConvertBlockStatus {
+    BLK_DATA,
+    BLK_ZERO,
+    BLK_BACKING_FILE,
+};
+
+#define MAX_COROUTINES 16
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_cur, src_num;
+    int64_t src_cur_offset;
+    int64_t total_sectors;
+    int64_t allocated_sectors;
+    int64_t allocated_done;
+    int64_t sector_num;
+    int64_t wr_offs;
+    enum ImgConvertBlockStatus status;
+    int64_t sector_next_status;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool target_has_backing;
+    bool check_status;
+    bool count_allocated;
+    int min_sparse;
+    int cluster_sectors;
+    size_t buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
+    bool wr_in_order;
+    bool compressed;
+    QEMUBH *wake_bh;
+} ImgConvertState;
+
+static void convert_select_part(ImgConvertState *s, int64_t sector_num)
+{
+    assert(sector_num >= s->src_cur_offset);
+    while (sector_num - s->src_cur_offset >= s->src_sectors[s->src_cur]) {
+        s->src_cur_offset += s->src_sectors[s->src_cur];
+        s->src_cur++;
+        assert(s->src_cur < s->src_num);
+    }
+}
+
+/*
+ * Find out how many sectors starting at @sector_num can be handled in
+ * one go, and how (s->status).  Returns the number of sectors or a
+ * negative errno value.
+ */
+static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
+{
+    int64_t ret, src_left;
+    int n, n1;
+
+    if (s->compressed) {
+        /* One cluster at a time, even across the end of a source image */
+        s->status = BLK_DATA;
+        return MIN(s->total_sectors - sector_num, s->cluster_sectors);
+    }
+
+    convert_select_part(s, sector_num);
+
+    assert(s->total_sectors > sector_num);
+    src_left = s->src_sectors[s->src_cur] - (sector_num - s->src_cur_offset);
+    n = MIN(src_left, INT_MAX);
+
+    if (!s->check_status) {
+        s->status = BLK_DATA;
+    } else if (s->sector_next_status <= sector_num) {
+        ret = bdrv_get_block_status(s->src[s->src_cur],
+                                    sector_num - s->src_cur_offset, n, &n1);
+        if (ret < 0) {
+            return ret;
+        }
+
+        /* If the output image is zero initialized, we are not working
+         * on a shared base and the input is zero we can skip the next
+         * n1 sectors.
+         *
+         * If the output image is being created as a copy on write
+         * image, assume that sectors which are unallocated in the
+         * input image are present in both the output's and input's
+         * base images (no need to copy them). */
+        if (s->has_zero_init && !s->target_has_backing &&
+            (ret & BDRV_BLOCK_ZERO)) {
+            s->status = BLK_ZERO;
+        } else if (s->target_has_backing && !(ret & BDRV_BLOCK_DATA)) {
+            s->status = BLK_BACKING_FILE;
+        } else {
+            s->status = BLK_DATA;
+        }
+        /* avoid redundant callouts to get_block_status */
+        s->sector_next_status = sector_num + n1;
+    }
+
+    if (s->check_status) {
+        n = MIN(n, s->sector_next_status - sector_num);
+    }
+    if (s->status != BLK_DATA) {
+        return n;
+    }
+
+    n = MIN(n, s->buf_sectors);
+
+    /* round down request length to an aligned sector, but
+     * do not bother doing this on short requests. They happen
+     * when we found an all-zero area, and the next sector to
+     * write will not be sector_num + n. */
+    if (s->cluster_sectors > 0 && n >= s->cluster_sectors) {
+        int64_t next_aligned_sector = (sector_num + n);
+        next_aligned_sector -= next_aligned_sector % s->cluster_sectors;
+        if (sector_num + n > next_aligned_sector) {
+            n = next_aligned_sector - sector_num;
+        }
+    }
+
+    return n;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s, int src_cur,
+                                        int64_t src_offset, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    return bdrv_co_readv(s->src[src_cur], sector_num - src_offset,
+                         nb_sectors, &qiov);
+}
+
+/* Like convert_co_read, but the range may span several source images */
+static int coroutine_fn convert_co_read_multi(ImgConvertState *s,
+                                              int64_t sector_num,
+                                              int nb_sectors, uint8_t *buf)
+{
+    int64_t src_offset = 0;
+    int src_cur = 0;
+    int n, ret;
+
+    while (nb_sectors > 0) {
+        while (sector_num - src_offset >= s->src_sectors[src_cur]) {
+            src_offset += s->src_sectors[src_cur];
+            src_cur++;
+            assert(src_cur < s->src_num);
+        }
+        n = MIN(nb_sectors,
+                s->src_sectors[src_cur] - (sector_num - src_offset));
+        ret = convert_co_read(s, src_cur, src_offset, sector_num, n, buf);
+        if (ret < 0) {
+            return ret;
+        }
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn convert_co_write_compressed(ImgConvertState *s,
+                                                    int64_t sector_num,
+                                                    int nb_sectors,
+                                                    uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+
+    if (buffer_is_zero(buf, nb_sectors * BDRV_SECTOR_SIZE)) {
+        return 0;
+    }
+
+    iov.iov_base = buf;
+    iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    return bdrv_co_write_compressed(s->target, sector_num, nb_sectors, &qiov);
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, int nb_sectors,
+                                         uint8_t *buf)
+{
+    while (nb_sectors > 0) {
+        int n = nb_sectors;
+
+        /* NOTE: at the same time we convert, we do not write zero
+           sectors to have a chance to compress the image. Ideally, we
+           should add a specific call to have the info to go faster */
+        if (!s->has_zero_init ||
+            is_allocated_sectors_min(buf, nb_sectors, &n, s->min_sparse)) {
+            QEMUIOVector qiov;
+            struct iovec iov;
+            int ret;
+
+            iov.iov_base = buf;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+
+            ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+/* Wake up the coroutine waiting to write at s->wr_offs, or every waiting
+ * coroutine if the conversion failed.
+ */
+static void convert_wake_writers(ImgConvertState *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] >= 0 &&
+            (s->ret != -EINPROGRESS ||
+             s->wait_sector_num[i] == s->wr_offs)) {
+            qemu_coroutine_enter(s->co[i], NULL);
+            if (s->ret == -EINPROGRESS) {
+                break;
+            }
+        }
+    }
+}
+
+static void convert_wake_bh(void *opaque)
+{
+    convert_wake_writers(opaque);
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf = NULL;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (s->ret == -EINPROGRESS) {
+        int64_t sector_num, src_offset;
+        enum ImgConvertBlockStatus status;
+        int n, src_cur;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", s->sector_num - s->src_cur_offset,
+                         strerror(-n));
+            s->ret = n;
+            break;
+        }
+        /* save current sector and allocation status to local variables */
+        sector_num = s->sector_num;
+        status = s->status;
+        src_cur = s->src_cur;
+        src_offset = s->src_cur_offset;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA && s->compressed) {
+            ret = convert_co_read_multi(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64 ": %s",
+                             sector_num, strerror(-ret));
+                s->ret = ret;
+                break;
+            }
+        } else if (status == BLK_DATA) {
+            ret = convert_co_read(s, src_cur, src_offset, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64 ": %s",
+                             sector_num - src_offset, strerror(-ret));
+                s->ret = ret;
+                break;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* keep writes in order */
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+            if (s->ret != -EINPROGRESS) {
+                break;
+            }
+        }
+
+        if (status == BLK_DATA && s->compressed) {
+            /* The target fixes the place of the cluster in the image
+             * before it yields, so the next cluster can be submitted
+             * while this one is compressed.  The bottom half lets it go
+             * once we have yielded.
+             */
+            s->wr_offs = sector_num + n;
+            qemu_bh_schedule(s->wake_bh);
+            ret = convert_co_write_compressed(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while compressing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+                break;
+            }
+
+            s->allocated_done += n;
+            qemu_progress_add_bytes((uint64_t)n * BDRV_SECTOR_SIZE);
+            qemu_progress_print(100.0 * s->allocated_done /
+                                s->allocated_sectors, 0);
+            continue;
+        } else if (status == BLK_DATA) {
+            ret = convert_co_write(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64 ": %s",
+                             sector_num, strerror(-ret));
+                s->ret = ret;
+                break;
+            }
+
+            s->allocated_done += n;
+            qemu_progress_add_bytes((uint64_t)n * BDRV_SECTOR_SIZE);
+            qemu_progress_print(100.0 * s->allocated_done /
+                                s->allocated_sectors, 0);
+        }
+
+        if (s->wr_in_order) {
+            s->wr_offs = sector_num + n;
+            convert_wake_writers(s);
+        }
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (s->ret != -EINPROGRESS) {
+        convert_wake_writers(s);
+    } else if (!s->running_coroutines) {
+        /* the last one to finish reports success */
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int ret, i, n;
+    int64_t sector_num = 0;
+
+    s->check_status = !s->compressed &&
+                      (s->has_zero_init || s->target_has_backing);
+
+    /* Count the sectors that will actually be copied, for progress */
+    if (s->check_status && s->count_allocated) {
+        s->allocated_sectors = 0;
+        while (sector_num < s->total_sectors) {
+            n = convert_iteration_sectors(s, sector_num);
+            if (n < 0) {
+                error_report("error while reading block status of sector %"
+                             PRId64 ": %s", sector_num - s->src_cur_offset,
+                             strerror(-n));
+                return n;
+            }
+            if (s->status == BLK_DATA) {
+                s->allocated_sectors += n;
+            }
+            sector_num += n;
+        }
+    } else {
+        s->allocated_sectors = s->total_sectors;
+    }
+
+    /* Re-set the cursors for the actual conversion */
+    s->src_cur = 0;
+    s->src_cur_offset = 0;
+    s->sector_next_status = 0;
+    s->sector_num = 0;
+    s->wr_offs = 0;
+    s->allocated_done = 0;
+
+    qemu_co_mutex_init(&s->lock);
+    if (s->compressed) {
+        s->wake_bh = aio_bh_new(bdrv_get_aio_context(s->target),
+                                convert_wake_bh, s);
+    }
+    s->ret = -EINPROGRESS;
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+    }
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i]) {
+            qemu_coroutine_enter(s->co[i], s);
+        }
+    }
+
+    while (s->running_coroutines) {
+        main_loop_wait(false);
+    }
+    if (s->wake_bh) {
+        qemu_bh_delete(s->wake_bh);
+    }
+
+    ret = s->ret;
+    assert(ret != -EINPROGRESS);
+    if (ret == 0 && s->compressed) {
+        /* signal EOF to align */
+        ret = bdrv_write_compressed(s->target, 0, NULL, 0);
+        if (ret < 0) {
+            error_report("error while compressing: %s", strerror(-ret));
+        }
+    }
+    return ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, n, n1, bs_n, bs_i, compress, cluster_sectors, skip_create;
+    int c, bs_n, bs_i, compress, cluster_sectors, skip_create;
     int64_t ret = 0;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
+    int64_t total_sectors;
+    int64_t *src_sectors = NULL;
+    int has_zero_init;
     uint64_t bs_sectors;
-    uint8_t * buf = NULL;
     size_t bufsectors = IO_BUF_SIZE / BDRV_SECTOR_SIZE;
-    const uint8_t *buf1;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
@@ -1149,6 +1620,10 @@ static int img_convert(int argc, char **argv)
     bool quiet = false;
     Error *local_err = NULL;
     QemuOpts *sn_opts = NULL;
+    ImgConvertState state;
+    int num_coroutines = 8;
+    bool wr_in_order = true;
+    int64_t buf_size = 0;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1157,7 +1632,7 @@ static int img_convert(int argc, char **argv)
     compress = 0;
     skip_create = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:qnl:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:qnl:m:WC:");
         if (c == -1) {
             break;
         }
@@ -1229,6 +1704,36 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+        {
+            char *end;
+            errno = 0;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (errno || *end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
+        case 'C':
+        {
+            char *end;
+            buf_size = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (buf_size < BDRV_SECTOR_SIZE || *end ||
+                buf_size % BDRV_SECTOR_SIZE ||
+                buf_size > 32768 * BDRV_SECTOR_SIZE) {
+                error_report("Invalid buffer size, it must be a multiple of "
+                             "512 bytes and at most 16M");
+                return 1;
+            }
+            break;
+        }
         }
     }
 
@@ -1258,6 +1763,12 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
+    if (compress && !wr_in_order) {
+        error_report("Out of order write and compress are mutually exclusive");
+        ret = -1;
+        goto out;
+    }
+
     qemu_progress_print(0, 100);
 
     bs = g_malloc0(bs_n * sizeof(BlockDriverState *));
@@ -1347,7 +1858,7 @@ static int img_convert(int argc, char **argv)
         QEMUOptionParameter *preallocation =
             get_option_parameter(param, BLOCK_OPT_PREALLOC);
 
-        if (!drv->bdrv_write_compressed) {
+        if (!drv->bdrv_write_compressed && !drv->bdrv_co_write_compressed) {
             error_report("Compression not supported for this file format");
             ret = -1;
             goto out;
@@ -1394,19 +1905,17 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-
     /* increase bufsectors from the default 4096 (2M) if opt_transfer_length
      * or discard_alignment of the out_bs is greater. Limit to 32768 (16MB)
-     * as maximum. */
-    bufsectors = MIN(32768,
-                     MAX(bufsectors, MAX(out_bs->bl.opt_transfer_length,
-                                         out_bs->bl.discard_alignment))
-                    );
-
-    buf = qemu_blockalign(out_bs, bufsectors * BDRV_SECTOR_SIZE);
+     * as maximum.  An explicit -C overrides this. */
+    if (buf_size) {
+        bufsectors = buf_size / BDRV_SECTOR_SIZE;
+    } else {
+        bufsectors = MIN(32768,
+                         MAX(bufsectors, MAX(out_bs->bl.opt_transfer_length,
+                                             out_bs->bl.discard_alignment))
+                        );
+    }
 
     if (skip_create) {
         int64_t output_length = bdrv_getlength(out_bs);
@@ -1439,198 +1948,41 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        sector_num = 0;
-
-        nb_sectors = total_sectors;
-
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
-
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading sector %" PRId64 ": %s",
-                                 bs_num, strerror(-ret));
-                    goto out;
-                }
-
-                buf2 += nlow * 512;
-                bs_num += nlow;
-
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
-
-            if (!buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf, n);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
-                    goto out;
-                }
-            }
-            sector_num += n;
-            qemu_progress_print(100.0 * sector_num / total_sectors, 0);
-        }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int64_t sectors_to_read, sectors_read, sector_num_next_status;
-        bool count_allocated_sectors;
-        int has_zero_init = min_sparse ? bdrv_has_zero_init(out_bs) : 0;
-
-        if (!has_zero_init && bdrv_can_write_zeroes_with_unmap(out_bs)) {
-            ret = bdrv_make_zero(out_bs, BDRV_REQ_MAY_UNMAP);
-            if (ret < 0) {
-                goto out;
-            }
-            has_zero_init = 1;
-        }
-
-        sectors_to_read = total_sectors;
-        count_allocated_sectors = progress && (out_baseimg || has_zero_init);
-restart:
-        sector_num = 0; // total number of sectors converted so far
-        sectors_read = 0;
-        sector_num_next_status = 0;
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                if (count_allocated_sectors) {
-                    sectors_to_read = sectors_read;
-                    count_allocated_sectors = false;
-                    goto restart;
-                }
-                ret = 0;
-                break;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if ((out_baseimg || has_zero_init) &&
-                sector_num >= sector_num_next_status) {
-                n = nb_sectors > INT_MAX ? INT_MAX : nb_sectors;
-                ret = bdrv_get_block_status(bs[bs_i], sector_num - bs_offset,
-                                            n, &n1);
-                if (ret < 0) {
-                    error_report("error while reading block status of sector %"
-                                 PRId64 ": %s", sector_num - bs_offset,
-                                 strerror(-ret));
-                    goto out;
-                }
-                /* If the output image is zero initialized, we are not working
-                 * on a shared base and the input is zero we can skip the next
-                 * n1 sectors */
-                if (has_zero_init && !out_baseimg && (ret & BDRV_BLOCK_ZERO)) {
-                    sector_num += n1;
-                    continue;
-                }
-                /* If the output image is being created as a copy on write
-                 * image, assume that sectors which are unallocated in the
-                 * input image are present in both the output's and input's
-                 * base images (no need to copy them). */
-                if (out_baseimg) {
-                    if (!(ret & BDRV_BLOCK_DATA)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image.
-                     * Copy only those as they may be followed by unallocated
-                     * sectors. */
-                    nb_sectors = n1;
-                }
-                /* avoid redundant callouts to get_block_status */
-                sector_num_next_status = sector_num + n1;
-            }
-
-            n = MIN(nb_sectors, bufsectors);
-
-            /* round down request length to an aligned sector, but
-             * do not bother doing this on short requests. They happen
-             * when we found an all-zero area, and the next sector to
-             * write will not be sector_num + n. */
-            if (cluster_sectors > 0 && n >= cluster_sectors) {
-                int64_t next_aligned_sector = (sector_num + n);
-                next_aligned_sector -= next_aligned_sector % cluster_sectors;
-                if (sector_num + n > next_aligned_sector) {
-                    n = next_aligned_sector - sector_num;
-                }
-            }
-
-            n = MIN(n, bs_sectors - (sector_num - bs_offset));
-
-            sectors_read += n;
-            if (count_allocated_sectors) {
-                sector_num += n;
-                continue;
-            }
+    }
 
-            n1 = n;
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                if (!has_zero_init ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(100.0 * sectors_read / sectors_to_read, 0);
+    has_zero_init = min_sparse ? bdrv_has_zero_init(out_bs) : 0;
+    if (!compress && !has_zero_init &&
+        bdrv_can_write_zeroes_with_unmap(out_bs)) {
+        ret = bdrv_make_zero(out_bs, BDRV_REQ_MAY_UNMAP);
+        if (ret < 0) {
+            goto out;
         }
+        has_zero_init = 1;
     }
+
+    src_sectors = g_new(int64_t, bs_n);
+    for (bs_i = 0; bs_i < bs_n; bs_i++) {
+        bdrv_get_geometry(bs[bs_i], &bs_sectors);
+        src_sectors[bs_i] = bs_sectors;
+    }
+
+    state = (ImgConvertState) {
+        .src                = bs,
+        .src_sectors        = src_sectors,
+        .src_num            = bs_n,
+        .total_sectors      = total_sectors,
+        .target             = out_bs,
+        .has_zero_init      = has_zero_init,
+        .target_has_backing = !!out_baseimg,
+        .count_allocated    = progress,
+        .min_sparse         = min_sparse,
+        .cluster_sectors    = cluster_sectors,
+        .buf_sectors        = bufsectors,
+        .num_coroutines     = num_coroutines,
+        .wr_in_order        = wr_in_order,
+        .compressed         = compress,
+    };
+    ret = convert_do_copy(&state);
 out:
     if (!ret) {
         qemu_progress_print(100, 0);
@@ -1638,7 +1990,7 @@ out:
     qemu_progress_end();
     free_option_parameters(create_options);
     free_option_parameters(param);
-    qemu_vfree(buf);
+    g_free(src_sectors);
     if (sn_opts) {
         qemu_opts_del(sn_opts);
     }
@@ -2700,6 +3052,402 @@ out:
     return 0;
 }
 
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t start_ns;
+} BenchRequest;
+
+struct BenchData {
+    BlockDriverState *bs;
+    int64_t image_size;
+    bool write;
+    bool random;
+    int bufsize;
+    int64_t step;
+    int64_t count;      /* requests to submit, 0 if limited by time */
+    int64_t deadline_ns;
+    int64_t start;      /* first offset, where sequential runs wrap to */
+    int64_t offset;
+    int64_t submitted;
+    int in_flight;
+    int ret;
+
+    /* completion latencies, in nanoseconds */
+    int64_t *latencies;
+    int64_t nr_latencies;
+    int64_t latencies_size;
+};
+
+static void bench_cb(void *opaque, int ret);
+
+static int64_t bench_next_offset(BenchData *b)
+{
+    int64_t offset;
+
+    if (b->random) {
+        uint64_t slots = (b->image_size - b->start) / b->bufsize;
+        uint64_t r = ((uint64_t)g_random_int() << 32) | g_random_int();
+
+        return b->start + (r % slots) * b->bufsize;
+    }
+
+    offset = b->offset;
+    b->offset += b->step;
+    if (b->offset + b->bufsize > b->image_size) {
+        b->offset = b->start;
+    }
+    return offset;
+}
+
+static bool bench_want_more(BenchData *b, int64_t now)
+{
+    if (b->ret < 0) {
+        return false;
+    }
+    if (b->count) {
+        return b->submitted < b->count;
+    }
+    return now < b->deadline_ns;
+}
+
+static void bench_submit(BenchRequest *req)
+{
+    BenchData *b = req->b;
+    BlockDriverAIOCB *acb;
+    int64_t offset = bench_next_offset(b);
+
+    b->in_flight++;
+    b->submitted++;
+    req->start_ns = get_clock();
+    if (b->write) {
+        acb = bdrv_aio_writev(b->bs, offset >> BDRV_SECTOR_BITS, &req->qiov,
+                              b->bufsize >> BDRV_SECTOR_BITS, bench_cb, req);
+    } else {
+        acb = bdrv_aio_readv(b->bs, offset >> BDRV_SECTOR_BITS, &req->qiov,
+                             b->bufsize >> BDRV_SECTOR_BITS, bench_cb, req);
+    }
+    if (!acb) {
+        error_report("Failed to issue request");
+        b->in_flight--;
+        b->ret = -EIO;
+    }
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+    int64_t now = get_clock();
+
+    b->in_flight--;
+    if (ret < 0) {
+        error_report("Failed request: %s", strerror(-ret));
+        b->ret = ret;
+        return;
+    }
+
+    if (b->nr_latencies == b->latencies_size) {
+        b->latencies_size = MAX(b->latencies_size * 2, 4096);
+        b->latencies = g_renew(int64_t, b->latencies, b->latencies_size);
+    }
+    b->latencies[b->nr_latencies++] = now - req->start_ns;
+
+    if (bench_want_more(b, now)) {
+        bench_submit(req);
+    }
+}
+
+static int bench_cmp_latency(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* nearest-rank percentile of the sorted latencies, in microseconds */
+static double bench_percentile(BenchData *b, double p)
+{
+    int64_t rank = (int64_t)(p / 100 * b->nr_latencies + 0.5);
+
+    rank = MIN(MAX(rank, 1), b->nr_latencies);
+    return b->latencies[rank - 1] / 1000.0;
+}
+
+static int img_bench(int argc, char **argv)
+{
+    int c, ret = 0, i;
+    const char *fmt = NULL, *filename;
+    const char *cache = BDRV_DEFAULT_CACHE;
+    bool quiet = false;
+    bool is_write = false;
+    bool is_random = false;
+    int64_t count = 0;
+    int64_t duration = 0;
+    int depth = 64;
+    int64_t offset = 0;
+    int64_t bufsize = 4096;
+    int64_t step = 0;
+    int pattern = 0;
+    int flags = 0;
+    BlockDriverState *bs = NULL;
+    BenchData data = {};
+    BenchRequest *reqs = NULL;
+    uint8_t *buf = NULL;
+    int64_t start_ns, elapsed_ns;
+    double seconds, total_us;
+
+    for (;;) {
+        c = getopt(argc, argv, "hc:d:D:f:no:P:qrs:S:t:w");
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+        case '?':
+            help();
+            break;
+        case 'c':
+        {
+            char *end;
+            errno = 0;
+            count = strtoll(optarg, &end, 0);
+            if (errno || *end || count <= 0) {
+                error_report("Invalid request count specified");
+                return 1;
+            }
+            break;
+        }
+        case 'd':
+        {
+            char *end;
+            errno = 0;
+            depth = strtol(optarg, &end, 0);
+            if (errno || *end || depth <= 0 || depth > 4096) {
+                error_report("Invalid queue depth specified");
+                return 1;
+            }
+            break;
+        }
+        case 'D':
+        {
+            char *end;
+            errno = 0;
+            duration = strtoll(optarg, &end, 0);
+            if (errno || *end || duration <= 0) {
+                error_report("Invalid duration specified");
+                return 1;
+            }
+            break;
+        }
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'n':
+            flags |= BDRV_O_NATIVE_AIO;
+            break;
+        case 'o':
+        {
+            char *end;
+            offset = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (offset < 0 || *end) {
+                error_report("Invalid offset specified");
+                return 1;
+            }
+            break;
+        }
+        case 'P':
+        {
+            char *end;
+            errno = 0;
+            pattern = strtol(optarg, &end, 0);
+            if (errno || *end || pattern < 0 || pattern > 0xff) {
+                error_report("Invalid pattern byte specified");
+                return 1;
+            }
+            break;
+        }
+        case 'q':
+            quiet = true;
+            break;
+        case 'r':
+            is_random = true;
+            break;
+        case 's':
+        {
+            char *end;
+            bufsize = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (bufsize <= 0 || *end || bufsize % BDRV_SECTOR_SIZE ||
+                bufsize > INT_MAX) {
+                error_report("Invalid buffer size specified");
+                return 1;
+            }
+            break;
+        }
+        case 'S':
+        {
+            char *end;
+            step = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (step < 0 || *end || step % BDRV_SECTOR_SIZE) {
+                error_report("Invalid step size specified");
+                return 1;
+            }
+            break;
+        }
+        case 't':
+            cache = optarg;
+            break;
+        case 'w':
+            is_write = true;
+            flags |= BDRV_O_RDWR;
+            break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        help();
+    }
+    filename = argv[argc - 1];
+
+    if (count && duration) {
+        error_report("-c and -D are mutually exclusive");
+        return 1;
+    }
+    if (!count && !duration) {
+        count = 75000;
+    }
+    if (offset % BDRV_SECTOR_SIZE) {
+        error_report("The offset must be a multiple of %d bytes",
+                     BDRV_SECTOR_SIZE);
+        return 1;
+    }
+    if (!step) {
+        step = bufsize;
+    }
+
+    ret = bdrv_parse_cache_flags(cache, &flags);
+    if (ret < 0) {
+        error_report("Invalid cache option: %s", cache);
+        return 1;
+    }
+
+    bs = bdrv_new_open(filename, fmt, flags, true, quiet);
+    if (!bs) {
+        error_report("Could not open image '%s'", filename);
+        ret = -1;
+        goto out;
+    }
+
+    data = (BenchData) {
+        .bs             = bs,
+        .image_size     = bdrv_getlength(bs),
+        .write          = is_write,
+        .random         = is_random,
+        .bufsize        = bufsize,
+        .step           = step,
+        .count          = count,
+        .start          = offset,
+        .offset         = offset,
+    };
+    if (data.image_size < 0) {
+        error_report("Could not get image size: %s",
+                     strerror(-data.image_size));
+        ret = -1;
+        goto out;
+    }
+    if (data.image_size < bufsize || offset > data.image_size - bufsize) {
+        error_report("The image is too small for the requested offset and "
+                     "buffer size");
+        ret = -1;
+        goto out;
+    }
+    if (bdrv_is_encrypted(bs)) {
+        qprintf(quiet, "The image is encrypted, using %s AES\n",
+                AES_accelerated() ? "AES-NI" : "portable");
+    }
+
+    buf = qemu_blockalign(bs, (size_t)depth * bufsize);
+    memset(buf, pattern, (size_t)depth * bufsize);
+    reqs = g_new0(BenchRequest, depth);
+    for (i = 0; i < depth; i++) {
+        reqs[i].b = &data;
+        reqs[i].iov.iov_base = buf + (size_t)i * bufsize;
+        reqs[i].iov.iov_len = bufsize;
+        qemu_iovec_init_external(&reqs[i].qiov, &reqs[i].iov, 1);
+    }
+
+    if (count) {
+        qprintf(quiet, "Sending %" PRId64 " %s requests, %" PRId64 " bytes "
+                "each, %d in parallel (%s, starting at offset %" PRId64
+                ", step size %" PRId64 ")\n", count,
+                is_write ? "write" : "read", bufsize, depth,
+                is_random ? "random" : "sequential", offset, step);
+    } else {
+        qprintf(quiet, "Sending %s requests for %" PRId64 " seconds, %"
+                PRId64 " bytes each, %d in parallel (%s, starting at offset %"
+                PRId64 ", step size %" PRId64 ")\n",
+                is_write ? "write" : "read", duration, bufsize, depth,
+                is_random ? "random" : "sequential", offset, step);
+    }
+
+    start_ns = get_clock();
+    data.deadline_ns = start_ns + duration * 1000000000LL;
+    for (i = 0; i < depth && bench_want_more(&data, start_ns); i++) {
+        bench_submit(&reqs[i]);
+    }
+    while (data.in_flight > 0) {
+        main_loop_wait(false);
+    }
+    elapsed_ns = get_clock() - start_ns;
+
+    if (data.ret < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    seconds = elapsed_ns / 1000000000.0;
+    total_us = 0;
+    for (i = 0; i < data.nr_latencies; i++) {
+        total_us += data.latencies[i] / 1000.0;
+    }
+    qsort(data.latencies, data.nr_latencies, sizeof(*data.latencies),
+          bench_cmp_latency);
+
+    qprintf(quiet, "Run completed in %3.3f seconds.\n", seconds);
+    if (data.nr_latencies && seconds > 0) {
+        qprintf(quiet, "Requests: %" PRId64 "  IOPS: %.1f  "
+                "Bandwidth: %.2f MiB/s\n", data.nr_latencies,
+                data.nr_latencies / seconds,
+                data.nr_latencies * (double)bufsize / seconds /
+                (1024 * 1024));
+        qprintf(quiet, "Latency (us): min %.1f  avg %.1f  p50 %.1f  "
+                "p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+                data.latencies[0] / 1000.0,
+                total_us / data.nr_latencies,
+                bench_percentile(&data, 50),
+                bench_percentile(&data, 90),
+                bench_percentile(&data, 99),
+                bench_percentile(&data, 99.9),
+                data.latencies[data.nr_latencies - 1] / 1000.0);
+    }
+
+out:
+    qemu_vfree(buf);
+    g_free(reqs);
+    g_free(data.latencies);
+    if (bs) {
+        bdrv_unref(bs);
+    }
+    if (ret) {
+        return 1;
+    }
+    return 0;
+}
+
 static const img_cmd_t img_cmds[] = {
 #define DEF(option, callback, arg_string)        \
     { option, callback },
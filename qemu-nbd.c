@@ -39,6 +39,7 @@
 #define QEMU_NBD_OPT_CACHE   1
 #define QEMU_NBD_OPT_AIO     2
 #define QEMU_NBD_OPT_DISCARD 3
+#define QEMU_NBD_OPT_MAX_REQUESTS 4
 
 static NBDExport *exp;
 static int verbose;
@@ -64,6 +65,9 @@ static void usage(const char *name)
 "  -k, --socket=PATH    path to the unix socket\n"
 "                       (default '"SOCKET_PATH"')\n"
 "  -e, --shared=NUM     device can be shared by NUM clients (default '1')\n"
+"      --max-requests=NUM\n"
+"                       serve up to NUM requests per client in parallel\n"
+"                       (default '16')\n"
 "  -t, --persistent     don't exit on the last connection\n"
 "  -v, --verbose        display extra debugging information\n"
 "\n"
@@ -234,7 +238,7 @@ static void *nbd_client_thread(void *arg)
     }
 
     ret = nbd_receive_negotiate(sock, NULL, &nbdflags,
-                                &size, &blocksize);
+                                &size, &blocksize, NULL);
     if (ret < 0) {
         goto out;
     }
@@ -347,6 +351,7 @@ int main(int argc, char **argv)
 #endif
         { "discard", 1, NULL, QEMU_NBD_OPT_DISCARD },
         { "shared", 1, NULL, 'e' },
+        { "max-requests", 1, NULL, QEMU_NBD_OPT_MAX_REQUESTS },
         { "format", 1, NULL, 'f' },
         { "persistent", 0, NULL, 't' },
         { "verbose", 0, NULL, 'v' },
@@ -358,6 +363,7 @@ int main(int argc, char **argv)
     char *end;
     int flags = BDRV_O_RDWR;
     int partition = -1;
+    int max_requests = -1;
     int ret;
     int fd;
     bool seen_cache = false;
@@ -418,6 +424,15 @@ int main(int argc, char **argv)
                 errx(EXIT_FAILURE, "Invalid discard mode `%s'", optarg);
             }
             break;
+        case QEMU_NBD_OPT_MAX_REQUESTS:
+            max_requests = strtol(optarg, &end, 0);
+            if (*end) {
+                errx(EXIT_FAILURE, "Invalid number of requests '%s'", optarg);
+            }
+            if (max_requests < 1) {
+                errx(EXIT_FAILURE, "Number of requests must be greater than 0");
+            }
+            break;
         case 'b':
             bindto = optarg;
             break;
@@ -631,6 +646,9 @@ int main(int argc, char **argv)
     }
 
     exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, nbd_export_closed);
+    if (max_requests != -1) {
+        nbd_export_set_max_requests(exp, max_requests);
+    }
 
     if (sockpath) {
         fd = unix_socket_incoming(sockpath);
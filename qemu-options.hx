@@ -35,7 +35,10 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off controls accelerated irqchip support\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
-    "                mem-merge=on|off controls memory merge support (default: on)\n",
+    "                mem-merge=on|off controls memory merge support (default: on)\n"
+    "                bounce-buffers=n number of DMA bounce buffers (default: 16)\n"
+    "                bounce-buffer-size=size size of each DMA bounce buffer\n"
+    "                xen-mapcache-size=size address space for mapping Xen guest memory\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -machine [type=]@var{name}[,prop=@var{value}[,...]]
@@ -58,6 +61,19 @@ Include guest memory in a core dump. The default is on.
 Enables or disables memory merge support. This feature, when supported by
 the host, de-duplicates identical memory pages among VMs instances
 (enabled by default).
+@item bounce-buffers=@var{n}
+@itemx bounce-buffer-size=@var{size}
+Devices that do DMA to memory which is not RAM, for example the MMIO
+region of another device, go through one of @var{n} bounce buffers of
+@var{size} bytes each.  A device that finds all of them busy has to wait
+or to split its transfer.  The defaults are 16 buffers of one target page.
+@item xen-mapcache-size=@var{size}
+Under Xen, QEMU maps guest memory into its own address space on demand,
+in 1 MB buckets (64 KB on 32-bit hosts), and keeps the mappings for
+reuse.  Once @var{size} bytes are mapped, the least recently used mapping
+is dropped.  The default is 32 GB (2 GB on 32-bit hosts) or what the
+address space limit of the process allows.  @code{info xen_mapcache}
+shows how well the cache works.
 @end table
 ETEXI
 
@@ -79,7 +95,11 @@ DEF("smp", HAS_ARG, QEMU_OPTION_smp,
     "                offline CPUs for hotplug, etc\n"
     "                cores= number of CPU cores on one socket\n"
     "                threads= number of threads on one CPU core\n"
-    "                sockets= number of discrete sockets in the system\n",
+    "                sockets= number of discrete sockets in the system\n"
+    "                [,affinity=cpu[-cpu][:cpu[-cpu]...]]\n"
+    "                [,sched=other|fifo[:prio]|rr[:prio]]\n"
+    "                affinity= host CPUs of each vCPU thread\n"
+    "                sched= scheduling policy of the vCPU threads\n",
         QEMU_ARCH_ALL)
 STEXI
 @item -smp [cpus=]@var{n}[,cores=@var{cores}][,threads=@var{threads}][,sockets=@var{sockets}][,maxcpus=@var{maxcpus}]
@@ -92,15 +112,42 @@ of @var{threads} per cores and the total number of @var{sockets} can be
 specified. Missing values will be computed. If any on the three values is
 given, the total number of CPUs @var{n} can be omitted. @var{maxcpus}
 specifies the maximum number of hotpluggable CPUs.
+
+@option{affinity} pins the vCPU threads to host CPUs.  It is a list of
+host CPU ranges separated by colons; vCPU @var{i} uses entry @var{i}
+modulo the length of the list, so @code{affinity=2-5} lets every vCPU
+run on host CPUs 2 to 5 and @code{affinity=2:3:4:5} gives each of four
+vCPUs its own host CPU.  @option{sched} sets the scheduling policy of the
+vCPU threads, with an optional real-time priority from 1 to 99 (1 by
+default).  Both are applied by each vCPU thread before the guest can run
+on it, and QEMU exits if they cannot be applied.  With TCG, all vCPUs
+share one thread, which uses the first entry.
 ETEXI
 
 DEF("numa", HAS_ARG, QEMU_OPTION_numa,
-    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n", QEMU_ARCH_ALL)
+    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n"
+    "      [,host-nodes=node[-node]]\n"
+    "      [,policy=default|preferred|bind|interleave]\n"
+    "      [,mem-path=path]\n", QEMU_ARCH_ALL)
 STEXI
 @item -numa @var{opts}
 @findex -numa
 Simulate a multi node NUMA system. If mem and cpus are omitted, resources
 are split equally.
+
+By default the guest nodes only describe the topology to the guest, and
+all of the guest RAM is a single block placed anywhere on the host.
+@option{host-nodes} binds the memory of a guest node to a range of host
+NUMA nodes, and @option{policy} selects how: @code{bind} (the default
+when @option{host-nodes} is given) only allocates from those nodes,
+@code{preferred} falls back to other nodes when they are full, and
+@code{interleave} spreads the pages across them.  @option{mem-path}
+allocates the memory of the node on a hugetlbfs mount, like
+@option{-mem-path} does for the whole guest.
+
+When any of these is given, each guest node gets its own RAM block, and
+the @option{mem} sizes must add up to the RAM size. Migration needs the
+same options on the destination.
 ETEXI
 
 DEF("add-fd", HAS_ARG, QEMU_OPTION_add_fd,
@@ -210,14 +257,32 @@ use is discouraged as it may be removed from future versions.
 ETEXI
 
 DEF("m", HAS_ARG, QEMU_OPTION_m,
-    "-m megs         set virtual RAM size to megs MB [default="
-    stringify(DEFAULT_RAM_SIZE) "]\n", QEMU_ARCH_ALL)
+    "-m [size=]megs[,slots=n,maxmem=size]\n"
+    "                set virtual RAM size to megs MB [default="
+    stringify(DEFAULT_RAM_SIZE) "]\n"
+    "                slots: number of DIMM slots for hotplug memory\n"
+    "                maxmem: maximum RAM size, including the DIMMs\n",
+    QEMU_ARCH_ALL)
 STEXI
-@item -m @var{megs}
+@item -m [size=]@var{megs}[,slots=@var{n},maxmem=@var{size}]
 @findex -m
 Set virtual RAM size to @var{megs} megabytes. Default is 128 MiB.  Optionally,
 a suffix of ``M'' or ``G'' can be used to signify a value in megabytes or
 gigabytes respectively.
+
+With @option{slots} and @option{maxmem}, the machine gets @var{n} DIMM slots,
+that can hold up to @var{size} minus @var{megs} of memory.  The DIMMs are
+added with @code{-device dimm} or with the @code{device_add} monitor command,
+and removed with @code{device_del} once the guest has released them.  The
+properties of a DIMM are @option{size}, a multiple of 128 MiB, the guest NUMA
+@option{node}, and the host placement @option{mem-path}, @option{host-nodes}
+and @option{policy} as for @option{-numa node}.  @option{slot} and
+@option{addr} default to the first free slot and address.  Only the PC
+machines with the i440FX chipset and ACPI have DIMM slots.
+
+@example
+qemu-system-x86_64 -m 1G,slots=4,maxmem=8G -device dimm,id=dimm0,size=1G
+@end example
 ETEXI
 
 DEF("mem-path", HAS_ARG, QEMU_OPTION_mempath,
@@ -234,7 +299,20 @@ DEF("mem-prealloc", 0, QEMU_OPTION_mem_prealloc,
 STEXI
 @item -mem-prealloc
 @findex -mem-prealloc
-Preallocate memory when using -mem-path.
+Preallocate memory when using -mem-path.  The pages are touched by up to
+one thread per host CPU (at most 16); enable the @code{ram_prealloc_*}
+trace events to follow the progress.
+ETEXI
+
+DEF("mem-share", 0, QEMU_OPTION_mem_share,
+    "-mem-share      map guest memory shared (use with -mem-path)\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -mem-share
+@findex -mem-share
+Map the file created by -mem-path shared rather than private, so that
+another process can map the same guest memory.  This is needed by
+vhost-user backends.
 ETEXI
 
 DEF("k", HAS_ARG, QEMU_OPTION_k,
@@ -411,7 +489,11 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [[,iops=i]|[[,iops_rd=r][,iops_wr=w]]]\n"
     "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
     "       [[,iops_max=im]|[[,iops_rd_max=irm][,iops_wr_max=iwm]]]\n"
-    "       [[,iops_size=is]]\n"
+    "       [[,iops_size=is]][,throttling.group=g]\n"
+    "       [,stats-intervals=i[:i...]]\n"
+    "       [[,merge.max-size=ms][,merge.timeout=mt]]\n"
+    "       [[,readahead.window=w][,readahead.max-memory=m]]\n"
+    "       [,chain-cache.size=c]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -467,6 +549,36 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item throttling.group=@var{g}
+Share the I/O limits of this drive with every other drive using throttle
+group @var{g}.  The limits of the group are the ones given for the last
+drive that joined it, and requests of the members are serviced in turn.
+@item stats-intervals=@var{i}[:@var{i}...]
+Collect I/O statistics (operation counts, minimum, maximum and average
+latency, average queue depth) over intervals of @var{i} seconds, in addition
+to the cumulative ones.  The values for the last complete interval of each
+length are reported by the query-blockstats QMP command.
+@item merge.max-size=@var{ms}
+Merge sequential reads or writes issued by the guest into host requests of at
+most @var{ms} bytes.  Requests are merged while the device submits a batch,
+and for at most @option{merge.timeout} microseconds after the first one of a
+batch arrived.  Merging is off by default.
+@item merge.timeout=@var{mt}
+Maximum time in microseconds (0 to 1000000) a read or write may be held back
+for merging.  The default of 0 only merges requests within a batch.
+@item readahead.window=@var{w}
+With @option{copy-on-read=on}, detect sequential reads by the guest and copy
+up to @var{w} bytes that follow them from the backing file in the background,
+so that later reads are served by the image file.  Readahead is off by
+default.
+@item readahead.max-memory=@var{m}
+Maximum amount of memory used for the buffers of readahead requests in
+flight; the default is 16M.
+@item chain-cache.size=@var{c}
+Use up to @var{c} bytes of memory to remember which image of the backing
+chain holds each 64K chunk of the disk, so that reads can skip the images
+that do not contain it.  This helps with long chains of snapshots.  Each
+chunk takes 16 bytes; the cache is off by default.
 @end table
 
 By default, the @option{cache=writeback} mode is used. It will report data
@@ -658,13 +770,23 @@ will create socketpair and pass one of the fds as sock_fd
 @end table
 
 -fsdev option is used along with -device driver "virtio-9p-pci".
-@item -device virtio-9p-pci,fsdev=@var{id},mount_tag=@var{mount_tag}
+@item -device virtio-9p-pci,fsdev=@var{id},mount_tag=@var{mount_tag}[,threads=@var{n}][,attr_cache_ttl=@var{ms}]
 Options for virtio-9p-pci driver are:
 @table @option
 @item fsdev=@var{id}
 Specifies the id value specified along with -fsdev option
 @item mount_tag=@var{mount_tag}
 Specifies the tag name to be used by the guest to mount this export point
+@item threads=@var{n}
+Limits the number of worker threads that run file system operations.
+The workers are shared by all 9p devices, which get the largest limit
+any of them asks for.  The default, 0, sets no limit.
+@item attr_cache_ttl=@var{ms}
+Keeps file attributes, and the fact that a name does not exist, for
+@var{ms} milliseconds, so that repeated lookups of the same paths do not
+reach the host file system.  Changes made by the guest through this
+device are seen at once; changes made on the host can take up to
+@var{ms} milliseconds to show.  The default, 0, disables the cache.
 @end table
 
 ETEXI
@@ -807,7 +929,7 @@ ETEXI
 DEF("display", HAS_ARG, QEMU_OPTION_display,
     "-display sdl[,frame=on|off][,alt_grab=on|off][,ctrl_grab=on|off]\n"
     "            [,window_close=on|off]|curses|none|\n"
-    "            vnc=<display>[,<optargs>]\n"
+    "            vnc=<display>[,<optargs>]|shm=<path>\n"
     "                select display type\n", QEMU_ARCH_ALL)
 STEXI
 @item -display @var{type}
@@ -832,6 +954,11 @@ only affects what is done with video output; -nographic also changes
 the destination of the serial and parallel port data.
 @item vnc
 Start a VNC server on display <arg>
+@item shm
+Export the display through shared memory to local processes that connect
+to the UNIX socket @var{path}.  The pixels are never copied through the
+socket; see @file{docs/shm-display.txt} for the protocol.  Only available
+on POSIX hosts.
 @end table
 ETEXI
 
@@ -1357,7 +1484,8 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
 #ifdef CONFIG_SLIRP
     "-net user[,vlan=n][,name=str][,net=addr[/mask]][,host=addr][,restrict=on|off]\n"
     "         [,hostname=host][,dhcpstart=addr][,dns=addr][,dnssearch=domain][,tftp=dir]\n"
-    "         [,bootfile=f][,hostfwd=rule][,guestfwd=rule]"
+    "         [,bootfile=f][,hostfwd=rule][,guestfwd=rule][,mtu=n]\n"
+    "         [,sndbuf=nbytes][,rcvbuf=nbytes]"
 #ifndef _WIN32
                                              "[,smb=dir[,smbserver=addr]]\n"
 #endif
@@ -1408,13 +1536,22 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                ownership and permissions for communication port.\n"
 #endif
 #ifdef CONFIG_NETMAP
-    "-net netmap,ifname=name[,devname=nmname]\n"
+    "-net netmap,ifname=name[,devname=nmname][,queues=n]\n"
     "                attach to the existing netmap-enabled network interface 'name', or to a\n"
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
+    "                use 'queues=n' to map n rings of the port to the queues of a\n"
+    "                multiqueue NIC\n"
 #endif
-    "-net dump[,vlan=n][,file=f][,len=n]\n"
+#ifdef CONFIG_LINUX
+    "-netdev vhost-user,id=str,path=socketpath[,vhostforce=on|off]\n"
+    "                let the process listening on UNIX socket 'socketpath'\n"
+    "                handle the virtqueues of the NIC (guest memory must be\n"
+    "                shared, see -mem-share)\n"
+#endif
+    "-net dump[,vlan=n][,file=f][,len=n][,ring=n][,filesize=n]\n"
     "                dump traffic on vlan 'n' to file 'f' (max n bytes per packet)\n"
+    "                through a ring of n bytes, in files of at most n bytes\n"
     "-net none       use it alone to have zero network devices. If no -net option\n"
     "                is provided, the default is '-net nic -net user'\n", QEMU_ARCH_ALL)
 DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
@@ -1431,6 +1568,9 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "netmap|"
 #endif
     "socket|"
+#ifdef CONFIG_LINUX
+    "vhost-user|"
+#endif
     "hubport],id=str[,option][,option][,...]\n", QEMU_ARCH_ALL)
 STEXI
 @item -net nic[,vlan=@var{n}][,macaddr=@var{mac}][,model=@var{type}] [,name=@var{name}][,addr=@var{addr}][,vectors=@var{v}]
@@ -1592,6 +1732,25 @@ so that QEMU behaves similar to an inetd process for that virtual server:
 qemu -net 'user,guestfwd=tcp:10.0.2.100:1234-cmd:netcat 10.10.1.1 4321'
 @end example
 
+@item mtu=@var{n}
+Set the MTU of the link between the guest and the user mode network stack,
+from 576 to 65521 (default 1500). Any other value than 1500 is advertised to
+the guest by the built-in DHCP server. Larger values let TCP connections use
+larger segments, which reduces the per-packet overhead.
+
+@item sndbuf=@var{nbytes}
+@item rcvbuf=@var{nbytes}
+Set the size of the buffers of each TCP connection, from 4096 to 1M bytes
+(default 64K). @option{sndbuf} holds the data received from the host that the
+guest has not acknowledged yet, @option{rcvbuf} the data sent by the guest that
+is not yet written to the host socket. The window advertised to the guest is
+never larger than 64K.
+
+Example:
+@example
+qemu -net nic,model=virtio -net user,mtu=9000,sndbuf=256K [...]
+@end example
+
 @end table
 
 Note: Legacy stand-alone options -tftp, -bootp, -smb and -redir are still
@@ -1761,11 +1920,37 @@ The hubport netdev lets you connect a NIC to a QEMU "vlan" instead of a single
 netdev.  @code{-net} and @code{-device} with parameter @option{vlan} create the
 required hub automatically.
 
-@item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}]
+@item -netdev vhost-user,id=@var{id},path=@var{path}[,vhostforce=on|off]
+
+Hand the virtqueues of a virtio-net NIC to an external process that listens
+on the UNIX socket @var{path}, for example a userspace switch.  QEMU sends
+the guest memory layout, the ring addresses and the kick and call eventfds
+over the socket, and the process accesses the rings in guest memory
+directly.  The protocol is described in @file{docs/specs/vhost-user.txt}.
+
+Guest memory must be backed by a shared file so that the process can map it,
+which requires @option{-mem-path} and @option{-mem-share}.  Migration is not
+supported.
+
+@example
+qemu -m 1024 -mem-path /dev/hugepages -mem-share \
+     -netdev vhost-user,id=net0,path=/var/run/switch.sock \
+     -device virtio-net-pci,netdev=net0
+@end example
+
+@item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}][,ring=@var{size}][,filesize=@var{size}]
 Dump network traffic on VLAN @var{n} to file @var{file} (@file{qemu-vlan0.pcap} by default).
 At most @var{len} bytes (64k by default) per packet are stored. The file format is
 libpcap, so it can be analyzed with tools such as tcpdump or Wireshark.
 
+By default each packet is written to the file before it is passed on. With
+@option{ring}, packets are instead copied to a buffer of @var{size} bytes and
+written by a separate thread; when the buffer is full, packets are not
+captured rather than slowing down the guest, and counted as dropped in
+@code{info network}. With @option{filesize}, a new file named
+@file{@var{file}.1}, @file{@var{file}.2}... is started whenever the current
+one would grow beyond @var{size} bytes.
+
 @item -net none
 Indicate that no network devices should be configured. It is used to
 override the default configuration (@option{-net nic -net user}) which
@@ -2090,6 +2275,19 @@ LIBISCSI_CHAP_PASSWORD="password" \
 qemu-system-i386 -drive file=iscsi://192.0.2.1/iqn.2001-04.com.example/1
 @end example
 
+Example (multipath: two sessions to each of two portals):
+@example
+qemu-system-i386 -iscsi id=iqn.2001-04.com.example,portal=192.0.2.2,sessions=2 \
+                 -drive file=iscsi://192.0.2.1/iqn.2001-04.com.example/1
+@end example
+
+The @option{portal} option can be repeated to add more portals of the same
+target; @option{sessions} sets how many sessions are opened to each portal,
+including the one in the URL (default 1, at most 16).  Commands are sent on
+the session with the fewest commands in flight.  When a session stops
+answering NOP-Out pings, its queued commands are resubmitted on the other
+sessions and it is only used again once it responds.
+
 iSCSI support is an optional feature of QEMU and only available when
 compiled and linked against libiscsi.
 ETEXI
@@ -2097,6 +2295,7 @@ DEF("iscsi", HAS_ARG, QEMU_OPTION_iscsi,
     "-iscsi [user=user][,password=password]\n"
     "       [,header-digest=CRC32C|CR32C-NONE|NONE-CRC32C|NONE\n"
     "       [,initiator-name=initiator-iqn][,id=target-iqn]\n"
+    "       [,portal=host[:port]][,sessions=n]\n"
     "                iSCSI session parameters\n", QEMU_ARCH_ALL)
 STEXI
 
@@ -2556,11 +2755,21 @@ Like -monitor but opens in 'control' mode.
 ETEXI
 
 DEF("mon", HAS_ARG, QEMU_OPTION_mon, \
-    "-mon [chardev=]name[,mode=readline|control][,default]\n", QEMU_ARCH_ALL)
+    "-mon [chardev=]name[,mode=readline|control][,default][,iothread=on|off]\n",
+    QEMU_ARCH_ALL)
 STEXI
-@item -mon [chardev=]name[,mode=readline|control][,default]
+@item -mon [chardev=]name[,mode=readline|control][,default][,iothread=on|off]
 @findex -mon
 Setup monitor on chardev @var{name}.
+
+With @option{iothread=on}, a QMP monitor (@option{mode=control}) reads its
+input in a separate thread.  A few query commands that do not need the
+global lock, such as @code{query-status} and @code{query-version}, are
+answered there right away even if the main loop is busy.  Other commands
+still run in the main loop.  Replies are always sent in the order the
+commands were received, so a query that is sent after a command still
+waiting for the main loop is delayed as well.  The chardev must be a
+socket, pipe, stdio, pty or UDP backend, and cannot be multiplexed.
 ETEXI
 
 DEF("debugcon", HAS_ARG, QEMU_OPTION_debugcon, \
@@ -2603,16 +2812,46 @@ Do not start CPU at startup (you must type 'c' in the monitor).
 ETEXI
 
 DEF("realtime", HAS_ARG, QEMU_OPTION_realtime,
-    "-realtime [mlock=on|off]\n"
+    "-realtime [mlock=on|off][,migration-affinity=cpu[-cpu]]\n"
+    "          [,migration-sched=other|fifo[:prio]|rr[:prio]]\n"
     "                run qemu with realtime features\n"
-    "                mlock=on|off controls mlock support (default: on)\n",
+    "                mlock=on|off controls mlock support (default: on)\n"
+    "                migration-affinity= host CPUs of the migration thread\n"
+    "                migration-sched= scheduling policy of the migration\n"
+    "                thread\n",
     QEMU_ARCH_ALL)
 STEXI
-@item -realtime mlock=on|off
+@item -realtime mlock=on|off[,migration-affinity=@var{cpus}][,migration-sched=@var{policy}]
 @findex -realtime
 Run qemu with realtime features.
 mlocking qemu and guest memory can be enabled via @option{mlock=on}
 (enabled by default).
+@option{migration-affinity} and @option{migration-sched} place the
+outgoing migration thread, with the same syntax as the @option{affinity}
+and @option{sched} options of @option{-smp}.  The dataplane thread of a
+virtio-blk device is placed with its @option{x-data-plane-affinity} and
+@option{x-data-plane-sched} properties.  Failing to apply these is
+reported but not fatal.
+ETEXI
+
+DEF("timer-slack", HAS_ARG, QEMU_OPTION_timer_slack,
+    "-timer-slack [rt=ns][,vm=ns][,host=ns]\n"
+    "                let the timers of each clock fire up to ns nanoseconds\n"
+    "                late, so that close deadlines share a host wakeup\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -timer-slack [rt=@var{ns}][,vm=@var{ns}][,host=@var{ns}]
+@findex -timer-slack
+Allow the timers of the @code{rt}, @code{vm} or @code{host} clock to
+fire up to @var{ns} nanoseconds late.  Wakeups are rounded up to a
+multiple of the slack, so timers whose deadlines fall in the same
+window, such as the periodic RTC, PIT and HPET timers and the virtio-net
+TX timer of an idle guest, are run together by a single host wakeup.
+This reduces the CPU that hosts with many idle guests spend on timer
+wakeups, at the cost of timer accuracy in the guest.  The default is 0,
+which runs every timer at its deadline.  The @code{vm} slack is ignored
+with @option{-icount}.  @code{info timers} in the monitor shows how many
+wakeups each clock causes.
 ETEXI
 
 DEF("gdb", HAS_ARG, QEMU_OPTION_gdb, \
@@ -2920,6 +3159,18 @@ STEXI
 Set TB size.
 ETEXI
 
+DEF("perfmap", 0, QEMU_OPTION_perfmap, \
+    "-perfmap        write a perf map of the translated code\n", QEMU_ARCH_ALL)
+STEXI
+@item -perfmap
+@findex -perfmap
+Write @file{/tmp/perf-@var{pid}.map} with an entry for each translation
+block, named after its guest PC and, when QEMU knows it, the guest symbol.
+@command{perf report} then attributes the time spent in generated code to
+guest functions instead of to an anonymous memory mapping.  Only useful
+with TCG.
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming p     prepare for incoming migration, listen on port p\n",
     QEMU_ARCH_ALL)
@@ -2927,6 +3178,14 @@ STEXI
 @item -incoming @var{port}
 @findex -incoming
 Prepare for incoming migration, listen on @var{port}.
+
+@code{-incoming template:@var{path}} starts a clone of a template saved with
+@code{migrate template:@var{path}}.  Guest RAM is mapped copy-on-write from
+@var{path}.ram instead of being copied; see @file{docs/migration-template.txt}.
+
+@code{-incoming file:@var{path}} restores a VM saved with
+@code{migrate file:@var{path}}.  Guest RAM is read from @var{path}.ram by
+several threads, with O_DIRECT where the file system supports it.
 ETEXI
 
 DEF("nodefaults", 0, QEMU_OPTION_nodefaults, \
@@ -3110,6 +3369,17 @@ Create an new object of type @var{typename} setting properties
 in the order they are specified.  Note that the 'id'
 property must be set.  These objects are placed in the
 '/objects' path.
+
+@table @option
+@item -object iothread,id=@var{id}[,poll-max-ns=@var{ns}][,poll-grow=@var{n}][,poll-shrink=@var{n}]
+Create an event loop thread.  Devices that support it, currently
+virtio-blk with @option{x-data-plane=on}, process their I/O in it when
+given @option{iothread=@var{id}}.  Several devices can share an iothread.
+The poll options set the busy-wait window of its event loop, like the
+@option{x-poll-*} properties of virtio-blk do for a private dataplane
+thread.  @code{query-iothreads} reports the host thread ID of each
+iothread, so that it can be pinned.
+@end table
 ETEXI
 
 DEF("msg", HAS_ARG, QEMU_OPTION_msg,
@@ -3123,6 +3393,18 @@ STEXI
 prepend a timestamp to each log message.(default:on)
 ETEXI
 
+DEF("startup-report", 0, QEMU_OPTION_startup_report,
+    "-startup-report print the time spent in each phase of startup\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -startup-report
+@findex -startup-report
+Print a table on stderr, just before the guest starts running, with the
+time spent in each phase of startup: option parsing, accelerator setup,
+backends, machine and device creation, ROM loading, reset.  The same
+timings are always available as the @code{vl_startup_phase} trace event.
+ETEXI
+
 HXCOMM This is the last statement. Insert new options before this line!
 STEXI
 @end table
@@ -29,6 +29,7 @@
 #include "hw/hw.h"
 
 #include "qemu/timer.h"
+#include "qmp-commands.h"
 #ifdef CONFIG_POSIX
 #include <pthread.h>
 #endif
@@ -53,6 +54,7 @@ typedef struct QEMUClock {
 
     QEMUClockType type;
     bool enabled;
+    int64_t slack_ns;
 } QEMUClock;
 
 QEMUTimerListGroup main_loop_tlg;
@@ -65,14 +67,26 @@ QEMUClock qemu_clocks[QEMU_CLOCK_MAX];
  * reenabling the clock can call all the notifiers.
  */
 
+/* The active timers of a QEMUTimerList are a binary min-heap ordered by
+ * expire time, so that timer_mod() and timer_del() take O(log n) instead of
+ * walking a sorted list.  Timers with the same expire time fire in the
+ * order they were armed, as they did with the list.
+ */
 struct QEMUTimerList {
     QEMUClock *clock;
     QemuMutex active_timers_lock;
-    QEMUTimer *active_timers;
+    QEMUTimer **active_timers;  /* the heap, active_timers[0] expires first */
+    int nb_active_timers;
+    int max_active_timers;
+    uint64_t seq;               /* for QEMUTimer.seq */
     QLIST_ENTRY(QEMUTimerList) list;
     QEMUTimerListNotifyCB *notify_cb;
     void *notify_opaque;
 
+    /* Only written by the thread that runs the timers */
+    uint64_t wakeups;           /* runs of the list that fired a timer */
+    uint64_t timers_fired;
+
     /* lightweight method to mark the end of timerlist's running */
     QemuEvent timers_done_ev;
 };
@@ -119,6 +133,7 @@ void timerlist_free(QEMUTimerList *timer_list)
         QLIST_REMOVE(timer_list, list);
     }
     qemu_mutex_destroy(&timer_list->active_timers_lock);
+    g_free(timer_list->active_timers);
     g_free(timer_list);
 }
 
@@ -170,9 +185,46 @@ void qemu_clock_enable(QEMUClockType type, bool enabled)
     }
 }
 
+void qemu_clock_set_slack(QEMUClockType type, int64_t slack_ns)
+{
+    QEMUClock *clock = qemu_clock_ptr(type);
+
+    assert(slack_ns >= 0);
+    clock->slack_ns = slack_ns;
+
+    /* A smaller slack may bring a deadline forward */
+    qemu_clock_notify(type);
+}
+
+int64_t qemu_clock_get_slack(QEMUClockType type)
+{
+    return qemu_clock_ptr(type)->slack_ns;
+}
+
+/* Round a deadline up to a multiple of the clock's slack.  The boundaries
+ * do not depend on the timer, so deadlines that fall in the same slack
+ * window, even on different timer lists, wake up the host only once.
+ */
+static int64_t qemu_clock_slack_deadline(QEMUClock *clock, int64_t expire_time)
+{
+    int64_t slack = clock->slack_ns;
+    int64_t rem;
+
+    if (!slack || !qemu_clock_use_for_deadline(clock->type) ||
+        expire_time > INT64_MAX - slack) {
+        return expire_time;
+    }
+
+    rem = expire_time % slack;
+    if (rem < 0) {
+        rem += slack;
+    }
+    return rem ? expire_time - rem + slack : expire_time;
+}
+
 bool timerlist_has_timers(QEMUTimerList *timer_list)
 {
-    return !!timer_list->active_timers;
+    return timer_list->nb_active_timers != 0;
 }
 
 bool qemu_clock_has_timers(QEMUClockType type)
@@ -186,11 +238,11 @@ bool timerlist_expired(QEMUTimerList *timer_list)
     int64_t expire_time;
 
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    if (!timer_list->active_timers) {
+    if (!timer_list->nb_active_timers) {
         qemu_mutex_unlock(&timer_list->active_timers_lock);
         return false;
     }
-    expire_time = timer_list->active_timers->expire_time;
+    expire_time = timer_list->active_timers[0]->expire_time;
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     return expire_time < qemu_clock_get_ns(timer_list->clock->type);
@@ -221,13 +273,14 @@ int64_t timerlist_deadline_ns(QEMUTimerList *timer_list)
      * the caller should notice the change and there is no race condition.
      */
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    if (!timer_list->active_timers) {
+    if (!timer_list->nb_active_timers) {
         qemu_mutex_unlock(&timer_list->active_timers_lock);
         return -1;
     }
-    expire_time = timer_list->active_timers->expire_time;
+    expire_time = timer_list->active_timers[0]->expire_time;
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
+    expire_time = qemu_clock_slack_deadline(timer_list->clock, expire_time);
     delta = expire_time - qemu_clock_get_ns(timer_list->clock->type);
 
     if (delta <= 0) {
@@ -330,6 +383,7 @@ void timer_init(QEMUTimer *ts,
     ts->opaque = opaque;
     ts->scale = scale;
     ts->expire_time = -1;
+    ts->heap_index = -1;
 }
 
 void timer_free(QEMUTimer *ts)
@@ -337,43 +391,101 @@ void timer_free(QEMUTimer *ts)
     g_free(ts);
 }
 
-static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
+static bool timer_before(QEMUTimer *a, QEMUTimer *b)
 {
-    QEMUTimer **pt, *t;
+    return a->expire_time < b->expire_time ||
+           (a->expire_time == b->expire_time && a->seq < b->seq);
+}
 
-    ts->expire_time = -1;
-    pt = &timer_list->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
+static void timer_heap_set(QEMUTimerList *timer_list, int i, QEMUTimer *ts)
+{
+    timer_list->active_timers[i] = ts;
+    ts->heap_index = i;
+}
+
+static void timer_heap_up(QEMUTimerList *timer_list, int i)
+{
+    QEMUTimer *ts = timer_list->active_timers[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!timer_before(ts, timer_list->active_timers[parent])) {
             break;
         }
-        pt = &t->next;
+        timer_heap_set(timer_list, i, timer_list->active_timers[parent]);
+        i = parent;
     }
+    timer_heap_set(timer_list, i, ts);
 }
 
-static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
-                                QEMUTimer *ts, int64_t expire_time)
+static void timer_heap_down(QEMUTimerList *timer_list, int i)
 {
-    QEMUTimer **pt, *t;
+    QEMUTimer **heap = timer_list->active_timers;
+    QEMUTimer *ts = heap[i];
+    int n = timer_list->nb_active_timers;
 
-    /* add the timer in the sorted list */
-    pt = &timer_list->active_timers;
     for (;;) {
-        t = *pt;
-        if (!timer_expired_ns(t, expire_time)) {
+        int child = 2 * i + 1;
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n && timer_before(heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!timer_before(heap[child], ts)) {
             break;
         }
-        pt = &t->next;
+        timer_heap_set(timer_list, i, heap[child]);
+        i = child;
     }
+    timer_heap_set(timer_list, i, ts);
+}
+
+static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    QEMUTimer **heap = timer_list->active_timers;
+    int i = ts->heap_index;
+    QEMUTimer *last;
+
+    ts->expire_time = -1;
+    if (i < 0 || i >= timer_list->nb_active_timers || heap[i] != ts) {
+        return;
+    }
+    ts->heap_index = -1;
+
+    /* Move the last timer into the hole and sift it whichever way it goes */
+    last = heap[--timer_list->nb_active_timers];
+    if (last != ts) {
+        timer_heap_set(timer_list, i, last);
+        if (i > 0 && timer_before(last, heap[(i - 1) / 2])) {
+            timer_heap_up(timer_list, i);
+        } else {
+            timer_heap_down(timer_list, i);
+        }
+    }
+}
+
+/* Returns true if @ts is now the first timer to expire */
+static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
+                                QEMUTimer *ts, int64_t expire_time)
+{
+    int i;
+
+    if (timer_list->nb_active_timers == timer_list->max_active_timers) {
+        timer_list->max_active_timers =
+            MAX(16, timer_list->max_active_timers * 2);
+        timer_list->active_timers = g_renew(QEMUTimer *,
+                                            timer_list->active_timers,
+                                            timer_list->max_active_timers);
+    }
+
     ts->expire_time = MAX(expire_time, 0);
-    ts->next = *pt;
-    *pt = ts;
+    ts->seq = timer_list->seq++;
+    i = timer_list->nb_active_timers++;
+    timer_heap_set(timer_list, i, ts);
+    timer_heap_up(timer_list, i);
 
-    return pt == &timer_list->active_timers;
+    return ts->heap_index == 0;
 }
 
 static void timerlist_rearm(QEMUTimerList *timer_list)
@@ -458,7 +570,7 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
 {
     QEMUTimer *ts;
     int64_t current_time;
-    bool progress = false;
+    uint64_t fired = 0;
     QEMUTimerCB *cb;
     void *opaque;
 
@@ -470,28 +582,31 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     current_time = qemu_clock_get_ns(timer_list->clock->type);
     for(;;) {
         qemu_mutex_lock(&timer_list->active_timers_lock);
-        ts = timer_list->active_timers;
+        ts = timer_list->nb_active_timers ? timer_list->active_timers[0] : NULL;
         if (!timer_expired_ns(ts, current_time)) {
             qemu_mutex_unlock(&timer_list->active_timers_lock);
             break;
         }
 
         /* remove timer from the list before calling the callback */
-        timer_list->active_timers = ts->next;
-        ts->next = NULL;
-        ts->expire_time = -1;
+        timer_del_locked(timer_list, ts);
         cb = ts->cb;
         opaque = ts->opaque;
         qemu_mutex_unlock(&timer_list->active_timers_lock);
 
         /* run the callback (the timer list can be modified) */
         cb(opaque);
-        progress = true;
+        fired++;
+    }
+
+    if (fired) {
+        timer_list->wakeups++;
+        timer_list->timers_fired += fired;
     }
 
 out:
     qemu_event_set(&timer_list->timers_done_ev);
-    return progress;
+    return fired != 0;
 }
 
 bool qemu_clock_run_timers(QEMUClockType type)
@@ -591,6 +706,38 @@ void init_clocks(void)
 #endif
 }
 
+static const char *const qemu_clock_names[QEMU_CLOCK_MAX] = {
+    [QEMU_CLOCK_REALTIME] = "rt",
+    [QEMU_CLOCK_VIRTUAL] = "vm",
+    [QEMU_CLOCK_HOST] = "host",
+};
+
+TimerClockInfoList *qmp_query_timers(Error **errp)
+{
+    TimerClockInfoList *head = NULL, **prev = &head;
+    QEMUClockType type;
+
+    for (type = 0; type < QEMU_CLOCK_MAX; type++) {
+        QEMUClock *clock = qemu_clock_ptr(type);
+        QEMUTimerList *timer_list;
+        TimerClockInfoList *elem = g_new0(TimerClockInfoList, 1);
+        TimerClockInfo *info = g_new0(TimerClockInfo, 1);
+
+        info->clock = g_strdup(qemu_clock_names[type]);
+        info->slack_ns = clock->slack_ns;
+        /* The counters of other threads may be slightly out of date */
+        QLIST_FOREACH(timer_list, &clock->timerlists, list) {
+            info->wakeups += atomic_read(&timer_list->wakeups);
+            info->timers_fired += atomic_read(&timer_list->timers_fired);
+        }
+
+        elem->value = info;
+        *prev = elem;
+        prev = &elem->next;
+    }
+    return head;
+}
+
 uint64_t timer_expire_time_ns(QEMUTimer *ts)
 {
     return timer_pending(ts) ? ts->expire_time : -1;
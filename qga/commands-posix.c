@@ -22,6 +22,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <inttypes.h>
+#include <poll.h>
 #include "qga/guest-agent-core.h"
 #include "qga-qmp-commands.h"
 #include "qapi/qmp/qerror.h"
@@ -508,6 +509,187 @@ GuestFileWrite *qmp_guest_file_write(int64_t handle, const char *buf_b64,
     return write_data;
 }
 
+#define QGA_BULK_COUNT_DEFAULT (1 << 20)
+#define QGA_BULK_COUNT_MAX (64 << 20)
+#define QGA_BULK_BUF_SIZE (64 * 1024)
+/* give up if the host stops draining or filling the bulk channel */
+#define QGA_BULK_TIMEOUT_MS 10000
+
+static int guest_bulk_wait(int fd, short events)
+{
+    struct pollfd pfd = { .fd = fd, .events = events };
+    int ret;
+
+    do {
+        ret = poll(&pfd, 1, QGA_BULK_TIMEOUT_MS);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return ret == -1 ? -1 : 0;
+}
+
+static int guest_bulk_send(int fd, const guchar *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = write(fd, buf, len);
+        if (ret == -1 && (errno == EAGAIN || errno == EINTR)) {
+            if (guest_bulk_wait(fd, POLLOUT) == -1) {
+                return -1;
+            }
+            continue;
+        } else if (ret == -1) {
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int guest_bulk_recv(int fd, guchar *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = read(fd, buf, len);
+        if (ret == -1 && (errno == EAGAIN || errno == EINTR)) {
+            if (guest_bulk_wait(fd, POLLIN) == -1) {
+                return -1;
+            }
+            continue;
+        } else if (ret == -1) {
+            return -1;
+        } else if (ret == 0) {
+            /* the host closed its end */
+            errno = EPIPE;
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+GuestFileBulk *qmp_guest_file_read_bulk(int64_t handle, bool has_count,
+                                        int64_t count, Error **err)
+{
+    GuestFileHandle *gfh = guest_file_handle_find(handle, err);
+    GuestFileBulk *bulk_data = NULL;
+    int64_t done = 0;
+    size_t len, read_count;
+    guchar *buf;
+    FILE *fh;
+    int fd;
+
+    if (!gfh) {
+        return NULL;
+    }
+
+    if (!has_count) {
+        count = QGA_BULK_COUNT_DEFAULT;
+    } else if (count < 0 || count > QGA_BULK_COUNT_MAX) {
+        error_setg(err, "value '%" PRId64 "' is invalid for argument count",
+                   count);
+        return NULL;
+    }
+
+    fd = ga_get_bulk_fd(ga_state, err);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    fh = gfh->fh;
+    buf = g_malloc(QGA_BULK_BUF_SIZE);
+    while (done < count) {
+        len = MIN(count - done, QGA_BULK_BUF_SIZE);
+        read_count = fread(buf, 1, len, fh);
+        if (read_count && guest_bulk_send(fd, buf, read_count) == -1) {
+            error_setg_errno(err, errno, "failed to write to bulk channel");
+            slog("guest-file-read-bulk failed, handle: %" PRId64, handle);
+            goto out;
+        }
+        done += read_count;
+        if (read_count < len) {
+            break;
+        }
+    }
+
+    if (ferror(fh) && !done) {
+        error_setg_errno(err, errno, "failed to read file");
+        slog("guest-file-read-bulk failed, handle: %" PRId64, handle);
+    } else {
+        bulk_data = g_malloc0(sizeof(GuestFileBulk));
+        bulk_data->count = done;
+        bulk_data->eof = feof(fh);
+    }
+
+out:
+    g_free(buf);
+    clearerr(fh);
+    return bulk_data;
+}
+
+GuestFileBulk *qmp_guest_file_write_bulk(int64_t handle, int64_t count,
+                                         Error **err)
+{
+    GuestFileHandle *gfh = guest_file_handle_find(handle, err);
+    GuestFileBulk *bulk_data = NULL;
+    int64_t done = 0, written = 0;
+    size_t len;
+    guchar *buf;
+    FILE *fh;
+    int fd;
+
+    if (!gfh) {
+        return NULL;
+    }
+
+    if (count < 0 || count > QGA_BULK_COUNT_MAX) {
+        error_setg(err, "value '%" PRId64 "' is invalid for argument count",
+                   count);
+        return NULL;
+    }
+
+    fd = ga_get_bulk_fd(ga_state, err);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    fh = gfh->fh;
+    buf = g_malloc(QGA_BULK_BUF_SIZE);
+    while (done < count) {
+        len = MIN(count - done, QGA_BULK_BUF_SIZE);
+        if (guest_bulk_recv(fd, buf, len) == -1) {
+            error_setg_errno(err, errno, "failed to read from bulk channel");
+            slog("guest-file-write-bulk failed, handle: %" PRId64, handle);
+            goto out;
+        }
+        done += len;
+        /* after a failed write, keep draining the data for this command */
+        if (!ferror(fh)) {
+            written += fwrite(buf, 1, len, fh);
+        }
+    }
+
+    if (ferror(fh)) {
+        error_setg_errno(err, errno, "failed to write to file");
+        slog("guest-file-write-bulk failed, handle: %" PRId64, handle);
+    } else {
+        bulk_data = g_malloc0(sizeof(GuestFileBulk));
+        bulk_data->count = written;
+        bulk_data->eof = feof(fh);
+    }
+
+out:
+    g_free(buf);
+    clearerr(fh);
+    return bulk_data;
+}
+
 struct GuestFileSeek *qmp_guest_file_seek(int64_t handle, int64_t offset,
                                           int64_t whence, Error **err)
 {
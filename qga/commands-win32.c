@@ -140,6 +140,20 @@ GuestFileWrite *qmp_guest_file_write(int64_t handle, const char *buf_b64,
     return 0;
 }
 
+GuestFileBulk *qmp_guest_file_read_bulk(int64_t handle, bool has_count,
+                                        int64_t count, Error **err)
+{
+    error_set(err, QERR_UNSUPPORTED);
+    return 0;
+}
+
+GuestFileBulk *qmp_guest_file_write_bulk(int64_t handle, int64_t count,
+                                         Error **err)
+{
+    error_set(err, QERR_UNSUPPORTED);
+    return 0;
+}
+
 GuestFileSeek *qmp_guest_file_seek(int64_t handle, int64_t offset,
                                    int64_t whence, Error **err)
 {
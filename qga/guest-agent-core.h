@@ -14,6 +14,8 @@
 #include "qemu-common.h"
 
 #define QGA_READ_COUNT_DEFAULT 4096
+/* how much of the command stream to read from the channel at once */
+#define QGA_CHANNEL_READ_COUNT (64 * 1024)
 
 typedef struct GAState GAState;
 typedef struct GACommandState GACommandState;
@@ -36,6 +38,9 @@ void ga_set_frozen(GAState *s);
 void ga_unset_frozen(GAState *s);
 const char *ga_fsfreeze_hook(GAState *s);
 int64_t ga_get_fd_handle(GAState *s, Error **errp);
+#ifndef _WIN32
+int ga_get_bulk_fd(GAState *s, Error **errp);
+#endif
 
 #ifndef _WIN32
 void reopen_fd_to_null(int fd);
@@ -91,6 +91,11 @@ struct GAState {
 #endif
     const gchar *pstate_filepath;
     GAPersistentState pstate;
+#ifndef _WIN32
+    /* binary channel for the guest-file-*-bulk commands, opened on demand */
+    const char *bulk_path;
+    int bulk_fd;
+#endif
 };
 
 struct GAState *ga_state;
@@ -190,6 +195,11 @@ static void usage(const char *cmd)
 "                    isa-serial (virtio-serial is the default)\n"
 "  -p, --path        device/socket path (the default for virtio-serial is:\n"
 "                    %s)\n"
+#ifndef _WIN32
+"  -B, --bulk-path   device path of a second virtio-serial port, for raw data\n"
+"                    of the guest-file-read-bulk/guest-file-write-bulk\n"
+"                    commands (disabled by default)\n"
+#endif
 "  -l, --logfile     set logfile path, logs to stderr by default\n"
 "  -f, --pidfile     specify pidfile (default is %s)\n"
 #ifdef CONFIG_FSFREEZE
@@ -557,7 +567,7 @@ static void process_command(GAState *s, QDict *req)
 }
 
 /* handle requests/control events coming in over the channel */
-static void process_event(JSONMessageParser *parser, QList *tokens)
+static void process_event(JSONMessageParser *parser, GQueue *tokens)
 {
     GAState *s = container_of(parser, GAState, parser);
     QObject *obj;
@@ -611,10 +621,11 @@ static void process_event(JSONMessageParser *parser, QList *tokens)
 static gboolean channel_event_cb(GIOCondition condition, gpointer data)
 {
     GAState *s = data;
-    gchar buf[QGA_READ_COUNT_DEFAULT+1];
+    gchar buf[QGA_CHANNEL_READ_COUNT+1];
     gsize count;
     GError *err = NULL;
-    GIOStatus status = ga_channel_read(s->channel, buf, QGA_READ_COUNT_DEFAULT, &count);
+    GIOStatus status = ga_channel_read(s->channel, buf, QGA_CHANNEL_READ_COUNT,
+                                       &count);
     if (err != NULL) {
         g_warning("error reading channel: %s", err->message);
         g_error_free(err);
@@ -907,6 +918,24 @@ int64_t ga_get_fd_handle(GAState *s, Error **errp)
     return handle;
 }
 
+#ifndef _WIN32
+int ga_get_bulk_fd(GAState *s, Error **errp)
+{
+    if (!s->bulk_path) {
+        error_setg(errp, "no bulk channel, see the --bulk-path option");
+        return -1;
+    }
+    if (s->bulk_fd == -1) {
+        s->bulk_fd = qemu_open(s->bulk_path, O_RDWR | O_NONBLOCK);
+        if (s->bulk_fd == -1) {
+            error_setg_errno(errp, errno, "failed to open bulk channel %s",
+                             s->bulk_path);
+        }
+    }
+    return s->bulk_fd;
+}
+#endif
+
 static void ga_print_cmd(QmpCommand *cmd, void *opaque)
 {
     printf("%s\n", qmp_command_name(cmd));
@@ -914,8 +943,11 @@ static void ga_print_cmd(QmpCommand *cmd, void *opaque)
 
 int main(int argc, char **argv)
 {
-    const char *sopt = "hVvdm:p:l:f:F::b:s:t:";
+    const char *sopt = "hVvdm:p:l:f:F::b:s:t:B:";
     const char *method = NULL, *path = NULL;
+#ifndef _WIN32
+    const char *bulk_path = NULL;
+#endif
     const char *log_filepath = NULL;
     const char *pid_filepath;
 #ifdef CONFIG_FSFREEZE
@@ -936,6 +968,9 @@ int main(int argc, char **argv)
         { "verbose", 0, NULL, 'v' },
         { "method", 1, NULL, 'm' },
         { "path", 1, NULL, 'p' },
+#ifndef _WIN32
+        { "bulk-path", 1, NULL, 'B' },
+#endif
         { "daemonize", 0, NULL, 'd' },
         { "blacklist", 1, NULL, 'b' },
 #ifdef _WIN32
@@ -963,6 +998,11 @@ int main(int argc, char **argv)
         case 'p':
             path = optarg;
             break;
+#ifndef _WIN32
+        case 'B':
+            bulk_path = optarg;
+            break;
+#endif
         case 'l':
             log_filepath = optarg;
             break;
@@ -1062,6 +1102,10 @@ int main(int argc, char **argv)
     s->log_file = stderr;
 #ifdef CONFIG_FSFREEZE
     s->fsfreeze_hook = fsfreeze_hook;
+#endif
+#ifndef _WIN32
+    s->bulk_path = bulk_path;
+    s->bulk_fd = -1;
 #endif
     g_log_set_default_handler(ga_log, s);
     g_log_set_fatal_mask(NULL, G_LOG_LEVEL_ERROR);
@@ -1174,6 +1218,11 @@ int main(int argc, char **argv)
 
     ga_command_state_cleanup_all(ga_state->command_state);
     ga_channel_free(ga_state->channel);
+#ifndef _WIN32
+    if (ga_state->bulk_fd != -1) {
+        close(ga_state->bulk_fd);
+    }
+#endif
 
     if (daemonize) {
         unlink(pid_filepath);
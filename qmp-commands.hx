@@ -583,6 +583,64 @@ Example:
      "arguments": { "filename": "/tmp/save" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "savevm-start",
+        .args_type  = "name:s?",
+        .mhandler.cmd_new = qmp_marshal_input_savevm_start,
+    },
+
+SQMP
+savevm-start
+------------
+
+Start a live snapshot.  The RAM is saved to the VM state area of the
+first image that supports snapshots while the guest runs.  The guest is
+stopped only for the last pass and for the disk snapshots.  The migration
+speed and downtime settings apply, and migrate_cancel aborts the
+snapshot.  Postcopy, multifd and compression must be disabled.
+
+Arguments:
+
+- "name": the snapshot name; an existing snapshot with this name or id is
+  replaced (json-string, optional)
+
+Example:
+
+-> { "execute": "savevm-start", "arguments": { "name": "before-upgrade" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-savevm",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_savevm,
+    },
+
+SQMP
+query-savevm
+------------
+
+Show the state of the last live snapshot.
+
+Return a json-object with the following information:
+
+- "status": "none", "active", "completed" or "failed" (json-string)
+- "name": the snapshot name (json-string, optional)
+- "vm-state-size": bytes of VM state saved, once finished (json-int,
+  optional)
+- "ram": RAM statistics as in query-migrate, while active (json-object,
+  optional)
+- "error": why the snapshot failed (json-string, optional)
+
+Example:
+
+-> { "execute": "query-savevm" }
+<- { "return": { "status": "completed", "name": "before-upgrade",
+                 "vm-state-size": 1090519040 } }
+
 EQMP
 
     {
@@ -661,6 +719,101 @@ Example:
 -> { "execute": "migrate_cancel" }
 <- { "return": {} }
 
+EQMP
+{
+        .name       = "migrate-start-postcopy",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_start_postcopy,
+    },
+
+SQMP
+migrate-start-postcopy
+----------------------
+
+Switch the current migration to postcopy. The x-postcopy-ram capability
+must have been enabled before the migration was started.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "migrate-start-postcopy" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:i",
+        .mhandler.cmd_new = qmp_marshal_input_calc_dirty_rate,
+    },
+
+SQMP
+calc-dirty-rate
+---------------
+
+Start measuring the rate at which the guest dirties its RAM, without
+migrating it.  The result is returned by query-dirty-rate.  A migration
+cannot be started while a measurement is in progress.
+
+Arguments:
+
+- "calc-time": length of the measurement in seconds, from 1 to 60 (json-int)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 1 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Return the result of the last dirty rate measurement.
+
+- "status": "unstarted", "measuring" or "measured" (json-string)
+- "page-size": size of a target page in bytes (json-int)
+- "calc-time": length of the measurement in seconds, once one has been
+  started (json-int, optional)
+- "dirty-pages": number of pages written during the measurement, once it
+  has finished (json-int, optional)
+- "dirty-pages-rate": number of pages written per second, once the
+  measurement has finished (json-int, optional)
+- "blocks": the same numbers for each RAM block, once the measurement has
+  finished (json-array, optional). Each element contains:
+         - "id": name of the RAM block (json-string)
+         - "size": size of the RAM block in bytes (json-int)
+         - "dirty-pages": number of pages written (json-int)
+         - "dirty-pages-rate": number of pages written per second (json-int)
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": {
+        "status": "measured",
+        "page-size": 4096,
+        "calc-time": 1,
+        "dirty-pages": 5120,
+        "dirty-pages-rate": 5117,
+        "blocks": [
+           { "id": "pc.ram", "size": 1073741824, "dirty-pages": 5100,
+             "dirty-pages-rate": 5097 },
+           { "id": "vga.vram", "size": 16777216, "dirty-pages": 20,
+             "dirty-pages-rate": 20 }
+        ]
+      }
+   }
+
 EQMP
 {
         .name       = "migrate-set-cache-size",
@@ -791,8 +944,9 @@ EQMP
 
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:b,protocol:s,begin:i?,end:i?",
-        .params     = "-p protocol [begin] [length]",
+        .args_type  = "paging:b,protocol:s,begin:i?,end:i?,format:s?,"
+                      "detach:b?",
+        .params     = "-p protocol [begin] [length] [format] [detach]",
         .help       = "dump guest memory to file",
         .user_print = monitor_user_noop,
         .mhandler.cmd_new = qmp_marshal_input_dump_guest_memory,
@@ -813,6 +967,13 @@ Arguments:
            with length together (json-int)
 - "length": the memory size, in bytes. It's optional, and should be specified
             with begin together (json-int)
+- "format": "elf" (the default) or "kdump-zlib", the kdump-compressed
+            format that crash can read.  kdump-zlib needs a seekable file
+            and cannot be combined with paging, begin or length
+            (json-string, optional)
+- "detach": if true, return at once and write the dump in the background;
+            the guest stays paused until it is complete.  Use query-dump
+            to follow it (json-bool, optional)
 
 Example:
 
@@ -823,6 +984,32 @@ Notes:
 
 (1) All boolean arguments default to false
 
+EQMP
+
+    {
+        .name       = "query-dump",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_dump,
+    },
+
+SQMP
+query-dump
+----------
+
+Show the state of the last guest memory dump.
+
+Return a json-object with the following information:
+
+- "status": "none", "active", "completed" or "failed" (json-string)
+- "completed": bytes of guest memory written so far (json-int)
+- "total": bytes of guest memory that the dump covers (json-int)
+
+Example:
+
+-> { "execute": "query-dump" }
+<- { "return": { "status": "active", "completed": 1073741824,
+                 "total": 4294967296 } }
+
 EQMP
 
     {
@@ -917,7 +1104,7 @@ EQMP
     {
         .name       = "drive-backup",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
-                      "on-source-error:s?,on-target-error:s?",
+                      "on-source-error:s?,on-target-error:s?,bitmap:s?",
         .mhandler.cmd_new = qmp_marshal_input_drive_backup,
     },
 
@@ -944,8 +1131,8 @@ Arguments:
             (json-string, optional)
 - "sync": what parts of the disk image should be copied to the destination;
   possibilities include "full" for all the disk, "top" for only the sectors
-  allocated in the topmost image, or "none" to only replicate new I/O
-  (MirrorSyncMode).
+  allocated in the topmost image, "none" to only replicate new I/O, or
+  "incremental" for the data marked dirty in "bitmap" (MirrorSyncMode).
 - "mode": whether and how QEMU should create a new image
           (NewImageMode, optional, default 'absolute-paths')
 - "speed": the maximum speed, in bytes per second (json-int, optional)
@@ -957,12 +1144,97 @@ Arguments:
                      'report' (no limitations, since this applies to
                      a different block device than device).
                      (BlockdevOnError, optional)
+- "bitmap": the dirty bitmap to use with sync mode "incremental"; it only
+            tracks the writes made after the backup started if the backup
+            succeeds (json-string, optional)
 
 Example:
 -> { "execute": "drive-backup", "arguments": { "device": "drive0",
                                                "sync": "full",
                                                "target": "backup.img" } }
 <- { "return": {} }
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-add",
+        .args_type  = "device:B,name:s,granularity:i?,file:s?",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
+    },
+
+SQMP
+block-dirty-bitmap-add
+----------------------
+
+Create a named dirty bitmap that records the writes to a block device, for
+use by incremental backups.
+
+Arguments:
+
+- "device": the name of the block device (json-string)
+- "name": the name of the bitmap, unique for the device (json-string)
+- "granularity": the granularity of the bitmap in bytes, a power of 2
+                 between 512 and 64M, default 64K (json-int, optional)
+- "file": file the bitmap is loaded from if it exists and saved to when
+          the device is closed (json-string, optional)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-add", "arguments": { "device": "drive0",
+                                                         "name": "backup0",
+                                                         "file": "drive0.bmap" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-remove",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_remove,
+    },
+
+SQMP
+block-dirty-bitmap-remove
+-------------------------
+
+Stop tracking writes with a named dirty bitmap and free it.  The bitmap file,
+if any, is not updated.
+
+Arguments:
+
+- "device": the name of the block device (json-string)
+- "name": the name of the bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-remove", "arguments": { "device": "drive0",
+                                                            "name": "backup0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-clear",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_clear,
+    },
+
+SQMP
+block-dirty-bitmap-clear
+------------------------
+
+Mark all the data clean in a named dirty bitmap.
+
+Arguments:
+
+- "device": the name of the block device (json-string)
+- "name": the name of the bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-clear", "arguments": { "device": "drive0",
+                                                           "name": "backup0" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1477,7 +1749,7 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,iops_size:l?",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,iops_size:l?,group:s?",
         .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
     },
 
@@ -1503,6 +1775,8 @@ Arguments:
 - "iops_rd_max":  read I/O operations max (json-int)
 - "iops_wr_max":  write I/O operations max (json-int)
 - "iops_size":  I/O size in bytes when limiting (json-int)
+- "group": throttle group whose limits are shared with other drives
+           (json-string, optional)
 
 Example:
 
@@ -1522,6 +1796,81 @@ Example:
                                                "iops_size": 0 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,boundaries:q?,boundaries-read:q?,boundaries-write:q?,boundaries-flush:q?,boundaries-stage:q?",
+        .mhandler.cmd_new = qmp_marshal_input_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Enable, reset or disable the latency histograms of a block device.  The
+histograms are reported by query-blockstats.
+
+Arguments:
+
+- "device": device name (json-string)
+- "boundaries": bin boundaries in nano-seconds for all request types,
+                strictly increasing (json-array, optional)
+- "boundaries-read": boundaries for reads (json-array, optional)
+- "boundaries-write": boundaries for writes (json-array, optional)
+- "boundaries-flush": boundaries for flushes (json-array, optional)
+- "boundaries-stage": boundaries for the histograms of the queue, driver and
+                      completion stages of reads and writes in the block
+                      layer (json-array, optional)
+
+A request type without boundaries has its histogram disabled.  The stage
+histograms are only enabled by "boundaries-stage".
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "virtio0",
+                    "boundaries": [ 100000, 1000000, 10000000 ] } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-throttle-groups",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_throttle_groups,
+    },
+
+SQMP
+query-throttle-groups
+---------------------
+
+List the throttle groups and the drives that share their limits.
+
+Each group is represented by a json-object, the returned value is a json-array
+of all groups.
+
+Each json-object contains the following:
+
+- "name": group name (json-string)
+- "members": json-array of the drives in the group, each containing:
+         - "device": device name (json-string)
+         - "queued-reads": read requests waiting for the group's limits
+                           (json-int)
+         - "queued-writes": write requests waiting for the group's limits
+                            (json-int)
+
+Example:
+
+-> { "execute": "query-throttle-groups" }
+<- { "return": [
+       { "name": "tenant1",
+         "members": [
+           { "device": "virtio1", "queued-reads": 0, "queued-writes": 3 },
+           { "device": "virtio0", "queued-reads": 1, "queued-writes": 0 } ] }
+     ]
+   }
+
 EQMP
 
     {
@@ -1710,6 +2059,7 @@ EQMP
         .name       = "query-version",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_version,
+        .flags      = MONITOR_CMD_BQL_FREE,
     },
 
 SQMP
@@ -1747,6 +2097,7 @@ EQMP
         .name       = "query-commands",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_commands,
+        .flags      = MONITOR_CMD_BQL_FREE,
     },
 
 SQMP
@@ -2021,8 +2372,64 @@ Each json-object contain the following:
     - "wr_total_time_ns": total time spend on writes in nano-seconds (json-int)
     - "rd_total_time_ns": total time spend on reads in nano-seconds (json-int)
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
+    - "flush_merged": cache flushes that waited for an earlier flush
+                      instead of going to the disk (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "metadata_cache": only present for image formats with metadata
+                        caches, like qcow2 (json-object, optional):
+        - "l2_hits": L2 table lookups served by the cache (json-int)
+        - "l2_misses": L2 tables read from the image (json-int)
+        - "refcount_hits": refcount block lookups served by the cache
+                           (json-int)
+        - "refcount_misses": refcount blocks read from the image (json-int)
+    - "data_cache": only present for drivers that cache image data, like
+                    blkcache (json-object, optional):
+        - "size": cache capacity in bytes (json-int)
+        - "used": bytes of the cache holding data (json-int)
+        - "dirty": bytes not yet written to the image (json-int)
+        - "hits": clusters read from the cache (json-int)
+        - "misses": clusters read from the image (json-int)
+        - "evictions": clusters dropped to make room (json-int)
+        - "writebacks": dirty clusters written to the image (json-int)
+    - "objects": only present for drivers for distributed storage, like
+                 sheepdog (json-object, optional):
+        - "connections": connections used for object I/O (json-int)
+        - "in_flight": object requests waiting for a response (json-int)
+        - "max_in_flight": highest value of "in_flight" (json-int)
+        - "pending": requests waiting for an allocation of the same object
+                     (json-int)
+        - "allocations": objects allocated (json-int)
+        - "metadata_updates": metadata writes recording allocations
+                              (json-int)
+    - "rd_queue_depth": reads currently in flight (json-int)
+    - "wr_queue_depth": writes currently in flight (json-int)
+    - "idle_time_ns": time since the last request completed, only present
+                      when no request is in flight (json-int, optional)
+    - "rd_latency_histogram", "wr_latency_histogram",
+      "flush_latency_histogram": only present if enabled with
+                                 block-latency-histogram-set
+                                 (json-object, optional):
+        - "boundaries": bin boundaries in nano-seconds (json-array)
+        - "bins": number of requests in each bin (json-array)
+    - "stage_latency": only present if enabled with the "boundaries-stage"
+                       argument of block-latency-histogram-set
+                       (json-object, optional):
+        - "queue": time waiting for throttling and overlapping requests
+        - "driver": time in the format and protocol drivers
+        - "completion": time until the AIO completion callback runs
+      each a histogram like "rd_latency_histogram" (json-object)
+    - "timed_stats": only present if the drive has "stats-intervals" set
+                     (json-array, optional); for each interval, the
+                     statistics of the last complete one:
+        - "interval_length": length of the interval in seconds (json-int)
+        - "rd_operations", "wr_operations", "flush_operations": requests
+          completed (json-int)
+        - "min_rd_latency_ns", "max_rd_latency_ns", "avg_rd_latency_ns",
+          and the same for "wr" and "flush": latencies in nano-seconds
+          (json-int)
+        - "avg_rd_queue_depth", "avg_wr_queue_depth": average number of
+          requests in flight (json-number)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -2045,6 +2452,7 @@ Example:
                   "wr_total_times_ns":313253456
                   "rd_total_times_ns":3465673657
                   "flush_total_times_ns":49653
+                  "flush_merged":6,
                   "flush_operations":61,
                }
             },
@@ -2057,7 +2465,14 @@ Example:
                "flush_operations":51,
                "wr_total_times_ns":313253456
                "rd_total_times_ns":3465673657
-               "flush_total_times_ns":49653
+               "flush_total_times_ns":49653,
+               "flush_merged":4,
+               "metadata_cache":{
+                  "l2_hits":35870,
+                  "l2_misses":734,
+                  "refcount_hits":412,
+                  "refcount_misses":3
+               }
             }
          },
          {
@@ -2161,6 +2576,140 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_cpus,
     },
 
+SQMP
+query-bql
+---------
+
+Show how contended the global mutex (BQL) is, and how long each thread
+waited for it and held it.  Time spent in a condition variable wait is
+not counted as holding the BQL.
+
+Return a json-object with the following information:
+
+- "contended": number of times a thread found the BQL taken (json-int)
+- "slept": how many of them the thread had to sleep after spinning
+  (json-int)
+- "threads": json-array of json-objects, the main loop first, with
+  - "thread": "main", "vcpu", "tcg", or "other" for all the remaining
+    threads together (json-string)
+  - "cpu-index": CPU index, only for "vcpu" (json-int)
+  - "thread-id": host thread ID, only for "vcpu" (json-int)
+  - "acquired": number of times the thread took the BQL (json-int)
+  - "contended": how many of them it had to wait (json-int)
+  - "wait-ns": time spent waiting (json-int)
+  - "hold-ns": time spent holding the BQL (json-int)
+  - "max-hold-ns": longest time the BQL was held (json-int)
+
+Example:
+
+-> { "execute": "query-bql" }
+<- { "return": {
+       "contended": 5211, "slept": 1930,
+       "threads": [
+         { "thread": "main", "acquired": 190332, "contended": 2410,
+           "wait-ns": 30512960, "hold-ns": 2107735560,
+           "max-hold-ns": 1656722 },
+         { "thread": "vcpu", "cpu-index": 0, "thread-id": 3134,
+           "acquired": 82131, "contended": 2801, "wait-ns": 41099212,
+           "hold-ns": 388022611, "max-hold-ns": 922001 },
+         { "thread": "other", "acquired": 0, "contended": 0,
+           "wait-ns": 0, "hold-ns": 0, "max-hold-ns": 0 } ] } }
+
+EQMP
+
+    {
+        .name       = "query-bql",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_bql,
+    },
+
+SQMP
+query-iothreads
+---------------
+
+Returns a list of information about each iothread.
+
+Note that this list excludes the QEMU main loop thread and the threads that
+devices create for themselves without an iothread.
+
+Return a json-array. Each iothread is represented by a json-object, which
+contains:
+
+- "id": name of iothread (json-str)
+- "thread-id": ID of the underlying host thread (json-int)
+- "poll-max-ns": longest busy-wait window in ns, 0 if disabled (json-int)
+- "poll-ns": current busy-wait window in ns (json-int)
+- "poll-attempts": event loop iterations that busy-waited (json-int)
+- "poll-successes": busy-waits that found an event (json-int)
+- "poll-time-ns": total time spent busy-waiting in ns (json-int)
+
+Example:
+
+-> { "execute": "query-iothreads" }
+<- { "return": [
+         {
+            "id":"iothread0",
+            "thread-id":3134,
+            "poll-max-ns":32768,
+            "poll-ns":16384,
+            "poll-attempts":12000,
+            "poll-successes":9000,
+            "poll-time-ns":51000000
+         },
+         {
+            "id":"iothread1",
+            "thread-id":3135,
+            "poll-max-ns":0,
+            "poll-ns":0,
+            "poll-attempts":0,
+            "poll-successes":0,
+            "poll-time-ns":0
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-iothreads",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_iothreads,
+    },
+
+SQMP
+query-timers
+------------
+
+Returns timer statistics for each clock, across the main loop and all
+iothreads.
+
+Return a json-array. Each clock is represented by a json-object, which
+contains:
+
+- "clock": "rt", "vm" or "host" (json-str)
+- "slack-ns": how late the timers of the clock may fire, in ns (json-int)
+- "wakeups": times the timers were run and at least one expired (json-int)
+- "timers-fired": number of timer callbacks run (json-int)
+
+Example:
+
+-> { "execute": "query-timers" }
+<- { "return": [
+         { "clock":"rt", "slack-ns":0, "wakeups":1200, "timers-fired":1250 },
+         { "clock":"vm", "slack-ns":1000000, "wakeups":5000,
+           "timers-fired":21000 },
+         { "clock":"host", "slack-ns":0, "wakeups":10, "timers-fired":10 }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-timers",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_timers,
+    },
+
 SQMP
 query-pci
 ---------
@@ -2402,6 +2951,84 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_kvm,
     },
 
+SQMP
+query-kvm-exits
+---------------
+
+Show how often each vCPU exited to QEMU, by exit reason.  Once profiling
+was turned on with kvm-exit-profile, MMIO and PIO exits are also shown by
+address.
+
+Return a json-array.  Each vCPU is represented by a json-object, which
+contains:
+
+- "cpu": CPU index (json-int)
+- "exits": json-array of json-objects with
+  - "reason": exit reason, such as "io", "mmio" or "hlt" (json-string)
+  - "count": number of exits (json-int)
+- "addresses": only present while profiling or after it, json-array of
+  json-objects, most frequent first, with
+  - "space": "mmio" or "pio" (json-string)
+  - "address": guest physical address or I/O port (json-int)
+  - "region": name of the memory region mapped there, optional
+    (json-string)
+  - "count": number of exits (json-int)
+  - "time-ns": time spent in the device model (json-int)
+- "dropped": exits that did not fit in "addresses" (json-int, optional)
+
+Exits handled without the global lock are counted in "exits" but are not
+profiled.
+
+Example:
+
+-> { "execute": "query-kvm-exits" }
+<- { "return": [
+       { "cpu": 0,
+         "exits": [ { "reason": "io", "count": 18532 },
+                    { "reason": "hlt", "count": 2211 },
+                    { "reason": "mmio", "count": 7310 },
+                    { "reason": "intr", "count": 940 } ],
+         "addresses": [ { "space": "mmio", "address": 4273733632,
+                          "region": "e1000-mmio", "count": 6981,
+                          "time-ns": 2350682 },
+                        { "space": "pio", "address": 112,
+                          "region": "rtc", "count": 3020,
+                          "time-ns": 1193013 } ],
+         "dropped": 0 } ] }
+
+EQMP
+
+    {
+        .name       = "query-kvm-exits",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_kvm_exits,
+    },
+
+SQMP
+kvm-exit-profile
+----------------
+
+Turn the profiling of MMIO and PIO exits by address on or off.  Turning
+it on discards the previous profile.  Turning it off keeps the profile for
+query-kvm-exits.
+
+Arguments:
+
+- "enable": true to start profiling, false to stop (json-bool)
+
+Example:
+
+-> { "execute": "kvm-exit-profile", "arguments": { "enable": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "kvm-exit-profile",
+        .args_type  = "enable:b",
+        .mhandler.cmd_new = qmp_marshal_input_kvm_exit_profile,
+    },
+
 SQMP
 query-status
 ------------
@@ -2440,6 +3067,7 @@ EQMP
         .name       = "query-status",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_status,
+        .flags      = MONITOR_CMD_BQL_FREE,
     },
 
 SQMP
@@ -2520,6 +3148,12 @@ Clients are described by a json-object, each one contain the following:
 - "service": client's port number (json-string)
 - "x509_dname": TLS dname (json-string, optional)
 - "sasl_username": SASL username (json-string, optional)
+- "encoders": a json-array of the encodings used for the client (optional),
+              each one a json-object with:
+         - "encoding": encoding name (json-string)
+         - "rects": rectangles sent (json-int)
+         - "bytes": bytes produced by the encoder (json-int)
+         - "time-ns": time spent encoding in nanoseconds (json-int)
 
 Example:
 
@@ -2535,7 +3169,15 @@ Example:
             {
                "host":"127.0.0.1",
                "service":"50401",
-               "family":"ipv4"
+               "family":"ipv4",
+               "encoders":[
+                  {
+                     "encoding":"tight",
+                     "rects":1024,
+                     "bytes":3145728,
+                     "time-ns":92000000
+                  }
+               ]
             }
          ]
       }
@@ -2648,6 +3290,7 @@ EQMP
         .name       = "query-name",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_name,
+        .flags      = MONITOR_CMD_BQL_FREE,
     },
 
 SQMP
@@ -2671,6 +3314,7 @@ EQMP
         .name       = "query-uuid",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_uuid,
+        .flags      = MONITOR_CMD_BQL_FREE,
     },
 
 SQMP
@@ -2778,6 +3422,46 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+         - "cache-hit": number of XBZRLE page cache hits
+         - "cache-evictions": number of pages thrown out of the cache to
+           make room for another one
+         - "cache-hit-rate": ratio of cache lookups that were hits
+           (json-number)
+         - "cache-eviction-rate": ratio of cache inserts that evicted
+           another page (json-number)
+- "compression": only present if the compress capability is on.
+  It is a json-object with the following compression information:
+         - "pages": number of compressed pages
+         - "busy": number of times the migration thread had to wait for a
+           free compression thread
+         - "compressed-size": number of bytes after compression
+         - "compression-rate": compressed bytes over original bytes
+         - "threads": json-array of per-thread json-objects with "id",
+           "pages", "compressed-size", "busy-time" (in milliseconds) and
+           "mbps"
+- "rdma": only present for x-rdma migrations.
+  It is a json-object with the following RDMA information:
+         - "registration-hits": number of writes to already registered
+           chunks
+         - "registration-misses": number of chunks registered on demand
+         - "unregistrations": number of chunks unpinned to honour
+           x-rdma-registration-cache
+         - "writes": number of RDMA writes posted
+         - "max-outstanding": most RDMA writes in flight at the same time
+         - "registration-time": milliseconds spent registering chunks
+         - "wire-time": milliseconds spent waiting for RDMA writes to
+           complete
+- "auto-tune": only present if the x-auto-tune capability is on.
+  It is a json-object with the following information:
+         - "bandwidth-limit": current rate limit in bytes per second
+         - "bandwidth": throughput over the last second in bytes per second
+         - "dirty-rate": bytes dirtied by the guest per second
+         - "throttle": percentage of time vCPUs are kept asleep
+         - "downtime-limit": downtime allowed for the final pass, in
+           milliseconds
+         - "adjustments": number of changes made so far
+         - "last-action": "none", "raise-bandwidth", "throttle",
+           "relax-throttle" or "raise-downtime"
 
 Examples:
 
@@ -2878,7 +3562,11 @@ Examples:
             "bytes":20971520,
             "pages":2444343,
             "cache-miss":2244,
-            "overflow":34434
+            "overflow":34434,
+            "cache-hit":2442099,
+            "cache-evictions":1022,
+            "cache-hit-rate":0.99,
+            "cache-eviction-rate":0.01
          }
       }
    }
@@ -2938,6 +3626,93 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_migrate_capabilities,
     },
 
+SQMP
+migrate-set-parameters
+----------------------
+
+Set migration parameters
+
+- "x-multifd-channels": number of extra channels used by x-multifd (json-int)
+- "compress-level": compression level, 0 to 9 (json-int)
+- "compress-threads": number of compression threads, 1 to 255 (json-int)
+- "decompress-threads": number of decompression threads, 1 to 255 (json-int)
+- "x-rdma-registration-cache": megabytes of guest RAM x-rdma keeps
+  registered when x-rdma-pin-all is off, 0 for no limit (json-int)
+- "x-file-buffer-size": bytes buffered by the migration stream, 4096 to
+  16777216 (json-int)
+- "x-file-iov-max": iovec entries per write of the migration stream, 1 to
+  the host's IOV_MAX (json-int)
+- "x-auto-tune-max-bandwidth": highest bandwidth limit x-auto-tune may set,
+  in bytes per second, 0 for no cap (json-int)
+- "x-auto-tune-deadline": milliseconds after the start by which x-auto-tune
+  tries to complete the migration, 0 for none (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "migrate-set-parameters" , "arguments":
+      { "compress-level": 1, "compress-threads": 8 } }
+
+EQMP
+
+    {
+        .name       = "migrate-set-parameters",
+        .args_type  = "x-multifd-channels:i?,compress-level:i?,"
+                      "compress-threads:i?,decompress-threads:i?,"
+                      "x-rdma-registration-cache:i?,"
+                      "x-file-buffer-size:i?,x-file-iov-max:i?,"
+                      "x-auto-tune-max-bandwidth:i?,x-auto-tune-deadline:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
+    },
+SQMP
+query-migrate-parameters
+------------------------
+
+Query current migration parameters
+
+- "parameters": migration parameters value
+         - "x-multifd-channels" : number of x-multifd channels (json-int)
+         - "compress-level" : compression level (json-int)
+         - "compress-threads" : number of compression threads (json-int)
+         - "decompress-threads" : number of decompression threads (json-int)
+         - "x-rdma-registration-cache" : RDMA registration cache size in
+           megabytes (json-int)
+         - "x-file-buffer-size" : migration stream buffer size in bytes
+           (json-int)
+         - "x-file-iov-max" : iovec entries per write (json-int)
+         - "x-auto-tune-max-bandwidth" : x-auto-tune bandwidth cap in bytes
+           per second (json-int)
+         - "x-auto-tune-deadline" : x-auto-tune deadline in milliseconds
+           (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- {
+      "return": {
+         "x-multifd-channels": 2,
+         "compress-level": 1,
+         "compress-threads": 8,
+         "decompress-threads": 2,
+         "x-rdma-registration-cache": 0,
+         "x-file-buffer-size": 32768,
+         "x-file-iov-max": 64,
+         "x-auto-tune-max-bandwidth": 0,
+         "x-auto-tune-deadline": 0
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-migrate-parameters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_parameters,
+    },
+
 SQMP
 query-balloon
 -------------
@@ -2997,7 +3772,7 @@ EQMP
     },
     {
         .name       = "nbd-server-add",
-        .args_type  = "device:B,writable:b?",
+        .args_type  = "device:B,writable:b?,max-requests:i?",
         .mhandler.cmd_new = qmp_marshal_input_nbd_server_add,
     },
     {
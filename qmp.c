@@ -25,6 +25,7 @@
 #include "sysemu/blockdev.h"
 #include "qom/qom-qobject.h"
 #include "hw/boards.h"
+#include "sysemu/dump.h"
 
 NameInfo *qmp_query_name(Error **errp)
 {
@@ -164,6 +165,9 @@ void qmp_cont(Error **errp)
         return;
     } else if (runstate_check(RUN_STATE_SUSPENDED)) {
         return;
+    } else if (dump_in_progress()) {
+        error_setg(errp, "the guest resumes when its memory dump is complete");
+        return;
     }
 
     bdrv_iterate(iostatus_bdrv_it, NULL);
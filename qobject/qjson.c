@@ -28,7 +28,7 @@ typedef struct JSONParsingState
     QObject *result;
 } JSONParsingState;
 
-static void parse_json(JSONMessageParser *parser, QList *tokens)
+static void parse_json(JSONMessageParser *parser, GQueue *tokens)
 {
     JSONParsingState *s = container_of(parser, JSONParsingState, parser);
     s->result = json_parser_parse(tokens, s->ap);
@@ -70,123 +70,185 @@ QObject *qobject_from_jsonf(const char *string, ...)
     return obj;
 }
 
+/* Output is collected in a small buffer and handed to the writer a chunk
+ * at a time, so that a large reply does not have to be built in memory
+ * before it is sent.
+ */
+#define TO_JSON_CHUNK   4096
+
+typedef struct ToJsonState
+{
+    QJSONWriteFunc *write;
+    void *opaque;
+    size_t len;
+    char buf[TO_JSON_CHUNK + 1];
+} ToJsonState;
+
 typedef struct ToJsonIterState
 {
     int indent;
     int pretty;
     int count;
-    QString *str;
+    ToJsonState *out;
 } ToJsonIterState;
 
-static void to_json(const QObject *obj, QString *str, int pretty, int indent);
+static void to_json_flush(ToJsonState *out)
+{
+    if (out->len) {
+        out->buf[out->len] = 0;
+        out->write(out->opaque, out->buf, out->len);
+        out->len = 0;
+    }
+}
+
+static void to_json_append_len(ToJsonState *out, const char *str, size_t len)
+{
+    size_t n;
+
+    while (len) {
+        if (out->len == TO_JSON_CHUNK) {
+            to_json_flush(out);
+        }
+        n = MIN(len, TO_JSON_CHUNK - out->len);
+        memcpy(out->buf + out->len, str, n);
+        out->len += n;
+        str += n;
+        len -= n;
+    }
+}
+
+static void to_json_append(ToJsonState *out, const char *str)
+{
+    to_json_append_len(out, str, strlen(str));
+}
+
+static void to_json_indent(ToJsonState *out, int indent)
+{
+    int j;
+
+    to_json_append(out, "\n");
+    for (j = 0 ; j < indent ; j++)
+        to_json_append(out, "    ");
+}
+
+static void to_json_str(const char *ptr, ToJsonState *out)
+{
+    const char *run;
+    int cp;
+    char buf[16];
+    char *end;
+
+    to_json_append(out, "\"");
+
+    for (; *ptr; ptr = end) {
+        /* Copy characters that need no escaping in one go */
+        run = ptr;
+        while (*ptr >= 0x20 && *ptr < 0x7F && *ptr != '\"' && *ptr != '\\') {
+            ptr++;
+        }
+        to_json_append_len(out, run, ptr - run);
+        if (!*ptr) {
+            break;
+        }
+
+        cp = mod_utf8_codepoint(ptr, 6, &end);
+        switch (cp) {
+        case '\"':
+            to_json_append(out, "\\\"");
+            break;
+        case '\\':
+            to_json_append(out, "\\\\");
+            break;
+        case '\b':
+            to_json_append(out, "\\b");
+            break;
+        case '\f':
+            to_json_append(out, "\\f");
+            break;
+        case '\n':
+            to_json_append(out, "\\n");
+            break;
+        case '\r':
+            to_json_append(out, "\\r");
+            break;
+        case '\t':
+            to_json_append(out, "\\t");
+            break;
+        default:
+            if (cp < 0) {
+                cp = 0xFFFD; /* replacement character */
+            }
+            if (cp > 0xFFFF) {
+                /* beyond BMP; need a surrogate pair */
+                snprintf(buf, sizeof(buf), "\\u%04X\\u%04X",
+                         0xD800 + ((cp - 0x10000) >> 10),
+                         0xDC00 + ((cp - 0x10000) & 0x3FF));
+            } else if (cp < 0x20 || cp >= 0x7F) {
+                snprintf(buf, sizeof(buf), "\\u%04X", cp);
+            } else {
+                buf[0] = cp;
+                buf[1] = 0;
+            }
+            to_json_append(out, buf);
+        }
+    }
+
+    to_json_append(out, "\"");
+}
+
+static void to_json(const QObject *obj, ToJsonState *out, int pretty,
+                    int indent);
 
 static void to_json_dict_iter(const char *key, QObject *obj, void *opaque)
 {
     ToJsonIterState *s = opaque;
-    QString *qkey;
-    int j;
 
     if (s->count)
-        qstring_append(s->str, ", ");
+        to_json_append(s->out, ", ");
 
     if (s->pretty) {
-        qstring_append(s->str, "\n");
-        for (j = 0 ; j < s->indent ; j++)
-            qstring_append(s->str, "    ");
+        to_json_indent(s->out, s->indent);
     }
 
-    qkey = qstring_from_str(key);
-    to_json(QOBJECT(qkey), s->str, s->pretty, s->indent);
-    QDECREF(qkey);
+    to_json_str(key, s->out);
 
-    qstring_append(s->str, ": ");
-    to_json(obj, s->str, s->pretty, s->indent);
+    to_json_append(s->out, ": ");
+    to_json(obj, s->out, s->pretty, s->indent);
     s->count++;
 }
 
 static void to_json_list_iter(QObject *obj, void *opaque)
 {
     ToJsonIterState *s = opaque;
-    int j;
 
     if (s->count)
-        qstring_append(s->str, ", ");
+        to_json_append(s->out, ", ");
 
     if (s->pretty) {
-        qstring_append(s->str, "\n");
-        for (j = 0 ; j < s->indent ; j++)
-            qstring_append(s->str, "    ");
+        to_json_indent(s->out, s->indent);
     }
 
-    to_json(obj, s->str, s->pretty, s->indent);
+    to_json(obj, s->out, s->pretty, s->indent);
     s->count++;
 }
 
-static void to_json(const QObject *obj, QString *str, int pretty, int indent)
+static void to_json(const QObject *obj, ToJsonState *out, int pretty,
+                    int indent)
 {
     switch (qobject_type(obj)) {
     case QTYPE_QINT: {
         QInt *val = qobject_to_qint(obj);
-        char buffer[1024];
+        char buffer[32];
+        int len;
 
-        snprintf(buffer, sizeof(buffer), "%" PRId64, qint_get_int(val));
-        qstring_append(str, buffer);
+        len = snprintf(buffer, sizeof(buffer), "%" PRId64, qint_get_int(val));
+        to_json_append_len(out, buffer, len);
         break;
     }
     case QTYPE_QSTRING: {
         QString *val = qobject_to_qstring(obj);
-        const char *ptr;
-        int cp;
-        char buf[16];
-        char *end;
-
-        ptr = qstring_get_str(val);
-        qstring_append(str, "\"");
-
-        for (; *ptr; ptr = end) {
-            cp = mod_utf8_codepoint(ptr, 6, &end);
-            switch (cp) {
-            case '\"':
-                qstring_append(str, "\\\"");
-                break;
-            case '\\':
-                qstring_append(str, "\\\\");
-                break;
-            case '\b':
-                qstring_append(str, "\\b");
-                break;
-            case '\f':
-                qstring_append(str, "\\f");
-                break;
-            case '\n':
-                qstring_append(str, "\\n");
-                break;
-            case '\r':
-                qstring_append(str, "\\r");
-                break;
-            case '\t':
-                qstring_append(str, "\\t");
-                break;
-            default:
-                if (cp < 0) {
-                    cp = 0xFFFD; /* replacement character */
-                }
-                if (cp > 0xFFFF) {
-                    /* beyond BMP; need a surrogate pair */
-                    snprintf(buf, sizeof(buf), "\\u%04X\\u%04X",
-                             0xD800 + ((cp - 0x10000) >> 10),
-                             0xDC00 + ((cp - 0x10000) & 0x3FF));
-                } else if (cp < 0x20 || cp >= 0x7F) {
-                    snprintf(buf, sizeof(buf), "\\u%04X", cp);
-                } else {
-                    buf[0] = cp;
-                    buf[1] = 0;
-                }
-                qstring_append(str, buf);
-            }
-        };
 
-        qstring_append(str, "\"");
+        to_json_str(qstring_get_str(val), out);
         break;
     }
     case QTYPE_QDICT: {
@@ -194,18 +256,15 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
         QDict *val = qobject_to_qdict(obj);
 
         s.count = 0;
-        s.str = str;
+        s.out = out;
         s.indent = indent + 1;
         s.pretty = pretty;
-        qstring_append(str, "{");
+        to_json_append(out, "{");
         qdict_iter(val, to_json_dict_iter, &s);
         if (pretty) {
-            int j;
-            qstring_append(str, "\n");
-            for (j = 0 ; j < indent ; j++)
-                qstring_append(str, "    ");
+            to_json_indent(out, indent);
         }
-        qstring_append(str, "}");
+        to_json_append(out, "}");
         break;
     }
     case QTYPE_QLIST: {
@@ -213,18 +272,15 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
         QList *val = qobject_to_qlist(obj);
 
         s.count = 0;
-        s.str = str;
+        s.out = out;
         s.indent = indent + 1;
         s.pretty = pretty;
-        qstring_append(str, "[");
+        to_json_append(out, "[");
         qlist_iter(val, (void *)to_json_list_iter, &s);
         if (pretty) {
-            int j;
-            qstring_append(str, "\n");
-            for (j = 0 ; j < indent ; j++)
-                qstring_append(str, "    ");
+            to_json_indent(out, indent);
         }
-        qstring_append(str, "]");
+        to_json_append(out, "]");
         break;
     }
     case QTYPE_QFLOAT: {
@@ -243,16 +299,16 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
             buffer[len] = 0;
         }
         
-        qstring_append(str, buffer);
+        to_json_append(out, buffer);
         break;
     }
     case QTYPE_QBOOL: {
         QBool *val = qobject_to_qbool(obj);
 
         if (qbool_get_int(val)) {
-            qstring_append(str, "true");
+            to_json_append(out, "true");
         } else {
-            qstring_append(str, "false");
+            to_json_append(out, "false");
         }
         break;
     }
@@ -265,11 +321,29 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
     }
 }
 
+void qobject_to_json_write(const QObject *obj, bool pretty,
+                           QJSONWriteFunc *write, void *opaque)
+{
+    ToJsonState *out = g_new(ToJsonState, 1);
+
+    out->write = write;
+    out->opaque = opaque;
+    out->len = 0;
+    to_json(obj, out, pretty, 0);
+    to_json_flush(out);
+    g_free(out);
+}
+
+static void qstring_write(void *opaque, const char *buf, size_t len)
+{
+    qstring_append(opaque, buf);
+}
+
 QString *qobject_to_json(const QObject *obj)
 {
     QString *str = qstring_new();
 
-    to_json(obj, str, 0, 0);
+    qobject_to_json_write(obj, false, qstring_write, str);
 
     return str;
 }
@@ -278,7 +352,7 @@ QString *qobject_to_json_pretty(const QObject *obj)
 {
     QString *str = qstring_new();
 
-    to_json(obj, str, 1, 0);
+    qobject_to_json_write(obj, true, qstring_write, str);
 
     return str;
 }
@@ -28,6 +28,9 @@
 
 #define MAX_INTERFACES 32
 
+/* Lookups that walk this many properties switch the object to a hash table */
+#define OBJECT_PROPERTY_HASH_MIN 8
+
 typedef struct InterfaceImpl InterfaceImpl;
 typedef struct TypeImpl TypeImpl;
 
@@ -353,6 +356,9 @@ static void object_property_del_all(Object *obj)
         ObjectProperty *prop = QTAILQ_FIRST(&obj->properties);
 
         QTAILQ_REMOVE(&obj->properties, prop, node);
+        if (obj->property_hash) {
+            g_hash_table_remove(obj->property_hash, prop->name);
+        }
 
         if (prop->release) {
             prop->release(obj, prop->name, prop->opaque);
@@ -362,6 +368,11 @@ static void object_property_del_all(Object *obj)
         g_free(prop->type);
         g_free(prop);
     }
+
+    if (obj->property_hash) {
+        g_hash_table_destroy(obj->property_hash);
+        obj->property_hash = NULL;
+    }
 }
 
 static void object_property_del_child(Object *obj, Object *child, Error **errp)
@@ -454,16 +465,7 @@ Object *object_dynamic_cast_assert(Object *obj, const char *typename,
                                      typename, file, line, func);
 
 #ifdef CONFIG_QOM_CAST_DEBUG
-    int i;
-    Object *inst;
-
-    for (i = 0; obj && i < OBJECT_CLASS_CAST_CACHE; i++) {
-        if (obj->class->cast_cache[i] == typename) {
-            goto out;
-        }
-    }
-
-    inst = object_dynamic_cast(obj, typename);
+    Object *inst = object_dynamic_cast(obj, typename);
 
     if (!inst && obj) {
         fprintf(stderr, "%s:%d:%s: Object %p is not an instance of type %s\n",
@@ -472,35 +474,29 @@ Object *object_dynamic_cast_assert(Object *obj, const char *typename,
     }
 
     assert(obj == inst);
-
-    if (obj && obj == inst) {
-        for (i = 1; i < OBJECT_CLASS_CAST_CACHE; i++) {
-            obj->class->cast_cache[i - 1] = obj->class->cast_cache[i];
-        }
-        obj->class->cast_cache[i - 1] = typename;
-    }
-
-out:
 #endif
     return obj;
 }
 
-ObjectClass *object_class_dynamic_cast(ObjectClass *class,
-                                       const char *typename)
+/* The cache is indexed by the address of the type name, which is what
+ * the cast macros pass, so a hit costs no string operation at all.  Only
+ * casts that return the class itself are remembered; interface casts
+ * return another class and always take the slow path.
+ *
+ * Casts can run outside the BQL, e.g. from dataplane threads.  Each slot
+ * is a single pointer, so a racing update at worst evicts another entry.
+ */
+static inline unsigned object_class_cast_slot(const char *typename)
+{
+    return ((uintptr_t)typename >> 3) & (OBJECT_CLASS_CAST_CACHE - 1);
+}
+
+static ObjectClass *object_class_dynamic_cast_slow(ObjectClass *class,
+                                                   const char *typename)
 {
     ObjectClass *ret = NULL;
     TypeImpl *target_type;
-    TypeImpl *type;
-
-    if (!class) {
-        return NULL;
-    }
-
-    /* A simple fast path that can trigger a lot for leaf classes.  */
-    type = class->type;
-    if (type->name == typename) {
-        return class;
-    }
+    TypeImpl *type = class->type;
 
     target_type = type_get_by_name(typename);
     if (!target_type) {
@@ -533,6 +529,34 @@ ObjectClass *object_class_dynamic_cast(ObjectClass *class,
     return ret;
 }
 
+ObjectClass *object_class_dynamic_cast(ObjectClass *class,
+                                       const char *typename)
+{
+    ObjectClass *ret;
+    unsigned slot;
+
+    if (!class) {
+        return NULL;
+    }
+
+    /* A simple fast path that can trigger a lot for leaf classes.  */
+    if (class->type->name == typename) {
+        return class;
+    }
+
+    slot = object_class_cast_slot(typename);
+    if (atomic_read(&class->cast_cache[slot]) == typename) {
+        return class;
+    }
+
+    ret = object_class_dynamic_cast_slow(class, typename);
+    if (ret == class) {
+        atomic_set(&class->cast_cache[slot], typename);
+    }
+
+    return ret;
+}
+
 ObjectClass *object_class_dynamic_cast_assert(ObjectClass *class,
                                               const char *typename,
                                               const char *file, int line,
@@ -543,16 +567,7 @@ ObjectClass *object_class_dynamic_cast_assert(ObjectClass *class,
     trace_object_class_dynamic_cast_assert(class ? class->type->name : "(null)",
                                            typename, file, line, func);
 
-#ifdef CONFIG_QOM_CAST_DEBUG
-    int i;
-
-    for (i = 0; class && i < OBJECT_CLASS_CAST_CACHE; i++) {
-        if (class->cast_cache[i] == typename) {
-            ret = class;
-            goto out;
-        }
-    }
-#else
+#ifndef CONFIG_QOM_CAST_DEBUG
     if (!class || !class->interfaces) {
         return class;
     }
@@ -565,15 +580,6 @@ ObjectClass *object_class_dynamic_cast_assert(ObjectClass *class,
         abort();
     }
 
-#ifdef CONFIG_QOM_CAST_DEBUG
-    if (class && ret == class) {
-        for (i = 1; i < OBJECT_CLASS_CAST_CACHE; i++) {
-            class->cast_cache[i - 1] = class->cast_cache[i];
-        }
-        class->cast_cache[i - 1] = typename;
-    }
-out:
-#endif
     return ret;
 }
 
@@ -719,13 +725,11 @@ void object_property_add(Object *obj, const char *name, const char *type,
 {
     ObjectProperty *prop;
 
-    QTAILQ_FOREACH(prop, &obj->properties, node) {
-        if (strcmp(prop->name, name) == 0) {
-            error_setg(errp, "attempt to add duplicate property '%s'"
-                       " to object (type '%s')", name,
-                       object_get_typename(obj));
-            return;
-        }
+    if (object_property_find(obj, name, NULL)) {
+        error_setg(errp, "attempt to add duplicate property '%s'"
+                   " to object (type '%s')", name,
+                   object_get_typename(obj));
+        return;
     }
 
     prop = g_malloc0(sizeof(*prop));
@@ -739,15 +743,46 @@ void object_property_add(Object *obj, const char *name, const char *type,
     prop->opaque = opaque;
 
     QTAILQ_INSERT_TAIL(&obj->properties, prop, node);
+    if (obj->property_hash) {
+        g_hash_table_insert(obj->property_hash, prop->name, prop);
+    }
+}
+
+static void object_property_hash_init(Object *obj)
+{
+    ObjectProperty *prop;
+
+    obj->property_hash = g_hash_table_new(g_str_hash, g_str_equal);
+    QTAILQ_FOREACH(prop, &obj->properties, node) {
+        g_hash_table_insert(obj->property_hash, prop->name, prop);
+    }
 }
 
+/* Devices can have dozens of properties, and property lookups by name
+ * are frequent.  The list keeps the order for enumeration; past a few
+ * entries, lookups go through a hash table built on first use.
+ */
 ObjectProperty *object_property_find(Object *obj, const char *name,
                                      Error **errp)
 {
     ObjectProperty *prop;
+    int n = 0;
 
-    QTAILQ_FOREACH(prop, &obj->properties, node) {
-        if (strcmp(prop->name, name) == 0) {
+    if (!obj->property_hash) {
+        QTAILQ_FOREACH(prop, &obj->properties, node) {
+            if (strcmp(prop->name, name) == 0) {
+                return prop;
+            }
+            if (++n == OBJECT_PROPERTY_HASH_MIN) {
+                object_property_hash_init(obj);
+                break;
+            }
+        }
+    }
+
+    if (obj->property_hash) {
+        prop = g_hash_table_lookup(obj->property_hash, name);
+        if (prop) {
             return prop;
         }
     }
@@ -768,6 +803,9 @@ void object_property_del(Object *obj, const char *name, Error **errp)
     }
 
     QTAILQ_REMOVE(&obj->properties, prop, node);
+    if (obj->property_hash) {
+        g_hash_table_remove(obj->property_hash, prop->name);
+    }
 
     g_free(prop->name);
     g_free(prop->type);
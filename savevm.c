@@ -32,16 +32,22 @@
 #include "qemu/timer.h"
 #include "audio/audio.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
 #include "qemu/sockets.h"
 #include "qemu/queue.h"
 #include "sysemu/cpus.h"
 #include "exec/memory.h"
 #include "qmp-commands.h"
 #include "trace.h"
+#include "qemu/atomic.h"
 #include "qemu/bitops.h"
 #include "qemu/iov.h"
 #include "block/snapshot.h"
 #include "block/qapi.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qapi/qmp/qerror.h"
 
 #define SELF_ANNOUNCE_ROUNDS 5
 
@@ -115,9 +121,6 @@ void qemu_announce_self(void)
 /***********************************************************/
 /* savevm/loadvm support */
 
-#define IO_BUF_SIZE 32768
-#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
-
 struct QEMUFile {
     const QEMUFileOps *ops;
     void *opaque;
@@ -129,10 +132,12 @@ struct QEMUFile {
                     when reading */
     int buf_index;
     int buf_size; /* 0 when writing */
-    uint8_t buf[IO_BUF_SIZE];
+    int buf_max;
+    uint8_t *buf;
 
-    struct iovec iov[MAX_IOV_SIZE];
+    struct iovec *iov;
     unsigned int iovcnt;
+    unsigned int iov_max;
 
     int last_error;
 };
@@ -480,6 +485,72 @@ QEMUFile *qemu_fopen_socket(int fd, const char *mode)
     return s->file;
 }
 
+/* In-memory QEMUFile, used to package part of the migration stream so that
+ * the destination can read it in one go.  The caller owns @data.
+ */
+typedef struct QEMUFileBuffer {
+    GByteArray *data;
+    size_t pos;
+} QEMUFileBuffer;
+
+static ssize_t buffer_writev_buffer(void *opaque, struct iovec *iov,
+                                    int iovcnt, int64_t pos)
+{
+    QEMUFileBuffer *s = opaque;
+    ssize_t size = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        g_byte_array_append(s->data, iov[i].iov_base, iov[i].iov_len);
+        size += iov[i].iov_len;
+    }
+    return size;
+}
+
+static int buffer_get_buffer(void *opaque, uint8_t *buf, int64_t pos,
+                             int size)
+{
+    QEMUFileBuffer *s = opaque;
+    size_t len = MIN(size, s->data->len - s->pos);
+
+    memcpy(buf, s->data->data + s->pos, len);
+    s->pos += len;
+    return len;
+}
+
+static int buffer_close(void *opaque)
+{
+    g_free(opaque);
+    return 0;
+}
+
+static const QEMUFileOps buffer_read_ops = {
+    .get_buffer = buffer_get_buffer,
+    .close =      buffer_close
+};
+
+static const QEMUFileOps buffer_write_ops = {
+    .writev_buffer = buffer_writev_buffer,
+    .close =         buffer_close
+};
+
+static QEMUFile *qemu_fopen_buffer(GByteArray *data, const char *mode)
+{
+    QEMUFileBuffer *s;
+
+    if (qemu_file_mode_is_not_valid(mode)) {
+        return NULL;
+    }
+
+    s = g_malloc0(sizeof(QEMUFileBuffer));
+    s->data = data;
+    if (mode[0] == 'w') {
+        return qemu_fopen_ops(s, &buffer_write_ops);
+    } else {
+        return qemu_fopen_ops(s, &buffer_read_ops);
+    }
+}
+
 QEMUFile *qemu_fopen(const char *filename, const char *mode)
 {
     QEMUFileStdio *s;
@@ -563,9 +634,35 @@ QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 
     f->opaque = opaque;
     f->ops = ops;
+    f->buf_max = QEMU_FILE_BUF_SIZE;
+    f->buf = g_malloc(f->buf_max);
+    f->iov_max = QEMU_FILE_IOV_MAX;
+    f->iov = g_new(struct iovec, f->iov_max);
     return f;
 }
 
+/*
+ * Resize the buffer and the iovec array of f.  Pending writes are flushed
+ * first; a file being read must not have buffered anything yet.
+ */
+void qemu_file_set_buffer_size(QEMUFile *f, int buf_size, int iov_max)
+{
+    qemu_fflush(f);
+    assert(f->buf_index == 0 && f->buf_size == 0 && f->iovcnt == 0);
+    assert(buf_size >= QEMU_FILE_BUF_SIZE_MIN && iov_max >= 1);
+
+    if (buf_size != f->buf_max) {
+        g_free(f->buf);
+        f->buf_max = buf_size;
+        f->buf = g_malloc(f->buf_max);
+    }
+    if (iov_max != f->iov_max) {
+        g_free(f->iov);
+        f->iov_max = iov_max;
+        f->iov = g_new(struct iovec, f->iov_max);
+    }
+}
+
 /*
  * Get last error for stream f
  *
@@ -578,7 +675,7 @@ int qemu_file_get_error(QEMUFile *f)
     return f->last_error;
 }
 
-static void qemu_file_set_error(QEMUFile *f, int ret)
+void qemu_file_set_error(QEMUFile *f, int ret)
 {
     if (f->last_error == 0) {
         f->last_error = ret;
@@ -697,7 +794,7 @@ static void qemu_fill_buffer(QEMUFile *f)
     f->buf_size = pending;
 
     len = f->ops->get_buffer(f->opaque, f->buf + pending, f->pos,
-                        IO_BUF_SIZE - pending);
+                        f->buf_max - pending);
     if (len > 0) {
         f->buf_size += len;
         f->pos += len;
@@ -746,6 +843,8 @@ int qemu_fclose(QEMUFile *f)
     if (f->last_error) {
         ret = f->last_error;
     }
+    g_free(f->buf);
+    g_free(f->iov);
     g_free(f);
     return ret;
 }
@@ -761,7 +860,7 @@ static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size)
         f->iov[f->iovcnt++].iov_len = size;
     }
 
-    if (f->iovcnt >= MAX_IOV_SIZE) {
+    if (f->iovcnt >= f->iov_max) {
         qemu_fflush(f);
     }
 }
@@ -789,8 +888,19 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
         return;
     }
 
+    /* Large buffers are not worth copying when the backend takes an
+     * iovec.  The caller may reuse buf as soon as we return, so send it
+     * right away.
+     */
+    if (f->ops->writev_buffer && size >= f->buf_max / 2) {
+        f->bytes_xfer += size;
+        add_to_iovec(f, buf, size);
+        qemu_fflush(f);
+        return;
+    }
+
     while (size > 0) {
-        l = IO_BUF_SIZE - f->buf_index;
+        l = f->buf_max - f->buf_index;
         if (l > size)
             l = size;
         memcpy(f->buf + f->buf_index, buf, l);
@@ -799,7 +909,7 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
             add_to_iovec(f, f->buf + f->buf_index, l);
         }
         f->buf_index += l;
-        if (f->buf_index == IO_BUF_SIZE) {
+        if (f->buf_index == f->buf_max) {
             qemu_fflush(f);
         }
         if (qemu_file_get_error(f)) {
@@ -822,7 +932,7 @@ void qemu_put_byte(QEMUFile *f, int v)
         add_to_iovec(f, f->buf + f->buf_index, 1);
     }
     f->buf_index++;
-    if (f->buf_index == IO_BUF_SIZE) {
+    if (f->buf_index == f->buf_max) {
         qemu_fflush(f);
     }
 }
@@ -860,6 +970,31 @@ static int qemu_peek_buffer(QEMUFile *f, uint8_t *buf, int size, size_t offset)
     return size;
 }
 
+/*
+ * Once the buffered data has been consumed, read what is left of a large
+ * request straight into the destination instead of through f->buf.
+ */
+static int qemu_get_buffer_direct(QEMUFile *f, uint8_t *buf, int size)
+{
+    int len;
+
+    assert(f->buf_index == f->buf_size);
+    f->buf_index = 0;
+    f->buf_size = 0;
+
+    len = f->ops->get_buffer(f->opaque, buf, f->pos, size);
+    if (len > 0) {
+        f->pos += len;
+        return len;
+    }
+    if (len == 0) {
+        qemu_file_set_error(f, -EIO);
+    } else if (len != -EAGAIN) {
+        qemu_file_set_error(f, len);
+    }
+    return 0;
+}
+
 int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size)
 {
     int pending = size;
@@ -868,11 +1003,15 @@ int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size)
     while (pending > 0) {
         int res;
 
-        res = qemu_peek_buffer(f, buf, pending, 0);
+        if (pending >= f->buf_max / 2 && f->buf_index == f->buf_size) {
+            res = qemu_get_buffer_direct(f, buf, pending);
+        } else {
+            res = qemu_peek_buffer(f, buf, pending, 0);
+            qemu_file_skip(f, res);
+        }
         if (res == 0) {
             return done;
         }
-        qemu_file_skip(f, res);
         buf += res;
         pending -= res;
         done += res;
@@ -937,6 +1076,14 @@ void qemu_file_reset_rate_limit(QEMUFile *f)
     f->bytes_xfer = 0;
 }
 
+/* Account for data that was sent on behalf of @f through another channel,
+ * so that rate limiting still covers it.
+ */
+void qemu_file_update_transfer(QEMUFile *f, int64_t len)
+{
+    f->bytes_xfer += len;
+}
+
 void qemu_put_be16(QEMUFile *f, unsigned int v)
 {
     qemu_put_byte(f, v >> 8);
@@ -1475,6 +1622,9 @@ typedef struct SaveStateEntry {
     CompatEntry *compat;
     int no_migrate;
     int is_ram;
+    /* Section serialized ahead of time by a savevm_parallel thread */
+    GByteArray *parallel_blob;
+    int parallel_error;
 } SaveStateEntry;
 
 
@@ -1831,6 +1981,65 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_COMMAND              0x08
+
+/* Commands embedded in the stream with QEMU_VM_COMMAND */
+enum qemu_vm_cmd {
+    MIG_CMD_INVALID = 0,
+    MIG_CMD_POSTCOPY_ADVISE,      /* Prior to any page transfers, just
+                                     warn we might want to do postcopy */
+    MIG_CMD_POSTCOPY_LISTEN,      /* Start listening for page requests */
+    MIG_CMD_POSTCOPY_RUN,         /* Start execution */
+    MIG_CMD_POSTCOPY_RAM_DISCARD, /* A list of pages to discard that
+                                     were previously sent during
+                                     precopy but are dirty */
+    MIG_CMD_PACKAGED,             /* Send a wrapped stream within this stream */
+};
+
+/* Upper bound for the device state sent in a MIG_CMD_PACKAGED */
+#define MAX_VM_CMD_PACKAGED_SIZE (1ul << 28)
+
+/* qemu_loadvm_state_main has handed the stream over to postcopy */
+#define LOADVM_QUIT 1
+
+static void qemu_savevm_command_send(QEMUFile *f, enum qemu_vm_cmd command,
+                                     uint16_t len, const uint8_t *data)
+{
+    trace_savevm_command_send(command, len);
+    qemu_put_byte(f, QEMU_VM_COMMAND);
+    qemu_put_be16(f, command);
+    qemu_put_be16(f, len);
+    if (len) {
+        qemu_put_buffer(f, data, len);
+    }
+    qemu_fflush(f);
+}
+
+/* Tell the destination which pages, already sent during precopy, have been
+ * dirtied since and must be dropped.  @nranges pairs of page-aligned start
+ * and length in bytes, within the RAMBlock @name.
+ */
+void qemu_savevm_send_postcopy_ram_discard(QEMUFile *f, const char *name,
+                                           uint16_t nranges,
+                                           uint64_t *start_list,
+                                           uint64_t *length_list)
+{
+    size_t name_len = strlen(name);
+    size_t len = 1 + name_len + nranges * 16;
+    uint8_t *buf;
+    int i;
+
+    assert(len <= UINT16_MAX);
+    buf = g_malloc(len);
+    buf[0] = name_len;
+    memcpy(buf + 1, name, name_len);
+    for (i = 0; i < nranges; i++) {
+        stq_be_p(buf + 1 + name_len + i * 16, start_list[i]);
+        stq_be_p(buf + 1 + name_len + i * 16 + 8, length_list[i]);
+    }
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RAM_DISCARD, len, buf);
+    g_free(buf);
+}
 
 bool qemu_savevm_state_blocked(Error **errp)
 {
@@ -1861,6 +2070,10 @@ void qemu_savevm_state_begin(QEMUFile *f,
     qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
     qemu_put_be32(f, QEMU_VM_FILE_VERSION);
 
+    if (migrate_postcopy_ram()) {
+        qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_ADVISE, 0, NULL);
+    }
+
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
 
@@ -1901,6 +2114,7 @@ void qemu_savevm_state_begin(QEMUFile *f,
 int qemu_savevm_state_iterate(QEMUFile *f)
 {
     SaveStateEntry *se;
+    int64_t start;
     int ret = 1;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
@@ -1915,13 +2129,15 @@ int qemu_savevm_state_iterate(QEMUFile *f)
         if (qemu_file_rate_limit(f)) {
             return 0;
         }
-        trace_savevm_section_start();
+        trace_savevm_section_start(se->idstr, se->section_id);
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_PART);
         qemu_put_be32(f, se->section_id);
 
         ret = se->ops->save_live_iterate(f, se->opaque);
-        trace_savevm_section_end(se->section_id);
+        trace_savevm_section_end(se->idstr, se->section_id,
+            (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start) / 1000);
 
         if (ret < 0) {
             qemu_file_set_error(f, ret);
@@ -1937,13 +2153,12 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     return ret;
 }
 
-void qemu_savevm_state_complete(QEMUFile *f)
+static int qemu_savevm_state_complete_live(QEMUFile *f)
 {
     SaveStateEntry *se;
+    int64_t start;
     int ret;
 
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (!se->ops || !se->ops->save_live_complete) {
             continue;
@@ -1953,40 +2168,242 @@ void qemu_savevm_state_complete(QEMUFile *f)
                 continue;
             }
         }
-        trace_savevm_section_start();
+        trace_savevm_section_start(se->idstr, se->section_id);
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_END);
         qemu_put_be32(f, se->section_id);
 
         ret = se->ops->save_live_complete(f, se->opaque);
-        trace_savevm_section_end(se->section_id);
+        trace_savevm_section_end(se->idstr, se->section_id,
+            (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start) / 1000);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
-            return;
+            return ret;
         }
     }
 
+    return 0;
+}
+
+static void qemu_savevm_section_full(QEMUFile *f, SaveStateEntry *se)
+{
+    int64_t start;
+    int len;
+
+    trace_savevm_section_start(se->idstr, se->section_id);
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    /* Section type */
+    qemu_put_byte(f, QEMU_VM_SECTION_FULL);
+    qemu_put_be32(f, se->section_id);
+
+    /* ID string */
+    len = strlen(se->idstr);
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (uint8_t *)se->idstr, len);
+
+    qemu_put_be32(f, se->instance_id);
+    qemu_put_be32(f, se->version_id);
+
+    vmstate_save(f, se);
+    trace_savevm_section_end(se->idstr, se->section_id,
+        (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start) / 1000);
+}
+
+/*
+ * Devices whose VMStateDescription sets save_parallel are serialized into
+ * memory by a few worker threads, while the migration thread finishes the
+ * live sections (RAM) and the other devices.  The buffers are then copied
+ * into the stream at the place the section would have had anyway, so the
+ * destination sees the usual format.
+ */
+#define SAVEVM_PARALLEL_THREADS 4
+
+static struct {
+    SaveStateEntry **entries;
+    int nb_entries;
+    int next;
+    int nb_threads;
+    QemuThread threads[SAVEVM_PARALLEL_THREADS];
+} savevm_parallel;
+
+static void *savevm_parallel_thread(void *opaque)
+{
+    int i;
+
+    while ((i = atomic_fetch_inc(&savevm_parallel.next)) <
+           savevm_parallel.nb_entries) {
+        SaveStateEntry *se = savevm_parallel.entries[i];
+        QEMUFile *bf;
+
+        se->parallel_blob = g_byte_array_new();
+        bf = qemu_fopen_buffer(se->parallel_blob, "wb");
+        qemu_savevm_section_full(bf, se);
+        qemu_fflush(bf);
+        se->parallel_error = qemu_file_get_error(bf);
+        qemu_fclose(bf);
+    }
+
+    return NULL;
+}
+
+/* Must be called with the VM stopped; does nothing if no device opted in */
+static void qemu_savevm_parallel_start(void)
+{
+    SaveStateEntry *se;
+    int i;
+
+    assert(!savevm_parallel.entries);
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
-        int len;
+        if (se->vmsd && se->vmsd->save_parallel) {
+            savevm_parallel.nb_entries++;
+        }
+    }
+    if (!savevm_parallel.nb_entries) {
+        return;
+    }
+
+    savevm_parallel.entries = g_new(SaveStateEntry *,
+                                    savevm_parallel.nb_entries);
+    i = 0;
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (se->vmsd && se->vmsd->save_parallel) {
+            savevm_parallel.entries[i++] = se;
+        }
+    }
+
+    savevm_parallel.next = 0;
+    savevm_parallel.nb_threads = MIN(savevm_parallel.nb_entries,
+                                     SAVEVM_PARALLEL_THREADS);
+    trace_savevm_parallel_start(savevm_parallel.nb_entries,
+                                savevm_parallel.nb_threads);
+    for (i = 0; i < savevm_parallel.nb_threads; i++) {
+        qemu_thread_create(&savevm_parallel.threads[i],
+                           savevm_parallel_thread, NULL,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void qemu_savevm_parallel_wait(void)
+{
+    int64_t start;
+    int i;
+
+    if (!savevm_parallel.nb_threads) {
+        return;
+    }
+
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    for (i = 0; i < savevm_parallel.nb_threads; i++) {
+        qemu_thread_join(&savevm_parallel.threads[i]);
+    }
+    savevm_parallel.nb_threads = 0;
+    trace_savevm_parallel_wait(
+        (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start) / 1000);
+}
 
+/* Wait for the workers and drop whatever they produced */
+static void qemu_savevm_parallel_finish(void)
+{
+    int i;
+
+    qemu_savevm_parallel_wait();
+    for (i = 0; i < savevm_parallel.nb_entries; i++) {
+        SaveStateEntry *se = savevm_parallel.entries[i];
+
+        if (se->parallel_blob) {
+            g_byte_array_free(se->parallel_blob, TRUE);
+            se->parallel_blob = NULL;
+        }
+        se->parallel_error = 0;
+    }
+    g_free(savevm_parallel.entries);
+    savevm_parallel.entries = NULL;
+    savevm_parallel.nb_entries = 0;
+}
+
+static void qemu_savevm_state_complete_devices(QEMUFile *f)
+{
+    SaveStateEntry *se;
+
+    if (!savevm_parallel.entries) {
+        qemu_savevm_parallel_start();
+    }
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
 	    continue;
         }
-        trace_savevm_section_start();
-        /* Section type */
-        qemu_put_byte(f, QEMU_VM_SECTION_FULL);
-        qemu_put_be32(f, se->section_id);
+        if (se->vmsd && se->vmsd->save_parallel) {
+            qemu_savevm_parallel_wait();
+            if (se->parallel_error) {
+                qemu_file_set_error(f, se->parallel_error);
+                break;
+            }
+            qemu_put_buffer(f, se->parallel_blob->data,
+                            se->parallel_blob->len);
+            continue;
+        }
+        qemu_savevm_section_full(f, se);
+    }
 
-        /* ID string */
-        len = strlen(se->idstr);
-        qemu_put_byte(f, len);
-        qemu_put_buffer(f, (uint8_t *)se->idstr, len);
+    qemu_savevm_parallel_finish();
+}
 
-        qemu_put_be32(f, se->instance_id);
-        qemu_put_be32(f, se->version_id);
+void qemu_savevm_state_complete(QEMUFile *f)
+{
+    cpu_synchronize_all_states();
 
-        vmstate_save(f, se);
-        trace_savevm_section_end(se->section_id);
+    /* Opted-in devices are serialized while RAM is being finished */
+    qemu_savevm_parallel_start();
+    if (qemu_savevm_state_complete_live(f) < 0) {
+        qemu_savevm_parallel_finish();
+        return;
+    }
+    qemu_savevm_state_complete_devices(f);
+
+    qemu_put_byte(f, QEMU_VM_EOF);
+    qemu_fflush(f);
+}
+
+/* Switch to postcopy: send the device state, packaged so that the
+ * destination can load it while the rest of the stream keeps flowing
+ * into RAM, together with the commands to start listening for page
+ * requests and to run the guest.  Must be called with the VM stopped.
+ */
+void qemu_savevm_state_postcopy_start(QEMUFile *f)
+{
+    GByteArray *blob = g_byte_array_new();
+    QEMUFile *bf = qemu_fopen_buffer(blob, "wb");
+    uint8_t len[4];
+
+    cpu_synchronize_all_states();
+
+    qemu_savevm_command_send(bf, MIG_CMD_POSTCOPY_LISTEN, 0, NULL);
+    qemu_savevm_state_complete_devices(bf);
+    qemu_savevm_command_send(bf, MIG_CMD_POSTCOPY_RUN, 0, NULL);
+    qemu_fflush(bf);
+
+    if (qemu_file_get_error(bf)) {
+        qemu_file_set_error(f, qemu_file_get_error(bf));
+    } else {
+        stl_be_p(len, blob->len);
+        qemu_savevm_command_send(f, MIG_CMD_PACKAGED, sizeof(len), len);
+        qemu_put_buffer(f, blob->data, blob->len);
+        qemu_fflush(f);
+    }
+
+    qemu_fclose(bf);
+    g_byte_array_free(blob, TRUE);
+}
+
+/* Finish a postcopy migration once all the RAM has been sent; the device
+ * state went in qemu_savevm_state_postcopy_start.
+ */
+void qemu_savevm_state_complete_postcopy(QEMUFile *f)
+{
+    if (qemu_savevm_state_complete_live(f) < 0) {
+        return;
     }
 
     qemu_put_byte(f, QEMU_VM_EOF);
@@ -2195,12 +2612,202 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
-int qemu_loadvm_state(QEMUFile *f)
+typedef QLIST_HEAD(, LoadStateEntry) LoadStateEntry_Head;
+
+/* The incoming stream being loaded by qemu_loadvm_state; the postcopy
+ * listen thread takes it over once the guest runs on this side.
+ */
+static struct {
+    QEMUFile *f;
+    LoadStateEntry_Head *handlers;
+    bool handed_off;
+} loadvm_incoming;
+
+static int qemu_loadvm_state_main(QEMUFile *f,
+                                  LoadStateEntry_Head *loadvm_handlers);
+
+static void loadvm_free_handlers(LoadStateEntry_Head *loadvm_handlers)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
     LoadStateEntry *le, *new_le;
-    uint8_t section_type;
+
+    QLIST_FOREACH_SAFE(le, loadvm_handlers, entry, new_le) {
+        QLIST_REMOVE(le, entry);
+        g_free(le);
+    }
+    g_free(loadvm_handlers);
+}
+
+static void *postcopy_ram_listen_thread(void *opaque)
+{
+    QEMUFile *f = loadvm_incoming.f;
+    LoadStateEntry_Head *loadvm_handlers = loadvm_incoming.handlers;
+    int ret;
+
+    rcu_register_thread();
+
+    ret = qemu_loadvm_state_main(f, loadvm_handlers);
+    if (ret == 0) {
+        ret = qemu_file_get_error(f);
+    }
+    if (ret < 0) {
+        /* The guest already runs here, there is nothing to go back to */
+        error_report("postcopy: failed to load the remaining RAM: %s",
+                     strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    postcopy_ram_incoming_cleanup();
+    loadvm_free_handlers(loadvm_handlers);
+    qemu_fclose(f);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static int loadvm_postcopy_handle_listen(QEMUFile *f)
+{
+    QEMUFile *rp;
+    QemuThread thread;
+    int fd = qemu_get_fd(loadvm_incoming.f);
+
+    trace_loadvm_postcopy_listen();
+
+    /* LISTEN only makes sense from within the packaged device state,
+     * while the main stream is still ours.
+     */
+    if (f == loadvm_incoming.f || loadvm_incoming.handed_off || fd == -1) {
+        error_report("postcopy: unexpected LISTEN command");
+        return -EINVAL;
+    }
+
+    /* From now on the main stream is read by a thread of its own */
+    qemu_set_block(fd);
+    rp = qemu_fopen_socket(dup(fd), "wb");
+    if (!rp || postcopy_ram_incoming_setup(rp) < 0) {
+        if (rp) {
+            qemu_fclose(rp);
+        }
+        return -EINVAL;
+    }
+
+    loadvm_incoming.handed_off = true;
+    qemu_thread_create(&thread, postcopy_ram_listen_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+    return 0;
+}
+
+static int loadvm_handle_cmd_packaged(QEMUFile *f, uint32_t length)
+{
+    LoadStateEntry_Head *loadvm_handlers;
+    GByteArray *blob;
+    QEMUFile *bf;
+    int ret;
+
+    if (length > MAX_VM_CMD_PACKAGED_SIZE) {
+        error_report("postcopy: unreasonably large packaged state: %u",
+                     length);
+        return -EINVAL;
+    }
+
+    blob = g_byte_array_sized_new(length);
+    g_byte_array_set_size(blob, length);
+    if (qemu_get_buffer(f, blob->data, length) != length) {
+        g_byte_array_free(blob, TRUE);
+        return -EINVAL;
+    }
+
+    loadvm_handlers = g_malloc0(sizeof(*loadvm_handlers));
+    QLIST_INIT(loadvm_handlers);
+    bf = qemu_fopen_buffer(blob, "rb");
+    ret = qemu_loadvm_state_main(bf, loadvm_handlers);
+    qemu_fclose(bf);
+    loadvm_free_handlers(loadvm_handlers);
+    g_byte_array_free(blob, TRUE);
+
+    return ret;
+}
+
+static int loadvm_process_command(QEMUFile *f)
+{
+    uint16_t cmd = qemu_get_be16(f);
+    uint16_t len = qemu_get_be16(f);
+    uint8_t *buf = NULL;
+    int ret = 0;
+    int i;
+
+    trace_loadvm_process_command(cmd, len);
+
+    if (len) {
+        buf = g_malloc(len);
+        qemu_get_buffer(f, buf, len);
+    }
+    if (qemu_file_get_error(f)) {
+        g_free(buf);
+        return qemu_file_get_error(f);
+    }
+
+    switch (cmd) {
+    case MIG_CMD_POSTCOPY_ADVISE:
+        if (!postcopy_ram_supported_by_host()) {
+            ret = -EINVAL;
+        }
+        break;
+
+    case MIG_CMD_POSTCOPY_RAM_DISCARD: {
+        char idstr[256];
+        uint8_t name_len;
+
+        if (!len || len < 1 + buf[0] || (len - 1 - buf[0]) % 16) {
+            error_report("postcopy: malformed discard command");
+            ret = -EINVAL;
+            break;
+        }
+        name_len = buf[0];
+        memcpy(idstr, buf + 1, name_len);
+        idstr[name_len] = 0;
+        for (i = 1 + name_len; i < len && ret == 0; i += 16) {
+            ret = postcopy_ram_discard_range(idstr, ldq_be_p(buf + i),
+                                             ldq_be_p(buf + i + 8));
+        }
+        break;
+    }
+
+    case MIG_CMD_POSTCOPY_LISTEN:
+        ret = loadvm_postcopy_handle_listen(f);
+        break;
+
+    case MIG_CMD_POSTCOPY_RUN:
+        trace_loadvm_postcopy_run();
+        if (!loadvm_incoming.handed_off) {
+            error_report("postcopy: RUN without LISTEN");
+            ret = -EINVAL;
+            break;
+        }
+        cpu_synchronize_all_post_init();
+        ret = LOADVM_QUIT;
+        break;
+
+    case MIG_CMD_PACKAGED:
+        if (len != 4) {
+            ret = -EINVAL;
+            break;
+        }
+        ret = loadvm_handle_cmd_packaged(f, ldl_be_p(buf));
+        break;
+
+    default:
+        error_report("Unknown migration command %u", cmd);
+        ret = -EINVAL;
+        break;
+    }
+
+    g_free(buf);
+    return ret;
+}
+
+int qemu_loadvm_state(QEMUFile *f)
+{
+    LoadStateEntry_Head *loadvm_handlers;
     unsigned int v;
     int ret;
 
@@ -2220,6 +2827,41 @@ int qemu_loadvm_state(QEMUFile *f)
     if (v != QEMU_VM_FILE_VERSION)
         return -ENOTSUP;
 
+    loadvm_handlers = g_malloc0(sizeof(*loadvm_handlers));
+    QLIST_INIT(loadvm_handlers);
+    loadvm_incoming.f = f;
+    loadvm_incoming.handlers = loadvm_handlers;
+    loadvm_incoming.handed_off = false;
+
+    ret = qemu_loadvm_state_main(f, loadvm_handlers);
+    if (ret == LOADVM_QUIT) {
+        /* The listen thread owns @f and the handlers from now on */
+        return LOADVM_POSTCOPY_RUNNING;
+    }
+
+    if (ret == 0) {
+        cpu_synchronize_all_post_init();
+    }
+
+    loadvm_free_handlers(loadvm_handlers);
+    loadvm_incoming.f = NULL;
+    loadvm_incoming.handlers = NULL;
+
+    if (ret == 0) {
+        ret = qemu_file_get_error(f);
+    }
+
+    return ret;
+}
+
+static int qemu_loadvm_state_main(QEMUFile *f,
+                                  LoadStateEntry_Head *loadvm_handlers)
+{
+    LoadStateEntry *le;
+    uint8_t section_type;
+    int64_t start;
+    int ret;
+
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
         SaveStateEntry *se;
@@ -2259,20 +2901,24 @@ int qemu_loadvm_state(QEMUFile *f)
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            QLIST_INSERT_HEAD(loadvm_handlers, le, entry);
 
+            trace_loadvm_section_start(idstr, section_id);
+            start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
                 goto out;
             }
+            trace_loadvm_section_end(idstr, section_id,
+                (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start) / 1000);
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
             section_id = qemu_get_be32(f);
 
-            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+            QLIST_FOREACH(le, loadvm_handlers, entry) {
                 if (le->section_id == section_id) {
                     break;
                 }
@@ -2283,34 +2929,39 @@ int qemu_loadvm_state(QEMUFile *f)
                 goto out;
             }
 
+            trace_loadvm_section_start(le->se->idstr, section_id);
+            start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
                 goto out;
             }
+            trace_loadvm_section_end(le->se->idstr, section_id,
+                (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start) / 1000);
+            break;
+        case QEMU_VM_COMMAND:
+            ret = loadvm_process_command(f);
+            if (ret != 0) {
+                /* Either an error or LOADVM_QUIT */
+                goto out;
+            }
             break;
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
             ret = -EINVAL;
             goto out;
         }
-    }
 
-    cpu_synchronize_all_post_init();
+        ret = qemu_file_get_error(f);
+        if (ret) {
+            goto out;
+        }
+    }
 
     ret = 0;
 
 out:
-    QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
-        QLIST_REMOVE(le, entry);
-        g_free(le);
-    }
-
-    if (ret == 0) {
-        ret = qemu_file_get_error(f);
-    }
-
     return ret;
 }
 
@@ -2328,7 +2979,7 @@ static BlockDriverState *find_vmstate_bs(void)
 /*
  * Deletes snapshots of a given name in all opened images.
  */
-static int del_existing_snapshots(Monitor *mon, const char *name)
+static int del_existing_snapshots(const char *name, Error **errp)
 {
     BlockDriverState *bs;
     QEMUSnapshotInfo sn1, *snapshot = &sn1;
@@ -2341,11 +2992,9 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
         {
             bdrv_snapshot_delete_by_id_or_name(bs, name, &err);
             if (error_is_set(&err)) {
-                monitor_printf(mon,
-                               "Error while deleting snapshot on device '%s':"
-                               " %s\n",
-                               bdrv_get_device_name(bs),
-                               error_get_pretty(err));
+                error_setg(errp, "Error while deleting snapshot on device "
+                           "'%s': %s", bdrv_get_device_name(bs),
+                           error_get_pretty(err));
                 error_free(err);
                 return -1;
             }
@@ -2355,19 +3004,14 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
     return 0;
 }
 
-void do_savevm(Monitor *mon, const QDict *qdict)
+/*
+ * Checks that every writable device can take a snapshot, and returns the
+ * device that will hold the VM state.
+ */
+static BlockDriverState *savevm_find_bs(Error **errp)
 {
-    BlockDriverState *bs, *bs1;
-    QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
-    int ret;
-    QEMUFile *f;
-    int saved_vm_running;
-    uint64_t vm_state_size;
-    qemu_timeval tv;
-    struct tm tm;
-    const char *name = qdict_get_try_str(qdict, "name");
+    BlockDriverState *bs;
 
-    /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
     while ((bs = bdrv_next(bs))) {
 
@@ -2376,20 +3020,25 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         }
 
         if (!bdrv_can_snapshot(bs)) {
-            monitor_printf(mon, "Device '%s' is writable but does not support snapshots.\n",
-                               bdrv_get_device_name(bs));
-            return;
+            error_setg(errp, "Device '%s' is writable but does not support "
+                       "snapshots.", bdrv_get_device_name(bs));
+            return NULL;
         }
     }
 
     bs = find_vmstate_bs();
     if (!bs) {
-        monitor_printf(mon, "No block device can accept snapshots\n");
-        return;
+        error_setg(errp, "No block device can accept snapshots");
     }
+    return bs;
+}
 
-    saved_vm_running = runstate_is_running();
-    vm_stop(RUN_STATE_SAVE_VM);
+static void savevm_init_snapshot(BlockDriverState *bs, QEMUSnapshotInfo *sn,
+                                 const char *name)
+{
+    QEMUSnapshotInfo old_sn1, *old_sn = &old_sn1;
+    qemu_timeval tv;
+    struct tm tm;
 
     memset(sn, 0, sizeof(*sn));
 
@@ -2400,8 +3049,7 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     sn->vm_clock_nsec = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
 
     if (name) {
-        ret = bdrv_snapshot_find(bs, old_sn, name);
-        if (ret >= 0) {
+        if (bdrv_snapshot_find(bs, old_sn, name) >= 0) {
             pstrcpy(sn->name, sizeof(sn->name), old_sn->name);
             pstrcpy(sn->id_str, sizeof(sn->id_str), old_sn->id_str);
         } else {
@@ -2412,9 +3060,283 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         localtime_r((const time_t *)&tv.tv_sec, &tm);
         strftime(sn->name, sizeof(sn->name), "vm-%Y%m%d%H%M%S", &tm);
     }
+}
+
+/*
+ * Creates the snapshot on every device; only the device that holds the VM
+ * state gets its size.  Returns the number of devices that failed.
+ */
+static int savevm_create_snapshots(BlockDriverState *bs, QEMUSnapshotInfo *sn,
+                                   uint64_t vm_state_size, Monitor *mon)
+{
+    BlockDriverState *bs1;
+    int ret, failed = 0;
+
+    bs1 = NULL;
+    while ((bs1 = bdrv_next(bs1))) {
+        if (bdrv_can_snapshot(bs1)) {
+            /* Write VM state size only to the image that contains the state */
+            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
+            ret = bdrv_snapshot_create(bs1, sn);
+            if (ret < 0) {
+                failed++;
+                if (mon) {
+                    monitor_printf(mon, "Error while creating snapshot on "
+                                   "'%s'\n", bdrv_get_device_name(bs1));
+                }
+            }
+        }
+    }
+    return failed;
+}
+
+/*
+ * Live savevm: the RAM is copied to the VM state area with the migration
+ * machinery while the guest keeps running.  The guest is only stopped for
+ * the last pass and the device state, and the disk snapshots are taken
+ * right after that, so they match the saved RAM.
+ */
+typedef struct LiveSaveVMFile {
+    BlockDriverState *bs;
+    int64_t size;
+} LiveSaveVMFile;
+
+static struct {
+    SaveVMStatus status;
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn;
+    uint64_t vm_state_size;
+    char *error;
+    Notifier notifier;
+} live_savevm;
+
+/*
+ * The migration thread writes without the iothread lock, except for the
+ * final pass; the block layer still needs it.
+ */
+static ssize_t live_savevm_writev_buffer(void *opaque, struct iovec *iov,
+                                         int iovcnt, int64_t pos)
+{
+    LiveSaveVMFile *s = opaque;
+    bool locked = qemu_mutex_iothread_locked();
+    QEMUIOVector qiov;
+    int ret;
+
+    qemu_iovec_init_external(&qiov, iov, iovcnt);
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    ret = bdrv_writev_vmstate(s->bs, &qiov, pos);
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->size = MAX(s->size, pos + (int64_t)qiov.size);
+    return qiov.size;
+}
+
+static int live_savevm_put_buffer(void *opaque, const uint8_t *buf,
+                                  int64_t pos, int size)
+{
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = size };
+
+    return live_savevm_writev_buffer(opaque, &iov, 1, pos);
+}
+
+static int live_savevm_close(void *opaque)
+{
+    LiveSaveVMFile *s = opaque;
+    int ret;
+
+    /* Called from the main loop by the migration cleanup */
+    ret = bdrv_flush(s->bs);
+    live_savevm.vm_state_size = s->size;
+    g_free(s);
+    return ret;
+}
+
+static const QEMUFileOps live_savevm_write_ops = {
+    .put_buffer     = live_savevm_put_buffer,
+    .writev_buffer  = live_savevm_writev_buffer,
+    .close          = live_savevm_close
+};
+
+static void live_savevm_fail(const char *fmt, ...) GCC_FMT_ATTR(1, 2);
+
+static void live_savevm_fail(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    g_free(live_savevm.error);
+    live_savevm.error = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+    live_savevm.status = SAVE_VM_STATUS_FAILED;
+}
+
+static void live_savevm_state_changed(Notifier *notifier, void *data)
+{
+    MigrationState *s = data;
+
+    if (live_savevm.status != SAVE_VM_STATUS_ACTIVE || s->file) {
+        return;
+    }
+
+    if (migration_has_failed(s)) {
+        live_savevm_fail("Writing the VM state failed");
+    } else if (migration_has_finished(s)) {
+        if (savevm_create_snapshots(live_savevm.bs, &live_savevm.sn,
+                                    live_savevm.vm_state_size, NULL)) {
+            live_savevm_fail("Error while creating the disk snapshots");
+        } else {
+            live_savevm.status = SAVE_VM_STATUS_COMPLETED;
+        }
+        if (s->vm_was_running) {
+            vm_start();
+        }
+    } else {
+        return;
+    }
+
+    trace_savevm_live_end(live_savevm.status, live_savevm.vm_state_size);
+    remove_migration_state_change_notifier(&live_savevm.notifier);
+}
+
+void qmp_savevm_start(bool has_name, const char *name, Error **errp)
+{
+    BlockDriverState *bs;
+    Error *local_err = NULL;
+    LiveSaveVMFile *file;
+    QEMUFile *f;
+
+    if (migration_is_active(migrate_get_current())) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (qemu_savevm_state_blocked(errp)) {
+        return;
+    }
+
+    if (dirty_rate_measuring()) {
+        error_setg(errp, "a dirty rate measurement is in progress");
+        return;
+    }
+
+    /* These capabilities need a second channel or a peer that answers */
+    if (migrate_postcopy_ram() || migrate_use_multifd() ||
+        migrate_use_compression()) {
+        error_setg(errp, "savevm-start cannot be used with the "
+                   "x-postcopy-ram, x-multifd or compress capabilities");
+        return;
+    }
+
+    bs = savevm_find_bs(errp);
+    if (!bs) {
+        return;
+    }
+
+    if (has_name && del_existing_snapshots(name, &local_err) < 0) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    live_savevm.status = SAVE_VM_STATUS_ACTIVE;
+    live_savevm.bs = bs;
+    live_savevm.vm_state_size = 0;
+    g_free(live_savevm.error);
+    live_savevm.error = NULL;
+    savevm_init_snapshot(bs, &live_savevm.sn, has_name ? name : NULL);
+
+    file = g_new0(LiveSaveVMFile, 1);
+    file->bs = bs;
+    f = qemu_fopen_ops(file, &live_savevm_write_ops);
+
+    trace_savevm_live_start(live_savevm.sn.name);
+    live_savevm.notifier.notify = live_savevm_state_changed;
+    add_migration_state_change_notifier(&live_savevm.notifier);
+    migrate_start_outgoing_file(f);
+}
+
+SaveVMInfo *qmp_query_savevm(Error **errp)
+{
+    SaveVMInfo *info = g_malloc0(sizeof(*info));
+    MigrationInfo *mig;
+
+    info->status = live_savevm.status;
+    if (live_savevm.status == SAVE_VM_STATUS_NONE) {
+        return info;
+    }
+
+    info->has_name = true;
+    info->name = g_strdup(live_savevm.sn.name);
+
+    if (live_savevm.status == SAVE_VM_STATUS_ACTIVE) {
+        mig = qmp_query_migrate(NULL);
+        if (mig->has_ram) {
+            info->has_ram = true;
+            info->ram = mig->ram;
+            mig->has_ram = false;
+            mig->ram = NULL;
+        }
+        qapi_free_MigrationInfo(mig);
+    } else {
+        info->has_vm_state_size = true;
+        info->vm_state_size = live_savevm.vm_state_size;
+    }
+
+    if (live_savevm.error) {
+        info->has_error = true;
+        info->error = g_strdup(live_savevm.error);
+    }
+    return info;
+}
+
+void do_savevm(Monitor *mon, const QDict *qdict)
+{
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn1, *sn = &sn1;
+    int ret;
+    QEMUFile *f;
+    int saved_vm_running;
+    uint64_t vm_state_size;
+    const char *name = qdict_get_try_str(qdict, "name");
+    Error *err = NULL;
+
+    if (qdict_get_try_bool(qdict, "live", 0)) {
+        qmp_savevm_start(!!name, name, &err);
+        if (error_is_set(&err)) {
+            monitor_printf(mon, "%s\n", error_get_pretty(err));
+            error_free(err);
+        }
+        return;
+    }
+
+    bs = savevm_find_bs(&err);
+    if (!bs) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_SAVE_VM);
+
+    savevm_init_snapshot(bs, sn, name);
+
+    /* fill auxiliary fields */
+    qemu_gettimeofday(&tv);
+    sn->date_sec = tv.tv_sec;
+    sn->date_nsec = tv.tv_usec * 1000;
+    sn->vm_clock_nsec = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
 
     /* Delete old snapshots of the same name */
-    if (name && del_existing_snapshots(mon, name) < 0) {
+    if (name && del_existing_snapshots(name, &err) < 0) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
         goto the_end;
     }
 
@@ -2433,19 +3355,7 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     }
 
     /* create the snapshots */
-
-    bs1 = NULL;
-    while ((bs1 = bdrv_next(bs1))) {
-        if (bdrv_can_snapshot(bs1)) {
-            /* Write VM state size only to the image that contains the state */
-            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
-            ret = bdrv_snapshot_create(bs1, sn);
-            if (ret < 0) {
-                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
-                               bdrv_get_device_name(bs1));
-            }
-        }
-    }
+    savevm_create_snapshots(bs, sn, vm_state_size, mon);
 
  the_end:
     if (saved_vm_running)
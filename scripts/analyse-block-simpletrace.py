@@ -0,0 +1,122 @@
+#!/usr/bin/env python
+#
+# Print the timeline of each block layer AIO request in a simpletrace log
+#
+# Copyright (c) 2014 QEMU contributors
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+# Usage: ./analyse-block-simpletrace.py <trace-events> <trace-file>
+#
+# Enable at least the bdrv_co_aio_*, bdrv_tracked_request_* and
+# bdrv_co_io_em events; thread_pool_*, laio_* and virtio_blk_handle_*
+# events add the host I/O and the device model to the timeline.  Each
+# request is printed when its completion callback runs, one line per
+# event with the time since the previous event and since the start.
+
+import simpletrace
+
+def signed(value):
+    '''Trace records are unsigned 64-bit, turn them back into an int'''
+    if value >= 1 << 63:
+        return value - (1 << 64)
+    return value
+
+class Request(object):
+    def __init__(self, id, is_write):
+        self.id = id
+        self.is_write = is_write
+        self.events = []
+
+    def add(self, timestamp, what):
+        self.events.append((timestamp, what))
+
+    def dump(self):
+        start = self.events[0][0]
+        last = start
+        kind = self.is_write and 'write' or 'read'
+        print 'request %d (%s): %0.3f us' % \
+            (self.id, kind, (self.events[-1][0] - start) / 1000.0)
+        for timestamp, what in self.events:
+            print '  %10.3f %+10.3f  %s' % \
+                ((timestamp - start) / 1000.0, (timestamp - last) / 1000.0,
+                 what)
+            last = timestamp
+        print
+
+class BlockRequestTracker(simpletrace.Analyzer):
+    def __init__(self):
+        self.device = {}      # device request -> (timestamp, event)
+        self.by_acb = {}      # block layer AIOCB -> Request
+        self.by_co = {}       # coroutine running a request -> Request
+        self.by_tracked = {}  # tracked request id -> Request
+        self.by_host = {}     # host AIOCB or thread pool request -> Request
+
+    def virtio_blk_handle_read(self, timestamp, req, sector, nsectors):
+        self.device[req] = (timestamp, 'virtio_blk_handle_read')
+
+    def virtio_blk_handle_write(self, timestamp, req, sector, nsectors):
+        self.device[req] = (timestamp, 'virtio_blk_handle_write')
+
+    def bdrv_co_aio_start(self, timestamp, acb, id, co, opaque, is_write):
+        r = Request(id, is_write)
+        if opaque in self.device:
+            r.add(*self.device.pop(opaque))
+        r.add(timestamp, 'submit')
+        self.by_acb[acb] = r
+        self.by_co[co] = r
+
+    def bdrv_tracked_request_begin(self, timestamp, bs, id, co, sector_num,
+                                   nb_sectors, is_write):
+        r = self.by_co.get(co)
+        if r:
+            r.add(timestamp, 'begin bs=0x%x sector=%d count=%d' %
+                  (bs, sector_num, nb_sectors))
+            self.by_tracked[id] = r
+
+    def bdrv_tracked_request_end(self, timestamp, bs, id):
+        r = self.by_tracked.pop(id, None)
+        if r:
+            r.add(timestamp, 'end bs=0x%x' % bs)
+
+    def host_submit(self, timestamp, req, co, what):
+        r = self.by_co.get(co)
+        if r:
+            r.add(timestamp, what)
+            self.by_host[req] = r
+
+    def host_complete(self, timestamp, req, what):
+        r = self.by_host.pop(req, None)
+        if r:
+            r.add(timestamp, what)
+
+    def bdrv_co_io_em(self, timestamp, bs, sector_num, nb_sectors, is_write,
+                      acb, co):
+        self.host_submit(timestamp, acb, co, 'host submit bs=0x%x' % bs)
+
+    def thread_pool_submit_co(self, timestamp, pool, req, id, co):
+        self.host_submit(timestamp, req, co, 'thread pool submit')
+
+    def thread_pool_complete(self, timestamp, pool, req, opaque, ret):
+        self.host_complete(timestamp, req, 'thread pool complete ret=%d' %
+                           signed(ret))
+
+    def laio_complete(self, timestamp, acb, id, ret):
+        self.host_complete(timestamp, acb, 'linux-aio complete ret=%d' %
+                           signed(ret))
+
+    def bdrv_co_aio_done(self, timestamp, acb, id, ret):
+        r = self.by_acb.get(acb)
+        if r:
+            r.add(timestamp, 'done ret=%d' % signed(ret))
+            for co in [c for c in self.by_co if self.by_co[c] is r]:
+                del self.by_co[co]
+
+    def bdrv_co_aio_complete(self, timestamp, acb, id, ret):
+        r = self.by_acb.pop(acb, None)
+        if r:
+            r.add(timestamp, 'completion callback')
+            r.dump()
+
+simpletrace.run(BlockRequestTracker())
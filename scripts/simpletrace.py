@@ -53,11 +53,47 @@ def get_record(edict, rechdr, fobj):
     return rec
 
 
+def get_record_v3(edict, rechdr, fobj):
+    """Deserialize a version 3 trace record, whose length includes padding."""
+    if rechdr is None:
+        return None
+    payload = fobj.read(rechdr[2] - struct.calcsize(rec_header_fmt))
+    rec = (rechdr[0], rechdr[1])
+    if rechdr[0] != dropped_event_id:
+        args = edict[rechdr[0]].args
+    else:
+        args = [('uint64_t', 'num_events_dropped')]
+    off = 0
+    for type, name in args:
+        if is_string(type):
+            (len,) = struct.unpack_from('=L', payload, off)
+            rec = rec + (payload[off + 4:off + 4 + len],)
+            off += 4 + len
+        else:
+            (value,) = struct.unpack_from('=Q', payload, off)
+            rec = rec + (value,)
+            off += 8
+    return rec
+
 def read_record(edict, fobj):
     """Deserialize a trace record from a file into a tuple (event_num, timestamp, arg1, ..., arg6)."""
     rechdr = read_header(fobj, rec_header_fmt)
     return get_record(edict, rechdr, fobj) # return tuple of record elements
 
+def read_trace_records_v3(edict, fobj):
+    """Read the records of all threads and merge them by timestamp.
+
+    Each thread has its own trace buffer, and the buffers are written out one
+    after the other, so the file is only ordered within a thread."""
+    records = []
+    while True:
+        rec = get_record_v3(edict, read_header(fobj, rec_header_fmt), fobj)
+        if rec is None:
+            break
+        records.append(rec)
+    records.sort(key=lambda rec: rec[1])
+    return records
+
 def read_trace_file(edict, fobj):
     """Deserialize trace records from a file, yielding record tuples (event_num, timestamp, arg1, ..., arg6)."""
     header = read_header(fobj, log_header_fmt)
@@ -66,13 +102,19 @@ def read_trace_file(edict, fobj):
        header[1] != header_magic:
         raise ValueError('Not a valid trace file!')
     if header[2] != 0 and \
-       header[2] != 2:
+       header[2] != 2 and \
+       header[2] != 3:
         raise ValueError('Unknown version of tracelog format!')
 
     log_version = header[2]
     if log_version == 0:
         raise ValueError('Older log format, not supported with this QEMU release!')
 
+    if log_version == 3:
+        for rec in read_trace_records_v3(edict, fobj):
+            yield rec
+        return
+
     while True:
         rec = read_record(edict, fobj)
         if rec is None:
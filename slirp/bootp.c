@@ -280,6 +280,15 @@ static void bootp_reply(Slirp *slirp, const struct bootp_t *bp)
         memcpy(q, &val, 4);
         q += 4;
 
+        if (slirp->if_mtu != IF_MTU) {
+            uint16_t mtu = htons(slirp->if_mtu);
+
+            *q++ = RFC1533_INTMTU;
+            *q++ = 2;
+            memcpy(q, &mtu, 2);
+            q += 2;
+        }
+
         if (*slirp->client_hostname) {
             val = strlen(slirp->client_hostname);
             *q++ = RFC1533_HOSTNAME;
@@ -13,8 +13,8 @@
 #define IF_AUTOCOMP	0x04	/* Autodetect (default) */
 #define IF_NOCIDCOMP	0x08	/* CID compression */
 
+/* Default MTU, which is also used as the MRU */
 #define IF_MTU 1500
-#define IF_MRU 1500
 #define	IF_COMP IF_AUTOCOMP	/* Flags for compression */
 
 /* 2 for alignment, 14 for ethernet, 40 for TCP/IP */
@@ -6,6 +6,12 @@
 struct Slirp;
 typedef struct Slirp Slirp;
 
+/* Limits of the mtu, sndbuf and rcvbuf arguments of slirp_init() */
+#define SLIRP_MTU_MIN 576
+#define SLIRP_MTU_MAX 65521
+#define SLIRP_SOCKBUF_MIN 4096
+#define SLIRP_SOCKBUF_MAX (1024 * 1024)
+
 int get_dns_addr(struct in_addr *pdns_addr);
 
 Slirp *slirp_init(int restricted, struct in_addr vnetwork,
@@ -13,7 +19,7 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
                   const char *vhostname, const char *tftp_path,
                   const char *bootfile, struct in_addr vdhcp_start,
                   struct in_addr vnameserver, const char **vdnssearch,
-                  void *opaque);
+                  int mtu, int sndbuf, int rcvbuf, void *opaque);
 void slirp_cleanup(Slirp *slirp);
 
 void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout);
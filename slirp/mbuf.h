@@ -61,6 +61,12 @@
  * How much free room there is
  */
 #define M_FREEROOM(m) (M_ROOM(m) - (m)->m_len)
+
+/*
+ * How much room is in the mbuf in front of m_data
+ */
+#define M_HEADROOM(m) ((m)->m_data - \
+			(((m)->m_flags & M_EXT) ? (m)->m_ext : (m)->m_dat))
 #define M_TRAILINGSPACE M_FREEROOM
 
 struct mbuf {
@@ -204,13 +204,16 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
                   const char *vhostname, const char *tftp_path,
                   const char *bootfile, struct in_addr vdhcp_start,
                   struct in_addr vnameserver, const char **vdnssearch,
-                  void *opaque)
+                  int mtu, int sndbuf, int rcvbuf, void *opaque)
 {
     Slirp *slirp = g_malloc0(sizeof(Slirp));
 
     slirp_init_once();
 
     slirp->restricted = restricted;
+    slirp->if_mtu = mtu ? mtu : IF_MTU;
+    slirp->tcp_sndspace = sndbuf ? sndbuf : TCP_SNDSPACE;
+    slirp->tcp_rcvspace = rcvbuf ? rcvbuf : TCP_RCVSPACE;
 
     if_init(slirp);
     ip_init(slirp);
@@ -769,12 +772,11 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
  */
 int if_encap(Slirp *slirp, struct mbuf *ifm)
 {
-    uint8_t buf[1600];
-    struct ethhdr *eh = (struct ethhdr *)buf;
+    struct ethhdr *eh;
     uint8_t ethaddr[ETH_ALEN];
     const struct ip *iph = (const struct ip *)ifm->m_data;
 
-    if (ifm->m_len + ETH_HLEN > sizeof(buf)) {
+    if (ifm->m_len > slirp->if_mtu) {
         return 1;
     }
 
@@ -816,13 +818,27 @@ int if_encap(Slirp *slirp, struct mbuf *ifm)
         }
         return 0;
     } else {
+        uint8_t *buf = NULL;
+
+        /*
+         * Packets are built with IF_MAXLINKHDR bytes of headroom, so the
+         * ethernet header normally goes in front of the data without
+         * copying the packet.
+         */
+        if (M_HEADROOM(ifm) >= ETH_HLEN) {
+            eh = (struct ethhdr *)(ifm->m_data - ETH_HLEN);
+        } else {
+            buf = g_malloc(ifm->m_len + ETH_HLEN);
+            memcpy(buf + ETH_HLEN, ifm->m_data, ifm->m_len);
+            eh = (struct ethhdr *)buf;
+        }
         memcpy(eh->h_dest, ethaddr, ETH_ALEN);
         memcpy(eh->h_source, special_ethaddr, ETH_ALEN - 4);
         /* XXX: not correct */
         memcpy(&eh->h_source[2], &slirp->vhost_addr, 4);
         eh->h_proto = htons(ETH_P_IP);
-        memcpy(buf + sizeof(struct ethhdr), ifm->m_data, ifm->m_len);
-        slirp_output(slirp->opaque, buf, ifm->m_len + ETH_HLEN);
+        slirp_output(slirp->opaque, (uint8_t *)eh, ifm->m_len + ETH_HLEN);
+        g_free(buf);
         return 1;
     }
 }
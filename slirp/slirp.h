@@ -220,6 +220,11 @@ struct Slirp {
     int restricted;
     struct ex_list *exec_list;
 
+    /* link and socket buffer sizes */
+    int if_mtu;
+    int tcp_sndspace;
+    int tcp_rcvspace;
+
     /* mbuf states */
     struct mbuf m_freelist, m_usedlist;
     int mbuf_alloced;
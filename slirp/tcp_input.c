@@ -371,8 +371,8 @@ findso:
 	    goto dropwithreset;
 	  }
 
-	  sbreserve(&so->so_snd, TCP_SNDSPACE);
-	  sbreserve(&so->so_rcv, TCP_RCVSPACE);
+	  sbreserve(&so->so_snd, slirp->tcp_sndspace);
+	  sbreserve(&so->so_rcv, slirp->tcp_rcvspace);
 
 	  so->so_laddr = ti->ti_src;
 	  so->so_lport = ti->ti_sport;
@@ -1462,13 +1462,16 @@ int
 tcp_mss(struct tcpcb *tp, u_int offer)
 {
 	struct socket *so = tp->t_socket;
+	Slirp *slirp = so->slirp;
+	int sndspace = slirp->tcp_sndspace;
+	int rcvspace = slirp->tcp_rcvspace;
 	int mss;
 
 	DEBUG_CALL("tcp_mss");
 	DEBUG_ARG("tp = %lx", (long)tp);
 	DEBUG_ARG("offer = %d", offer);
 
-	mss = min(IF_MTU, IF_MRU) - sizeof(struct tcpiphdr);
+	mss = slirp->if_mtu - sizeof(struct tcpiphdr);
 	if (offer)
 		mss = min(mss, offer);
 	mss = max(mss, 32);
@@ -1477,12 +1480,10 @@ tcp_mss(struct tcpcb *tp, u_int offer)
 
 	tp->snd_cwnd = mss;
 
-	sbreserve(&so->so_snd, TCP_SNDSPACE + ((TCP_SNDSPACE % mss) ?
-                                               (mss - (TCP_SNDSPACE % mss)) :
-                                               0));
-	sbreserve(&so->so_rcv, TCP_RCVSPACE + ((TCP_RCVSPACE % mss) ?
-                                               (mss - (TCP_RCVSPACE % mss)) :
-                                               0));
+	sbreserve(&so->so_snd, sndspace + ((sndspace % mss) ?
+                                           (mss - (sndspace % mss)) : 0));
+	sbreserve(&so->so_rcv, rcvspace + ((rcvspace % mss) ?
+                                           (mss - (rcvspace % mss)) : 0));
 
 	DEBUG_MISC((dfd, " returning mss = %d\n", mss));
 
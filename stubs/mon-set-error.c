@@ -1,7 +1,7 @@
 #include "qemu-common.h"
 #include "monitor/monitor.h"
 
-Monitor *cur_mon;
+__thread Monitor *cur_mon;
 
 void monitor_set_error(Monitor *mon, QError *qerror)
 {
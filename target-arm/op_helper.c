@@ -85,6 +85,61 @@ void tlb_fill(CPUARMState *env, target_ulong addr, int is_write, int mmu_idx,
         raise_exception(env, env->exception_index);
     }
 }
+#else
+
+/* Fast path for STREX in user mode: do the store with a host
+   compare-and-swap on the value that LDREX loaded, without stopping the
+   other threads.  Return 0 or 1 for Rd, or 2 if the store must be left to
+   do_strex() in cpu_loop(), because the address is misaligned or its page
+   is not writable (including pages write protected because they hold
+   translated code).  exclusive_info has the same layout as there.  */
+uint32_t HELPER(strex)(CPUARMState *env, uint32_t addr)
+{
+    int size = env->exclusive_info & 0xf;
+    int nbytes = size == 3 ? 8 : 1 << size;
+    uint32_t val = env->regs[(env->exclusive_info >> 8) & 0xf];
+    union {
+        uint32_t w[2];
+        uint64_t d;
+    } old, new;
+    bool ok;
+
+    if (addr != env->exclusive_addr) {
+        return 1;
+    }
+    if ((addr & (nbytes - 1)) || !(page_get_flags(addr) & PAGE_WRITE)) {
+        return 2;
+    }
+
+    switch (size) {
+    case 0:
+        ok = __sync_bool_compare_and_swap((uint8_t *)g2h(addr),
+                                          (uint8_t)env->exclusive_val,
+                                          (uint8_t)val);
+        break;
+    case 1:
+        ok = __sync_bool_compare_and_swap((uint16_t *)g2h(addr),
+                                          tswap16(env->exclusive_val),
+                                          tswap16(val));
+        break;
+    case 2:
+        ok = __sync_bool_compare_and_swap((uint32_t *)g2h(addr),
+                                          tswap32(env->exclusive_val),
+                                          tswap32(val));
+        break;
+    case 3:
+        old.w[0] = tswap32(env->exclusive_val);
+        old.w[1] = tswap32(env->exclusive_high);
+        new.w[0] = tswap32(val);
+        new.w[1] = tswap32(env->regs[(env->exclusive_info >> 12) & 0xf]);
+        ok = __sync_bool_compare_and_swap((uint64_t *)g2h(addr),
+                                          old.d, new.d);
+        break;
+    default:
+        abort();
+    }
+    return !ok;
+}
 #endif
 
 uint32_t HELPER(add_setq)(CPUARMState *env, uint32_t a, uint32_t b)
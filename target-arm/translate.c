@@ -6761,10 +6761,30 @@ static void gen_clrex(DisasContext *s)
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
                                 TCGv_i32 addr, int size)
 {
+    TCGv_i32 tmp;
+    int slow_label;
+    int done_label;
+
+    /* Try the store with a compare-and-swap in helper_strex().  Only if
+       that cannot be done, exit to cpu_loop() which does it in an
+       exclusive section.  */
+    slow_label = gen_new_label();
+    done_label = gen_new_label();
     tcg_gen_mov_i32(cpu_exclusive_test, addr);
     tcg_gen_movi_i32(cpu_exclusive_info,
                      size | (rd << 4) | (rt << 8) | (rt2 << 12));
-    gen_exception_insn(s, 4, EXCP_STREX);
+    tmp = tcg_temp_local_new_i32();
+    gen_helper_strex(tmp, cpu_env, addr);
+    tcg_gen_brcondi_i32(TCG_COND_EQ, tmp, 2, slow_label);
+    tcg_gen_mov_i32(cpu_R[rd], tmp);
+    tcg_gen_movi_i32(cpu_exclusive_addr, -1);
+    tcg_gen_br(done_label);
+    gen_set_label(slow_label);
+    gen_set_condexec(s);
+    gen_set_pc_im(s, s->pc - 4);
+    gen_exception(EXCP_STREX);
+    gen_set_label(done_label);
+    tcg_temp_free_i32(tmp);
 }
 #else
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
@@ -10268,7 +10288,7 @@ static inline void gen_intermediate_code_internal(ARMCPU *cpu,
     if (max_insns == 0)
         max_insns = CF_COUNT_MASK;
 
-    gen_tb_start();
+    gen_tb_start(tb);
 
     tcg_clear_temp_count();
 
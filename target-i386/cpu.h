@@ -305,6 +305,10 @@
 #define MSR_TSC_ADJUST                  0x0000003b
 #define MSR_IA32_TSCDEADLINE            0x6e0
 
+/* KVM paravirtual EOI, also emulated for TCG guests */
+#define MSR_PV_EOI_EN                   0x4b564d04
+#define MSR_PV_EOI_EN_ENABLE            1
+
 #define MSR_P6_PERFCTR0                 0xc1
 
 #define MSR_MTRRcap                     0xfe
@@ -536,6 +540,12 @@ typedef uint32_t FeatureWordArray[FEATURE_WORDS];
 #define CPUID_SVM_PAUSEFILTER  (1 << 10)
 #define CPUID_SVM_PFTHRESHOLD  (1 << 12)
 
+#define CPUID_KVM_PV_EOI       (1 << 6)
+
+/* Hypervisor leaves for TCG guests with KVM paravirtual features */
+#define CPUID_KVM_SIGNATURE    0x40000000
+#define CPUID_KVM_FEATURES     0x40000001
+
 #define CPUID_7_0_EBX_FSGSBASE (1 << 0)
 #define CPUID_7_0_EBX_BMI1     (1 << 3)
 #define CPUID_7_0_EBX_HLE      (1 << 4)
@@ -288,6 +288,16 @@ void helper_wrmsr(CPUX86State *env)
     case MSR_IA32_APICBASE:
         cpu_set_apic_base(env->apic_state, val);
         break;
+    case MSR_IA32_TSCDEADLINE:
+        if (env->features[FEAT_1_ECX] & CPUID_EXT_TSC_DEADLINE_TIMER) {
+            cpu_set_apic_tsc_deadline(env->apic_state, val);
+        }
+        break;
+    case MSR_PV_EOI_EN:
+        if (env->features[FEAT_KVM] & CPUID_KVM_PV_EOI) {
+            env->pv_eoi_en_msr = val;
+        }
+        break;
     case MSR_EFER:
         {
             uint64_t update_mask;
@@ -439,6 +449,12 @@ void helper_rdmsr(CPUX86State *env)
     case MSR_IA32_APICBASE:
         val = cpu_get_apic_base(env->apic_state);
         break;
+    case MSR_IA32_TSCDEADLINE:
+        val = cpu_get_apic_tsc_deadline(env->apic_state);
+        break;
+    case MSR_PV_EOI_EN:
+        val = env->pv_eoi_en_msr;
+        break;
     case MSR_EFER:
         val = env->efer;
         break;
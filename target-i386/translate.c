@@ -3236,6 +3236,45 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0xdf] = AESNI_OP(aeskeygenassist),
 };
 
+static void gen_pandn_i64(TCGv_i64 ret, TCGv_i64 arg1, TCGv_i64 arg2)
+{
+    tcg_gen_andc_i64(ret, arg2, arg1);
+}
+
+/* Apply a lane-wise operation to the SIZE bytes at OP1_OFFSET and
+   OP2_OFFSET in env with inline 64 or 32 bit ops instead of a helper
+   call.  The lanes are independent, so their order in the host
+   representation of the register does not matter.  */
+static void gen_sse_op_i64(int op1_offset, int op2_offset, int size,
+                           void (*gen)(TCGv_i64, TCGv_i64, TCGv_i64))
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    int i;
+
+    for (i = 0; i < size; i += 8) {
+        tcg_gen_ld_i64(t0, cpu_env, op1_offset + i);
+        tcg_gen_ld_i64(t1, cpu_env, op2_offset + i);
+        gen(t0, t0, t1);
+        tcg_gen_st_i64(t0, cpu_env, op1_offset + i);
+    }
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+}
+
+static void gen_sse_op_i32(int op1_offset, int op2_offset, int size,
+                           void (*gen)(TCGv_i32, TCGv_i32, TCGv_i32))
+{
+    int i;
+
+    for (i = 0; i < size; i += 4) {
+        tcg_gen_ld_i32(cpu_tmp2_i32, cpu_env, op1_offset + i);
+        tcg_gen_ld_i32(cpu_tmp3_i32, cpu_env, op2_offset + i);
+        gen(cpu_tmp2_i32, cpu_tmp2_i32, cpu_tmp3_i32);
+        tcg_gen_st_i32(cpu_tmp2_i32, cpu_env, op1_offset + i);
+    }
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -4651,6 +4690,42 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt = (SSEFunc_0_eppt)sse_fn_epp;
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
+        case 0x54: /* andps, andpd */
+        case 0xdb: /* pand */
+            gen_sse_op_i64(op1_offset, op2_offset, is_xmm ? 16 : 8,
+                           tcg_gen_and_i64);
+            break;
+        case 0x55: /* andnps, andnpd */
+        case 0xdf: /* pandn */
+            gen_sse_op_i64(op1_offset, op2_offset, is_xmm ? 16 : 8,
+                           gen_pandn_i64);
+            break;
+        case 0x56: /* orps, orpd */
+        case 0xeb: /* por */
+            gen_sse_op_i64(op1_offset, op2_offset, is_xmm ? 16 : 8,
+                           tcg_gen_or_i64);
+            break;
+        case 0x57: /* xorps, xorpd */
+        case 0xef: /* pxor */
+            gen_sse_op_i64(op1_offset, op2_offset, is_xmm ? 16 : 8,
+                           tcg_gen_xor_i64);
+            break;
+        case 0xd4: /* paddq */
+            gen_sse_op_i64(op1_offset, op2_offset, is_xmm ? 16 : 8,
+                           tcg_gen_add_i64);
+            break;
+        case 0xfb: /* psubq */
+            gen_sse_op_i64(op1_offset, op2_offset, is_xmm ? 16 : 8,
+                           tcg_gen_sub_i64);
+            break;
+        case 0xfe: /* paddd */
+            gen_sse_op_i32(op1_offset, op2_offset, is_xmm ? 16 : 8,
+                           tcg_gen_add_i32);
+            break;
+        case 0xfa: /* psubd */
+            gen_sse_op_i32(op1_offset, op2_offset, is_xmm ? 16 : 8,
+                           tcg_gen_sub_i32);
+            break;
         default:
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
@@ -8358,7 +8433,7 @@ static inline void gen_intermediate_code_internal(X86CPU *cpu,
     if (max_insns == 0)
         max_insns = CF_COUNT_MASK;
 
-    gen_tb_start();
+    gen_tb_start(tb);
     for(;;) {
         if (unlikely(!QTAILQ_EMPTY(&env->breakpoints))) {
             QTAILQ_FOREACH(bp, &env->breakpoints, entry) {
@@ -409,6 +409,7 @@ SubchDev *css_find_subch(uint8_t m, uint8_t cssid, uint8_t ssid,
                          uint16_t schid);
 bool css_subch_visible(SubchDev *sch);
 void css_conditional_io_interrupt(SubchDev *sch);
+void css_adapter_interrupt(uint8_t isc);
 int css_do_stsch(SubchDev *sch, SCHIB *schib);
 bool css_schid_final(int m, uint8_t cssid, uint8_t ssid, uint16_t schid);
 int css_do_msch(SubchDev *sch, SCHIB *schib);
@@ -440,6 +441,9 @@ static inline bool css_subch_visible(SubchDev *sch)
 static inline void css_conditional_io_interrupt(SubchDev *sch)
 {
 }
+static inline void css_adapter_interrupt(uint8_t isc)
+{
+}
 static inline int css_do_stsch(SubchDev *sch, SCHIB *schib)
 {
     return -ENODEV;
@@ -454,6 +454,44 @@ static inline void tcg_out_arith(TCGContext *s, enum aarch64_arith_opc opc,
     tcg_out32(s, base | rm << 16 | shift | rn << 5 | rd);
 }
 
+/* logical operations on the complement of rm: BIC, ORN and EON */
+static inline void tcg_out_logicn(TCGContext *s, enum aarch64_arith_opc opc,
+                                  int ext, TCGReg rd, TCGReg rn, TCGReg rm)
+{
+    /* the arith encoding of AND, ORR and EOR with the N bit 1 << 21 */
+    unsigned int base = ext ? (0x80 | opc) << 24 : opc << 24;
+    assert(opc == ARITH_AND || opc == ARITH_OR || opc == ARITH_XOR);
+    tcg_out32(s, base | 1 << 21 | rm << 16 | rn << 5 | rd);
+}
+
+static inline void tcg_out_adc(TCGContext *s, int ext, bool sub,
+                               TCGReg rd, TCGReg rn, TCGReg rm)
+{
+    /* Using ADC 0x1a000000, SBC 0x5a000000 */
+    unsigned int base = sub ? 0x5a000000 : 0x1a000000;
+    if (ext) {
+        base |= 0x80000000;
+    }
+    tcg_out32(s, base | rm << 16 | rn << 5 | rd);
+}
+
+static void tcg_out_addsub2(TCGContext *s, int ext, bool sub,
+                            TCGReg rl, TCGReg rh, TCGReg al, TCGReg ah,
+                            TCGReg bl, TCGReg bh)
+{
+    TCGReg orig_rl = rl;
+
+    /* the low half is written first, it must not clobber ah or bh */
+    if (rl == ah || rl == bh) {
+        rl = TCG_REG_TMP;
+    }
+    tcg_out_arith(s, sub ? ARITH_SUBS : ARITH_ADDS, ext, rl, al, bl, 0);
+    tcg_out_adc(s, ext, sub, rh, ah, bh);
+    if (rl != orig_rl) {
+        tcg_out_movr(s, ext, orig_rl, rl);
+    }
+}
+
 static inline void tcg_out_mul(TCGContext *s, int ext,
                                TCGReg rd, TCGReg rn, TCGReg rm)
 {
@@ -462,6 +500,47 @@ static inline void tcg_out_mul(TCGContext *s, int ext,
     tcg_out32(s, base | rm << 16 | rn << 5 | rd);
 }
 
+static inline void tcg_out_mulh(TCGContext *s, int ext, bool is_signed,
+                                TCGReg rd, TCGReg rn, TCGReg rm)
+{
+    if (ext) {
+        /* using UMULH 0x9bc07c00, SMULH 0x9b407c00 */
+        unsigned int base = is_signed ? 0x9b407c00 : 0x9bc07c00;
+        tcg_out32(s, base | rm << 16 | rn << 5 | rd);
+    } else {
+        /* using UMULL 0x9ba07c00, SMULL 0x9b207c00 Xd, Wn, Wm, then
+           LSR Xd, Xd, #32 alias of UBFM 0xd360fc00 to keep the high half */
+        unsigned int base = is_signed ? 0x9b207c00 : 0x9ba07c00;
+        tcg_out32(s, base | rm << 16 | rn << 5 | rd);
+        tcg_out32(s, 0xd360fc00 | rd << 5 | rd);
+    }
+}
+
+static inline void tcg_out_msub(TCGContext *s, int ext, TCGReg rd,
+                                TCGReg rn, TCGReg rm, TCGReg ra)
+{
+    /* Using MSUB 0x1b008000 Wd, Wn, Wm, Wa: rd = ra - rn * rm */
+    unsigned int base = ext ? 0x9b008000 : 0x1b008000;
+    tcg_out32(s, base | rm << 16 | ra << 10 | rn << 5 | rd);
+}
+
+static inline void tcg_out_div(TCGContext *s, int ext, bool is_signed,
+                               TCGReg rd, TCGReg rn, TCGReg rm)
+{
+    /* using 2-source data processing UDIV 0x1ac00800, SDIV 0x1ac00c00 */
+    unsigned int base = ext ? 0x9ac00800 : 0x1ac00800;
+    tcg_out32(s, base | is_signed << 10 | rm << 16 | rn << 5 | rd);
+}
+
+static inline void tcg_out_rem(TCGContext *s, int ext, bool is_signed,
+                               TCGReg rd, TCGReg rn, TCGReg rm)
+{
+    /* rd = rn - (rn / rm) * rm, the quotient goes to TMP so that rd
+       may be the same as rn or rm */
+    tcg_out_div(s, ext, is_signed, TCG_REG_TMP, rn, rm);
+    tcg_out_msub(s, ext, rd, TCG_REG_TMP, rm, rn);
+}
+
 static inline void tcg_out_shiftrot_reg(TCGContext *s,
                                         enum aarch64_srr_opc opc, int ext,
                                         TCGReg rd, TCGReg rn, TCGReg rm)
@@ -487,6 +566,23 @@ static inline void tcg_out_sbfm(TCGContext *s, int ext, TCGReg rd, TCGReg rn,
     tcg_out32(s, base | a << 16 | b << 10 | rn << 5 | rd);
 }
 
+static inline void tcg_out_bfm(TCGContext *s, int ext, TCGReg rd, TCGReg rn,
+                               unsigned int a, unsigned int b)
+{
+    /* Using BFM 0x33000000 Wd, Wn, a, b */
+    unsigned int base = ext ? 0xb3400000 : 0x33000000;
+    tcg_out32(s, base | a << 16 | b << 10 | rn << 5 | rd);
+}
+
+static inline void tcg_out_deposit(TCGContext *s, int ext, TCGReg rd,
+                                   TCGReg rn, unsigned int lsb,
+                                   unsigned int width)
+{
+    /* Using BFI alias of BFM Wd, Wn, (32 - lsb) % 32, width - 1 */
+    int max = ext ? 63 : 31;
+    tcg_out_bfm(s, ext, rd, rn, -lsb & max, width - 1);
+}
+
 static inline void tcg_out_extr(TCGContext *s, int ext, TCGReg rd,
                                 TCGReg rn, TCGReg rm, unsigned int a)
 {
@@ -548,6 +644,15 @@ static inline void tcg_out_cset(TCGContext *s, int ext, TCGReg rd, TCGCond c)
     tcg_out32(s, base | tcg_cond_to_aarch64[tcg_invert_cond(c)] << 12 | rd);
 }
 
+static inline void tcg_out_csel(TCGContext *s, int ext, TCGReg rd,
+                                TCGReg rn, TCGReg rm, TCGCond c)
+{
+    /* Using CSEL 0x1a800000 Xd, Xn, Xm, cond */
+    unsigned int base = ext ? 0x9a800000 : 0x1a800000;
+    tcg_out32(s, base | rm << 16 | tcg_cond_to_aarch64[c] << 12
+              | rn << 5 | rd);
+}
+
 static inline void tcg_out_goto(TCGContext *s, tcg_target_long target)
 {
     tcg_target_long offset;
@@ -1190,12 +1295,92 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
         tcg_out_arith(s, ARITH_XOR, ext, args[0], args[1], args[2], 0);
         break;
 
+    case INDEX_op_andc_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_andc_i32:
+        tcg_out_logicn(s, ARITH_AND, ext, args[0], args[1], args[2]);
+        break;
+
+    case INDEX_op_orc_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_orc_i32:
+        tcg_out_logicn(s, ARITH_OR, ext, args[0], args[1], args[2]);
+        break;
+
+    case INDEX_op_eqv_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_eqv_i32:
+        tcg_out_logicn(s, ARITH_XOR, ext, args[0], args[1], args[2]);
+        break;
+
+    case INDEX_op_not_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_not_i32:      /* MVN / ORN Wd, WZR, Wm */
+        tcg_out_logicn(s, ARITH_OR, ext, args[0], TCG_REG_XZR, args[1]);
+        break;
+
+    case INDEX_op_neg_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_neg_i32:      /* NEG / SUB Wd, WZR, Wm */
+        tcg_out_arith(s, ARITH_SUB, ext, args[0], TCG_REG_XZR, args[1], 0);
+        break;
+
     case INDEX_op_mul_i64:
         ext = 1; /* fall through */
     case INDEX_op_mul_i32:
         tcg_out_mul(s, ext, args[0], args[1], args[2]);
         break;
 
+    case INDEX_op_muluh_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_muluh_i32:
+        tcg_out_mulh(s, ext, false, args[0], args[1], args[2]);
+        break;
+
+    case INDEX_op_mulsh_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_mulsh_i32:
+        tcg_out_mulh(s, ext, true, args[0], args[1], args[2]);
+        break;
+
+    case INDEX_op_div_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_div_i32:
+        tcg_out_div(s, ext, true, args[0], args[1], args[2]);
+        break;
+
+    case INDEX_op_divu_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_divu_i32:
+        tcg_out_div(s, ext, false, args[0], args[1], args[2]);
+        break;
+
+    case INDEX_op_rem_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_rem_i32:
+        tcg_out_rem(s, ext, true, args[0], args[1], args[2]);
+        break;
+
+    case INDEX_op_remu_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_remu_i32:
+        tcg_out_rem(s, ext, false, args[0], args[1], args[2]);
+        break;
+
+    case INDEX_op_add2_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_add2_i32:
+        tcg_out_addsub2(s, ext, false, args[0], args[1],
+                        args[2], args[3], args[4], args[5]);
+        break;
+
+    case INDEX_op_sub2_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_sub2_i32:
+        tcg_out_addsub2(s, ext, true, args[0], args[1],
+                        args[2], args[3], args[4], args[5]);
+        break;
+
     case INDEX_op_shl_i64:
         ext = 1; /* fall through */
     case INDEX_op_shl_i32:
@@ -1263,6 +1448,19 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
         tcg_out_cset(s, 0, args[0], args[3]);
         break;
 
+    case INDEX_op_movcond_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_movcond_i32: /* CMP 1, 2, CSEL 0, 3, 4, cond(5) */
+        tcg_out_cmp(s, ext, args[1], args[2], 0);
+        tcg_out_csel(s, ext, args[0], args[3], args[4], args[5]);
+        break;
+
+    case INDEX_op_deposit_i64:
+        ext = 1; /* fall through */
+    case INDEX_op_deposit_i32: /* BFI 0, 2, pos(3), len(4), 1 is 0 */
+        tcg_out_deposit(s, ext, args[0], args[2], args[3], args[4]);
+        break;
+
     case INDEX_op_qemu_ld8u:
         tcg_out_qemu_ld(s, args, 0 | 0);
         break;
@@ -1386,6 +1584,34 @@ static const TCGTargetOpDef aarch64_op_defs[] = {
     { INDEX_op_or_i64, { "r", "r", "r" } },
     { INDEX_op_xor_i32, { "r", "r", "r" } },
     { INDEX_op_xor_i64, { "r", "r", "r" } },
+    { INDEX_op_andc_i32, { "r", "r", "r" } },
+    { INDEX_op_andc_i64, { "r", "r", "r" } },
+    { INDEX_op_orc_i32, { "r", "r", "r" } },
+    { INDEX_op_orc_i64, { "r", "r", "r" } },
+    { INDEX_op_eqv_i32, { "r", "r", "r" } },
+    { INDEX_op_eqv_i64, { "r", "r", "r" } },
+    { INDEX_op_not_i32, { "r", "r" } },
+    { INDEX_op_not_i64, { "r", "r" } },
+    { INDEX_op_neg_i32, { "r", "r" } },
+    { INDEX_op_neg_i64, { "r", "r" } },
+
+    { INDEX_op_muluh_i32, { "r", "r", "r" } },
+    { INDEX_op_muluh_i64, { "r", "r", "r" } },
+    { INDEX_op_mulsh_i32, { "r", "r", "r" } },
+    { INDEX_op_mulsh_i64, { "r", "r", "r" } },
+    { INDEX_op_div_i32, { "r", "r", "r" } },
+    { INDEX_op_div_i64, { "r", "r", "r" } },
+    { INDEX_op_divu_i32, { "r", "r", "r" } },
+    { INDEX_op_divu_i64, { "r", "r", "r" } },
+    { INDEX_op_rem_i32, { "r", "r", "r" } },
+    { INDEX_op_rem_i64, { "r", "r", "r" } },
+    { INDEX_op_remu_i32, { "r", "r", "r" } },
+    { INDEX_op_remu_i64, { "r", "r", "r" } },
+
+    { INDEX_op_add2_i32, { "r", "r", "r", "r", "r", "r" } },
+    { INDEX_op_add2_i64, { "r", "r", "r", "r", "r", "r" } },
+    { INDEX_op_sub2_i32, { "r", "r", "r", "r", "r", "r" } },
+    { INDEX_op_sub2_i64, { "r", "r", "r", "r", "r", "r" } },
 
     { INDEX_op_shl_i32, { "r", "r", "ri" } },
     { INDEX_op_shr_i32, { "r", "r", "ri" } },
@@ -1402,6 +1628,11 @@ static const TCGTargetOpDef aarch64_op_defs[] = {
     { INDEX_op_setcond_i32, { "r", "r", "r" } },
     { INDEX_op_brcond_i64, { "r", "r" } },
     { INDEX_op_setcond_i64, { "r", "r", "r" } },
+    { INDEX_op_movcond_i32, { "r", "r", "r", "r", "r" } },
+    { INDEX_op_movcond_i64, { "r", "r", "r", "r", "r" } },
+
+    { INDEX_op_deposit_i32, { "r", "0", "r" } },
+    { INDEX_op_deposit_i64, { "r", "0", "r" } },
 
     { INDEX_op_qemu_ld8u, { "r", "l" } },
     { INDEX_op_qemu_ld8s, { "r", "l" } },
@@ -1069,7 +1069,6 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                        && temps[args[3]].val == 0) {
                 /* Simplify LT/GE comparisons vs zero to a single compare
                    vs the high word of the input.  */
-                reset_all_temps(nb_temps);
                 s->gen_opc_buf[op_index] = INDEX_op_brcond_i32;
                 gen_args[0] = args[1];
                 gen_args[1] = args[3];
@@ -1134,9 +1133,15 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                to compute the operation result) so no propagation is done.
                We trash everything if the operation is the end of a basic
                block, otherwise we only trash the output args.  "mask" is
-               the non-zero bits mask for the first output arg.  */
+               the non-zero bits mask for the first output arg.
+               The fall-through path of a conditional branch has no other
+               predecessor, so what we know stays true there and the
+               extended basic block goes on until the next label.  */
             if (def->flags & TCG_OPF_BB_END) {
-                reset_all_temps(nb_temps);
+                if (op != INDEX_op_brcond_i32 && op != INDEX_op_brcond_i64 &&
+                    op != INDEX_op_brcond2_i32) {
+                    reset_all_temps(nb_temps);
+                }
             } else {
                 for (i = 0; i < def->nb_oargs; i++) {
                     reset_temp(args[i]);
@@ -1154,10 +1159,162 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
     return gen_args;
 }
 
+/* Size in bytes of the memory accessed by a host load or store, 0 if OP
+   is not one.  */
+static int ld_st_size(TCGOpcode op)
+{
+    switch (op) {
+    case INDEX_op_ld8u_i32:
+    case INDEX_op_ld8s_i32:
+    case INDEX_op_ld8u_i64:
+    case INDEX_op_ld8s_i64:
+    case INDEX_op_st8_i32:
+    case INDEX_op_st8_i64:
+        return 1;
+    case INDEX_op_ld16u_i32:
+    case INDEX_op_ld16s_i32:
+    case INDEX_op_ld16u_i64:
+    case INDEX_op_ld16s_i64:
+    case INDEX_op_st16_i32:
+    case INDEX_op_st16_i64:
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_st_i32:
+    case INDEX_op_st32_i64:
+        return 4;
+    case INDEX_op_ld_i64:
+    case INDEX_op_st_i64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+static bool is_st(TCGOpcode op)
+{
+    switch (op) {
+    case INDEX_op_st8_i32:
+    case INDEX_op_st16_i32:
+    case INDEX_op_st_i32:
+    case INDEX_op_st8_i64:
+    case INDEX_op_st16_i64:
+    case INDEX_op_st32_i64:
+    case INDEX_op_st_i64:
+        return true;
+    default:
+        return false;
+    }
+}
+
+#define MAX_PENDING_STORES 16
+
+struct tcg_pending_store {
+    int op_index;
+    TCGArg *args;
+    TCGArg base;
+    tcg_target_long offset;
+    int size;
+};
+
+/* Remove stores to env (or any other fixed register) that are overwritten
+   by a store of the same size at the same offset before anything can read
+   them: a host load, a helper call, a guest memory access, which may fault
+   and exit to the main loop, or the end of the basic block.  Stores that
+   overlap the memory slot of a global are kept, since the register
+   allocator may load the global from there at any time.  */
+static void tcg_dead_store_elim(TCGContext *s, uint16_t *tcg_opc_ptr,
+                                TCGArg *args, const TCGOpDef *tcg_op_defs)
+{
+    struct tcg_pending_store pending[MAX_PENDING_STORES];
+    int nb_pending, op_index, nb_ops, nb_args, size, i;
+    const TCGOpDef *def;
+    TCGOpcode op;
+    tcg_target_long offset;
+    TCGArg base;
+
+    nb_pending = 0;
+    nb_ops = tcg_opc_ptr - s->gen_opc_buf;
+    for (op_index = 0; op_index < nb_ops; op_index++, args += nb_args) {
+        op = s->gen_opc_buf[op_index];
+        def = &tcg_op_defs[op];
+        if (op == INDEX_op_nopn) {
+            nb_args = args[0];
+            continue;
+        }
+        if (op == INDEX_op_call) {
+            nb_args = (args[0] >> 16) + (args[0] & 0xffff) + 3;
+            nb_pending = 0;
+            continue;
+        }
+        nb_args = def->nb_args;
+        if (def->flags & (TCG_OPF_BB_END | TCG_OPF_CALL_CLOBBER |
+                          TCG_OPF_SIDE_EFFECTS)) {
+            nb_pending = 0;
+            continue;
+        }
+        size = ld_st_size(op);
+        if (size == 0) {
+            continue;
+        }
+
+        base = args[1];
+        offset = args[2];
+        if (!s->temps[base].fixed_reg) {
+            /* may point anywhere, even to env */
+            if (!is_st(op)) {
+                nb_pending = 0;
+            }
+            continue;
+        }
+        if (!is_st(op)) {
+            /* a load only keeps the stores it overlaps */
+            for (i = 0; i < nb_pending; i++) {
+                if (pending[i].base == base &&
+                    pending[i].offset < offset + size &&
+                    offset < pending[i].offset + pending[i].size) {
+                    pending[i--] = pending[--nb_pending];
+                }
+            }
+            continue;
+        }
+
+        for (i = 0; i < nb_pending; i++) {
+            if (pending[i].base == base && pending[i].offset == offset &&
+                pending[i].size == size) {
+                /* turn the old store into a nopn of the same length */
+                s->gen_opc_buf[pending[i].op_index] = INDEX_op_nopn;
+                pending[i].args[0] = 3;
+                pending[i].args[2] = 3;
+                pending[i--] = pending[--nb_pending];
+            }
+        }
+        for (i = 0; i < s->nb_globals; i++) {
+            TCGTemp *ts = &s->temps[i];
+
+            if (!ts->fixed_reg && ts->mem_reg == s->temps[base].reg &&
+                ts->mem_offset < offset + size &&
+                offset < ts->mem_offset + (ts->type == TCG_TYPE_I64 ? 8 : 4)) {
+                break;
+            }
+        }
+        if (i == s->nb_globals && nb_pending < MAX_PENDING_STORES) {
+            pending[nb_pending].op_index = op_index;
+            pending[nb_pending].args = args;
+            pending[nb_pending].base = base;
+            pending[nb_pending].offset = offset;
+            pending[nb_pending].size = size;
+            nb_pending++;
+        }
+    }
+}
+
 TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr,
         TCGArg *args, TCGOpDef *tcg_op_defs)
 {
     TCGArg *res;
     res = tcg_constant_folding(s, tcg_opc_ptr, args, tcg_op_defs);
+    tcg_dead_store_elim(s, tcg_opc_ptr, args, tcg_op_defs);
     return res;
 }
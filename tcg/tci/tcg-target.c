@@ -22,7 +22,21 @@
  * THE SOFTWARE.
  */
 
-#include "tcg-be-null.h"
+/* Used to fuse instructions, see tci_fuse_ld() */
+typedef struct TCGBackendData {
+    uint8_t *ld_start;
+    uint8_t *ld_end;
+    TCGReg ld_reg;
+} TCGBackendData;
+
+static inline void tcg_out_tb_init(TCGContext *s)
+{
+    s->be->ld_end = NULL;
+}
+
+static inline void tcg_out_tb_finalize(TCGContext *s)
+{
+}
 
 /* TODO list:
  * - See TODO comments in code.
@@ -482,6 +496,33 @@ static void tci_out_label(TCGContext *s, TCGArg arg)
     }
 }
 
+/* Remember a load, in case the next instruction can be fused with it */
+static void tci_note_ld(TCGContext *s, uint8_t *start, TCGReg reg)
+{
+    s->be->ld_start = start;
+    s->be->ld_end = s->code_ptr;
+    s->be->ld_reg = reg;
+}
+
+/* Can the instruction starting at code_ptr be fused into the load before
+ * it?  The load must be the last instruction emitted and write the
+ * register that this one reads.  No label can sit between the two: after
+ * a label the register allocator has no value in any register, so the
+ * register would have been reloaded after the label.
+ */
+static bool tci_fuse_ld(TCGContext *s, uint8_t *code_ptr, TCGArg reg,
+                        TCGOpcode ld_opc)
+{
+    TCGBackendData *be = s->be;
+
+    if (be->ld_end != code_ptr || be->ld_reg != reg ||
+        be->ld_start[0] != ld_opc) {
+        return false;
+    }
+    be->ld_end = NULL;
+    return true;
+}
+
 static void tcg_out_ld(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg1,
                        intptr_t arg2)
 {
@@ -504,6 +545,7 @@ static void tcg_out_ld(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg1,
 #endif
     }
     old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_note_ld(s, old_code_ptr, ret);
 }
 
 static void tcg_out_mov(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg)
@@ -698,7 +740,14 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
         TODO();
         break;
     case INDEX_op_brcond_i64:
-        tcg_out_r(s, args[0]);
+        if (tci_fuse_ld(s, old_code_ptr, args[0], INDEX_op_ld_i64)) {
+            /* The load already names the register */
+            s->code_ptr = old_code_ptr;
+            old_code_ptr = s->be->ld_start;
+            old_code_ptr[0] = TCI_OP_ld_brcond_i64;
+        } else {
+            tcg_out_r(s, args[0]);
+        }
         tcg_out_ri64(s, const_args[1], args[1]);
         tcg_out8(s, args[2]);           /* condition */
         tci_out_label(s, args[3]);
@@ -764,7 +813,13 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
         break;
 #endif
     case INDEX_op_brcond_i32:
-        tcg_out_r(s, args[0]);
+        if (tci_fuse_ld(s, old_code_ptr, args[0], INDEX_op_ld_i32)) {
+            s->code_ptr = old_code_ptr;
+            old_code_ptr = s->be->ld_start;
+            old_code_ptr[0] = TCI_OP_ld_brcond_i32;
+        } else {
+            tcg_out_r(s, args[0]);
+        }
         tcg_out_ri32(s, const_args[1], args[1]);
         tcg_out8(s, args[2]);           /* condition */
         tci_out_label(s, args[3]);
@@ -833,6 +888,9 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
         tcg_abort();
     }
     old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    if (opc == INDEX_op_ld_i32 || opc == INDEX_op_ld_i64) {
+        tci_note_ld(s, old_code_ptr, args[0]);
+    }
 }
 
 static void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg, TCGReg arg1,
@@ -877,6 +935,7 @@ static void tcg_target_init(TCGContext *s)
 
     /* The current code uses uint8_t for tcg operations. */
     assert(ARRAY_SIZE(tcg_op_defs) <= UINT8_MAX);
+    assert(TCI_NB_OPS <= UINT8_MAX);
 
     /* Registers available for 32 bit operations. */
     tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I32], 0,
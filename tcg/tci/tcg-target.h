@@ -177,6 +177,13 @@ typedef enum {
 #define TCG_TARGET_CALL_STACK_OFFSET    0
 #define TCG_TARGET_STACK_ALIGN          16
 
+/* Superinstructions.  The code generator fuses some common pairs of TCG
+ * opcodes into one bytecode instruction, which only the interpreter knows.
+ */
+#define TCI_OP_ld_brcond_i32            (NB_OPS + 0)
+#define TCI_OP_ld_brcond_i64            (NB_OPS + 1)
+#define TCI_NB_OPS                      (NB_OPS + 2)
+
 void tci_disas(uint8_t opc);
 
 uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr);
@@ -433,62 +433,289 @@ static bool tci_compare64(uint64_t u0, uint64_t u1, TCGCond condition)
     return result;
 }
 
+/* With GCC, every handler ends with its own indirect jump to the handler
+ * of the next instruction, through a table of label addresses.  That is
+ * cheaper than going back to a single switch, and the host branch
+ * predictor gets one entry per handler.  An opcode missing from the table
+ * reaches the default case.
+ */
+#if defined(__GNUC__)
+# define TCI_THREADED
+#endif
+
+#if !defined(NDEBUG)
+# define TCI_FETCH_DEBUG() (op_size = tb_ptr[1], old_code_ptr = tb_ptr)
+#else
+# define TCI_FETCH_DEBUG() ((void)0)
+#endif
+#if defined(GETPC)
+# define TCI_FETCH_PC() (tci_tb_ptr = (uintptr_t)tb_ptr)
+#else
+# define TCI_FETCH_PC() ((void)0)
+#endif
+
+/* Decode opcode and size entry of the next instruction. */
+#define TCI_FETCH() \
+    do { \
+        opc = tb_ptr[0]; \
+        TCI_FETCH_DEBUG(); \
+        TCI_FETCH_PC(); \
+        tb_ptr += 2; \
+    } while (0)
+
+#if defined(TCI_THREADED)
+# define TCI_CASE(op) case op: do_##op
+# define TCI_TARGET(op) [op] = &&do_##op
+# define TCI_NEXT() \
+    do { \
+        assert(tb_ptr == old_code_ptr + op_size); \
+        TCI_FETCH(); \
+        goto *tci_dispatch[opc]; \
+    } while (0)
+#else
+# define TCI_CASE(op) case op
+# define TCI_NEXT() break
+#endif
+
 /* Interpret pseudo code in tb. */
 uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 {
     long tcg_temps[CPU_TEMP_BUF_NLONGS];
     uintptr_t sp_value = (uintptr_t)(tcg_temps + CPU_TEMP_BUF_NLONGS);
     uintptr_t next_tb = 0;
-
-    tci_reg[TCG_AREG0] = (tcg_target_ulong)env;
-    tci_reg[TCG_REG_CALL_STACK] = sp_value;
-    assert(tb_ptr);
-
-    for (;;) {
-        TCGOpcode opc = tb_ptr[0];
+    unsigned opc;
 #if !defined(NDEBUG)
-        uint8_t op_size = tb_ptr[1];
-        uint8_t *old_code_ptr = tb_ptr;
-#endif
-        tcg_target_ulong t0;
-        tcg_target_ulong t1;
-        tcg_target_ulong t2;
-        tcg_target_ulong label;
-        TCGCond condition;
-        target_ulong taddr;
+    uint8_t op_size;
+    uint8_t *old_code_ptr;
+#endif
+    tcg_target_ulong t0;
+    tcg_target_ulong t1;
+    tcg_target_ulong t2;
+    tcg_target_ulong label;
+    TCGCond condition;
+    target_ulong taddr;
 #ifndef CONFIG_SOFTMMU
-        tcg_target_ulong host_addr;
+    tcg_target_ulong host_addr;
 #endif
-        uint8_t tmp8;
-        uint16_t tmp16;
-        uint32_t tmp32;
-        uint64_t tmp64;
+    uint8_t tmp8;
+    uint16_t tmp16;
+    uint32_t tmp32;
+    uint64_t tmp64;
 #if TCG_TARGET_REG_BITS == 32
-        uint64_t v64;
+    uint64_t v64;
 #endif
-
-#if defined(GETPC)
-        tci_tb_ptr = (uintptr_t)tb_ptr;
+#if defined(TCI_THREADED)
+    static const void *const tci_dispatch[TCI_NB_OPS] = {
+        [0 ... TCI_NB_OPS - 1] = &&do_default,
+        TCI_TARGET(INDEX_op_end),
+        TCI_TARGET(INDEX_op_nop),
+        TCI_TARGET(INDEX_op_nop1),
+        TCI_TARGET(INDEX_op_nop2),
+        TCI_TARGET(INDEX_op_nop3),
+        TCI_TARGET(INDEX_op_nopn),
+        TCI_TARGET(INDEX_op_discard),
+        TCI_TARGET(INDEX_op_set_label),
+        TCI_TARGET(INDEX_op_call),
+        TCI_TARGET(INDEX_op_br),
+        TCI_TARGET(INDEX_op_setcond_i32),
+#if TCG_TARGET_REG_BITS == 32
+        TCI_TARGET(INDEX_op_setcond2_i32),
+#elif TCG_TARGET_REG_BITS == 64
+        TCI_TARGET(INDEX_op_setcond_i64),
+#endif
+        TCI_TARGET(INDEX_op_mov_i32),
+        TCI_TARGET(INDEX_op_movi_i32),
+        TCI_TARGET(INDEX_op_ld8u_i32),
+        TCI_TARGET(INDEX_op_ld8s_i32),
+        TCI_TARGET(INDEX_op_ld16u_i32),
+        TCI_TARGET(INDEX_op_ld16s_i32),
+        TCI_TARGET(INDEX_op_ld_i32),
+        TCI_TARGET(INDEX_op_st8_i32),
+        TCI_TARGET(INDEX_op_st16_i32),
+        TCI_TARGET(INDEX_op_st_i32),
+        TCI_TARGET(INDEX_op_add_i32),
+        TCI_TARGET(INDEX_op_sub_i32),
+        TCI_TARGET(INDEX_op_mul_i32),
+#if TCG_TARGET_HAS_div_i32
+        TCI_TARGET(INDEX_op_div_i32),
+        TCI_TARGET(INDEX_op_divu_i32),
+        TCI_TARGET(INDEX_op_rem_i32),
+        TCI_TARGET(INDEX_op_remu_i32),
+#elif TCG_TARGET_HAS_div2_i32
+        TCI_TARGET(INDEX_op_div2_i32),
+        TCI_TARGET(INDEX_op_divu2_i32),
+#endif
+        TCI_TARGET(INDEX_op_and_i32),
+        TCI_TARGET(INDEX_op_or_i32),
+        TCI_TARGET(INDEX_op_xor_i32),
+        TCI_TARGET(INDEX_op_shl_i32),
+        TCI_TARGET(INDEX_op_shr_i32),
+        TCI_TARGET(INDEX_op_sar_i32),
+#if TCG_TARGET_HAS_rot_i32
+        TCI_TARGET(INDEX_op_rotl_i32),
+        TCI_TARGET(INDEX_op_rotr_i32),
+#endif
+#if TCG_TARGET_HAS_deposit_i32
+        TCI_TARGET(INDEX_op_deposit_i32),
+#endif
+        TCI_TARGET(INDEX_op_brcond_i32),
+#if TCG_TARGET_REG_BITS == 32
+        TCI_TARGET(INDEX_op_add2_i32),
+        TCI_TARGET(INDEX_op_sub2_i32),
+        TCI_TARGET(INDEX_op_brcond2_i32),
+        TCI_TARGET(INDEX_op_mulu2_i32),
+#endif /* TCG_TARGET_REG_BITS == 32 */
+#if TCG_TARGET_HAS_ext8s_i32
+        TCI_TARGET(INDEX_op_ext8s_i32),
+#endif
+#if TCG_TARGET_HAS_ext16s_i32
+        TCI_TARGET(INDEX_op_ext16s_i32),
+#endif
+#if TCG_TARGET_HAS_ext8u_i32
+        TCI_TARGET(INDEX_op_ext8u_i32),
+#endif
+#if TCG_TARGET_HAS_ext16u_i32
+        TCI_TARGET(INDEX_op_ext16u_i32),
+#endif
+#if TCG_TARGET_HAS_bswap16_i32
+        TCI_TARGET(INDEX_op_bswap16_i32),
+#endif
+#if TCG_TARGET_HAS_bswap32_i32
+        TCI_TARGET(INDEX_op_bswap32_i32),
+#endif
+#if TCG_TARGET_HAS_not_i32
+        TCI_TARGET(INDEX_op_not_i32),
+#endif
+#if TCG_TARGET_HAS_neg_i32
+        TCI_TARGET(INDEX_op_neg_i32),
+#endif
+#if TCG_TARGET_REG_BITS == 64
+        TCI_TARGET(INDEX_op_mov_i64),
+        TCI_TARGET(INDEX_op_movi_i64),
+        TCI_TARGET(INDEX_op_ld8u_i64),
+        TCI_TARGET(INDEX_op_ld8s_i64),
+        TCI_TARGET(INDEX_op_ld16u_i64),
+        TCI_TARGET(INDEX_op_ld16s_i64),
+        TCI_TARGET(INDEX_op_ld32u_i64),
+        TCI_TARGET(INDEX_op_ld32s_i64),
+        TCI_TARGET(INDEX_op_ld_i64),
+        TCI_TARGET(INDEX_op_st8_i64),
+        TCI_TARGET(INDEX_op_st16_i64),
+        TCI_TARGET(INDEX_op_st32_i64),
+        TCI_TARGET(INDEX_op_st_i64),
+        TCI_TARGET(INDEX_op_add_i64),
+        TCI_TARGET(INDEX_op_sub_i64),
+        TCI_TARGET(INDEX_op_mul_i64),
+#if TCG_TARGET_HAS_div_i64
+        TCI_TARGET(INDEX_op_div_i64),
+        TCI_TARGET(INDEX_op_divu_i64),
+        TCI_TARGET(INDEX_op_rem_i64),
+        TCI_TARGET(INDEX_op_remu_i64),
+#elif TCG_TARGET_HAS_div2_i64
+        TCI_TARGET(INDEX_op_div2_i64),
+        TCI_TARGET(INDEX_op_divu2_i64),
+#endif
+        TCI_TARGET(INDEX_op_and_i64),
+        TCI_TARGET(INDEX_op_or_i64),
+        TCI_TARGET(INDEX_op_xor_i64),
+        TCI_TARGET(INDEX_op_shl_i64),
+        TCI_TARGET(INDEX_op_shr_i64),
+        TCI_TARGET(INDEX_op_sar_i64),
+#if TCG_TARGET_HAS_rot_i64
+        TCI_TARGET(INDEX_op_rotl_i64),
+        TCI_TARGET(INDEX_op_rotr_i64),
+#endif
+#if TCG_TARGET_HAS_deposit_i64
+        TCI_TARGET(INDEX_op_deposit_i64),
+#endif
+        TCI_TARGET(INDEX_op_brcond_i64),
+#if TCG_TARGET_HAS_ext8u_i64
+        TCI_TARGET(INDEX_op_ext8u_i64),
+#endif
+#if TCG_TARGET_HAS_ext8s_i64
+        TCI_TARGET(INDEX_op_ext8s_i64),
+#endif
+#if TCG_TARGET_HAS_ext16s_i64
+        TCI_TARGET(INDEX_op_ext16s_i64),
+#endif
+#if TCG_TARGET_HAS_ext16u_i64
+        TCI_TARGET(INDEX_op_ext16u_i64),
+#endif
+#if TCG_TARGET_HAS_ext32s_i64
+        TCI_TARGET(INDEX_op_ext32s_i64),
+#endif
+#if TCG_TARGET_HAS_ext32u_i64
+        TCI_TARGET(INDEX_op_ext32u_i64),
+#endif
+#if TCG_TARGET_HAS_bswap16_i64
+        TCI_TARGET(INDEX_op_bswap16_i64),
+#endif
+#if TCG_TARGET_HAS_bswap32_i64
+        TCI_TARGET(INDEX_op_bswap32_i64),
+#endif
+#if TCG_TARGET_HAS_bswap64_i64
+        TCI_TARGET(INDEX_op_bswap64_i64),
+#endif
+#if TCG_TARGET_HAS_not_i64
+        TCI_TARGET(INDEX_op_not_i64),
+#endif
+#if TCG_TARGET_HAS_neg_i64
+        TCI_TARGET(INDEX_op_neg_i64),
+#endif
+#endif /* TCG_TARGET_REG_BITS == 64 */
+#if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
+        TCI_TARGET(INDEX_op_debug_insn_start),
+#else
+        TCI_TARGET(INDEX_op_debug_insn_start),
+#endif
+        TCI_TARGET(INDEX_op_exit_tb),
+        TCI_TARGET(INDEX_op_goto_tb),
+        TCI_TARGET(INDEX_op_qemu_ld8u),
+        TCI_TARGET(INDEX_op_qemu_ld8s),
+        TCI_TARGET(INDEX_op_qemu_ld16u),
+        TCI_TARGET(INDEX_op_qemu_ld16s),
+#if TCG_TARGET_REG_BITS == 64
+        TCI_TARGET(INDEX_op_qemu_ld32u),
+        TCI_TARGET(INDEX_op_qemu_ld32s),
+#endif /* TCG_TARGET_REG_BITS == 64 */
+        TCI_TARGET(INDEX_op_qemu_ld32),
+        TCI_TARGET(INDEX_op_qemu_ld64),
+        TCI_TARGET(INDEX_op_qemu_st8),
+        TCI_TARGET(INDEX_op_qemu_st16),
+        TCI_TARGET(INDEX_op_qemu_st32),
+        TCI_TARGET(INDEX_op_qemu_st64),
+        TCI_TARGET(TCI_OP_ld_brcond_i32),
+#if TCG_TARGET_REG_BITS == 64
+        TCI_TARGET(TCI_OP_ld_brcond_i64),
+#endif
+    };
 #endif
 
-        /* Skip opcode and size entry. */
-        tb_ptr += 2;
+    tci_reg[TCG_AREG0] = (tcg_target_ulong)env;
+    tci_reg[TCG_REG_CALL_STACK] = sp_value;
+    assert(tb_ptr);
+
+    for (;;) {
+        TCI_FETCH();
+#if defined(TCI_THREADED)
+        goto *tci_dispatch[opc];
+#endif
 
         switch (opc) {
-        case INDEX_op_end:
-        case INDEX_op_nop:
-            break;
-        case INDEX_op_nop1:
-        case INDEX_op_nop2:
-        case INDEX_op_nop3:
-        case INDEX_op_nopn:
-        case INDEX_op_discard:
+        TCI_CASE(INDEX_op_end):
+        TCI_CASE(INDEX_op_nop):
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_nop1):
+        TCI_CASE(INDEX_op_nop2):
+        TCI_CASE(INDEX_op_nop3):
+        TCI_CASE(INDEX_op_nopn):
+        TCI_CASE(INDEX_op_discard):
             TODO();
-            break;
-        case INDEX_op_set_label:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_set_label):
             TODO();
-            break;
-        case INDEX_op_call:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_call):
             t0 = tci_read_ri(&tb_ptr);
 #if TCG_TARGET_REG_BITS == 32
             tmp64 = ((helper_function)t0)(tci_read_reg(TCG_REG_R0),
@@ -511,194 +738,194 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
                                           tci_read_reg(TCG_REG_R5));
             tci_write_reg(TCG_REG_R0, tmp64);
 #endif
-            break;
-        case INDEX_op_br:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_br):
             label = tci_read_label(&tb_ptr);
             assert(tb_ptr == old_code_ptr + op_size);
             tb_ptr = (uint8_t *)label;
             continue;
-        case INDEX_op_setcond_i32:
+        TCI_CASE(INDEX_op_setcond_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             condition = *tb_ptr++;
             tci_write_reg32(t0, tci_compare32(t1, t2, condition));
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_REG_BITS == 32
-        case INDEX_op_setcond2_i32:
+        TCI_CASE(INDEX_op_setcond2_i32):
             t0 = *tb_ptr++;
             tmp64 = tci_read_r64(&tb_ptr);
             v64 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
             tci_write_reg32(t0, tci_compare64(tmp64, v64, condition));
-            break;
+            TCI_NEXT();
 #elif TCG_TARGET_REG_BITS == 64
-        case INDEX_op_setcond_i64:
+        TCI_CASE(INDEX_op_setcond_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
             tci_write_reg64(t0, tci_compare64(t1, t2, condition));
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_mov_i32:
+        TCI_CASE(INDEX_op_mov_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
-        case INDEX_op_movi_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_movi_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_i32(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 
             /* Load/store operations (32 bit). */
 
-        case INDEX_op_ld8u_i32:
+        TCI_CASE(INDEX_op_ld8u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg8(t0, *(uint8_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld8s_i32:
-        case INDEX_op_ld16u_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_ld8s_i32):
+        TCI_CASE(INDEX_op_ld16u_i32):
             TODO();
-            break;
-        case INDEX_op_ld16s_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_ld16s_i32):
             TODO();
-            break;
-        case INDEX_op_ld_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_ld_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
-            break;
-        case INDEX_op_st8_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_st8_i32):
             t0 = tci_read_r8(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             *(uint8_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st16_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_st16_i32):
             t0 = tci_read_r16(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             *(uint16_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_st_i32):
             t0 = tci_read_r32(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             assert(t1 != sp_value || (int32_t)t2 < 0);
             *(uint32_t *)(t1 + t2) = t0;
-            break;
+            TCI_NEXT();
 
             /* Arithmetic operations (32 bit). */
 
-        case INDEX_op_add_i32:
+        TCI_CASE(INDEX_op_add_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 + t2);
-            break;
-        case INDEX_op_sub_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_sub_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 - t2);
-            break;
-        case INDEX_op_mul_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_mul_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 * t2);
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_div_i32
-        case INDEX_op_div_i32:
+        TCI_CASE(INDEX_op_div_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, (int32_t)t1 / (int32_t)t2);
-            break;
-        case INDEX_op_divu_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_divu_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 / t2);
-            break;
-        case INDEX_op_rem_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_rem_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, (int32_t)t1 % (int32_t)t2);
-            break;
-        case INDEX_op_remu_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_remu_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 % t2);
-            break;
+            TCI_NEXT();
 #elif TCG_TARGET_HAS_div2_i32
-        case INDEX_op_div2_i32:
-        case INDEX_op_divu2_i32:
+        TCI_CASE(INDEX_op_div2_i32):
+        TCI_CASE(INDEX_op_divu2_i32):
             TODO();
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_and_i32:
+        TCI_CASE(INDEX_op_and_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 & t2);
-            break;
-        case INDEX_op_or_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_or_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 | t2);
-            break;
-        case INDEX_op_xor_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_xor_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 ^ t2);
-            break;
+            TCI_NEXT();
 
             /* Shift/rotate operations (32 bit). */
 
-        case INDEX_op_shl_i32:
+        TCI_CASE(INDEX_op_shl_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 << t2);
-            break;
-        case INDEX_op_shr_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_shr_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 >> t2);
-            break;
-        case INDEX_op_sar_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_sar_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, ((int32_t)t1 >> t2));
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_rot_i32
-        case INDEX_op_rotl_i32:
+        TCI_CASE(INDEX_op_rotl_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, rol32(t1, t2));
-            break;
-        case INDEX_op_rotr_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_rotr_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, ror32(t1, t2));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_deposit_i32
-        case INDEX_op_deposit_i32:
+        TCI_CASE(INDEX_op_deposit_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             t2 = tci_read_r32(&tb_ptr);
@@ -706,9 +933,9 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tmp8 = *tb_ptr++;
             tmp32 = (((1 << tmp8) - 1) << tmp16);
             tci_write_reg32(t0, (t1 & ~tmp32) | ((t2 << tmp16) & tmp32));
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_brcond_i32:
+        TCI_CASE(INDEX_op_brcond_i32):
             t0 = tci_read_r32(&tb_ptr);
             t1 = tci_read_ri32(&tb_ptr);
             condition = *tb_ptr++;
@@ -718,23 +945,23 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
                 tb_ptr = (uint8_t *)label;
                 continue;
             }
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_REG_BITS == 32
-        case INDEX_op_add2_i32:
+        TCI_CASE(INDEX_op_add2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             tmp64 = tci_read_r64(&tb_ptr);
             tmp64 += tci_read_r64(&tb_ptr);
             tci_write_reg64(t1, t0, tmp64);
-            break;
-        case INDEX_op_sub2_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_sub2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             tmp64 = tci_read_r64(&tb_ptr);
             tmp64 -= tci_read_r64(&tb_ptr);
             tci_write_reg64(t1, t0, tmp64);
-            break;
-        case INDEX_op_brcond2_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_brcond2_i32):
             tmp64 = tci_read_r64(&tb_ptr);
             v64 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
@@ -744,228 +971,228 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
                 tb_ptr = (uint8_t *)label;
                 continue;
             }
-            break;
-        case INDEX_op_mulu2_i32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_mulu2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             t2 = tci_read_r32(&tb_ptr);
             tmp64 = tci_read_r32(&tb_ptr);
             tci_write_reg64(t1, t0, t2 * tmp64);
-            break;
+            TCI_NEXT();
 #endif /* TCG_TARGET_REG_BITS == 32 */
 #if TCG_TARGET_HAS_ext8s_i32
-        case INDEX_op_ext8s_i32:
+        TCI_CASE(INDEX_op_ext8s_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r8s(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16s_i32
-        case INDEX_op_ext16s_i32:
+        TCI_CASE(INDEX_op_ext16s_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16s(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext8u_i32
-        case INDEX_op_ext8u_i32:
+        TCI_CASE(INDEX_op_ext8u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r8(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16u_i32
-        case INDEX_op_ext16u_i32:
+        TCI_CASE(INDEX_op_ext16u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap16_i32
-        case INDEX_op_bswap16_i32:
+        TCI_CASE(INDEX_op_bswap16_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg32(t0, bswap16(t1));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap32_i32
-        case INDEX_op_bswap32_i32:
+        TCI_CASE(INDEX_op_bswap32_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, bswap32(t1));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_not_i32
-        case INDEX_op_not_i32:
+        TCI_CASE(INDEX_op_not_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, ~t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_neg_i32
-        case INDEX_op_neg_i32:
+        TCI_CASE(INDEX_op_neg_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, -t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_REG_BITS == 64
-        case INDEX_op_mov_i64:
+        TCI_CASE(INDEX_op_mov_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
-        case INDEX_op_movi_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_movi_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_i64(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 
             /* Load/store operations (64 bit). */
 
-        case INDEX_op_ld8u_i64:
+        TCI_CASE(INDEX_op_ld8u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg8(t0, *(uint8_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld8s_i64:
-        case INDEX_op_ld16u_i64:
-        case INDEX_op_ld16s_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_ld8s_i64):
+        TCI_CASE(INDEX_op_ld16u_i64):
+        TCI_CASE(INDEX_op_ld16s_i64):
             TODO();
-            break;
-        case INDEX_op_ld32u_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_ld32u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld32s_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_ld32s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg32s(t0, *(int32_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_ld_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             tci_write_reg64(t0, *(uint64_t *)(t1 + t2));
-            break;
-        case INDEX_op_st8_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_st8_i64):
             t0 = tci_read_r8(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             *(uint8_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st16_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_st16_i64):
             t0 = tci_read_r16(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             *(uint16_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st32_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_st32_i64):
             t0 = tci_read_r32(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             *(uint32_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_st_i64):
             t0 = tci_read_r64(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_s32(&tb_ptr);
             assert(t1 != sp_value || (int32_t)t2 < 0);
             *(uint64_t *)(t1 + t2) = t0;
-            break;
+            TCI_NEXT();
 
             /* Arithmetic operations (64 bit). */
 
-        case INDEX_op_add_i64:
+        TCI_CASE(INDEX_op_add_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 + t2);
-            break;
-        case INDEX_op_sub_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_sub_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 - t2);
-            break;
-        case INDEX_op_mul_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_mul_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 * t2);
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_div_i64
-        case INDEX_op_div_i64:
-        case INDEX_op_divu_i64:
-        case INDEX_op_rem_i64:
-        case INDEX_op_remu_i64:
+        TCI_CASE(INDEX_op_div_i64):
+        TCI_CASE(INDEX_op_divu_i64):
+        TCI_CASE(INDEX_op_rem_i64):
+        TCI_CASE(INDEX_op_remu_i64):
             TODO();
-            break;
+            TCI_NEXT();
 #elif TCG_TARGET_HAS_div2_i64
-        case INDEX_op_div2_i64:
-        case INDEX_op_divu2_i64:
+        TCI_CASE(INDEX_op_div2_i64):
+        TCI_CASE(INDEX_op_divu2_i64):
             TODO();
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_and_i64:
+        TCI_CASE(INDEX_op_and_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 & t2);
-            break;
-        case INDEX_op_or_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_or_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 | t2);
-            break;
-        case INDEX_op_xor_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_xor_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 ^ t2);
-            break;
+            TCI_NEXT();
 
             /* Shift/rotate operations (64 bit). */
 
-        case INDEX_op_shl_i64:
+        TCI_CASE(INDEX_op_shl_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 << t2);
-            break;
-        case INDEX_op_shr_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_shr_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 >> t2);
-            break;
-        case INDEX_op_sar_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_sar_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, ((int64_t)t1 >> t2));
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_rot_i64
-        case INDEX_op_rotl_i64:
+        TCI_CASE(INDEX_op_rotl_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, rol64(t1, t2));
-            break;
-        case INDEX_op_rotr_i64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_rotr_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, ror64(t1, t2));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_deposit_i64
-        case INDEX_op_deposit_i64:
+        TCI_CASE(INDEX_op_deposit_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             t2 = tci_read_r64(&tb_ptr);
@@ -973,9 +1200,9 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tmp8 = *tb_ptr++;
             tmp64 = (((1ULL << tmp8) - 1) << tmp16);
             tci_write_reg64(t0, (t1 & ~tmp64) | ((t2 << tmp16) & tmp64));
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_brcond_i64:
+        TCI_CASE(INDEX_op_brcond_i64):
             t0 = tci_read_r64(&tb_ptr);
             t1 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
@@ -985,108 +1212,108 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
                 tb_ptr = (uint8_t *)label;
                 continue;
             }
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_ext8u_i64
-        case INDEX_op_ext8u_i64:
+        TCI_CASE(INDEX_op_ext8u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r8(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext8s_i64
-        case INDEX_op_ext8s_i64:
+        TCI_CASE(INDEX_op_ext8s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r8s(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16s_i64
-        case INDEX_op_ext16s_i64:
+        TCI_CASE(INDEX_op_ext16s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r16s(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16u_i64
-        case INDEX_op_ext16u_i64:
+        TCI_CASE(INDEX_op_ext16u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext32s_i64
-        case INDEX_op_ext32s_i64:
+        TCI_CASE(INDEX_op_ext32s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32s(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext32u_i64
-        case INDEX_op_ext32u_i64:
+        TCI_CASE(INDEX_op_ext32u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap16_i64
-        case INDEX_op_bswap16_i64:
+        TCI_CASE(INDEX_op_bswap16_i64):
             TODO();
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg64(t0, bswap16(t1));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap32_i64
-        case INDEX_op_bswap32_i64:
+        TCI_CASE(INDEX_op_bswap32_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg64(t0, bswap32(t1));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap64_i64
-        case INDEX_op_bswap64_i64:
+        TCI_CASE(INDEX_op_bswap64_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, bswap64(t1));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_not_i64
-        case INDEX_op_not_i64:
+        TCI_CASE(INDEX_op_not_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, ~t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_neg_i64
-        case INDEX_op_neg_i64:
+        TCI_CASE(INDEX_op_neg_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, -t1);
-            break;
+            TCI_NEXT();
 #endif
 #endif /* TCG_TARGET_REG_BITS == 64 */
 
             /* QEMU specific operations. */
 
 #if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
-        case INDEX_op_debug_insn_start:
+        TCI_CASE(INDEX_op_debug_insn_start):
             TODO();
-            break;
+            TCI_NEXT();
 #else
-        case INDEX_op_debug_insn_start:
+        TCI_CASE(INDEX_op_debug_insn_start):
             TODO();
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_exit_tb:
+        TCI_CASE(INDEX_op_exit_tb):
             next_tb = *(uint64_t *)tb_ptr;
             goto exit;
             break;
-        case INDEX_op_goto_tb:
+        TCI_CASE(INDEX_op_goto_tb):
             t0 = tci_read_i32(&tb_ptr);
             assert(tb_ptr == old_code_ptr + op_size);
             tb_ptr += (int32_t)t0;
             continue;
-        case INDEX_op_qemu_ld8u:
+        TCI_CASE(INDEX_op_qemu_ld8u):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1096,8 +1323,8 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tmp8 = *(uint8_t *)(host_addr + GUEST_BASE);
 #endif
             tci_write_reg8(t0, tmp8);
-            break;
-        case INDEX_op_qemu_ld8s:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_qemu_ld8s):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1107,8 +1334,8 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tmp8 = *(uint8_t *)(host_addr + GUEST_BASE);
 #endif
             tci_write_reg8s(t0, tmp8);
-            break;
-        case INDEX_op_qemu_ld16u:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_qemu_ld16u):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1118,8 +1345,8 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tmp16 = tswap16(*(uint16_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg16(t0, tmp16);
-            break;
-        case INDEX_op_qemu_ld16s:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_qemu_ld16s):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1129,9 +1356,9 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tmp16 = tswap16(*(uint16_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg16s(t0, tmp16);
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_REG_BITS == 64
-        case INDEX_op_qemu_ld32u:
+        TCI_CASE(INDEX_op_qemu_ld32u):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1141,8 +1368,8 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tmp32 = tswap32(*(uint32_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg32(t0, tmp32);
-            break;
-        case INDEX_op_qemu_ld32s:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_qemu_ld32s):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1152,9 +1379,9 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tmp32 = tswap32(*(uint32_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg32s(t0, tmp32);
-            break;
+            TCI_NEXT();
 #endif /* TCG_TARGET_REG_BITS == 64 */
-        case INDEX_op_qemu_ld32:
+        TCI_CASE(INDEX_op_qemu_ld32):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1164,8 +1391,8 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             tmp32 = tswap32(*(uint32_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg32(t0, tmp32);
-            break;
-        case INDEX_op_qemu_ld64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_qemu_ld64):
             t0 = *tb_ptr++;
 #if TCG_TARGET_REG_BITS == 32
             t1 = *tb_ptr++;
@@ -1181,8 +1408,8 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 #if TCG_TARGET_REG_BITS == 32
             tci_write_reg(t1, tmp64 >> 32);
 #endif
-            break;
-        case INDEX_op_qemu_st8:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_qemu_st8):
             t0 = tci_read_r8(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1192,8 +1419,8 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             host_addr = (tcg_target_ulong)taddr;
             *(uint8_t *)(host_addr + GUEST_BASE) = t0;
 #endif
-            break;
-        case INDEX_op_qemu_st16:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_qemu_st16):
             t0 = tci_read_r16(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1203,8 +1430,8 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             host_addr = (tcg_target_ulong)taddr;
             *(uint16_t *)(host_addr + GUEST_BASE) = tswap16(t0);
 #endif
-            break;
-        case INDEX_op_qemu_st32:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_qemu_st32):
             t0 = tci_read_r32(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1214,8 +1441,8 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             host_addr = (tcg_target_ulong)taddr;
             *(uint32_t *)(host_addr + GUEST_BASE) = tswap32(t0);
 #endif
-            break;
-        case INDEX_op_qemu_st64:
+            TCI_NEXT();
+        TCI_CASE(INDEX_op_qemu_st64):
             tmp64 = tci_read_r64(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1225,8 +1452,43 @@ uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
             host_addr = (tcg_target_ulong)taddr;
             *(uint64_t *)(host_addr + GUEST_BASE) = tswap64(tmp64);
 #endif
-            break;
+            TCI_NEXT();
+        TCI_CASE(TCI_OP_ld_brcond_i32):
+            t0 = *tb_ptr++;
+            t1 = tci_read_r(&tb_ptr);
+            t2 = tci_read_s32(&tb_ptr);
+            tmp32 = *(uint32_t *)(t1 + t2);
+            tci_write_reg32(t0, tmp32);
+            t1 = tci_read_ri32(&tb_ptr);
+            condition = *tb_ptr++;
+            label = tci_read_label(&tb_ptr);
+            if (tci_compare32(tmp32, t1, condition)) {
+                assert(tb_ptr == old_code_ptr + op_size);
+                tb_ptr = (uint8_t *)label;
+                continue;
+            }
+            TCI_NEXT();
+#if TCG_TARGET_REG_BITS == 64
+        TCI_CASE(TCI_OP_ld_brcond_i64):
+            t0 = *tb_ptr++;
+            t1 = tci_read_r(&tb_ptr);
+            t2 = tci_read_s32(&tb_ptr);
+            tmp64 = *(uint64_t *)(t1 + t2);
+            tci_write_reg64(t0, tmp64);
+            t1 = tci_read_ri64(&tb_ptr);
+            condition = *tb_ptr++;
+            label = tci_read_label(&tb_ptr);
+            if (tci_compare64(tmp64, t1, condition)) {
+                assert(tb_ptr == old_code_ptr + op_size);
+                tb_ptr = (uint8_t *)label;
+                continue;
+            }
+            TCI_NEXT();
+#endif
         default:
+#if defined(TCI_THREADED)
+        do_default:
+#endif
             TODO();
             break;
         }
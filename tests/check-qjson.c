@@ -1241,6 +1241,44 @@ static void large_dict(void)
     g_string_free(gstr, true);
 }
 
+static void json_write_append(void *opaque, const char *buf, size_t len)
+{
+    GString *gstr = opaque;
+
+    g_assert_cmpint(strlen(buf), ==, len);
+    g_string_append(gstr, buf);
+}
+
+/* The writer is called several times for a large object, and the pieces
+ * add up to what qobject_to_json returns.
+ */
+static void large_dict_write(void)
+{
+    GString *gstr = g_string_new("");
+    GString *out = g_string_new("");
+    QObject *obj, *obj2;
+    QString *str;
+
+    gen_test_json(gstr, 10, 100);
+    obj = qobject_from_json(gstr->str);
+    g_assert(obj != NULL);
+
+    qobject_to_json_write(obj, false, json_write_append, out);
+    str = qobject_to_json(obj);
+    g_assert_cmpint(out->len, >, 4096);
+    g_assert_cmpstr(qstring_get_str(str), ==, out->str);
+
+    obj2 = qobject_from_json(out->str);
+    g_assert(obj2 != NULL);
+    g_assert(qobject_type(obj2) == QTYPE_QDICT);
+
+    qobject_decref(obj2);
+    QDECREF(str);
+    qobject_decref(obj);
+    g_string_free(out, true);
+    g_string_free(gstr, true);
+}
+
 static void simple_list(void)
 {
     int i;
@@ -1483,6 +1521,7 @@ int main(int argc, char **argv)
 
     g_test_add_func("/dicts/simple_dict", simple_dict);
     g_test_add_func("/dicts/large_dict", large_dict);
+    g_test_add_func("/dicts/large_dict_write", large_dict_write);
     g_test_add_func("/lists/simple_list", simple_list);
 
     g_test_add_func("/whitespace/simple_whitespace", simple_whitespace);
@@ -38,7 +38,58 @@ static void test_fw_cfg_signature(void)
 
 static void test_fw_cfg_id(void)
 {
-    g_assert_cmpint(qfw_cfg_get_u32(fw_cfg, FW_CFG_ID), ==, 1);
+    g_assert_cmpint(qfw_cfg_get_u32(fw_cfg, FW_CFG_ID), ==,
+                    FW_CFG_VERSION | FW_CFG_VERSION_DMA);
+}
+
+#define DMA_DESC_ADDR   0x200000
+#define DMA_BUF_ADDR    0x201000
+
+/* Runs a DMA transfer and returns the control word written back */
+static uint32_t fw_cfg_dma(uint32_t control, uint32_t length)
+{
+    uint8_t desc[16];
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        desc[i] = control >> (24 - i * 8);
+        desc[4 + i] = length >> (24 - i * 8);
+    }
+    for (i = 0; i < 8; i++) {
+        desc[8 + i] = (uint64_t)DMA_BUF_ADDR >> (56 - i * 8);
+    }
+    memwrite(DMA_DESC_ADDR, desc, sizeof(desc));
+
+    /* The register is big endian */
+    outl(0x514, GUINT32_TO_BE(0));
+    outl(0x518, GUINT32_TO_BE(DMA_DESC_ADDR));
+
+    return GUINT32_FROM_BE(readl(DMA_DESC_ADDR));
+}
+
+static void test_fw_cfg_dma(void)
+{
+    uint8_t buf[8];
+
+    memset(buf, 0xff, sizeof(buf));
+    memwrite(DMA_BUF_ADDR, buf, sizeof(buf));
+
+    /* Reading past the end of the item fills with zeroes */
+    g_assert_cmphex(fw_cfg_dma(FW_CFG_DMA_CTL_SELECT | FW_CFG_DMA_CTL_READ |
+                               (FW_CFG_SIGNATURE << 16), sizeof(buf)), ==, 0);
+    memread(DMA_BUF_ADDR, buf, sizeof(buf));
+    g_assert(memcmp(buf, "QEMU\0\0\0\0", sizeof(buf)) == 0);
+
+    /* Skip, then read from the current offset */
+    g_assert_cmphex(fw_cfg_dma(FW_CFG_DMA_CTL_SELECT | FW_CFG_DMA_CTL_SKIP |
+                               (FW_CFG_SIGNATURE << 16), 2), ==, 0);
+    g_assert_cmphex(fw_cfg_dma(FW_CFG_DMA_CTL_READ, 2), ==, 0);
+    memread(DMA_BUF_ADDR, buf, 2);
+    g_assert(memcmp(buf, "MU", 2) == 0);
+
+    /* The register identifies itself */
+    g_assert_cmphex(GUINT32_FROM_BE(inl(0x514)), ==,
+                    FW_CFG_DMA_SIGNATURE >> 32);
 }
 
 static void test_fw_cfg_uuid(void)
@@ -125,6 +176,7 @@ int main(int argc, char **argv)
     g_test_add_func("/fw_cfg/max_cpus", test_fw_cfg_max_cpus);
     g_test_add_func("/fw_cfg/numa", test_fw_cfg_numa);
     g_test_add_func("/fw_cfg/boot_menu", test_fw_cfg_boot_menu);
+    g_test_add_func("/fw_cfg/dma", test_fw_cfg_dma);
 
     cmdline = g_strdup_printf("-uuid 4600cb32-38ec-4b2f-8acb-81c6ea54f2d8 ");
     s = qtest_start(cmdline);
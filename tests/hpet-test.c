@@ -0,0 +1,94 @@
+/*
+ * QTest testcase for the HPET
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "libqtest.h"
+#include "hw/timer/hpet.h"
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define BIOS_SIZE       0x10000
+#define COUNTER_VALUE   0x12345678
+
+static char bios_path[] = "/tmp/qtest-hpet.XXXXXX";
+
+/* A BIOS whose reset vector writes COUNTER_VALUE to the main counter and
+ * spins.  In real mode, TCG does not check segment limits, so a 32-bit
+ * address reaches the HPET.
+ */
+static void create_bios(void)
+{
+    static const uint8_t reset[] = {
+        /* movl $COUNTER_VALUE, HPET_BASE + HPET_COUNTER */
+        0x66, 0x67, 0xc7, 0x05,
+        (HPET_BASE + HPET_COUNTER) & 0xff,
+        ((HPET_BASE + HPET_COUNTER) >> 8) & 0xff,
+        ((HPET_BASE + HPET_COUNTER) >> 16) & 0xff,
+        ((HPET_BASE + HPET_COUNTER) >> 24) & 0xff,
+        COUNTER_VALUE & 0xff, (COUNTER_VALUE >> 8) & 0xff,
+        (COUNTER_VALUE >> 16) & 0xff, (COUNTER_VALUE >> 24) & 0xff,
+        /* 1: jmp 1b */
+        0xeb, 0xfe,
+    };
+    uint8_t *bios;
+    ssize_t ret;
+    int fd;
+
+    bios = g_malloc0(BIOS_SIZE);
+    memcpy(bios + BIOS_SIZE - 16, reset, sizeof(reset));
+
+    fd = mkstemp(bios_path);
+    g_assert(fd >= 0);
+    ret = write(fd, bios, BIOS_SIZE);
+    g_assert(ret == BIOS_SIZE);
+    close(fd);
+    g_free(bios);
+}
+
+/* The vCPU thread runs guest code with the global mutex held, and must
+ * not take it again to write the counter.
+ */
+static void test_counter_write_tcg(void)
+{
+    char *args;
+    uint32_t counter = 0;
+    int i;
+
+    args = g_strdup_printf("-machine accel=tcg -bios %s", bios_path);
+    qtest_start(args);
+
+    for (i = 0; i < 500; i++) {
+        counter = readl(HPET_BASE + HPET_COUNTER);
+        if (counter == COUNTER_VALUE) {
+            break;
+        }
+        g_usleep(10000);
+    }
+    g_assert_cmphex(counter, ==, COUNTER_VALUE);
+
+    qtest_end();
+    g_free(args);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    create_bios();
+    qtest_add_func("/hpet/counter-write/tcg", test_counter_write_tcg);
+    ret = g_test_run();
+    unlink(bios_path);
+
+    return ret;
+}
@@ -0,0 +1,160 @@
+/*
+ * libqos virtio-pci driver
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The legacy interface: the registers are in BAR 0, and MSI-X is left
+ * disabled so that the device configuration starts at offset 20.
+ */
+
+#include <glib.h>
+
+#include "libqos/virtio-pci.h"
+
+#include "qemu-common.h"
+#include "hw/pci/pci_regs.h"
+
+#define QVIRTIO_PCI_HOST_FEATURES       0
+#define QVIRTIO_PCI_GUEST_FEATURES      4
+#define QVIRTIO_PCI_QUEUE_PFN           8
+#define QVIRTIO_PCI_QUEUE_NUM           12
+#define QVIRTIO_PCI_QUEUE_SEL           14
+#define QVIRTIO_PCI_QUEUE_NOTIFY        16
+#define QVIRTIO_PCI_STATUS              18
+#define QVIRTIO_PCI_ISR                 19
+#define QVIRTIO_PCI_CONFIG              20
+
+typedef struct QVirtioPCIForeachData {
+    uint16_t device_type;
+    QVirtioPCIDevice *found;
+} QVirtioPCIForeachData;
+
+static uint8_t qvirtio_pci_config_readb(QVirtioDevice *d, uint64_t offset)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    return qpci_io_readb(dev->pdev, dev->addr + QVIRTIO_PCI_CONFIG + offset);
+}
+
+static uint16_t qvirtio_pci_config_readw(QVirtioDevice *d, uint64_t offset)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    return qpci_io_readw(dev->pdev, dev->addr + QVIRTIO_PCI_CONFIG + offset);
+}
+
+static uint32_t qvirtio_pci_config_readl(QVirtioDevice *d, uint64_t offset)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    return qpci_io_readl(dev->pdev, dev->addr + QVIRTIO_PCI_CONFIG + offset);
+}
+
+static uint64_t qvirtio_pci_config_readq(QVirtioDevice *d, uint64_t offset)
+{
+    return qvirtio_pci_config_readl(d, offset) |
+           ((uint64_t)qvirtio_pci_config_readl(d, offset + 4) << 32);
+}
+
+static uint32_t qvirtio_pci_get_features(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    return qpci_io_readl(dev->pdev, dev->addr + QVIRTIO_PCI_HOST_FEATURES);
+}
+
+static void qvirtio_pci_set_features(QVirtioDevice *d, uint32_t features)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    qpci_io_writel(dev->pdev, dev->addr + QVIRTIO_PCI_GUEST_FEATURES,
+                   features);
+}
+
+static uint8_t qvirtio_pci_get_status(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    return qpci_io_readb(dev->pdev, dev->addr + QVIRTIO_PCI_STATUS);
+}
+
+static void qvirtio_pci_set_status(QVirtioDevice *d, uint8_t status)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    qpci_io_writeb(dev->pdev, dev->addr + QVIRTIO_PCI_STATUS, status);
+}
+
+static uint8_t qvirtio_pci_get_isr_status(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    return qpci_io_readb(dev->pdev, dev->addr + QVIRTIO_PCI_ISR);
+}
+
+static void qvirtio_pci_queue_select(QVirtioDevice *d, uint16_t index)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    qpci_io_writew(dev->pdev, dev->addr + QVIRTIO_PCI_QUEUE_SEL, index);
+}
+
+static uint16_t qvirtio_pci_get_queue_size(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    return qpci_io_readw(dev->pdev, dev->addr + QVIRTIO_PCI_QUEUE_NUM);
+}
+
+static void qvirtio_pci_set_queue_address(QVirtioDevice *d, uint32_t pfn)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    qpci_io_writel(dev->pdev, dev->addr + QVIRTIO_PCI_QUEUE_PFN, pfn);
+}
+
+static void qvirtio_pci_notify(QVirtioDevice *d, uint16_t index)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    qpci_io_writew(dev->pdev, dev->addr + QVIRTIO_PCI_QUEUE_NOTIFY, index);
+}
+
+const QVirtioBus qvirtio_pci = {
+    .config_readb = qvirtio_pci_config_readb,
+    .config_readw = qvirtio_pci_config_readw,
+    .config_readl = qvirtio_pci_config_readl,
+    .config_readq = qvirtio_pci_config_readq,
+    .get_features = qvirtio_pci_get_features,
+    .set_features = qvirtio_pci_set_features,
+    .get_status = qvirtio_pci_get_status,
+    .set_status = qvirtio_pci_set_status,
+    .get_isr_status = qvirtio_pci_get_isr_status,
+    .queue_select = qvirtio_pci_queue_select,
+    .get_queue_size = qvirtio_pci_get_queue_size,
+    .set_queue_address = qvirtio_pci_set_queue_address,
+    .notify = qvirtio_pci_notify,
+};
+
+static void qvirtio_pci_foreach_callback(QPCIDevice *dev, int devfn,
+                                         void *data)
+{
+    QVirtioPCIForeachData *d = data;
+
+    /* Legacy devices have the virtio device type as subsystem ID */
+    if (d->found ||
+        qpci_config_readw(dev, PCI_SUBSYSTEM_ID) != d->device_type) {
+        g_free(dev);
+        return;
+    }
+    d->found = g_new0(QVirtioPCIDevice, 1);
+    d->found->vdev.device_type = d->device_type;
+    d->found->pdev = dev;
+}
+
+QVirtioPCIDevice *qvirtio_pci_device_find(QPCIBus *bus, uint16_t device_type)
+{
+    QVirtioPCIForeachData data = { .device_type = device_type };
+
+    qpci_device_foreach(bus, QVIRTIO_VENDOR_ID, -1,
+                        qvirtio_pci_foreach_callback, &data);
+    return data.found;
+}
+
+void qvirtio_pci_device_enable(QVirtioPCIDevice *d)
+{
+    d->addr = qpci_iomap(d->pdev, 0);
+    g_assert(d->addr != NULL);
+    qpci_device_enable(d->pdev);
+}
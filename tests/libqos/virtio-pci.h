@@ -0,0 +1,30 @@
+/*
+ * libqos virtio-pci driver
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef LIBQOS_VIRTIO_PCI_H
+#define LIBQOS_VIRTIO_PCI_H
+
+#include "libqos/virtio.h"
+#include "libqos/pci.h"
+
+typedef struct QVirtioPCIDevice {
+    QVirtioDevice vdev;
+    QPCIDevice *pdev;
+    void *addr;
+} QVirtioPCIDevice;
+
+extern const QVirtioBus qvirtio_pci;
+
+/* Find the first legacy virtio-pci device of the given type, or NULL */
+QVirtioPCIDevice *qvirtio_pci_device_find(QPCIBus *bus, uint16_t device_type);
+
+/* Enable the device and map its I/O BAR */
+void qvirtio_pci_device_enable(QVirtioPCIDevice *d);
+
+#endif
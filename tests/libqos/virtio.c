@@ -0,0 +1,175 @@
+/*
+ * libqos virtio driver
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Split virtqueues with the legacy layout.  Guest memory is only accessed
+ * through libqtest, so every access is a round trip to QEMU; the driver
+ * keeps what it wrote in host memory and reads back only the used ring.
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "libqtest.h"
+#include "libqos/virtio.h"
+
+#include "qemu-common.h"
+
+typedef struct QVRingDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} QEMU_PACKED QVRingDesc;
+
+/* How long qvirtqueue_wait_buf waits for the device */
+#define QVIRTIO_TIMEOUT_S       5
+
+void qvirtio_reset(const QVirtioBus *bus, QVirtioDevice *d)
+{
+    bus->set_status(d, QVIRTIO_RESET);
+    g_assert_cmphex(bus->get_status(d), ==, QVIRTIO_RESET);
+}
+
+void qvirtio_set_acknowledge(const QVirtioBus *bus, QVirtioDevice *d)
+{
+    bus->set_status(d, bus->get_status(d) | QVIRTIO_ACKNOWLEDGE);
+    g_assert_cmphex(bus->get_status(d), ==, QVIRTIO_ACKNOWLEDGE);
+}
+
+void qvirtio_set_driver(const QVirtioBus *bus, QVirtioDevice *d)
+{
+    bus->set_status(d, bus->get_status(d) | QVIRTIO_DRIVER);
+    g_assert_cmphex(bus->get_status(d), ==,
+                    QVIRTIO_DRIVER | QVIRTIO_ACKNOWLEDGE);
+}
+
+void qvirtio_set_driver_ok(const QVirtioBus *bus, QVirtioDevice *d)
+{
+    bus->set_status(d, bus->get_status(d) | QVIRTIO_DRIVER_OK);
+    g_assert_cmphex(bus->get_status(d), ==,
+                    QVIRTIO_DRIVER_OK | QVIRTIO_DRIVER | QVIRTIO_ACKNOWLEDGE);
+}
+
+static uint64_t qvring_align(uint64_t addr)
+{
+    return (addr + QVRING_ALIGN - 1) & ~(uint64_t)(QVRING_ALIGN - 1);
+}
+
+QVirtQueue *qvirtqueue_setup(const QVirtioBus *bus, QVirtioDevice *d,
+                             QGuestAllocator *alloc, uint16_t index)
+{
+    QVirtQueue *vq = g_new0(QVirtQueue, 1);
+    uint64_t size, addr;
+    uint8_t *zero;
+    int i;
+
+    bus->queue_select(d, index);
+    vq->index = index;
+    vq->size = bus->get_queue_size(d);
+    g_assert_cmpint(vq->size, >, 0);
+
+    /* Descriptors, then the available ring with flags, index and
+     * used_event, then the used ring with flags, index and avail_event.
+     */
+    size = qvring_align(16 * vq->size + 2 * (3 + vq->size)) +
+           qvring_align(2 * 3 + 8 * vq->size);
+    addr = guest_alloc(alloc, size);
+    g_assert_cmphex(addr & (QVRING_ALIGN - 1), ==, 0);
+
+    vq->desc = addr;
+    vq->avail = addr + 16 * vq->size;
+    vq->used = qvring_align(vq->avail + 2 * (3 + vq->size));
+
+    zero = g_malloc0(size);
+    memwrite(addr, zero, size);
+    g_free(zero);
+
+    vq->next = g_new(uint16_t, vq->size);
+    vq->has_next = g_new0(bool, vq->size);
+    for (i = 0; i < vq->size; i++) {
+        vq->next[i] = i + 1;
+    }
+    vq->free_head = 0;
+    vq->num_free = vq->size;
+
+    bus->set_queue_address(d, addr / QVRING_ALIGN);
+    return vq;
+}
+
+uint16_t qvirtqueue_add(QVirtQueue *vq, uint64_t data, uint32_t len,
+                        bool write, bool next)
+{
+    QVRingDesc desc;
+    uint16_t i;
+
+    g_assert_cmpint(vq->num_free, >, 0);
+    i = vq->free_head;
+    vq->free_head = vq->next[i];
+    vq->num_free--;
+
+    /* A chain continues with the next free descriptor, which is the one
+     * that the following call takes.
+     */
+    vq->has_next[i] = next;
+    desc.addr = cpu_to_le64(data);
+    desc.len = cpu_to_le32(len);
+    desc.flags = cpu_to_le16((next ? QVRING_DESC_F_NEXT : 0) |
+                             (write ? QVRING_DESC_F_WRITE : 0));
+    desc.next = cpu_to_le16(next ? vq->free_head : 0);
+    memwrite(vq->desc + 16 * i, &desc, sizeof(desc));
+    return i;
+}
+
+void qvirtqueue_push(QVirtQueue *vq, uint16_t head)
+{
+    writew(vq->avail + 4 + 2 * (vq->avail_idx % vq->size), head);
+    vq->avail_idx++;
+}
+
+void qvirtqueue_kick(const QVirtioBus *bus, QVirtioDevice *d,
+                     QVirtQueue *vq)
+{
+    writew(vq->avail + 2, vq->avail_idx);
+    bus->notify(d, vq->index);
+}
+
+bool qvirtqueue_get_buf(QVirtQueue *vq, uint16_t *head, uint32_t *len)
+{
+    uint64_t elem;
+    uint16_t last;
+
+    if (readw(vq->used + 2) == vq->last_used_idx) {
+        return false;
+    }
+
+    elem = vq->used + 4 + 8 * (vq->last_used_idx % vq->size);
+    *head = readl(elem);
+    *len = readl(elem + 4);
+    vq->last_used_idx++;
+
+    /* Put the whole chain back at the head of the free list */
+    g_assert_cmpint(*head, <, vq->size);
+    for (last = *head; vq->has_next[last]; last = vq->next[last]) {
+        vq->num_free++;
+    }
+    vq->num_free++;
+    vq->next[last] = vq->free_head;
+    vq->free_head = *head;
+    return true;
+}
+
+void qvirtqueue_wait_buf(QVirtQueue *vq, uint16_t *head, uint32_t *len)
+{
+    GTimer *timer = g_timer_new();
+
+    while (!qvirtqueue_get_buf(vq, head, len)) {
+        g_assert_cmpfloat(g_timer_elapsed(timer, NULL), <,
+                          QVIRTIO_TIMEOUT_S);
+    }
+    g_timer_destroy(timer);
+}
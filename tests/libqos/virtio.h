@@ -0,0 +1,108 @@
+/*
+ * libqos virtio driver
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef LIBQOS_VIRTIO_H
+#define LIBQOS_VIRTIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "libqos/malloc.h"
+
+#define QVIRTIO_VENDOR_ID       0x1AF4
+
+#define QVIRTIO_NET_DEVICE_ID   0x1
+#define QVIRTIO_BLK_DEVICE_ID   0x2
+
+#define QVIRTIO_RESET           0x0
+#define QVIRTIO_ACKNOWLEDGE     0x1
+#define QVIRTIO_DRIVER          0x2
+#define QVIRTIO_DRIVER_OK       0x4
+
+#define QVRING_DESC_F_NEXT      0x1
+#define QVRING_DESC_F_WRITE     0x2
+
+#define QVRING_ALIGN            4096
+
+typedef struct QVirtioDevice {
+    /* Device type, one of the QVIRTIO_*_DEVICE_ID values */
+    uint16_t device_type;
+} QVirtioDevice;
+
+typedef struct QVirtQueue {
+    uint64_t desc;          /* guest addresses of the three parts */
+    uint64_t avail;
+    uint64_t used;
+    uint16_t index;
+    uint16_t size;
+    uint16_t avail_idx;
+    uint16_t last_used_idx;
+
+    /* Free descriptors are chained through next[], starting at free_head.
+     * next[] and has_next[] mirror the descriptors that the driver wrote,
+     * so that completed chains can be freed without reading them back.
+     */
+    uint16_t free_head;
+    uint16_t num_free;
+    uint16_t *next;
+    bool *has_next;
+} QVirtQueue;
+
+/* The transport, for example virtio-pci */
+typedef struct QVirtioBus {
+    uint8_t (*config_readb)(QVirtioDevice *d, uint64_t offset);
+    uint16_t (*config_readw)(QVirtioDevice *d, uint64_t offset);
+    uint32_t (*config_readl)(QVirtioDevice *d, uint64_t offset);
+    uint64_t (*config_readq)(QVirtioDevice *d, uint64_t offset);
+
+    uint32_t (*get_features)(QVirtioDevice *d);
+    void (*set_features)(QVirtioDevice *d, uint32_t features);
+
+    uint8_t (*get_status)(QVirtioDevice *d);
+    void (*set_status)(QVirtioDevice *d, uint8_t status);
+    uint8_t (*get_isr_status)(QVirtioDevice *d);
+
+    void (*queue_select)(QVirtioDevice *d, uint16_t index);
+    uint16_t (*get_queue_size)(QVirtioDevice *d);
+    void (*set_queue_address)(QVirtioDevice *d, uint32_t pfn);
+    void (*notify)(QVirtioDevice *d, uint16_t index);
+} QVirtioBus;
+
+void qvirtio_reset(const QVirtioBus *bus, QVirtioDevice *d);
+void qvirtio_set_acknowledge(const QVirtioBus *bus, QVirtioDevice *d);
+void qvirtio_set_driver(const QVirtioBus *bus, QVirtioDevice *d);
+void qvirtio_set_driver_ok(const QVirtioBus *bus, QVirtioDevice *d);
+
+/* Allocate virtqueue @index in guest memory and hand it to the device */
+QVirtQueue *qvirtqueue_setup(const QVirtioBus *bus, QVirtioDevice *d,
+                             QGuestAllocator *alloc, uint16_t index);
+
+/* Add a buffer to the chain being built and return its descriptor, which
+ * is the head of the chain for the first buffer.  Set @next for every
+ * buffer but the last.
+ */
+uint16_t qvirtqueue_add(QVirtQueue *vq, uint64_t data, uint32_t len,
+                        bool write, bool next);
+
+/* Make the chain starting at @head available; the device only looks at
+ * it after qvirtqueue_kick.
+ */
+void qvirtqueue_push(QVirtQueue *vq, uint16_t head);
+void qvirtqueue_kick(const QVirtioBus *bus, QVirtioDevice *d,
+                     QVirtQueue *vq);
+
+/* Reap one used chain and free its descriptors.  Returns false if the
+ * device has not completed anything new.
+ */
+bool qvirtqueue_get_buf(QVirtQueue *vq, uint16_t *head, uint32_t *len);
+
+/* Like qvirtqueue_get_buf, but wait up to a few seconds for a completion */
+void qvirtqueue_wait_buf(QVirtQueue *vq, uint16_t *head, uint32_t *len);
+
+#endif
@@ -186,6 +186,34 @@ void qtest_quit(QTestState *s)
     g_free(s);
 }
 
+double qtest_cpu_time(QTestState *s)
+{
+    unsigned long utime, stime;
+    char *path, *contents, *p;
+    double ret = -1;
+    pid_t pid;
+
+    pid = qtest_qemu_pid(s);
+    if (pid == -1) {
+        return -1;
+    }
+
+    /* utime and stime are the 14th and 15th fields, the first fields
+     * after the parenthesized command name are all numbers
+     */
+    path = g_strdup_printf("/proc/%d/stat", pid);
+    if (g_file_get_contents(path, &contents, NULL, NULL)) {
+        p = strrchr(contents, ')');
+        if (p && sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                        "%lu %lu", &utime, &stime) == 2) {
+            ret = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+        }
+        g_free(contents);
+    }
+    g_free(path);
+    return ret;
+}
+
 static void socket_sendf(int fd, const char *fmt, va_list ap)
 {
     gchar *str;
@@ -299,7 +327,7 @@ typedef struct {
     QDict *response;
 } QMPResponseParser;
 
-static void qmp_response(JSONMessageParser *parser, QList *tokens)
+static void qmp_response(JSONMessageParser *parser, GQueue *tokens)
 {
     QMPResponseParser *qmp = container_of(parser, QMPResponseParser, parser);
     QObject *obj;
@@ -575,6 +603,14 @@ void qtest_add_func(const char *str, void (*fn))
     g_test_add_func(path, fn);
 }
 
+void qtest_add_data_func(const char *str, const void *data,
+                         void (*fn)(const void *))
+{
+    gchar *path = g_strdup_printf("/%s/%s", qtest_get_arch(), str);
+    g_test_add_data_func(path, data, fn);
+    g_free(path);
+}
+
 void qtest_memwrite(QTestState *s, uint64_t addr, const void *data, size_t size)
 {
     const uint8_t *ptr = data;
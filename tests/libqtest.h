@@ -306,6 +306,16 @@ int64_t qtest_clock_step(QTestState *s, int64_t step);
  */
 int64_t qtest_clock_set(QTestState *s, int64_t val);
 
+/**
+ * qtest_cpu_time:
+ * @s: #QTestState instance to operate on.
+ *
+ * Returns: The user and system CPU time that the QEMU process has used so
+ * far, in seconds, or -1 if it cannot be determined.  Only implemented
+ * on Linux.
+ */
+double qtest_cpu_time(QTestState *s);
+
 /**
  * qtest_get_arch:
  *
@@ -324,6 +334,19 @@ const char *qtest_get_arch(void);
  */
 void qtest_add_func(const char *str, void (*fn));
 
+/**
+ * qtest_add_data_func:
+ * @str: Test case path.
+ * @data: Test case data
+ * @fn: Test case function
+ *
+ * Add a GTester testcase with the given name, data and function.
+ * The path is prefixed with the architecture under test, as
+ * returned by qtest_get_arch().
+ */
+void qtest_add_data_func(const char *str, const void *data,
+                         void (*fn)(const void *));
+
 /**
  * qtest_start:
  * @args: other arguments to pass to QEMU
@@ -0,0 +1,115 @@
+/*
+ *  TCG backend micro benchmarks for the optional integer ops
+ *
+ *  Each kernel stresses one TCG op that a host backend may implement
+ *  natively or leave to the generic expansion in tcg-op.h: 64x64->128 bit
+ *  multiplies (muluh), conditional moves (movcond) and byte register
+ *  writes (deposit).  Run it under QEMU built with and without a backend
+ *  change and compare the times; the checksums must match the native run.
+ *  The 'speed-alu' make target does this for x86_64.
+ *
+ *  Copyright (c) 2014 QEMU contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#define ITERATIONS 20000000
+
+static uint64_t data[256];
+
+/* the high half of a 128 bit product, as in hashing and bignum code */
+static uint64_t bench_mulhi(void)
+{
+    uint64_t sum = 0;
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        uint64_t a = data[i & 255], b = data[(i + 1) & 255];
+
+        sum += (uint64_t)(((unsigned __int128)a * (b | 1)) >> 64);
+    }
+    return sum;
+}
+
+/* branchless min and max */
+static uint64_t bench_select(void)
+{
+    uint64_t sum = 0;
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        uint64_t a = data[i & 255], b = data[(i + 7) & 255];
+        uint64_t lo, hi;
+
+        hi = a;
+        lo = b;
+        asm("cmp %2, %3\n\t"
+            "cmova %3, %0\n\t"
+            "cmova %2, %1"
+            : "+r"(hi), "+r"(lo) : "r"(a), "r"(b) : "cc");
+        sum += lo ^ (hi >> 3);
+    }
+    return sum;
+}
+
+/* 8 and 16 bit writes to a register keep its other bits */
+static uint64_t bench_partial(void)
+{
+    uint64_t sum = 0, x = 0x0123456789abcdefULL;
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        uint64_t c = data[i & 255];
+
+        asm("movb %b1, %b0\n\t"
+            "movw %w1, %w0\n\t"
+            "movb %b2, %h0"
+            : "+Q"(x) : "Q"(c), "Q"(c >> 13));
+        sum += x;
+        x = (x << 1) | (x >> 63);
+    }
+    return sum;
+}
+
+static void run(const char *name, uint64_t (*fn)(void))
+{
+    struct timeval start, end;
+    uint64_t sum;
+    long us;
+
+    gettimeofday(&start, NULL);
+    sum = fn();
+    gettimeofday(&end, NULL);
+    us = (end.tv_sec - start.tv_sec) * 1000000L +
+         (end.tv_usec - start.tv_usec);
+    printf("%-8s %016llx %8ld us\n", name, (unsigned long long)sum, us);
+}
+
+int main(void)
+{
+    uint64_t x = 12345;
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        data[i] = x;
+    }
+    run("mulhi", bench_mulhi);
+    run("select", bench_select);
+    run("partial", bench_partial);
+    return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ *  Floating point micro benchmarks
+ *
+ *  Each kernel runs one kind of operation on normal numbers, the case the
+ *  host FPU fast path in fpu/softfloat.c handles.  Build it for SSE so that
+ *  the i386 target goes through float32 and float64 rather than the x87
+ *  floatx80 code, and compare the times under QEMU with the native run.
+ *  The checksums must match.  The 'speed-fp' make target does this for
+ *  i386.
+ *
+ *  Copyright (c) 2014 QEMU contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#define ITERATIONS 10000000
+
+static double data[256];
+static float fdata[256];
+
+static double bench_add64(void)
+{
+    double sum = 0;
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        sum += data[i & 255];
+    }
+    return sum;
+}
+
+static double bench_mul64(void)
+{
+    double sum = 0;
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        sum += data[i & 255] * data[(i + 1) & 255];
+    }
+    return sum;
+}
+
+static double bench_div64(void)
+{
+    double sum = 0;
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        sum += 1.0 / data[i & 255];
+    }
+    return sum;
+}
+
+static double bench_sqrt64(void)
+{
+    double sum = 0;
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        sum += sqrt(data[i & 255]);
+    }
+    return sum;
+}
+
+/* a small dot product, the inner loop of most scientific code */
+static double bench_dot32(void)
+{
+    float sum = 0;
+    int i, j;
+
+    for (i = 0; i < ITERATIONS / 256; i++) {
+        for (j = 0; j < 256; j++) {
+            sum += fdata[j] * fdata[255 - j];
+        }
+        sum *= 0.5f;
+    }
+    return sum;
+}
+
+static void run(const char *name, double (*fn)(void))
+{
+    struct timeval start, end;
+    uint64_t bits;
+    double r;
+    long us;
+
+    gettimeofday(&start, NULL);
+    r = fn();
+    gettimeofday(&end, NULL);
+    us = (end.tv_sec - start.tv_sec) * 1000000L +
+         (end.tv_usec - start.tv_usec);
+    memcpy(&bits, &r, sizeof(bits));
+    printf("%-8s %016llx %8ld us\n", name, (unsigned long long)bits, us);
+}
+
+int main(void)
+{
+    uint32_t x = 12345;
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        x = x * 1103515245 + 12345;
+        data[i] = 0.75 + (x >> 8) / (double)(1 << 25);
+        fdata[i] = data[i];
+    }
+    run("add64", bench_add64);
+    run("mul64", bench_mul64);
+    run("div64", bench_div64);
+    run("sqrt64", bench_sqrt64);
+    run("dot32", bench_dot32);
+    return 0;
+}
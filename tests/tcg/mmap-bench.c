@@ -0,0 +1,100 @@
+/*
+ *  mmap churn benchmark for linux-user
+ *
+ *  Several threads map, touch, protect and unmap small anonymous regions
+ *  while one thread reserves and releases a large PROT_NONE region, as
+ *  garbage collected runtimes do.  Run it natively and under QEMU (the
+ *  'speed-mmap' make target does this for i386) and compare the times.
+ *
+ *  Copyright (c) 2014 QEMU contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#define NB_THREADS      4
+#define ITERATIONS      20000
+#define SMALL_SIZE      (64 * 1024)
+#define RESERVE_SIZE    (256 * 1024 * 1024)
+#define RESERVE_LOOPS   200
+
+static void *small_maps(void *opaque)
+{
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        char *p = mmap(NULL, SMALL_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        p[0] = p[SMALL_SIZE - 1] = 1;
+        if (mprotect(p, SMALL_SIZE / 2, PROT_READ) < 0) {
+            perror("mprotect");
+            exit(1);
+        }
+        munmap(p, SMALL_SIZE);
+    }
+    return NULL;
+}
+
+static void *reservations(void *opaque)
+{
+    int i;
+
+    for (i = 0; i < RESERVE_LOOPS; i++) {
+        char *p = mmap(NULL, RESERVE_SIZE, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        /* commit a little of it, as a heap would */
+        mprotect(p, SMALL_SIZE, PROT_READ | PROT_WRITE);
+        memset(p, 0, SMALL_SIZE);
+        munmap(p, RESERVE_SIZE);
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t threads[NB_THREADS + 1];
+    struct timeval start, end;
+    int i;
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < NB_THREADS; i++) {
+        pthread_create(&threads[i], NULL, small_maps, NULL);
+    }
+    pthread_create(&threads[NB_THREADS], NULL, reservations, NULL);
+    for (i = 0; i <= NB_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    gettimeofday(&end, NULL);
+
+    printf("%d threads x %d small maps, %d reservations: %ld ms\n",
+           NB_THREADS, ITERATIONS, RESERVE_LOOPS,
+           (end.tv_sec - start.tv_sec) * 1000L +
+           (end.tv_usec - start.tv_usec) / 1000);
+    return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ *  TCG optimizer micro benchmarks
+ *
+ *  Each kernel is a loop with short forward branches, the pattern that
+ *  limits what tcg/optimize.c can propagate.  Run it under QEMU built with
+ *  and without a change to the optimizer and compare the times; the
+ *  checksums must match the native run.  The 'speed-opt' make target does
+ *  this for i386.
+ *
+ *  Copyright (c) 2014 QEMU contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#define ITERATIONS 20000000
+
+static uint32_t data[256];
+
+/* clamp and abs: one or two short branches per iteration */
+static uint32_t bench_clamp(void)
+{
+    uint32_t sum = 0;
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        int32_t v = (int32_t)(data[i & 255] - 0x80000000u);
+
+        if (v < 0) {
+            v = -v;
+        }
+        if (v > 0x40000000) {
+            v = 0x40000000;
+        }
+        sum += v;
+    }
+    return sum;
+}
+
+/* a state machine whose state stays constant along each path */
+static uint32_t bench_state(void)
+{
+    uint32_t sum = 0, state = 0;
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        uint32_t c = data[i & 255];
+
+        if (state == 0) {
+            state = (c & 1) ? 1 : 0;
+            sum += 3;
+        } else if (state == 1) {
+            state = (c & 2) ? 2 : 0;
+            sum += state * 5;
+        } else {
+            state = 0;
+            sum ^= c;
+        }
+    }
+    return sum;
+}
+
+/* flag heavy code: compares and carries feeding branches */
+static uint32_t bench_flags(void)
+{
+    uint32_t a = 1, b = 0;
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        uint32_t c = data[i & 255];
+
+        if (a + c < a) {
+            b++;
+        }
+        a += c;
+        if (a & 0x100) {
+            a ^= 0x55;
+        }
+    }
+    return a + b;
+}
+
+static void run(const char *name, uint32_t (*fn)(void))
+{
+    struct timeval start, end;
+    uint32_t sum;
+    long us;
+
+    gettimeofday(&start, NULL);
+    sum = fn();
+    gettimeofday(&end, NULL);
+    us = (end.tv_sec - start.tv_sec) * 1000000L +
+         (end.tv_usec - start.tv_usec);
+    printf("%-8s %08x %8ld us\n", name, sum, us);
+}
+
+int main(void)
+{
+    uint32_t x = 12345;
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        x = x * 1103515245 + 12345;
+        data[i] = x;
+    }
+    run("clamp", bench_clamp);
+    run("state", bench_state);
+    run("flags", bench_flags);
+    return 0;
+}
@@ -0,0 +1,166 @@
+/*
+ * AES tests and microbenchmark
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Run with -m perf to get the CBC throughput with 512-byte sectors.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/aes.h"
+
+#define NR_CHUNKS       16
+#define CHUNK_SIZE      512
+#define PERF_BYTES      (256 * 1024 * 1024)
+
+static uint8_t in[NR_CHUNKS * CHUNK_SIZE];
+static uint8_t out[NR_CHUNKS * CHUNK_SIZE];
+static uint8_t ref[NR_CHUNKS * CHUNK_SIZE];
+static uint8_t ivecs[NR_CHUNKS * AES_BLOCK_SIZE];
+
+static void fill_random(uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = g_test_rand_int();
+    }
+}
+
+/* FIPS-197 appendix C */
+static void test_fips197(void)
+{
+    static const uint8_t key[32] = {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+        0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+        0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+        0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+    };
+    static const uint8_t plain[16] = {
+        0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+        0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff,
+    };
+    static const uint8_t cipher[3][16] = {
+        { 0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+          0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a },
+        { 0xdd, 0xa9, 0x7c, 0xa4, 0x86, 0x4c, 0xdf, 0xe0,
+          0x6e, 0xaf, 0x70, 0xa0, 0xec, 0x0d, 0x71, 0x91 },
+        { 0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf,
+          0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89 },
+    };
+    uint8_t buf[16], iv[16];
+    AES_KEY ek, dk;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        int bits = 128 + 64 * i;
+
+        g_assert_cmpint(AES_set_encrypt_key(key, bits, &ek), ==, 0);
+        g_assert_cmpint(AES_set_decrypt_key(key, bits, &dk), ==, 0);
+
+        /* A zero IV makes the first CBC block plain ECB */
+        memset(iv, 0, sizeof(iv));
+        AES_cbc_encrypt(plain, buf, 16, &ek, iv, 1);
+        g_assert(memcmp(buf, cipher[i], 16) == 0);
+        g_assert(memcmp(iv, cipher[i], 16) == 0);
+
+        memset(iv, 0, sizeof(iv));
+        AES_cbc_encrypt(buf, buf, 16, &dk, iv, 0);
+        g_assert(memcmp(buf, plain, 16) == 0);
+    }
+}
+
+static void test_cbc_chunks(void)
+{
+    uint8_t key[32], iv[AES_BLOCK_SIZE];
+    AES_KEY ek, dk;
+    int i, j;
+
+    for (i = 0; i < 3; i++) {
+        fill_random(key, sizeof(key));
+        fill_random(in, sizeof(in));
+        fill_random(ivecs, sizeof(ivecs));
+        AES_set_encrypt_key(key, 128 + 64 * i, &ek);
+        AES_set_decrypt_key(key, 128 + 64 * i, &dk);
+
+        /* One block at a time, the way CBC is defined */
+        for (j = 0; j < NR_CHUNKS * CHUNK_SIZE; j += AES_BLOCK_SIZE) {
+            const uint8_t *prev = j % CHUNK_SIZE ? &ref[j - AES_BLOCK_SIZE]
+                                   : &ivecs[j / CHUNK_SIZE * AES_BLOCK_SIZE];
+            uint8_t x[AES_BLOCK_SIZE];
+            int k;
+
+            for (k = 0; k < AES_BLOCK_SIZE; k++) {
+                x[k] = in[j + k] ^ prev[k];
+            }
+            AES_encrypt(x, &ref[j], &ek);
+        }
+
+        /* Every count of chunks, to cover partial batches */
+        for (j = 1; j <= NR_CHUNKS; j++) {
+            AES_cbc_encrypt_chunks(in, out, j, CHUNK_SIZE, &ek, ivecs, 1);
+            g_assert(memcmp(out, ref, j * CHUNK_SIZE) == 0);
+
+            AES_cbc_encrypt_chunks(out, out, j, CHUNK_SIZE, &dk, ivecs, 0);
+            g_assert(memcmp(out, in, j * CHUNK_SIZE) == 0);
+        }
+
+        /* AES_cbc_encrypt returns the next IV */
+        memcpy(iv, ivecs, AES_BLOCK_SIZE);
+        AES_cbc_encrypt(in, out, CHUNK_SIZE, &ek, iv, 1);
+        g_assert(memcmp(out, ref, CHUNK_SIZE) == 0);
+        g_assert(memcmp(iv, &ref[CHUNK_SIZE - AES_BLOCK_SIZE],
+                        AES_BLOCK_SIZE) == 0);
+    }
+}
+
+static void test_perf(gconstpointer opaque)
+{
+    int enc = GPOINTER_TO_INT(opaque);
+    int rounds = PERF_BYTES / sizeof(in);
+    uint8_t key[16];
+    AES_KEY aes_key;
+    double elapsed;
+    int i;
+
+    fill_random(key, sizeof(key));
+    fill_random(in, sizeof(in));
+    if (enc) {
+        AES_set_encrypt_key(key, 128, &aes_key);
+    } else {
+        AES_set_decrypt_key(key, 128, &aes_key);
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < rounds; i++) {
+        AES_cbc_encrypt_chunks(in, in, NR_CHUNKS, CHUNK_SIZE, &aes_key,
+                               ivecs, enc);
+    }
+    elapsed = g_test_timer_elapsed();
+
+    g_test_maximized_result((double)rounds * sizeof(in) / elapsed / (1 << 20),
+                            "AES-128-CBC %s (%s): %.0f MB/s",
+                            enc ? "encrypt" : "decrypt",
+                            AES_accelerated() ? "AES-NI" : "portable",
+                            (double)rounds * sizeof(in) / elapsed / (1 << 20));
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/aes/fips197", test_fips197);
+    g_test_add_func("/aes/cbc-chunks", test_cbc_chunks);
+
+    if (g_test_perf()) {
+        g_test_add_data_func("/aes/perf/encrypt", GINT_TO_POINTER(1),
+                             test_perf);
+        g_test_add_data_func("/aes/perf/decrypt", GINT_TO_POINTER(0),
+                             test_perf);
+    }
+
+    return g_test_run();
+}
@@ -112,6 +112,63 @@ static void test_notify(void)
     g_assert(!aio_poll(ctx, false));
 }
 
+typedef struct {
+    QemuMutex start_lock;
+    bool thread_acquired;
+} AcquireTestData;
+
+static void *test_acquire_thread(void *opaque)
+{
+    AcquireTestData *data = opaque;
+
+    /* Wait for other thread to let us start */
+    qemu_mutex_lock(&data->start_lock);
+    qemu_mutex_unlock(&data->start_lock);
+
+    aio_context_acquire(ctx);
+    aio_context_release(ctx);
+
+    data->thread_acquired = true; /* success, we got here */
+
+    return NULL;
+}
+
+static void dummy_notifier_read(EventNotifier *unused)
+{
+    g_assert(false); /* should never be invoked */
+}
+
+static void test_acquire(void)
+{
+    QemuThread thread;
+    EventNotifier notifier;
+    AcquireTestData data;
+
+    /* Dummy event notifier ensures aio_poll() will block */
+    event_notifier_init(&notifier, false);
+    aio_set_event_notifier(ctx, &notifier, dummy_notifier_read);
+    g_assert(!aio_poll(ctx, false)); /* consume aio_notify() */
+
+    qemu_mutex_init(&data.start_lock);
+    qemu_mutex_lock(&data.start_lock);
+    data.thread_acquired = false;
+
+    qemu_thread_create(&thread, test_acquire_thread,
+                       &data, QEMU_THREAD_JOINABLE);
+
+    /* Block in aio_poll(), let other thread kick us and acquire context */
+    aio_context_acquire(ctx);
+    qemu_mutex_unlock(&data.start_lock); /* let the thread run */
+    g_assert(!aio_poll(ctx, true));
+    aio_context_release(ctx);
+
+    qemu_thread_join(&thread);
+    aio_set_event_notifier(ctx, &notifier, NULL);
+    event_notifier_cleanup(&notifier);
+
+    g_assert(data.thread_acquired);
+}
+
 static void test_bh_schedule(void)
 {
     BHTestData data = { .n = 0 };
@@ -365,6 +422,117 @@ static void test_wait_event_notifier_noflush(void)
     event_notifier_cleanup(&data.e);
 }
 
+static int poll_pending;
+
+static bool poll_ready_cb(void *opaque)
+{
+    EventNotifierTestData *data = container_of(opaque, EventNotifierTestData,
+                                               e);
+    if (!poll_pending) {
+        return false;
+    }
+    poll_pending--;
+    data->n++;
+    return true;
+}
+
+static void test_poll_mode(void)
+{
+    EventNotifierTestData data = { .n = 0, .active = 1 };
+    AioPollStats stats;
+
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, event_ready_cb);
+    aio_set_event_notifier_poll(ctx, &data.e, poll_ready_cb);
+    aio_context_set_poll_params(ctx, 1000000000LL, 0, 0);
+    while (aio_poll(ctx, false));
+
+    /* The first wait is short, so the polling window opens */
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    aio_context_get_poll_stats(ctx, &stats);
+    g_assert_cmpint(stats.attempts, ==, 0);
+    g_assert_cmpint(stats.poll_ns, >, 0);
+
+    /* Now the poll handler finds work without sleeping */
+    poll_pending = 1;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 2);
+    aio_context_get_poll_stats(ctx, &stats);
+    g_assert_cmpint(stats.attempts, ==, 1);
+    g_assert_cmpint(stats.successes, ==, 1);
+
+    aio_context_set_poll_params(ctx, 0, 0, 0);
+    aio_set_event_notifier(ctx, &data.e, NULL);
+    g_assert(!aio_poll(ctx, false));
+    event_notifier_cleanup(&data.e);
+}
+
+/* Enough handlers for aio-posix.c to switch from poll() to epoll */
+#define MANY_NOTIFIERS 100
+
+static void test_many_event_notifiers(bool use_gsource)
+{
+    EventNotifierTestData data[MANY_NOTIFIERS];
+    int i;
+
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        data[i] = (EventNotifierTestData) { .n = 0, .active = 1 };
+        event_notifier_init(&data[i].e, false);
+        aio_set_event_notifier(ctx, &data[i].e, event_ready_cb);
+    }
+    while (use_gsource ? g_main_context_iteration(NULL, false)
+                       : aio_poll(ctx, false)) {
+        /* consume aio_notify() */
+    }
+
+    /* Handlers added and changed after the switch must still be seen */
+    for (i = 0; i < MANY_NOTIFIERS; i += 7) {
+        event_notifier_set(&data[i].e);
+    }
+    while (use_gsource ? g_main_context_iteration(NULL, false)
+                       : aio_poll(ctx, false)) {
+        /* Do nothing */
+    }
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        g_assert_cmpint(data[i].n, ==, i % 7 ? 0 : 1);
+    }
+
+    /* Removed handlers are not called */
+    for (i = 0; i < MANY_NOTIFIERS; i += 2) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL);
+    }
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        event_notifier_set(&data[i].e);
+    }
+    while (use_gsource ? g_main_context_iteration(NULL, false)
+                       : aio_poll(ctx, false)) {
+        /* Do nothing */
+    }
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        g_assert_cmpint(data[i].n, ==,
+                        (i % 7 ? 0 : 1) + (i % 2 ? 1 : 0));
+    }
+
+    for (i = 1; i < MANY_NOTIFIERS; i += 2) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL);
+    }
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        event_notifier_cleanup(&data[i].e);
+    }
+}
+
+static void test_many(void)
+{
+    test_many_event_notifiers(false);
+}
+
+static void test_source_many(void)
+{
+    test_many_event_notifiers(true);
+}
+
 static void test_timer_schedule(void)
 {
     TimerTestData data = { .n = 0, .ctx = ctx, .ns = SCALE_MS * 750LL,
@@ -757,6 +925,62 @@ static void test_source_timer_schedule(void)
     timer_del(&data.timer);
 }
 
+/* Benchmarks, only run with -m perf.  */
+
+#define PERF_DISPATCHES     1000000
+
+static void test_perf_bh(void)
+{
+    BHTestData data = { .n = 0, .max = PERF_DISPATCHES };
+    double elapsed;
+
+    data.bh = aio_bh_new(ctx, bh_test_cb, &data);
+    g_test_timer_start();
+    qemu_bh_schedule(data.bh);
+    wait_for_aio();
+    elapsed = g_test_timer_elapsed();
+    g_assert_cmpint(data.n, ==, PERF_DISPATCHES);
+    qemu_bh_delete(data.bh);
+
+    g_test_maximized_result(PERF_DISPATCHES / elapsed,
+                            "%.0f bottom halves/s", PERF_DISPATCHES / elapsed);
+}
+
+/* One busy event notifier, next to a number of idle ones */
+static void test_perf_event(gconstpointer opaque)
+{
+    int idle = GPOINTER_TO_INT(opaque);
+    EventNotifierTestData data = { .n = 0, .active = PERF_DISPATCHES,
+                                   .auto_set = true };
+    EventNotifierTestData *idle_data = g_new0(EventNotifierTestData, idle);
+    double elapsed;
+    int i;
+
+    for (i = 0; i < idle; i++) {
+        event_notifier_init(&idle_data[i].e, false);
+        aio_set_event_notifier(ctx, &idle_data[i].e, event_ready_cb);
+    }
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, event_ready_cb);
+
+    g_test_timer_start();
+    event_notifier_set(&data.e);
+    wait_until_inactive(&data);
+    elapsed = g_test_timer_elapsed();
+    g_assert_cmpint(data.n, ==, PERF_DISPATCHES);
+
+    aio_set_event_notifier(ctx, &data.e, NULL);
+    event_notifier_cleanup(&data.e);
+    for (i = 0; i < idle; i++) {
+        aio_set_event_notifier(ctx, &idle_data[i].e, NULL);
+        event_notifier_cleanup(&idle_data[i].e);
+    }
+    g_free(idle_data);
+
+    g_test_maximized_result(PERF_DISPATCHES / elapsed,
+                            "%.0f events/s with %d idle notifiers",
+                            PERF_DISPATCHES / elapsed, idle);
+}
 
 /* End of tests.  */
 
@@ -775,6 +999,7 @@ int main(int argc, char **argv)
 
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/aio/notify",                  test_notify);
+    g_test_add_func("/aio/acquire",                 test_acquire);
     g_test_add_func("/aio/bh/schedule",             test_bh_schedule);
     g_test_add_func("/aio/bh/schedule10",           test_bh_schedule10);
     g_test_add_func("/aio/bh/cancel",               test_bh_cancel);
@@ -787,6 +1012,8 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+    g_test_add_func("/aio/poll-mode",               test_poll_mode);
+    g_test_add_func("/aio/event/many",              test_many);
 
     g_test_add_func("/aio-gsource/notify",                  test_source_notify);
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
@@ -801,6 +1028,15 @@ int main(int argc, char **argv)
     g_test_add_func("/aio-gsource/event/wait",              test_source_wait_event_notifier);
     g_test_add_func("/aio-gsource/event/wait/no-flush-cb",  test_source_wait_event_notifier_noflush);
     g_test_add_func("/aio-gsource/event/flush",             test_source_flush_event_notifier);
+    g_test_add_func("/aio-gsource/event/many",              test_source_many);
     g_test_add_func("/aio-gsource/timer/schedule",          test_source_timer_schedule);
+
+    if (g_test_perf()) {
+        g_test_add_func("/aio/perf/bh", test_perf_bh);
+        g_test_add_data_func("/aio/perf/event", GINT_TO_POINTER(0),
+                             test_perf_event);
+        g_test_add_data_func("/aio/perf/event/idle64", GINT_TO_POINTER(64),
+                             test_perf_event);
+    }
     return g_test_run();
 }
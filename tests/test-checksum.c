@@ -0,0 +1,188 @@
+/*
+ * crc32c and internet checksum tests and microbenchmark
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Run with -m perf to get the throughput of each routine.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/crc32c.h"
+#include "net/checksum.h"
+
+#define BUF_SIZE        (64 * 1024)
+#define PERF_BYTES      (256 * 1024 * 1024)
+
+static uint8_t buf[BUF_SIZE + 64];
+
+/* Bit at a time, as in the definition of the CRC */
+static uint32_t crc32c_ref(uint32_t crc, const uint8_t *data, size_t len)
+{
+    int i;
+
+    while (len--) {
+        crc ^= *data++;
+        for (i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78 : 0);
+        }
+    }
+    return crc ^ 0xffffffff;
+}
+
+/* Byte at a time, as net_checksum_add_cont() used to do */
+static uint32_t checksum_ref(int len, const uint8_t *data, int seq)
+{
+    uint32_t sum = 0;
+    int i;
+
+    for (i = seq; i < seq + len; i++) {
+        sum += (i & 1) ? data[i - seq] : (uint32_t)data[i - seq] << 8;
+    }
+    return sum;
+}
+
+static void fill_buf(void)
+{
+    int i;
+
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = g_test_rand_int();
+    }
+}
+
+static void test_crc32c_check(void)
+{
+    /* The check value of CRC-32C */
+    g_assert_cmphex(crc32c(0xffffffff, (const uint8_t *)"123456789", 9), ==,
+                    0xe3069283);
+    g_assert_cmphex(crc32c(0xffffffff, buf, 0), ==, 0);
+}
+
+static void test_crc32c_random(void)
+{
+    int i;
+
+    fill_buf();
+
+    /* Unaligned starts, and lengths around each stream size */
+    for (i = 0; i < 1000; i++) {
+        int off = g_test_rand_int_range(0, 64);
+        int len = i < 500 ? g_test_rand_int_range(0, 3 * 1024 + 64)
+                          : g_test_rand_int_range(0, BUF_SIZE);
+        uint32_t seed = g_test_rand_int();
+
+        g_assert_cmphex(crc32c(seed, buf + off, len), ==,
+                        crc32c_ref(seed, buf + off, len));
+    }
+}
+
+static void test_checksum_random(void)
+{
+    int i;
+
+    fill_buf();
+    for (i = 0; i < 1000; i++) {
+        int off = g_test_rand_int_range(0, 64);
+        int len = g_test_rand_int_range(0, 2048);
+        int seq = g_test_rand_int_range(0, 4);
+
+        g_assert_cmphex(net_checksum_add_cont(len, buf + off, seq), ==,
+                        checksum_ref(len, buf + off, seq));
+    }
+}
+
+static void test_checksum_max(void)
+{
+    /* The largest IP packet, with the largest sum */
+    memset(buf, 0xff, sizeof(buf));
+    g_assert_cmphex(net_checksum_finish(net_checksum_add(65535, buf)), ==,
+                    net_checksum_finish(checksum_ref(65535, buf, 0)));
+    g_assert_cmphex(net_raw_checksum(buf, 2), ==, 0);
+}
+
+static void test_checksum_iov(void)
+{
+    struct iovec iov[3];
+    uint32_t sum;
+
+    fill_buf();
+
+    /* Odd sized pieces start at both even and odd offsets in the packet */
+    iov[0].iov_base = buf;
+    iov[0].iov_len = 7;
+    iov[1].iov_base = buf + 7;
+    iov[1].iov_len = 100;
+    iov[2].iov_base = buf + 107;
+    iov[2].iov_len = 1393;
+
+    sum = net_checksum_add_iov(iov, 3, 3, 1480);
+    g_assert_cmphex(net_checksum_finish(sum), ==,
+                    net_checksum_finish(checksum_ref(1480, buf + 3, 0)));
+}
+
+typedef struct {
+    const char *name;
+    int len;
+    bool crc;
+} PerfTest;
+
+static void test_perf(gconstpointer opaque)
+{
+    const PerfTest *t = opaque;
+    int rounds = PERF_BYTES / t->len;
+    uint32_t sum = 0;
+    double elapsed;
+    int i;
+
+    fill_buf();
+    g_test_timer_start();
+    for (i = 0; i < rounds; i++) {
+        if (t->crc) {
+            sum ^= crc32c(0xffffffff, buf, t->len);
+        } else {
+            sum += net_checksum_add(t->len, buf);
+        }
+    }
+    elapsed = g_test_timer_elapsed();
+
+    g_test_maximized_result((double)rounds * t->len / elapsed / (1 << 20),
+                            "%s %d bytes: %.0f MB/s (%x)", t->name,
+                            t->len,
+                            (double)rounds * t->len / elapsed / (1 << 20),
+                            sum);
+}
+
+static const PerfTest perf_tests[] = {
+    { "/crc32c/perf/64", 64, true },
+    { "/crc32c/perf/512", 512, true },
+    { "/crc32c/perf/4096", 4096, true },
+    { "/crc32c/perf/65536", 65536, true },
+    { "/checksum/perf/64", 64, false },
+    { "/checksum/perf/1500", 1500, false },
+    { "/checksum/perf/65535", 65535, false },
+};
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/crc32c/check", test_crc32c_check);
+    g_test_add_func("/crc32c/random", test_crc32c_random);
+    g_test_add_func("/checksum/random", test_checksum_random);
+    g_test_add_func("/checksum/max", test_checksum_max);
+    g_test_add_func("/checksum/iov", test_checksum_iov);
+
+    if (g_test_perf()) {
+        for (i = 0; i < ARRAY_SIZE(perf_tests); i++) {
+            g_test_add_data_func(perf_tests[i].name, &perf_tests[i],
+                                 test_perf);
+        }
+    }
+
+    return g_test_run();
+}
@@ -227,7 +227,8 @@ static void perf_lifecycle(void)
     }
     duration = g_test_timer_elapsed();
 
-    g_test_message("Lifecycle %u iterations: %f s\n", max, duration);
+    g_test_minimized_result(duration, "Lifecycle %u iterations: %f s",
+                            max, duration);
 }
 
 static void perf_nesting(void)
@@ -251,7 +252,8 @@ static void perf_nesting(void)
     }
     duration = g_test_timer_elapsed();
 
-    g_test_message("Nesting %u iterations of %u depth each: %f s\n",
+    g_test_minimized_result(duration,
+        "Nesting %u iterations of %u depth each: %f s",
         maxcycles, maxnesting, duration);
 }
 
@@ -284,10 +286,46 @@ static void perf_yield(void)
     }
     duration = g_test_timer_elapsed();
 
-    g_test_message("Yield %u iterations: %f s\n",
+    g_test_minimized_result(duration, "Yield %u iterations: %f s",
         maxcycles, duration);
 }
 
+/*
+ * Pool benchmark: many coroutines alive at once, like a deep I/O queue
+ */
+
+static void coroutine_fn yield_once(void *opaque)
+{
+    qemu_coroutine_yield();
+}
+
+static void perf_pool(void)
+{
+    Coroutine *coroutines[256];
+    unsigned int i, j, maxcycles, depth;
+    double duration;
+
+    maxcycles = 10000;
+    depth = ARRAY_SIZE(coroutines);
+
+    g_test_timer_start();
+    for (i = 0; i < maxcycles; i++) {
+        for (j = 0; j < depth; j++) {
+            coroutines[j] = qemu_coroutine_create(yield_once);
+            qemu_coroutine_enter(coroutines[j], NULL);
+        }
+        for (j = 0; j < depth; j++) {
+            qemu_coroutine_enter(coroutines[j], NULL);
+        }
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_maximized_result(maxcycles * depth / duration,
+                            "Pool %u iterations of %u coroutines: %f s, "
+                            "%f creations/s", maxcycles, depth, duration,
+                            maxcycles * depth / duration);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -301,6 +339,7 @@ int main(int argc, char **argv)
         g_test_add_func("/perf/lifecycle", perf_lifecycle);
         g_test_add_func("/perf/nesting", perf_nesting);
         g_test_add_func("/perf/yield", perf_yield);
+        g_test_add_func("/perf/pool", perf_pool);
     }
     return g_test_run();
 }
@@ -30,6 +30,7 @@
 #include <string.h>
 
 #include "qemu-common.h"
+#include "qemu/bitmap.h"
 
 
 static void test_parse_uint_null(void)
@@ -226,6 +227,197 @@ static void test_parse_uint_full_correct(void)
     g_assert_cmpint(i, ==, 123);
 }
 
+#define ZERO_BUF_SIZE 4096
+#define ZERO_PERF_PAGES 1024
+#define ZERO_PERF_ROUNDS 64
+
+/* What buffer_find_nonzero_offset must return, computed a byte at a time */
+static size_t reference_find_nonzero_offset(const uint8_t *buf, size_t len)
+{
+    size_t chunk = sizeof(VECTYPE);
+    size_t block = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * chunk;
+    size_t i;
+
+    for (i = 0; i < len && !buf[i]; i++) {
+        /* nothing */
+    }
+    if (i == len) {
+        return len;
+    }
+    return i < block ? i / chunk * chunk : i / block * block;
+}
+
+/* test-cutils only links util/cutils.o, so no qemu_memalign */
+static uint8_t *alloc_aligned(size_t size, uint8_t **to_free)
+{
+    *to_free = g_malloc(size + 64);
+    return (uint8_t *)QEMU_ALIGN_UP((uintptr_t)*to_free, 64);
+}
+
+static void test_buffer_find_nonzero_offset(void)
+{
+    uint8_t *to_free;
+    uint8_t *buf = alloc_aligned(ZERO_BUF_SIZE + sizeof(VECTYPE), &to_free);
+    size_t len, pos;
+    int shift;
+
+    /* both the aligned and the only sizeof(VECTYPE) aligned cases */
+    for (shift = 0; shift <= sizeof(VECTYPE); shift += sizeof(VECTYPE)) {
+        uint8_t *p = buf + shift;
+        size_t step = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR *
+                      sizeof(VECTYPE);
+
+        for (len = 0; len <= ZERO_BUF_SIZE; len += step) {
+            memset(p, 0, len);
+            g_assert(can_use_buffer_find_nonzero_offset(p, len));
+            g_assert_cmpint(buffer_find_nonzero_offset(p, len), ==, len);
+            g_assert(buffer_is_zero(p, len));
+
+            for (pos = 0; pos < len; pos++) {
+                p[pos] = 1 + g_test_rand_int_range(0, 255);
+                g_assert_cmpint(buffer_find_nonzero_offset(p, len), ==,
+                                reference_find_nonzero_offset(p, len));
+                g_assert(!buffer_is_zero(p, len));
+                p[pos] = 0;
+            }
+        }
+    }
+
+    g_free(to_free);
+}
+
+static void test_buffer_find_nonzero_offset_perf(gconstpointer opaque)
+{
+    /* offset of the first non-zero byte in each page, or the page size */
+    size_t nonzero = GPOINTER_TO_SIZE(opaque);
+    uint8_t *to_free;
+    uint8_t *buf = alloc_aligned(ZERO_PERF_PAGES * ZERO_BUF_SIZE, &to_free);
+    size_t found = 0;
+    double elapsed;
+    int i, j;
+
+    memset(buf, 0, ZERO_PERF_PAGES * ZERO_BUF_SIZE);
+    if (nonzero < ZERO_BUF_SIZE) {
+        for (i = 0; i < ZERO_PERF_PAGES; i++) {
+            buf[i * ZERO_BUF_SIZE + nonzero] = 1;
+        }
+    }
+
+    g_test_timer_start();
+    for (j = 0; j < ZERO_PERF_ROUNDS; j++) {
+        for (i = 0; i < ZERO_PERF_PAGES; i++) {
+            found += buffer_find_nonzero_offset(buf + i * ZERO_BUF_SIZE,
+                                                ZERO_BUF_SIZE);
+        }
+    }
+    elapsed = g_test_timer_elapsed();
+    g_assert(found > 0 || nonzero == 0);
+
+    g_test_maximized_result(ZERO_PERF_ROUNDS * ZERO_PERF_PAGES / elapsed,
+                            "first non-zero byte at %zu: %.0f pages/s, "
+                            "%.0f MB/s", nonzero,
+                            ZERO_PERF_ROUNDS * ZERO_PERF_PAGES / elapsed,
+                            ZERO_PERF_ROUNDS * ZERO_PERF_PAGES *
+                            (double)MIN(nonzero, ZERO_BUF_SIZE) /
+                            elapsed / (1 << 20));
+    g_free(to_free);
+}
+
+#define DIFF_CHUNK      64      /* 16 pixels at 32 bits per pixel */
+#define DIFF_WIDTH      1920
+#define DIFF_HEIGHT     1080
+#define DIFF_CHUNKS     (DIFF_WIDTH * 4 / DIFF_CHUNK)
+#define DIFF_PERF_ROUNDS 100
+
+static void test_buffer_diff_copy(void)
+{
+    DECLARE_BITMAP(todo, DIFF_CHUNKS);
+    DECLARE_BITMAP(dirty, DIFF_CHUNKS);
+    size_t len = DIFF_CHUNKS * DIFF_CHUNK;
+    uint8_t *free_src, *free_dst;
+    uint8_t *src = alloc_aligned(len + 1, &free_src);
+    uint8_t *dst = alloc_aligned(len + 1, &free_dst);
+    int shift, i;
+
+    /* both the vector and the memcmp paths */
+    for (shift = 0; shift <= 1; shift++) {
+        uint8_t *s = src + shift;
+
+        memset(s, 0, len);
+        memset(dst, 0, len);
+        bitmap_fill(todo, DIFF_CHUNKS);
+        bitmap_zero(dirty, DIFF_CHUNKS);
+        g_assert_cmpint(buffer_diff_copy(dst, s, DIFF_CHUNK, DIFF_CHUNKS,
+                                         todo, dirty), ==, 0);
+        g_assert(bitmap_empty(todo, DIFF_CHUNKS));
+        g_assert(bitmap_empty(dirty, DIFF_CHUNKS));
+
+        /* change the first and last byte of some chunks */
+        s[0] = 1;
+        s[5 * DIFF_CHUNK - 1] = 1;
+        s[len - 1] = 1;
+        /* a change in a chunk that is not marked is not seen */
+        s[10 * DIFF_CHUNK] = 1;
+        bitmap_fill(todo, DIFF_CHUNKS);
+        clear_bit(10, todo);
+        g_assert_cmpint(buffer_diff_copy(dst, s, DIFF_CHUNK, DIFF_CHUNKS,
+                                         todo, dirty), ==, 3);
+        g_assert(bitmap_empty(todo, DIFF_CHUNKS));
+        for (i = 0; i < DIFF_CHUNKS; i++) {
+            g_assert_cmpint(test_bit(i, dirty), ==,
+                            i == 0 || i == 4 || i == DIFF_CHUNKS - 1);
+        }
+        g_assert_cmpint(dst[10 * DIFF_CHUNK], ==, 0);
+        s[10 * DIFF_CHUNK] = 0;
+        g_assert(memcmp(dst, s, len) == 0);
+    }
+
+    g_free(free_src);
+    g_free(free_dst);
+}
+
+static void test_buffer_diff_copy_perf(gconstpointer opaque)
+{
+    /* one chunk in @every changes between two frames */
+    int every = GPOINTER_TO_INT(opaque);
+    size_t row = DIFF_CHUNKS * DIFF_CHUNK;
+    uint8_t *free_src, *free_dst;
+    uint8_t *src = alloc_aligned(row * DIFF_HEIGHT, &free_src);
+    uint8_t *dst = alloc_aligned(row * DIFF_HEIGHT, &free_dst);
+    DECLARE_BITMAP(todo, DIFF_CHUNKS);
+    DECLARE_BITMAP(dirty, DIFF_CHUNKS);
+    long changed = 0;
+    double elapsed;
+    int i, x, y;
+
+    memset(dst, 0, row * DIFF_HEIGHT);
+    memset(src, 0, row * DIFF_HEIGHT);
+
+    g_test_timer_start();
+    for (i = 0; i < DIFF_PERF_ROUNDS; i++) {
+        for (y = 0; y < DIFF_HEIGHT; y++) {
+            for (x = (y + i) % every; x < DIFF_CHUNKS; x += every) {
+                src[y * row + x * DIFF_CHUNK] = i + 1;
+            }
+            bitmap_fill(todo, DIFF_CHUNKS);
+            changed += buffer_diff_copy(dst + y * row, src + y * row,
+                                        DIFF_CHUNK, DIFF_CHUNKS, todo, dirty);
+        }
+    }
+    elapsed = g_test_timer_elapsed();
+    g_assert_cmpint(changed, >=, DIFF_PERF_ROUNDS * DIFF_HEIGHT);
+
+    g_test_maximized_result(DIFF_PERF_ROUNDS / elapsed,
+                            "%dx%d, one change per %d chunks: "
+                            "%.0f frames/s, %.0f MB/s",
+                            DIFF_WIDTH, DIFF_HEIGHT, every,
+                            DIFF_PERF_ROUNDS / elapsed,
+                            DIFF_PERF_ROUNDS * (double)row * DIFF_HEIGHT /
+                            elapsed / (1 << 20));
+    g_free(free_src);
+    g_free(free_dst);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -246,6 +438,24 @@ int main(int argc, char **argv)
                     test_parse_uint_full_trailing);
     g_test_add_func("/cutils/parse_uint_full/correct",
                     test_parse_uint_full_correct);
+    g_test_add_func("/cutils/buffer_find_nonzero_offset",
+                    test_buffer_find_nonzero_offset);
+    g_test_add_func("/cutils/buffer_diff_copy", test_buffer_diff_copy);
+
+    if (g_test_perf()) {
+        g_test_add_data_func("/cutils/buffer_find_nonzero_offset/perf/zero",
+                             GSIZE_TO_POINTER(ZERO_BUF_SIZE),
+                             test_buffer_find_nonzero_offset_perf);
+        g_test_add_data_func("/cutils/buffer_find_nonzero_offset/perf/half",
+                             GSIZE_TO_POINTER(ZERO_BUF_SIZE / 2),
+                             test_buffer_find_nonzero_offset_perf);
+        g_test_add_data_func("/cutils/buffer_diff_copy/perf/sparse",
+                             GINT_TO_POINTER(DIFF_CHUNKS),
+                             test_buffer_diff_copy_perf);
+        g_test_add_data_func("/cutils/buffer_diff_copy/perf/busy",
+                             GINT_TO_POINTER(4),
+                             test_buffer_diff_copy_perf);
+    }
 
     return g_test_run();
 }
@@ -340,6 +340,20 @@ static void test_hbitmap_granularity(TestHBitmapData *data,
     g_assert_cmpint(hbitmap_count(data->hb), ==, 2);
 }
 
+static void test_hbitmap_size(TestHBitmapData *data,
+                              const void *unused)
+{
+    hbitmap_test_init(data, L1 + 1, 0);
+    g_assert_cmpint(hbitmap_size(data->hb), ==, L1 + 1);
+    hbitmap_test_teardown(data, unused);
+
+    /* The size is rounded up to the granularity */
+    hbitmap_test_init(data, L1 + 1, 2);
+    g_assert_cmpint(hbitmap_size(data->hb), ==, L1 + 4);
+    hbitmap_test_set(data, L1, 1);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, 4);
+}
+
 static void test_hbitmap_iter_granularity(TestHBitmapData *data,
                                           const void *unused)
 {
@@ -369,6 +383,195 @@ static void test_hbitmap_iter_granularity(TestHBitmapData *data,
     g_assert_cmpint(hbitmap_iter_next(&hbi), <, 0);
 }
 
+/* Walk the runs with hbitmap_iter_next_extent and check them against the
+ * shadow bitmap, which must not have granularity.
+ */
+static void hbitmap_test_check_extents(TestHBitmapData *data)
+{
+    HBitmapIter hbi;
+    int64_t first;
+    uint64_t count, i, pos = 0;
+
+    hbitmap_iter_init(&hbi, data->hb, 0);
+    while ((first = hbitmap_iter_next_extent(&hbi, &count)) >= 0) {
+        g_assert_cmpint(count, >, 0);
+        g_assert_cmpint(first, >=, pos);
+        for (i = pos; i < first + count; i++) {
+            g_assert_cmpint(!!(data->bits[i >> LOG_BITS_PER_LONG] &
+                               (1UL << (i & (BITS_PER_LONG - 1)))),
+                            ==, i >= first);
+        }
+        pos = first + count;
+        g_assert_cmpint(hbitmap_next_zero(data->hb, first), ==, pos);
+    }
+    g_assert_cmpint(count, ==, 0);
+    for (i = pos; i < data->size; i++) {
+        g_assert_cmpint(data->bits[i >> LOG_BITS_PER_LONG] &
+                        (1UL << (i & (BITS_PER_LONG - 1))), ==, 0);
+    }
+}
+
+static void test_hbitmap_iter_extent(TestHBitmapData *data,
+                                     const void *unused)
+{
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_test_check_extents(data);
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, L1 - 1, 2);
+    hbitmap_test_set(data, L2 - 3, L1 * 3);
+    hbitmap_test_set(data, L3 - L1 - 1, L1 + 1);
+    hbitmap_test_check_extents(data);
+    hbitmap_test_reset(data, L2, 1);
+    hbitmap_test_check_extents(data);
+    hbitmap_test_set(data, 0, L3);
+    hbitmap_test_check_extents(data);
+}
+
+static void test_hbitmap_next_zero(TestHBitmapData *data,
+                                   const void *unused)
+{
+    hbitmap_test_init(data, L2, 4);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0), ==, 0);
+    hbitmap_test_set(data, 16, 40);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0), ==, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 20), ==, 64);
+    hbitmap_test_set(data, 0, L2);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0), ==, L2);
+}
+
+static void test_hbitmap_serialize(TestHBitmapData *data,
+                                   const void *unused)
+{
+    HBitmap *copy;
+    uint64_t gran, step, start, count, size;
+    uint8_t *buf;
+
+    /* An unaligned size, cut into parts of three serialization units */
+    hbitmap_test_init(data, L2 * 3 + 7, 0);
+    hbitmap_test_set(data, 3, L1 * 2);
+    hbitmap_test_set(data, L2 - 1, L1 + 5);
+    hbitmap_test_set(data, L2 * 3, 7);
+
+    copy = hbitmap_alloc(L2 * 3 + 7, 0);
+    hbitmap_set(copy, 0, L2 * 3 + 7);
+    gran = hbitmap_serialization_granularity(data->hb);
+    step = gran * 3;
+    for (start = 0; start < data->size; start += step) {
+        count = MIN(step, data->size - start);
+        size = hbitmap_serialization_size(data->hb, start, count);
+        buf = g_malloc0(size);
+        hbitmap_serialize_part(data->hb, buf, start, count);
+        hbitmap_deserialize_part(copy, buf, start, count,
+                                 start + count == data->size);
+        g_free(buf);
+    }
+
+    hbitmap_free(data->hb);
+    data->hb = copy;
+    hbitmap_test_check(data, 0);
+    hbitmap_test_check_extents(data);
+}
+
+static void test_hbitmap_merge(TestHBitmapData *data,
+                               const void *unused)
+{
+    HBitmap *other;
+    size_t i;
+
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_test_set(data, L1, L2);
+    other = hbitmap_alloc(L3, 0);
+    hbitmap_set(other, L2, L2 + 1);
+
+    g_assert(hbitmap_merge(data->hb, other));
+    hbitmap_test_set(data, L2, L2 + 1);
+    hbitmap_test_check_extents(data);
+
+    hbitmap_reset(other, L2, L1);
+    g_assert(hbitmap_and(data->hb, other));
+    for (i = 0; i < L3 / BITS_PER_LONG; i++) {
+        data->bits[i] = 0;
+    }
+    hbitmap_test_set(data, L2 + L1, L2 + 1 - L1);
+    hbitmap_test_check_extents(data);
+    hbitmap_free(other);
+
+    /* Bitmaps with different geometry are left alone */
+    other = hbitmap_alloc(L3 + 1, 0);
+    hbitmap_set(other, 0, L3 + 1);
+    g_assert(!hbitmap_merge(data->hb, other));
+    g_assert(!hbitmap_and(data->hb, other));
+    hbitmap_free(other);
+    other = hbitmap_alloc(L3, 1);
+    hbitmap_set(other, 0, L3);
+    g_assert(!hbitmap_merge(data->hb, other));
+    hbitmap_free(other);
+    hbitmap_test_check(data, 0);
+}
+
+/* Compare walking a sparse bitmap a granule at a time, the way the dirty
+ * bitmap users did, with walking it an extent at a time.
+ */
+static void test_hbitmap_perf_iter(TestHBitmapData *data,
+                                   const void *unused)
+{
+    HBitmapIter hbi;
+    uint64_t i, count, total;
+    int64_t first;
+    double t;
+
+    hbitmap_test_init(data, L3, 0);
+    for (i = 0; i < L3; i += L2) {
+        hbitmap_set(data->hb, i, L2 / 2);
+    }
+
+    g_test_timer_start();
+    total = 0;
+    hbitmap_iter_init(&hbi, data->hb, 0);
+    while (hbitmap_iter_next(&hbi) >= 0) {
+        total++;
+    }
+    t = g_test_timer_elapsed();
+    g_assert_cmpint(total, ==, L3 / 2);
+    g_test_minimized_result(t, "hbitmap_iter_next: %.3f ms", t * 1000);
+
+    g_test_timer_start();
+    total = 0;
+    hbitmap_iter_init(&hbi, data->hb, 0);
+    while ((first = hbitmap_iter_next_extent(&hbi, &count)) >= 0) {
+        total += count;
+    }
+    t = g_test_timer_elapsed();
+    g_assert_cmpint(total, ==, L3 / 2);
+    g_test_minimized_result(t, "hbitmap_iter_next_extent: %.3f ms", t * 1000);
+}
+
+/* Setting and resetting runs of granules, as the dirty bitmap does for
+ * writes of a few clusters each.
+ */
+static void test_hbitmap_perf_set(TestHBitmapData *data,
+                                  const void *unused)
+{
+    uint64_t i;
+    double t;
+    int round;
+
+    hbitmap_test_init(data, L3, 0);
+
+    g_test_timer_start();
+    for (round = 0; round < 100; round++) {
+        for (i = 0; i + 16 <= L3; i += 17) {
+            hbitmap_set(data->hb, i, 16);
+        }
+        for (i = 0; i + 16 <= L3; i += 17) {
+            hbitmap_reset(data->hb, i, 16);
+        }
+    }
+    t = g_test_timer_elapsed();
+    g_assert_cmpint(hbitmap_count(data->hb), ==, 0);
+    g_test_minimized_result(t, "hbitmap_set/reset: %.3f ms", t * 1000);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -381,6 +584,7 @@ int main(int argc, char **argv)
     g_test_init(&argc, &argv, NULL);
     hbitmap_test_add("/hbitmap/size/0", test_hbitmap_zero);
     hbitmap_test_add("/hbitmap/size/unaligned", test_hbitmap_unaligned);
+    hbitmap_test_add("/hbitmap/size/granularity", test_hbitmap_size);
     hbitmap_test_add("/hbitmap/iter/empty", test_hbitmap_iter_empty);
     hbitmap_test_add("/hbitmap/iter/partial", test_hbitmap_iter_partial);
     hbitmap_test_add("/hbitmap/iter/granularity", test_hbitmap_iter_granularity);
@@ -395,6 +599,14 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
+    hbitmap_test_add("/hbitmap/iter/extent", test_hbitmap_iter_extent);
+    hbitmap_test_add("/hbitmap/next-zero", test_hbitmap_next_zero);
+    hbitmap_test_add("/hbitmap/serialize", test_hbitmap_serialize);
+    hbitmap_test_add("/hbitmap/merge", test_hbitmap_merge);
+    if (g_test_perf()) {
+        hbitmap_test_add("/hbitmap/perf/iter", test_hbitmap_perf_iter);
+        hbitmap_test_add("/hbitmap/perf/set", test_hbitmap_perf_set);
+    }
     g_test_run();
 
     return 0;
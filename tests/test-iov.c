@@ -398,6 +398,136 @@ static void test_discard_back(void)
     iov_free(iov, iov_cnt);
 }
 
+#define WRITEV_CHUNK    4096
+#define WRITEV_NIOV     8
+#define WRITEV_TOTAL    (64 * 1024 * 1024)
+
+/* Stream through a pipe the way the character devices do: non-blocking
+ * writev of a guest buffer at a time, waiting for POLLOUT when it is full.
+ */
+static void test_writev(void)
+{
+#ifndef _WIN32
+    int fds[2];
+    uint32_t *data;
+    struct iovec iov[WRITEV_NIOV], *cur;
+    unsigned i, cnt;
+    size_t done = 0;
+    ssize_t r;
+    pid_t pid;
+    int status;
+    int64_t start, elapsed;
+    GPollFD pfd;
+
+    g_assert(pipe(fds) == 0);
+    pid = fork();
+    g_assert(pid >= 0);
+
+    if (pid == 0) {
+        /* reader & verifier */
+        uint32_t buf[65536 / sizeof(uint32_t)];
+        uint32_t next = 0;
+        size_t pending = 0, n;
+
+        close(fds[1]);
+        for (;;) {
+            r = read(fds[0], (uint8_t *)buf + pending, sizeof(buf) - pending);
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            if (r <= 0) {
+                break;
+            }
+            pending += r;
+            for (n = 0; n < pending / 4; n++) {
+                if (buf[n] != next++) {
+                    exit(1);
+                }
+            }
+            memmove(buf, buf + n, pending % 4);
+            pending %= 4;
+        }
+        exit(next == WRITEV_TOTAL / 4 ? 0 : 1);
+    }
+
+    close(fds[0]);
+    fcntl(fds[1], F_SETFL, O_WRONLY | O_NONBLOCK);
+    data = g_malloc(WRITEV_CHUNK * WRITEV_NIOV);
+    start = g_get_monotonic_time();
+
+    while (done < WRITEV_TOTAL) {
+        for (i = 0; i < WRITEV_CHUNK * WRITEV_NIOV / 4; i++) {
+            data[i] = done / 4 + i;
+        }
+        for (i = 0; i < WRITEV_NIOV; i++) {
+            iov[i].iov_base = (uint8_t *)data + i * WRITEV_CHUNK;
+            iov[i].iov_len = WRITEV_CHUNK;
+        }
+        cur = iov;
+        cnt = WRITEV_NIOV;
+        while (cnt) {
+            r = iov_writev(fds[1], cur, cnt);
+            if (r < 0) {
+                g_assert(errno == EAGAIN);
+                pfd.fd = fds[1];
+                pfd.events = G_IO_OUT;
+                g_poll(&pfd, 1, -1);
+                continue;
+            }
+            g_assert(r > 0);
+            iov_discard_front(&cur, &cnt, r);
+            done += r;
+        }
+    }
+
+    elapsed = g_get_monotonic_time() - start;
+    close(fds[1]);
+    g_assert(waitpid(pid, &status, 0) == pid);
+    g_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    if (elapsed > 0) {
+        g_test_message("writev: %" PRId64 " MB/s",
+                       (int64_t)WRITEV_TOTAL / elapsed);
+    }
+    g_free(data);
+#endif
+}
+
+/* Copy throughput for a 64 KiB request split in elements of the given
+ * size, as a scatter/gather list from a guest would be.
+ */
+#define PERF_BYTES      65536
+#define PERF_ROUNDS     20000
+
+static void test_perf_copy(gconstpointer opaque)
+{
+    size_t elem = GPOINTER_TO_INT(opaque);
+    unsigned niov = PERF_BYTES / elem;
+    struct iovec *iov = g_new(struct iovec, niov);
+    char *buf = g_malloc0(PERF_BYTES);
+    char *data = g_malloc0(PERF_BYTES);
+    double elapsed, mbs;
+    unsigned i;
+
+    for (i = 0; i < niov; i++) {
+        iov[i].iov_base = data + i * elem;
+        iov[i].iov_len = elem;
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_ROUNDS; i++) {
+        iov_from_buf(iov, niov, 0, buf, PERF_BYTES);
+        iov_to_buf(iov, niov, 0, buf, PERF_BYTES);
+    }
+    elapsed = g_test_timer_elapsed();
+    mbs = 2.0 * PERF_ROUNDS * PERF_BYTES / elapsed / (1 << 20);
+
+    g_test_maximized_result(mbs, "%zu-byte elements: %.0f MB/s", elem, mbs);
+
+    g_free(data);
+    g_free(buf);
+    g_free(iov);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -406,5 +536,12 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/iov/io", test_io);
     g_test_add_func("/basic/iov/discard-front", test_discard_front);
     g_test_add_func("/basic/iov/discard-back", test_discard_back);
+    g_test_add_func("/basic/iov/writev", test_writev);
+    if (g_test_perf()) {
+        g_test_add_data_func("/basic/iov/perf/copy/4096",
+                             GINT_TO_POINTER(4096), test_perf_copy);
+        g_test_add_data_func("/basic/iov/perf/copy/512",
+                             GINT_TO_POINTER(512), test_perf_copy);
+    }
     return g_test_run();
 }
@@ -0,0 +1,168 @@
+/*
+ * Page cache unit tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+#include "qemu-common.h"
+#include "include/migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+
+static void fill_page(uint8_t *page, uint64_t addr)
+{
+    memset(page, (uint8_t)(addr / PAGE_SIZE), PAGE_SIZE);
+}
+
+static void test_insert_lookup(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE], expected[PAGE_SIZE];
+    uint64_t addr;
+
+    g_assert(cache);
+    for (addr = 0; addr < 64 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(!cache_is_cached(cache, addr));
+        fill_page(page, addr);
+        cache_insert(cache, addr, page);
+    }
+
+    /* everything fits, nothing may have been evicted */
+    for (addr = 0; addr < 64 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr));
+        fill_page(expected, addr);
+        g_assert(memcmp(get_cached_data(cache, addr), expected,
+                        PAGE_SIZE) == 0);
+    }
+    g_assert(get_cached_data(cache, 64 * PAGE_SIZE) == NULL);
+
+    /* inserting a cached page updates it in place */
+    memset(page, 0xa5, PAGE_SIZE);
+    cache_insert(cache, 0, page);
+    g_assert(memcmp(get_cached_data(cache, 0), page, PAGE_SIZE) == 0);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_eviction(void)
+{
+    PageCache *cache = cache_init(16, PAGE_SIZE);
+    PageCacheStats stats;
+    uint8_t page[PAGE_SIZE];
+    uint64_t addr;
+    int cached = 0;
+
+    g_assert(cache);
+    for (addr = 0; addr < 1024 * PAGE_SIZE; addr += PAGE_SIZE) {
+        fill_page(page, addr);
+        cache_insert(cache, addr, page);
+    }
+
+    for (addr = 0; addr < 1024 * PAGE_SIZE; addr += PAGE_SIZE) {
+        if (get_cached_data(cache, addr)) {
+            fill_page(page, addr);
+            g_assert(memcmp(get_cached_data(cache, addr), page,
+                            PAGE_SIZE) == 0);
+            cached++;
+        }
+    }
+    g_assert_cmpint(cached, ==, 16);
+
+    cache_get_stats(cache, &stats);
+    g_assert_cmpint(stats.inserts, ==, 1024);
+    g_assert_cmpint(stats.evictions, ==, 1024 - 16);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_recently_used(void)
+{
+    PageCache *cache = cache_init(8, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint64_t addr;
+
+    /* a single set: a page that keeps being looked up survives */
+    g_assert(cache);
+    memset(page, 0, PAGE_SIZE);
+    for (addr = 0; addr < 8 * PAGE_SIZE; addr += PAGE_SIZE) {
+        cache_insert(cache, addr, page);
+    }
+    for (addr = 8 * PAGE_SIZE; addr < 64 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, 0));
+        cache_insert(cache, addr, page);
+    }
+    g_assert(cache_is_cached(cache, 0));
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_stats(void)
+{
+    PageCache *cache = cache_init(8, PAGE_SIZE);
+    PageCacheStats stats;
+    uint8_t page[PAGE_SIZE];
+
+    g_assert(cache);
+    memset(page, 0, PAGE_SIZE);
+    g_assert(!cache_is_cached(cache, 0));
+    cache_insert(cache, 0, page);
+    g_assert(cache_is_cached(cache, 0));
+    g_assert(cache_is_cached(cache, 0));
+
+    cache_get_stats(cache, &stats);
+    g_assert_cmpint(stats.hits, ==, 2);
+    g_assert_cmpint(stats.misses, ==, 1);
+    g_assert_cmpint(stats.inserts, ==, 1);
+    g_assert_cmpint(stats.evictions, ==, 0);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(100, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint64_t addr;
+
+    g_assert(cache);
+    memset(page, 0, PAGE_SIZE);
+    cache_insert(cache, 0, page);
+
+    g_assert_cmpint(cache_resize(cache, 64), ==, 64);
+    g_assert(cache_is_cached(cache, 0));
+
+    g_assert_cmpint(cache_resize(cache, 1000), ==, 512);
+    g_assert(!cache_is_cached(cache, 0));
+    for (addr = 0; addr < 512 * PAGE_SIZE; addr += PAGE_SIZE) {
+        fill_page(page, addr);
+        cache_insert(cache, addr, page);
+    }
+    for (addr = 0; addr < 512 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr));
+    }
+
+    g_assert_cmpint(cache_resize(cache, 2), ==, 2);
+    g_assert_cmpint(cache_resize(cache, 0), ==, -1);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page_cache/insert_lookup", test_insert_lookup);
+    g_test_add_func("/page_cache/eviction", test_eviction);
+    g_test_add_func("/page_cache/recently_used", test_recently_used);
+    g_test_add_func("/page_cache/stats", test_stats);
+    g_test_add_func("/page_cache/resize", test_resize);
+    return g_test_run();
+}
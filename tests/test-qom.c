@@ -0,0 +1,196 @@
+/*
+ * QOM cast and property lookup tests
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qom/object.h"
+
+#define TYPE_TEST_BASE      "test-base"
+#define TYPE_TEST_MID       "test-mid"
+#define TYPE_TEST_LEAF      "test-leaf"
+#define TYPE_TEST_OTHER     "test-other"
+#define TYPE_TEST_IFACE     "test-iface"
+
+#define NR_PROPS            64
+#define PERF_ROUNDS         (1 << 22)
+
+static const TypeInfo base_info = {
+    .name = TYPE_TEST_BASE,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(Object),
+    .abstract = true,
+};
+
+static const TypeInfo mid_info = {
+    .name = TYPE_TEST_MID,
+    .parent = TYPE_TEST_BASE,
+    .abstract = true,
+};
+
+static const TypeInfo leaf_info = {
+    .name = TYPE_TEST_LEAF,
+    .parent = TYPE_TEST_MID,
+    .interfaces = (InterfaceInfo[]) {
+        { TYPE_TEST_IFACE },
+        { }
+    },
+};
+
+static const TypeInfo other_info = {
+    .name = TYPE_TEST_OTHER,
+    .parent = TYPE_TEST_BASE,
+};
+
+static const TypeInfo iface_info = {
+    .name = TYPE_TEST_IFACE,
+    .parent = TYPE_INTERFACE,
+    .class_size = sizeof(InterfaceClass),
+};
+
+static void test_cast(void)
+{
+    Object *leaf = object_new(TYPE_TEST_LEAF);
+    Object *other = object_new(TYPE_TEST_OTHER);
+    ObjectClass *oc = object_get_class(leaf);
+    char *name;
+    int i;
+
+    /* Twice, so that the second round is answered from the cache */
+    for (i = 0; i < 2; i++) {
+        g_assert(object_dynamic_cast(leaf, TYPE_TEST_LEAF) == leaf);
+        g_assert(object_dynamic_cast(leaf, TYPE_TEST_MID) == leaf);
+        g_assert(object_dynamic_cast(leaf, TYPE_TEST_BASE) == leaf);
+        g_assert(object_dynamic_cast(leaf, TYPE_OBJECT) == leaf);
+        g_assert(object_dynamic_cast(leaf, TYPE_TEST_OTHER) == NULL);
+        g_assert(object_dynamic_cast(leaf, "no-such-type") == NULL);
+
+        g_assert(object_dynamic_cast(other, TYPE_TEST_BASE) == other);
+        g_assert(object_dynamic_cast(other, TYPE_TEST_MID) == NULL);
+        g_assert(object_dynamic_cast(other, TYPE_TEST_IFACE) == NULL);
+
+        g_assert(object_class_dynamic_cast(oc, TYPE_TEST_MID) == oc);
+        g_assert(object_class_dynamic_cast(oc, TYPE_TEST_IFACE) != NULL);
+        g_assert(object_class_dynamic_cast(oc, TYPE_TEST_IFACE) != oc);
+    }
+
+    /* The cache compares pointers; another copy of a name still works */
+    name = g_strdup(TYPE_TEST_MID);
+    g_assert(object_dynamic_cast(leaf, name) == leaf);
+    g_assert(object_dynamic_cast(other, name) == NULL);
+    g_free(name);
+
+    object_unref(leaf);
+    object_unref(other);
+}
+
+static void test_properties(void)
+{
+    Object *obj = object_new(TYPE_TEST_OTHER);
+    uint32_t values[NR_PROPS];
+    Error *err = NULL;
+    char name[32];
+    int i;
+
+    for (i = 0; i < NR_PROPS; i++) {
+        values[i] = i;
+        snprintf(name, sizeof(name), "prop%d", i);
+        object_property_add_uint32_ptr(obj, name, &values[i], NULL);
+        g_assert_cmpint(object_property_get_int(obj, name, NULL), ==, i);
+    }
+
+    object_property_add_uint32_ptr(obj, "prop3", &values[3], &err);
+    g_assert(err != NULL);
+    error_free(err);
+    err = NULL;
+
+    for (i = 0; i < NR_PROPS; i += 2) {
+        snprintf(name, sizeof(name), "prop%d", i);
+        object_property_del(obj, name, NULL);
+    }
+    for (i = 0; i < NR_PROPS; i++) {
+        snprintf(name, sizeof(name), "prop%d", i);
+        g_assert((object_property_find(obj, name, NULL) != NULL) == (i & 1));
+    }
+
+    /* Deleted names can be added again */
+    object_property_add_uint32_ptr(obj, "prop0", &values[5], NULL);
+    g_assert_cmpint(object_property_get_int(obj, "prop0", NULL), ==, 5);
+
+    object_property_find(obj, "no-such-property", &err);
+    g_assert(err != NULL);
+    error_free(err);
+
+    object_unref(obj);
+}
+
+static void test_perf_cast(void)
+{
+    Object *obj = object_new(TYPE_TEST_LEAF);
+    Object *cast = NULL;
+    double elapsed;
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_ROUNDS; i++) {
+        cast = OBJECT_CHECK(Object, obj, TYPE_TEST_BASE);
+    }
+    elapsed = g_test_timer_elapsed();
+    g_test_maximized_result(PERF_ROUNDS / elapsed, "%.0f casts/s",
+                            PERF_ROUNDS / elapsed);
+    g_assert(cast == obj);
+
+    object_unref(obj);
+}
+
+static void test_perf_property(void)
+{
+    Object *obj = object_new(TYPE_TEST_OTHER);
+    uint32_t values[NR_PROPS] = { 0 };
+    char name[32];
+    double elapsed;
+    int i;
+
+    for (i = 0; i < NR_PROPS; i++) {
+        snprintf(name, sizeof(name), "prop%d", i);
+        object_property_add_uint32_ptr(obj, name, &values[i], NULL);
+    }
+
+    /* The last property is the worst case for a linear walk */
+    g_test_timer_start();
+    for (i = 0; i < PERF_ROUNDS; i++) {
+        object_property_find(obj, name, NULL);
+    }
+    elapsed = g_test_timer_elapsed();
+    g_test_maximized_result(PERF_ROUNDS / elapsed, "%.0f lookups/s",
+                            PERF_ROUNDS / elapsed);
+
+    object_unref(obj);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    module_call_init(MODULE_INIT_QOM);
+    type_register_static(&base_info);
+    type_register_static(&mid_info);
+    type_register_static(&leaf_info);
+    type_register_static(&other_info);
+    type_register_static(&iface_info);
+
+    g_test_add_func("/qom/cast", test_cast);
+    g_test_add_func("/qom/properties", test_properties);
+
+    if (g_test_perf()) {
+        g_test_add_func("/qom/perf/cast", test_perf_cast);
+        g_test_add_func("/qom/perf/property", test_perf_property);
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,120 @@
+/*
+ * RCU tests
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/rcu.h"
+
+#define NR_READERS      4
+#define NR_UPDATES      1000
+
+typedef struct {
+    struct rcu_head rcu;
+    int alive;
+} Object;
+
+static Object *shared;
+static bool stop;
+
+static void test_nesting(void)
+{
+    rcu_read_lock();
+    rcu_read_lock();
+    rcu_read_unlock();
+    rcu_read_unlock();
+
+    /* Must not wait for a reader that is not in a critical section */
+    synchronize_rcu();
+}
+
+static void *reader_thread(void *opaque)
+{
+    unsigned long *reads = opaque;
+    Object *p;
+
+    rcu_register_thread();
+    while (!atomic_read(&stop)) {
+        rcu_read_lock();
+        p = atomic_rcu_read(&shared);
+        g_assert(atomic_read(&p->alive));
+        rcu_read_unlock();
+        (*reads)++;
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void test_synchronize(void)
+{
+    QemuThread threads[NR_READERS];
+    unsigned long reads[NR_READERS] = { 0 };
+    Object *old[NR_UPDATES];
+    Object *p;
+    int i;
+
+    shared = g_new0(Object, 1);
+    shared->alive = 1;
+    stop = false;
+
+    for (i = 0; i < NR_READERS; i++) {
+        qemu_thread_create(&threads[i], reader_thread, &reads[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    /* Old objects are killed after a grace period but not freed, so that
+     * a reader still using one fails the assertion instead of reading
+     * freed memory.
+     */
+    for (i = 0; i < NR_UPDATES; i++) {
+        p = g_new0(Object, 1);
+        p->alive = 1;
+        old[i] = shared;
+        atomic_rcu_set(&shared, p);
+        synchronize_rcu();
+        atomic_set(&old[i]->alive, 0);
+    }
+
+    atomic_mb_set(&stop, true);
+    for (i = 0; i < NR_READERS; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+
+    for (i = 0; i < NR_UPDATES; i++) {
+        g_free(old[i]);
+    }
+    g_free(shared);
+}
+
+static void object_kill(Object *p)
+{
+    atomic_mb_set(&p->alive, 0);
+}
+
+static void test_call_rcu(void)
+{
+    Object p = { .alive = 1 };
+    int i;
+
+    call_rcu(&p, object_kill, rcu);
+
+    /* The callback runs after a grace period in another thread */
+    for (i = 0; i < 500 && atomic_mb_read(&p.alive); i++) {
+        g_usleep(10000);
+    }
+    g_assert_cmpint(p.alive, ==, 0);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/rcu/nesting", test_nesting);
+    g_test_add_func("/rcu/synchronize", test_synchronize);
+    g_test_add_func("/rcu/call_rcu", test_call_rcu);
+    return g_test_run();
+}
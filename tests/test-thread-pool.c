@@ -202,6 +202,64 @@ static void test_cancel(void)
     }
 }
 
+static int nop_cb(void *opaque)
+{
+    return 0;
+}
+
+static void throughput_done_cb(void *opaque, int ret)
+{
+    active--;
+}
+
+/* Requests per second for trivial work items, with a few in flight */
+static void test_submit_throughput(void)
+{
+    const int total = 200000;
+    const int batch = 64;
+    double elapsed;
+    int i, j;
+
+    g_test_timer_start();
+    for (i = 0; i < total; i += batch) {
+        for (j = 0; j < batch; j++) {
+            thread_pool_submit_aio(pool, nop_cb, NULL,
+                                   throughput_done_cb, NULL);
+        }
+        active = batch;
+        while (active > 0) {
+            aio_poll(ctx, true);
+        }
+    }
+    elapsed = g_test_timer_elapsed();
+
+    g_test_maximized_result(total / elapsed, "%.0f requests/s",
+                            total / elapsed);
+}
+
+/* Round trips per second with a single request in flight: the cost of
+ * waking a worker and getting the completion back to the AioContext
+ */
+static void test_submit_roundtrip(void)
+{
+    const int total = 20000;
+    double elapsed;
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < total; i++) {
+        thread_pool_submit_aio(pool, nop_cb, NULL, throughput_done_cb, NULL);
+        active = 1;
+        while (active > 0) {
+            aio_poll(ctx, true);
+        }
+    }
+    elapsed = g_test_timer_elapsed();
+
+    g_test_maximized_result(total / elapsed, "%.0f round trips/s",
+                            total / elapsed);
+}
+
 int main(int argc, char **argv)
 {
     int ret;
@@ -217,6 +275,12 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-co", test_submit_co);
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
     g_test_add_func("/thread-pool/cancel", test_cancel);
+    if (g_test_perf()) {
+        g_test_add_func("/thread-pool/perf/throughput",
+                        test_submit_throughput);
+        g_test_add_func("/thread-pool/perf/roundtrip",
+                        test_submit_roundtrip);
+    }
 
     ret = g_test_run();
 
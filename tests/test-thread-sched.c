@@ -0,0 +1,66 @@
+/*
+ * Thread placement option parsing tests
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/thread.h"
+
+static void test_affinity(void)
+{
+    QemuThreadSched s = {};
+
+    g_assert_cmpint(qemu_thread_parse_affinity(&s, "3"), ==, 0);
+    g_assert_cmpint(s.first_cpu, ==, 3);
+    g_assert_cmpint(s.nr_cpus, ==, 1);
+
+    g_assert_cmpint(qemu_thread_parse_affinity(&s, "2-5"), ==, 0);
+    g_assert_cmpint(s.first_cpu, ==, 2);
+    g_assert_cmpint(s.nr_cpus, ==, 4);
+
+    g_assert_cmpint(qemu_thread_parse_affinity(&s, ""), ==, -EINVAL);
+    g_assert_cmpint(qemu_thread_parse_affinity(&s, "5-2"), ==, -EINVAL);
+    g_assert_cmpint(qemu_thread_parse_affinity(&s, "1-"), ==, -EINVAL);
+    g_assert_cmpint(qemu_thread_parse_affinity(&s, "1,2"), ==, -EINVAL);
+    g_assert_cmpint(qemu_thread_parse_affinity(&s, "100000"), ==, -EINVAL);
+
+    /* Failures leave the previous value */
+    g_assert_cmpint(s.first_cpu, ==, 2);
+    g_assert_cmpint(s.nr_cpus, ==, 4);
+}
+
+static void test_sched(void)
+{
+    QemuThreadSched s = {};
+
+    g_assert_cmpint(qemu_thread_parse_sched(&s, "other"), ==, 0);
+    g_assert_cmpint(s.policy, ==, QEMU_THREAD_SCHED_OTHER);
+    g_assert_cmpint(s.priority, ==, 0);
+
+    g_assert_cmpint(qemu_thread_parse_sched(&s, "fifo"), ==, 0);
+    g_assert_cmpint(s.policy, ==, QEMU_THREAD_SCHED_FIFO);
+    g_assert_cmpint(s.priority, ==, 1);
+
+    g_assert_cmpint(qemu_thread_parse_sched(&s, "rr:50"), ==, 0);
+    g_assert_cmpint(s.policy, ==, QEMU_THREAD_SCHED_RR);
+    g_assert_cmpint(s.priority, ==, 50);
+
+    g_assert_cmpint(qemu_thread_parse_sched(&s, "fifo:0"), ==, -EINVAL);
+    g_assert_cmpint(qemu_thread_parse_sched(&s, "fifo:100"), ==, -EINVAL);
+    g_assert_cmpint(qemu_thread_parse_sched(&s, "other:1"), ==, -EINVAL);
+    g_assert_cmpint(qemu_thread_parse_sched(&s, "fif"), ==, -EINVAL);
+    g_assert_cmpint(qemu_thread_parse_sched(&s, "batch"), ==, -EINVAL);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/thread-sched/affinity", test_affinity);
+    g_test_add_func("/thread-sched/sched", test_sched);
+    return g_test_run();
+}
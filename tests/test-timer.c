@@ -0,0 +1,261 @@
+/*
+ * QEMUTimerList tests and microbenchmark
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Run with -m perf to get insert and expire rates.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/timer.h"
+
+#define NR_TIMERS 1000
+
+typedef struct {
+    QEMUTimer timer;
+    int64_t expire_time;
+    int index;
+} TestTimer;
+
+static QEMUTimerList *tl;
+static TestTimer timers[NR_TIMERS];
+static int fired[NR_TIMERS];
+static int nb_fired;
+
+static void timer_cb(void *opaque)
+{
+    TestTimer *t = opaque;
+
+    g_assert_cmpint(nb_fired, <, NR_TIMERS);
+    fired[nb_fired++] = t->index;
+}
+
+static void init_timers(void)
+{
+    int i;
+
+    for (i = 0; i < NR_TIMERS; i++) {
+        timers[i].index = i;
+        timer_init(&timers[i].timer, tl, SCALE_NS, timer_cb, &timers[i]);
+    }
+    nb_fired = 0;
+}
+
+/* Expire times in the past, so that timerlist_run_timers() fires them */
+static void arm(int i, int64_t expire_time)
+{
+    timers[i].expire_time = expire_time;
+    timer_mod_ns(&timers[i].timer, expire_time);
+}
+
+static void check_order(void)
+{
+    int i;
+
+    for (i = 1; i < nb_fired; i++) {
+        TestTimer *a = &timers[fired[i - 1]];
+        TestTimer *b = &timers[fired[i]];
+
+        g_assert_cmpint(a->expire_time, <=, b->expire_time);
+    }
+}
+
+static void test_order(void)
+{
+    int i;
+
+    init_timers();
+    for (i = 0; i < NR_TIMERS; i++) {
+        arm(i, g_test_rand_int_range(0, NR_TIMERS * 10));
+    }
+    g_assert(timerlist_has_timers(tl));
+    g_assert(timerlist_run_timers(tl));
+    g_assert(!timerlist_has_timers(tl));
+    g_assert_cmpint(nb_fired, ==, NR_TIMERS);
+    check_order();
+}
+
+static void test_same_expire_time(void)
+{
+    int i;
+
+    /* Timers that expire together fire in the order they were armed */
+    init_timers();
+    for (i = 0; i < NR_TIMERS; i++) {
+        arm(NR_TIMERS - 1 - i, i / 10);
+    }
+    timerlist_run_timers(tl);
+    g_assert_cmpint(nb_fired, ==, NR_TIMERS);
+    for (i = 0; i < NR_TIMERS; i++) {
+        g_assert_cmpint(fired[i], ==, NR_TIMERS - 1 - i);
+    }
+}
+
+static void test_del_mod(void)
+{
+    int i;
+
+    init_timers();
+    for (i = 0; i < NR_TIMERS; i++) {
+        arm(i, g_test_rand_int_range(0, NR_TIMERS * 10));
+    }
+
+    /* Delete a third, move a third far into the future */
+    for (i = 0; i < NR_TIMERS; i += 3) {
+        timer_del(&timers[i].timer);
+        g_assert(!timer_pending(&timers[i].timer));
+    }
+    for (i = 1; i < NR_TIMERS; i += 3) {
+        arm(i, INT64_MAX / 2);
+    }
+    /* Deleting twice is harmless */
+    timer_del(&timers[0].timer);
+
+    timerlist_run_timers(tl);
+    g_assert_cmpint(nb_fired, ==, NR_TIMERS / 3);
+    check_order();
+    for (i = 0; i < nb_fired; i++) {
+        g_assert_cmpint(fired[i] % 3, ==, 2);
+    }
+
+    for (i = 1; i < NR_TIMERS; i += 3) {
+        g_assert(timer_pending(&timers[i].timer));
+        timer_del(&timers[i].timer);
+    }
+    g_assert(!timerlist_has_timers(tl));
+}
+
+static void test_mod_anticipate(void)
+{
+    init_timers();
+    arm(0, 1000);
+    arm(1, 2000);
+
+    /* Only moves a timer earlier */
+    timer_mod_anticipate_ns(&timers[1].timer, 3000);
+    timer_mod_anticipate_ns(&timers[0].timer, 500);
+    timers[0].expire_time = 500;
+
+    timerlist_run_timers(tl);
+    g_assert_cmpint(nb_fired, ==, 2);
+    g_assert_cmpint(fired[0], ==, 0);
+    g_assert_cmpint(fired[1], ==, 1);
+}
+
+static void test_slack(void)
+{
+    int64_t slack = 10 * SCALE_MS;
+    int64_t before, after, deadline, boundary;
+
+    init_timers();
+    qemu_clock_set_slack(QEMU_CLOCK_REALTIME, slack);
+    g_assert_cmpint(qemu_clock_get_slack(QEMU_CLOCK_REALTIME), ==, slack);
+
+    /* Two timers in the same slack window share one wakeup at its end */
+    before = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    boundary = before - before % slack + 2 * slack;
+    arm(0, boundary - slack + 1);
+    arm(1, boundary - 1);
+    deadline = timerlist_deadline_ns(tl);
+    after = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    g_assert_cmpint(before + deadline, <=, boundary);
+    g_assert_cmpint(after + deadline, >=, boundary);
+
+    /* Without slack the first timer sets the deadline again */
+    qemu_clock_set_slack(QEMU_CLOCK_REALTIME, 0);
+    before = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    deadline = timerlist_deadline_ns(tl);
+    after = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    g_assert_cmpint(before + deadline, <=, timers[0].expire_time);
+    g_assert_cmpint(after + deadline, >=, timers[0].expire_time);
+
+    timer_del(&timers[0].timer);
+    timer_del(&timers[1].timer);
+}
+
+static void timer_cb_count(void *opaque)
+{
+    nb_fired++;
+}
+
+static void bench_timers(int n)
+{
+    TestTimer *t = g_new0(TestTimer, n);
+    int64_t far = INT64_MAX / 2;
+    double insert, mod, expire;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        timer_init(&t[i].timer, tl, SCALE_NS, timer_cb_count, NULL);
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        timer_mod_ns(&t[i].timer, far + g_test_rand_int());
+    }
+    insert = g_test_timer_elapsed();
+
+    /* Re-arming is what devices do all the time */
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        timer_mod_ns(&t[i].timer, far + g_test_rand_int());
+    }
+    mod = g_test_timer_elapsed();
+
+    for (i = 0; i < n; i++) {
+        timer_mod_ns(&t[i].timer, g_test_rand_int_range(0, n));
+    }
+    nb_fired = 0;
+    g_test_timer_start();
+    timerlist_run_timers(tl);
+    expire = g_test_timer_elapsed();
+    g_assert_cmpint(nb_fired, ==, n);
+
+    g_test_message("%6d timers: %8.0f inserts/ms %8.0f mods/ms "
+                   "%8.0f expires/ms", n,
+                   n / insert / 1000, n / mod / 1000, n / expire / 1000);
+    g_free(t);
+}
+
+static void test_bench(void)
+{
+    int n;
+
+    for (n = 10; n <= 100000; n *= 10) {
+        TestTimer *t;
+        int i;
+
+        /* As many timers again stay pending, as in a running guest */
+        t = g_new0(TestTimer, n);
+        for (i = 0; i < n; i++) {
+            timer_init(&t[i].timer, tl, SCALE_NS, timer_cb_count, NULL);
+            timer_mod_ns(&t[i].timer, INT64_MAX / 2 + i);
+        }
+        bench_timers(n);
+        for (i = 0; i < n; i++) {
+            timer_del(&t[i].timer);
+        }
+        g_free(t);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    init_clocks();
+    tl = timerlist_new(QEMU_CLOCK_REALTIME, NULL, NULL);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/timer/order", test_order);
+    g_test_add_func("/timer/same-expire-time", test_same_expire_time);
+    g_test_add_func("/timer/del-mod", test_del_mod);
+    g_test_add_func("/timer/mod-anticipate", test_mod_anticipate);
+    g_test_add_func("/timer/slack", test_slack);
+    if (g_test_perf()) {
+        g_test_add_func("/timer/bench", test_bench);
+    }
+    return g_test_run();
+}
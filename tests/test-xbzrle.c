@@ -179,6 +179,196 @@ static void test_encode_decode(void)
     }
 }
 
+/* Straightforward byte at a time encoder, the accelerated one must produce
+ * exactly the same stream.
+ */
+static int reference_encode(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                            uint8_t *dst, int dlen)
+{
+    int d = 0, i = 0, start;
+
+    while (i < slen) {
+        if (d + 2 > dlen) {
+            return -1;
+        }
+        start = i;
+        while (i < slen && old_buf[i] == new_buf[i]) {
+            i++;
+        }
+        if (i - start == slen) {
+            return 0;
+        }
+        if (i == slen) {
+            return d;
+        }
+        d += uleb128_encode_small(dst + d, i - start);
+
+        start = i;
+        while (i < slen && old_buf[i] != new_buf[i]) {
+            i++;
+        }
+        if (d + 2 > dlen) {
+            return -1;
+        }
+        d += uleb128_encode_small(dst + d, i - start);
+        if (d + i - start > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + start, i - start);
+        d += i - start;
+    }
+
+    return d;
+}
+
+/* Typical ways a guest dirties a page */
+typedef enum {
+    DIFF_SPARSE_BYTES,      /* counters and flags scattered over the page */
+    DIFF_SHORT_RUNS,        /* a few small structures updated */
+    DIFF_LONG_RUN,          /* a buffer partially rewritten */
+    DIFF_RANDOM,            /* rewritten with unrelated data: overflows */
+    DIFF_MAX,
+} DiffPattern;
+
+static const char *diff_pattern_name[DIFF_MAX] = {
+    [DIFF_SPARSE_BYTES] = "sparse_bytes",
+    [DIFF_SHORT_RUNS] = "short_runs",
+    [DIFF_LONG_RUN] = "long_run",
+    [DIFF_RANDOM] = "random",
+};
+
+static void make_diff(uint8_t *old_buf, uint8_t *new_buf, DiffPattern pattern)
+{
+    int i, j, pos, len;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old_buf[i] = g_test_rand_int_range(0, 4) ? 0 :
+                     g_test_rand_int_range(0, 256);
+    }
+    memcpy(new_buf, old_buf, PAGE_SIZE);
+
+    switch (pattern) {
+    case DIFF_SPARSE_BYTES:
+        for (i = 0; i < 32; i++) {
+            new_buf[g_test_rand_int_range(0, PAGE_SIZE)] ^= 0x5a;
+        }
+        break;
+    case DIFF_SHORT_RUNS:
+        for (i = 0; i < 16; i++) {
+            pos = g_test_rand_int_range(0, PAGE_SIZE - 64);
+            len = g_test_rand_int_range(1, 64);
+            for (j = pos; j < pos + len; j++) {
+                new_buf[j] ^= 0xff;
+            }
+        }
+        break;
+    case DIFF_LONG_RUN:
+        pos = g_test_rand_int_range(0, PAGE_SIZE / 2);
+        for (j = pos; j < pos + PAGE_SIZE / 4; j++) {
+            new_buf[j] ^= 0xff;
+        }
+        break;
+    case DIFF_RANDOM:
+        for (i = 0; i < PAGE_SIZE; i++) {
+            new_buf[i] = ~old_buf[i];
+        }
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void test_encode_reference(void)
+{
+    uint8_t *old_buf = g_malloc(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *expected = g_malloc(PAGE_SIZE);
+    int i, dlen, rc, ref;
+
+    for (i = 0; i < 4000; i++) {
+        make_diff(old_buf, new_buf, i % DIFF_MAX);
+        /* also exercise the overflow checks with short destinations */
+        dlen = (i & 1) ? PAGE_SIZE : g_test_rand_int_range(2, PAGE_SIZE);
+
+        rc = xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE, compressed,
+                                  dlen);
+        ref = reference_encode(old_buf, new_buf, PAGE_SIZE, expected, dlen);
+        g_assert_cmpint(rc, ==, ref);
+        if (rc > 0) {
+            g_assert(memcmp(compressed, expected, rc) == 0);
+            g_assert_cmpint(xbzrle_decode_buffer(compressed, rc, old_buf,
+                                                 PAGE_SIZE), <=, PAGE_SIZE);
+            g_assert(memcmp(old_buf, new_buf, PAGE_SIZE) == 0);
+        }
+    }
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(compressed);
+    g_free(expected);
+}
+
+/* Throughput benchmarks, only run with -m perf */
+#define PERF_PAGES 64
+#define PERF_ROUNDS 2000
+
+static void test_perf(gconstpointer opaque)
+{
+    DiffPattern pattern = GPOINTER_TO_INT(opaque);
+    uint8_t *old_buf = g_malloc(PAGE_SIZE * PERF_PAGES);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE * PERF_PAGES);
+    uint8_t *compressed = g_malloc(PAGE_SIZE * PERF_PAGES);
+    uint8_t *decoded = g_malloc(PAGE_SIZE);
+    int lens[PERF_PAGES];
+    uint64_t encoded_bytes = 0;
+    double elapsed;
+    int i, j;
+
+    for (i = 0; i < PERF_PAGES; i++) {
+        make_diff(old_buf + i * PAGE_SIZE, new_buf + i * PAGE_SIZE, pattern);
+    }
+
+    g_test_timer_start();
+    for (j = 0; j < PERF_ROUNDS; j++) {
+        for (i = 0; i < PERF_PAGES; i++) {
+            lens[i] = xbzrle_encode_buffer(old_buf + i * PAGE_SIZE,
+                                           new_buf + i * PAGE_SIZE, PAGE_SIZE,
+                                           compressed + i * PAGE_SIZE,
+                                           PAGE_SIZE);
+        }
+    }
+    elapsed = g_test_timer_elapsed();
+    for (i = 0; i < PERF_PAGES; i++) {
+        encoded_bytes += MAX(lens[i], 0);
+    }
+    g_test_maximized_result(PERF_ROUNDS * PERF_PAGES / elapsed,
+                            "%s: encode %.0f pages/s, %.3f of the page size",
+                            diff_pattern_name[pattern],
+                            PERF_ROUNDS * PERF_PAGES / elapsed,
+                            (double)encoded_bytes / (PERF_PAGES * PAGE_SIZE));
+
+    g_test_timer_start();
+    for (j = 0; j < PERF_ROUNDS; j++) {
+        for (i = 0; i < PERF_PAGES; i++) {
+            if (lens[i] > 0) {
+                xbzrle_decode_buffer(compressed + i * PAGE_SIZE, lens[i],
+                                     decoded, PAGE_SIZE);
+            }
+        }
+    }
+    elapsed = g_test_timer_elapsed();
+    g_test_maximized_result(PERF_ROUNDS * PERF_PAGES / elapsed,
+                            "%s: decode %.0f pages/s",
+                            diff_pattern_name[pattern],
+                            PERF_ROUNDS * PERF_PAGES / elapsed);
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(compressed);
+    g_free(decoded);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -191,6 +381,18 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_reference", test_encode_reference);
+
+    if (g_test_perf()) {
+        int i;
+
+        for (i = 0; i < DIFF_MAX; i++) {
+            char *path = g_strdup_printf("/xbzrle/perf/%s",
+                                         diff_pattern_name[i]);
+            g_test_add_data_func(path, GINT_TO_POINTER(i), test_perf);
+            g_free(path);
+        }
+    }
 
     return g_test_run();
 }
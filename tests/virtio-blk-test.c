@@ -0,0 +1,265 @@
+/*
+ * virtio-blk test cases and benchmarks
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * With -m perf, the device is kept busy at a fixed queue depth, set with
+ * QTEST_QUEUE_DEPTH (default 1 and 32).  The request rate includes the
+ * qtest protocol, which is the same for every build, so it is meant for
+ * comparing device model and block layer changes against each other.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "libqtest.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
+
+#include "qemu-common.h"
+
+#define TEST_IMAGE_SIZE         (64 * 1024 * 1024)
+#define PERF_REQUESTS           20000
+#define PERF_REQUEST_SIZE       4096
+
+#define QVIRTIO_BLK_T_IN        0
+#define QVIRTIO_BLK_T_OUT       1
+#define QVIRTIO_BLK_S_OK        0
+
+typedef struct QVirtioBlkReq {
+    uint32_t type;
+    uint32_t ioprio;
+    uint64_t sector;
+} QEMU_PACKED QVirtioBlkReq;
+
+/* A request slot: the header, the data and the status byte */
+typedef struct QVirtioBlkSlot {
+    uint64_t req;
+    uint64_t data;
+    uint64_t status;
+} QVirtioBlkSlot;
+
+static char tmp_path[] = "/tmp/qtest.XXXXXX";
+
+static QVirtioPCIDevice *dev;
+static QVirtQueue *vq;
+static QGuestAllocator *alloc;
+
+static void virtio_blk_start(void)
+{
+    QPCIBus *bus;
+    uint64_t capacity;
+    char *cmdline;
+
+    cmdline = g_strdup_printf("-drive if=none,id=drive0,file=%s,format=raw "
+                              "-device virtio-blk-pci,drive=drive0",
+                              tmp_path);
+    qtest_start(cmdline);
+    g_free(cmdline);
+
+    bus = qpci_init_pc();
+    alloc = pc_alloc_init();
+    dev = qvirtio_pci_device_find(bus, QVIRTIO_BLK_DEVICE_ID);
+    g_assert(dev != NULL);
+    qvirtio_pci_device_enable(dev);
+
+    qvirtio_reset(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_acknowledge(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_driver(&qvirtio_pci, &dev->vdev);
+    qvirtio_pci.set_features(&dev->vdev, 0);
+
+    capacity = qvirtio_pci.config_readq(&dev->vdev, 0);
+    g_assert_cmpint(capacity, ==, TEST_IMAGE_SIZE / 512);
+
+    vq = qvirtqueue_setup(&qvirtio_pci, &dev->vdev, alloc, 0);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+}
+
+static void virtio_blk_quit(void)
+{
+    qtest_end();
+}
+
+static void virtio_blk_slot_init(QVirtioBlkSlot *slot, uint32_t type,
+                                 uint64_t sector, uint32_t size)
+{
+    QVirtioBlkReq req = {
+        .type = cpu_to_le32(type),
+        .sector = cpu_to_le64(sector),
+    };
+
+    slot->req = guest_alloc(alloc, sizeof(req));
+    slot->data = guest_alloc(alloc, size);
+    slot->status = guest_alloc(alloc, 1);
+    memwrite(slot->req, &req, sizeof(req));
+}
+
+static uint16_t virtio_blk_submit(QVirtioBlkSlot *slot, uint32_t type,
+                                  uint32_t size)
+{
+    uint16_t head;
+
+    writeb(slot->status, 0xff);
+    head = qvirtqueue_add(vq, slot->req, sizeof(QVirtioBlkReq), false, true);
+    qvirtqueue_add(vq, slot->data, size, type == QVIRTIO_BLK_T_IN, true);
+    qvirtqueue_add(vq, slot->status, 1, true, false);
+    qvirtqueue_push(vq, head);
+    return head;
+}
+
+static void test_basic(void)
+{
+    QVirtioBlkSlot wr, rd;
+    uint8_t buf[512], data[512];
+    uint16_t head;
+    uint32_t len;
+    int i;
+
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = i * 7;
+    }
+
+    virtio_blk_start();
+
+    virtio_blk_slot_init(&wr, QVIRTIO_BLK_T_OUT, 1, sizeof(buf));
+    memwrite(wr.data, buf, sizeof(buf));
+    virtio_blk_submit(&wr, QVIRTIO_BLK_T_OUT, sizeof(buf));
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, vq);
+    qvirtqueue_wait_buf(vq, &head, &len);
+    g_assert_cmpint(readb(wr.status), ==, QVIRTIO_BLK_S_OK);
+
+    virtio_blk_slot_init(&rd, QVIRTIO_BLK_T_IN, 1, sizeof(data));
+    virtio_blk_submit(&rd, QVIRTIO_BLK_T_IN, sizeof(data));
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, vq);
+    qvirtqueue_wait_buf(vq, &head, &len);
+    g_assert_cmpint(readb(rd.status), ==, QVIRTIO_BLK_S_OK);
+    g_assert_cmpint(len, ==, sizeof(data) + 1);
+
+    memread(rd.data, data, sizeof(data));
+    g_assert(memcmp(buf, data, sizeof(data)) == 0);
+
+    virtio_blk_quit();
+}
+
+static void test_perf(gconstpointer opaque)
+{
+    uint32_t type = GPOINTER_TO_INT(opaque) & 1;
+    int depth = GPOINTER_TO_INT(opaque) >> 1;
+    QVirtioBlkSlot *slots;
+    uint16_t *slot_of_head;
+    int submitted, completed, i;
+    double elapsed, cpu;
+    uint16_t head;
+    uint32_t len;
+
+    virtio_blk_start();
+
+    /* Each request takes three descriptors */
+    g_assert_cmpint(depth * 3, <=, vq->size);
+    slots = g_new(QVirtioBlkSlot, depth);
+    slot_of_head = g_new(uint16_t, vq->size);
+    for (i = 0; i < depth; i++) {
+        virtio_blk_slot_init(&slots[i], type,
+                             i * (PERF_REQUEST_SIZE / 512), PERF_REQUEST_SIZE);
+    }
+
+    cpu = qtest_cpu_time(global_qtest);
+    g_test_timer_start();
+
+    for (i = 0; i < depth; i++) {
+        slot_of_head[virtio_blk_submit(&slots[i], type,
+                                       PERF_REQUEST_SIZE)] = i;
+    }
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, vq);
+    submitted = depth;
+    completed = 0;
+
+    /* Resubmit every completed slot, and notify once per batch */
+    while (completed < PERF_REQUESTS) {
+        qvirtqueue_wait_buf(vq, &head, &len);
+        do {
+            completed++;
+            i = slot_of_head[head];
+            if (submitted < PERF_REQUESTS) {
+                slot_of_head[virtio_blk_submit(&slots[i], type,
+                                               PERF_REQUEST_SIZE)] = i;
+                submitted++;
+            }
+        } while (qvirtqueue_get_buf(vq, &head, &len));
+        qvirtqueue_kick(&qvirtio_pci, &dev->vdev, vq);
+    }
+
+    elapsed = g_test_timer_elapsed();
+    cpu = qtest_cpu_time(global_qtest) - cpu;
+
+    g_test_maximized_result(PERF_REQUESTS / elapsed,
+                            "%s, queue depth %d: %.0f requests/s",
+                            type == QVIRTIO_BLK_T_IN ? "read" : "write",
+                            depth, PERF_REQUESTS / elapsed);
+    if (cpu >= 0) {
+        g_test_minimized_result(cpu * 1e6 / PERF_REQUESTS,
+                                "%.1f us of QEMU CPU time per request",
+                                cpu * 1e6 / PERF_REQUESTS);
+    }
+
+    g_free(slot_of_head);
+    g_free(slots);
+    virtio_blk_quit();
+}
+
+static void add_perf_tests(int depth)
+{
+    char *path;
+
+    path = g_strdup_printf("virtio/blk/pci/perf/read/%d", depth);
+    qtest_add_data_func(path, GINT_TO_POINTER(depth << 1 | QVIRTIO_BLK_T_IN),
+                        test_perf);
+    g_free(path);
+    path = g_strdup_printf("virtio/blk/pci/perf/write/%d", depth);
+    qtest_add_data_func(path, GINT_TO_POINTER(depth << 1 | QVIRTIO_BLK_T_OUT),
+                        test_perf);
+    g_free(path);
+}
+
+int main(int argc, char **argv)
+{
+    const char *arch = qtest_get_arch();
+    const char *depth = getenv("QTEST_QUEUE_DEPTH");
+    int fd;
+    int ret;
+
+    /* Create a temporary raw image */
+    fd = mkstemp(tmp_path);
+    g_assert_cmpint(fd, >=, 0);
+    ret = ftruncate(fd, TEST_IMAGE_SIZE);
+    g_assert_cmpint(ret, ==, 0);
+    close(fd);
+
+    g_test_init(&argc, &argv, NULL);
+
+    if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
+        qtest_add_func("virtio/blk/pci/basic", test_basic);
+        if (g_test_perf()) {
+            if (depth) {
+                add_perf_tests(atoi(depth));
+            } else {
+                add_perf_tests(1);
+                add_perf_tests(32);
+            }
+        }
+    }
+
+    ret = g_test_run();
+
+    unlink(tmp_path);
+    return ret;
+}
@@ -0,0 +1,211 @@
+/*
+ * virtio-net test cases and benchmarks
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The device is connected to a hub with no other port, which drops the
+ * packets, so only the transmit path of the device model and of the net
+ * layer is measured.  With -m perf the transmit queue is kept filled to
+ * QTEST_QUEUE_DEPTH packets (default 1 and 64).
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "libqtest.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
+
+#include "qemu-common.h"
+
+#define PERF_PACKETS            50000
+#define PACKET_SIZE             1514
+
+/* struct virtio_net_hdr, without VIRTIO_NET_F_MRG_RXBUF */
+#define QVIRTIO_NET_HDR_SIZE    10
+
+#define QVIRTIO_NET_TX_QUEUE    1
+
+/* A packet slot: the header and the frame */
+typedef struct QVirtioNetSlot {
+    uint64_t hdr;
+    uint64_t data;
+} QVirtioNetSlot;
+
+static QVirtioPCIDevice *dev;
+static QVirtQueue *tx;
+static QGuestAllocator *alloc;
+
+static void virtio_net_start(void)
+{
+    QPCIBus *bus;
+
+    qtest_start("-netdev hubport,id=hub0,hubid=0 "
+                "-device virtio-net-pci,netdev=hub0");
+
+    bus = qpci_init_pc();
+    alloc = pc_alloc_init();
+    dev = qvirtio_pci_device_find(bus, QVIRTIO_NET_DEVICE_ID);
+    g_assert(dev != NULL);
+    qvirtio_pci_device_enable(dev);
+
+    qvirtio_reset(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_acknowledge(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_driver(&qvirtio_pci, &dev->vdev);
+    qvirtio_pci.set_features(&dev->vdev, 0);
+
+    tx = qvirtqueue_setup(&qvirtio_pci, &dev->vdev, alloc,
+                          QVIRTIO_NET_TX_QUEUE);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+}
+
+static void virtio_net_quit(void)
+{
+    qtest_end();
+}
+
+static void virtio_net_slot_init(QVirtioNetSlot *slot)
+{
+    uint8_t hdr[QVIRTIO_NET_HDR_SIZE] = { 0 };
+    uint8_t frame[PACKET_SIZE];
+
+    /* Broadcast, from a locally administered address, with an
+     * experimental ethertype
+     */
+    memset(frame, 0xff, 6);
+    memcpy(frame + 6, "\x02\x00\x00\x00\x00\x01", 6);
+    frame[12] = 0x88;
+    frame[13] = 0xb5;
+    memset(frame + 14, 0x5a, sizeof(frame) - 14);
+
+    slot->hdr = guest_alloc(alloc, sizeof(hdr));
+    slot->data = guest_alloc(alloc, sizeof(frame));
+    memwrite(slot->hdr, hdr, sizeof(hdr));
+    memwrite(slot->data, frame, sizeof(frame));
+}
+
+static uint16_t virtio_net_submit(QVirtioNetSlot *slot)
+{
+    uint16_t head;
+
+    head = qvirtqueue_add(tx, slot->hdr, QVIRTIO_NET_HDR_SIZE, false, true);
+    qvirtqueue_add(tx, slot->data, PACKET_SIZE, false, false);
+    qvirtqueue_push(tx, head);
+    return head;
+}
+
+static void test_tx(void)
+{
+    QVirtioNetSlot slot;
+    uint16_t head, done;
+    uint32_t len;
+
+    virtio_net_start();
+
+    virtio_net_slot_init(&slot);
+    head = virtio_net_submit(&slot);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, tx);
+    qvirtqueue_wait_buf(tx, &done, &len);
+    g_assert_cmpint(done, ==, head);
+
+    virtio_net_quit();
+}
+
+static void test_perf_tx(gconstpointer opaque)
+{
+    int depth = GPOINTER_TO_INT(opaque);
+    QVirtioNetSlot *slots;
+    uint16_t *slot_of_head;
+    int submitted, completed, i;
+    double elapsed, cpu;
+    uint16_t head;
+    uint32_t len;
+
+    virtio_net_start();
+
+    /* Each packet takes two descriptors */
+    g_assert_cmpint(depth * 2, <=, tx->size);
+    slots = g_new(QVirtioNetSlot, depth);
+    slot_of_head = g_new(uint16_t, tx->size);
+    for (i = 0; i < depth; i++) {
+        virtio_net_slot_init(&slots[i]);
+    }
+
+    cpu = qtest_cpu_time(global_qtest);
+    g_test_timer_start();
+
+    for (i = 0; i < depth; i++) {
+        slot_of_head[virtio_net_submit(&slots[i])] = i;
+    }
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, tx);
+    submitted = depth;
+    completed = 0;
+
+    /* Resubmit every completed slot, and notify once per batch */
+    while (completed < PERF_PACKETS) {
+        qvirtqueue_wait_buf(tx, &head, &len);
+        do {
+            completed++;
+            i = slot_of_head[head];
+            if (submitted < PERF_PACKETS) {
+                slot_of_head[virtio_net_submit(&slots[i])] = i;
+                submitted++;
+            }
+        } while (qvirtqueue_get_buf(tx, &head, &len));
+        qvirtqueue_kick(&qvirtio_pci, &dev->vdev, tx);
+    }
+
+    elapsed = g_test_timer_elapsed();
+    cpu = qtest_cpu_time(global_qtest) - cpu;
+
+    g_test_maximized_result(PERF_PACKETS / elapsed,
+                            "tx, queue depth %d: %.0f packets/s",
+                            depth, PERF_PACKETS / elapsed);
+    if (cpu >= 0) {
+        g_test_minimized_result(cpu * 1e6 / PERF_PACKETS,
+                                "%.1f us of QEMU CPU time per packet",
+                                cpu * 1e6 / PERF_PACKETS);
+    }
+
+    g_free(slot_of_head);
+    g_free(slots);
+    virtio_net_quit();
+}
+
+static void add_perf_test(int depth)
+{
+    char *path = g_strdup_printf("virtio/net/pci/perf/tx/%d", depth);
+
+    qtest_add_data_func(path, GINT_TO_POINTER(depth), test_perf_tx);
+    g_free(path);
+}
+
+int main(int argc, char **argv)
+{
+    const char *arch = qtest_get_arch();
+    const char *depth = getenv("QTEST_QUEUE_DEPTH");
+
+    g_test_init(&argc, &argv, NULL);
+
+    if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
+        qtest_add_func("virtio/net/pci/tx", test_tx);
+        if (g_test_perf()) {
+            if (depth) {
+                add_perf_test(atoi(depth));
+            } else {
+                add_perf_test(1);
+                add_perf_test(64);
+            }
+        }
+    }
+
+    return g_test_run();
+}
@@ -17,6 +17,7 @@
 #include "qemu-common.h"
 #include "qemu/queue.h"
 #include "qemu/thread.h"
+#include "qemu/atomic.h"
 #include "qemu/osdep.h"
 #include "block/coroutine.h"
 #include "trace.h"
@@ -52,6 +53,9 @@ struct ThreadPoolElement {
     /* Access to this list is protected by lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
+    /* Pushed atomically once the request is done or canceled.  */
+    ThreadPoolElement *done_next;
+
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
@@ -69,16 +73,37 @@ struct ThreadPool {
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
 
+    /* Finished requests, most recent first.  Workers push with cmpxchg,
+     * the AioContext takes the whole list with xchg.
+     */
+    ThreadPoolElement *done;
+
     /* The following variables are protected by lock.  */
     QTAILQ_HEAD(, ThreadPoolElement) request_list;
     int cur_threads;
     int idle_threads;
+    int pending_wakeups; /* sem posts not consumed yet */
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
     int pending_cancellations; /* whether we need a cond_broadcast */
     bool stopping;
 };
 
+static void thread_pool_push_done(ThreadPool *pool, ThreadPoolElement *req)
+{
+    ThreadPoolElement *old;
+
+    do {
+        old = atomic_read(&pool->done);
+        req->done_next = old;
+    } while (atomic_cmpxchg(&pool->done, old, req) != old);
+
+    /* Only the first completion after a drain needs to kick the context */
+    if (!old) {
+        event_notifier_set(&pool->notifier);
+    }
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
@@ -91,14 +116,23 @@ static void *worker_thread(void *opaque)
         ThreadPoolElement *req;
         int ret;
 
-        do {
+        /* Keep taking requests as long as there are some; only sleep on
+         * the semaphore when the list is empty.  A busy pool thus needs
+         * no semaphore operations at all.
+         */
+        while (QTAILQ_EMPTY(&pool->request_list) && !pool->stopping) {
             pool->idle_threads++;
             qemu_mutex_unlock(&pool->lock);
             ret = qemu_sem_timedwait(&pool->sem, 10000);
             qemu_mutex_lock(&pool->lock);
             pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
-        if (ret == -1 || pool->stopping) {
+            if (ret == 0) {
+                pool->pending_wakeups--;
+            } else if (QTAILQ_EMPTY(&pool->request_list)) {
+                goto out;
+            }
+        }
+        if (pool->stopping) {
             break;
         }
 
@@ -119,9 +153,12 @@ static void *worker_thread(void *opaque)
             qemu_cond_broadcast(&pool->check_cancel);
         }
 
-        event_notifier_set(&pool->notifier);
+        /* req may be freed as soon as it is on the list */
+        thread_pool_push_done(pool, req);
     }
 
+out:
+
     pool->cur_threads--;
     qemu_cond_signal(&pool->worker_stopped);
     qemu_mutex_unlock(&pool->lock);
@@ -171,30 +208,34 @@ static void spawn_thread(ThreadPool *pool)
 static void event_notifier_ready(EventNotifier *notifier)
 {
     ThreadPool *pool = container_of(notifier, ThreadPool, notifier);
-    ThreadPoolElement *elem, *next;
+    ThreadPoolElement *elem, *next, *list = NULL;
 
+    /* Clear first: a request pushed after this point kicks again */
     event_notifier_test_and_clear(notifier);
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_CANCELED && elem->state != THREAD_DONE) {
-            continue;
-        }
+    elem = atomic_xchg(&pool->done, NULL);
+
+    /* Complete in the order the requests finished */
+    while (elem) {
+        next = elem->done_next;
+        elem->done_next = list;
+        list = elem;
+        elem = next;
+    }
+
+    /* The list is private now, so callbacks may safely poll again */
+    for (elem = list; elem; elem = next) {
+        next = elem->done_next;
+        QLIST_REMOVE(elem, all);
         if (elem->state == THREAD_DONE) {
             trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                        elem->ret);
+            if (elem->common.cb) {
+                /* Read state before ret.  */
+                smp_rmb();
+                elem->common.cb(elem->common.opaque, elem->ret);
+            }
         }
-        if (elem->state == THREAD_DONE && elem->common.cb) {
-            QLIST_REMOVE(elem, all);
-            /* Read state before ret.  */
-            smp_rmb();
-            elem->common.cb(elem->common.opaque, elem->ret);
-            qemu_aio_release(elem);
-            goto restart;
-        } else {
-            /* remove the request */
-            QLIST_REMOVE(elem, all);
-            qemu_aio_release(elem);
-        }
+        qemu_aio_release(elem);
     }
 }
 
@@ -206,16 +247,14 @@ static void thread_pool_cancel(BlockDriverAIOCB *acb)
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
     qemu_mutex_lock(&pool->lock);
-    if (elem->state == THREAD_QUEUED &&
-        /* No thread has yet started working on elem. we can try to "steal"
-         * the item from the worker if we can get a signal from the
-         * semaphore.  Because this is non-blocking, we can do it with
-         * the lock taken and ensure that elem will remain THREAD_QUEUED.
+    if (elem->state == THREAD_QUEUED) {
+        /* No thread has yet started working on elem, so it can simply be
+         * taken off the list.  A worker that was woken up for it finds
+         * the list empty and goes back to sleep.
          */
-        qemu_sem_timedwait(&pool->sem, 0) == 0) {
         QTAILQ_REMOVE(&pool->request_list, elem, reqs);
         elem->state = THREAD_CANCELED;
-        event_notifier_set(&pool->notifier);
+        thread_pool_push_done(pool, elem);
     } else {
         pool->pending_cancellations++;
         while (elem->state != THREAD_CANCELED && elem->state != THREAD_DONE) {
@@ -248,12 +287,15 @@ BlockDriverAIOCB *thread_pool_submit_aio(ThreadPool *pool,
     trace_thread_pool_submit(pool, req, arg);
 
     qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
+    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
+    if (pool->idle_threads > pool->pending_wakeups) {
+        /* Wake up one sleeping worker per request, but no more */
+        pool->pending_wakeups++;
+        qemu_sem_post(&pool->sem);
+    } else if (pool->cur_threads < pool->max_threads) {
         spawn_thread(pool);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
     qemu_mutex_unlock(&pool->lock);
-    qemu_sem_post(&pool->sem);
     return &req->common;
 }
 
@@ -274,8 +316,11 @@ int coroutine_fn thread_pool_submit_co(ThreadPool *pool, ThreadPoolFunc *func,
                                        void *arg)
 {
     ThreadPoolCo tpc = { .co = qemu_coroutine_self(), .ret = -EINPROGRESS };
+    BlockDriverAIOCB *req;
+
     assert(qemu_in_coroutine());
-    thread_pool_submit_aio(pool, func, arg, thread_pool_co_cb, &tpc);
+    req = thread_pool_submit_aio(pool, func, arg, thread_pool_co_cb, &tpc);
+    trace_thread_pool_submit_co(pool, req, req->id, tpc.co);
     qemu_coroutine_yield();
     return tpc.ret;
 }
@@ -333,6 +378,7 @@ void thread_pool_free(ThreadPool *pool)
     pool->stopping = true;
     while (pool->cur_threads > 0) {
         qemu_sem_post(&pool->sem);
+        pool->pending_wakeups++;
         qemu_cond_wait(&pool->worker_stopped, &pool->lock);
     }
 
@@ -17,6 +17,7 @@
 #include <pthread.h>
 #endif
 #include "qemu/timer.h"
+#include "qemu/atomic.h"
 #include "trace.h"
 #include "trace/control.h"
 
@@ -27,7 +28,7 @@
 #define HEADER_MAGIC 0xf2b177cb0aa429b4ULL
 
 /** Trace file version number, bump if format changes */
-#define HEADER_VERSION 2
+#define HEADER_VERSION 3
 
 /** Records were dropped event ID */
 #define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
@@ -56,14 +57,44 @@ static bool trace_available;
 static bool trace_writeout_enabled;
 
 enum {
-    TRACE_BUF_LEN = 4096 * 64,
+    TRACE_BUF_LEN = 4096 * 64,      /* per thread, must be a power of two */
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
+    TRACE_RECORD_ALIGN = 8,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
-static volatile gint dropped_events;
+/*
+ * Each thread that traces gets its own ring buffer, so that vCPUs and
+ * I/O threads do not bounce a shared index between them.  The owner is the
+ * only producer and the writeout thread the only consumer.  The owner
+ * reserves a record by moving @head forward with a compare-and-swap, which
+ * only matters if a signal handler traces in the middle of a record, and
+ * sets TRACE_RECORD_VALID in it when it is complete.  The writeout thread
+ * copies valid records starting at @tail, zeroes them and gives the space
+ * back by moving @tail.
+ *
+ * Records are multiples of 8 bytes, so that the event word is always
+ * stored in one piece.
+ *
+ * Buffers are never freed.  When a thread exits, its buffer is marked
+ * unused and the next new thread takes it over.
+ */
+typedef struct TraceThreadBuffer {
+    struct TraceThreadBuffer *next;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int dropped;       /* records lost because the buffer was full */
+    int in_use;
+    uint32_t thread;            /* stored in each record of this buffer */
+    uint8_t buf[TRACE_BUF_LEN];
+} TraceThreadBuffer;
+
+static TraceThreadBuffer *trace_buffers;
+static unsigned int trace_nr_buffers;
+static __thread TraceThreadBuffer *trace_thread_buffer;
+#ifndef _WIN32
+static pthread_key_t trace_buffer_key;
+#endif
+
 static FILE *trace_fp;
 static char *trace_file_name;
 
@@ -71,8 +102,8 @@ static char *trace_file_name;
 typedef struct {
     uint64_t event; /*   TraceEventID */
     uint64_t timestamp_ns;
-    uint32_t length;   /*    in bytes */
-    uint32_t reserved; /*    unused */
+    uint32_t length;   /*    in bytes, including padding */
+    uint32_t thread;   /*    number of the per-thread buffer */
     uint64_t arguments[];
 } TraceRecord;
 
@@ -83,34 +114,52 @@ typedef struct {
 } TraceLogHeader;
 
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
+static void read_from_buffer(TraceThreadBuffer *tb, unsigned int idx,
+                             void *dataptr, size_t size)
+{
+    unsigned int off = idx & (TRACE_BUF_LEN - 1);
+    size_t n = MIN(size, TRACE_BUF_LEN - off);
 
-static void clear_buffer_range(unsigned int idx, size_t len)
+    memcpy(dataptr, tb->buf + off, n);
+    memcpy((uint8_t *)dataptr + n, tb->buf, size - n);
+}
+
+static unsigned int write_to_buffer(TraceThreadBuffer *tb, unsigned int idx,
+                                    const void *dataptr, size_t size)
 {
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = 0;
-        num++;
-    }
+    unsigned int off = idx & (TRACE_BUF_LEN - 1);
+    size_t n = MIN(size, TRACE_BUF_LEN - off);
+
+    memcpy(tb->buf + off, dataptr, n);
+    memcpy(tb->buf, (const uint8_t *)dataptr + n, size - n);
+    return idx + size; /* most callers wants to know where to write next */
+}
+
+static void clear_buffer_range(TraceThreadBuffer *tb, unsigned int idx,
+                               size_t len)
+{
+    unsigned int off = idx & (TRACE_BUF_LEN - 1);
+    size_t n = MIN(len, TRACE_BUF_LEN - off);
+
+    memset(tb->buf + off, 0, n);
+    memset(tb->buf, 0, len - n);
 }
+
 /**
- * Read a trace record from the trace buffer
+ * Read a trace record from a thread's buffer
  *
- * @idx         Trace buffer index
+ * @tb          Thread buffer, the record is read at its tail
  * @record      Trace record to fill
  *
  * Returns false if the record is not valid.
  */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+static bool get_trace_record(TraceThreadBuffer *tb, TraceRecord **recordptr)
 {
-    uint64_t event_flag = 0;
+    unsigned int idx = tb->tail;
     TraceRecord record;
+
     /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
+    read_from_buffer(tb, idx, &record.event, sizeof(record.event));
 
     if (!(record.event & TRACE_RECORD_VALID)) {
         return false;
@@ -118,17 +167,18 @@ static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
 
     smp_rmb(); /* read memory barrier before accessing record */
     /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
+    read_from_buffer(tb, idx, &record, sizeof(TraceRecord));
     *recordptr = malloc(record.length); /* dont use g_malloc, can deadlock when traced */
     /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
+    read_from_buffer(tb, idx, *recordptr, record.length);
     (*recordptr)->event &= ~TRACE_RECORD_VALID;
     /* clear the trace buffer range for consumed record otherwise any byte
      * with its MSB set may be considered as a valid event id when the writer
      * thread crosses this range of buffer again.
      */
-    clear_buffer_range(idx, record.length);
+    clear_buffer_range(tb, idx, record.length);
+    smp_mb(); /* the cleared range must be visible before it is reused */
+    atomic_set(&tb->tail, idx + record.length);
     return true;
 }
 
@@ -165,35 +215,32 @@ static void wait_for_trace_records_available(void)
 static gpointer writeout_thread(gpointer opaque)
 {
     TraceRecord *recordptr;
+    TraceThreadBuffer *tb;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
-    int dropped_count;
+    unsigned int dropped_count;
     size_t unused __attribute__ ((unused));
 
     for (;;) {
         wait_for_trace_records_available();
 
-        if (g_atomic_int_get(&dropped_events)) {
-            dropped.rec.event = DROPPED_EVENT_ID,
-            dropped.rec.timestamp_ns = get_clock();
-            dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t),
-            dropped.rec.reserved = 0;
-            do {
-                dropped_count = g_atomic_int_get(&dropped_events);
-            } while (!g_atomic_int_compare_and_exchange(&dropped_events,
-                                                        dropped_count, 0));
-            dropped.rec.arguments[0] = dropped_count;
-            unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
-        }
-
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* dont use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
+        for (tb = atomic_mb_read(&trace_buffers); tb; tb = tb->next) {
+            dropped_count = atomic_xchg(&tb->dropped, 0);
+            if (dropped_count) {
+                dropped.rec.event = DROPPED_EVENT_ID;
+                dropped.rec.timestamp_ns = get_clock();
+                dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t);
+                dropped.rec.thread = tb->thread;
+                dropped.rec.arguments[0] = dropped_count;
+                unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+            }
+
+            while (get_trace_record(tb, &recordptr)) {
+                unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
+                free(recordptr); /* dont use g_free, can deadlock when traced */
+            }
         }
 
         fflush(trace_fp);
@@ -201,85 +248,114 @@ static gpointer writeout_thread(gpointer opaque)
     return NULL;
 }
 
+#ifndef _WIN32
+static void trace_thread_exit(void *opaque)
+{
+    TraceThreadBuffer *tb = opaque;
+
+    /* Events traced by later destructors take the buffer again */
+    trace_thread_buffer = NULL;
+    atomic_mb_set(&tb->in_use, 0);
+}
+#endif
+
+static TraceThreadBuffer *trace_get_thread_buffer(void)
+{
+    TraceThreadBuffer *tb = trace_thread_buffer;
+    TraceThreadBuffer *old;
+
+    if (likely(tb)) {
+        return tb;
+    }
+
+    /* Take over the buffer of a thread that exited, if there is one */
+    for (tb = atomic_mb_read(&trace_buffers); tb; tb = tb->next) {
+        if (!atomic_read(&tb->in_use) && !atomic_cmpxchg(&tb->in_use, 0, 1)) {
+            break;
+        }
+    }
+
+    if (!tb) {
+        tb = calloc(1, sizeof(*tb)); /* dont use g_malloc, can deadlock when traced */
+        if (!tb) {
+            return NULL;
+        }
+        tb->in_use = 1;
+        tb->thread = atomic_fetch_inc(&trace_nr_buffers);
+        do {
+            old = atomic_read(&trace_buffers);
+            tb->next = old;
+        } while (atomic_cmpxchg(&trace_buffers, old, tb) != old);
+    }
+
+#ifndef _WIN32
+    pthread_setspecific(trace_buffer_key, tb);
+#endif
+    trace_thread_buffer = tb;
+    return tb;
+}
+
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, &val,
+                                   sizeof(uint64_t));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, &slen,
+                                   sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, TraceEventID event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
-    uint32_t rec_len = sizeof(TraceRecord) + datasize;
-    uint64_t event_u64 = event;
-    uint64_t timestamp_ns = get_clock();
+    TraceThreadBuffer *tb = trace_get_thread_buffer();
+    unsigned int old_idx, new_idx;
+    uint32_t rec_len = ROUND_UP(sizeof(TraceRecord) + datasize,
+                                TRACE_RECORD_ALIGN);
+    TraceRecord record;
+
+    if (!tb) {
+        return -ENOMEM;
+    }
 
     do {
-        old_idx = g_atomic_int_get(&trace_idx);
-        smp_rmb();
+        old_idx = atomic_read(&tb->head);
         new_idx = old_idx + rec_len;
 
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
+        if (new_idx - atomic_read(&tb->tail) > TRACE_BUF_LEN) {
             /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc(&dropped_events);
+            atomic_inc(&tb->dropped);
             return -ENOSPC;
         }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
-
-    idx = old_idx % TRACE_BUF_LEN;
+    } while (atomic_cmpxchg(&tb->head, old_idx, new_idx) != old_idx);
 
-    rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event_u64, sizeof(event_u64));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
+    record.event = event;
+    record.timestamp_ns = get_clock();
+    record.length = rec_len;
+    record.thread = tb->thread;
+    write_to_buffer(tb, old_idx, &record, sizeof(TraceRecord));
 
-    rec->tbuf_idx = idx;
-    rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
+    rec->tbuf = tb;
+    rec->tbuf_idx = old_idx;
+    rec->rec_off = old_idx + sizeof(TraceRecord);
     return 0;
 }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
-    }
-}
-
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = data_ptr[x++];
-    }
-    return idx; /* most callers wants to know where to write next */
-}
-
 void trace_record_finish(TraceBufferRecord *rec)
 {
-    TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    TraceThreadBuffer *tb = rec->tbuf;
+    uint64_t *event = (uint64_t *)(tb->buf + (rec->tbuf_idx &
+                                              (TRACE_BUF_LEN - 1)));
+
     smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    atomic_set(event, *event | TRACE_RECORD_VALID);
 
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
-        > TRACE_BUF_FLUSH_THRESHOLD) {
+    if (atomic_read(&tb->head) - atomic_read(&tb->tail)
+        > TRACE_BUF_FLUSH_THRESHOLD && !atomic_read(&trace_available)) {
         flush_trace_file(false);
     }
 }
@@ -424,6 +500,10 @@ bool trace_backend_init(const char *events, const char *file)
         return false;
     }
 
+#ifndef _WIN32
+    pthread_key_create(&trace_buffer_key, trace_thread_exit);
+#endif
+
     atexit(st_flush_trace_buffer);
     trace_backend_init_events(events);
     st_set_trace_file(file);
@@ -24,6 +24,7 @@ bool st_set_trace_file(const char *file);
 void st_flush_trace_buffer(void);
 
 typedef struct {
+    struct TraceThreadBuffer *tbuf;
     unsigned int tbuf_idx;
     unsigned int rec_off;
 } TraceBufferRecord;
@@ -125,6 +125,26 @@ static void *l1_map[V_L1_SIZE];
 /* code generation context */
 TCGContext tcg_ctx;
 
+/* Emit per-TB execution counters, see gen_tb_start() */
+int tb_profile_enabled;
+
+/* What "info tb-hot" knows about a guest PC, summed over all the TBs that
+   were translated for it */
+typedef struct TBProfile {
+    uint64_t pc;
+    uint64_t exec_count;    /* executions of TBs that no longer exist */
+    uint64_t insns;         /* guest instructions they executed */
+    uint64_t live_count;    /* the same for the current TBs... */
+    uint64_t live_insns;    /* ...only valid in dump_tb_hot() */
+    unsigned int translations;
+    unsigned int invalidations;
+} TBProfile;
+
+static GHashTable *tb_profile_stats;
+
+/* See tcg_perf_map_init() */
+static FILE *tb_perf_map;
+
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2);
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
@@ -559,6 +579,58 @@ static inline void *alloc_code_gen_buffer(void)
 }
 #endif /* USE_STATIC_CODE_GEN_BUFFER, USE_MMAP */
 
+/* Split the code buffer and the TB array in regions.  Each region must hold
+   many TBs of the largest possible size, otherwise evicting one would not
+   give back much room; small buffers are just flushed as a whole.  */
+#define TB_REGION_MIN_SIZE (16 * TCG_MAX_OP_SIZE * OPC_BUF_SIZE)
+
+static void tb_regions_init(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    size_t region_size;
+    int i;
+
+    ctx->nb_regions = tcg_ctx.code_gen_buffer_size / TB_REGION_MIN_SIZE;
+    ctx->nb_regions = MAX(1, MIN(ctx->nb_regions, TB_MAX_REGIONS));
+    ctx->tbs_per_region = tcg_ctx.code_gen_max_blocks / ctx->nb_regions;
+    region_size = tcg_ctx.code_gen_buffer_size / ctx->nb_regions;
+
+    for (i = 0; i < ctx->nb_regions; i++) {
+        TBRegion *r = &ctx->regions[i];
+
+        r->start = tcg_ctx.code_gen_buffer + i * region_size;
+        r->end = r->start + region_size;
+        r->code_end = r->start;
+        r->first_tb = i * ctx->tbs_per_region;
+        r->nb_tbs = 0;
+    }
+    ctx->regions[ctx->nb_regions - 1].end =
+        tcg_ctx.code_gen_buffer + tcg_ctx.code_gen_buffer_size;
+    ctx->cur_region = 0;
+}
+
+static void tb_regions_reset(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int i;
+
+    for (i = 0; i < ctx->nb_regions; i++) {
+        ctx->regions[i].code_end = ctx->regions[i].start;
+        ctx->regions[i].nb_tbs = 0;
+    }
+    ctx->cur_region = 0;
+    tcg_ctx.code_gen_ptr = ctx->regions[0].start;
+}
+
+/* Size of the code generated in region 'r' */
+static size_t tb_region_code_size(TBRegion *r)
+{
+    if (r == &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region]) {
+        return tcg_ctx.code_gen_ptr - r->start;
+    }
+    return r->code_end - r->start;
+}
+
 static inline void code_gen_alloc(size_t tb_size)
 {
     tcg_ctx.code_gen_buffer_size = size_code_gen_buffer(tb_size);
@@ -586,6 +658,10 @@ static inline void code_gen_alloc(size_t tb_size)
             CODE_GEN_AVG_BLOCK_SIZE;
     tcg_ctx.tb_ctx.tbs =
             g_malloc(tcg_ctx.code_gen_max_blocks * sizeof(TranslationBlock));
+    tb_regions_init();
+    tcg_ctx.tb_ctx.tb_phys_hash_bits = CODE_GEN_PHYS_HASH_BITS;
+    tcg_ctx.tb_ctx.tb_phys_hash =
+            g_new0(TranslationBlock *, 1 << CODE_GEN_PHYS_HASH_BITS);
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -610,31 +686,39 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Allocate a new translation block in the current region.  Return NULL
+   if the region has too many translation blocks or too much generated
+   code; tb_gen_code() then moves on to the next region. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBRegion *r = &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region];
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks ||
-        (tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer) >=
-         tcg_ctx.code_gen_buffer_max_size) {
+    if (r->nb_tbs >= tcg_ctx.tb_ctx.tbs_per_region ||
+        (tcg_ctx.code_gen_ptr - r->start) >=
+         (r->end - r->start) - TCG_MAX_OP_SIZE * OPC_BUF_SIZE) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &tcg_ctx.tb_ctx.tbs[r->first_tb + r->nb_tbs++];
+    tcg_ctx.tb_ctx.nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    tb->invalid = false;
+    tb->exec_count = 0;
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    TBRegion *r = &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region];
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    if (r->nb_tbs > 0 && tb == &tcg_ctx.tb_ctx.tbs[r->first_tb +
+                                                   r->nb_tbs - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
+        r->nb_tbs--;
         tcg_ctx.tb_ctx.nb_tbs--;
     }
 }
@@ -681,11 +765,47 @@ static void page_flush_tb(void)
     }
 }
 
+static TBProfile *tb_profile_get(target_ulong pc)
+{
+    uint64_t key = pc;
+    TBProfile *p;
+
+    if (!tb_profile_stats) {
+        tb_profile_stats = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                                 NULL, g_free);
+    }
+    p = g_hash_table_lookup(tb_profile_stats, &key);
+    if (!p) {
+        p = g_new0(TBProfile, 1);
+        p->pc = pc;
+        g_hash_table_insert(tb_profile_stats, &p->pc, p);
+    }
+    return p;
+}
+
+/* Keep the execution count of TB, which is going away */
+static void tb_profile_retire(TranslationBlock *tb, bool invalidated)
+{
+    TBProfile *p;
+
+    if (!tb->exec_count && !(invalidated && tb_profile_enabled)) {
+        return;
+    }
+    p = tb_profile_get(tb->pc);
+    p->exec_count += tb->exec_count;
+    p->insns += tb->exec_count * tb->icount;
+    tb->exec_count = 0;
+    if (invalidated) {
+        p->invalidations++;
+    }
+}
+
 /* flush all the translation blocks */
 /* XXX: tb_flush is currently not thread safe */
 void tb_flush(CPUArchState *env1)
 {
     CPUState *cpu;
+    int i, j;
 
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
@@ -698,7 +818,15 @@ void tb_flush(CPUArchState *env1)
         > tcg_ctx.code_gen_buffer_size) {
         cpu_abort(env1, "Internal error: code buffer overflow\n");
     }
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_regions; i++) {
+        TBRegion *r = &tcg_ctx.tb_ctx.regions[i];
+
+        for (j = 0; j < r->nb_tbs; j++) {
+            tb_profile_retire(&tcg_ctx.tb_ctx.tbs[r->first_tb + j], false);
+        }
+    }
     tcg_ctx.tb_ctx.nb_tbs = 0;
+    tb_regions_reset();
 
     CPU_FOREACH(cpu) {
         CPUArchState *env = cpu->env_ptr;
@@ -706,11 +834,13 @@ void tb_flush(CPUArchState *env1)
         memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof(void *));
     }
 
+    /* keep the size of the hash table, the guest is likely to need as
+       many TBs again */
     memset(tcg_ctx.tb_ctx.tb_phys_hash, 0,
-            CODE_GEN_PHYS_HASH_SIZE * sizeof(void *));
+           (1 << tcg_ctx.tb_ctx.tb_phys_hash_bits) * sizeof(void *));
+    tcg_ctx.tb_ctx.nb_hashed_tbs = 0;
     page_flush_tb();
 
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tcg_ctx.tb_ctx.tb_flush_count++;
@@ -724,8 +854,9 @@ static void tb_invalidate_check(target_ulong address)
     int i;
 
     address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_ctx.tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
+    for (i = 0; i < (1 << tcg_ctx.tb_ctx.tb_phys_hash_bits); i++) {
+        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
+                tb = tb->phys_hash_next) {
             if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
                   address >= tb->pc + tb->size)) {
                 printf("ERROR invalidate: address=" TARGET_FMT_lx
@@ -742,7 +873,7 @@ static void tb_page_check(void)
     TranslationBlock *tb;
     int i, flags1, flags2;
 
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
+    for (i = 0; i < (1 << tcg_ctx.tb_ctx.tb_phys_hash_bits); i++) {
         for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
                 tb = tb->phys_hash_next) {
             flags1 = page_get_flags(tb->pc);
@@ -835,8 +966,10 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
+    h = tb_phys_hash_func(phys_pc, tb->cs_base, tb->flags,
+                          tcg_ctx.tb_ctx.tb_phys_hash_bits);
     tb_hash_remove(&tcg_ctx.tb_ctx.tb_phys_hash[h], tb);
+    tcg_ctx.tb_ctx.nb_hashed_tbs--;
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -880,10 +1013,44 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
         tb1 = tb2;
     }
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
+    tb->invalid = true;
+    tb_profile_retire(tb, true);
 
     tcg_ctx.tb_ctx.tb_phys_invalidate_count++;
 }
 
+/* Make room for new code by reusing the oldest region.  Only the TBs in
+   it are invalidated: tb_phys_invalidate() takes them out of the hash
+   table, the page lists and the jump caches, and resets the jumps that
+   TBs in the other regions have chained to them. */
+static void tb_evict_region(CPUArchState *env)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r;
+    int i;
+
+    if (ctx->nb_regions == 1) {
+        tb_flush(env);
+        return;
+    }
+
+    ctx->regions[ctx->cur_region].code_end = tcg_ctx.code_gen_ptr;
+    ctx->cur_region = (ctx->cur_region + 1) % ctx->nb_regions;
+    r = &ctx->regions[ctx->cur_region];
+    for (i = 0; i < r->nb_tbs; i++) {
+        TranslationBlock *tb = &ctx->tbs[r->first_tb + i];
+
+        if (!tb->invalid) {
+            tb_phys_invalidate(tb, -1);
+        }
+    }
+    ctx->nb_tbs -= r->nb_tbs;
+    r->nb_tbs = 0;
+    r->code_end = r->start;
+    tcg_ctx.code_gen_ptr = r->start;
+    ctx->tb_region_evict_count++;
+}
+
 static inline void set_bits(uint8_t *tab, int start, int len)
 {
     int end, mask, end1;
@@ -940,6 +1107,39 @@ static void build_page_bitmap(PageDesc *p)
     }
 }
 
+/* Tell host profilers about the code generated for each TB.  perf reads
+ * /tmp/perf-<pid>.map when it finds samples in anonymous executable memory:
+ * one line per symbol, with the start and size in hex followed by a name.
+ * The file is line buffered so that it is complete even if QEMU does not
+ * exit cleanly.
+ */
+void tcg_perf_map_init(void)
+{
+    char *path = g_strdup_printf("/tmp/perf-%d.map", getpid());
+
+    tb_perf_map = fopen(path, "w");
+    if (tb_perf_map) {
+        setvbuf(tb_perf_map, NULL, _IOLBF, 0);
+    } else {
+        fprintf(stderr, "qemu: could not open %s: %s\n", path,
+                strerror(errno));
+    }
+    g_free(path);
+}
+
+/* Name the code after the guest PC and, if it is known, its symbol.
+ * Code buffer space is reused after a flush or eviction; later entries
+ * for the same host address then describe the new code.
+ */
+static void tb_perf_map_add(TranslationBlock *tb, int code_size)
+{
+    const char *symbol = lookup_symbol(tb->pc);
+
+    fprintf(tb_perf_map, "%" PRIxPTR " %x tb-0x" TARGET_FMT_lx "%s%s\n",
+            (uintptr_t)tb->tc_ptr, code_size, (target_ulong)tb->pc,
+            symbol[0] ? " " : "", symbol);
+}
+
 TranslationBlock *tb_gen_code(CPUArchState *env,
                               target_ulong pc, target_ulong cs_base,
                               int flags, int cflags)
@@ -953,8 +1153,8 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+        /* the current region is full, evict the oldest one */
+        tb_evict_region(env);
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
@@ -966,6 +1166,12 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     tb->flags = flags;
     tb->cflags = cflags;
     cpu_gen_code(env, tb, &code_gen_size);
+    if (tb_profile_enabled) {
+        tb_profile_get(pc)->translations++;
+    }
+    if (tb_perf_map) {
+        tb_perf_map_add(tb, code_gen_size);
+    }
     tcg_ctx.code_gen_ptr = (void *)(((uintptr_t)tcg_ctx.code_gen_ptr +
             code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
@@ -1279,6 +1485,39 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 #endif /* TARGET_HAS_SMC */
 }
 
+/* Double the number of buckets of tb_phys_hash once it holds more TBs
+   than buckets, so that chains stay short however much guest code is
+   translated.  */
+static void tb_phys_hash_grow(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    unsigned int old_size = 1 << ctx->tb_phys_hash_bits;
+    unsigned int bits = ctx->tb_phys_hash_bits + 1;
+    TranslationBlock **hash, *tb, *next;
+    unsigned int i, h;
+
+    if (ctx->nb_hashed_tbs <= old_size) {
+        return;
+    }
+
+    hash = g_new0(TranslationBlock *, 1 << bits);
+    for (i = 0; i < old_size; i++) {
+        for (tb = ctx->tb_phys_hash[i]; tb != NULL; tb = next) {
+            next = tb->phys_hash_next;
+            h = tb_phys_hash_func(tb->page_addr[0] +
+                                  (tb->pc & ~TARGET_PAGE_MASK),
+                                  tb->cs_base, tb->flags, bits);
+            tb->phys_hash_next = hash[h];
+            hash[h] = tb;
+        }
+    }
+
+    g_free(ctx->tb_phys_hash);
+    ctx->tb_phys_hash = hash;
+    ctx->tb_phys_hash_bits = bits;
+    ctx->tb_phys_hash_resize_count++;
+}
+
 /* add a new TB and link it to the physical page tables. phys_page2 is
    (-1) to indicate that only one page contains the TB. */
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
@@ -1291,10 +1530,13 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
        before we are done.  */
     mmap_lock();
     /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
+    h = tb_phys_hash_func(phys_pc, tb->cs_base, tb->flags,
+                          tcg_ctx.tb_ctx.tb_phys_hash_bits);
     ptb = &tcg_ctx.tb_ctx.tb_phys_hash[h];
     tb->phys_hash_next = *ptb;
     *ptb = tb;
+    tcg_ctx.tb_ctx.nb_hashed_tbs++;
+    tb_phys_hash_grow();
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1328,21 +1570,33 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
     int m_min, m_max, m;
     uintptr_t v;
-    TranslationBlock *tb;
+    TranslationBlock *tb, *tbs;
+    TBRegion *r;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer) {
+        return NULL;
+    }
+    /* TBs are sorted by tc_ptr only within a region */
+    m = 0;
+    while (m < tcg_ctx.tb_ctx.nb_regions &&
+           tc_ptr >= (uintptr_t)tcg_ctx.tb_ctx.regions[m].end) {
+        m++;
+    }
+    if (m == tcg_ctx.tb_ctx.nb_regions) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    r = &tcg_ctx.tb_ctx.regions[m];
+    if (r->nb_tbs <= 0 || tc_ptr >= (uintptr_t)r->start +
+                                    tb_region_code_size(r)) {
         return NULL;
     }
+    tbs = &tcg_ctx.tb_ctx.tbs[r->first_tb];
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1352,7 +1606,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return &tbs[m_max];
 }
 
 #if defined(TARGET_HAS_ICE) && !defined(CONFIG_USER_ONLY)
@@ -1495,49 +1749,54 @@ void tb_flush_jmp_cache(CPUArchState *env, target_ulong addr)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    int hash_size, hash_used, chain, max_chain;
+    size_t code_size;
     TranslationBlock *tb;
+    TBRegion *r;
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    code_size = 0;
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_regions; i++) {
+        r = &tcg_ctx.tb_ctx.regions[i];
+        code_size += tb_region_code_size(r);
+        for (j = 0; j < r->nb_tbs; j++) {
+            tb = &tcg_ctx.tb_ctx.tbs[r->first_tb + j];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %zd/%zd\n",
+                code_size, tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "TB regions          %d (current %d)\n",
+                tcg_ctx.tb_ctx.nb_regions, tcg_ctx.tb_ctx.cur_region);
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
             tcg_ctx.tb_ctx.nb_tbs ? target_code_size /
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %zd bytes (expansion ratio: %0.1f)\n",
+            tcg_ctx.tb_ctx.nb_tbs ? code_size / tcg_ctx.tb_ctx.nb_tbs : 0,
+            target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -1548,14 +1807,128 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 direct_jmp2_count,
                 tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp2_count * 100) /
                         tcg_ctx.tb_ctx.nb_tbs : 0);
+
+    hash_size = 1 << tcg_ctx.tb_ctx.tb_phys_hash_bits;
+    hash_used = 0;
+    max_chain = 0;
+    for (i = 0; i < hash_size; i++) {
+        chain = 0;
+        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
+                tb = tb->phys_hash_next) {
+            chain++;
+        }
+        if (chain) {
+            hash_used++;
+        }
+        max_chain = MAX(max_chain, chain);
+    }
+    cpu_fprintf(f, "TB hash buckets     %d/%d (%d%% used)\n",
+                hash_used, hash_size, (hash_used * 100) / hash_size);
+    cpu_fprintf(f, "TB hash chain len   avg %0.2f max %d\n",
+                hash_used ? (double)tcg_ctx.tb_ctx.nb_hashed_tbs / hash_used
+                          : 0, max_chain);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
+    cpu_fprintf(f, "TB hash resize count %d\n",
+            tcg_ctx.tb_ctx.tb_phys_hash_resize_count);
+    cpu_fprintf(f, "TB region evictions %d\n",
+            tcg_ctx.tb_ctx.tb_region_evict_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "TLB miss count      %" PRIu64 "\n", tlb_miss_count);
+    cpu_fprintf(f, "victim TLB hits     %" PRIu64 " (%" PRIu64 "%%)\n",
+                tlb_victim_hit_count,
+                tlb_miss_count ? (tlb_victim_hit_count * 100) /
+                                 tlb_miss_count : 0);
     tcg_dump_info(f, cpu_fprintf);
 }
 
+static gint tb_profile_cmp(gconstpointer a, gconstpointer b)
+{
+    const TBProfile *pa = *(TBProfile **)a;
+    const TBProfile *pb = *(TBProfile **)b;
+    uint64_t ca = pa->exec_count + pa->live_count;
+    uint64_t cb = pb->exec_count + pb->live_count;
+
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+/* Print the COUNT guest PCs whose TBs were executed most often */
+void dump_tb_hot(FILE *f, fprintf_function cpu_fprintf, int count)
+{
+    GHashTableIter iter;
+    GPtrArray *sorted;
+    TBProfile *p;
+    TBRegion *r;
+    TranslationBlock *tb;
+    int i, j;
+
+    if (!tb_profile_enabled && !tb_profile_stats) {
+        cpu_fprintf(f, "TB profiling is off, enable it with "
+                    "\"tb-profile on\"\n");
+        return;
+    }
+
+    if (tb_profile_stats) {
+        g_hash_table_iter_init(&iter, tb_profile_stats);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&p)) {
+            p->live_count = 0;
+            p->live_insns = 0;
+        }
+    }
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_regions; i++) {
+        r = &tcg_ctx.tb_ctx.regions[i];
+        for (j = 0; j < r->nb_tbs; j++) {
+            tb = &tcg_ctx.tb_ctx.tbs[r->first_tb + j];
+            if (tb->exec_count) {
+                p = tb_profile_get(tb->pc);
+                p->live_count += tb->exec_count;
+                p->live_insns += tb->exec_count * tb->icount;
+            }
+        }
+    }
+    if (!tb_profile_stats) {
+        return;
+    }
+
+    sorted = g_ptr_array_new();
+    g_hash_table_iter_init(&iter, tb_profile_stats);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&p)) {
+        g_ptr_array_add(sorted, p);
+    }
+    g_ptr_array_sort(sorted, tb_profile_cmp);
+
+    cpu_fprintf(f, "%-18s %14s %14s %6s %6s  %s\n", "pc", "executions",
+                "guest insns", "trans", "inval", "symbol");
+    for (i = 0; i < count && i < sorted->len; i++) {
+        p = g_ptr_array_index(sorted, i);
+        cpu_fprintf(f, "0x" TARGET_FMT_lx " %14" PRIu64 " %14" PRIu64
+                    " %6u %6u  %s\n", (target_ulong)p->pc,
+                    p->exec_count + p->live_count, p->insns + p->live_insns,
+                    p->translations, p->invalidations,
+                    lookup_symbol(p->pc));
+    }
+    g_ptr_array_free(sorted, TRUE);
+}
+
+/* Forget the statistics of "info tb-hot" */
+void tb_profile_reset(void)
+{
+    TBRegion *r;
+    int i, j;
+
+    if (tb_profile_stats) {
+        g_hash_table_remove_all(tb_profile_stats);
+    }
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_regions; i++) {
+        r = &tcg_ctx.tb_ctx.regions[i];
+        for (j = 0; j < r->nb_tbs; j++) {
+            tcg_ctx.tb_ctx.tbs[r->first_tb + j].exec_count = 0;
+        }
+    }
+}
+
 #else /* CONFIG_USER_ONLY */
 
 void cpu_interrupt(CPUState *cpu, int mask)
@@ -1693,7 +2066,7 @@ int page_get_flags(target_ulong address)
    on PAGE_WRITE.  The mmap_lock should already be held.  */
 void page_set_flags(target_ulong start, target_ulong end, int flags)
 {
-    target_ulong addr, len;
+    target_ulong addr, len, n, i;
 
     /* This function should never be called with addresses outside the
        guest address space.  If this assert fires, it probably indicates
@@ -1710,19 +2083,31 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
         flags |= PAGE_WRITE_ORG;
     }
 
-    for (addr = start, len = end - start;
-         len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        PageDesc *p = page_find_alloc(addr >> TARGET_PAGE_BITS, 1);
-
-        /* If the write protection bit is set, then we invalidate
-           the code inside.  */
-        if (!(p->flags & PAGE_WRITE) &&
-            (flags & PAGE_WRITE) &&
-            p->first_tb) {
-            tb_invalidate_phys_page(addr, 0, NULL, false);
+    /* Work on one leaf of l1_map at a time.  Leaves that were never
+       allocated already have no flags and no TBs, so there is nothing
+       to do there when unmapping; this keeps munmap of large
+       reservations short, since it runs with mmap_lock held.  */
+    for (addr = start, len = end - start; len != 0;
+         len -= n << TARGET_PAGE_BITS, addr += n << TARGET_PAGE_BITS) {
+        tb_page_addr_t index = addr >> TARGET_PAGE_BITS;
+        PageDesc *p = page_find_alloc(index, flags != 0);
+
+        n = V_L2_SIZE - (index & (V_L2_SIZE - 1));
+        n = MIN(n, len >> TARGET_PAGE_BITS);
+        if (!p) {
+            continue;
+        }
+        for (i = 0; i < n; i++, p++) {
+            /* If the write protection bit is set, then we invalidate
+               the code inside.  */
+            if (!(p->flags & PAGE_WRITE) &&
+                (flags & PAGE_WRITE) &&
+                p->first_tb) {
+                tb_invalidate_phys_page(addr + (i << TARGET_PAGE_BITS), 0,
+                                        NULL, false);
+            }
+            p->flags = flags;
         }
-        p->flags = flags;
     }
 }
 
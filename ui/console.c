@@ -27,8 +27,13 @@
 #include "qemu/timer.h"
 #include "qmp-commands.h"
 #include "sysemu/char.h"
+#include "monitor/monitor.h"
 #include "trace.h"
 
+#ifdef CONFIG_POSIX
+#include <sys/mman.h>
+#endif
+
 #define DEFAULT_BACKSCROLL 512
 #define MAX_CONSOLES 12
 #define CONSOLE_CURSOR_PERIOD 500
@@ -127,6 +132,13 @@ struct QemuConsole {
     const GraphicHwOps *hw_ops;
     void *hw;
 
+    /* Cost of the gfx_update callbacks, see "info display" */
+    bool damaged;
+    uint64_t refresh_count;
+    uint64_t refresh_damaged;
+    uint64_t refresh_ns;
+    uint64_t refresh_max_ns;
+
     /* Text console state */
     int width;
     int height;
@@ -251,7 +263,44 @@ void graphic_hw_update(QemuConsole *con)
         con = active_console;
     }
     if (con && con->hw_ops->gfx_update) {
+        int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        uint64_t elapsed;
+
+        con->damaged = false;
         con->hw_ops->gfx_update(con->hw);
+
+        elapsed = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+        con->refresh_count++;
+        con->refresh_damaged += con->damaged;
+        con->refresh_ns += elapsed;
+        con->refresh_max_ns = MAX(con->refresh_max_ns, elapsed);
+    }
+}
+
+void console_info(Monitor *mon, const QDict *qdict)
+{
+    QemuConsole *con;
+    int i;
+
+    for (i = 0; i < nb_consoles; i++) {
+        con = consoles[i];
+        if (!con->hw_ops || !con->hw_ops->gfx_update) {
+            continue;
+        }
+        monitor_printf(mon, "console %d%s: %" PRIu64 " refreshes, %" PRIu64
+                       " with changes", con->index,
+                       con == active_console ? " (active)" : "",
+                       con->refresh_count, con->refresh_damaged);
+        if (con->refresh_count) {
+            monitor_printf(mon, ", avg %" PRIu64 " us, max %" PRIu64 " us",
+                           con->refresh_ns / con->refresh_count / 1000,
+                           con->refresh_max_ns / 1000);
+        }
+        monitor_printf(mon, "\n");
+    }
+    if (display_state) {
+        monitor_printf(mon, "refresh interval: %" PRIu64 " ms\n",
+                       display_state->update_interval);
     }
 }
 
@@ -1204,19 +1253,84 @@ static QemuConsole *new_console(DisplayState *ds, console_type_t console_type)
     return s;
 }
 
+#ifdef CONFIG_POSIX
+static bool surface_use_shm;
+
+/*
+ * Allocate @size bytes of anonymous shared memory, returning the mapping
+ * and storing in *@fd a descriptor that can be passed to another process.
+ */
+void *qemu_display_shm_alloc(size_t size, int *fd)
+{
+    static unsigned int counter;
+    char name[64];
+    void *data;
+
+    snprintf(name, sizeof(name), "/qemu-display-%d-%u",
+             (int)getpid(), counter++);
+    *fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (*fd < 0) {
+        return NULL;
+    }
+    shm_unlink(name);
+    qemu_set_cloexec(*fd);
+
+    if (ftruncate(*fd, size) < 0) {
+        goto fail;
+    }
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (data == MAP_FAILED) {
+        goto fail;
+    }
+    return data;
+
+fail:
+    close(*fd);
+    *fd = -1;
+    return NULL;
+}
+
+void qemu_display_shm_free(void *data, size_t size, int fd)
+{
+    munmap(data, size);
+    close(fd);
+}
+
+/*
+ * Allocate the pixels of non-shared surfaces in shared memory from now
+ * on, so that they can be handed to another process without copying.
+ */
+void qemu_displaysurface_use_shm(void)
+{
+    surface_use_shm = true;
+}
+#endif
+
 static void qemu_alloc_display(DisplaySurface *surface, int width, int height,
                                int linesize, PixelFormat pf, int newflags)
 {
+    void *data = NULL;
+
     surface->pf = pf;
 
     qemu_pixman_image_unref(surface->image);
     surface->image = NULL;
 
+#ifdef CONFIG_POSIX
+    if (surface_use_shm) {
+        surface->shm_size = (size_t)linesize * height;
+        data = qemu_display_shm_alloc(surface->shm_size, &surface->shm_fd);
+        if (data) {
+            newflags |= QEMU_SHM_FLAG;
+        }
+    }
+#endif
+
     surface->format = qemu_pixman_get_format(&pf);
     assert(surface->format != 0);
     surface->image = pixman_image_create_bits(surface->format,
                                               width, height,
-                                              NULL, linesize);
+                                              data, linesize);
     assert(surface->image != NULL);
 
     surface->flags = newflags | QEMU_ALLOCATED_FLAG;
@@ -1291,6 +1405,12 @@ void qemu_free_displaysurface(DisplaySurface *surface)
         return;
     }
     trace_displaysurface_free(surface);
+#ifdef CONFIG_POSIX
+    if (surface->flags & QEMU_SHM_FLAG) {
+        qemu_display_shm_free(surface_data(surface), surface->shm_size,
+                              surface->shm_fd);
+    }
+#endif
     qemu_pixman_image_unref(surface->image);
     g_free(surface);
 }
@@ -1351,6 +1471,7 @@ void dpy_gfx_update(QemuConsole *con, int x, int y, int w, int h)
     int width = surface_width(con->surface);
     int height = surface_height(con->surface);
 
+    con->damaged = true;
     x = MAX(x, 0);
     y = MAX(y, 0);
     x = MIN(x, width);
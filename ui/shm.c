@@ -0,0 +1,321 @@
+/*
+ * Shared memory display
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Exports the console surface to local processes through a shared memory
+ * segment.  Clients connect to a UNIX socket, receive the segment as a
+ * file descriptor, and are then told which rectangles changed.  The wire
+ * format is described in docs/shm-display.txt.
+ */
+
+#include <sys/socket.h>
+#include <sys/mman.h>
+
+#include "qemu-common.h"
+#include "ui/console.h"
+#include "qemu/sockets.h"
+#include "qemu/queue.h"
+#include "qemu/main-loop.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "trace.h"
+
+enum {
+    SHM_DISPLAY_SURFACE = 1,    /* server -> client, carries the fd */
+    SHM_DISPLAY_UPDATE  = 2,    /* server -> client */
+    SHM_DISPLAY_ACK     = 3,    /* client -> server */
+};
+
+typedef struct ShmDisplayMsg {
+    uint32_t type;
+    uint32_t format;            /* pixman format code */
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t padding;
+    uint64_t size;              /* size of the segment */
+} ShmDisplayMsg;
+
+typedef struct ShmDisplayClient {
+    int fd;
+    /* An update was sent and not acknowledged yet */
+    bool busy;
+    /* Damage accumulated since the last update, as a bounding box */
+    bool dirty;
+    int x1, y1, x2, y2;
+    QTAILQ_ENTRY(ShmDisplayClient) next;
+} ShmDisplayClient;
+
+typedef struct ShmDisplay {
+    DisplayChangeListener dcl;
+    int lsock;
+    DisplaySurface *ds;
+    /* Copy of surfaces that live in guest memory */
+    void *shadow;
+    int shadow_fd;
+    size_t shadow_size;
+    QTAILQ_HEAD(, ShmDisplayClient) clients;
+} ShmDisplay;
+
+static ShmDisplay shm_display;
+
+static int shm_client_send(ShmDisplayClient *client, ShmDisplayMsg *msg,
+                           int fd)
+{
+    struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    if (fd >= 0) {
+        memset(control, 0, sizeof(control));
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    do {
+        ret = sendmsg(client->fd, &mh, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    /* Messages are tiny and updates wait for an acknowledgement, so a
+     * client that lets its socket buffer fill up is not reading at all.
+     */
+    return ret == sizeof(*msg) ? 0 : -1;
+}
+
+static void shm_client_damage(ShmDisplayClient *client,
+                              int x, int y, int w, int h)
+{
+    if (!client->dirty) {
+        client->x1 = x;
+        client->y1 = y;
+        client->x2 = x + w;
+        client->y2 = y + h;
+        client->dirty = true;
+        return;
+    }
+    client->x1 = MIN(client->x1, x);
+    client->y1 = MIN(client->y1, y);
+    client->x2 = MAX(client->x2, x + w);
+    client->y2 = MAX(client->y2, y + h);
+}
+
+static void shm_client_disconnect(ShmDisplayClient *client)
+{
+    trace_shm_display_client_disconnect(client->fd);
+    qemu_set_fd_handler(client->fd, NULL, NULL, NULL);
+    close(client->fd);
+    QTAILQ_REMOVE(&shm_display.clients, client, next);
+    g_free(client);
+}
+
+static int shm_client_send_surface(ShmDisplayClient *client)
+{
+    DisplaySurface *ds = shm_display.ds;
+    ShmDisplayMsg msg = { .type = SHM_DISPLAY_SURFACE };
+    int fd;
+
+    if (!ds) {
+        return 0;
+    }
+    msg.width = surface_width(ds);
+    msg.height = surface_height(ds);
+    if (shm_display.shadow) {
+        fd = shm_display.shadow_fd;
+        msg.format = PIXMAN_x8r8g8b8;
+        msg.stride = surface_width(ds) * 4;
+        msg.size = shm_display.shadow_size;
+    } else {
+        fd = ds->shm_fd;
+        msg.format = ds->format;
+        msg.stride = surface_stride(ds);
+        msg.size = ds->shm_size;
+    }
+    if (shm_client_send(client, &msg, fd) < 0) {
+        return -1;
+    }
+
+    /* A new segment is shown from scratch, outstanding updates are moot */
+    client->busy = false;
+    client->dirty = false;
+    shm_client_damage(client, 0, 0, msg.width, msg.height);
+    return 0;
+}
+
+static void shm_client_read(void *opaque)
+{
+    ShmDisplayClient *client = opaque;
+    ShmDisplayMsg msg;
+    ssize_t ret;
+
+    do {
+        ret = recv(client->fd, &msg, sizeof(msg), 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0 && errno == EAGAIN) {
+        return;
+    }
+    if (ret != sizeof(msg)) {
+        shm_client_disconnect(client);
+        return;
+    }
+    if (msg.type == SHM_DISPLAY_ACK) {
+        client->busy = false;
+    }
+}
+
+static void shm_display_accept(void *opaque)
+{
+    ShmDisplayClient *client;
+    int fd;
+
+    fd = qemu_accept(shm_display.lsock, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    qemu_set_nonblock(fd);
+
+    client = g_new0(ShmDisplayClient, 1);
+    client->fd = fd;
+    QTAILQ_INSERT_TAIL(&shm_display.clients, client, next);
+    qemu_set_fd_handler(fd, shm_client_read, NULL, client);
+    trace_shm_display_client_connect(fd);
+
+    if (shm_client_send_surface(client) < 0) {
+        shm_client_disconnect(client);
+    }
+}
+
+static void shm_copy_shadow(int x, int y, int w, int h)
+{
+    DisplaySurface *ds = shm_display.ds;
+    pixman_image_t *dst;
+
+    dst = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+                                   surface_width(ds), surface_height(ds),
+                                   shm_display.shadow, surface_width(ds) * 4);
+    pixman_image_composite(PIXMAN_OP_SRC, ds->image, NULL, dst,
+                           x, y, 0, 0, x, y, w, h);
+    pixman_image_unref(dst);
+}
+
+static void shm_free_shadow(void)
+{
+    if (shm_display.shadow) {
+        qemu_display_shm_free(shm_display.shadow, shm_display.shadow_size,
+                              shm_display.shadow_fd);
+        shm_display.shadow = NULL;
+    }
+}
+
+static void shm_update(DisplayChangeListener *dcl,
+                       int x, int y, int w, int h)
+{
+    ShmDisplayClient *client;
+
+    if (shm_display.shadow) {
+        shm_copy_shadow(x, y, w, h);
+    }
+    QTAILQ_FOREACH(client, &shm_display.clients, next) {
+        shm_client_damage(client, x, y, w, h);
+    }
+}
+
+static void shm_switch(DisplayChangeListener *dcl,
+                       DisplaySurface *new_surface)
+{
+    ShmDisplayClient *client, *next;
+
+    shm_free_shadow();
+    shm_display.ds = new_surface;
+
+    /* Surfaces that point into guest memory, and surfaces created before
+     * the backend was up, are not in shared memory; keep a copy for them.
+     * The shadow always uses the x8r8g8b8 layout.
+     */
+    if (!(new_surface->flags & QEMU_SHM_FLAG)) {
+        shm_display.shadow_size = (size_t)surface_width(new_surface) * 4 *
+                                  surface_height(new_surface);
+        shm_display.shadow = qemu_display_shm_alloc(shm_display.shadow_size,
+                                                    &shm_display.shadow_fd);
+        if (!shm_display.shadow) {
+            error_report("shm display: cannot allocate %zu bytes",
+                         shm_display.shadow_size);
+            shm_display.ds = NULL;
+            return;
+        }
+        shm_copy_shadow(0, 0, surface_width(new_surface),
+                        surface_height(new_surface));
+    }
+    trace_shm_display_switch(surface_width(new_surface),
+                             surface_height(new_surface),
+                             shm_display.shadow != NULL);
+
+    QTAILQ_FOREACH_SAFE(client, &shm_display.clients, next, next) {
+        if (shm_client_send_surface(client) < 0) {
+            shm_client_disconnect(client);
+        }
+    }
+}
+
+static void shm_refresh(DisplayChangeListener *dcl)
+{
+    ShmDisplayClient *client, *next;
+    ShmDisplayMsg msg = { .type = SHM_DISPLAY_UPDATE };
+
+    graphic_hw_update(dcl->con);
+
+    /* At most one update per client and refresh, and none until the
+     * client has acknowledged the previous one; damage keeps accumulating
+     * in the meantime.
+     */
+    QTAILQ_FOREACH_SAFE(client, &shm_display.clients, next, next) {
+        if (!client->dirty || client->busy) {
+            continue;
+        }
+        msg.x = client->x1;
+        msg.y = client->y1;
+        msg.width = client->x2 - client->x1;
+        msg.height = client->y2 - client->y1;
+        if (shm_client_send(client, &msg, -1) < 0) {
+            shm_client_disconnect(client);
+            continue;
+        }
+        client->dirty = false;
+        client->busy = true;
+    }
+}
+
+static const DisplayChangeListenerOps shm_ops = {
+    .dpy_name          = "shm",
+    .dpy_gfx_update    = shm_update,
+    .dpy_gfx_switch    = shm_switch,
+    .dpy_refresh       = shm_refresh,
+};
+
+void shm_display_init(DisplayState *ds, const char *path, Error **errp)
+{
+    qemu_displaysurface_use_shm();
+
+    shm_display.lsock = unix_listen(path, NULL, 0, errp);
+    if (shm_display.lsock < 0) {
+        return;
+    }
+    QTAILQ_INIT(&shm_display.clients);
+    qemu_set_fd_handler(shm_display.lsock, shm_display_accept, NULL, NULL);
+
+    shm_display.dcl.ops = &shm_ops;
+    register_displaychangelistener(&shm_display.dcl);
+}
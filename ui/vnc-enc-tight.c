@@ -39,7 +39,9 @@
 #define PNG_SKIP_SETJMP_CHECK
 #include <png.h>
 #endif
-#ifdef CONFIG_VNC_JPEG
+#ifdef CONFIG_VNC_TURBOJPEG
+#include <turbojpeg.h>
+#elif defined(CONFIG_VNC_JPEG)
 #include <stdio.h>
 #include <jpeglib.h>
 #endif
@@ -1139,6 +1141,70 @@ static int send_palette_rect(VncState *vs, int x, int y,
  * JPEG compression stuff.
  */
 #ifdef CONFIG_VNC_JPEG
+/*
+ * The JPEG quality is lowered by one level each time the data still queued
+ * for the client doubles past TIGHT_JPEG_BACKLOG_STEP, so that a client on
+ * a slow link gets more frames instead of an ever longer queue.
+ */
+#define TIGHT_JPEG_BACKLOG_STEP (256 * 1024)
+
+static int tight_jpeg_quality(VncState *vs)
+{
+    size_t backlog = vs->output_backlog;
+    int level = vs->tight.quality;
+
+    while (level > 0 && backlog >= TIGHT_JPEG_BACKLOG_STEP) {
+        level--;
+        backlog /= 2;
+    }
+    return tight_conf[level].jpeg_quality;
+}
+
+#ifdef CONFIG_VNC_TURBOJPEG
+/*
+ * TurboJPEG reads the server surface directly, without converting each line
+ * to RGB first, and its compressor is set up once per client.
+ */
+static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
+{
+#ifdef HOST_WORDS_BIGENDIAN
+    int pixfmt = TJPF_XRGB;
+#else
+    int pixfmt = TJPF_BGRX;
+#endif
+    unsigned long size;
+    unsigned char *buf;
+
+    if (surface_bytes_per_pixel(vs->vd->ds) == 1) {
+        return send_full_color_rect(vs, x, y, w, h);
+    }
+
+    if (!vs->tight.tjhandle) {
+        vs->tight.tjhandle = tjInitCompress();
+        if (!vs->tight.tjhandle) {
+            return send_full_color_rect(vs, x, y, w, h);
+        }
+    }
+
+    size = tjBufSize(w, h, TJSAMP_420);
+    buffer_reserve(&vs->tight.jpeg, size);
+    buf = vs->tight.jpeg.buffer;
+    if (tjCompress2(vs->tight.tjhandle, vnc_server_fb_ptr(vs->vd, x, y), w,
+                    vnc_server_fb_stride(vs->vd), h, pixfmt, &buf, &size,
+                    TJSAMP_420, quality,
+                    TJFLAG_NOREALLOC | TJFLAG_FASTDCT) < 0) {
+        return send_full_color_rect(vs, x, y, w, h);
+    }
+
+    vnc_write_u8(vs, VNC_TIGHT_JPEG << 4);
+
+    tight_send_compact_size(vs, size);
+    vnc_write(vs, vs->tight.jpeg.buffer, size);
+    buffer_reset(&vs->tight.jpeg);
+
+    return 1;
+}
+#else
 /*
  * Destination manager implementation for JPEG library.
  */
@@ -1229,6 +1295,7 @@ static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
 
     return 1;
 }
+#endif /* CONFIG_VNC_TURBOJPEG */
 #endif /* CONFIG_VNC_JPEG */
 
 /*
@@ -1429,7 +1496,7 @@ static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
     if (colors == 0) {
         if (force || (tight_jpeg_conf[vs->tight.quality].jpeg_full &&
                       tight_detect_smooth_image(vs, w, h))) {
-            int quality = tight_conf[vs->tight.quality].jpeg_quality;
+            int quality = tight_jpeg_quality(vs);
 
             ret = send_jpeg_rect(vs, x, y, w, h, quality);
         } else {
@@ -1443,7 +1510,7 @@ static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
         if (force || (colors > 96 &&
                       tight_jpeg_conf[vs->tight.quality].jpeg_idx &&
                       tight_detect_smooth_image(vs, w, h))) {
-            int quality = tight_conf[vs->tight.quality].jpeg_quality;
+            int quality = tight_jpeg_quality(vs);
 
             ret = send_jpeg_rect(vs, x, y, w, h, quality);
         } else {
@@ -1690,6 +1757,12 @@ void vnc_tight_clear(VncState *vs)
 #ifdef CONFIG_VNC_JPEG
     buffer_free(&vs->tight.jpeg);
 #endif
+#ifdef CONFIG_VNC_TURBOJPEG
+    if (vs->tight.tjhandle) {
+        tjDestroy(vs->tight.tjhandle);
+        vs->tight.tjhandle = NULL;
+    }
+#endif
 #ifdef CONFIG_VNC_PNG
     buffer_free(&vs->tight.png);
 #endif
@@ -41,10 +41,12 @@
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  *                          if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is held
- * to avoid screen corruption (this does not block vnc_refresh() because it
- * uses trylock()) but the output lock is not held because the thread works on
- * its own output buffer.
+ * Each client has its own queue and worker thread, so that a slow client
+ * does not hold up the others.  While a worker is encoding, it is counted in
+ * VncDisplay::encoders to avoid screen corruption.  The workers only read the
+ * server surface, so they can all encode at the same time, while
+ * vnc_refresh() skips the surface update if any of them is busy.  The output
+ * lock is not held because the thread works on its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
  */
@@ -58,14 +60,6 @@ struct VncJobQueue {
     QTAILQ_HEAD(, VncJob) jobs;
 };
 
-typedef struct VncJobQueue VncJobQueue;
-
-/*
- * We use a single global queue, but most of the functions are
- * already reentrant, so we can easily add more than one encoding thread
- */
-static VncJobQueue *queue;
-
 static void vnc_lock_queue(VncJobQueue *queue)
 {
     qemu_mutex_lock(&queue->mutex);
@@ -81,9 +75,7 @@ VncJob *vnc_job_new(VncState *vs)
     VncJob *job = g_malloc0(sizeof(VncJob));
 
     job->vs = vs;
-    vnc_lock_queue(queue);
     QLIST_INIT(&job->rectangles);
-    vnc_unlock_queue(queue);
     return job;
 }
 
@@ -96,14 +88,15 @@ int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h)
     entry->rect.w = w;
     entry->rect.h = h;
 
-    vnc_lock_queue(queue);
+    /* The job is not visible to the worker until vnc_job_push() */
     QLIST_INSERT_HEAD(&job->rectangles, entry, next);
-    vnc_unlock_queue(queue);
     return 1;
 }
 
 void vnc_job_push(VncJob *job)
 {
+    VncJobQueue *queue = job->vs->jobs_queue;
+
     vnc_lock_queue(queue);
     if (queue->exit || QLIST_EMPTY(&job->rectangles)) {
         g_free(job);
@@ -114,48 +107,64 @@ void vnc_job_push(VncJob *job)
     vnc_unlock_queue(queue);
 }
 
-static bool vnc_has_job_locked(VncState *vs)
-{
-    VncJob *job;
-
-    QTAILQ_FOREACH(job, &queue->jobs, next) {
-        if (job->vs == vs || !vs) {
-            return true;
-        }
-    }
-    return false;
-}
-
 bool vnc_has_job(VncState *vs)
 {
+    VncJobQueue *queue = vs->jobs_queue;
     bool ret;
 
+    if (!queue) {
+        return false;
+    }
+
     vnc_lock_queue(queue);
-    ret = vnc_has_job_locked(vs);
+    ret = !QTAILQ_EMPTY(&queue->jobs);
     vnc_unlock_queue(queue);
     return ret;
 }
 
-void vnc_jobs_clear(VncState *vs)
+static void vnc_jobs_clear_locked(VncJobQueue *queue)
 {
     VncJob *job, *tmp;
+    VncRectEntry *entry, *next;
 
-    vnc_lock_queue(queue);
-    QTAILQ_FOREACH_SAFE(job, &queue->jobs, next, tmp) {
-        if (job->vs == vs || !vs) {
-            QTAILQ_REMOVE(&queue->jobs, job, next);
+    /* The first job may be in the hands of the worker */
+    job = QTAILQ_FIRST(&queue->jobs);
+    if (!job) {
+        return;
+    }
+    while ((tmp = QTAILQ_NEXT(job, next)) != NULL) {
+        QTAILQ_REMOVE(&queue->jobs, tmp, next);
+        QLIST_FOREACH_SAFE(entry, &tmp->rectangles, next, next) {
+            g_free(entry);
         }
+        g_free(tmp);
+    }
+}
+
+void vnc_jobs_clear(VncState *vs)
+{
+    VncJobQueue *queue = vs->jobs_queue;
+
+    if (!queue) {
+        return;
     }
+
+    vnc_lock_queue(queue);
+    vnc_jobs_clear_locked(queue);
     vnc_unlock_queue(queue);
 }
 
 void vnc_jobs_join(VncState *vs)
 {
-    vnc_lock_queue(queue);
-    while (vnc_has_job_locked(vs)) {
-        qemu_cond_wait(&queue->cond, &queue->mutex);
+    VncJobQueue *queue = vs->jobs_queue;
+
+    if (queue) {
+        vnc_lock_queue(queue);
+        while (!QTAILQ_EMPTY(&queue->jobs)) {
+            qemu_cond_wait(&queue->cond, &queue->mutex);
+        }
+        vnc_unlock_queue(queue);
     }
-    vnc_unlock_queue(queue);
     vnc_jobs_consume_buffer(vs);
 }
 
@@ -192,21 +201,45 @@ static void vnc_async_encoding_start(VncState *orig, VncState *local)
     local->zlib = orig->zlib;
     local->hextile = orig->hextile;
     local->zrle = orig->zrle;
-    local->output =  queue->buffer;
+    local->output =  orig->jobs_queue->buffer;
+    local->output_backlog = orig->output_backlog;
     local->csock = -1; /* Don't do any network work on this thread */
+    memset(local->encoder_stats, 0, sizeof(local->encoder_stats));
 
     buffer_reset(&local->output);
 }
 
 static void vnc_async_encoding_end(VncState *orig, VncState *local)
 {
+    int i;
+
     orig->tight = local->tight;
     orig->zlib = local->zlib;
     orig->hextile = local->hextile;
     orig->zrle = local->zrle;
     orig->lossy_rect = local->lossy_rect;
 
-    queue->buffer = local->output;
+    for (i = 0; i < VNC_STAT_ENC_MAX; i++) {
+        orig->encoder_stats[i].rects += local->encoder_stats[i].rects;
+        orig->encoder_stats[i].bytes += local->encoder_stats[i].bytes;
+        orig->encoder_stats[i].time_ns += local->encoder_stats[i].time_ns;
+    }
+
+    orig->jobs_queue->buffer = local->output;
+}
+
+static void vnc_encoding_begin(VncDisplay *vd)
+{
+    vnc_lock_display(vd);
+    vd->encoders++;
+    vnc_unlock_display(vd);
+}
+
+static void vnc_encoding_finish(VncDisplay *vd)
+{
+    vnc_lock_display(vd);
+    vd->encoders--;
+    vnc_unlock_display(vd);
 }
 
 static int vnc_worker_thread_loop(VncJobQueue *queue)
@@ -234,6 +267,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         vnc_unlock_output(job->vs);
         goto disconnected;
     }
+    job->vs->output_backlog = job->vs->output.offset;
     vnc_unlock_output(job->vs);
 
     /* Make a local copy of vs and switch output buffers */
@@ -246,12 +280,12 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     saved_offset = vs.output.offset;
     vnc_write_u16(&vs, 0);
 
-    vnc_lock_display(job->vs->vd);
+    vnc_encoding_begin(job->vs->vd);
     QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
         int n;
 
         if (job->vs->csock == -1) {
-            vnc_unlock_display(job->vs->vd);
+            vnc_encoding_finish(job->vs->vd);
             goto disconnected;
         }
 
@@ -263,7 +297,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         }
         g_free(entry);
     }
-    vnc_unlock_display(job->vs->vd);
+    vnc_encoding_finish(job->vs->vd);
 
     /* Put n_rectangles at the beginning of the message */
     vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
@@ -300,13 +334,12 @@ static VncJobQueue *vnc_queue_init(void)
     return queue;
 }
 
-static void vnc_queue_clear(VncJobQueue *q)
+static void vnc_queue_clear(VncJobQueue *queue)
 {
     qemu_cond_destroy(&queue->cond);
     qemu_mutex_destroy(&queue->mutex);
     buffer_free(&queue->buffer);
-    g_free(q);
-    queue = NULL; /* Unset global queue */
+    g_free(queue);
 }
 
 static void *vnc_worker_thread(void *arg)
@@ -320,32 +353,30 @@ static void *vnc_worker_thread(void *arg)
     return NULL;
 }
 
-static bool vnc_worker_thread_running(void)
-{
-    return queue; /* Check global queue */
-}
-
-void vnc_start_worker_thread(void)
+void vnc_start_worker_thread(VncState *vs)
 {
     VncJobQueue *q;
 
-    if (vnc_worker_thread_running())
+    if (vs->jobs_queue)
         return ;
 
     q = vnc_queue_init();
     qemu_thread_create(&q->thread, vnc_worker_thread, q, QEMU_THREAD_DETACHED);
-    queue = q; /* Set global queue */
+    vs->jobs_queue = q;
 }
 
-void vnc_stop_worker_thread(void)
+void vnc_stop_worker_thread(VncState *vs)
 {
-    if (!vnc_worker_thread_running())
+    VncJobQueue *queue = vs->jobs_queue;
+
+    if (!queue)
         return ;
 
-    /* Remove all jobs and wake up the thread */
+    /* Remove all jobs and wake up the thread, which frees the queue */
     vnc_lock_queue(queue);
     queue->exit = true;
+    vnc_jobs_clear_locked(queue);
     vnc_unlock_queue(queue);
-    vnc_jobs_clear(NULL);
     qemu_cond_broadcast(&queue->cond);
+    vs->jobs_queue = NULL;
 }
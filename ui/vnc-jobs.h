@@ -39,8 +39,8 @@ void vnc_jobs_clear(VncState *vs);
 void vnc_jobs_join(VncState *vs);
 
 void vnc_jobs_consume_buffer(VncState *vs);
-void vnc_start_worker_thread(void);
-void vnc_stop_worker_thread(void);
+void vnc_start_worker_thread(VncState *vs);
+void vnc_stop_worker_thread(VncState *vs);
 
 /* Locks */
 static inline int vnc_trylock_display(VncDisplay *vd)
@@ -299,7 +299,42 @@ static void vnc_qmp_event(VncState *vs, MonitorEvent event)
     qobject_decref(data);
 }
 
-static VncClientInfo *qmp_query_vnc_client(const VncState *client)
+static const char *const vnc_stat_encoding_names[VNC_STAT_ENC_MAX] = {
+    [VNC_STAT_ENC_RAW] = "raw",
+    [VNC_STAT_ENC_HEXTILE] = "hextile",
+    [VNC_STAT_ENC_ZLIB] = "zlib",
+    [VNC_STAT_ENC_TIGHT] = "tight",
+    [VNC_STAT_ENC_TIGHT_PNG] = "tight-png",
+    [VNC_STAT_ENC_ZRLE] = "zrle",
+    [VNC_STAT_ENC_ZYWRLE] = "zywrle",
+};
+
+static VncEncoderInfoList *qmp_query_vnc_encoders(VncState *client)
+{
+    VncEncoderInfoList *head = NULL, *entry;
+    VncEncoderStat *stat;
+    int i;
+
+    vnc_lock_output(client);
+    for (i = VNC_STAT_ENC_MAX - 1; i >= 0; i--) {
+        stat = &client->encoder_stats[i];
+        if (!stat->rects && !stat->bytes) {
+            continue;
+        }
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->encoding = g_strdup(vnc_stat_encoding_names[i]);
+        entry->value->rects = stat->rects;
+        entry->value->bytes = stat->bytes;
+        entry->value->time_ns = stat->time_ns;
+        entry->next = head;
+        head = entry;
+    }
+    vnc_unlock_output(client);
+    return head;
+}
+
+static VncClientInfo *qmp_query_vnc_client(VncState *client)
 {
     struct sockaddr_storage sa;
     socklen_t salen = sizeof(sa);
@@ -336,6 +371,9 @@ static VncClientInfo *qmp_query_vnc_client(const VncState *client)
     }
 #endif
 
+    info->encoders = qmp_query_vnc_encoders(client);
+    info->has_encoders = info->encoders != NULL;
+
     return info;
 }
 
@@ -691,33 +729,49 @@ int vnc_raw_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
 
 int vnc_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
 {
+    int64_t start = get_clock();
+    size_t offset = vs->output.offset;
+    VncEncoderStat *stat;
     int n = 0;
 
     switch(vs->vnc_encoding) {
         case VNC_ENCODING_ZLIB:
             n = vnc_zlib_send_framebuffer_update(vs, x, y, w, h);
+            stat = &vs->encoder_stats[VNC_STAT_ENC_ZLIB];
             break;
         case VNC_ENCODING_HEXTILE:
             vnc_framebuffer_update(vs, x, y, w, h, VNC_ENCODING_HEXTILE);
             n = vnc_hextile_send_framebuffer_update(vs, x, y, w, h);
+            stat = &vs->encoder_stats[VNC_STAT_ENC_HEXTILE];
             break;
         case VNC_ENCODING_TIGHT:
             n = vnc_tight_send_framebuffer_update(vs, x, y, w, h);
+            stat = &vs->encoder_stats[VNC_STAT_ENC_TIGHT];
             break;
         case VNC_ENCODING_TIGHT_PNG:
             n = vnc_tight_png_send_framebuffer_update(vs, x, y, w, h);
+            stat = &vs->encoder_stats[VNC_STAT_ENC_TIGHT_PNG];
             break;
         case VNC_ENCODING_ZRLE:
             n = vnc_zrle_send_framebuffer_update(vs, x, y, w, h);
+            stat = &vs->encoder_stats[VNC_STAT_ENC_ZRLE];
             break;
         case VNC_ENCODING_ZYWRLE:
             n = vnc_zywrle_send_framebuffer_update(vs, x, y, w, h);
+            stat = &vs->encoder_stats[VNC_STAT_ENC_ZYWRLE];
             break;
         default:
             vnc_framebuffer_update(vs, x, y, w, h, VNC_ENCODING_RAW);
             n = vnc_raw_send_framebuffer_update(vs, x, y, w, h);
+            stat = &vs->encoder_stats[VNC_STAT_ENC_RAW];
             break;
     }
+
+    if (n > 0) {
+        stat->rects += n;
+    }
+    stat->bytes += vs->output.offset - offset;
+    stat->time_ns += get_clock() - start;
     return n;
 }
 
@@ -1031,6 +1085,7 @@ void vnc_disconnect_finish(VncState *vs)
     int i;
 
     vnc_jobs_join(vs); /* Wait encoding jobs */
+    vnc_stop_worker_thread(vs);
 
     vnc_lock_output(vs);
     vnc_qmp_event(vs, QEVENT_VNC_DISCONNECTED);
@@ -2698,9 +2753,9 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     server_row = (uint8_t *)pixman_image_get_data(vd->server);
     for (y = 0; y < height; y++) {
         if (!bitmap_empty(vd->guest.dirty[y], VNC_DIRTY_BITS)) {
-            int x;
+            DECLARE_BITMAP(changed, VNC_DIRTY_BITS);
             uint8_t *guest_ptr;
-            uint8_t *server_ptr;
+            long n, x;
 
             if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
                 qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb, width, 0, y);
@@ -2708,21 +2763,26 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
             } else {
                 guest_ptr = guest_row;
             }
-            server_ptr = server_row;
 
-            for (x = 0; x + 15 < width;
-                    x += 16, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
-                if (!test_and_clear_bit((x / 16), vd->guest.dirty[y]))
-                    continue;
-                if (memcmp(server_ptr, guest_ptr, cmp_bytes) == 0)
-                    continue;
-                memcpy(server_ptr, guest_ptr, cmp_bytes);
-                if (!vd->non_adaptive)
-                    vnc_rect_updated(vd, x, y, &tv);
+            /* Only the dirty 16-pixel chunks are compared, and the changed
+             * ones are copied and collected in one bitmap for the row.
+             */
+            bitmap_zero(changed, VNC_DIRTY_BITS);
+            n = buffer_diff_copy(server_row, guest_ptr, cmp_bytes,
+                                 width / 16, vd->guest.dirty[y], changed);
+            if (n) {
+                if (!vd->non_adaptive) {
+                    for (x = find_first_bit(changed, width / 16);
+                         x < width / 16;
+                         x = find_next_bit(changed, width / 16, x + 1)) {
+                        vnc_rect_updated(vd, x * 16, y, &tv);
+                    }
+                }
                 QTAILQ_FOREACH(vs, &vd->clients, next) {
-                    set_bit((x / 16), vs->dirty[y]);
+                    bitmap_or(vs->dirty[y], vs->dirty[y], changed,
+                              VNC_DIRTY_BITS);
                 }
-                has_dirty++;
+                has_dirty += n;
             }
         }
         guest_row  += pixman_image_get_stride(vd->guest.fb);
@@ -2738,12 +2798,26 @@ static void vnc_refresh(DisplayChangeListener *dcl)
     VncState *vs, *vn;
     int has_dirty, rects = 0;
 
+    if (QTAILQ_EMPTY(&vd->clients)) {
+        /* Nobody is watching, leave the display device alone.  A new
+         * client gets a full update anyway.
+         */
+        update_displaychangelistener(&vd->dcl, VNC_REFRESH_INTERVAL_MAX);
+        return;
+    }
+
     graphic_hw_update(NULL);
 
     if (vnc_trylock_display(vd)) {
         update_displaychangelistener(&vd->dcl, VNC_REFRESH_INTERVAL_BASE);
         return;
     }
+    if (vd->encoders) {
+        /* A worker is reading the server surface, try again later */
+        vnc_unlock_display(vd);
+        update_displaychangelistener(&vd->dcl, VNC_REFRESH_INTERVAL_BASE);
+        return;
+    }
 
     has_dirty = vnc_refresh_server_surface(vd);
     vnc_unlock_display(vd);
@@ -2847,6 +2921,7 @@ void vnc_init_state(VncState *vs)
 
     qemu_mutex_init(&vs->output_mutex);
     vs->bh = qemu_bh_new(vnc_jobs_bh, vs);
+    vnc_start_worker_thread(vs);
 
     QTAILQ_INSERT_HEAD(&vd->clients, vs, next);
 
@@ -2933,7 +3008,6 @@ void vnc_display_init(DisplayState *ds)
         exit(1);
 
     qemu_mutex_init(&vs->mutex);
-    vnc_start_worker_thread();
 
     vs->dcl.ops = &dcl_ops;
     register_displaychangelistener(&vs->dcl);
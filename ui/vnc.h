@@ -64,6 +64,7 @@ typedef struct Buffer
 
 typedef struct VncState VncState;
 typedef struct VncJob VncJob;
+typedef struct VncJobQueue VncJobQueue;
 typedef struct VncRect VncRect;
 typedef struct VncRectEntry VncRectEntry;
 
@@ -153,6 +154,7 @@ struct VncDisplay
     kbd_layout_t *kbd_layout;
     int lock_key_sync;
     QemuMutex mutex;
+    int encoders; /* workers reading the server surface, protected by mutex */
 
     QEMUCursor *cursor;
     int cursor_msize;
@@ -188,6 +190,9 @@ typedef struct VncTight {
 #ifdef CONFIG_VNC_JPEG
     Buffer jpeg;
 #endif
+#ifdef CONFIG_VNC_TURBOJPEG
+    void *tjhandle; /* TurboJPEG compressor, kept across rectangles */
+#endif
 #ifdef CONFIG_VNC_PNG
     Buffer png;
 #endif
@@ -234,6 +239,24 @@ struct VncRectEntry
     QLIST_ENTRY(VncRectEntry) next;
 };
 
+/* Encodings accounted in VncState::encoder_stats */
+enum {
+    VNC_STAT_ENC_RAW,
+    VNC_STAT_ENC_HEXTILE,
+    VNC_STAT_ENC_ZLIB,
+    VNC_STAT_ENC_TIGHT,
+    VNC_STAT_ENC_TIGHT_PNG,
+    VNC_STAT_ENC_ZRLE,
+    VNC_STAT_ENC_ZYWRLE,
+    VNC_STAT_ENC_MAX,
+};
+
+typedef struct VncEncoderStat {
+    uint64_t rects;
+    uint64_t bytes;
+    uint64_t time_ns;
+} VncEncoderStat;
+
 struct VncJob
 {
     VncState *vs;
@@ -311,6 +334,11 @@ struct VncState
     QemuMutex output_mutex;
     QEMUBH *bh;
     Buffer jobs_buffer;
+    VncJobQueue *jobs_queue;
+    /* Bytes not yet sent to the client when the current job started */
+    size_t output_backlog;
+    /* Protected by output_mutex, updated when a job completes */
+    VncEncoderStat encoder_stats[VNC_STAT_ENC_MAX];
 
     /* Encoding specific, if you add something here, don't forget to
      *  update vnc_async_encoding_start()
@@ -30,6 +30,12 @@
 #include "qemu-common.h"
 #include "qemu/aes.h"
 
+#if defined(CONFIG_AESNI_OPT) && defined(CONFIG_CPUID_H)
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+#endif
+
 typedef uint32_t u32;
 typedef uint8_t u8;
 
@@ -1257,6 +1263,168 @@ void AES_decrypt(const unsigned char *in, unsigned char *out,
 
 #endif /* AES_ASM */
 
+#if defined(CONFIG_AESNI_OPT) && defined(CONFIG_CPUID_H)
+static bool aes_use_aesni;
+
+/* Chunks, or blocks of a chunk, that go through the pipeline together */
+#define AESNI_PARALLEL 4
+
+/*
+ * AES_KEY holds big-endian words, AES-NI wants the bytes in memory order.
+ * The schedule built by AES_set_decrypt_key() is already the one of the
+ * equivalent inverse cipher, which is what aesdec expects.
+ */
+static void __attribute__((target("aes,ssse3")))
+aesni_load_key(const AES_KEY *key, __m128i *rk)
+{
+    const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+                                       4, 5, 6, 7, 0, 1, 2, 3);
+    int i;
+
+    for (i = 0; i <= key->rounds; i++) {
+        rk[i] = _mm_shuffle_epi8(
+            _mm_loadu_si128((const __m128i *)&key->rd_key[4 * i]), bswap);
+    }
+}
+
+/*
+ * CBC encryption is serial within a chunk, so encrypt several chunks at
+ * once to hide the latency of aesenc.
+ */
+static void __attribute__((target("aes,ssse3")))
+aesni_cbc_encrypt_chunks(const unsigned char *in, unsigned char *out,
+                         unsigned long nb_chunks, unsigned long chunk_len,
+                         const AES_KEY *key, const unsigned char *ivecs)
+{
+    __m128i rk[AES_MAXNR + 1];
+    __m128i x[AESNI_PARALLEL];
+    int rounds = key->rounds;
+    unsigned long off;
+    int i, j, n;
+
+    aesni_load_key(key, rk);
+    while (nb_chunks) {
+        n = MIN(nb_chunks, AESNI_PARALLEL);
+        for (j = 0; j < n; j++) {
+            x[j] = _mm_loadu_si128((const __m128i *)(ivecs + j * 16));
+        }
+        for (off = 0; off < chunk_len; off += AES_BLOCK_SIZE) {
+            for (j = 0; j < n; j++) {
+                __m128i b = _mm_loadu_si128((const __m128i *)
+                                            (in + j * chunk_len + off));
+                x[j] = _mm_xor_si128(_mm_xor_si128(x[j], b), rk[0]);
+            }
+            for (i = 1; i < rounds; i++) {
+                for (j = 0; j < n; j++) {
+                    x[j] = _mm_aesenc_si128(x[j], rk[i]);
+                }
+            }
+            for (j = 0; j < n; j++) {
+                x[j] = _mm_aesenclast_si128(x[j], rk[rounds]);
+                _mm_storeu_si128((__m128i *)(out + j * chunk_len + off), x[j]);
+            }
+        }
+        in += n * chunk_len;
+        out += n * chunk_len;
+        ivecs += n * AES_BLOCK_SIZE;
+        nb_chunks -= n;
+    }
+}
+
+/* CBC decryption of the blocks of a chunk is independent */
+static void __attribute__((target("aes,ssse3")))
+aesni_cbc_decrypt_chunks(const unsigned char *in, unsigned char *out,
+                         unsigned long nb_chunks, unsigned long chunk_len,
+                         const AES_KEY *key, const unsigned char *ivecs)
+{
+    __m128i rk[AES_MAXNR + 1];
+    __m128i c[AESNI_PARALLEL], x[AESNI_PARALLEL];
+    __m128i prev;
+    int rounds = key->rounds;
+    unsigned long off;
+    int i, j, n;
+
+    aesni_load_key(key, rk);
+    for (; nb_chunks; nb_chunks--) {
+        prev = _mm_loadu_si128((const __m128i *)ivecs);
+        for (off = 0; off < chunk_len; off += n * AES_BLOCK_SIZE) {
+            n = MIN((chunk_len - off) / AES_BLOCK_SIZE, AESNI_PARALLEL);
+
+            /* Load everything first, in and out may be the same buffer */
+            for (j = 0; j < n; j++) {
+                c[j] = _mm_loadu_si128((const __m128i *)
+                                       (in + off + j * AES_BLOCK_SIZE));
+                x[j] = _mm_xor_si128(c[j], rk[0]);
+            }
+            for (i = 1; i < rounds; i++) {
+                for (j = 0; j < n; j++) {
+                    x[j] = _mm_aesdec_si128(x[j], rk[i]);
+                }
+            }
+            for (j = 0; j < n; j++) {
+                x[j] = _mm_aesdeclast_si128(x[j], rk[rounds]);
+                x[j] = _mm_xor_si128(x[j], j ? c[j - 1] : prev);
+                _mm_storeu_si128((__m128i *)(out + off + j * AES_BLOCK_SIZE),
+                                 x[j]);
+            }
+            prev = c[n - 1];
+        }
+        in += chunk_len;
+        out += chunk_len;
+        ivecs += AES_BLOCK_SIZE;
+    }
+}
+
+static void __attribute__((constructor)) aes_init_accel(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        aes_use_aesni = (ecx & bit_AES) && (ecx & bit_SSSE3);
+    }
+}
+#endif
+
+bool AES_accelerated(void)
+{
+#if defined(CONFIG_AESNI_OPT) && defined(CONFIG_CPUID_H)
+    return aes_use_aesni;
+#else
+    return false;
+#endif
+}
+
+void AES_cbc_encrypt_chunks(const unsigned char *in, unsigned char *out,
+                            unsigned long nb_chunks, unsigned long chunk_len,
+                            const AES_KEY *key, const unsigned char *ivecs,
+                            const int enc)
+{
+    unsigned char ivec[AES_BLOCK_SIZE];
+
+    assert(chunk_len % AES_BLOCK_SIZE == 0);
+
+#if defined(CONFIG_AESNI_OPT) && defined(CONFIG_CPUID_H)
+    if (aes_use_aesni && chunk_len) {
+        if (enc) {
+            aesni_cbc_encrypt_chunks(in, out, nb_chunks, chunk_len, key,
+                                     ivecs);
+        } else {
+            aesni_cbc_decrypt_chunks(in, out, nb_chunks, chunk_len, key,
+                                     ivecs);
+        }
+        return;
+    }
+#endif
+
+    for (; nb_chunks; nb_chunks--) {
+        memcpy(ivec, ivecs, AES_BLOCK_SIZE);
+        AES_cbc_encrypt(in, out, chunk_len, key, ivec, enc);
+        in += chunk_len;
+        out += chunk_len;
+        ivecs += AES_BLOCK_SIZE;
+    }
+}
+
 void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
 		     const unsigned long length, const AES_KEY *key,
 		     unsigned char *ivec, const int enc)
@@ -1268,6 +1436,22 @@ void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
 
 	assert(in && out && key && ivec);
 
+#if defined(CONFIG_AESNI_OPT) && defined(CONFIG_CPUID_H)
+	if (aes_use_aesni && len && len % AES_BLOCK_SIZE == 0) {
+		/* the last ciphertext block is the next IV */
+		if (enc) {
+			aesni_cbc_encrypt_chunks(in, out, 1, len, key, ivec);
+			memcpy(ivec, out + len - AES_BLOCK_SIZE,
+			       AES_BLOCK_SIZE);
+		} else {
+			memcpy(tmp, in + len - AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+			aesni_cbc_decrypt_chunks(in, out, 1, len, key, ivec);
+			memcpy(ivec, tmp, AES_BLOCK_SIZE);
+		}
+		return;
+	}
+#endif
+
 	if (enc) {
 		while (len >= AES_BLOCK_SIZE) {
 			for(n=0; n < AES_BLOCK_SIZE; ++n)
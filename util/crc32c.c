@@ -28,6 +28,12 @@
 #include "qemu-common.h"
 #include "qemu/crc32c.h"
 
+#if defined(CONFIG_CRC32C_OPT) && defined(CONFIG_CPUID_H)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
 /*
  * This is the CRC-32C table
  * Generated with:
@@ -105,11 +111,130 @@ static const uint32_t crc32c_table[256] = {
 };
 
 
-uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+static uint32_t crc32c_table_update(uint32_t crc, const uint8_t *data,
+                                    unsigned int length)
 {
     while (length--) {
         crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
     }
-    return crc^0xffffffff;
+    return crc;
+}
+
+#if defined(CONFIG_CRC32C_OPT) && defined(CONFIG_CPUID_H)
+/*
+ * The SSE4.2 crc32 instruction computes the same (bit-reflected, not
+ * inverted) update as the table, 8 bytes at a time.
+ */
+static uint32_t __attribute__((target("sse4.2")))
+crc32c_sse42_update(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    uint64_t crc64 = crc;
+    uint64_t val;
+
+    for (; length >= 8; length -= 8, data += 8) {
+        memcpy(&val, data, 8);
+        crc64 = _mm_crc32_u64(crc64, val);
+    }
+    crc = crc64;
+    while (length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+/*
+ * crc32 has a latency of three cycles but a throughput of one per cycle,
+ * so long buffers are split in three streams that are computed in
+ * parallel.  The CRC of the first two streams is then shifted over the
+ * following ones, by multiplying it by x^(8 * stream length) modulo the
+ * polynomial, and xor-ed into the third one.
+ */
+static const unsigned int crc32c_stream_len[] = { 1024, 128 };
+static uint32_t crc32c_shift_k[ARRAY_SIZE(crc32c_stream_len)][2];
+
+/* x^n modulo the CRC-32C polynomial, bit-reflected */
+static uint32_t crc32c_xpow(unsigned int n)
+{
+    uint32_t r = 0x80000000;
+
+    while (n--) {
+        r = (r >> 1) ^ (r & 1 ? 0x82F63B78 : 0);
+    }
+    return r;
+}
+
+static void crc32c_init_shift(void)
+{
+    int i;
+
+    /*
+     * clmul of two reflected 32-bit values gives their product times x,
+     * and crc32 of the 64-bit result multiplies it by x^32: take 33 off.
+     */
+    for (i = 0; i < ARRAY_SIZE(crc32c_stream_len); i++) {
+        crc32c_shift_k[i][0] = crc32c_xpow(8 * crc32c_stream_len[i] - 33);
+        crc32c_shift_k[i][1] = crc32c_xpow(16 * crc32c_stream_len[i] - 33);
+    }
+}
+
+static uint32_t __attribute__((target("sse4.2,pclmul")))
+crc32c_pclmul_update(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(crc32c_stream_len); i++) {
+        const unsigned int n = crc32c_stream_len[i];
+        const __m128i k1 = _mm_cvtsi32_si128(crc32c_shift_k[i][0]);
+        const __m128i k2 = _mm_cvtsi32_si128(crc32c_shift_k[i][1]);
+
+        for (; length >= 3 * n; length -= 3 * n, data += 3 * n) {
+            uint64_t crc0 = crc, crc1 = 0, crc2 = 0;
+            uint64_t v0, v1, v2;
+            unsigned int j;
+            __m128i t;
+
+            for (j = 0; j < n; j += 8) {
+                memcpy(&v0, data + j, 8);
+                memcpy(&v1, data + n + j, 8);
+                memcpy(&v2, data + 2 * n + j, 8);
+                crc0 = _mm_crc32_u64(crc0, v0);
+                crc1 = _mm_crc32_u64(crc1, v1);
+                crc2 = _mm_crc32_u64(crc2, v2);
+            }
+
+            t = _mm_xor_si128(
+                _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc0), k2, 0),
+                _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc1), k1, 0));
+            crc = crc2 ^ _mm_crc32_u64(0, _mm_cvtsi128_si64(t));
+        }
+    }
+
+    return crc32c_sse42_update(crc, data, length);
+}
+#endif
+
+static uint32_t (*crc32c_update)(uint32_t crc, const uint8_t *data,
+                                 unsigned int length) = crc32c_table_update;
+
+static void __attribute__((constructor)) crc32c_init_accel(void)
+{
+#if defined(CONFIG_CRC32C_OPT) && defined(CONFIG_CPUID_H)
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_2)) {
+        return;
+    }
+    if (ecx & bit_PCLMUL) {
+        crc32c_init_shift();
+        crc32c_update = crc32c_pclmul_update;
+    } else {
+        crc32c_update = crc32c_sse42_update;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    return crc32c_update(crc, data, length) ^ 0xffffffff;
 }
 
@@ -27,6 +27,12 @@
 
 #include "qemu/sockets.h"
 #include "qemu/iov.h"
+#include "qemu/bitops.h"
+
+#if defined(CONFIG_AVX2_OPT) && defined(CONFIG_CPUID_H)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
 
 void strpadcpy(char *buf, int buf_size, const char *str, char pad)
 {
@@ -163,6 +169,124 @@ int qemu_fdatasync(int fd)
 #endif
 }
 
+/*
+ * The first BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR chunks are checked
+ * one by one, the rest of the buffer by a block scanner that returns the
+ * offset of the first block of BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR
+ * chunks with a non-zero byte, or @len.  The scanner is chosen at startup
+ * for the host.
+ */
+#define BUFFER_FIND_NONZERO_OFFSET_BLOCK \
+    (BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE))
+
+static size_t find_nonzero_block_vec(const void *buf, size_t i, size_t len)
+{
+    const VECTYPE *p = buf;
+    const VECTYPE zero = (VECTYPE){0};
+
+    for (i /= sizeof(VECTYPE);
+         i < len / sizeof(VECTYPE);
+         i += BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR) {
+        VECTYPE tmp0 = p[i + 0] | p[i + 1];
+        VECTYPE tmp1 = p[i + 2] | p[i + 3];
+        VECTYPE tmp2 = p[i + 4] | p[i + 5];
+        VECTYPE tmp3 = p[i + 6] | p[i + 7];
+        VECTYPE tmp01 = tmp0 | tmp1;
+        VECTYPE tmp23 = tmp2 | tmp3;
+        if (!ALL_EQ(tmp01 | tmp23, zero)) {
+            break;
+        }
+    }
+
+    return i * sizeof(VECTYPE);
+}
+
+#if defined(CONFIG_AVX2_OPT) && defined(CONFIG_CPUID_H)
+/* AVX2 needs the CPU feature and the OS saving the YMM registers */
+bool host_cpu_has_avx2(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    uint32_t xcr0_lo, xcr0_hi;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+    __cpuid(1, eax, ebx, ecx, edx);
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) {
+        return false;
+    }
+    asm("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6) {
+        return false;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return ebx & bit_AVX2;
+}
+
+/*
+ * Same result as find_nonzero_block_vec, for blocks of 128 bytes.  The
+ * buffer is only aligned to sizeof(VECTYPE), so the loads are unaligned;
+ * two blocks are or-ed together per iteration and the first one checked
+ * again on a hit.
+ */
+static size_t __attribute__((target("avx2")))
+find_nonzero_block_avx2(const void *buf, size_t i, size_t len)
+{
+    const size_t block = BUFFER_FIND_NONZERO_OFFSET_BLOCK;
+    const uint8_t *p = buf;
+
+    for (; i + 2 * block <= len; i += 2 * block) {
+        const __m256i *q = (const __m256i *)(p + i);
+        __m256i t0 = _mm256_or_si256(_mm256_loadu_si256(q + 0),
+                                     _mm256_loadu_si256(q + 1));
+        __m256i t1 = _mm256_or_si256(_mm256_loadu_si256(q + 2),
+                                     _mm256_loadu_si256(q + 3));
+        __m256i t2 = _mm256_or_si256(_mm256_loadu_si256(q + 4),
+                                     _mm256_loadu_si256(q + 5));
+        __m256i t3 = _mm256_or_si256(_mm256_loadu_si256(q + 6),
+                                     _mm256_loadu_si256(q + 7));
+        __m256i t01 = _mm256_or_si256(t0, t1);
+        __m256i t = _mm256_or_si256(t01, _mm256_or_si256(t2, t3));
+
+        if (!_mm256_testz_si256(t, t)) {
+            if (!_mm256_testz_si256(t01, t01)) {
+                return i;
+            }
+            return i + block;
+        }
+    }
+
+    /* Not a tail call into SSE code, which would run with dirty YMM state */
+    if (i < len) {
+        const __m256i *q = (const __m256i *)(p + i);
+        __m256i t = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256(q + 0),
+                            _mm256_loadu_si256(q + 1)),
+            _mm256_or_si256(_mm256_loadu_si256(q + 2),
+                            _mm256_loadu_si256(q + 3)));
+
+        if (_mm256_testz_si256(t, t)) {
+            i += block;
+        }
+    }
+
+    return i;
+}
+#endif
+
+static size_t (*find_nonzero_block)(const void *buf, size_t i, size_t len) =
+    find_nonzero_block_vec;
+
+static void __attribute__((constructor)) cutils_init_accel(void)
+{
+#if defined(CONFIG_AVX2_OPT) && defined(CONFIG_CPUID_H)
+    /* find_nonzero_block_avx2 works on blocks of 128 bytes or a multiple */
+    if (BUFFER_FIND_NONZERO_OFFSET_BLOCK % 128 == 0 && host_cpu_has_avx2()) {
+        find_nonzero_block = find_nonzero_block_avx2;
+    }
+#endif
+}
+
 /*
  * Searches for an area with non-zero content in a buffer
  *
@@ -201,21 +325,7 @@ size_t buffer_find_nonzero_offset(const void *buf, size_t len)
         }
     }
 
-    for (i = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR;
-         i < len / sizeof(VECTYPE);
-         i += BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR) {
-        VECTYPE tmp0 = p[i + 0] | p[i + 1];
-        VECTYPE tmp1 = p[i + 2] | p[i + 3];
-        VECTYPE tmp2 = p[i + 4] | p[i + 5];
-        VECTYPE tmp3 = p[i + 6] | p[i + 7];
-        VECTYPE tmp01 = tmp0 | tmp1;
-        VECTYPE tmp23 = tmp2 | tmp3;
-        if (!ALL_EQ(tmp01 | tmp23, zero)) {
-            break;
-        }
-    }
-
-    return i * sizeof(VECTYPE);
+    return find_nonzero_block(buf, BUFFER_FIND_NONZERO_OFFSET_BLOCK, len);
 }
 
 /*
@@ -258,6 +368,79 @@ bool buffer_is_zero(const void *buf, size_t len)
     return true;
 }
 
+#define BUFFER_DIFF_COPY_UNROLL_FACTOR 4
+
+static bool buffer_equal_vec(const void *a, const void *b, size_t len)
+{
+    const VECTYPE *p = a;
+    const VECTYPE *q = b;
+    const VECTYPE zero = (VECTYPE){0};
+    size_t i;
+
+    for (i = 0; i < len / sizeof(VECTYPE);
+         i += BUFFER_DIFF_COPY_UNROLL_FACTOR) {
+        VECTYPE tmp0 = (p[i + 0] ^ q[i + 0]) | (p[i + 1] ^ q[i + 1]);
+        VECTYPE tmp1 = (p[i + 2] ^ q[i + 2]) | (p[i + 3] ^ q[i + 3]);
+        if (!ALL_EQ(tmp0 | tmp1, zero)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Copy the chunks of @src that differ from @dst
+ *
+ * @dst and @src are made of @nr chunks of @chunk bytes each.  Only the
+ * chunks whose bit is set in @todo are compared, and their bits are
+ * cleared.  Chunks that differ are copied to @dst and their bit is set
+ * in @dirty.
+ *
+ * Chunks are compared a vector at a time if @chunk is a multiple of
+ * BUFFER_DIFF_COPY_UNROLL_FACTOR * sizeof(VECTYPE) and both buffers are
+ * aligned to sizeof(VECTYPE).
+ *
+ * The return value is the number of chunks that were copied.
+ */
+long buffer_diff_copy(void *dst, const void *src, size_t chunk, long nr,
+                      unsigned long *todo, unsigned long *dirty)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    bool vec = chunk % (BUFFER_DIFF_COPY_UNROLL_FACTOR * sizeof(VECTYPE)) == 0
+        && ((uintptr_t) d) % sizeof(VECTYPE) == 0
+        && ((uintptr_t) s) % sizeof(VECTYPE) == 0;
+    long changed = 0;
+    long w;
+
+    /* Walk the bitmap a word at a time, most of it is usually clear */
+    for (w = 0; w < BITS_TO_LONGS(nr); w++) {
+        unsigned long bits = todo[w];
+        unsigned long diff = 0;
+
+        if (w == nr / BITS_PER_LONG) {
+            bits &= BIT_MASK(nr) - 1;
+        }
+        todo[w] &= ~bits;
+
+        while (bits) {
+            int bit = ctzl(bits);
+            size_t off = (w * BITS_PER_LONG + bit) * chunk;
+
+            bits &= bits - 1;
+            if (vec ? buffer_equal_vec(d + off, s + off, chunk)
+                    : memcmp(d + off, s + off, chunk) == 0) {
+                continue;
+            }
+            memcpy(d + off, s + off, chunk);
+            diff |= 1UL << bit;
+            changed++;
+        }
+        dirty[w] |= diff;
+    }
+    return changed;
+}
+
 #ifndef _WIN32
 /* Sets a specific flag */
 int fcntl_setfl(int fd, int flag)
@@ -15,6 +15,7 @@
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/bswap.h"
 #include "trace.h"
 
 /* HBitmaps provides an array of bits.  The bits are stored as usual in an
@@ -168,6 +169,65 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
     }
 }
 
+/* Return the first item at or after @pos, in the last level and not
+ * accounting for the granularity, whose bit is clear; or hb->size.
+ * Runs of set bits are skipped a word at a time.
+ */
+static uint64_t hb_next_zero(const HBitmap *hb, uint64_t pos)
+{
+    const unsigned long *level = hb->levels[HBITMAP_LEVELS - 1];
+    size_t i = pos >> BITS_PER_LEVEL;
+    unsigned long cur;
+
+    if (pos >= hb->size) {
+        return hb->size;
+    }
+
+    cur = ~level[i] & ~((1UL << (pos & (BITS_PER_LONG - 1))) - 1);
+    while (cur == 0) {
+        if (((uint64_t)++i << BITS_PER_LEVEL) >= hb->size) {
+            return hb->size;
+        }
+        cur = ~level[i];
+    }
+
+    /* Bits past the end of the bitmap are clear, so cap to the size */
+    return MIN(((uint64_t)i << BITS_PER_LEVEL) + ctzl(cur), hb->size);
+}
+
+uint64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start)
+{
+    return hb_next_zero(hb, start >> hb->granularity) << hb->granularity;
+}
+
+int64_t hbitmap_iter_next_extent(HBitmapIter *hbi, uint64_t *count)
+{
+    const HBitmap *hb = hbi->hb;
+    int64_t first;
+    uint64_t end;
+    unsigned i;
+
+    first = hbitmap_iter_next(hbi);
+    if (first < 0) {
+        *count = 0;
+        return -1;
+    }
+
+    end = hb_next_zero(hb, (first >> hb->granularity) + 1);
+    *count = (end << hb->granularity) - first;
+
+    if (end < hb->size) {
+        hbitmap_iter_init(hbi, hb, end << hb->granularity);
+    } else {
+        /* Leave only the sentinel, so that the next call returns -1 */
+        for (i = 1; i < HBITMAP_LEVELS; i++) {
+            hbi->cur[i] = 0;
+        }
+        hbi->cur[0] = 1UL << (BITS_PER_LONG - 1);
+    }
+    return first;
+}
+
 bool hbitmap_empty(const HBitmap *hb)
 {
     return hb->count == 0;
@@ -178,6 +238,11 @@ int hbitmap_granularity(const HBitmap *hb)
     return hb->granularity;
 }
 
+uint64_t hbitmap_size(const HBitmap *hb)
+{
+    return hb->size << hb->granularity;
+}
+
 uint64_t hbitmap_count(const HBitmap *hb)
 {
     return hb->count << hb->granularity;
@@ -367,6 +432,145 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
 }
 
+/* Recompute the count and the upper levels from the last level, after it
+ * was changed directly.  This is O(size / BITS_PER_LONG).
+ */
+static void hb_rebuild(HBitmap *hb)
+{
+    uint64_t size = hb->size;
+    uint64_t count = 0;
+    size_t i, n;
+    int level;
+
+    n = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+    for (i = 0; i < n; i++) {
+        count += popcountl(hb->levels[HBITMAP_LEVELS - 1][i]);
+    }
+    hb->count = count;
+
+    for (level = HBITMAP_LEVELS - 1; level > 0; level--) {
+        size_t parents = MAX((n + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+
+        memset(hb->levels[level - 1], 0, parents * sizeof(unsigned long));
+        for (i = 0; i < n; i++) {
+            if (hb->levels[level][i]) {
+                hb->levels[level - 1][i >> BITS_PER_LEVEL] |=
+                    1UL << (i & (BITS_PER_LONG - 1));
+            }
+        }
+        n = parents;
+    }
+    hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+}
+
+/* Words of the last level covering [@start, @start + @count) */
+static void hb_words_range(const HBitmap *hb, uint64_t start, uint64_t count,
+                           size_t *first, size_t *nb)
+{
+    uint64_t granule = hbitmap_serialization_granularity(hb);
+    uint64_t last = (start + count - 1) >> hb->granularity;
+
+    assert(start % granule == 0);
+    assert((start + count) % granule == 0 ||
+           start + count == hbitmap_size(hb));
+    assert(count && last < hb->size);
+
+    *first = (start >> hb->granularity) >> BITS_PER_LEVEL;
+    *nb = (last >> BITS_PER_LEVEL) - *first + 1;
+}
+
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb)
+{
+    return (uint64_t)BITS_PER_LONG << hb->granularity;
+}
+
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count)
+{
+    size_t first, nb;
+
+    hb_words_range(hb, start, count, &first, &nb);
+    return nb * sizeof(unsigned long);
+}
+
+/* The words are stored little endian, so the format does not depend on the
+ * size of a long: bit N of the bitmap is bit N % 8 of byte N / 8.
+ */
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count)
+{
+    const unsigned long *level = hb->levels[HBITMAP_LEVELS - 1];
+    unsigned long *out = (unsigned long *)buf;
+    size_t first, nb, i;
+
+    hb_words_range(hb, start, count, &first, &nb);
+    for (i = 0; i < nb; i++) {
+        out[i] = BITS_PER_LONG == 32 ? cpu_to_le32(level[first + i])
+                                     : cpu_to_le64(level[first + i]);
+    }
+}
+
+void hbitmap_deserialize_part(HBitmap *hb, const uint8_t *buf,
+                              uint64_t start, uint64_t count, bool finish)
+{
+    unsigned long *level = hb->levels[HBITMAP_LEVELS - 1];
+    const unsigned long *in = (const unsigned long *)buf;
+    size_t first, nb, i;
+
+    hb_words_range(hb, start, count, &first, &nb);
+    for (i = 0; i < nb; i++) {
+        level[first + i] = BITS_PER_LONG == 32 ? le32_to_cpu(in[i])
+                                               : le64_to_cpu(in[i]);
+    }
+
+    /* Drop bits past the end, which the iterator does not expect */
+    if (first + nb == ((hb->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL) &&
+        (hb->size & (BITS_PER_LONG - 1))) {
+        level[first + nb - 1] &= (1UL << (hb->size & (BITS_PER_LONG - 1))) - 1;
+    }
+
+    if (finish) {
+        hbitmap_deserialize_finish(hb);
+    }
+}
+
+void hbitmap_deserialize_finish(HBitmap *hb)
+{
+    hb_rebuild(hb);
+}
+
+bool hbitmap_merge(HBitmap *a, const HBitmap *b)
+{
+    size_t i, n;
+
+    if (a->size != b->size || a->granularity != b->granularity) {
+        return false;
+    }
+
+    n = (a->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL;
+    for (i = 0; i < n; i++) {
+        a->levels[HBITMAP_LEVELS - 1][i] |= b->levels[HBITMAP_LEVELS - 1][i];
+    }
+    hb_rebuild(a);
+    return true;
+}
+
+bool hbitmap_and(HBitmap *a, const HBitmap *b)
+{
+    size_t i, n;
+
+    if (a->size != b->size || a->granularity != b->granularity) {
+        return false;
+    }
+
+    n = (a->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL;
+    for (i = 0; i < n; i++) {
+        a->levels[HBITMAP_LEVELS - 1][i] &= b->levels[HBITMAP_LEVELS - 1][i];
+    }
+    hb_rebuild(a);
+    return true;
+}
+
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
@@ -215,6 +215,16 @@ ssize_t iov_send_recv(int sockfd, struct iovec *iov, unsigned iov_cnt,
     return total;
 }
 
+ssize_t iov_writev(int fd, const struct iovec *iov, unsigned iov_cnt)
+{
+    ssize_t ret;
+
+    do {
+        ret = writev(fd, iov, MIN(iov_cnt, IOV_MAX));
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
 
 void iov_hexdump(const struct iovec *iov, const unsigned int iov_cnt,
                  FILE *fp, const char *prefix, size_t limit)
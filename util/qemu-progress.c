@@ -25,12 +25,15 @@
 #include "qemu-common.h"
 #include "qemu/osdep.h"
 #include "sysemu/sysemu.h"
+#include "qemu/timer.h"
 #include <stdio.h>
 
 struct progress_state {
     float current;
     float last_print;
     float min_skip;
+    uint64_t bytes;
+    int64_t start_time_ns;
     void (*print)(void);
     void (*end)(void);
 };
@@ -38,6 +41,21 @@ struct progress_state {
 static struct progress_state state;
 static volatile sig_atomic_t print_pending;
 
+/*
+ * Format the transfer rate, if the operation reports the bytes it has
+ * processed; otherwise an empty string.
+ */
+static void progress_format_rate(char *buf, size_t len)
+{
+    int64_t elapsed_ns = get_clock() - state.start_time_ns;
+
+    buf[0] = '\0';
+    if (state.bytes && elapsed_ns > 0) {
+        double rate = (double)state.bytes / elapsed_ns * 1000000000.0;
+        snprintf(buf, len, " %.1f MiB/s", rate / (1024 * 1024));
+    }
+}
+
 /*
  * Simple progress print function.
  * @percent relative percent of current operation
@@ -45,7 +63,10 @@ static volatile sig_atomic_t print_pending;
  */
 static void progress_simple_print(void)
 {
-    printf("    (%3.2f/100%%)\r", state.current);
+    char rate[32];
+
+    progress_format_rate(rate, sizeof(rate));
+    printf("    (%3.2f/100%%)%s\r", state.current, rate);
     fflush(stdout);
 }
 
@@ -70,7 +91,10 @@ static void sigusr_print(int signal)
 static void progress_dummy_print(void)
 {
     if (print_pending) {
-        fprintf(stderr, "    (%3.2f/100%%)\n", state.current);
+        char rate[32];
+
+        progress_format_rate(rate, sizeof(rate));
+        fprintf(stderr, "    (%3.2f/100%%)%s\n", state.current, rate);
         print_pending = 0;
     }
 }
@@ -105,6 +129,8 @@ static void progress_dummy_init(void)
 void qemu_progress_init(int enabled, float min_skip)
 {
     state.min_skip = min_skip;
+    state.bytes = 0;
+    state.start_time_ns = get_clock();
     if (enabled) {
         progress_simple_init();
     } else {
@@ -114,7 +140,9 @@ void qemu_progress_init(int enabled, float min_skip)
 
 void qemu_progress_end(void)
 {
-    state.end();
+    if (state.end) {
+        state.end();
+    }
 }
 
 /*
@@ -132,6 +160,11 @@ void qemu_progress_print(float delta, int max)
 {
     float current;
 
+    /* Library code may report progress in programs that never set it up */
+    if (!state.print) {
+        return;
+    }
+
     if (max == 0) {
         current = delta;
     } else {
@@ -148,3 +181,12 @@ void qemu_progress_print(float delta, int max)
         state.print();
     }
 }
+
+/*
+ * Report that @bytes more bytes have been processed.  Once this has been
+ * called, progress reports include the average transfer rate.
+ */
+void qemu_progress_add_bytes(uint64_t bytes)
+{
+    state.bytes += bytes;
+}
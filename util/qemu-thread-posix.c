@@ -20,12 +20,23 @@
 #include <limits.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sched.h>
 #ifdef __linux__
 #include <sys/syscall.h>
 #include <linux/futex.h>
 #endif
 #include "qemu/thread.h"
 #include "qemu/atomic.h"
+#include "qemu/notify.h"
+
+/* Upper bound for the spinning of adaptive mutexes, in trylock attempts */
+#define QEMU_MUTEX_SPIN_MAX     100
+
+#if defined(__i386__) || defined(__x86_64__)
+#define qemu_mutex_pause()      asm volatile("pause" ::: "memory")
+#else
+#define qemu_mutex_pause()      barrier()
+#endif
 
 static void error_exit(int err, const char *msg)
 {
@@ -44,6 +55,16 @@ void qemu_mutex_init(QemuMutex *mutex)
     pthread_mutexattr_destroy(&mutexattr);
     if (err)
         error_exit(err, __func__);
+
+    mutex->adaptive = false;
+    mutex->spin = 0;
+    mutex->contended = mutex->slept = 0;
+}
+
+void qemu_mutex_init_adaptive(QemuMutex *mutex)
+{
+    qemu_mutex_init(mutex);
+    mutex->adaptive = true;
 }
 
 void qemu_mutex_destroy(QemuMutex *mutex)
@@ -55,10 +76,49 @@ void qemu_mutex_destroy(QemuMutex *mutex)
         error_exit(err, __func__);
 }
 
+/* Spin with trylock for up to twice the recent average before sleeping.
+ * The average is kept like glibc does for PTHREAD_MUTEX_ADAPTIVE_NP, which
+ * cannot be used here because it does no error checking.  glibc mutexes
+ * are futex-based, so the uncontended path never enters the kernel.
+ */
+static void qemu_mutex_lock_adaptive(QemuMutex *mutex)
+{
+    int max, i, err;
+
+    if (pthread_mutex_trylock(&mutex->lock) == 0) {
+        return;
+    }
+
+    max = mutex->spin * 2 + 10;
+    if (max > QEMU_MUTEX_SPIN_MAX) {
+        max = QEMU_MUTEX_SPIN_MAX;
+    }
+    for (i = 0; i < max; i++) {
+        qemu_mutex_pause();
+        if (pthread_mutex_trylock(&mutex->lock) == 0) {
+            break;
+        }
+    }
+    if (i == max) {
+        err = pthread_mutex_lock(&mutex->lock);
+        if (err) {
+            error_exit(err, __func__);
+        }
+        mutex->slept++;
+    }
+    mutex->contended++;
+    mutex->spin += (i - mutex->spin) / 8;
+}
+
 void qemu_mutex_lock(QemuMutex *mutex)
 {
     int err;
 
+    if (mutex->adaptive) {
+        qemu_mutex_lock_adaptive(mutex);
+        return;
+    }
+
     err = pthread_mutex_lock(&mutex->lock);
     if (err)
         error_exit(err, __func__);
@@ -78,6 +138,12 @@ void qemu_mutex_unlock(QemuMutex *mutex)
         error_exit(err, __func__);
 }
 
+void qemu_mutex_get_stats(QemuMutex *mutex, QemuMutexStats *stats)
+{
+    stats->contended = mutex->contended;
+    stats->slept = mutex->slept;
+}
+
 void qemu_cond_init(QemuCond *cond)
 {
     int err;
@@ -434,6 +500,95 @@ void qemu_thread_exit(void *retval)
     pthread_exit(retval);
 }
 
+int qemu_thread_set_sched(const QemuThreadSched *sched)
+{
+    struct sched_param param = { .sched_priority = 0 };
+    int policy, err;
+
+    if (sched->nr_cpus) {
+#ifdef __linux__
+        cpu_set_t set;
+        int cpu;
+
+        CPU_ZERO(&set);
+        for (cpu = sched->first_cpu;
+             cpu < sched->first_cpu + sched->nr_cpus; cpu++) {
+            CPU_SET(cpu, &set);
+        }
+        /* With a pid of zero, Linux changes the calling thread only */
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            return -errno;
+        }
+#else
+        return -ENOSYS;
+#endif
+    }
+
+    switch (sched->policy) {
+    case QEMU_THREAD_SCHED_DEFAULT:
+        return 0;
+    case QEMU_THREAD_SCHED_OTHER:
+        policy = SCHED_OTHER;
+        break;
+    case QEMU_THREAD_SCHED_FIFO:
+        policy = SCHED_FIFO;
+        param.sched_priority = sched->priority;
+        break;
+    case QEMU_THREAD_SCHED_RR:
+        policy = SCHED_RR;
+        param.sched_priority = sched->priority;
+        break;
+    default:
+        abort();
+    }
+
+    err = pthread_setschedparam(pthread_self(), policy, &param);
+    return -err;
+}
+
+static pthread_key_t exit_key;
+
+/* The thread's exit notifiers live in the key's value itself */
+union NotifierThreadData {
+    void *ptr;
+    NotifierList list;
+};
+QEMU_BUILD_BUG_ON(sizeof(union NotifierThreadData) != sizeof(void *));
+
+void qemu_thread_atexit_add(Notifier *notifier)
+{
+    union NotifierThreadData ntd;
+
+    ntd.ptr = pthread_getspecific(exit_key);
+    notifier_list_add(&ntd.list, notifier);
+    pthread_setspecific(exit_key, ntd.ptr);
+}
+
+void qemu_thread_atexit_remove(Notifier *notifier)
+{
+    union NotifierThreadData ntd;
+
+    ntd.ptr = pthread_getspecific(exit_key);
+    notifier_remove(notifier);
+    pthread_setspecific(exit_key, ntd.ptr);
+}
+
+static void qemu_thread_atexit_run(void *arg)
+{
+    union NotifierThreadData ntd = { .ptr = arg };
+
+    notifier_list_notify(&ntd.list, NULL);
+}
+
+static void __attribute__((constructor)) qemu_thread_atexit_init(void)
+{
+    int err = pthread_key_create(&exit_key, qemu_thread_atexit_run);
+
+    if (err) {
+        error_exit(err, __func__);
+    }
+}
+
 void *qemu_thread_join(QemuThread *thread)
 {
     int err;
@@ -0,0 +1,74 @@
+/*
+ * Parsing of thread placement and scheduling options
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/thread.h"
+
+/* Keep in sync with CPU_SETSIZE on Linux */
+#define QEMU_THREAD_MAX_CPUS    1024
+
+int qemu_thread_parse_affinity(QemuThreadSched *sched, const char *str)
+{
+    unsigned long long first, last;
+    char *endptr;
+
+    if (parse_uint(str, &first, &endptr, 10) < 0) {
+        return -EINVAL;
+    }
+    if (*endptr == '-') {
+        if (parse_uint_full(endptr + 1, &last, 10) < 0) {
+            return -EINVAL;
+        }
+    } else if (*endptr == '\0') {
+        last = first;
+    } else {
+        return -EINVAL;
+    }
+
+    if (last < first || last >= QEMU_THREAD_MAX_CPUS) {
+        return -EINVAL;
+    }
+
+    sched->first_cpu = first;
+    sched->nr_cpus = last - first + 1;
+    return 0;
+}
+
+int qemu_thread_parse_sched(QemuThreadSched *sched, const char *str)
+{
+    unsigned long long priority = 0;
+    const char *p = strchr(str, ':');
+    size_t len = p ? p - str : strlen(str);
+    QemuThreadSchedPolicy policy;
+
+    if (len == 5 && !strncmp(str, "other", len)) {
+        policy = QEMU_THREAD_SCHED_OTHER;
+    } else if (len == 4 && !strncmp(str, "fifo", len)) {
+        policy = QEMU_THREAD_SCHED_FIFO;
+    } else if (len == 2 && !strncmp(str, "rr", len)) {
+        policy = QEMU_THREAD_SCHED_RR;
+    } else {
+        return -EINVAL;
+    }
+
+    if (p) {
+        /* Priorities only exist for the real-time policies */
+        if (policy == QEMU_THREAD_SCHED_OTHER ||
+            parse_uint_full(p + 1, &priority, 10) < 0 ||
+            priority < 1 || priority > 99) {
+            return -EINVAL;
+        }
+    } else if (policy != QEMU_THREAD_SCHED_OTHER) {
+        priority = 1;
+    }
+
+    sched->policy = policy;
+    sched->priority = priority;
+    return 0;
+}
@@ -12,6 +12,7 @@
  */
 #include "qemu-common.h"
 #include "qemu/thread.h"
+#include "qemu/notify.h"
 #include <process.h>
 #include <assert.h>
 #include <limits.h>
@@ -27,21 +28,63 @@ static void error_exit(int err, const char *msg)
     abort();
 }
 
+/* Upper bound for the spinning of adaptive mutexes, in trylock attempts */
+#define QEMU_MUTEX_SPIN_MAX     100
+
 void qemu_mutex_init(QemuMutex *mutex)
 {
     mutex->owner = 0;
+    mutex->adaptive = false;
+    mutex->spin = 0;
+    mutex->contended = mutex->slept = 0;
     InitializeCriticalSection(&mutex->lock);
 }
 
+void qemu_mutex_init_adaptive(QemuMutex *mutex)
+{
+    qemu_mutex_init(mutex);
+    mutex->adaptive = true;
+}
+
 void qemu_mutex_destroy(QemuMutex *mutex)
 {
     assert(mutex->owner == 0);
     DeleteCriticalSection(&mutex->lock);
 }
 
+/* Same policy as the POSIX version.  The spin count of the critical
+ * section is left alone, so that it does not spin a second time.
+ */
+static void qemu_mutex_enter_adaptive(QemuMutex *mutex)
+{
+    int max, i;
+
+    if (TryEnterCriticalSection(&mutex->lock)) {
+        return;
+    }
+
+    max = MIN(mutex->spin * 2 + 10, QEMU_MUTEX_SPIN_MAX);
+    for (i = 0; i < max; i++) {
+        YieldProcessor();
+        if (TryEnterCriticalSection(&mutex->lock)) {
+            break;
+        }
+    }
+    if (i == max) {
+        EnterCriticalSection(&mutex->lock);
+        mutex->slept++;
+    }
+    mutex->contended++;
+    mutex->spin += (i - mutex->spin) / 8;
+}
+
 void qemu_mutex_lock(QemuMutex *mutex)
 {
-    EnterCriticalSection(&mutex->lock);
+    if (mutex->adaptive) {
+        qemu_mutex_enter_adaptive(mutex);
+    } else {
+        EnterCriticalSection(&mutex->lock);
+    }
 
     /* Win32 CRITICAL_SECTIONs are recursive.  Assert that we're not
      * using them as such.
@@ -69,6 +112,12 @@ void qemu_mutex_unlock(QemuMutex *mutex)
     LeaveCriticalSection(&mutex->lock);
 }
 
+void qemu_mutex_get_stats(QemuMutex *mutex, QemuMutexStats *stats)
+{
+    stats->contended = mutex->contended;
+    stats->slept = mutex->slept;
+}
+
 void qemu_cond_init(QemuCond *cond)
 {
     memset(cond, 0, sizeof(*cond));
@@ -266,6 +315,17 @@ struct QemuThreadData {
 };
 
 static __thread QemuThreadData *qemu_thread_data;
+static __thread NotifierList thread_exit;
+
+void qemu_thread_atexit_add(Notifier *notifier)
+{
+    notifier_list_add(&thread_exit, notifier);
+}
+
+void qemu_thread_atexit_remove(Notifier *notifier)
+{
+    notifier_remove(notifier);
+}
 
 static unsigned __stdcall win32_start_routine(void *arg)
 {
@@ -286,6 +346,7 @@ void qemu_thread_exit(void *arg)
 {
     QemuThreadData *data = qemu_thread_data;
 
+    notifier_list_notify(&thread_exit, NULL);
     if (data) {
         assert(data->mode != QEMU_THREAD_DETACHED);
         data->ret = arg;
@@ -351,6 +412,14 @@ void qemu_thread_create(QemuThread *thread,
     thread->data = (mode == QEMU_THREAD_DETACHED) ? NULL : data;
 }
 
+int qemu_thread_set_sched(const QemuThreadSched *sched)
+{
+    if (sched->nr_cpus || sched->policy != QEMU_THREAD_SCHED_DEFAULT) {
+        return -ENOSYS;
+    }
+    return 0;
+}
+
 void qemu_thread_get_self(QemuThread *thread)
 {
     thread->data = qemu_thread_data;
@@ -0,0 +1,208 @@
+/*
+ * Read-copy-update
+ *
+ * Copyright (c) 2014 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The grace period detection follows the "memory barrier" flavor of
+ * liburcu: each reader publishes a snapshot of a global counter while it
+ * is in a critical section, and a writer waits until no reader holds a
+ * snapshot older than the current counter.
+ */
+
+#include "qemu-common.h"
+#include "qemu/rcu.h"
+#include "qemu/main-loop.h"
+
+unsigned long rcu_gp_ctr = RCU_GP_LOCKED;
+
+QemuEvent rcu_gp_event;
+static QemuMutex rcu_gp_lock;
+
+/* Registered readers, protected by rcu_gp_lock */
+static QLIST_HEAD(, rcu_reader_data) registry =
+    QLIST_HEAD_INITIALIZER(registry);
+
+__thread struct rcu_reader_data rcu_reader;
+
+/* Is the reader in a critical section that began before the current
+ * grace period?
+ */
+static inline bool rcu_gp_ongoing(unsigned long *ctr)
+{
+    unsigned long v;
+
+    v = atomic_read(ctr);
+    return v && (v != rcu_gp_ctr);
+}
+
+static void wait_for_readers(void)
+{
+    QLIST_HEAD(, rcu_reader_data) qsreaders = QLIST_HEAD_INITIALIZER(qsreaders);
+    struct rcu_reader_data *index, *tmp;
+
+    for (;;) {
+        /* Readers that see waiting == true set the event when they leave
+         * their critical section.  Reset it before setting the flags, so
+         * that no wakeup is lost.
+         */
+        qemu_event_reset(&rcu_gp_event);
+        QLIST_FOREACH(index, &registry, node) {
+            atomic_set(&index->waiting, true);
+        }
+
+        /* Order the waiting flags before the reads of the counters, and
+         * pair with the exchange in rcu_read_unlock().
+         */
+        smp_mb();
+
+        QLIST_FOREACH_SAFE(index, &registry, node, tmp) {
+            if (!rcu_gp_ongoing(&index->ctr)) {
+                QLIST_REMOVE(index, node);
+                QLIST_INSERT_HEAD(&qsreaders, index, node);
+                atomic_set(&index->waiting, false);
+            }
+        }
+
+        if (QLIST_EMPTY(&registry)) {
+            break;
+        }
+
+        qemu_event_wait(&rcu_gp_event);
+    }
+
+    /* Order the reads of the counters before whatever the caller frees */
+    smp_mb();
+
+    while (!QLIST_EMPTY(&qsreaders)) {
+        index = QLIST_FIRST(&qsreaders);
+        QLIST_REMOVE(index, node);
+        QLIST_INSERT_HEAD(&registry, index, node);
+    }
+}
+
+void synchronize_rcu(void)
+{
+    assert(rcu_reader.depth == 0);
+
+    qemu_mutex_lock(&rcu_gp_lock);
+
+    if (!QLIST_EMPTY(&registry)) {
+        if (sizeof(rcu_gp_ctr) < 8) {
+            /* A 32-bit counter can wrap around while a reader sleeps in
+             * its critical section.  Flip bit 1 twice, waiting for the
+             * readers each time, like liburcu does.
+             */
+            atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr ^ RCU_GP_CTR);
+            wait_for_readers();
+            atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr ^ RCU_GP_CTR);
+        } else {
+            atomic_mb_set(&rcu_gp_ctr, rcu_gp_ctr + RCU_GP_CTR);
+        }
+
+        wait_for_readers();
+    }
+
+    qemu_mutex_unlock(&rcu_gp_lock);
+}
+
+void rcu_register_thread(void)
+{
+    assert(rcu_reader.ctr == 0 && !rcu_reader.registered);
+    qemu_mutex_lock(&rcu_gp_lock);
+    QLIST_INSERT_HEAD(&registry, &rcu_reader, node);
+    qemu_mutex_unlock(&rcu_gp_lock);
+    rcu_reader.registered = true;
+}
+
+void rcu_unregister_thread(void)
+{
+    assert(rcu_reader.depth == 0 && rcu_reader.registered);
+    rcu_reader.registered = false;
+    qemu_mutex_lock(&rcu_gp_lock);
+    QLIST_REMOVE(&rcu_reader, node);
+    qemu_mutex_unlock(&rcu_gp_lock);
+}
+
+/* Callbacks queued by call_rcu1().  They are handed to the call_rcu
+ * thread a batch at a time, and run after a grace period.
+ */
+static QemuMutex rcu_call_lock;
+static QemuEvent rcu_call_ready_event;
+static struct rcu_head *rcu_call_head;
+static struct rcu_head **rcu_call_tail = &rcu_call_head;
+static bool rcu_call_started;
+static QemuThread rcu_call_thread;
+
+/* Give callbacks queued close together a chance to share a grace period */
+#define RCU_CALL_MIN_DELAY_US   10000
+
+static void *call_rcu_thread(void *opaque)
+{
+    struct rcu_head *node, *next;
+
+    rcu_register_thread();
+
+    for (;;) {
+        qemu_event_wait(&rcu_call_ready_event);
+        g_usleep(RCU_CALL_MIN_DELAY_US);
+
+        qemu_mutex_lock(&rcu_call_lock);
+        qemu_event_reset(&rcu_call_ready_event);
+        node = rcu_call_head;
+        rcu_call_head = NULL;
+        rcu_call_tail = &rcu_call_head;
+        qemu_mutex_unlock(&rcu_call_lock);
+
+        if (!node) {
+            continue;
+        }
+
+        synchronize_rcu();
+
+        qemu_mutex_lock_iothread();
+        while (node) {
+            next = node->next;
+            node->func(node);
+            node = next;
+        }
+        qemu_mutex_unlock_iothread();
+    }
+
+    abort();
+}
+
+void call_rcu1(struct rcu_head *node, RCUCBFunc *func)
+{
+    node->func = func;
+    node->next = NULL;
+
+    qemu_mutex_lock(&rcu_call_lock);
+    *rcu_call_tail = node;
+    rcu_call_tail = &node->next;
+
+    /* Only start the thread when it is needed.  Tools and user-mode
+     * emulation never call call_rcu(), and the system emulator can
+     * daemonize before the first call.
+     */
+    if (!rcu_call_started) {
+        rcu_call_started = true;
+        qemu_thread_create(&rcu_call_thread, call_rcu_thread, NULL,
+                           QEMU_THREAD_DETACHED);
+    }
+    qemu_mutex_unlock(&rcu_call_lock);
+
+    qemu_event_set(&rcu_call_ready_event);
+}
+
+static void __attribute__((__constructor__)) rcu_init(void)
+{
+    qemu_mutex_init(&rcu_gp_lock);
+    qemu_event_init(&rcu_gp_event, true);
+    qemu_mutex_init(&rcu_call_lock);
+    qemu_event_init(&rcu_call_ready_event, false);
+
+    rcu_register_thread();
+}
@@ -138,6 +138,7 @@ int main(int argc, char **argv)
 #include "qemu/cache-utils.h"
 #include "sysemu/blockdev.h"
 #include "hw/block/block.h"
+#include "hw/mem/dimm.h"
 #include "migration/block.h"
 #include "sysemu/tpm.h"
 #include "sysemu/dma.h"
@@ -187,8 +188,11 @@ DisplayType display_type = DT_DEFAULT;
 static int display_remote;
 const char* keyboard_layout = NULL;
 ram_addr_t ram_size;
+uint64_t maxram_size;
+int ram_slots;
 const char *mem_path = NULL;
 int mem_prealloc = 0; /* force preallocation of physical target memory */
+int mem_share = 0; /* map -mem-path files shared with other processes */
 int nb_nics;
 NICInfo nd_table[MAX_NICS];
 int autostart;
@@ -211,6 +215,7 @@ int smp_cores = 1;
 int smp_threads = 1;
 #ifdef CONFIG_VNC
 const char *vnc_display;
+static const char *shm_display;
 #endif
 int acpi_enabled = 1;
 int no_hpet = 0;
@@ -250,6 +255,8 @@ static QTAILQ_HEAD(, FWBootEntry) fw_boot_order =
 int nb_numa_nodes;
 uint64_t node_mem[MAX_NODES];
 unsigned long *node_cpumask[MAX_NODES];
+static HostMemPolicy node_policy[MAX_NODES];
+static bool have_node_policy;
 
 uint8_t qemu_uuid[16];
 bool qemu_uuid_set;
@@ -268,6 +275,7 @@ bool xen_allowed;
 uint32_t xen_domid;
 enum xen_mode xen_mode = XEN_EMULATE;
 static int tcg_tb_size;
+static bool tcg_perf_map;
 
 static int default_serial = 1;
 static int default_parallel = 1;
@@ -422,6 +430,18 @@ static QemuOptsList qemu_machine_opts = {
             .name = "mem-merge",
             .type = QEMU_OPT_BOOL,
             .help = "enable/disable memory merge support",
+        }, {
+            .name = "bounce-buffers",
+            .type = QEMU_OPT_NUMBER,
+            .help = "number of buffers for DMA to memory that is not RAM",
+        }, {
+            .name = "bounce-buffer-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of each DMA bounce buffer",
+        }, {
+            .name = "xen-mapcache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "address space for mapping Xen guest memory",
         },{
             .name = "usb",
             .type = QEMU_OPT_BOOL,
@@ -514,6 +534,50 @@ static QemuOptsList qemu_realtime_opts = {
         {
             .name = "mlock",
             .type = QEMU_OPT_BOOL,
+        }, {
+            .name = "migration-affinity",
+            .type = QEMU_OPT_STRING,
+        }, {
+            .name = "migration-sched",
+            .type = QEMU_OPT_STRING,
+        },
+        { /* end of list */ }
+    },
+};
+
+static QemuOptsList qemu_mem_opts = {
+    .name = "memory",
+    .implied_opt_name = "size",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_mem_opts.head),
+    .desc = {
+        {
+            /* Parsed with strtosz, where no suffix means megabytes */
+            .name = "size",
+            .type = QEMU_OPT_STRING,
+        }, {
+            .name = "slots",
+            .type = QEMU_OPT_NUMBER,
+        }, {
+            .name = "maxmem",
+            .type = QEMU_OPT_STRING,
+        },
+        { /* end of list */ }
+    },
+};
+
+static QemuOptsList qemu_timer_slack_opts = {
+    .name = "timer-slack",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_timer_slack_opts.head),
+    .desc = {
+        {
+            .name = "rt",
+            .type = QEMU_OPT_NUMBER,
+        }, {
+            .name = "vm",
+            .type = QEMU_OPT_NUMBER,
+        }, {
+            .name = "host",
+            .type = QEMU_OPT_NUMBER,
         },
         { /* end of list */ }
     },
@@ -555,6 +619,49 @@ const char *qemu_get_vm_name(void)
     return qemu_name;
 }
 
+/* Time spent in each phase of startup, up to the entry into the main
+ * loop.  Every phase goes to the trace, and -startup-report prints the
+ * whole table on stderr.
+ */
+#define STARTUP_PHASES_MAX 16
+
+static struct {
+    const char *name;
+    int64_t end;
+} startup_phases[STARTUP_PHASES_MAX];
+static int startup_nr_phases;
+static int64_t startup_begin;
+static bool startup_report;
+
+static void startup_phase_done(const char *name)
+{
+    int64_t now = get_clock();
+    int64_t prev = startup_nr_phases ?
+                   startup_phases[startup_nr_phases - 1].end : startup_begin;
+
+    trace_vl_startup_phase(name, (now - prev) / 1000);
+    if (startup_nr_phases < STARTUP_PHASES_MAX) {
+        startup_phases[startup_nr_phases].name = name;
+        startup_phases[startup_nr_phases].end = now;
+        startup_nr_phases++;
+    }
+}
+
+static void startup_print_report(void)
+{
+    int64_t prev = startup_begin;
+    int i;
+
+    fprintf(stderr, "startup phase            time (ms)\n");
+    for (i = 0; i < startup_nr_phases; i++) {
+        fprintf(stderr, "%-24s %9.3f\n", startup_phases[i].name,
+                (startup_phases[i].end - prev) / 1000000.0);
+        prev = startup_phases[i].end;
+    }
+    fprintf(stderr, "%-24s %9.3f\n", "total",
+            (prev - startup_begin) / 1000000.0);
+}
+
 static void res_free(void)
 {
     if (boot_splash_filedata != NULL) {
@@ -1306,6 +1413,127 @@ error:
     exit(1);
 }
 
+static void numa_node_parse_host_nodes(int nodenr, const char *nodes)
+{
+    char *endptr;
+    unsigned long long value, endvalue;
+
+    if (parse_uint(nodes, &value, &endptr, 10) < 0) {
+        goto error;
+    }
+    if (*endptr == '-') {
+        if (parse_uint_full(endptr + 1, &endvalue, 10) < 0) {
+            goto error;
+        }
+    } else if (*endptr == '\0') {
+        endvalue = value;
+    } else {
+        goto error;
+    }
+
+    if (endvalue >= MAX_HOST_NODES || endvalue < value) {
+        goto error;
+    }
+
+    bitmap_set(node_policy[nodenr].nodes, value, endvalue - value + 1);
+    return;
+
+error:
+    fprintf(stderr, "qemu: Invalid NUMA host node range: %s\n", nodes);
+    exit(1);
+}
+
+static void numa_node_parse_policy(int nodenr, const char *optarg)
+{
+    HostMemPolicy *policy = &node_policy[nodenr];
+    char option[1024];
+
+    if (get_param_value(option, sizeof(option), "mem-path", optarg) != 0) {
+        policy->mem_path = g_strdup(option);
+        have_node_policy = true;
+    }
+
+    if (get_param_value(option, sizeof(option), "host-nodes", optarg) != 0) {
+        numa_node_parse_host_nodes(nodenr, option);
+        policy->mode = HOST_MEM_POLICY_BIND;
+        have_node_policy = true;
+    }
+
+    if (get_param_value(option, sizeof(option), "policy", optarg) != 0) {
+        if (!strcmp(option, "default")) {
+            policy->mode = HOST_MEM_POLICY_DEFAULT;
+        } else if (!strcmp(option, "preferred")) {
+            policy->mode = HOST_MEM_POLICY_PREFERRED;
+        } else if (!strcmp(option, "bind")) {
+            policy->mode = HOST_MEM_POLICY_BIND;
+        } else if (!strcmp(option, "interleave")) {
+            policy->mode = HOST_MEM_POLICY_INTERLEAVE;
+        } else {
+            fprintf(stderr, "qemu: Invalid NUMA memory policy: %s\n",
+                    option);
+            exit(1);
+        }
+        have_node_policy = true;
+    }
+
+    if ((policy->mode == HOST_MEM_POLICY_BIND ||
+         policy->mode == HOST_MEM_POLICY_INTERLEAVE) &&
+        bitmap_empty(policy->nodes, MAX_HOST_NODES)) {
+        fprintf(stderr, "qemu: NUMA memory policy needs host-nodes\n");
+        exit(1);
+    }
+}
+
+/*
+ * Allocate the system RAM of a board.  Without host placement options for
+ * the NUMA nodes, this is a single RAM block as it always was, so that
+ * migration keeps working.  Otherwise each guest node gets its own RAM
+ * block "name.nodeN", bound to its host nodes, and @mr is a container for
+ * them.
+ */
+void memory_region_allocate_system_memory(MemoryRegion *mr, Object *owner,
+                                          const char *name,
+                                          uint64_t ram_size)
+{
+    uint64_t addr = 0, total = 0;
+    int i;
+
+    if (!have_node_policy) {
+        memory_region_init_ram(mr, owner, name, ram_size);
+        vmstate_register_ram_global(mr);
+        return;
+    }
+
+    for (i = 0; i < nb_numa_nodes; i++) {
+        total += node_mem[i];
+    }
+    if (total != ram_size) {
+        fprintf(stderr, "qemu: NUMA node memory (%" PRIu64 " MB) does not "
+                "match the RAM size (%" PRIu64 " MB)\n",
+                total >> 20, ram_size >> 20);
+        exit(1);
+    }
+
+    memory_region_init(mr, owner, name, ram_size);
+    for (i = 0; i < nb_numa_nodes; i++) {
+        MemoryRegion *seg;
+        char *seg_name;
+
+        if (!node_mem[i]) {
+            continue;
+        }
+
+        seg = g_new(MemoryRegion, 1);
+        seg_name = g_strdup_printf("%s.node%d", name, i);
+        memory_region_init_ram_policy(seg, owner, seg_name, node_mem[i],
+                                      &node_policy[i]);
+        vmstate_register_ram_global(seg);
+        memory_region_add_subregion(mr, addr, seg);
+        g_free(seg_name);
+        addr += node_mem[i];
+    }
+}
+
 static void numa_add(const char *optarg)
 {
     char option[128];
@@ -1351,6 +1579,7 @@ static void numa_add(const char *optarg)
         if (get_param_value(option, 128, "cpus", optarg) != 0) {
             numa_node_parse_cpus(nodenr, option);
         }
+        numa_node_parse_policy(nodenr, optarg);
         nb_numa_nodes++;
     } else {
         fprintf(stderr, "Invalid -numa option: %s\n", option);
@@ -1379,6 +1608,12 @@ static QemuOptsList qemu_smp_opts = {
         }, {
             .name = "maxcpus",
             .type = QEMU_OPT_NUMBER,
+        }, {
+            .name = "affinity",
+            .type = QEMU_OPT_STRING,
+        }, {
+            .name = "sched",
+            .type = QEMU_OPT_STRING,
         },
         { /*End of list */ }
     },
@@ -1412,6 +1647,12 @@ static void smp_parse(QemuOpts *opts)
 
         max_cpus = qemu_opt_get_number(opts, "maxcpus", 0);
 
+        if (qemu_set_vcpu_sched(qemu_opt_get(opts, "affinity"),
+                                qemu_opt_get(opts, "sched")) < 0) {
+            fprintf(stderr, "qemu: invalid smp affinity or sched option\n");
+            exit(1);
+        }
+
         smp_cpus = cpus;
         smp_cores = cores > 0 ? cores : 1;
         smp_threads = threads > 0 ? threads : 1;
@@ -1433,6 +1674,49 @@ static void smp_parse(QemuOpts *opts)
 
 }
 
+static uint64_t parse_ram_size(const char *what, const char *str)
+{
+    int64_t value;
+    uint64_t sz;
+    ram_addr_t ram_sz;
+    char *end;
+
+    value = strtosz(str, &end);
+    if (value < 0 || *end) {
+        fprintf(stderr, "qemu: invalid %s: %s\n", what, str);
+        exit(1);
+    }
+    sz = QEMU_ALIGN_UP((uint64_t)value, 8192);
+    ram_sz = sz;
+    if (ram_sz != sz) {
+        fprintf(stderr, "qemu: %s too large\n", what);
+        exit(1);
+    }
+    return sz;
+}
+
+static void configure_memory(QemuOpts *opts)
+{
+    const char *size = qemu_opt_get(opts, "size");
+    const char *maxmem = qemu_opt_get(opts, "maxmem");
+
+    if (size) {
+        ram_size = parse_ram_size("ram size", size);
+    }
+    ram_slots = qemu_opt_get_number(opts, "slots", 0);
+    maxram_size = maxmem ? parse_ram_size("maximum ram size", maxmem) : 0;
+
+    if (ram_slots < 0 || ram_slots > DIMM_MAX_SLOTS) {
+        fprintf(stderr, "qemu: the number of memory slots must be between "
+                "0 and %d\n", DIMM_MAX_SLOTS);
+        exit(1);
+    }
+    if (!ram_slots != !maxmem) {
+        fprintf(stderr, "qemu: memory slots need both slots and maxmem\n");
+        exit(1);
+    }
+}
+
 static void configure_realtime(QemuOpts *opts)
 {
     bool enable_mlock;
@@ -1445,8 +1729,38 @@ static void configure_realtime(QemuOpts *opts)
             exit(1);
         }
     }
+
+    if (migrate_set_thread_sched(qemu_opt_get(opts, "migration-affinity"),
+                                 qemu_opt_get(opts, "migration-sched")) < 0) {
+        fprintf(stderr, "qemu: invalid migration-affinity or "
+                "migration-sched\n");
+        exit(1);
+    }
 }
 
+static void configure_timer_slack(QemuOpts *opts)
+{
+    static const struct {
+        const char *name;
+        QEMUClockType type;
+    } clocks[] = {
+        { "rt", QEMU_CLOCK_REALTIME },
+        { "vm", QEMU_CLOCK_VIRTUAL },
+        { "host", QEMU_CLOCK_HOST },
+    };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(clocks); i++) {
+        uint64_t slack = qemu_opt_get_number(opts, clocks[i].name, 0);
+
+        if (slack > INT64_MAX) {
+            fprintf(stderr, "qemu: invalid timer slack for %s clock\n",
+                    clocks[i].name);
+            exit(1);
+        }
+        qemu_clock_set_slack(clocks[i].type, slack);
+    }
+}
 
 static void configure_msg(QemuOpts *opts)
 {
@@ -2213,6 +2527,17 @@ static DisplayType select_display(const char *p)
 #else
         fprintf(stderr, "VNC support is disabled\n");
         exit(1);
+#endif
+    } else if (strstart(p, "shm", &opts)) {
+#ifdef CONFIG_POSIX
+        display_remote++;
+        if (!strstart(opts, "=", &shm_display) || !*shm_display) {
+            fprintf(stderr, "shm display requires a socket path shm=<path>\n");
+            exit(1);
+        }
+#else
+        fprintf(stderr, "shm display is only supported on POSIX hosts\n");
+        exit(1);
 #endif
     } else if (strstart(p, "curses", &opts)) {
 #ifdef CONFIG_CURSES
@@ -2359,6 +2684,14 @@ static int mon_init_func(QemuOpts *opts, void *opaque)
     if (qemu_opt_get_bool(opts, "pretty", 0))
         flags |= MONITOR_USE_PRETTY;
 
+    if (qemu_opt_get_bool(opts, "iothread", false)) {
+        if (!(flags & MONITOR_USE_CONTROL)) {
+            fprintf(stderr, "iothread=on requires mode=control\n");
+            exit(1);
+        }
+        flags |= MONITOR_USE_IOTHREAD;
+    }
+
     if (qemu_opt_get_bool(opts, "default", 0))
         flags |= MONITOR_IS_DEFAULT;
 
@@ -2611,6 +2944,9 @@ static QEMUMachine *machine_parse(const char *name)
 static int tcg_init(void)
 {
     tcg_exec_init(tcg_tb_size * 1024 * 1024);
+    if (tcg_perf_map) {
+        tcg_perf_map_init();
+    }
     return 0;
 }
 
@@ -2891,11 +3227,14 @@ int main(int argc, char **argv, char **envp)
     qemu_add_opts(&qemu_object_opts);
     qemu_add_opts(&qemu_tpmdev_opts);
     qemu_add_opts(&qemu_realtime_opts);
+    qemu_add_opts(&qemu_mem_opts);
+    qemu_add_opts(&qemu_timer_slack_opts);
     qemu_add_opts(&qemu_msg_opts);
 
     runstate_init();
 
     init_clocks();
+    startup_begin = get_clock();
     rtc_clock = QEMU_CLOCK_HOST;
 
     qemu_init_auxval(envp);
@@ -3183,24 +3522,13 @@ int main(int argc, char **argv, char **envp)
                 version();
                 exit(0);
                 break;
-            case QEMU_OPTION_m: {
-                int64_t value;
-                uint64_t sz;
-                char *end;
-
-                value = strtosz(optarg, &end);
-                if (value < 0 || *end) {
-                    fprintf(stderr, "qemu: invalid ram size: %s\n", optarg);
-                    exit(1);
-                }
-                sz = QEMU_ALIGN_UP((uint64_t)value, 8192);
-                ram_size = sz;
-                if (ram_size != sz) {
-                    fprintf(stderr, "qemu: ram size too large\n");
+            case QEMU_OPTION_m:
+                opts = qemu_opts_parse(qemu_find_opts("memory"), optarg, 1);
+                if (!opts) {
                     exit(1);
                 }
+                configure_memory(opts);
                 break;
-            }
 #ifdef CONFIG_TPM
             case QEMU_OPTION_tpmdev:
                 if (tpm_config_parse(qemu_find_opts("tpmdev"), optarg) < 0) {
@@ -3214,6 +3542,9 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_mem_prealloc:
                 mem_prealloc = 1;
                 break;
+            case QEMU_OPTION_mem_share:
+                mem_share = 1;
+                break;
             case QEMU_OPTION_d:
                 log_mask = optarg;
                 break;
@@ -3671,6 +4002,9 @@ int main(int argc, char **argv, char **envp)
                     tcg_tb_size = 0;
                 }
                 break;
+            case QEMU_OPTION_perfmap:
+                tcg_perf_map = true;
+                break;
             case QEMU_OPTION_icount:
                 icount_option = optarg;
                 break;
@@ -3796,6 +4130,17 @@ int main(int argc, char **argv, char **envp)
                 }
                 configure_realtime(opts);
                 break;
+            case QEMU_OPTION_timer_slack:
+                opts = qemu_opts_parse(qemu_find_opts("timer-slack"),
+                                       optarg, 0);
+                if (!opts) {
+                    exit(1);
+                }
+                configure_timer_slack(opts);
+                break;
+            case QEMU_OPTION_startup_report:
+                startup_report = true;
+                break;
             case QEMU_OPTION_msg:
                 opts = qemu_opts_parse(qemu_find_opts("msg"), optarg, 0);
                 if (!opts) {
@@ -4042,13 +4387,21 @@ int main(int argc, char **argv, char **envp)
     if (ram_size == 0) {
         ram_size = DEFAULT_RAM_SIZE * 1024 * 1024;
     }
+    if (!ram_slots) {
+        maxram_size = ram_size;
+    } else if (maxram_size <= ram_size) {
+        fprintf(stderr, "qemu: maxmem must be larger than the ram size\n");
+        exit(1);
+    }
 
     if (qemu_opts_foreach(qemu_find_opts("device"), device_help_func, NULL, 0)
         != 0) {
         exit(0);
     }
 
+    startup_phase_done("options");
     configure_accelerator();
+    startup_phase_done("accelerator");
 
     if (qtest_chrdev) {
         qtest_init(qtest_chrdev, qtest_log);
@@ -4161,6 +4514,7 @@ int main(int argc, char **argv, char **envp)
                   CDROM_OPTS);
     default_drive(default_floppy, snapshot, IF_FLOPPY, 0, FD_OPTS);
     default_drive(default_sdcard, snapshot, IF_SD, 0, SD_OPTS);
+    startup_phase_done("backends");
 
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 
@@ -4254,6 +4608,13 @@ int main(int argc, char **argv, char **envp)
                                  .initrd_filename = initrd_filename,
                                  .cpu_model = cpu_model };
     machine->init(&args);
+    startup_phase_done("machine");
+
+    if (ram_slots && !object_resolve_path_type("", TYPE_DIMM_BUS, NULL)) {
+        fprintf(stderr, "qemu: machine %s does not support memory slots\n",
+                machine->name);
+        exit(1);
+    }
 
     audio_init();
 
@@ -4272,6 +4633,7 @@ int main(int argc, char **argv, char **envp)
     /* init generic devices */
     if (qemu_opts_foreach(qemu_find_opts("device"), device_init_func, NULL, 1) != 0)
         exit(1);
+    startup_phase_done("devices");
 
     net_check_clients();
 
@@ -4308,6 +4670,19 @@ int main(int argc, char **argv, char **envp)
     /* must be after terminal init, SDL library changes signal handlers */
     os_setup_signal_handling();
 
+#ifdef CONFIG_POSIX
+    if (shm_display) {
+        Error *local_err = NULL;
+        shm_display_init(ds, shm_display, &local_err);
+        if (local_err != NULL) {
+            error_report("Failed to start shm display on `%s': %s",
+                         shm_display, error_get_pretty(local_err));
+            error_free(local_err);
+            exit(1);
+        }
+    }
+#endif
+
 #ifdef CONFIG_VNC
     /* init remote displays */
     if (vnc_display) {
@@ -4336,12 +4711,14 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
 
+    startup_phase_done("displays");
     qdev_machine_creation_done();
 
     if (rom_load_all() != 0) {
         fprintf(stderr, "rom loading failed\n");
         exit(1);
     }
+    startup_phase_done("roms");
 
     /* TODO: once all bus devices are qdevified, this should be done
      * when bus is created by qdev.c */
@@ -4350,8 +4727,10 @@ int main(int argc, char **argv, char **envp)
 
     /* Done notifiers can load ROMs */
     rom_load_done();
+    startup_phase_done("machine-done");
 
     qemu_system_reset(VMRESET_SILENT);
+    startup_phase_done("reset");
     if (loadvm) {
         if (load_vmstate(loadvm) < 0) {
             autostart = 0;
@@ -4373,6 +4752,10 @@ int main(int argc, char **argv, char **envp)
 
     os_setup_post();
 
+    startup_phase_done("start");
+    if (startup_report) {
+        startup_print_report();
+    }
     main_loop();
     bdrv_close_all();
     pause_all_vcpus();
@@ -11,8 +11,169 @@
  *
  */
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
+#if defined(CONFIG_AVX2_OPT) && defined(CONFIG_CPUID_H)
+#include <immintrin.h>
+#endif
+
+/*
+ * The encoder spends its time looking for the end of runs of equal bytes
+ * (zrun) and of differing bytes (nzrun).  Both searches come in a generic
+ * version working a long at a time and in vector versions; the best one
+ * for the host is picked once at startup.  They all return the same index,
+ * so the encoded stream does not depend on the host.
+ */
+
+/* Index of the first byte at or after @i where @a and @b differ, or @n */
+static int find_diff_long(const uint8_t *a, const uint8_t *b, int i, int n)
+{
+    while (i < n && (i % sizeof(long))) {
+        if (a[i] != b[i]) {
+            return i;
+        }
+        i++;
+    }
+
+    /* word at a time for speed */
+    while (i + sizeof(long) <= n &&
+           *(long *)(a + i) == *(long *)(b + i)) {
+        i += sizeof(long);
+    }
+
+    while (i < n && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+/* Index of the first byte at or after @i where @a and @b agree, or @n */
+static int find_equal_long(const uint8_t *a, const uint8_t *b, int i, int n)
+{
+    /* truncation to 32-bit long okay */
+    long mask = (long)0x0101010101010101ULL;
+    long xor;
+
+    while (i < n && (i % sizeof(long))) {
+        if (a[i] == b[i]) {
+            return i;
+        }
+        i++;
+    }
+
+    /* word at a time for speed, stop at the first zero byte of the xor */
+    while (i + sizeof(long) <= n) {
+        xor = *(long *)(a + i) ^ *(long *)(b + i);
+        if ((xor - mask) & ~xor & (mask << 7)) {
+            break;
+        }
+        i += sizeof(long);
+    }
+
+    while (i < n && a[i] != b[i]) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef __SSE2__
+static int find_diff_sse2(const uint8_t *a, const uint8_t *b, int i, int n)
+{
+    unsigned int m;
+
+    while (i + 16 <= n) {
+        m = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                _mm_loadu_si128((__m128i *)(a + i)),
+                _mm_loadu_si128((__m128i *)(b + i))));
+        if (m != 0xffff) {
+            return i + ctz32(~m);
+        }
+        i += 16;
+    }
+    return find_diff_long(a, b, i, n);
+}
+
+static int find_equal_sse2(const uint8_t *a, const uint8_t *b, int i, int n)
+{
+    unsigned int m;
+
+    while (i + 16 <= n) {
+        m = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                _mm_loadu_si128((__m128i *)(a + i)),
+                _mm_loadu_si128((__m128i *)(b + i))));
+        if (m) {
+            return i + ctz32(m);
+        }
+        i += 16;
+    }
+    return find_equal_long(a, b, i, n);
+}
+#endif
+
+#if defined(CONFIG_AVX2_OPT) && defined(CONFIG_CPUID_H)
+static int __attribute__((target("avx2")))
+find_diff_avx2(const uint8_t *a, const uint8_t *b, int i, int n)
+{
+    uint32_t m;
+
+    while (i + 32 <= n) {
+        m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                _mm256_loadu_si256((__m256i *)(a + i)),
+                _mm256_loadu_si256((__m256i *)(b + i))));
+        if (m != 0xffffffff) {
+            return i + ctz32(~m);
+        }
+        i += 32;
+    }
+    /* gcc does not clean up the YMM state before a tail call */
+    _mm256_zeroupper();
+    return find_diff_long(a, b, i, n);
+}
+
+static int __attribute__((target("avx2")))
+find_equal_avx2(const uint8_t *a, const uint8_t *b, int i, int n)
+{
+    uint32_t m;
+
+    while (i + 32 <= n) {
+        m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                _mm256_loadu_si256((__m256i *)(a + i)),
+                _mm256_loadu_si256((__m256i *)(b + i))));
+        if (m) {
+            return i + ctz32(m);
+        }
+        i += 32;
+    }
+    /* gcc does not clean up the YMM state before a tail call */
+    _mm256_zeroupper();
+    return find_equal_long(a, b, i, n);
+}
+#endif
+
+static struct {
+    int (*find_diff)(const uint8_t *a, const uint8_t *b, int i, int n);
+    int (*find_equal)(const uint8_t *a, const uint8_t *b, int i, int n);
+} xbzrle_accel = {
+#ifdef __SSE2__
+    .find_diff = find_diff_sse2,
+    .find_equal = find_equal_sse2,
+#else
+    .find_diff = find_diff_long,
+    .find_equal = find_equal_long,
+#endif
+};
+
+static void __attribute__((constructor)) xbzrle_init_accel(void)
+{
+#if defined(CONFIG_AVX2_OPT) && defined(CONFIG_CPUID_H)
+    if (host_cpu_has_avx2()) {
+        xbzrle_accel.find_diff = find_diff_avx2;
+        xbzrle_accel.find_equal = find_equal_avx2;
+    }
+#endif
+}
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -27,9 +188,7 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res, xor;
-    uint8_t *nzrun_start = NULL;
+    int d = 0, i = 0, j, limit;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -40,28 +199,8 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        j = xbzrle_accel.find_diff(old_buf, new_buf, i, slen);
+        zrun_len = j - i;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -69,55 +208,34 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
         }
 
         /* skip last zero run */
-        if (i == slen) {
+        if (j == slen) {
             return d;
         }
 
         d += uleb128_encode_small(dst + d, zrun_len);
-
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
+        i = j;
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            long mask = (long)0x0101010101010101ULL;
-            while (i < slen) {
-                xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
+
+        /* an nzrun that does not fit is an overflow, don't scan past it */
+        limit = MIN(slen, i + dlen - d);
+        j = xbzrle_accel.find_equal(old_buf, new_buf, i, limit);
+        if (j == limit && limit < slen) {
+            return -1;
         }
+        nzrun_len = j - i;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
         if (d + nzrun_len > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
+        memcpy(dst + d, new_buf + i, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
+        i = j;
     }
 
     return d;
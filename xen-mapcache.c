@@ -20,6 +20,8 @@
 #include <sys/mman.h>
 
 #include "sysemu/xen-mapcache.h"
+#include "sysemu/sysemu.h"
+#include "qemu/queue.h"
 #include "trace.h"
 
 
@@ -59,6 +61,8 @@ typedef struct MapCacheEntry {
     uint8_t lock;
     hwaddr size;
     struct MapCacheEntry *next;
+    /* Mapped entries, least recently used first */
+    QTAILQ_ENTRY(MapCacheEntry) lru;
 } MapCacheEntry;
 
 typedef struct MapCacheRev {
@@ -78,6 +82,14 @@ typedef struct MapCache {
     unsigned long max_mcache_size;
     unsigned int mcache_bucket_shift;
 
+    /* Entries that hash to a busy bucket are chained rather than replacing
+     * it, until mapped_size reaches max_mcache_size; then the least
+     * recently used unlocked entry is unmapped.
+     */
+    QTAILQ_HEAD(, MapCacheEntry) lru;
+    hwaddr mapped_size;
+    XenMapCacheStats stats;
+
     phys_offset_to_gaddr_t phys_offset_to_gaddr;
     void *opaque;
 } MapCache;
@@ -95,7 +107,7 @@ static inline int test_bits(int nr, int size, const unsigned long *addr)
 
 void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
 {
-    unsigned long size;
+    unsigned long size, max_size;
     struct rlimit rlimit_as;
 
     mapcache = g_malloc0(sizeof (MapCache));
@@ -104,11 +116,16 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
     mapcache->opaque = opaque;
 
     QTAILQ_INIT(&mapcache->locked_entries);
+    QTAILQ_INIT(&mapcache->lru);
+
+    max_size = qemu_opt_get_size(qemu_get_machine_opts(), "xen-mapcache-size",
+                                 MCACHE_MAX_SIZE);
+    max_size = MAX(max_size, MCACHE_BUCKET_SIZE);
 
     if (geteuid() == 0) {
         rlimit_as.rlim_cur = RLIM_INFINITY;
         rlimit_as.rlim_max = RLIM_INFINITY;
-        mapcache->max_mcache_size = MCACHE_MAX_SIZE;
+        mapcache->max_mcache_size = max_size;
     } else {
         getrlimit(RLIMIT_AS, &rlimit_as);
         rlimit_as.rlim_cur = rlimit_as.rlim_max;
@@ -117,11 +134,11 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
             fprintf(stderr, "Warning: QEMU's maximum size of virtual"
                     " memory is not infinity.\n");
         }
-        if (rlimit_as.rlim_max < MCACHE_MAX_SIZE + NON_MCACHE_MEMORY_SIZE) {
+        if (rlimit_as.rlim_max < max_size + NON_MCACHE_MEMORY_SIZE) {
             mapcache->max_mcache_size = rlimit_as.rlim_max -
                 NON_MCACHE_MEMORY_SIZE;
         } else {
-            mapcache->max_mcache_size = MCACHE_MAX_SIZE;
+            mapcache->max_mcache_size = max_size;
         }
     }
 
@@ -154,11 +171,14 @@ static void xen_remap_bucket(MapCacheEntry *entry,
     pfns = g_malloc0(nb_pfn * sizeof (xen_pfn_t));
     err = g_malloc0(nb_pfn * sizeof (int));
 
+    mapcache->stats.remaps++;
     if (entry->vaddr_base != NULL) {
         if (munmap(entry->vaddr_base, entry->size) != 0) {
             perror("unmap fails");
             exit(-1);
         }
+        mapcache->mapped_size -= entry->size;
+        QTAILQ_REMOVE(&mapcache->lru, entry, lru);
     }
     if (entry->valid_mapping != NULL) {
         g_free(entry->valid_mapping);
@@ -179,6 +199,8 @@ static void xen_remap_bucket(MapCacheEntry *entry,
     entry->vaddr_base = vaddr_base;
     entry->paddr_index = address_index;
     entry->size = size;
+    mapcache->mapped_size += size;
+    QTAILQ_INSERT_TAIL(&mapcache->lru, entry, lru);
     entry->valid_mapping = (unsigned long *) g_malloc0(sizeof(unsigned long) *
             BITS_TO_LONGS(size >> XC_PAGE_SHIFT));
 
@@ -193,6 +215,58 @@ static void xen_remap_bucket(MapCacheEntry *entry,
     g_free(err);
 }
 
+static void xen_unmap_entry(MapCacheEntry *entry)
+{
+    if (munmap(entry->vaddr_base, entry->size) != 0) {
+        perror("unmap fails");
+        exit(-1);
+    }
+    mapcache->mapped_size -= entry->size;
+    QTAILQ_REMOVE(&mapcache->lru, entry, lru);
+    if (mapcache->last_entry == entry) {
+        mapcache->last_entry = NULL;
+    }
+
+    entry->paddr_index = 0;
+    entry->vaddr_base = NULL;
+    entry->size = 0;
+    g_free(entry->valid_mapping);
+    entry->valid_mapping = NULL;
+}
+
+/*
+ * Unmaps the least recently used entry that is not locked.  Chained
+ * entries are freed; the first entry of a bucket is part of the array
+ * and is only emptied.
+ */
+static bool xen_map_cache_evict(void)
+{
+    MapCacheEntry *entry, *pentry;
+
+    QTAILQ_FOREACH(entry, &mapcache->lru, lru) {
+        if (!entry->lock) {
+            break;
+        }
+    }
+    if (!entry) {
+        return false;
+    }
+
+    trace_xen_map_cache_evict(entry->paddr_index, entry->size);
+    mapcache->stats.evictions++;
+    xen_unmap_entry(entry);
+
+    pentry = &mapcache->entry[entry->paddr_index % mapcache->nr_buckets];
+    if (pentry != entry) {
+        while (pentry->next != entry) {
+            pentry = pentry->next;
+        }
+        pentry->next = entry->next;
+        g_free(entry);
+    }
+    return true;
+}
+
 uint8_t *xen_map_cache(hwaddr phys_addr, hwaddr size,
                        uint8_t lock)
 {
@@ -226,6 +300,7 @@ tryagain:
         test_bits(address_offset >> XC_PAGE_SHIFT,
                   __test_bit_size >> XC_PAGE_SHIFT,
                   mapcache->last_entry->valid_mapping)) {
+        mapcache->stats.hits++;
         trace_xen_map_cache_return(mapcache->last_entry->vaddr_base + address_offset);
         return mapcache->last_entry->vaddr_base + address_offset;
     }
@@ -240,28 +315,48 @@ tryagain:
         __size = MCACHE_BUCKET_SIZE;
     }
 
+    /* Look for a mapping of the same range.  One that lacks some of the
+     * pages is mapped again if nobody holds it, since the guest may have
+     * populated them since.
+     */
     entry = &mapcache->entry[address_index % mapcache->nr_buckets];
-
-    while (entry && entry->lock && entry->vaddr_base &&
-            (entry->paddr_index != address_index || entry->size != __size ||
-             !test_bits(address_offset >> XC_PAGE_SHIFT,
-                 __test_bit_size >> XC_PAGE_SHIFT,
-                 entry->valid_mapping))) {
-        pentry = entry;
+    while (entry && (!entry->vaddr_base ||
+                     entry->paddr_index != address_index ||
+                     entry->size != __size ||
+                     (entry->lock &&
+                      !test_bits(address_offset >> XC_PAGE_SHIFT,
+                                 __test_bit_size >> XC_PAGE_SHIFT,
+                                 entry->valid_mapping)))) {
         entry = entry->next;
     }
-    if (!entry) {
-        entry = g_malloc0(sizeof (MapCacheEntry));
-        pentry->next = entry;
+
+    if (entry && test_bits(address_offset >> XC_PAGE_SHIFT,
+                           __test_bit_size >> XC_PAGE_SHIFT,
+                           entry->valid_mapping)) {
+        mapcache->stats.hits++;
+        QTAILQ_REMOVE(&mapcache->lru, entry, lru);
+        QTAILQ_INSERT_TAIL(&mapcache->lru, entry, lru);
+    } else if (entry) {
+        mapcache->stats.misses++;
         xen_remap_bucket(entry, __size, address_index);
-    } else if (!entry->lock) {
-        if (!entry->vaddr_base || entry->paddr_index != address_index ||
-                entry->size != __size ||
-                !test_bits(address_offset >> XC_PAGE_SHIFT,
-                    __test_bit_size >> XC_PAGE_SHIFT,
-                    entry->valid_mapping)) {
-            xen_remap_bucket(entry, __size, address_index);
+    } else {
+        mapcache->stats.misses++;
+        while (mapcache->mapped_size + __size > mapcache->max_mcache_size &&
+               xen_map_cache_evict()) {
+            /* nothing */
+        }
+
+        /* Use an empty slot of the bucket, or chain a new one */
+        entry = &mapcache->entry[address_index % mapcache->nr_buckets];
+        while (entry && entry->vaddr_base) {
+            pentry = entry;
+            entry = entry->next;
         }
+        if (!entry) {
+            entry = g_malloc0(sizeof (MapCacheEntry));
+            pentry->next = entry;
+        }
+        xen_remap_bucket(entry, __size, address_index);
     }
 
     if(!test_bits(address_offset >> XC_PAGE_SHIFT,
@@ -331,7 +426,7 @@ ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
 
 void xen_invalidate_map_cache_entry(uint8_t *buffer)
 {
-    MapCacheEntry *entry = NULL, *pentry = NULL;
+    MapCacheEntry *entry = NULL;
     MapCacheRev *reventry;
     hwaddr paddr_index;
     hwaddr size;
@@ -360,27 +455,21 @@ void xen_invalidate_map_cache_entry(uint8_t *buffer)
         mapcache->last_entry = NULL;
     }
 
+    /* Prefer a locked entry, there may be an unlocked one for the same
+     * range that was mapped again meanwhile.
+     */
     entry = &mapcache->entry[paddr_index % mapcache->nr_buckets];
-    while (entry && (entry->paddr_index != paddr_index || entry->size != size)) {
-        pentry = entry;
+    while (entry && (entry->paddr_index != paddr_index ||
+                     entry->size != size || !entry->lock)) {
         entry = entry->next;
     }
     if (!entry) {
         DPRINTF("Trying to unmap address %p that is not in the mapcache!\n", buffer);
         return;
     }
-    entry->lock--;
-    if (entry->lock > 0 || pentry == NULL) {
-        return;
-    }
 
-    pentry->next = entry->next;
-    if (munmap(entry->vaddr_base, entry->size) != 0) {
-        perror("unmap fails");
-        exit(-1);
-    }
-    g_free(entry->valid_mapping);
-    g_free(entry);
+    /* The mapping stays cached; the LRU policy unmaps it when needed */
+    entry->lock--;
 }
 
 void xen_invalidate_map_cache(void)
@@ -401,7 +490,21 @@ void xen_invalidate_map_cache(void)
 
     for (i = 0; i < mapcache->nr_buckets; i++) {
         MapCacheEntry *entry = &mapcache->entry[i];
+        MapCacheEntry *pentry = entry;
+
+        /* Chained entries are freed, the first one is only emptied */
+        while (pentry->next) {
+            entry = pentry->next;
+            if (entry->lock > 0) {
+                pentry = entry;
+                continue;
+            }
+            xen_unmap_entry(entry);
+            pentry->next = entry->next;
+            g_free(entry);
+        }
 
+        entry = &mapcache->entry[i];
         if (entry->vaddr_base == NULL) {
             continue;
         }
@@ -409,19 +512,21 @@ void xen_invalidate_map_cache(void)
             continue;
         }
 
-        if (munmap(entry->vaddr_base, entry->size) != 0) {
-            perror("unmap fails");
-            exit(-1);
-        }
-
-        entry->paddr_index = 0;
-        entry->vaddr_base = NULL;
-        entry->size = 0;
-        g_free(entry->valid_mapping);
-        entry->valid_mapping = NULL;
+        xen_unmap_entry(entry);
     }
 
     mapcache->last_entry = NULL;
 
     mapcache_unlock();
 }
+
+void xen_map_cache_get_stats(XenMapCacheStats *stats)
+{
+    if (!mapcache) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    *stats = mapcache->stats;
+    stats->mapped_size = mapcache->mapped_size;
+    stats->max_size = mapcache->max_mcache_size;
+}